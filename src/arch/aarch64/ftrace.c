@@ -1,15 +1,22 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
 
 #include <utils/util.h>
 #include <utils/log.h>
 #include <task/task.h>
 
 #include <arch/aarch64/instruments.h>
+#include <arch/aarch64/debug-monitors.h>
 #include <arch/aarch64/ftrace.h>
+#include <patch/patch.h>
 
 /*
  * Replace a single instruction, which may be a branch or NOP.
@@ -46,3 +53,190 @@ int ftrace_modify_code(struct task_struct *task, unsigned long pc, uint32_t old,
 	return 0;
 }
 
+/* The BL from @ip to @addr, NULL if @addr is out of the +/-128M range */
+const char *ftrace_call_replace(uint32_t *insn, unsigned long ip,
+				unsigned long addr)
+{
+	*insn = aarch64_insn_gen_branch_imm(ip, addr, AARCH64_INSN_BRANCH_LINK);
+	if (*insn == AARCH64_BREAK_FAULT)
+		return NULL;
+	return (const char *)insn;
+}
+
+/**
+ * Find the mcount site of the function at @ip, @code is the first @len bytes
+ * of it. With -pg, the first BL of function is the call of _mcount after
+ * the frame record is set up, and the lr is passed in x0:
+ *
+ *	mov	x0, x30
+ *	bl	_mcount
+ *
+ * The NOP site is the BL replaced with NOP after build, like the kernel does
+ * with the mcount sites, thus the function costs one NOP if not traced.
+ */
+int ftrace_find_mcount_site(const uint8_t *code, size_t len, unsigned long ip,
+			    const unsigned long *mcounts, int nr,
+			    unsigned long *site)
+{
+	unsigned long dst;
+	uint64_t imm;
+	uint32_t insn;
+	int64_t offset;
+	size_t off;
+	int i;
+
+	for (off = 0; off + AARCH64_INSN_SIZE <= len; off += AARCH64_INSN_SIZE) {
+		memcpy(&insn, code + off, sizeof(insn));
+		if (insn == AARCH64_INSN_NOP && off >= AARCH64_INSN_SIZE) {
+			uint32_t prev;
+
+			memcpy(&prev, code + off - AARCH64_INSN_SIZE,
+			       sizeof(prev));
+			if (prev == AARCH64_INSN_MOV_X0_LR) {
+				*site = ip + off;
+				return FTRACE_SITE_NOP;
+			}
+		}
+		if (!aarch64_insn_is_bl(insn))
+			continue;
+
+		/* imm26 is signed, in units of instruction */
+		imm = aarch64_insn_decode_immediate(AARCH64_INSN_IMM_26, insn);
+		offset = (int64_t)(imm << 38) >> 36;
+		dst = ip + off + offset;
+
+		for (i = 0; i < nr; i++) {
+			if (dst != mcounts[i])
+				continue;
+			*site = ip + off;
+			return FTRACE_SITE_CALL;
+		}
+		return -ENOENT;
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * Make all running threads of target fetch the modified instructions now,
+ * the caches of the written range are already flushed, see
+ * aarch64_insn_write_batch(). The threads stopped in kernel resynchronize
+ * when they return to userspace. Target task must be in attach session.
+ */
+static void ftrace_sync_core(struct task_struct *task)
+{
+	unsigned long res;
+	int ret;
+
+	ret = task_syscall(task, __NR_membarrier,
+			   MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE,
+			   0, 0, 0, 0, 0, &res);
+	if (!ret && !res)
+		ret = task_syscall(task, __NR_membarrier,
+				   MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE,
+				   0, 0, 0, 0, 0, &res);
+	if (ret || res)
+		ulp_debug("membarrier sync core of %d failed, %ld.\n",
+			  task->pid, (long)res);
+}
+
+/* Validate the @nr sites by one vectored read, see ftrace_modify_code() */
+static int ftrace_validate_sites(struct task_struct *task,
+				 const struct code_write *w, unsigned int nr)
+{
+	struct task_iov *iov;
+	uint32_t *cur;
+	unsigned int i;
+	int err = 0;
+
+	iov = calloc(nr, sizeof(*iov));
+	cur = calloc(nr, sizeof(*cur));
+	if (!iov || !cur) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		iov[i].remote = w[i].addr;
+		iov[i].local = &cur[i];
+		iov[i].len = AARCH64_INSN_SIZE;
+	}
+	if (memcpy_from_task_iov(task, iov, nr) != nr * AARCH64_INSN_SIZE) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (memcmp(&cur[i], w[i].old, AARCH64_INSN_SIZE)) {
+			ulp_error("Site %lx is %08x, not expected.\n",
+				  w[i].addr, cur[i]);
+			err = -EINVAL;
+			break;
+		}
+	}
+out:
+	free(iov);
+	free(cur);
+	return err;
+}
+
+/**
+ * Swap the BL and NOP of @nr mcount sites, each one is one word aligned
+ * store of 4 bytes. The architecture allows concurrent modification and
+ * execution of B, BL and NOP, see ARM ARM B2.2.5, thus no thread need to be
+ * stopped and checked, same as the kernel ftrace of arm64. All sites are
+ * validated by one read, written by one aarch64_insn_write_batch(), with
+ * one cache flush and one sync core in the same attach session. All or
+ * nothing, all sites are restored if failed.
+ */
+int ftrace_modify_sites(struct task_struct *task, const struct code_write *w,
+			unsigned int nr)
+{
+	struct aarch64_insn_patch *new, *old;
+	unsigned int i;
+	int err;
+
+	if (!nr)
+		return 0;
+
+	for (i = 0; i < nr; i++)
+		if (w[i].len != AARCH64_INSN_SIZE)
+			return -EINVAL;
+
+	err = ftrace_validate_sites(task, w, nr);
+	if (err)
+		return err;
+
+	new = calloc(nr, sizeof(*new));
+	old = calloc(nr, sizeof(*old));
+	if (!new || !old) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		new[i].addr = old[i].addr = w[i].addr;
+		memcpy(&new[i].insn, w[i].new, AARCH64_INSN_SIZE);
+		memcpy(&old[i].insn, w[i].old, AARCH64_INSN_SIZE);
+	}
+
+	err = task_attach_session(task);
+	if (err) {
+		ulp_error("Attach %d to modify sites failed.\n", task->pid);
+		goto out;
+	}
+
+	err = aarch64_insn_write_batch(task, new, nr);
+	if (err) {
+		ulp_error("Modify %u sites failed, rollback.\n", nr);
+		if (aarch64_insn_write_batch(task, old, nr))
+			ulp_error("Rollback %u sites failed.\n", nr);
+	}
+
+	ftrace_sync_core(task);
+	task_detach_session(task);
+out:
+	free(new);
+	free(old);
+	return err;
+}
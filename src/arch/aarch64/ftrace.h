@@ -1,10 +1,25 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
+#pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 
+/* hint #0 */
+#define AARCH64_INSN_NOP	0xD503201FU
+/* mov x0, x30, the lr is passed to _mcount with -pg */
+#define AARCH64_INSN_MOV_X0_LR	0xAA1E03E0U
+
 struct task_struct;
+struct code_write;
 
 int ftrace_modify_code(struct task_struct *task, unsigned long pc, uint32_t old,
 		       uint32_t new, bool validate);
+const char *ftrace_call_replace(uint32_t *insn, unsigned long ip,
+				unsigned long addr);
+int ftrace_modify_sites(struct task_struct *task, const struct code_write *w,
+			unsigned int nr);
+int ftrace_find_mcount_site(const uint8_t *code, size_t len, unsigned long ip,
+			    const unsigned long *mcounts, int nr,
+			    unsigned long *site);
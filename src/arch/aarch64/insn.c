@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <utils/util.h>
 #include <utils/log.h>
@@ -36,14 +38,86 @@ int aarch64_insn_write(struct task_struct *task, unsigned long addr,
 	if ((uintptr_t)tp & 0x3)
 		return -EINVAL;
 
+	/**
+	 * The kernel cleans D-cache and invalidates I-cache of the written
+	 * range of /proc/PID/mem, see ftrace_sync_core() for the running
+	 * threads.
+	 */
 	ret = memcpy_to_task(task, addr, &insn, AARCH64_INSN_SIZE);
-	if (ret) {
-		// TODO
-		//__flush_icache_range((uintptr_t)tp,
-		//		     (uintptr_t)tp + AARCH64_INSN_SIZE);
+
+	return ret == AARCH64_INSN_SIZE ? 0 : -1;
+}
+
+/**
+ * Write @n instructions with one vectored write, then flush the caches of
+ * all of them by one run of ICACHE_FLUSH_STUB in target task, instead of
+ * one write and a flush for each. The write through process_vm_writev(2)
+ * into a writable text has no cache maintenance of kernel, which the
+ * /proc/PID/mem path has. Target task is attached if not in attach
+ * session. All of them are checked before any write, but a failed batch
+ * may be written partially.
+ *
+ * The other running threads still need a context synchronization, such as
+ * ftrace_sync_core().
+ */
+int aarch64_insn_write_batch(struct task_struct *task,
+			     const struct aarch64_insn_patch *p, int n)
+{
+	unsigned char stub[] = {ICACHE_FLUSH_STUB};
+	struct task_iov *iov;
+	unsigned long *addrs;
+	bool attached = false;
+	int i, ret = 0;
+
+	if (n <= 0)
+		return n ? -EINVAL : 0;
+
+	iov = calloc(n, sizeof(*iov));
+	addrs = calloc(n, sizeof(*addrs));
+	if (!iov || !addrs) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	return ret ? 0 : -1;
+	for (i = 0; i < n; i++) {
+		/* A64 instructions must be word aligned */
+		if (p[i].addr & 0x3) {
+			ret = -EINVAL;
+			goto out;
+		}
+		iov[i].local = (void *)&p[i].insn;
+		iov[i].remote = p[i].addr;
+		iov[i].len = AARCH64_INSN_SIZE;
+		addrs[i] = p[i].addr;
+	}
+
+	if (memcpy_to_task_iov(task, iov, n) != (ssize_t)n * AARCH64_INSN_SIZE) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (!task->session.active) {
+		ret = task_attach_session(task);
+		if (ret) {
+			ulp_warning("Attach %d to flush icache failed.\n",
+				    task->pid);
+			goto out;
+		}
+		attached = true;
+	}
+
+	ret = task_run_stub(task, stub, sizeof(stub), addrs,
+			    n * sizeof(*addrs), n);
+	if (ret)
+		ulp_error("Flush icache of %d instructions failed, %s\n", n,
+			  strerror(-ret));
+
+	if (attached && task_detach_session(task) && !ret)
+		ret = -errno;
+out:
+	free(iov);
+	free(addrs);
+	return ret;
 }
 
 // see arch/arm64/kernel/insn.c same function
@@ -191,7 +265,7 @@ uint32_t aarch64_insn_encode_immediate(enum aarch64_insn_imm_type type,
 	return insn;
 }
 
-uint32_t aarch64_insn_gen_branch_imm(unsigned pc, unsigned long addr,
+uint32_t aarch64_insn_gen_branch_imm(unsigned long pc, unsigned long addr,
 				     enum aarch64_insn_branch_type type)
 {
 	uint32_t insn;
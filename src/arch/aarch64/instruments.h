@@ -20,6 +20,68 @@
 		INST_SYSCALL, /* syscall */\
 		INST_INT3, /* int3 */
 
+/**
+ * Syscall batch stub, see task_syscall_batch(), x19 point to syscall table,
+ * x20 is number of entries, every entry is 72 bytes:
+ *
+ *   0: nr, 8-48: args[6], 56: ref_mask, 64: return value
+ *
+ * If bit i of ref_mask is set, args[i] is an address, load args[i] from it.
+ */
+#define SYSCALL_BATCH_STUB \
+		0x54, 0x03, 0x00, 0xb4, /* b4000354 cbz x20, done */\
+		0x75, 0x1e, 0x40, 0xf9, /* f9401e75 ldr x21, [x19, #56] */\
+		0x60, 0x06, 0x40, 0xf9, /* f9400660 ldr x0, [x19, #8] */\
+		0x55, 0x00, 0x00, 0x36, /* 36000055 tbz x21, #0, .+8 */\
+		0x00, 0x00, 0x40, 0xf9, /* f9400000 ldr x0, [x0] */\
+		0x61, 0x0a, 0x40, 0xf9, /* f9400a61 ldr x1, [x19, #16] */\
+		0x55, 0x00, 0x08, 0x36, /* 36080055 tbz x21, #1, .+8 */\
+		0x21, 0x00, 0x40, 0xf9, /* f9400021 ldr x1, [x1] */\
+		0x62, 0x0e, 0x40, 0xf9, /* f9400e62 ldr x2, [x19, #24] */\
+		0x55, 0x00, 0x10, 0x36, /* 36100055 tbz x21, #2, .+8 */\
+		0x42, 0x00, 0x40, 0xf9, /* f9400042 ldr x2, [x2] */\
+		0x63, 0x12, 0x40, 0xf9, /* f9401263 ldr x3, [x19, #32] */\
+		0x55, 0x00, 0x18, 0x36, /* 36180055 tbz x21, #3, .+8 */\
+		0x63, 0x00, 0x40, 0xf9, /* f9400063 ldr x3, [x3] */\
+		0x64, 0x16, 0x40, 0xf9, /* f9401664 ldr x4, [x19, #40] */\
+		0x55, 0x00, 0x20, 0x36, /* 36200055 tbz x21, #4, .+8 */\
+		0x84, 0x00, 0x40, 0xf9, /* f9400084 ldr x4, [x4] */\
+		0x65, 0x1a, 0x40, 0xf9, /* f9401a65 ldr x5, [x19, #48] */\
+		0x55, 0x00, 0x28, 0x36, /* 36280055 tbz x21, #5, .+8 */\
+		0xa5, 0x00, 0x40, 0xf9, /* f94000a5 ldr x5, [x5] */\
+		0x68, 0x02, 0x40, 0xf9, /* f9400268 ldr x8, [x19] */\
+		0x01, 0x00, 0x00, 0xd4, /* d4000001 svc #0 */\
+		0x60, 0x22, 0x00, 0xf9, /* f9002260 str x0, [x19, #64] */\
+		0x73, 0x22, 0x01, 0x91, /* 91012273 add x19, x19, #72 */\
+		0x94, 0x06, 0x00, 0xd1, /* d1000694 sub x20, x20, #1 */\
+		0xe7, 0xff, 0xff, 0x17, /* 17ffffe7 b loop */\
+		0xa0, 0x00, 0x20, 0xd4, /* d42000a0 done: brk #5 */\
+
+/**
+ * Cache maintenance stub, see aarch64_insn_write_batch(), x19 point to the
+ * table of addresses, x20 is number of them. Clean D-cache of all of them
+ * to the point of unification, then invalidate I-cache, the IC IVAU is
+ * broadcast to the inner shareable domain, the ISB only synchronizes the
+ * thread runs the stub.
+ */
+#define ICACHE_FLUSH_STUB \
+		0xf5, 0x03, 0x13, 0xaa, /* aa1303f5 mov x21, x19 */\
+		0xf6, 0x03, 0x14, 0xaa, /* aa1403f6 mov x22, x20 */\
+		0xb6, 0x00, 0x00, 0xb4, /* b40000b6 1: cbz x22, 2f */\
+		0xa0, 0x86, 0x40, 0xf8, /* f84086a0 ldr x0, [x21], #8 */\
+		0x20, 0x7b, 0x0b, 0xd5, /* d50b7b20 dc cvau, x0 */\
+		0xd6, 0x06, 0x00, 0xd1, /* d10006d6 sub x22, x22, #1 */\
+		0xfc, 0xff, 0xff, 0x17, /* 17fffffc b 1b */\
+		0x9f, 0x3b, 0x03, 0xd5, /* d5033b9f 2: dsb ish */\
+		0xb4, 0x00, 0x00, 0xb4, /* b40000b4 3: cbz x20, 4f */\
+		0x60, 0x86, 0x40, 0xf8, /* f8408660 ldr x0, [x19], #8 */\
+		0x20, 0x75, 0x0b, 0xd5, /* d50b7520 ic ivau, x0 */\
+		0x94, 0x06, 0x00, 0xd1, /* d1000694 sub x20, x20, #1 */\
+		0xfc, 0xff, 0xff, 0x17, /* 17fffffc b 3b */\
+		0x9f, 0x3b, 0x03, 0xd5, /* d5033b9f 4: dsb ish */\
+		0xdf, 0x3f, 0x03, 0xd5, /* d5033fdf isb */\
+		0xa0, 0x00, 0x20, 0xd4, /* d42000a0 brk #5 */\
+
 #define JMP_TABLE_JUMP_AARCH64  0xd61f022058000051 /*  ldr x17 #8; br x17 */
 #define JMP_TABLE_JUMP_ARCH     JMP_TABLE_JUMP_AARCH64
 
@@ -176,11 +238,20 @@ struct task_struct;
 int aarch64_insn_read(struct task_struct *task, unsigned long addr, uint32_t *insnp);
 int aarch64_insn_write(struct task_struct *task, unsigned long addr, uint32_t insn);
 
+/* One instruction of aarch64_insn_write_batch() */
+struct aarch64_insn_patch {
+	unsigned long addr;
+	uint32_t insn;
+};
+
+int aarch64_insn_write_batch(struct task_struct *task,
+			     const struct aarch64_insn_patch *p, int n);
+
 uint64_t aarch64_insn_decode_immediate(enum aarch64_insn_imm_type type,
 				       uint32_t insn);
 uint32_t aarch64_insn_encode_immediate(enum aarch64_insn_imm_type type,
 				       uint32_t insn, uint64_t imm);
-uint32_t aarch64_insn_gen_branch_imm(unsigned pc, unsigned long addr,
+uint32_t aarch64_insn_gen_branch_imm(unsigned long pc, unsigned long addr,
 				     enum aarch64_insn_branch_type type);
 
 uint32_t aarch64_func_bl_offset(void *func);
@@ -24,3 +24,9 @@ struct mcount_regs {
 #define ARG7(a) ((a)->x6)
 #define ARG8(a) ((a)->x7)
 
+
+/**
+ * Stack pointer when the child returns into _ftrace_mcount_return(), the
+ * @retval of mcount_exit() is below it, see mcount.S.
+ */
+#define MCOUNT_RETURN_SP(retval)	((unsigned long)(retval) + 32)
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <string.h>
 
 #include <utils/util.h>
 #include <utils/log.h>
@@ -18,16 +19,20 @@ enum aarch64_reloc_op {
 	RELOC_OP_PAGE,
 };
 
-static uint64_t do_reloc(enum aarch64_reloc_op reloc_op, uint32_t *place,
+/**
+ * The @place is the planned content of location, see struct reloc_plan, and
+ * @pc is the address of location in target task.
+ */
+static uint64_t do_reloc(enum aarch64_reloc_op reloc_op, uint64_t pc,
 			 uint64_t val)
 {
 	switch (reloc_op) {
 	case RELOC_OP_ABS:
 		return val;
 	case RELOC_OP_PREL:
-		return val - (uint64_t)place;
+		return val - pc;
 	case RELOC_OP_PAGE:
-		return (val & ~0xfff) - ((uint64_t)place & ~0xfff);
+		return (val & ~0xfff) - (pc & ~0xfff);
 	case RELOC_OP_NONE:
 		return 0;
 	}
@@ -36,10 +41,10 @@ static uint64_t do_reloc(enum aarch64_reloc_op reloc_op, uint32_t *place,
 	return 0;
 }
 
-static int reloc_data(enum aarch64_reloc_op op, void *place, uint64_t val,
-		      int len)
+static int reloc_data(enum aarch64_reloc_op op, void *place, uint64_t pc,
+		      uint64_t val, int len)
 {
-	int64_t sval = do_reloc(op, place, val);
+	int64_t sval = do_reloc(op, pc, val);
 
 	/*
 	 * The ELF psABI for AArch64 documents the 16-bit and 32-bit place
@@ -103,14 +108,14 @@ enum aarch64_insn_movw_imm_type {
 };
 
 static int reloc_insn_movw(enum aarch64_reloc_op op, uint32_t *place,
-			   uint64_t val, int lsb,
+			   uint64_t pc, uint64_t val, int lsb,
 			   enum aarch64_insn_movw_imm_type imm_type)
 {
 	uint64_t imm;
 	int64_t sval;
 	uint32_t insn = *place;
 
-	sval = do_reloc(op, place, val);
+	sval = do_reloc(op, pc, val);
 	imm = sval >> lsb;
 
 	if (imm_type == AARCH64_INSN_IMM_MOVNZ) {
@@ -145,7 +150,7 @@ static int reloc_insn_movw(enum aarch64_reloc_op op, uint32_t *place,
 }
 
 static int reloc_insn_imm(enum aarch64_reloc_op op, uint32_t *place,
-			  uint64_t val, int lsb, int len,
+			  uint64_t pc, uint64_t val, int lsb, int len,
 			  enum aarch64_insn_imm_type imm_type)
 {
 	uint64_t imm, imm_mask;
@@ -153,7 +158,7 @@ static int reloc_insn_imm(enum aarch64_reloc_op op, uint32_t *place,
 	uint32_t insn = *place;
 
 	/* Calculate the relocation value. */
-	sval = do_reloc(op, place, val);
+	sval = do_reloc(op, pc, val);
 	sval >>= lsb;
 
 	/* Extract the value bits and shift them to bit 0. */
@@ -183,55 +188,82 @@ static int reloc_insn_imm(enum aarch64_reloc_op op, uint32_t *place,
 /**
  * See same name function in kernel source code.
  */
-static int reloc_insn_adrp(Elf64_Shdr *sechdrs, uint32_t *place, uint64_t val)
+static int reloc_insn_adrp(uint32_t *place, uint64_t pc, uint64_t val)
 {
-	return reloc_insn_imm(RELOC_OP_PAGE, place, val, 12, 21,
+	return reloc_insn_imm(RELOC_OP_PAGE, place, pc, val, 12, 21,
 			      AARCH64_INSN_IMM_ADR);
 }
 
-int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
-			    const char *strtab, unsigned int symindex,
-			    unsigned int relsec)
+/* Bytes of location, the instruction relocations are always 4 bytes */
+static unsigned int reloc_size(uint32_t type)
 {
-	unsigned int i;
-	int ovf;
+	switch (type) {
+#if R_AARCH64_NONE != R_ARM_NONE
+	case R_ARM_NONE:
+#endif
+	case R_AARCH64_NONE:
+		return 0;
+	case R_AARCH64_ABS64:
+	case R_AARCH64_PREL64:
+		return 8;
+	case R_AARCH64_ABS16:
+	case R_AARCH64_PREL16:
+		return 2;
+	default:
+		return AARCH64_INSN_SIZE;
+	}
+}
+
+int arch_plan_relocs(const struct load_info *info, const struct reloc_log *log,
+		     unsigned int nr, struct reloc_plans *plans)
+{
+	GElf_Shdr *symsec = &info->sechdrs[info->index.sym];
+	unsigned int i, nr_syms;
+	const struct reloc_log *r;
+	struct reloc_plan *p;
 	bool overflow_check;
-	Elf64_Sym *sym;
-	void *loc;
-	uint64_t val;
+	Elf64_Sym *syms, *sym;
+	uint64_t val, pc;
+	int ovf;
 
-	/* See x86_64 for t_off's meaning */
-	long t_off = (long)info->hdr - (long)info->target_hdr;
+	syms = (void *)info->hdr + symsec->sh_offset;
+	nr_syms = symsec->sh_size / sizeof(*syms);
 
-	/**
-	 * sh_addr now point to target process address space, so need to
-	 * relocate to current process.
-	 */
-	Elf64_Rela *rel = (void *)sechdrs[relsec].sh_addr + t_off;
+	for (i = 0; i < nr; i++) {
+		r = &log[i];
+		p = &plans->ents[i];
+
+		p->offset = r->offset;
+		p->size = reloc_size(r->type);
+		p->u64 = 0;
+
+		if (r->sym >= nr_syms || r->offset + p->size > info->len) {
+			ulp_error("Invalid relocation, sym %u, offset %x\n",
+				  r->sym, r->offset);
+			return -ENOEXEC;
+		}
 
-	for (i = 0; i < sechdrs[relsec].sh_size / sizeof(*rel); i++) {
 		/**
-		 * This is where to make the change, so, here need to relocate
-		 * to current process address space (use info->target_hdr and
-		 * info->hdr)
+		 * Start from the current content, only the immediate field
+		 * of instruction is changed.
 		 */
-		loc = (void *)(sechdrs[sechdrs[relsec].sh_info].sh_addr + t_off
-			+ rel[i].r_offset);
+		memcpy(p->bytes, (void *)info->hdr + r->offset, p->size);
+
+		/* The offset is the same in current process and target */
+		pc = info->target_hdr + r->offset;
 
 		/**
 		 * This is the symbol it is referring to.  Note that all
 		 * undefined symbols have been resolved.
 		 */
-		sym = (Elf64_Sym *)(sechdrs[symindex].sh_addr + t_off)
-			+ ELF64_R_SYM(rel[i].r_info);
-
-		ulp_debug("type %d st_value %lx r_addend %lx loc %lx\n",
-			(int)ELF64_R_TYPE(rel[i].r_info),
-			sym->st_value, rel[i].r_addend, (uint64_t)loc);
+		sym = &syms[r->sym];
+		val = sym->st_value + r->addend;
+		overflow_check = true;
 
-		val = sym->st_value + rel[i].r_addend;
+		ulp_debug("type %d st_value %lx r_addend %lx pc %lx\n",
+			  r->type, sym->st_value, r->addend, pc);
 
-		switch (ELF64_R_TYPE(rel[i].r_info)) {
+		switch (r->type) {
 		/* Null relocations. */
 #if R_AARCH64_NONE != R_ARM_NONE
 		case R_ARM_NONE:
@@ -243,23 +275,23 @@ int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
 		/* Data relocations. */
 		case R_AARCH64_ABS64:
 			overflow_check = false;
-			ovf = reloc_data(RELOC_OP_ABS, loc, val, 64);
+			ovf = reloc_data(RELOC_OP_ABS, &p->u64, pc, val, 64);
 			break;
 		case R_AARCH64_ABS32:
-			ovf = reloc_data(RELOC_OP_ABS, loc, val, 32);
+			ovf = reloc_data(RELOC_OP_ABS, &p->u64, pc, val, 32);
 			break;
 		case R_AARCH64_ABS16:
-			ovf = reloc_data(RELOC_OP_ABS, loc, val, 16);
+			ovf = reloc_data(RELOC_OP_ABS, &p->u64, pc, val, 16);
 			break;
 		case R_AARCH64_PREL64:
 			overflow_check = false;
-			ovf = reloc_data(RELOC_OP_PREL, loc, val, 64);
+			ovf = reloc_data(RELOC_OP_PREL, &p->u64, pc, val, 64);
 			break;
 		case R_AARCH64_PREL32:
-			ovf = reloc_data(RELOC_OP_PREL, loc, val, 32);
+			ovf = reloc_data(RELOC_OP_PREL, &p->u64, pc, val, 32);
 			break;
 		case R_AARCH64_PREL16:
-			ovf = reloc_data(RELOC_OP_PREL, loc, val, 16);
+			ovf = reloc_data(RELOC_OP_PREL, &p->u64, pc, val, 16);
 			break;
 
 		/* MOVW instruction relocations. */
@@ -267,82 +299,82 @@ int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
 			overflow_check = false;
 			FALLTHROUGH;
 		case R_AARCH64_MOVW_UABS_G0:
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 0,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 0,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_UABS_G1_NC:
 			overflow_check = false;
 			FALLTHROUGH;
 		case R_AARCH64_MOVW_UABS_G1:
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 16,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 16,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_UABS_G2_NC:
 			overflow_check = false;
 			FALLTHROUGH;
 		case R_AARCH64_MOVW_UABS_G2:
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 32,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 32,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_UABS_G3:
 			/* We're using the top bits so we can't overflow. */
 			overflow_check = false;
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 48,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 48,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_SABS_G0:
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 0,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 0,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 		case R_AARCH64_MOVW_SABS_G1:
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 16,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 16,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 		case R_AARCH64_MOVW_SABS_G2:
-			ovf = reloc_insn_movw(RELOC_OP_ABS, loc, val, 32,
+			ovf = reloc_insn_movw(RELOC_OP_ABS, &p->u32, pc, val, 32,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G0_NC:
 			overflow_check = false;
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 0,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 0,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G0:
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 0,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 0,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G1_NC:
 			overflow_check = false;
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 16,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 16,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G1:
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 16,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 16,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G2_NC:
 			overflow_check = false;
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 32,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 32,
 					      AARCH64_INSN_IMM_MOVKZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G2:
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 32,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 32,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 		case R_AARCH64_MOVW_PREL_G3:
 			/* We're using the top bits so we can't overflow. */
 			overflow_check = false;
-			ovf = reloc_insn_movw(RELOC_OP_PREL, loc, val, 48,
+			ovf = reloc_insn_movw(RELOC_OP_PREL, &p->u32, pc, val, 48,
 					      AARCH64_INSN_IMM_MOVNZ);
 			break;
 
 		/* Immediate instruction relocations. */
 		case R_AARCH64_LD_PREL_LO19:
-			ovf = reloc_insn_imm(RELOC_OP_PREL, loc, val, 2, 19,
+			ovf = reloc_insn_imm(RELOC_OP_PREL, &p->u32, pc, val, 2, 19,
 					     AARCH64_INSN_IMM_19);
 			break;
 		case R_AARCH64_ADR_PREL_LO21:
-			ovf = reloc_insn_imm(RELOC_OP_PREL, loc, val, 0, 21,
+			ovf = reloc_insn_imm(RELOC_OP_PREL, &p->u32, pc, val, 0, 21,
 					     AARCH64_INSN_IMM_ADR);
 			break;
 
@@ -350,7 +382,7 @@ int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
 			overflow_check = false;
 		case R_AARCH64_ADR_PREL_PG_HI21:
 			/* ADRP ins */
-			ovf = reloc_insn_adrp(sechdrs, loc, val);
+			ovf = reloc_insn_adrp(&p->u32, pc, val);
 			if (ovf && ovf != -ERANGE)
 				return ovf;
 			break;
@@ -358,41 +390,41 @@ int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
 		case R_AARCH64_ADD_ABS_LO12_NC:
 		case R_AARCH64_LDST8_ABS_LO12_NC:
 			overflow_check = false;
-			ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 0, 12,
+			ovf = reloc_insn_imm(RELOC_OP_ABS, &p->u32, pc, val, 0, 12,
 					     AARCH64_INSN_IMM_12);
 			break;
 		case R_AARCH64_LDST16_ABS_LO12_NC:
 			overflow_check = false;
-			ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 1, 11,
+			ovf = reloc_insn_imm(RELOC_OP_ABS, &p->u32, pc, val, 1, 11,
 					     AARCH64_INSN_IMM_12);
 			break;
 		case R_AARCH64_LDST32_ABS_LO12_NC:
 			overflow_check = false;
-			ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 2, 10,
+			ovf = reloc_insn_imm(RELOC_OP_ABS, &p->u32, pc, val, 2, 10,
 					     AARCH64_INSN_IMM_12);
 			break;
 		case R_AARCH64_LDST64_ABS_LO12_NC:
 			overflow_check = false;
-			ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 3, 9,
+			ovf = reloc_insn_imm(RELOC_OP_ABS, &p->u32, pc, val, 3, 9,
 					     AARCH64_INSN_IMM_12);
 			break;
 		case R_AARCH64_LDST128_ABS_LO12_NC:
 			overflow_check = false;
-			ovf = reloc_insn_imm(RELOC_OP_ABS, loc, val, 4, 8,
+			ovf = reloc_insn_imm(RELOC_OP_ABS, &p->u32, pc, val, 4, 8,
 					     AARCH64_INSN_IMM_12);
 			break;
 		case R_AARCH64_TSTBR14:
-			ovf = reloc_insn_imm(RELOC_OP_PREL, loc, val, 2, 14,
+			ovf = reloc_insn_imm(RELOC_OP_PREL, &p->u32, pc, val, 2, 14,
 					     AARCH64_INSN_IMM_14);
 			break;
 		case R_AARCH64_CONDBR19:
-			ovf = reloc_insn_imm(RELOC_OP_PREL, loc, val, 2, 19,
+			ovf = reloc_insn_imm(RELOC_OP_PREL, &p->u32, pc, val, 2, 19,
 					     AARCH64_INSN_IMM_19);
 			break;
 
 		case R_AARCH64_JUMP26:
 		case R_AARCH64_CALL26:
-			ovf = reloc_insn_imm(RELOC_OP_PREL, loc, val, 2, 26,
+			ovf = reloc_insn_imm(RELOC_OP_PREL, &p->u32, pc, val, 2, 26,
 					     AARCH64_INSN_IMM_26);
 			if (ovf == -ERANGE) {
 				ulp_error("Out of rang.\n");
@@ -400,8 +432,7 @@ int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
 			break;
 
 		default:
-			ulp_error("unsupported RELA relocation: %lu\n",
-				ELF64_R_TYPE(rel[i].r_info));
+			ulp_error("unsupported RELA relocation: %u\n", r->type);
 			return -ENOEXEC;
 		}
 
@@ -412,8 +443,165 @@ int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
 	return 0;
 
 overflow:
-	ulp_error("overflow in relocation type %d val %lx\n",
-		(int)ELF64_R_TYPE(rel[i].r_info), val);
-	return -ENOEXEC;
+	ulp_error("overflow in relocation type %d val %lx\n", r->type, val);
+	if (sym->st_shndx == SHN_UNDEF)
+		plans->range_near = sym->st_value;
+	return -ERANGE;
+}
+
+#define A64_NOP		0xd503201f
+
+static inline long a64_sext(uint64_t v, int bits)
+{
+	return (long)(v << (64 - bits)) >> (64 - bits);
+}
+
+/* ldr x@reg, @off; the literal is PC-relative, +/-1MB */
+static inline uint32_t a64_ldr_lit(int reg, long off)
+{
+	return 0x58000000 | (off >> 2 & 0x7ffff) << 5 | reg;
 }
 
+/* br x@reg */
+static inline uint32_t a64_br(int reg)
+{
+	return 0xd61f0000 | reg << 5;
+}
+
+/**
+ * The PC-relative instructions are relocated, the conditional branches and
+ * literal loads to absolute literal, the scratch x16 or x17, which is not
+ * written by the relocated ones, jumps back.
+ */
+ssize_t arch_orig_tramp(unsigned long ip, const void *code, size_t len,
+			size_t need, unsigned long to, void *buf, size_t size,
+			unsigned long lit, size_t *used)
+{
+	unsigned int n = 0, max = size / 4, rt;
+	uint32_t *out = buf, insn;
+	unsigned long pc, dst, target;
+	unsigned long regs = 0;
+	size_t off;
+	int tmp;
+	long imm;
+
+	need = ROUND_UP(need, 4);
+	if (need > len)
+		return -ENODATA;
+
+	for (off = 0; off < need; off += 4) {
+		memcpy(&insn, (const char *)code + off, 4);
+		regs |= BIT(insn & 0x1f);
+		if (aarch64_insn_is_ldp(insn) || aarch64_insn_is_ldp_pre(insn) ||
+		    aarch64_insn_is_ldp_post(insn))
+			regs |= BIT(insn >> 10 & 0x1f);
+	}
+	tmp = !(regs & BIT(16)) ? 16 : !(regs & BIT(17)) ? 17 : -1;
+	if (tmp < 0)
+		return -EOPNOTSUPP;
+
+	for (off = 0; off < need; off += 4) {
+		memcpy(&insn, (const char *)code + off, 4);
+		pc = ip + off;
+		dst = to + n * 4;
+		rt = insn & 0x1f;
+
+		if (n + 6 > max)
+			return -ENOSPC;
+
+		if (aarch64_insn_is_adr(insn) || aarch64_insn_is_adrp(insn)) {
+			imm = a64_sext(aarch64_insn_decode_immediate(
+					AARCH64_INSN_IMM_ADR, insn), 21);
+			if (aarch64_insn_is_adrp(insn)) {
+				target = (pc & ~0xfffUL) + imm * SZ_4K;
+				imm = ((long)target - (long)(dst & ~0xfffUL)) /
+				      SZ_4K;
+			} else {
+				target = pc + imm;
+				imm = (long)target - (long)dst;
+			}
+			if (imm < -SZ_1M || imm >= SZ_1M)
+				return -ERANGE;
+			out[n++] = aarch64_insn_encode_immediate(
+					AARCH64_INSN_IMM_ADR, insn, imm);
+		} else if (aarch64_insn_is_b(insn) ||
+			   aarch64_insn_is_bl(insn)) {
+			target = pc + a64_sext((insn & 0x3ffffff) << 2, 28);
+			if (target > ip && target < ip + need)
+				return -EOPNOTSUPP;
+			imm = (long)target - (long)dst;
+			if (imm < -SZ_128M || imm >= SZ_128M)
+				return -ERANGE;
+			out[n++] = aarch64_insn_encode_immediate(
+					AARCH64_INSN_IMM_26, insn, imm >> 2);
+			if (aarch64_insn_is_b(insn))
+				break;
+		} else if (aarch64_insn_is_bcond(insn) ||
+			   aarch64_insn_is_cbz(insn) ||
+			   aarch64_insn_is_cbnz(insn) ||
+			   aarch64_insn_is_tbz(insn) ||
+			   aarch64_insn_is_tbnz(insn)) {
+			bool tb = aarch64_insn_is_tbz(insn) ||
+				  aarch64_insn_is_tbnz(insn);
+			enum aarch64_insn_imm_type type = tb ?
+				AARCH64_INSN_IMM_14 : AARCH64_INSN_IMM_19;
+
+			imm = a64_sext(aarch64_insn_decode_immediate(type,
+					insn) << 2, tb ? 16 : 21);
+			target = pc + imm;
+			if (target > ip && target < ip + need)
+				return -EOPNOTSUPP;
+			/* b.cond 1f; b 2f; 1: ldr; br; .quad target; 2: */
+			out[n++] = aarch64_insn_encode_immediate(type, insn, 2);
+			out[n++] = 0x14000005;
+			out[n++] = a64_ldr_lit(tmp, 8);
+			out[n++] = a64_br(tmp);
+			memcpy(&out[n], &target, 8);
+			n += 2;
+		} else if (aarch64_insn_is_ldr_lit(insn) ||
+			   aarch64_insn_is_ldrsw_lit(insn)) {
+			imm = a64_sext(aarch64_insn_decode_immediate(
+					AARCH64_INSN_IMM_19, insn) << 2, 21);
+			target = pc + imm;
+			if (target >= ip && target < ip + need)
+				return -EOPNOTSUPP;
+			/* ldr xt, 1f; ldr{,sw} t, [xt]; b 2f; 1: .quad; 2: */
+			out[n++] = a64_ldr_lit(rt, 12);
+			if (aarch64_insn_is_ldrsw_lit(insn))
+				out[n++] = 0xb9800000 | rt << 5 | rt;
+			else if (insn & BIT(30))
+				out[n++] = 0xf9400000 | rt << 5 | rt;
+			else
+				out[n++] = 0xb9400000 | rt << 5 | rt;
+			out[n++] = 0x14000003;
+			memcpy(&out[n], &target, 8);
+			n += 2;
+		} else if (aarch64_insn_is_prfm_lit(insn)) {
+			out[n++] = A64_NOP;
+		} else if ((insn & 0x3b000000) == 0x18000000) {
+			/* SIMD literal */
+			return -EOPNOTSUPP;
+		} else {
+			out[n++] = insn;
+			if (aarch64_insn_is_ret(insn) ||
+			    aarch64_insn_is_ret_auth(insn) ||
+			    aarch64_insn_is_br(insn) ||
+			    aarch64_insn_is_br_auth(insn))
+				break;
+		}
+	}
+	/* The instruction of break is relocated */
+	if (off < need)
+		off += 4;
+
+	if (n + 2 > max)
+		return -ENOSPC;
+	imm = (long)lit - (long)(to + n * 4);
+	if ((imm & 3) || imm < -SZ_1M || imm >= SZ_1M)
+		return -ERANGE;
+	out[n++] = a64_ldr_lit(tmp, imm);
+	out[n++] = a64_br(tmp);
+
+	*used = off;
+	return n * 4;
+}
@@ -18,3 +18,15 @@
 
 #define SYSCALL_RET(_regs)	_regs.regs[0]
 #define SYSCALL_IP(_regs)	_regs.pc
+
+/* Stack walk, see task_check_stacks() */
+#define REGS_IP(_regs)	_regs.pc
+#define REGS_SP(_regs)	_regs.sp
+#define REGS_FP(_regs)	_regs.regs[29]
+#define REGS_LR(_regs)	_regs.regs[30]
+
+/* see SYSCALL_BATCH_STUB */
+#define SYSCALL_BATCH_REGS_PREPARE(_regs, table, n) do {	\
+		_regs.regs[19] = table;	\
+		_regs.regs[20] = n;	\
+	} while (0)
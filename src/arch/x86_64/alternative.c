@@ -2,14 +2,18 @@
 // see linux:arch/x86/kernel/alternative.c
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <cpuid.h>
 
 #include <utils/compiler.h>
+#include <utils/log.h>
 
 #include <arch/x86_64/nops.h>
 
 
 #ifdef K8_NOP1
-static __unused const unsigned char k8nops[] =
+static const unsigned char k8nops[] =
 {
 	K8_NOP1,
 	K8_NOP2,
@@ -21,7 +25,7 @@ static __unused const unsigned char k8nops[] =
 	K8_NOP8,
 	K8_NOP5_ATOMIC
 };
-static __unused const unsigned char * const k8_nops[ASM_NOP_MAX+2] =
+static const unsigned char * const k8_nops[ASM_NOP_MAX+2] =
 {
 	NULL,
 	k8nops,
@@ -37,7 +41,7 @@ static __unused const unsigned char * const k8_nops[ASM_NOP_MAX+2] =
 #endif
 
 #ifdef P6_NOP1
-static __unused const unsigned char p6nops[] =
+static const unsigned char p6nops[] =
 {
 	P6_NOP1,
 	P6_NOP2,
@@ -49,7 +53,7 @@ static __unused const unsigned char p6nops[] =
 	P6_NOP8,
 	P6_NOP5_ATOMIC
 };
-static __unused const unsigned char * const p6_nops[ASM_NOP_MAX+2] =
+static const unsigned char * const p6_nops[ASM_NOP_MAX+2] =
 {
 	NULL,
 	p6nops,                                 /* 0x90 */
@@ -66,7 +70,67 @@ static __unused const unsigned char * const p6_nops[ASM_NOP_MAX+2] =
 
 
 #if defined(__x86_64__)
-// TODO: see linux:arch_init_ideal_nops() function
 const unsigned char * const *ideal_nops = p6_nops;
+
+/* Vendor signature in %ebx of CPUID leaf 0 */
+#define CPUID_VENDOR_INTEL	0x756e6547 /* "Genu" */
+#define CPUID_VENDOR_AMD	0x68747541 /* "Auth" */
+#define CPUID_VENDOR_HYGON	0x6f677948 /* "Hygo" */
+
+/**
+ * Select the NOP table for the running CPU, same as the kernel does, the
+ * P6 NOPs are avoided on the Intel models which decode them slow, and on
+ * the CPUs which may not support them at all.
+ */
+void arch_init_ideal_nops(void)
+{
+	unsigned int eax, ebx, ecx, edx, vendor, family, model;
+
+	if (!__get_cpuid(0, &eax, &vendor, &ecx, &edx) ||
+	    !__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return;
+
+	family = (eax >> 8) & 0xf;
+	model = (eax >> 4) & 0xf;
+	if (family == 0xf)
+		family += (eax >> 20) & 0xff;
+	if (family >= 0x6)
+		model += ((eax >> 16) & 0xf) << 4;
+
+	switch (vendor) {
+	case CPUID_VENDOR_INTEL:
+		/* Decoder quirk, these models run the K8 NOPs faster */
+		if (family == 6 && model >= 0x0f && model != 0x1c &&
+		    model != 0x26 && model != 0x27 && model < 0x30)
+			ideal_nops = k8_nops;
+		else
+			ideal_nops = p6_nops;
+		break;
+	case CPUID_VENDOR_HYGON:
+		ideal_nops = p6_nops;
+		break;
+	case CPUID_VENDOR_AMD:
+		if (family > 0xf) {
+			ideal_nops = p6_nops;
+			break;
+		}
+		/* fallthrough */
+	default:
+		ideal_nops = k8_nops;
+		break;
+	}
+
+	ulp_debug("Ideal nops: %s\n", ideal_nops == p6_nops ? "p6" : "k8");
+}
+
+/**
+ * The 5 bytes NOP of mcount site may be generated by another CPU or another
+ * compiler than the running one, accept all atomic 5 bytes NOPs.
+ */
+bool is_atomic_nop5(const void *code)
+{
+	return !memcmp(code, p6_nops[NOP_ATOMIC5], 5) ||
+	       !memcmp(code, k8_nops[NOP_ATOMIC5], 5);
+}
 #endif
 
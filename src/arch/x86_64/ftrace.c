@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -11,6 +12,7 @@
 #include <arch/x86_64/instruments.h>
 #include <arch/x86_64/ftrace.h>
 #include <arch/x86_64/nops.h>
+#include <patch/patch.h>
 
 const char *ftrace_nop_replace(void)
 {
@@ -23,3 +25,77 @@ const char *ftrace_call_replace(union text_poke_insn *insn, unsigned long ip,
 	return text_gen_insn(insn, INST_CALL, (void *)ip, (void *)addr);
 }
 
+/**
+ * Swap the CALL and NOP of @nr mcount sites through int3, the threads of
+ * target keep running, see text_poke_bp_batch().
+ */
+int ftrace_modify_sites(struct task_struct *task, const struct code_write *w,
+			unsigned int nr)
+{
+	return text_poke_bp_batch(task, w, nr);
+}
+
+/**
+ * Find the mcount site of the function at @ip, @code is the first @len bytes
+ * of it. With -pg, the function calls mcount once the frame pointer is set
+ * up, the callee saved registers and the stack allocation may be before the
+ * call, with -mnop-mcount, the call is a 5 bytes nop.
+ *
+ * Only the prologue instructions above are decoded, any other instruction
+ * before the site means the function is not instrumented.
+ */
+int ftrace_find_mcount_site(const uint8_t *code, size_t len, unsigned long ip,
+			    const unsigned long *mcounts, int nr,
+			    unsigned long *site)
+{
+	const uint8_t *p;
+	size_t off = 0;
+	int32_t disp;
+	int i;
+
+	/* endbr64 */
+	if (len >= 4 && !memcmp(code, "\xf3\x0f\x1e\xfa", 4))
+		off += 4;
+
+	/* push %rbp; mov %rsp,%rbp */
+	if (off + 4 > len || memcmp(code + off, "\x55\x48\x89\xe5", 4))
+		return -ENOENT;
+	off += 4;
+
+	while (off + MCOUNT_INSN_SIZE <= len) {
+		p = code + off;
+
+		if (p[0] == INST_CALL) {
+			memcpy(&disp, p + 1, sizeof(disp));
+			for (i = 0; i < nr; i++) {
+				if (ip + off + CALL_INSN_SIZE + disp != mcounts[i])
+					continue;
+				*site = ip + off;
+				return FTRACE_SITE_CALL;
+			}
+			return -ENOENT;
+		}
+
+		if (is_atomic_nop5(p)) {
+			*site = ip + off;
+			return FTRACE_SITE_NOP;
+		}
+
+		if (p[0] == 0x53)
+			/* push %rbx */
+			off += 1;
+		else if (p[0] == 0x41 && p[1] >= 0x54 && p[1] <= 0x57)
+			/* push %r12-%r15 */
+			off += 2;
+		else if (p[0] == 0x48 && p[1] == 0x83 && p[2] == 0xec)
+			/* sub $imm8,%rsp */
+			off += 4;
+		else if (p[0] == 0x48 && p[1] == 0x81 && p[2] == 0xec)
+			/* sub $imm32,%rsp */
+			off += 7;
+		else
+			return -ENOENT;
+	}
+
+	return -ENOENT;
+}
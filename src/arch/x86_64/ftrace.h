@@ -2,9 +2,20 @@
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 
+struct task_struct;
+struct code_write;
+
 const char *ftrace_nop_replace(void);
 const char *ftrace_call_replace(union text_poke_insn *insn, unsigned long ip,
 				unsigned long addr);
+int text_poke_bp_batch(struct task_struct *task, const struct code_write *w,
+		       unsigned int nr);
+int ftrace_modify_sites(struct task_struct *task, const struct code_write *w,
+			unsigned int nr);
 
+int ftrace_find_mcount_site(const uint8_t *code, size_t len, unsigned long ip,
+			    const unsigned long *mcounts, int nr,
+			    unsigned long *site);
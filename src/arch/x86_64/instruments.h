@@ -42,6 +42,50 @@
 		INST_SYSCALL, /* syscall */\
 		INST_INT3, /* int3 */
 
+/**
+ * Syscall batch stub, see task_syscall_batch(), %rbx point to syscall table,
+ * %r12 is number of entries, every entry is 72 bytes:
+ *
+ *   0: nr, 8-48: args[6], 56: ref_mask, 64: return value
+ *
+ * If bit i of ref_mask is set, args[i] is an address, load args[i] from it.
+ */
+#define SYSCALL_BATCH_STUB \
+		0x4d, 0x85, 0xe4,       /* 00: test %r12,%r12 */\
+		0x74, 0x64,             /* 03: je 69 <done> */\
+		0x4c, 0x8b, 0x6b, 0x38, /* 05: mov 0x38(%rbx),%r13 */\
+		0x48, 0x8b, 0x7b, 0x08, /* 09: mov 0x8(%rbx),%rdi */\
+		0x41, 0xf6, 0xc5, 0x01, /* 0d: test $0x1,%r13b */\
+		0x74, 0x03,             /* 11: je 16 */\
+		0x48, 0x8b, 0x3f,       /* 13: mov (%rdi),%rdi */\
+		0x48, 0x8b, 0x73, 0x10, /* 16: mov 0x10(%rbx),%rsi */\
+		0x41, 0xf6, 0xc5, 0x02, /* 1a: test $0x2,%r13b */\
+		0x74, 0x03,             /* 1e: je 23 */\
+		0x48, 0x8b, 0x36,       /* 20: mov (%rsi),%rsi */\
+		0x48, 0x8b, 0x53, 0x18, /* 23: mov 0x18(%rbx),%rdx */\
+		0x41, 0xf6, 0xc5, 0x04, /* 27: test $0x4,%r13b */\
+		0x74, 0x03,             /* 2b: je 30 */\
+		0x48, 0x8b, 0x12,       /* 2d: mov (%rdx),%rdx */\
+		0x4c, 0x8b, 0x53, 0x20, /* 30: mov 0x20(%rbx),%r10 */\
+		0x41, 0xf6, 0xc5, 0x08, /* 34: test $0x8,%r13b */\
+		0x74, 0x03,             /* 38: je 3d */\
+		0x4d, 0x8b, 0x12,       /* 3a: mov (%r10),%r10 */\
+		0x4c, 0x8b, 0x43, 0x28, /* 3d: mov 0x28(%rbx),%r8 */\
+		0x41, 0xf6, 0xc5, 0x10, /* 41: test $0x10,%r13b */\
+		0x74, 0x03,             /* 45: je 4a */\
+		0x4d, 0x8b, 0x00,       /* 47: mov (%r8),%r8 */\
+		0x4c, 0x8b, 0x4b, 0x30, /* 4a: mov 0x30(%rbx),%r9 */\
+		0x41, 0xf6, 0xc5, 0x20, /* 4e: test $0x20,%r13b */\
+		0x74, 0x03,             /* 52: je 57 */\
+		0x4d, 0x8b, 0x09,       /* 54: mov (%r9),%r9 */\
+		0x48, 0x8b, 0x03,       /* 57: mov (%rbx),%rax */\
+		INST_SYSCALL,           /* 5a: syscall */\
+		0x48, 0x89, 0x43, 0x40, /* 5c: mov %rax,0x40(%rbx) */\
+		0x48, 0x83, 0xc3, 0x48, /* 60: add $0x48,%rbx */\
+		0x49, 0xff, 0xcc,       /* 64: dec %r12 */\
+		0xeb, 0x97,             /* 67: jmp 0 */\
+		INST_INT3,              /* 69: done: int3 */
+
 
 #define JMP_TABLE_JUMP_X86_64   0x90900000000225ff /* jmp [rip+2]; nop; nop */
 #define JMP_TABLE_JUMP_ARCH     JMP_TABLE_JUMP_X86_64
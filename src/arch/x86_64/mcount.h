@@ -20,3 +20,9 @@ struct mcount_regs {
 #define ARG5(a) ((a)->r8)
 #define ARG6(a) ((a)->r9)
 
+
+/**
+ * Stack pointer when the child returns into _ftrace_mcount_return(), the
+ * @retval of mcount_exit() is below it, see mcount.S.
+ */
+#define MCOUNT_RETURN_SP(retval)	((unsigned long)(retval) + 48)
@@ -116,5 +116,6 @@
 #ifndef __ASSEMBLY__
 extern const unsigned char * const *ideal_nops;
 extern void arch_init_ideal_nops(void);
+extern bool is_atomic_nop5(const void *code);
 #endif
 
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <utils/util.h>
@@ -20,194 +21,503 @@ const char *ulpatch_jmpq_replace(union text_poke_insn *insn, unsigned long ip,
 	return text_gen_insn(insn, INST_JMPQ, (void *)ip, (void *)addr);
 }
 
-static long target_off = 0L;
-static inline void *debug_memcpy(void *dst, const void *src, size_t n)
-{
-	int i;
-	ulp_debug("RELA: Copy %ld bytes from %p to %p\n", n, src, dst);
-	ulp_debug("RELA: Copy %x to %p\n", *(int *)src, dst - target_off);
-	if (get_log_level() >= LOG_NOTICE) {
-		for (i = 0; i < n; i += sizeof(unsigned int)) {
-			unsigned int ui = *(unsigned int *)(src + i);
-			ulp_debug("    : %x\n", ui);
-		}
-	}
-
-	return memcpy(dst, src, n);
-}
-
-int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
-			    const char *strtab, unsigned int symindex,
-			    unsigned int relsec)
+/**
+ * How to apply one type of relocation, the value is S + A, minus P if
+ * X86_RELOC_F_PCREL, then written with @size bytes, see x86_apply_group().
+ */
+enum {
+	X86_RELOC_F_VALID = BIT(0),
+	X86_RELOC_F_PCREL = BIT(1),
+	/* GOTPCREL like, the TLS symbol's GOT entry is in target already */
+	X86_RELOC_F_GOT = BIT(2),
+	/* Overflow check of the 32bit value */
+	X86_RELOC_F_U32 = BIT(3),
+	X86_RELOC_F_S32 = BIT(4),
+	/* Should not be present, skip it */
+	X86_RELOC_F_SKIP = BIT(5),
+};
+
+struct x86_reloc_howto {
+	uint8_t size;
+	uint8_t flags;
+};
+
+static const struct x86_reloc_howto x86_howtos[R_X86_64_NUM] = {
+	[R_X86_64_NONE] = { 0, X86_RELOC_F_VALID },
+	[R_X86_64_64] = { 8, X86_RELOC_F_VALID },
+	[R_X86_64_32] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_U32 },
+	[R_X86_64_32S] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_S32 },
+	[R_X86_64_PC32] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_PCREL },
+	[R_X86_64_PLT32] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_PCREL },
+	[R_X86_64_PC64] = { 8, X86_RELOC_F_VALID | X86_RELOC_F_PCREL },
+	/**
+	 * Newest kernel already remove {GOTTPOFF, GOTPCREL, REX_GOTPCRELX,
+	 * GOTPCRELX} cases, because kernel module ko is not PIC, and kernel
+	 * address smaller than 0xffffffff.
+	 */
+	[R_X86_64_GOTTPOFF] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_PCREL |
+				   X86_RELOC_F_GOT },
+	[R_X86_64_GOTPCREL] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_PCREL |
+				   X86_RELOC_F_GOT },
+	[R_X86_64_REX_GOTPCRELX] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_PCREL |
+					X86_RELOC_F_GOT },
+	[R_X86_64_GOTPCRELX] = { 4, X86_RELOC_F_VALID | X86_RELOC_F_PCREL |
+				    X86_RELOC_F_GOT },
+	/* FIXME: Newest kernel already remove {TPOFF64, TPOFF32} cases */
+	[R_X86_64_TPOFF64] = { 0, X86_RELOC_F_VALID | X86_RELOC_F_SKIP },
+	[R_X86_64_TPOFF32] = { 0, X86_RELOC_F_VALID | X86_RELOC_F_SKIP },
+};
+
+/**
+ * Plan relocations of the same type in a tight loop, nothing is written.
+ * If @replay, the location is relocated already, see struct reloc_plans.
+ */
+static int x86_plan_group(const struct load_info *info, Elf64_Sym *syms,
+			  const struct reloc_log *log, const unsigned int *idx,
+			  unsigned int nr, uint32_t type,
+			  struct reloc_plans *plans)
 {
+	const struct x86_reloc_howto *h = &x86_howtos[type];
+	const struct reloc_log *r = NULL;
+	struct reloc_plan *p;
+	uint64_t val = 0, old;
+	Elf64_Sym *sym = NULL;
 	unsigned int i;
 
-	/**
-	 * Object file is indicated by '#', address space is represented by '|--|'
-	 *
-	 *                                     hdr
-	 *                                     |
-	 * HostTask    |-----------------------###########----------|
-	 *                                     |    ^
-	 *                      |<-- t_off  -->|    sh_addr
-	 *                      |
-	 * TargetTask  |--------###########-------------------------|
-	 *                      |    ^
-	 *              target_hdr   |
-	 *                          rel
-	 */
-	long t_off = (long)info->hdr - (long)info->target_hdr;
+	if (h->flags & X86_RELOC_F_SKIP)
+		ulp_error("%s should not be present\n", rela_type_string(type));
 
-	target_off = t_off;
-	void *(*write_func)(void *, const void *, size_t) = debug_memcpy;
+	for (i = 0; i < nr; i++) {
+		r = &log[idx[i]];
+		p = &plans->ents[idx[i]];
 
-	/**
-	 * sh_addr now point to target process address space, so need to
-	 * relocate to current process.
-	 */
-	Elf64_Rela *rel = (void *)sechdrs[relsec].sh_addr + t_off;
-	Elf64_Sym *sym;
-	void *loc;
-	uint64_t val;
-	int r_type = 0;
-	const char *symname;
+		p->offset = r->offset;
+		p->size = h->size;
+		p->u64 = 0;
 
-	ulp_debug("Applying relocate section %u to %u\n", relsec, sechdrs[relsec].sh_info);
+		if (!h->size)
+			continue;
 
-	for (i = 0; i < sechdrs[relsec].sh_size / sizeof(*rel); i++) {
+		if (r->offset + h->size > info->len)
+			goto invalid_relocation;
+
+		/* All undefined symbols have been resolved */
+		sym = &syms[r->sym];
+		val = sym->st_value + r->addend;
 
 		/**
-		 * This is where to make the change, so, here need to relocate
-		 * to current process address space (use info->target_hdr and
-		 * info->hdr)
+		 * This is GOTTPOFF that already points to an appropriate GOT
+		 * entry in the target's memory.
+		 *
+		 * TODO: undefined symbol need val += sizeof(unsigned long).
 		 */
-		loc = (void *)(sechdrs[sechdrs[relsec].sh_info].sh_addr + t_off
-			+ rel[i].r_offset);
+		if (h->flags & X86_RELOC_F_GOT && !is_undef_symbol(sym) &&
+		    GELF_ST_TYPE(sym->st_info) == STT_TLS)
+			val = r->addend + info->target_hdr - 4;
 
 		/**
-		 * This is the symbol it is referring to.  Note that all
-		 * undefined symbols have been resolved.
+		 * The offset is the same in current process and target
+		 * process, the location in target process is P.
 		 */
-		sym = (Elf64_Sym *)(sechdrs[symindex].sh_addr + t_off)
-			+ ELF64_R_SYM(rel[i].r_info);
+		if (h->flags & X86_RELOC_F_PCREL)
+			val -= info->target_hdr + r->offset;
+
+		old = 0;
+		memcpy(&old, (void *)info->hdr + r->offset, h->size);
+		if (!plans->replay && old != 0)
+			goto invalid_relocation;
+
+		if (h->flags & X86_RELOC_F_U32 && val != (uint32_t)val)
+			goto overflow;
+		if (h->flags & X86_RELOC_F_S32 && (int64_t)val != (int32_t)val)
+			goto overflow;
+		/* Not checked before, but never silently truncate it */
+		if (h->flags & X86_RELOC_F_PCREL && h->size == 4 &&
+		    (int64_t)val != (int32_t)val)
+			goto overflow;
+
+		p->u64 = val;
+
+		ulp_debug("RELA: %s sym %u, r_addend %lx, offset %x, val %lx\n",
+			  rela_type_string(type), r->sym, r->addend, r->offset,
+			  val);
+	}
 
-		memshowinlog(LOG_DEBUG, info->strtab, info->sechdrs[info->index.sym].sh_size);
-		ulp_debug("symname: st_name = %d, st_value %lx, bind %d, SYM:r_info %ld, ndx %d\n",
-			  sym->st_name, sym->st_value, ELF64_ST_BIND(sym->st_info),
-			  ELF64_R_SYM(rel[i].r_info), sym->st_shndx);
+	return 0;
 
-		symname = strtab + sym->st_name;
-		r_type = (int)ELF64_R_TYPE(rel[i].r_info);
-		val = sym->st_value + rel[i].r_addend;
+invalid_relocation:
+	ulp_error("x86: Skipping invalid relocation target, "
+		"existing value is nonzero for type %s(%d), offset %x, "
+		"val %lx\n", rela_type_string(type), type, r->offset, val);
+	return -ENOEXEC;
 
-		ulp_debug("RELA: '%s', st_name %d, type %d, st_value %lx, "
-		       "r_addend %lx, loc %lx, val %lx\n",
-			symname, sym->st_name, r_type,
-			sym->st_value, rel[i].r_addend, (uint64_t)loc, val);
+overflow:
+	ulp_error("overflow in relocation type %s(%d) val %lx, offset %x, "
+		  "sym '%s'\n", rela_type_string(type), type, val, r->offset,
+		  info->strtab + sym->st_name);
+	ulp_error("likely not compiled with -fpic and -fno-PIE.\n");
+	if (sym->st_shndx == SHN_UNDEF)
+		plans->range_near = sym->st_value;
+	return -ERANGE;
+}
 
-		switch (r_type) {
+/* Group the relocations by type with counting sort, then plan them */
+int arch_plan_relocs(const struct load_info *info, const struct reloc_log *log,
+		     unsigned int nr, struct reloc_plans *plans)
+{
+	unsigned int start[R_X86_64_NUM + 1] = {}, pos[R_X86_64_NUM];
+	GElf_Shdr *symsec = &info->sechdrs[info->index.sym];
+	unsigned int i, *idx, nr_syms;
+	uint32_t type;
+	Elf64_Sym *syms;
+	int err = 0;
+
+	if (!nr)
+		return 0;
+
+	nr_syms = symsec->sh_size / sizeof(*syms);
+
+	for (i = 0; i < nr; i++) {
+		type = log[i].type;
+		if (log[i].sym >= nr_syms) {
+			ulp_error("Invalid symbol index %u\n", log[i].sym);
+			return -ENOEXEC;
+		}
+		if (type >= R_X86_64_NUM ||
+		    !(x86_howtos[type].flags & X86_RELOC_F_VALID)) {
+			ulp_error("Unknown rela relocation: %s\n",
+				  rela_type_string(type));
+			return -ENOEXEC;
+		}
+		start[type + 1]++;
+	}
 
-		case R_X86_64_NONE:
-			ulp_warning("Handle R_X86_64_NONE\n");
-			break;
+	for (type = 0; type < R_X86_64_NUM; type++) {
+		start[type + 1] += start[type];
+		pos[type] = start[type];
+	}
 
-		case R_X86_64_64:
-			ulp_warning("Handle R_X86_64_64\n");
-			if (*(uint64_t*)loc != 0)
-				goto invalid_relocation;
-			write_func(loc, &val, 8);
-			break;
+	idx = malloc(sizeof(*idx) * nr);
+	if (!idx)
+		return -ENOMEM;
 
-		case R_X86_64_32:
-			ulp_warning("Handle R_X86_64_32\n");
-			if (*(uint32_t *)loc != 0)
-				goto invalid_relocation;
-			write_func(loc, &val, 4);
-			if (val != *(uint32_t *)loc)
-				goto overflow;
-			break;
+	for (i = 0; i < nr; i++)
+		idx[pos[log[i].type]++] = i;
 
-		case R_X86_64_32S:
-			ulp_warning("Handle R_X86_64_32S\n");
-			if (*(int32_t *)loc != 0)
-				goto invalid_relocation;
-			write_func(loc, &val, 4);
-			if ((int64_t)val != *(int32_t *)loc)
-				goto overflow;
-			break;
+	syms = (void *)info->hdr + symsec->sh_offset;
 
-		/**
-		 * Newest kernel already remove {GOTTPOFF, GOTPCREL,
-		 * REX_GOTPCRELX, GOTPCRELX} cases, because kernel module ko
-		 * is not PIC, and kernel address smaller than 0xffffffff.
-		 */
-		case R_X86_64_GOTTPOFF:
-		case R_X86_64_GOTPCREL:
-		case R_X86_64_REX_GOTPCRELX:
-		case R_X86_64_GOTPCRELX:
-			if (is_undef_symbol(sym)) {
-				// TODO
-				// val += sizeof(unsigned long);
-			} else if (GELF_ST_TYPE(sym->st_info) == STT_TLS) {
-				/**
-				 * This is GOTTPOFF that already points to an
-				 * appropriate GOT entry in the target's memory.
-				 */
-				val = rel->r_addend + info->target_hdr - 4;
-			}
-			FALLTHROUGH;
-
-		case R_X86_64_PC32:
-			ulp_warning("Handle R_X86_64_PC32\n");
-			FALLTHROUGH;
-
-		case R_X86_64_PLT32:
-			ulp_warning("Handle R_X86_64_PLT32\n");
-			if (*(uint32_t *)loc != 0)
-				goto invalid_relocation;
-			/**
-			 * - t_off means that in target process
-			 */
-			val -= (uint64_t)loc - t_off;
-			write_func(loc, &val, 4);
-			break;
+	for (type = 0; type < R_X86_64_NUM && !err; type++) {
+		if (start[type + 1] == start[type])
+			continue;
+		err = x86_plan_group(info, syms, log, idx + start[type],
+				     start[type + 1] - start[type], type,
+				     plans);
+	}
 
-		case R_X86_64_PC64:
-			ulp_warning("Handle R_X86_64_PC64\n");
-			if (*(uint64_t *)loc != 0)
-				goto invalid_relocation;
-			/**
-			 * - t_off means that in target process
-			 */
-			val -= (uint64_t)loc - t_off;
-			write_func(loc, &val, 8);
-			break;
+	free(idx);
+	return err;
+}
 
-		/* FIXME: Newest kernel already remove {TPOFF64, TPOFF32} cases */
-		case R_X86_64_TPOFF64:
-		case R_X86_64_TPOFF32:
-			ulp_error("TPOFF32/TPOFF64 should not be present\n");
+/**
+ * Operands of the one-byte and 0x0f opcodes, enough for the function
+ * prologues, see x86_insn_decode(). Zero if not supported, such as VEX.
+ */
+enum {
+	X86_OP_VALID = BIT(0),
+	X86_OP_MODRM = BIT(1),
+	X86_OP_IMM8 = BIT(2),
+	X86_OP_IMM16 = BIT(3),
+	/* imm16 with 0x66, otherwise imm32 */
+	X86_OP_IMMZ = BIT(4),
+	/* imm64 with REX.W, otherwise as X86_OP_IMMZ */
+	X86_OP_IMMV = BIT(5),
+	/* moffs64, moffs32 with 0x67 */
+	X86_OP_MOFFS = BIT(6),
+	/* 0xf6 and 0xf7, test has immediate */
+	X86_OP_GRP3 = BIT(7),
+	X86_OP_REL8 = BIT(8),
+	X86_OP_REL32 = BIT(9),
+	/* ret, jmp, int3, no jump back is needed */
+	X86_OP_END = BIT(10),
+};
+
+#define _V	X86_OP_VALID
+#define _M	(X86_OP_VALID | X86_OP_MODRM)
+#define _I8	(X86_OP_VALID | X86_OP_IMM8)
+#define _IZ	(X86_OP_VALID | X86_OP_IMMZ)
+#define _END	(X86_OP_VALID | X86_OP_END)
+
+static const uint16_t x86_ops1[256] = {
+	[0x00 ... 0x03] = _M, [0x04] = _I8, [0x05] = _IZ,
+	[0x08 ... 0x0b] = _M, [0x0c] = _I8, [0x0d] = _IZ,
+	[0x10 ... 0x13] = _M, [0x14] = _I8, [0x15] = _IZ,
+	[0x18 ... 0x1b] = _M, [0x1c] = _I8, [0x1d] = _IZ,
+	[0x20 ... 0x23] = _M, [0x24] = _I8, [0x25] = _IZ,
+	[0x28 ... 0x2b] = _M, [0x2c] = _I8, [0x2d] = _IZ,
+	[0x30 ... 0x33] = _M, [0x34] = _I8, [0x35] = _IZ,
+	[0x38 ... 0x3b] = _M, [0x3c] = _I8, [0x3d] = _IZ,
+	[0x50 ... 0x5f] = _V,
+	[0x63] = _M,
+	[0x68] = _IZ, [0x69] = _M | _IZ, [0x6a] = _I8, [0x6b] = _M | _I8,
+	[0x70 ... 0x7f] = _V | X86_OP_REL8,
+	[0x80] = _M | _I8, [0x81] = _M | _IZ, [0x83] = _M | _I8,
+	[0x84 ... 0x8f] = _M,
+	[0x90 ... 0x99] = _V, [0x9b ... 0x9f] = _V,
+	[0xa0 ... 0xa3] = _V | X86_OP_MOFFS,
+	[0xa4 ... 0xa7] = _V, [0xa8] = _I8, [0xa9] = _IZ, [0xaa ... 0xaf] = _V,
+	[0xb0 ... 0xb7] = _I8, [0xb8 ... 0xbf] = _V | X86_OP_IMMV,
+	[0xc0 ... 0xc1] = _M | _I8, [0xc2] = _END | X86_OP_IMM16,
+	[0xc3] = _END, [0xc6] = _M | _I8, [0xc7] = _M | _IZ,
+	[0xc8] = _I8 | X86_OP_IMM16, [0xc9] = _V, [0xcc] = _END,
+	[0xd0 ... 0xd3] = _M, [0xd8 ... 0xdf] = _M,
+	[0xe8] = _V | X86_OP_REL32, [0xe9] = _END | X86_OP_REL32,
+	[0xeb] = _END | X86_OP_REL8,
+	[0xf4] = _END, [0xf5] = _V, [0xf6 ... 0xf7] = _M | X86_OP_GRP3,
+	[0xf8 ... 0xfd] = _V, [0xfe ... 0xff] = _M,
+};
+
+/* After 0x0f, 0x38 and 0x3a are the three-byte opcodes */
+static const uint16_t x86_ops2[256] = {
+	[0x00 ... 0x01] = _M, [0x05] = _V, [0x0b] = _END, [0x0d] = _M,
+	[0x10 ... 0x1f] = _M, [0x28 ... 0x2f] = _M, [0x31] = _V,
+	[0x38] = _M, [0x3a] = _M | _I8,
+	[0x40 ... 0x6f] = _M, [0x70 ... 0x73] = _M | _I8,
+	[0x74 ... 0x76] = _M, [0x7e ... 0x7f] = _M,
+	[0x80 ... 0x8f] = _V | X86_OP_REL32,
+	[0x90 ... 0x9f] = _M,
+	[0xa2] = _V, [0xa3] = _M, [0xa4] = _M | _I8, [0xa5] = _M,
+	[0xab] = _M, [0xac] = _M | _I8, [0xad] = _M, [0xaf] = _M,
+	[0xb0 ... 0xb1] = _M, [0xb3] = _M, [0xb6 ... 0xb7] = _M,
+	[0xba] = _M | _I8, [0xbb ... 0xbf] = _M,
+	[0xc0 ... 0xc1] = _M, [0xc2] = _M | _I8, [0xc3] = _M,
+	[0xc4 ... 0xc6] = _M | _I8, [0xc7] = _M, [0xc8 ... 0xcf] = _V,
+	[0xd0 ... 0xff] = _M,
+};
+
+#undef _V
+#undef _M
+#undef _I8
+#undef _IZ
+#undef _END
+
+#define X86_MAX_INSN_SIZE	15
+
+struct x86_insn {
+	unsigned int len;
+	uint16_t flags;
+	/* The opcode byte, after 0x0f if @escape */
+	uint8_t opcode;
+	bool escape;
+	/* Offset of the rel8/rel32, or the disp32 of RIP-relative, or 0 */
+	unsigned int rel;
+	bool rip;
+	bool opsize;
+};
+
+/* Length and operands of the instruction @p of at most @len bytes */
+static int x86_insn_decode(const uint8_t *p, size_t len, struct x86_insn *insn)
+{
+	bool adsize = false, rexw = false, test = false;
+	unsigned int i, disp = 0, imm = 0;
+	uint8_t modrm, reg;
+	uint16_t f;
+
+	memset(insn, 0, sizeof(*insn));
+	len = MIN(len, (size_t)X86_MAX_INSN_SIZE);
+
+	for (i = 0; i < len; i++) {
+		if (p[i] == 0x66)
+			insn->opsize = true;
+		else if (p[i] == 0x67)
+			adsize = true;
+		else if (p[i] != 0x26 && p[i] != 0x2e && p[i] != 0x36 &&
+			 p[i] != 0x3e && p[i] != 0x64 && p[i] != 0x65 &&
+			 p[i] != 0xf0 && p[i] != 0xf2 && p[i] != 0xf3)
 			break;
-
-		default:
-			ulp_error("Unknown rela relocation: %s\n",
-				rela_type_string(r_type));
-			return -ENOEXEC;
+	}
+	if (i < len && (p[i] & 0xf0) == 0x40)
+		rexw = p[i++] & 0x8;
+	if (i >= len)
+		return -ENODATA;
+
+	insn->opcode = p[i++];
+	if (insn->opcode == 0x0f) {
+		if (i >= len)
+			return -ENODATA;
+		insn->escape = true;
+		insn->opcode = p[i++];
+		f = x86_ops2[insn->opcode];
+		/* The third opcode byte */
+		if (insn->opcode == 0x38 || insn->opcode == 0x3a)
+			i++;
+	} else
+		f = x86_ops1[insn->opcode];
+	if (!f)
+		return -EOPNOTSUPP;
+
+	if (f & X86_OP_MODRM) {
+		if (i >= len)
+			return -ENODATA;
+		modrm = p[i++];
+		reg = modrm >> 3 & 7;
+		if ((modrm >> 6) != 3 && (modrm & 7) == 4) {
+			if (i >= len)
+				return -ENODATA;
+			/* SIB without base */
+			if ((modrm >> 6) == 0 && (p[i] & 7) == 5)
+				disp = 4;
+			i++;
+		} else if ((modrm >> 6) == 0 && (modrm & 7) == 5) {
+			/* EIP-relative */
+			if (adsize)
+				return -EOPNOTSUPP;
+			insn->rip = true;
+			insn->rel = i;
+			disp = 4;
 		}
+		if ((modrm >> 6) == 1)
+			disp = 1;
+		else if ((modrm >> 6) == 2)
+			disp = 4;
+		i += disp;
+
+		test = (f & X86_OP_GRP3) && reg < 2;
+		/* jmp *, ljmp * */
+		if (!insn->escape && insn->opcode == 0xff &&
+		    (reg == 4 || reg == 5))
+			f |= X86_OP_END;
+	}
+
+	if (f & X86_OP_IMM8 || (test && insn->opcode == 0xf6))
+		imm += 1;
+	if (f & X86_OP_IMM16)
+		imm += 2;
+	if (f & X86_OP_IMMZ || (test && insn->opcode == 0xf7))
+		imm += insn->opsize ? 2 : 4;
+	if (f & X86_OP_IMMV)
+		imm += rexw ? 8 : insn->opsize ? 2 : 4;
+	if (f & X86_OP_MOFFS)
+		imm += adsize ? 4 : 8;
+	if (f & (X86_OP_REL8 | X86_OP_REL32)) {
+		/* rel16 */
+		if (insn->opsize)
+			return -EOPNOTSUPP;
+		insn->rel = i;
+		imm += f & X86_OP_REL8 ? 1 : 4;
 	}
+	i += imm;
+	if (i > len)
+		return -ENODATA;
 
+	insn->len = i;
+	insn->flags = f;
 	return 0;
+}
 
-invalid_relocation:
-	ulp_error("x86: Skipping invalid relocation target, "
-		"existing value is nonzero for type %s(%d), loc %p, val %lx\n",
-		rela_type_string(r_type), r_type, loc, val);
-	return -ENOEXEC;
+/* Relocate the relative branch @insn to @target into @out at @to */
+static ssize_t x86_reloc_branch(const struct x86_insn *insn,
+				unsigned long target, unsigned long to,
+				uint8_t *out, size_t size)
+{
+	unsigned int n = 0;
+	long rel;
+	int32_t rel32;
+
+	if (size < 6)
+		return -ENOSPC;
+
+	if (!insn->escape && insn->opcode == 0xe8)
+		out[n++] = 0xe8;
+	else if (!insn->escape && (insn->opcode == 0xe9 ||
+				   insn->opcode == 0xeb))
+		out[n++] = 0xe9;
+	else {
+		/* Jcc rel8 is 0x7X, Jcc rel32 is 0x0f 0x8X */
+		out[n++] = 0x0f;
+		out[n++] = 0x80 | (insn->opcode & 0xf);
+	}
 
-overflow:
-	ulp_error("overflow in relocation type %s(%d) val %lx, loc %lx, sym '%s'\n",
-		rela_type_string(r_type), r_type, val, (uint64_t)loc, symname);
-	ulp_error("likely not compiled with -fpic and -fno-PIE.\n");
-	return -ENOEXEC;
+	rel = (long)target - (long)(to + n + 4);
+	if (rel != (int32_t)rel)
+		return -ERANGE;
+	rel32 = rel;
+	memcpy(out + n, &rel32, 4);
+	return n + 4;
 }
 
+/**
+ * The relative branches are converted to rel32, the RIP-relative operands
+ * are fixed up, the ones refer to the relocated bytes are not supported.
+ */
+ssize_t arch_orig_tramp(unsigned long ip, const void *code, size_t len,
+			size_t need, unsigned long to, void *buf, size_t size,
+			unsigned long lit, size_t *used)
+{
+	const uint8_t *p = code;
+	uint8_t *out = buf;
+	struct x86_insn insn;
+	unsigned long pc, target;
+	size_t off = 0, n = 0;
+	int32_t disp;
+	ssize_t ret;
+	long rel;
+	int err;
+
+	while (off < need) {
+		err = x86_insn_decode(p + off, len - off, &insn);
+		if (err)
+			return err;
+
+		pc = ip + off;
+		if (insn.flags & (X86_OP_REL8 | X86_OP_REL32)) {
+			if (insn.flags & X86_OP_REL8)
+				disp = (int8_t)p[off + insn.rel];
+			else
+				memcpy(&disp, p + off + insn.rel, 4);
+			target = pc + insn.len + disp;
+			if (target > ip && target < ip + need)
+				return -EOPNOTSUPP;
+			ret = x86_reloc_branch(&insn, target, to + n, out + n,
+					       size - n);
+			if (ret < 0)
+				return ret;
+			n += ret;
+		} else {
+			if (n + insn.len > size)
+				return -ENOSPC;
+			memcpy(out + n, p + off, insn.len);
+			if (insn.rip) {
+				memcpy(&disp, p + off + insn.rel, 4);
+				target = pc + insn.len + disp;
+				if (target >= ip && target < ip + need)
+					return -EOPNOTSUPP;
+				rel = (long)target - (long)(to + n + insn.len);
+				if (rel != (int32_t)rel)
+					return -ERANGE;
+				disp = rel;
+				memcpy(out + n + insn.rel, &disp, 4);
+			}
+			n += insn.len;
+		}
+
+		off += insn.len;
+		/* The bytes after it are never run */
+		if (insn.flags & X86_OP_END)
+			break;
+	}
+
+	/* jmp *lit(%rip) */
+	if (n + 6 > size)
+		return -ENOSPC;
+	rel = (long)lit - (long)(to + n + 6);
+	if (rel != (int32_t)rel)
+		return -ERANGE;
+	disp = rel;
+	out[n++] = 0xff;
+	out[n++] = 0x25;
+	memcpy(out + n, &disp, 4);
+	n += 4;
+
+	*used = off;
+	return n;
+}
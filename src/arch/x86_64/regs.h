@@ -17,3 +17,16 @@
 
 #define SYSCALL_RET(regs)	regs.rax
 #define SYSCALL_IP(regs)	regs.rip
+
+/* Stack walk, see task_check_stacks() */
+#define REGS_IP(regs)	regs.rip
+#define REGS_SP(regs)	regs.rsp
+#define REGS_FP(regs)	regs.rbp
+/* No link register, the return address is on stack */
+#define REGS_LR(regs)	0
+
+/* see SYSCALL_BATCH_STUB */
+#define SYSCALL_BATCH_REGS_PREPARE(regs, table, n) do {	\
+		regs.rbx = table;	\
+		regs.r12 = n;	\
+	} while (0)
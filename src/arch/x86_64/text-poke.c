@@ -0,0 +1,422 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+#include <patch/patch.h>
+
+#include <arch/x86_64/instruments.h>
+#include <arch/x86_64/ftrace.h>
+
+
+/**
+ * Modify live instructions of target without stopping the thread group, the
+ * same sequence as linux:text_poke_bp_batch():
+ *
+ *   1. write int3 on the first byte of every site, sync
+ *   2. write all but the first byte of every site, sync
+ *   3. write the first byte of every site, sync
+ *
+ * Every thread of target is PTRACE_SEIZEd but not interrupted, a thread hit
+ * the int3 of one site reports SIGTRAP to us, the kernel emulates the
+ * instruction the int3 replaced, we can't, thus the thread is rewound to the
+ * site and parked until step 3 is done, then it executes the new one. Other
+ * threads keep running all the time, only stop a moment when detached.
+ *
+ * The sync is MEMBARRIER_CMD_GLOBAL, it returns after every CPU has passed a
+ * grace period, the CPUs run target in userspace pass it through interrupt,
+ * and the return of interrupt is serializing, see SDM 8.1.3 cross modifying
+ * code.
+ */
+
+struct poke_thread {
+	pid_t tid;
+	/* Hit the int3 of one site, rewound, stopped until done */
+	bool parked;
+	bool exited;
+};
+
+struct poke_ctx {
+	struct task_struct *task;
+	const struct code_write *w;
+	unsigned int nr;
+
+	struct poke_thread *threads;
+	unsigned int nr_threads;
+	unsigned int max_threads;
+};
+
+static struct poke_thread *poke_find_thread(struct poke_ctx *ctx, pid_t tid)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr_threads; i++) {
+		if (ctx->threads[i].tid == tid)
+			return &ctx->threads[i];
+	}
+	return NULL;
+}
+
+static int poke_add_thread(struct poke_ctx *ctx, pid_t tid)
+{
+	struct poke_thread *threads;
+	unsigned int max;
+
+	if (ctx->nr_threads == ctx->max_threads) {
+		max = ctx->max_threads ? ctx->max_threads * 2 : 16;
+		threads = realloc(ctx->threads, sizeof(*threads) * max);
+		if (!threads)
+			return -ENOMEM;
+		ctx->threads = threads;
+		ctx->max_threads = max;
+	}
+
+	ctx->threads[ctx->nr_threads++] = (struct poke_thread) { .tid = tid };
+	return 0;
+}
+
+/**
+ * The clones of the seized threads are traced by PTRACE_O_TRACECLONE, but a
+ * thread created by an unseized one between two scan is not, rescan until no
+ * new thread found. Any untraced thread hit the int3 will be killed by the
+ * SIGTRAP, thus no thread should be missed.
+ */
+static int poke_seize_all(struct poke_ctx *ctx)
+{
+	char proc_task_dir[64];
+	struct dirent *ent;
+	int err = 0, nr_new;
+	pid_t tid;
+	DIR *dir;
+
+	snprintf(proc_task_dir, sizeof(proc_task_dir), "/proc/%d/task/",
+		 ctx->task->pid);
+
+	do {
+		dir = opendir(proc_task_dir);
+		if (!dir) {
+			ulp_error("Open %s failed, %m\n", proc_task_dir);
+			return -errno;
+		}
+
+		nr_new = 0;
+		while ((ent = readdir(dir)) != NULL) {
+			tid = atoi(ent->d_name);
+			if (tid <= 0 || poke_find_thread(ctx, tid))
+				continue;
+
+			if (ptrace(PTRACE_SEIZE, tid, NULL,
+				   (void *)PTRACE_O_TRACECLONE)) {
+				/* Thread exit already */
+				if (errno == ESRCH)
+					continue;
+				ulp_error("Seize thread %d failed. %m\n", tid);
+				err = -errno;
+				break;
+			}
+
+			err = poke_add_thread(ctx, tid);
+			if (err) {
+				ptrace(PTRACE_DETACH, tid, NULL, NULL);
+				break;
+			}
+			nr_new++;
+		}
+		closedir(dir);
+	} while (!err && nr_new);
+
+	ulp_debug("Seize %u threads of %d.\n", ctx->nr_threads,
+		  ctx->task->pid);
+	return err;
+}
+
+static bool poke_is_site(struct poke_ctx *ctx, unsigned long addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr; i++) {
+		if (ctx->w[i].addr == addr)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * If the SIGTRAP of thread is raised by the int3 of one site, rewind the
+ * thread to the site, and return true.
+ */
+static bool poke_rewind(struct poke_ctx *ctx, pid_t tid)
+{
+	struct user_regs_struct regs;
+
+	if (thread_getregs(tid, &regs))
+		return false;
+
+	if (!poke_is_site(ctx, regs.rip - INT3_INSN_SIZE))
+		return false;
+
+	regs.rip -= INT3_INSN_SIZE;
+	if (ptrace(PTRACE_SETREGS, tid, NULL, &regs)) {
+		ulp_error("Rewind thread %d failed, %m\n", tid);
+		return false;
+	}
+
+	ulp_debug("Thread %d hit %llx, parked.\n", tid, regs.rip);
+	return true;
+}
+
+/**
+ * Handle one stop of a running thread, resume it unless it hit the int3 of
+ * one site.
+ */
+static void poke_handle(struct poke_ctx *ctx, unsigned int i, int status)
+{
+	unsigned long msg;
+	pid_t tid = ctx->threads[i].tid;
+	int sig;
+
+	if (WIFEXITED(status) || WIFSIGNALED(status)) {
+		ctx->threads[i].exited = true;
+		return;
+	}
+
+	sig = WSTOPSIG(status);
+
+	switch (status >> 16) {
+	case PTRACE_EVENT_CLONE:
+		/* The new thread is traced already, it starts with a stop */
+		if (!ptrace(PTRACE_GETEVENTMSG, tid, NULL, &msg) &&
+		    !poke_find_thread(ctx, msg) && poke_add_thread(ctx, msg))
+			ulp_error("No memory for thread %lu.\n", msg);
+		sig = 0;
+		break;
+	case PTRACE_EVENT_STOP:
+		/* Group stop, keep it stopped and wait for SIGCONT */
+		if (sig != SIGTRAP) {
+			ptrace(PTRACE_LISTEN, tid, NULL, NULL);
+			return;
+		}
+		sig = 0;
+		break;
+	case 0:
+		if (sig == SIGTRAP && poke_rewind(ctx, tid)) {
+			ctx->threads[i].parked = true;
+			return;
+		}
+		break;
+	default:
+		sig = 0;
+		break;
+	}
+
+	ptrace(PTRACE_CONT, tid, NULL, (void *)(uintptr_t)sig);
+}
+
+static void poke_poll(struct poke_ctx *ctx)
+{
+	struct poke_thread *t;
+	unsigned int i;
+	int status;
+
+	/* The new threads are appended, handle them in this round too */
+	for (i = 0; i < ctx->nr_threads; i++) {
+		t = &ctx->threads[i];
+		while (!t->exited && !t->parked &&
+		       waitpid(t->tid, &status, WNOHANG | __WALL) > 0) {
+			poke_handle(ctx, i, status);
+			t = &ctx->threads[i];
+		}
+	}
+}
+
+static void poke_sync(struct poke_ctx *ctx)
+{
+	static bool warned = false;
+
+	poke_poll(ctx);
+
+	if (syscall(__NR_membarrier, MEMBARRIER_CMD_GLOBAL, 0) < 0) {
+		if (!warned)
+			ulp_warning("membarrier global failed, %m\n");
+		warned = true;
+		usleep(1000);
+	}
+
+	poke_poll(ctx);
+}
+
+/**
+ * Resume the parked threads and detach all threads, the running ones are
+ * interrupted one by one, each stops only for the detaching.
+ */
+static void poke_release(struct poke_ctx *ctx)
+{
+	struct poke_thread *t;
+	unsigned int i;
+	int status = 0, sig = 0;
+
+	for (i = 0; i < ctx->nr_threads; i++) {
+		t = &ctx->threads[i];
+		if (t->exited)
+			continue;
+
+		if (!t->parked)
+			ptrace(PTRACE_INTERRUPT, t->tid, NULL, NULL);
+
+		while (!t->parked) {
+			if (waitpid(t->tid, &status, __WALL) < 0 ||
+			    WIFEXITED(status) || WIFSIGNALED(status)) {
+				t->exited = true;
+				break;
+			}
+
+			sig = WSTOPSIG(status);
+
+			/* Interrupt stop or group stop */
+			if (status >> 16 == PTRACE_EVENT_STOP)
+				break;
+
+			if (status >> 16) {
+				poke_handle(ctx, i, status);
+				t = &ctx->threads[i];
+				continue;
+			}
+
+			/* Signal delivery stop, deliver it when detach */
+			if (sig != SIGTRAP || !poke_rewind(ctx, t->tid))
+				break;
+			t->parked = true;
+		}
+
+		if (t->exited)
+			continue;
+
+		if (t->parked || status >> 16 == PTRACE_EVENT_STOP)
+			sig = 0;
+
+		if (ptrace(PTRACE_DETACH, t->tid, NULL, (void *)(uintptr_t)sig))
+			ulp_warning("Detach thread %d failed, %m\n", t->tid);
+	}
+
+	free(ctx->threads);
+}
+
+static int poke_write(struct poke_ctx *ctx, unsigned int i, size_t off,
+		      const void *buf, size_t len)
+{
+	unsigned long addr = ctx->w[i].addr + off;
+
+	if (!len)
+		return 0;
+
+	if (memcpy_to_task(ctx->task, addr, (void *)buf, len) != len) {
+		ulp_error("Poke %lx of %d failed.\n", addr, ctx->task->pid);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/**
+ * Restore all sites through the int3 too, any site may be in any step.
+ */
+static void poke_rollback(struct poke_ctx *ctx)
+{
+	static const uint8_t int3 = INST_INT3;
+	const struct code_write *w = ctx->w;
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr; i++)
+		poke_write(ctx, i, 0, &int3, INT3_INSN_SIZE);
+	poke_sync(ctx);
+
+	for (i = 0; i < ctx->nr; i++)
+		poke_write(ctx, i, INT3_INSN_SIZE,
+			   (const uint8_t *)w[i].old + INT3_INSN_SIZE,
+			   w[i].len - INT3_INSN_SIZE);
+	poke_sync(ctx);
+
+	for (i = 0; i < ctx->nr; i++)
+		poke_write(ctx, i, 0, w[i].old, INT3_INSN_SIZE);
+	poke_sync(ctx);
+}
+
+/**
+ * Replace @nr instructions, each one of @w is at most POKE_MAX_OPCODE_SIZE
+ * bytes, and its current bytes must be @w.old. All or nothing, the sites
+ * are restored if failed.
+ */
+int text_poke_bp_batch(struct task_struct *task, const struct code_write *w,
+		       unsigned int nr)
+{
+	static const uint8_t int3 = INST_INT3;
+	struct poke_ctx ctx = {
+		.task = task,
+		.w = w,
+		.nr = nr,
+	};
+	uint8_t buf[POKE_MAX_OPCODE_SIZE];
+	unsigned int i;
+	int err;
+
+	if (!nr)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!w[i].len || w[i].len > POKE_MAX_OPCODE_SIZE)
+			return -EINVAL;
+		if (memcpy_from_task(task, buf, w[i].addr, w[i].len) !=
+		    w[i].len)
+			return -EFAULT;
+		if (memcmp(buf, w[i].old, w[i].len)) {
+			ulp_error("%lx of %d is modified by others.\n",
+				  w[i].addr, task->pid);
+			return -EBUSY;
+		}
+	}
+
+	err = poke_seize_all(&ctx);
+	if (err)
+		goto release;
+
+	for (i = 0; !err && i < nr; i++)
+		err = poke_write(&ctx, i, 0, &int3, INT3_INSN_SIZE);
+	if (err)
+		goto rollback;
+	poke_sync(&ctx);
+
+	for (i = 0; !err && i < nr; i++)
+		err = poke_write(&ctx, i, INT3_INSN_SIZE,
+				 (const uint8_t *)w[i].new + INT3_INSN_SIZE,
+				 w[i].len - INT3_INSN_SIZE);
+	if (err)
+		goto rollback;
+	poke_sync(&ctx);
+
+	for (i = 0; !err && i < nr; i++)
+		err = poke_write(&ctx, i, 0, w[i].new, INT3_INSN_SIZE);
+	if (err)
+		goto rollback;
+	poke_sync(&ctx);
+
+	goto release;
+
+rollback:
+	ulp_error("Poke %u sites of %d failed, rollback.\n", nr, task->pid);
+	poke_rollback(&ctx);
+release:
+	poke_release(&ctx);
+	return err;
+}
@@ -9,12 +9,16 @@
 
 static int log_level = LOG_ERR;
 static bool force = false;
+static bool log_async = false;
 
 enum {
 	ARG_LOG_LEVEL = 139,
 	ARG_LOG_DEBUG,
 	ARG_LOG_ERR,
 	ARG_LOG_INFO,
+	ARG_LOG_ASYNC,
+	ARG_SEIZE,
+	ARG_MEM_STATS,
 	ARG_COMMON_MAX,
 };
 
@@ -30,6 +34,8 @@ static void print_usage_common(const char *progname)
 	"                      or %s\n"
 	"  --log-debug         set log level to DEBUG(%d)\n"
 	"  --log-error         set log level to ERR(%d)\n"
+	"  --log-async         write logs in a background thread, the logs may\n"
+	"                      interleave with other output.\n"
 	"\n",
 	get_log_level(),
 	LOG_EMERG, LOG_ALERT, LOG_CRIT, LOG_ERR, LOG_WARNING, LOG_NOTICE, LOG_INFO,
@@ -42,8 +48,12 @@ static void print_usage_common(const char *progname)
 	"  -h, --help          display this help and exit\n"
 	"  -V, --version       output version information and exit\n"
 	"  -F, --force         force, such as overwirte exist file\n"
+	"  --seize             attach target with PTRACE_SEIZE and PTRACE_INTERRUPT\n"
+	"                      instead of PTRACE_ATTACH, no SIGSTOP is sent.\n"
 	"  --info              Print detailed information about features \n"
 	"                      supported by the kernel and the ulpatch build.\n"
+	"  --mem-stats         print the live bytes, peak bytes and objects of\n"
+	"                      the local memory of each subsystem at exit.\n"
 	"\n");
 	printf(" %s %s\n", progname, ulpatch_version());
 }
@@ -55,10 +65,13 @@ static void print_usage_common(const char *progname)
 	{ "lv",             required_argument, 0, ARG_LOG_LEVEL },	\
 	{ "log-debug",      no_argument,       0, ARG_LOG_DEBUG },	\
 	{ "log-error",      no_argument,       0, ARG_LOG_ERR },	\
+	{ "log-async",      no_argument,       0, ARG_LOG_ASYNC },	\
 	{ "dry-run",        no_argument,       0, 'u' },	\
 	{ "verbose",        no_argument,       0, 'v' },	\
 	{ "info",           no_argument,       0, ARG_LOG_INFO },	\
-	{ "force",          no_argument,       0, 'F' },
+	{ "force",          no_argument,       0, 'F' },	\
+	{ "seize",          no_argument,       0, ARG_SEIZE },	\
+	{ "mem-stats",      no_argument,       0, ARG_MEM_STATS },
 #define COMMON_GETOPT_OPTSTRING "uVv::hF"
 
 #define COMMON_GETOPT_CASES(progname, usage, argv)	\
@@ -87,12 +100,21 @@ static void print_usage_common(const char *progname)
 	case ARG_LOG_ERR:	\
 		log_level = LOG_ERR;	\
 		break;	\
+	case ARG_LOG_ASYNC:	\
+		log_async = true;	\
+		break;	\
 	case ARG_LOG_INFO:	\
 		ulpatch_info(progname);	\
 		cmd_exit_success();	\
 	case 'F':	\
 		force = true;	\
 		break;	\
+	case ARG_SEIZE:	\
+		set_task_attach_mode(TASK_ATTACH_SEIZE);	\
+		break;	\
+	case ARG_MEM_STATS:	\
+		ulp_mem_stats_enable(true);	\
+		break;	\
 	case '?':	\
 		fprintf(stderr, "ERROR: Unknown option or %s missing argument.\n", argv[optind - 1]);	\
 		cmd_exit(1);
@@ -104,8 +126,12 @@ static void print_usage_common(const char *progname)
 static void args_common_reset(void)
 {
 	reset_verbose();
+	disable_dry_run();
 	log_level = LOG_ERR;
 	force = false;
+	log_async = false;
+	set_task_attach_mode(TASK_ATTACH_PTRACE);
+	ulp_mem_stats_enable(false);
 }
 
 /**
@@ -129,6 +155,24 @@ static void reset_getopt(void)
 		reset_getopt();	\
 	} while (0)
 
+/**
+ * The commands exit by exit(3) in many places, print the --mem-stats by
+ * atexit(3). In ulpatchd(8), it's printed after each request instead, see
+ * run_request().
+ */
+#if defined(ULP_CMD_MAIN)
+static void print_mem_stats_atexit(void)
+{
+	print_ulp_mem_stats(stderr);
+}
+# define COMMON_MEM_STATS_ATEXIT() do {	\
+		if (ulp_mem_stats_enabled())	\
+			atexit(print_mem_stats_atexit);	\
+	} while (0)
+#else
+# define COMMON_MEM_STATS_ATEXIT() do { } while (0)
+#endif
+
 /**
  * This needs to be executed after calling getopt() to parse the parameters,
  * because the following configuration parameters are set during getopt(),
@@ -136,5 +180,10 @@ static void reset_getopt(void)
  */
 #define COMMON_IN_MAIN_AFTER_PARSE_ARGS() do {	\
 		set_log_level(log_level);	\
+		if (log_async)	\
+			ulp_log_async_start();	\
+		else	\
+			ulp_log_async_stop();	\
+		COMMON_MEM_STATS_ATEXIT();	\
 	} while (0)
 
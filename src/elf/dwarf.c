@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/dl.h>
+#include <elf/elf-api.h>
+
+
+/**
+ * The types of DWARF .debug_info, read by libdw of elfutils, which is
+ * loaded by dlopen(3) on the first open, like libzstd, the tools never
+ * decode don't need it. Only the few functions and the ABI stable structs
+ * of libdw.h are declared here, libdw development package is not needed to
+ * build.
+ */
+typedef struct Dwarf Dwarf;
+typedef uint64_t Dwarf_Off;
+typedef uint64_t Dwarf_Word;
+typedef int64_t Dwarf_Sword;
+
+typedef struct {
+	void *addr;
+	void *cu;
+	void *abbrev;
+	long int padding__;
+} Dwarf_Die;
+
+typedef struct {
+	unsigned int code;
+	unsigned int form;
+	unsigned char *valp;
+	void *cu;
+} Dwarf_Attribute;
+
+#define DWARF_C_READ			0
+
+/* See dwarf.h */
+#define DW_TAG_array_type		0x01
+#define DW_TAG_class_type		0x02
+#define DW_TAG_enumeration_type		0x04
+#define DW_TAG_member			0x0d
+#define DW_TAG_pointer_type		0x0f
+#define DW_TAG_reference_type		0x10
+#define DW_TAG_structure_type		0x13
+#define DW_TAG_subroutine_type		0x15
+#define DW_TAG_typedef			0x16
+#define DW_TAG_union_type		0x17
+#define DW_TAG_subrange_type		0x21
+#define DW_TAG_base_type		0x24
+#define DW_TAG_const_type		0x26
+#define DW_TAG_enumerator		0x28
+#define DW_TAG_volatile_type		0x35
+#define DW_TAG_restrict_type		0x37
+#define DW_TAG_atomic_type		0x47
+
+#define DW_AT_const_value		0x1c
+#define DW_AT_upper_bound		0x2f
+#define DW_AT_count			0x37
+#define DW_AT_data_member_location	0x38
+#define DW_AT_declaration		0x3c
+#define DW_AT_encoding			0x3e
+#define DW_AT_type			0x49
+#define DW_AT_data_bit_offset		0x6b
+
+#define DW_ATE_boolean			0x02
+#define DW_ATE_float			0x04
+#define DW_ATE_signed			0x05
+#define DW_ATE_signed_char		0x06
+#define DW_ATE_unsigned			0x07
+#define DW_ATE_unsigned_char		0x08
+
+static struct {
+	Dwarf *(*dwarf_begin)(int fd, int cmd);
+	int (*dwarf_end)(Dwarf *dwarf);
+	int (*dwarf_nextcu)(Dwarf *dwarf, Dwarf_Off off, Dwarf_Off *next_off,
+			    size_t *header_size, Dwarf_Off *abbrev_off,
+			    uint8_t *address_size, uint8_t *offset_size);
+	Dwarf_Die *(*dwarf_offdie)(Dwarf *dwarf, Dwarf_Off off,
+				   Dwarf_Die *result);
+	Dwarf_Off (*dwarf_dieoffset)(Dwarf_Die *die);
+	int (*dwarf_child)(Dwarf_Die *die, Dwarf_Die *result);
+	int (*dwarf_siblingof)(Dwarf_Die *die, Dwarf_Die *result);
+	int (*dwarf_tag)(Dwarf_Die *die);
+	const char *(*dwarf_diename)(Dwarf_Die *die);
+	int (*dwarf_hasattr)(Dwarf_Die *die, unsigned int name);
+	Dwarf_Attribute *(*dwarf_attr_integrate)(Dwarf_Die *die,
+						 unsigned int name,
+						 Dwarf_Attribute *result);
+	Dwarf_Die *(*dwarf_formref_die)(Dwarf_Attribute *attr,
+					Dwarf_Die *result);
+	int (*dwarf_formudata)(Dwarf_Attribute *attr, Dwarf_Word *val);
+	int (*dwarf_formsdata)(Dwarf_Attribute *attr, Dwarf_Sword *val);
+	int (*dwarf_aggregate_size)(Dwarf_Die *die, Dwarf_Word *size);
+	int (*dwarf_bytesize)(Dwarf_Die *die);
+	int (*dwarf_bitsize)(Dwarf_Die *die);
+	int (*dwarf_bitoffset)(Dwarf_Die *die);
+} libdw;
+
+static const struct ulp_dl_sym libdw_syms[] = {
+	ULP_DL_SYM(dwarf_begin, libdw.dwarf_begin),
+	ULP_DL_SYM(dwarf_end, libdw.dwarf_end),
+	ULP_DL_SYM(dwarf_nextcu, libdw.dwarf_nextcu),
+	ULP_DL_SYM(dwarf_offdie, libdw.dwarf_offdie),
+	ULP_DL_SYM(dwarf_dieoffset, libdw.dwarf_dieoffset),
+	ULP_DL_SYM(dwarf_child, libdw.dwarf_child),
+	ULP_DL_SYM(dwarf_siblingof, libdw.dwarf_siblingof),
+	ULP_DL_SYM(dwarf_tag, libdw.dwarf_tag),
+	ULP_DL_SYM(dwarf_diename, libdw.dwarf_diename),
+	ULP_DL_SYM(dwarf_hasattr, libdw.dwarf_hasattr),
+	ULP_DL_SYM(dwarf_attr_integrate, libdw.dwarf_attr_integrate),
+	ULP_DL_SYM(dwarf_formref_die, libdw.dwarf_formref_die),
+	ULP_DL_SYM(dwarf_formudata, libdw.dwarf_formudata),
+	ULP_DL_SYM(dwarf_formsdata, libdw.dwarf_formsdata),
+	ULP_DL_SYM(dwarf_aggregate_size, libdw.dwarf_aggregate_size),
+	ULP_DL_SYM(dwarf_bytesize, libdw.dwarf_bytesize),
+	ULP_DL_SYM(dwarf_bitsize, libdw.dwarf_bitsize),
+	ULP_DL_SYM(dwarf_bitoffset, libdw.dwarf_bitoffset),
+};
+
+static struct ulp_dl libdw_dl = {
+	.soname = "libdw.so.1",
+	.name = "libdw.so",
+	.syms = libdw_syms,
+	.nr_syms = ARRAY_SIZE(libdw_syms),
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+struct ulp_dwarf {
+	int fd;
+	Dwarf *dwarf;
+};
+
+/**
+ * Open the DWARF of ELF @path, which is the ELF itself if not stripped, or
+ * the separate debug file, see bfd_elf_debuginfo_path(). Return NULL and
+ * set errno if no libdw or no DWARF.
+ */
+struct ulp_dwarf *ulp_dwarf_open(const char *path)
+{
+	struct ulp_dwarf *dw;
+	int err;
+
+	err = ulp_dl_load(&libdw_dl);
+	if (err) {
+		errno = -err;
+		return NULL;
+	}
+
+	dw = malloc(sizeof(*dw));
+	if (!dw)
+		return NULL;
+
+	dw->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (dw->fd < 0) {
+		err = errno;
+		goto free;
+	}
+
+	dw->dwarf = libdw.dwarf_begin(dw->fd, DWARF_C_READ);
+	if (!dw->dwarf) {
+		ulp_debug("No DWARF in %s\n", path);
+		err = ENOENT;
+		close(dw->fd);
+		goto free;
+	}
+	return dw;
+
+free:
+	free(dw);
+	errno = err;
+	return NULL;
+}
+
+void ulp_dwarf_close(struct ulp_dwarf *dw)
+{
+	if (!dw)
+		return;
+	libdw.dwarf_end(dw->dwarf);
+	close(dw->fd);
+	free(dw);
+}
+
+static bool die_of(struct ulp_dwarf *dw, uint64_t off, Dwarf_Die *die)
+{
+	return off && libdw.dwarf_offdie(dw->dwarf, off, die);
+}
+
+/* Offset of DIE of DW_AT_type of @die, 0 if void */
+static uint64_t die_type(Dwarf_Die *die)
+{
+	Dwarf_Attribute attr;
+	Dwarf_Die type;
+
+	if (!libdw.dwarf_attr_integrate(die, DW_AT_type, &attr) ||
+	    !libdw.dwarf_formref_die(&attr, &type))
+		return 0;
+	return libdw.dwarf_dieoffset(&type);
+}
+
+static bool die_udata(Dwarf_Die *die, unsigned int name, uint64_t *val)
+{
+	Dwarf_Attribute attr;
+	Dwarf_Word w;
+
+	if (!libdw.dwarf_attr_integrate(die, name, &attr) ||
+	    libdw.dwarf_formudata(&attr, &w))
+		return false;
+	*val = w;
+	return true;
+}
+
+static bool tag_matches(int tag, const char *kind)
+{
+	switch (tag) {
+	case DW_TAG_structure_type:
+	case DW_TAG_class_type:
+		return !kind || !strcmp(kind, "struct");
+	case DW_TAG_union_type:
+		return !kind || !strcmp(kind, "union");
+	case DW_TAG_enumeration_type:
+		return !kind || !strcmp(kind, "enum");
+	case DW_TAG_typedef:
+	case DW_TAG_base_type:
+		return !kind;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Find the type of @name in the top level DIEs of all compile units, the
+ * name could be prefixed by 'struct ', 'union ' or 'enum ', otherwise the
+ * typedef or base type of this name matches too. The declarations are
+ * skipped.
+ */
+int ulp_dwarf_find_type(struct ulp_dwarf *dw, const char *name, uint64_t *off)
+{
+	Dwarf_Off cu = 0, next;
+	const char *kind = NULL, *sp, *n;
+	char kbuf[8];
+	size_t hsize;
+	Dwarf_Die cudie, die;
+
+	sp = strchr(name, ' ');
+	if (sp && sp - name < sizeof(kbuf)) {
+		memcpy(kbuf, name, sp - name);
+		kbuf[sp - name] = '\0';
+		if (!strcmp(kbuf, "struct") || !strcmp(kbuf, "union") ||
+		    !strcmp(kbuf, "enum")) {
+			kind = kbuf;
+			name = sp + 1;
+		}
+	}
+
+	while (!libdw.dwarf_nextcu(dw->dwarf, cu, &next, &hsize, NULL, NULL,
+				   NULL)) {
+		if (!libdw.dwarf_offdie(dw->dwarf, cu + hsize, &cudie) ||
+		    libdw.dwarf_child(&cudie, &die)) {
+			cu = next;
+			continue;
+		}
+		do {
+			if (!tag_matches(libdw.dwarf_tag(&die), kind))
+				continue;
+			n = libdw.dwarf_diename(&die);
+			if (!n || strcmp(n, name) ||
+			    libdw.dwarf_hasattr(&die, DW_AT_declaration))
+				continue;
+			*off = libdw.dwarf_dieoffset(&die);
+			return 0;
+		} while (!libdw.dwarf_siblingof(&die, &die));
+		cu = next;
+	}
+	return -ENOENT;
+}
+
+static enum ulp_dwarf_enc base_encoding(Dwarf_Die *die)
+{
+	uint64_t enc = 0;
+
+	die_udata(die, DW_AT_encoding, &enc);
+	switch (enc) {
+	case DW_ATE_boolean:
+		return ULP_DWARF_ENC_BOOL;
+	case DW_ATE_float:
+		return ULP_DWARF_ENC_FLOAT;
+	case DW_ATE_signed:
+		return ULP_DWARF_ENC_SIGNED;
+	case DW_ATE_signed_char:
+	case DW_ATE_unsigned_char:
+		return ULP_DWARF_ENC_CHAR;
+	case DW_ATE_unsigned:
+	default:
+		return ULP_DWARF_ENC_UNSIGNED;
+	}
+}
+
+/* Number of elements of all dimensions, 0 if unknown, the flexible one */
+static uint64_t array_elems(Dwarf_Die *die)
+{
+	uint64_t nr = 1, n;
+	Dwarf_Die sub;
+
+	if (libdw.dwarf_child(die, &sub))
+		return 0;
+	do {
+		if (libdw.dwarf_tag(&sub) != DW_TAG_subrange_type)
+			continue;
+		if (die_udata(&sub, DW_AT_count, &n))
+			nr *= n;
+		else if (die_udata(&sub, DW_AT_upper_bound, &n))
+			nr *= n + 1;
+		else
+			return 0;
+	} while (!libdw.dwarf_siblingof(&sub, &sub));
+	return nr;
+}
+
+int ulp_dwarf_get_type(struct ulp_dwarf *dw, uint64_t off,
+		       struct ulp_dwarf_type *t)
+{
+	Dwarf_Die die;
+	Dwarf_Word size;
+
+	memset(t, 0, sizeof(*t));
+	if (!die_of(dw, off, &die))
+		return -ENOENT;
+
+	t->off = off;
+	t->name = libdw.dwarf_diename(&die);
+	t->type = die_type(&die);
+	if (!libdw.dwarf_aggregate_size(&die, &size))
+		t->size = size;
+
+	switch (libdw.dwarf_tag(&die)) {
+	case DW_TAG_base_type:
+		t->kind = ULP_DWARF_BASE;
+		t->enc = base_encoding(&die);
+		break;
+	case DW_TAG_pointer_type:
+	case DW_TAG_reference_type:
+		t->kind = ULP_DWARF_POINTER;
+		t->size = t->size ?: sizeof(void *);
+		break;
+	case DW_TAG_structure_type:
+	case DW_TAG_class_type:
+		t->kind = ULP_DWARF_STRUCT;
+		break;
+	case DW_TAG_union_type:
+		t->kind = ULP_DWARF_UNION;
+		break;
+	case DW_TAG_enumeration_type:
+		t->kind = ULP_DWARF_ENUM;
+		break;
+	case DW_TAG_array_type:
+		t->kind = ULP_DWARF_ARRAY;
+		t->nr_elems = array_elems(&die);
+		break;
+	case DW_TAG_typedef:
+		t->kind = ULP_DWARF_TYPEDEF;
+		break;
+	case DW_TAG_const_type:
+	case DW_TAG_volatile_type:
+	case DW_TAG_restrict_type:
+	case DW_TAG_atomic_type:
+		t->kind = ULP_DWARF_QUAL;
+		break;
+	case DW_TAG_subroutine_type:
+		t->kind = ULP_DWARF_FUNC;
+		break;
+	default:
+		t->kind = ULP_DWARF_UNKNOWN;
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Call @cb for each member of struct or union @off in order, stop if @cb
+ * returns non-zero, and return it.
+ */
+int ulp_dwarf_for_each_member(struct ulp_dwarf *dw, uint64_t off,
+			      int (*cb)(const struct ulp_dwarf_member *m,
+					void *arg),
+			      void *arg)
+{
+	struct ulp_dwarf_member m;
+	uint64_t loc, bit;
+	Dwarf_Die die, child;
+	int n, size, ret;
+
+	if (!die_of(dw, off, &die))
+		return -ENOENT;
+	if (libdw.dwarf_child(&die, &child))
+		return 0;
+
+	do {
+		if (libdw.dwarf_tag(&child) != DW_TAG_member)
+			continue;
+
+		memset(&m, 0, sizeof(m));
+		m.name = libdw.dwarf_diename(&child);
+		m.type = die_type(&child);
+		/* Members of union have no location */
+		if (die_udata(&child, DW_AT_data_member_location, &loc))
+			m.offset = loc;
+
+		n = libdw.dwarf_bitsize(&child);
+		if (n > 0) {
+			m.bit_size = n;
+			/* DWARF 4, or DWARF 2 of big endian view */
+			if (die_udata(&child, DW_AT_data_bit_offset, &bit)) {
+				m.bit_offset = bit;
+			} else {
+				size = libdw.dwarf_bytesize(&child);
+				bit = libdw.dwarf_bitoffset(&child);
+				if (size > 0)
+					m.bit_offset = m.offset * 8 + size * 8 -
+						       bit - n;
+			}
+			m.offset = 0;
+		}
+
+		ret = cb(&m, arg);
+		if (ret)
+			return ret;
+	} while (!libdw.dwarf_siblingof(&child, &child));
+	return 0;
+}
+
+/* Name of enumerator @val of enum @off, NULL if not found */
+const char *ulp_dwarf_enum_name(struct ulp_dwarf *dw, uint64_t off,
+				int64_t val)
+{
+	Dwarf_Attribute attr;
+	Dwarf_Die die, child;
+	Dwarf_Sword sv;
+
+	if (!die_of(dw, off, &die) || libdw.dwarf_child(&die, &child))
+		return NULL;
+
+	do {
+		if (libdw.dwarf_tag(&child) != DW_TAG_enumerator ||
+		    !libdw.dwarf_attr_integrate(&child, DW_AT_const_value,
+						&attr))
+			continue;
+		if (!libdw.dwarf_formsdata(&attr, &sv) && sv == val)
+			return libdw.dwarf_diename(&child);
+	} while (!libdw.dwarf_siblingof(&child, &child));
+	return NULL;
+}
@@ -14,6 +14,25 @@
 #include <utils/compiler.h>
 #include <utils/rbtree.h>
 #include <utils/list.h>
+#include <utils/eytzinger.h>
+
+enum sym_type {
+	SYM_TYPE_MIN,
+	/**
+	 * This symbol is extern, check with is_extern_symbol(), of course it's
+	 * undef, but undef symbol maybe not extern, like @plt
+	 */
+	SYM_TYPE_EXTERN,
+	/**
+	 * If symbol is undef and not extern.
+	 */
+	SYM_TYPE_UNDEF,
+	/**
+	 * Defined symbol.
+	 */
+	SYM_TYPE_DEFINED,
+	SYM_TYPE_MAX,
+};
 
 struct elf_file {
 	int fd;
@@ -66,38 +85,40 @@ struct elf_file {
 	 * struct symbol.node
 	 */
 	struct rb_root symbols;
+	/**
+	 * Lookup index of symbols, the key is the interned name of each
+	 * enum sym_type, rebuilt on lookup after any symbol linked.
+	 */
+	struct eytz_index sym_index[SYM_TYPE_MAX];
+	bool sym_index_dirty;
 
 	/* has fentry, mcount(), etc. */
 	bool support_ftrace;
 	char *mcount_name;
 
-	/* List all elf files */
-	struct list_head node;
-};
-
-struct vm_area_struct;
-
-enum sym_type {
-	SYM_TYPE_MIN,
 	/**
-	 * This symbol is extern, check with is_extern_symbol(), of course it's
-	 * undef, but undef symbol maybe not extern, like @plt
+	 * Opened by elf_file_open_lazy(), sections are not decoded, symbols
+	 * are loaded on first lookup, see elf_file_load_syms().
 	 */
-	SYM_TYPE_EXTERN,
-	/**
-	 * If symbol is undef and not extern.
-	 */
-	SYM_TYPE_UNDEF,
+	bool lazy;
+	bool syms_loaded;
+
 	/**
-	 * Defined symbol.
+	 * Decoded SHT_RELA sections in section order, never on open, only
+	 * after handle_relocs_all().
 	 */
-	SYM_TYPE_DEFINED,
-	SYM_TYPE_MAX,
+	struct elf_rela_sec *relas;
+	int nr_relas;
+
+	/* List all elf files */
+	struct list_head node;
 };
 
+struct vm_area_struct;
+
 struct symbol {
-	/* strdup() */
-	char *name;
+	/* Interned, see str_intern() */
+	const char *name;
 	/**
 	 * Store GELF_ST_TYPE(sym->st_info), such as STT_OBJECT/STT_FUNC
 	 * for rbtree compare and search.
@@ -141,6 +162,7 @@ int elf_core_init(void);
 const char *libc_object(void);
 
 struct elf_file *elf_file_open(const char *filepath);
+struct elf_file *elf_file_open_lazy(const char *filepath);
 struct elf_file *elf_file_find(const char *filepath);
 int elf_file_close(const char *filepath);
 
@@ -156,7 +178,30 @@ const char *phdr_flags_str_unsafe(GElf_Phdr *pphdr);
 const char *phdr_type_str(GElf_Phdr *pphdr);
 
 /* ELF Sections api */
+
+/* Streaming iterator of sections, see elf_section_iter_init() */
+struct elf_section_iter {
+	struct elf_file *elf;
+	void *map;
+	size_t map_size;
+
+	/* Current section */
+	size_t idx;
+	GElf_Shdr *shdr;
+	const char *name;
+	/* Mapped by elf_section_iter_data() */
+	const void *data;
+	size_t data_len;
+};
+
+bool elf_section_is_debug(const char *name);
+int elf_section_iter_init(struct elf_section_iter *it, struct elf_file *elf);
+int elf_section_iter_next(struct elf_section_iter *it);
+const void *elf_section_iter_data(struct elf_section_iter *it);
+void elf_section_iter_fini(struct elf_section_iter *it);
+
 int handle_sections(struct elf_file *elf);
+int elf_file_load_syms(struct elf_file *elf);
 
 /* ELF Symbol api */
 const char *st_bind_string(const GElf_Sym *sym);
@@ -195,13 +240,43 @@ bool is_extern_symbol(const GElf_Sym *sym);
 bool is_ftrace_entry(char *func);
 
 /* ELF Note api */
-int handle_notes(struct elf_file *elf, GElf_Shdr *shdr, Elf_Scn *scn);
+int handle_notes(struct elf_file *elf, const void *notes, size_t size,
+		 size_t align);
 int print_elf_build_id(FILE *fp, uint8_t *build_id, size_t descsz);
 const char *elf_strbuildid(uint8_t *bid, size_t descsz, char *buf,
 			   size_t buf_len);
+int elf_notes_build_id(const void *notes, size_t size, size_t align,
+		       uint8_t *bid, size_t bid_size);
+int elf_read_build_id(const char *filepath, uint8_t *bid, size_t bid_size);
 
 /* ELF Rela api */
+
+/* One decoded relocation entry, see handle_relocs_all() */
+struct elf_rela {
+	GElf_Addr offset;
+	GElf_Xword type;
+	/* Value of the symbol, 0 if no symbol */
+	GElf_Addr value;
+	GElf_Sxword addend;
+	/* Name of the symbol or section, NULL if unknown, owned by ELF */
+	const char *name;
+};
+
+/* One SHT_RELA section of elf_file::relas */
+struct elf_rela_sec {
+	size_t index;
+	const char *name;
+	int nr;
+	struct elf_rela *entries;
+};
+
 int handle_relocs(struct elf_file *elf, GElf_Shdr *shdr, Elf_Scn *scn);
+/* At most worker threads of handle_relocs_all() */
+#define ELF_RELOCS_MAX_THREADS	16
+/* Decode in caller thread if less relocation entries than this */
+#define ELF_RELOCS_PARALLEL_MIN_ENTRIES	(16 * 1024)
+int handle_relocs_all(struct elf_file *elf);
+void elf_free_relocs(struct elf_file *elf);
 const char *r_x86_64_name(int r);
 const char *r_aarch64_name(int r);
 const char *rela_type_string(int r);
@@ -213,12 +288,55 @@ int auxv_type_info(GElf_Xword a_type, const char **name, const char **format);
 /* Swap 'objdump' command to C code. */
 struct bfd_elf_file;
 struct bfd_sym;
+struct bfd_demangled;
 
 struct bfd_elf_file* bfd_elf_open(const char *elf_file);
 int bfd_elf_file_refcount(struct bfd_elf_file *file);
 const char *bfd_elf_file_name(struct bfd_elf_file *file);
 int bfd_elf_close(struct bfd_elf_file *file);
 
+/* At most worker threads of bfd_elf_preload() */
+#define BFD_ELF_PRELOAD_MAX_THREADS	16
+int bfd_elf_preload(const char **names, int nr);
+void bfd_elf_sym_cache_enable(bool enable);
+void bfd_elf_debuginfo_enable(bool enable);
+int bfd_elf_debuginfo_path(struct bfd_elf_file *file, char *buf,
+			   size_t blen);
+
+/**
+ * Closed bfd_elf_files are cached in memory, bounded by the budget, see
+ * bfd_elf_cache_set_budget().
+ */
+struct bfd_elf_cache_stats {
+	size_t budget;
+	/* All opened files, referenced or not */
+	size_t bytes;
+	unsigned long nr_files;
+	/* Unreferenced files on LRU, could be evicted */
+	size_t unused_bytes;
+	unsigned long nr_unused;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+#define BFD_ELF_CACHE_DEFAULT_BUDGET	(256UL * 1024 * 1024)
+size_t bfd_elf_cache_set_budget(size_t bytes);
+void bfd_elf_cache_get_stats(struct bfd_elf_cache_stats *stats);
+
+bool bfd_elf_has_sym(struct bfd_elf_file *file, const char *name);
+struct bfd_sym *bfd_next_prefix_sym(struct bfd_elf_file *file,
+				    const char *prefix, struct bfd_sym *prev);
+
+const struct bfd_demangled *bfd_next_demangled(struct bfd_elf_file *file,
+					       const char *prefix,
+					       const struct bfd_demangled *prev);
+struct bfd_sym *bfd_find_demangled_sym(struct bfd_elf_file *file,
+				       const char *name);
+const char *bfd_demangled_name(const struct bfd_demangled *d);
+struct bfd_sym *bfd_demangled_sym(const struct bfd_demangled *d);
+
 unsigned long bfd_elf_plt_sym_addr(struct bfd_elf_file *file, const char *sym);
 struct bfd_sym *bfd_next_plt_sym(struct bfd_elf_file *file,
 				 struct bfd_sym *prev);
@@ -237,6 +355,73 @@ const char *bfd_strbid(const struct bfd_build_id *bid, char *buf, int blen);
 
 int bfd_elf_destroy(void);
 
+/**
+ * Types of DWARF, see src/elf/dwarf.c, a type is the offset of its DIE in
+ * .debug_info, the names point to the string section of the opened DWARF.
+ */
+struct ulp_dwarf;
+
+enum ulp_dwarf_kind {
+	ULP_DWARF_UNKNOWN,
+	ULP_DWARF_BASE,
+	ULP_DWARF_POINTER,
+	ULP_DWARF_STRUCT,
+	ULP_DWARF_UNION,
+	ULP_DWARF_ENUM,
+	ULP_DWARF_ARRAY,
+	ULP_DWARF_TYPEDEF,
+	/* const, volatile, restrict and _Atomic */
+	ULP_DWARF_QUAL,
+	/* Only pointed to */
+	ULP_DWARF_FUNC,
+};
+
+enum ulp_dwarf_enc {
+	ULP_DWARF_ENC_UNSIGNED,
+	ULP_DWARF_ENC_SIGNED,
+	ULP_DWARF_ENC_BOOL,
+	ULP_DWARF_ENC_CHAR,
+	ULP_DWARF_ENC_FLOAT,
+};
+
+struct ulp_dwarf_type {
+	uint64_t off;
+	enum ulp_dwarf_kind kind;
+	/* NULL if anonymous */
+	const char *name;
+	/* Bytes, 0 if unknown, such as void and the flexible array */
+	uint64_t size;
+	/* The type referred by pointer, array, typedef, qualifier and enum */
+	uint64_t type;
+	/* Elements of all dimensions of array */
+	uint64_t nr_elems;
+	enum ulp_dwarf_enc enc;
+};
+
+struct ulp_dwarf_member {
+	/* NULL if anonymous, such as the embedded union */
+	const char *name;
+	uint64_t type;
+	/* Bytes from start of struct, 0 for bit field */
+	uint64_t offset;
+	/* If bit field, bits and bit offset from start of struct */
+	unsigned int bit_size;
+	uint64_t bit_offset;
+};
+
+struct ulp_dwarf *ulp_dwarf_open(const char *path);
+void ulp_dwarf_close(struct ulp_dwarf *dw);
+int ulp_dwarf_find_type(struct ulp_dwarf *dw, const char *name,
+			uint64_t *off);
+int ulp_dwarf_get_type(struct ulp_dwarf *dw, uint64_t off,
+		       struct ulp_dwarf_type *t);
+int ulp_dwarf_for_each_member(struct ulp_dwarf *dw, uint64_t off,
+			      int (*cb)(const struct ulp_dwarf_member *m,
+					void *arg),
+			      void *arg);
+const char *ulp_dwarf_enum_name(struct ulp_dwarf *dw, uint64_t off,
+				int64_t val);
+
 /**
  * Store BFD function wrapper here
  */
@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #if defined(HAVE_ELFUTILS_DEVEL)
 #include <elfutils/elf-knowledge.h>
@@ -300,59 +302,147 @@ static void elf_object_note(struct elf_file *elf, uint32_t namesz,
 	}
 }
 
-int handle_notes(struct elf_file *elf, GElf_Shdr *shdr, Elf_Scn *scn)
+/**
+ * Handle the raw notes of SHT_NOTE section, @align is the sh_addralign, 4
+ * or 8, see elf_section_iter_data().
+ */
+int handle_notes(struct elf_file *elf, const void *notes, size_t size,
+		 size_t align)
 {
-	Elf_Data *data = elf_getdata(scn, NULL);
-
-	if (!data)
-		goto bad_note;
-
-	size_t offset  = 0;
-	GElf_Nhdr nhdr;
-	size_t name_offset;
-	size_t desc_offset;
-
-	while (offset < data->d_size &&
-		(offset = gelf_getnote(data, offset, &nhdr, &name_offset,
-				       &desc_offset)) > 0) {
-		const char *name = nhdr.n_namesz == 0 ? "" : data->d_buf + name_offset;
-		const char *desc = data->d_buf + desc_offset;
-
-		/**
-		 * GNU Build Attributes are weird, they store most of their data
-		 * into the owner name field.  Extract just the owner name
-		 * prefix here, then use the rest later as data.
-		 */
-		bool is_gnu_build_attr =
-			ulp_startswith(name, ELF_NOTE_GNU_BUILD_ATTRIBUTE_PREFIX);
-
-		/* if name has "GA" prefix */
-		const char *print_name = (is_gnu_build_attr
-			? ELF_NOTE_GNU_BUILD_ATTRIBUTE_PREFIX : name);
-
-		size_t __unused print_namesz = (is_gnu_build_attr
-			? strlen (print_name) : nhdr.n_namesz);
-
-		char __unused buf[100];
-		/* Filter out invalid entries.  */
-		if (memchr(name, '\0', nhdr.n_namesz) != NULL
-			/* XXX For now help broken Linux kernels.  */
-			|| 1) {
-			if (elf->ehdr->e_type == ET_CORE) {
-				/* TODO */
-			} else {
-				elf_object_note(elf, nhdr.n_namesz, name,
-						nhdr.n_type, nhdr.n_descsz,
-						desc);
-			}
+	const GElf_Nhdr *nhdr;
+	size_t off = 0, name_off, desc_off;
+
+	if (align != 8)
+		align = 4;
+
+	while (off + sizeof(GElf_Nhdr) <= size) {
+		nhdr = notes + off;
+		name_off = off + sizeof(GElf_Nhdr);
+		desc_off = name_off + ALIGN(nhdr->n_namesz, align);
+		off = desc_off + ALIGN(nhdr->n_descsz, align);
+
+		if (desc_off + nhdr->n_descsz > size)
+			goto bad_note;
+
+		const char *name = nhdr->n_namesz == 0 ? "" : notes + name_off;
+		const char *desc = notes + desc_off;
+
+		if (elf->ehdr->e_type == ET_CORE) {
+			/* TODO */
+		} else {
+			elf_object_note(elf, nhdr->n_namesz, name,
+					nhdr->n_type, nhdr->n_descsz, desc);
 		}
 	}
-	if (offset == data->d_size)
-		return 0;
+	return 0;
 
 bad_note:
-	ulp_error("cannot get content of note: %s",
-		data != NULL ? "garbage data" : elf_errmsg(-1));
+	ulp_error("cannot get content of note: garbage data\n");
 	return -ENODATA;
 }
 
+/**
+ * Find the GNU Build ID in the raw notes, like PT_NOTE segment.
+ *
+ * @align: the p_align of PT_NOTE, 4 or 8.
+ *
+ * Return the length of Build ID, -ENOENT if not found, -ENOSPC if @bid is
+ * too small.
+ */
+int elf_notes_build_id(const void *notes, size_t size, size_t align,
+		       uint8_t *bid, size_t bid_size)
+{
+	const GElf_Nhdr *nhdr;
+	size_t off = 0, name_off, desc_off;
+
+	if (align != 8)
+		align = 4;
+
+	while (off + sizeof(GElf_Nhdr) <= size) {
+		nhdr = notes + off;
+		name_off = off + sizeof(GElf_Nhdr);
+		desc_off = name_off + ALIGN(nhdr->n_namesz, align);
+		off = desc_off + ALIGN(nhdr->n_descsz, align);
+
+		if (desc_off + nhdr->n_descsz > size)
+			break;
+
+		if (nhdr->n_type != NT_GNU_BUILD_ID ||
+		    nhdr->n_namesz != sizeof(ELF_NOTE_GNU) ||
+		    memcmp(notes + name_off, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)))
+			continue;
+
+		if (nhdr->n_descsz > bid_size)
+			return -ENOSPC;
+		memcpy(bid, notes + desc_off, nhdr->n_descsz);
+		return nhdr->n_descsz;
+	}
+	return -ENOENT;
+}
+
+/* Too large PT_NOTE is not a Build ID note */
+#define ELF_NOTE_MAX_SIZE	(64 * 1024)
+
+/**
+ * Read the GNU Build ID of ELF file, only the ELF header, program headers
+ * and PT_NOTE segments are read, no libelf or BFD involved.
+ *
+ * Return the length of Build ID, negative errno if failed.
+ */
+int elf_read_build_id(const char *filepath, uint8_t *bid, size_t bid_size)
+{
+	GElf_Ehdr ehdr;
+	GElf_Phdr *phdrs = NULL;
+	void *notes = NULL;
+	int fd, i, ret = -ENOENT;
+	size_t phsz;
+
+	fd = open(filepath, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    !ehdr_ok(&ehdr) || ehdr.e_phentsize != sizeof(GElf_Phdr)) {
+		ret = -ENOEXEC;
+		goto close;
+	}
+
+	phsz = ehdr.e_phnum * sizeof(GElf_Phdr);
+	phdrs = malloc(phsz ?: 1);
+	if (!phdrs) {
+		ret = -ENOMEM;
+		goto close;
+	}
+	if (pread(fd, phdrs, phsz, ehdr.e_phoff) != phsz) {
+		ret = -EIO;
+		goto close;
+	}
+
+	for (i = 0; i < ehdr.e_phnum && ret < 0; i++) {
+		GElf_Phdr *phdr = &phdrs[i];
+
+		if (phdr->p_type != PT_NOTE || !phdr->p_filesz ||
+		    phdr->p_filesz > ELF_NOTE_MAX_SIZE)
+			continue;
+
+		notes = realloc(notes, phdr->p_filesz);
+		if (!notes) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (pread(fd, notes, phdr->p_filesz, phdr->p_offset) !=
+		    phdr->p_filesz)
+			continue;
+
+		ret = elf_notes_build_id(notes, phdr->p_filesz, phdr->p_align,
+					 bid, bid_size);
+		if (ret == -ENOSPC)
+			break;
+	}
+
+close:
+	free(notes);
+	free(phdrs);
+	close(fd);
+	return ret;
+}
@@ -13,6 +13,7 @@
 #include <elf/elf-api.h>
 #include <utils/log.h>
 #include <utils/list.h>
+#include <utils/memstat.h>
 #include <utils/compiler.h>
 
 /* Store all already opened ELF file handlers */
@@ -40,7 +41,15 @@ struct elf_file *elf_file_find(const char *filepath)
 	return NULL;
 }
 
-struct elf_file *elf_file_open(const char *filepath)
+/* The headers of elf_file, the symbols are ULP_MEM_ELF_SYM */
+static long elf_file_mem_bytes(const struct elf_file *elf)
+{
+	return sizeof(*elf) + sizeof(GElf_Ehdr) +
+		elf->phdrnum * sizeof(GElf_Phdr) +
+		elf->shdrnum * (sizeof(GElf_Shdr) + sizeof(char *));
+}
+
+static struct elf_file *__elf_file_open(const char *filepath, bool lazy)
 {
 	int i, fd;
 	size_t size;
@@ -78,10 +87,13 @@ struct elf_file *elf_file_open(const char *filepath)
 	elf->elf = __elf;
 	elf->rawfile = elf_rawfile(__elf, &elf->rawsize);
 	elf->size = size;
+	elf->lazy = lazy;
 	strncpy(elf->filepath, filepath, sizeof(elf->filepath) - 1);
 
 	/* Init symbols red black tree */
 	rb_init(&elf->symbols);
+	for (i = 0; i < SYM_TYPE_MAX; i++)
+		eytz_init(&elf->sym_index[i]);
 
 	/* ELF file header */
 
@@ -129,7 +141,13 @@ struct elf_file *elf_file_open(const char *filepath)
 			goto free_shdrs;
 		}
 
-		if ((shdr->sh_flags & SHF_COMPRESSED) != 0) {
+		/**
+		 * Nobody read the section data in lazy mode, and the DWARF
+		 * sections are never read, maybe GBs of debuginfo.
+		 */
+		if (!lazy && (shdr->sh_flags & SHF_COMPRESSED) != 0 &&
+		    !elf_section_is_debug(elf_strptr(__elf, elf->shdrstrndx,
+						     shdr->sh_name) ?: "")) {
 
 			if (elf_compress(scn, 0, 0) < 0)
 				ulp_warning("WARNING: %s [%zd]\n",
@@ -168,6 +186,7 @@ struct elf_file *elf_file_open(const char *filepath)
 	/* Save it to ELF list */
 	list_add(&elf->node, &elf_file_list);
 	elf_files_number++;
+	ulp_mem_account(ULP_MEM_ELF_FILE, elf_file_mem_bytes(elf), 1);
 
 	return elf;
 
@@ -189,9 +208,28 @@ error_open:
 	return NULL;
 }
 
+struct elf_file *elf_file_open(const char *filepath)
+{
+	return __elf_file_open(filepath, false);
+}
+
+/**
+ * Only the ELF header, program headers, section headers and Build ID are
+ * read, for whom only need a couple of sections, like build-id check. The
+ * symbols are loaded on first lookup.
+ *
+ * If the ELF was already opened, the opened one is returned, no matter in
+ * which mode.
+ */
+struct elf_file *elf_file_open_lazy(const char *filepath)
+{
+	return __elf_file_open(filepath, true);
+}
+
 int elf_file_close(const char *filepath)
 {
 	struct elf_file *elf = NULL, *tmp;
+	int i;
 
 	/* No elf loaded, return */
 	if (elf_files_number <= 0)
@@ -217,12 +255,17 @@ int elf_file_close(const char *filepath)
 	if (elf->support_ftrace)
 		free(elf->mcount_name);
 
+	elf_free_relocs(elf);
+
 	/* Destroy symbols rb tree */
 	rb_destroy(&elf->symbols, rb_free_symbol);
+	for (i = 0; i < SYM_TYPE_MAX; i++)
+		eytz_free(&elf->sym_index[i]);
 
 	close(elf->fd);
 	list_del(&elf->node);
 	elf_files_number--;
+	ulp_mem_account(ULP_MEM_ELF_FILE, -elf_file_mem_bytes(elf), -1);
 
 	elf_end(elf->elf);
 	free(elf);
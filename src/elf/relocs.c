@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -9,6 +10,7 @@
 #include <malloc.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <elf/elf-api.h>
 #include <utils/util.h>
@@ -253,52 +255,145 @@ static int handle_relocs_rel(struct elf_file *elf, GElf_Shdr *shdr,
 	return -1;
 }
 
-static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
-			      Elf_Scn *scn)
+/**
+ * One relocation section, all libelf lookups are done in
+ * rela_section_prepare() in caller thread, rela_section_decode() only reads
+ * the fetched Elf_Data and the cached section headers of struct elf_file,
+ * then the entries could be decoded in worker thread, see
+ * handle_relocs_all(). If @record, the entries are saved in @entries.
+ */
+struct rela_section {
+	struct elf_file *elf;
+	GElf_Shdr *shdr;
+	Elf_Scn *scn;
+
+	Elf_Data *data;
+	Elf_Data *symdata;
+	Elf_Data *xndxdata;
+	GElf_Shdr symshdr_mem;
+	GElf_Shdr *symshdr;
+	GElf_Shdr destshdr_mem;
+	GElf_Shdr *destshdr;
+	/* The string table of symbols */
+	Elf_Data *strdata;
+	size_t index;
+	const char *name;
+	const char *destname;
+	int nentries;
+
+	/* Result of rela_section_decode() */
+	int ret;
+	bool record;
+	struct elf_rela *entries;
+	int nr;
+};
+
+static int rela_section_prepare(struct rela_section *rs, struct elf_file *elf,
+				GElf_Shdr *shdr, Elf_Scn *scn)
 {
-	int i, cnt;
-	int __unused class = gelf_getclass(elf->elf);
 	size_t sh_entsize = gelf_fsize (elf->elf, ELF_T_RELA, 1, EV_CURRENT);
-	int nentries = shdr->sh_size / sh_entsize;
+
+	memset(rs, 0, sizeof(struct rela_section));
+
+	rs->elf = elf;
+	rs->shdr = shdr;
+	rs->scn = scn;
+	rs->nentries = shdr->sh_size / sh_entsize;
 
 	/* Get the data of the section.  */
-	Elf_Data *data = elf_getdata(scn, NULL);
-	if (data == NULL)
+	rs->data = elf_getdata(scn, NULL);
+	if (rs->data == NULL)
 		return -1;
 
 	/* Get the symbol table information.  */
 	Elf_Scn *symscn = elf_getscn (elf->elf, shdr->sh_link);
-	GElf_Shdr symshdr_mem;
-	GElf_Shdr *symshdr = gelf_getshdr (symscn, &symshdr_mem);
-	Elf_Data *symdata = elf_getdata (symscn, NULL);
+	rs->symshdr = gelf_getshdr (symscn, &rs->symshdr_mem);
+	rs->symdata = elf_getdata (symscn, NULL);
 
 	/* Get the section header of the section the relocations are for.  */
-	GElf_Shdr destshdr_mem;
-	GElf_Shdr *destshdr = gelf_getshdr (elf_getscn (elf->elf, shdr->sh_info),
-			&destshdr_mem);
+	rs->destshdr = gelf_getshdr (elf_getscn (elf->elf, shdr->sh_info),
+			&rs->destshdr_mem);
 
-	if (unlikely (symshdr == NULL || symdata == NULL || destshdr == NULL)) {
+	if (unlikely (rs->symshdr == NULL || rs->symdata == NULL ||
+		      rs->destshdr == NULL)) {
 		ulp_error("\nInvalid symbol table at offset %#0" PRIx64 "\n",
 			shdr->sh_offset);
 		return -1;
 	}
 
 	/* Search for the optional extended section index table.  */
-	Elf_Data *xndxdata = NULL;
 	int xndxscnidx = elf_scnshndx (scn);
 	if (unlikely (xndxscnidx > 0))
-		xndxdata = elf_getdata (elf_getscn (elf->elf, xndxscnidx), NULL);
+		rs->xndxdata = elf_getdata (elf_getscn (elf->elf, xndxscnidx), NULL);
+
+	/* elf_strptr() loads the string table lazily, never call it in worker */
+	rs->strdata = elf_getdata(elf_getscn(elf->elf, rs->symshdr->sh_link),
+				  NULL);
+
+	rs->index = elf_ndxscn(scn);
+	rs->name = rs->index < elf->shdrnum ? elf->shdrnames[rs->index] : "";
+	rs->destname = shdr->sh_info < elf->shdrnum ?
+			elf->shdrnames[shdr->sh_info] : "";
 
-	/* Get the section header string table index.  */
-	size_t __unused shstrndx = elf->shdrstrndx;
+	return 0;
+}
+
+static const char *rela_sym_name(struct rela_section *rs, GElf_Word st_name)
+{
+	Elf_Data *d = rs->strdata;
+
+	if (!d || !d->d_buf || st_name >= d->d_size)
+		return "";
+	return (const char *)d->d_buf + st_name;
+}
+
+static const char *rela_shdr_name(struct rela_section *rs, size_t ndx)
+{
+	if (ndx == 0 || ndx >= rs->elf->shdrnum)
+		return NULL;
+	return rs->elf->shdrnames[ndx];
+}
+
+static void rela_record(struct rela_section *rs, GElf_Rela *rel,
+			GElf_Sym *sym, const char *name)
+{
+	struct elf_rela *e;
+
+	if (!rs->entries)
+		return;
+
+	e = &rs->entries[rs->nr++];
+	e->offset = rel->r_offset;
+	e->type = GELF_R_TYPE(rel->r_info);
+	e->value = sym ? sym->st_value : 0;
+	e->addend = rel->r_addend;
+	e->name = name;
+}
+
+static int rela_section_decode(struct rela_section *rs)
+{
+	int i, cnt;
+	struct elf_file *elf = rs->elf;
+	GElf_Shdr *shdr = rs->shdr;
+	Elf_Data *data = rs->data;
+	Elf_Data *symdata = rs->symdata;
+	Elf_Data *xndxdata = rs->xndxdata;
+	int nentries = rs->nentries;
+	int __unused class = elf->ehdr->e_ident[EI_CLASS];
+
+	if (rs->record && nentries > 0) {
+		rs->entries = malloc(sizeof(struct elf_rela) * nentries);
+		if (!rs->entries)
+			return -ENOMEM;
+	}
 
 	if (shdr->sh_info != 0) {
 		// Relocation section [11] '.rela.plt' for section [24] '.got' at offset 0x2b38 contains 105 entries:
 		printf("Relocation section [%2zu] '%s' for section [%2u] '%s' at offset %#0" PRIx64 " contains %d entry:\n",
-			elf_ndxscn (scn),
-			elf_strptr (elf->elf, shstrndx, shdr->sh_name),
+			rs->index,
+			rs->name,
 			(unsigned int) shdr->sh_info,
-			elf_strptr (elf->elf, shstrndx, destshdr->sh_name),
+			rs->destname,
 			shdr->sh_offset,
 			nentries);
 	} else {
@@ -307,8 +402,8 @@ static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
 		 * name.  */
 		// Relocation section [10] '.rela.dyn' at offset 0x1728 contains 214 entries:
 		printf("Relocation section [%2u] '%s' at offset %#0" PRIx64 " contains %d entry:\n",
-			(unsigned int) elf_ndxscn (scn),
-			elf_strptr (elf->elf, shstrndx, shdr->sh_name),
+			(unsigned int) rs->index,
+			rs->name,
 			shdr->sh_offset,
 			nentries);
 	}
@@ -349,14 +444,16 @@ static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
 				}
 
 				if (is_statically_linked > 0 && shdr->sh_link == 0) {
+					rela_record(rs, rel, NULL, rs->destname);
 					printf("  %#0*" PRIx64 "  %-15s %*s  %#6" PRIx64 " %s\n",
 						class == ELFCLASS32 ? 10 : 18,
 						rel->r_offset,
 						rela_type_string(GELF_R_TYPE (rel->r_info)),
 						class == ELFCLASS32 ? 10 : 18, "",
 						rel->r_addend,
-						elf_strptr (elf->elf, shstrndx, destshdr->sh_name));
+						rs->destname);
 				} else {
+					rela_record(rs, rel, NULL, NULL);
 					printf("  %#0*" PRIx64 "  %-15s <%ld>\n",
 						class == ELFCLASS32 ? 10 : 18,
 						rel->r_offset,
@@ -366,6 +463,8 @@ static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
 
 			/* sym == NULL */
 			} else if (GELF_ST_TYPE (sym->st_info) != STT_SECTION) {
+				rela_record(rs, rel, sym,
+					    rela_sym_name(rs, sym->st_name));
 				printf("  %#0*" PRIx64 "  %-15s %#0*" PRIx64 "  %+6" PRId64 " %s\n",
 					class == ELFCLASS32 ? 10 : 18,
 					rel->r_offset,
@@ -373,20 +472,19 @@ static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
 					class == ELFCLASS32 ? 10 : 18,
 					sym->st_value,
 					rel->r_addend,
-					elf_strptr (elf->elf, symshdr->sh_link, sym->st_name));
+					rela_sym_name(rs, sym->st_name));
 
 			/* STT_SECTION */
 			} else {
 
 				/* This is a relocation against a STT_SECTION symbol.  */
-				GElf_Shdr secshdr_mem;
-				GElf_Shdr *secshdr;
-				secshdr = gelf_getshdr(elf_getscn(elf->elf,
+				const char *secname;
+				secname = rela_shdr_name(rs,
 							sym->st_shndx == SHN_XINDEX
-							? xndx : sym->st_shndx),
-							&secshdr_mem);
+							? xndx : sym->st_shndx);
+				rela_record(rs, rel, sym, secname);
 
-				if (unlikely (secshdr == NULL)) {
+				if (unlikely (secname == NULL)) {
 					printf("  %#0*" PRIx64 "  %-15s <%ld>\n",
 						class == ELFCLASS32 ? 10 : 18, rel->r_offset,
 						rela_type_string(GELF_R_TYPE (rel->r_info)),
@@ -400,7 +498,7 @@ static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
 						rela_type_string(GELF_R_TYPE (rel->r_info)),
 						class == ELFCLASS32 ? 10 : 18, sym->st_value,
 						rel->r_addend,
-						elf_strptr (elf->elf, shstrndx, secshdr->sh_name));
+						secname);
 				}
 			}
 		}
@@ -410,6 +508,16 @@ static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
 	return 0;
 }
 
+static int handle_relocs_rela(struct elf_file *elf, GElf_Shdr *shdr,
+			      Elf_Scn *scn)
+{
+	struct rela_section rs;
+
+	if (rela_section_prepare(&rs, elf, shdr, scn))
+		return -1;
+	return rela_section_decode(&rs);
+}
+
 int handle_relocs(struct elf_file *elf, GElf_Shdr *shdr, Elf_Scn *scn)
 {
 	if (shdr->sh_type == SHT_REL)
@@ -420,3 +528,139 @@ int handle_relocs(struct elf_file *elf, GElf_Shdr *shdr, Elf_Scn *scn)
 	return -EINVAL;
 }
 
+struct relocs_work {
+	struct rela_section *sections;
+	int nr;
+	/* next index of sections[] to decode */
+	int next;
+};
+
+static void *relocs_worker(void *arg)
+{
+	struct relocs_work *work = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED))
+		< work->nr)
+		work->sections[i].ret = rela_section_decode(&work->sections[i]);
+
+	return NULL;
+}
+
+static void relocs_parallel(struct relocs_work *work, int nr_entries)
+{
+	pthread_t threads[ELF_RELOCS_MAX_THREADS];
+	int i, nr_threads, nr_cpus;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = MIN(work->nr, MIN(MAX(nr_cpus, 1), ELF_RELOCS_MAX_THREADS));
+	/* Not worth to start threads for small object */
+	if (nr_entries < ELF_RELOCS_PARALLEL_MIN_ENTRIES)
+		nr_threads = 0;
+
+	for (i = 0; i < nr_threads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, relocs_worker, work))
+			break;
+	}
+	nr_threads = i;
+
+	/* Current thread is one of the workers */
+	relocs_worker(work);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+void elf_free_relocs(struct elf_file *elf)
+{
+	int i;
+
+	for (i = 0; i < elf->nr_relas; i++)
+		free(elf->relas[i].entries);
+	free(elf->relas);
+	elf->relas = NULL;
+	elf->nr_relas = 0;
+}
+
+/**
+ * Decode all relocation sections of ELF into elf_file::relas, the sections
+ * are independent, thus they are decoded concurrently, each worker records
+ * the entries of its section, then the sections are merged in section
+ * order, the first failed section's result is returned. It's never called
+ * by elf_file_open(), only by whom need the relocations.
+ *
+ * libelf is not thread safe, the section data and names are fetched in
+ * caller thread, workers only read them. The readelf-like output of decode
+ * is compiled out, see the printf() above, thus nothing is interleaved.
+ */
+int handle_relocs_all(struct elf_file *elf)
+{
+	struct relocs_work work = {};
+	struct rela_section *rs;
+	int i, ret = 0, nr_entries = 0;
+
+	elf_free_relocs(elf);
+
+	work.sections = calloc(elf->shdrnum, sizeof(struct rela_section));
+	if (!work.sections)
+		return -ENOMEM;
+
+	for (i = 0; i < elf->shdrnum; i++) {
+		GElf_Shdr *shdr = &elf->shdrs[i];
+		Elf_Scn *scn = elf_getscn(elf->elf, i);
+
+		rs = &work.sections[work.nr];
+
+		/* Such as .rela.debug_info, see elf_section_is_debug() */
+		if ((shdr->sh_type == SHT_REL || shdr->sh_type == SHT_RELA) &&
+		    shdr->sh_info && shdr->sh_info < elf->shdrnum &&
+		    elf_section_is_debug(elf->shdrnames[shdr->sh_info]))
+			continue;
+
+		if (shdr->sh_type == SHT_REL) {
+			if (!ret)
+				ret = handle_relocs_rel(elf, shdr, scn);
+			continue;
+		}
+		if (shdr->sh_type != SHT_RELA)
+			continue;
+
+		if (rela_section_prepare(rs, elf, shdr, scn)) {
+			if (!ret)
+				ret = -1;
+			continue;
+		}
+		rs->record = true;
+		nr_entries += rs->nentries;
+		work.nr++;
+	}
+
+	ulp_debug("%s: %d rela sections, %d entries\n", elf->filepath,
+		  work.nr, nr_entries);
+
+	relocs_parallel(&work, nr_entries);
+
+	elf->relas = calloc(work.nr ?: 1, sizeof(struct elf_rela_sec));
+	if (!elf->relas)
+		ret = -ENOMEM;
+
+	/* Merge in section order */
+	for (i = 0; i < work.nr; i++) {
+		rs = &work.sections[i];
+		if (!ret)
+			ret = rs->ret;
+		if (!elf->relas) {
+			free(rs->entries);
+			continue;
+		}
+		elf->relas[i].index = rs->index;
+		elf->relas[i].name = rs->name;
+		elf->relas[i].nr = rs->nr;
+		elf->relas[i].entries = rs->entries;
+	}
+	if (elf->relas)
+		elf->nr_relas = work.nr;
+
+	free(work.sections);
+	return ret;
+}
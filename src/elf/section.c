@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -16,20 +17,167 @@
 #include <utils/compiler.h>
 
 
-int handle_sections(struct elf_file *elf)
+/* DWARF sections, never read unless someone asks for them */
+bool elf_section_is_debug(const char *name)
+{
+	return ulp_startswith(name, ".debug_") ||
+		ulp_startswith(name, ".zdebug_");
+}
+
+/**
+ * Streaming iterator of the sections of @elf. The section headers and
+ * names are already read by libelf, the data of the section is only mapped
+ * if elf_section_iter_data() is called, from a private read-only mapping
+ * of the whole file with MADV_SEQUENTIAL, and the pages are dropped by
+ * MADV_DONTNEED when the iterator moves on, thus the RSS never grows with
+ * the size of file, such as GBs of debuginfo.
+ */
+int elf_section_iter_init(struct elf_section_iter *it, struct elf_file *elf)
+{
+	struct stat st;
+
+	memset(it, 0, sizeof(*it));
+	it->elf = elf;
+	it->idx = -1;
+
+	if (fstat(elf->fd, &st))
+		return -errno;
+
+	it->map_size = st.st_size;
+	it->map = mmap(NULL, it->map_size, PROT_READ, MAP_PRIVATE, elf->fd, 0);
+	if (it->map == MAP_FAILED) {
+		it->map = NULL;
+		return -errno;
+	}
+	madvise(it->map, it->map_size, MADV_SEQUENTIAL);
+	return 0;
+}
+
+/* Drop the pages of the data of current section */
+static void elf_section_iter_drop(struct elf_section_iter *it)
+{
+	unsigned long page = ulp_page_size();
+	unsigned long start, end;
+
+	if (!it->data_len)
+		return;
+
+	/* The partial pages may be shared with the neighbour sections */
+	start = ALIGN((unsigned long)it->data, page);
+	end = ALIGN_DOWN((unsigned long)it->data + it->data_len, page);
+	if (start < end)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+	it->data_len = 0;
+}
+
+/**
+ * Move to the next section, return 0 if there is, -ENOENT if no more
+ * section, the other negative errno if failed.
+ */
+int elf_section_iter_next(struct elf_section_iter *it)
+{
+	struct elf_file *elf = it->elf;
+
+	elf_section_iter_drop(it);
+
+	if (++it->idx >= elf->shdrnum)
+		return -ENOENT;
+
+	it->shdr = &elf->shdrs[it->idx];
+	it->name = elf_strptr(elf->elf, elf->shdrstrndx, it->shdr->sh_name);
+	if (!it->name) {
+		ulp_error("couldn't get section name: %s\n", elf_errmsg(-1));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/**
+ * Raw data of current section, in the file byte order, NULL if the section
+ * has no data in file or out of file. The compressed section is not
+ * uncompressed.
+ */
+const void *elf_section_iter_data(struct elf_section_iter *it)
+{
+	GElf_Shdr *shdr = it->shdr;
+
+	if (shdr->sh_type == SHT_NOBITS || !shdr->sh_size ||
+	    shdr->sh_offset > it->map_size ||
+	    shdr->sh_size > it->map_size - shdr->sh_offset)
+		return NULL;
+
+	it->data = it->map + shdr->sh_offset;
+	it->data_len = shdr->sh_size;
+	madvise((void *)ALIGN_DOWN((unsigned long)it->data, ulp_page_size()),
+		it->data_len, MADV_WILLNEED);
+	return it->data;
+}
+
+void elf_section_iter_fini(struct elf_section_iter *it)
 {
-	int i, ret = 0;
+	if (it->map)
+		munmap(it->map, it->map_size);
+	it->map = NULL;
+}
 
-	for (i = 0; i < elf->shdrnum; i++) {
-		GElf_Shdr *shdr = &elf->shdrs[i];
-		Elf_Scn *scn = elf_getscn(elf->elf, i);
+/* Find out the version and extended index sections of symbol table @scn */
+static void handle_symtab_aux_sections(struct elf_file *elf, Elf_Scn *scn)
+{
+	Elf_Scn *runscn = NULL;
 
-		elf->shdrnames[i] = elf_strptr(elf->elf, elf->shdrstrndx,
-						shdr->sh_name);
-		if (elf->shdrnames[i] == NULL) {
-			ulp_error("couldn't get section name: %s\n", elf_errmsg(-1));
-			return -ENOENT;
+	while ((runscn = elf_nextscn(elf->elf, runscn)) != NULL) {
+		GElf_Shdr runshdr_mem;
+		GElf_Shdr *runshdr = gelf_getshdr(runscn, &runshdr_mem);
+		if (!runshdr)
+			continue;
+
+		/* Handle section header by type */
+		switch (runshdr->sh_type) {
+		/* Bingo, found the version information. Now get the data. */
+		case SHT_GNU_versym:
+			if (runshdr->sh_link == elf_ndxscn(scn))
+				elf->versym_data = elf_getdata(runscn, NULL);
+			break;
+		/* This is the information about the needed versions. */
+		case SHT_GNU_verneed:
+			elf->verneed_data = elf_getdata(runscn, NULL);
+			elf->verneed_stridx = runshdr->sh_link;
+			break;
+		/* This is the information about the defined versions. */
+		case SHT_GNU_verdef:
+			elf->verdef_data = elf_getdata(runscn, NULL);
+			elf->verdef_stridx = runshdr->sh_link;
+			break;
+		/* Extended section index. */
+		case SHT_SYMTAB_SHNDX:
+			if (runshdr->sh_link == elf_ndxscn(scn))
+				elf->xndx_data = elf_getdata(runscn, NULL);
+			break;
 		}
+	}
+}
+
+/**
+ * If elf_file::lazy, only the section names, section indexes and the GNU
+ * Build ID note are handled, the data of sections are not decoded, and the
+ * symbols are loaded by elf_file_load_syms() on demand.
+ */
+int handle_sections(struct elf_file *elf)
+{
+	struct elf_section_iter it;
+	const void *notes;
+	int i, ret;
+
+	ret = elf_section_iter_init(&it, elf);
+	if (ret)
+		return ret;
+
+	while (!(ret = elf_section_iter_next(&it))) {
+		GElf_Shdr *shdr = it.shdr;
+		Elf_Scn *scn = elf_getscn(elf->elf, it.idx);
+
+		i = it.idx;
+		elf->shdrnames[i] = (char *)it.name;
 
 		/* Handle section header by type */
 		switch (shdr->sh_type) {
@@ -37,33 +185,46 @@ int handle_sections(struct elf_file *elf)
 			/* .plt */
 			if (strcmp(elf->shdrnames[i], ".plt") == 0) {
 				ulp_debug("%s PLT: %d\n", elf->filepath, i);
-				elf->plt_data = elf_getdata(scn, NULL);
+				if (!elf->lazy)
+					elf->plt_data = elf_getdata(scn, NULL);
 				elf->plt_shdr_idx = i;
 			/* .got */
 			} else if (strcmp(elf->shdrnames[i], ".got") == 0) {
 				ulp_debug("%s GOT: %d\n", elf->filepath, i);
-				elf->got_data = elf_getdata(scn, NULL);
+				if (!elf->lazy)
+					elf->got_data = elf_getdata(scn, NULL);
 				elf->got_shdr_idx = i;
 			}
 			break;
 		case SHT_SYMTAB:
-			elf->symtab_data = elf_getdata(scn, NULL);
+			if (!elf->lazy) {
+				elf->symtab_data = elf_getdata(scn, NULL);
+				handle_symtab_aux_sections(elf, scn);
+			}
 			elf->symtab_shdr_idx = i;
 			break;
 		/**
 		 * Symbols import from dynamic library.
 		 */
 		case SHT_DYNSYM:
-			elf->dynsym_data = elf_getdata(scn, NULL);
+			if (!elf->lazy) {
+				elf->dynsym_data = elf_getdata(scn, NULL);
+				handle_symtab_aux_sections(elf, scn);
+			}
 			elf->dynsym_shdr_idx = i;
 			break;
 		case SHT_NOTE:
-			handle_notes(elf, shdr, scn);
+			/* Build ID is always needed */
+			if (elf->lazy && elf->build_id)
+				break;
+			notes = elf_section_iter_data(&it);
+			if (notes)
+				handle_notes(elf, notes, shdr->sh_size,
+					     shdr->sh_addralign);
 			break;
+		/* Decoded on demand only, see handle_relocs_all() */
 		case SHT_REL:
 		case SHT_RELA:
-			handle_relocs(elf, shdr, scn);
-			break;
 		case SHT_GNU_ATTRIBUTES:
 		case SHT_GNU_LIBLIST:
 		/* readelf --section-groups */
@@ -71,41 +232,15 @@ int handle_sections(struct elf_file *elf)
 		default:
 			break;
 		}
-
-		/* Find out whether we have other sections we might need.  */
-		Elf_Scn *runscn = NULL;
-
-		while ((runscn = elf_nextscn(elf->elf, runscn)) != NULL) {
-			GElf_Shdr runshdr_mem;
-			GElf_Shdr *runshdr = gelf_getshdr(runscn, &runshdr_mem);
-			if (!runshdr)
-				continue;
-
-			/* Handle section header by type */
-			switch (runshdr->sh_type) {
-			/* Bingo, found the version information. Now get the data. */
-			case SHT_GNU_versym:
-				if (runshdr->sh_link == elf_ndxscn(scn))
-					elf->versym_data = elf_getdata(runscn, NULL);
-				break;
-			/* This is the information about the needed versions. */
-			case SHT_GNU_verneed:
-				elf->verneed_data = elf_getdata(runscn, NULL);
-				elf->verneed_stridx = runshdr->sh_link;
-				break;
-			/* This is the information about the defined versions. */
-			case SHT_GNU_verdef:
-				elf->verdef_data = elf_getdata(runscn, NULL);
-				elf->verdef_stridx = runshdr->sh_link;
-				break;
-			/* Extended section index. */
-			case SHT_SYMTAB_SHNDX:
-				if (runshdr->sh_link == elf_ndxscn(scn))
-					elf->xndx_data = elf_getdata(runscn, NULL);
-				break;
-			}
-		}
 	}
+	elf_section_iter_fini(&it);
+
+	if (ret != -ENOENT)
+		return ret;
+	ret = 0;
+
+	if (elf->lazy)
+		return ret;
 
 	if (elf->symtab_shdr_idx)
 		handle_symtab(elf, elf_getscn(elf->elf, elf->symtab_shdr_idx));
@@ -113,6 +248,40 @@ int handle_sections(struct elf_file *elf)
 	if (elf->dynsym_shdr_idx)
 		handle_symtab(elf, elf_getscn(elf->elf, elf->dynsym_shdr_idx));
 
+	elf->syms_loaded = true;
 	return ret;
 }
 
+/**
+ * Decode symbol tables of ELF opened by elf_file_open_lazy(), it's called
+ * by symbol lookup functions, no need to call it directly.
+ */
+int elf_file_load_syms(struct elf_file *elf)
+{
+	Elf_Scn *scn;
+
+	if (elf->syms_loaded)
+		return 0;
+
+	elf->syms_loaded = true;
+
+	if (elf->symtab_shdr_idx) {
+		scn = elf_getscn(elf->elf, elf->symtab_shdr_idx);
+		elf->symtab_data = elf_getdata(scn, NULL);
+		handle_symtab_aux_sections(elf, scn);
+	}
+	if (elf->dynsym_shdr_idx) {
+		scn = elf_getscn(elf->elf, elf->dynsym_shdr_idx);
+		elf->dynsym_data = elf_getdata(scn, NULL);
+		handle_symtab_aux_sections(elf, scn);
+	}
+
+	if (elf->symtab_shdr_idx)
+		handle_symtab(elf, elf_getscn(elf->elf, elf->symtab_shdr_idx));
+
+	if (elf->dynsym_shdr_idx)
+		handle_symtab(elf, elf_getscn(elf->elf, elf->dynsym_shdr_idx));
+
+	ulp_debug("Load %s symbols lazily.\n", elf->filepath);
+	return 0;
+}
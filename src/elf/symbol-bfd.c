@@ -6,13 +6,84 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <bfd.h>
+#if defined(BINUTILS_HAVE_BFD_THREAD_INIT)
+# include <pthread.h>
+#endif
 
 #include <elf/elf-api.h>
 
 #include <utils/log.h>
 #include <utils/util.h>
 #include <utils/list.h>
+#include <utils/slab.h>
+#include <utils/eytzinger.h>
+#include <utils/dl.h>
+
+
+/**
+ * libbfd is loaded by dlopen(3) on the first bfd_elf_open() or preload, the
+ * relocation of libbfd is a noticeable part of the startup, and most runs
+ * of such as ulpinfo never open an ELF file with bfd. The calls below go
+ * through the pointers, the macros and inlines of bfd.h which dispatch by
+ * abfd->xvec need nothing, except the address of the standard sections.
+ */
+static struct {
+	__typeof__(bfd_openr) *bfd_openr;
+	__typeof__(bfd_close) *bfd_close;
+	__typeof__(bfd_check_format) *bfd_check_format;
+	__typeof__(bfd_check_format_matches) *bfd_check_format_matches;
+	__typeof__(bfd_get_section_by_name) *bfd_get_section_by_name;
+	__typeof__(bfd_get_section_contents) *bfd_get_section_contents;
+	__typeof__(bfd_demangle) *bfd_demangle;
+#if defined(BINUTILS_HAVE_BFD_THREAD_INIT)
+	__typeof__(bfd_thread_init) *bfd_thread_init;
+#endif
+	__typeof__(_bfd_std_section) *_bfd_std_section;
+} libbfd;
+
+static const struct ulp_dl_sym libbfd_syms[] = {
+	ULP_DL_SYM(bfd_openr, libbfd.bfd_openr),
+	ULP_DL_SYM(bfd_close, libbfd.bfd_close),
+	ULP_DL_SYM(bfd_check_format, libbfd.bfd_check_format),
+	ULP_DL_SYM(bfd_check_format_matches, libbfd.bfd_check_format_matches),
+	ULP_DL_SYM(bfd_get_section_by_name, libbfd.bfd_get_section_by_name),
+	ULP_DL_SYM(bfd_get_section_contents, libbfd.bfd_get_section_contents),
+	ULP_DL_SYM(bfd_demangle, libbfd.bfd_demangle),
+#if defined(BINUTILS_HAVE_BFD_THREAD_INIT)
+	ULP_DL_SYM(bfd_thread_init, libbfd.bfd_thread_init),
+#endif
+	ULP_DL_SYM(_bfd_std_section, libbfd._bfd_std_section),
+};
+
+#ifndef LIBBFD_SONAME
+# define LIBBFD_SONAME	NULL
+#endif
+
+static struct ulp_dl libbfd_dl = {
+	.soname = LIBBFD_SONAME,
+	.name = "libbfd.so",
+	.syms = libbfd_syms,
+	.nr_syms = ARRAY_SIZE(libbfd_syms),
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define bfd_openr		libbfd.bfd_openr
+#define bfd_close		libbfd.bfd_close
+#define bfd_check_format	libbfd.bfd_check_format
+#define bfd_check_format_matches libbfd.bfd_check_format_matches
+#define bfd_get_section_by_name	libbfd.bfd_get_section_by_name
+#define bfd_get_section_contents libbfd.bfd_get_section_contents
+#define bfd_demangle		libbfd.bfd_demangle
+#define bfd_thread_init		libbfd.bfd_thread_init
+/* Used by bfd_und_section_ptr */
+#define _bfd_std_section	(*libbfd._bfd_std_section)
 
 
 enum bfd_sym_type {
@@ -24,8 +95,17 @@ enum bfd_sym_type {
 
 struct bfd_elf_file {
 	char name[PATH_MAX];
+	/**
+	 * stat(2) of name when opened, the file on the same path could be
+	 * replaced later, see file_match().
+	 */
+	dev_t file_dev;
+	ino_t file_ino;
+	struct timespec file_mtime;
 
 	bfd *bfd;
+	/* Separate debuginfo of the stripped ELF, see file_open_debuginfo() */
+	bfd *debug_bfd;
 
 	/**
 	 * One ELF file could be opened more than one time, if that, refcount
@@ -39,8 +119,10 @@ struct bfd_elf_file {
 	asymbol **dynsyms;
 	long dynsymcount;
 
+	/* Computed on the first lookup of PLT, see file_load_plt_syms() */
 	asymbol *synthsyms;
 	long synthcount;
+	bool plt_loaded;
 
 	asymbol **sorted_syms;
 	long sorted_symcount;
@@ -48,24 +130,70 @@ struct bfd_elf_file {
 	/* head is bfd_elf_file_list */
 	struct list_head node;
 
+	/* head is bfd_elf_lru_list, only linked while refcount is 0 */
+	struct list_head lru;
+	/* Estimated memory footprint, see file_mem_size() */
+	size_t mem_size;
+
 	struct rb_root rb_tree_syms[BFD_ELF_SYM_TYPE_NUM];
+	/**
+	 * Lookup index of rb_tree_syms[], the key is the interned name, built
+	 * once all symbols are linked, see build_bfd_sym_index().
+	 */
+	struct eytz_index sym_index[BFD_ELF_SYM_TYPE_NUM];
+	bool sym_indexed;
+
+	/**
+	 * C++ symbols sorted by demangled name, built on the first lookup of
+	 * demangled name, see build_demangled_index().
+	 */
+	struct bfd_demangled *demangled;
+	size_t nr_demangled;
+	bool demangled_built;
+
+	/* All struct bfd_sym come from here */
+	struct slab_cache sym_slab;
+
+	/* mmap(2)ed symbol cache file, see sym_cache_map() */
+	void *cache;
+	size_t cache_size;
 };
 
 struct bfd_sym {
-	char *name;
+	/* Interned, see str_intern() */
+	const char *name;
 	unsigned long addr;
 	enum bfd_sym_type type;
 
-	/* Point to struct bfd_elf_file syms, no need to free */
+	/**
+	 * Point to struct bfd_elf_file syms, no need to free. NULL if the
+	 * symbol is loaded from symbol cache.
+	 */
 	asymbol *bfd_asym;
 
 	/* root is bfd_elf_file.rb_tree_syms[type] */
 	struct rb_node node;
 };
 
+struct bfd_demangled {
+	/* Interned, see str_intern() */
+	const char *name;
+	struct bfd_sym *sym;
+};
+
 /* We just open few elf files, link list is ok. */
 static LIST_HEAD(bfd_elf_file_list);
 
+/**
+ * The closed files are kept in memory for the next bfd_elf_open(), the
+ * least recently closed one is at the tail, and is released first when the
+ * total footprint exceeds the budget. Referenced files are never evicted.
+ */
+static LIST_HEAD(bfd_elf_lru_list);
+static struct bfd_elf_cache_stats bfd_elf_cache = {
+	.budget = BFD_ELF_CACHE_DEFAULT_BUDGET,
+};
+
 /**
  * The following is the BFD-SYM symbol related public function interface.
  */
@@ -78,17 +206,28 @@ static inline int __cmp_bfd_sym(struct rb_node *n1, unsigned long key)
 	struct bfd_sym *s1 = rb_entry(n1, struct bfd_sym, node);
 	struct bfd_sym *s2 = (struct bfd_sym *)key;
 
+	/* Interned names */
+	if (s1->name == s2->name)
+		return 0;
 	return strcmp(s1->name, s2->name);
 }
 
-static struct bfd_sym *alloc_bfd_sym(const char *name, unsigned long addr,
+static struct bfd_sym *alloc_bfd_sym(struct bfd_elf_file *file,
+				     const char *name, unsigned long addr,
 				     enum bfd_sym_type type, asymbol *asym)
 {
-	struct bfd_sym *s = malloc(sizeof(struct bfd_sym));
+	struct bfd_sym *s = slab_alloc(&file->sym_slab);
+
+	if (!s)
+		return NULL;
 
 	memset(s, 0, sizeof(*s));
 
-	s->name = strdup(name);
+	s->name = str_intern(name);
+	if (!s->name) {
+		slab_free(&file->sym_slab, s);
+		return NULL;
+	}
 	s->addr = addr;
 	s->type = type;
 	s->bfd_asym = asym;
@@ -96,20 +235,29 @@ static struct bfd_sym *alloc_bfd_sym(const char *name, unsigned long addr,
 	return s;
 }
 
-static void free_bfd_sym(struct bfd_sym *s)
+static void free_bfd_sym(struct bfd_elf_file *file, struct bfd_sym *s)
 {
-	free(s->name);
-	free(s);
+	slab_free(&file->sym_slab, s);
 }
 
-static struct bfd_sym *find_bfd_sym(struct rb_root *root, const char *name)
+static struct bfd_sym *find_bfd_sym(struct bfd_elf_file *file,
+				     enum bfd_sym_type type, const char *name)
 {
 	struct bfd_sym tmp = {
-		.name = (char *)name,
+		.name = str_intern_lookup(name),
 	};
-	struct rb_node *node = rb_search_node(root, __cmp_bfd_sym,
-					(unsigned long)&tmp);
+	struct rb_node *node;
+
+	/* Never interned, no symbol has this name */
+	if (!tmp.name)
+		return NULL;
 
+	if (file->sym_indexed)
+		return eytz_find(&file->sym_index[type],
+				 (unsigned long)tmp.name);
+
+	node = rb_search_node(&file->rb_tree_syms[type], __cmp_bfd_sym,
+			      (unsigned long)&tmp);
 	return node ? rb_entry(node, struct bfd_sym, node) : NULL;
 }
 
@@ -127,6 +275,61 @@ static struct bfd_sym *next_bfd_sym(struct rb_root *root, struct bfd_sym *prev)
 	return next ? rb_entry(next, struct bfd_sym, node) : NULL;
 }
 
+/**
+ * The symbols are never changed once built, index them in sorted arrays,
+ * which are more cache friendly than the rbtrees for the name lookups. The
+ * rbtrees are kept for the iterations in order of name.
+ */
+static int build_bfd_sym_type_index(struct bfd_elf_file *file, int type)
+{
+	unsigned long *keys = NULL, *tmp_keys;
+	void **vals = NULL, **tmp_vals;
+	size_t nr = 0, cap = 0;
+	struct bfd_sym *s;
+	int err = -ENOMEM;
+
+	for (s = next_bfd_sym(&file->rb_tree_syms[type], NULL); s;
+	     s = next_bfd_sym(&file->rb_tree_syms[type], s)) {
+		if (nr == cap) {
+			cap = cap ? cap * 2 : 1024;
+			tmp_keys = realloc(keys, cap * sizeof(*keys));
+			if (tmp_keys)
+				keys = tmp_keys;
+			tmp_vals = realloc(vals, cap * sizeof(*vals));
+			if (tmp_vals)
+				vals = tmp_vals;
+			if (!tmp_keys || !tmp_vals)
+				goto out;
+		}
+		keys[nr] = (unsigned long)s->name;
+		vals[nr++] = s;
+	}
+
+	eytz_free(&file->sym_index[type]);
+	err = eytz_build_unsorted(&file->sym_index[type], keys, vals, nr);
+out:
+	free(keys);
+	free(vals);
+	return err;
+}
+
+static void build_bfd_sym_index(struct bfd_elf_file *file)
+{
+	int type;
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		if (build_bfd_sym_type_index(file, type))
+			goto fail;
+	}
+	file->sym_indexed = true;
+	return;
+
+fail:
+	ulp_warning("No memory for symbol index of %s.\n", file->name);
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++)
+		eytz_free(&file->sym_index[type]);
+}
+
 unsigned long bfd_sym_addr(struct bfd_sym *symbol)
 {
 	return symbol ? symbol->addr : 0;
@@ -164,15 +367,232 @@ struct bfd_sym *bfd_next_text_sym(struct bfd_elf_file *file,
 	return next_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_TEXT], prev);
 }
 
+/**
+ * Any of .text, .data or .plt symbol has this name.
+ */
+bool bfd_elf_has_sym(struct bfd_elf_file *file, const char *name)
+{
+	int i;
+
+	if (!file)
+		return false;
+
+	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++)
+		if (find_bfd_sym(file, i, name))
+			return true;
+	return false;
+}
+
+/**
+ * The smallest symbol whose name >= @prefix, the in-order of rbtree is
+ * descending, see __cmp_bfd_sym().
+ */
+static struct bfd_sym *lower_bfd_sym(struct rb_root *root, const char *prefix)
+{
+	struct rb_node *node = root->rb_node, *found = NULL;
+	struct bfd_sym *s;
+
+	while (node) {
+		s = rb_entry(node, struct bfd_sym, node);
+		if (strcmp(s->name, prefix) >= 0) {
+			found = node;
+			node = node->rb_right;
+		} else {
+			node = node->rb_left;
+		}
+	}
+	return found ? rb_entry(found, struct bfd_sym, node) : NULL;
+}
+
+/**
+ * Iterate .text, .plt and .data symbols whose name starts with @prefix, in
+ * ascending order of name of each type, the other symbols are never
+ * visited. The empty @prefix iterates all symbols.
+ */
+struct bfd_sym *bfd_next_prefix_sym(struct bfd_elf_file *file,
+				    const char *prefix, struct bfd_sym *prev)
+{
+	size_t len = strlen(prefix);
+	struct rb_node *node;
+	struct bfd_sym *s;
+	int type = 0;
+
+	if (prev) {
+		node = rb_prev(&prev->node);
+		s = node ? rb_entry(node, struct bfd_sym, node) : NULL;
+		if (s && !strncmp(s->name, prefix, len))
+			return s;
+		type = prev->type + 1;
+	}
+
+	for (; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		s = lower_bfd_sym(&file->rb_tree_syms[type], prefix);
+		if (s && !strncmp(s->name, prefix, len))
+			return s;
+	}
+	return NULL;
+}
+
+/**
+ * The following is the demangled name related function interface.
+ */
+
+/* See libiberty demangle.h */
+#ifndef DMGL_PARAMS
+# define DMGL_PARAMS	(1 << 0)
+# define DMGL_ANSI	(1 << 1)
+#endif
+
+static int cmp_bfd_demangled(const void *a, const void *b)
+{
+	const struct bfd_demangled *da = a, *db = b;
+	int ret = strcmp(da->name, db->name);
+
+	/* The .text one first */
+	return ret ?: (int)da->sym->type - (int)db->sym->type;
+}
+
+/**
+ * Only the symbols of Itanium C++ ABI, whose name starts with "_Z", are
+ * demangled, once per file, and the demangled names are interned. The one
+ * failed to demangle is indexed by the mangled name.
+ */
+static void build_demangled_index(struct bfd_elf_file *file)
+{
+	struct bfd_demangled *ds = NULL, *tmp;
+	size_t nr = 0, cap = 0, size;
+	struct bfd_sym *s;
+	const char *name;
+	char *dem;
+	int type;
+
+	file->demangled_built = true;
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		for (s = next_bfd_sym(&file->rb_tree_syms[type], NULL); s;
+		     s = next_bfd_sym(&file->rb_tree_syms[type], s)) {
+			if (strncmp(s->name, "_Z", 2))
+				continue;
+
+			dem = bfd_demangle(file->bfd, s->name,
+					   DMGL_PARAMS | DMGL_ANSI);
+			name = dem ? str_intern(dem) : s->name;
+			free(dem);
+			if (!name)
+				goto fail;
+
+			if (nr == cap) {
+				cap = cap ? cap * 2 : 1024;
+				tmp = realloc(ds, cap * sizeof(*ds));
+				if (!tmp)
+					goto fail;
+				ds = tmp;
+			}
+			ds[nr].name = name;
+			ds[nr++].sym = s;
+		}
+	}
+
+	qsort(ds, nr, sizeof(*ds), cmp_bfd_demangled);
+	file->demangled = ds;
+	file->nr_demangled = nr;
+
+	size = nr * sizeof(*ds);
+	file->mem_size += size;
+	bfd_elf_cache.bytes += size;
+	if (!file->refcount)
+		bfd_elf_cache.unused_bytes += size;
+
+	ulp_debug("Demangle %zu symbols of %s.\n", nr, file->name);
+	return;
+
+fail:
+	ulp_warning("No memory for demangled index of %s.\n", file->name);
+	free(ds);
+}
+
+/* The first one whose demangled name >= @prefix */
+static size_t lower_demangled(struct bfd_elf_file *file, const char *prefix)
+{
+	size_t lo = 0, hi = file->nr_demangled, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(file->demangled[mid].name, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Iterate the C++ symbols whose demangled name starts with @prefix, such
+ * as "ns::Class::", in ascending order of demangled name. The index is
+ * built on the first call, the files never looked up by demangled name
+ * demangle nothing.
+ */
+const struct bfd_demangled *bfd_next_demangled(struct bfd_elf_file *file,
+					       const char *prefix,
+					       const struct bfd_demangled *prev)
+{
+	size_t i;
+
+	if (!file)
+		return NULL;
+
+	if (!file->demangled_built)
+		build_demangled_index(file);
+
+	i = prev ? prev - file->demangled + 1 : lower_demangled(file, prefix);
+	if (i >= file->nr_demangled ||
+	    strncmp(file->demangled[i].name, prefix, strlen(prefix)))
+		return NULL;
+	return &file->demangled[i];
+}
+
+/**
+ * Find the symbol of demangled @name, the full one with the parameters,
+ * such as "ns::Class::method(int) const", or the qualified name only, such
+ * as "ns::Class::method", the first overload in order of name wins.
+ */
+struct bfd_sym *bfd_find_demangled_sym(struct bfd_elf_file *file,
+				       const char *name)
+{
+	const struct bfd_demangled *d;
+	size_t len = strlen(name);
+	unsigned char c;
+
+	for (d = bfd_next_demangled(file, name, NULL); d;
+	     d = bfd_next_demangled(file, name, d)) {
+		c = d->name[len];
+		if (c == '\0' || c == '(')
+			return d->sym;
+		/* Sorted, the others are such as "ns::Class::method2" */
+		if (c > '(')
+			break;
+	}
+	return NULL;
+}
+
+const char *bfd_demangled_name(const struct bfd_demangled *d)
+{
+	return d ? d->name : NULL;
+}
+
+struct bfd_sym *bfd_demangled_sym(const struct bfd_demangled *d)
+{
+	return d ? d->sym : NULL;
+}
+
 unsigned long bfd_elf_text_sym_addr(struct bfd_elf_file *file, const char *name)
 {
 	if (!file)
 		return 0;
 
 	struct bfd_sym *symbol;
-	struct rb_root *rbroot = &file->rb_tree_syms[BFD_ELF_SYM_TEXT];
 
-	symbol = find_bfd_sym(rbroot, name);
+	symbol = find_bfd_sym(file, BFD_ELF_SYM_TEXT, name);
 
 	return bfd_sym_addr(symbol);
 }
@@ -186,9 +606,19 @@ static bool asymbol_is_plt(asymbol *sym)
 	return strstr(sym->name, "@plt") ? true : false;
 }
 
+static void file_load_plt_syms(struct bfd_elf_file *file);
+static void file_free(struct bfd_elf_file *file);
+
+/**
+ * The PLT symbols are computed on the first call of bfd_next_plt_sym() or
+ * bfd_elf_plt_sym_addr(), the other lookups, such as bfd_next_prefix_sym(),
+ * never compute them, see file_load_plt_syms().
+ */
 struct bfd_sym *bfd_next_plt_sym(struct bfd_elf_file *file,
 				 struct bfd_sym *prev)
 {
+	if (!file->plt_loaded)
+		file_load_plt_syms(file);
 	return next_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_PLT], prev);
 }
 
@@ -198,9 +628,11 @@ unsigned long bfd_elf_plt_sym_addr(struct bfd_elf_file *file, const char *name)
 		return 0;
 
 	struct bfd_sym *symbol;
-	struct rb_root *rbroot = &file->rb_tree_syms[BFD_ELF_SYM_PLT];
 
-	symbol = find_bfd_sym(rbroot, name);
+	if (!file->plt_loaded)
+		file_load_plt_syms(file);
+
+	symbol = find_bfd_sym(file, BFD_ELF_SYM_PLT, name);
 
 	return bfd_sym_addr(symbol);
 }
@@ -241,8 +673,7 @@ unsigned long bfd_elf_data_sym_addr(struct bfd_elf_file *file, const char *name)
 		return 0;
 
 	struct bfd_sym *symbol;
-	struct rb_root *rbroot = &file->rb_tree_syms[BFD_ELF_SYM_DATA];
-	symbol = find_bfd_sym(rbroot, name);
+	symbol = find_bfd_sym(file, BFD_ELF_SYM_DATA, name);
 	return bfd_sym_addr(symbol);
 }
 
@@ -250,24 +681,61 @@ unsigned long bfd_elf_data_sym_addr(struct bfd_elf_file *file, const char *name)
  * Common load functions
  */
 
+/* @st is stat(2) of @filename, the file is not replaced since @f opened */
+static bool file_match(struct bfd_elf_file *f, const char *filename,
+		       const struct stat *st)
+{
+	return !strcmp(filename, f->name) && f->file_dev == st->st_dev &&
+		f->file_ino == st->st_ino &&
+		f->file_mtime.tv_sec == st->st_mtim.tv_sec &&
+		f->file_mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
 static struct bfd_elf_file *file_already_load(const char *filename)
 {
 	struct bfd_elf_file *f, *tmp, *ret = NULL;
+	struct stat st;
+
+	if (stat(filename, &st))
+		return NULL;
 
 	list_for_each_entry_safe(f, tmp, &bfd_elf_file_list, node) {
-		if (!strcmp(filename, f->name)) {
-			f->refcount++;
-			ret = f;
-			break;
+		if (strcmp(filename, f->name))
+			continue;
+
+		/**
+		 * The file was replaced, evict the stale one if nobody uses
+		 * it, the referenced one is evicted after the last close.
+		 */
+		if (!file_match(f, filename, &st)) {
+			if (f->refcount == 0) {
+				ulp_debug("Evict stale bfd_elf_file %s\n",
+					  f->name);
+				list_del(&f->lru);
+				bfd_elf_cache.nr_unused--;
+				bfd_elf_cache.unused_bytes -= f->mem_size;
+				bfd_elf_cache.evictions++;
+				file_free(f);
+			}
+			continue;
+		}
+
+		/* Take it back from LRU */
+		if (f->refcount++ == 0) {
+			list_del(&f->lru);
+			bfd_elf_cache.nr_unused--;
+			bfd_elf_cache.unused_bytes -= f->mem_size;
 		}
+		ret = f;
+		break;
 	}
 	return ret;
 }
 
-static asymbol **slurp_symtab(struct bfd_elf_file *file)
+/* @abfd is bfd_elf_file::bfd or bfd_elf_file::debug_bfd */
+static asymbol **slurp_symtab(struct bfd_elf_file *file, bfd *abfd)
 {
 	asymbol **sy;
-	bfd *abfd = file->bfd;
 	long storage;
 
 	file->symcount = 0;
@@ -364,7 +832,8 @@ static long remove_useless_symbols(asymbol **symbols, long count)
 		if ((sym->flags & (BSF_DEBUGGING | BSF_SECTION_SYM))
 			&& ! is_significant_symbol_name(sym->name))
 			continue;
-		if (bfd_is_und_section(sym->section) ||
+		/* Not bfd_is_und_section(), the inline refers to libbfd */
+		if (sym->section == bfd_und_section_ptr ||
 		    bfd_is_com_section(sym->section))
 			continue;
 
@@ -373,21 +842,534 @@ static long remove_useless_symbols(asymbol **symbols, long count)
 	return out_ptr - symbols;
 }
 
-static struct bfd_elf_file *file_load(const char *filename)
+/**
+ * Symbol cache, the sorted symbols of each type are saved in one file named
+ * by GNU build-id under ULP_SYM_CACHE_DIR, the next open of the same ELF
+ * mmap(2) it instead of slurping symbol tables. ELF without build-id is
+ * named by path hash, device and inode.
+ *
+ * The cache directory is shared by all ulpatch tools, thus when scan every
+ * process in host, each distinct library is parsed only once, and the cache
+ * pages are shared in page cache between all processes.
+ *
+ * Layout:
+ *
+ *   struct sym_cache_hdr
+ *   struct sym_cache_ent[nr_syms[BFD_ELF_SYM_TEXT]]
+ *   struct sym_cache_ent[nr_syms[BFD_ELF_SYM_PLT]]
+ *   struct sym_cache_ent[nr_syms[BFD_ELF_SYM_DATA]]
+ *   strtab
+ */
+#define SYM_CACHE_MAGIC		"ULPSYMC"
+/* 3: No PLT symbols, see file_load_plt_syms() */
+#define SYM_CACHE_VERSION	3
+#define SYM_CACHE_MAX_BUILD_ID	64
+
+struct sym_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t build_id_size;
+	uint8_t build_id[SYM_CACHE_MAX_BUILD_ID];
+	/* stat(2) of the ELF file */
+	uint64_t file_size;
+	uint64_t file_dev;
+	uint64_t file_ino;
+	int64_t file_mtime;
+	uint32_t nr_syms[BFD_ELF_SYM_TYPE_NUM];
+	uint32_t strtab_size;
+};
+
+struct sym_cache_ent {
+	uint64_t addr;
+	/* offset in strtab */
+	uint32_t name;
+	uint32_t len;
+};
+
+static bool sym_cache_enabled = true;
+
+void bfd_elf_sym_cache_enable(bool enable)
+{
+	sym_cache_enabled = enable;
+}
+
+static bool sym_cache_has_bid(struct bfd_elf_file *file)
+{
+	const struct bfd_build_id *bid = file->bfd->build_id;
+	return bid && bid->size && bid->size <= SYM_CACHE_MAX_BUILD_ID;
+}
+
+static void sym_cache_path(struct bfd_elf_file *file, const struct stat *st,
+			   char *buf, size_t blen)
+{
+	char sbid[SYM_CACHE_MAX_BUILD_ID * 2 + 1];
+
+	if (sym_cache_has_bid(file)) {
+		bfd_strbid(file->bfd->build_id, sbid, sizeof(sbid));
+		snprintf(buf, blen, ULP_SYM_CACHE_DIR "/%s.syms", sbid);
+	} else
+		snprintf(buf, blen, ULP_SYM_CACHE_DIR "/%08x-%lx-%lx.syms",
+			 str_hash(file->name, strlen(file->name)),
+			 (unsigned long)st->st_dev, (unsigned long)st->st_ino);
+}
+
+static bool sym_cache_valid(struct bfd_elf_file *file, const void *cache,
+			    size_t size, const struct stat *st)
+{
+	const struct bfd_build_id *bid = file->bfd->build_id;
+	const struct sym_cache_hdr *hdr = cache;
+	size_t expect = sizeof(struct sym_cache_hdr);
+	int i;
+
+	if (size < expect)
+		return false;
+	if (memcmp(hdr->magic, SYM_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SYM_CACHE_VERSION)
+		return false;
+	if (hdr->file_size != st->st_size)
+		return false;
+
+	if (sym_cache_has_bid(file)) {
+		if (hdr->build_id_size != bid->size ||
+		    memcmp(hdr->build_id, bid->data, bid->size))
+			return false;
+	} else {
+		/* Without build-id, the file identity is all we have */
+		if (hdr->build_id_size || hdr->file_dev != st->st_dev ||
+		    hdr->file_ino != st->st_ino ||
+		    hdr->file_mtime != st->st_mtime)
+			return false;
+	}
+
+	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++)
+		expect += hdr->nr_syms[i] * sizeof(struct sym_cache_ent);
+	expect += hdr->strtab_size;
+
+	return size == expect;
+}
+
+/**
+ * mmap(2) the symbol cache of the ELF file, the rbtrees are built from it
+ * by file_build_syms(). Only the cache file owned by current user or root,
+ * and not writable by others is trusted.
+ */
+static int sym_cache_map(struct bfd_elf_file *file)
+{
+	char path[PATH_MAX];
+	struct stat st, elf_st;
+	void *cache;
+	int fd;
+
+	if (!sym_cache_enabled)
+		return -ENOENT;
+
+	if (stat(file->name, &elf_st))
+		return -errno;
+
+	sym_cache_path(file, &elf_st, path, sizeof(path));
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) || (st.st_uid != geteuid() && st.st_uid != 0) ||
+	    st.st_mode & (S_IWGRP | S_IWOTH) || st.st_size == 0) {
+		close(fd);
+		return -EPERM;
+	}
+
+	cache = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache == MAP_FAILED)
+		return -errno;
+
+	if (!sym_cache_valid(file, cache, st.st_size, &elf_st)) {
+		ulp_debug("Symbol cache %s is stale.\n", path);
+		munmap(cache, st.st_size);
+		return -ESTALE;
+	}
+
+	file->cache = cache;
+	file->cache_size = st.st_size;
+	ulp_debug("Symbol cache %s hit.\n", path);
+	return 0;
+}
+
+static void sym_cache_build_syms(struct bfd_elf_file *file)
+{
+	const struct sym_cache_hdr *hdr = file->cache;
+	const struct sym_cache_ent *ent = (void *)(hdr + 1);
+	const char *strtab;
+	uint32_t nr = 0;
+	int type;
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++)
+		nr += hdr->nr_syms[type];
+	strtab = (const char *)(ent + nr);
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		uint32_t i;
+
+		for (i = 0; i < hdr->nr_syms[type]; i++, ent++) {
+			struct bfd_sym *s;
+			const char *name;
+
+			if (ent->name + ent->len >= hdr->strtab_size)
+				continue;
+			name = strtab + ent->name;
+			if (name[ent->len] != '\0')
+				continue;
+
+			s = alloc_bfd_sym(file, name, ent->addr, type, NULL);
+			if (!s)
+				break;
+			if (link_bfd_sym(&file->rb_tree_syms[type], s))
+				free_bfd_sym(file, s);
+		}
+	}
+
+	munmap(file->cache, file->cache_size);
+	file->cache = NULL;
+	file->cache_size = 0;
+}
+
+/**
+ * Save all symbols of the rbtrees into symbol cache, write to a temporary
+ * file and rename(2) it, thus the reader never see half written cache.
+ */
+static int sym_cache_save(struct bfd_elf_file *file)
+{
+	const struct bfd_build_id *bid;
+	struct sym_cache_hdr hdr;
+	struct sym_cache_ent ent;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct bfd_sym *s;
+	struct stat st;
+	uint32_t off = 0;
+	int type, fd;
+	FILE *fp;
+
+	if (!sym_cache_enabled)
+		return -ENOENT;
+
+	if (stat(file->name, &st))
+		return -errno;
+
+	sym_cache_path(file, &st, path, sizeof(path));
+
+	if (mkdir(ULP_PROC_ROOT_DIR, 0755) && errno != EEXIST)
+		return -errno;
+	if (mkdir(ULP_SYM_CACHE_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -errno;
+
+	/* Shared with other users, see sym_cache_map() */
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+		return -errno;
+	}
+
+	bid = file->bfd->build_id;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SYM_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SYM_CACHE_VERSION;
+	if (sym_cache_has_bid(file)) {
+		hdr.build_id_size = bid->size;
+		memcpy(hdr.build_id, bid->data, bid->size);
+	}
+	hdr.file_size = st.st_size;
+	hdr.file_dev = st.st_dev;
+	hdr.file_ino = st.st_ino;
+	hdr.file_mtime = st.st_mtime;
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		for (s = next_bfd_sym(&file->rb_tree_syms[type], NULL); s;
+		     s = next_bfd_sym(&file->rb_tree_syms[type], s)) {
+			hdr.nr_syms[type]++;
+			hdr.strtab_size += strlen(s->name) + 1;
+		}
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		for (s = next_bfd_sym(&file->rb_tree_syms[type], NULL); s;
+		     s = next_bfd_sym(&file->rb_tree_syms[type], s)) {
+			memset(&ent, 0, sizeof(ent));
+			ent.addr = s->addr;
+			ent.name = off;
+			ent.len = strlen(s->name);
+			off += ent.len + 1;
+			fwrite(&ent, sizeof(ent), 1, fp);
+		}
+	}
+
+	for (type = 0; type < BFD_ELF_SYM_TYPE_NUM; type++) {
+		for (s = next_bfd_sym(&file->rb_tree_syms[type], NULL); s;
+		     s = next_bfd_sym(&file->rb_tree_syms[type], s))
+			fwrite(s->name, strlen(s->name) + 1, 1, fp);
+	}
+
+	if (fclose(fp) || rename(tmp, path)) {
+		ulp_warning("Save symbol cache %s failed, %m\n", path);
+		unlink(tmp);
+		return -EIO;
+	}
+
+	ulp_debug("Save symbol cache %s\n", path);
+	return 0;
+}
+
+/**
+ * Separate debuginfo, the .symtab of stripped ELF is in the debug file of
+ * debuginfo package, found by GNU build-id or .gnu_debuglink, the same as
+ * gdb(1) "Separate Debug Files", or fetched by debuginfod-find(1) if
+ * DEBUGINFOD_URLS is set. Only the .symtab of it is slurped, never DWARF,
+ * and the symbols are saved in the symbol cache of the stripped ELF, thus
+ * only the first open of the same build looks up the debug file.
+ */
+#define DEBUGINFO_DIR	"/usr/lib/debug"
+
+static bool debuginfo_enabled = true;
+
+void bfd_elf_debuginfo_enable(bool enable)
+{
+	debuginfo_enabled = enable;
+}
+
+static bool debuginfo_by_build_id(struct bfd_elf_file *file, char *buf,
+				  size_t blen)
+{
+	char sbid[SYM_CACHE_MAX_BUILD_ID * 2 + 1];
+
+	if (!sym_cache_has_bid(file) || file->bfd->build_id->size < 2)
+		return false;
+
+	bfd_strbid(file->bfd->build_id, sbid, sizeof(sbid));
+	snprintf(buf, blen, DEBUGINFO_DIR "/.build-id/%.2s/%s.debug", sbid,
+		 sbid + 2);
+	return fexist(buf);
+}
+
+/**
+ * The .gnu_debuglink is the file name of debug file, then 4 bytes CRC32,
+ * the CRC32 is not checked, it needs to read the whole debug file, the
+ * build-id is checked by file_open_debuginfo() instead.
+ */
+static bool debuginfo_by_debuglink(struct bfd_elf_file *file, char *buf,
+				   size_t blen)
+{
+	char link[NAME_MAX + 1], dir[PATH_MAX], *p;
+	bfd_size_type len;
+	asection *sec;
+	int i;
+
+	sec = bfd_get_section_by_name(file->bfd, ".gnu_debuglink");
+	if (!sec || !sec->size)
+		return false;
+
+	len = MIN(sec->size, sizeof(link) - 1);
+	if (!bfd_get_section_contents(file->bfd, sec, link, 0, len))
+		return false;
+	link[len] = '\0';
+	if (!link[0] || strchr(link, '/'))
+		return false;
+
+	strncpy(dir, file->name, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	p = strrchr(dir, '/');
+	if (p)
+		*p = '\0';
+	else
+		strcpy(dir, ".");
+
+	for (i = 0; i < 3; i++) {
+		switch (i) {
+		case 0:
+			snprintf(buf, blen, "%s/%s", dir, link);
+			break;
+		case 1:
+			snprintf(buf, blen, "%s/.debug/%s", dir, link);
+			break;
+		case 2:
+			snprintf(buf, blen, DEBUGINFO_DIR "%s/%s", dir, link);
+			break;
+		}
+		if (strcmp(buf, file->name) && fexist(buf))
+			return true;
+	}
+	return false;
+}
+
+/* Where debuginfod-find(1) saves the debug file */
+static void debuginfod_cache_path(const char *sbid, char *buf, size_t blen)
+{
+	const char *dir = getenv("DEBUGINFOD_CACHE_PATH");
+
+	if (dir)
+		snprintf(buf, blen, "%s/%s/debuginfo", dir, sbid);
+	else if ((dir = getenv("XDG_CACHE_HOME")))
+		snprintf(buf, blen, "%s/debuginfod_client/%s/debuginfo", dir,
+			 sbid);
+	else
+		snprintf(buf, blen, "%s/.cache/debuginfod_client/%s/debuginfo",
+			 getenv("HOME") ?: "", sbid);
+}
+
+static bool debuginfo_by_debuginfod(struct bfd_elf_file *file, char *buf,
+				    size_t blen)
+{
+	char sbid[SYM_CACHE_MAX_BUILD_ID * 2 + 1];
+	const char *urls = getenv("DEBUGINFOD_URLS");
+	posix_spawn_file_actions_t actions;
+	extern char **environ;
+	int status, err;
+	pid_t pid;
+
+	if (!urls || !urls[0] || !sym_cache_has_bid(file))
+		return false;
+
+	bfd_strbid(file->bfd->build_id, sbid, sizeof(sbid));
+	debuginfod_cache_path(sbid, buf, blen);
+	if (fexist(buf))
+		return true;
+
+	char *argv[] = { "debuginfod-find", "debuginfo", sbid, NULL };
+
+	/* Not fork(2), maybe called in the workers of bfd_elf_preload() */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+					 O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+					 O_WRONLY, 0);
+	err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err) {
+		ulp_debug("spawn debuginfod-find failed, %s\n", strerror(err));
+		return false;
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return false;
+	return fexist(buf);
+}
+
+/**
+ * Slurp the .symtab of the debug file of stripped @file as the
+ * bfd_elf_file::syms, the sections of them are in debug_bfd, with the same
+ * flags and addresses as @file.
+ */
+static void file_open_debuginfo(struct bfd_elf_file *file)
+{
+	const struct bfd_build_id *bid = file->bfd->build_id, *dbid;
+	char path[PATH_MAX];
+	asymbol **syms;
+	bfd *dbfd;
+
+	if (!debuginfo_enabled)
+		return;
+
+	if (!debuginfo_by_build_id(file, path, sizeof(path)) &&
+	    !debuginfo_by_debuglink(file, path, sizeof(path)) &&
+	    !debuginfo_by_debuginfod(file, path, sizeof(path)))
+		return;
+
+	dbfd = bfd_openr(path, NULL);
+	if (!dbfd)
+		return;
+
+	if (!bfd_check_format(dbfd, bfd_object))
+		goto close;
+
+	/* The debuglink maybe a file of another build */
+	dbid = dbfd->build_id;
+	if (sym_cache_has_bid(file) && (!dbid || dbid->size != bid->size ||
+	    memcmp(dbid->data, bid->data, bid->size))) {
+		ulp_warning("%s is not debuginfo of %s.\n", path, file->name);
+		goto close;
+	}
+
+	syms = slurp_symtab(file, dbfd);
+	if (!syms)
+		goto close;
+
+	free(file->syms);
+	file->syms = syms;
+	file->debug_bfd = dbfd;
+	ulp_info("Load %ld symbols of %s from %s.\n", file->symcount,
+		 file->name, path);
+	return;
+
+close:
+	bfd_close(dbfd);
+}
+
+/**
+ * Path of the separate debug file of @file, such as for DWARF, which is
+ * never read by bfd. Return 0 if found, the one of stripped ELF is loaded
+ * already, and checked by build-id.
+ */
+int bfd_elf_debuginfo_path(struct bfd_elf_file *file, char *buf, size_t blen)
+{
+	if (file->debug_bfd) {
+		snprintf(buf, blen, "%s", bfd_get_filename(file->debug_bfd));
+		return 0;
+	}
+
+	if (!debuginfo_enabled)
+		return -ENOENT;
+
+	if (debuginfo_by_build_id(file, buf, blen) ||
+	    debuginfo_by_debuglink(file, buf, blen) ||
+	    debuginfo_by_debuginfod(file, buf, blen))
+		return 0;
+	return -ENOENT;
+}
+
+/**
+ * Open the bfd and slurp all symbols, the symbol rbtrees are not built and
+ * the file is not linked into bfd_elf_file_list, this part could run in
+ * worker thread, see bfd_elf_preload().
+ */
+static struct bfd_elf_file *file_open_bfd(const char *filename)
 {
 	int i;
 	struct bfd_elf_file *file;
+	struct stat st;
 	char **matching;
 	char *target = NULL;
 
+	/* Before open, a file replaced later will not match */
+	if (stat(filename, &st))
+		return NULL;
+
 	file = malloc(sizeof(struct bfd_elf_file));
+	if (!file)
+		return NULL;
 	memset(file, 0, sizeof(struct bfd_elf_file));
 
 	file->refcount = 1;
 	strncpy(file->name, filename, PATH_MAX - 1);
+	file->file_dev = st.st_dev;
+	file->file_ino = st.st_ino;
+	file->file_mtime = st.st_mtim;
 
-	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++)
+	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++) {
 		rb_init(&file->rb_tree_syms[i]);
+		eytz_init(&file->sym_index[i]);
+	}
+	slab_cache_init(&file->sym_slab, sizeof(struct bfd_sym), 0);
+	file->sym_slab.mem_type = ULP_MEM_BFD_SYM;
 
 	file->bfd = bfd_openr(file->name, target);
 
@@ -401,22 +1383,20 @@ static struct bfd_elf_file *file_load(const char *filename)
 		goto close;
 	}
 
-	file->syms = slurp_symtab(file);
-	file->dynsyms = slurp_dynamic_symtab(file);
+	/* No need to slurp anything if cache hit */
+	if (!sym_cache_map(file))
+		return file;
 
-	file->synthcount = bfd_get_synthetic_symtab(file->bfd,
-					     file->symcount, file->syms,
-					     file->dynsymcount, file->dynsyms,
-					     &file->synthsyms);
-	if (file->synthcount < 0)
-		file->synthcount = 0;
+	file->syms = slurp_symtab(file, file->bfd);
+	if (!file->symcount)
+		file_open_debuginfo(file);
+	file->dynsyms = slurp_dynamic_symtab(file);
 
-	ulp_debug("Bfd_sym: %s has %ld syms, %ld dynsyms, %ld synthsyms.\n",
-		  file->name, file->symcount, file->dynsymcount,
-		  file->synthcount);
+	ulp_debug("Bfd_sym: %s has %ld syms, %ld dynsyms.\n", file->name,
+		  file->symcount, file->dynsymcount);
 
 	file->sorted_symcount = file->symcount ? file->symcount : file->dynsymcount;
-	file->sorted_syms = (asymbol **)malloc((file->sorted_symcount + file->synthcount)
+	file->sorted_syms = (asymbol **)malloc(file->sorted_symcount
 						* sizeof(asymbol *));
 
 	if (file->sorted_symcount != 0) {
@@ -427,9 +1407,59 @@ static struct bfd_elf_file *file_load(const char *filename)
 							file->sorted_symcount);
 	}
 
-	for (i = 0; i < file->synthcount; ++i) {
-		file->sorted_syms[file->sorted_symcount] = file->synthsyms + i;
-		++file->sorted_symcount;
+	return file;
+
+close:
+	bfd_close(file->bfd);
+	free(file);
+	return NULL;
+}
+
+/**
+ * Rough footprint of the file, the asymbol arrays, the bfd_sym slab and the
+ * mapped symbol cache. The internal allocations of libbfd are counted as
+ * one asymbol each slurped symbol.
+ */
+static size_t file_mem_size(struct bfd_elf_file *file)
+{
+	struct slab_cache *slab = &file->sym_slab;
+	size_t size = sizeof(struct bfd_elf_file);
+	int i;
+
+	size += (file->symcount + file->dynsymcount) *
+		(sizeof(asymbol *) + sizeof(asymbol));
+	size += file->synthcount * sizeof(asymbol);
+	size += file->sorted_symcount * sizeof(asymbol *);
+	size += slab->nr_chunks * slab->nr_per_chunk * slab->obj_size;
+	size += file->cache_size;
+	size += file->nr_demangled * sizeof(struct bfd_demangled);
+	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++)
+		size += (file->sym_index[i].nr + 1) *
+			(sizeof(unsigned long) + sizeof(void *));
+
+	return size;
+}
+
+/**
+ * The file_mem_size() part of ULP_MEM_ELF_FILE, the bfd_sym slab is
+ * accounted to ULP_MEM_BFD_SYM by itself.
+ */
+static long file_mem_file_bytes(struct bfd_elf_file *file)
+{
+	struct slab_cache *slab = &file->sym_slab;
+
+	return file->mem_size -
+		slab->nr_chunks * slab->nr_per_chunk * slab->obj_size;
+}
+
+/* Build symbol rbtrees, and link the file into bfd_elf_file_list */
+static void file_build_syms(struct bfd_elf_file *file)
+{
+	int i;
+
+	if (file->cache) {
+		sym_cache_build_syms(file);
+		goto done;
 	}
 
 	for (i = 0; i < file->sorted_symcount; i++) {
@@ -438,82 +1468,115 @@ static struct bfd_elf_file *file_load(const char *filename)
 		const char *name = asymbol_pure_name(s, buf, sizeof(buf));
 		unsigned long value = bfd_asymbol_value(s);
 
-		if (asymbol_is_plt(s)) {
-			struct bfd_sym *symbol;
-			symbol = alloc_bfd_sym(name, value, BFD_ELF_SYM_PLT, s);
-			link_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_PLT], symbol);
-			ulp_debug("Bfd_sym: %#016lx %s @plt\n", value, name);
-		}
-
 		if (asymbol_is_text(s)) {
 			struct bfd_sym *symbol;
-			symbol = alloc_bfd_sym(name, value, BFD_ELF_SYM_TEXT, s);
-			link_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_TEXT], symbol);
+			symbol = alloc_bfd_sym(file, name, value,
+					       BFD_ELF_SYM_TEXT, s);
+			/* Duplicate symbol name */
+			if (symbol && link_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_TEXT],
+						   symbol))
+				free_bfd_sym(file, symbol);
 			ulp_debug("Bfd_sym: %#016lx %s .text\n", value, name);
 		}
 
 		if (asymbol_is_data(s)) {
 			struct bfd_sym *symbol;
-			symbol = alloc_bfd_sym(name, value, BFD_ELF_SYM_DATA, s);
-			link_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_DATA], symbol);
+			symbol = alloc_bfd_sym(file, name, value,
+					       BFD_ELF_SYM_DATA, s);
+			/* Duplicate symbol name */
+			if (symbol && link_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_DATA],
+						   symbol))
+				free_bfd_sym(file, symbol);
 			ulp_debug("Bfd_sym: %#016lx %s .data\n", value, name);
 		}
 	}
 
-	list_add(&file->node, &bfd_elf_file_list);
-
-	return file;
+	sym_cache_save(file);
 
-close:
-	bfd_close(file->bfd);
-	return NULL;
+done:
+	build_bfd_sym_index(file);
+	file->mem_size = file_mem_size(file);
+	list_add(&file->node, &bfd_elf_file_list);
+	bfd_elf_cache.nr_files++;
+	bfd_elf_cache.bytes += file->mem_size;
+	ulp_mem_account(ULP_MEM_ELF_FILE, file_mem_file_bytes(file), 1);
 }
 
-struct bfd_elf_file *bfd_elf_open(const char *elf_file)
+/**
+ * The synthetic symbols of libbfd, such as "printf@plt", are made from the
+ * relocations and .plt section, which is a significant share of the load
+ * time and memory of large libraries, and most of the VMAs never look up
+ * PLT at all. Compute them on the first lookup of PLT of the file, the
+ * symbol tables are slurped here if the symbol cache hit, see
+ * sym_cache_map().
+ */
+static void file_load_plt_syms(struct bfd_elf_file *file)
 {
-	struct bfd_elf_file *file = NULL;
-
-	if (!fexist(elf_file)) {
-		errno = EEXIST;
-		return NULL;
+	struct bfd_sym *symbol;
+	size_t old_size = file->mem_size;
+	long old_bytes = file_mem_file_bytes(file);
+	const char *name;
+	char buf[256];
+	asymbol *s;
+	long i;
+
+	file->plt_loaded = true;
+
+	if (!file->syms && !file->dynsyms) {
+		file->syms = slurp_symtab(file, file->bfd);
+		file->dynsyms = slurp_dynamic_symtab(file);
 	}
 
-	file = file_already_load(elf_file);
-	if (!file)
-		file = file_load(elf_file);
+	/* The symbols of debuginfo belong to the other bfd */
+	file->synthcount = bfd_get_synthetic_symtab(file->bfd,
+			file->debug_bfd ? 0 : file->symcount,
+			file->debug_bfd ? NULL : file->syms,
+			file->dynsymcount, file->dynsyms, &file->synthsyms);
+	if (file->synthcount < 0)
+		file->synthcount = 0;
 
-	return file;
-}
+	ulp_debug("Bfd_sym: %s has %ld synthsyms.\n", file->name,
+		  file->synthcount);
 
-static void __rb_free_bfd_sym(struct rb_node *node)
-{
-	struct bfd_sym *s = rb_entry(node, struct bfd_sym, node);
-	free_bfd_sym(s);
-}
+	for (i = 0; i < file->synthcount; i++) {
+		s = file->synthsyms + i;
+		if (!asymbol_is_plt(s))
+			continue;
 
-int bfd_elf_file_refcount(struct bfd_elf_file *file)
-{
-	return file ? file->refcount : -1;
-}
+		name = asymbol_pure_name(s, buf, sizeof(buf));
+		if (!name)
+			continue;
 
-const char *bfd_elf_file_name(struct bfd_elf_file *file)
-{
-	return file ? file->name : NULL;
+		symbol = alloc_bfd_sym(file, name, bfd_asymbol_value(s),
+				       BFD_ELF_SYM_PLT, s);
+		/* Duplicate symbol name */
+		if (symbol && link_bfd_sym(&file->rb_tree_syms[BFD_ELF_SYM_PLT],
+					   symbol))
+			free_bfd_sym(file, symbol);
+		ulp_debug("Bfd_sym: %#016lx %s @plt\n", bfd_asymbol_value(s),
+			  name);
+	}
+
+	if (file->sym_indexed &&
+	    build_bfd_sym_type_index(file, BFD_ELF_SYM_PLT)) {
+		ulp_warning("No memory for symbol index of %s.\n", file->name);
+		for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++)
+			eytz_free(&file->sym_index[i]);
+		file->sym_indexed = false;
+	}
+
+	file->mem_size = file_mem_size(file);
+	bfd_elf_cache.bytes += file->mem_size - old_size;
+	ulp_mem_account(ULP_MEM_ELF_FILE,
+			file_mem_file_bytes(file) - old_bytes, 0);
+	if (!file->refcount)
+		bfd_elf_cache.unused_bytes += file->mem_size - old_size;
 }
 
-int bfd_elf_close(struct bfd_elf_file *file)
+static void file_free(struct bfd_elf_file *file)
 {
 	int i;
 
-	if (!file)
-		return -1;
-
-	file->refcount--;
-	if (file->refcount >= 1) {
-		ulp_debug("Could not close used bfd_elf_file.\n");
-		return 0;
-	}
-
 	if (file->syms) {
 		free(file->syms);
 		file->syms = NULL;
@@ -538,23 +1601,304 @@ int bfd_elf_close(struct bfd_elf_file *file)
 	file->synthcount = 0;
 	file->sorted_symcount = 0;
 
+	if (file->cache) {
+		munmap(file->cache, file->cache_size);
+		file->cache = NULL;
+	}
+
+	free(file->demangled);
+	file->demangled = NULL;
+	file->nr_demangled = 0;
+
 	list_del(&file->node);
+	bfd_elf_cache.nr_files--;
+	bfd_elf_cache.bytes -= file->mem_size;
+	ulp_mem_account(ULP_MEM_ELF_FILE, -file_mem_file_bytes(file), -1);
 
-	/* Destroy all type symbols rb tree */
-	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++)
-		rb_destroy(&file->rb_tree_syms[i], __rb_free_bfd_sym);
+	/* Destroy all type symbols rb tree, symbols are released in bulk */
+	for (i = 0; i < BFD_ELF_SYM_TYPE_NUM; i++) {
+		rb_init(&file->rb_tree_syms[i]);
+		eytz_free(&file->sym_index[i]);
+	}
+	slab_cache_destroy(&file->sym_slab);
 
+	if (file->debug_bfd)
+		bfd_close(file->debug_bfd);
 	bfd_close(file->bfd);
 	free(file);
+}
+
+/* Release the least recently closed files until under the budget */
+static void cache_shrink(void)
+{
+	struct bfd_elf_file *file;
+
+	while (bfd_elf_cache.bytes > bfd_elf_cache.budget &&
+	       !list_empty(&bfd_elf_lru_list)) {
+		file = list_last_entry(&bfd_elf_lru_list, struct bfd_elf_file,
+				       lru);
+		ulp_debug("Evict bfd_elf_file %s, %ld bytes\n", file->name,
+			  file->mem_size);
+		list_del(&file->lru);
+		bfd_elf_cache.nr_unused--;
+		bfd_elf_cache.unused_bytes -= file->mem_size;
+		bfd_elf_cache.evictions++;
+		file_free(file);
+	}
+}
+
+/* The file has no reference any more, keep it on LRU */
+static void file_put_lru(struct bfd_elf_file *file)
+{
+	list_add(&file->lru, &bfd_elf_lru_list);
+	bfd_elf_cache.nr_unused++;
+	bfd_elf_cache.unused_bytes += file->mem_size;
+}
+
+static struct bfd_elf_file *file_load(const char *filename)
+{
+	struct bfd_elf_file *file;
+
+	file = file_open_bfd(filename);
+	if (file)
+		file_build_syms(file);
+	return file;
+}
+
+#if defined(BINUTILS_HAVE_BFD_THREAD_INIT)
+static pthread_mutex_t bfd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool bfd_lock(void *data)
+{
+	return pthread_mutex_lock(&bfd_mutex) == 0;
+}
+
+static bool bfd_unlock(void *data)
+{
+	return pthread_mutex_unlock(&bfd_mutex) == 0;
+}
+
+struct preload_work {
+	const char **names;
+	struct bfd_elf_file **files;
+	int nr;
+	/* next index of names[] to open */
+	int next;
+};
+
+static void *preload_worker(void *arg)
+{
+	struct preload_work *work = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED))
+		< work->nr)
+		work->files[i] = file_open_bfd(work->names[i]);
+
+	return NULL;
+}
+
+static int preload_parallel(const char **names, int nr)
+{
+	static bool bfd_thread_ok = false;
+	struct preload_work work = {
+		.names = names,
+		.nr = nr,
+		.next = 0,
+	};
+	pthread_t threads[BFD_ELF_PRELOAD_MAX_THREADS];
+	int i, nr_threads, nr_cpus;
+
+	if (!bfd_thread_ok) {
+		bfd_thread_ok = bfd_thread_init(bfd_lock, bfd_unlock, NULL);
+		if (!bfd_thread_ok)
+			return -ENOTSUP;
+	}
+
+	work.files = calloc(nr, sizeof(struct bfd_elf_file *));
+	if (!work.files)
+		return -ENOMEM;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = MIN(nr, MIN(MAX(nr_cpus, 1), BFD_ELF_PRELOAD_MAX_THREADS));
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, preload_worker, &work))
+			break;
+	}
+	nr_threads = i;
+
+	/* If no thread was created, do the work in current thread */
+	preload_worker(&work);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Merge in load order, rbtrees and intern table are not locked */
+	for (i = 0; i < nr; i++) {
+		if (!work.files[i])
+			continue;
+		/* Take over by the first bfd_elf_open() */
+		work.files[i]->refcount = 0;
+		file_build_syms(work.files[i]);
+		file_put_lru(work.files[i]);
+	}
+	cache_shrink();
+
+	free(work.files);
 	return 0;
 }
+#endif
+
+/**
+ * Open and slurp all ELF files in concurrent, the rbtrees are built in the
+ * caller thread. The preloaded file has no reference and is kept on LRU
+ * like a closed one, the caller should bfd_elf_open() each of them later.
+ *
+ * Do nothing if bfd library doesn't support threads, then the files are
+ * opened one by one in bfd_elf_open().
+ */
+int bfd_elf_preload(const char **names, int nr)
+{
+#if defined(BINUTILS_HAVE_BFD_THREAD_INIT)
+	const char **todo;
+	int i, j, n = 0, ret;
+
+	if (nr <= 1)
+		return 0;
+
+	ret = ulp_dl_load(&libbfd_dl);
+	if (ret)
+		return ret;
+
+	todo = malloc(nr * sizeof(char *));
+	if (!todo)
+		return -ENOMEM;
+
+	/* Skip loaded and duplicate files */
+	for (i = 0; i < nr; i++) {
+		struct bfd_elf_file *f;
+		struct stat st;
+		bool dup = false;
+
+		if (stat(names[i], &st))
+			continue;
+
+		list_for_each_entry(f, &bfd_elf_file_list, node) {
+			if (file_match(f, names[i], &st)) {
+				dup = true;
+				break;
+			}
+		}
+		for (j = 0; j < n && !dup; j++)
+			dup = !strcmp(names[i], todo[j]);
+		if (!dup)
+			todo[n++] = names[i];
+	}
 
+	ret = n > 1 ? preload_parallel(todo, n) : 0;
+	ulp_debug("Preload %d bfd files, ret %d\n", n, ret);
+
+	free(todo);
+	return ret;
+#else
+	return 0;
+#endif
+}
+
+struct bfd_elf_file *bfd_elf_open(const char *elf_file)
+{
+	struct bfd_elf_file *file = NULL;
+
+	if (!fexist(elf_file)) {
+		errno = EEXIST;
+		return NULL;
+	}
+
+	/* The cached one was loaded by libbfd already */
+	file = file_already_load(elf_file);
+	if (file) {
+		bfd_elf_cache.hits++;
+		return file;
+	}
+
+	if (ulp_dl_load(&libbfd_dl)) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	bfd_elf_cache.misses++;
+	file = file_load(elf_file);
+	if (file)
+		cache_shrink();
+
+	return file;
+}
+
+int bfd_elf_file_refcount(struct bfd_elf_file *file)
+{
+	return file ? file->refcount : -1;
+}
+
+const char *bfd_elf_file_name(struct bfd_elf_file *file)
+{
+	return file ? file->name : NULL;
+}
+
+/**
+ * Drop one reference, the unreferenced file is not released right now, but
+ * kept on LRU for the next bfd_elf_open() of the same file, until it is
+ * evicted by the budget, see bfd_elf_cache_set_budget().
+ */
+int bfd_elf_close(struct bfd_elf_file *file)
+{
+	if (!file || file->refcount == 0)
+		return -1;
+
+	file->refcount--;
+	if (file->refcount >= 1) {
+		ulp_debug("Could not close used bfd_elf_file.\n");
+		return 0;
+	}
+
+	file_put_lru(file);
+	cache_shrink();
+	return 0;
+}
+
+/**
+ * Set the memory budget of all opened bfd_elf_files in bytes, return the
+ * old one. 0 means release the file once the last reference is dropped.
+ */
+size_t bfd_elf_cache_set_budget(size_t bytes)
+{
+	size_t old = bfd_elf_cache.budget;
+
+	bfd_elf_cache.budget = bytes;
+	cache_shrink();
+	return old;
+}
+
+void bfd_elf_cache_get_stats(struct bfd_elf_cache_stats *stats)
+{
+	*stats = bfd_elf_cache;
+}
+
+/* Release all unreferenced files, the referenced ones are left alone */
 int bfd_elf_destroy(void)
 {
 	struct bfd_elf_file *f, *tmp;
 
-	list_for_each_entry_safe(f, tmp, &bfd_elf_file_list, node)
-		bfd_elf_close(f);
+	list_for_each_entry_safe(f, tmp, &bfd_elf_lru_list, lru) {
+		list_del(&f->lru);
+		bfd_elf_cache.nr_unused--;
+		bfd_elf_cache.unused_bytes -= f->mem_size;
+		file_free(f);
+	}
+
+	list_for_each_entry(f, &bfd_elf_file_list, node)
+		ulp_warning("bfd_elf_file %s still has %ld references.\n",
+			    f->name, f->refcount);
 
 	return 0;
 }
@@ -11,6 +11,7 @@
 #include <elf/elf-api.h>
 #include <utils/util.h>
 #include <utils/log.h>
+#include <utils/slab.h>
 #include <patch/patch.h>
 
 
@@ -315,6 +316,8 @@ int handle_symtab(struct elf_file *elf, Elf_Scn *scn)
 			pversion ?: "");
 
 		struct symbol *s = alloc_symbol(symname, sym);
+		if (!s)
+			return -ENOMEM;
 		ret = link_symbol(elf, s);
 		if (ret) {
 			free_symbol(s);
@@ -339,6 +342,8 @@ int handle_symtab(struct elf_file *elf, Elf_Scn *scn)
 
 bool elf_support_ftrace(struct elf_file *elf)
 {
+	/* Found by handle_symtab() */
+	elf_file_load_syms(elf);
 	return elf->support_ftrace;
 }
 
@@ -361,7 +366,8 @@ int cmp_symbol_name(struct rb_node *n1, unsigned long key)
 	 */
 
 	if (s1->sym_type == s2->sym_type)
-		return strcmp(s1->name, s2->name);
+		/* Interned names */
+		return s1->name == s2->name ? 0 : strcmp(s1->name, s2->name);
 	else if (s1->sym_type > s2->sym_type)
 		return -1;
 	else if (s1->sym_type < s2->sym_type)
@@ -373,9 +379,15 @@ struct symbol *alloc_symbol(const char *name, const GElf_Sym *sym)
 {
 	struct symbol *s = malloc(sizeof(struct symbol));
 
+	if (!s)
+		return NULL;
 	memset(s, 0, sizeof(*s));
 
-	s->name = strdup(name);
+	s->name = str_intern(name);
+	if (!s->name) {
+		free(s);
+		return NULL;
+	}
 	s->type = GELF_ST_TYPE(sym->st_info);
 	if (is_extern_symbol(sym))
 		s->sym_type = SYM_TYPE_EXTERN;
@@ -386,6 +398,7 @@ struct symbol *alloc_symbol(const char *name, const GElf_Sym *sym)
 
 	memcpy(&s->sym, sym, sizeof(GElf_Sym));
 
+	ulp_mem_account(ULP_MEM_ELF_SYM, sizeof(struct symbol), 1);
 	return s;
 }
 
@@ -394,24 +407,91 @@ struct symbol *dup_symbol(struct symbol *sym)
 	struct symbol *new;
 
 	new = malloc(sizeof(struct symbol));
+	if (!new)
+		return NULL;
+	/* The interned name is shared */
 	memcpy(new, sym, sizeof(struct symbol));
-	new->name = strdup(sym->name);
+	ulp_mem_account(ULP_MEM_ELF_SYM, sizeof(struct symbol), 1);
 
 	return new;
 }
 
+/**
+ * Rebuild elf_file::sym_index[] from the symbols rbtree, the symbols are
+ * build once and searched many times, the sorted arrays are more cache
+ * friendly than the rbtree.
+ */
+static int elf_build_sym_index(struct elf_file *elf)
+{
+	size_t nr[SYM_TYPE_MAX] = {}, total = 0, off[SYM_TYPE_MAX];
+	struct rb_node *rnode;
+	struct symbol *s;
+	unsigned long *keys;
+	void **vals;
+	int i, err = 0;
+
+	for (rnode = rb_first(&elf->symbols); rnode; rnode = rb_next(rnode)) {
+		s = rb_entry(rnode, struct symbol, node);
+		nr[s->sym_type]++;
+		total++;
+	}
+
+	keys = malloc((total ?: 1) * sizeof(*keys));
+	vals = malloc((total ?: 1) * sizeof(*vals));
+	if (!keys || !vals) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, total = 0; i < SYM_TYPE_MAX; i++) {
+		off[i] = total;
+		total += nr[i];
+	}
+
+	for (rnode = rb_first(&elf->symbols); rnode; rnode = rb_next(rnode)) {
+		s = rb_entry(rnode, struct symbol, node);
+		keys[off[s->sym_type]] = (unsigned long)s->name;
+		vals[off[s->sym_type]++] = s;
+	}
+
+	for (i = 0; i < SYM_TYPE_MAX && !err; i++)
+		err = eytz_build_unsorted(&elf->sym_index[i],
+					  keys + off[i] - nr[i],
+					  vals + off[i] - nr[i], nr[i]);
+	if (!err)
+		elf->sym_index_dirty = false;
+out:
+	free(keys);
+	free(vals);
+	return err;
+}
+
 struct symbol *__find_symbol(struct elf_file *elf, const char *name, int type,
 			     enum sym_type sym_type)
 {
 	struct symbol tmp = {
-		.name = (char *)name,
 		.type = type,
 		.sym_type = sym_type,
 	};
 	struct rb_node *node;
+	const char *key;
 
 	ulp_debug("Find: %s : %s\n", elf->filepath, name);
 
+	/* Symbol names are interned while loading */
+	elf_file_load_syms(elf);
+
+	/* Never interned, no symbol has this name */
+	key = str_intern_lookup(name);
+	if (!key)
+		return NULL;
+
+	if (!elf->sym_index_dirty || !elf_build_sym_index(elf))
+		return eytz_find(&elf->sym_index[sym_type],
+				 (unsigned long)key);
+
+	/* No memory for the index */
+	tmp.name = key;
 	node = rb_search_node(&elf->symbols, cmp_symbol_name,
 			      (unsigned long)&tmp);
 	return node ? rb_entry(node, struct symbol, node) : NULL;
@@ -446,6 +526,8 @@ int for_each_symbol(struct elf_file *elf, void (*handler)(struct elf_file *,
 		return -EINVAL;
 	}
 
+	elf_file_load_syms(elf);
+
 	first = rb_first(&elf->symbols);
 
 	for (rnode = first; rnode; rnode = rb_next(rnode)) {
@@ -492,14 +574,17 @@ int link_symbol(struct elf_file *elf, struct symbol *s)
 insert:
 	node = rb_insert_node(&elf->symbols, &s->node,
 			      cmp_symbol_name, (unsigned long)s);
-	return node ? -EINVAL : 0;
+	if (node)
+		return -EINVAL;
+	elf->sym_index_dirty = true;
+	return 0;
 }
 
 void free_symbol(struct symbol *s)
 {
 	if (s->phdrs)
 		free(s->phdrs);
-	free(s->name);
+	ulp_mem_account(ULP_MEM_ELF_SYM, -(long)sizeof(struct symbol), -1);
 	free(s);
 }
 
@@ -1,7 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
 #include <patch/patch.h>
+#include <patch/ftrace-ring.h>
 
 #if defined(__x86_64__)
 #include <arch/x86_64/mcount.h>
@@ -24,6 +31,405 @@ extern int try_to_wake_up(struct task_struct *task, int mode, int wake_flags);
 #endif /* ULPATCH_TEST */
 
 
+/**
+ * Set by ulftrace after the object is patched, NULL if not tracing. Must not
+ * be in .bss, see rewrite_section_headers().
+ */
+struct ulp_ftrace_shm *ulp_ftrace_shm __attribute__((section(".data"))) = NULL;
+
+/* The thread pointer is unique for each living thread, no syscall */
+static inline unsigned long thread_pointer(void)
+{
+	unsigned long tp;
+#if defined(__x86_64__)
+	__asm__ __volatile__("mov %%fs:0, %0" : "=r"(tp));
+#elif defined(__aarch64__)
+	__asm__ __volatile__("mrs %0, tpidr_el0" : "=r"(tp));
+#endif
+	return tp;
+}
+
+/**
+ * Find the ring of current thread, claim a free one at the first time if
+ * @claim, the tid is the only syscall, once for each thread. On NUMA host,
+ * the new ring is touched by the owner before it's published, thus all of
+ * the pages are local to the node of owner, and the node is the other
+ * syscall.
+ */
+static struct ulp_ftrace_ring *thread_ring(struct ulp_ftrace_shm *shm,
+					   bool claim)
+{
+	struct ulp_ftrace_ring *ring;
+	unsigned int cpu, node = 0;
+	int i;
+
+	i = ulp_ftrace_owner_claim(shm, thread_pointer(), claim);
+	if (i < 0) {
+		if (claim)
+			__atomic_fetch_add(&shm->lost, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	ring = &shm->rings[i];
+	if (__atomic_load_n(&shm->owners[i].tid, __ATOMIC_RELAXED))
+		return ring;
+
+	if (shm->nr_nodes > 1) {
+		ulp_ftrace_ring_touch(ring, getpagesize());
+		if (syscall(SYS_getcpu, &cpu, &node, NULL))
+			node = 0;
+	}
+	ulp_ftrace_owner_publish(shm, i, syscall(SYS_gettid), node);
+	return ring;
+}
+
+/* vDSO, no syscall */
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Write the entry and the @len bytes of encoded arguments following it, in
+ * one commit, see struct ulp_ftrace_event.
+ */
+static void record_event(struct ulp_ftrace_shm *shm,
+			 struct ulp_ftrace_ring *ring, unsigned long child,
+			 unsigned long parent, const uint8_t *args,
+			 unsigned int len)
+{
+	unsigned int i, n = ULP_FTRACE_ARGS_SLOTS(len), size;
+	struct ulp_ftrace_event *e;
+
+	if (!ulp_ftrace_ring_reserve_n(ring, n + 1))
+		return;
+
+	e = ulp_ftrace_ring_slot(ring, 0);
+	e->ns = now_ns();
+	e->tid = ring->tid;
+	e->type = ULP_FTRACE_ENTRY | len << 16;
+	e->child_ip = child;
+	e->parent_ip = parent;
+
+	/* The slots may wrap around the end of ring */
+	for (i = 0; i < n; i++) {
+		size = len - i * sizeof(*e);
+		if (size > sizeof(*e))
+			size = sizeof(*e);
+		__builtin_memcpy(ulp_ftrace_ring_slot(ring, i + 1)->data,
+				 args + i * sizeof(*e), size);
+	}
+
+	ulp_ftrace_ring_commit_n(ring, n + 1);
+
+	/* Consumer is sleeping and enough events, rare */
+	if (ulp_ftrace_need_wake(shm, ring))
+		syscall(SYS_futex, &shm->futex, FUTEX_WAKE,
+			ULP_FTRACE_MAX_NODES, NULL, NULL, 0);
+}
+
+/**
+ * Push the frame into shadow stack and replace the return address of child
+ * with _ftrace_mcount_return().
+ *
+ * ulftrace clears ULP_FTRACE_F_GRAPH and then waits for the depth of all
+ * rings to be zero before unpatch, the depth is published before the flag
+ * is checked again, both with SEQ_CST, thus either ulftrace sees this frame
+ * or the return is not hooked.
+ */
+static void hook_return(struct ulp_ftrace_shm *shm,
+			struct ulp_ftrace_ring *ring, unsigned long *parent_loc,
+			unsigned long child, int slot)
+{
+	unsigned int depth = ring->depth;
+	struct ulp_ftrace_frame *f;
+
+	if (depth >= ULP_FTRACE_GRAPH_DEPTH) {
+		__atomic_fetch_add(&shm->graph_overflow, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	f = &ring->frames[depth];
+	f->parent = *parent_loc;
+	f->parent_loc = (unsigned long)parent_loc;
+	f->child = child;
+	f->slot = slot;
+
+	__atomic_store_n(&ring->depth, depth + 1, __ATOMIC_SEQ_CST);
+	if (!(__atomic_load_n(&shm->flags, __ATOMIC_SEQ_CST) &
+	      ULP_FTRACE_F_GRAPH)) {
+		__atomic_store_n(&ring->depth, depth, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* The last one, don't count the overhead of hook into duration */
+	f->ns = now_ns();
+	*parent_loc = (unsigned long)_ftrace_mcount_return;
+}
+
+/* Only the owner thread writes the histograms, no atomic instruction */
+static void account_return(struct ulp_ftrace_shm *shm,
+			   struct ulp_ftrace_ring *ring,
+			   const struct ulp_ftrace_frame *f, uint64_t ns)
+{
+	struct ulp_ftrace_counter *cnt = &ring->counters[f->slot];
+	struct ulp_ftrace_hist *hist;
+	int i;
+
+	ns = ns > f->ns ? ns - f->ns : 0;
+
+	if (__atomic_load_n(&shm->flags, __ATOMIC_RELAXED) & ULP_FTRACE_F_COUNT)
+		__atomic_store_n(&cnt->ns, cnt->ns + ns, __ATOMIC_RELAXED);
+
+	for (i = 0; i < ULP_FTRACE_HISTS; i++) {
+		hist = &ring->hists[i];
+		if (hist->ip == f->child)
+			break;
+		if (!hist->ip) {
+			__atomic_store_n(&hist->ip, f->child, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	if (i >= ULP_FTRACE_HISTS) {
+		__atomic_fetch_add(&shm->hist_lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ulp_ftrace_hist_add(hist, ns);
+}
+
+/**
+ * Walk the frame pointers of current thread, the frame record is the saved
+ * frame pointer followed by the return address on both x86_64 and aarch64,
+ * and @parent_loc is the return address of child's frame. The stack is
+ * copied by one process_vm_readv(2) of itself, which stops at the first
+ * unmapped page instead of faulting, then walked in the copy, thus a
+ * broken chain never touches memory out of the thread's own stack.
+ */
+static void record_stack(struct ulp_ftrace_shm *shm,
+			 struct ulp_ftrace_ring *ring,
+			 unsigned long *parent_loc, unsigned long child)
+{
+	unsigned long base = (unsigned long)(parent_loc - 1), fp = base;
+	uint64_t ips[ULP_FTRACE_STACK_DEPTH], *buf = ring->stack_buf;
+	struct iovec local = {
+		.iov_base = buf,
+		.iov_len = sizeof(ring->stack_buf),
+	};
+	struct iovec remote = {
+		.iov_base = (void *)base,
+		.iov_len = sizeof(ring->stack_buf),
+	};
+	unsigned long off, next;
+	uint32_t nr = 0;
+	long n;
+
+	n = syscall(SYS_process_vm_readv, ring->tid, &local, 1, &remote, 1, 0);
+	if (n < 2 * (long)sizeof(uint64_t)) {
+		__atomic_fetch_add(&shm->stack_lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ips[nr++] = child;
+	while (nr < ULP_FTRACE_STACK_DEPTH) {
+		off = (fp - base) / sizeof(uint64_t);
+		if (!buf[off + 1])
+			break;
+		ips[nr++] = buf[off + 1];
+
+		/* The callers are above, the outermost frame pointer is 0 */
+		next = buf[off];
+		if (next <= fp || next & (sizeof(uint64_t) - 1) ||
+		    next - base + 2 * sizeof(uint64_t) > n)
+			break;
+		fp = next;
+	}
+
+	if (!ulp_ftrace_stack_add(shm, ips, nr))
+		__atomic_fetch_add(&shm->stack_lost, 1, __ATOMIC_RELAXED);
+}
+
+static inline int64_t mcount_arg(struct mcount_regs *regs, unsigned int n)
+{
+	switch (n) {
+	case 1: return ARG1(regs);
+	case 2: return ARG2(regs);
+	case 3: return ARG3(regs);
+	case 4: return ARG4(regs);
+	case 5: return ARG5(regs);
+	case 6: return ARG6(regs);
+	}
+	return 0;
+}
+
+/**
+ * Copy the string at @addr by process_vm_readv(2) of itself, like
+ * record_stack(), a bad pointer never faults. Return the length without
+ * the NUL, or -1 if unreadable, @truncated if no NUL in ULP_FTRACE_STR_MAX
+ * bytes.
+ */
+static int read_str(struct ulp_ftrace_ring *ring, unsigned long addr,
+		    uint8_t *buf, bool *truncated)
+{
+	struct iovec local = {
+		.iov_base = buf,
+		.iov_len = ULP_FTRACE_STR_MAX,
+	};
+	struct iovec remote = {
+		.iov_base = (void *)addr,
+		.iov_len = ULP_FTRACE_STR_MAX,
+	};
+	long n, i;
+
+	if (!addr)
+		return -1;
+
+	n = syscall(SYS_process_vm_readv, ring->tid, &local, 1, &remote, 1, 0);
+	if (n <= 0)
+		return -1;
+
+	i = 0;
+	while (i < n && buf[i])
+		i++;
+	*truncated = i == n;
+	return i;
+}
+
+/**
+ * Encode the arguments of @schema into @buf, see enum ulp_ftrace_arg_type,
+ * return the length, ULP_FTRACE_ARGS_MAX bytes at most.
+ */
+static unsigned int encode_args(struct ulp_ftrace_ring *ring,
+				const struct ulp_ftrace_schema *schema,
+				struct mcount_regs *regs, uint8_t *buf)
+{
+	unsigned int i, type;
+	uint8_t *p = buf;
+	bool truncated;
+	int64_t v;
+	int n;
+
+	for (i = 0; i < ULP_FTRACE_PRED_ARGS; i++) {
+		type = schema->type[i];
+		if (type == ULP_FTRACE_ARG_NONE)
+			continue;
+
+		v = mcount_arg(regs, i + 1);
+		if (type == ULP_FTRACE_ARG_STR) {
+			n = read_str(ring, v, p + 2, &truncated);
+			if (n >= 0) {
+				*p++ = ULP_FTRACE_ARG_TAG(i + 1, type);
+				*p++ = n | (truncated ?
+					    ULP_FTRACE_STR_TRUNCATED : 0);
+				p += n;
+				continue;
+			}
+			type = ULP_FTRACE_ARG_HEX;
+		}
+
+		*p++ = ULP_FTRACE_ARG_TAG(i + 1, type);
+		if (type == ULP_FTRACE_ARG_INT)
+			p = ulp_ftrace_put_varint(p, ulp_ftrace_zigzag(v));
+		else
+			p = ulp_ftrace_put_varint(p, v);
+	}
+	return p - buf;
+}
+
+/* All argument predicates match, no ring is needed */
+static bool preds_match(struct ulp_ftrace_shm *shm, struct mcount_regs *regs)
+{
+	const struct ulp_ftrace_pred *pred;
+	unsigned int i;
+
+	for (i = 0; i < shm->nr_preds; i++) {
+		pred = &shm->preds[i];
+		if (!ulp_ftrace_pred_test(pred, mcount_arg(regs, pred->arg)))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * The probe after the trampoline, return the ring if the call is recorded,
+ * NULL if not.
+ */
+static struct ulp_ftrace_ring *probe(struct ulp_ftrace_shm *shm,
+				     uint64_t flags, unsigned long *parent_loc,
+				     unsigned long child,
+				     struct mcount_regs *regs)
+{
+	const struct ulp_ftrace_schema *schema;
+	uint8_t args[ULP_FTRACE_ARGS_MAX];
+	struct ulp_ftrace_ring *ring;
+	struct ulp_ftrace_counter *cnt;
+	unsigned int len = 0;
+	int slot;
+
+	/* Cheap checks first, no ring is claimed for them */
+	slot = ulp_ftrace_filter_index(shm, child);
+	if (slot < 0)
+		return NULL;
+	if (shm->nr_preds && !preds_match(shm, regs))
+		return NULL;
+
+	ring = thread_ring(shm, true);
+	if (!ring)
+		return NULL;
+
+	if (!ulp_ftrace_tid_match(shm, ring->tid) ||
+	    !ulp_ftrace_sample(shm, ring))
+		return NULL;
+
+	/* Count mode, a few loads and one store */
+	if (flags & ULP_FTRACE_F_COUNT) {
+		cnt = &ring->counters[slot];
+		__atomic_store_n(&cnt->calls, cnt->calls + 1, __ATOMIC_RELAXED);
+	}
+	if (flags & ULP_FTRACE_F_EVENTS) {
+		schema = &shm->schemas[slot];
+		if (schema->nr)
+			len = encode_args(ring, schema, regs, args);
+		record_event(shm, ring, child, *parent_loc, args, len);
+	}
+	if (flags & ULP_FTRACE_F_STACK)
+		record_stack(shm, ring, parent_loc, child);
+	if (flags & ULP_FTRACE_F_GRAPH)
+		hook_return(shm, ring, parent_loc, child, slot);
+	return ring;
+}
+
+/**
+ * Only while ulftrace calibrates, the skipped calls of threads without
+ * ring are not accounted.
+ */
+static void measure_probe(struct ulp_ftrace_shm *shm, uint64_t flags,
+			  unsigned long *parent_loc, unsigned long child,
+			  struct mcount_regs *regs)
+{
+	struct ulp_ftrace_ring *ring;
+	struct ulp_ftrace_cost *cost;
+	uint64_t start, cycles;
+
+	start = ulp_ftrace_cycles();
+	ring = probe(shm, flags, parent_loc, child, regs);
+	cycles = ulp_ftrace_cycles() - start;
+
+	if (ring)
+		cost = &ring->costs[ULP_FTRACE_COST_RECORD];
+	else {
+		ring = thread_ring(shm, false);
+		if (!ring)
+			return;
+		cost = &ring->costs[ULP_FTRACE_COST_SKIP];
+	}
+	__atomic_store_n(&cost->cycles, cost->cycles + cycles,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&cost->calls, cost->calls + 1, __ATOMIC_RELEASE);
+}
+
 /* for example:
  * main()
  *  -> _ftrace_mcount()
@@ -32,6 +438,9 @@ extern int try_to_wake_up(struct task_struct *task, int mode, int wake_flags);
 int mcount_entry(unsigned long *parent_loc, unsigned long child,
 		 struct mcount_regs *regs)
 {
+	struct ulp_ftrace_shm *shm;
+	uint64_t flags;
+
 #if defined(ULPATCH_TEST)
 
 	ulp_warning("parent: %p, child: %lx, args: %ld %ld %ld %ld %ld %ld.\n",
@@ -56,18 +465,76 @@ int mcount_entry(unsigned long *parent_loc, unsigned long child,
 
 #endif /* ULPATCH_TEST */
 
-	/* TODO */
+	shm = __atomic_load_n(&ulp_ftrace_shm, __ATOMIC_ACQUIRE);
+	if (!shm)
+		return 0;
+
+	flags = __atomic_load_n(&shm->flags, __ATOMIC_RELAXED);
+	if (!flags)
+		return 0;
+
+	/* Coverage mode, no ring, no predicate, the site is disarmed soon */
+	if (flags & ULP_FTRACE_F_COVER) {
+		ulp_ftrace_cover_hit(shm, child);
+		return 0;
+	}
+
+	if (flags & ULP_FTRACE_F_MEASURE)
+		measure_probe(shm, flags, parent_loc, child, regs);
+	else
+		probe(shm, flags, parent_loc, child, regs);
 	return 0;
 }
 
+/**
+ * The child returns into _ftrace_mcount_return(), pop the frame from shadow
+ * stack, account the duration and return the original return address.
+ *
+ * The hooked return address is already popped from stack, the @parent_loc
+ * of matched frame is below the stack pointer, and the outer frames are all
+ * above it. The frames below the matched one are skipped by longjmp() or
+ * exception, pop them too.
+ */
 unsigned long mcount_exit(long *retval)
 {
+	unsigned long sp = MCOUNT_RETURN_SP(retval);
+	struct ulp_ftrace_shm *shm;
+	struct ulp_ftrace_ring *ring;
+	struct ulp_ftrace_frame *f;
+	unsigned int depth, n = 0;
+	unsigned long parent;
+	uint64_t ns = now_ns();
+
 #if defined(ULPATCH_TEST)
 	printf("CALL mcount_exit.\n");
 #endif /* ULPATCH_TEST */
 
-	/* TODO */
-	return 0;
+	/* Never cleared by ulftrace while any return is hooked */
+	shm = __atomic_load_n(&ulp_ftrace_shm, __ATOMIC_ACQUIRE);
+	ring = shm ? thread_ring(shm, false) : NULL;
+	if (!ring)
+		abort();
+
+	depth = ring->depth;
+	while (depth && ring->frames[depth - 1].parent_loc < sp) {
+		depth--;
+		n++;
+	}
+	/* No way to return, the shadow stack is broken */
+	if (!n)
+		abort();
+
+	if (n > 1)
+		__atomic_fetch_add(&shm->graph_unwound, n - 1,
+				   __ATOMIC_RELAXED);
+
+	f = &ring->frames[depth];
+	account_return(shm, ring, f, ns);
+	parent = f->parent;
+
+	/* Last, ulftrace may unpatch once depth of all rings is zero */
+	__atomic_store_n(&ring->depth, depth, __ATOMIC_RELEASE);
+	return parent;
 }
 
 #if defined(__x86_64__)
@@ -0,0 +1,804 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef __ULP_FTRACE_RING_H
+#define __ULP_FTRACE_RING_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Shared memory between ulftrace and ftrace object in target process, the
+ * ftrace object writes events into the ring of current thread, ulftrace
+ * reads them. Every ring has only one producer (the owner thread) and one
+ * consumer (ulftrace), no lock and no syscall on the fast path.
+ *
+ * The memory is a memfd created in target process, mapped by both sides,
+ * see ulftrace.c.
+ */
+#define ULP_FTRACE_MAGIC	"ulftrace"
+#define ULP_FTRACE_VERSION	10
+
+/* Must be power of 2 */
+#define ULP_FTRACE_MAX_RINGS	64
+#define ULP_FTRACE_RING_EVENTS	4096
+
+#define ULP_FTRACE_CACHELINE	64
+
+/* NUMA nodes of consumers at most, see struct ulp_ftrace_owner */
+#define ULP_FTRACE_MAX_NODES	16
+
+/* Default events in ring to wake up the waiting consumer */
+#define ULP_FTRACE_WATERMARK	(ULP_FTRACE_RING_EVENTS / 4)
+
+/* Traced functions at most, see struct ulp_ftrace_shm::filters */
+#define ULP_FTRACE_MAX_FILTERS	4096
+/* Functions of coverage mode at most, see struct ulp_ftrace_shm::cover */
+#define ULP_FTRACE_MAX_COVER	65536
+
+/* Predicates of arguments and threads, all of them must match */
+#define ULP_FTRACE_MAX_PREDS	8
+#define ULP_FTRACE_MAX_TIDS	16
+/* ARG1(regs) - ARG6(regs) of mcount_regs */
+#define ULP_FTRACE_PRED_ARGS	6
+
+/* Flags of struct ulp_ftrace_shm::flags */
+#define ULP_FTRACE_F_EVENTS	0x1
+#define ULP_FTRACE_F_GRAPH	0x2
+#define ULP_FTRACE_F_COUNT	0x4
+/* Time the probe with the cycle counter, see struct ulp_ftrace_cost */
+#define ULP_FTRACE_F_MEASURE	0x8
+/* Sample the user stack of calls, see struct ulp_ftrace_stack */
+#define ULP_FTRACE_F_STACK	0x10
+/* Mark the first call of functions, see struct ulp_ftrace_shm::cover_bits */
+#define ULP_FTRACE_F_COVER	0x20
+
+/* Hooked returns of one thread at most, the deeper calls are not hooked */
+#define ULP_FTRACE_GRAPH_DEPTH	64
+/* Functions of one thread histogram */
+#define ULP_FTRACE_HISTS	8
+/* log2 buckets of nanoseconds */
+#define ULP_FTRACE_HIST_BUCKETS	64
+
+/**
+ * Captured arguments of the entry event, see struct ulp_ftrace_schema. The
+ * bytes of one string at most, and of the encoded arguments at most.
+ */
+#define ULP_FTRACE_STR_MAX	64
+#define ULP_FTRACE_ARGS_MAX	(ULP_FTRACE_PRED_ARGS * (2 + ULP_FTRACE_STR_MAX))
+
+/**
+ * Stack mode: the frames of one stack at most, the unique stacks of table,
+ * must be power of 2, the slots probed to insert one, and the bytes of the
+ * thread's stack read to walk the frames.
+ */
+#define ULP_FTRACE_STACK_DEPTH	32
+#define ULP_FTRACE_STACKS	4096
+#define ULP_FTRACE_STACK_PROBES	16
+#define ULP_FTRACE_STACK_READ	16384
+
+enum ulp_ftrace_event_type {
+	ULP_FTRACE_ENTRY = 1,
+};
+
+/**
+ * The low 16 bits of @type is enum ulp_ftrace_event_type, the high 16 bits
+ * of the entry is the length of captured arguments. The arguments follow
+ * the entry as raw bytes in ULP_FTRACE_ARGS_SLOTS() slots, committed with
+ * it, thus the consumer always pops them together.
+ */
+struct ulp_ftrace_event {
+	union {
+		struct {
+			/* CLOCK_MONOTONIC */
+			uint64_t ns;
+			uint32_t tid;
+			uint32_t type;
+			uint64_t child_ip;
+			uint64_t parent_ip;
+		};
+		uint8_t data[32];
+	};
+};
+
+#define ULP_FTRACE_EVENT_TYPE(type)	((type) & 0xffff)
+#define ULP_FTRACE_EVENT_ARGS(type)	((type) >> 16)
+
+/* Slots of @len bytes of arguments following the entry */
+#define ULP_FTRACE_ARGS_SLOTS(len)				\
+	(((len) + sizeof(struct ulp_ftrace_event) - 1) /	\
+	 sizeof(struct ulp_ftrace_event))
+
+/**
+ * The arguments are encoded one by one, a tag byte of (arg << 4 | type),
+ * then the zigzag varint of INT, the varint of HEX, or the length byte and
+ * the bytes of STR, the bit 7 of length is set if it's truncated. The STR
+ * is encoded as HEX if it couldn't be read.
+ */
+enum ulp_ftrace_arg_type {
+	ULP_FTRACE_ARG_NONE,
+	ULP_FTRACE_ARG_INT,
+	ULP_FTRACE_ARG_HEX,
+	ULP_FTRACE_ARG_STR,
+};
+#define ULP_FTRACE_ARG_TAG(arg, type)	((arg) << 4 | (type))
+#define ULP_FTRACE_STR_TRUNCATED	0x80
+
+/* The arguments captured of function, @type[N] is of argument N + 1 */
+struct ulp_ftrace_schema {
+	uint8_t type[ULP_FTRACE_PRED_ARGS];
+	uint8_t nr;
+	uint8_t pad;
+};
+
+/**
+ * Frame of shadow stack, the return address at @parent_loc is replaced with
+ * _ftrace_mcount_return(), and @parent is restored by mcount_exit().
+ */
+struct ulp_ftrace_frame {
+	uint64_t parent;
+	uint64_t parent_loc;
+	uint64_t child;
+	uint64_t ns;
+	/* Index of filters, see ulp_ftrace_filter_index() */
+	uint32_t slot;
+	uint32_t pad;
+};
+
+/**
+ * Duration histogram of one function, bucket N counts the calls of duration
+ * in [2^(N-1), 2^N) nanoseconds, bucket 0 is zero duration.
+ */
+struct ulp_ftrace_hist {
+	uint64_t ip;
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[ULP_FTRACE_HIST_BUCKETS];
+};
+
+/**
+ * Count mode, calls of function in slot of ulp_ftrace_filter_index(), and
+ * the time of the returned calls in graph mode.
+ */
+struct ulp_ftrace_counter {
+	uint64_t calls;
+	uint64_t ns;
+};
+
+/**
+ * Unique stack of stack mode, @ips[0] is the traced function, the others
+ * are return addresses, the outermost one at last. The slot is claimed by
+ * CAS of @hash, then @ips and @nr are written, @nr is published at last,
+ * the slot is never released. All threads increase @count.
+ */
+struct ulp_ftrace_stack {
+	uint64_t hash;
+	uint64_t count;
+	uint32_t nr;
+	uint32_t pad;
+	uint64_t ips[ULP_FTRACE_STACK_DEPTH];
+};
+
+/* The traced function covers [start, end) */
+struct ulp_ftrace_filter {
+	uint64_t start;
+	uint64_t end;
+};
+
+enum ulp_ftrace_pred_op {
+	ULP_FTRACE_PRED_EQ = 1,
+	ULP_FTRACE_PRED_NE,
+	ULP_FTRACE_PRED_LT,
+	ULP_FTRACE_PRED_LE,
+	ULP_FTRACE_PRED_GT,
+	ULP_FTRACE_PRED_GE,
+	/* Any bit of @val is set */
+	ULP_FTRACE_PRED_AND,
+};
+
+/* The argument @arg (start from 1) compares with @val, signed */
+struct ulp_ftrace_pred {
+	uint8_t arg;
+	uint8_t op;
+	uint16_t pad[3];
+	int64_t val;
+};
+
+/**
+ * The calls are not recorded (filtered or sampled out) or recorded, the
+ * costs of them are quite different.
+ */
+enum ulp_ftrace_cost_type {
+	ULP_FTRACE_COST_SKIP,
+	ULP_FTRACE_COST_RECORD,
+	ULP_FTRACE_COST_NUM,
+};
+
+/* Cycles of mcount_entry() measured with ULP_FTRACE_F_MEASURE */
+struct ulp_ftrace_cost {
+	uint64_t calls;
+	uint64_t cycles;
+};
+
+/**
+ * Owner of the ring of the same index, out of the rings, thus a thread
+ * probes the owners without touching the pages of other rings, and the
+ * pages of a ring are touched by its owner at first, which are local to
+ * the NUMA node of it, see ulp_ftrace_owner_claim().
+ */
+struct ulp_ftrace_owner {
+	/**
+	 * Thread pointer of owner thread, 0 if free. Claimed by owner with
+	 * CAS, and never released, a new thread reuses the TCB of the exited
+	 * thread inherits the ring.
+	 */
+	uint64_t tp;
+	/* Published by owner at last, the consumer skips the ring if 0 */
+	uint32_t tid;
+	/* Node of owner thread when claimed, where the ring memory is */
+	uint32_t node;
+};
+
+struct ulp_ftrace_ring {
+	/* Copy of struct ulp_ftrace_owner::tid, in the owner's cache line */
+	uint32_t tid;
+	uint32_t pad;
+
+	/* Written by producer only */
+	uint64_t head __attribute__((aligned(ULP_FTRACE_CACHELINE)));
+	uint64_t dropped;
+	/* Calls matched all predicates, before sampling */
+	uint64_t calls;
+	struct ulp_ftrace_cost costs[ULP_FTRACE_COST_NUM];
+
+	/* Written by consumer only */
+	uint64_t tail __attribute__((aligned(ULP_FTRACE_CACHELINE)));
+
+	struct ulp_ftrace_event events[ULP_FTRACE_RING_EVENTS]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+
+	/**
+	 * Written by producer only. The consumer reads @depth to know whether
+	 * any return of this thread is still hooked, and the histograms as
+	 * aggregates, no event of the graph mode goes through the ring.
+	 */
+	uint32_t depth __attribute__((aligned(ULP_FTRACE_CACHELINE)));
+	uint32_t pad2;
+	struct ulp_ftrace_frame frames[ULP_FTRACE_GRAPH_DEPTH];
+	struct ulp_ftrace_hist hists[ULP_FTRACE_HISTS];
+
+	/**
+	 * Written by producer only, the counters of each thread are in its
+	 * own ring, no cache line is shared between threads. The pages are
+	 * not touched until count mode is used.
+	 */
+	struct ulp_ftrace_counter counters[ULP_FTRACE_MAX_FILTERS]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+
+	/**
+	 * Stack mode: the copy of the owner thread's stack, the frames are
+	 * walked in it, see record_stack() of ftrace object.
+	 */
+	uint64_t stack_buf[ULP_FTRACE_STACK_READ / sizeof(uint64_t)]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+};
+
+struct ulp_ftrace_shm {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_rings;
+	/**
+	 * Only trace the child ip in any of @filters, which are sorted by
+	 * address and not overlapped, trace all if @nr_filters is 0. Written
+	 * by consumer before the tracing starts.
+	 */
+	uint32_t nr_filters;
+	/* Record 1 in @sample calls of each thread, 0 or 1 records all */
+	uint32_t sample;
+	/**
+	 * Predicates, checked before recording, written by consumer before
+	 * the tracing starts. Empty @tids means all threads.
+	 */
+	uint32_t nr_preds;
+	uint32_t nr_tids;
+	struct ulp_ftrace_pred preds[ULP_FTRACE_MAX_PREDS];
+	uint32_t tids[ULP_FTRACE_MAX_TIDS];
+	/* Events of threads without ring */
+	uint64_t lost;
+	/* ULP_FTRACE_F_*, cleared by consumer to stop tracing */
+	uint64_t flags;
+	/**
+	 * NUMA nodes of consumers, the rings are not prefaulted by consumer
+	 * if more than one, but touched by the owners, see ftrace object.
+	 */
+	uint32_t nr_nodes;
+	/* Graph mode: calls too deep to hook, or without histogram slot */
+	uint64_t graph_overflow;
+	uint64_t hist_lost;
+	/* Graph mode: frames skipped by longjmp() or exception */
+	uint64_t graph_unwound;
+	/* Stack mode: stacks not walked, or the table is full */
+	uint64_t stack_lost;
+
+	/**
+	 * Consumer sets @waiting and sleeps on @futex, the producer wakes it up
+	 * once any ring has @watermark events, the FUTEX_WAKE is the only
+	 * syscall of producer, and only when the consumer is sleeping. No
+	 * full barrier on the fast path, a missed wakeup is bounded by the
+	 * wait timeout of consumer.
+	 */
+	uint32_t futex __attribute__((aligned(ULP_FTRACE_CACHELINE)));
+	uint32_t waiting;
+	uint32_t watermark;
+
+	struct ulp_ftrace_owner owners[ULP_FTRACE_MAX_RINGS]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+
+	struct ulp_ftrace_filter filters[ULP_FTRACE_MAX_FILTERS];
+	/* Arguments captured of each filter, written with @filters */
+	struct ulp_ftrace_schema schemas[ULP_FTRACE_MAX_FILTERS];
+
+	/**
+	 * Coverage mode: the functions armed, sorted like @filters, and the
+	 * bit of one is set by its first call. ulftrace disarms the sites of
+	 * the marked ones, no probe is hit by them after that.
+	 */
+	uint32_t nr_cover;
+	uint64_t cover_bits[ULP_FTRACE_MAX_COVER / 64]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+	struct ulp_ftrace_filter cover[ULP_FTRACE_MAX_COVER];
+
+	struct ulp_ftrace_ring rings[ULP_FTRACE_MAX_RINGS]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+
+	/* Stack mode: unique stacks of all threads, open addressing */
+	struct ulp_ftrace_stack stacks[ULP_FTRACE_STACKS]
+		__attribute__((aligned(ULP_FTRACE_CACHELINE)));
+};
+
+static inline void ulp_ftrace_shm_init(struct ulp_ftrace_shm *shm)
+{
+	__builtin_memcpy(shm->magic, ULP_FTRACE_MAGIC, sizeof(shm->magic));
+	shm->version = ULP_FTRACE_VERSION;
+	shm->nr_rings = ULP_FTRACE_MAX_RINGS;
+	shm->watermark = ULP_FTRACE_WATERMARK;
+	shm->nr_nodes = 1;
+}
+
+/**
+ * Producer: the ring index of thread @tp, probed from the hash of it, or
+ * claim the first free one if @claim. Return -1 if not found or all of
+ * them are claimed. The claimer owns the ring, and publishes it with
+ * ulp_ftrace_owner_publish() after the ring memory is touched.
+ */
+static inline int ulp_ftrace_owner_claim(struct ulp_ftrace_shm *shm,
+					 uint64_t tp, bool claim)
+{
+	unsigned int i, idx, mask = ULP_FTRACE_MAX_RINGS - 1;
+	struct ulp_ftrace_owner *o;
+	uint64_t cur;
+
+	idx = (tp >> 12) ^ (tp >> 20);
+
+	for (i = 0; i < ULP_FTRACE_MAX_RINGS; i++) {
+		o = &shm->owners[(idx + i) & mask];
+
+		cur = __atomic_load_n(&o->tp, __ATOMIC_ACQUIRE);
+		if (cur == tp)
+			return o - shm->owners;
+		if (cur)
+			continue;
+		if (!claim)
+			break;
+
+		if (__atomic_compare_exchange_n(&o->tp, &cur, tp, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return o - shm->owners;
+	}
+	return -1;
+}
+
+static inline void ulp_ftrace_owner_publish(struct ulp_ftrace_shm *shm,
+					    int i, uint32_t tid,
+					    uint32_t node)
+{
+	shm->rings[i].tid = tid;
+	shm->owners[i].node = node;
+	__atomic_store_n(&shm->owners[i].tid, tid, __ATOMIC_RELEASE);
+}
+
+/* Consumer: the ring @i is published by owner, see ulp_ftrace_owner */
+static inline bool ulp_ftrace_ring_live(const struct ulp_ftrace_shm *shm,
+					unsigned int i)
+{
+	return __atomic_load_n(&shm->owners[i].tid, __ATOMIC_ACQUIRE) != 0;
+}
+
+/**
+ * Producer: write fault every page of the new claimed ring, the shmem page
+ * is allocated on the node of current thread. The RMW of zero keeps the
+ * page shared with the neighbor ring intact.
+ */
+static inline void ulp_ftrace_ring_touch(struct ulp_ftrace_ring *ring,
+					 unsigned long page_size)
+{
+	uint64_t *p = (uint64_t *)ring, *end = (uint64_t *)(ring + 1);
+
+	for (; p < end; p += page_size / sizeof(*p))
+		__atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(end - 1, 0, __ATOMIC_RELAXED);
+}
+
+/* The index of range in sorted @base that covers @ip, -1 if none */
+static inline int ulp_ftrace_range_index(const struct ulp_ftrace_filter *base,
+					 uint32_t n, uint64_t ip)
+{
+	const struct ulp_ftrace_filter *p = base;
+	uint32_t half;
+
+	if (!n)
+		return -1;
+
+	/* The last range starts at or below @ip */
+	while (n > 1) {
+		half = n / 2;
+		if (p[half].start <= ip)
+			p += half;
+		n -= half;
+	}
+	return ip >= p->start && ip < p->end ? p - base : -1;
+}
+
+/**
+ * Producer: the index of filter that covers @ip, binary search, -1 if @ip
+ * is not traced. Always 0 if no filter.
+ */
+static inline int ulp_ftrace_filter_index(const struct ulp_ftrace_shm *shm,
+					  uint64_t ip)
+{
+	if (!shm->nr_filters)
+		return 0;
+	return ulp_ftrace_range_index(shm->filters, shm->nr_filters, ip);
+}
+
+static inline bool ulp_ftrace_filter_match(const struct ulp_ftrace_shm *shm,
+					   uint64_t ip)
+{
+	return ulp_ftrace_filter_index(shm, ip) >= 0;
+}
+
+/**
+ * Producer: mark the function covers @ip as called. The bit is tested
+ * first, the cache line is only written by the first calls, before the
+ * site is disarmed.
+ */
+static inline void ulp_ftrace_cover_hit(struct ulp_ftrace_shm *shm,
+					uint64_t ip)
+{
+	uint64_t *word, bit;
+	int i;
+
+	i = ulp_ftrace_range_index(shm->cover, shm->nr_cover, ip);
+	if (i < 0)
+		return;
+
+	word = &shm->cover_bits[i / 64];
+	bit = 1ULL << (i % 64);
+	if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+		__atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+}
+
+/* Consumer: the function @i of coverage table is called or not */
+static inline bool ulp_ftrace_cover_test(const struct ulp_ftrace_shm *shm,
+					 uint32_t i)
+{
+	return __atomic_load_n(&shm->cover_bits[i / 64], __ATOMIC_RELAXED) &
+	       (1ULL << (i % 64));
+}
+
+/* Producer: the argument value @v matches @pred or not */
+static inline bool ulp_ftrace_pred_test(const struct ulp_ftrace_pred *pred,
+					int64_t v)
+{
+	switch (pred->op) {
+	case ULP_FTRACE_PRED_EQ:
+		return v == pred->val;
+	case ULP_FTRACE_PRED_NE:
+		return v != pred->val;
+	case ULP_FTRACE_PRED_LT:
+		return v < pred->val;
+	case ULP_FTRACE_PRED_LE:
+		return v <= pred->val;
+	case ULP_FTRACE_PRED_GT:
+		return v > pred->val;
+	case ULP_FTRACE_PRED_GE:
+		return v >= pred->val;
+	case ULP_FTRACE_PRED_AND:
+		return (v & pred->val) != 0;
+	}
+	return false;
+}
+
+/* Producer: the thread @tid is traced or not */
+static inline bool ulp_ftrace_tid_match(const struct ulp_ftrace_shm *shm,
+					uint32_t tid)
+{
+	uint32_t i;
+
+	if (!shm->nr_tids)
+		return true;
+	for (i = 0; i < shm->nr_tids; i++) {
+		if (shm->tids[i] == tid)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Producer: 1 in shm::sample calls of ring is recorded, the first call is
+ * always recorded, no division if the sample is a power of 2.
+ */
+static inline bool ulp_ftrace_sample(const struct ulp_ftrace_shm *shm,
+				     struct ulp_ftrace_ring *ring)
+{
+	uint64_t n = ring->calls++;
+	uint32_t sample = shm->sample;
+
+	if (sample <= 1)
+		return true;
+	if (!(sample & (sample - 1)))
+		return !(n & (sample - 1));
+	return !(n % sample);
+}
+
+/**
+ * The constant rate cycle counter, shared by all CPUs, no syscall. The TSC
+ * frequency is calibrated by consumer, the generic timer has CNTFRQ_EL0.
+ */
+static inline uint64_t ulp_ftrace_cycles(void)
+{
+#if defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+	return v;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Consumer: average cycles of one call of @cost, @read is the cycles of
+ * reading the counter twice, which is measured too, 0 if no call.
+ */
+static inline uint64_t ulp_ftrace_cost_cycles(
+	const struct ulp_ftrace_cost *cost, uint64_t read)
+{
+	uint64_t overhead = cost->calls * read;
+
+	if (!cost->calls || cost->cycles <= overhead)
+		return 0;
+	return (cost->cycles - overhead) / cost->calls;
+}
+
+/**
+ * Producer: reserve the next event of ring, NULL if the ring is full, then
+ * the event is dropped. Publish it with ulp_ftrace_ring_commit().
+ */
+static inline struct ulp_ftrace_event *
+ulp_ftrace_ring_reserve(struct ulp_ftrace_ring *ring)
+{
+	uint64_t head = ring->head;
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= ULP_FTRACE_RING_EVENTS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return (void *)0;
+	}
+	return &ring->events[head & (ULP_FTRACE_RING_EVENTS - 1)];
+}
+
+static inline void ulp_ftrace_ring_commit(struct ulp_ftrace_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Producer: reserve @n slots, the entry and its arguments, all or none, see
+ * ulp_ftrace_ring_slot(). Return false and count one drop if the ring is
+ * full.
+ */
+static inline bool ulp_ftrace_ring_reserve_n(struct ulp_ftrace_ring *ring,
+					     unsigned int n)
+{
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->head - tail + n > ULP_FTRACE_RING_EVENTS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+/* Producer: the slot @i of the reserved ones */
+static inline struct ulp_ftrace_event *
+ulp_ftrace_ring_slot(struct ulp_ftrace_ring *ring, unsigned int i)
+{
+	return &ring->events[(ring->head + i) & (ULP_FTRACE_RING_EVENTS - 1)];
+}
+
+static inline void ulp_ftrace_ring_commit_n(struct ulp_ftrace_ring *ring,
+					    unsigned int n)
+{
+	__atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+/* Producer: number of events not consumed yet */
+static inline uint64_t ulp_ftrace_ring_used(struct ulp_ftrace_ring *ring)
+{
+	return ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Producer: the consumer should be woken up, the caller owns the wakeup if
+ * true returned, see struct ulp_ftrace_shm::futex.
+ */
+static inline bool ulp_ftrace_need_wake(struct ulp_ftrace_shm *shm,
+					struct ulp_ftrace_ring *ring)
+{
+	if (!__atomic_load_n(&shm->waiting, __ATOMIC_RELAXED) ||
+	    ulp_ftrace_ring_used(ring) < shm->watermark)
+		return false;
+	if (!__atomic_exchange_n(&shm->waiting, 0, __ATOMIC_ACQ_REL))
+		return false;
+	__atomic_fetch_add(&shm->futex, 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * Consumer: pop at most @n events into @e, the tail is updated once for
+ * all of them. Return the number of events.
+ */
+static inline unsigned int ulp_ftrace_ring_pop_batch(
+	struct ulp_ftrace_ring *ring, struct ulp_ftrace_event *e,
+	unsigned int n)
+{
+	uint64_t tail = ring->tail;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned int i;
+
+	if (head - tail < n)
+		n = head - tail;
+
+	for (i = 0; i < n; i++)
+		e[i] = ring->events[(tail + i) & (ULP_FTRACE_RING_EVENTS - 1)];
+
+	if (n)
+		__atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Consumer: pop one event into @e, return false if ring is empty */
+static inline bool ulp_ftrace_ring_pop(struct ulp_ftrace_ring *ring,
+				       struct ulp_ftrace_event *e)
+{
+	uint64_t tail = ring->tail;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (tail == head)
+		return false;
+
+	*e = ring->events[tail & (ULP_FTRACE_RING_EVENTS - 1)];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* LEB128 varint, 10 bytes at most */
+static inline uint8_t *ulp_ftrace_put_varint(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline uint64_t ulp_ftrace_zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/* FNV-1a of the @nr frames of stack, never 0, which is the free slot */
+static inline uint64_t ulp_ftrace_stack_hash(const uint64_t *ips,
+					     uint32_t nr)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		h ^= ips[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h ?: 1;
+}
+
+/**
+ * Producer: count one call of the stack of @nr frames @ips, the stacks of
+ * the same hash are the same one. Return false if the table is full.
+ */
+static inline bool ulp_ftrace_stack_add(struct ulp_ftrace_shm *shm,
+					const uint64_t *ips, uint32_t nr)
+{
+	uint64_t h = ulp_ftrace_stack_hash(ips, nr), cur;
+	struct ulp_ftrace_stack *s;
+	uint32_t i, j;
+
+	for (i = 0; i < ULP_FTRACE_STACK_PROBES; i++) {
+		s = &shm->stacks[(h + i) & (ULP_FTRACE_STACKS - 1)];
+		cur = __atomic_load_n(&s->hash, __ATOMIC_RELAXED);
+		if (!cur && __atomic_compare_exchange_n(&s->hash, &cur, h,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			for (j = 0; j < nr; j++)
+				s->ips[j] = ips[j];
+			__atomic_store_n(&s->nr, nr, __ATOMIC_RELEASE);
+			cur = h;
+		}
+		if (cur == h) {
+			__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Bucket of duration @ns, see struct ulp_ftrace_hist */
+static inline unsigned int ulp_ftrace_hist_bucket(uint64_t ns)
+{
+	unsigned int b = ns ? 64 - __builtin_clzll(ns) : 0;
+	return b < ULP_FTRACE_HIST_BUCKETS ? b : ULP_FTRACE_HIST_BUCKETS - 1;
+}
+
+/* Producer: account one call of @ns into @hist */
+static inline void ulp_ftrace_hist_add(struct ulp_ftrace_hist *hist,
+				       uint64_t ns)
+{
+	hist->buckets[ulp_ftrace_hist_bucket(ns)]++;
+	hist->sum_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Consumer: the upper bound nanoseconds of the bucket that holds the
+ * @pct percentile of @hist, 0 if no call. The bucket resolution is a
+ * power of 2, the result is at most 2 times of the real percentile.
+ */
+static inline uint64_t ulp_ftrace_hist_percentile(
+	const struct ulp_ftrace_hist *hist, unsigned int pct)
+{
+	uint64_t sum = 0, count = 0, rank;
+	unsigned int b;
+
+	for (b = 0; b < ULP_FTRACE_HIST_BUCKETS; b++)
+		count += hist->buckets[b];
+	if (!count)
+		return 0;
+
+	/* The rank-th call, start from 1 */
+	rank = (count * pct + 99) / 100 ?: 1;
+
+	for (b = 0; b < ULP_FTRACE_HIST_BUCKETS; b++) {
+		sum += hist->buckets[b];
+		if (sum >= rank)
+			break;
+	}
+	return b ? 1ULL << b : 0;
+}
+
+#endif /* __ULP_FTRACE_RING_H */
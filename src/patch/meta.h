@@ -19,11 +19,16 @@
  * Use to check ulp file is support version or not. If any changes occur to the
  * metadata structure, we should increase this version number.
  */
-#define ULPATCH_FILE_VERSION	3
+#define ULPATCH_FILE_VERSION	4
+/* The oldest readable version, which has no SEC_ULPATCH_INDEX */
+#define ULPATCH_FILE_VERSION_MIN	3
 
 #define SEC_ULPATCH_MAGIC	".ULPATCH"
 #define SEC_ULPATCH_STRTAB	".ulpatch.strtab"
 #define SEC_ULPATCH_INFO	".ulpatch.info"
+#define SEC_ULPATCH_INDEX	".ulpatch.index"
+#define SEC_ULPATCH_COUNTER	".ulpatch.counter"
+#define SEC_ULPATCH_ORIG	".ulpatch.orig"
 
 #ifndef __stringify
 #define __stringify_1(x...)	#x
@@ -37,8 +42,11 @@
  * @dst_func: the destination function in target task
  * @author: who wrote this patch code
  *
- * FIXME: We should split author to a single macro like ULPATCH_AUTHOR(), maybe
- * one ulp file has multi ULPATCH_INFO()
+ * One ulp file could has multi ULPATCH_INFO(), the N-th string group of
+ * SEC_ULPATCH_STRTAB matches the N-th struct ulpatch_info of
+ * SEC_ULPATCH_INFO, all of them are applied and rolled back as a whole.
+ *
+ * FIXME: We should split author to a single macro like ULPATCH_AUTHOR().
  */
 #define ULPATCH_INFO(src_func, dst_func, author) \
 __asm__ (								\
@@ -60,8 +68,38 @@ __asm__ (								\
 	"	.long " __stringify(ULPATCH_FILE_VERSION) " \n"		\
 	"	.byte 0x11, 0x22, 0x33, 0x44 \n"			\
 	".popsection \n"						\
+	".pushsection " SEC_ULPATCH_INDEX ", \"a\", @progbits\n"	\
+	"	.fill 32, 1, 0\n" /* struct ulpatch_index */		\
+	".popsection \n"						\
+	".pushsection " SEC_ULPATCH_COUNTER ", \"awx\", @progbits\n"	\
+	"	.balign 64\n"						\
+	"	.fill 128, 1, 0\n" /* struct ulpatch_counter */	\
+	".popsection \n"						\
+	".pushsection " SEC_ULPATCH_ORIG ", \"awx\", @progbits\n"	\
+	"	.balign 8\n"						\
+	"	.fill 128, 1, 0\n" /* struct ulpatch_orig */		\
+	".popsection \n"						\
 );
 
+/**
+ * The original dst_func of ULPATCH_INFO(), the patch function could wrap
+ * it instead of replacing the whole body, for example:
+ *
+ *   extern int ULPATCH_ORIG(foo)(int arg);
+ *
+ *   int patch_foo(int arg)
+ *   {
+ *           if (arg < 0)
+ *                   return -EINVAL;
+ *           return ULPATCH_ORIG(foo)(arg);
+ *   }
+ *   ULPATCH_INFO(patch_foo, foo, "Author");
+ *
+ * See struct ulpatch_orig.
+ */
+#define ULP_ORIG_SUFFIX		"__ulp_orig"
+#define ULPATCH_ORIG(dst_func)	dst_func##__ulp_orig
+
 /**
  * each element point each string in SEC_ULPATCH_STRTAB
  *
@@ -94,6 +132,29 @@ struct ulpatch_info {
 	/* Record the live patch was patched time */
 	unsigned long time;
 
+	/**
+	 * ULP_INFO_F_GOT: virtual_addr is the GOT slot of target function,
+	 * only orig_code[0], the original address in the slot, is replaced.
+	 */
+#define ULP_INFO_F_GOT	0x1
+	/**
+	 * ULP_INFO_F_JMP_TABLE: the entry is struct jmp_table_entry even if
+	 * the patch is near enough, only the address is replaced when the
+	 * patch is updated, see update_patch().
+	 */
+#define ULP_INFO_F_JMP_TABLE	0x2
+	/**
+	 * ULP_INFO_F_COUNTER: patch_func_addr is the trampoline of struct
+	 * ulpatch_counter, which counts the calls and jumps to the patch
+	 * function.
+	 */
+#define ULP_INFO_F_COUNTER	0x4
+	/**
+	 * ULP_INFO_F_VENEER: the patch is out of range of direct jump, the
+	 * entry is the direct jump to a veneer near it, which jumps to
+	 * patch_func_addr, see struct ulp_veneer_hdr.
+	 */
+#define ULP_INFO_F_VENEER	0x8
 	unsigned int flags;
 
 	/* Must be ULPATCH_FILE_VERSION */
@@ -102,3 +163,62 @@ struct ulpatch_info {
 	char pad[4];
 } __attribute__((packed));
 
+/**
+ * SEC_ULPATCH_INDEX section, one entry for each ULPATCH_INFO(), all zero in
+ * the object file, filled in when the patch is loaded. The readers of the
+ * loaded patch, such as ulpinfo, jump straight to the sections and symbols,
+ * without looking up the section names or walking the symtab.
+ *
+ * The section index of SEC_ULPATCH_INDEX itself is stored in the padding of
+ * ELF e_ident, see ULP_EI_INDEX.
+ */
+struct ulpatch_index {
+#define ULPATCH_INDEX_MAGIC	0x58444955 /* "UIDX" */
+	unsigned int magic;
+
+	/* Section indexes, the same in every entry */
+	unsigned short sec_info;
+	unsigned short sec_strtab;
+	unsigned short sec_build_id;
+	unsigned short sec_symtab;
+
+	/* Symbol indexes of src_func and dst_func, 0 if not in symtab */
+	unsigned int src_sym;
+	unsigned int dst_sym;
+
+	/* Number of unique undefined symbols of patch */
+	unsigned int nr_undefs;
+
+	/* SEC_ULPATCH_COUNTER if loaded with counters, otherwise 0 */
+	unsigned short sec_counter;
+
+	char pad[6];
+} __attribute__((packed));
+
+/**
+ * SEC_ULPATCH_COUNTER section, one entry for each ULPATCH_INFO(), all zero
+ * in the object file. If the patch is loaded with counters, the target
+ * function jumps to the trampoline generated by loader, which bumps the
+ * count and jumps to the patch function, see ULP_INFO_F_COUNTER.
+ */
+struct ulpatch_counter {
+	/* Alone in the cache line, never shares it with the code */
+	unsigned long count;
+	char pad[56];
+
+	unsigned char tramp[56];
+	/* The patch function */
+	unsigned long addr;
+} __attribute__((packed));
+
+/**
+ * SEC_ULPATCH_ORIG section, one entry for each ULPATCH_INFO(), all zero in
+ * the object file. If the patch calls ULPATCH_ORIG(dst_func), the loader
+ * relocates the instructions overwritten by the jump into the trampoline,
+ * which jumps back to the rest of dst_func, see setup_orig_tramps().
+ */
+struct ulpatch_orig {
+	unsigned char tramp[120];
+	/* The rest of dst_func */
+	unsigned long addr;
+} __attribute__((packed));
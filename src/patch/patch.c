@@ -9,12 +9,19 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/syscall.h>
 #include <time.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #include <elf/elf-api.h>
 #include <utils/disasm.h>
 #include <utils/log.h>
 #include <utils/list.h>
+#include <utils/memstat.h>
+#include <utils/emit.h>
 #include <task/task.h>
 #include <utils/compiler.h>
 
@@ -60,10 +67,17 @@ void print_ulp_info(FILE *fp, const char *pfx, struct ulpatch_info *inf)
 
 	snprintf(disasm_pfx, sizeof(disasm_pfx) - 1, "%s             ", prefix);
 
+	/* The GOT slot stores an address, not code */
+	if (inf->flags & ULP_INFO_F_GOT)
+		fprintf(fp, "%sGOT slot %#016lx: %#016lx -> %#016lx\n",
+			disasm_pfx, inf->virtual_addr, inf->orig_code[0],
+			inf->patch_func_addr);
+
 	/**
 	 * If orig_code fill 0x00, no need to display.
 	 */
-	if (memcmp(zero_code, inf->orig_code, sizeof(inf->orig_code))) {
+	if (!(inf->flags & ULP_INFO_F_GOT) &&
+	    memcmp(zero_code, inf->orig_code, sizeof(inf->orig_code))) {
 		fprintf(fp, "%s----- orig code ------\n", disasm_pfx);
 		fdisasm_arch(fp, disasm_pfx, inf->target_func_addr,
 			     (void *)inf->orig_code, sizeof(inf->orig_code));
@@ -74,7 +88,8 @@ void print_ulp_info(FILE *fp, const char *pfx, struct ulpatch_info *inf)
 	 * find_vma() use to ensure address is exist in target task address
 	 * space.
 	 */
-	if (current != zero_task && find_vma(current, inf->target_func_addr)) {
+	if (!(inf->flags & ULP_INFO_F_GOT) && current != zero_task &&
+	    find_vma(current, inf->target_func_addr)) {
 		memcpy_from_task(current, (void *)&insn, inf->target_func_addr,
 				 sizeof(insn));
 		fprintf(fp, "%s----- jmp table ------\n", disasm_pfx);
@@ -110,14 +125,48 @@ void print_ulp_info(FILE *fp, const char *pfx, struct ulpatch_info *inf)
 		inf->pad[2], inf->pad[3]);
 }
 
+/**
+ * Emit an array of @nr functions of patch, the fields of print_ulp_strtab()
+ * and print_ulp_info(), without the disassembly.
+ */
+void emit_ulp_funcs(struct emitter *e, struct ulpatch_strtab *strtabs,
+		    struct ulpatch_info *infos, unsigned int nr)
+{
+	unsigned int i;
+
+	emit_array(e, nr);
+	for (i = 0; i < nr; i++) {
+		emit_map(e, 10);
+		emit_kv_u64(e, "id", infos[i].ulp_id);
+		emit_kv_str(e, "src_func", strtabs[i].src_func);
+		emit_kv_str(e, "dst_func", strtabs[i].dst_func);
+		emit_kv_str(e, "author", strtabs[i].author);
+		emit_kv_u64(e, "target_addr", infos[i].target_func_addr);
+		emit_kv_u64(e, "patch_addr", infos[i].patch_func_addr);
+		emit_kv_u64(e, "virtual_addr", infos[i].virtual_addr);
+		emit_kv_u64(e, "time", infos[i].time);
+		emit_kv_u64(e, "flags", infos[i].flags);
+		emit_kv_u64(e, "version", infos[i].version);
+	}
+}
+
 /* free load_info */
 void release_load_info(struct load_info *info)
 {
 	if (info->patch.mmap) {
+		ulp_mem_account(ULP_MEM_LOAD_INFO, -(long)info->patch.mmap->size,
+				-1);
 		fmunmap(info->patch.mmap);
 		info->patch.mmap = NULL;
 	}
 
+	if (info->patch.obj) {
+		ulp_mem_account(ULP_MEM_LOAD_INFO, -(long)info->patch.obj->size,
+				0);
+		fmunmap(info->patch.obj);
+		info->patch.obj = NULL;
+	}
+
 	if (info->patch.path) {
 		free(info->patch.path);
 		info->patch.path = NULL;
@@ -132,10 +181,29 @@ void release_load_info(struct load_info *info)
 		free(info->ulp_name);
 		info->ulp_name = NULL;
 	}
+
+	if (info->ulp_strtabs) {
+		free(info->ulp_strtabs);
+		info->ulp_strtabs = NULL;
+	}
+
+	free(info->src_syms);
+	info->src_syms = NULL;
+	free(info->dst_syms);
+	info->dst_syms = NULL;
+	free(info->orig_undefs);
+	info->orig_undefs = NULL;
+
+	free(info->undef.names);
+	free(info->undef.addrs);
+	free(info->undef.weak);
+	free(info->undef.of_sym);
+	memset(&info->undef, 0, sizeof(info->undef));
 }
 
-/* Make ulp file name. */
-static char *__make_pid_ulpname(pid_t pid, char *buf, size_t buf_len)
+/* Make ulp file name, @seed is like ulp-XXXXXX */
+static char *__make_pid_ulpname(pid_t pid, char *buf, size_t buf_len,
+				char *seed)
 {
 	char buffer1[PATH_MAX];
 	const char *s;
@@ -143,7 +211,7 @@ static char *__make_pid_ulpname(pid_t pid, char *buf, size_t buf_len)
 
 make:
 	/* make ulp-XXXXXX temp file name */
-	s = fmktempname(buffer1, PATH_MAX, PATCH_VMA_TEMP_PREFIX "XXXXXX");
+	s = fmktempname(buffer1, PATH_MAX, seed);
 	if (!s)
 		goto make;
 
@@ -173,10 +241,134 @@ static int __chk_load_info_len(struct load_info *info)
 	return 0;
 }
 
+/**
+ * Only the sections target needs are in the patch image mapped into target,
+ * the relocations, debug info and other host-side sections are read from
+ * the object file, they are SHT_NULL in the image:
+ *
+ *   ELF header | text | rodata | symtab, strtab, notes | section headers |
+ *   page aligned, writable data
+ *
+ * Every text section is cache line aligned, the writable data never shares
+ * a page with text. The section indexes are kept.
+ */
+enum patch_sec_class {
+	PATCH_SEC_TEXT,
+	PATCH_SEC_RODATA,
+	PATCH_SEC_META,
+	PATCH_SEC_DATA,
+	PATCH_SEC_HOST,
+};
+
+#define PATCH_TEXT_ALIGN	64
+
+static enum patch_sec_class patch_sec_class(const GElf_Shdr *shdr)
+{
+	if (shdr->sh_flags & SHF_ALLOC) {
+		if (shdr->sh_flags & SHF_WRITE)
+			return PATCH_SEC_DATA;
+		if (shdr->sh_flags & SHF_EXECINSTR)
+			return PATCH_SEC_TEXT;
+		return PATCH_SEC_RODATA;
+	}
+
+	switch (shdr->sh_type) {
+	case SHT_SYMTAB:
+	case SHT_STRTAB:
+	case SHT_NOTE:
+		return PATCH_SEC_META;
+	default:
+		return PATCH_SEC_HOST;
+	}
+}
+
+/**
+ * Lay out the sections of object @ehdr of @len bytes, the new offsets are
+ * set in @shdrs, the copy of section headers. Return the size of image, or
+ * 0 if the object is invalid.
+ */
+static unsigned long layout_patch_image(const GElf_Ehdr *ehdr,
+					unsigned long len, GElf_Shdr *shdrs)
+{
+	unsigned long off = sizeof(GElf_Ehdr), align;
+	enum patch_sec_class c;
+	bool has_data = false;
+	unsigned int i;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		if (shdrs[i].sh_type != SHT_NOBITS &&
+		    (shdrs[i].sh_offset > len ||
+		     shdrs[i].sh_size > len - shdrs[i].sh_offset)) {
+			ulp_error("Section %u truncated.\n", i);
+			return 0;
+		}
+		align = shdrs[i].sh_addralign;
+		if (align & (align - 1)) {
+			ulp_error("Section %u bad align %lu.\n", i, align);
+			return 0;
+		}
+		if (patch_sec_class(&shdrs[i]) == PATCH_SEC_DATA)
+			has_data = true;
+	}
+
+	for (c = PATCH_SEC_TEXT; c < PATCH_SEC_HOST; c++) {
+		if (c == PATCH_SEC_DATA) {
+			off = ROUND_UP(off, sizeof(GElf_Shdr));
+			shdrs[0].sh_offset = off;
+			off += ehdr->e_shnum * sizeof(GElf_Shdr);
+			if (has_data)
+				off = PAGE_UP(off);
+		}
+		for (i = 1; i < ehdr->e_shnum; i++) {
+			if (patch_sec_class(&shdrs[i]) != c)
+				continue;
+			align = shdrs[i].sh_addralign ?: 1;
+			if (c == PATCH_SEC_TEXT)
+				align = MAX(align, PATCH_TEXT_ALIGN);
+			off = ROUND_UP(off, align);
+			shdrs[i].sh_offset = off;
+			if (shdrs[i].sh_type != SHT_NOBITS)
+				off += shdrs[i].sh_size;
+		}
+	}
+	return off;
+}
+
+/* Build the patch image of object @obj into @img, see layout_patch_image() */
+static void build_patch_image(const GElf_Ehdr *obj, GElf_Shdr *shdrs,
+			      void *img)
+{
+	const GElf_Shdr *osec = (void *)obj + obj->e_shoff;
+	GElf_Ehdr *ehdr = img;
+	unsigned int i;
+
+	memcpy(ehdr, obj, sizeof(GElf_Ehdr));
+	ehdr->e_shoff = shdrs[0].sh_offset;
+
+	for (i = 1; i < obj->e_shnum; i++) {
+		if (patch_sec_class(&shdrs[i]) == PATCH_SEC_HOST) {
+			shdrs[i].sh_type = SHT_NULL;
+			shdrs[i].sh_flags = 0;
+			shdrs[i].sh_offset = 0;
+			shdrs[i].sh_size = 0;
+			continue;
+		}
+		if (shdrs[i].sh_type != SHT_NOBITS)
+			memcpy(img + shdrs[i].sh_offset,
+			       (void *)obj + osec[i].sh_offset,
+			       shdrs[i].sh_size);
+	}
+
+	shdrs[0] = osec[0];
+	memcpy(img + ehdr->e_shoff, shdrs, obj->e_shnum * sizeof(GElf_Shdr));
+}
+
 /* see linux:kernel/module.c */
 int alloc_patch_file(const char *obj_from, const char *ulp_file,
 		     struct load_info *info)
 {
+	GElf_Shdr *shdrs = NULL;
+	GElf_Ehdr *obj;
 	int err = 0;
 
 	/* source object file must exist. */
@@ -189,55 +381,290 @@ int alloc_patch_file(const char *obj_from, const char *ulp_file,
 	info->ulp_name = strdup(obj_from);
 	info->patch.path = strdup(ulp_file);
 
-	info->len = fsize(obj_from);
-	if (info->len < sizeof(*(info->hdr))) {
+	info->patch.obj = fmmap_rdonly(obj_from);
+	if (!info->patch.obj) {
+		ulp_error("%s: fmmap failed.\n", obj_from);
+		err = -EIO;
+		goto out;
+	}
+	/* The mapped object and image, one load_info */
+	ulp_mem_account(ULP_MEM_LOAD_INFO, info->patch.obj->size, 0);
+
+	obj = info->patch.obj->mem;
+	if (info->patch.obj->size < sizeof(*obj)) {
 		ulp_error("%s truncated.\n", obj_from);
 		err = -ENOEXEC;
-		goto out;
+		goto free_out;
+	}
+
+	if (!ehdr_magic_ok(obj)) {
+		ulp_error("Invalid ELF format: %s\n", obj_from);
+		err = -ENOEXEC;
+		goto free_out;
+	}
+
+	info->hdr = obj;
+	info->len = info->patch.obj->size;
+	err = __chk_load_info_len(info);
+	info->hdr = NULL;
+	if (err || !obj->e_shnum) {
+		err = -ENOEXEC;
+		goto free_out;
+	}
+
+	shdrs = malloc(obj->e_shnum * sizeof(GElf_Shdr));
+	if (!shdrs) {
+		err = -ENOMEM;
+		goto free_out;
+	}
+	memcpy(shdrs, (void *)obj + obj->e_shoff,
+	       obj->e_shnum * sizeof(GElf_Shdr));
+
+	info->len = layout_patch_image(obj, info->patch.obj->size, shdrs);
+	if (!info->len) {
+		err = -ENOEXEC;
+		goto free_out;
 	}
 
-	/* allocate memory for object file */
 	info->patch.mmap = fmmap_shmem_create(info->patch.path, info->len);
 	if (!info->patch.mmap) {
 		ulp_error("%s: fmmap failed.\n", info->patch.path);
-		err = -1;
+		err = -EIO;
+		goto free_out;
+	}
+	ulp_mem_account(ULP_MEM_LOAD_INFO, info->patch.mmap->size, 1);
+
+	build_patch_image(obj, shdrs, info->patch.mmap->mem);
+
+	ulp_debug("Patch image %lu bytes of object %lu bytes.\n", info->len,
+		  info->patch.obj->size);
+
+	/* This is the header of brand new patch image. */
+	info->hdr = info->patch.mmap->mem;
+
+out:
+	free(shdrs);
+	return err;
+
+free_out:
+	free(shdrs);
+	release_load_info(info);
+	return err;
+}
+
+/**
+ * Map the patch object @obj in place read-only, only for reading metadata,
+ * see setup_load_info(). Nothing is written, thus the load_info must never
+ * be relocated or loaded, use alloc_patch_file() for that.
+ */
+int open_patch_file(const char *obj, struct load_info *info)
+{
+	int err = 0;
+
+	if (!fexist(obj)) {
+		ulp_error("%s not exist.\n", obj);
+		return -EEXIST;
+	}
+
+	info->ulp_name = strdup(obj);
+
+	info->patch.mmap = fmmap_rdonly(obj);
+	if (!info->patch.mmap) {
+		ulp_error("%s: fmmap failed.\n", obj);
+		err = -EIO;
 		goto out;
 	}
+	ulp_mem_account(ULP_MEM_LOAD_INFO, info->patch.mmap->size, 1);
 
-	/* copy from file */
-	if (fmemcpy(info->patch.mmap->mem, info->len, obj_from) != info->len) {
-		ulp_error("copy chunk failed.\n");
-		err = -EFAULT;
+	info->len = info->patch.mmap->size;
+	if (info->len < sizeof(*(info->hdr))) {
+		ulp_error("%s truncated.\n", obj);
+		err = -ENOEXEC;
 		goto out;
 	}
 
-	/* This is the header of brand new object ELF file. */
 	info->hdr = info->patch.mmap->mem;
 
 	if (!ehdr_magic_ok(info->hdr)) {
-		ulp_error("Invalid ELF format: %s\n", obj_from);
-		err = -1;
-		goto free_out;
+		ulp_error("Invalid ELF format: %s\n", obj);
+		err = -ENOEXEC;
+		goto out;
 	}
-	if (__chk_load_info_len(info))
-		goto free_out;
 
+	err = __chk_load_info_len(info);
 out:
+	if (err)
+		release_load_info(info);
 	return err;
+}
 
-free_out:
-	release_load_info(info);
+struct patch_check {
+	char *path;
+	/* The object is checked again if any of them changed */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	int ret;
+	/* Build ID of the valid patch, see patch_file_build_id() */
+	char *str_build_id;
+	/* patch_check_list */
+	struct list_head node;
+};
+
+static LIST_HEAD(patch_check_list);
+static struct patch_check_stats patch_check_stats;
+
+void patch_check_get_stats(struct patch_check_stats *stats)
+{
+	*stats = patch_check_stats;
+}
+
+static void free_patch_check(struct patch_check *c)
+{
+	list_del(&c->node);
+	patch_check_stats.nr_entries--;
+	free(c->str_build_id);
+	free(c->path);
+	free(c);
+}
+
+void patch_check_flush(void)
+{
+	struct patch_check *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &patch_check_list, node)
+		free_patch_check(c);
+}
+
+static int __check_patch_file(const char *file, char **str_build_id)
+{
+	struct load_info info = {};
+	int err;
+
+	err = open_patch_file(file, &info);
+	if (err)
+		return err;
+
+	err = setup_load_info(&info);
+	if (err) {
+		ulp_debug("Load %s failed\n", file);
+		err = -ENODATA;
+		goto out;
+	}
+
+	if (strcmp(info.ulp_strtab.magic, SEC_ULPATCH_MAGIC)) {
+		ulp_debug("%s is not ulpatch file.\n", file);
+		err = -ENODATA;
+	} else if (str_build_id && info.str_build_id) {
+		*str_build_id = strdup(info.str_build_id);
+	}
+
+out:
+	release_load_info(&info);
 	return err;
 }
 
 /**
- * Get load_info from ULPatch vma
+ * Validate the .ULPATCH sections of patch object @file in place, without
+ * any file written. The result is cached by path, inode, size and mtime,
+ * the unchanged object is never mapped again. Return NULL if no memory.
+ */
+static struct patch_check *get_patch_check(const char *file,
+					   const struct stat *st)
+{
+	struct patch_check *c;
+
+	list_for_each_entry(c, &patch_check_list, node) {
+		if (strcmp(c->path, file))
+			continue;
+		if (c->dev == st->st_dev && c->ino == st->st_ino &&
+		    c->size == st->st_size &&
+		    c->mtime.tv_sec == st->st_mtim.tv_sec &&
+		    c->mtime.tv_nsec == st->st_mtim.tv_nsec) {
+			patch_check_stats.hits++;
+			list_move(&c->node, &patch_check_list);
+			return c;
+		}
+		/* Modified, check again */
+		free_patch_check(c);
+		break;
+	}
+
+	patch_check_stats.misses++;
+
+	c = malloc(sizeof(struct patch_check));
+	if (!c)
+		return NULL;
+
+	c->path = strdup(file);
+	c->dev = st->st_dev;
+	c->ino = st->st_ino;
+	c->size = st->st_size;
+	c->mtime = st->st_mtim;
+	c->str_build_id = NULL;
+	c->ret = __check_patch_file(file, &c->str_build_id);
+
+	list_add(&c->node, &patch_check_list);
+	patch_check_stats.nr_entries++;
+
+	if (patch_check_stats.nr_entries > PATCH_CHECK_MAX_ENTRIES)
+		free_patch_check(list_last_entry(&patch_check_list,
+						 struct patch_check, node));
+	return c;
+}
+
+int check_patch_file(const char *file)
+{
+	struct patch_check *c;
+	struct stat st;
+
+	if (!file)
+		return -EEXIST;
+
+	if (stat(file, &st)) {
+		ulp_debug("%s is not exist.\n", file);
+		return -EEXIST;
+	}
+
+	c = get_patch_check(file, &st);
+	if (!c)
+		return __check_patch_file(file, NULL);
+	return c->ret;
+}
+
+/**
+ * Build ID of the valid patch object @file, from the cache of
+ * check_patch_file(), valid until the next check. NULL if not valid.
+ */
+const char *patch_file_build_id(const char *file)
+{
+	struct patch_check *c;
+	struct stat st;
+
+	if (!file || stat(file, &st))
+		return NULL;
+
+	c = get_patch_check(file, &st);
+	return c && !c->ret ? c->str_build_id : NULL;
+}
+
+/* See ulp_read_fn */
+int ulp_task_read(void *task, void *buf, size_t len, unsigned long addr)
+{
+	if (memcpy_from_task(task, buf, addr, len) != len)
+		return -EIO;
+	return 0;
+}
+
+/**
+ * Get load_info from ULPatch vma, only the metadata, the symbols of patch
+ * are linked into task on demand, see load_ulp_syms().
  */
 int load_ulp_info_from_vma(struct vm_area_struct *vma, struct load_info *info)
 {
 	int ret;
 	struct vma_ulp *ulp;
-	unsigned int i;
 	struct task_struct *task = vma->task;
 
 	if (vma->type != VMA_ULPATCH || !vma->ulp) {
@@ -245,9 +672,10 @@ int load_ulp_info_from_vma(struct vm_area_struct *vma, struct load_info *info)
 		return -ENOENT;
 	}
 
+	/* The newest one, see alloc_ulp() and alloc_ulp_slot() */
 	ulp = vma->ulp;
-	info->target_hdr = vma->vm_start;
-	info->len = vma->vm_end - vma->vm_start;
+	info->target_hdr = ulp->start;
+	info->len = ulp->len;
 	info->hdr = ulp->elf_mem;
 
 	ret = __chk_load_info_len(info);
@@ -256,61 +684,127 @@ int load_ulp_info_from_vma(struct vm_area_struct *vma, struct load_info *info)
 
 	setup_load_info(info);
 
-	GElf_Shdr *symsec = &info->sechdrs[info->index.sym];
-	GElf_Sym *sym = (void *)info->hdr + symsec->sh_addr - info->target_hdr;
+	ulp->strtab = info->ulp_strtab;
+	memcpy(&ulp->info, info->ulp_info, sizeof(struct ulpatch_info));
+	ulp->str_build_id = strdup(info->str_build_id);
+
+	/* All functions of patch, the strings and infos are in elf_mem */
+	ulp->nr_funcs = info->nr_funcs;
+	ulp->infos = info->ulp_info;
+	ulp->strtabs = info->ulp_strtabs;
+	info->ulp_strtabs = NULL;
+
+	/* See setup_patch_counters() */
+	if (info->ulp_index && info->ulp_index->sec_counter)
+		ulp->counters = ulp->start +
+			info->sechdrs[info->ulp_index->sec_counter].sh_offset;
+
+	ulp->sym_idx = info->index.sym;
+	if (ulp->sym_idx && !ulp->syms_lazy) {
+		ulp->syms_lazy = true;
+		task->tsyms.nr_lazy_ulps++;
+		task_lazy_vma_elf_syms(vma);
+	}
+
+	task_index_ulp(task, ulp);
+
+	ulp_debug("%s build id %s\n", vma->name_, ulp->str_build_id);
+
+	return 0;
+}
+
+/**
+ * Link the symbols of patch into task, the .symtab and .strtab are read
+ * into the sparse elf_mem only now, see load_ulp_info_from_vma().
+ */
+int load_ulp_syms(struct vma_ulp *ulp)
+{
+	struct vm_area_struct *vma = ulp->vma;
+	struct task_struct *task = vma->task;
+	GElf_Ehdr *hdr = ulp->elf_mem;
+	GElf_Shdr *sechdrs, *symsec, *strsec;
+	struct task_sym *tsym;
+	const char *strtab;
+	GElf_Sym *sym;
+	unsigned int i;
+	int err;
+
+	if (!ulp->syms_lazy)
+		return 0;
+	ulp->syms_lazy = false;
+	task->tsyms.nr_lazy_ulps--;
+
+	sechdrs = (void *)hdr + hdr->e_shoff;
+	symsec = &sechdrs[ulp->sym_idx];
+
+	err = ulp_read_sparse_section(ulp_task_read, task, hdr, ulp->start,
+				      ulp->sym_idx);
+	if (!err)
+		err = ulp_read_sparse_section(ulp_task_read, task, hdr,
+					      ulp->start, symsec->sh_link);
+	if (err) {
+		ulp_error("Failed read symbols of %s\n", vma->name_);
+		return err;
+	}
+
+	strsec = &sechdrs[symsec->sh_link];
+	strtab = (void *)hdr + strsec->sh_offset;
+	sym = (void *)hdr + symsec->sh_offset;
 
 	for (i = 0; i < symsec->sh_size / sizeof(GElf_Sym); i++) {
-		char *name = info->strtab + sym[i].st_name;
+		const char *name;
+
+		if (sym[i].st_name >= strsec->sh_size)
+			continue;
+		name = strtab + sym[i].st_name;
 
 		/* skip undefined symbols */
 		if (is_undef_symbol(&sym[i])) {
 			ulp_debug("%s undef symbol: %s %lx\n",
-				  basename(vma->name_), name, sym[i].st_value);
-			/* Skip undefined symbol */
+				  basename((char *)vma->name_), name,
+				  sym[i].st_value);
 			continue;
 		}
 
 		/**
 		 * Record ULP symbols
 		 */
-		struct task_sym *tsym;
 		tsym = alloc_task_sym(name, sym[i].st_value, vma);
+		if (!tsym)
+			return -ENOMEM;
 		link_task_sym(task, tsym);
 	}
 
-	ulp->strtab = info->ulp_strtab;
-	memcpy(&ulp->info, info->ulp_info, sizeof(struct ulpatch_info));
-	ulp->str_build_id = strdup(info->str_build_id);
-
-	ulp_debug("%s build id %s\n", vma->name_, ulp->str_build_id);
-
 	return 0;
 }
 
-static int create_mmap_vma_file(struct task_struct *task,
-				struct load_info *info)
+/**
+ * Find a free area of @size bytes, from where any address is reachable by
+ * the direct jump of the instruction at @ip, see arch_near_jmp().
+ */
+static unsigned long find_near_vma_gap(struct task_struct *task, size_t size,
+				       unsigned long ip)
 {
-	int ret = 0;
-	ssize_t map_len = info->len;
-	unsigned long map_v, addr;
-	int map_fd;
-	int prot;
+	unsigned long low, high;
 
-	/* attach target task */
-	task_attach(task->pid);
+	if (!ip || size >= ARCH_NEAR_JMP_RANGE)
+		return 0;
 
-	map_fd = task_open(task, (char *)info->patch.path, O_RDWR, 0644);
-	if (map_fd <= 0) {
-		ulp_error("remote open failed.\n");
-		return -1;
-	}
+	low = ip > ARCH_NEAR_JMP_RANGE ? ip - ARCH_NEAR_JMP_RANGE : 0;
+	low = MAX(low, (unsigned long)MIN_ULP_START_VMA_ADDR);
+	high = ip + ARCH_NEAR_JMP_RANGE - size;
 
-	ret = task_ftruncate(task, map_fd, map_len);
-	if (ret != 0) {
-		ulp_error("remote ftruncate failed.\n");
-		ret = -EFAULT;
-		goto close_ret;
-	}
+	return find_vma_gap(task, size, low, high);
+}
+
+/**
+ * The address to map @map_len bytes of patch VMA, near @near first if it's
+ * not zero.
+ */
+static unsigned long find_patch_vma_addr(struct task_struct *task,
+					 ssize_t map_len, unsigned long near)
+{
+	unsigned long addr;
 
 	/**
 	 * TODO: This patch can't map to the area that address bigger than
@@ -321,41 +815,224 @@ static int create_mmap_vma_file(struct task_struct *task,
 	 * bigger than 4 bytes, Such as:
 	 *    $ cat /proc/$(pidof hello)/maps
 	 *    5583490000-5583491000 r-xp 00000000 b3:02 1061933 /hello
+	 *
+	 * Try the area below 4GB first.
 	 */
-	addr = find_vma_span_area(task, map_len, MIN_ULP_START_VMA_ADDR);
+	addr = find_near_vma_gap(task, map_len, near);
+	if (addr)
+		ulp_debug("Near placement %lx for %lx\n", addr, near);
+	if (!addr)
+		addr = find_vma_gap(task, map_len, MIN_ULP_START_VMA_ADDR,
+				    MAX_ULP_START_VMA_ADDR);
+	if (!addr)
+		addr = find_vma_span_area(task, map_len, MIN_ULP_START_VMA_ADDR);
 	if ((addr & 0x00000000FFFFFFFFUL) != addr) {
 		ulp_warning("Not found 4 bytes length address span area in memory space.\n"\
 			"please: cat /proc/%d/maps\n", task->pid);
 	}
 
-	prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-	map_v = task_mmap(task, addr, map_len, prot, MAP_SHARED, map_fd, 0);
-	if (!map_v) {
-		ulp_error("remote mmap failed.\n");
-		ret = -EFAULT;
-		goto close_ret;
+	return addr;
+}
+
+/**
+ * Open, ftruncate, mmap and close the file @path in target task, the target
+ * task must has permission to open and modify it, thus chown it first.
+ * Return the address or negative errno.
+ */
+static unsigned long mmap_vma_file_open(struct task_struct *task,
+					const char *path, ssize_t map_len,
+					unsigned long addr, int prot, int flags)
+{
+	const struct task_status *status;
+	int ret;
+
+	/**
+	 * open, ftruncate, mmap and close the patch file in target task with
+	 * only one ptrace stop/continue cycle, the pathname store in data of
+	 * the batch.
+	 */
+	struct task_syscall_entry calls[] = {
+#if defined(__x86_64__)
+		{
+			.nr = __NR_open,
+			.args = { 0, O_RDWR, 0644 },
+			.data_mask = BIT(0),
+		},
+#elif defined(__aarch64__)
+		{
+			.nr = __NR_openat,
+			.args = { AT_FDCWD, 0, O_RDWR, 0644 },
+			.data_mask = BIT(1),
+		},
+#else
+# error "Unsupport architecture"
+#endif
+		{
+			.nr = __NR_ftruncate,
+			.args = { 0, map_len },
+			.ret_mask = BIT(0),
+		},
+		{
+			.nr = __NR_mmap,
+			.args = { addr, map_len, prot, flags, 0, 0 },
+			.ret_mask = BIT(4),
+		},
+		{
+			.nr = __NR_close,
+			.args = { 0 },
+			.ret_mask = BIT(0),
+		},
+	};
+
+	status = task_status(task);
+	if (!status || chown(path, status->uid, status->gid)) {
+		ret = -errno;
+		ulp_error("chown %s failed, %m.\n", path);
+		return ret;
 	}
 
-	/* save the target mmap address */
-	info->target_hdr = map_v;
+	ret = task_syscall_batch(task, calls, ARRAY_SIZE(calls), path,
+				 strlen(path) + 1);
+	if (ret) {
+		ulp_error("remote syscalls failed.\n");
+		return ret;
+	}
 
-	update_task_vmas_ulp(task);
-	ulp_debug("Done to create patch vma, addr 0x%lx\n", map_v);
+	if ((long)calls[0].ret < 0) {
+		ulp_error("remote open failed, %s.\n",
+			  strerror(-(long)calls[0].ret));
+		return calls[0].ret;
+	}
 
-close_ret:
-	task_close(task, map_fd);
-	task_detach(task->pid);
-	return ret;
+	if (calls[1].ret != 0) {
+		ulp_error("remote ftruncate failed.\n");
+		if (calls[2].ret && calls[2].ret <= -4096UL)
+			task_munmap(task, calls[2].ret, map_len);
+		return -EFAULT;
+	}
+
+	return calls[2].ret;
+}
+
+/**
+ * Open the file @path here, and pass the fd into target task to mmap, the
+ * target task needs no permission of @path, nothing to open in target task.
+ * The fd is read-only unless the mapping is shared and writable, such as
+ * the private shared image of share_patch_image(), which is never resized.
+ * Return the address or negative errno.
+ */
+static unsigned long mmap_vma_file_fd(struct task_struct *task,
+				      const char *path, ssize_t map_len,
+				      unsigned long addr, int prot, int flags)
+{
+	bool rdonly = (flags & MAP_TYPE) == MAP_PRIVATE ||
+		      !(prot & PROT_WRITE);
+	unsigned long map_v;
+	struct stat st;
+	int fd;
+
+	fd = open(path, (rdonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (rdonly) {
+		/* Beyond the end of file is SIGBUS */
+		if (fstat(fd, &st) || st.st_size < map_len) {
+			map_v = -EINVAL;
+			ulp_error("%s is shorter than %ld.\n", path, map_len);
+			goto close;
+		}
+	} else if (ftruncate(fd, map_len)) {
+		map_v = -errno;
+		ulp_error("ftruncate %s failed, %m.\n", path);
+		goto close;
+	}
+
+	map_v = task_mmap_fd(task, addr, map_len, prot, flags, fd, 0);
+
+close:
+	close(fd);
+	return map_v;
+}
+
+/**
+ * mmap(2) the file @path in the attached target task, return the address or
+ * negative errno.
+ */
+static unsigned long mmap_vma_file(struct task_struct *task, const char *path,
+				   ssize_t map_len, unsigned long addr,
+				   int prot, int flags)
+{
+	unsigned long map_v;
+
+	/**
+	 * Passing the fd fails if the target task is in another network
+	 * namespace, or the socket syscalls are denied by seccomp, then open
+	 * the file in target task.
+	 */
+	map_v = mmap_vma_file_fd(task, path, map_len, addr, prot, flags);
+	if (!map_v || map_v > -4096UL) {
+		ulp_debug("Pass fd of %s to %d failed, %s, open it remotely.\n",
+			  path, task->pid, strerror(-(long)map_v));
+		map_v = mmap_vma_file_open(task, path, map_len, addr, prot,
+					   flags);
+	}
+	return map_v;
+}
+
+/**
+ * Map the file @path into target task, which is at least @map_len bytes,
+ * return the address through @map_addr. If @near is not zero, try to map
+ * near it first, thus the direct jump from @near is possible.
+ */
+static int create_mmap_vma_file(struct task_struct *task, const char *path,
+				ssize_t map_len, unsigned long near,
+				unsigned long *map_addr)
+{
+	int ret = 0;
+	unsigned long map_v, addr;
+	int prot;
+
+	addr = find_patch_vma_addr(task, map_len, near);
+	prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+	/* attach target task */
+	ret = task_attach_session(task);
+	if (ret)
+		return ret;
+
+	/**
+	 * Prefault the page tables, the first calls of patched functions
+	 * take no page fault. The pages are written by kick after, the
+	 * MAP_SHARED file mapping breaks no COW.
+	 */
+	map_v = mmap_vma_file(task, path, map_len, addr, prot,
+			      MAP_SHARED | MAP_POPULATE);
+	if (!map_v || map_v > -4096UL) {
+		ulp_error("remote mmap failed.\n");
+		ret = map_v ? (long)map_v : -EFAULT;
+		goto detach;
+	}
+
+	/* save the target mmap address */
+	*map_addr = map_v;
+
+	update_task_vmas_ulp(task);
+	ulp_debug("Done to create patch vma, addr 0x%lx\n", map_v);
+
+detach:
+	task_detach_session(task);
+	return ret;
 }
 
 static void delete_mmap_vma_file(struct task_struct *task,
 				 struct load_info *info)
 {
 	ulp_warning("munmap ulpatch.\n");
-	task_attach(task->pid);
+	task_attach_leader(task);
 	task_munmap(task, info->target_hdr, info->len);
 	update_task_vmas_ulp(task);
-	task_detach(task->pid);
+	task_detach_leader(task);
 }
 
 static unsigned int find_sec(const struct load_info *info, const char *name)
@@ -372,6 +1049,70 @@ static unsigned int find_sec(const struct load_info *info, const char *name)
 	return 0;
 }
 
+/**
+ * The SEC_ULPATCH_INDEX of the loaded patch, NULL if not indexed, such as
+ * the object file or the older version, see write_ulpatch_index().
+ */
+static struct ulpatch_index *ulpatch_index_of(const struct load_info *info)
+{
+	unsigned int idx = ulp_ei_index(info->hdr), shnum = info->hdr->e_shnum;
+	struct ulpatch_index *ix;
+	GElf_Shdr *shdr;
+
+	if (!idx || idx >= shnum)
+		return NULL;
+
+	shdr = &info->sechdrs[idx];
+	if (shdr->sh_size < sizeof(*ix) || shdr->sh_offset > info->len ||
+	    shdr->sh_size > info->len - shdr->sh_offset)
+		return NULL;
+
+	ix = (void *)info->hdr + shdr->sh_offset;
+	if (ix->magic != ULPATCH_INDEX_MAGIC ||
+	    !ix->sec_info || ix->sec_info >= shnum ||
+	    !ix->sec_strtab || ix->sec_strtab >= shnum ||
+	    !ix->sec_build_id || ix->sec_build_id >= shnum ||
+	    !ix->sec_symtab || ix->sec_symtab >= shnum ||
+	    ix->sec_counter >= shnum ||
+	    info->sechdrs[ix->sec_symtab].sh_type != SHT_SYMTAB)
+		return NULL;
+	return ix;
+}
+
+/**
+ * Fill the SEC_ULPATCH_INDEX of patch copy, which is mapped into target,
+ * after scan_patch_syms(). Nothing to do if the patch has no such section,
+ * like the older version.
+ */
+static void write_ulpatch_index(struct load_info *info)
+{
+	struct ulpatch_index *ix;
+	unsigned int idx, i;
+
+	idx = find_sec(info, SEC_ULPATCH_INDEX);
+	if (!idx || idx > UINT16_MAX ||
+	    info->sechdrs[idx].sh_size < info->nr_funcs * sizeof(*ix))
+		return;
+
+	ix = (void *)info->hdr + info->sechdrs[idx].sh_offset;
+	for (i = 0; i < info->nr_funcs; i++) {
+		ix[i] = (struct ulpatch_index) {
+			.magic = ULPATCH_INDEX_MAGIC,
+			.sec_info = info->index.info,
+			.sec_strtab = info->index.ulp_strtab,
+			.sec_build_id = info->index.build_id,
+			.sec_symtab = info->index.sym,
+			.src_sym = info->src_syms[i],
+			.dst_sym = info->dst_syms[i],
+			.nr_undefs = info->undef.nr,
+			.sec_counter = info->index.counter,
+		};
+	}
+
+	info->hdr->e_ident[ULP_EI_INDEX] = idx & 0xff;
+	info->hdr->e_ident[ULP_EI_INDEX + 1] = idx >> 8;
+}
+
 static int parse_ulpatch_strtab(struct ulpatch_strtab *s, const char *strtab)
 {
 	const char *p = strtab;
@@ -395,6 +1136,52 @@ static int parse_ulpatch_strtab(struct ulpatch_strtab *s, const char *strtab)
 	return 0;
 }
 
+/* The next string group of SEC_ULPATCH_STRTAB, see ULPATCH_INFO() */
+static const char *next_ulpatch_strtab(const struct ulpatch_strtab *s)
+{
+	return s->author + strlen(s->author) + 1;
+}
+
+/* Parse all ULPATCH_INFO() of patch, one string group for each info */
+static int parse_ulpatch_strtabs(struct load_info *info)
+{
+	GElf_Shdr *strsec = &info->sechdrs[info->index.ulp_strtab];
+	GElf_Shdr *infosec = &info->sechdrs[info->index.info];
+	const char *p, *end;
+	unsigned int i, nr;
+
+	nr = infosec->sh_size / sizeof(struct ulpatch_info);
+	if (!nr || nr > ULPATCH_MAX_FUNCS ||
+	    infosec->sh_size % sizeof(struct ulpatch_info)) {
+		ulp_error("Invalid %s section size %ld.\n", SEC_ULPATCH_INFO,
+			  infosec->sh_size);
+		return -EINVAL;
+	}
+
+	free(info->ulp_strtabs);
+	info->ulp_strtabs = calloc(nr, sizeof(struct ulpatch_strtab));
+	if (!info->ulp_strtabs)
+		return -ENOMEM;
+
+	p = (void *)info->hdr + strsec->sh_offset;
+	end = p + strsec->sh_size;
+
+	for (i = 0; i < nr; i++) {
+		if (p >= end || parse_ulpatch_strtab(&info->ulp_strtabs[i], p)) {
+			ulp_error("No %s for ULPATCH_INFO %d.\n",
+				  SEC_ULPATCH_STRTAB, i);
+			return -ENOENT;
+		}
+		p = next_ulpatch_strtab(&info->ulp_strtabs[i]);
+		if (p > end)
+			return -ENOENT;
+	}
+
+	info->nr_funcs = nr;
+	info->ulp_strtab = info->ulp_strtabs[0];
+	return 0;
+}
+
 /**
  * Set up our basic convenience variables (pointers to section headers,
  * search for module section index etc), and do some basic section
@@ -416,8 +1203,19 @@ int setup_load_info(struct load_info *info)
 	info->secstrings = (void *)info->hdr
 		+ info->sechdrs[info->hdr->e_shstrndx].sh_offset;
 
+	/* The loaded patch has the index, no section names lookup */
+	info->ulp_index = ulpatch_index_of(info);
+	if (info->ulp_index) {
+		info->index.info = info->ulp_index->sec_info;
+		info->index.ulp_strtab = info->ulp_index->sec_strtab;
+		secbuildid = info->ulp_index->sec_build_id;
+	} else {
+		info->index.info = find_sec(info, SEC_ULPATCH_INFO);
+		info->index.ulp_strtab = find_sec(info, SEC_ULPATCH_STRTAB);
+		secbuildid = find_sec(info, ".note.gnu.build-id");
+	}
+
 	/* found ".ulpatch.info" */
-	info->index.info = find_sec(info, SEC_ULPATCH_INFO);
 	if (info->index.info == 0) {
 		ulp_error("Not found %s section.\n", SEC_ULPATCH_INFO);
 		return -EEXIST;
@@ -426,27 +1224,29 @@ int setup_load_info(struct load_info *info)
 	info->ulp_info = (void *)info->hdr
 		+ info->sechdrs[info->index.info].sh_offset;
 
-	/* Check ULP file version, must match to ulpatch software version */
-	if (info->ulp_info->version != ULPATCH_FILE_VERSION) {
-		ulp_error("ULPatch version (%d) != %d\n",
-			  info->ulp_info->version, ULPATCH_FILE_VERSION);
-		return -EINVAL;
+	/* Check ULP file version, must be supported by ulpatch software */
+	for (i = 0; i < info->sechdrs[info->index.info].sh_size /
+	     sizeof(struct ulpatch_info); i++) {
+		if (info->ulp_info[i].version < ULPATCH_FILE_VERSION_MIN ||
+		    info->ulp_info[i].version > ULPATCH_FILE_VERSION) {
+			ulp_error("ULPatch version (%d) not in [%d, %d]\n",
+				  info->ulp_info[i].version,
+				  ULPATCH_FILE_VERSION_MIN,
+				  ULPATCH_FILE_VERSION);
+			return -EINVAL;
+		}
 	}
 
 	/* found ".ulpatch.strtab" */
-	info->index.ulp_strtab = find_sec(info, SEC_ULPATCH_STRTAB);
 	if (info->index.ulp_strtab == 0) {
 		ulp_error("Not found %s section.\n", SEC_ULPATCH_STRTAB);
 		return -EEXIST;
 	}
-	const char *ulp_strtab = (void *)info->hdr
-		+ info->sechdrs[info->index.ulp_strtab].sh_offset;
 
 	/**
 	 * Get Build ID of patch ELF,  Mark a PATCH file with BuildID to avoid
 	 * duplicate patches.
 	 */
-	secbuildid = find_sec(info, ".note.gnu.build-id");
 	if (secbuildid == 0 || info->sechdrs[secbuildid].sh_type != SHT_NOTE) {
 		ulp_error("Not found Build ID or .note.gnu.build-id section.\n"
 			"Add gcc argument '-Wl,--build-id=sha1'\n"
@@ -474,7 +1274,7 @@ int setup_load_info(struct load_info *info)
 		break;
 	}
 
-	err = parse_ulpatch_strtab(&info->ulp_strtab, ulp_strtab);
+	err = parse_ulpatch_strtabs(info);
 	if (err) {
 		ulp_error("Failed parse ulpatch_strtab.\n");
 		return -ENOENT;
@@ -483,7 +1283,8 @@ int setup_load_info(struct load_info *info)
 	// TODO+MORE info
 
 	/* Find internal symbols and strings. */
-	for (i = 1; i < info->hdr->e_shnum; i++) {
+	for (i = info->ulp_index ? info->ulp_index->sec_symtab : 1;
+	     i < info->hdr->e_shnum; i++) {
 		if (info->sechdrs[i].sh_type == SHT_SYMTAB) {
 			ulp_debug("Found symtab in ulp.\n");
 			info->index.sym = i;
@@ -519,6 +1320,10 @@ static int rewrite_section_headers(struct load_info *info)
 
 		const char *name = info->secstrings + shdr->sh_name;
 
+		/* Host-side section, not in patch image */
+		if (shdr->sh_type == SHT_NULL)
+			continue;
+
 		if (shdr->sh_type != SHT_NOBITS
 			&& info->len < shdr->sh_offset + shdr->sh_size) {
 			ulp_error("Patch len %lu truncated\n", info->len);
@@ -587,38 +1392,293 @@ unsigned long arch_jmp_table_jmp(void)
 #endif
 }
 
+/**
+ * Generate the direct jump from @ip to @addr into @insn, jmp rel32 on x86_64
+ * and B imm26 on aarch64. Return the length of instruction, 0 if @addr is
+ * out of range, then the jmp table is needed, see arch_jmp_table_jmp().
+ */
+size_t arch_near_jmp(unsigned long ip, unsigned long addr, void *insn)
+{
+	long off;
+
+#if defined(__x86_64__)
+	off = (long)addr - (long)(ip + JMP32_INSN_SIZE);
+	if (off != (int32_t)off)
+		return 0;
+	ulpatch_jmpq_replace((union text_poke_insn *)insn, ip, addr);
+	return JMP32_INSN_SIZE;
+#elif defined(__aarch64__)
+	uint32_t b;
+
+	off = (long)addr - (long)ip;
+	if ((ip & 0x3) || (addr & 0x3) || off < -SZ_128M || off >= SZ_128M)
+		return 0;
+	b = aarch64_insn_gen_branch_imm(ip, addr, AARCH64_INSN_BRANCH_NOLINK);
+	if (b == AARCH64_BREAK_FAULT)
+		return 0;
+	memcpy(insn, &b, sizeof(b));
+	return sizeof(b);
+#else
+# error "Unsupport architecture"
+#endif
+}
+
+/**
+ * Generate the trampoline of @c, which is at @addr in target task, bump
+ * c->count and jump to c->addr. The scratch registers only, x16 and x17 on
+ * aarch64, are clobbered. Return the length of code.
+ */
+static size_t counter_tramp(struct ulpatch_counter *c, unsigned long addr)
+{
+	unsigned long pc = addr + offsetof(struct ulpatch_counter, tramp);
+	unsigned long lit = addr + offsetof(struct ulpatch_counter, addr);
+	unsigned char *p = c->tramp;
+	int32_t off;
+
+#if defined(__x86_64__)
+	/* endbr64, the target function jumps here by the jmp table */
+	memcpy(p, "\xf3\x0f\x1e\xfa", 4);
+	p += 4;
+	/* lock incq count(%rip) */
+	memcpy(p, "\xf0\x48\xff\x05", 4);
+	p += 4;
+	off = addr - (pc + (p - c->tramp) + 4);
+	memcpy(p, &off, 4);
+	p += 4;
+	/* jmp *addr(%rip) */
+	memcpy(p, "\xff\x25", 2);
+	p += 2;
+	off = lit - (pc + (p - c->tramp) + 4);
+	memcpy(p, &off, 4);
+	p += 4;
+#elif defined(__aarch64__)
+	uint32_t insn[7];
+	unsigned int n = 0;
+
+	/* adr x16, count */
+	off = addr - pc;
+	insn[n++] = 0x10000010 | (off & 0x3) << 29 | (off >> 2 & 0x7ffff) << 5;
+	if (getauxval(AT_HWCAP) & HWCAP_ATOMICS) {
+		insn[n++] = 0xd2800031; /* mov x17, #1 */
+		insn[n++] = 0xf831021f; /* stadd x17, [x16] */
+	} else {
+		/* No LSE, the concurrent bumps may be lost */
+		insn[n++] = 0xf9400211; /* ldr x17, [x16] */
+		insn[n++] = 0x91000631; /* add x17, x17, #1 */
+		insn[n++] = 0xf9000211; /* str x17, [x16] */
+	}
+	/* ldr x16, addr; br x16 */
+	off = lit - (pc + n * 4);
+	insn[n++] = 0x58000010 | (off >> 2 & 0x7ffff) << 5;
+	insn[n++] = 0xd61f0200;
+	memcpy(p, insn, n * 4);
+	p += n * 4;
+#else
+# error "Unsupport architecture"
+#endif
+	return p - c->tramp;
+}
+
 /**
  * Try find symbol in current patch, otherwise, search in libc and target task
  * symtab.
  *
  * @return: 0-failed
  */
-static const unsigned long resolve_symbol(const struct task_struct *task,
-					  const char *name, int type)
+static unsigned int undef_slot(const struct load_info *info,
+			       const unsigned int *slots, unsigned int mask,
+			       const char *name)
 {
-	const struct task_sym *tsym;
-	unsigned long addr = 0;
+	unsigned int i;
+
+	for (i = str_hash(name, strlen(name)) & mask;; i = (i + 1) & mask) {
+		if (!slots[i] || !strcmp(info->undef.names[slots[i] - 1], name))
+			return i;
+	}
+}
+
+/* The function of which @name is ULPATCH_ORIG(dst_func), or -1 */
+static int orig_func_of(const struct load_info *info, const char *name)
+{
+	size_t len = strlen(name), n = strlen(ULP_ORIG_SUFFIX);
+	const char *dst;
+	unsigned int i;
+
+	if (len <= n || strcmp(name + len - n, ULP_ORIG_SUFFIX))
+		return -1;
+
+	for (i = 0; i < info->nr_funcs; i++) {
+		dst = info->ulp_strtabs[i].dst_func;
+		if (strlen(dst) == len - n && !strncmp(dst, name, len - n))
+			return i;
+	}
+	return -1;
+}
+
+/* SEC_ULPATCH_ORIG if any ULPATCH_ORIG() is called, see scan_patch_syms() */
+static int patch_orig_sec(struct load_info *info)
+{
+	unsigned int i, idx;
 
-	if (!task || !name) {
-		errno = EINVAL;
+	for (i = 0; i < info->nr_funcs && !info->orig_undefs[i]; i++);
+	if (i == info->nr_funcs)
 		return 0;
+
+	idx = find_sec(info, SEC_ULPATCH_ORIG);
+	if (!idx || info->sechdrs[idx].sh_size <
+	    info->nr_funcs * sizeof(struct ulpatch_orig)) {
+		ulp_error("No %s in %s, rebuild it to call %s%s.\n",
+			  SEC_ULPATCH_ORIG, info->name ?: "patch",
+			  info->ulp_strtabs[i].dst_func, ULP_ORIG_SUFFIX);
+		return -ENOEXEC;
+	}
+	info->index.orig = idx;
+	return 0;
+}
+
+/**
+ * Scan the symtab of patch once, find the symbol of every src_func, and
+ * gather the unique undefined symbol names, which are resolved in batch by
+ * simplify_symbols().
+ */
+static int scan_patch_syms(struct load_info *info)
+{
+	GElf_Shdr *symsec = &info->sechdrs[info->index.sym];
+	GElf_Sym *syms = (void *)info->hdr + symsec->sh_offset;
+	unsigned int i, j, nr_syms, nr_undefs = 0, mask, *slots, *slot;
+	int err = -ENOMEM;
+
+	nr_syms = symsec->sh_size / sizeof(GElf_Sym);
+
+	info->src_syms = calloc(info->nr_funcs, sizeof(unsigned int));
+	info->dst_syms = calloc(info->nr_funcs, sizeof(unsigned int));
+	info->orig_undefs = calloc(info->nr_funcs, sizeof(unsigned int));
+	info->undef.of_sym = calloc(nr_syms ?: 1, sizeof(unsigned int));
+	if (!info->src_syms || !info->dst_syms || !info->orig_undefs ||
+	    !info->undef.of_sym)
+		return -ENOMEM;
+
+	for (i = 1; i < nr_syms; i++)
+		nr_undefs += syms[i].st_shndx == SHN_UNDEF;
+
+	for (mask = 1; mask < nr_undefs * 2; mask <<= 1);
+	slots = calloc(mask, sizeof(unsigned int));
+	mask--;
+
+	info->undef.names = calloc(nr_undefs ?: 1, sizeof(char *));
+	info->undef.addrs = calloc(nr_undefs ?: 1, sizeof(unsigned long));
+	info->undef.weak = calloc(nr_undefs ?: 1, sizeof(bool));
+	if (!slots || !info->undef.names || !info->undef.addrs ||
+	    !info->undef.weak)
+		goto out;
+
+	for (i = 1; i < nr_syms; i++) {
+		const char *name = info->strtab + syms[i].st_name;
+		bool weak = GELF_ST_BIND(syms[i].st_info) == STB_WEAK;
+
+		if (syms[i].st_shndx != SHN_UNDEF) {
+			for (j = 0; j < info->nr_funcs; j++) {
+				if (!info->src_syms[j] &&
+				    !strcmp(info->ulp_strtabs[j].src_func, name))
+					info->src_syms[j] = i;
+			}
+			continue;
+		}
+
+		for (j = 0; j < info->nr_funcs; j++) {
+			if (!info->dst_syms[j] &&
+			    !strcmp(info->ulp_strtabs[j].dst_func, name))
+				info->dst_syms[j] = i;
+		}
+
+		slot = &slots[undef_slot(info, slots, mask, name)];
+		if (!*slot) {
+			info->undef.names[info->undef.nr] = name;
+			info->undef.weak[info->undef.nr] = weak;
+			*slot = ++info->undef.nr;
+			j = orig_func_of(info, name);
+			if (j != -1U)
+				info->orig_undefs[j] = *slot;
+		}
+		/* Strong if any reference is strong */
+		info->undef.weak[*slot - 1] &= weak;
+		info->undef.of_sym[i] = *slot - 1;
 	}
+
+	ulp_debug("Patch has %u symbols, %u unique undefined.\n", nr_syms,
+		  info->undef.nr);
+	err = patch_orig_sec(info);
+out:
+	free(slots);
+	return err;
+}
+
+/**
+ * Resolve all undefined symbols of patch in batch, dynamic symbols first,
+ * from target memory like the dynamic linker does, which is cheap and works
+ * for deleted libraries, then the symbol hash index of target task. All of
+ * unresolved names are reported together.
+ */
+static int resolve_undef_symbols(const struct load_info *info)
+{
+	struct task_struct *task = info->target_task;
+	const struct task_sym *tsym;
+	unsigned int i, nr_dyn, nr_miss = 0;
+	char buf[512];
+	size_t off = 0;
+
+	if (!info->undef.nr)
+		return 0;
+
 	if (!(task->fto_flag & FTO_VMA_ELF_SYMBOLS)) {
 		ulp_error("Must open task with FTO_VMA_ELF_SYMBOLS.\n");
-		errno = EINVAL;
-		return 0;
+		return -EINVAL;
+	}
+
+	/* The trampolines in patch, see setup_orig_tramps() */
+	for (i = 0; info->index.orig && i < info->nr_funcs; i++) {
+		if (info->orig_undefs[i])
+			info->undef.addrs[info->orig_undefs[i] - 1] =
+				info->target_hdr +
+				info->sechdrs[info->index.orig].sh_offset +
+				i * sizeof(struct ulpatch_orig) +
+				offsetof(struct ulpatch_orig, tramp);
+	}
+
+	nr_dyn = task_dynsym_addrs(task, info->undef.names, info->undef.addrs,
+				   info->undef.nr);
+
+	for (i = 0; i < info->undef.nr; i++) {
+		if (info->undef.addrs[i])
+			continue;
+
+		tsym = find_task_sym(task, info->undef.names[i], NULL, NULL);
+		if (tsym) {
+			info->undef.addrs[i] = tsym->addr;
+			continue;
+		}
+
+		/* Ok if weak */
+		if (info->undef.weak[i])
+			continue;
+
+		nr_miss++;
+		if (off < sizeof(buf))
+			off += snprintf(buf + off, sizeof(buf) - off, " %s",
+					info->undef.names[i]);
 	}
 
-	tsym = find_task_sym((struct task_struct *)task, name, NULL, NULL);
-	if (tsym)
-		addr = tsym->addr;
+	ulp_debug("Resolve %u undefined symbols, %u from dynsym.\n",
+		  info->undef.nr, nr_dyn);
 
-	if (!addr) {
+	if (nr_miss) {
+		ulp_error("Couldn't found %u symbols:%s%s\n", nr_miss, buf,
+			  off >= sizeof(buf) ? " ..." : "");
 		errno = ENOENT;
-		ulp_error("Couldn't found symbol %s\n", name);
+		return -ENOENT;
 	}
 
-	return addr;
+	return 0;
 }
 
 /* Change all symbols so that st_value encodes the pointer directly. */
@@ -637,6 +1697,10 @@ static int simplify_symbols(const struct load_info *info)
 	ulp_debug("sym = %p + %lx - %lx, sh_offset %lx\n",
 		info->hdr, symsec->sh_addr, info->target_hdr, symsec->sh_offset);
 
+	ret = resolve_undef_symbols(info);
+	if (ret)
+		return ret;
+
 	for (i = 1; i < symsec->sh_size / sizeof(GElf_Sym); i++) {
 		const char *name = info->strtab + sym[i].st_name;
 
@@ -658,26 +1722,11 @@ static int simplify_symbols(const struct load_info *info)
 			break;
 
 		case SHN_UNDEF:
-			ulp_debug("Resolve UNDEF sym %s\n", name);
-			unsigned long addr;
-			addr = resolve_symbol(info->target_task, name,
-					      GELF_ST_TYPE(sym[i].st_info));
-			/* Ok if resolved.  */
-			if (addr) {
-				sym[i].st_value = addr;
-			}
-
-			/* Ok if weak.  */
-			if (!addr && GELF_ST_BIND(sym[i].st_info) == STB_WEAK) {
-				break;
-			}
-
-			/* Not found symbol in any where */
-			ret = addr ? 0 : -ENOENT;
-			if (ret) {
-				ulp_error("Unknown symbol %s's addr %lx (err %d)\n",
-					 name, addr, ret);
-			}
+			/* Resolved already, zero if weak and not found */
+			sym[i].st_value =
+				info->undef.addrs[info->undef.of_sym[i]];
+			ulp_debug("Resolve UNDEF sym %s %lx\n", name,
+				  sym[i].st_value);
 			break;
 
 		default:
@@ -693,6 +1742,30 @@ static int simplify_symbols(const struct load_info *info)
 	return ret;
 }
 
+/**
+ * Reserve @n entries at the end of relocation log, return the first one, or
+ * NULL if no memory.
+ */
+static struct reloc_log *reloc_logs_reserve(struct reloc_logs *logs,
+					    unsigned int n)
+{
+	struct reloc_log *tmp;
+	unsigned int cap;
+
+	if (logs->nr + n > logs->cap) {
+		cap = MAX(logs->cap * 2, logs->nr + n + 64);
+		tmp = realloc(logs->ents, sizeof(struct reloc_log) * cap);
+		if (!tmp)
+			return NULL;
+		logs->ents = tmp;
+		logs->cap = cap;
+	}
+
+	tmp = &logs->ents[logs->nr];
+	logs->nr += n;
+	return tmp;
+}
+
 /**
  * Relocation is the process of connecting symbolic references with symbolic
  * definitions.
@@ -700,14 +1773,110 @@ static int simplify_symbols(const struct load_info *info)
  * refs:
  * [0] https://docs.oracle.com/cd/E19120-01/open.solaris/819-0690/6n33n7fct/index.html
  */
-static int apply_relocations(const struct load_info *info)
+/**
+ * Plan all relocations in @log, nothing is written if any of them is out of
+ * range, thus caller could retry it at other address, see __init_patch().
+ * Then apply all of them in one sweep.
+ */
+static int apply_reloc_log(struct load_info *info, const struct reloc_log *log,
+			   unsigned int nr, bool replay)
 {
+	struct reloc_plans plans = {
+		.replay = replay,
+	};
+	unsigned int i;
+	int err;
+
+	if (!nr)
+		return 0;
+
+	plans.ents = malloc(sizeof(struct reloc_plan) * nr);
+	if (!plans.ents)
+		return -ENOMEM;
+
+	err = arch_plan_relocs(info, log, nr, &plans);
+	if (err) {
+		info->range_near = plans.range_near;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++)
+		memcpy((void *)info->hdr + plans.ents[i].offset,
+		       plans.ents[i].bytes, plans.ents[i].size);
+
+	ulp_debug("Applied %u relocations\n", nr);
+out:
+	free(plans.ents);
+	return err;
+}
+
+/* The relocations are host-side, see layout_patch_image() */
+static void *obj_hdr(const struct load_info *info)
+{
+	return info->patch.obj ? info->patch.obj->mem : (void *)info->hdr;
+}
+
+static GElf_Shdr *obj_sechdrs(const struct load_info *info)
+{
+	GElf_Ehdr *ehdr = obj_hdr(info);
+
+	return (void *)ehdr + ehdr->e_shoff;
+}
+
+/**
+ * Convert RELA section @relsec into relocation log, the offset from hdr is
+ * the same in current process and target process.
+ *
+ * Object file is indicated by '#', address space is represented by '|--|'
+ *
+ *                                     hdr
+ *                                     |
+ * HostTask    |-----------------------###########----------|
+ *                                     |    ^
+ *                                     |    offset
+ *
+ * TargetTask  |--------###########-------------------------|
+ *                      |    ^
+ *              target_hdr   offset
+ */
+static int log_relocate_add(const struct load_info *info,
+			    struct reloc_logs *logs, unsigned int relsec)
+{
+	GElf_Shdr *relshdr = &obj_sechdrs(info)[relsec];
+	Elf64_Rela *rel = obj_hdr(info) + relshdr->sh_offset;
+	unsigned int i, nr = relshdr->sh_size / sizeof(*rel);
+	struct reloc_log *log;
+	unsigned long base;
+
+	/* Offset of the section to be relocated from hdr */
+	base = info->sechdrs[relshdr->sh_info].sh_offset;
+
+	log = reloc_logs_reserve(logs, nr);
+	if (!log)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		log[i].offset = base + rel[i].r_offset;
+		log[i].sym = ELF64_R_SYM(rel[i].r_info);
+		log[i].type = ELF64_R_TYPE(rel[i].r_info);
+		log[i].addend = rel[i].r_addend;
+	}
+
+	ulp_debug("Relocate section %u to %u, %u relocations\n", relsec,
+		  relshdr->sh_info, nr);
+	return 0;
+}
+
+static int apply_relocations(struct load_info *info)
+{
+	struct reloc_logs tmp = {}, *logs = info->relocs ?: &tmp;
+	GElf_Shdr *shdrs = obj_sechdrs(info);
 	unsigned int i;
 	int err = 0;
 
 	/* Now do relocations. */
 	for (i = 0; i< info->hdr->e_shnum; i++) {
-		unsigned int infosec = info->sechdrs[i].sh_info;
+		unsigned int infosec = shdrs[i].sh_info;
 
 		/* Not a valid relocation section? */
 		if (infosec >= info->hdr->e_shnum)
@@ -717,44 +1886,558 @@ static int apply_relocations(const struct load_info *info)
 		if (!(info->sechdrs[infosec].sh_flags & SHF_ALLOC))
 			continue;
 
-		if (unlikely(info->sechdrs[i].sh_type == SHT_REL)) {
+		if (unlikely(shdrs[i].sh_type == SHT_REL)) {
 			/* Not support 32bit SHT_REL yet */
 			err = -ENOEXEC;
 			break;
-		} else if (info->sechdrs[i].sh_type == SHT_RELA)
-			err = arch_apply_relocate_add(info, info->sechdrs,
-						      info->strtab,
-						      info->index.sym, i);
+		} else if (shdrs[i].sh_type == SHT_RELA)
+			err = log_relocate_add(info, logs, i);
 
-		if (err < 0) {
-			ulp_error("apply relocations failed.\n");
+		if (err < 0)
 			break;
-		}
 	}
 
+	if (!err)
+		err = apply_reloc_log(info, logs->ents, logs->nr, false);
+	if (err < 0)
+		ulp_error("apply relocations failed.\n");
+
+	free(tmp.ents);
 	return err;
 }
 
-static int post_relocation(const struct load_info *info)
+/**
+ * Pre-linked patch images. The relocated patch image only depends on the
+ * patch itself, the patch VMA address and the layout of target task, that
+ * is, the Build ID and load address of every ELF and ULPatch VMA that the
+ * UNDEF symbols are resolved from. When rolling out the same patch to the
+ * identical processes, like forked workers, reuse the image and skip the
+ * symbol resolution and relocation.
+ *
+ * If only the addresses differ, like the same binary with ASLR, the symbols
+ * are rebased and the logged relocations are replayed, see rebase_prelink().
+ */
+struct prelink_entry {
+	char *str_build_id;
+	unsigned long target_hdr;
+	unsigned long len;
+
+	/* See prelink_layout() */
+	void *layout;
+	size_t layout_size;
+	unsigned int nr_layout;
+
+	/* Copy of load_info::hdr after post_relocation() */
+	void *image;
+
+	/**
+	 * Base of every symbol, the index of layout or PRELINK_BASE_*, NULL
+	 * if can't be rebased, see prelink_sym_bases().
+	 */
+	int *sym_bases;
+	unsigned int nr_syms;
+	struct reloc_logs relocs;
+
+	/* prelink_list */
+	struct list_head node;
+};
+
+static LIST_HEAD(prelink_list);
+static struct patch_prelink_stats prelink_stats = {
+	.enabled = true,
+};
+
+void patch_prelink_enable(bool enable)
 {
-	/* TODO: need add_allsyms() */
+	prelink_stats.enabled = enable;
+}
 
-	return 0;
+void patch_prelink_get_stats(struct patch_prelink_stats *stats)
+{
+	*stats = prelink_stats;
 }
 
-static int solve_patch_symbols(struct load_info *info)
+static void free_prelink(struct prelink_entry *e)
 {
-	int i;
-	struct task_struct *task = info->target_task;
-	struct task_sym *tsym;
-	const char *dst_func, *src_func;
-	GElf_Sym *sym_src_func = NULL;
+	list_del(&e->node);
+	prelink_stats.nr_entries--;
+	free(e->str_build_id);
+	free(e->layout);
+	free(e->image);
+	free(e->sym_bases);
+	free(e->relocs.ents);
+	free(e);
+}
 
-	dst_func = info->ulp_strtab.dst_func;
-	src_func = info->ulp_strtab.src_func;
+void patch_prelink_flush(void)
+{
+	struct prelink_entry *e, *tmp;
 
-	tsym = find_task_sym(task, dst_func, NULL, NULL);
-	if (!tsym) {
+	list_for_each_entry_safe(e, tmp, &prelink_list, node)
+		free_prelink(e);
+}
+
+/* Append one (address, Build ID) to layout, @buf is freed if failed */
+static int layout_append(char **buf, size_t *len, size_t *cap,
+			 unsigned long addr, const void *id, int n)
+{
+	size_t need = sizeof(addr) + sizeof(n) + n;
+	char *tmp;
+
+	if (*len + need > *cap) {
+		*cap = MAX(*cap * 2, *len + need + 1024);
+		tmp = realloc(*buf, *cap);
+		if (!tmp) {
+			free(*buf);
+			*buf = NULL;
+			return -ENOMEM;
+		}
+		*buf = tmp;
+	}
+
+	memcpy(*buf + *len, &addr, sizeof(addr));
+	memcpy(*buf + *len + sizeof(addr), &n, sizeof(n));
+	memcpy(*buf + *len + sizeof(addr) + sizeof(n), id, n);
+	*len += need;
+	return 0;
+}
+
+struct layout_iter {
+	const char *buf;
+	size_t size, off;
+	/* Current one */
+	unsigned long addr;
+	const void *id;
+	int n;
+};
+
+static bool layout_next(struct layout_iter *it)
+{
+	size_t hlen = sizeof(it->addr) + sizeof(it->n);
+
+	if (it->off + hlen > it->size)
+		return false;
+
+	memcpy(&it->addr, it->buf + it->off, sizeof(it->addr));
+	memcpy(&it->n, it->buf + it->off + sizeof(it->addr), sizeof(it->n));
+	it->id = it->buf + it->off + hlen;
+	it->off += hlen + it->n;
+	return it->off <= it->size;
+}
+
+/**
+ * Serialize (load address, Build ID) of every ELF and ULPatch VMA of task in
+ * address order. Return -ENOENT if any ELF has no Build ID, such task is
+ * never cached.
+ */
+static int prelink_layout(struct task_struct *task, void **layout,
+			  size_t *size)
+{
+	struct vm_area_struct *vma;
+	struct vma_ulp *ulp;
+	uint8_t bid[64];
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	int n;
+
+	task_for_each_vma(vma, task) {
+		/**
+		 * No symbols without Build ID, see load_ulp_info_from_vma(),
+		 * like the VMA of the patch being loaded.
+		 */
+		if (vma->type == VMA_ULPATCH) {
+			for (ulp = vma->ulp; ulp; ulp = ulp->next) {
+				if (!ulp->str_build_id)
+					continue;
+				if (layout_append(&buf, &len, &cap, ulp->start,
+						  ulp->str_build_id,
+						  strlen(ulp->str_build_id)))
+					return -ENOMEM;
+			}
+			continue;
+		}
+
+		if (!vma->vma_elf)
+			continue;
+
+		n = vma_read_build_id(vma, bid, sizeof(bid));
+		if (n <= 0)
+			goto noent;
+
+		if (layout_append(&buf, &len, &cap, vma->vma_elf->load_addr,
+				  bid, n))
+			return -ENOMEM;
+	}
+
+	*layout = buf;
+	*size = len;
+	return 0;
+
+noent:
+	ulp_debug("%s has no Build ID, no prelink.\n", vma->name_);
+	free(buf);
+	return -ENOENT;
+}
+
+static struct prelink_entry *find_prelink(const struct load_info *info,
+					  const void *layout, size_t size)
+{
+	struct prelink_entry *e;
+
+	list_for_each_entry(e, &prelink_list, node) {
+		if (e->target_hdr == info->target_hdr &&
+		    e->len == info->len &&
+		    e->layout_size == size &&
+		    !strcmp(e->str_build_id, info->str_build_id) &&
+		    !memcmp(e->layout, layout, size)) {
+			/* Most recently used at head */
+			list_move(&e->node, &prelink_list);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Not changed or changed with the patch VMA, see prelink_entry::sym_bases */
+#define PRELINK_BASE_ABS	-1
+#define PRELINK_BASE_PATCH	-2
+
+/* Index of the layout VMA that @addr belongs to, -1 if none */
+static int prelink_addr_base(struct task_struct *task, const void *layout,
+			     size_t size, unsigned long addr)
+{
+	struct layout_iter it = { .buf = layout, .size = size };
+	struct vm_area_struct *vma;
+	struct vma_ulp *ulp;
+	unsigned long base = 0;
+	int i;
+
+	vma = find_vma(task, addr);
+	if (!vma)
+		return -1;
+
+	if (vma->type == VMA_ULPATCH) {
+		for (ulp = vma->ulp; ulp; ulp = ulp->next) {
+			if (addr >= ulp->start && addr < ulp->start + ulp->len)
+				base = ulp->start;
+		}
+	} else if (vma->leader && vma->leader->vma_elf)
+		base = vma->leader->vma_elf->load_addr;
+
+	for (i = 0; base && layout_next(&it); i++) {
+		if (it.addr == base)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Record which VMA every symbol of relocated image is based on, thus the
+ * image could be rebased for the same layout at other addresses. Return
+ * NULL if any UNDEF symbol is not from the layout VMAs.
+ */
+static int *prelink_sym_bases(const struct load_info *info,
+			      const void *layout, size_t size)
+{
+	GElf_Shdr *symsec = &info->sechdrs[info->index.sym];
+	GElf_Sym *syms = (void *)info->hdr + symsec->sh_offset;
+	unsigned int i, nr_syms = symsec->sh_size / sizeof(GElf_Sym);
+	int *bases;
+
+	bases = malloc(sizeof(int) * (nr_syms ?: 1));
+	if (!bases)
+		return NULL;
+
+	for (i = 0; i < nr_syms; i++) {
+		switch (syms[i].st_shndx) {
+		case SHN_UNDEF:
+			/* Weak and not found */
+			if (!syms[i].st_value) {
+				bases[i] = PRELINK_BASE_ABS;
+				break;
+			}
+			/* Such as ULPATCH_ORIG() */
+			if (syms[i].st_value >= info->target_hdr &&
+			    syms[i].st_value < info->target_hdr + info->len) {
+				bases[i] = PRELINK_BASE_PATCH;
+				break;
+			}
+			bases[i] = prelink_addr_base(info->target_task, layout,
+						     size, syms[i].st_value);
+			if (bases[i] < 0) {
+				ulp_debug("%s is not in layout, no rebase.\n",
+					  info->strtab + syms[i].st_name);
+				free(bases);
+				return NULL;
+			}
+			break;
+		case SHN_ABS:
+			bases[i] = PRELINK_BASE_ABS;
+			break;
+		default:
+			bases[i] = syms[i].st_shndx < info->hdr->e_shnum ?
+				   PRELINK_BASE_PATCH : PRELINK_BASE_ABS;
+			break;
+		}
+	}
+
+	return bases;
+}
+
+/**
+ * Return the load address deltas of every VMA, if the @layout has the same
+ * Build IDs in the same order of prelink entry, otherwise NULL.
+ */
+static long *layout_deltas(const struct prelink_entry *e, const void *layout,
+			   size_t size)
+{
+	struct layout_iter old = { .buf = e->layout, .size = e->layout_size };
+	struct layout_iter new = { .buf = layout, .size = size };
+	unsigned int i;
+	long *deltas;
+
+	if (size != e->layout_size)
+		return NULL;
+
+	deltas = malloc(sizeof(long) * (e->nr_layout ?: 1));
+	if (!deltas)
+		return NULL;
+
+	for (i = 0; i < e->nr_layout; i++) {
+		if (!layout_next(&old) || !layout_next(&new) ||
+		    old.n != new.n || memcmp(old.id, new.id, old.n)) {
+			free(deltas);
+			return NULL;
+		}
+		deltas[i] = new.addr - old.addr;
+	}
+	return deltas;
+}
+
+/**
+ * Rebase the pre-linked image of @e into load_info::hdr, the section
+ * headers and symbols are moved with their VMA, then the relocations are
+ * replayed from log, no symbol is resolved again.
+ */
+static int rebase_prelink(struct load_info *info,
+			  const struct prelink_entry *e, const long *deltas)
+{
+	GElf_Shdr *symsec = &info->sechdrs[info->index.sym];
+	long patch_delta = info->target_hdr - e->target_hdr;
+	GElf_Sym *syms;
+	unsigned int i;
+	void *orig;
+	int err;
+
+	/* Restore if failed, the full relocation needs the original */
+	orig = malloc(info->len);
+	if (!orig)
+		return -ENOMEM;
+	memcpy(orig, info->hdr, info->len);
+	memcpy(info->hdr, e->image, info->len);
+
+	for (i = 1; i < info->hdr->e_shnum; i++)
+		if (info->sechdrs[i].sh_type != SHT_NULL)
+			info->sechdrs[i].sh_addr = info->target_hdr +
+						   info->sechdrs[i].sh_offset;
+
+	syms = (void *)info->hdr + symsec->sh_offset;
+	for (i = 0; i < e->nr_syms; i++) {
+		if (e->sym_bases[i] == PRELINK_BASE_PATCH)
+			syms[i].st_value += patch_delta;
+		else if (e->sym_bases[i] >= 0)
+			syms[i].st_value += deltas[e->sym_bases[i]];
+	}
+
+	err = apply_reloc_log(info, e->relocs.ents, e->relocs.nr, true);
+	if (err)
+		memcpy(info->hdr, orig, info->len);
+
+	free(orig);
+	return err;
+}
+
+/* Try all of entries of the same patch, whose layout differs in addresses */
+static int apply_prelink_rebase(struct load_info *info, const void *layout,
+				size_t size)
+{
+	struct prelink_entry *e;
+	long *deltas;
+	int err;
+
+	list_for_each_entry(e, &prelink_list, node) {
+		if (!e->sym_bases || e->len != info->len ||
+		    strcmp(e->str_build_id, info->str_build_id))
+			continue;
+
+		deltas = layout_deltas(e, layout, size);
+		if (!deltas)
+			continue;
+
+		err = rebase_prelink(info, e, deltas);
+		free(deltas);
+		if (!err) {
+			list_move(&e->node, &prelink_list);
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static void save_prelink(const struct load_info *info, void *layout,
+			 size_t size)
+{
+	struct layout_iter it = { .buf = layout, .size = size };
+	struct prelink_entry *e;
+
+	e = calloc(1, sizeof(struct prelink_entry));
+	if (!e)
+		return;
+
+	e->image = malloc(info->len);
+	e->str_build_id = strdup(info->str_build_id);
+	if (!e->image || !e->str_build_id) {
+		free(e->image);
+		free(e->str_build_id);
+		free(e);
+		return;
+	}
+
+	memcpy(e->image, info->hdr, info->len);
+	e->target_hdr = info->target_hdr;
+	e->len = info->len;
+	e->layout = layout;
+	e->layout_size = size;
+	while (layout_next(&it))
+		e->nr_layout++;
+
+	/* Move the relocation log into entry */
+	if (info->relocs)
+		e->sym_bases = prelink_sym_bases(info, layout, size);
+	if (e->sym_bases) {
+		e->nr_syms = info->sechdrs[info->index.sym].sh_size /
+			     sizeof(GElf_Sym);
+		e->relocs = *info->relocs;
+		memset(info->relocs, 0, sizeof(struct reloc_logs));
+	}
+
+	list_add(&e->node, &prelink_list);
+	prelink_stats.nr_entries++;
+
+	if (prelink_stats.nr_entries > PATCH_PRELINK_MAX_ENTRIES)
+		free_prelink(list_last_entry(&prelink_list,
+					     struct prelink_entry, node));
+}
+
+/**
+ * Copy the pre-linked image into load_info::hdr if there is one matches
+ * the layout of target task. Return 0 if hit, and the section headers,
+ * symbols and relocations are all done.
+ *
+ * If miss, the layout is returned through @layout, pass it to
+ * save_prelink() after relocation.
+ */
+static int apply_prelink(struct load_info *info, void **layout, size_t *size)
+{
+	struct prelink_entry *e;
+
+	*layout = NULL;
+
+	if (!prelink_stats.enabled)
+		return -ENOENT;
+
+	if (prelink_layout(info->target_task, layout, size))
+		return -ENOENT;
+
+	e = find_prelink(info, *layout, *size);
+	if (e) {
+		/* Same image layout, all pointers of load_info are still valid */
+		memcpy(info->hdr, e->image, info->len);
+	} else if (!apply_prelink_rebase(info, *layout, *size)) {
+		prelink_stats.rebased++;
+	} else {
+		prelink_stats.misses++;
+		return -ENOENT;
+	}
+	prelink_stats.hits++;
+
+	free(*layout);
+	*layout = NULL;
+
+	ulp_debug("Prelink hit %s at %lx\n", info->str_build_id,
+		  info->target_hdr);
+	return 0;
+}
+
+static int post_relocation(const struct load_info *info)
+{
+	/* TODO: need add_allsyms() */
+
+	return 0;
+}
+
+static enum patch_mode patch_mode = PATCH_MODE_JMP;
+
+static const char *patch_mode_names[] = {
+	[PATCH_MODE_JMP] = "jmp",
+	[PATCH_MODE_GOT] = "got",
+};
+
+/* Return enum patch_mode, or -EINVAL */
+int patch_mode_parse(const char *str)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(patch_mode_names); i++)
+		if (!strcmp(str, patch_mode_names[i]))
+			return i;
+	return -EINVAL;
+}
+
+void patch_set_mode(enum patch_mode mode)
+{
+	patch_mode = mode;
+}
+
+/**
+ * Redirect the GOT slot of main executable instead of the entry of target
+ * function, the slot is an aligned pointer, written by one store.
+ */
+static int solve_patch_got(struct load_info *info, unsigned int n)
+{
+	struct task_struct *task = info->target_task;
+	struct ulpatch_info *ulp_info = &info->ulp_info[n];
+	const char *dst_func = info->ulp_strtabs[n].dst_func;
+	unsigned long slot;
+
+	slot = vma_got_slot(task->vma_self_elf, dst_func);
+	if (!slot) {
+		ulp_error("Couldn't found GOT slot of %s in %s, it's not "
+			  "imported, patch it with --mode=jmp.\n", dst_func,
+			  task->exe);
+		return -ENOENT;
+	}
+
+	ulp_info->virtual_addr = slot;
+	ulp_info->flags |= ULP_INFO_F_GOT;
+	return 0;
+}
+
+/* Resolve the N-th function of patch, see ULPATCH_INFO() */
+static int solve_patch_func(struct load_info *info, unsigned int n)
+{
+	struct task_struct *task = info->target_task;
+	struct ulpatch_info *ulp_info = &info->ulp_info[n];
+	struct task_sym *tsym;
+	const char *dst_func, *src_func;
+	GElf_Sym *sym_src_func = NULL;
+	int err;
+
+	dst_func = info->ulp_strtabs[n].dst_func;
+	src_func = info->ulp_strtabs[n].src_func;
+
+	tsym = find_task_sym(task, dst_func, NULL, NULL);
+	if (!tsym) {
 		ulp_error("Couldn't found %s in target process, maybe %s is "
 			  "stripped, or you could load symbol-file.\n",
 			  dst_func, task->exe);
@@ -764,14 +2447,9 @@ static int solve_patch_symbols(struct load_info *info)
 	GElf_Shdr *symsec = (GElf_Shdr *)&info->sechdrs[info->index.sym];
 	GElf_Sym *syms = (GElf_Sym *)((void *)info->hdr + symsec->sh_offset);
 
-	for (i = 0; i < symsec->sh_size / sizeof(GElf_Sym); i++) {
-		GElf_Sym *sym = &syms[i];
-		char *name = info->strtab + sym->st_name;
-		ulp_debug("patch: %s, %d\n", name, sym->st_name);
-
-		if (!strcmp(src_func, name))
-			sym_src_func = sym;
-	}
+	/* Found by scan_patch_syms() */
+	if (info->src_syms[n])
+		sym_src_func = &syms[info->src_syms[n]];
 
 	if (!sym_src_func) {
 		ulp_error("Couldn't found %s in %s.\n", src_func,
@@ -779,145 +2457,1710 @@ static int solve_patch_symbols(struct load_info *info)
 		return -ENOENT;
 	}
 
-	info->ulp_info->ulp_id = ++task->max_ulp_id;
-	info->ulp_info->target_func_addr = tsym->addr;
-	info->ulp_info->patch_func_addr = sym_src_func->st_value;
+	ulp_info->target_func_addr = tsym->addr;
+	ulp_info->patch_func_addr = sym_src_func->st_value;
 	/* Replace from start of target function */
-	info->ulp_info->virtual_addr = info->ulp_info->target_func_addr;
+	ulp_info->virtual_addr = ulp_info->target_func_addr;
+	ulp_info->flags &= ~ULP_INFO_F_GOT;
 
-	info->ulp_info->time = secs();
+	if (patch_mode == PATCH_MODE_GOT) {
+		err = solve_patch_got(info, n);
+		if (err)
+			return err;
+	}
 
 	ulp_debug("Found %s symbol address %#016lx.\n", dst_func,
-		  info->ulp_info->target_func_addr);
+		  ulp_info->target_func_addr);
 	ulp_debug("Found %s symbol address %#016lx.\n", src_func,
-		  info->ulp_info->patch_func_addr);
+		  ulp_info->patch_func_addr);
 	return 0;
 }
 
-static int kick_target_process(const struct load_info *info)
+static int solve_patch_symbols(struct load_info *info)
 {
-	int n;
-	int err = 0;
+	int err;
+	unsigned int i, j;
 	struct task_struct *task = info->target_task;
-	unsigned long target_hdr = info->target_hdr;
-	size_t insn_sz = 0;
-	const char *new_insn = NULL;
-	struct jmp_table_entry jmp_entry;
+	unsigned long now = secs();
 
-	jmp_entry.jmp = arch_jmp_table_jmp();
-	jmp_entry.addr = info->ulp_info->patch_func_addr;
-	new_insn = (void *)&jmp_entry;
-	insn_sz = sizeof(struct jmp_table_entry);
+	for (i = 0; i < info->nr_funcs; i++) {
+		err = solve_patch_func(info, i);
+		if (err)
+			return err;
 
-	n = memcpy_from_task(task, info->ulp_info->orig_code,
-			     info->ulp_info->virtual_addr, insn_sz);
-	if (n == -1 || n < insn_sz) {
-		ulp_error("Backup original instructions failed.\n");
-		err = -ENOEXEC;
-		goto done;
+		/**
+		 * Every function entry or GOT slot is overwritten, two of them
+		 * must not overlap, otherwise the backup of one is the patched
+		 * code of another one.
+		 */
+		for (j = 0; j < i; j++) {
+			unsigned long a = info->ulp_info[i].virtual_addr;
+			unsigned long b = info->ulp_info[j].virtual_addr;
+			/* The lower one must end before the higher one */
+			size_t len = ulp_info_size(a < b ? &info->ulp_info[i] :
+						   &info->ulp_info[j]);
+
+			if (MAX(a, b) - MIN(a, b) < len) {
+				ulp_error("%s and %s overlap in patch.\n",
+					  info->ulp_strtabs[i].dst_func,
+					  info->ulp_strtabs[j].dst_func);
+				return -EINVAL;
+			}
+		}
 	}
 
-	ulp_debug("Copy ulpatch to target process. Jmp table: from %s(%lx) jump to %s(%lx)\n",
-		info->ulp_strtab.dst_func,
-		info->ulp_info->target_func_addr,
-		info->ulp_strtab.src_func,
-		info->ulp_info->patch_func_addr);
+	/* All functions of one patch share the ID, added and removed as one */
+	task->max_ulp_id++;
+	for (i = 0; i < info->nr_funcs; i++) {
+		info->ulp_info[i].ulp_id = task->max_ulp_id;
+		info->ulp_info[i].time = now;
+	}
 
-	/* copy patch to target address space */
-	n = memcpy_to_task(task, target_hdr, info->hdr, info->len);
-	if (n == -1 || n < info->len) {
-		ulp_error("failed kick target process.\n");
-		err = -ENOEXEC;
-		goto done;
+	return 0;
+}
+
+/**
+ * The functions of new patch must not overlap the bytes patched by other
+ * patches partly, otherwise the backup of it is a piece of the jump of
+ * another one. If the same bytes are patched, the new one is stacked on
+ * the top, see struct ulp_range. The patch replaced by it is ignored.
+ */
+static int check_patch_ranges(const struct load_info *info)
+{
+	struct task_struct *task = info->target_task;
+	unsigned long start, last;
+	struct ulp_range *r;
+	unsigned int i;
+
+	for (i = 0; i < info->nr_funcs; i++) {
+		start = info->ulp_info[i].virtual_addr;
+		last = start + ulp_info_size(&info->ulp_info[i]) - 1;
+
+		for (r = find_ulp_range(task, start, last); r;
+		     r = find_ulp_range_next(r, start, last)) {
+			if (r->ulp == info->replace)
+				continue;
+			if (r->node.start != start || r->node.last != last) {
+				ulp_error("%s overlaps patch %d partly.\n",
+					  info->ulp_strtabs[i].dst_func,
+					  r->ulp->info.ulp_id);
+				return -EBUSY;
+			}
+			ulp_debug("%s is stacked on patch %d.\n",
+				  info->ulp_strtabs[i].dst_func,
+				  r->ulp->info.ulp_id);
+		}
+	}
+	return 0;
+}
+
+/**
+ * The patch stacked on @ulp, which patched the same bytes later, and is not
+ * one of @ulps, NULL if none. The patch can't be unpatched or updated
+ * before the ones on top of it, the backup of them is the jump of it.
+ */
+static struct vma_ulp *find_stacked_ulp(struct task_struct *task,
+					struct vma_ulp *ulp,
+					struct vma_ulp **ulps, int nr)
+{
+	unsigned long start, last;
+	struct ulp_range *r;
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < ulp->nr_ranges; i++) {
+		start = ulp->ranges[i].node.start;
+		last = ulp->ranges[i].node.last;
+
+		for (r = find_ulp_range(task, start, last); r;
+		     r = find_ulp_range_next(r, start, last)) {
+			if (r->ulp->info.ulp_id <= ulp->info.ulp_id)
+				continue;
+			for (j = 0; j < nr && ulps[j] != r->ulp; j++);
+			if (j == nr)
+				return r->ulp;
+		}
+	}
+	return NULL;
+}
+
+static struct patch_stop_stats patch_stop_stats;
+
+void patch_get_stop_stats(struct patch_stop_stats *stats)
+{
+	*stats = patch_stop_stats;
+}
+
+static struct patch_phase_stats phase_stats;
+
+static const char *patch_phase_names[PATCH_PHASE_NUM] = {
+	[PATCH_PHASE_ALLOC] = "alloc",
+	[PATCH_PHASE_MMAP] = "mmap",
+	[PATCH_PHASE_REWRITE] = "rewrite",
+	[PATCH_PHASE_SIMPLIFY] = "simplify",
+	[PATCH_PHASE_RELOCATE] = "relocate",
+	[PATCH_PHASE_SOLVE] = "solve",
+	[PATCH_PHASE_KICK] = "kick",
+	[PATCH_PHASE_STOP] = "stop",
+};
+
+const char *patch_phase_name(enum patch_phase phase)
+{
+	if (phase >= PATCH_PHASE_NUM)
+		return "unknown";
+	return patch_phase_names[phase];
+}
+
+void patch_get_phase_stats(struct patch_phase_stats *stats)
+{
+	*stats = phase_stats;
+	stats->stop = patch_stop_stats;
+}
+
+static void phase_begin(struct task_struct *task, const char *op)
+{
+	memset(&phase_stats, 0, sizeof(phase_stats));
+	phase_stats.pid = task->pid;
+	phase_stats.op = op;
+}
+
+/* Account the cost since @start to @phase, return current time */
+static unsigned long phase_end(enum patch_phase phase, unsigned long start)
+{
+	unsigned long now = nsecs();
+	phase_stats.phase_ns[phase] += now - start;
+	return now;
+}
+
+static void phase_done(int ret, unsigned long start)
+{
+	phase_stats.ret = ret;
+	phase_stats.total_ns = nsecs() - start;
+}
+
+/**
+ * One record of each patch or unpatch, the JSON record is one line, which
+ * is easy to be collected by log agent.
+ */
+void print_patch_phase_stats(FILE *fp, const struct patch_phase_stats *stats,
+			     bool json)
+{
+	const struct patch_stop_stats *stop = &stats->stop;
+	int i;
+
+	if (json) {
+		fprintf(fp, "{\"pid\":%d,\"op\":\"%s\",\"ret\":%d,"
+			"\"prelinked\":%s,\"inherited\":%s,\"total_ns\":%lu,"
+			"\"phases\":{",
+			stats->pid, stats->op ?: "none", stats->ret,
+			stats->prelinked ? "true" : "false",
+			stats->inherited ? "true" : "false", stats->total_ns);
+		for (i = 0; i < PATCH_PHASE_NUM; i++)
+			fprintf(fp, "%s\"%s\":%lu", i ? "," : "",
+				patch_phase_name(i), stats->phase_ns[i]);
+		fprintf(fp, "},\"stop\":{\"nr_funcs\":%u,\"stop_ns\":%lu,"
+			"\"nr_threads\":%u,\"check_ns\":%lu,"
+			"\"nr_retries\":%u,\"nr_skipped\":%u}}\n",
+			stop->nr_funcs, stop->stop_ns, stop->nr_threads,
+			stop->check_ns, stop->nr_retries, stop->nr_skipped);
+		return;
 	}
 
-	task_attach(task->pid);
+	fprintf(fp, "Task %d %s ret %d%s%s, total %.3f ms\n", stats->pid,
+		stats->op ?: "none", stats->ret,
+		stats->prelinked ? " (prelinked)" : "",
+		stats->inherited ? " (inherited)" : "",
+		stats->total_ns / 1000000.0);
+	for (i = 0; i < PATCH_PHASE_NUM; i++)
+		fprintf(fp, "  %-10s %10.3f ms\n", patch_phase_name(i),
+			stats->phase_ns[i] / 1000000.0);
+	fprintf(fp, "  %u functions, check %u threads in %.3f ms, %u retries"
+		" (%u without stop)\n",
+		stop->nr_funcs, stop->nr_threads, stop->check_ns / 1000000.0,
+		stop->nr_retries, stop->nr_skipped);
+}
+
+static void record_stop(struct task_struct *task, unsigned int nr_funcs,
+			unsigned long start)
+{
+	patch_stop_stats.nr_funcs = nr_funcs;
+	patch_stop_stats.stop_ns = nsecs() - start;
+	phase_stats.phase_ns[PATCH_PHASE_STOP] = patch_stop_stats.stop_ns;
+
+	ulp_info("Stop %d for %ld ns, %u functions, check %u threads in %ld ns, %u retries.\n",
+		 task->pid, patch_stop_stats.stop_ns, nr_funcs,
+		 patch_stop_stats.nr_threads, patch_stop_stats.check_ns,
+		 patch_stop_stats.nr_retries);
+}
+
+static int cmp_addr_range(const void *a, const void *b)
+{
+	const struct task_addr_range *ra = a, *rb = b;
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static bool patch_quiesce_enabled = false;
+
+/**
+ * Park the threads by the injected signal handler instead of ptrace stop,
+ * see task_quiesce_threads(), fall back to ptrace stop if it's impossible.
+ * Only the PC is checked, thus it's used when only the entries of target
+ * functions are rewritten. Releasing a patch needs the stacks check and
+ * the remote munmap(2), which are done in ptrace stop.
+ */
+void patch_quiesce_enable(bool enable)
+{
+	patch_quiesce_enabled = enable;
+}
+
+/**
+ * Freeze all threads of target task with the stacks check, see
+ * freeze_safely(), by the signal handler if @quiesce and possible.
+ */
+static int freeze_check(struct task_struct *task,
+			const struct task_addr_range *ranges, unsigned int nr,
+			bool quiesce, struct task_stack_stats *st)
+{
+	int err;
+
+	if (quiesce) {
+		err = task_quiesce_threads(task, ranges, nr,
+					   PATCH_SAFETY_BUDGET_NS, st);
+		if (!err || err == -EBUSY)
+			return err;
+		ulp_debug("Quiesce %d failed, %s, stop by ptrace.\n",
+			  task->pid, strerror(-err));
+		memset(st, 0, sizeof(*st));
+	}
+
+	err = task_freeze_threads(task);
+	if (err) {
+		ulp_error("Freeze target process failed.\n");
+		return err;
+	}
+	if (!nr)
+		return 0;
+
+	err = task_check_stacks(task, ranges, nr, PATCH_SAFETY_BUDGET_NS, st);
+	if (err)
+		task_thaw_threads(task);
+	return err;
+}
+
+/* Resume the threads frozen by freeze_safely() */
+static void thaw_safely(struct task_struct *task)
+{
+	if (task_quiesced(task))
+		task_quiesce_release(task);
+	else
+		task_thaw_threads(task);
+	/* Restore the signal action of target if has */
+	task_quiesce_end(task);
+}
+
+/**
+ * Freeze target task, and make sure no thread is executing the @nr code
+ * blocks to be rewritten, otherwise thaw and retry later with backoff. If
+ * @nr is 0, such as only the GOT slots are written, the stacks are not
+ * checked. If @quiesce, try task_quiesce_threads() first, see
+ * patch_quiesce_enable(). Before every freeze, the blocked threads are
+ * checked without stop, see task_precheck_stacks(). Return the start time
+ * of the last window through @start.
+ */
+static int freeze_safely(struct task_struct *task, const struct code_write *w,
+			 unsigned int nr, bool quiesce, unsigned long *start)
+{
+	struct task_addr_range ranges[nr ?: 1];
+	struct task_stack_stats st = {};
+	unsigned long backoff = PATCH_SAFETY_BACKOFF_US;
+	unsigned int i, retry;
+	struct task_sym *sym;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		ranges[i].start = w[i].addr;
+		ranges[i].end = w[i].addr + w[i].len;
+	}
+	/* See task_check_stacks() */
+	qsort(ranges, nr, sizeof(ranges[0]), cmp_addr_range);
+
+	patch_stop_stats.nr_skipped = 0;
+
+	for (retry = 0; ; retry++) {
+		patch_stop_stats.nr_retries = retry;
+
+		/* A blocked thread in ranges is seen without stop */
+		err = nr ? task_precheck_stacks(task, ranges, nr, &st) : 0;
+		if (err == -EBUSY) {
+			patch_stop_stats.nr_skipped++;
+		} else {
+			*start = nsecs();
+			err = freeze_check(task, ranges, nr, quiesce, &st);
+			patch_stop_stats.nr_threads = st.nr_threads;
+			patch_stop_stats.check_ns = st.check_ns;
+			if (!err)
+				return 0;
+		}
+
+		if (err == -EBUSY) {
+			sym = find_task_sym_contain(task, st.busy_addr, NULL);
+			ulp_debug("Thread %d is busy at %lx(%s), retry %u.\n",
+				  st.busy_tid, st.busy_addr,
+				  sym ? sym->name : "??", retry);
+		} else if (err == -ETIME) {
+			ulp_debug("Check stacks timeout %ld ns, retry %u.\n",
+				  st.check_ns, retry);
+		} else {
+			task_quiesce_end(task);
+			return err;
+		}
+
+		if (retry >= PATCH_SAFETY_MAX_RETRIES) {
+			ulp_error("Task %d is busy, give up after %u retries.\n",
+				  task->pid, retry);
+			task_quiesce_end(task);
+			return -EBUSY;
+		}
+
+		usleep(backoff);
+		backoff = MIN(backoff * 2, PATCH_SAFETY_BACKOFF_MAX_US);
+	}
+}
+
+/**
+ * Write all code blocks into target task, all or nothing. If any of them
+ * failed, the written ones are restored from struct code_write::old in
+ * reverse order. All threads of target task must be frozen.
+ */
+static int write_code_all(struct task_struct *task,
+			  const struct code_write *w, unsigned int nr)
+{
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < nr; i++) {
+		n = memcpy_to_task(task, w[i].addr, (void *)w[i].new, w[i].len);
+		if (n == -1 || n < w[i].len)
+			break;
+	}
+
+	if (i == nr)
+		return 0;
+
+	ulp_error("Write %lx failed, rollback %u functions.\n", w[i].addr, i);
+
+	/* The failed one maybe written partly, restore it too */
+	do {
+		n = memcpy_to_task(task, w[i].addr, (void *)w[i].old, w[i].len);
+		if (n == -1 || n < w[i].len)
+			ulp_error("Rollback %lx failed.\n", w[i].addr);
+	} while (i--);
+
+	return -ENOEXEC;
+}
+
+/**
+ * Rewrite @nr code blocks of target task in one stop window, all or
+ * nothing, no thread is executing any of them while rewriting. The caller
+ * need not freeze the task.
+ */
+int write_code_safely(struct task_struct *task, const struct code_write *w,
+		      unsigned int nr)
+{
+	unsigned long start;
+	int err;
+
+	if (!nr)
+		return 0;
+
+	err = freeze_safely(task, w, nr, patch_quiesce_enabled, &start);
+	if (err)
+		return err;
+
+	/* The parked threads may wake up while writing, stop them by ptrace */
+	if (task_quiesced(task) && task_quiesce_check(task)) {
+		ulp_debug("Quiescence of %d expired, stop by ptrace.\n",
+			  task->pid);
+		thaw_safely(task);
+		err = freeze_safely(task, w, nr, false, &start);
+		if (err)
+			return err;
+	}
+
+	err = write_code_all(task, w, nr);
+
+	thaw_safely(task);
+	record_stop(task, nr, start);
+	return err;
+}
+
+union patch_jmp {
+	struct jmp_table_entry jmp_entry;
+	char near[sizeof(struct jmp_table_entry)];
+};
+
+static bool patch_veneer_enabled = false;
+
+/**
+ * Jump to the far patch function through a veneer near the target function,
+ * thus only one direct jump is written to the entry of it, instead of the
+ * jmp table, see ULP_INFO_F_VENEER.
+ */
+void patch_veneer_enable(bool enable)
+{
+	patch_veneer_enabled = enable;
+}
+
+static bool is_near_jmp(unsigned long ip, unsigned long addr)
+{
+	union patch_jmp insn;
+
+	return arch_near_jmp(ip, addr, insn.near) != 0;
+}
+
+/* The veneer in the local copy of veneer island */
+static struct jmp_table_entry *veneer_slot(struct ulp_veneer_hdr *hdr,
+					   int slot)
+{
+	return (void *)hdr + ULP_VENEER_HDR_SIZE + slot * ULP_VENEER_SLOT_SIZE;
+}
+
+/**
+ * Find the veneer jumps to @addr, or a free one if @addr is zero, which is
+ * reachable by the direct jump of @ip. Return the address of it, 0 if not
+ * found.
+ */
+static unsigned long find_veneer(struct task_struct *task, unsigned long ip,
+				 unsigned long addr,
+				 struct vm_area_struct **pvma, int *pslot)
+{
+	struct vm_area_struct *vma;
+	struct ulp_veneer_hdr *hdr;
+	unsigned long v;
+	int i;
+
+	task_for_each_vma(vma, task) {
+		hdr = vma->ulp_veneer;
+		if (vma->type != VMA_ULPATCH || !hdr)
+			continue;
+
+		for (i = 0; i < hdr->nr_slots; i++) {
+			if (addr ? !hdr->refs[i] ||
+				   veneer_slot(hdr, i)->addr != addr :
+				   hdr->refs[i])
+				continue;
+			v = ulp_veneer_slot_addr(vma->vm_start, i);
+			if (!is_near_jmp(ip, v))
+				continue;
+			*pvma = vma;
+			*pslot = i;
+			return v;
+		}
+	}
+	return 0;
+}
+
+/* Map a new veneer island near @ip, NULL if impossible */
+static struct vm_area_struct *create_veneer_vma(struct task_struct *task,
+						unsigned long ip)
+{
+	unsigned long addr, last;
+	char buffer[PATH_MAX];
+	struct mmap_struct *mem;
+	struct ulp_veneer_hdr *hdr;
+	struct vm_area_struct *vma;
+	char *path;
+
+	if (!find_near_vma_gap(task, ULP_VENEER_SIZE, ip))
+		return NULL;
+
+	path = __make_pid_ulpname(task->pid, buffer, sizeof(buffer),
+				  PATCH_VENEER_TEMP_PREFIX "XXXXXX");
+
+	mem = fmmap_shmem_create(path, ULP_VENEER_SIZE);
+	if (!mem)
+		return NULL;
+
+	hdr = mem->mem;
+	memcpy(hdr->magic, ULP_VENEER_MAGIC, sizeof(hdr->magic));
+	hdr->version = ULP_VENEER_VERSION;
+	hdr->nr_slots = ULP_VENEER_MAX_SLOTS;
+	fmunmap(mem);
+
+	if (create_mmap_vma_file(task, path, ULP_VENEER_SIZE, ip, &addr)) {
+		ulp_error("Create veneer island %s failed.\n", path);
+		fremove(path);
+		return NULL;
+	}
+
+	/* The placement falls back to anywhere, see find_patch_vma_addr() */
+	last = ulp_veneer_slot_addr(addr, ULP_VENEER_MAX_SLOTS - 1);
+	vma = find_vma(task, addr);
+	if (!vma || !is_near_jmp(ip, addr) || !is_near_jmp(ip, last) ||
+	    vma_load_ulp(vma)) {
+		ulp_warning("Veneer island %lx is not near %lx.\n", addr, ip);
+		task_munmap(task, addr, ULP_VENEER_SIZE);
+		if (vma)
+			free_ulp(vma);
+		fremove(path);
+		return NULL;
+	}
+
+	ulp_debug("Veneer island %s at %lx near %lx\n", path, addr, ip);
+	return vma;
+}
+
+static int veneer_write_hdr(struct vm_area_struct *vma)
+{
+	int n;
+
+	n = memcpy_to_task(vma->task, vma->vm_start, vma->ulp_veneer,
+			   sizeof(struct ulp_veneer_hdr));
+	return n == sizeof(struct ulp_veneer_hdr) ? 0 : -EFAULT;
+}
+
+/**
+ * Get the veneer from @ip to @addr, the one of same patch function is
+ * shared, otherwise a free one is written, the island is created if none
+ * is near.
+ */
+static int get_veneer(struct task_struct *task, unsigned long ip,
+		      unsigned long addr)
+{
+	struct vm_area_struct *vma;
+	struct jmp_table_entry *ent;
+	int slot, n;
+
+	if (find_veneer(task, ip, addr, &vma, &slot))
+		goto get;
+
+	if (!find_veneer(task, ip, 0, &vma, &slot) &&
+	    (!create_veneer_vma(task, ip) ||
+	     !find_veneer(task, ip, 0, &vma, &slot)))
+		return -ENOSPC;
+
+	ent = veneer_slot(vma->ulp_veneer, slot);
+	ent->jmp = arch_jmp_table_jmp();
+	ent->addr = addr;
+	n = memcpy_to_task(task, ulp_veneer_slot_addr(vma->vm_start, slot),
+			   ent, sizeof(*ent));
+	if (n != sizeof(*ent))
+		return -EFAULT;
+
+get:
+	if (vma->ulp_veneer->refs[slot] == UINT16_MAX)
+		return -EOVERFLOW;
+
+	vma->ulp_veneer->refs[slot]++;
+	if (veneer_write_hdr(vma)) {
+		vma->ulp_veneer->refs[slot]--;
+		return -EFAULT;
+	}
+
+	ulp_debug("Veneer %lx from %lx to %lx, refs %u\n",
+		  ulp_veneer_slot_addr(vma->vm_start, slot), ip, addr,
+		  vma->ulp_veneer->refs[slot]);
+	return 0;
+}
+
+/* Put the veneer of get_veneer(), unmap the island if it's empty */
+static int put_veneer(struct task_struct *task, unsigned long ip,
+		      unsigned long addr)
+{
+	struct vm_area_struct *vma;
+	struct ulp_veneer_hdr *hdr;
+	int slot, i;
+
+	if (!find_veneer(task, ip, addr, &vma, &slot))
+		return -ENOENT;
+
+	hdr = vma->ulp_veneer;
+	hdr->refs[slot]--;
+	for (i = 0; i < hdr->nr_slots; i++)
+		if (hdr->refs[i])
+			return veneer_write_hdr(vma);
+
+	if (task_munmap(task, vma->vm_start, vma->vm_end - vma->vm_start)) {
+		ulp_error("failed to munmap veneer island.\n");
+		return -ENOEXEC;
+	}
+
+	free_ulp(vma);
+	fremove(vma->name_);
+	return 0;
+}
+
+/* Put the veneers of @nr functions of @infos */
+static void put_veneers(struct task_struct *task, struct ulpatch_info *infos,
+			unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!(infos[i].flags & ULP_INFO_F_VENEER))
+			continue;
+		if (put_veneer(task, infos[i].virtual_addr,
+			       infos[i].patch_func_addr))
+			ulp_warning("Put veneer of %lx failed.\n",
+				    infos[i].virtual_addr);
+		infos[i].flags &= ~ULP_INFO_F_VENEER;
+	}
+}
+
+/**
+ * Use the veneer for the function of @ulp_info if it's enabled and the
+ * patch is out of range of direct jump, fall back to the jmp table if no
+ * veneer island could be mapped near the target function.
+ */
+static void setup_veneer(struct task_struct *task,
+			 struct ulpatch_info *ulp_info)
+{
+	int err;
+
+	if (!patch_veneer_enabled ||
+	    ulp_info->flags & (ULP_INFO_F_GOT | ULP_INFO_F_JMP_TABLE |
+			       ULP_INFO_F_VENEER) ||
+	    is_near_jmp(ulp_info->virtual_addr, ulp_info->patch_func_addr))
+		return;
+
+	err = get_veneer(task, ulp_info->virtual_addr,
+			 ulp_info->patch_func_addr);
+	if (err) {
+		ulp_warning("No veneer near %lx, jmp table instead, %s.\n",
+			    ulp_info->virtual_addr, strerror(-err));
+		return;
+	}
+	ulp_info->flags |= ULP_INFO_F_VENEER;
+}
+
+/* The jump written to the entry of target function, return the length */
+static size_t patch_jmp_insn(struct task_struct *task,
+			     const struct ulpatch_info *ulp_info,
+			     union patch_jmp *insn)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr;
+	size_t len;
+	int slot;
+
+	addr = ulp_info->patch_func_addr;
+	if (ulp_info->flags & ULP_INFO_F_VENEER)
+		addr = find_veneer(task, ulp_info->virtual_addr, addr, &vma,
+				   &slot);
+
+	/**
+	 * Direct jump if the patch or the veneer is near enough, less bytes
+	 * are modified, and no indirect branch.
+	 */
+	if (ulp_info->flags & ULP_INFO_F_JMP_TABLE || !addr)
+		len = 0;
+	else
+		len = arch_near_jmp(ulp_info->virtual_addr, addr, insn->near);
+	if (!len) {
+		insn->jmp_entry.jmp = arch_jmp_table_jmp();
+		insn->jmp_entry.addr = ulp_info->patch_func_addr;
+		len = sizeof(struct jmp_table_entry);
+	}
+	return len;
+}
+
+/**
+ * Check every function of @ulp jumps to the patch in @task, such as the
+ * patch inherited from the parent by fork(2), of which the text and the
+ * patch VMA are copied, no relocation is needed.
+ */
+int verify_patch(struct task_struct *task, struct vma_ulp *ulp)
+{
+	struct ulpatch_info *infos = ulp->infos ?: &ulp->info;
+	unsigned int i, nr = ulp->infos ? ulp->nr_funcs : 1;
+	union patch_jmp insn, cur;
+	size_t len;
+	int n;
+
+	for (i = 0; i < nr; i++) {
+		if (infos[i].patch_func_addr < ulp->start ||
+		    infos[i].patch_func_addr >= ulp->start + ulp->len) {
+			ulp_debug("Patch function %lx is not in %lx-%lx\n",
+				  infos[i].patch_func_addr, ulp->start,
+				  ulp->start + ulp->len);
+			return -ENOEXEC;
+		}
+
+		if (infos[i].flags & ULP_INFO_F_GOT) {
+			len = sizeof(infos[i].patch_func_addr);
+			memcpy(&insn, &infos[i].patch_func_addr, len);
+		} else
+			len = patch_jmp_insn(task, &infos[i], &insn);
+		n = memcpy_from_task(task, &cur, infos[i].virtual_addr, len);
+		if (n == -1 || n < len || memcmp(&cur, &insn, len)) {
+			ulp_debug("Function %lx not jump to patch %lx\n",
+				  infos[i].virtual_addr,
+				  infos[i].patch_func_addr);
+			return -ENOEXEC;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Generate the trampoline of every ULPATCH_ORIG() called by the patch, after
+ * the original code is backed up, before the image is copied into target.
+ * All bytes of ulp_info_size() are relocated, not only the jump, thus the
+ * trampoline is still valid if the jump changes, see kick_update_process().
+ */
+static int setup_orig_tramps(const struct load_info *info)
+{
+	struct task_struct *task = info->target_task;
+	GElf_Shdr *shdr = &info->sechdrs[info->index.orig];
+	struct ulpatch_orig *o = (void *)info->hdr + shdr->sh_offset;
+	unsigned long addr = info->target_hdr + shdr->sh_offset;
+	unsigned long lit, jmp = arch_jmp_table_jmp();
+	const struct ulpatch_info *ulp_info;
+	/* The last instruction may cross the end of backup */
+	unsigned char code[sizeof(ulp_info->orig_code) * 2];
+	const char *dst_func;
+	unsigned int i;
+	size_t used = 0;
+	ssize_t n;
+
+	for (i = 0; i < info->nr_funcs; i++, o++, addr += sizeof(*o)) {
+		if (!info->orig_undefs[i])
+			continue;
+
+		ulp_info = &info->ulp_info[i];
+		dst_func = info->ulp_strtabs[i].dst_func;
+		lit = addr + offsetof(struct ulpatch_orig, addr);
+		memset(o, 0, sizeof(*o));
+
+		/**
+		 * The GOT slot is replaced, not the code. The function patched
+		 * by the jmp table of another patch jumps to it.
+		 */
+		if (ulp_info->flags & ULP_INFO_F_GOT ||
+		    !memcmp(ulp_info->orig_code, &jmp, sizeof(jmp))) {
+			n = arch_orig_tramp(0, NULL, 0, 0, addr, o->tramp,
+					    sizeof(o->tramp), lit, &used);
+			o->addr = ulp_info->orig_code[
+				ulp_info->flags & ULP_INFO_F_GOT ? 0 : 1];
+		} else {
+			memset(code, 0, sizeof(code));
+			memcpy(code, ulp_info->orig_code,
+			       sizeof(ulp_info->orig_code));
+			memcpy_from_task(task,
+					 code + sizeof(ulp_info->orig_code),
+					 ulp_info->virtual_addr +
+					 sizeof(ulp_info->orig_code),
+					 sizeof(ulp_info->orig_code));
+			n = arch_orig_tramp(ulp_info->virtual_addr, code,
+					    sizeof(code),
+					    ulp_info_size(ulp_info), addr,
+					    o->tramp, sizeof(o->tramp), lit,
+					    &used);
+			o->addr = ulp_info->virtual_addr + used;
+		}
+		if (n < 0) {
+			ulp_error("Couldn't relocate the entry of %s for "
+				  "%s%s, %s.\n", dst_func, dst_func,
+				  ULP_ORIG_SUFFIX, strerror(-n));
+			return n;
+		}
+
+		ulp_debug("%s%s at %lx, %zu bytes relocated, back to %lx\n",
+			  dst_func, ULP_ORIG_SUFFIX, addr, used, o->addr);
+	}
+	return 0;
+}
+
+static int kick_target_process(const struct load_info *info)
+{
+	int n;
+	int err = 0;
+	unsigned int i, nr = info->nr_funcs, nr_code = 0, nr_got = 0;
+	struct task_struct *task = info->target_task;
+	unsigned long target_hdr = info->target_hdr;
+	unsigned long start;
+	union patch_jmp insn[nr];
+	struct code_write w[nr], *wi;
+	size_t size;
+
+	for (i = 0; i < nr; i++) {
+		struct ulpatch_info *ulp_info = &info->ulp_info[i];
+
+		/**
+		 * The code blocks first, then the GOT slots from the end, see
+		 * freeze_safely().
+		 */
+		if (ulp_info->flags & ULP_INFO_F_GOT) {
+			wi = &w[nr - ++nr_got];
+			wi->len = sizeof(ulp_info->patch_func_addr);
+			wi->new = &ulp_info->patch_func_addr;
+		} else {
+			setup_veneer(task, ulp_info);
+			wi = &w[nr_code++];
+			wi->len = patch_jmp_insn(task, ulp_info, &insn[i]);
+			wi->new = &insn[i];
+		}
+		wi->addr = ulp_info->virtual_addr;
+		wi->old = ulp_info->orig_code;
+
+		/* Always backup all, see delete_patch() */
+		size = ulp_info_size(ulp_info);
+		memset(ulp_info->orig_code, 0, sizeof(ulp_info->orig_code));
+		n = memcpy_from_task(task, ulp_info->orig_code,
+				     ulp_info->virtual_addr, size);
+		if (n == -1 || n < size) {
+			ulp_error("Backup original instructions failed.\n");
+			err = -ENOEXEC;
+			goto done;
+		}
+
+		ulp_debug("Copy ulpatch to target process. %s: from %s(%lx) jump to %s(%lx)\n",
+			ulp_info->flags & ULP_INFO_F_GOT ? "GOT slot" :
+			wi->len == sizeof(struct jmp_table_entry) ?
+				"Jmp table" : "Near jmp",
+			info->ulp_strtabs[i].dst_func,
+			ulp_info->target_func_addr,
+			info->ulp_strtabs[i].src_func,
+			ulp_info->patch_func_addr);
+	}
+
+	if (info->index.orig) {
+		err = setup_orig_tramps(info);
+		if (err)
+			goto done;
+	}
+
+	/* copy patch to target address space */
+	n = memcpy_to_task(task, target_hdr, info->hdr, info->len);
+	if (n == -1 || n < info->len) {
+		ulp_error("failed kick target process.\n");
+		err = -ENOEXEC;
+		goto done;
+	}
+
+	/**
+	 * Stop all threads once for all functions, make sure no thread run
+	 * the target function entry while rewrite it. The GOT slots are data,
+	 * written by one aligned store each, no stack is checked for them.
+	 */
+	err = freeze_safely(task, w, nr_code, patch_quiesce_enabled, &start);
+	if (err)
+		goto done;
+
+	err = write_code_all(task, w, nr);
+
+	thaw_safely(task);
+	record_stop(task, nr, start);
+
+done:
+	if (err)
+		ulp_error("Kick target process failed.\n");
+	return err;
+}
+
+/* The function of @infos at @addr, NULL if not patched by them */
+static struct ulpatch_info *find_func_at(struct ulpatch_info *infos,
+					 unsigned int nr, unsigned long addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (infos[i].virtual_addr == addr)
+			return &infos[i];
+	return NULL;
+}
+
+/**
+ * Kick the patch @info, which replaces info->replace, see update_patch().
+ * If a function is patched by both of them through struct jmp_table_entry
+ * or the GOT slot, only the address word is replaced by one aligned
+ * store, no instruction is modified. The other functions of new patch are
+ * rewritten as kick_target_process() does, and the functions only patched
+ * by the old one are restored. The stacks are checked against the code
+ * rewritten and the old patch, which is released after.
+ */
+static int kick_update_process(const struct load_info *info)
+{
+	struct vma_ulp *old_ulp = info->replace;
+	struct task_struct *task = info->target_task;
+	struct ulpatch_info *infos = info->ulp_info, *old;
+	struct ulpatch_info *old_infos = old_ulp->infos ?: &old_ulp->info;
+	unsigned int nr_old = old_ulp->infos ? old_ulp->nr_funcs : 1;
+	unsigned int i, nr = info->nr_funcs + nr_old, nr_code = 0, nr_word = 0;
+	union patch_jmp insn[info->nr_funcs], cur[nr];
+	struct code_write w[nr], words[nr], *wi;
+	unsigned long start;
+	size_t size;
+	int n, err;
+
+	err = verify_patch(task, old_ulp);
+	if (err) {
+		ulp_error("Patch %d is broken, can't be updated.\n",
+			  old_ulp->info.ulp_id);
+		return err;
+	}
+
+	for (i = 0; i < info->nr_funcs; i++) {
+		old = find_func_at(old_infos, nr_old, infos[i].virtual_addr);
+
+		if (infos[i].flags & ULP_INFO_F_GOT) {
+			wi = &words[nr_word++];
+			wi->addr = infos[i].virtual_addr;
+			wi->len = sizeof(infos[i].patch_func_addr);
+			wi->new = &infos[i].patch_func_addr;
+		} else if (old && patch_jmp_insn(task, old, &insn[i]) ==
+			   sizeof(struct jmp_table_entry)) {
+			/* Keep the jmp table, the address word is swapped */
+			infos[i].flags |= ULP_INFO_F_JMP_TABLE;
+			wi = &words[nr_word++];
+			wi->addr = infos[i].virtual_addr +
+				   offsetof(struct jmp_table_entry, addr);
+			wi->len = sizeof(infos[i].patch_func_addr);
+			wi->new = &infos[i].patch_func_addr;
+		} else {
+			setup_veneer(task, &infos[i]);
+			wi = &w[nr_code++];
+			wi->addr = infos[i].virtual_addr;
+			wi->len = patch_jmp_insn(task, &infos[i], &insn[i]);
+			wi->new = &insn[i];
+		}
+
+		/* The original code is backed up by the old one */
+		if (old) {
+			memcpy(infos[i].orig_code, old->orig_code,
+			       sizeof(old->orig_code));
+			continue;
+		}
+
+		size = ulp_info_size(&infos[i]);
+		memset(infos[i].orig_code, 0, sizeof(infos[i].orig_code));
+		n = memcpy_from_task(task, infos[i].orig_code,
+				     infos[i].virtual_addr, size);
+		if (n == -1 || n < size) {
+			ulp_error("Backup original instructions failed.\n");
+			return -ENOEXEC;
+		}
+	}
+
+	/* Restore the functions not patched by the new one */
+	for (i = 0; i < nr_old; i++) {
+		if (find_func_at(infos, info->nr_funcs,
+				 old_infos[i].virtual_addr))
+			continue;
+		if (old_infos[i].flags & ULP_INFO_F_GOT)
+			wi = &words[nr_word++];
+		else
+			wi = &w[nr_code++];
+		wi->addr = old_infos[i].virtual_addr;
+		wi->len = ulp_info_size(&old_infos[i]);
+		wi->new = old_infos[i].orig_code;
+	}
+
+	/* The address words after the code blocks, see freeze_safely() */
+	memcpy(&w[nr_code], words, nr_word * sizeof(words[0]));
+	nr = nr_code + nr_word;
+
+	for (i = 0; i < nr; i++) {
+		w[i].old = &cur[i];
+		n = memcpy_from_task(task, &cur[i], w[i].addr, w[i].len);
+		if (n == -1 || n < w[i].len) {
+			ulp_error("Backup patched code failed.\n");
+			return -ENOEXEC;
+		}
+	}
+
+	if (info->index.orig) {
+		err = setup_orig_tramps(info);
+		if (err)
+			return err;
+	}
+
+	n = memcpy_to_task(task, info->target_hdr, info->hdr, info->len);
+	if (n == -1 || n < info->len) {
+		ulp_error("Copy patch to target process failed.\n");
+		return -ENOEXEC;
+	}
+
+	/**
+	 * No thread may run the old patch, which is released after, the
+	 * range of it is checked as a code block, but never written.
+	 */
+	struct code_write chk[nr_code + 1];
+
+	memcpy(chk, w, nr_code * sizeof(w[0]));
+	chk[nr_code] = (struct code_write) {
+		.addr = old_ulp->start,
+		.len = old_ulp->len,
+	};
+
+	err = freeze_safely(task, chk, nr_code + 1, false, &start);
+	if (err)
+		return err;
+
+	err = write_code_all(task, w, nr);
+
+	thaw_safely(task);
+	record_stop(task, nr, start);
+
+	ulp_debug("Update patch %d, %u address words, %u code blocks.\n",
+		  old_ulp->info.ulp_id, nr_word, nr_code);
+	return err;
+}
+
+/* Number of threads stopped by task_freeze_threads() */
+static unsigned int nr_freeze_threads(struct task_struct *task)
+{
+	struct list_head *threads;
+	struct thread *thread;
+	unsigned int nr = 0;
+
+	if (!(task->fto_flag & FTO_THREADS))
+		return 1;
+
+	/* Not loaded yet in dry run, see estimate_patch() */
+	threads = task_threads(task);
+	if (!threads)
+		return 1;
+
+	list_for_each_entry(thread, threads, node)
+		nr++;
+	return MAX(nr, 1U);
+}
+
+/**
+ * Dry run of kick_target_process(), the original code of target functions
+ * is backed up, the relocated patch is copied, and the function entries are
+ * rewritten in one stop window.
+ */
+static void estimate_kick(const struct load_info *info)
+{
+	struct patch_estimate *est = info->estimate;
+	char insn[sizeof(struct jmp_table_entry)];
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < info->nr_funcs; i++) {
+		struct ulpatch_info *ulp_info = &info->ulp_info[i];
+
+		if (ulp_info->flags & ULP_INFO_F_GOT) {
+			len = sizeof(ulp_info->patch_func_addr);
+		} else {
+			len = arch_near_jmp(ulp_info->virtual_addr,
+					    ulp_info->patch_func_addr, insn);
+			if (len)
+				est->nr_near++;
+			else
+				len = sizeof(struct jmp_table_entry);
+		}
+
+		est->stop_bytes += len;
+		est->bytes_read += ulp_info_size(ulp_info);
+	}
+
+	est->nr_funcs = info->nr_funcs;
+	est->bytes_written += info->len + est->stop_bytes;
+	est->nr_stops++;
+	est->nr_threads = nr_freeze_threads(info->target_task);
+}
+
+static bool patch_counter_enabled = false;
+
+/**
+ * Count the calls of every patched function by the trampoline, see struct
+ * ulpatch_counter and read_patch_counters().
+ */
+void patch_counter_enable(bool enable)
+{
+	patch_counter_enabled = enable;
+}
+
+/* SEC_ULPATCH_COUNTER if counters enabled and the patch has, otherwise 0 */
+static unsigned int patch_counter_sec(const struct load_info *info)
+{
+	unsigned int idx;
+
+	if (!patch_counter_enabled)
+		return 0;
+
+	idx = find_sec(info, SEC_ULPATCH_COUNTER);
+	if (!idx || idx > UINT16_MAX || info->sechdrs[idx].sh_size <
+	    info->nr_funcs * sizeof(struct ulpatch_counter)) {
+		ulp_warning("No %s in %s, not counted.\n", SEC_ULPATCH_COUNTER,
+			    info->name ?: "patch");
+		return 0;
+	}
+	return idx;
+}
+
+/**
+ * Redirect every function to the trampoline of counter, after the patch
+ * functions are solved, see solve_patch_func().
+ */
+static void setup_patch_counters(struct load_info *info)
+{
+	GElf_Shdr *shdr = &info->sechdrs[info->index.counter];
+	struct ulpatch_counter *c = (void *)info->hdr + shdr->sh_offset;
+	unsigned long addr = info->target_hdr + shdr->sh_offset;
+	unsigned int i;
+
+	/* 64 bytes cache line, see .balign of ULPATCH_INFO() */
+	if (addr & 63)
+		ulp_warning("Counters at %lx are not cache line aligned.\n",
+			    addr);
+
+	for (i = 0; i < info->nr_funcs; i++, c++, addr += sizeof(*c)) {
+		memset(c, 0, sizeof(*c));
+		c->addr = info->ulp_info[i].patch_func_addr;
+		counter_tramp(c, addr);
+		info->ulp_info[i].patch_func_addr =
+			addr + offsetof(struct ulpatch_counter, tramp);
+		info->ulp_info[i].flags |= ULP_INFO_F_COUNTER;
+	}
+}
+
+/**
+ * Read the call counts of every function of @ulp into @counts, all of them
+ * by one remote read. Return -ENOENT if not loaded with counters.
+ */
+int read_patch_counters(struct task_struct *task, struct vma_ulp *ulp,
+			unsigned long *counts)
+{
+	unsigned int i, nr = ulp->infos ? ulp->nr_funcs : 1;
+	struct ulpatch_counter c[nr];
+	int n;
+
+	if (!ulp->counters)
+		return -ENOENT;
+
+	n = memcpy_from_task(task, c, ulp->counters, sizeof(c));
+	if (n == -1 || n < sizeof(c))
+		return -EIO;
+
+	for (i = 0; i < nr; i++)
+		counts[i] = c[i].count;
+	return 0;
+}
+
+static int load_patch(struct load_info *info)
+{
+	long err = 0;
+	struct vma_ulp *ulp;
+	struct task_struct *task = info->target_task;
+	struct reloc_logs relocs = {};
+	void *layout = NULL;
+	size_t layout_size = 0;
+	unsigned long t;
+
+	err = setup_load_info(info);
+	if (err)
+		goto free_copy;
+
+	/**
+	 * Check the Build ID exist or not.
+	 */
+	ulp = find_ulp_by_build_id(task, info->str_build_id);
+	if (ulp) {
+		ulp_error("Build ID %s already exist\n" \
+			"Check ULPatch in target process first.\n",
+			ulp->str_build_id);
+		err = -EALREADY;
+		goto free_copy;
+	}
+
+	/* May be there are some blacklists and sign check */
+
+	err = scan_patch_syms(info);
+	if (err)
+		goto free_copy;
+	info->index.counter = patch_counter_sec(info);
+	write_ulpatch_index(info);
+
+	if (!apply_prelink(info, &layout, &layout_size)) {
+		phase_stats.prelinked = true;
+		if (info->estimate)
+			info->estimate->prelinked = true;
+		goto solve;
+	}
+
+	/* Log the relocations for rebase_prelink() */
+	if (layout && !info->estimate)
+		info->relocs = &relocs;
+
+	t = nsecs();
+	err = rewrite_section_headers(info);
+	if (err)
+		goto free_copy;
+	t = phase_end(PATCH_PHASE_REWRITE, t);
+
+	/* Fix up syms, so that st_value is a pointer to location. */
+	err = simplify_symbols(info);
+	if (err < 0)
+		goto free_copy;
+	t = phase_end(PATCH_PHASE_SIMPLIFY, t);
+
+	err = apply_relocations(info);
+	if (err < 0)
+		goto free_copy;
+
+	err = post_relocation(info);
+	if (err < 0)
+		goto free_copy;
+	phase_end(PATCH_PHASE_RELOCATE, t);
+
+	/* Dry run image is never used by target task, don't cache it */
+	if (layout && !info->estimate) {
+		save_prelink(info, layout, layout_size);
+		/* Owned by the prelink entry now */
+		layout = NULL;
+	}
+
+solve:
+	t = nsecs();
+	err = solve_patch_symbols(info);
+	if (err < 0)
+		goto free_copy;
+	err = check_patch_ranges(info);
+	if (err)
+		goto free_copy;
+	if (info->index.counter)
+		setup_patch_counters(info);
+	t = phase_end(PATCH_PHASE_SOLVE, t);
+
+	if (info->estimate) {
+		/* See solve_patch_symbols(), no patch is loaded */
+		task->max_ulp_id--;
+		estimate_kick(info);
+		goto free_copy;
+	}
+
+	if (info->replace)
+		err = kick_update_process(info);
+	else
+		err = kick_target_process(info);
+	if (err < 0) {
+		put_veneers(task, info->ulp_info, info->nr_funcs);
+		goto free_copy;
+	}
+	phase_end(PATCH_PHASE_KICK, t);
+
+free_copy:
+	free(layout);
+	free(relocs.ents);
+	info->relocs = NULL;
+	release_load_info(info);
+	return err;
+}
+
+static bool patch_pool_enabled = false;
+
+/**
+ * Load the small patches into the shared patch pool VMA, instead of
+ * mapping a new VMA for each of them, see struct ulp_pool_hdr.
+ */
+void patch_pool_enable(bool enable)
+{
+	patch_pool_enabled = enable;
+}
+
+static int pool_free_slot(const struct ulp_pool_hdr *hdr)
+{
+	int i;
+
+	for (i = 0; i < hdr->nr_slots; i++)
+		if (!(hdr->used & BIT(i)))
+			return i;
+	return -ENOSPC;
+}
+
+static struct vm_area_struct *find_pool_vma(struct task_struct *task)
+{
+	struct vm_area_struct *vma;
+
+	task_for_each_vma(vma, task) {
+		if (vma->type == VMA_ULPATCH && vma->ulp_pool &&
+		    pool_free_slot(vma->ulp_pool) >= 0)
+			return vma;
+	}
+	return NULL;
+}
+
+static struct vm_area_struct *create_pool_vma(struct task_struct *task,
+					      unsigned long near)
+{
+	char buffer[PATH_MAX];
+	struct mmap_struct *mem;
+	struct ulp_pool_hdr *hdr;
+	unsigned long addr;
+	char *path;
+
+	path = __make_pid_ulpname(task->pid, buffer, sizeof(buffer),
+				  PATCH_POOL_TEMP_PREFIX "XXXXXX");
+
+	mem = fmmap_shmem_create(path, ULP_POOL_SIZE);
+	if (!mem)
+		return NULL;
+
+	hdr = mem->mem;
+	memcpy(hdr->magic, ULP_POOL_MAGIC, sizeof(hdr->magic));
+	hdr->version = ULP_POOL_VERSION;
+	hdr->nr_slots = ULP_POOL_MAX_SLOTS;
+	hdr->slot_size = ULP_POOL_SLOT_SIZE;
+	hdr->used = 0;
+	fmunmap(mem);
+
+	if (create_mmap_vma_file(task, path, ULP_POOL_SIZE, near, &addr)) {
+		ulp_error("Create patch pool %s failed.\n", path);
+		fremove(path);
+		return NULL;
+	}
+
+	/* The header was loaded by vma_load_ulp() while updating VMAs */
+	return find_vma(task, addr);
+}
+
+/* Find a free slot of patch pool for the patch, create pool if needed */
+static int pool_alloc_slot(struct load_info *info, unsigned long near)
+{
+	struct task_struct *task = info->target_task;
+	struct vm_area_struct *vma;
+
+	vma = find_pool_vma(task) ?: create_pool_vma(task, near);
+	if (!vma || !vma->ulp_pool)
+		return -ENOMEM;
+
+	info->pool_vma = vma;
+	info->pool_slot = pool_free_slot(vma->ulp_pool);
+	info->target_hdr = ulp_pool_slot_addr(vma->vm_start, vma->ulp_pool,
+					      info->pool_slot);
+
+	ulp_debug("Patch pool %s slot %d, addr %lx\n", vma->name_,
+		  info->pool_slot, info->target_hdr);
+	return 0;
+}
+
+static int pool_write_hdr(struct vm_area_struct *vma)
+{
+	int n;
+
+	n = memcpy_to_task(vma->task, vma->vm_start, vma->ulp_pool,
+			   sizeof(struct ulp_pool_hdr));
+	return n == sizeof(struct ulp_pool_hdr) ? 0 : -EFAULT;
+}
+
+/* Mark the slot used in target task, and record it in ulp_list */
+static int pool_commit_slot(struct load_info *info)
+{
+	struct vm_area_struct *vma = info->pool_vma;
+	struct ulp_pool_hdr *hdr = vma->ulp_pool;
+	int slot = info->pool_slot;
+	struct load_info tmp = {
+		.target_task = info->target_task,
+	};
+
+	hdr->used |= BIT(slot);
+	hdr->len[slot] = info->len;
+	if (pool_write_hdr(vma)) {
+		ulp_error("Update patch pool header failed.\n");
+		hdr->used &= ~BIT(slot);
+		return -EFAULT;
+	}
+
+	if (!alloc_ulp_slot(vma, slot))
+		load_ulp_info_from_vma(vma, &tmp);
+	return 0;
+}
+
+/**
+ * The address of function to be patched, before the patch is loaded, which
+ * is the hint of placement, 0 if not found.
+ */
+static unsigned long patch_target_func(struct load_info *info)
+{
+	struct ulpatch_strtab strtab;
+	struct task_sym *tsym;
+	unsigned int idx;
+
+	info->sechdrs = (void *)info->hdr + info->hdr->e_shoff;
+	info->secstrings = (void *)info->hdr
+		+ info->sechdrs[info->hdr->e_shstrndx].sh_offset;
+
+	idx = find_sec(info, SEC_ULPATCH_STRTAB);
+	if (!idx || parse_ulpatch_strtab(&strtab, (void *)info->hdr +
+					 info->sechdrs[idx].sh_offset))
+		return 0;
+
+	tsym = find_task_sym(info->target_task, strtab.dst_func, NULL, NULL);
+	return tsym ? tsym->addr : 0;
+}
+
+/**
+ * Load the new standalone patch VMA into task, then it's indexed, and could
+ * be unpatched without re-open the task.
+ */
+static void load_new_patch_vma(struct task_struct *task, unsigned long addr)
+{
+	struct vm_area_struct *vma;
+	struct load_info tmp = {
+		.target_task = task,
+	};
+
+	vma = find_vma(task, addr);
+	if (!vma || vma->type != VMA_ULPATCH)
+		return;
+
+	/* Loaded before the patch was relocated, reload it */
+	if (vma->ulp)
+		free_ulp(vma);
+
+	if (alloc_ulp(vma))
+		return;
+
+	if (load_ulp_info_from_vma(vma, &tmp))
+		unlink_ulp(vma->ulp);
+	else if (task->max_ulp_id < tmp.ulp_info->ulp_id)
+		task->max_ulp_id = tmp.ulp_info->ulp_id;
+}
+
+/* Dry run of pool_alloc_slot() and pool_commit_slot() */
+static int estimate_pool_slot(struct load_info *info, unsigned long near)
+{
+	struct patch_estimate *est = info->estimate;
+	struct task_struct *task = info->target_task;
+	struct ulp_pool_hdr hdr = {
+		.slot_size = ULP_POOL_SLOT_SIZE,
+	};
+	struct vm_area_struct *vma;
+	unsigned long addr;
+
+	vma = find_pool_vma(task);
+	if (vma) {
+		info->target_hdr = ulp_pool_slot_addr(vma->vm_start,
+				vma->ulp_pool, pool_free_slot(vma->ulp_pool));
+	} else {
+		addr = find_patch_vma_addr(task, ULP_POOL_SIZE, near);
+		if (!addr)
+			return -ENOMEM;
+		info->target_hdr = ulp_pool_slot_addr(addr, &hdr, 0);
+		est->nr_syscalls += TASK_MMAP_FD_NR_SYSCALLS;
+		est->nr_vmas++;
+	}
+
+	est->pool = true;
+	/* The pool header is updated after kick */
+	est->bytes_written += sizeof(struct ulp_pool_hdr);
+	return 0;
+}
+
+static bool patch_share_enabled = false;
+
+/**
+ * Map the identical relocated images of different processes from one file,
+ * the page cache is spent once for each unique image, see
+ * share_patch_image().
+ */
+void patch_share_enable(bool enable)
+{
+	patch_share_enabled = enable;
+}
 
-	/**
-	 * FIXME: Make sure safety.
-	 */
+/* Copy @nr struct ulpatch_info, clear the different fields of processes */
+static void ulp_info_mask(struct ulpatch_info *dst,
+			  const struct ulpatch_info *src, unsigned int nr)
+{
+	unsigned int i;
 
-	n = memcpy_to_task(task, info->ulp_info->virtual_addr,
-			   (void *)new_insn, insn_sz);
-	if (n == -1 || n < insn_sz) {
-		ulp_error("failed kick target process.\n");
-		err = -ENOEXEC;
+	memcpy(dst, src, sizeof(*dst) * nr);
+	for (i = 0; i < nr; i++) {
+		dst[i].ulp_id = ULP_ID_NONE;
+		dst[i].time = 0;
 	}
+}
 
-	task_detach(task->pid);
+static uint64_t fnv1a_64(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
 
-done:
-	if (err)
-		ulp_error("Kick target process failed.\n");
-	return err;
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
-static int load_patch(struct load_info *info)
+/* Hash the image of @info, the struct ulpatch_info array is @masked */
+static uint64_t patch_image_hash(const struct load_info *info,
+				 const struct ulpatch_info *masked)
 {
-	long err = 0;
-	struct vma_ulp *ulp, *tmpulp;
-	struct task_struct *task = info->target_task;
+	size_t off = (void *)info->ulp_info - (void *)info->hdr;
+	size_t size = sizeof(*masked) * info->nr_funcs;
+	uint64_t hash = 14695981039346656037ULL;
+
+	hash = fnv1a_64(hash, info->hdr, off);
+	hash = fnv1a_64(hash, masked, size);
+	return fnv1a_64(hash, (void *)info->hdr + off + size,
+			info->len - off - size);
+}
 
-	err = setup_load_info(info);
-	if (err)
-		goto free_copy;
+/**
+ * Map the shared file of the image of @info at the same address, if the
+ * same image of another process exists. The canonical file is
+ * ULP_SHARE_DIR/HASH, and a hard link of it is
+ * ULP_PROC_ROOT_DIR/PID/TASK_PROC_MAP_FILES/ulp-sHASH, thus the patch VMA
+ * is still found by the PID in name. The bytes are compared, the hash is
+ * only the key. The image is mapped MAP_PRIVATE, the writes of the patch,
+ * such as the counters and the data of patch, are private pages of each
+ * process, and the ID and time of patch are written back.
+ */
+static int share_patch_image(struct load_info *info)
+{
+	struct task_struct *task = info->target_task;
+	size_t off = (void *)info->ulp_info - (void *)info->hdr;
+	size_t size = sizeof(struct ulpatch_info) * info->nr_funcs;
+	char canon[PATH_MAX], name[PATH_MAX];
+	struct ulpatch_info *masked, *theirs;
+	struct mmap_struct *f = NULL;
+	bool created = false;
+	unsigned long map_v;
+	uint64_t hash;
+	int n, err = 0;
+
+	masked = malloc(size * 2);
+	if (!masked)
+		return -ENOMEM;
+	theirs = masked + info->nr_funcs;
+
+	ulp_info_mask(masked, info->ulp_info, info->nr_funcs);
+	hash = patch_image_hash(info, masked);
+
+	snprintf(canon, sizeof(canon), ULP_SHARE_DIR "/%016lx", hash);
+	snprintf(name, sizeof(name),
+		 ULP_PROC_ROOT_DIR "/%d/" TASK_PROC_MAP_FILES "/"
+		 PATCH_VMA_TEMP_PREFIX "s%016lx", task->pid, hash);
+
+	if (mkdir(ULP_SHARE_DIR, 0755) && errno != EEXIST) {
+		err = -errno;
+		goto out;
+	}
 
-	/**
-	 * Check the Build ID exist or not.
-	 */
-	list_for_each_entry_safe(ulp, tmpulp, &task->ulp_list, node) {
-		ulp_debug("ULPatch \n");
-		if (!strcmp(ulp->str_build_id, info->str_build_id)) {
-			ulp_error("Build ID %s already exist\n" \
-				"Check ULPatch in target process first.\n",
-				ulp->str_build_id);
-			err = -EALREADY;
-			goto free_copy;
+	if (fexist(canon)) {
+		f = fmmap_rdonly(canon);
+		if (!f || f->size != info->len) {
+			err = -EEXIST;
+			goto out;
 		}
-	}
+		ulp_info_mask(theirs, f->mem + off, info->nr_funcs);
+		if (memcmp(f->mem, info->hdr, off) ||
+		    memcmp(theirs, masked, size) ||
+		    memcmp(f->mem + off + size, (void *)info->hdr + off + size,
+			   info->len - off - size)) {
+			ulp_debug("Hash %016lx collision, not shared.\n", hash);
+			err = -EEXIST;
+			goto out;
+		}
+	} else if (link(info->patch.path, canon)) {
+		err = -errno;
+		goto out;
+	} else
+		created = true;
 
-	/* May be there are some blacklists and sign check */
+	if (link(canon, name)) {
+		err = -errno;
+		goto out;
+	}
 
-	err = rewrite_section_headers(info);
-	if (err)
-		goto free_copy;
+	err = task_attach_session(task);
+	if (err) {
+		fremove(name);
+		goto out;
+	}
 
-	/* Fix up syms, so that st_value is a pointer to location. */
-	err = simplify_symbols(info);
-	if (err < 0)
-		goto free_copy;
+	/* Same bytes, the threads run in it see nothing changed */
+	map_v = mmap_vma_file(task, name, info->len, info->target_hdr,
+			      PROT_READ | PROT_WRITE | PROT_EXEC,
+			      MAP_PRIVATE | MAP_FIXED);
+	if (map_v != info->target_hdr) {
+		ulp_error("Remap shared %s failed.\n", name);
+		err = map_v > -4096UL ? (long)map_v : -EFAULT;
+		fremove(name);
+		goto detach;
+	}
 
-	err = apply_relocations(info);
-	if (err < 0)
-		goto free_copy;
+	/**
+	 * MAP_POPULATE write faults the private writable mapping, and breaks
+	 * COW of all pages, thus prefault it read-only. Old kernel returns
+	 * -EINVAL, the pages are faulted lazily.
+	 */
+	if (task_madvise(task, info->target_hdr, info->len, MADV_POPULATE_READ))
+		ulp_debug("Prefault shared %s failed.\n", name);
 
-	err = post_relocation(info);
-	if (err < 0)
-		goto free_copy;
+	n = memcpy_to_task(task, info->target_hdr + off, info->ulp_info, size);
+	if (n == -1 || n < size) {
+		ulp_error("Write patch info failed.\n");
+		err = -EFAULT;
+	}
 
-	err = solve_patch_symbols(info);
-	if (err < 0)
-		goto free_copy;
+	/* Not mapped any more */
+	fremove(info->patch.path);
+	free(info->patch.path);
+	info->patch.path = strdup(name);
 
-	err = kick_target_process(info);
-	if (err < 0)
-		goto free_copy;
+	update_task_vmas_ulp(task);
+	ulp_debug("Share patch image %s at %lx\n", canon, info->target_hdr);
 
-free_copy:
-	release_load_info(info);
+detach:
+	task_detach_session(task);
+out:
+	/* The canonical file is never mapped MAP_SHARED by any process */
+	if (err && created)
+		fremove(canon);
+	if (f)
+		fmunmap(f);
+	free(masked);
 	return err;
 }
 
+/**
+ * Remove the canonical file of the image shared by @name, see
+ * share_patch_image(), if no process maps it any more.
+ */
+static void unshare_patch_image(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	char canon[PATH_MAX];
+	struct stat st;
+
+	base = base ? base + 1 : name;
+	if (strncmp(base, PATCH_VMA_TEMP_PREFIX "s",
+		    strlen(PATCH_VMA_TEMP_PREFIX) + 1) ||
+	    strlen(base) != strlen(PATCH_VMA_TEMP_PREFIX) + 17)
+		return;
+
+	snprintf(canon, sizeof(canon), ULP_SHARE_DIR "/%s",
+		 base + strlen(PATCH_VMA_TEMP_PREFIX) + 1);
+	if (!stat(canon, &st) && st.st_nlink == 1)
+		fremove(canon);
+}
+
 /* looks like init_module() in kernel */
-int init_patch(struct task_struct *task, const char *obj_file)
+/**
+ * Load patch near @near, or near the target function if zero. If there is
+ * relocation out of range, @near is set to the symbol address of it.
+ */
+static int init_patch_near(struct task_struct *task, const char *obj_file,
+			   struct patch_estimate *est, struct vma_ulp *replace,
+			   unsigned long *near)
 {
 	int err;
 	char buffer[PATH_MAX];
 	char *ulp_file;
+	unsigned long t;
 
 	struct load_info info = {
 		.target_task = task,
 		.str_build_id = NULL,
+		.estimate = est,
+		.replace = replace,
 	};
 
 	if (!(task->fto_flag & FTO_PROC)) {
@@ -925,22 +4168,62 @@ int init_patch(struct task_struct *task, const char *obj_file)
 		return -1;
 	}
 
-	ulp_file = __make_pid_ulpname(task->pid, buffer, sizeof(buffer));
+	ulp_file = __make_pid_ulpname(task->pid, buffer, sizeof(buffer),
+				      PATCH_VMA_TEMP_PREFIX "XXXXXX");
 
+	t = nsecs();
 	err = alloc_patch_file(obj_file, ulp_file, &info);
 	if (err) {
 		ulp_error("Parse %s failed.\n", obj_file);
 		goto err;
 	}
+	phase_end(PATCH_PHASE_ALLOC, t);
 
 	/**
-	 * Target task will open/mmap the object ulp file, thus, it must has
-	 * permission to open and modify the object file.
+	 * The small patch is copied into the slot of patch pool, the ulp file
+	 * is only the local working copy, which is removed at last.
 	 */
-	err = chown(ulp_file, task->status.uid, task->status.gid);
-	if (err) {
-		ulp_error("chown %s failed.\n", ulp_file);
-		goto err;
+	if (!*near)
+		*near = patch_target_func(&info);
+
+	if (patch_pool_enabled && info.len <= ULP_POOL_SLOT_SIZE) {
+		t = nsecs();
+		if (est)
+			err = estimate_pool_slot(&info, *near);
+		else
+			err = pool_alloc_slot(&info, *near);
+		if (err) {
+			release_load_info(&info);
+			goto err;
+		}
+		phase_end(PATCH_PHASE_MMAP, t);
+
+		if (est)
+			est->addr = info.target_hdr;
+
+		err = load_patch(&info);
+		*near = info.range_near;
+		if (!err && !est)
+			err = pool_commit_slot(&info);
+		if (!err && !est)
+			perf_map_add(&info);
+		release_load_info(&info);
+		fremove(ulp_file);
+		return err;
+	}
+
+	/* Relocate the local copy at the address it would be mapped */
+	if (est) {
+		info.target_hdr = find_patch_vma_addr(task, info.len, *near);
+		est->addr = info.target_hdr;
+		est->nr_syscalls += TASK_MMAP_FD_NR_SYSCALLS;
+		est->nr_vmas++;
+
+		err = info.target_hdr ? load_patch(&info) : -ENOMEM;
+		*near = info.range_near;
+		release_load_info(&info);
+		fremove(ulp_file);
+		return err;
 	}
 
 	/**
@@ -948,19 +4231,32 @@ int init_patch(struct task_struct *task, const char *obj_file)
 	 * ULP_PROC_ROOT_DIR/PID/TASK_PROC_MAP_FILES directory, it's named by
 	 * mktemp().
 	 */
-	err = create_mmap_vma_file(task, &info);
+	t = nsecs();
+	err = create_mmap_vma_file(task, info.patch.path, info.len, *near,
+				   &info.target_hdr);
 	if (err) {
 		release_load_info(&info);
 		goto err;
 	}
+	phase_end(PATCH_PHASE_MMAP, t);
 
 	err = load_patch(&info);
+	*near = info.range_near;
 	if (err) {
 		delete_mmap_vma_file(task, &info);
 		release_load_info(&info);
 		goto err;
 	}
 
+	if (patch_share_enabled) {
+		err = share_patch_image(&info);
+		if (err)
+			ulp_warning("Patch image not shared, %s.\n",
+				    strerror(-err));
+	}
+
+	perf_map_add(&info);
+	load_new_patch_vma(task, info.target_hdr);
 	return 0;
 
 err:
@@ -973,55 +4269,435 @@ err:
 	return err;
 }
 
-/* delete last patched patch, so, don't need any other arguments */
-int delete_patch(struct task_struct *task)
+static int __init_patch(struct task_struct *task, const char *obj_file,
+			struct patch_estimate *est, struct vma_ulp *replace)
 {
-	int n, err;
-	size_t insn_sz;
-	struct vma_ulp *ulp, *tmpulp;
-	struct ulpatch_info *ulp_info;
-	struct vm_area_struct *vma;
+	unsigned long near = 0;
+	int err;
 
-	err = 0;
-	ulp_info = NULL;
+	err = init_patch_near(task, obj_file, est, replace, &near);
 
-	list_for_each_entry_safe(ulp, tmpulp, &task->ulp_list, node) {
-		if (task->max_ulp_id == ulp->info.ulp_id) {
-			ulp_info("Found last ulpatch vma.\n");
-			ulp_info = &ulp->info;
-			break;
-		}
+	/* Nothing is written if out of range, retry near the symbol once */
+	if (err == -ERANGE && near) {
+		ulp_warning("Relocation out of range, retry near %lx\n", near);
+		err = init_patch_near(task, obj_file, est, replace, &near);
 	}
+	return err;
+}
 
-	if (!ulp_info) {
-		ulp_error("Not found any ulp.\n");
+/**
+ * The child forked from the patched parent has the patch already, the
+ * patch VMA is named by the pid of parent, see ulp_vma_owner(). Return 0 if
+ * the inherited patch of @obj_file is intact, -ENOENT if not inherited.
+ */
+static int init_inherited_patch(struct task_struct *task,
+				const char *obj_file)
+{
+	struct vma_ulp *ulp;
+	const char *bid;
+	pid_t owner;
+	int err;
+
+	bid = patch_file_build_id(obj_file);
+	if (!bid)
+		return -ENOENT;
+
+	ulp = find_ulp_by_build_id(task, bid);
+	if (!ulp)
+		return -ENOENT;
+
+	owner = ulp_vma_owner(ulp->vma->name_);
+	if (!owner || owner == task->pid)
 		return -ENOENT;
+
+	err = verify_patch(task, ulp);
+	if (err) {
+		ulp_error("Patch %s inherited from %d is broken in %d.\n",
+			  bid, owner, task->pid);
+		return err;
 	}
 
-	insn_sz = sizeof(ulp_info->orig_code);
-	vma = ulp->vma;
+	ulp_info("Patch %s is inherited from %d, skip.\n", bid, owner);
+	phase_stats.inherited = true;
+	return 0;
+}
 
-	task_attach(task->pid);
+/* Cost of every phase is recorded, see patch_get_phase_stats() */
+int init_patch(struct task_struct *task, const char *obj_file)
+{
+	unsigned long start = nsecs();
+	int err;
 
-	n = memcpy_to_task(task, ulp_info->virtual_addr, (void *)ulp_info->orig_code, insn_sz);
-	if (n == -1 || n < insn_sz) {
-		ulp_error("failed kick target process.\n");
-		err = -ENOEXEC;
-		goto exit;
+	phase_begin(task, "patch");
+	err = init_inherited_patch(task, obj_file);
+	if (err == -ENOENT)
+		err = __init_patch(task, obj_file, NULL, NULL);
+	phase_done(err, start);
+	return err;
+}
+
+/**
+ * Check @pid has the patch @obj_file inherited from parent, without the ELF
+ * files and symbols loaded, such as the workers of prefork server patched
+ * before fork(2). Return 0 if inherited and intact, -ENOENT if not
+ * inherited, then init_patch() is needed.
+ */
+int check_inherited_patch(pid_t pid, const char *obj_file)
+{
+	struct task_struct *task;
+	unsigned long start = nsecs();
+	int err;
+
+	if (!patch_file_build_id(obj_file))
+		return -ENOENT;
+
+	/* FTO_VMA_ELF loads the patches, see vma_load_ulp() */
+	task = open_task(pid, FTO_PROC | FTO_VMA_ELF);
+	if (!task)
+		return -ENOENT;
+
+	phase_begin(task, "patch");
+	err = init_inherited_patch(task, obj_file);
+	phase_done(err, start);
+
+	close_task(task);
+	return err;
+}
+
+/**
+ * Dry run of init_patch(), predict the cost of patching @task by @obj_file
+ * without touching it. Only the local working copy of patch is relocated,
+ * which is removed at last.
+ */
+int estimate_patch(struct task_struct *task, const char *obj_file,
+		   struct patch_estimate *est)
+{
+	unsigned long start = nsecs();
+	int err;
+
+	memset(est, 0, sizeof(*est));
+
+	phase_begin(task, "estimate");
+	err = __init_patch(task, obj_file, est, NULL);
+	phase_done(err, start);
+	return err;
+}
+
+void print_patch_estimate(FILE *fp, pid_t pid,
+			  const struct patch_estimate *est, bool json)
+{
+	if (json) {
+		fprintf(fp, "{\"pid\":%d,\"addr\":%lu,\"pool\":%s,"
+			"\"prelinked\":%s,\"nr_funcs\":%u,\"nr_near\":%u,"
+			"\"nr_syscalls\":%u,\"nr_vmas\":%u,"
+			"\"bytes_read\":%lu,\"bytes_written\":%lu,"
+			"\"nr_stops\":%u,\"nr_threads\":%u,"
+			"\"stop_bytes\":%lu}\n",
+			pid, est->addr, est->pool ? "true" : "false",
+			est->prelinked ? "true" : "false", est->nr_funcs,
+			est->nr_near, est->nr_syscalls, est->nr_vmas,
+			est->bytes_read, est->bytes_written, est->nr_stops,
+			est->nr_threads, est->stop_bytes);
+		return;
 	}
 
-	err = task_munmap(task, vma->vm_start, vma->vm_end - vma->vm_start);
-	if (err) {
+	fprintf(fp, "Task %d dry run, patch at %#lx%s%s\n", pid, est->addr,
+		est->pool ? " (pool)" : "",
+		est->prelinked ? " (prelinked)" : "");
+	fprintf(fp, "  %u functions, %u direct jump, %u jmp table\n",
+		est->nr_funcs, est->nr_near, est->nr_funcs - est->nr_near);
+	fprintf(fp, "  %u remote syscalls, %u new VMAs\n",
+		est->nr_syscalls, est->nr_vmas);
+	fprintf(fp, "  %lu bytes read, %lu bytes written\n",
+		est->bytes_read, est->bytes_written);
+	fprintf(fp, "  %u stop windows, %u threads, %lu bytes rewritten\n",
+		est->nr_stops, est->nr_threads, est->stop_bytes);
+}
+
+/**
+ * Release the patch pool slot or unmap the patch VMA of @ulp, and remove it
+ * from task. No function may jump to it any more.
+ */
+static int release_ulp(struct task_struct *task, struct vma_ulp *ulp)
+{
+	struct vm_area_struct *vma = ulp->vma;
+
+	perf_map_remove(task->pid, ulp->start, ulp->len);
+	put_veneers(task, ulp->infos ?: &ulp->info,
+		    ulp->infos ? ulp->nr_funcs : 1);
+
+	/* Release the slot, unmap the patch pool only if it's empty */
+	if (ulp->slot >= 0 && vma->ulp_pool) {
+		vma->ulp_pool->used &= ~BIT(ulp->slot);
+		unlink_ulp(ulp);
+		if (vma->ulp_pool->used)
+			return pool_write_hdr(vma) ? -ENOEXEC : 0;
+	} else
+		unlink_ulp(ulp);
+
+	if (task_munmap(task, vma->vm_start, vma->vm_end - vma->vm_start)) {
 		print_vma(stdout, true, vma, false);
 		ulp_error("failed to munmap vma.\n");
-		err = -ENOEXEC;
-		goto exit;
+		return -ENOEXEC;
 	}
 
+	/* Never reuse the unmapped patch pool, see find_pool_vma() */
+	free_ulp(vma);
 	fremove(vma->name_);
+	unshare_patch_image(vma->name_);
+	return 0;
+}
+
+/**
+ * Replace the patch of @id, the latest one if 0, by @obj_file, such as
+ * upgrade a patch from v1 to v2 without unpatch and patch again, see
+ * kick_update_process().
+ */
+int update_patch(struct task_struct *task, unsigned int id,
+		 const char *obj_file)
+{
+	unsigned long start = nsecs();
+	struct vma_ulp *ulp, *top;
+	int err;
+
+	id = id ?: task->max_ulp_id;
+	ulp = find_ulp_by_id(task, id);
+	if (!ulp) {
+		ulp_error("Not found ulp with ID %d.\n", id);
+		return -ENOENT;
+	}
+
+	top = find_stacked_ulp(task, ulp, &ulp, 1);
+	if (top) {
+		ulp_error("Patch %d is stacked on %d, unpatch it first.\n",
+			  top->info.ulp_id, id);
+		return -EBUSY;
+	}
+
+	phase_begin(task, "update");
+	err = __init_patch(task, obj_file, NULL, ulp);
+	if (!err) {
+		ulp_info("Replace ulpatch %d by %d.\n", id, task->max_ulp_id);
+		err = release_ulp(task, ulp);
+		task->max_ulp_id = task_last_ulp_id(task);
+	}
+	phase_done(err, start);
+	return err;
+}
+
+/* The ones patched later first, see __delete_patches() */
+static int cmp_ulp_id_desc(const void *a, const void *b)
+{
+	const struct vma_ulp *ua = *(struct vma_ulp **)a;
+	const struct vma_ulp *ub = *(struct vma_ulp **)b;
+
+	return ua->info.ulp_id < ub->info.ulp_id ? 1 :
+		ua->info.ulp_id > ub->info.ulp_id ? -1 : 0;
+}
+
+/**
+ * Unpatch @nr patches in one stop window, restore all functions of all of
+ * them, or keep all of them patched. Then release the patch pool slot or
+ * unmap the patch VMA, and remove the patch from task. The patches stacked
+ * on them must be unpatched together, the functions are restored from the
+ * top of stack, thus the bytes patched by many of them are restored by the
+ * lowest one at last.
+ */
+static int __delete_patches(struct task_struct *task, struct vma_ulp **ulps,
+			    int nr)
+{
+	int n, err = 0;
+	unsigned int i, j, nr_funcs = 0, nr_gots = 0;
+	unsigned long start;
+	struct ulpatch_info *ulp_info;
+	struct vma_ulp *top;
+
+	qsort(ulps, nr, sizeof(*ulps), cmp_ulp_id_desc);
+
+	for (i = 0; i < nr; i++) {
+		top = find_stacked_ulp(task, ulps[i], ulps, nr);
+		if (top) {
+			ulp_error("Patch %d is stacked on %d, unpatch it "
+				  "first.\n", top->info.ulp_id,
+				  ulps[i]->info.ulp_id);
+			return -EBUSY;
+		}
+
+		ulp_info = ulps[i]->infos ?: &ulps[i]->info;
+		for (j = 0; j < (ulps[i]->infos ? ulps[i]->nr_funcs : 1); j++) {
+			if (ulp_info[j].flags & ULP_INFO_F_GOT)
+				nr_gots++;
+			nr_funcs++;
+		}
+	}
+
+	if (!nr_funcs)
+		return 0;
+
+	unsigned long cur[nr_funcs][ARRAY_SIZE(ulp_info->orig_code)];
+	struct code_write w[nr_funcs], *wi;
+	unsigned int nr_code = 0, nr_got = 0;
+
+	for (i = 0; i < nr; i++) {
+		ulp_info = ulps[i]->infos ?: &ulps[i]->info;
+		for (j = 0; j < (ulps[i]->infos ? ulps[i]->nr_funcs : 1); j++) {
+			/**
+			 * GOT slots at the end, see kick_target_process(), in
+			 * the same order of patches.
+			 */
+			if (ulp_info[j].flags & ULP_INFO_F_GOT)
+				wi = &w[nr_funcs - nr_gots + nr_got++];
+			else
+				wi = &w[nr_code++];
+			wi->addr = ulp_info[j].virtual_addr;
+			wi->new = ulp_info[j].orig_code;
+			wi->old = cur[wi - w];
+			wi->len = ulp_info_size(&ulp_info[j]);
+		}
+	}
+
+	/**
+	 * No thread may run the patches, which are released below, the
+	 * ranges of them are checked as code blocks, but never written, same
+	 * as kick_update_process().
+	 */
+	struct code_write chk[nr_code + nr];
+
+	memcpy(chk, w, nr_code * sizeof(w[0]));
+	for (i = 0; i < nr; i++) {
+		chk[nr_code + i] = (struct code_write) {
+			.addr = ulps[i]->start,
+			.len = ulps[i]->len,
+		};
+	}
+
+	err = freeze_safely(task, chk, nr_code + nr, false, &start);
+	if (err)
+		return err;
+
+	for (i = 0; i < nr_funcs; i++) {
+		n = memcpy_from_task(task, cur[i], w[i].addr, w[i].len);
+		if (n == -1 || n < w[i].len) {
+			ulp_error("failed backup patched code.\n");
+			err = -ENOEXEC;
+			goto exit;
+		}
+	}
+
+	err = write_code_all(task, w, nr_funcs);
+	if (err) {
+		ulp_error("failed kick target process.\n");
+		goto exit;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ulp_info("Unpatch ulpatch %d.\n", ulps[i]->info.ulp_id);
+		if (release_ulp(task, ulps[i]))
+			err = -ENOEXEC;
+	}
+
+	task->max_ulp_id = task_last_ulp_id(task);
 
 exit:
-	task_detach(task->pid);
+	thaw_safely(task);
+	record_stop(task, nr_funcs, start);
+	return err;
+}
+
+static int delete_patches(struct task_struct *task, struct vma_ulp **ulps,
+			  int nr)
+{
+	unsigned long start = nsecs();
+	int err;
+
+	phase_begin(task, "unpatch");
+	err = __delete_patches(task, ulps, nr);
+	phase_done(err, start);
+	return err;
+}
+
+int delete_patch_by_id(struct task_struct *task, unsigned int id)
+{
+	return delete_patches_by_id(task, &id, 1);
+}
+
+int delete_patch_by_build_id(struct task_struct *task, const char *build_id)
+{
+	struct vma_ulp *ulp;
+
+	ulp = find_ulp_by_build_id(task, build_id);
+	if (!ulp) {
+		ulp_error("Not found ulp with Build ID %s.\n", build_id);
+		return -ENOENT;
+	}
+
+	return delete_patches(task, &ulp, 1);
+}
+
+/**
+ * Unpatch all @ids in one stop window, the duplicate IDs are ignored, fail
+ * if any of them not exist.
+ */
+int delete_patches_by_id(struct task_struct *task, const unsigned int *ids,
+			 int nr)
+{
+	struct vma_ulp **ulps, *ulp;
+	int i, j, n = 0, err;
+
+	ulps = calloc(MAX(nr, 1), sizeof(struct vma_ulp *));
+	if (!ulps)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		ulp = find_ulp_by_id(task, ids[i]);
+		if (!ulp) {
+			ulp_error("Not found ulp with ID %d.\n", ids[i]);
+			err = -ENOENT;
+			goto out;
+		}
+		for (j = 0; j < n && ulps[j] != ulp; j++);
+		if (j == n)
+			ulps[n++] = ulp;
+	}
+
+	err = delete_patches(task, ulps, n);
+out:
+	free(ulps);
+	return err;
+}
+
+int delete_all_patches(struct task_struct *task)
+{
+	struct vma_ulp **ulps, *ulp;
+	int nr = 0, err;
+
+	list_for_each_entry(ulp, &task->ulp_list, node)
+		nr++;
+
+	if (!nr)
+		return 0;
+
+	ulps = calloc(nr, sizeof(struct vma_ulp *));
+	if (!ulps)
+		return -ENOMEM;
+
+	nr = 0;
+	list_for_each_entry(ulp, &task->ulp_list, node)
+		ulps[nr++] = ulp;
+
+	err = delete_patches(task, ulps, nr);
+	free(ulps);
 	return err;
 }
 
+/* delete last patched patch, so, don't need any other arguments */
+int delete_patch(struct task_struct *task)
+{
+	if (!find_ulp_by_id(task, task->max_ulp_id)) {
+		ulp_error("Not found any ulp.\n");
+		return -ENOENT;
+	}
+
+	ulp_info("Found last ulpatch vma.\n");
+	return delete_patch_by_id(task, task->max_ulp_id);
+}
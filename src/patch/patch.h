@@ -8,6 +8,7 @@
 #include <gelf.h>
 
 #include <utils/util.h>
+#include <utils/list.h>
 #include <utils/compiler.h>
 
 #ifndef __ULP_DEV
@@ -26,6 +27,7 @@
 #endif
 
 struct vm_area_struct;
+struct patch_estimate;
 
 /* see linux:kernel/module-internal.h */
 struct load_info {
@@ -43,17 +45,64 @@ struct load_info {
 	struct {
 		char *path;
 		struct mmap_struct *mmap;
+		/**
+		 * The object file, read-only, the host-side sections not in
+		 * patch image are read from it, see alloc_patch_file().
+		 */
+		struct mmap_struct *obj;
 	} patch;
 
+	/* Not NULL if the patch is loaded into slot of patch pool */
+	struct vm_area_struct *pool_vma;
+	int pool_slot;
+
+	/* Not NULL in dry run, nothing is done in target, see estimate_patch() */
+	struct patch_estimate *estimate;
+
+	/* Not NULL if this patch replaces it, see update_patch() */
+	struct vma_ulp *replace;
+
 	GElf_Shdr *sechdrs;
 	char *secstrings, *strtab;
 	unsigned long symoffs, stroffs, init_typeoffs, core_typeoffs;
 
+	/* Array of nr_funcs, all ULPATCH_INFO() of patch */
 	struct ulpatch_info *ulp_info;
+	unsigned int nr_funcs;
+	/* The first one of ulp_strtabs */
 	struct ulpatch_strtab ulp_strtab;
+	/* malloc, nr_funcs entries, need free */
+	struct ulpatch_strtab *ulp_strtabs;
+	/* Symbol index of every src_func, see scan_patch_syms() */
+	unsigned int *src_syms;
+	/* Symbol index of every dst_func if undefined, 0 otherwise */
+	unsigned int *dst_syms;
+	/**
+	 * Index plus one of undef::names of ULPATCH_ORIG() of every dst_func,
+	 * 0 if not called, see setup_orig_tramps().
+	 */
+	unsigned int *orig_undefs;
+	/* SEC_ULPATCH_INDEX of the loaded patch, see write_ulpatch_index() */
+	struct ulpatch_index *ulp_index;
+
+	/* Unique undefined symbols of patch, malloc, see scan_patch_syms() */
+	struct {
+		unsigned int nr;
+		const char **names;
+		unsigned long *addrs;
+		/* All references are STB_WEAK */
+		bool *weak;
+		/* Index of names[] for each SHN_UNDEF symbol */
+		unsigned int *of_sym;
+	} undef;
 	/* Store Build ID if exist. malloc, need free */
 	char *str_build_id;
 
+	/* Not NULL if the applied relocations are logged, see save_prelink() */
+	struct reloc_logs *relocs;
+	/* Relocation out of range, retry near it, see struct reloc_plans */
+	unsigned long range_near;
+
 	struct {
 		unsigned int
 			sym,
@@ -61,7 +110,9 @@ struct load_info {
 			vers,
 			ulp_strtab,
 			info,
-			build_id;
+			build_id,
+			counter,
+			orig;
 	} index;
 };
 
@@ -74,8 +125,35 @@ struct load_info {
 # define MCOUNT_INSN_SIZE	BL_INSN_SIZE
 #endif
 
+/* Bytes of function entry to find the mcount site, see ftrace_find_mcount_site() */
+#define FTRACE_SITE_SCAN_SIZE	32
+
+enum ftrace_site_type {
+	/* The call of mcount, -pg */
+	FTRACE_SITE_CALL = 1,
+	/* The call is replaced with nop, -pg -mnop-mcount */
+	FTRACE_SITE_NOP,
+};
+
+
+/**
+ * The e_ident padding of the loaded patch holds the section index of
+ * SEC_ULPATCH_INDEX, little endian, zero in the object file.
+ */
+#define ULP_EI_INDEX	EI_PAD
+
+static inline unsigned int ulp_ei_index(const GElf_Ehdr *hdr)
+{
+	return hdr->e_ident[ULP_EI_INDEX] |
+	       hdr->e_ident[ULP_EI_INDEX + 1] << 8;
+}
+
+/* Max number of ULPATCH_INFO() in one patch */
+#define ULPATCH_MAX_FUNCS	64
 
 #define PATCH_VMA_TEMP_PREFIX	"ulp-"
+#define PATCH_POOL_TEMP_PREFIX	PATCH_VMA_TEMP_PREFIX "pool-"
+#define PATCH_VENEER_TEMP_PREFIX	PATCH_VMA_TEMP_PREFIX "veneer-"
 
 struct jmp_table_entry {
 	unsigned long jmp;
@@ -83,6 +161,8 @@ struct jmp_table_entry {
 };
 
 struct task_struct;
+struct vma_ulp;
+struct emitter;
 
 extern void _ftrace_mcount(void);
 extern void _ftrace_mcount_return(void);
@@ -93,21 +173,339 @@ unsigned long mcount_exit(long *retval);
 
 void print_ulp_strtab(FILE *fp, const char *pfx, struct ulpatch_strtab *strtab);
 void print_ulp_info(FILE *fp, const char *pfx, struct ulpatch_info *inf);
+void emit_ulp_funcs(struct emitter *e, struct ulpatch_strtab *strtabs,
+		    struct ulpatch_info *infos, unsigned int nr);
 const char *ulp_info_strftime(struct ulpatch_info *inf);
 
 int alloc_patch_file(const char *obj_from, const char *obj_to,
 			struct load_info *info);
+int open_patch_file(const char *obj, struct load_info *info);
+
+/* Result of check_patch_file() is cached, see struct patch_check */
+struct patch_check_stats {
+	unsigned long nr_entries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+#define PATCH_CHECK_MAX_ENTRIES	64
+int check_patch_file(const char *file);
+const char *patch_file_build_id(const char *file);
+void patch_check_get_stats(struct patch_check_stats *stats);
+void patch_check_flush(void);
 int load_ulp_info_from_vma(struct vm_area_struct *vma, struct load_info *info);
+int load_ulp_syms(struct vma_ulp *ulp);
 int setup_load_info(struct load_info *info);
 void release_load_info(struct load_info *info);
 
+/**
+ * Relocated patch images are cached in memory, and reused for the task that
+ * has the same layout, see apply_prelink().
+ */
+struct patch_prelink_stats {
+	bool enabled;
+	unsigned long nr_entries;
+	unsigned long hits;
+	/* Hits of the same layout at different addresses, see rebase_prelink() */
+	unsigned long rebased;
+	unsigned long misses;
+};
+
+#define PATCH_PRELINK_MAX_ENTRIES	16
+void patch_prelink_enable(bool enable);
+void patch_prelink_get_stats(struct patch_prelink_stats *stats);
+void patch_prelink_flush(void);
+
+void patch_pool_enable(bool enable);
+void patch_counter_enable(bool enable);
+void patch_quiesce_enable(bool enable);
+void patch_share_enable(bool enable);
+void patch_veneer_enable(bool enable);
+
+/* perf-PID.map of the functions of patch, see src/patch/perfmap.c */
+#define PATCH_PERF_MAP_FMT	"/tmp/perf-%d.map"
+void patch_perf_map_enable(bool enable);
+int perf_map_add(const struct load_info *info);
+int perf_map_remove(pid_t pid, unsigned long start, unsigned long len);
+int read_patch_counters(struct task_struct *task, struct vma_ulp *ulp,
+			unsigned long *counts);
+
+/**
+ * How the target functions are redirected to the patch, PATCH_MODE_JMP
+ * rewrites the entry of target function, PATCH_MODE_GOT writes the GOT slot
+ * of main executable, only the calls of it through PLT/GOT are redirected,
+ * no text is modified.
+ */
+enum patch_mode {
+	PATCH_MODE_JMP,
+	PATCH_MODE_GOT,
+};
+
+int patch_mode_parse(const char *str);
+void patch_set_mode(enum patch_mode mode);
+
+/**
+ * All functions of patch are written in one stop window, this is the last
+ * window of init_patch() or delete_patch().
+ */
+struct patch_stop_stats {
+	unsigned int nr_funcs;
+	unsigned long stop_ns;
+	/* Thread stack check of the last window, see task_check_stacks() */
+	unsigned int nr_threads;
+	unsigned long check_ns;
+	/* Number of windows given up because some thread was busy */
+	unsigned int nr_retries;
+	/* Of them, not stopped, told by task_precheck_stacks() */
+	unsigned int nr_skipped;
+};
+
+/**
+ * If any thread is executing the bytes to be rewritten, thaw the task and
+ * retry later, the backoff is doubled every time. The stack walk of every
+ * window is limited by PATCH_SAFETY_BUDGET_NS.
+ */
+#define PATCH_SAFETY_MAX_RETRIES	10
+#define PATCH_SAFETY_BACKOFF_US		1000
+#define PATCH_SAFETY_BACKOFF_MAX_US	100000
+#define PATCH_SAFETY_BUDGET_NS		2000000
+
+void patch_get_stop_stats(struct patch_stop_stats *stats);
+
+/* Code block to be rewritten in target task */
+struct code_write {
+	unsigned long addr;
+	const void *new;
+	const void *old;
+	size_t len;
+};
+
+int write_code_safely(struct task_struct *task, const struct code_write *w,
+		      unsigned int nr);
+
+/**
+ * Monotonic cost of every phase of the last init_patch() or unpatch, the
+ * phase is 0 if skipped, such as the relocation phases of pre-linked patch,
+ * or all phases but PATCH_PHASE_STOP of unpatch.
+ */
+enum patch_phase {
+	/* alloc_patch_file(), copy and parse the patch object */
+	PATCH_PHASE_ALLOC,
+	/* Map the patch VMA or the patch pool slot in target task */
+	PATCH_PHASE_MMAP,
+	/* rewrite_section_headers() */
+	PATCH_PHASE_REWRITE,
+	/* simplify_symbols() */
+	PATCH_PHASE_SIMPLIFY,
+	/* apply_relocations() and post_relocation() */
+	PATCH_PHASE_RELOCATE,
+	/* solve_patch_symbols() */
+	PATCH_PHASE_SOLVE,
+	/* kick_target_process(), include the stop window */
+	PATCH_PHASE_KICK,
+	/* Target task is stopped, see struct patch_stop_stats */
+	PATCH_PHASE_STOP,
+	PATCH_PHASE_NUM,
+};
+
+struct patch_phase_stats {
+	pid_t pid;
+	/* "patch" or "unpatch" */
+	const char *op;
+	int ret;
+	/* Relocation is skipped, see apply_prelink() */
+	bool prelinked;
+	/* Inherited from parent by fork(2), nothing is done */
+	bool inherited;
+	unsigned long total_ns;
+	unsigned long phase_ns[PATCH_PHASE_NUM];
+	struct patch_stop_stats stop;
+};
+
+const char *patch_phase_name(enum patch_phase phase);
+void patch_get_phase_stats(struct patch_phase_stats *stats);
+void print_patch_phase_stats(FILE *fp, const struct patch_phase_stats *stats,
+			     bool json);
+
+/**
+ * Predicted cost of init_patch(), see estimate_patch(). The symbol
+ * resolution, relocation and placement search are done on host, the target
+ * task is never attached, stopped or modified.
+ */
+struct patch_estimate {
+	/* Planned address of the patch, new VMA or slot of patch pool */
+	unsigned long addr;
+	bool pool;
+	bool prelinked;
+	unsigned int nr_funcs;
+	/* Functions reachable by direct jump, the others use jmp table */
+	unsigned int nr_near;
+	/* Remote syscalls injected by ptrace, see task_syscall_batch() */
+	unsigned int nr_syscalls;
+	/* New VMAs of target task */
+	unsigned int nr_vmas;
+	/* Through /proc/PID/mem */
+	unsigned long bytes_read;
+	unsigned long bytes_written;
+	/* Stop windows without busy retries, and threads stopped of each */
+	unsigned int nr_stops;
+	unsigned int nr_threads;
+	/* Bytes of function entries rewritten in the stop window */
+	unsigned long stop_bytes;
+};
+
+int estimate_patch(struct task_struct *task, const char *obj_file,
+		   struct patch_estimate *est);
+void print_patch_estimate(FILE *fp, pid_t pid,
+			  const struct patch_estimate *est, bool json);
+
+/**
+ * One patch found by ulp_scan_all(), the infos and strtabs point to the
+ * sparse image elf_mem.
+ */
+struct ulp_scan_patch {
+	pid_t pid;
+	/* Not the pid if inherited from parent by fork(2) */
+	pid_t owner;
+	char *vma;
+	unsigned long start;
+	unsigned long len;
+	/* Slot index if in patch pool, otherwise -1 */
+	int slot;
+	char *str_build_id;
+	unsigned int nr_funcs;
+	struct ulpatch_info *infos;
+	struct ulpatch_strtab *strtabs;
+	void *elf_mem;
+	/* struct ulp_scan_task.patches */
+	struct list_head node;
+};
+
+struct ulp_scan_task {
+	pid_t pid;
+	/* NULL if no patch */
+	char *exe;
+	struct list_head patches;
+	unsigned int nr_patches;
+	/* Can't read maps or mem, such as exited or no permission */
+	int err;
+	/* The VMAs of ulp_scan::iter, NULL if read from /proc/PID/maps */
+	const struct task_vma_iter_task *vmas;
+};
+
+/* All processes of host, in the order of /proc */
+struct ulp_scan {
+	struct ulp_scan_task *tasks;
+	unsigned int nr_tasks;
+	/* See ulp_scan_bpf_enable(), NULL if not used */
+	struct task_vma_iter *iter;
+	/* The next one to be scanned */
+	unsigned int next;
+	unsigned int nr_errors;
+};
+
+#define ULP_SCAN_MAX_THREADS	64
+
+/* Read @len bytes at @addr into @buf, return zero or negative errno */
+typedef int (*ulp_read_fn)(void *arg, void *buf, size_t len,
+			   unsigned long addr);
+
+int ulp_task_read(void *task, void *buf, size_t len, unsigned long addr);
+void *ulp_read_sparse_elf(ulp_read_fn read, void *arg, unsigned long start,
+			  unsigned long len);
+int ulp_read_sparse_section(ulp_read_fn read, void *arg, void *mem,
+			    unsigned long start, unsigned int idx);
+
+void ulp_scan_bpf_enable(bool enable);
+int ulp_scan_all(struct ulp_scan *scan, int nr_threads);
+void ulp_scan_free(struct ulp_scan *scan);
+
 int init_patch(struct task_struct *task, const char *obj_file);
+int verify_patch(struct task_struct *task, struct vma_ulp *ulp);
+int check_inherited_patch(pid_t pid, const char *obj_file);
+int update_patch(struct task_struct *task, unsigned int id,
+		 const char *obj_file);
 int delete_patch(struct task_struct *task);
+int delete_patch_by_id(struct task_struct *task, unsigned int id);
+int delete_patch_by_build_id(struct task_struct *task, const char *build_id);
+int delete_patches_by_id(struct task_struct *task, const unsigned int *ids,
+			 int nr);
+int delete_all_patches(struct task_struct *task);
+
+/**
+ * Compact log of one applied relocation, the symbol is not resolved again
+ * when it's replayed, the st_value of symbol is rebased instead, see
+ * rebase_prelink().
+ */
+struct reloc_log {
+	/* Offset of the location from load_info::hdr */
+	uint32_t offset;
+	/* Index of symbol in the symtab of patch */
+	uint32_t sym;
+	uint32_t type;
+	int64_t addend;
+};
+
+struct reloc_logs {
+	struct reloc_log *ents;
+	unsigned int nr, cap;
+};
+
+/**
+ * Planned relocation, the new content of location is computed and range
+ * checked for all relocations before any byte is written, then they are
+ * applied in one sweep, see apply_reloc_log().
+ */
+struct reloc_plan {
+	/* Offset of the location from load_info::hdr */
+	uint32_t offset;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		uint32_t u32;
+		uint16_t u16;
+		uint8_t bytes[8];
+	};
+};
+
+struct reloc_plans {
+	/* Same number as the relocation log */
+	struct reloc_plan *ents;
+	/**
+	 * The location is relocated already, only the value changes, such as
+	 * rebase_prelink().
+	 */
+	bool replay;
+	/* The symbol address of the first out of range one, see -ERANGE */
+	unsigned long range_near;
+};
 
-int arch_apply_relocate_add(const struct load_info *info, GElf_Shdr *sechdrs,
-			    const char *strtab, unsigned int symindex,
-			    unsigned int relsec);
+/**
+ * Compute the relocations in @log into @plans::ents, return -ERANGE if any
+ * is out of range, the image is never modified.
+ */
+int arch_plan_relocs(const struct load_info *info, const struct reloc_log *log,
+		     unsigned int nr, struct reloc_plans *plans);
 
 unsigned long arch_jmp_table_jmp(void);
 
+/* Range of direct jump, reserve some bytes for the instruction itself */
+#if defined(__x86_64__)
+# define ARCH_NEAR_JMP_RANGE	(SZ_2G - SZ_1M)
+#elif defined(__aarch64__)
+# define ARCH_NEAR_JMP_RANGE	(SZ_128M - SZ_1M)
+#endif
+size_t arch_near_jmp(unsigned long ip, unsigned long addr, void *insn);
+
+/**
+ * Relocate the instructions of at least @need bytes at @ip into @buf of
+ * @size bytes, which is at @to in target task, @code is the @len bytes at
+ * @ip, then jump to the address in literal @lit. Return the length of code
+ * and the bytes relocated in @used, -EOPNOTSUPP if any instruction is not
+ * supported, -ERANGE if any PC-relative one is out of range.
+ */
+ssize_t arch_orig_tramp(unsigned long ip, const void *code, size_t len,
+			size_t need, unsigned long to, void *buf, size_t size,
+			unsigned long lit, size_t *used);
+
 #endif /* __ELF_ULPATCH_H */
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <elf/elf-api.h>
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+#include <patch/patch.h>
+
+
+/**
+ * The functions of patch are in an anonymous-like ULPatch VMA, which perf
+ * and the other profilers couldn't symbolize, thus the samples of them are
+ * lost. Like the JIT runtimes do, the functions are appended into
+ * /tmp/perf-PID.map after patched, one "START SIZE NAME" line for each,
+ * and the lines in the range of patch are removed after unpatched.
+ *
+ * The lines are appended by one write(2) of O_APPEND, the removal rewrites
+ * the file, a line appended by the JIT runtime of target meanwhile may be
+ * lost.
+ */
+
+static bool patch_perf_map_enabled = false;
+
+void patch_perf_map_enable(bool enable)
+{
+	patch_perf_map_enabled = enable;
+}
+
+static void perf_map_path(pid_t pid, char *buf, size_t len)
+{
+	snprintf(buf, len, PATCH_PERF_MAP_FMT, pid);
+}
+
+/**
+ * Append the defined functions of the relocated patch @info, the symbol
+ * values are the addresses in target already, see simplify_symbols().
+ */
+int perf_map_add(const struct load_info *info)
+{
+	struct task_struct *task = info->target_task;
+	const struct task_status *status;
+	GElf_Shdr *symsec;
+	GElf_Sym *syms;
+	unsigned int i, nr_syms;
+	char path[PATH_MAX], *buf = NULL, *tmp;
+	size_t len = 0, cap = 0;
+	bool created;
+	int fd, n, err = 0;
+
+	if (!patch_perf_map_enabled || !info->index.sym)
+		return 0;
+
+	symsec = &info->sechdrs[info->index.sym];
+	syms = (void *)info->hdr + symsec->sh_offset;
+	nr_syms = symsec->sh_size / sizeof(GElf_Sym);
+
+	for (i = 1; i < nr_syms; i++) {
+		const GElf_Sym *sym = &syms[i];
+
+		if (GELF_ST_TYPE(sym->st_info) != STT_FUNC || !sym->st_size ||
+		    sym->st_shndx == SHN_UNDEF ||
+		    sym->st_shndx >= SHN_LORESERVE)
+			continue;
+		if (sym->st_value < info->target_hdr ||
+		    sym->st_value >= info->target_hdr + info->len)
+			continue;
+
+		/* Longest NAME and hex of 64-bit START and SIZE */
+		if (cap - len < strlen(info->strtab + sym->st_name) + 40) {
+			cap = MAX(cap * 2, (size_t)SZ_4K);
+			tmp = realloc(buf, cap);
+			if (!tmp) {
+				err = -ENOMEM;
+				goto out;
+			}
+			buf = tmp;
+		}
+		n = snprintf(buf + len, cap - len, "%lx %lx %s\n",
+			     (unsigned long)sym->st_value,
+			     (unsigned long)sym->st_size,
+			     info->strtab + sym->st_name);
+		if (n < 0 || n >= cap - len) {
+			err = -EINVAL;
+			goto out;
+		}
+		len += n;
+	}
+
+	if (!len)
+		goto out;
+
+	perf_map_path(task->pid, path, sizeof(path));
+	created = !fexist(path);
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		ulp_warning("Open %s failed, %m\n", path);
+		goto out;
+	}
+
+	/* The profiler of the owner of target reads it */
+	status = task_status(task);
+	if (created && status && fchown(fd, status->euid, status->egid))
+		ulp_debug("Chown %s failed, %m\n", path);
+
+	if (write(fd, buf, len) != len) {
+		err = -EIO;
+		ulp_warning("Write %s failed.\n", path);
+	}
+	close(fd);
+
+	ulp_debug("Append %zu bytes of patch symbols into %s\n", len, path);
+out:
+	free(buf);
+	return err;
+}
+
+/**
+ * Remove the lines of perf-PID.map in [start, start + len), the file is
+ * rewritten by rename(2), and removed if nothing left. Nothing to do if
+ * there is no such file.
+ */
+int perf_map_remove(pid_t pid, unsigned long start, unsigned long len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], line[PATH_MAX + 64];
+	unsigned long addr, nr = 0, nr_left = 0;
+	FILE *fp, *out = NULL;
+	struct stat st;
+	int fd, err = 0;
+
+	perf_map_path(pid, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+
+	if (fstat(fileno(fp), &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+	out = fdopen(fd, "w");
+	if (!out) {
+		err = -errno;
+		close(fd);
+		goto remove;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lx", &addr) == 1 && addr >= start &&
+		    addr < start + len) {
+			nr++;
+			continue;
+		}
+		fputs(line, out);
+		nr_left++;
+	}
+
+	if (!nr)
+		goto remove;
+
+	if (fchmod(fd, st.st_mode & 07777) ||
+	    fchown(fd, st.st_uid, st.st_gid))
+		ulp_debug("Keep mode of %s failed, %m\n", path);
+
+	if (fflush(out) || (nr_left ? rename(tmp, path) : unlink(path))) {
+		err = -errno;
+		goto remove;
+	}
+
+	ulp_debug("Remove %lu patch symbols from %s\n", nr, path);
+	if (nr_left)
+		goto out;
+remove:
+	unlink(tmp);
+out:
+	if (out)
+		fclose(out);
+	fclose(fp);
+	return err;
+}
@@ -0,0 +1,631 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <elf/elf-api.h>
+#include <utils/log.h>
+#include <utils/list.h>
+#include <utils/uring.h>
+#include <task/task.h>
+
+#include <patch/patch.h>
+
+
+/**
+ * Host-wide scan of patches, for every process, only the /proc/PID/maps
+ * text is parsed to find the patch VMAs, and only the ELF header, section
+ * headers and the sections needed by setup_load_info() are read from
+ * /proc/PID/mem. No task_struct, no ELF of the other VMAs and no symbols,
+ * thus thousands of processes are scanned by a few threads in seconds.
+ */
+
+/**
+ * The sections of patch read into the sparse image, the others are zero,
+ * see ulp_read_sparse_elf().
+ */
+static const char *sparse_sections[] = {
+	SEC_ULPATCH_INFO,
+	SEC_ULPATCH_STRTAB,
+	".note.gnu.build-id",
+};
+
+static int scan_pread(int fd, void *buf, size_t len, unsigned long addr)
+{
+	if (pread(fd, buf, len, addr) != len)
+		return -EIO;
+	return 0;
+}
+
+static int scan_read(void *arg, void *buf, size_t len, unsigned long addr)
+{
+	return scan_pread(*(int *)arg, buf, len, addr);
+}
+
+static bool sparse_section_wanted(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sparse_sections); i++)
+		if (!strcmp(name, sparse_sections[i]))
+			return true;
+	return false;
+}
+
+/**
+ * Read section @idx of the sparse patch image @mem from @start, at the same
+ * offset as the whole image. The section headers were checked already, see
+ * ulp_read_sparse_elf().
+ */
+int ulp_read_sparse_section(ulp_read_fn read, void *arg, void *mem,
+			    unsigned long start, unsigned int idx)
+{
+	GElf_Ehdr *ehdr = mem;
+	GElf_Shdr *shdr;
+
+	if (!idx || idx >= ehdr->e_shnum)
+		return -EINVAL;
+
+	shdr = (GElf_Shdr *)(mem + ehdr->e_shoff) + idx;
+	if (shdr->sh_type == SHT_NOBITS || !shdr->sh_size)
+		return 0;
+	return read(arg, mem + shdr->sh_offset, shdr->sh_size,
+		    start + shdr->sh_offset);
+}
+
+/**
+ * The loaded patch has SEC_ULPATCH_INDEX, read the sections it lists, no
+ * section names matching. Return -ENOENT if not indexed.
+ */
+static int read_indexed_sections(ulp_read_fn read, void *arg, void *mem,
+				 unsigned long start)
+{
+	GElf_Ehdr *ehdr = mem;
+	unsigned int idx = ulp_ei_index(ehdr), shnum = ehdr->e_shnum;
+	struct ulpatch_index *ix;
+	GElf_Shdr *shdr;
+
+	if (!idx || idx >= shnum)
+		return -ENOENT;
+
+	shdr = (GElf_Shdr *)(mem + ehdr->e_shoff) + idx;
+	if (shdr->sh_type == SHT_NOBITS || shdr->sh_size < sizeof(*ix) ||
+	    ulp_read_sparse_section(read, arg, mem, start, idx))
+		return -ENOENT;
+
+	ix = mem + shdr->sh_offset;
+	if (ix->magic != ULPATCH_INDEX_MAGIC ||
+	    ix->sec_info >= shnum || ix->sec_strtab >= shnum ||
+	    ix->sec_build_id >= shnum)
+		return -ENOENT;
+
+	if (ulp_read_sparse_section(read, arg, mem, start, ix->sec_info) ||
+	    ulp_read_sparse_section(read, arg, mem, start, ix->sec_strtab) ||
+	    ulp_read_sparse_section(read, arg, mem, start, ix->sec_build_id))
+		return -ENOENT;
+	return 0;
+}
+
+/**
+ * Read the sparse image of patch ELF at [@start, @start + @len), only the
+ * headers and the sparse_sections[] are read, at the same offsets as the
+ * whole image, thus setup_load_info() works on it. The sections are found
+ * by SEC_ULPATCH_INDEX if there is, by names otherwise. The image is
+ * calloc(3)ed, the pages never touched cost nothing. Read more sections
+ * later by ulp_read_sparse_section().
+ */
+void *ulp_read_sparse_elf(ulp_read_fn read, void *arg, unsigned long start,
+			  unsigned long len)
+{
+	GElf_Ehdr *ehdr;
+	GElf_Shdr *shdrs, *shdr;
+	const char *secstrings;
+	unsigned long shsz;
+	unsigned int i;
+	void *mem;
+
+	if (len < sizeof(GElf_Ehdr))
+		return NULL;
+
+	mem = calloc(1, len);
+	if (!mem)
+		return NULL;
+
+	ehdr = mem;
+	if (read(arg, ehdr, sizeof(*ehdr), start) || !ehdr_magic_ok(ehdr))
+		goto fail;
+
+	shsz = ehdr->e_shnum * sizeof(GElf_Shdr);
+	if (ehdr->e_shoff >= len || shsz > len - ehdr->e_shoff ||
+	    ehdr->e_shstrndx >= ehdr->e_shnum)
+		goto fail;
+
+	shdrs = mem + ehdr->e_shoff;
+	if (read(arg, shdrs, shsz, start + ehdr->e_shoff))
+		goto fail;
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		shdr = &shdrs[i];
+		if (shdr->sh_type == SHT_NOBITS)
+			continue;
+		if (shdr->sh_offset > len ||
+		    shdr->sh_size > len - shdr->sh_offset)
+			goto fail;
+	}
+
+	shdr = &shdrs[ehdr->e_shstrndx];
+	if (!shdr->sh_size ||
+	    read(arg, mem + shdr->sh_offset, shdr->sh_size,
+		 start + shdr->sh_offset))
+		goto fail;
+	secstrings = mem + shdr->sh_offset;
+	/* The last byte is zero, the names never run out of it */
+	((char *)secstrings)[shdr->sh_size - 1] = '\0';
+
+	if (!read_indexed_sections(read, arg, mem, start))
+		return mem;
+
+	for (i = 1; i < ehdr->e_shnum; i++) {
+		shdr = &shdrs[i];
+		if (shdr->sh_name >= shdrs[ehdr->e_shstrndx].sh_size ||
+		    !sparse_section_wanted(secstrings + shdr->sh_name))
+			continue;
+		if (ulp_read_sparse_section(read, arg, mem, start, i))
+			goto fail;
+	}
+	return mem;
+
+fail:
+	free(mem);
+	return NULL;
+}
+
+static int scan_add_patch(struct ulp_scan_task *st, int fd, const char *vma,
+			  unsigned long start, unsigned long len, int slot)
+{
+	struct load_info info = {};
+	struct ulp_scan_patch *p;
+	int err;
+
+	info.hdr = ulp_read_sparse_elf(scan_read, &fd, start, len);
+	if (!info.hdr) {
+		ulp_debug("%d: read patch %lx:%s failed.\n", st->pid, start,
+			  vma);
+		return -ENOEXEC;
+	}
+	info.len = len;
+
+	err = setup_load_info(&info);
+	if (!err && !info.str_build_id)
+		err = -ENOENT;
+	if (err)
+		goto fail;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	p->vma = strdup(vma);
+	if (!p->vma) {
+		free(p);
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	p->pid = st->pid;
+	p->owner = ulp_vma_owner(vma);
+	p->start = start;
+	p->len = len;
+	p->slot = slot;
+	p->elf_mem = info.hdr;
+	p->nr_funcs = info.nr_funcs;
+	p->infos = info.ulp_info;
+	p->strtabs = info.ulp_strtabs;
+	p->str_build_id = info.str_build_id;
+	info.ulp_strtabs = NULL;
+	info.str_build_id = NULL;
+
+	list_add(&p->node, &st->patches);
+	st->nr_patches++;
+	return 0;
+
+fail:
+	release_load_info(&info);
+	free(info.hdr);
+	return err;
+}
+
+static int scan_add_pool(struct ulp_scan_task *st, int fd, const char *vma,
+			 unsigned long start, unsigned long end)
+{
+	struct ulp_pool_hdr hdr;
+	int slot;
+
+	if (scan_pread(fd, &hdr, sizeof(hdr), start) ||
+	    hdr.version != ULP_POOL_VERSION ||
+	    hdr.nr_slots > ULP_POOL_MAX_SLOTS ||
+	    ulp_pool_slot_addr(start, &hdr, hdr.nr_slots) > end)
+		return -ENOEXEC;
+
+	for (slot = 0; slot < hdr.nr_slots; slot++) {
+		if (!(hdr.used & BIT(slot)) || hdr.len[slot] > hdr.slot_size)
+			continue;
+		scan_add_patch(st, fd, vma,
+			       ulp_pool_slot_addr(start, &hdr, slot),
+			       hdr.len[slot], slot);
+	}
+	return 0;
+}
+
+static void scan_add_vma(struct ulp_scan_task *st, int *fd, const char *vma,
+			 unsigned long start, unsigned long end)
+{
+	char path[64], magic[sizeof(ULP_POOL_MAGIC)];
+
+	/* Open mem only if there is any patch */
+	if (*fd < 0) {
+		snprintf(path, sizeof(path), "/proc/%d/mem", st->pid);
+		*fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (*fd < 0) {
+			st->err = -errno;
+			return;
+		}
+	}
+
+	if (scan_pread(*fd, magic, sizeof(magic), start))
+		return;
+
+	if (!memcmp(magic, ULP_POOL_MAGIC, sizeof(ULP_POOL_MAGIC)))
+		scan_add_pool(st, *fd, vma, start, end);
+	/* No patch in veneer island */
+	else if (!memcmp(magic, ULP_VENEER_MAGIC, sizeof(ULP_VENEER_MAGIC)))
+		return;
+	else
+		scan_add_patch(st, *fd, vma, start, end - start, -1);
+}
+
+/* The patch VMA being merged, the VMAs are fed in the order of address */
+struct scan_vmas {
+	char prev[PATH_MAX];
+	unsigned long prev_start, prev_end;
+	int fd;
+};
+
+static void scan_vma(struct ulp_scan_task *st, struct scan_vmas *sv,
+		     const char *name, unsigned long start, unsigned long end,
+		     unsigned long off)
+{
+	if (!strstr(name, PATCH_VMA_TEMP_PREFIX) ||
+	    get_vma_type(st->pid, "", name) != VMA_ULPATCH)
+		return;
+
+	/* The rest of the same patch file, split by mprotect(2) */
+	if (off && start == sv->prev_end && !strcmp(name, sv->prev)) {
+		sv->prev_end = end;
+		return;
+	}
+
+	if (sv->prev[0])
+		scan_add_vma(st, &sv->fd, sv->prev, sv->prev_start,
+			     sv->prev_end);
+
+	snprintf(sv->prev, sizeof(sv->prev), "%s", name);
+	sv->prev_start = start;
+	sv->prev_end = end;
+}
+
+static void scan_vmas_end(struct ulp_scan_task *st, struct scan_vmas *sv)
+{
+	char path[64], name[PATH_MAX];
+	ssize_t n;
+
+	if (sv->prev[0])
+		scan_add_vma(st, &sv->fd, sv->prev, sv->prev_start,
+			     sv->prev_end);
+	if (sv->fd >= 0)
+		close(sv->fd);
+
+	if (!st->nr_patches)
+		return;
+
+	snprintf(path, sizeof(path), "/proc/%d/exe", st->pid);
+	n = readlink(path, name, sizeof(name) - 1);
+	if (n > 0) {
+		name[n] = '\0';
+		st->exe = strdup(name);
+	}
+}
+
+/* The /proc/PID/maps text @maps of @st, read by scan_worker() */
+static void scan_task(struct ulp_scan_task *st, const char *maps)
+{
+	char line[PATH_MAX + 128], name[PATH_MAX];
+	struct scan_vmas sv = { .fd = -1 };
+	unsigned long start, end, off;
+	const char *p = maps, *eol;
+	size_t len;
+
+	for (; *p; p = *eol ? eol + 1 : eol) {
+		eol = strchrnul(p, '\n');
+		len = MIN((size_t)(eol - p), sizeof(line) - 1);
+		memcpy(line, p, len);
+		line[len] = '\0';
+
+		name[0] = '\0';
+		if (sscanf(line, "%lx-%lx %*s %lx %*x:%*x %*u %4095s", &start,
+			   &end, &off, name) < 4)
+			continue;
+		scan_vma(st, &sv, name, start, end, off);
+	}
+
+	scan_vmas_end(st, &sv);
+}
+
+/* Same as scan_task(), the VMAs are from the task_vma BPF iterator */
+static void scan_task_iter(struct ulp_scan_task *st)
+{
+	const struct task_vma_iter_task *t = st->vmas;
+	struct scan_vmas sv = { .fd = -1 };
+	const struct maps_entry *e;
+	char name[PATH_MAX];
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < t->nr; i++) {
+		e = &t->ents[i];
+		/* Up to the first space, like the %s of scan_task() */
+		len = strcspn(e->name, " ");
+		len = MIN(MIN(len, e->name_len), sizeof(name) - 1);
+		if (!len)
+			continue;
+		memcpy(name, e->name, len);
+		name[len] = '\0';
+		scan_vma(st, &sv, name, e->start, e->end, e->off);
+	}
+
+	scan_vmas_end(st, &sv);
+}
+
+/* The tasks taken by a worker at once, their maps are read by one batch */
+#define SCAN_BATCH	64
+
+/* Take the next @nr tasks to scan, return the number taken */
+static unsigned int scan_take(struct ulp_scan *scan, unsigned int nr,
+			      struct ulp_scan_task **first)
+{
+	unsigned int i;
+
+	i = __atomic_fetch_add(&scan->next, nr, __ATOMIC_RELAXED);
+	if (i >= scan->nr_tasks)
+		return 0;
+	*first = &scan->tasks[i];
+	return MIN(nr, scan->nr_tasks - i);
+}
+
+/**
+ * The maps of a batch of tasks are read by ulp_read_files(), by io_uring
+ * if supported, thus a few syscalls for the whole batch instead of an
+ * open(2), read(2)s and a close(2) for every process.
+ */
+static void *scan_worker(void *arg)
+{
+	struct ulp_scan *scan = arg;
+	struct ulp_file_read reads[SCAN_BATCH], *r;
+	char paths[SCAN_BATCH][32];
+	struct ulp_scan_task *sts, *st;
+	struct ulp_uring *ring;
+	unsigned int i, n, nr;
+
+	ring = ulp_uring_open();
+
+	while ((n = scan_take(scan, SCAN_BATCH, &sts)) != 0) {
+		for (i = 0, nr = 0; i < n; i++) {
+			if (sts[i].vmas)
+				continue;
+			snprintf(paths[nr], sizeof(paths[nr]), "/proc/%d/maps",
+				 sts[i].pid);
+			reads[nr].path = paths[nr];
+			nr++;
+		}
+		ulp_read_files(ring, reads, nr);
+
+		for (i = 0, r = reads; i < n; i++) {
+			st = &sts[i];
+			if (st->vmas)
+				scan_task_iter(st);
+			else if (r->err)
+				st->err = r++->err;
+			else
+				scan_task(st, r++->buf);
+			if (st->err)
+				__atomic_fetch_add(&scan->nr_errors, 1,
+						   __ATOMIC_RELAXED);
+		}
+
+		for (i = 0; i < nr; i++)
+			free(reads[i].buf);
+	}
+
+	ulp_uring_close(ring);
+	return NULL;
+}
+
+static int scan_list_pids(struct ulp_scan *scan)
+{
+	struct ulp_scan_task *tasks, *st;
+	struct dirent *ent;
+	unsigned int cap = 0;
+	DIR *dir;
+	pid_t pid;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -errno;
+
+	while ((ent = readdir(dir)) != NULL) {
+		pid = atoi(ent->d_name);
+		if (pid <= 0 || pid == getpid())
+			continue;
+
+		if (scan->nr_tasks == cap) {
+			cap = cap ? cap * 2 : 1024;
+			tasks = realloc(scan->tasks, cap * sizeof(*tasks));
+			if (!tasks) {
+				closedir(dir);
+				return -ENOMEM;
+			}
+			scan->tasks = tasks;
+		}
+
+		st = &scan->tasks[scan->nr_tasks++];
+		memset(st, 0, sizeof(*st));
+		st->pid = pid;
+		list_init(&st->patches);
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/**
+ * The processes of the task_vma BPF iterator snapshot, the VMAs of them
+ * are not read from /proc/PID/maps, except the incomplete ones.
+ */
+static int scan_list_iter(struct ulp_scan *scan)
+{
+	const struct task_vma_iter_task *t;
+	struct ulp_scan_task *st;
+	unsigned int i;
+
+	scan->tasks = calloc(MAX(scan->iter->nr_tasks, 1), sizeof(*st));
+	if (!scan->tasks)
+		return -ENOMEM;
+
+	for (i = 0; i < scan->iter->nr_tasks; i++) {
+		t = &scan->iter->tasks[i];
+		if (t->pid == getpid())
+			continue;
+		st = &scan->tasks[scan->nr_tasks++];
+		st->pid = t->pid;
+		st->vmas = t->incomplete ? NULL : t;
+		list_init(&st->patches);
+	}
+	return 0;
+}
+
+static int scan_read_iter(struct ulp_scan *scan)
+{
+	int err;
+
+	scan->iter = malloc(sizeof(*scan->iter));
+	if (!scan->iter)
+		return -ENOMEM;
+
+	err = task_vma_iter_read(scan->iter);
+	if (!err)
+		err = scan_list_iter(scan);
+	if (err) {
+		task_vma_iter_free(scan->iter);
+		free(scan->iter);
+		scan->iter = NULL;
+		free(scan->tasks);
+		scan->tasks = NULL;
+		scan->nr_tasks = 0;
+	}
+	return err;
+}
+
+/* See ulp_scan_bpf_enable() */
+static bool scan_bpf;
+
+/**
+ * Read the VMAs of all processes by one pass of the task_vma BPF iterator
+ * in ulp_scan_all(), instead of /proc/PID/maps of everyone. If the kernel
+ * doesn't support or no permission, /proc is read as usual.
+ */
+void ulp_scan_bpf_enable(bool enable)
+{
+	scan_bpf = enable;
+}
+
+/**
+ * Scan all processes of host by @nr_threads threads, 0 means the number of
+ * online CPUs. The processes that can't be read, such as exited or no
+ * permission, are skipped and counted in ulp_scan::nr_errors. Free the
+ * result by ulp_scan_free() whatever returned.
+ */
+int ulp_scan_all(struct ulp_scan *scan, int nr_threads)
+{
+	pthread_t threads[ULP_SCAN_MAX_THREADS];
+	int i, err = -EOPNOTSUPP;
+
+	memset(scan, 0, sizeof(*scan));
+
+	if (scan_bpf) {
+		err = scan_read_iter(scan);
+		if (err)
+			ulp_debug("No task_vma iterator, %s, read /proc.\n",
+				  strerror(-err));
+	}
+	if (err)
+		err = scan_list_pids(scan);
+	if (err)
+		return err;
+
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* Every thread takes a batch at least */
+	nr_threads = MIN(nr_threads,
+			 ROUND_UP(scan->nr_tasks, SCAN_BATCH) / SCAN_BATCH);
+	nr_threads = MIN(MAX(nr_threads, 1) - 1, ULP_SCAN_MAX_THREADS);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, scan))
+			break;
+	}
+	nr_threads = i;
+
+	/* If no thread was created, do the work in current thread */
+	scan_worker(scan);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	ulp_debug("Scan %u processes by %d threads, %u errors.\n",
+		  scan->nr_tasks, nr_threads + 1, scan->nr_errors);
+	return 0;
+}
+
+void ulp_scan_free(struct ulp_scan *scan)
+{
+	struct ulp_scan_patch *p, *tmp;
+	struct ulp_scan_task *st;
+	unsigned int i;
+
+	for (i = 0; i < scan->nr_tasks; i++) {
+		st = &scan->tasks[i];
+		list_for_each_entry_safe(p, tmp, &st->patches, node) {
+			list_del(&p->node);
+			free(p->str_build_id);
+			free(p->strtabs);
+			free(p->elf_mem);
+			free(p->vma);
+			free(p);
+		}
+		free(st->exe);
+	}
+
+	free(scan->tasks);
+	if (scan->iter) {
+		task_vma_iter_free(scan->iter);
+		free(scan->iter);
+	}
+	memset(scan, 0, sizeof(*scan));
+}
@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Remote arena, reserve one large region in target task with one
+ * task_mmap(), then hand out small sub-allocations locally, without any
+ * syscall. Every size class has free list, and for the new chunk just bump
+ * the arena offset.
+ *
+ * The free list node is local memory, the target task memory is never
+ * touched for bookkeeping.
+ */
+struct arena_chunk {
+	unsigned long addr;
+	/* struct task_arena.free_lists[] */
+	struct list_head node;
+};
+
+static int size_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < TASK_ARENA_NR_CLASSES; i++)
+		if (size <= TASK_ARENA_MIN_CHUNK << i)
+			return i;
+	return -1;
+}
+
+int task_arena_create(struct task_struct *task, size_t size)
+{
+	struct task_arena *arena;
+	unsigned long base;
+	int i;
+
+	if (task->arena) {
+		errno = EEXIST;
+		return -EEXIST;
+	}
+
+	size = PAGE_UP(size);
+
+	arena = malloc(sizeof(struct task_arena));
+	if (!arena)
+		return -ENOMEM;
+
+	base = task_mmap(task, 0UL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!base || base == (unsigned long)MAP_FAILED) {
+		ulp_error("Remote arena mmap failed, %lx\n", base);
+		free(arena);
+		return -ENOMEM;
+	}
+
+	memset(arena, 0, sizeof(struct task_arena));
+	ulp_mem_account(ULP_MEM_ARENA, sizeof(struct task_arena), 1);
+	arena->base = base;
+	arena->size = size;
+	for (i = 0; i < TASK_ARENA_NR_CLASSES; i++)
+		list_init(&arena->free_lists[i]);
+
+	task->arena = arena;
+
+	ulp_debug("Remote arena 0x%lx, size %ld\n", base, size);
+	return 0;
+}
+
+static void free_arena_local(struct task_arena *arena)
+{
+	struct arena_chunk *chunk, *tmp;
+	int i;
+
+	for (i = 0; i < TASK_ARENA_NR_CLASSES; i++) {
+		list_for_each_entry_safe(chunk, tmp, &arena->free_lists[i],
+					 node) {
+			list_del(&chunk->node);
+			free(chunk);
+		}
+	}
+	ulp_mem_account(ULP_MEM_ARENA, -(long)(sizeof(struct task_arena) +
+			arena->nr_free_chunks * sizeof(struct arena_chunk)), -1);
+	free(arena);
+}
+
+/**
+ * munmap the arena region in target task, target task must be attached.
+ */
+int task_arena_destroy(struct task_struct *task)
+{
+	struct task_arena *arena = task->arena;
+	int ret;
+
+	if (!arena)
+		return 0;
+
+	task->arena = NULL;
+	ret = task_munmap(task, arena->base, arena->size);
+	free_arena_local(arena);
+	return ret;
+}
+
+/* Only release local bookkeeping, used when close task */
+void task_arena_release(struct task_struct *task)
+{
+	if (!task->arena)
+		return;
+	ulp_warning("Remote arena 0x%lx not destroyed.\n", task->arena->base);
+	free_arena_local(task->arena);
+	task->arena = NULL;
+}
+
+bool task_arena_contains(struct task_struct *task, unsigned long addr)
+{
+	struct task_arena *arena = task->arena;
+	return arena && addr >= arena->base && addr < arena->base + arena->size;
+}
+
+/**
+ * Return remote address, 0 if the size is too large or arena is full, then
+ * the caller should mmap directly.
+ */
+unsigned long task_arena_alloc(struct task_struct *task, size_t size)
+{
+	struct task_arena *arena = task->arena;
+	struct arena_chunk *chunk;
+	unsigned long addr;
+	size_t chunk_size;
+	int class;
+
+	if (!arena || !size)
+		return 0;
+
+	class = size_class(size);
+	if (class < 0)
+		return 0;
+
+	chunk_size = TASK_ARENA_MIN_CHUNK << class;
+
+	if (!list_empty(&arena->free_lists[class])) {
+		chunk = list_first_entry(&arena->free_lists[class],
+					 struct arena_chunk, node);
+		list_del(&chunk->node);
+		addr = chunk->addr;
+		free(chunk);
+		arena->nr_free_chunks--;
+		ulp_mem_account(ULP_MEM_ARENA, -(long)sizeof(*chunk), 0);
+	} else {
+		if (arena->bump + chunk_size > arena->size)
+			return 0;
+		addr = arena->base + arena->bump;
+		arena->bump += chunk_size;
+	}
+
+	arena->used += chunk_size;
+	arena->requested += size;
+	arena->nr_allocs++;
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+
+	return addr;
+}
+
+int task_arena_free(struct task_struct *task, unsigned long addr, size_t size)
+{
+	struct task_arena *arena = task->arena;
+	struct arena_chunk *chunk;
+	int class;
+
+	if (!task_arena_contains(task, addr))
+		return -EINVAL;
+
+	class = size_class(size);
+	if (class < 0)
+		return -EINVAL;
+
+	chunk = malloc(sizeof(struct arena_chunk));
+	if (!chunk)
+		return -ENOMEM;
+
+	chunk->addr = addr;
+	list_add(&chunk->node, &arena->free_lists[class]);
+	ulp_mem_account(ULP_MEM_ARENA, sizeof(*chunk), 0);
+
+	arena->used -= TASK_ARENA_MIN_CHUNK << class;
+	arena->requested -= size;
+	arena->nr_frees++;
+	arena->nr_free_chunks++;
+
+	return 0;
+}
+
+void task_arena_stats(FILE *fp, const struct task_struct *task)
+{
+	const struct task_arena *arena = task->arena;
+
+	if (!arena)
+		return;
+
+	fprintf(fp, "Arena:   0x%lx-0x%lx size %ld\n", arena->base,
+		arena->base + arena->size, arena->size);
+	fprintf(fp, "         bump %ld, used %ld (requested %ld), peak %ld\n",
+		arena->bump, arena->used, arena->requested, arena->peak);
+	fprintf(fp, "         allocs %ld, frees %ld, free chunks %ld\n",
+		arena->nr_allocs, arena->nr_frees, arena->nr_free_chunks);
+}
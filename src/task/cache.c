@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <utils/log.h>
+#include <utils/list.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+
+/**
+ * Cache of opened tasks for long-lived process, such as ulpatchd(8). Once
+ * enabled, close_task() only drops the reference, the task_struct, the
+ * VMAs, the ELF files and symbols are kept. The next open_task() of the
+ * same pid and same flags updates it with reload_task(), which re-reads
+ * /proc/PID/maps and peeks the new VMAs only.
+ *
+ * The task opened with FTO_RDWR is never cached, the patches it applied
+ * or removed are tracked by the task_struct of itself only, the writer
+ * always opens a new one.
+ *
+ * Only used in one thread, no lock.
+ */
+
+static LIST_HEAD(task_cache);
+static unsigned int task_cache_nr = 0;
+static unsigned int task_cache_max = 0;
+static unsigned long task_cache_max_idle_ns = 0;
+
+/* Field 22 of /proc/PID/stat, the reused pid has different starttime */
+unsigned long long proc_pid_start_time(pid_t pid)
+{
+	unsigned long long start = 0;
+	char path[64], buf[1024], *p;
+	int i;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (fload(path, buf, sizeof(buf)) <= 0)
+		return 0;
+
+	/* comm may contain spaces and ')', skip to the last ')' */
+	p = strrchr(buf, ')');
+	if (!p)
+		return 0;
+
+	/* Fields after comm starts from 3 */
+	for (i = 3; i <= 22 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (p)
+		start = strtoull(p + 1, NULL, 10);
+	return start;
+}
+
+/**
+ * The starttime is kept by exec(2), check the executable, the one replaced
+ * in place by a new version is the same path, which is checked by the
+ * ELF refresh of the VMAs.
+ */
+static bool task_exe_unchanged(struct task_struct *task)
+{
+	char buf[PATH_MAX];
+
+	if (!get_proc_pid_exe(task->pid, buf, sizeof(buf)))
+		return false;
+	return !strcmp(buf, task->exe);
+}
+
+/* The pidfd tells it exactly, otherwise compare the starttime */
+static bool task_is_same(struct task_struct *task)
+{
+	if (task->pidfd >= 0 && !task_alive(task))
+		return false;
+	return proc_pid_start_time(task->pid) == task->start_time;
+}
+
+static void task_cache_del(struct task_struct *task)
+{
+	list_del(&task->cache_node);
+	task->cached = false;
+	task_cache_nr--;
+	ulp_debug("Uncache task %d, flag %x\n", task->pid, task->fto_flag);
+	close_task(task);
+}
+
+/**
+ * Enable the cache with at most @max_tasks tasks, the unused ones are
+ * dropped after @max_idle_ns by task_cache_prune(), zero means never. Zero
+ * @max_tasks disables the cache and drops all unused tasks.
+ */
+void task_cache_enable(unsigned int max_tasks, unsigned long max_idle_ns)
+{
+	task_cache_max = max_tasks;
+	task_cache_max_idle_ns = max_idle_ns;
+	if (!max_tasks)
+		task_cache_flush();
+}
+
+struct task_struct *task_cache_get(pid_t pid, int flag)
+{
+	struct task_struct *task, *tmp;
+	int err;
+
+	list_for_each_entry_safe(task, tmp, &task_cache, cache_node) {
+		if (task->pid != pid || task->fto_flag != flag)
+			continue;
+
+		/* Opened and not closed yet, share it */
+		if (task->cache_ref) {
+			task->cache_ref++;
+			return task;
+		}
+
+		/* Exited, pid reused, or exec(2)ed another binary */
+		if (!task_is_same(task) || !task_exe_unchanged(task)) {
+			ulp_debug("Task %d is not the cached one\n", pid);
+			task_cache_del(task);
+			return NULL;
+		}
+
+		err = reload_task(task);
+		if (err) {
+			ulp_warning("Reload task %d failed, %s\n", pid,
+				    strerror(-err));
+			task_cache_del(task);
+			return NULL;
+		}
+
+		task->cache_ref++;
+		/* Most recently used at head */
+		list_move(&task->cache_node, &task_cache);
+		return task;
+	}
+	return NULL;
+}
+
+void task_cache_add(struct task_struct *task)
+{
+	struct task_struct *victim = NULL, *tmp;
+
+	if (!task_cache_max || (task->fto_flag & FTO_RDWR))
+		return;
+
+	task->start_time = proc_pid_start_time(task->pid);
+	if (!task->start_time)
+		return;
+
+	/* Drop the least recently used one, which is not in use */
+	if (task_cache_nr >= task_cache_max) {
+		list_for_each_entry(tmp, &task_cache, cache_node) {
+			if (!tmp->cache_ref)
+				victim = tmp;
+		}
+		if (!victim)
+			return;
+		task_cache_del(victim);
+	}
+
+	task->cached = true;
+	task->cache_ref = 1;
+	list_add(&task->cache_node, &task_cache);
+	task_cache_nr++;
+	ulp_debug("Cache task %d, flag %x\n", task->pid, task->fto_flag);
+}
+
+/**
+ * Drop the reference of close_task(), return true if the task is cached,
+ * then close_task() must not free it.
+ */
+bool task_cache_put(struct task_struct *task)
+{
+	if (!task->cached)
+		return false;
+
+	if (task->cache_ref > 0 && --task->cache_ref == 0)
+		task->cache_idle_ns = nsecs();
+	return true;
+}
+
+/* Drop the unused tasks exited, pid reused, or idle too long */
+void task_cache_prune(void)
+{
+	struct task_struct *task, *tmp;
+	unsigned long now = nsecs();
+
+	list_for_each_entry_safe(task, tmp, &task_cache, cache_node) {
+		if (task->cache_ref)
+			continue;
+		if (!task_is_same(task) ||
+		    (task_cache_max_idle_ns &&
+		     now - task->cache_idle_ns > task_cache_max_idle_ns))
+			task_cache_del(task);
+	}
+}
+
+/**
+ * The process @pid exited or exec(2)ed, drop its unused tasks right now,
+ * the ones in use are dropped by task_cache_get() or task_cache_prune()
+ * after close_task(). Return the number of dropped tasks.
+ */
+int task_cache_evict(pid_t pid)
+{
+	struct task_struct *task, *tmp;
+	int n = 0;
+
+	list_for_each_entry_safe(task, tmp, &task_cache, cache_node) {
+		if (task->pid != pid)
+			continue;
+		if (task->cache_ref) {
+			/* Never match starttime of /proc/PID/stat */
+			task->start_time = 0;
+			continue;
+		}
+		task_cache_del(task);
+		n++;
+	}
+	return n;
+}
+
+/* Drop all unused tasks */
+void task_cache_flush(void)
+{
+	struct task_struct *task, *tmp;
+
+	list_for_each_entry_safe(task, tmp, &task_cache, cache_node) {
+		if (!task->cache_ref)
+			task_cache_del(task);
+	}
+}
+
+/**
+ * Save at most @max cached tasks to @ents, the most recently used first,
+ * for the checkpoint of ulpatchd(8). Return the number of them.
+ */
+int task_cache_save(struct task_cache_ent *ents, int max)
+{
+	struct task_struct *task;
+	int n = 0;
+
+	list_for_each_entry(task, &task_cache, cache_node) {
+		if (n >= max)
+			break;
+		/* Exited or exec(2)ed, see task_cache_evict() */
+		if (!task->start_time)
+			continue;
+		ents[n].pid = task->pid;
+		ents[n].flag = task->fto_flag;
+		ents[n].start_time = task->start_time;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Open the task saved by task_cache_save() again and cache it, the ELF
+ * files and symbols are loaded from the symbol cache. Return -ESRCH if the
+ * process exited or the pid is reused.
+ */
+int task_cache_restore(const struct task_cache_ent *ent)
+{
+	struct task_struct *task;
+
+	if (!task_cache_max || !ent->start_time ||
+	    proc_pid_start_time(ent->pid) != ent->start_time)
+		return -ESRCH;
+
+	task = open_task(ent->pid, ent->flag);
+	if (!task)
+		return errno ? -errno : -ESRCH;
+	close_task(task);
+	return 0;
+}
+
+void dump_task_cache(FILE *fp)
+{
+	struct task_struct *task;
+
+	fp = fp ?: stdout;
+
+	fprintf(fp, "%-8s %-16s %-8s %-4s %s\n", "PID", "COMM", "FLAG", "REF",
+		"IDLE(s)");
+	list_for_each_entry(task, &task_cache, cache_node) {
+		fprintf(fp, "%-8d %-16s %-8x %-4d %lu\n", task->pid, task->comm,
+			task->fto_flag, task->cache_ref,
+			task->cache_ref ? 0 :
+			(nsecs() - task->cache_idle_ns) / 1000000000UL);
+	}
+	fprintf(fp, "Total: %u/%u\n", task_cache_nr, task_cache_max);
+}
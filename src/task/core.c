@@ -8,14 +8,20 @@
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <elf.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <elf/elf-api.h>
 
 #include <utils/log.h>
+#include <utils/emit.h>
+#include <utils/zstd.h>
 #include <task/task.h>
 
 #if defined(__x86_64__)
@@ -28,97 +34,156 @@
 
 
 /**
- * data vma will splited by linker(GNU linker ld) according to PT_GNU_RELRO,
- * see ".data.rel.ro" section, which in the last PT_LOAD and has single PHDR.
- * at the same time, it's in PT_GNU_RELRO, which will be set to readonly by
- * GNU Linker by mprotect(2) syscall.
+ * Match key of a program header, see vma_match_phdrs(), a VMA matches it if
+ * the VMA starts at @start, and ends at @end with @flags unless @any.
  */
-static int _relro_dl_mprotect(struct vm_area_struct *vma, GElf_Phdr *phdr,
-			      unsigned long load_addr, GElf_Phdr *relro_phdr)
-{
-	int ret = 0;
+struct phdr_key {
 	unsigned long start, end;
+	unsigned int flags;
+	bool any;
+	/* Index of phdrs */
+	int idx;
+};
 
-	struct range {
-		unsigned long start, end;
-	} range[2];
-
-	if (!relro_phdr)
-		return 0;
-
-	start = PAGE_DOWN(load_addr + relro_phdr->p_vaddr);
-	end = PAGE_DOWN(load_addr + relro_phdr->p_vaddr + relro_phdr->p_memsz);
-
-	/**
-	 * This is PT_GNU_RELRO VMA
-	 */
-	range[0].start = start;
-	range[0].end = end;
-	/**
-	 * This is the last PT_LOAD, who splited by GNU linker
-	 * _dl_protect_relro() function. Current vma will match to this range.
-	 */
-	range[1].start = end;
-	range[1].end = vma->vm_end;
-
-#if 0
-	ret |= (range[0].start == vma->vm_start) &&
-		(range[0].end == vma->vm_end);
-#endif
-	ret |= (range[1].start == vma->vm_start) &&
-		(range[1].end == vma->vm_end);
+static int phdr_key_cmp(const void *a, const void *b)
+{
+	const struct phdr_key *k1 = a, *k2 = b;
 
-	return ret;
+	if (k1->start != k2->start)
+		return k1->start < k2->start ? -1 : 1;
+	return k1->idx - k2->idx;
 }
 
 /**
- * Match VMA with PT_LOAD
+ * Return the phdrs index of the last matched key in sorted @keys, the later
+ * program header wins as the walk of phdrs did, -1 if no match.
  */
-static int match_vma_phdr(struct vm_area_struct *vma, GElf_Phdr *phdr,
-			  unsigned long load_addr, GElf_Phdr *relro_phdr)
+static int phdr_key_find(const struct phdr_key *keys, int nr,
+			 unsigned long start, unsigned long end,
+			 unsigned int flags)
 {
-	int ret = 0;
-	unsigned long addr, size, off;
+	int lo = 0, hi = nr, mid, idx = -1;
 
-	addr = load_addr + phdr->p_vaddr;
-	size = phdr->p_filesz + ELF_PAGEOFFSET(phdr->p_vaddr);
-	off = phdr->p_offset - ELF_PAGEOFFSET(phdr->p_vaddr);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (keys[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	addr = ELF_PAGESTART(addr);
-	size = ELF_PAGEALIGN(size);
-	/* also check off? */
-	(void)off;
+	for (; lo < nr && keys[lo].start == start; lo++) {
+		if (keys[lo].any ||
+		    (keys[lo].end == end && keys[lo].flags == flags))
+			idx = keys[lo].idx;
+	}
+	return idx;
+}
 
-	ret = (addr == vma->vm_start) && (addr + size == vma->vm_end) &&
-		((phdr->p_flags & (PF_R | PF_W | PF_X)) ==
-			vma_prot2flags(vma->prot));
+/**
+ * Match the leader ELF @vma and its siblings with the program headers. The
+ * PT_LOAD and PT_GNU_RELRO are turned into keys sorted by start address,
+ * then every VMA costs one binary search, instead of walking all siblings
+ * for every program header.
+ */
+static int vma_match_phdrs(struct vm_area_struct *vma,
+			   struct task_link_map *lm, GElf_Phdr *relro_phdr)
+{
+	struct vma_elf_mem *elf = vma->vma_elf;
+	unsigned long load_addr = elf->load_addr, addr, size;
+	int i, idx, nr = 0, nr_v = 0, last_load = -1;
+	struct phdr_key *keys, *vkeys;
+	struct vm_area_struct *v;
+	GElf_Phdr *phdr;
+
+	keys = malloc(2 * (elf->ehdr.e_phnum + 1) * sizeof(*keys));
+	if (!keys)
+		return -ENOMEM;
+	vkeys = keys + elf->ehdr.e_phnum + 1;
+
+	for (i = 0; i < elf->ehdr.e_phnum; i++) {
+		phdr = &elf->phdrs[i];
+		if (phdr->p_type != PT_LOAD && phdr->p_type != PT_GNU_RELRO)
+			continue;
+
+		addr = ELF_PAGESTART(load_addr + phdr->p_vaddr);
+		size = ELF_PAGEALIGN(phdr->p_filesz +
+				     ELF_PAGEOFFSET(phdr->p_vaddr));
+		keys[nr++] = (struct phdr_key) {
+			.start = addr,
+			.end = addr + size,
+			.flags = phdr->p_flags & (PF_R | PF_W | PF_X),
+			.idx = i,
+		};
+
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		last_load = i;
 
-	ulp_debug("MatchPhdr: %lx-%lx vs %lx-%lx "PROT_FMT" ret=%d\n",
-		addr, addr + size, vma->vm_start, vma->vm_end,
-		PROT_ARGS(vma->prot), ret);
+		/**
+		 * Without the link_map, guess the load offset by the file
+		 * offset, see the sibling's key below.
+		 */
+		vkeys[nr_v++] = (struct phdr_key) {
+			.start = lm ? ALIGN_DOWN(lm->l_addr + phdr->p_vaddr,
+						 PAGE_SIZE)
+				    : ALIGN_DOWN(phdr->p_vaddr, phdr->p_align),
+			.any = true,
+			.idx = i,
+		};
+	}
 
 	/**
-	 * If has PT_GNU_RELRO(".data.rel.ro" in it), the GNU linker will
-	 * set PT_GNU_RELRO to readonly in _dl_protect_relro() function.
-	 * At the same time, ".data.rel.ro" in the last PT_LOAD too.
+	 * Data vma will splited by linker(GNU linker ld) according to
+	 * PT_GNU_RELRO, see ".data.rel.ro" section, which in the last PT_LOAD
+	 * and has single PHDR. At the same time, it's in PT_GNU_RELRO, which
+	 * will be set to readonly by GNU Linker _dl_protect_relro(). The rest
+	 * of the VMA after PT_GNU_RELRO matches the last PT_LOAD.
 	 */
-	if (!ret && phdr->p_type == PT_LOAD && relro_phdr)
-		ret = _relro_dl_mprotect(vma, phdr, load_addr, relro_phdr);
-
-	if (ret) {
-		vma->is_matched_phdr = true;
-		memcpy(&vma->phdr, phdr, sizeof(vma->phdr));
+	if (last_load >= 0 && relro_phdr) {
+		keys[nr++] = (struct phdr_key) {
+			.start = PAGE_DOWN(load_addr + relro_phdr->p_vaddr +
+					   relro_phdr->p_memsz),
+			.any = true,
+			.idx = last_load,
+		};
+	}
+
+	qsort(keys, nr, sizeof(*keys), phdr_key_cmp);
+	qsort(vkeys, nr_v, sizeof(*vkeys), phdr_key_cmp);
+
+	idx = phdr_key_find(keys, nr, vma->vm_start, vma->vm_end,
+			    vma_prot2flags(vma->prot));
+	if (idx >= 0)
+		vma->phdr = &elf->phdrs[idx];
+
+	list_for_each_entry(v, &vma->siblings, siblings) {
+		idx = phdr_key_find(keys, nr, v->vm_start, v->vm_end,
+				    vma_prot2flags(v->prot));
+		if (idx >= 0)
+			v->phdr = &elf->phdrs[idx];
+
+		/* Ignore vma holes, ---p */
+		if (vma->prot == PROT_NONE)
+			continue;
+
+		idx = phdr_key_find(vkeys, nr_v, lm ? v->vm_start :
+				    v->vm_pgoff << PAGE_SHIFT, 0, 0);
+		if (idx >= 0) {
+			v->voffset = elf->phdrs[idx].p_vaddr;
+			ulp_debug("Get %s voffset %lx\n", vma->name_,
+				  v->voffset);
+		}
 	}
 
-	return ret;
+	free(keys);
+	return 0;
 }
 
-int alloc_ulp(struct vm_area_struct *vma)
+static int __alloc_ulp(struct vm_area_struct *vma, unsigned long start,
+		       unsigned long len, int slot)
 {
-	int ret;
-	void *mem;
 	struct vma_ulp *ulp;
-	size_t ulp_size = vma->vm_end - vma->vm_start;
 	struct task_struct *task = vma->task;
 
 	ulp = malloc(sizeof(struct vma_ulp));
@@ -126,49 +191,317 @@ int alloc_ulp(struct vm_area_struct *vma)
 		ulp_error("malloc failed.\n");
 		return -ENOMEM;
 	}
+	memset(ulp, 0, sizeof(struct vma_ulp));
 
-	mem = malloc(ulp_size);
-	if (!mem) {
-		ulp_error("malloc failed.\n");
-		return -ENOMEM;
+	/* Only the metadata, the symbols are read by load_ulp_syms() */
+	ulp->elf_mem = ulp_read_sparse_elf(ulp_task_read, task, start, len);
+	if (!ulp->elf_mem) {
+		ulp_error("Failed read %lx:%s\n", start, vma->name_);
+		free(ulp);
+		errno = EAGAIN;
+		return -EAGAIN;
 	}
 
-	vma->ulp = ulp;
-	ulp->elf_mem = mem;
 	ulp->vma = vma;
+	RB_CLEAR_NODE(&ulp->node_id);
+	RB_CLEAR_NODE(&ulp->node_build_id);
+	ulp->start = start;
+	ulp->len = len;
+	ulp->slot = slot;
 	ulp->str_build_id = NULL;
+	ulp->ranges = NULL;
+	ulp->nr_ranges = 0;
 
-	/* Copy VMA from target task memory space */
-	ret = memcpy_from_task(task, ulp->elf_mem, vma->vm_start, ulp_size);
-	if (ret == -1 || ret < ulp_size) {
-		ulp_error("Failed read %lx:%s\n", vma->vm_start, vma->name_);
-		free_ulp(vma);
-		errno = EAGAIN;
-		return -EAGAIN;
-	}
+	/* The newest one is vma::ulp */
+	ulp->next = vma->ulp;
+	vma->ulp = ulp;
 
 	list_add(&ulp->node, &task->ulp_list);
 	return 0;
 }
 
-void free_ulp(struct vm_area_struct *vma)
+int alloc_ulp(struct vm_area_struct *vma)
 {
-	struct vma_ulp *ulp = vma->ulp;
+	return __alloc_ulp(vma, vma->vm_start, vma->vm_end - vma->vm_start, -1);
+}
 
-	if (!ulp) {
+/* Load the patch in @slot of patch pool VMA */
+int alloc_ulp_slot(struct vm_area_struct *vma, int slot)
+{
+	struct ulp_pool_hdr *hdr = vma->ulp_pool;
+
+	if (!hdr || slot >= hdr->nr_slots || !(hdr->used & BIT(slot)) ||
+	    hdr->len[slot] > hdr->slot_size) {
 		errno = EINVAL;
-		return;
+		return -EINVAL;
 	}
 
-	ulp_debug("Remove %s from ulpatch list.\n", vma->name_);
+	return __alloc_ulp(vma, ulp_pool_slot_addr(vma->vm_start, hdr, slot),
+			   hdr->len[slot], slot);
+}
+
+static void unindex_ulp_ranges(struct vma_ulp *ulp)
+{
+	struct task_struct *task = ulp->vma->task;
+	unsigned int i;
+
+	for (i = 0; i < ulp->nr_ranges; i++)
+		interval_tree_remove(&ulp->ranges[i].node, &task->ulp_ranges);
+
+	free(ulp->ranges);
+	ulp->ranges = NULL;
+	ulp->nr_ranges = 0;
+}
+
+/* Remove one patch from its VMA and task::ulp_list, and free it */
+void unlink_ulp(struct vma_ulp *ulp)
+{
+	struct vma_ulp **pp;
+
+	for (pp = &ulp->vma->ulp; *pp; pp = &(*pp)->next) {
+		if (*pp == ulp) {
+			*pp = ulp->next;
+			break;
+		}
+	}
 
 	list_del(&ulp->node);
+	unindex_ulp_ranges(ulp);
+	if (ulp->syms_lazy)
+		ulp->vma->task->tsyms.nr_lazy_ulps--;
+	if (!RB_EMPTY_NODE(&ulp->node_id))
+		rb_erase_cached(&ulp->node_id, &ulp->vma->task->ulps_by_id);
+	if (!RB_EMPTY_NODE(&ulp->node_build_id))
+		rb_erase(&ulp->node_build_id,
+			 &ulp->vma->task->ulps_by_build_id);
 	if (ulp->str_build_id)
 		free(ulp->str_build_id);
+	if (ulp->strtabs)
+		free(ulp->strtabs);
 
 	free(ulp->elf_mem);
 	free(ulp);
-	vma->ulp = NULL;
+}
+
+static int __cmp_ulp_id(struct rb_node *node, unsigned long key)
+{
+	struct vma_ulp *ulp = rb_entry(node, struct vma_ulp, node_id);
+	unsigned int id = (unsigned int)key;
+
+	return ulp->info.ulp_id > id ? 1 : ulp->info.ulp_id < id ? -1 : 0;
+}
+
+static int __cmp_ulp_build_id(struct rb_node *node, unsigned long key)
+{
+	struct vma_ulp *ulp = rb_entry(node, struct vma_ulp, node_build_id);
+
+	return strcmp(ulp->str_build_id, (const char *)key);
+}
+
+/* Index the bytes replaced by every function of patch */
+static int index_ulp_ranges(struct task_struct *task, struct vma_ulp *ulp)
+{
+	struct ulpatch_info *infos = ulp->infos ?: &ulp->info;
+	unsigned int i, nr = ulp->infos ? ulp->nr_funcs : 1;
+	struct ulp_range *r;
+
+	/* Indexed again, such as the patch info was reloaded */
+	if (ulp->ranges)
+		unindex_ulp_ranges(ulp);
+
+	ulp->ranges = calloc(nr, sizeof(struct ulp_range));
+	if (!ulp->ranges)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		r = &ulp->ranges[i];
+		r->ulp = ulp;
+		r->node.start = infos[i].virtual_addr;
+		r->node.last = infos[i].virtual_addr +
+			ulp_info_size(&infos[i]) - 1;
+		interval_tree_insert(&r->node, &task->ulp_ranges);
+	}
+	ulp->nr_ranges = nr;
+	return 0;
+}
+
+/**
+ * Index the patch by ID, Build ID and the replaced bytes, must be called
+ * after the patch info loaded, see load_ulp_info_from_vma().
+ */
+int task_index_ulp(struct task_struct *task, struct vma_ulp *ulp)
+{
+	struct rb_node *node;
+	int err;
+
+	err = index_ulp_ranges(task, ulp);
+	if (err)
+		return err;
+
+	node = rb_insert_node_cached(&task->ulps_by_id, &ulp->node_id,
+				     __cmp_ulp_id, ulp->info.ulp_id);
+	if (node) {
+		ulp_warning("Duplicate ULP ID %d\n", ulp->info.ulp_id);
+		return -EEXIST;
+	}
+
+	if (!ulp->str_build_id)
+		return 0;
+
+	node = rb_insert_node(&task->ulps_by_build_id, &ulp->node_build_id,
+			      __cmp_ulp_build_id,
+			      (unsigned long)ulp->str_build_id);
+	if (node) {
+		ulp_warning("Duplicate ULP Build ID %s\n", ulp->str_build_id);
+		return -EEXIST;
+	}
+	return 0;
+}
+
+struct vma_ulp *find_ulp_by_id(struct task_struct *task, unsigned int id)
+{
+	struct rb_node *node;
+
+	node = rb_search_node(&task->ulps_by_id.rb_root, __cmp_ulp_id, id);
+	return node ? rb_entry(node, struct vma_ulp, node_id) : NULL;
+}
+
+struct vma_ulp *find_ulp_by_build_id(struct task_struct *task,
+				     const char *build_id)
+{
+	struct rb_node *node;
+
+	if (!build_id)
+		return NULL;
+
+	node = rb_search_node(&task->ulps_by_build_id, __cmp_ulp_build_id,
+			      (unsigned long)build_id);
+	return node ? rb_entry(node, struct vma_ulp, node_build_id) : NULL;
+}
+
+/**
+ * The first patched range overlaps [start, last], in O(log n), the next
+ * ones by find_ulp_range_next(), not in order of ULP ID.
+ */
+struct ulp_range *find_ulp_range(struct task_struct *task, unsigned long start,
+				 unsigned long last)
+{
+	struct interval_tree_node *node;
+
+	node = interval_tree_iter_first(&task->ulp_ranges, start, last);
+	return node ? container_of(node, struct ulp_range, node) : NULL;
+}
+
+struct ulp_range *find_ulp_range_next(struct ulp_range *range,
+				      unsigned long start, unsigned long last)
+{
+	struct interval_tree_node *node;
+
+	node = interval_tree_iter_next(&range->node, start, last);
+	return node ? container_of(node, struct ulp_range, node) : NULL;
+}
+
+/* The biggest ID of patches in task, 0 if no patch */
+unsigned int task_last_ulp_id(struct task_struct *task)
+{
+	struct rb_node *node = rb_first_cached(&task->ulps_by_id);
+
+	/* The in-order of rbtree is descending, the leftmost is cached */
+	return node ? rb_entry(node, struct vma_ulp, node_id)->info.ulp_id : 0;
+}
+
+void free_ulp(struct vm_area_struct *vma)
+{
+	if (vma->ulp_pool) {
+		free(vma->ulp_pool);
+		vma->ulp_pool = NULL;
+	}
+	if (vma->ulp_veneer) {
+		free(vma->ulp_veneer);
+		vma->ulp_veneer = NULL;
+	}
+
+	if (!vma->ulp) {
+		errno = EINVAL;
+		return;
+	}
+
+	ulp_debug("Remove %s from ulpatch list.\n", vma->name_);
+
+	while (vma->ulp)
+		unlink_ulp(vma->ulp);
+}
+
+static int vma_load_ulp_pool(struct vm_area_struct *vma)
+{
+	int ret, slot;
+	struct ulp_pool_hdr *hdr;
+	struct task_struct *task = vma->task;
+
+	hdr = malloc(sizeof(struct ulp_pool_hdr));
+	if (!hdr)
+		return -ENOMEM;
+
+	ret = memcpy_from_task(task, hdr, vma->vm_start, sizeof(*hdr));
+	if (ret == -1 || ret < sizeof(*hdr) ||
+	    hdr->version != ULP_POOL_VERSION ||
+	    hdr->nr_slots > ULP_POOL_MAX_SLOTS ||
+	    ulp_pool_slot_addr(vma->vm_start, hdr, hdr->nr_slots) >
+	    vma->vm_end) {
+		ulp_error("Invalid patch pool %lx:%s\n", vma->vm_start,
+			  vma->name_);
+		free(hdr);
+		return -ENOEXEC;
+	}
+
+	vma->ulp_pool = hdr;
+
+	for (slot = 0; slot < hdr->nr_slots; slot++) {
+		struct load_info info = {
+			.target_task = task,
+		};
+
+		if (!(hdr->used & BIT(slot)))
+			continue;
+
+		ret = alloc_ulp_slot(vma, slot);
+		if (ret)
+			continue;
+
+		load_ulp_info_from_vma(vma, &info);
+
+		if (task->max_ulp_id < info.ulp_info->ulp_id)
+			task->max_ulp_id = info.ulp_info->ulp_id;
+	}
+
+	ulp_debug("Load patch pool %s, used %#lx\n", vma->name_, hdr->used);
+	return 0;
+}
+
+/* No patch in veneer island, only the veneers, see struct ulp_veneer_hdr */
+static int vma_load_ulp_veneer(struct vm_area_struct *vma)
+{
+	struct ulp_veneer_hdr *hdr;
+	int ret;
+
+	hdr = malloc(ULP_VENEER_SIZE);
+	if (!hdr)
+		return -ENOMEM;
+
+	ret = memcpy_from_task(vma->task, hdr, vma->vm_start, ULP_VENEER_SIZE);
+	if (ret == -1 || ret < ULP_VENEER_SIZE ||
+	    hdr->version != ULP_VENEER_VERSION ||
+	    hdr->nr_slots > ULP_VENEER_MAX_SLOTS ||
+	    vma->vm_end - vma->vm_start < ULP_VENEER_SIZE) {
+		ulp_error("Invalid veneer island %lx:%s\n", vma->vm_start,
+			  vma->name_);
+		free(hdr);
+		return -ENOEXEC;
+	}
+
+	vma->ulp_veneer = hdr;
+	ulp_debug("Load veneer island %s\n", vma->name_);
+	return 0;
 }
 
 int vma_load_ulp(struct vm_area_struct *vma)
@@ -190,6 +523,11 @@ int vma_load_ulp(struct vm_area_struct *vma)
 		return -EAGAIN;
 	}
 
+	if (!memcmp(&ehdr, ULP_POOL_MAGIC, sizeof(ULP_POOL_MAGIC)))
+		return vma_load_ulp_pool(vma);
+	if (!memcmp(&ehdr, ULP_VENEER_MAGIC, sizeof(ULP_VENEER_MAGIC)))
+		return vma_load_ulp_veneer(vma);
+
 	if (!ehdr_magic_ok(&ehdr)) {
 		ulp_error("VMA %s(%lx) is ULPATCH, but it's not ELF.",
 			  vma->name_, vma->vm_start);
@@ -198,7 +536,9 @@ int vma_load_ulp(struct vm_area_struct *vma)
 	}
 
 	vma->is_elf = true;
-	alloc_ulp(vma);
+	ret = alloc_ulp(vma);
+	if (ret)
+		return ret;
 
 	load_ulp_info_from_vma(vma, &info);
 
@@ -208,19 +548,24 @@ int vma_load_ulp(struct vm_area_struct *vma)
 	return 0;
 }
 
-/* Only FTO_VMA_ELF flag will load VMA ELF */
-static int vma_peek_elf_hdrs(struct vm_area_struct *vma)
+/**
+ * Load the patches of ULPatch VMAs not loaded yet, see FTO_VMA_ULP, the
+ * failed one reports error, same as peek_task_elf_hdrs().
+ */
+static void task_load_ulps(struct task_struct *task)
 {
-	GElf_Ehdr ehdr = {};
-	struct task_struct *task = vma->task;
-	unsigned long phaddr;
-	unsigned int phsz = 0;
-	int ret;
-	int i;
-	bool is_share_lib = true;
-	unsigned long lowest_vaddr = ULONG_MAX;
-	GElf_Phdr *gnu_relro_phdr = NULL;
+	struct vm_area_struct *vma;
+
+	task_for_each_vma(vma, task) {
+		if (vma->type == VMA_ULPATCH && !vma->ulp && !vma->ulp_pool &&
+		    !vma->ulp_veneer)
+			vma_load_ulp(vma);
+	}
+}
 
+/* Check the VMA is worth to peek ELF header or not */
+static bool vma_need_peek_elf(struct vm_area_struct *vma)
+{
 	/* Check VMA type, and skip it */
 	switch (vma->type) {
 	case VMA_VVAR:
@@ -228,17 +573,27 @@ static int vma_peek_elf_hdrs(struct vm_area_struct *vma)
 	case VMA_STACK:
 	case VMA_UPROBES:
 	case VMA_VSYSCALL:
+	/* Anonymous memory is never ELF, no read at all */
+	case VMA_ANON:
+	case VMA_HEAP:
 		ulp_debug("skip %s\n", vma_type_name(vma->type));
-		return 0;
+		return false;
 	case VMA_ULPATCH:
-		return vma_load_ulp(vma);
+		return false;
 	default:
 		break;
 	}
 
 	/* Just skip already peeked ELF */
 	if (vma->vma_elf != NULL || vma->is_elf)
-		return 0;
+		return false;
+
+	/**
+	 * The ELF header is at file offset 0, peek it once per file, the
+	 * siblings are matched with the leader's phdrs, see vma_match_phdrs().
+	 */
+	if (vma->leader != vma || vma->vm_pgoff)
+		return false;
 
 	/**
 	 * Add more check here, skip some VMA peek, because some vma pread()
@@ -247,21 +602,66 @@ static int vma_peek_elf_hdrs(struct vm_area_struct *vma)
 	if (!strncmp(vma->name_, "/etc", 4) ||
 	    !strncmp(vma->name_, "/sys", 4)) {
 		ulp_debug("Skip peek vma %s\n", vma->name_);
-		return 0;
+		return false;
 	}
 
+	return true;
+}
+
+/* Number of program headers read along with ELF header */
+#define TASK_PEEK_NR_PHDRS	16
+
+/* The beginning of ELF VMA, see peek_task_elf_hdrs() */
+struct elf_hdrs_peek {
+	GElf_Ehdr ehdr;
+	GElf_Phdr phdrs[TASK_PEEK_NR_PHDRS];
+};
+
+/**
+ * Only FTO_VMA_ELF flag will load VMA ELF
+ *
+ * @peeked: ELF header and maybe the program headers already read from
+ *          vma->vm_start, see peek_task_elf_hdrs(), NULL means read them
+ *          here.
+ */
+static int vma_peek_elf_hdrs(struct vm_area_struct *vma,
+			     const struct elf_hdrs_peek *peeked)
+{
+	GElf_Ehdr ehdr = {};
+	struct task_struct *task = vma->task;
+	unsigned long phaddr;
+	unsigned int phsz = 0;
+	int ret;
+	int i;
+	bool is_share_lib = true;
+	unsigned long lowest_vaddr = ULONG_MAX;
+	GElf_Phdr *gnu_relro_phdr = NULL;
+	struct task_link_map *lm;
+
+	/* Loaded already, see reload_task() */
+	if (vma->type == VMA_ULPATCH)
+		return vma->ulp || vma->ulp_pool || vma->ulp_veneer ? 0 :
+		       vma_load_ulp(vma);
+
+	if (!vma_need_peek_elf(vma))
+		return 0;
+
 	ulp_debug("Try peek elf hdr from %s, addr %lx\n", vma->name_,
 		  vma->vm_start);
 
 	/**
 	 * Read the ELF header from target task memory.
 	 */
-	ret = memcpy_from_task(task, &ehdr, vma->vm_start, sizeof(ehdr));
-	if (ret < sizeof(ehdr)) {
-		ulp_error("Failed read from %lx:%s\n", vma->vm_start,
-			  vma->name_);
-		errno = EAGAIN;
-		return -EAGAIN;
+	if (peeked)
+		memcpy(&ehdr, &peeked->ehdr, sizeof(ehdr));
+	else {
+		ret = memcpy_from_task(task, &ehdr, vma->vm_start, sizeof(ehdr));
+		if (ret < sizeof(ehdr)) {
+			ulp_error("Failed read from %lx:%s\n", vma->vm_start,
+				  vma->name_);
+			errno = EAGAIN;
+			return -EAGAIN;
+		}
 	}
 
 	/* If it's not ELF, return success, skip the non-ELF VMAs */
@@ -296,7 +696,7 @@ static int vma_peek_elf_hdrs(struct vm_area_struct *vma)
 	}
 
 	/* VMA is ELF, handle it */
-	vma->vma_elf = malloc(sizeof(struct vma_elf_mem));
+	vma->vma_elf = task_elf_alloc(task, sizeof(struct vma_elf_mem));
 	if (!vma->vma_elf)
 		return -ENOMEM;
 
@@ -321,21 +721,28 @@ static int vma_peek_elf_hdrs(struct vm_area_struct *vma)
 	if (phsz == 0) {
 		ulp_warning("%s: no phdr, e_phoff %lx, skip it.\n",
 			 vma->name_, vma->vma_elf->ehdr.e_phoff);
-		free(vma->vma_elf);
+		vma->vma_elf = NULL;
 		return 0;
 	}
 
-	vma->vma_elf->phdrs = malloc(phsz);
+	vma->vma_elf->phdrs = task_elf_alloc(task, phsz);
 	if (!vma->vma_elf->phdrs) {
-		free(vma->vma_elf);
+		vma->vma_elf = NULL;
 		return -ENOMEM;
 	}
 
+	/* Usually right after the ELF header, read already */
+	if (peeked && ehdr.e_phoff >= sizeof(peeked->ehdr) &&
+	    ehdr.e_phoff + phsz <= sizeof(*peeked)) {
+		memcpy(vma->vma_elf->phdrs, (void *)peeked + ehdr.e_phoff,
+		       phsz);
+		goto peek_phdrs_done;
+	}
+
 	/* Read all program headers from target task memory space */
 	ulp_debug("peek phdr from target addr %lx, len %d\n", phaddr, phsz);
 	if (memcpy_from_task(task, vma->vma_elf->phdrs, phaddr, phsz) < phsz) {
-		free(vma->vma_elf->phdrs);
-		free(vma->vma_elf);
+		vma->vma_elf = NULL;
 		ulp_error("Failed to read %s program header.\n", vma->name_);
 		return -EAGAIN;
 	}
@@ -379,14 +786,15 @@ set_share_lib:
 
 	vma->is_share_lib = !!is_share_lib;
 
+	/* The exact load bias, see FTO_LINK_MAP */
+	lm = vma_link_map(vma);
+
 	/**
 	 * VMA is ELF, for each program header to find the lowest Virtual
 	 * address in p_vaddr.
 	 */
 	for (i = 0; i < vma->vma_elf->ehdr.e_phnum; i++) {
 		GElf_Phdr *phdr = &vma->vma_elf->phdrs[i];
-		unsigned long vaddr;
-		struct vm_area_struct *sibling, *tmpvma;
 
 		switch (phdr->p_type) {
 		case PT_LOAD:
@@ -395,28 +803,6 @@ set_share_lib:
 
 			ulp_debug("PT_LOAD: %s, lowest_vaddr %lx\n", vma->name_,
 				lowest_vaddr);
-
-			/* Virtual address offset */
-			vaddr = ALIGN_DOWN(phdr->p_vaddr, phdr->p_align);
-
-			list_for_each_entry_safe(sibling, tmpvma,
-				&vma->siblings, siblings) {
-
-				/* Ignore vma holes, ---p */
-				if (vma->prot == PROT_NONE)
-					continue;
-
-				/**
-				 * TODO: How to get the real offset of load
-				 * maybe i can use /proc/PID/auxv to get it.
-				 */
-				if ((sibling->vm_pgoff << PAGE_SHIFT) == vaddr) {
-					ulp_debug("Get %s voffset %lx\n",
-						vma->name_, phdr->p_vaddr);
-					sibling->voffset = phdr->p_vaddr;
-				}
-			}
-
 			FALLTHROUGH;
 		case PT_GNU_RELRO:
 			gnu_relro_phdr = phdr;
@@ -428,8 +814,6 @@ set_share_lib:
 		ulp_error("%s: unable to find lowest load address(%lx).\n",
 			vma->name_, lowest_vaddr);
 		print_vma(stdout, true, vma, true);
-		free(vma->vma_elf->phdrs);
-		free(vma->vma_elf);
 		vma->vma_elf = NULL;
 		vma->is_elf = false;
 		vma->is_share_lib = false;
@@ -437,31 +821,16 @@ set_share_lib:
 	}
 
 	vma->vma_elf->load_addr = vma->vm_start - lowest_vaddr;
-
-	for (i = 0; i < vma->vma_elf->ehdr.e_phnum; i++) {
-		GElf_Phdr *phdr = &vma->vma_elf->phdrs[i];
-		struct vm_area_struct *sibling, *tmpvma;
-
-		switch (phdr->p_type) {
-
-		case PT_LOAD:
-		case PT_GNU_RELRO:
-			/* leader */
-			match_vma_phdr(vma, phdr, vma->vma_elf->load_addr,
-				       gnu_relro_phdr);
-			/* siblings */
-			list_for_each_entry_safe(sibling, tmpvma,
-						 &vma->siblings, siblings) {
-				match_vma_phdr(sibling, phdr,
-					       vma->vma_elf->load_addr,
-					       gnu_relro_phdr);
-			}
-			break;
-		default:
-			break;
-		}
+	if (lm && lm->l_addr != vma->vma_elf->load_addr) {
+		ulp_debug("%s: load_addr %lx, l_addr %lx\n", vma->name_,
+			  vma->vma_elf->load_addr, lm->l_addr);
+		vma->vma_elf->load_addr = lm->l_addr;
 	}
 
+	ret = vma_match_phdrs(vma, lm, gnu_relro_phdr);
+	if (ret)
+		return ret;
+
 	ulp_info("%s vma start %lx, load_addr %lx\n",
 		vma->name_, vma->vm_start, vma->vma_elf->load_addr);
 
@@ -471,6 +840,7 @@ set_share_lib:
 static int vma_load_elf_file(struct vm_area_struct *vma)
 {
 	struct task_struct *task = vma->task;
+	char buf[PATH_MAX];
 
 	if (!vma->is_elf) {
 		errno = EINVAL;
@@ -480,8 +850,10 @@ static int vma_load_elf_file(struct vm_area_struct *vma)
 	/**
 	 * "[vdso]" vma is elf, but file is not exist, could not open it.
 	 */
-	if (task->fto_flag & FTO_VMA_ELF_FILE && fexist(vma->name_)) {
-		vma->bfd_elf_file = bfd_elf_open(vma->name_);
+	if (task->fto_flag & FTO_VMA_ELF_FILE &&
+	    task_path_exist(task, vma->name_)) {
+		vma->bfd_elf_file = bfd_elf_open(task_path(task, vma->name_,
+							   buf, sizeof(buf)));
 		if (!vma->bfd_elf_file) {
 			ulp_error("Open ELF bfd %s failed.\n", vma->name_);
 			errno = EINVAL;
@@ -502,6 +874,16 @@ static int vma_load_elf_file(struct vm_area_struct *vma)
 	return 0;
 }
 
+/**
+ * The ELF details of VMAs come from task::elf_pool, they are released in
+ * bulk by close_task(), the chunks instead of the objects one by one. The
+ * ones of the VMAs unmapped by refresh_task_vmas() are kept until then.
+ */
+void *task_elf_alloc(struct task_struct *task, size_t size)
+{
+	return str_pool_alloc(&task->elf_pool, ROUND_UP(size, sizeof(long)));
+}
+
 void vma_free_elf(struct vm_area_struct *vma)
 {
 	if (!vma->is_elf || vma->type == VMA_ULPATCH) {
@@ -509,13 +891,13 @@ void vma_free_elf(struct vm_area_struct *vma)
 		return;
 	}
 
-	free(vma->vma_elf->phdrs);
-	free(vma->vma_elf);
+	/* In task::elf_pool */
+	vma->vma_elf = NULL;
 }
 
 int update_task_vmas_ulp(struct task_struct *task)
 {
-	return read_task_vmas(task, true);
+	return refresh_task_vmas(task, NULL);
 }
 
 void print_task(FILE *fp, const struct task_struct *task, bool detail)
@@ -538,11 +920,20 @@ void print_task(FILE *fp, const struct task_struct *task, bool detail)
 	/* Detail */
 	fprintf(fp, "FTO:     %-32x\n", task->fto_flag);
 	fprintf(fp, "MemFD:   %-32d\n", task->proc_mem_fd);
+	if (task->mcache.enabled)
+		fprintf(fp, "MemCache: pages %ld, hits %ld, misses %ld\n",
+			task->mcache.nr_pages, task->mcache.hits,
+			task->mcache.misses);
+	task_arena_stats(fp, task);
+	print_task_err_stats(fp);
 }
 
 void print_thread(FILE *fp, struct task_struct *task, struct thread *thread)
 {
-	fprintf(fp, "pid %d, tid %d\n", task->pid, thread->tid);
+	fprintf(fp, "pid %d, tid %d", task->pid, thread->tid);
+	if (thread->frozen)
+		fprintf(fp, ", frozen in %ld ns", thread->stop_ns);
+	fprintf(fp, "\n");
 }
 
 void print_fd(FILE *fp, struct task_struct *task, struct fd *fd)
@@ -550,6 +941,24 @@ void print_fd(FILE *fp, struct task_struct *task, struct fd *fd)
 	fprintf(fp, "fd %d -> %s\n", fd->fd, fd->symlink);
 }
 
+/* The file of fd, include socket and pipe, see task_getfd() */
+static void print_fd_stat(FILE *fp, struct task_struct *task, struct fd *fd)
+{
+	struct stat st;
+	int newfd;
+
+	newfd = task_getfd(task, fd->fd);
+	if (newfd < 0)
+		return;
+
+	if (!fstat(newfd, &st))
+		fprintf(fp, "\tdev %u:%u ino %lu mode %o size %ld\n",
+			major(st.st_dev), minor(st.st_dev),
+			(unsigned long)st.st_ino, st.st_mode,
+			(long)st.st_size);
+	close(newfd);
+}
+
 int dump_task(FILE *fp, const struct task_struct *task, bool detail)
 {
 	if (!fp)
@@ -574,55 +983,233 @@ void dump_task_vmas(FILE *fp, struct task_struct *task, bool detail)
 	fprintf(fp, "\n(E)ELF, (S)SharedLib, (P)MatchPhdr, (L)Leader\n");
 }
 
-int dump_task_addr_to_file(const char *ofile, struct task_struct *task,
-			   unsigned long addr, unsigned long size)
+void emit_task_vmas(struct emitter *e, struct task_struct *task)
 {
-	void *mem = NULL;
+	struct vm_area_struct *vma;
 
-	/* default is stdout */
-	int nbytes;
+	list_for_each_entry(vma, &task->vma_list, node_list)
+		emit_vma(e, vma, NULL);
+}
 
-	/* If no output file name is specified, then the default output to stdout
-	 * can be output using redirection. */
-	int fd = fileno(stdout);
+/* Read and write this much memory of target once, see dump_task_addr_to_fd() */
+#define DUMP_CHUNK_SIZE	SZ_1M
 
-	if (ofile) {
-		fd = open(ofile, O_CREAT | O_RDWR, 0664);
-		if (fd <= 0) {
-			ulp_error("open %s: %m\n", ofile);
-			return -1;
-		}
+static bool dump_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	/* Compare with itself shifted 1 byte, the whole is zero if equal */
+	return !p[0] && !memcmp(p, p + 1, len - 1);
+}
+
+/**
+ * Read one chunk of target memory, if the chunk is not all readable, such
+ * as the guard pages and the pages beyond the file end, read it page by
+ * page, the unreadable pages are zero filled. Return the number of
+ * unreadable pages.
+ */
+static int dump_read_chunk(struct task_struct *task, void *buf,
+			   unsigned long addr, size_t size)
+{
+	size_t off, len;
+	int holes = 0;
+
+	if (pread(task->proc_mem_fd, buf, size, addr) == size)
+		return 0;
+
+	for (off = 0; off < size; off += len) {
+		len = MIN(PAGE_SIZE - ((addr + off) & (PAGE_SIZE - 1)),
+			  size - off);
+		if (pread(task->proc_mem_fd, buf + off, len, addr + off) != len) {
+			memset(buf + off, 0, len);
+			holes++;
+		}
 	}
-	struct vm_area_struct *vma = find_vma(task, addr);
-	if (!vma) {
-		ulp_error("%s vma not exist on 0x%lx.\n", task->comm, addr);
-		return -1;
+	return holes;
+}
+
+static int dump_write(int fd, const void *buf, size_t size)
+{
+	ssize_t n;
+
+	while (size) {
+		n = write(fd, buf, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ulp_error("write failed, %m.\n");
+			return -errno ?: -EIO;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/**
+ * Stream [addr, addr + size) of target to @fd in DUMP_CHUNK_SIZE chunks,
+ * thus the memory is flat no matter how large the VMA is. The unreadable
+ * pages are dumped as zero instead of failing the whole dump.
+ *
+ * With DUMP_F_SPARSE, the zero pages are skipped with lseek(2) if @fd is
+ * seekable, they take no disk space.
+ *
+ * The /proc/PID/mem doesn't support splice(2) nor copy_file_range(2), thus
+ * the data has to pass through the user buffer.
+ */
+int dump_task_addr_to_fd(int fd, struct task_struct *task, unsigned long addr,
+			 unsigned long size, unsigned int flags)
+{
+	size_t off, len, pg, end, n, hole = 0;
+	int holes = 0, ret = 0;
+	bool sparse, zero;
+	off_t start;
+	void *buf;
+
+	start = lseek(fd, 0, SEEK_CUR);
+	sparse = (flags & DUMP_F_SPARSE) && start != -1;
+
+	buf = malloc(DUMP_CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	for (off = 0; off < size; off += len) {
+		len = MIN(DUMP_CHUNK_SIZE, size - off);
+		holes += dump_read_chunk(task, buf, addr + off, len);
+
+		if (!sparse) {
+			ret = dump_write(fd, buf, len);
+			if (ret)
+				break;
+			continue;
+		}
+
+		/* Skip the zero pages, write the others in one write */
+		for (pg = 0; pg < len; pg = end) {
+			n = MIN(PAGE_SIZE, len - pg);
+			zero = dump_is_zero(buf + pg, n);
+			for (end = pg + n; end < len; end += n) {
+				n = MIN(PAGE_SIZE, len - end);
+				if (dump_is_zero(buf + end, n) != zero)
+					break;
+			}
+
+			if (zero) {
+				hole += end - pg;
+				continue;
+			}
+
+			if (hole && lseek(fd, hole, SEEK_CUR) == -1) {
+				ret = -errno;
+				break;
+			}
+			hole = 0;
+
+			ret = dump_write(fd, buf + pg, end - pg);
+			if (ret)
+				break;
+		}
+		if (ret)
+			break;
+	}
+
+	/* The trailing hole, make the file size right */
+	if (!ret && hole && ftruncate(fd, start + size))
+		ret = -errno;
+
+	if (holes)
+		ulp_warning("%d pages of %lx-%lx unreadable, dump as zero.\n",
+			    holes, addr, addr + size);
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * Like dump_task_addr_to_fd(), but compress the stream into the seekable
+ * zstd @fd with a thread for each CPU, the next chunk is read while the
+ * previous ones are compressed. The zero pages compress to nearly nothing,
+ * thus DUMP_F_SPARSE means nothing here.
+ */
+static int dump_task_addr_to_zst(int fd, struct task_struct *task,
+				 unsigned long addr, unsigned long size)
+{
+	struct ulp_zst *z;
+	size_t off, len;
+	int holes = 0, ret = 0, err;
+	void *buf;
+
+	buf = malloc(DUMP_CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	z = ulp_zst_open(fd, 0);
+	if (!z) {
+		ret = -errno;
+		goto out;
+	}
+
+	for (off = 0; off < size; off += len) {
+		len = MIN(DUMP_CHUNK_SIZE, size - off);
+		holes += dump_read_chunk(task, buf, addr + off, len);
+		ret = ulp_zst_write(z, buf, len);
+		if (ret)
+			break;
 	}
 
-	mem = malloc(size);
+	err = ulp_zst_close(z);
+	if (!ret)
+		ret = err;
 
-	memcpy_from_task(task, mem, addr, size);
+	if (holes)
+		ulp_warning("%d pages of %lx-%lx unreadable, dump as zero.\n",
+			    holes, addr, addr + size);
+out:
+	free(buf);
+	return ret;
+}
+
+int dump_task_addr_to_file(const char *ofile, struct task_struct *task,
+			   unsigned long addr, unsigned long size,
+			   unsigned int flags)
+{
+	/**
+	 * If no output file name is specified, then the default output to
+	 * stdout can be output using redirection.
+	 */
+	int fd = fileno(stdout);
+	int ret;
 
-	/* write to file or stdout */
-	nbytes = write(fd, mem, size);
-	if (nbytes != size) {
-		ulp_error("write failed, %m.\n");
-		free(mem);
+	struct vm_area_struct *vma = find_vma_or_query(task, addr);
+	if (!vma) {
+		ulp_error("%s vma not exist on 0x%lx.\n", task->comm, addr);
 		return -1;
 	}
 
-	free(mem);
+	if (ofile) {
+		fd = open(ofile, O_CREAT | O_WRONLY | O_TRUNC, 0664);
+		if (fd < 0) {
+			ulp_error("open %s: %m\n", ofile);
+			return -1;
+		}
+	}
+
+	if (ofile && ulp_zst_path(ofile))
+		ret = dump_task_addr_to_zst(fd, task, addr, size);
+	else
+		ret = dump_task_addr_to_fd(fd, task, addr, size, flags);
+
 	if (fd != fileno(stdout))
 		close(fd);
 
-	return 0;
+	return ret ? -1 : 0;
 }
 
 int dump_task_vma_to_file(const char *ofile, struct task_struct *task,
-			  unsigned long addr)
+			  unsigned long addr, unsigned int flags)
 {
 	size_t vma_size = 0;
-	struct vm_area_struct *vma = find_vma(task, addr);
+	struct vm_area_struct *vma = find_vma_or_query(task, addr);
 	if (!vma) {
 		ulp_error("%s vma not exist on 0x%lx.\n", task->comm, addr);
 		return -1;
@@ -630,54 +1217,67 @@ int dump_task_vma_to_file(const char *ofile, struct task_struct *task,
 
 	vma_size = vma->vm_end - vma->vm_start;
 
-	return dump_task_addr_to_file(ofile, task, vma->vm_start, vma_size);
+	return dump_task_addr_to_file(ofile, task, vma->vm_start, vma_size,
+				      flags);
 }
 
 void dump_task_threads(FILE *fp, struct task_struct *task, bool detail)
 {
+	struct list_head *threads;
 	struct thread *thread;
 
 	if (!fp)
 		fp = stdout;
 
-	if (!(task->fto_flag & FTO_THREADS)) {
-		ulp_error("Not set FTO_THREADS(%ld) flag\n", FTO_THREADS);
+	threads = task_threads(task);
+	if (!threads)
 		return;
-	}
 
-	list_for_each_entry(thread, &task->threads_list, node)
+	list_for_each_entry(thread, threads, node)
 		print_thread(fp, task, thread);
 }
 
 void dump_task_fds(FILE *fp, struct task_struct *task, bool detail)
 {
+	struct list_head *fds;
 	struct fd *fd;
 
 	if (!fp)
 		fp = stdout;
 
-	if (!(task->fto_flag & FTO_FD)) {
-		ulp_error("Not set FTO_FD(%ld) flag\n", FTO_FD);
+	fds = task_fds(task);
+	if (!fds)
 		return;
-	}
 
-	list_for_each_entry(fd, &task->fds_list, node)
+	list_for_each_entry(fd, fds, node) {
 		print_fd(fp, task, fd);
+		if (detail)
+			print_fd_stat(fp, task, fd);
+	}
 }
 
 int free_task_vmas(struct task_struct *task)
 {
 	struct vm_area_struct *vma, *tmpvma;
 
-	list_for_each_entry_safe(vma, tmpvma, &task->vma_list, node_list) {
-		unlink_vma(task, vma);
-		free_vma(vma);
-	}
+	/**
+	 * All VMAs will be released with task::vma_slab, and the ELF details
+	 * with task::elf_pool, no need to erase one by one from rbtree, which
+	 * cost rebalance. Only the patches are freed one by one.
+	 */
+	list_for_each_entry_safe(vma, tmpvma, &task->vma_list, node_list)
+		free_ulp(vma);
+	slab_cache_destroy(&task->vma_slab);
+	str_pool_destroy(&task->elf_pool);
 
 	list_init(&task->vma_list);
 	list_init(&task->ulp_list);
+	rb_init_cached(&task->ulps_by_id);
+	rb_init(&task->ulps_by_build_id);
+	task->ulp_ranges = RB_ROOT;
 	list_init(&task->threads_list);
 	list_init(&task->fds_list);
+	list_init(&task->link_maps);
 	rb_init(&task->vmas_rb);
 
 	task->libc_vma = NULL;
@@ -693,6 +1293,72 @@ bool proc_pid_exist(pid_t pid)
 	return fexist(path);
 }
 
+/**
+ * Find processes whose /proc/PID/comm is @comm, current process is skipped.
+ * Return the number of pids stored in @pids, at most @max.
+ */
+int proc_pgrep(const char *comm, pid_t *pids, int max)
+{
+	char path[PATH_MAX], buf[TASK_COMM_LEN + 1];
+	struct dirent *ent;
+	DIR *dir;
+	FILE *fp;
+	pid_t pid;
+	int n = 0;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -errno;
+
+	while ((ent = readdir(dir)) != NULL && n < max) {
+		pid = atoi(ent->d_name);
+		if (pid <= 0 || pid == getpid())
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (fgets(buf, sizeof(buf), fp)) {
+			buf[strcspn(buf, "\n")] = '\0';
+			if (!strcmp(buf, comm))
+				pids[n++] = pid;
+		}
+		fclose(fp);
+	}
+
+	closedir(dir);
+	return n;
+}
+
+/**
+ * The executable mapping of libc is there, open_task() needs it. The new
+ * process of execve(2) has only the executable and the dynamic linker for
+ * a while, see ulpatchd(8).
+ */
+bool proc_pid_libc_mapped(pid_t pid)
+{
+	char path[64], line[PATH_MAX + 128], perms[8], name[PATH_MAX];
+	bool mapped = false;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	while (!mapped && fgets(line, sizeof(line), fp)) {
+		name[0] = '\0';
+		if (sscanf(line, "%*x-%*x %7s %*x %*x:%*x %*u %4095s", perms,
+			   name) < 2 || perms[2] != 'x' || name[0] != '/')
+			continue;
+		mapped = get_vma_type(pid, "", name) == VMA_LIBC;
+	}
+
+	fclose(fp);
+	return mapped;
+}
+
 char *get_proc_pid_exe(pid_t pid, char *buf, size_t bufsz)
 {
 	ssize_t ret = 0;
@@ -735,7 +1401,14 @@ static int __get_comm(struct task_struct *task)
 		return -errno;
 	}
 
-	fp = fopen(path, "r");
+	ret = task_proc_open(task, "comm", O_RDONLY);
+	fp = ret < 0 ? NULL : fdopen(ret, "r");
+	if (!fp) {
+		ulp_error("open %s failed, %m\n", path);
+		if (ret >= 0)
+			close(ret);
+		return -errno;
+	}
 
 	ret = fscanf(fp, "%s", task->comm);
 	if (ret == EOF) {
@@ -754,14 +1427,13 @@ static int __get_exe(struct task_struct *task)
 	ssize_t ret;
 
 	snprintf(path, sizeof(path), "/proc/%d/exe", task->pid);
-	ret = readlink(path, realpath, sizeof(realpath));
+	ret = task_proc_readlink(task, "exe", realpath, sizeof(realpath));
 	if (ret < 0) {
 		ulp_error("readlink %s failed, %m\n", path);
 		return -errno;
 	}
-	realpath[ret] = '\0';
 
-	if (!fexist(realpath)) {
+	if (!task_path_exist(task, realpath)) {
 		ulp_error("Execute %s is removed!\n", realpath);
 		return -ENOENT;
 	}
@@ -771,93 +1443,73 @@ static int __get_exe(struct task_struct *task)
 	return 0;
 }
 
+/* The saved auxv of kernel is AT_VECTOR_SIZE, less than 64 pairs */
+#define TASK_AUXV_MAX	128
+
 static int load_task_auxv(pid_t pid, struct task_struct_auxv *pauxv)
 {
-	int fd, n, ret = 0;
-	char buf[PATH_MAX];
-	GElf_auxv_t auxv;
+	GElf_auxv_t auxv[TASK_AUXV_MAX];
+	const char *missing = NULL;
+	char path[64];
+	ssize_t n;
+	size_t i, nr;
 
 	memset(pauxv, 0x00, sizeof(struct task_struct_auxv));
 
-	snprintf(buf, PATH_MAX - 1, "/proc/%d/auxv", pid);
-	fd = open(buf, O_RDONLY);
-	if (fd == -1) {
-		ret = -errno;
-		ulp_error("Open %s failed, %m\n", buf);
-		goto exit;
+	snprintf(path, sizeof(path), "/proc/%d/auxv", pid);
+	n = fload(path, auxv, sizeof(auxv));
+	if (n < 0) {
+		ulp_error("Read %s failed, %s\n", path, strerror(-n));
+		return n;
 	}
 
-	while (true) {
-		n = read(fd, &auxv, sizeof(auxv));
-		if (n < sizeof(auxv))
-			break;
-		switch (auxv.a_type) {
+	nr = n / sizeof(auxv[0]);
+	for (i = 0; i < nr && auxv[i].a_type != AT_NULL; i++) {
+		switch (auxv[i].a_type) {
 		case AT_PHDR:
-			pauxv->auxv_phdr = auxv.a_un.a_val;
+			pauxv->auxv_phdr = auxv[i].a_un.a_val;
 			break;
 		case AT_PHENT:
-			pauxv->auxv_phent = auxv.a_un.a_val;
+			pauxv->auxv_phent = auxv[i].a_un.a_val;
 			break;
 		case AT_PHNUM:
-			pauxv->auxv_phnum = auxv.a_un.a_val;
+			pauxv->auxv_phnum = auxv[i].a_un.a_val;
 			break;
 		case AT_BASE:
-			pauxv->auxv_interp = auxv.a_un.a_val;
+			pauxv->auxv_interp = auxv[i].a_un.a_val;
 			break;
 		case AT_ENTRY:
-			pauxv->auxv_entry = auxv.a_un.a_val;
+			pauxv->auxv_entry = auxv[i].a_un.a_val;
 			break;
 		}
 	}
 
-	if (pauxv->auxv_phdr == 0) {
-		ulp_error("Not found AT_PHDR in %s\n", buf);
-		errno = ENOENT;
-		ret = -errno;
-		goto close_exit;
-	}
-	if (pauxv->auxv_phent == 0) {
-		ulp_error("Not found AT_PHENT in %s\n", buf);
-		errno = ENOENT;
-		ret = -errno;
-		goto close_exit;
-	}
-	if (pauxv->auxv_phnum == 0) {
-		ulp_error("Not found AT_PHNUM in %s\n", buf);
-		errno = ENOENT;
-		ret = -errno;
-		goto close_exit;
-	}
-	if (pauxv->auxv_interp == 0) {
-		ulp_error("Not found AT_BASE in %s\n", buf);
-		errno = ENOENT;
-		ret = -errno;
-		goto close_exit;
-	}
-	if (pauxv->auxv_entry == 0) {
-		ulp_error("Not found AT_ENTRY in %s\n", buf);
+	if (pauxv->auxv_phdr == 0)
+		missing = "AT_PHDR";
+	else if (pauxv->auxv_phent == 0)
+		missing = "AT_PHENT";
+	else if (pauxv->auxv_phnum == 0)
+		missing = "AT_PHNUM";
+	else if (pauxv->auxv_interp == 0)
+		missing = "AT_BASE";
+	else if (pauxv->auxv_entry == 0)
+		missing = "AT_ENTRY";
+
+	if (missing) {
+		ulp_error("Not found %s in %s\n", missing, path);
 		errno = ENOENT;
-		ret = -errno;
-		goto close_exit;
+		return -ENOENT;
 	}
-
-close_exit:
-	close(fd);
-exit:
-	return ret;
+	return 0;
 }
 
-int print_task_auxv(FILE *fp, const struct task_struct *task)
+int print_task_auxv(FILE *fp, struct task_struct *task)
 {
 	const struct task_struct_auxv *pauxv;
 
-	if (!task || !(task->fto_flag & FTO_AUXV)) {
-		ulp_error("Not set FTO_AUXV.\n");
-		errno = EINVAL;
-		return -EINVAL;
-	}
-
-	pauxv = &task->auxv;
+	pauxv = task_auxv(task);
+	if (!pauxv)
+		return -errno;
 
 	if (!fp)
 		fp = stdout;
@@ -874,84 +1526,88 @@ int print_task_auxv(FILE *fp, const struct task_struct *task)
 	return 0;
 }
 
+static int status_uid(struct task_status *ts, const char *val)
+{
+	return sscanf(val, "%u %u %u %u", &ts->uid, &ts->euid, &ts->suid,
+		      &ts->fsuid) == 4 ? 0 : -EINVAL;
+}
+
+static int status_gid(struct task_status *ts, const char *val)
+{
+	return sscanf(val, "%u %u %u %u", &ts->gid, &ts->egid, &ts->sgid,
+		      &ts->fsgid) == 4 ? 0 : -EINVAL;
+}
+
+/* The keys of /proc/PID/status parsed, add the new fields here */
+static const struct status_key {
+	const char *key;
+	int (*parse)(struct task_status *ts, const char *val);
+} status_keys[] = {
+	{ "Uid", status_uid },
+	{ "Gid", status_gid },
+};
+
+/**
+ * Parse /proc/PID/status in memory, the generated file is read by one
+ * read(2), the lines are dispatched by key.
+ */
 static int load_task_status(pid_t pid, struct task_status *status)
 {
-	int fd, ret = 0;
-	char buf[PATH_MAX];
-	FILE *fp;
+	char path[64], buf[4096], *line, *next, *val;
 	struct task_status ts;
+	unsigned int found = 0;
+	ssize_t n;
+	int i;
 
 	memset(&ts, 0x00, sizeof(struct task_status));
-	snprintf(buf, PATH_MAX - 1, "/proc/%d/status", pid);
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
 
-	fd = open(buf, O_RDONLY);
-	fp = fdopen(fd, "r");
-	if (fd == -1 || !fd) {
-		ulp_error("Open %s failed, %m\n", buf);
-		ret = -errno;
-		goto close_exit;
+	/* Uid: and Gid: are at the head, a truncated tail is fine */
+	n = fload(path, buf, sizeof(buf));
+	if (n < 0) {
+		ulp_error("Read %s failed, %s\n", path, strerror(-n));
+		return n;
 	}
 
-	ts.uid = ts.euid = ts.suid = ts.fsuid = -1;
-	ts.gid = ts.egid = ts.sgid = ts.fsgid = -1;
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
 
-	fseek(fp, 0, SEEK_SET);
-	do {
-		int r;
-		char line[1024], label[128];
+		val = strchr(line, ':');
+		if (!val)
+			continue;
+		*val++ = '\0';
 
-		if (!fgets(line, sizeof(line), fp))
-			break;
-		ulp_debug("Status: %s\n", line);
-
-		if (!strncmp(line, "Uid:", 4)) {
-			r = sscanf(line, "%s %d %d %d %d", label,
-					&ts.uid,
-					&ts.euid,
-					&ts.suid,
-					&ts.fsuid);
-			if (r <= 0) {
-				ulp_error("sscanf failed.\n");
-				ret = -errno;
-				goto close_exit;
-			}
-		}
-
-		if (!strncmp(line, "Gid:", 4)) {
-			r = sscanf(line, "%s %d %d %d %d", label,
-					&ts.gid,
-					&ts.egid,
-					&ts.sgid,
-					&ts.fsgid);
-			if (r <= 0) {
-				ulp_error("sscanf failed.\n");
-				ret = -errno;
-				goto close_exit;
+		for (i = 0; i < ARRAY_SIZE(status_keys); i++) {
+			if (strcmp(line, status_keys[i].key))
+				continue;
+			if (status_keys[i].parse(&ts, val)) {
+				ulp_error("Parse %s: of %s failed.\n", line,
+					  path);
+				return -EINVAL;
 			}
+			found |= BIT(i);
+			break;
 		}
+	}
 
-		/* TODO: Parse more lines */
-
-	} while (true);
-
-	if (ts.uid == -1 || ts.euid == -1 || ts.suid == -1 || ts.fsuid == -1 ||
-	    ts.gid == -1 || ts.egid == -1 || ts.sgid == -1 || ts.fsgid == -1) {
-		ulp_error("Not found Uid: or Gid: in %s\n", buf);
-		ret = -ENOENT;
-		goto close_exit;
+	if (found != BIT(ARRAY_SIZE(status_keys)) - 1) {
+		ulp_error("Not found Uid: or Gid: in %s\n", path);
+		return -ENOENT;
 	}
 
 	memcpy(status, &ts, sizeof(struct task_status));
-
-close_exit:
-	fclose(fp);
-	close(fd);
-	return ret;
+	return 0;
 }
 
-int print_task_status(FILE *fp, const struct task_struct *task)
+int print_task_status(FILE *fp, struct task_struct *task)
 {
-	const struct task_status *ps = &task->status;
+	const struct task_status *ps;
+
+	ps = task_status(task);
+	if (!ps)
+		return -errno;
 
 	if (!fp)
 		fp = stdout;
@@ -963,6 +1619,549 @@ int print_task_status(FILE *fp, const struct task_struct *task)
 	return 0;
 }
 
+/**
+ * Read the ELF header and program headers of all ELF leader VMAs with one
+ * vectored read, then peek the rest of the ELF headers VMA by VMA.
+ */
+static int peek_task_elf_hdrs(struct task_struct *task)
+{
+	struct vm_area_struct *vma;
+	struct task_iov *iov;
+	struct elf_hdrs_peek *hdrs, **peeked;
+	const char **names;
+	char buf[PATH_MAX], *dup;
+	ssize_t n, expect = 0;
+	int i, iv, nr = 0, nr_dup;
+
+	task_for_each_vma(vma, task)
+		nr++;
+
+	/* Nothing to peek, and malloc(0) may return NULL */
+	if (nr == 0)
+		return 0;
+
+	hdrs = malloc(nr * sizeof(struct elf_hdrs_peek));
+	peeked = malloc(nr * sizeof(struct elf_hdrs_peek *));
+	iov = malloc(nr * sizeof(struct task_iov));
+	names = malloc(nr * sizeof(char *));
+	if (!hdrs || !peeked || !iov || !names) {
+		free(hdrs);
+		free(peeked);
+		free(iov);
+		free(names);
+		return -ENOMEM;
+	}
+
+	i = iv = 0;
+	task_for_each_vma(vma, task) {
+		peeked[i] = NULL;
+		if (vma_need_peek_elf(vma)) {
+			peeked[i] = &hdrs[iv];
+			iov[iv].remote = vma->vm_start;
+			iov[iv].local = &hdrs[iv];
+			/* Less than one page, never cross the VMA */
+			iov[iv].len = sizeof(struct elf_hdrs_peek);
+			expect += iov[iv].len;
+			iv++;
+		}
+		i++;
+	}
+
+	n = memcpy_from_task_iov(task, iov, iv);
+
+	/**
+	 * If some VMA read failed, just peek VMA one by one, and the failed
+	 * one will report error.
+	 */
+	if (n != expect) {
+		ulp_debug("Peek ehdrs %ld bytes, expect %ld\n", n, expect);
+		memset(peeked, 0, nr * sizeof(struct elf_hdrs_peek *));
+	}
+
+	i = iv = 0;
+	task_for_each_vma(vma, task) {
+		vma_peek_elf_hdrs(vma, peeked[i++]);
+		if (vma->is_elf && !vma->bfd_elf_file &&
+		    task->fto_flag & FTO_VMA_ELF_FILE &&
+		    task_path_exist(task, vma->name_))
+			names[iv++] = vma->name_;
+	}
+
+	/* The same names as vma_load_elf_file() opens, under task's root */
+	if (task->root_dirfd >= 0) {
+		for (i = nr_dup = 0; i < iv; i++) {
+			dup = strdup(task_path(task, names[i], buf,
+					       sizeof(buf)));
+			if (dup)
+				names[nr_dup++] = dup;
+		}
+		iv = nr_dup;
+	}
+
+	/* Open all ELF files in concurrent */
+	bfd_elf_preload(names, iv);
+
+	if (task->root_dirfd >= 0) {
+		for (i = 0; i < iv; i++)
+			free((char *)names[i]);
+	}
+
+	/* The opened ones are skipped, if called by reload_task() */
+	task_for_each_vma(vma, task) {
+		if (vma->is_elf && !vma->bfd_elf_file)
+			vma_load_elf_file(vma);
+	}
+
+	free(hdrs);
+	free(peeked);
+	free(iov);
+	free(names);
+	return 0;
+}
+
+/**
+ * Update the task opened before, as if open_task() again, only the VMAs
+ * mapped since last time are peeked, see task_cache_get().
+ */
+int reload_task(struct task_struct *task)
+{
+	struct task_vma_changes c;
+	struct vm_area_struct *vma;
+	int flag = task->fto_flag;
+	int err;
+
+	err = refresh_task_vmas(task, &c);
+	if (err)
+		return err;
+
+	if (!task->libc_vma || !task->stack)
+		return -ENOENT;
+
+	/* The memory may be changed */
+	task_mem_cache_destroy(task);
+
+	err = __get_comm(task);
+	if (err)
+		return err;
+
+	if (task->fto_loaded & FTO_STATUS) {
+		err = load_task_status(task->pid, &task->status);
+		if (err)
+			return err;
+	}
+
+	/* dlopen(3) and dlclose(3) change it */
+	if ((c.nr_added || c.nr_removed) &&
+	    (task->fto_loaded & FTO_LINK_MAP || flag & FTO_LINK_MAP))
+		task_load_link_map(task);
+
+	if (c.nr_added && (flag & FTO_VMA_ELF)) {
+		err = peek_task_elf_hdrs(task);
+		if (err)
+			return err;
+	} else if (c.nr_added && (flag & FTO_VMA_ULP)) {
+		task_load_ulps(task);
+	}
+
+	if (c.nr_added && (flag & FTO_VMA_ELF_SYMBOLS)) {
+		task_for_each_vma(vma, task) {
+			if (vma->is_elf)
+				task_lazy_vma_elf_syms(vma);
+		}
+	}
+
+	/* Only what was loaded, the others are loaded on first use */
+	if (task->fto_loaded & FTO_THREADS) {
+		err = task_refresh_threads(task);
+		if (err < 0)
+			return err;
+	}
+
+	if (task->fto_loaded & FTO_FD) {
+		err = task_load_fds(task);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+void task_free_threads(struct task_struct *task)
+{
+	struct thread *thread, *tmpthread;
+
+	list_for_each_entry_safe(thread, tmpthread, &task->threads_list, node) {
+		list_del(&thread->node);
+		free(thread);
+	}
+}
+
+static int task_add_thread(struct task_struct *task, int tid, void *arg)
+{
+	struct thread *thread;
+
+	ulp_debug("Thread %d\n", tid);
+	/**
+	 * Maybe we should skip the thread tid == pid, however, if that,
+	 * we must add an extra list of extra opendir while loop, thus,
+	 * we add the pid == tid thread to task.threads_list.
+	 *
+	 * The threads created later are not in the list, see
+	 * task_refresh_threads().
+	 */
+	if (tid == task->pid)
+		ulp_debug("Thread %d (pid)\n", tid);
+	thread = calloc(1, sizeof(struct thread));
+	if (!thread)
+		return -ENOMEM;
+	thread->tid = tid;
+	list_init(&thread->node);
+	list_add(&thread->node, &task->threads_list);
+	return 0;
+}
+
+/* Read /proc/PID/task/xxx to task_struct::threads_list, drop the old */
+int task_load_threads(struct task_struct *task)
+{
+	int err;
+
+	task_free_threads(task);
+
+	err = task_proc_readdir(task, "task", task_add_thread, NULL);
+	if (err) {
+		ulp_error("read /proc/%d/task/ failed, %s.\n", task->pid,
+			  strerror(-err));
+		task_free_threads(task);
+		return err;
+	}
+	task->fto_loaded |= FTO_THREADS;
+	return 0;
+}
+
+struct tids {
+	pid_t *tids;
+	unsigned int nr, cap;
+};
+
+static int tids_add(struct task_struct *task, int tid, void *arg)
+{
+	struct tids *t = arg;
+	pid_t *tmp;
+
+	if (t->nr == t->cap) {
+		t->cap = t->cap ? t->cap * 2 : 64;
+		tmp = realloc(t->tids, t->cap * sizeof(pid_t));
+		if (!tmp)
+			return -ENOMEM;
+		t->tids = tmp;
+	}
+	t->tids[t->nr++] = tid;
+	return 0;
+}
+
+static int cmp_tid(const void *a, const void *b)
+{
+	pid_t t1 = *(const pid_t *)a, t2 = *(const pid_t *)b;
+	return t1 < t2 ? -1 : t1 > t2;
+}
+
+/**
+ * Update task_struct::threads_list as /proc/PID/task/ now, the new threads
+ * are added, unfrozen, and the exited ones are dropped, the others are kept
+ * as is, include the frozen state. The tids of /proc are sorted and diffed
+ * against the list, no thread is allocated again.
+ *
+ * Return the number of new threads, or negative errno.
+ */
+int task_refresh_threads(struct task_struct *task)
+{
+	struct tids now = {};
+	struct thread *thread, *tmp;
+	unsigned int i;
+	uint8_t *seen;
+	pid_t *found;
+	int err, nr_new = 0;
+
+	if (!(task->fto_loaded & FTO_THREADS))
+		return task_load_threads(task);
+
+	err = task_proc_readdir(task, "task", tids_add, &now);
+	if (err)
+		goto out;
+	qsort(now.tids, now.nr, sizeof(pid_t), cmp_tid);
+
+	seen = calloc(now.nr ?: 1, 1);
+	if (!seen) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	list_for_each_entry_safe(thread, tmp, &task->threads_list, node) {
+		found = bsearch(&thread->tid, now.tids, now.nr, sizeof(pid_t),
+				cmp_tid);
+		if (found) {
+			seen[found - now.tids] = 1;
+			continue;
+		}
+		/* The frozen one is reaped by task_thaw_threads() */
+		if (thread->frozen)
+			continue;
+		ulp_debug("Thread %d gone.\n", thread->tid);
+		list_del(&thread->node);
+		free(thread);
+	}
+
+	for (i = 0; i < now.nr; i++) {
+		if (seen[i])
+			continue;
+		err = task_add_thread(task, now.tids[i], NULL);
+		if (err)
+			break;
+		ulp_debug("Thread %d new.\n", now.tids[i]);
+		nr_new++;
+	}
+	free(seen);
+
+out:
+	free(now.tids);
+	if (err) {
+		ulp_error("refresh threads of %d failed, %s.\n", task->pid,
+			  strerror(-err));
+		return err;
+	}
+	return nr_new;
+}
+
+void task_free_fds(struct task_struct *task)
+{
+	int i;
+
+	free(task->fd_table);
+	task->fd_table = NULL;
+	task->nr_fds = 0;
+	list_init(&task->fds_list);
+
+	for (i = 0; i < TASK_FD_MAX_THREADS; i++) {
+		str_pool_destroy(&task->fd_pools[i]);
+		str_pool_init(&task->fd_pools[i], 0);
+	}
+}
+
+static int task_add_fd(struct task_struct *task, int ifd, void *arg)
+{
+	unsigned int *cap = arg;
+	struct fd *table;
+
+	if (task->nr_fds == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		table = realloc(task->fd_table, *cap * sizeof(struct fd));
+		if (!table)
+			return -ENOMEM;
+		task->fd_table = table;
+	}
+	memset(&task->fd_table[task->nr_fds], 0, sizeof(struct fd));
+	task->fd_table[task->nr_fds++].fd = ifd;
+	return 0;
+}
+
+/* The sockets and anonymous inodes, no need to readlink(2) */
+static bool fd_type_symlink(struct fd *fd, const struct stat *st, char *buf,
+			    size_t blen)
+{
+	switch (fd->type) {
+	case S_IFSOCK:
+		snprintf(buf, blen, "socket:[%lu]", (unsigned long)st->st_ino);
+		return true;
+	case 0:
+		snprintf(buf, blen, "anon_inode:");
+		return true;
+	/* Maybe a named pipe, the path is needed */
+	case S_IFIFO:
+	default:
+		return false;
+	}
+}
+
+static void task_resolve_fd(struct task_struct *task, struct fd *fd,
+			    struct str_pool *pool)
+{
+	char name[32], buf[PATH_MAX];
+	struct stat st;
+	int ret;
+
+	snprintf(name, sizeof(name), "fd/%d", fd->fd);
+
+	if (task->fto_flag & FTO_FD_TYPE && !task_proc_stat(task, name, &st)) {
+		fd->type = st.st_mode & S_IFMT;
+		if (fd_type_symlink(fd, &st, buf, sizeof(buf)))
+			goto save;
+	}
+
+	ret = task_proc_readlink(task, name, buf, sizeof(buf));
+	if (ret < 0) {
+		ulp_warning("readlink %s failed\n", name);
+		strcpy(buf, "[UNKNOWN]");
+	} else if (!(task->fto_flag & FTO_FD_TYPE)) {
+		if (ulp_startswith(buf, "socket:["))
+			fd->type = S_IFSOCK;
+		else if (ulp_startswith(buf, "pipe:["))
+			fd->type = S_IFIFO;
+	}
+
+save:
+	fd->symlink = str_pool_strdup(pool, buf) ?: "[UNKNOWN]";
+}
+
+struct fds_work {
+	struct task_struct *task;
+	/* next index of task_struct::fd_table[] to resolve */
+	unsigned int next;
+};
+
+struct fds_worker {
+	struct fds_work *work;
+	struct str_pool *pool;
+};
+
+/* Take this many fds once */
+#define FDS_WORK_BATCH	64
+
+static void *fds_worker(void *arg)
+{
+	struct fds_worker *worker = arg;
+	struct task_struct *task = worker->work->task;
+	unsigned int i, end;
+
+	while ((i = __atomic_fetch_add(&worker->work->next, FDS_WORK_BATCH,
+				       __ATOMIC_RELAXED)) < task->nr_fds) {
+		end = MIN(i + FDS_WORK_BATCH, task->nr_fds);
+		for (; i < end; i++)
+			task_resolve_fd(task, &task->fd_table[i],
+					worker->pool);
+	}
+	return NULL;
+}
+
+/**
+ * Read /proc/PID/fd/xxx to task_struct::fds_list, drop the old. The fd
+ * numbers are read by getdents64(2) into one fd_table, then the symlinks
+ * are resolved concurrently if there are many, such as 100k sockets, each
+ * worker saves the symlinks in its own fd_pools[].
+ */
+int task_load_fds(struct task_struct *task)
+{
+	struct fds_worker workers[TASK_FD_MAX_THREADS];
+	pthread_t threads[TASK_FD_MAX_THREADS];
+	struct fds_work work = { .task = task };
+	int i, err, nr_threads, nr_cpus;
+	unsigned int cap = 0;
+
+	task_free_fds(task);
+
+	err = task_proc_readdir(task, "fd", task_add_fd, &cap);
+	if (err) {
+		ulp_error("read /proc/%d/fd/ failed, %s.\n", task->pid,
+			  strerror(-err));
+		task_free_fds(task);
+		return err;
+	}
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = MIN(MAX(nr_cpus, 1), TASK_FD_MAX_THREADS);
+	/* Not worth to start threads for a few fds */
+	if (task->nr_fds < TASK_FD_PARALLEL_MIN)
+		nr_threads = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		workers[i].work = &work;
+		workers[i].pool = &task->fd_pools[i];
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, fds_worker, &workers[i]))
+			break;
+	}
+	nr_threads = i;
+
+	/* Current thread is one of the workers */
+	fds_worker(&workers[0]);
+
+	for (i = 1; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* The table never moves from now on */
+	for (i = 0; i < task->nr_fds; i++)
+		list_add(&task->fd_table[i].node, &task->fds_list);
+
+	ulp_debug("%d: %u fds by %d threads.\n", task->pid, task->nr_fds,
+		  nr_threads);
+	task->fto_loaded |= FTO_FD;
+	return 0;
+}
+
+/**
+ * The thread list of task, /proc/PID/task/ is read on the first call, call
+ * task_load_threads() to update. Return NULL with errno set if failed.
+ */
+struct list_head *task_threads(struct task_struct *task)
+{
+	int err;
+
+	if (!(task->fto_loaded & FTO_THREADS)) {
+		err = task_load_threads(task);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+	}
+	return &task->threads_list;
+}
+
+/* Same as task_threads(), for /proc/PID/fd/ */
+struct list_head *task_fds(struct task_struct *task)
+{
+	int err;
+
+	if (!(task->fto_loaded & FTO_FD)) {
+		err = task_load_fds(task);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+	}
+	return &task->fds_list;
+}
+
+const struct task_struct_auxv *task_auxv(struct task_struct *task)
+{
+	int err;
+
+	if (!(task->fto_loaded & FTO_AUXV)) {
+		err = load_task_auxv(task->pid, &task->auxv);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+		task->fto_loaded |= FTO_AUXV;
+	}
+	return &task->auxv;
+}
+
+const struct task_status *task_status(struct task_struct *task)
+{
+	int err;
+
+	if (!(task->fto_loaded & FTO_STATUS)) {
+		err = load_task_status(task->pid, &task->status);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+		task->fto_loaded |= FTO_STATUS;
+	}
+	return &task->status;
+}
+
 /**
  * Open target task
  *
@@ -971,7 +2170,7 @@ int print_task_status(FILE *fp, const struct task_struct *task)
  */
 struct task_struct *open_task(pid_t pid, int flag)
 {
-	int err = 0;
+	int i, err = 0;
 	struct task_struct *task = NULL;
 	int o_flags;
 	struct vm_area_struct *tmp_vma;
@@ -982,6 +2181,13 @@ struct task_struct *open_task(pid_t pid, int flag)
 		return NULL;
 	}
 
+	/* Warm task of ulpatchd(8), see task_cache_enable() */
+	task = task_cache_get(pid, flag);
+	if (task) {
+		set_current_task(task);
+		return task;
+	}
+
 	task = malloc(sizeof(struct task_struct));
 	if (!task) {
 		ulp_error("malloc task failed, %m.\n");
@@ -992,24 +2198,48 @@ struct task_struct *open_task(pid_t pid, int flag)
 
 	task->fto_flag = flag;
 	task->pid = pid;
+	task->proc_mem_fd = -1;
+	task->proc_maps_fd = -1;
+
+	/* All /proc/PID files are opened on it */
+	err = task_open_handles(task);
+	if (err) {
+		free(task);
+		task = NULL;
+		goto failed;
+	}
 
 	list_init(&task->vma_list);
 	list_init(&task->ulp_list);
+	rb_init_cached(&task->ulps_by_id);
+	rb_init(&task->ulps_by_build_id);
+	task->ulp_ranges = RB_ROOT;
 	list_init(&task->threads_list);
 	list_init(&task->fds_list);
+	for (i = 0; i < TASK_FD_MAX_THREADS; i++)
+		str_pool_init(&task->fd_pools[i], 0);
 	rb_init(&task->vmas_rb);
+	str_pool_init(&task->elf_pool, 0);
+	task->elf_pool.mem_type = ULP_MEM_VMA;
+	slab_cache_init(&task->vma_slab, sizeof(struct vm_area_struct),
+			TASK_VMA_SLAB_NR);
+	task->vma_slab.mem_type = ULP_MEM_VMA;
 	task_syms_init(&task->tsyms);
+	task_mem_cache_init(task, (flag & FTO_MEM_CACHE) && !(flag & FTO_RDWR)
+				  ? TASK_MEM_CACHE_MAX_PAGES : 0);
 
 	if (flag & FTO_AUXV) {
 		err = load_task_auxv(pid, &task->auxv);
 		if (err)
 			goto free_task;
+		task->fto_loaded |= FTO_AUXV;
 	}
 
 	if (flag & FTO_STATUS) {
-		err =load_task_status(pid, &task->status);
+		err = load_task_status(pid, &task->status);
 		if (err)
 			goto free_task;
+		task->fto_loaded |= FTO_STATUS;
 	}
 
 	err = __get_comm(task);
@@ -1022,33 +2252,49 @@ struct task_struct *open_task(pid_t pid, int flag)
 
 	/* Open target process memory */
 	o_flags = flag & FTO_RDWR ? O_RDWR : O_RDONLY;
-	task->proc_mem_fd = __open_pid_mem(pid, o_flags);
-	if (task->proc_mem_fd <= 0)
+	task->proc_mem_fd = task_proc_open(task, "mem", o_flags);
+	if (task->proc_mem_fd <= 0) {
+		ulp_error("open /proc/%d/mem failed. %m\n", pid);
+		err = -errno;
 		goto free_task;
-
-	task->proc_mem_fd = task->proc_mem_fd;
+	}
 
 	err = read_task_vmas(task, false);
 	if (err)
 		goto free_task;
 
+	if (flag & FTO_VMA_QUERY)
+		task_vma_query_init(task);
+
 	if (!task->libc_vma || !task->stack) {
 		ulp_error("No libc or stack founded.\n");
 		goto free_task;
 	}
 
+	/* Not fatal, the load bias are guessed from the phdrs */
+	if (flag & FTO_LINK_MAP) {
+		err = task_load_link_map(task);
+		if (err)
+			ulp_warning("Load link_map of %d failed, %s\n", pid,
+				    strerror(-err));
+	}
+
 	if (flag & FTO_VMA_ELF) {
-		task_for_each_vma(tmp_vma, task) {
-			vma_peek_elf_hdrs(tmp_vma);
-			if (tmp_vma->is_elf)
-				vma_load_elf_file(tmp_vma);
-		}
+		err = peek_task_elf_hdrs(task);
+		if (err)
+			goto free_task;
+	} else if (flag & FTO_VMA_ULP) {
+		task_load_ulps(task);
 	}
 
+	/**
+	 * Symbols are loaded on demand, the first lookup of a name only loads
+	 * the VMAs whose bfd_elf_file has the name.
+	 */
 	if (flag & FTO_VMA_ELF_SYMBOLS) {
 		task_for_each_vma(tmp_vma, task) {
 			if (tmp_vma->is_elf)
-				task_load_vma_elf_syms(tmp_vma);
+				task_lazy_vma_elf_syms(tmp_vma);
 		}
 	}
 
@@ -1083,86 +2329,15 @@ struct task_struct *open_task(pid_t pid, int flag)
 		}
 	}
 
-	/* /proc/PID/task/xxx */
-	if (flag & FTO_THREADS) {
-		DIR *dir;
-		struct dirent *entry;
-		pid_t child;
-		struct thread *thread;
-		char proc_task_dir[] = {"/proc/1234567890abc/task"};
-		sprintf(proc_task_dir, "/proc/%d/task/", task->pid);
-		dir = opendir(proc_task_dir);
-		if (!dir) {
-			ulp_error("opendir %s failed.\n", proc_task_dir);
-			goto free_task;
-		}
-		while ((entry = readdir(dir)) != NULL) {
-			if (!strcmp(entry->d_name , ".") ||
-			    !strcmp(entry->d_name, ".."))
-				continue;
-			ulp_debug("Thread %s\n", entry->d_name);
-			child = atoi(entry->d_name);
-			/**
-			 * Maybe we should skip the thread tid == pid, however,
-			 * if that, we must add an extra list of extra opendir
-			 * while loop, thus, we add the pid == tid thread to
-			 * task.threads_list.
-			 *
-			 * TODO: Should we need update threads_list by timingly
-			 * read /proc/PID/task/, make sure new thread created
-			 * during the ULPatch patching or unpatching? Maybe this
-			 * is a longterm work, but not now.
-			 */
-			if (child == task->pid)
-				ulp_debug("Thread %s (pid)\n", entry->d_name);
-			thread = malloc(sizeof(struct thread));
-			thread->tid = child;
-			list_init(&thread->node);
-			list_add(&thread->node, &task->threads_list);
-		}
-		closedir(dir);
-	}
-
-	/* /proc/PID/fd/xxx */
+	/* The threads are loaded by the first task_threads() */
 	if (flag & FTO_FD) {
-		DIR *dir;
-		struct dirent *entry;
-		int ifd;
-		int ret;
-		struct fd *fd;
-		char proc_fd[PATH_MAX] = {"/proc/1234567890abc/fd/"};
-		sprintf(proc_fd, "/proc/%d/fd/", task->pid);
-		dir = opendir(proc_fd);
-		if (!dir) {
-			ulp_error("opendir %s failed.\n", proc_fd);
+		err = task_load_fds(task);
+		if (err)
 			goto free_task;
-		}
-		while ((entry = readdir(dir)) != NULL) {
-			if (!strcmp(entry->d_name , ".") ||
-			    !strcmp(entry->d_name, ".."))
-				continue;
-			ulp_debug("FD %s\n", entry->d_name);
-			ifd = atoi(entry->d_name);
-
-			fd = malloc(sizeof(struct fd));
-			memset(fd, 0x00, sizeof(struct fd));
-
-			fd->fd = ifd;
-
-			/* Read symbol link */
-			sprintf(proc_fd, "/proc/%d/fd/%d", task->pid, ifd);
-			ret = readlink(proc_fd, fd->symlink, PATH_MAX);
-			if (ret < 0) {
-				ulp_warning("readlink %s failed\n", proc_fd);
-				strncpy(fd->symlink, "[UNKNOWN]", PATH_MAX);
-			}
-
-			list_init(&fd->node);
-			list_add(&fd->node, &task->fds_list);
-		}
-		closedir(dir);
 	}
 
+	task_cache_add(task);
+
 	set_current_task(task);
 
 	return task;
@@ -1226,6 +2401,19 @@ static void __check_and_free_task_proc(struct task_struct *task)
 		__clean_task_proc(task);
 }
 
+static bool close_task_fast = false;
+
+/**
+ * The short-lived commands close the task just before exit, skip the
+ * teardown of local memory, file descriptors and BFD files, which are
+ * released by exit(2) anyway. Only the effects out of current process are
+ * done, such as cleaning the ULP_PROC_ROOT_DIR directory.
+ */
+void close_task_fast_enable(bool enable)
+{
+	close_task_fast = enable;
+}
+
 int close_task(struct task_struct *task)
 {
 	struct vm_area_struct *tmp_vma;
@@ -1235,14 +2423,26 @@ int close_task(struct task_struct *task)
 		return -EINVAL;
 	}
 
+	/* Keep it warm for the next open_task() */
+	if (task_cache_put(task)) {
+		reset_current_task();
+		return 0;
+	}
+
+	if (close_task_fast) {
+		if (task->fto_flag & FTO_PROC)
+			__check_and_free_task_proc(task);
+		reset_current_task();
+		return 0;
+	}
+
 	if (task->proc_mem_fd > STDERR_FILENO)
 		close(task->proc_mem_fd);
 
-	if (task->fto_flag & FTO_VMA_ELF) {
-		task_for_each_vma(tmp_vma, task)
-			vma_free_elf(tmp_vma);
-	}
+	task_vma_query_destroy(task);
+	task_close_handles(task);
 
+	/* The ELF details are released with task::elf_pool */
 	if (task->fto_flag & FTO_VMA_ELF_FILE) {
 		task_for_each_vma(tmp_vma, task) {
 			if (tmp_vma->is_elf)
@@ -1250,25 +2450,23 @@ int close_task(struct task_struct *task)
 		}
 	}
 
-	if (task->fto_flag & FTO_VMA_ELF_SYMBOLS)
-		free_task_syms(task);
+	/* ULP symbols are linked even without FTO_VMA_ELF_SYMBOLS */
+	free_task_syms(task);
 
 	if (task->fto_flag & FTO_PROC)
 		__check_and_free_task_proc(task);
 
-	if (task->fto_flag & FTO_THREADS) {
-		struct thread *thread, *tmpthread;
-		list_for_each_entry_safe(thread, tmpthread, &task->threads_list,
-			   node)
-			free(thread);
-	}
+	if (task->fto_loaded & FTO_THREADS)
+		task_free_threads(task);
 
-	if (task->fto_flag & FTO_FD) {
-		struct fd *fd, *tmpfd;
-		list_for_each_entry_safe(fd, tmpfd, &task->fds_list, node)
-			free(fd);
-	}
+	if (task->fto_loaded & FTO_FD)
+		task_free_fds(task);
+
+	task_free_link_map(task);
 
+	task_mem_cache_destroy(task);
+	task_arena_release(task);
+	task_quiesce_free(task);
 	free_task_vmas(task);
 	free(task->exe);
 	free(task);
@@ -1278,7 +2476,26 @@ int close_task(struct task_struct *task)
 	return 0;
 }
 
-int task_attach(pid_t pid)
+static enum task_attach_mode attach_mode = TASK_ATTACH_PTRACE;
+/* Time from attach request to target task stopped of last task_attach() */
+static unsigned long attach_latency_ns = 0;
+
+void set_task_attach_mode(enum task_attach_mode mode)
+{
+	attach_mode = mode;
+}
+
+enum task_attach_mode get_task_attach_mode(void)
+{
+	return attach_mode;
+}
+
+unsigned long task_attach_latency_ns(void)
+{
+	return attach_latency_ns;
+}
+
+static int __task_attach_ptrace(pid_t pid)
 {
 	int ret;
 	int status;
@@ -1319,6 +2536,273 @@ int task_attach(pid_t pid)
 	return ret;
 }
 
+/**
+ * PTRACE_SEIZE doesn't stop the target, and PTRACE_INTERRUPT makes the
+ * target enter PTRACE_EVENT_STOP without any signal sent, thus, we don't
+ * need to filter out our own SIGSTOP among signals of the target.
+ */
+static int __task_attach_seize(pid_t pid)
+{
+	int ret;
+	int status;
+	int sig;
+
+	ret = ptrace(PTRACE_SEIZE, pid, NULL, NULL);
+	if (ret != 0) {
+		ulp_error("Seize %d failed. %m\n", pid);
+		return -errno;
+	}
+
+	ret = ptrace(PTRACE_INTERRUPT, pid, NULL, NULL);
+	if (ret != 0) {
+		ulp_error("Interrupt %d failed. %m\n", pid);
+		ret = -errno;
+		ptrace(PTRACE_DETACH, pid, NULL, NULL);
+		return ret;
+	}
+
+	while (1) {
+		ret = waitpid(pid, &status, __WALL);
+		if (ret < 0) {
+			ulp_error("can't wait for pid %d\n", pid);
+			return -errno;
+		}
+
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			ulp_error("Task %d exit while seize.\n", pid);
+			return -ESRCH;
+		}
+
+		/* Interrupt stop or group stop */
+		if (status >> 16 == PTRACE_EVENT_STOP)
+			break;
+
+		/**
+		 * Signal delivery stop happens before the interrupt stop,
+		 * deliver it, the interrupt is still pending.
+		 */
+		sig = WSTOPSIG(status);
+		ulp_debug("Task %d got signal %d while seize.\n", pid, sig);
+
+		ret = ptrace(PTRACE_CONT, pid, NULL, (void *)(uintptr_t)sig);
+		if (ret < 0) {
+			ulp_error("can't cont tracee\n");
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Same as task_attach(), and record how the leader of @task is traced, see
+ * task::seized. Call task_detach_leader() to detach.
+ */
+int task_attach_leader(struct task_struct *task)
+{
+	int ret;
+
+	ret = task_attach(task->pid);
+	if (ret == 0)
+		task->seized = attach_mode == TASK_ATTACH_SEIZE;
+	return ret;
+}
+
+int task_detach_leader(struct task_struct *task)
+{
+	task->seized = false;
+	return task_detach(task->pid);
+}
+
+int task_attach(pid_t pid)
+{
+	unsigned long start = nsecs();
+	int ret;
+
+	if (attach_mode == TASK_ATTACH_SEIZE)
+		ret = __task_attach_seize(pid);
+	else
+		ret = __task_attach_ptrace(pid);
+
+	if (ret == 0) {
+		attach_latency_ns = nsecs() - start;
+		ulp_debug("Task %d stopped in %ld ns.\n", pid,
+			  attach_latency_ns);
+	}
+
+	return ret;
+}
+
+/**
+ * PTRACE_SEIZE and PTRACE_INTERRUPT every unfrozen thread first, then wait
+ * them, thus, the threads stop concurrently, and the whole latency is about
+ * the slowest thread, not the sum of all threads. Return the number of the
+ * threads frozen by this call, or negative errno. If seize failed, the
+ * threads seized already are still waited, every thread left on the list
+ * is stopped or not frozen, see task_thaw_threads().
+ */
+static int freeze_unfrozen_threads(struct task_struct *task,
+				   unsigned long start, unsigned long *max_ns)
+{
+	struct thread *thread, *tmp, *seized;
+	int ret, status, sig, nr = 0, err = 0;
+	LIST_HEAD(waiting);
+
+	list_for_each_entry_safe(thread, tmp, &task->threads_list, node) {
+		if (thread->frozen)
+			continue;
+		thread->stop_ns = 0;
+
+		ret = ptrace(PTRACE_SEIZE, thread->tid, NULL, NULL);
+		if (ret != 0) {
+			/* Thread exit already */
+			if (errno == ESRCH) {
+				ulp_debug("Thread %d exit.\n", thread->tid);
+				list_del(&thread->node);
+				free(thread);
+				continue;
+			}
+			err = -errno;
+			ulp_error("Seize thread %d failed. %s\n", thread->tid,
+				  strerror(-err));
+			break;
+		}
+		thread->frozen = true;
+		ptrace(PTRACE_INTERRUPT, thread->tid, NULL, NULL);
+		/* Only these are waited below */
+		list_move(&thread->node, &waiting);
+		nr++;
+	}
+
+	list_for_each_entry_safe(thread, tmp, &waiting, node) {
+		while (1) {
+			ret = waitpid(thread->tid, &status, __WALL);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				ret = -errno;
+				ulp_error("can't wait thread %d\n", thread->tid);
+				/**
+				 * Seized but never seen stopped, PTRACE_DETACH
+				 * fails with ESRCH on the running tracee, thus
+				 * task_thaw_threads() must skip them, they are
+				 * released when the tracer exits.
+				 */
+				list_for_each_entry(seized, &waiting, node)
+					seized->frozen = false;
+				list_splice_tail(&waiting, &task->threads_list);
+				return ret;
+			}
+			if (WIFEXITED(status) || WIFSIGNALED(status)) {
+				ulp_debug("Thread %d exit.\n", thread->tid);
+				list_del(&thread->node);
+				free(thread);
+				thread = NULL;
+				nr--;
+				break;
+			}
+			if (status >> 16 == PTRACE_EVENT_STOP) {
+				thread->stop_ns = nsecs() - start;
+				break;
+			}
+			/* Signal delivery stop, the interrupt is still pending */
+			sig = WSTOPSIG(status);
+			ptrace(PTRACE_CONT, thread->tid, NULL,
+			       (void *)(uintptr_t)sig);
+		}
+
+		if (thread) {
+			*max_ns = MAX(*max_ns, thread->stop_ns);
+			list_move_tail(&thread->node, &task->threads_list);
+		}
+	}
+
+	return err ? err : nr;
+}
+
+/**
+ * Stop all threads of target task, see freeze_unfrozen_threads(). The
+ * threads created while freezing, such as by the thread pool of server, are
+ * not in the list, thus /proc/PID/task/ is re-scanned once all known
+ * threads stopped, and the new ones are frozen too, until no new thread,
+ * the stopped threads can't create any more. Only the diff of tids is
+ * handled each round, see task_refresh_threads().
+ *
+ * Without FTO_THREADS, only the thread group leader will be attached.
+ * Call task_thaw_threads() to detach.
+ */
+int task_freeze_threads(struct task_struct *task)
+{
+	struct thread *thread;
+	unsigned long start, max_ns = 0;
+	int ret, nr = 0, round;
+
+	if (!(task->fto_flag & FTO_THREADS))
+		return task_attach_leader(task);
+
+	if (!task_threads(task))
+		return -errno;
+
+	start = nsecs();
+	/* Every thread include the leader, see freeze_unfrozen_threads() */
+	task->seized = true;
+
+	list_for_each_entry(thread, &task->threads_list, node)
+		thread->frozen = false;
+
+	for (round = 0; round < TASK_FREEZE_MAX_ROUNDS; round++) {
+		ret = freeze_unfrozen_threads(task, start, &max_ns);
+		if (ret < 0)
+			goto failed;
+		nr += ret;
+
+		ret = task_refresh_threads(task);
+		if (ret <= 0)
+			break;
+		ulp_debug("Task %d has %d new threads while freezing.\n",
+			  task->pid, ret);
+	}
+	if (ret < 0)
+		goto failed;
+	if (ret > 0) {
+		ulp_error("Task %d keeps creating threads.\n", task->pid);
+		ret = -EAGAIN;
+		goto failed;
+	}
+
+	attach_latency_ns = max_ns;
+	ulp_debug("Task %d freeze %d threads in %ld ns, %d rounds.\n",
+		  task->pid, nr, max_ns, round + 1);
+
+	return 0;
+
+failed:
+	task_thaw_threads(task);
+	return ret;
+}
+
+int task_thaw_threads(struct task_struct *task)
+{
+	struct thread *thread;
+	int err = 0;
+
+	if (!(task->fto_flag & FTO_THREADS))
+		return task_detach_leader(task);
+
+	task->seized = false;
+	list_for_each_entry(thread, &task->threads_list, node) {
+		if (!thread->frozen)
+			continue;
+		thread->frozen = false;
+		if (ptrace(PTRACE_DETACH, thread->tid, NULL, NULL) != 0) {
+			ulp_error("Detach thread %d failed. %m\n", thread->tid);
+			err = -errno;
+		}
+	}
+
+	return err;
+}
+
 int task_detach(pid_t pid)
 {
 	long rv;
@@ -1383,15 +2867,94 @@ static __unused int pid_read(int pid, void *dst, const void *src, size_t len)
 	return len;
 }
 
+/* Process wide, the workers of scanning copy from task in parallel */
+static struct task_err_stats task_err_stats;
+
+static const char *task_err_names[TASK_ERR_NUM] = {
+	[TASK_ERR_MEM_READ] = "read",
+	[TASK_ERR_MEM_WRITE] = "write",
+	[TASK_ERR_REGS] = "regs",
+};
+
+/**
+ * Count one failure, return true if it should be reported, that's the 1st,
+ * 2nd, 4th, 8th ... one of @type, the rest are only counted. The backtrace
+ * of reported one is printed if verbose.
+ */
+bool task_err_account(enum task_err_type type, int err)
+{
+	unsigned long nr;
+
+	nr = __atomic_add_fetch(&task_err_stats.nr[type], 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&task_err_stats.last_errno[type], err,
+			 __ATOMIC_RELAXED);
+
+	if (nr & (nr - 1))
+		return false;
+	if (is_verbose())
+		do_backtrace(stdout);
+	return true;
+}
+
+void task_get_err_stats(struct task_err_stats *stats)
+{
+	int i;
+
+	for (i = 0; i < TASK_ERR_NUM; i++) {
+		stats->nr[i] = __atomic_load_n(&task_err_stats.nr[i],
+					       __ATOMIC_RELAXED);
+		stats->last_errno[i] = __atomic_load_n(
+			&task_err_stats.last_errno[i], __ATOMIC_RELAXED);
+	}
+}
+
+void task_reset_err_stats(void)
+{
+	memset(&task_err_stats, 0, sizeof(task_err_stats));
+}
+
+/* Nothing printed if no failure */
+void print_task_err_stats(FILE *fp)
+{
+	struct task_err_stats stats;
+	bool any = false;
+	int i;
+
+	task_get_err_stats(&stats);
+	for (i = 0; i < TASK_ERR_NUM; i++) {
+		if (!stats.nr[i])
+			continue;
+		fprintf(fp, "%s %s %lu (last %s)", any ? "," : "Errors:",
+			task_err_names[i], stats.nr[i],
+			strerror(stats.last_errno[i]));
+		any = true;
+	}
+	if (any)
+		fprintf(fp, "\n");
+}
+
 int memcpy_from_task(struct task_struct *task, void *dst,
 		     unsigned long task_src, ssize_t size)
 {
 	int ret = -1;
+
+	/* Large read, such as dump VMA, will flush the whole cache */
+	if (task->mcache.enabled &&
+	    size <= task->mcache.max_pages * PAGE_SIZE / 4) {
+		ret = task_mem_cache_read(task, dst, task_src, size);
+		if (ret == size)
+			return ret;
+	}
+
 	ret = pread(task->proc_mem_fd, dst, size, task_src);
 	if (ret == -1) {
-		ulp_error("pread(%d, %p, %ld, 0x%lx) = %d failed, %m\n",
-			task->proc_mem_fd, dst, size, task_src, ret);
-		do_backtrace(stdout);
+		int err = errno;
+
+		if (task_err_account(TASK_ERR_MEM_READ, err))
+			ulp_error("pread(%d, %p, %ld, 0x%lx) failed, %s\n",
+				  task->proc_mem_fd, dst, size, task_src,
+				  strerror(err));
+		errno = err;
 	}
 	/* pread(2) will return -1 if failed, keep it that way. */
 	return ret;
@@ -1401,27 +2964,181 @@ int memcpy_to_task(struct task_struct *task, unsigned long task_dst, void *src,
 		   ssize_t size)
 {
 	int ret = -1;
+	task_mem_cache_invalidate(task, task_dst, size);
 	ret = pwrite(task->proc_mem_fd, src, size, task_dst);
 	if (ret == -1) {
-		ulp_error("pwrite(%d, %p, %ld, 0x%lx)=%d failed, %m\n",
-			task->proc_mem_fd, src, size, task_dst, ret);
-		do_backtrace(stdout);
+		int err = errno;
+
+		if (task_err_account(TASK_ERR_MEM_WRITE, err))
+			ulp_error("pwrite(%d, %p, %ld, 0x%lx) failed, %s\n",
+				  task->proc_mem_fd, src, size, task_dst,
+				  strerror(err));
+		errno = err;
 	}
 	/* pwrite(2) will return -1 if failed, keep it that way. */
 	return ret;
 }
 
+/* Max number of iovec pass to process_vm_readv(2) once */
+#define TASK_IOV_BATCH	64
+
+static ssize_t __memcpy_task_iov(struct task_struct *task,
+				 const struct task_iov *iov, int n, bool write)
+{
+	struct iovec local[TASK_IOV_BATCH], remote[TASK_IOV_BATCH];
+	ssize_t total = 0, ret;
+	int i, j, nr;
+	size_t done;
+
+	for (i = 0; i < n;) {
+		nr = 0;
+		ret = -1;
+
+		if (!task->proc_mem_only) {
+			for (j = i; j < n && nr < TASK_IOV_BATCH; j++, nr++) {
+				local[nr].iov_base = iov[j].local;
+				local[nr].iov_len = iov[j].len;
+				remote[nr].iov_base = (void *)iov[j].remote;
+				remote[nr].iov_len = iov[j].len;
+			}
+			if (write)
+				ret = process_vm_writev(task->pid, local, nr,
+							remote, nr, 0);
+			else
+				ret = process_vm_readv(task->pid, local, nr,
+						       remote, nr, 0);
+			if (ret == -1 && (errno == ENOSYS || errno == EPERM)) {
+				ulp_debug("process_vm_%sv(%d) %m, use /proc/PID/mem.\n",
+					  write ? "write" : "read", task->pid);
+				task->proc_mem_only = true;
+			}
+		}
+
+		/**
+		 * Skip over all elements that process_vm_readv(2) transfered
+		 * completely, it stops at the first remote iovec that partially
+		 * transfered or failed.
+		 */
+		done = ret > 0 ? ret : 0;
+		total += done;
+		while (i < n && (done >= iov[i].len)) {
+			done -= iov[i].len;
+			i++;
+			nr--;
+		}
+		if (i >= n)
+			break;
+		/* The whole batch was transfered */
+		if (ret > 0 && nr == 0)
+			continue;
+
+		/**
+		 * Copy the rest of current element by /proc/PID/mem, which
+		 * could access pages that process_vm_readv(2) can't, such as
+		 * readonly text when write, just like ptrace(2) FOLL_FORCE.
+		 */
+		if (write)
+			ret = pwrite(task->proc_mem_fd, iov[i].local + done,
+				     iov[i].len - done, iov[i].remote + done);
+		else
+			ret = pread(task->proc_mem_fd, iov[i].local + done,
+				    iov[i].len - done, iov[i].remote + done);
+		if (ret == -1 || ret < iov[i].len - done) {
+			int err = ret == -1 ? errno : EIO;
+
+			task_err_account(write ? TASK_ERR_MEM_WRITE :
+					 TASK_ERR_MEM_READ, err);
+			ulp_debug("%s(%d, 0x%lx, %ld) failed, %s\n",
+				  write ? "pwrite" : "pread", task->proc_mem_fd,
+				  iov[i].remote + done, iov[i].len - done,
+				  strerror(err));
+			if (!write) {
+				total -= done;
+				memset(iov[i].local, 0, iov[i].len);
+			}
+		} else
+			total += ret;
+		i++;
+	}
+
+	return total;
+}
+
+/**
+ * Copy many discontinuous remote memory areas to local buffers, mostly with
+ * a single process_vm_readv(2) syscall, fallback to /proc/PID/mem when it's
+ * not permitted or the remote page is not readable.
+ *
+ * Return the total number of bytes copied, if less than the sum of all
+ * iov[].len, some element failed and it's local buffer is zeroed.
+ */
+ssize_t memcpy_from_task_iov(struct task_struct *task,
+			     const struct task_iov *iov, int n)
+{
+	return __memcpy_task_iov(task, iov, n, false);
+}
+
+/**
+ * Same as memcpy_from_task_iov(), but write local buffers to target task,
+ * with process_vm_writev(2).
+ */
+ssize_t memcpy_to_task_iov(struct task_struct *task,
+			   const struct task_iov *iov, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		task_mem_cache_invalidate(task, iov[i].remote, iov[i].len);
+	return __memcpy_task_iov(task, iov, n, true);
+}
+
 #define MAX_STR_LEN	1024
 
+/**
+ * Copy a NUL-terminated string from target task, at most @size bytes include
+ * the NUL. Read chunk by chunk, every chunk never cross the page boundary,
+ * thus, a short string costs only one or two syscalls.
+ *
+ * Return the length of string (not include NUL), -E2BIG if @size is too
+ * small (@dst is still NUL-terminated), or -EFAULT if read failed.
+ */
+ssize_t strscpy_from_task(struct task_struct *task, char *dst,
+			  unsigned long task_src, size_t size)
+{
+	size_t copied = 0, chunk;
+	unsigned long addr;
+	char *nul;
+	int n;
+
+	if (!size)
+		return -E2BIG;
+
+	while (copied < size) {
+		addr = task_src + copied;
+		chunk = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+		chunk = MIN(chunk, size - copied);
+
+		n = memcpy_from_task(task, dst + copied, addr, chunk);
+		if (n <= 0) {
+			dst[copied] = '\0';
+			return -EFAULT;
+		}
+
+		/* glibc's memchr(3) is word-at-a-time or SIMD already */
+		nul = memchr(dst + copied, '\0', n);
+		if (nul)
+			return nul - dst;
+
+		copied += n;
+	}
+
+	dst[size - 1] = '\0';
+	return -E2BIG;
+}
+
 char *strcpy_from_task(struct task_struct *task, char *dst,
 		       unsigned long task_src)
 {
-	int i;
-	for (i = 0;; i++) {
-		memcpy_from_task(task, &dst[i], task_src + i, 1);
-		if (dst[i] == '\0' || i >= MAX_STR_LEN)
-			break;
-	}
+	strscpy_from_task(task, dst, task_src, MAX_STR_LEN);
 	return dst;
 }
 
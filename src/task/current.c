@@ -29,6 +29,9 @@ static struct task_struct fallback_task = {
 	.pid = 0,
 	.fto_flag = 0,
 	.exe = "??",
+	.pidfd = -1,
+	.proc_dirfd = -1,
+	.root_dirfd = -1,
 };
 
 int set_current_task(struct task_struct *task)
@@ -0,0 +1,612 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <elf/elf-api.h>
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+
+/**
+ * Decode the object of a DWARF type in target task, the pointers to struct
+ * or union are followed level by level to @depth. All objects of one level
+ * are read by one memcpy_from_task_iov(), mostly one process_vm_readv(2),
+ * thus the number of reads grows with the depth, not the number of objects.
+ * The object pointed more than once, such as the cycle of list, is decoded
+ * once.
+ *
+ * The type is found in the DWARF of the ELF files of target, the main
+ * executable first, then the separate debug file of it, see
+ * bfd_elf_debuginfo_path().
+ */
+
+/* Elements of array printed at most */
+#define DECODE_MAX_ELEMS	64
+/* Bigger object is never read */
+#define DECODE_MAX_SIZE		SZ_1M
+/* Embedded aggregates deeper than this are printed as {...} */
+#define DECODE_MAX_NEST		32
+
+struct decode_obj {
+	unsigned long addr;
+	uint64_t type;
+	size_t size;
+	void *buf;
+	/* Index of the object and the member pointing to it, -1 for root */
+	int parent;
+	const char *member;
+	bool unreadable;
+};
+
+struct decode_ctx {
+	FILE *fp;
+	struct task_struct *task;
+	struct ulp_dwarf *dw;
+	int depth;
+	int level;
+	/* Index of the object being printed, the parent of the queued */
+	int cur;
+
+	struct decode_obj *objs;
+	unsigned int nr_objs;
+	unsigned int max_objs;
+	/* Open addressing of object index + 1, by address and type */
+	unsigned int *seen;
+
+	struct task_decode_stats *stats;
+};
+
+static int get_type(struct decode_ctx *ctx, uint64_t off,
+		    struct ulp_dwarf_type *t)
+{
+	return ulp_dwarf_get_type(ctx->dw, off, t);
+}
+
+/* Skip the typedefs and qualifiers, return false if void */
+static bool strip_type(struct decode_ctx *ctx, uint64_t off,
+		       struct ulp_dwarf_type *t)
+{
+	int n;
+
+	for (n = 0; n < DECODE_MAX_NEST; n++) {
+		if (get_type(ctx, off, t))
+			return false;
+		if (t->kind != ULP_DWARF_TYPEDEF && t->kind != ULP_DWARF_QUAL)
+			return true;
+		off = t->type;
+	}
+	return false;
+}
+
+static uint64_t type_size(struct decode_ctx *ctx, uint64_t off)
+{
+	struct ulp_dwarf_type t;
+
+	if (get_type(ctx, off, &t))
+		return 0;
+	if (t.size)
+		return t.size;
+	return strip_type(ctx, off, &t) ? t.size : 0;
+}
+
+static void type_name(struct decode_ctx *ctx, uint64_t off, char *buf,
+		      size_t len)
+{
+	struct ulp_dwarf_type t;
+	char sub[128];
+
+	if (!off || get_type(ctx, off, &t)) {
+		snprintf(buf, len, "void");
+		return;
+	}
+
+	switch (t.kind) {
+	case ULP_DWARF_STRUCT:
+	case ULP_DWARF_UNION:
+	case ULP_DWARF_ENUM:
+		snprintf(buf, len, "%s %s", t.kind == ULP_DWARF_STRUCT ?
+			 "struct" : t.kind == ULP_DWARF_UNION ? "union" :
+			 "enum", t.name ?: "<anon>");
+		break;
+	case ULP_DWARF_POINTER:
+		type_name(ctx, t.type, sub, sizeof(sub));
+		snprintf(buf, len, "%s *", sub);
+		break;
+	case ULP_DWARF_ARRAY:
+		type_name(ctx, t.type, sub, sizeof(sub));
+		snprintf(buf, len, "%s[%" PRIu64 "]", sub, t.nr_elems);
+		break;
+	case ULP_DWARF_QUAL:
+		type_name(ctx, t.type, buf, len);
+		break;
+	case ULP_DWARF_FUNC:
+		snprintf(buf, len, "func");
+		break;
+	default:
+		snprintf(buf, len, "%s", t.name ?: "?");
+		break;
+	}
+}
+
+static unsigned int seen_slot(struct decode_ctx *ctx, unsigned long addr,
+			      uint64_t type)
+{
+	unsigned int mask = ctx->max_objs * 2 - 1, i;
+	struct decode_obj *obj;
+
+	i = ((addr >> 3) ^ (type * 0x9e3779b97f4a7c15ULL)) & mask;
+	for (; ctx->seen[i]; i = (i + 1) & mask) {
+		obj = &ctx->objs[ctx->seen[i] - 1];
+		if (obj->addr == addr && obj->type == type)
+			break;
+	}
+	return i;
+}
+
+/**
+ * Queue the object at @addr for the next level, return the index of it, or
+ * -1 if too many objects.
+ */
+static int queue_obj(struct decode_ctx *ctx, unsigned long addr,
+		     uint64_t type, size_t size, const char *member)
+{
+	struct decode_obj *obj;
+	unsigned int slot;
+
+	slot = seen_slot(ctx, addr, type);
+	if (ctx->seen[slot])
+		return ctx->seen[slot] - 1;
+	if (ctx->nr_objs == ctx->max_objs)
+		return -1;
+
+	obj = &ctx->objs[ctx->nr_objs];
+	memset(obj, 0, sizeof(*obj));
+	obj->addr = addr;
+	obj->type = type;
+	obj->size = size;
+	obj->parent = ctx->cur;
+	obj->member = member;
+	ctx->seen[slot] = ++ctx->nr_objs;
+	return ctx->nr_objs - 1;
+}
+
+static uint64_t load_uint(const uint8_t *p, size_t size)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, p, MIN(size, sizeof(v)));
+	return v;
+}
+
+static int64_t load_int(const uint8_t *p, size_t size)
+{
+	uint64_t v = load_uint(p, size);
+
+	if (size && size < 8 && (v & (1ULL << (size * 8 - 1))))
+		v |= ~0ULL << (size * 8);
+	return v;
+}
+
+static void print_char(FILE *fp, int c)
+{
+	if (c == '"' || c == '\\')
+		fprintf(fp, "\\%c", c);
+	else if (isprint(c))
+		fputc(c, fp);
+	else
+		fprintf(fp, "\\x%02x", c & 0xff);
+}
+
+static void print_value(struct decode_ctx *ctx, uint64_t off,
+			const uint8_t *p, size_t size, int indent,
+			const char *member);
+
+struct member_arg {
+	struct decode_ctx *ctx;
+	const uint8_t *p;
+	size_t size;
+	int indent;
+};
+
+static int print_member(const struct ulp_dwarf_member *m, void *arg)
+{
+	struct member_arg *a = arg;
+	struct decode_ctx *ctx = a->ctx;
+	uint64_t msize, v;
+	unsigned int i;
+
+	fprintf(ctx->fp, "%*s.%s = ", a->indent * 2, "", m->name ?: "<anon>");
+
+	if (m->bit_size) {
+		if (m->bit_size > 64 ||
+		    (m->bit_offset + m->bit_size + 7) / 8 > a->size) {
+			fprintf(ctx->fp, "<out of range>,\n");
+			return 0;
+		}
+		for (i = 0, v = 0; i < m->bit_size; i++) {
+			uint64_t bit = m->bit_offset + i;
+			v |= (uint64_t)((a->p[bit / 8] >> (bit % 8)) & 1) << i;
+		}
+		fprintf(ctx->fp, "%" PRIu64 ",\n", v);
+		return 0;
+	}
+
+	msize = type_size(ctx, m->type);
+	if (m->offset + msize > a->size) {
+		fprintf(ctx->fp, "<out of range>,\n");
+		return 0;
+	}
+	print_value(ctx, m->type, a->p + m->offset, msize, a->indent,
+		    m->name);
+	fprintf(ctx->fp, ",\n");
+	return 0;
+}
+
+static void print_pointer(struct decode_ctx *ctx, uint64_t to,
+			  unsigned long addr, const char *member)
+{
+	struct ulp_dwarf_type t;
+	int idx;
+
+	fprintf(ctx->fp, "%#lx", addr);
+	if (!addr || !strip_type(ctx, to, &t) ||
+	    (t.kind != ULP_DWARF_STRUCT && t.kind != ULP_DWARF_UNION) ||
+	    !t.size || t.size > DECODE_MAX_SIZE)
+		return;
+
+	/* The last level, the pointed ones are not decoded */
+	if (ctx->level >= ctx->depth)
+		return;
+
+	/* Queue the stripped type, the typedef aliases are the same object */
+	idx = queue_obj(ctx, addr, t.off, t.size, member);
+	if (idx < 0)
+		ctx->stats->nr_dropped++;
+	else
+		fprintf(ctx->fp, " -> [%d]", idx);
+}
+
+static void print_array(struct decode_ctx *ctx, const struct ulp_dwarf_type *t,
+			const uint8_t *p, size_t size, int indent,
+			const char *member)
+{
+	struct ulp_dwarf_type e;
+	uint64_t esize, i, n;
+	bool scalar;
+
+	esize = type_size(ctx, t->type);
+	if (!esize || !strip_type(ctx, t->type, &e)) {
+		fprintf(ctx->fp, "{}");
+		return;
+	}
+	n = MIN(t->nr_elems, size / esize);
+
+	if (e.kind == ULP_DWARF_BASE && e.enc == ULP_DWARF_ENC_CHAR &&
+	    esize == 1) {
+		fputc('"', ctx->fp);
+		for (i = 0; i < n && p[i]; i++)
+			print_char(ctx->fp, p[i]);
+		fputc('"', ctx->fp);
+		return;
+	}
+
+	scalar = e.kind != ULP_DWARF_STRUCT && e.kind != ULP_DWARF_UNION &&
+		 e.kind != ULP_DWARF_ARRAY;
+	fprintf(ctx->fp, "{");
+	for (i = 0; i < MIN(n, (uint64_t)DECODE_MAX_ELEMS); i++) {
+		if (scalar) {
+			fprintf(ctx->fp, "%s", i ? ", " : "");
+		} else {
+			fprintf(ctx->fp, "%s\n%*s[%" PRIu64 "] = ",
+				i ? "," : "", (indent + 1) * 2, "", i);
+		}
+		print_value(ctx, t->type, p + i * esize, esize, indent + 1,
+			    member);
+	}
+	if (n > DECODE_MAX_ELEMS)
+		fprintf(ctx->fp, "%s...", scalar ? ", " : ",\n");
+	if (!scalar && n)
+		fprintf(ctx->fp, "\n%*s", indent * 2, "");
+	fprintf(ctx->fp, "}");
+}
+
+/* Print the value of type @off in @p of @size bytes, no newline at end */
+static void print_value(struct decode_ctx *ctx, uint64_t off,
+			const uint8_t *p, size_t size, int indent,
+			const char *member)
+{
+	struct member_arg arg;
+	struct ulp_dwarf_type t;
+	const char *name;
+	int64_t sv;
+	float f;
+	double d;
+
+	if (!strip_type(ctx, off, &t) || indent > DECODE_MAX_NEST) {
+		fprintf(ctx->fp, "{...}");
+		return;
+	}
+	if (t.size > size) {
+		fprintf(ctx->fp, "<out of range>");
+		return;
+	}
+
+	switch (t.kind) {
+	case ULP_DWARF_BASE:
+		switch (t.enc) {
+		case ULP_DWARF_ENC_BOOL:
+			fprintf(ctx->fp, "%s", load_uint(p, t.size) ?
+				"true" : "false");
+			break;
+		case ULP_DWARF_ENC_CHAR:
+			sv = load_int(p, t.size);
+			fprintf(ctx->fp, "%" PRId64 " '", sv);
+			print_char(ctx->fp, (int)sv);
+			fputc('\'', ctx->fp);
+			break;
+		case ULP_DWARF_ENC_SIGNED:
+			fprintf(ctx->fp, "%" PRId64, load_int(p, t.size));
+			break;
+		case ULP_DWARF_ENC_FLOAT:
+			if (t.size == sizeof(f)) {
+				memcpy(&f, p, sizeof(f));
+				fprintf(ctx->fp, "%g", f);
+			} else if (t.size == sizeof(d)) {
+				memcpy(&d, p, sizeof(d));
+				fprintf(ctx->fp, "%g", d);
+			} else {
+				fprintf(ctx->fp, "%#" PRIx64,
+					load_uint(p, t.size));
+			}
+			break;
+		case ULP_DWARF_ENC_UNSIGNED:
+		default:
+			fprintf(ctx->fp, "%" PRIu64, load_uint(p, t.size));
+			break;
+		}
+		break;
+	case ULP_DWARF_ENUM:
+		sv = load_int(p, t.size);
+		name = ulp_dwarf_enum_name(ctx->dw, t.off, sv);
+		if (name)
+			fprintf(ctx->fp, "%s (%" PRId64 ")", name, sv);
+		else
+			fprintf(ctx->fp, "%" PRId64, sv);
+		break;
+	case ULP_DWARF_POINTER:
+		print_pointer(ctx, t.type, load_uint(p, t.size), member);
+		break;
+	case ULP_DWARF_ARRAY:
+		print_array(ctx, &t, p, size, indent, member);
+		break;
+	case ULP_DWARF_STRUCT:
+	case ULP_DWARF_UNION:
+		arg.ctx = ctx;
+		arg.p = p;
+		arg.size = t.size;
+		arg.indent = indent + 1;
+		fprintf(ctx->fp, "{\n");
+		ulp_dwarf_for_each_member(ctx->dw, t.off, print_member, &arg);
+		fprintf(ctx->fp, "%*s}", indent * 2, "");
+		break;
+	default:
+		fprintf(ctx->fp, "<%s>", t.kind == ULP_DWARF_FUNC ? "func" :
+			"unknown");
+		break;
+	}
+}
+
+static bool all_zero(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+/* Read the objects [@start, @end) of one level by one vectored read */
+static int read_level(struct decode_ctx *ctx, unsigned int start,
+		      unsigned int end)
+{
+	struct task_iov *iov;
+	struct decode_obj *obj;
+	size_t total = 0;
+	unsigned int i;
+	ssize_t n;
+
+	iov = calloc(end - start, sizeof(*iov));
+	if (!iov)
+		return -ENOMEM;
+
+	for (i = start; i < end; i++) {
+		obj = &ctx->objs[i];
+		obj->buf = malloc(obj->size);
+		if (!obj->buf) {
+			free(iov);
+			return -ENOMEM;
+		}
+		iov[i - start].remote = obj->addr;
+		iov[i - start].local = obj->buf;
+		iov[i - start].len = obj->size;
+		total += obj->size;
+	}
+
+	n = memcpy_from_task_iov(ctx->task, iov, end - start);
+	ctx->stats->nr_reads++;
+	free(iov);
+
+	/* The failed ones are zeroed, check them one by one */
+	if (n < 0 || n < total) {
+		for (i = start; i < end; i++) {
+			obj = &ctx->objs[i];
+			if (!all_zero(obj->buf, obj->size))
+				continue;
+			ctx->stats->nr_reads++;
+			n = memcpy_from_task(ctx->task, obj->buf, obj->addr,
+					     obj->size);
+			if (n != obj->size) {
+				obj->unreadable = true;
+				ctx->stats->nr_unreadable++;
+			}
+		}
+	}
+	return 0;
+}
+
+static void print_obj(struct decode_ctx *ctx, unsigned int idx)
+{
+	struct decode_obj *obj = &ctx->objs[idx];
+	char name[256];
+
+	type_name(ctx, obj->type, name, sizeof(name));
+	fprintf(ctx->fp, "[%u] %s @ %#lx", idx, name, obj->addr);
+	if (obj->parent >= 0)
+		fprintf(ctx->fp, " <- [%d].%s", obj->parent,
+			obj->member ?: "<anon>");
+
+	if (obj->unreadable) {
+		fprintf(ctx->fp, " <unreadable>\n");
+		return;
+	}
+
+	fprintf(ctx->fp, " = ");
+	print_value(ctx, obj->type, obj->buf, obj->size, 0, NULL);
+	fprintf(ctx->fp, "\n");
+}
+
+/* Open the DWARF of the ELF of @vma which has type @type */
+static struct ulp_dwarf *vma_find_type(struct task_struct *task,
+				       struct vm_area_struct *vma,
+				       const char *type, uint64_t *off)
+{
+	char path[PATH_MAX], buf[PATH_MAX];
+	struct ulp_dwarf *dw;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (i == 0) {
+			if (!task_path_exist(task, vma->name_))
+				continue;
+			task_path(task, vma->name_, path, sizeof(path));
+		} else if (!vma->bfd_elf_file ||
+			   bfd_elf_debuginfo_path(vma->bfd_elf_file, buf,
+						  sizeof(buf))) {
+			break;
+		} else {
+			snprintf(path, sizeof(path), "%s", buf);
+		}
+
+		dw = ulp_dwarf_open(path);
+		if (!dw)
+			continue;
+		if (!ulp_dwarf_find_type(dw, type, off)) {
+			ulp_debug("Found type %s in %s\n", type, path);
+			return dw;
+		}
+		ulp_dwarf_close(dw);
+	}
+	return NULL;
+}
+
+/* The executable first, then the libraries in order of address */
+static struct ulp_dwarf *task_find_type(struct task_struct *task,
+					const char *type, uint64_t *off)
+{
+	struct vm_area_struct *vma;
+	struct ulp_dwarf *dw;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		task_for_each_vma(vma, task) {
+			if (!vma->is_elf || vma->leader != vma ||
+			    (vma->type == VMA_SELF) != !pass)
+				continue;
+			dw = vma_find_type(task, vma, type, off);
+			if (dw)
+				return dw;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Decode the object of @type at @addr of @task into @fp, follow the
+ * pointers @depth levels, see DECODE_MAX_SIZE and TASK_DECODE_MAX_OBJS.
+ */
+int task_decode(FILE *fp, struct task_struct *task, const char *type,
+		unsigned long addr, int depth, struct task_decode_stats *stats)
+{
+	struct decode_ctx ctx = {
+		.fp = fp ?: stdout,
+		.task = task,
+		.depth = MIN(MAX(depth, 0), TASK_DECODE_MAX_DEPTH),
+		.cur = -1,
+		.max_objs = TASK_DECODE_MAX_OBJS,
+		.stats = stats,
+	};
+	unsigned int start, end, i;
+	struct ulp_dwarf_type t;
+	uint64_t off, size;
+	int err = 0;
+
+	memset(stats, 0, sizeof(*stats));
+
+	ctx.dw = task_find_type(task, type, &off);
+	if (!ctx.dw) {
+		ulp_error("Not found type %s in DWARF of pid %d\n", type,
+			  task->pid);
+		return -ENOENT;
+	}
+
+	size = type_size(&ctx, off);
+	if (!size || size > DECODE_MAX_SIZE) {
+		ulp_error("Size of %s is %" PRIu64 ", not decode\n", type,
+			  size);
+		err = -E2BIG;
+		goto close;
+	}
+
+	ctx.objs = calloc(ctx.max_objs, sizeof(*ctx.objs));
+	ctx.seen = calloc(ctx.max_objs * 2, sizeof(*ctx.seen));
+	if (!ctx.objs || !ctx.seen) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	if (strip_type(&ctx, off, &t))
+		off = t.off;
+	queue_obj(&ctx, addr, off, size, NULL);
+
+	/* The objects of the next level are queued while printing */
+	for (start = 0, ctx.level = 0; start < ctx.nr_objs;
+	     start = end, ctx.level++) {
+		end = ctx.nr_objs;
+		err = read_level(&ctx, start, end);
+		if (err)
+			break;
+		stats->nr_levels++;
+		for (i = start; i < end; i++) {
+			ctx.cur = i;
+			print_obj(&ctx, i);
+		}
+	}
+	stats->nr_objs = ctx.nr_objs;
+
+free:
+	for (i = 0; ctx.objs && i < ctx.nr_objs; i++)
+		free(ctx.objs[i].buf);
+	free(ctx.objs);
+	free(ctx.seen);
+close:
+	ulp_dwarf_close(ctx.dw);
+	return err;
+}
@@ -0,0 +1,586 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <elf.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Resolve dynamic symbols from the target task memory directly, through
+ * PT_DYNAMIC, DT_GNU_HASH, DT_SYMTAB and DT_STRTAB of the ELF VMAs, no ELF
+ * file is opened, thus it works for deleted-but-mapped libraries too.
+ *
+ * The bloom filter and buckets are copied on the first lookup, then one
+ * lookup costs a batched read of chain words, and one vectored read of the
+ * candidate symbols and one of their names. The misses of bloom filter
+ * cost nothing remote.
+ *
+ * [0] https://sourceware.org/legacy-ml/binutils/2006-10/msg00377.html
+ */
+
+/* Bits of one bloom filter word, ElfW(Addr) */
+#define BLOOM_WORD_BITS	(8 * sizeof(unsigned long))
+
+/* Words of chain read at once, a chain is short in general */
+#define DYNSYM_CHAIN_BATCH	16
+
+/* Max bytes of bloom filter and buckets copied, see parse_dynsym() */
+#define DYNSYM_CACHE_MAX	SZ_1M
+
+/* Hash function of DT_GNU_HASH */
+static uint32_t gnu_hash(const char *name)
+{
+	uint32_t h = 5381;
+	const unsigned char *c;
+
+	for (c = (const unsigned char *)name; *c; c++)
+		h = (h << 5) + h + *c;
+	return h;
+}
+
+/**
+ * The dynamic linker relocates the d_ptr of .dynamic in place on most
+ * architectures, but not all of them, and [vdso] is never relocated.
+ */
+static unsigned long dyn_ptr(struct vm_area_struct *vma, unsigned long ptr)
+{
+	unsigned long load_addr = vma->vma_elf->load_addr;
+	return ptr < load_addr ? ptr + load_addr : ptr;
+}
+
+/* The whole .dynamic in one read */
+static GElf_Dyn *read_dynamic(struct vm_area_struct *vma, size_t *nr)
+{
+	struct vma_elf_mem *elf = vma->vma_elf;
+	GElf_Phdr *dynamic = NULL;
+	GElf_Dyn *dyns;
+	size_t size;
+	int i, n;
+
+	for (i = 0; elf->phdrs && i < elf->ehdr.e_phnum; i++) {
+		if (elf->phdrs[i].p_type == PT_DYNAMIC) {
+			dynamic = &elf->phdrs[i];
+			break;
+		}
+	}
+	if (!dynamic || !dynamic->p_memsz || dynamic->p_memsz > SZ_64K)
+		return NULL;
+
+	size = dynamic->p_memsz;
+	dyns = malloc(size);
+	if (!dyns)
+		return NULL;
+
+	n = memcpy_from_task(vma->task, dyns, elf->load_addr + dynamic->p_vaddr,
+			     size);
+	if (n < (int)sizeof(GElf_Dyn)) {
+		free(dyns);
+		return NULL;
+	}
+
+	*nr = n / sizeof(GElf_Dyn);
+	return dyns;
+}
+
+static int parse_dynsym(struct vm_area_struct *vma)
+{
+	struct vma_elf_dynsym *dynsym = &vma->vma_elf->dynsym;
+	struct task_struct *task = vma->task;
+	unsigned long gnu_hash_addr = 0;
+	struct task_iov iov[2];
+	size_t nr = 0, i, bloom_len, buckets_len;
+	uint32_t hdr[4];
+	GElf_Dyn *dyns;
+	int err = 0;
+
+	dyns = read_dynamic(vma, &nr);
+	if (!dyns)
+		return -ENOENT;
+
+	for (i = 0; i < nr && dyns[i].d_tag != DT_NULL; i++) {
+		switch (dyns[i].d_tag) {
+		case DT_GNU_HASH:
+			gnu_hash_addr = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_SYMTAB:
+			dynsym->symtab = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_STRTAB:
+			dynsym->strtab = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_STRSZ:
+			dynsym->strsz = dyns[i].d_un.d_val;
+			break;
+		case DT_SYMENT:
+			if (dyns[i].d_un.d_val != sizeof(GElf_Sym))
+				err = -ENOEXEC;
+			break;
+		}
+	}
+	free(dyns);
+	if (err)
+		return err;
+
+	if (!gnu_hash_addr || !dynsym->symtab || !dynsym->strtab) {
+		ulp_debug("%s: no DT_GNU_HASH.\n", vma->name_);
+		return -ENOENT;
+	}
+
+	if (memcpy_from_task(task, hdr, gnu_hash_addr, sizeof(hdr)) <
+	    sizeof(hdr))
+		return -EAGAIN;
+
+	dynsym->nbuckets = hdr[0];
+	dynsym->symoffset = hdr[1];
+	dynsym->bloom_size = hdr[2];
+	dynsym->bloom_shift = hdr[3];
+
+	/* bloom_size must be power of 2 */
+	if (!dynsym->nbuckets || !dynsym->bloom_size ||
+	    dynsym->bloom_size & (dynsym->bloom_size - 1))
+		return -ENOEXEC;
+
+	dynsym->bloom = gnu_hash_addr + sizeof(hdr);
+	dynsym->buckets = dynsym->bloom +
+			  dynsym->bloom_size * sizeof(unsigned long);
+	dynsym->chain = dynsym->buckets + dynsym->nbuckets * sizeof(uint32_t);
+
+	/**
+	 * The bloom filter and buckets are a few KiB even for libc, copy them
+	 * once, then the misses cost no remote read, and the hits only the
+	 * chain, symbols and names.
+	 */
+	bloom_len = dynsym->bloom_size * sizeof(unsigned long);
+	buckets_len = dynsym->nbuckets * sizeof(uint32_t);
+	if (bloom_len + buckets_len > DYNSYM_CACHE_MAX)
+		return -E2BIG;
+
+	/* In task::elf_pool, see task_elf_alloc() */
+	dynsym->bloom_words = task_elf_alloc(task, bloom_len);
+	dynsym->bucket_words = task_elf_alloc(task, buckets_len);
+	if (!dynsym->bloom_words || !dynsym->bucket_words) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	iov[0].remote = dynsym->bloom;
+	iov[0].local = dynsym->bloom_words;
+	iov[0].len = bloom_len;
+	iov[1].remote = dynsym->buckets;
+	iov[1].local = dynsym->bucket_words;
+	iov[1].len = buckets_len;
+	if (memcpy_from_task_iov(task, iov, 2) != bloom_len + buckets_len) {
+		err = -EAGAIN;
+		goto fail;
+	}
+
+	ulp_debug("%s: dynsym %lx, strtab %lx, gnu_hash %lx, nbuckets %u\n",
+		  vma->name_, dynsym->symtab, dynsym->strtab, gnu_hash_addr,
+		  dynsym->nbuckets);
+	return 0;
+
+fail:
+	vma_free_dynsym(vma);
+	return err;
+}
+
+void vma_free_dynsym(struct vm_area_struct *vma)
+{
+	struct vma_elf_dynsym *dynsym = &vma->vma_elf->dynsym;
+
+	/* Released with task::elf_pool */
+	dynsym->bloom_words = NULL;
+	dynsym->bucket_words = NULL;
+}
+
+/* Return the address if @sym is the definition of @name, 0 if not */
+static unsigned long dynsym_match(struct vm_area_struct *vma,
+				  const GElf_Sym *sym, const char *buf,
+				  const char *name, size_t len)
+{
+	if (memcmp(buf, name, len + 1))
+		return 0;
+	if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0)
+		return 0;
+	switch (GELF_ST_TYPE(sym->st_info)) {
+	case STT_GNU_IFUNC:
+	case STT_TLS:
+		return 0;
+	}
+	return vma->vma_elf->load_addr + sym->st_value;
+}
+
+/**
+ * Check the candidates @idx[] of chain whose hash matches, the symbols are
+ * read by one vectored read, then the names by another one.
+ */
+static unsigned long dynsym_check(struct vm_area_struct *vma,
+				  const uint32_t *idx, int n,
+				  const char *name, size_t len)
+{
+	struct vma_elf_dynsym *dynsym = &vma->vma_elf->dynsym;
+	struct task_iov iov[DYNSYM_CHAIN_BATCH];
+	GElf_Sym syms[DYNSYM_CHAIN_BATCH];
+	char bufs[DYNSYM_CHAIN_BATCH][len + 1];
+	unsigned long addr;
+	ssize_t expect = 0;
+	int i, nr = 0;
+
+	for (i = 0; i < n; i++) {
+		iov[i].remote = dynsym->symtab + idx[i] * sizeof(GElf_Sym);
+		iov[i].local = &syms[i];
+		iov[i].len = sizeof(GElf_Sym);
+		expect += iov[i].len;
+	}
+	if (memcpy_from_task_iov(vma->task, iov, n) != expect)
+		return 0;
+
+	/* Compact the symbols whose name could be @name */
+	expect = 0;
+	for (i = 0; i < n; i++) {
+		if (syms[i].st_name + len >= dynsym->strsz)
+			continue;
+		syms[nr] = syms[i];
+		iov[nr].remote = dynsym->strtab + syms[i].st_name;
+		iov[nr].local = bufs[nr];
+		iov[nr].len = len + 1;
+		expect += iov[nr].len;
+		nr++;
+	}
+	if (!nr || memcpy_from_task_iov(vma->task, iov, nr) != expect)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		addr = dynsym_match(vma, &syms[i], bufs[i], name, len);
+		if (addr)
+			return addr;
+	}
+	return 0;
+}
+
+/**
+ * Return the address of dynamic symbol defined in the ELF VMA, 0 if not
+ * found. The VMA must be the leader of ELF, which has vma::vma_elf.
+ *
+ * STT_GNU_IFUNC and STT_TLS symbols are not resolved here, the address of
+ * them is not the symbol value, leave them to the caller.
+ */
+unsigned long vma_dynsym_addr(struct vm_area_struct *vma, const char *name)
+{
+	struct task_struct *task = vma->task;
+	struct vma_elf_dynsym *dynsym;
+	uint32_t h, bucket, idx, chains[DYNSYM_CHAIN_BATCH];
+	uint32_t cands[DYNSYM_CHAIN_BATCH];
+	unsigned long word, mask, addr, chain;
+	int i, n, nr;
+	bool last = false;
+	size_t len;
+
+	if (!vma->vma_elf || !name)
+		return 0;
+
+	dynsym = &vma->vma_elf->dynsym;
+	if (dynsym->state == 0)
+		dynsym->state = parse_dynsym(vma) ?: 1;
+	if (dynsym->state < 0)
+		return 0;
+
+	len = strlen(name);
+	h = gnu_hash(name);
+
+	/* Bloom filter, most misses are stopped here without remote read */
+	word = dynsym->bloom_words[(h / BLOOM_WORD_BITS) &
+				   (dynsym->bloom_size - 1)];
+	mask = (1UL << (h % BLOOM_WORD_BITS)) |
+	       (1UL << ((h >> dynsym->bloom_shift) % BLOOM_WORD_BITS));
+	if ((word & mask) != mask)
+		return 0;
+
+	bucket = dynsym->bucket_words[h % dynsym->nbuckets];
+	if (bucket < dynsym->symoffset)
+		return 0;
+
+	/* Read the chain in batches, never cross the page boundary */
+	for (idx = bucket; !last; idx += n) {
+		chain = dynsym->chain + (idx - dynsym->symoffset) *
+			sizeof(uint32_t);
+		n = (PAGE_SIZE - (chain & (PAGE_SIZE - 1))) / sizeof(uint32_t);
+		n = MIN(MAX(n, 1), DYNSYM_CHAIN_BATCH);
+
+		n = memcpy_from_task(task, chains, chain, n * sizeof(uint32_t));
+		if (n < (int)sizeof(uint32_t))
+			return 0;
+		n /= sizeof(uint32_t);
+
+		for (i = nr = 0; i < n; i++) {
+			if ((h | 1) == (chains[i] | 1))
+				cands[nr++] = idx + i;
+			/* The last symbol of this bucket */
+			if (chains[i] & 1) {
+				last = true;
+				break;
+			}
+		}
+
+		if (nr) {
+			addr = dynsym_check(vma, cands, nr, name, len);
+			if (addr)
+				return addr;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Search all ELF VMAs of task in address order, the first one defines the
+ * symbol wins, like the dynamic linker does.
+ */
+unsigned long task_dynsym_addr(struct task_struct *task, const char *name)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->vma_elf || vma->type == VMA_ULPATCH)
+			continue;
+		addr = vma_dynsym_addr(vma, name);
+		if (addr) {
+			ulp_debug("Resolve %s from %s dynsym: %lx\n", name,
+				  vma->name_, addr);
+			return addr;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Batch version of task_dynsym_addr(), resolve all @names whose @addrs is
+ * zero, walk the ELF VMAs once for all of them, return the number resolved.
+ */
+int task_dynsym_addrs(struct task_struct *task, const char **names,
+		      unsigned long *addrs, int n)
+{
+	struct vm_area_struct *vma;
+	int i, nr = 0, left = 0;
+
+	for (i = 0; i < n; i++)
+		left += !addrs[i];
+
+	task_for_each_vma(vma, task) {
+		if (!left)
+			break;
+		if (!vma->vma_elf || vma->type == VMA_ULPATCH)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (addrs[i])
+				continue;
+			addrs[i] = vma_dynsym_addr(vma, names[i]);
+			if (addrs[i]) {
+				ulp_debug("Resolve %s from %s dynsym: %lx\n",
+					  names[i], vma->name_, addrs[i]);
+				nr++;
+				left--;
+			}
+		}
+	}
+	return nr;
+}
+
+/**
+ * The GOT slots, of which the dynamic linker stores the address of an
+ * imported function, found by the R_*_JUMP_SLOT relocations of DT_JMPREL
+ * and the R_*_GLOB_DAT relocations of DT_RELA, such as -fno-plt calls.
+ */
+#if defined(__x86_64__)
+# define R_GOT_JUMP_SLOT	R_X86_64_JUMP_SLOT
+# define R_GOT_GLOB_DAT		R_X86_64_GLOB_DAT
+#elif defined(__aarch64__)
+# define R_GOT_JUMP_SLOT	R_AARCH64_JUMP_SLOT
+# define R_GOT_GLOB_DAT		R_AARCH64_GLOB_DAT
+#endif
+
+/* Relocations read at once */
+#define GOT_RELA_BATCH	256
+
+struct got_tables {
+	/* DT_JMPREL first, then DT_RELA */
+	unsigned long rela[2];
+	size_t relasz[2];
+	unsigned long symtab;
+	unsigned long strtab;
+	size_t strsz;
+};
+
+static int parse_got_tables(struct vm_area_struct *vma, struct got_tables *t)
+{
+	size_t nr = 0, i;
+	GElf_Dyn *dyns;
+	int err = 0;
+
+	dyns = read_dynamic(vma, &nr);
+	if (!dyns)
+		return -ENOENT;
+
+	for (i = 0; i < nr && dyns[i].d_tag != DT_NULL; i++) {
+		switch (dyns[i].d_tag) {
+		case DT_JMPREL:
+			t->rela[0] = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_PLTRELSZ:
+			t->relasz[0] = dyns[i].d_un.d_val;
+			break;
+		case DT_PLTREL:
+			if (dyns[i].d_un.d_val != DT_RELA)
+				err = -ENOEXEC;
+			break;
+		case DT_RELA:
+			t->rela[1] = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_RELASZ:
+			t->relasz[1] = dyns[i].d_un.d_val;
+			break;
+		case DT_RELAENT:
+			if (dyns[i].d_un.d_val != sizeof(GElf_Rela))
+				err = -ENOEXEC;
+			break;
+		case DT_SYMENT:
+			if (dyns[i].d_un.d_val != sizeof(GElf_Sym))
+				err = -ENOEXEC;
+			break;
+		case DT_SYMTAB:
+			t->symtab = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_STRTAB:
+			t->strtab = dyn_ptr(vma, dyns[i].d_un.d_ptr);
+			break;
+		case DT_STRSZ:
+			t->strsz = dyns[i].d_un.d_val;
+			break;
+		}
+	}
+	free(dyns);
+	if (err)
+		return err;
+
+	if (!t->symtab || !t->strtab)
+		return -ENOENT;
+	return 0;
+}
+
+/**
+ * Check the candidate relocations @cands[], the symbols are read by one
+ * vectored read, then the names by another one, like dynsym_check().
+ */
+static const GElf_Rela *got_check(struct vm_area_struct *vma,
+				  const struct got_tables *t,
+				  const GElf_Rela **cands, int n,
+				  const char *name, size_t len)
+{
+	struct task_iov iov[DYNSYM_CHAIN_BATCH];
+	GElf_Sym syms[DYNSYM_CHAIN_BATCH];
+	char bufs[DYNSYM_CHAIN_BATCH][len + 1];
+	const GElf_Rela *relas[DYNSYM_CHAIN_BATCH];
+	ssize_t expect = 0;
+	int i, nr = 0;
+
+	for (i = 0; i < n; i++) {
+		iov[i].remote = t->symtab +
+				GELF_R_SYM(cands[i]->r_info) * sizeof(GElf_Sym);
+		iov[i].local = &syms[i];
+		iov[i].len = sizeof(GElf_Sym);
+		expect += iov[i].len;
+	}
+	if (memcpy_from_task_iov(vma->task, iov, n) != expect)
+		return NULL;
+
+	expect = 0;
+	for (i = 0; i < n; i++) {
+		if (syms[i].st_name + len >= t->strsz)
+			continue;
+		relas[nr] = cands[i];
+		iov[nr].remote = t->strtab + syms[i].st_name;
+		iov[nr].local = bufs[nr];
+		iov[nr].len = len + 1;
+		expect += iov[nr].len;
+		nr++;
+	}
+	if (!nr || memcpy_from_task_iov(vma->task, iov, nr) != expect)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		if (!memcmp(bufs[i], name, len + 1))
+			return relas[i];
+	}
+	return NULL;
+}
+
+/**
+ * Return the address of GOT slot of imported function @name in the ELF VMA,
+ * 0 if not found. The VMA must be the leader of ELF, which has vma::vma_elf.
+ * The R_*_JUMP_SLOT wins if the function has both kinds of slots, only the
+ * calls of this ELF through the returned slot are redirected by writing it.
+ */
+unsigned long vma_got_slot(struct vm_area_struct *vma, const char *name)
+{
+	GElf_Rela relas[GOT_RELA_BATCH];
+	const GElf_Rela *cands[DYNSYM_CHAIN_BATCH], *rela = NULL;
+	struct got_tables t = {};
+	unsigned long off, type, slot;
+	int tbl, i, n, nr;
+	size_t len;
+
+	if (!vma || !vma->vma_elf || !name)
+		return 0;
+
+	if (parse_got_tables(vma, &t))
+		return 0;
+
+	len = strlen(name);
+
+	for (tbl = 0; tbl < ARRAY_SIZE(t.rela) && !rela; tbl++) {
+		if (!t.rela[tbl])
+			continue;
+
+		for (off = 0; off < t.relasz[tbl] && !rela;
+		     off += n * sizeof(GElf_Rela)) {
+			n = MIN((t.relasz[tbl] - off) / sizeof(GElf_Rela),
+				GOT_RELA_BATCH);
+			n = memcpy_from_task(vma->task, relas, t.rela[tbl] + off,
+					     n * sizeof(GElf_Rela));
+			if (n < (int)sizeof(GElf_Rela))
+				return 0;
+			n /= sizeof(GElf_Rela);
+
+			for (i = nr = 0; i < n && !rela; i++) {
+				type = GELF_R_TYPE(relas[i].r_info);
+				if (!GELF_R_SYM(relas[i].r_info) ||
+				    type != (tbl ? R_GOT_GLOB_DAT :
+						   R_GOT_JUMP_SLOT))
+					continue;
+				cands[nr++] = &relas[i];
+				if (nr < DYNSYM_CHAIN_BATCH)
+					continue;
+				rela = got_check(vma, &t, cands, nr, name, len);
+				nr = 0;
+			}
+			if (nr && !rela)
+				rela = got_check(vma, &t, cands, nr, name, len);
+		}
+	}
+	if (!rela)
+		return 0;
+
+	slot = vma->vma_elf->load_addr + rela->r_offset;
+	/* Must be one aligned store, see struct ulpatch_info::flags */
+	if (slot & (sizeof(unsigned long) - 1))
+		return 0;
+
+	ulp_debug("Found %s GOT slot of %s: %lx\n", vma->name_, name, slot);
+	return slot;
+}
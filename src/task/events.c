@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Process fork, exec and exit events from the proc connector of netlink,
+ * see linux:drivers/connector/cn_proc.c, which needs CAP_NET_ADMIN and
+ * CONFIG_PROC_EVENTS. Only the events of processes are reported, the
+ * threads are filtered out.
+ */
+
+/* One netlink message carries one cn_msg, which carries one proc_event */
+struct task_events_msg {
+	struct nlmsghdr nlh;
+	struct cn_msg cn;
+	union {
+		enum proc_cn_mcast_op op;
+		struct proc_event ev;
+	};
+} __attribute__((packed));
+
+static int task_events_send_op(int fd, enum proc_cn_mcast_op op)
+{
+	struct task_events_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(msg.cn) + sizeof(msg.op));
+	msg.nlh.nlmsg_type = NLMSG_DONE;
+	msg.nlh.nlmsg_pid = getpid();
+	msg.cn.id.idx = CN_IDX_PROC;
+	msg.cn.id.val = CN_VAL_PROC;
+	msg.cn.len = sizeof(msg.op);
+	msg.op = op;
+
+	if (send(fd, &msg, msg.nlh.nlmsg_len, 0) != msg.nlh.nlmsg_len)
+		return -errno;
+	return 0;
+}
+
+/**
+ * Subscribe the process events, return the non-blocking fd for poll(2)
+ * and task_events_read(), or negative errno, -EPERM without CAP_NET_ADMIN.
+ */
+int task_events_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = CN_IDX_PROC,
+		.nl_pid = getpid(),
+	};
+	int fd, err;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    NETLINK_CONNECTOR);
+	if (fd < 0) {
+		err = -errno;
+		ulp_debug("Create proc connector socket failed, %m\n");
+		return err;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err = -errno;
+		ulp_debug("Bind proc connector failed, %m\n");
+		goto close;
+	}
+
+	err = task_events_send_op(fd, PROC_CN_MCAST_LISTEN);
+	if (err) {
+		ulp_debug("Listen proc connector failed, %s\n",
+			  strerror(-err));
+		goto close;
+	}
+	return fd;
+
+close:
+	close(fd);
+	return err;
+}
+
+void task_events_close(int fd)
+{
+	if (fd < 0)
+		return;
+	task_events_send_op(fd, PROC_CN_MCAST_IGNORE);
+	close(fd);
+}
+
+static bool task_event_parse(const struct proc_event *pe,
+			     struct task_event *ev)
+{
+	memset(ev, 0, sizeof(*ev));
+
+	switch (pe->what) {
+	case PROC_EVENT_FORK:
+		/* New thread */
+		if (pe->event_data.fork.child_pid !=
+		    pe->event_data.fork.child_tgid)
+			return false;
+		ev->type = TASK_EVENT_FORK;
+		ev->pid = pe->event_data.fork.child_tgid;
+		ev->ppid = pe->event_data.fork.parent_tgid;
+		return true;
+	case PROC_EVENT_EXEC:
+		ev->type = TASK_EVENT_EXEC;
+		ev->pid = pe->event_data.exec.process_tgid;
+		return true;
+	case PROC_EVENT_EXIT:
+		/**
+		 * The exit of thread group leader, the process is zombie or
+		 * about to be, the other threads exit before or soon.
+		 */
+		if (pe->event_data.exit.process_pid !=
+		    pe->event_data.exit.process_tgid)
+			return false;
+		ev->type = TASK_EVENT_EXIT;
+		ev->pid = pe->event_data.exit.process_tgid;
+		ev->exit_code = pe->event_data.exit.exit_code;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Read all pending events of @fd, call @cb for each one. Return the number
+ * of events, or -ENOBUFS if some events are lost because the receive
+ * buffer overflowed, then the caller should check all the processes it
+ * cares about.
+ */
+int task_events_read(int fd,
+		     void (*cb)(const struct task_event *ev, void *arg),
+		     void *arg)
+{
+	char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct task_event ev;
+	struct nlmsghdr *nlh;
+	struct cn_msg *cn;
+	ssize_t len;
+	int nr = 0;
+
+	while (1) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (len == 0)
+			break;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_OVERRUN)
+				return -ENOBUFS;
+			if (nlh->nlmsg_type != NLMSG_DONE)
+				continue;
+
+			cn = NLMSG_DATA(nlh);
+			if (cn->id.idx != CN_IDX_PROC ||
+			    cn->id.val != CN_VAL_PROC ||
+			    cn->len < sizeof(struct proc_event))
+				continue;
+
+			if (!task_event_parse((struct proc_event *)cn->data,
+					      &ev))
+				continue;
+
+			cb(&ev, arg);
+			nr++;
+		}
+	}
+	return nr;
+}
@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Pass the file descriptor of current process into target task by
+ * SCM_RIGHTS, and use it in target task, no need to open any path in
+ * target task, thus the file needs no permission for the target task, and
+ * it can be a memfd or an unlinked file.
+ *
+ * The target task creates an unix datagram socket autobound in abstract
+ * namespace, the name is chosen by kernel and read back from target task,
+ * thus no other process could bind it first. And it connects to the socket
+ * of current process, thus only current process could send to it. Both
+ * processes must be in the same network namespace. Nothing is sent unless
+ * all the syscalls before are succeed.
+ */
+
+/* The batch data of task_mmap_fd() */
+struct fdpass_data {
+	/* The socket of target task, autobound */
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	/* The socket of current process */
+	struct sockaddr_un peer;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	char byte;
+};
+
+/**
+ * The received fd is loaded as unsigned long by the batch stub, the fd is
+ * initialized to -1 and the upper bytes to zero, if nothing is received,
+ * the syscalls use it will fail with EBADF.
+ */
+#define FDPASS_FD_OFFSET	\
+	(offsetof(struct fdpass_data, ctl) + CMSG_LEN(0))
+
+struct fdpass_ctx {
+	struct fdpass_data *data;
+	socklen_t addrlen;
+	int sock;
+	int fd;
+	int err;
+};
+
+/* Create an autobind abstract unix datagram socket */
+static int fdpass_socket(struct sockaddr_un *addr, socklen_t *addrlen)
+{
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	*addrlen = sizeof(*addr);
+
+	if (bind(sock, (struct sockaddr *)addr, sizeof(sa_family_t)) ||
+	    getsockname(sock, (struct sockaddr *)addr, addrlen)) {
+		close(sock);
+		return -errno;
+	}
+	return sock;
+}
+
+static int fdpass_send(int sock, const struct sockaddr_un *addr,
+		       socklen_t addrlen, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(fd))] = {};
+	char byte = 0;
+	struct iovec iov = {
+		.iov_base = &byte,
+		.iov_len = sizeof(byte),
+	};
+	struct msghdr msg = {
+		.msg_name = (void *)addr,
+		.msg_namelen = addrlen,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(byte))
+		return -errno;
+	return 0;
+}
+
+/**
+ * The socket of target task is connected, read back the autobound name of
+ * it, fill the msghdr of recvmsg(2) with the addresses in target task, and
+ * send the fd to it. If any syscall before failed, the fd is never sent,
+ * the recvmsg(2) gets nothing, and the mmap(2) fails with EBADF.
+ */
+static void fdpass_pause(struct task_struct *task,
+			 struct task_syscall_entry *calls, int i,
+			 unsigned long remote_data, void *arg)
+{
+	struct fdpass_ctx *ctx = arg;
+	struct fdpass_data *d = ctx->data;
+	size_t off = offsetof(struct fdpass_data, msg);
+	size_t len = offsetof(struct fdpass_data, ctl) - off;
+	struct task_iov iov[] = {
+		{
+			.remote = remote_data +
+				offsetof(struct fdpass_data, addr),
+			.local = &d->addr,
+			.len = sizeof(d->addr),
+		},
+		{
+			.remote = remote_data +
+				offsetof(struct fdpass_data, addrlen),
+			.local = &d->addrlen,
+			.len = sizeof(d->addrlen),
+		},
+	};
+	int k;
+
+	/* socket(2) returns the fd, bind, getsockname and connect return 0 */
+	for (k = 0; k <= i; k++) {
+		if ((long)calls[k].ret < 0 || (k > 0 && calls[k].ret)) {
+			ctx->err = (long)calls[k].ret < 0 ?
+				(long)calls[k].ret : -EPROTO;
+			ulp_debug("remote syscall %lu failed, %s\n",
+				  calls[k].nr, strerror(-ctx->err));
+			return;
+		}
+	}
+
+	/* Not cached, written by the syscalls just now */
+	if (memcpy_from_task_iov(task, iov, ARRAY_SIZE(iov)) !=
+	    sizeof(d->addr) + sizeof(d->addrlen)) {
+		ctx->err = -EFAULT;
+		return;
+	}
+	ctx->addrlen = d->addrlen;
+	if (ctx->addrlen <= sizeof(sa_family_t) ||
+	    ctx->addrlen > sizeof(d->addr) || d->addr.sun_path[0] != '\0') {
+		ulp_debug("remote socket is not autobound.\n");
+		ctx->err = -EADDRNOTAVAIL;
+		return;
+	}
+
+	d->iov.iov_base = (void *)(remote_data +
+				   offsetof(struct fdpass_data, byte));
+	d->iov.iov_len = sizeof(d->byte);
+	d->msg.msg_iov = (void *)(remote_data +
+				  offsetof(struct fdpass_data, iov));
+	d->msg.msg_iovlen = 1;
+	d->msg.msg_control = (void *)(remote_data +
+				      offsetof(struct fdpass_data, ctl));
+	d->msg.msg_controllen = sizeof(d->ctl);
+
+	if (memcpy_to_task(task, remote_data + off, (void *)d + off, len)
+	    != len) {
+		ctx->err = -EFAULT;
+		return;
+	}
+
+	ctx->err = fdpass_send(ctx->sock, &d->addr, ctx->addrlen, ctx->fd);
+	if (ctx->err)
+		ulp_debug("send fd to %d failed, %s\n", task->pid,
+			  strerror(-ctx->err));
+}
+
+/**
+ * mmap(2) the file descriptor @fd of current process into target task, in
+ * the one task_syscall_batch() of TASK_MMAP_FD_NR_SYSCALLS syscalls. The
+ * mapping refers to the same file of @fd, the vma name in target task is
+ * the path of @fd. Return the address, or negative errno.
+ */
+unsigned long task_mmap_fd(struct task_struct *task, unsigned long addr,
+			   size_t length, int prot, int flags, int fd,
+			   off_t offset)
+{
+	struct fdpass_data data;
+	struct fdpass_ctx ctx = {
+		.data = &data,
+		.fd = fd,
+	};
+	socklen_t peerlen;
+	int ret, nfd = -1;
+
+	memset(&data, 0, sizeof(data));
+	memcpy(data.ctl.buf + CMSG_LEN(0), &nfd, sizeof(nfd));
+
+	ctx.sock = fdpass_socket(&data.peer, &peerlen);
+	if (ctx.sock < 0)
+		return ctx.sock;
+
+	data.addr.sun_family = AF_UNIX;
+	data.addrlen = sizeof(data.addr);
+
+	struct task_syscall_entry calls[] = {
+		{
+			.nr = __NR_socket,
+			.args = { AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 },
+		},
+		{
+			/* Autobind, see unix(7) */
+			.nr = __NR_bind,
+			.args = { 0, offsetof(struct fdpass_data, addr),
+				  sizeof(sa_family_t) },
+			.ret_mask = BIT(0),
+			.data_mask = BIT(1),
+		},
+		{
+			.nr = __NR_getsockname,
+			.args = { 0, offsetof(struct fdpass_data, addr),
+				  offsetof(struct fdpass_data, addrlen) },
+			.ret_mask = BIT(0),
+			.data_mask = BIT(1) | BIT(2),
+		},
+		{
+			.nr = __NR_connect,
+			.args = { 0, offsetof(struct fdpass_data, peer),
+				  peerlen },
+			.ret_mask = BIT(0),
+			.data_mask = BIT(1),
+			.pause = true,
+		},
+		{
+			.nr = __NR_recvmsg,
+			.args = { 0, offsetof(struct fdpass_data, msg),
+				  MSG_DONTWAIT | MSG_CMSG_CLOEXEC },
+			.ret_mask = BIT(0),
+			.data_mask = BIT(1),
+		},
+		{
+			.nr = __NR_close,
+			.args = { 0 },
+			.ret_mask = BIT(0),
+		},
+		{
+			.nr = __NR_mmap,
+			.args = { addr, length, prot, flags, FDPASS_FD_OFFSET,
+				  offset },
+			.data_mask = BIT(4),
+			.load_mask = BIT(4),
+		},
+		{
+			.nr = __NR_close,
+			.args = { FDPASS_FD_OFFSET },
+			.data_mask = BIT(0),
+			.load_mask = BIT(0),
+		},
+	};
+
+	ret = task_syscall_batch_pause(task, calls, ARRAY_SIZE(calls), &data,
+				       sizeof(data), fdpass_pause, &ctx);
+	close(ctx.sock);
+	if (ret)
+		return ret;
+
+	if ((long)calls[0].ret < 0)
+		return calls[0].ret;
+	if (ctx.err)
+		return ctx.err;
+	if ((long)calls[4].ret < 0)
+		return calls[4].ret;
+
+	return calls[6].ret;
+}
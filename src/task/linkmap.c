@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <elf.h>
+#include <link.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Discover the loaded objects of target task from the link_map list of the
+ * dynamic linker, the l_addr is the exact load bias. The r_debug is found
+ * by DT_DEBUG of the executable, whose program headers are at AT_PHDR, or
+ * by _r_debug of the dynamic linker at AT_BASE. It costs a few remote reads
+ * for each object, no VMA is peeked.
+ *
+ * The target is the same ABI as ULPatch, the struct r_debug and struct
+ * link_map of <link.h> are used directly.
+ */
+
+/* Never loop forever on a corrupted list */
+#define TASK_LINK_MAP_MAX	4096
+
+/* The executable load bias and .dynamic from the phdrs at AT_PHDR */
+static int exe_dynamic(struct task_struct *task,
+		       const struct task_struct_auxv *auxv,
+		       unsigned long *dynamic, unsigned long *size)
+{
+	GElf_Phdr *phdrs;
+	unsigned long bias = 0;
+	bool has_phdr = false;
+	size_t len;
+	int i, err = 0;
+
+	if (!auxv->auxv_phnum || auxv->auxv_phent != sizeof(GElf_Phdr))
+		return -ENOENT;
+
+	len = auxv->auxv_phnum * sizeof(GElf_Phdr);
+	phdrs = malloc(len);
+	if (!phdrs)
+		return -ENOMEM;
+
+	if (memcpy_from_task(task, phdrs, auxv->auxv_phdr, len) < len) {
+		err = -EAGAIN;
+		goto out;
+	}
+
+	*dynamic = *size = 0;
+	for (i = 0; i < auxv->auxv_phnum; i++) {
+		switch (phdrs[i].p_type) {
+		case PT_PHDR:
+			bias = auxv->auxv_phdr - phdrs[i].p_vaddr;
+			has_phdr = true;
+			break;
+		case PT_DYNAMIC:
+			*dynamic = phdrs[i].p_vaddr;
+			*size = phdrs[i].p_memsz;
+			break;
+		}
+	}
+
+	/* Without PT_PHDR, the bias is unknown, the linkers always emit it */
+	if (!*dynamic || !has_phdr)
+		err = -ENOENT;
+	else
+		*dynamic += bias;
+out:
+	free(phdrs);
+	return err;
+}
+
+/* DT_DEBUG is filled by the dynamic linker with &_r_debug */
+static unsigned long exe_dt_debug(struct task_struct *task,
+				  const struct task_struct_auxv *auxv)
+{
+	unsigned long dynamic, size, r_debug = 0;
+	GElf_Dyn *dyns;
+	int i;
+
+	if (exe_dynamic(task, auxv, &dynamic, &size) || !size || size > SZ_64K)
+		return 0;
+
+	dyns = malloc(size);
+	if (!dyns)
+		return 0;
+
+	if (memcpy_from_task(task, dyns, dynamic, size) == size) {
+		for (i = 0; i < size / sizeof(GElf_Dyn); i++) {
+			if (dyns[i].d_tag == DT_NULL)
+				break;
+			if (dyns[i].d_tag == DT_DEBUG) {
+				r_debug = dyns[i].d_un.d_ptr;
+				break;
+			}
+		}
+	}
+
+	free(dyns);
+	return r_debug;
+}
+
+static unsigned long task_r_debug(struct task_struct *task)
+{
+	const struct task_struct_auxv *auxv;
+	struct vm_area_struct *vma;
+	unsigned long addr;
+
+	auxv = task_auxv(task);
+	if (!auxv)
+		return 0;
+
+	addr = exe_dt_debug(task, auxv);
+	if (addr)
+		return addr;
+
+	/* Such as no DT_DEBUG, the dynamic symbols need the peeked ELF */
+	vma = find_vma(task, auxv->auxv_interp);
+	if (vma && vma->leader && vma->leader->vma_elf)
+		addr = vma_dynsym_addr(vma->leader, "_r_debug");
+
+	ulp_debug("Task %d _r_debug %lx\n", task->pid, addr);
+	return addr;
+}
+
+void task_free_link_map(struct task_struct *task)
+{
+	struct task_link_map *m, *tmp;
+
+	list_for_each_entry_safe(m, tmp, &task->link_maps, node) {
+		list_del(&m->node);
+		free(m->name);
+		free(m);
+	}
+	task->nr_link_maps = 0;
+	task->fto_loaded &= ~FTO_LINK_MAP;
+}
+
+/**
+ * Walk the link_map list of target task, drop the old. The list is walked
+ * only if r_debug::r_state is RT_CONSISTENT, otherwise the linker is in
+ * the middle of dlopen(3) or dlclose(3), -EAGAIN is returned.
+ */
+int task_load_link_map(struct task_struct *task)
+{
+	char name[PATH_MAX];
+	struct r_debug rd;
+	struct link_map lm;
+	struct task_link_map *m;
+	struct vm_area_struct *vma;
+	unsigned long addr;
+	int n;
+
+	task_free_link_map(task);
+
+	addr = task_r_debug(task);
+	if (!addr)
+		return -ENOENT;
+
+	if (memcpy_from_task(task, &rd, addr, sizeof(rd)) < sizeof(rd))
+		return -EAGAIN;
+
+	/* Zero version, the linker didn't initialize it yet */
+	if (!rd.r_version || rd.r_state != RT_CONSISTENT) {
+		ulp_debug("Task %d r_debug version %d, state %d\n", task->pid,
+			  rd.r_version, rd.r_state);
+		return -EAGAIN;
+	}
+
+	for (addr = (unsigned long)rd.r_map, n = 0;
+	     addr && n < TASK_LINK_MAP_MAX;
+	     addr = (unsigned long)lm.l_next, n++) {
+		if (memcpy_from_task(task, &lm, addr, sizeof(lm)) < sizeof(lm))
+			goto fail;
+
+		name[0] = '\0';
+		if (lm.l_name && strscpy_from_task(task, name,
+				(unsigned long)lm.l_name, sizeof(name)) < 0)
+			goto fail;
+
+		m = malloc(sizeof(*m));
+		if (!m)
+			goto fail;
+
+		m->name = strdup(name);
+		if (!m->name) {
+			free(m);
+			goto fail;
+		}
+		m->addr = addr;
+		m->l_addr = lm.l_addr;
+		m->l_ld = (unsigned long)lm.l_ld;
+
+		/* .dynamic is in one of the VMAs of the object */
+		vma = m->l_ld ? find_vma(task, m->l_ld) : NULL;
+		m->vma = vma ? vma->leader : NULL;
+
+		list_add(&m->node, &task->link_maps);
+		task->nr_link_maps++;
+	}
+
+	if (addr)
+		ulp_warning("Task %d link_map has more than %d objects.\n",
+			    task->pid, TASK_LINK_MAP_MAX);
+
+	task->fto_loaded |= FTO_LINK_MAP;
+	ulp_debug("Task %d link_map has %ld objects\n", task->pid,
+		  task->nr_link_maps);
+	return 0;
+
+fail:
+	task_free_link_map(task);
+	return -EAGAIN;
+}
+
+struct list_head *task_link_maps(struct task_struct *task)
+{
+	int err;
+
+	if (!(task->fto_loaded & FTO_LINK_MAP)) {
+		err = task_load_link_map(task);
+		if (err) {
+			errno = -err;
+			return NULL;
+		}
+	}
+	return &task->link_maps;
+}
+
+/* The link_map of ELF leader @vma, NULL if not found or not loaded */
+struct task_link_map *vma_link_map(struct vm_area_struct *vma)
+{
+	struct task_struct *task = vma->task;
+	struct task_link_map *m;
+
+	if (!(task->fto_loaded & FTO_LINK_MAP))
+		return NULL;
+
+	list_for_each_entry(m, &task->link_maps, node) {
+		if (m->vma == vma)
+			return m;
+	}
+	return NULL;
+}
+
+int print_task_link_map(FILE *fp, struct task_struct *task)
+{
+	struct list_head *head;
+	struct task_link_map *m;
+
+	head = task_link_maps(task);
+	if (!head)
+		return -errno;
+
+	if (!fp)
+		fp = stdout;
+
+	fprintf(fp, "%-18s %-18s %-18s %s\n", "LINK_MAP", "L_ADDR", "L_LD",
+		"NAME");
+	list_for_each_entry(m, head, node) {
+		fprintf(fp, "%#-18lx %#-18lx %#-18lx %s\n", m->addr, m->l_addr,
+			m->l_ld, m->name[0] ? m->name : task->exe);
+	}
+	return 0;
+}
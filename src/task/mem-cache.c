@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * One cached page of target task memory.
+ */
+struct task_page {
+	/* page aligned address in target task */
+	unsigned long addr;
+	/* struct task_mem_cache.pages */
+	struct rb_node node;
+	/* struct task_mem_cache.lru, the most recently used at head */
+	struct list_head lru;
+	char data[];
+};
+
+static int __page_cmp(struct rb_node *node, unsigned long key)
+{
+	struct task_page *page = rb_entry(node, struct task_page, node);
+
+	if (page->addr > key)
+		return 1;
+	else if (page->addr < key)
+		return -1;
+	return 0;
+}
+
+void task_mem_cache_init(struct task_struct *task, size_t max_pages)
+{
+	struct task_mem_cache *cache = &task->mcache;
+
+	rb_init(&cache->pages);
+	list_init(&cache->lru);
+	cache->nr_pages = 0;
+	cache->max_pages = max_pages;
+	cache->hits = cache->misses = 0;
+	cache->enabled = max_pages > 0;
+}
+
+static void free_page(struct task_mem_cache *cache, struct task_page *page)
+{
+	rb_erase(&page->node, &cache->pages);
+	list_del(&page->lru);
+	free(page);
+	cache->nr_pages--;
+	ulp_mem_account(ULP_MEM_CACHE,
+			-(long)(sizeof(struct task_page) + PAGE_SIZE), -1);
+}
+
+static struct task_page *load_page(struct task_struct *task, unsigned long addr)
+{
+	struct task_mem_cache *cache = &task->mcache;
+	struct task_page *page;
+	ssize_t n;
+
+	/* Evict the least recently used page */
+	if (cache->nr_pages >= cache->max_pages) {
+		page = list_last_entry(&cache->lru, struct task_page, lru);
+		free_page(cache, page);
+	}
+
+	page = malloc(sizeof(struct task_page) + PAGE_SIZE);
+	if (!page)
+		return NULL;
+
+	n = pread(task->proc_mem_fd, page->data, PAGE_SIZE, addr);
+	if (n != PAGE_SIZE) {
+		free(page);
+		return NULL;
+	}
+
+	page->addr = addr;
+	rb_insert_node(&cache->pages, &page->node, __page_cmp, addr);
+	list_add(&page->lru, &cache->lru);
+	cache->nr_pages++;
+	ulp_mem_account(ULP_MEM_CACHE, sizeof(struct task_page) + PAGE_SIZE,
+			1);
+
+	return page;
+}
+
+/**
+ * Read target task memory through page cache.
+ *
+ * Return number of bytes read, -1 if any page can't be cached, then the
+ * caller should read it directly.
+ */
+ssize_t task_mem_cache_read(struct task_struct *task, void *dst,
+			    unsigned long task_src, size_t size)
+{
+	struct task_mem_cache *cache = &task->mcache;
+	struct task_page *page;
+	struct rb_node *rbnode;
+	unsigned long addr, off;
+	size_t copied = 0, len;
+
+	while (copied < size) {
+		addr = PAGE_DOWN(task_src + copied);
+		off = task_src + copied - addr;
+		len = MIN(PAGE_SIZE - off, size - copied);
+
+		rbnode = rb_search_node(&cache->pages, __page_cmp, addr);
+		if (rbnode) {
+			page = rb_entry(rbnode, struct task_page, node);
+			list_move(&page->lru, &cache->lru);
+			cache->hits++;
+		} else {
+			page = load_page(task, addr);
+			if (!page)
+				return -1;
+			cache->misses++;
+		}
+
+		memcpy(dst + copied, page->data + off, len);
+		copied += len;
+	}
+
+	return copied;
+}
+
+/**
+ * Drop all cached pages overlap [addr, addr + size), call it when target
+ * memory was modified, unmapped or protection changed.
+ */
+void task_mem_cache_invalidate(struct task_struct *task, unsigned long addr,
+			       size_t size)
+{
+	struct task_mem_cache *cache = &task->mcache;
+	struct task_page *page;
+	struct rb_node *rbnode;
+	unsigned long start, end;
+
+	if (!cache->nr_pages)
+		return;
+
+	start = PAGE_DOWN(addr);
+	end = PAGE_UP(addr + size);
+
+	/* Huge range, just drop all pages */
+	if ((end - start) / PAGE_SIZE > cache->nr_pages) {
+		task_mem_cache_destroy(task);
+		return;
+	}
+
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		rbnode = rb_search_node(&cache->pages, __page_cmp, addr);
+		if (!rbnode)
+			continue;
+		page = rb_entry(rbnode, struct task_page, node);
+		free_page(cache, page);
+	}
+}
+
+void task_mem_cache_destroy(struct task_struct *task)
+{
+	struct task_mem_cache *cache = &task->mcache;
+	struct task_page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &cache->lru, lru)
+		free_page(cache, page);
+}
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/emit.h>
+#include <task/task.h>
+
+
+/**
+ * Residency of VMAs from /proc/PID/pagemap, one 64-bit entry per page, see
+ * linux:Documentation/admin-guide/mm/pagemap.rst. The entries are read
+ * PAGEMAP_BATCH a time, a VMA of 100GB with 4K pages takes 400 reads of
+ * 512KB, and the counting loop has no branch, thus compiler vectorizes it.
+ *
+ * pagemap has no THP flag, a PMD mapped THP is the PMD aligned run of
+ * present pages, of which the PFNs are contiguous and start at PMD aligned
+ * PFN. The PFNs are zero without CAP_SYS_ADMIN, then THP is unknown.
+ */
+
+/* Entries read once, the batch span is multiple of PMD size */
+#define PAGEMAP_BATCH	(SZ_512K / sizeof(uint64_t))
+
+/* Number of PTEs of one page table, also the pages of one PMD */
+#define PMD_NR_PAGES	(PAGE_SIZE / sizeof(uint64_t))
+
+static bool pagemap_is_thp(const uint64_t *pm, size_t nr)
+{
+	uint64_t pfn = pm[0] & PM_PFN_MASK;
+	size_t i;
+
+	if (!(pm[0] & PM_PRESENT) || !pfn || (pfn & (nr - 1)))
+		return false;
+
+	for (i = 1; i < nr; i++) {
+		if ((pm[i] & (PM_PRESENT | PM_PFN_MASK)) !=
+		    (PM_PRESENT | (pfn + i)))
+			return false;
+	}
+	return true;
+}
+
+static int pagemap_vma_residency(int fd, uint64_t *pm,
+				 struct vm_area_struct *vma,
+				 struct task_vma_residency *res)
+{
+	unsigned long addr, next, span, pmd_size;
+	unsigned long present, swapped;
+	uint64_t pfn = 0;
+	size_t i, n;
+
+	memset(res, 0, sizeof(*res));
+
+	/* [vsyscall] is beyond TASK_SIZE, not in pagemap */
+	if (vma->type == VMA_VSYSCALL)
+		return 0;
+
+	span = PAGEMAP_BATCH * PAGE_SIZE;
+	pmd_size = PMD_NR_PAGES * PAGE_SIZE;
+
+	for (addr = vma->vm_start; addr < vma->vm_end; addr = next) {
+		/* Align batch to span, never split a PMD into two batches */
+		next = MIN(ROUND_DOWN(addr, span) + span, vma->vm_end);
+		n = (next - addr) / PAGE_SIZE;
+
+		if (pread(fd, pm, n * sizeof(pm[0]),
+			  addr / PAGE_SIZE * sizeof(pm[0])) != n * sizeof(pm[0])) {
+			ulp_error("Read pagemap of %d at 0x%lx failed, %m\n",
+				  vma->task->pid, addr);
+			return -EIO;
+		}
+
+		present = swapped = 0;
+		for (i = 0; i < n; i++) {
+			present += !!(pm[i] & PM_PRESENT);
+			swapped += !!(pm[i] & PM_SWAP);
+			/* Swap offset is not PFN, mask with present */
+			pfn |= pm[i] & PM_PFN_MASK & -!!(pm[i] & PM_PRESENT);
+		}
+		res->present += present;
+		res->swapped += swapped;
+
+		for (i = (ROUND_UP(addr, pmd_size) - addr) / PAGE_SIZE;
+		     i + PMD_NR_PAGES <= n; i += PMD_NR_PAGES) {
+			if (pagemap_is_thp(pm + i, PMD_NR_PAGES))
+				res->thp += PMD_NR_PAGES;
+		}
+	}
+
+	res->pfn = !!pfn;
+	return 0;
+}
+
+static int pagemap_open(struct task_struct *task, uint64_t **pm)
+{
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", task->pid);
+	fd = task_proc_open(task, "pagemap", O_RDONLY);
+	if (fd < 0) {
+		ulp_error("Open %s failed, %m\n", path);
+		return -errno;
+	}
+
+	*pm = malloc(PAGEMAP_BATCH * sizeof(uint64_t));
+	if (!*pm) {
+		close(fd);
+		return -ENOMEM;
+	}
+	return fd;
+}
+
+int task_vma_residency(struct task_struct *task, struct vm_area_struct *vma,
+		       struct task_vma_residency *res)
+{
+	uint64_t *pm;
+	int fd, ret;
+
+	fd = pagemap_open(task, &pm);
+	if (fd < 0)
+		return fd;
+
+	ret = pagemap_vma_residency(fd, pm, vma, res);
+
+	free(pm);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Residency of the first @nr VMAs in address order into @res, by one open
+ * of pagemap. Return the number of VMAs, or -errno.
+ */
+int task_vmas_residency(struct task_struct *task,
+			struct task_vma_residency *res, unsigned int nr)
+{
+	struct vm_area_struct *vma;
+	unsigned int i = 0;
+	uint64_t *pm;
+	int fd, ret = 0;
+
+	fd = pagemap_open(task, &pm);
+	if (fd < 0)
+		return fd;
+
+	list_for_each_entry(vma, &task->vma_list, node_list) {
+		if (i >= nr)
+			break;
+		ret = pagemap_vma_residency(fd, pm, vma, &res[i]);
+		if (ret)
+			break;
+		i++;
+	}
+
+	free(pm);
+	close(fd);
+	return ret ?: i;
+}
+
+void dump_task_vmas_residency(FILE *fp, struct task_struct *task)
+{
+	unsigned long present = 0, swapped = 0, thp = 0;
+	struct task_vma_residency res;
+	struct vm_area_struct *vma;
+	unsigned long kb;
+	bool pfn = false;
+	uint64_t *pm;
+	char buf[32];
+	int fd;
+
+	fp = fp ?: stdout;
+
+	fd = pagemap_open(task, &pm);
+	if (fd < 0)
+		return;
+
+	kb = PAGE_SIZE / SZ_1K;
+
+	fprintf(fp, "%16s %16s %4s %10s %10s %10s %s\n",
+		"Start", "End", "Perm", "Rss(KB)", "Swap(KB)", "THP(KB)",
+		"Name");
+
+	list_for_each_entry(vma, &task->vma_list, node_list) {
+		if (pagemap_vma_residency(fd, pm, vma, &res))
+			break;
+
+		present += res.present;
+		swapped += res.swapped;
+		thp += res.thp;
+		pfn |= res.pfn;
+
+		/* No present page, no PFN to check */
+		if (res.pfn || !res.present)
+			snprintf(buf, sizeof(buf), "%lu", res.thp * kb);
+		else
+			snprintf(buf, sizeof(buf), "-");
+
+		fprintf(fp, "%016lx-%016lx %4s %10lu %10lu %10s %s\n",
+			vma->vm_start, vma->vm_end, vma->perms,
+			res.present * kb, res.swapped * kb, buf, vma->name_);
+	}
+
+	if (pfn)
+		snprintf(buf, sizeof(buf), "%lu", thp * kb);
+	else
+		snprintf(buf, sizeof(buf), "-");
+
+	fprintf(fp, "%38s %10lu %10lu %10s\n", "Total:", present * kb,
+		swapped * kb, buf);
+	if (!pfn)
+		fprintf(fp, "\nTHP need PFN of pagemap, need CAP_SYS_ADMIN.\n");
+
+	free(pm);
+	close(fd);
+}
+
+void emit_task_vmas_residency(struct emitter *e, struct task_struct *task)
+{
+	struct task_vma_residency res;
+	struct vm_area_struct *vma;
+	uint64_t *pm;
+	int fd;
+
+	fd = pagemap_open(task, &pm);
+	if (fd < 0)
+		return;
+
+	list_for_each_entry(vma, &task->vma_list, node_list) {
+		if (pagemap_vma_residency(fd, pm, vma, &res))
+			break;
+		emit_vma(e, vma, &res);
+	}
+
+	free(pm);
+	close(fd);
+}
@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Stable handles of task, the pidfd refers to the process itself, not the
+ * pid number, and the /proc/PID directory fd, which is opened only if the
+ * pidfd is alive after it, thus it's the directory of the same process. All
+ * /proc/PID files of task are opened by openat(2) on it, no more path walk
+ * of /proc and pid, and never the files of another process with reused pid.
+ *
+ * pidfd_open(2) is Linux 5.3, pidfd_getfd(2) is Linux 5.6, without them the
+ * /proc/PID directory is still used.
+ *
+ * If task is in another mount namespace, such as a container, the root of
+ * it is opened too, the exe and VMA names of task are paths in its mount
+ * namespace, they are resolved under the root, see task_path(), no setns(2)
+ * and no walk of /proc/PID/root for each test of existence.
+ */
+
+/* Same number on all architectures */
+#ifndef SYS_pidfd_open
+# define SYS_pidfd_open		434
+#endif
+#ifndef SYS_pidfd_getfd
+# define SYS_pidfd_getfd	438
+#endif
+
+static int sys_pidfd_open(pid_t pid, unsigned int flags)
+{
+	return syscall(SYS_pidfd_open, pid, flags);
+}
+
+static int sys_pidfd_getfd(int pidfd, int targetfd, unsigned int flags)
+{
+	return syscall(SYS_pidfd_getfd, pidfd, targetfd, flags);
+}
+
+/* The pidfd is readable once the process exits, zombie included */
+static bool pidfd_exited(int pidfd)
+{
+	struct pollfd pfd = {
+		.fd = pidfd,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/* The mount namespace of ulpatch itself, never changed */
+static bool self_mnt_ns(struct stat *st)
+{
+	static struct stat self_st;
+	static int loaded = 0;
+
+	if (!loaded)
+		loaded = stat("/proc/self/ns/mnt", &self_st) ? -1 : 1;
+	if (loaded < 0)
+		return false;
+
+	*st = self_st;
+	return true;
+}
+
+/* Open the root of task if it is in another mount namespace */
+static void task_open_root(struct task_struct *task)
+{
+	struct stat self_st, st;
+
+	if (!self_mnt_ns(&self_st) || task_proc_stat(task, "ns/mnt", &st))
+		return;
+	if (st.st_dev == self_st.st_dev && st.st_ino == self_st.st_ino)
+		return;
+
+	task->root_dirfd = openat(task->proc_dirfd, "root",
+				  O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (task->root_dirfd < 0)
+		ulp_warning("open /proc/%d/root failed, %m\n", task->pid);
+	else
+		ulp_debug("%d is in another mount namespace.\n", task->pid);
+}
+
+int task_open_handles(struct task_struct *task)
+{
+	char path[64];
+	int err;
+
+	task->root_dirfd = -1;
+	task->pidfd = sys_pidfd_open(task->pid, 0);
+	if (task->pidfd < 0)
+		ulp_debug("pidfd_open %d failed, %m\n", task->pid);
+
+	snprintf(path, sizeof(path), "/proc/%d", task->pid);
+	task->proc_dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (task->proc_dirfd < 0) {
+		err = -errno;
+		ulp_error("open %s failed, %m\n", path);
+		goto close;
+	}
+
+	/* Exited and the pid reused between pidfd_open() and open() */
+	if (task->pidfd >= 0 && pidfd_exited(task->pidfd)) {
+		ulp_error("pid %d exited.\n", task->pid);
+		err = -ESRCH;
+		goto close;
+	}
+
+	task_open_root(task);
+	return 0;
+
+close:
+	task_close_handles(task);
+	return err;
+}
+
+void task_close_handles(struct task_struct *task)
+{
+	if (task->pidfd > STDERR_FILENO)
+		close(task->pidfd);
+	if (task->proc_dirfd > STDERR_FILENO)
+		close(task->proc_dirfd);
+	if (task->root_dirfd > STDERR_FILENO)
+		close(task->root_dirfd);
+	task->pidfd = -1;
+	task->proc_dirfd = -1;
+	task->root_dirfd = -1;
+}
+
+/**
+ * The process of task is not exited, the pid maybe reused if not, only
+ * accurate with pidfd.
+ */
+bool task_alive(struct task_struct *task)
+{
+	if (task->pidfd >= 0)
+		return !pidfd_exited(task->pidfd);
+	return proc_pid_exist(task->pid);
+}
+
+/**
+ * Open /proc/PID/@name of task, such as "maps", "mem" and "fd/3", return
+ * the fd or -1 with errno set.
+ */
+int task_proc_open(struct task_struct *task, const char *name, int flags)
+{
+	char path[PATH_MAX];
+
+	if (task->proc_dirfd >= 0)
+		return openat(task->proc_dirfd, name, flags | O_CLOEXEC);
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", task->pid, name);
+	return open(path, flags | O_CLOEXEC);
+}
+
+/* readlink(2) /proc/PID/@name, @buf is NUL terminated if success */
+ssize_t task_proc_readlink(struct task_struct *task, const char *name,
+			   char *buf, size_t bufsz)
+{
+	char path[PATH_MAX];
+	ssize_t ret;
+
+	if (task->proc_dirfd >= 0) {
+		ret = readlinkat(task->proc_dirfd, name, buf, bufsz - 1);
+	} else {
+		snprintf(path, sizeof(path), "/proc/%d/%s", task->pid, name);
+		ret = readlink(path, buf, bufsz - 1);
+	}
+	if (ret >= 0)
+		buf[ret] = '\0';
+	return ret;
+}
+
+/* stat(2) /proc/PID/@name, follow the symlink, such as fd/N */
+int task_proc_stat(struct task_struct *task, const char *name,
+		   struct stat *st)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (task->proc_dirfd >= 0) {
+		ret = fstatat(task->proc_dirfd, name, st, 0);
+	} else {
+		snprintf(path, sizeof(path), "/proc/%d/%s", task->pid, name);
+		ret = stat(path, st);
+	}
+	return ret ? -errno : 0;
+}
+
+/**
+ * The @path of task's mount namespace, such as the exe and VMA name, in
+ * ulpatch's mount namespace, it's /proc/PID/root/@path if task is in
+ * another one, otherwise @path itself. The paths from kernel are resolved
+ * already, thus no absolute symlink under /proc/PID/root in them.
+ */
+const char *task_path(struct task_struct *task, const char *path, char *buf,
+		      size_t bufsz)
+{
+	if (task->root_dirfd < 0 || path[0] != '/')
+		return path;
+
+	snprintf(buf, bufsz, "/proc/%d/root%s", task->pid, path);
+	return buf;
+}
+
+/* fexist() of @path in task's mount namespace, relative to its root */
+bool task_path_exist(struct task_struct *task, const char *path)
+{
+	struct stat st;
+
+	if (task->root_dirfd < 0 || path[0] != '/')
+		return fexist(path);
+
+	return !fstatat(task->root_dirfd, path + 1, &st, 0);
+}
+
+/* Read this much of directory entries once, thousands of fds */
+#define PROC_DIRENT_BUF_SIZE	(64 * 1024)
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/**
+ * Call @cb for each numeric entry of /proc/PID/@name directory, such as
+ * fd/ and task/, stop if @cb returns non-zero. The entries are read by
+ * getdents64(2) in large batches, no DIR stream and no allocation for each
+ * entry. Return 0, the non-zero of @cb, or negative errno.
+ */
+int task_proc_readdir(struct task_struct *task, const char *name,
+		      int (*cb)(struct task_struct *task, int num, void *arg),
+		      void *arg)
+{
+	struct linux_dirent64 *d;
+	int dirfd, num, ret = 0;
+	long n, off;
+	char *buf, *p;
+
+	dirfd = task_proc_open(task, name, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0)
+		return -errno;
+
+	buf = malloc(PROC_DIRENT_BUF_SIZE);
+	if (!buf) {
+		close(dirfd);
+		return -ENOMEM;
+	}
+
+	while (!ret && (n = syscall(SYS_getdents64, dirfd, buf,
+				    PROC_DIRENT_BUF_SIZE)) > 0) {
+		for (off = 0; off < n && !ret; off += d->d_reclen) {
+			d = (void *)(buf + off);
+
+			/* Skip "." and ".." */
+			num = 0;
+			for (p = d->d_name; *p >= '0' && *p <= '9'; p++)
+				num = num * 10 + (*p - '0');
+			if (*p || p == d->d_name)
+				continue;
+
+			ret = cb(task, num, arg);
+		}
+	}
+	if (n < 0 && !ret)
+		ret = -errno;
+
+	free(buf);
+	close(dirfd);
+	return ret;
+}
+
+/**
+ * Duplicate the file descriptor @fd of task into current process, which is
+ * the same open file description, the file offset is shared. Fallback to
+ * open /proc/PID/fd/@fd read only, which is a new open file description.
+ * Return the new fd or negative errno.
+ */
+int task_getfd(struct task_struct *task, int fd)
+{
+	char name[32];
+	int newfd;
+
+	if (task->pidfd >= 0) {
+		newfd = sys_pidfd_getfd(task->pidfd, fd, 0);
+		if (newfd >= 0)
+			return newfd;
+		if (errno != ENOSYS)
+			ulp_debug("pidfd_getfd %d:%d failed, %m\n", task->pid,
+				  fd);
+	}
+
+	snprintf(name, sizeof(name), "fd/%d", fd);
+	newfd = task_proc_open(task, name, O_RDONLY);
+	return newfd < 0 ? -errno : newfd;
+}
@@ -12,10 +12,13 @@
 #include <stdlib.h>
 #include <elf.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include <elf/elf-api.h>
 
 #include <utils/log.h>
+#include <utils/util.h>
 #include <task/task.h>
 
 
@@ -55,3 +58,128 @@ int open_pid_mem_rw(pid_t pid)
 	return __open_pid_mem(pid, O_RDWR);
 }
 
+
+#define PROC_GC_MAX_THREADS	64
+
+struct proc_gc {
+	int root_fd;
+	pid_t *pids;
+	unsigned int nr_pids;
+	/* The next one to be removed */
+	unsigned int next;
+	struct task_proc_gc_stats stats;
+};
+
+static void *proc_gc_worker(void *arg)
+{
+	struct proc_gc *gc = arg;
+	char name[16];
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&gc->next, 1, __ATOMIC_RELAXED)) <
+	       gc->nr_pids) {
+		snprintf(name, sizeof(name), "%d", gc->pids[i]);
+		if (fremove_recursive_at(gc->root_fd, name))
+			__atomic_fetch_add(&gc->stats.nr_errors, 1,
+					   __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&gc->stats.nr_removed, 1,
+					   __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* The ULP_PROC_ROOT_DIR/PID of the exited processes */
+static int proc_gc_list(struct proc_gc *gc)
+{
+	unsigned int cap = 0;
+	struct dirent *dp;
+	pid_t pid, *pids;
+	char *end;
+	DIR *dir;
+	int fd;
+
+	fd = openat(gc->root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return -errno;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		pid = strtol(dp->d_name, &end, 10);
+		/* Such as ULP_SYM_CACHE_DIR */
+		if (pid <= 0 || *end != '\0')
+			continue;
+		gc->stats.nr_dirs++;
+		if (proc_pid_exist(pid))
+			continue;
+
+		if (gc->nr_pids == cap) {
+			cap = MAX(cap * 2, 64U);
+			pids = realloc(gc->pids, cap * sizeof(*pids));
+			if (!pids) {
+				closedir(dir);
+				return -ENOMEM;
+			}
+			gc->pids = pids;
+		}
+		gc->pids[gc->nr_pids++] = pid;
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+/**
+ * Remove ULP_PROC_ROOT_DIR/PID of the processes exited without closed by
+ * ULPatch, such as killed while patched, by @nr_threads threads, 0 means
+ * the number of online CPUs. The directories are removed relative to the
+ * opened ULP_PROC_ROOT_DIR, see fremove_recursive_at().
+ */
+int task_proc_gc(int nr_threads, struct task_proc_gc_stats *stats)
+{
+	pthread_t threads[PROC_GC_MAX_THREADS];
+	struct proc_gc gc = {};
+	int i, err;
+
+	gc.root_fd = open(ULP_PROC_ROOT_DIR,
+			  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (gc.root_fd < 0) {
+		err = errno == ENOENT ? 0 : -errno;
+		goto out;
+	}
+
+	err = proc_gc_list(&gc);
+	if (err)
+		goto close;
+
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* The caller is one of them */
+	nr_threads = MIN(MIN(nr_threads, gc.nr_pids) - 1, PROC_GC_MAX_THREADS);
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, proc_gc_worker, &gc))
+			break;
+	}
+	nr_threads = i;
+
+	proc_gc_worker(&gc);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	ulp_debug("Remove %u of %u %s/PID by %d threads, %u failed.\n",
+		  gc.stats.nr_removed, gc.stats.nr_dirs, ULP_PROC_ROOT_DIR,
+		  nr_threads + 1, gc.stats.nr_errors);
+close:
+	close(gc.root_fd);
+	free(gc.pids);
+out:
+	if (stats)
+		*stats = gc.stats;
+	return err;
+}
@@ -0,0 +1,718 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include <utils/log.h>
+#include <task/task.h>
+
+
+/**
+ * Signal-based quiescence, an alternative of task_freeze_threads() without
+ * ptrace stop of the thread group, like the RCU quiescent state.
+ *
+ * A tiny signal handler is injected into one page of memfd, which is
+ * mapped in both target and current process. Every thread is sent a
+ * real-time signal, the handler checks the interrupted PC against the
+ * ranges to be rewritten, if it's outside, checks in and waits on the
+ * futex of the page, otherwise counts busy and returns. Once all threads
+ * checked in, no one can execute the ranges or create thread, the text is
+ * written through /proc/PID/mem, then the threads are released by one
+ * FUTEX_WAKE. The threads are paused only for the write.
+ *
+ * Only the PC is checked, not the return addresses of stack, see
+ * task_check_stacks(). The page is never unmapped, a late handler of
+ * pending signal may run in it, it's reused by the next quiescence. The
+ * signal is sent by rt_tgsigqueueinfo(2) with the generation of the
+ * round, the late one of old round is ignored by handler.
+ *
+ * A thread waits at most TASK_QUIESCE_HOLD_NS for each wakeup, if current
+ * process is killed, the threads escape and count it. Thus the caller must
+ * call task_quiesce_check() right before the write, which fails once any
+ * thread escaped, or the first half of the hold is over, the write may
+ * outlast the hold.
+ */
+
+#if !defined(MFD_CLOEXEC)
+# define MFD_CLOEXEC	0x0001U
+#endif
+
+#define TASK_QUIESCE_MAGIC	"ulpquies"
+#define TASK_QUIESCE_VERSION	1
+#define TASK_QUIESCE_NAME	"ulpatch-quiesce"
+#define TASK_QUIESCE_CODE_OFF	2048
+#define TASK_QUIESCE_HOLD_NS	1000000000UL
+
+/* Try the signals from SIGRTMAX down, the first unused one is taken */
+#define TASK_QUIESCE_SIG_MAX	64
+#define TASK_QUIESCE_NR_SIGS	8
+
+/* struct sigaction of kernel, for rt_sigaction(2) */
+struct ksigaction {
+	unsigned long handler;
+	unsigned long flags;
+	unsigned long restorer;
+	unsigned long mask;
+};
+
+#ifndef SA_RESTORER
+# define SA_RESTORER	0x04000000
+#endif
+
+/**
+ * The page shared with target task, the fields accessed by handler are
+ * less than 128 bytes offset, see quiesce_code().
+ */
+struct task_quiesce_page {
+	char magic[8];
+	uint32_t version;
+	/* The generation of current round, the si_value of signal */
+	uint32_t gen;
+	uint32_t arrived;
+	uint32_t busy;
+	/* Futex, the threads of round wait until it's the generation */
+	uint32_t release;
+	uint32_t escaped;
+	uint32_t nr_ranges;
+	uint32_t pad;
+	unsigned long busy_pc;
+	struct timespec hold;
+	struct task_addr_range ranges[TASK_QUIESCE_MAX_RANGES];
+	struct ksigaction act;
+	struct ksigaction oldact;
+};
+
+struct task_quiesce {
+	struct task_quiesce_page *page;
+	size_t size;
+	unsigned long remote;
+	int sig;
+	/* All threads checked in, see task_quiesce_threads() */
+	bool parked;
+	/* Before any thread of the round waits, see task_quiesce_check() */
+	unsigned long park_ns;
+};
+
+#define QOFF(field)	offsetof(struct task_quiesce_page, field)
+
+/**
+ * Write the handler code at @code, return the length, the offset of
+ * restorer is returned by @restorer, 0 if none.
+ */
+static size_t quiesce_code(void *code, size_t *restorer)
+{
+	size_t pc_off = offsetof(ucontext_t, uc_mcontext) +
+#if defined(__x86_64__)
+		offsetof(mcontext_t, gregs[REG_RIP]);
+	int32_t base = -(int32_t)(TASK_QUIESCE_CODE_OFF + 22);
+	unsigned char insn[] = {
+		/* endbr64 */
+		0xf3, 0x0f, 0x1e, 0xfa,
+		/* mov si_value(%rsi), %r9d */
+		0x44, 0x8b, 0x4e, offsetof(siginfo_t, si_value),
+		/* mov pc_off(%rdx), %rax */
+		0x48, 0x8b, 0x82, 0, 0, 0, 0,
+		/* lea page(%rip), %rsi */
+		0x48, 0x8d, 0x35, 0, 0, 0, 0,
+		/* cmp gen(%rsi), %r9d; jne out */
+		0x44, 0x3b, 0x4e, QOFF(gen),
+		0x75, 0x52,
+		/* mov nr_ranges(%rsi), %ecx; lea ranges(%rsi), %rdi */
+		0x8b, 0x4e, QOFF(nr_ranges),
+		0x48, 0x8d, 0x7e, QOFF(ranges),
+		/* loop: test %ecx, %ecx; jz arrive */
+		0x85, 0xc9,
+		0x74, 0x1c,
+		/* cmp (%rdi), %rax; jb next; cmp 8(%rdi), %rax; jb busy */
+		0x48, 0x3b, 0x07,
+		0x72, 0x06,
+		0x48, 0x3b, 0x47, 0x08,
+		0x72, 0x08,
+		/* next: add $16, %rdi; dec %ecx; jmp loop */
+		0x48, 0x83, 0xc7, 0x10,
+		0xff, 0xc9,
+		0xeb, 0xe9,
+		/* busy: mov %rax, busy_pc(%rsi); lock incl busy(%rsi); ret */
+		0x48, 0x89, 0x46, QOFF(busy_pc),
+		0xf0, 0xff, 0x46, QOFF(busy),
+		0xc3,
+		/* arrive: lock incl arrived(%rsi) */
+		0xf0, 0xff, 0x46, QOFF(arrived),
+		/* wait: mov release(%rsi), %edx, out if released our round */
+		0x8b, 0x56, QOFF(release),
+		/* mov %edx, %eax; sub %r9d, %eax; jns out */
+		0x89, 0xd0,
+		0x44, 0x29, 0xc8,
+		0x79, 0x1d,
+		/* futex(&release, FUTEX_WAIT, %edx, &hold) */
+		0x56,
+		0x48, 0x8d, 0x7e, QOFF(release),
+		0x31, 0xf6,
+		0x4c, 0x8d, 0x57, QOFF(hold) - QOFF(release),
+		0xb8, __NR_futex, 0x00, 0x00, 0x00,
+		0x0f, 0x05,
+		0x5e,
+		/* cmp $-ETIMEDOUT, %rax; jne wait; lock incl escaped(%rsi) */
+		0x48, 0x83, 0xf8, (unsigned char)-ETIMEDOUT,
+		0x75, 0xdd,
+		0xf0, 0xff, 0x46, QOFF(escaped),
+		/* out: ret */
+		0xc3,
+		/* padding */
+		0xcc,
+		/* restorer: mov $__NR_rt_sigreturn, %rax; syscall */
+		0x48, 0xc7, 0xc0, __NR_rt_sigreturn, 0x00, 0x00, 0x00,
+		0x0f, 0x05,
+	};
+	int32_t off = pc_off;
+
+	memcpy(insn + 11, &off, 4);
+	memcpy(insn + 18, &base, 4);
+	*restorer = 112;
+#elif defined(__aarch64__)
+		offsetof(mcontext_t, pc);
+	int32_t base = -(int32_t)(TASK_QUIESCE_CODE_OFF + 8);
+	uint32_t insn[] = {
+		/* ldr w12, [x1, #si_value] */
+		0xb940002c | (offsetof(siginfo_t, si_value) / 4) << 10,
+		/* ldr x3, [x2, #pc_off] */
+		0xf9400043 | (pc_off / 8) << 10,
+		/* adr x4, page */
+		0x10000004 | (base & 0x3) << 29 | (base >> 2 & 0x7ffff) << 5,
+		/* ldr w5, [x4, #gen]; cmp w12, w5; b.ne out */
+		0xb9400085 | (QOFF(gen) / 4) << 10,
+		0x6b05019f,
+		0x54000501,
+		/* ldr w5, [x4, #nr_ranges]; add x6, x4, #ranges */
+		0xb9400085 | (QOFF(nr_ranges) / 4) << 10,
+		0x91000086 | QOFF(ranges) << 10,
+		/* loop: cbz w5, arrive */
+		0x34000205,
+		/* ldp x7, x8, [x6]; cmp x3, x7; b.lo next */
+		0xa94020c7,
+		0xeb07007f,
+		0x54000063,
+		/* cmp x3, x8; b.lo busy */
+		0xeb08007f,
+		0x54000083,
+		/* next: add x6, x6, #16; sub w5, w5, #1; b loop */
+		0x910040c6,
+		0x510004a5,
+		0x17fffff8,
+		/* busy: str x3, [x4, #busy_pc]; add x9, x4, #busy */
+		0xf9000083 | (QOFF(busy_pc) / 8) << 10,
+		0x91000089 | QOFF(busy) << 10,
+		/* 1: ldxr w10, [x9]; add w10, w10, #1; stlxr w11, w10, [x9] */
+		0x885f7d2a,
+		0x1100054a,
+		0x880bfd2a,
+		/* cbnz w11, 1b; ret */
+		0x35ffffab,
+		0xd65f03c0,
+		/* arrive: add x9, x4, #arrived; atomic increment */
+		0x91000089 | QOFF(arrived) << 10,
+		0x885f7d2a,
+		0x1100054a,
+		0x880bfd2a,
+		0x35ffffab,
+		/* add x0, x4, #release */
+		0x91000080 | QOFF(release) << 10,
+		/* wait: ldar w2, [x0]; sub w13, w2, w12; tbz w13, #31, out */
+		0x88dffc02,
+		0x4b0c004d,
+		0x36f801ad,
+		/* futex(&release, FUTEX_WAIT, w2, &hold) */
+		0xd2800001,
+		0x91000083 | QOFF(hold) << 10,
+		0xd2800008 | __NR_futex << 5,
+		0xd4000001,
+		/* cmn x0, #ETIMEDOUT; add x0, x4, #release; b.ne wait */
+		0xb100001f | ETIMEDOUT << 10,
+		0x91000080 | QOFF(release) << 10,
+		0x54fffee1,
+		/* add x9, x4, #escaped; atomic increment */
+		0x91000089 | QOFF(escaped) << 10,
+		0x885f7d2a,
+		0x1100054a,
+		0x880bfd2a,
+		0x35ffffab,
+		/* out: ret */
+		0xd65f03c0,
+	};
+
+	/* The kernel returns to the sigreturn trampoline of vDSO */
+	*restorer = 0;
+#else
+# error "Unsupport architecture"
+#endif
+	memcpy(code, insn, sizeof(insn));
+	return sizeof(insn);
+}
+
+/* Some thread of task blocks @sig, see SigBlk of /proc/PID/task/TID/status */
+static bool sig_blocked(struct task_struct *task, int sig)
+{
+	struct thread *thread;
+	char path[PATH_MAX], line[256];
+	unsigned long mask;
+	bool blocked = false;
+	FILE *fp;
+
+	list_for_each_entry(thread, &task->threads_list, node) {
+		snprintf(path, sizeof(path), "/proc/%d/task/%d/status",
+			 task->pid, thread->tid);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		while (fgets(line, sizeof(line), fp)) {
+			if (sscanf(line, "SigBlk: %lx", &mask) == 1) {
+				blocked = mask & BIT(sig - 1);
+				break;
+			}
+		}
+		fclose(fp);
+		if (blocked)
+			return true;
+	}
+	return false;
+}
+
+/* Map the page left by the last quiescence, see struct task_quiesce */
+static int quiesce_reuse(struct task_struct *task, struct task_quiesce *q)
+{
+	struct vm_area_struct *vma;
+	char path[PATH_MAX];
+	void *mem;
+	int fd;
+
+	task_for_each_vma(vma, task) {
+		if (strstr(vma->name_, "memfd:" TASK_QUIESCE_NAME))
+			break;
+	}
+	if (!vma || vma->vm_end - vma->vm_start != q->size)
+		return -ENOENT;
+
+	snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx",
+		 task->pid, vma->vm_start, vma->vm_end);
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	mem = mmap(NULL, q->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return -errno;
+
+	q->page = mem;
+	if (memcmp(q->page->magic, TASK_QUIESCE_MAGIC, 8) ||
+	    q->page->version != TASK_QUIESCE_VERSION) {
+		munmap(mem, q->size);
+		q->page = NULL;
+		return -ENOEXEC;
+	}
+
+	q->remote = vma->vm_start;
+	return 0;
+}
+
+/* Create the page in target task, the task must be attached */
+static int quiesce_create(struct task_struct *task, struct task_quiesce *q)
+{
+	const char *name = TASK_QUIESCE_NAME;
+	char path[PATH_MAX];
+	int ret, fd, remote_fd;
+	void *mem;
+	struct task_syscall_entry calls[] = {
+		{
+			.nr = __NR_memfd_create,
+			.args = { 0, MFD_CLOEXEC },
+			.data_mask = BIT(0),
+		},
+		{
+			.nr = __NR_ftruncate,
+			.args = { 0, q->size },
+			.ret_mask = BIT(0),
+		},
+		{
+			.nr = __NR_mmap,
+			.args = { 0, q->size,
+				  PROT_READ | PROT_WRITE | PROT_EXEC,
+				  MAP_SHARED, 0, 0 },
+			.ret_mask = BIT(4),
+		},
+	};
+
+	ret = task_syscall_batch(task, calls, ARRAY_SIZE(calls), name,
+				 strlen(name) + 1);
+	if (ret)
+		return ret;
+
+	remote_fd = calls[0].ret;
+	if (remote_fd < 0)
+		return remote_fd;
+
+	if (calls[1].ret || !calls[2].ret || calls[2].ret > -4096UL) {
+		ret = -ENOMEM;
+		goto close;
+	}
+	q->remote = calls[2].ret;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", task->pid, remote_fd);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		goto unmap;
+	}
+
+	mem = mmap(NULL, q->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		ret = -errno;
+		goto unmap;
+	}
+
+	q->page = mem;
+	memcpy(q->page->magic, TASK_QUIESCE_MAGIC, 8);
+	q->page->version = TASK_QUIESCE_VERSION;
+	q->page->hold.tv_sec = TASK_QUIESCE_HOLD_NS / 1000000000UL;
+	q->page->hold.tv_nsec = TASK_QUIESCE_HOLD_NS % 1000000000UL;
+	goto close;
+
+unmap:
+	task_munmap(task, q->remote, q->size);
+close:
+	task_close(task, remote_fd);
+	return ret;
+}
+
+/* rt_sigaction(2) of @act and @oldact in the page, the index or -1 */
+static int quiesce_sigaction(struct task_struct *task, struct task_quiesce *q,
+			     int sig, bool set, bool get)
+{
+	unsigned long res;
+	int ret;
+
+	ret = task_syscall(task, __NR_rt_sigaction, sig,
+			   set ? q->remote + QOFF(act) : 0,
+			   get ? q->remote + QOFF(oldact) : 0,
+			   sizeof(q->page->act.mask), 0, 0, &res);
+	if (ret < 0)
+		return ret;
+	return res;
+}
+
+/**
+ * Map the page, or reuse it, install the handler of an unused signal,
+ * which is not blocked by any thread.
+ */
+static int task_quiesce_begin(struct task_struct *task)
+{
+	struct task_quiesce *q;
+	unsigned char *code;
+	size_t restorer;
+	int i, sig, ret;
+
+	if (!(task->fto_flag & FTO_THREADS))
+		return -EOPNOTSUPP;
+	if (!task_threads(task))
+		return -errno;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return -ENOMEM;
+	q->size = ulp_page_size();
+
+	ret = task_attach_session(task);
+	if (ret)
+		goto free;
+
+	if (quiesce_reuse(task, q)) {
+		ret = quiesce_create(task, q);
+		if (ret) {
+			ulp_error("Create quiesce page failed, %s.\n",
+				  strerror(-ret));
+			goto detach;
+		}
+	}
+
+	/* The same bytes if reused, a late handler running it is fine */
+	code = (void *)q->page + TASK_QUIESCE_CODE_OFF;
+	quiesce_code(code, &restorer);
+	__builtin___clear_cache((void *)code, (void *)q->page + q->size);
+
+	q->page->act.handler = q->remote + TASK_QUIESCE_CODE_OFF;
+	q->page->act.flags = SA_SIGINFO | SA_RESTART;
+	q->page->act.restorer = 0;
+	if (restorer) {
+		q->page->act.flags |= SA_RESTORER;
+		q->page->act.restorer = q->page->act.handler + restorer;
+	}
+	/* The other signals wait the handler */
+	q->page->act.mask = ~0UL;
+
+	ret = -EBUSY;
+	for (i = 0; i < TASK_QUIESCE_NR_SIGS; i++) {
+		sig = TASK_QUIESCE_SIG_MAX - i;
+		if (quiesce_sigaction(task, q, sig, false, true) ||
+		    q->page->oldact.handler != (unsigned long)SIG_DFL ||
+		    sig_blocked(task, sig))
+			continue;
+
+		ret = quiesce_sigaction(task, q, sig, true, false);
+		if (!ret) {
+			q->sig = sig;
+			break;
+		}
+	}
+	if (ret) {
+		ulp_debug("No unused signal of %d to quiesce.\n", task->pid);
+		munmap(q->page, q->size);
+		goto detach;
+	}
+
+	task->quiesce = q;
+	ulp_debug("Quiesce %d by signal %d, page %lx\n", task->pid, sig,
+		  q->remote);
+
+detach:
+	task_detach_session(task);
+free:
+	if (ret)
+		free(q);
+	return ret;
+}
+
+void task_quiesce_free(struct task_struct *task)
+{
+	struct task_quiesce *q = task->quiesce;
+
+	if (!q)
+		return;
+	munmap(q->page, q->size);
+	free(q);
+	task->quiesce = NULL;
+}
+
+/**
+ * Restore the signal action of target task, the page is kept. The signal
+ * ignored first flushes the pending ones, which would terminate the task
+ * by the default action.
+ */
+int task_quiesce_end(struct task_struct *task)
+{
+	struct task_quiesce *q = task->quiesce;
+	int ret;
+
+	if (!q)
+		return 0;
+
+	ret = task_attach_session(task);
+	if (!ret) {
+		q->page->act.handler = (unsigned long)SIG_IGN;
+		ret = quiesce_sigaction(task, q, q->sig, true, false);
+		memcpy(&q->page->act, &q->page->oldact, sizeof(q->page->act));
+		ret = quiesce_sigaction(task, q, q->sig, true, false) ?: ret;
+		task_detach_session(task);
+	}
+	if (ret)
+		ulp_error("Restore signal %d of %d failed.\n", q->sig,
+			  task->pid);
+
+	task_quiesce_free(task);
+	return ret;
+}
+
+static int quiesce_send(struct task_struct *task, struct thread *thread,
+			uint32_t gen)
+{
+	siginfo_t info = {
+		.si_signo = task->quiesce->sig,
+		.si_code = SI_QUEUE,
+	};
+
+	info.si_pid = getpid();
+	info.si_uid = getuid();
+	info.si_value.sival_int = gen;
+
+	if (syscall(__NR_rt_tgsigqueueinfo, task->pid, thread->tid,
+		    info.si_signo, &info))
+		return -errno;
+	return 0;
+}
+
+/* Wake all threads of @q->page->gen */
+static void quiesce_wake(struct task_quiesce *q)
+{
+	uint32_t gen = __atomic_load_n(&q->page->gen, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&q->page->release, gen, __ATOMIC_RELEASE);
+	syscall(__NR_futex, &q->page->release, FUTEX_WAKE, INT_MAX, NULL,
+		NULL, 0);
+	q->parked = false;
+}
+
+/**
+ * Park all threads of target task in the handler, outside the @nr
+ * @ranges, within @budget_ns, the same as task_check_stacks(), return
+ * -EBUSY if any thread is executing them, -ETIME if some thread doesn't
+ * check in, such as stopped, or the other errno, then the caller should
+ * use task_freeze_threads(). Call task_quiesce_release() to resume.
+ */
+int task_quiesce_threads(struct task_struct *task,
+			 const struct task_addr_range *ranges, int nr,
+			 unsigned long budget_ns,
+			 struct task_stack_stats *stats)
+{
+	struct task_quiesce_page *page;
+	unsigned int sent = 0, done;
+	struct thread *thread, *tmp;
+	unsigned long start = nsecs();
+	uint32_t gen;
+	int ret, round;
+
+	memset(stats, 0, sizeof(*stats));
+
+	if (nr > TASK_QUIESCE_MAX_RANGES)
+		return -E2BIG;
+
+	if (!task->quiesce) {
+		ret = task_quiesce_begin(task);
+		if (ret)
+			return ret;
+	}
+	page = task->quiesce->page;
+
+	memcpy(page->ranges, ranges, nr * sizeof(*ranges));
+	page->nr_ranges = nr;
+	page->arrived = 0;
+	page->busy = 0;
+	page->escaped = 0;
+	gen = page->gen + 1;
+	/* Never the released one, see quiesce_wake() */
+	if (gen == page->release)
+		gen++;
+	__atomic_store_n(&page->gen, gen, __ATOMIC_RELEASE);
+
+	list_for_each_entry(thread, &task->threads_list, node)
+		thread->quiesced = false;
+
+	task->quiesce->parked = true;
+	task->quiesce->park_ns = start;
+	ret = 0;
+
+	for (round = 0; round < TASK_FREEZE_MAX_ROUNDS; round++) {
+		list_for_each_entry_safe(thread, tmp, &task->threads_list,
+					 node) {
+			if (thread->quiesced)
+				continue;
+			ret = quiesce_send(task, thread, gen);
+			if (ret == -ESRCH) {
+				list_del(&thread->node);
+				free(thread);
+				continue;
+			}
+			if (ret)
+				goto release;
+			thread->quiesced = true;
+			sent++;
+		}
+
+		while (1) {
+			done = __atomic_load_n(&page->arrived,
+					       __ATOMIC_ACQUIRE) +
+			       __atomic_load_n(&page->busy, __ATOMIC_ACQUIRE);
+			if (page->busy) {
+				stats->busy_addr = page->busy_pc;
+				ret = -EBUSY;
+				goto release;
+			}
+			if (done >= sent)
+				break;
+			if (nsecs() - start > budget_ns) {
+				stats->timeout = true;
+				ret = -ETIME;
+				goto release;
+			}
+			sched_yield();
+		}
+
+		/* The parked threads can't create any more */
+		ret = task_refresh_threads(task);
+		if (ret <= 0)
+			break;
+	}
+	/* Keeps creating threads */
+	if (ret > 0)
+		ret = -EAGAIN;
+	if (ret)
+		goto release;
+
+	stats->nr_threads = sent;
+	stats->check_ns = nsecs() - start;
+	return 0;
+
+release:
+	stats->nr_threads = sent;
+	stats->check_ns = nsecs() - start;
+	quiesce_wake(task->quiesce);
+	return ret;
+}
+
+bool task_quiesced(struct task_struct *task)
+{
+	return task->quiesce && task->quiesce->parked;
+}
+
+/**
+ * The threads parked by task_quiesce_threads() still wait, and would wait
+ * at least half of TASK_QUIESCE_HOLD_NS more, return -ETIME otherwise, the
+ * caller should release them and use task_freeze_threads().
+ */
+int task_quiesce_check(struct task_struct *task)
+{
+	struct task_quiesce *q = task->quiesce;
+	uint32_t escaped;
+
+	if (!q || !q->parked)
+		return -EINVAL;
+
+	escaped = __atomic_load_n(&q->page->escaped, __ATOMIC_ACQUIRE);
+	if (escaped) {
+		ulp_debug("%u threads of %d escaped the quiescence.\n",
+			  escaped, task->pid);
+		return -ETIME;
+	}
+	if (nsecs() - q->park_ns > TASK_QUIESCE_HOLD_NS / 2) {
+		ulp_debug("Quiescence of %d is about to expire.\n", task->pid);
+		return -ETIME;
+	}
+	return 0;
+}
+
+/* Resume the threads parked by task_quiesce_threads() */
+int task_quiesce_release(struct task_struct *task)
+{
+	struct task_quiesce *q = task->quiesce;
+	uint32_t escaped;
+
+	if (!q || !q->parked)
+		return 0;
+
+	escaped = __atomic_load_n(&q->page->escaped, __ATOMIC_ACQUIRE);
+	quiesce_wake(q);
+	if (escaped) {
+		ulp_warning("%u threads of %d escaped the quiescence.\n",
+			    escaped, task->pid);
+		q->page->escaped = 0;
+	}
+	return 0;
+}
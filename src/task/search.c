@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+
+/**
+ * Search a byte pattern in the readable VMAs of target task, the VMAs are
+ * split into SEARCH_CHUNK_SIZE chunks and read by process_vm_readv(2) in
+ * parallel, every chunk is read with the first len - 1 bytes of the next
+ * one, thus a match across the chunk boundary is found by the chunk where
+ * it starts, and only by it.
+ */
+
+#define SEARCH_CHUNK_SIZE	SZ_1M
+#define SEARCH_MAX_THREADS	64
+
+struct search_seg {
+	unsigned long start, end;
+	struct vm_area_struct *vma;
+};
+
+struct search_work {
+	struct task_struct *task;
+	const unsigned char *pat;
+	size_t len;
+	size_t max;
+
+	struct search_seg *segs;
+	int nr_segs;
+
+	pthread_mutex_t lock;
+	/* Next chunk, the segment and the offset in segment */
+	int seg;
+	unsigned long off;
+
+	struct task_search_match *matches;
+	size_t nr, cap;
+	unsigned long unreadable;
+	int err;
+};
+
+static bool vma_searchable(struct vm_area_struct *vma, const char *pattern)
+{
+	if (!(vma->prot & PROT_READ))
+		return false;
+
+	switch (vma->type) {
+	/* Not accessible, or special mappings of kernel */
+	case VMA_VVAR:
+	case VMA_VVAR_VCLOCK:
+	case VMA_VSYSCALL:
+	case VMA_UPROBES:
+		return false;
+	default:
+		break;
+	}
+
+	return !pattern || !fnmatch(pattern, vma->name_, 0) ||
+	       !fnmatch(pattern, basename((char *)vma->name_), 0);
+}
+
+static int search_build_segs(struct search_work *work, const char *pattern)
+{
+	struct vm_area_struct *vma;
+	int n = 0;
+
+	task_for_each_vma(vma, work->task)
+		n++;
+
+	work->segs = calloc(n ?: 1, sizeof(struct search_seg));
+	if (!work->segs)
+		return -ENOMEM;
+
+	task_for_each_vma(vma, work->task) {
+		if (!vma_searchable(vma, pattern))
+			continue;
+		work->segs[work->nr_segs].start = vma->vm_start;
+		work->segs[work->nr_segs].end = vma->vm_end;
+		work->segs[work->nr_segs].vma = vma;
+		work->nr_segs++;
+	}
+	return 0;
+}
+
+static bool search_take(struct search_work *work, struct search_seg **seg,
+			unsigned long *addr, size_t *len)
+{
+	struct search_seg *s;
+	bool ok = false;
+
+	pthread_mutex_lock(&work->lock);
+	for (; work->seg < work->nr_segs; work->seg++, work->off = 0) {
+		s = &work->segs[work->seg];
+		if (s->start + work->off >= s->end)
+			continue;
+
+		*seg = s;
+		*addr = s->start + work->off;
+		*len = MIN(SEARCH_CHUNK_SIZE, s->end - *addr);
+		work->off += *len;
+		ok = true;
+		break;
+	}
+	pthread_mutex_unlock(&work->lock);
+	return ok;
+}
+
+static int search_add(struct search_work *work, unsigned long addr,
+		      struct vm_area_struct *vma)
+{
+	struct task_search_match *tmp;
+
+	if (work->max && work->nr >= work->max)
+		return -E2BIG;
+
+	if (work->nr == work->cap) {
+		work->cap = work->cap ? work->cap * 2 : 64;
+		tmp = realloc(work->matches, work->cap * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		work->matches = tmp;
+	}
+	work->matches[work->nr].addr = addr;
+	work->matches[work->nr].vma = vma;
+	work->nr++;
+	return 0;
+}
+
+/**
+ * Read [addr, addr + size) page by page in one scatter read. If some page
+ * is unreadable, it is zeroed, find them one by one then, return false in
+ * @ok[] for them. Called by search_worker(), all the reads are uncached.
+ */
+static void search_read(struct search_work *work, void *buf,
+			struct task_iov *iov, bool *ok, unsigned long addr,
+			size_t size)
+{
+	ssize_t n;
+	int i, nr;
+
+	for (i = 0, nr = 0; nr < size; i++, nr += PAGE_SIZE) {
+		iov[i].remote = addr + nr;
+		iov[i].local = buf + nr;
+		iov[i].len = MIN(PAGE_SIZE, size - nr);
+		ok[i] = true;
+	}
+
+	n = memcpy_from_task_iov(work->task, iov, i);
+	if (n == size)
+		return;
+
+	/* One by one, never through the task::mcache, not thread safe */
+	for (i = 0, nr = 0; nr < size; i++, nr += PAGE_SIZE) {
+		ok[i] = memcpy_from_task_iov(work->task, &iov[i], 1) ==
+			iov[i].len;
+		if (!ok[i])
+			__atomic_fetch_add(&work->unreadable, 1,
+					   __ATOMIC_RELAXED);
+	}
+}
+
+/* The match at @off of buffer is in readable pages */
+static bool search_match_ok(const bool *ok, size_t off, size_t len)
+{
+	size_t p;
+
+	for (p = off / PAGE_SIZE; p <= (off + len - 1) / PAGE_SIZE; p++)
+		if (!ok[p])
+			return false;
+	return true;
+}
+
+static void *search_worker(void *arg)
+{
+	struct search_work *work = arg;
+	size_t len, size, nr_pages, off;
+	struct search_seg *seg;
+	struct task_iov *iov;
+	unsigned long addr;
+	unsigned char *buf, *p;
+	bool *ok;
+	int err;
+
+	/* With the first len - 1 bytes of the next chunk */
+	size = SEARCH_CHUNK_SIZE + ROUND_UP(work->len, PAGE_SIZE);
+	nr_pages = size / PAGE_SIZE;
+
+	buf = malloc(size);
+	iov = malloc(sizeof(*iov) * nr_pages);
+	ok = malloc(sizeof(*ok) * nr_pages);
+	if (!buf || !iov || !ok) {
+		work->err = -ENOMEM;
+		goto out;
+	}
+
+	while (!work->err && search_take(work, &seg, &addr, &len)) {
+		size = MIN(len + work->len - 1, seg->end - addr);
+		search_read(work, buf, iov, ok, addr, size);
+
+		for (off = 0; off < len; off = p - buf + 1) {
+			p = ulp_memmem(buf + off, size - off, work->pat,
+				       work->len);
+			/* The ones start in the next chunk belong to it */
+			if (!p || p - buf >= len)
+				break;
+			if (!search_match_ok(ok, p - buf, work->len))
+				continue;
+
+			pthread_mutex_lock(&work->lock);
+			err = search_add(work, addr + (p - buf), seg->vma);
+			pthread_mutex_unlock(&work->lock);
+			if (err) {
+				work->err = err;
+				break;
+			}
+		}
+	}
+
+out:
+	free(ok);
+	free(iov);
+	free(buf);
+	return NULL;
+}
+
+static int cmp_match(const void *a, const void *b)
+{
+	const struct task_search_match *ma = a, *mb = b;
+
+	return ma->addr < mb->addr ? -1 : ma->addr > mb->addr;
+}
+
+/**
+ * Search @pat of @len bytes in all readable VMAs, or the VMAs whose path or
+ * basename matches fnmatch(3) @vma_pattern, by @nr_threads threads. The
+ * matches are stored into @matches in the order of address, free(3) it.
+ * At most @max matches, 0 means no limit.
+ *
+ * Return the number of matches, -E2BIG if more than @max, @max of them are
+ * stored still, or other negative errno.
+ */
+ssize_t task_search(struct task_struct *task, const void *pat, size_t len,
+		    const char *vma_pattern, int nr_threads, size_t max,
+		    struct task_search_match **matches)
+{
+	pthread_t threads[SEARCH_MAX_THREADS];
+	struct search_work work = {
+		.task = task,
+		.pat = pat,
+		.len = len,
+		.max = max,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	int i, err;
+
+	*matches = NULL;
+	if (!len)
+		return -EINVAL;
+
+	err = search_build_segs(&work, vma_pattern);
+	if (err)
+		return err;
+
+	nr_threads = MIN(MAX(nr_threads, 1) - 1, SEARCH_MAX_THREADS);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, search_worker, &work))
+			break;
+	}
+	nr_threads = i;
+
+	/* If no thread was created, do the work in current thread */
+	search_worker(&work);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(work.segs);
+
+	ulp_debug("Search %zu bytes in %d VMAs, %zu matches, %lu unreadable "
+		  "pages\n", len, work.nr_segs, work.nr, work.unreadable);
+
+	if (work.err && work.err != -E2BIG) {
+		free(work.matches);
+		return work.err;
+	}
+
+	qsort(work.matches, work.nr, sizeof(*work.matches), cmp_match);
+	*matches = work.matches;
+	return work.err ?: work.nr;
+}
@@ -0,0 +1,656 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+#include <sys/procfs.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/zstd.h>
+#include <task/task.h>
+
+
+/**
+ * Write the memory of target task to an ELF core-like file: one PT_NOTE of
+ * NT_PRPSINFO and NT_PRSTATUS of every thread, then one PT_LOAD of every
+ * VMA of task_struct::vma_list, the unreadable VMAs have zero p_filesz.
+ *
+ * The VMA list and registers are recorded with all threads frozen, then
+ * the memory is copied by process_vm_readv(2) workers, each one copies
+ * SNAPSHOT_CHUNK_SIZE a time and writes it with pwrite(2), the file is
+ * sized with ftruncate(2) first, thus the unreadable pages are holes.
+ *
+ * With SNAPSHOT_F_SOFT_DIRTY, the threads are thawed right after the
+ * soft-dirty bits are cleared, the copy runs while target is running, then
+ * the threads are frozen again to copy the soft-dirty pages only, see
+ * linux:Documentation/admin-guide/mm/soft-dirty.rst. The snapshot is the
+ * memory at the second freeze, but the VMAs created after the first one
+ * are missing.
+ *
+ * If @file is .zst, the snapshot is written into an unlinked temporary
+ * file in the same directory, and compressed into @file in seekable zstd
+ * format after thawed, thus the stop time is no longer than the plain one.
+ */
+
+#define SNAPSHOT_CHUNK_SIZE	SZ_1M
+#define SNAPSHOT_MAX_THREADS	64
+
+#if defined(__x86_64__)
+# define SNAPSHOT_ELF_MACHINE	EM_X86_64
+#elif defined(__aarch64__)
+# define SNAPSHOT_ELF_MACHINE	EM_AARCH64
+#else
+# error "Not support architecture"
+#endif
+
+struct snapshot_seg {
+	unsigned long start, end;
+	off_t offset;
+	/* PF_* */
+	uint32_t flags;
+	/* Copy the memory, zero p_filesz if not */
+	bool dump;
+};
+
+struct snapshot_work {
+	struct task_struct *task;
+	int fd;
+	struct snapshot_seg *segs;
+	int nr_segs;
+
+	/* Next chunk to copy, the segment and the offset in segment */
+	pthread_mutex_t lock;
+	int seg;
+	unsigned long off;
+
+	unsigned long bytes;
+	unsigned long unreadable;
+	int err;
+};
+
+static bool vma_dumpable(struct vm_area_struct *vma)
+{
+	if (!(vma->prot & PROT_READ))
+		return false;
+
+	switch (vma->type) {
+	/* Not accessible, or special mappings of kernel */
+	case VMA_VVAR:
+	case VMA_VVAR_VCLOCK:
+	case VMA_VSYSCALL:
+	case VMA_UPROBES:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/* The offset of segment is relative to the first one */
+static struct snapshot_seg *snapshot_build_segs(struct task_struct *task,
+						 int *nr)
+{
+	struct vm_area_struct *vma;
+	struct snapshot_seg *segs;
+	off_t offset = 0;
+	int n = 0;
+
+	task_for_each_vma(vma, task)
+		n++;
+
+	segs = calloc(n ?: 1, sizeof(struct snapshot_seg));
+	if (!segs)
+		return NULL;
+
+	n = 0;
+	task_for_each_vma(vma, task) {
+		struct snapshot_seg *seg = &segs[n++];
+
+		seg->start = vma->vm_start;
+		seg->end = vma->vm_end;
+		seg->flags = (vma->prot & PROT_READ ? PF_R : 0) |
+			     (vma->prot & PROT_WRITE ? PF_W : 0) |
+			     (vma->prot & PROT_EXEC ? PF_X : 0);
+		seg->dump = vma_dumpable(vma);
+		seg->offset = offset;
+		if (seg->dump)
+			offset += seg->end - seg->start;
+	}
+
+	*nr = n;
+	return segs;
+}
+
+/* Take the next chunk of all dumpable segments */
+static bool snapshot_take(struct snapshot_work *work, unsigned long *addr,
+			  size_t *len, off_t *offset)
+{
+	struct snapshot_seg *seg;
+	bool ok = false;
+
+	pthread_mutex_lock(&work->lock);
+	for (; work->seg < work->nr_segs; work->seg++, work->off = 0) {
+		seg = &work->segs[work->seg];
+		if (!seg->dump || seg->start + work->off >= seg->end)
+			continue;
+
+		*addr = seg->start + work->off;
+		*len = MIN(SNAPSHOT_CHUNK_SIZE, seg->end - *addr);
+		*offset = seg->offset + work->off;
+		work->off += *len;
+		ok = true;
+		break;
+	}
+	pthread_mutex_unlock(&work->lock);
+	return ok;
+}
+
+/**
+ * Copy [addr, addr + len) to file @offset, page by page in one scatter
+ * read, thus every unreadable page is zeroed alone.
+ */
+static int snapshot_copy(struct snapshot_work *work, void *buf,
+			 struct task_iov *iov, unsigned long addr, size_t len,
+			 off_t offset)
+{
+	ssize_t n;
+	int i, nr;
+
+	for (i = 0, nr = 0; nr < len; i++, nr += PAGE_SIZE) {
+		iov[i].remote = addr + nr;
+		iov[i].local = buf + nr;
+		iov[i].len = MIN(PAGE_SIZE, len - nr);
+	}
+
+	n = memcpy_from_task_iov(work->task, iov, i);
+
+	__atomic_fetch_add(&work->bytes, n > 0 ? n : 0, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&work->unreadable, (len - MAX(n, 0)) / PAGE_SIZE,
+			   __ATOMIC_RELAXED);
+
+	if (pwrite(work->fd, buf, len, offset) != len) {
+		ulp_error("Write snapshot at %lx failed, %m\n", offset);
+		return -errno ?: -EIO;
+	}
+	return 0;
+}
+
+static void *snapshot_worker(void *arg)
+{
+	struct snapshot_work *work = arg;
+	struct task_iov *iov;
+	unsigned long addr;
+	off_t offset;
+	size_t len;
+	void *buf;
+	int err;
+
+	buf = malloc(SNAPSHOT_CHUNK_SIZE);
+	iov = malloc(sizeof(*iov) * (SNAPSHOT_CHUNK_SIZE / PAGE_SIZE));
+	if (!buf || !iov)
+		goto out;
+
+	while (!work->err && snapshot_take(work, &addr, &len, &offset)) {
+		err = snapshot_copy(work, buf, iov, addr, len, offset);
+		if (err)
+			work->err = err;
+	}
+
+out:
+	free(iov);
+	free(buf);
+	return NULL;
+}
+
+static int snapshot_copy_all(struct snapshot_work *work, int nr_threads)
+{
+	pthread_t threads[SNAPSHOT_MAX_THREADS];
+	int i;
+
+	nr_threads = MIN(MAX(nr_threads, 1) - 1, SNAPSHOT_MAX_THREADS);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, snapshot_worker, work))
+			break;
+	}
+	nr_threads = i;
+
+	/* If no thread was created, do the work in current thread */
+	snapshot_worker(work);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	return work->err;
+}
+
+/**
+ * Copy the soft-dirty pages again, the threads must be frozen. Return the
+ * number of pages copied.
+ */
+static long snapshot_copy_dirty(struct snapshot_work *work)
+{
+	uint64_t pm[SNAPSHOT_CHUNK_SIZE / PAGE_SIZE];
+	unsigned long addr, end, run;
+	struct snapshot_seg *seg;
+	struct task_iov *iov;
+	char path[64];
+	long nr = 0;
+	off_t off;
+	size_t n, i;
+	void *buf;
+	int fd, s;
+
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", work->task->pid);
+	fd = task_proc_open(work->task, "pagemap", O_RDONLY);
+	if (fd < 0) {
+		ulp_error("Open %s failed, %m\n", path);
+		return -errno;
+	}
+
+	buf = malloc(SNAPSHOT_CHUNK_SIZE);
+	iov = malloc(sizeof(*iov) * (SNAPSHOT_CHUNK_SIZE / PAGE_SIZE));
+	if (!buf || !iov) {
+		nr = -ENOMEM;
+		goto out;
+	}
+
+	for (s = 0; s < work->nr_segs && nr >= 0; s++) {
+		seg = &work->segs[s];
+		if (!seg->dump)
+			continue;
+
+		for (addr = seg->start; addr < seg->end; addr = end) {
+			end = MIN(addr + SNAPSHOT_CHUNK_SIZE, seg->end);
+			n = (end - addr) / PAGE_SIZE;
+			if (pread(fd, pm, n * sizeof(pm[0]),
+				  addr / PAGE_SIZE * sizeof(pm[0])) !=
+			    n * sizeof(pm[0])) {
+				nr = -EIO;
+				break;
+			}
+
+			/* Copy every run of soft-dirty pages once */
+			for (i = 0; i < n; i += run) {
+				for (run = 0; i + run < n &&
+				     (pm[i + run] & PM_SOFT_DIRTY); run++)
+					;
+				if (!run) {
+					run = 1;
+					continue;
+				}
+				off = seg->offset + addr - seg->start +
+				      i * PAGE_SIZE;
+				if (snapshot_copy(work, buf, iov,
+						  addr + i * PAGE_SIZE,
+						  run * PAGE_SIZE, off)) {
+					nr = -EIO;
+					break;
+				}
+				nr += run;
+			}
+			if (nr < 0)
+				break;
+		}
+	}
+
+out:
+	free(iov);
+	free(buf);
+	close(fd);
+	return nr;
+}
+
+static size_t note_size(size_t desc)
+{
+	return sizeof(Elf64_Nhdr) + ALIGN(sizeof("CORE"), 4) + ALIGN(desc, 4);
+}
+
+static void *note_append(void *p, int type, const void *desc, size_t size)
+{
+	Elf64_Nhdr *nhdr = p;
+
+	nhdr->n_namesz = sizeof("CORE");
+	nhdr->n_descsz = size;
+	nhdr->n_type = type;
+	p += sizeof(*nhdr);
+	memcpy(p, "CORE", sizeof("CORE"));
+	p += ALIGN(sizeof("CORE"), 4);
+	memcpy(p, desc, size);
+	return p + ALIGN(size, 4);
+}
+
+static void *note_append_prstatus(void *p, pid_t tid)
+{
+	struct user_regs_struct regs;
+	struct elf_prstatus prstatus;
+
+	if (thread_getregs(tid, &regs))
+		return NULL;
+
+	memset(&prstatus, 0, sizeof(prstatus));
+	prstatus.pr_pid = tid;
+	memcpy(&prstatus.pr_reg, &regs,
+	       MIN(sizeof(prstatus.pr_reg), sizeof(regs)));
+	return note_append(p, NT_PRSTATUS, &prstatus, sizeof(prstatus));
+}
+
+/**
+ * Build the PT_NOTE, the registers of every thread are read here, thus the
+ * threads must be frozen.
+ */
+static void *snapshot_build_notes(struct task_struct *task, size_t *size,
+				  unsigned int *nr_threads)
+{
+	struct elf_prpsinfo prpsinfo;
+	struct thread *thread;
+	unsigned int n = 1;
+	void *notes, *p, *next;
+
+	list_for_each_entry(thread, &task->threads_list, node)
+		n++;
+
+	notes = calloc(1, note_size(sizeof(prpsinfo)) +
+			  n * note_size(sizeof(struct elf_prstatus)));
+	if (!notes)
+		return NULL;
+
+	memset(&prpsinfo, 0, sizeof(prpsinfo));
+	prpsinfo.pr_pid = task->pid;
+	strncpy(prpsinfo.pr_fname, task->comm, sizeof(prpsinfo.pr_fname) - 1);
+	p = note_append(notes, NT_PRPSINFO, &prpsinfo, sizeof(prpsinfo));
+
+	*nr_threads = 0;
+
+	/* Without FTO_THREADS, only the leader is frozen */
+	if (!(task->fto_flag & FTO_THREADS)) {
+		next = note_append_prstatus(p, task->pid);
+		if (next) {
+			p = next;
+			(*nr_threads)++;
+		}
+	} else {
+		list_for_each_entry(thread, &task->threads_list, node) {
+			if (!thread->frozen)
+				continue;
+			next = note_append_prstatus(p, thread->tid);
+			if (next) {
+				p = next;
+				(*nr_threads)++;
+			}
+		}
+	}
+
+	*size = p - notes;
+	return notes;
+}
+
+static int snapshot_write_headers(int fd, struct snapshot_seg *segs, int nr,
+				  const void *notes, size_t notes_size,
+				  off_t notes_off)
+{
+	size_t phdrs_size = sizeof(Elf64_Phdr) * (nr + 1);
+	Elf64_Ehdr ehdr = {
+		.e_ident = {
+			ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
+			ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_NONE,
+		},
+		.e_type = ET_CORE,
+		.e_machine = SNAPSHOT_ELF_MACHINE,
+		.e_version = EV_CURRENT,
+		.e_phoff = sizeof(Elf64_Ehdr),
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_phentsize = sizeof(Elf64_Phdr),
+		.e_phnum = nr + 1,
+	};
+	Elf64_Phdr *phdrs;
+	int i, ret = 0;
+
+	phdrs = calloc(1, phdrs_size);
+	if (!phdrs)
+		return -ENOMEM;
+
+	phdrs[0].p_type = PT_NOTE;
+	phdrs[0].p_offset = notes_off;
+	phdrs[0].p_filesz = notes_size;
+	phdrs[0].p_align = 4;
+
+	for (i = 0; i < nr; i++) {
+		Elf64_Phdr *phdr = &phdrs[i + 1];
+
+		phdr->p_type = PT_LOAD;
+		phdr->p_flags = segs[i].flags;
+		phdr->p_offset = segs[i].offset;
+		phdr->p_vaddr = segs[i].start;
+		phdr->p_memsz = segs[i].end - segs[i].start;
+		phdr->p_filesz = segs[i].dump ? phdr->p_memsz : 0;
+		phdr->p_align = PAGE_SIZE;
+	}
+
+	if (pwrite(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+	    pwrite(fd, phdrs, phdrs_size, ehdr.e_phoff) != phdrs_size ||
+	    pwrite(fd, notes, notes_size, notes_off) != notes_size)
+		ret = -errno ?: -EIO;
+
+	free(phdrs);
+	return ret;
+}
+
+/* An unlinked file in the directory of @file */
+static int snapshot_open_tmp(const char *file)
+{
+	char tmp[PATH_MAX];
+	char *slash;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s", file) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+	slash = strrchr(tmp, '/');
+	if (slash)
+		*(slash + 1) = '\0';
+	else
+		strcpy(tmp, "./");
+
+	fd = open(tmp, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0)
+		return fd;
+
+	/* No O_TMPFILE support of the filesystem */
+	if (strlen(tmp) + sizeof(".ulp-snapshot.XXXXXX") > sizeof(tmp))
+		return -ENAMETOOLONG;
+	strcat(tmp, ".ulp-snapshot.XXXXXX");
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -errno;
+	unlink(tmp);
+	return fd;
+}
+
+static int snapshot_compress(int fd, off_t size, const char *file,
+			     int nr_threads)
+{
+	struct ulp_zst *z;
+	off_t off;
+	ssize_t n;
+	void *buf;
+	int zfd, err = 0;
+
+	buf = malloc(SNAPSHOT_CHUNK_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	zfd = open(file, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+	if (zfd < 0) {
+		err = -errno;
+		ulp_error("Open %s failed, %m\n", file);
+		goto out;
+	}
+
+	z = ulp_zst_open(zfd, nr_threads);
+	if (!z) {
+		err = -errno;
+		goto close;
+	}
+
+	for (off = 0; off < size && !err; off += n) {
+		n = pread(fd, buf, MIN(SNAPSHOT_CHUNK_SIZE, size - off), off);
+		if (n <= 0) {
+			err = n ? -errno : -EIO;
+			break;
+		}
+		err = ulp_zst_write(z, buf, n);
+	}
+
+	n = ulp_zst_close(z);
+	if (!err)
+		err = n;
+close:
+	close(zfd);
+	if (err)
+		unlink(file);
+out:
+	free(buf);
+	return err;
+}
+
+/**
+ * Take a snapshot of target task into @file, see the top of this file.
+ * @nr_threads: number of copy threads, at least 1, the caller included.
+ */
+int task_snapshot(struct task_struct *task, const char *file,
+		  unsigned int flags, int nr_threads,
+		  struct task_snapshot_stats *stats)
+{
+	struct snapshot_work work = {
+		.task = task,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct task_snapshot_stats st = {};
+	unsigned long freeze_at, t;
+	bool frozen, soft_dirty = false;
+	off_t notes_off, data_off, size = 0;
+	size_t notes_size = 0;
+	void *notes = NULL;
+	bool zst = ulp_zst_path(file);
+	long dirty;
+	int err, i;
+
+	if (zst) {
+		work.fd = snapshot_open_tmp(file);
+		if (work.fd < 0) {
+			ulp_error("Open temporary file of %s failed, %s\n",
+				  file, strerror(-work.fd));
+			return work.fd;
+		}
+	} else {
+		work.fd = open(file, O_CREAT | O_RDWR | O_TRUNC, 0600);
+		if (work.fd < 0) {
+			ulp_error("Open %s failed, %m\n", file);
+			return -errno;
+		}
+	}
+
+	freeze_at = nsecs();
+	err = task_freeze_threads(task);
+	if (err) {
+		ulp_error("Freeze %d failed.\n", task->pid);
+		goto close;
+	}
+	frozen = true;
+
+	err = refresh_task_vmas(task, NULL);
+	if (err)
+		goto thaw;
+
+	notes = snapshot_build_notes(task, &notes_size, &st.nr_threads);
+	work.segs = snapshot_build_segs(task, &work.nr_segs);
+	if (!notes || !work.segs) {
+		err = -ENOMEM;
+		goto thaw;
+	}
+
+	notes_off = sizeof(Elf64_Ehdr) +
+		    sizeof(Elf64_Phdr) * (work.nr_segs + 1);
+	data_off = ALIGN(notes_off + notes_size, PAGE_SIZE);
+
+	size = data_off;
+	for (i = 0; i < work.nr_segs; i++) {
+		work.segs[i].offset += data_off;
+		if (work.segs[i].dump)
+			size = work.segs[i].offset + work.segs[i].end -
+			       work.segs[i].start;
+	}
+
+	err = snapshot_write_headers(work.fd, work.segs, work.nr_segs, notes,
+				     notes_size, notes_off);
+	if (!err && ftruncate(work.fd, size))
+		err = -errno;
+	if (err)
+		goto thaw;
+
+	if (flags & SNAPSHOT_F_SOFT_DIRTY) {
+		soft_dirty = !task_clear_soft_dirty(task);
+		if (!soft_dirty)
+			ulp_warning("Clear soft-dirty of %d failed, copy in freeze.\n",
+				    task->pid);
+	}
+
+	/* Copy while running, fix up the pages dirtied meanwhile later */
+	if (soft_dirty) {
+		task_thaw_threads(task);
+		st.stop_ns += nsecs() - freeze_at;
+		frozen = false;
+	}
+
+	t = nsecs();
+	err = snapshot_copy_all(&work, nr_threads);
+	st.copy_ns = nsecs() - t;
+	st.bytes = work.bytes;
+	st.unreadable = work.unreadable;
+	if (err || !soft_dirty)
+		goto thaw;
+
+	freeze_at = nsecs();
+	err = task_freeze_threads(task);
+	if (err) {
+		ulp_error("Freeze %d again failed.\n", task->pid);
+		goto thaw;
+	}
+	frozen = true;
+
+	dirty = snapshot_copy_dirty(&work);
+	if (dirty < 0)
+		err = dirty;
+	else
+		st.nr_dirty = dirty;
+
+thaw:
+	if (frozen) {
+		task_thaw_threads(task);
+		st.stop_ns += nsecs() - freeze_at;
+	}
+
+	if (!err && zst) {
+		t = nsecs();
+		err = snapshot_compress(work.fd, size, file, nr_threads);
+		st.compress_ns = nsecs() - t;
+	}
+
+	st.nr_loads = work.nr_segs;
+	ulp_info("Snapshot %d: %u threads, %d loads, %lu bytes, %lu dirty, stop %lu ns.\n",
+		 task->pid, st.nr_threads, st.nr_loads, st.bytes, st.nr_dirty,
+		 st.stop_ns);
+close:
+	if (stats)
+		*stats = st;
+	free(work.segs);
+	free(notes);
+	close(work.fd);
+	return err;
+}
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+
+/**
+ * Which pages of target were written since a point in time, see
+ * linux:Documentation/admin-guide/mm/soft-dirty.rst. Clear the soft-dirty
+ * bits with task_clear_soft_dirty(), let target run, then read the bits
+ * from /proc/PID/pagemap with task_soft_dirty_ranges(). Only the dirty
+ * pages need to be read or dumped, instead of the whole VMA again.
+ */
+
+/* Read this many pagemap entries once */
+#define PAGEMAP_BATCH	512
+
+int task_clear_soft_dirty(struct task_struct *task)
+{
+	char path[64];
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/clear_refs", task->pid);
+	fd = task_proc_open(task, "clear_refs", O_WRONLY);
+	if (fd < 0) {
+		ulp_error("Open %s failed, %m\n", path);
+		return -errno;
+	}
+	/* 4 means clear the soft-dirty bits of all pages */
+	if (write(fd, "4", 1) != 1) {
+		ret = -errno;
+		ulp_error("Clear soft-dirty of %d failed, %m\n", task->pid);
+	}
+	close(fd);
+	return ret;
+}
+
+/**
+ * Get the runs of soft-dirty pages in [start, end), @start and @end are
+ * aligned to pages. The array is allocated and saved to @ranges, free it
+ * with free(3). Return the number of runs, or negative errno.
+ */
+int task_soft_dirty_ranges(struct task_struct *task, unsigned long start,
+			   unsigned long end, struct task_addr_range **ranges)
+{
+	struct task_addr_range *r = NULL, *tmp;
+	uint64_t pm[PAGEMAP_BATCH];
+	unsigned long addr, pg;
+	int fd, nr = 0, cap = 0;
+	char path[64];
+	size_t n, i;
+
+	start = PAGE_DOWN(start);
+	end = PAGE_UP(end);
+
+	snprintf(path, sizeof(path), "/proc/%d/pagemap", task->pid);
+	fd = task_proc_open(task, "pagemap", O_RDONLY);
+	if (fd < 0) {
+		ulp_error("Open %s failed, %m\n", path);
+		return -errno;
+	}
+
+	for (addr = start; addr < end; addr += n * PAGE_SIZE) {
+		n = MIN(PAGEMAP_BATCH, (end - addr) / PAGE_SIZE);
+		if (pread(fd, pm, n * sizeof(pm[0]),
+			  addr / PAGE_SIZE * sizeof(pm[0])) != n * sizeof(pm[0])) {
+			ulp_error("Read %s at 0x%lx failed, %m\n", path, addr);
+			nr = -EIO;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!(pm[i] & PM_SOFT_DIRTY))
+				continue;
+
+			pg = addr + i * PAGE_SIZE;
+			/* Extend the last run, even cross the batches */
+			if (nr && r[nr - 1].end == pg) {
+				r[nr - 1].end += PAGE_SIZE;
+				continue;
+			}
+
+			if (nr == cap) {
+				cap = cap ? cap * 2 : 16;
+				tmp = realloc(r, sizeof(*r) * cap);
+				if (!tmp) {
+					nr = -ENOMEM;
+					goto out;
+				}
+				r = tmp;
+			}
+			r[nr].start = pg;
+			r[nr].end = pg + PAGE_SIZE;
+			nr++;
+		}
+	}
+
+out:
+	close(fd);
+	if (nr <= 0) {
+		free(r);
+		r = NULL;
+	}
+	*ranges = r;
+	return nr;
+}
+
+/**
+ * Dump the soft-dirty pages of the VMA that contains @addr to @ofile, each
+ * page is written at its offset in the VMA, as dump_task_vma_to_file(), and
+ * the clean pages are holes, thus the output file is always sparse.
+ */
+int dump_task_soft_dirty_to_file(const char *ofile, struct task_struct *task,
+				 unsigned long addr, unsigned int flags)
+{
+	struct task_addr_range *ranges;
+	struct vm_area_struct *vma;
+	int i, nr, fd, ret = 0;
+
+	vma = find_vma_or_query(task, addr);
+	if (!vma) {
+		ulp_error("%s vma not exist on 0x%lx.\n", task->comm, addr);
+		return -1;
+	}
+
+	nr = task_soft_dirty_ranges(task, vma->vm_start, vma->vm_end, &ranges);
+	if (nr < 0)
+		return -1;
+
+	fd = open(ofile, O_CREAT | O_WRONLY | O_TRUNC, 0664);
+	if (fd < 0) {
+		ulp_error("open %s: %m\n", ofile);
+		free(ranges);
+		return -1;
+	}
+
+	for (i = 0; i < nr && !ret; i++) {
+		if (lseek(fd, ranges[i].start - vma->vm_start, SEEK_SET) == -1) {
+			ret = -errno;
+			break;
+		}
+		ret = dump_task_addr_to_fd(fd, task, ranges[i].start,
+					   ranges[i].end - ranges[i].start,
+					   flags);
+	}
+
+	if (!ret && ftruncate(fd, vma->vm_end - vma->vm_start))
+		ret = -errno;
+
+	close(fd);
+	free(ranges);
+	return ret ? -1 : 0;
+}
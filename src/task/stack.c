@@ -0,0 +1,528 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/user.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+#if defined(__x86_64__)
+#include <arch/x86_64/regs.h>
+#elif defined(__aarch64__)
+#include <arch/aarch64/regs.h>
+#endif
+
+
+/**
+ * Activeness check of frozen task, make sure no thread is executing in the
+ * given address ranges, the PC and every return address of the frame
+ * pointer chain are checked.
+ *
+ * The registers are read by tracer (current thread) serially, which is one
+ * ptrace(2) for each thread, the stacks are walked by worker threads, and
+ * the remote reads don't go through task::mcache, which is not thread
+ * safe. The workers never touch the VMAs of task either, the return
+ * addresses are checked against a sorted copy of the executable ranges,
+ * the addresses not in it are looked up by tracer after, maybe in the text
+ * mapped since the VMAs were read, see stack_retry_misses().
+ *
+ * Without frame pointer, the walk stops at the first frame, only the PC and
+ * the outermost return address candidate are checked.
+ */
+struct stack_walk {
+	pid_t tid;
+	unsigned long pc, sp, fp, lr;
+
+	unsigned long nr_frames;
+	unsigned long cost_ns;
+	/* The address found in ranges, 0 if not found */
+	unsigned long busy_addr;
+	/* The first return address candidate not in stack_work::text */
+	unsigned long miss_addr;
+	bool timeout;
+};
+
+struct stack_work {
+	struct task_struct *task;
+	const struct task_addr_range *ranges;
+	int nr_ranges;
+	/* The PROT_EXEC VMAs, sorted and merged, see stack_text_init() */
+	struct task_addr_range *text;
+	int nr_text;
+	struct stack_walk *walks;
+	int nr;
+	int next;
+	/* 0 means no limit */
+	unsigned long deadline;
+	/* Any thread is busy, no need walk the others */
+	int busy;
+};
+
+/* Binary search, the ranges are sorted by start and not overlapped */
+static bool addr_in_ranges(const struct task_addr_range *base, int n,
+			   unsigned long addr)
+{
+	int half;
+
+	if (!n)
+		return false;
+
+	while (n > 1) {
+		half = n / 2;
+		if (base[half].start <= addr)
+			base += half;
+		n -= half;
+	}
+	return addr >= base->start && addr < base->end;
+}
+
+/* See task_check_stacks() */
+static bool in_ranges(const struct stack_work *work, unsigned long addr)
+{
+	return addr_in_ranges(work->ranges, work->nr_ranges, addr);
+}
+
+/* Return address must be in executable VMA */
+static bool is_text(struct stack_work *work, struct stack_walk *w,
+		    unsigned long addr)
+{
+	if (addr_in_ranges(work->text, work->nr_text, addr))
+		return true;
+	if (!w->miss_addr)
+		w->miss_addr = addr;
+	return false;
+}
+
+/**
+ * Copy the PROT_EXEC VMAs of task, in tracer, the vma_list is sorted by
+ * address, the adjacent ones are merged.
+ */
+static int stack_text_init(struct stack_work *work)
+{
+	struct task_struct *task = work->task;
+	struct vm_area_struct *vma;
+	struct task_addr_range *r;
+	int n = 0;
+
+	free(work->text);
+	work->text = NULL;
+	work->nr_text = 0;
+
+	task_for_each_vma(vma, task)
+		n += !!(vma->prot & PROT_EXEC);
+
+	work->text = malloc(sizeof(*work->text) * MAX(n, 1));
+	if (!work->text)
+		return -ENOMEM;
+
+	task_for_each_vma(vma, task) {
+		if (!(vma->prot & PROT_EXEC))
+			continue;
+		if (work->nr_text &&
+		    work->text[work->nr_text - 1].end == vma->vm_start) {
+			work->text[work->nr_text - 1].end = vma->vm_end;
+			continue;
+		}
+		r = &work->text[work->nr_text++];
+		r->start = vma->vm_start;
+		r->end = vma->vm_end;
+	}
+	return 0;
+}
+
+static bool stack_read(struct task_struct *task, void *dst, unsigned long addr,
+		       size_t size)
+{
+	return pread(task->proc_mem_fd, dst, size, addr) == size;
+}
+
+static void walk_stack(struct stack_work *work, struct stack_walk *w)
+{
+	struct task_struct *task = work->task;
+	unsigned long start = nsecs();
+	unsigned long fp = w->fp, frame[2], ret;
+	int depth;
+
+	if (in_ranges(work, w->pc)) {
+		w->busy_addr = w->pc;
+		goto out;
+	}
+
+	/**
+	 * The thread maybe stopped before the frame is set up, such as at
+	 * the function entry, then the return address is in LR, or at the
+	 * top of stack if no link register.
+	 */
+	if (w->lr) {
+		ret = w->lr;
+	} else if (!stack_read(task, &ret, w->sp, sizeof(ret))) {
+		ret = 0;
+	}
+	if (ret && is_text(work, w, ret) && in_ranges(work, ret)) {
+		w->busy_addr = ret;
+		goto out;
+	}
+
+	/**
+	 * Both x86_64 and aarch64 frame record is {caller FP, return address},
+	 * and FP points to it.
+	 */
+	for (depth = 0; fp && depth < TASK_STACK_MAX_DEPTH; depth++) {
+		if ((fp & (sizeof(long) - 1)) || fp < w->sp ||
+		    fp - w->sp > TASK_STACK_MAX_SIZE)
+			break;
+		if (!stack_read(task, frame, fp, sizeof(frame)))
+			break;
+
+		ret = frame[1];
+		if (!is_text(work, w, ret))
+			break;
+
+		w->nr_frames++;
+		if (in_ranges(work, ret)) {
+			w->busy_addr = ret;
+			break;
+		}
+
+		/* Stack grows down, the caller frame is higher */
+		if (frame[0] <= fp)
+			break;
+		fp = frame[0];
+
+		if (work->deadline && nsecs() > work->deadline) {
+			w->timeout = true;
+			break;
+		}
+	}
+
+out:
+	w->cost_ns = nsecs() - start;
+	if (w->busy_addr)
+		__atomic_store_n(&work->busy, 1, __ATOMIC_RELAXED);
+}
+
+static void *stack_worker(void *arg)
+{
+	struct stack_work *work = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED))
+		< work->nr) {
+		if (__atomic_load_n(&work->busy, __ATOMIC_RELAXED))
+			break;
+		walk_stack(work, &work->walks[i]);
+	}
+
+	return NULL;
+}
+
+/**
+ * The walks stopped at an address not in text, if PROCMAP_QUERY finds the
+ * text mapped after the VMAs were read, copy the text again and walk them
+ * again, in tracer.
+ */
+static int stack_retry_misses(struct stack_work *work)
+{
+	struct vm_area_struct *vma;
+	struct stack_walk *w, saved;
+	bool found = false;
+	int i, ret;
+
+	if (!work->task->procmap_query)
+		return 0;
+
+	for (i = 0; i < work->nr; i++) {
+		w = &work->walks[i];
+		if (!w->miss_addr || w->timeout)
+			continue;
+		vma = find_vma_or_query(work->task, w->miss_addr);
+		if (vma && (vma->prot & PROT_EXEC))
+			found = true;
+	}
+	if (!found)
+		return 0;
+
+	ret = stack_text_init(work);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < work->nr && !work->busy; i++) {
+		w = &work->walks[i];
+		if (!w->miss_addr || w->timeout)
+			continue;
+		saved = *w;
+		memset(w, 0, sizeof(*w));
+		w->tid = saved.tid;
+		w->pc = saved.pc;
+		w->sp = saved.sp;
+		w->fp = saved.fp;
+		w->lr = saved.lr;
+		walk_stack(work, w);
+		w->cost_ns += saved.cost_ns;
+	}
+	return 0;
+}
+
+static int stack_parallel(struct stack_work *work)
+{
+	pthread_t threads[TASK_STACK_MAX_THREADS];
+	int i, nr_threads = 0, nr_cpus, ret;
+
+	ret = stack_text_init(work);
+	if (ret)
+		return ret;
+
+	if (work->nr >= TASK_STACK_PARALLEL_MIN) {
+		nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = MIN(work->nr / TASK_STACK_PARALLEL_MIN,
+				 MIN(MAX(nr_cpus, 1), TASK_STACK_MAX_THREADS));
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, stack_worker, work))
+			break;
+	}
+	nr_threads = i;
+
+	/* Current thread works too */
+	stack_worker(work);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (!work->busy)
+		ret = stack_retry_misses(work);
+
+	free(work->text);
+	work->text = NULL;
+	work->nr_text = 0;
+	return ret;
+}
+
+static int init_walk(struct stack_walk *w, pid_t tid)
+{
+	struct user_regs_struct regs;
+	int ret;
+
+	ret = thread_getregs(tid, &regs);
+	if (ret)
+		return ret;
+
+	memset(w, 0, sizeof(*w));
+	w->tid = tid;
+	w->pc = REGS_IP(regs);
+	w->sp = REGS_SP(regs);
+	w->fp = REGS_FP(regs);
+	w->lr = REGS_LR(regs);
+	return 0;
+}
+
+/**
+ * Check all frozen threads of task, see task_freeze_threads(), without
+ * FTO_THREADS, only the thread group leader is checked. The @ranges must be
+ * sorted by start and not overlapped.
+ *
+ * Return 0 if no thread is in @ranges, -EBUSY if any, -ETIME if the walk
+ * cost more than @budget_ns (0 means no limit), the caller should thaw and
+ * retry later for both of them.
+ */
+int task_check_stacks(struct task_struct *task,
+		      const struct task_addr_range *ranges, int nr,
+		      unsigned long budget_ns, struct task_stack_stats *stats)
+{
+	struct task_stack_stats st = {};
+	struct stack_work work = {
+		.task = task,
+		.ranges = ranges,
+		.nr_ranges = nr,
+	};
+	struct thread *thread;
+	unsigned long start = nsecs();
+	int i, n = 0, ret = 0;
+
+	if (task->fto_flag & FTO_THREADS) {
+		list_for_each_entry(thread, &task->threads_list, node)
+			n += thread->frozen;
+	} else
+		n = 1;
+
+	work.walks = calloc(MAX(n, 1), sizeof(struct stack_walk));
+	if (!work.walks)
+		return -ENOMEM;
+
+	if (task->fto_flag & FTO_THREADS) {
+		list_for_each_entry(thread, &task->threads_list, node) {
+			if (!thread->frozen)
+				continue;
+			ret = init_walk(&work.walks[work.nr], thread->tid);
+			if (ret)
+				goto out;
+			thread->ip = work.walks[work.nr++].pc;
+		}
+	} else {
+		ret = init_walk(&work.walks[0], task->pid);
+		if (ret)
+			goto out;
+		work.nr = 1;
+	}
+
+	if (budget_ns)
+		work.deadline = nsecs() + budget_ns;
+
+	ret = stack_parallel(&work);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < work.nr; i++) {
+		struct stack_walk *w = &work.walks[i];
+
+		st.nr_frames += w->nr_frames;
+		st.max_thread_ns = MAX(st.max_thread_ns, w->cost_ns);
+		st.timeout |= w->timeout;
+		if (w->busy_addr && !st.busy_tid) {
+			st.busy_tid = w->tid;
+			st.busy_addr = w->busy_addr;
+		}
+	}
+
+	if (st.busy_tid)
+		ret = -EBUSY;
+	else if (st.timeout || (budget_ns && nsecs() > work.deadline))
+		ret = -ETIME;
+
+out:
+	st.nr_threads = work.nr;
+	st.check_ns = nsecs() - start;
+
+	ulp_debug("Task %d check %u threads %ld frames in %ld ns, ret %d\n",
+		  task->pid, st.nr_threads, st.nr_frames, st.check_ns, ret);
+
+	if (stats)
+		*stats = st;
+	free(work.walks);
+	return ret;
+}
+
+/**
+ * Read the PC and SP of a blocked thread @tid from /proc/PID/task/TID/syscall
+ * without stopping it, "NR ARGS... SP PC" if blocked in a syscall, "-1 SP PC"
+ * if blocked otherwise, return -EAGAIN if it's running.
+ */
+static int read_blocked_regs(struct task_struct *task, pid_t tid,
+			     struct stack_walk *w)
+{
+	char path[64], buf[256], *tok[9], *p, *save;
+	int fd, n, nr_tok = 0;
+
+	snprintf(path, sizeof(path), "task/%d/syscall", tid);
+	fd = task_proc_open(task, path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return n ? -errno : -ENODATA;
+	buf[n] = '\0';
+
+	if (!strncmp(buf, "running", 7))
+		return -EAGAIN;
+
+	for (p = strtok_r(buf, " \n", &save); p && nr_tok < ARRAY_SIZE(tok);
+	     p = strtok_r(NULL, " \n", &save))
+		tok[nr_tok++] = p;
+	if (nr_tok < 3)
+		return -EINVAL;
+
+	memset(w, 0, sizeof(*w));
+	w->tid = tid;
+	w->sp = strtoul(tok[nr_tok - 2], NULL, 0);
+	w->pc = strtoul(tok[nr_tok - 1], NULL, 0);
+	return 0;
+}
+
+/**
+ * Stop-free check before task_freeze_threads(), the PC and the return
+ * address candidate at the top of stack of every blocked thread are checked
+ * against the sorted @ranges, see task_check_stacks(). The running threads
+ * are unknown, counted as stats.nr_running. The PC is recorded in
+ * struct thread::ip.
+ *
+ * Return -EBUSY if any blocked thread is in @ranges, then the freeze can
+ * be skipped and retried later, 0 doesn't mean the freeze will succeed.
+ */
+int task_precheck_stacks(struct task_struct *task,
+			 const struct task_addr_range *ranges, int nr,
+			 struct task_stack_stats *stats)
+{
+	struct task_stack_stats st = {};
+	struct stack_work work = {
+		.task = task,
+		.ranges = ranges,
+		.nr_ranges = nr,
+	};
+	struct thread *thread;
+	unsigned long start = nsecs();
+	int i, n = 0, ret = 0;
+
+	if (task->fto_flag & FTO_THREADS) {
+		list_for_each_entry(thread, &task->threads_list, node)
+			n++;
+	} else
+		n = 1;
+
+	work.walks = calloc(MAX(n, 1), sizeof(struct stack_walk));
+	if (!work.walks)
+		return -ENOMEM;
+
+	if (task->fto_flag & FTO_THREADS) {
+		list_for_each_entry(thread, &task->threads_list, node) {
+			st.nr_threads++;
+			if (read_blocked_regs(task, thread->tid,
+					      &work.walks[work.nr])) {
+				st.nr_running++;
+				continue;
+			}
+			thread->ip = work.walks[work.nr++].pc;
+		}
+	} else {
+		st.nr_threads = 1;
+		if (read_blocked_regs(task, task->pid, &work.walks[0]))
+			st.nr_running = 1;
+		else
+			work.nr = 1;
+	}
+
+	ret = stack_parallel(&work);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < work.nr; i++) {
+		struct stack_walk *w = &work.walks[i];
+
+		if (w->busy_addr) {
+			st.busy_tid = w->tid;
+			st.busy_addr = w->busy_addr;
+			ret = -EBUSY;
+			break;
+		}
+	}
+
+out:
+	st.check_ns = nsecs() - start;
+
+	ulp_debug("Task %d precheck %u threads, %u running, in %ld ns, ret %d\n",
+		  task->pid, st.nr_threads, st.nr_running, st.check_ns, ret);
+
+	if (stats)
+		*stats = st;
+	free(work.walks);
+	return ret;
+}
@@ -12,6 +12,9 @@
 #include <stdlib.h>
 #include <elf.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <libgen.h>
+#include <regex.h>
 
 #include <elf/elf-api.h>
 
@@ -23,6 +26,9 @@ static inline int __cmp_task_sym(struct rb_node *n1, unsigned long key)
 {
 	struct task_sym *s1 = rb_entry(n1, struct task_sym, sort_by_name);
 	struct task_sym *s2 = (struct task_sym *)key;
+	/* Interned names */
+	if (s1->name == s2->name)
+		return 0;
 	return strcmp(s1->name, s2->name);
 }
 
@@ -30,53 +36,88 @@ static inline int __cmp_task_addr(struct rb_node *n1, unsigned long key)
 {
 	struct task_sym *s1 = rb_entry(n1, struct task_sym, sort_by_addr);
 	struct task_sym *s2 = (struct task_sym *)key;
-	return s1->addr - s2->addr;
+	/* The difference of addresses doesn't fit in int */
+	if (s1->addr > s2->addr)
+		return 1;
+	return s1->addr < s2->addr ? -1 : 0;
 }
 
-static void __rb_free_task_sym_name(struct rb_node *node)
+static struct task_sym **tsym_hash_slot(struct task_sym **hash, size_t size,
+					 const char *name)
 {
-	struct task_sym *s = rb_entry(node, struct task_sym, sort_by_name);
+	size_t mask = size - 1;
+	size_t i;
 
-	if (s->list_name.is_head) {
-		struct task_sym *node, *tmp;
-		list_for_each_entry_safe(node, tmp, &s->list_name.head,
-			   list_name.node) {
-			list_del(&node->list_name.node);
-			s->refcount--;
-			free_task_sym(node);
-		}
+	/* Linear probing, interned name compare by pointer */
+	for (i = str_intern_hash(name) & mask;; i = (i + 1) & mask) {
+		if (!hash[i] || hash[i]->name == name)
+			return &hash[i];
 	}
+}
+
+static int tsym_hash_grow(struct task_syms *tsyms)
+{
+	size_t size, i;
+	struct task_sym **hash;
+
+	size = tsyms->hash_size ? tsyms->hash_size << 1
+				: TASK_SYMS_HASH_MIN_SIZE;
+	hash = calloc(size, sizeof(struct task_sym *));
+	if (!hash)
+		return -ENOMEM;
 
-	list_del(&s->list_name.node);
-	free_task_sym(s);
+	for (i = 0; i < tsyms->hash_size; i++) {
+		struct task_sym *s = tsyms->hash[i];
+		if (s)
+			*tsym_hash_slot(hash, size, s->name) = s;
+	}
+
+	ulp_mem_account(ULP_MEM_TASK_SYM, (long)(size - tsyms->hash_size) *
+			sizeof(struct task_sym *), 0);
+	free(tsyms->hash);
+	tsyms->hash = hash;
+	tsyms->hash_size = size;
+	return 0;
 }
 
-static void __rb_free_task_sym_addr(struct rb_node *node)
+static void tsym_hash_insert(struct task_syms *tsyms, struct task_sym *s)
 {
-	struct task_sym *s = rb_entry(node, struct task_sym, sort_by_addr);
+	if (tsyms->hash_failed)
+		return;
 
-	if (s->list_addr.is_head) {
-		struct task_sym *node, *tmp;
-		list_for_each_entry_safe(node, tmp, &s->list_addr.head,
-			   list_addr.node) {
-			list_del(&node->list_addr.node);
-			s->refcount--;
-			free_task_sym(node);
-		}
+	/* Keep load factor under 1/2 */
+	if ((tsyms->nr_hash + 1) * 2 > tsyms->hash_size &&
+	    tsym_hash_grow(tsyms)) {
+		ulp_warning("No memory for symbol hash, use rbtree.\n");
+		ulp_mem_account(ULP_MEM_TASK_SYM, -(long)(tsyms->hash_size *
+				sizeof(struct task_sym *)), 0);
+		free(tsyms->hash);
+		tsyms->hash = NULL;
+		tsyms->hash_size = tsyms->nr_hash = 0;
+		tsyms->hash_failed = true;
+		return;
 	}
 
-	list_del(&s->list_addr.node);
-	free_task_sym(s);
+	*tsym_hash_slot(tsyms->hash, tsyms->hash_size, s->name) = s;
+	tsyms->nr_hash++;
 }
 
 struct task_sym *alloc_task_sym(const char *name, unsigned long addr,
 				struct vm_area_struct *vma)
 {
-	struct task_sym *s = malloc(sizeof(struct task_sym));
+	struct task_syms *tsyms = &vma->task->tsyms;
+	struct task_sym *s = slab_alloc(&tsyms->slab);
+
+	if (!s)
+		return NULL;
 
 	memset(s, 0, sizeof(*s));
 
-	s->name = strdup(name);
+	s->name = str_intern(name);
+	if (!s->name) {
+		slab_free(&tsyms->slab, s);
+		return NULL;
+	}
 	s->addr = addr;
 	s->vma = vma;
 
@@ -92,16 +133,185 @@ struct task_sym *alloc_task_sym(const char *name, unsigned long addr,
 
 void free_task_sym(struct task_sym *s)
 {
-	if (--s->refcount == TS_REFCOUNT_NOT_USED) {
-		free(s->name);
-		free(s);
+	if (--s->refcount == TS_REFCOUNT_NOT_USED)
+		slab_free(&s->vma->task->tsyms.slab, s);
+}
+
+/**
+ * Defer task_load_vma_elf_syms() until the first lookup needs it, the
+ * VMA_ULPATCH one is lazy after load_ulp_info_from_vma().
+ */
+void task_lazy_vma_elf_syms(struct vm_area_struct *vma)
+{
+	if (vma->type == VMA_ULPATCH ? !vma->ulp :
+	    !vma->is_elf || !vma->bfd_elf_file)
+		return;
+	if (vma->syms_lazy)
+		return;
+	vma->syms_lazy = true;
+	vma->task->tsyms.nr_lazy_vmas++;
+}
+
+/* The patches are small, all symbols of them are linked directly */
+static int vma_load_ulps_syms(struct vm_area_struct *vma)
+{
+	struct vma_ulp *ulp;
+	int err = 0;
+
+	for (ulp = vma->ulp; ulp; ulp = ulp->next)
+		err = load_ulp_syms(ulp) ?: err;
+	return err;
+}
+
+/**
+ * The names of lazy patch symbols are not interned yet, the lookup by name
+ * can't tell which patch has it, link all of them, they are small.
+ */
+static void task_load_ulps_syms(struct task_struct *task)
+{
+	struct vma_ulp *ulp;
+
+	if (!task->tsyms.nr_lazy_ulps)
+		return;
+
+	list_for_each_entry(ulp, &task->ulp_list, node)
+		load_ulp_syms(ulp);
+}
+
+/**
+ * Symbol lookup is layered, the lazy VMAs are not copied into task_syms,
+ * their symbols stay in the bfd_elf_file shared by all tasks and VMAs of the
+ * same file, with addresses relative to the file. Only the symbols match
+ * the name are linked into task, with the VMA load bias applied, the VMA is
+ * still lazy.
+ *
+ * If the whole VMA is loaded later, the duplicates are dropped by the
+ * address check of __link_task_sym_name().
+ */
+static void task_load_syms_by_name(struct task_struct *task, const char *name)
+{
+	/* PLT is the last one, see FTO_VMA_PLT */
+	static unsigned long (*const sym_addr[])(struct bfd_elf_file *,
+						 const char *) = {
+		bfd_elf_text_sym_addr,
+		bfd_elf_data_sym_addr,
+		bfd_elf_plt_sym_addr,
+	};
+	struct vm_area_struct *vma;
+	struct task_sym *tsym;
+	unsigned long addr;
+	int i, nr;
+
+	if (!task->tsyms.nr_lazy_vmas)
+		return;
+
+	nr = ARRAY_SIZE(sym_addr);
+	if (!(task->fto_flag & FTO_VMA_PLT))
+		nr--;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->syms_lazy)
+			continue;
+		/* Loaded already, see task_load_ulps_syms() */
+		if (vma->type == VMA_ULPATCH)
+			continue;
+		for (i = 0; i < nr; i++) {
+			addr = sym_addr[i](vma->bfd_elf_file, name);
+			if (!addr)
+				continue;
+			tsym = alloc_task_sym(name, addr + vma->vma_elf->load_addr,
+					      vma);
+			if (!tsym)
+				return;
+			link_task_sym(task, tsym);
+			if (tsym->refcount == TS_REFCOUNT_NOT_USED)
+				slab_free(&task->tsyms.slab, tsym);
+		}
+	}
+}
+
+/**
+ * The ELF VMAs without bfd_elf_file, such as the deleted-but-mapped file or
+ * opened without FTO_VMA_ELF_FILE, resolve @name from the dynamic symbols
+ * in target memory, see vma_dynsym_addr(). The found ones are linked into
+ * task, thus resolved once.
+ */
+static void task_load_dynsym_by_name(struct task_struct *task,
+				     const char *name)
+{
+	struct vm_area_struct *vma;
+	struct task_sym *tsym;
+	unsigned long addr;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->vma_elf || vma->bfd_elf_file ||
+		    vma->type == VMA_ULPATCH)
+			continue;
+		addr = vma_dynsym_addr(vma, name);
+		if (!addr)
+			continue;
+		tsym = alloc_task_sym(name, addr, vma);
+		if (!tsym)
+			return;
+		link_task_sym(task, tsym);
+		if (tsym->refcount == TS_REFCOUNT_NOT_USED)
+			slab_free(&task->tsyms.slab, tsym);
+	}
+}
+
+static struct task_sym *__find_task_sym(struct task_syms *tsyms,
+					struct task_sym *key)
+{
+	struct rb_node *node;
+
+	if (tsyms->hash)
+		return *tsym_hash_slot(tsyms->hash, tsyms->hash_size,
+				       key->name);
+
+	node = rb_search_node(&tsyms->rb_syms, __cmp_task_sym,
+			      (unsigned long)key);
+	return node ? rb_entry(node, struct task_sym, sort_by_name) : NULL;
+}
+
+/* Such as "ns::Class::method" or "method(int)", never a mangled one */
+static bool is_demangled_name(const char *name)
+{
+	return strstr(name, "::") || strchr(name, '(');
+}
+
+/**
+ * Find the C++ symbol by demangled @name in the ELF files in order of VMAs,
+ * see bfd_find_demangled_sym(), then look up the mangled name.
+ */
+static struct task_sym *find_task_sym_demangled(struct task_struct *task,
+						const char *name,
+						const struct task_sym ***extras,
+						size_t *nr_extras)
+{
+	struct vm_area_struct *vma;
+	struct bfd_sym *bsym;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->vma_elf || !vma->bfd_elf_file ||
+		    vma->type == VMA_ULPATCH)
+			continue;
+		bsym = bfd_find_demangled_sym(vma->bfd_elf_file, name);
+		if (bsym) {
+			ulp_debug("Demangled %s is %s in %s\n", name,
+				  bfd_sym_name(bsym), vma->name_);
+			return find_task_sym(task, bfd_sym_name(bsym), extras,
+					     nr_extras);
+		}
 	}
+	return NULL;
 }
 
 /**
  * If there are mot than one symbols match the 'name', and extras is not NULL,
  * extras[nr_extras] point to symbols in 'task', extras need to free(), and
- * it's readonly.
+ * it's readonly. The lookup loops should walk the extras by
+ * task_sym_for_each_extra() or task_sym_extras() instead, which never
+ * allocate.
  *
  * Usage:
  *
@@ -113,60 +323,294 @@ struct task_sym *find_task_sym(struct task_struct *task, const char *name,
 			       const struct task_sym ***extras,
 			       size_t *nr_extras)
 {
-	struct rb_root *root;
-	struct rb_node *node;
-	struct task_sym *sym, *is, *itmp;
-	struct task_sym tmp = {
-		.name = (char *)name,
-	};
-	root = &task->tsyms.rb_syms;
-	node = rb_search_node(root, __cmp_task_sym, (unsigned long)&tmp);
+	struct task_sym *sym;
+	struct task_syms *tsyms = &task->tsyms;
+	struct task_sym tmp = {};
 
 	if (nr_extras)
 		*nr_extras = 0;
 
-	if (node && extras && nr_extras) {
-		size_t nr = 0;
-		sym = rb_entry(node, struct task_sym, sort_by_name);
+	task_load_ulps_syms(task);
+	tmp.name = str_intern_lookup(name);
 
-		/* Get extra count */
-		list_for_each_entry_safe(is, itmp, &sym->list_name.head,
-			   list_name.node)
-			nr++;
+	/* Never interned, no symbol has this name, except the demangled */
+	if (!tmp.name)
+		goto demangled;
+
+	task_load_syms_by_name(task, tmp.name);
+
+	sym = __find_task_sym(tsyms, &tmp);
+	if (!sym) {
+		/* No BFD nor on-disk file needed */
+		task_load_dynsym_by_name(task, tmp.name);
+		sym = __find_task_sym(tsyms, &tmp);
+	}
+	if (!sym)
+		goto demangled;
+
+	if (extras && nr_extras) {
+		size_t nr = task_sym_extras(sym, NULL, 0);
 
-		/* Get the sym pointers */
 		if (nr) {
-			*extras = (void *)malloc(nr * sizeof(struct task_sym **));
-			*nr_extras = nr;
-			nr = 0;
-			list_for_each_entry_safe(is, itmp,
-			    &sym->list_name.head, list_name.node) {
-				(*extras)[nr++] = is;
-			}
+			*extras = malloc(nr * sizeof(struct task_sym *));
+			if (*extras)
+				*nr_extras = task_sym_extras(sym, *extras, nr);
 		}
 	}
-	return node ? rb_entry(node, struct task_sym, sort_by_name) : NULL;
+	return sym;
+
+demangled:
+	if (!is_demangled_name(name))
+		return NULL;
+	return find_task_sym_demangled(task, name, extras, nr_extras);
+}
+
+/**
+ * Store at most @max other symbols of the same name of @sym into @buf,
+ * return the number of all of them, no allocation, see
+ * task_sym_for_each_extra().
+ */
+size_t task_sym_extras(const struct task_sym *sym, const struct task_sym **buf,
+		       size_t max)
+{
+	const struct task_sym *is;
+	size_t nr = 0;
+
+	task_sym_for_each_extra(is, sym) {
+		if (nr < max)
+			buf[nr] = is;
+		nr++;
+	}
+	return nr;
 }
 
 struct task_sym *find_task_addr(struct task_struct *task, unsigned long addr)
 {
+	struct task_syms *tsyms = &task->tsyms;
 	struct rb_root *root;
 	struct rb_node *node;
 	struct task_sym tmp = {
 		.addr = addr,
 	};
+	task_load_all_syms(task);
+
+	/* The address index is rebuilt together with ranges */
+	if ((tsyms->ranges && !tsyms->ranges_dirty) ||
+	    !task_syms_build_ranges(task))
+		return eytz_find(&tsyms->addr_index, addr);
+
 	root = &task->tsyms.rb_addrs;
 	node = rb_search_node(root, __cmp_task_addr, (unsigned long)&tmp);
 	return node ? rb_entry(node, struct task_sym, sort_by_addr) : NULL;
 }
 
+/**
+ * Build task_syms::ranges and task_syms::addr_index from rb_addrs, which is
+ * sorted already. The symbols with the same address as the rb_addrs entry
+ * are skipped.
+ */
+int task_syms_build_ranges(struct task_struct *task)
+{
+	struct task_syms *tsyms = &task->tsyms;
+	struct task_sym_range *ranges, *r;
+	struct vm_area_struct *vma = NULL;
+	struct rb_node *node;
+	struct task_sym *s;
+	unsigned long *keys;
+	void **vals;
+	size_t nr, i, n;
+	int err;
+
+	task_load_all_syms(task);
+	nr = tsyms->nr_addrs;
+
+	ranges = malloc(nr * sizeof(struct task_sym_range) ?: 1);
+	keys = malloc(nr * sizeof(*keys) ?: 1);
+	vals = malloc(nr * sizeof(*vals) ?: 1);
+	if (!ranges || !keys || !vals) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	/* The in-order of rb_addrs is descending */
+	for (node = rb_last(&tsyms->rb_addrs), i = n = 0; node && n < nr;
+	     node = rb_prev(node)) {
+		s = rb_entry(node, struct task_sym, sort_by_addr);
+		keys[n] = s->addr;
+		vals[n++] = s;
+		if (!vma || s->addr < vma->vm_start || s->addr >= vma->vm_end)
+			vma = find_vma(task, s->addr);
+		/* Symbol not mapped */
+		if (!vma)
+			continue;
+		r = &ranges[i++];
+		r->start = s->addr;
+		r->size = vma->vm_end - s->addr;
+		r->sym = s;
+	}
+	nr = i;
+
+	err = eytz_build(&tsyms->addr_index, keys, vals, n);
+	if (err)
+		goto fail;
+	free(keys);
+	free(vals);
+
+	/* Next symbol in same VMA ends this one */
+	for (i = 0; i + 1 < nr; i++)
+		ranges[i].size = MIN(ranges[i].size,
+				     ranges[i + 1].start - ranges[i].start);
+
+	free(tsyms->ranges);
+	tsyms->ranges = ranges;
+	tsyms->nr_ranges = nr;
+	tsyms->ranges_dirty = false;
+
+	ulp_debug("Build %ld task symbol ranges.\n", nr);
+	return 0;
+
+fail:
+	free(ranges);
+	free(keys);
+	free(vals);
+	return err;
+}
+
+/**
+ * Find the symbol contains @addr, like which function the PC is in.
+ *
+ * @offset: could be NULL, return addr - symbol address.
+ */
+struct task_sym *find_task_sym_contain(struct task_struct *task,
+				       unsigned long addr,
+				       unsigned long *offset)
+{
+	struct task_syms *tsyms = &task->tsyms;
+	const struct task_sym_range *base;
+	size_t n, half;
+
+	if ((!tsyms->ranges || tsyms->ranges_dirty) &&
+	    task_syms_build_ranges(task))
+		return NULL;
+
+	n = tsyms->nr_ranges;
+	if (!n)
+		return NULL;
+
+	/**
+	 * Branchless binary search, find the last range start <= addr, the
+	 * ternary is compiled to conditional move.
+	 */
+	base = tsyms->ranges;
+	while (n > 1) {
+		half = n / 2;
+		base = base[half].start <= addr ? base + half : base;
+		n -= half;
+	}
+
+	if (addr < base->start || addr - base->start >= base->size)
+		return NULL;
+
+	if (offset)
+		*offset = addr - base->start;
+	return base->sym;
+}
+
+/**
+ * The rb_syms entry of a name is the symbol of the lowest address ELF VMA,
+ * as if all VMAs were loaded in order, no matter in which order the lazy
+ * VMAs are loaded. The ULP symbols never take the place.
+ */
+static bool tsym_name_before(const struct task_sym *a,
+			     const struct task_sym *b)
+{
+	if (a->vma->type == VMA_ULPATCH || b->vma->type == VMA_ULPATCH)
+		return false;
+	return a->vma->vm_start < b->vma->vm_start;
+}
+
+/* The @new takes the duplicate name chain of @head, and @head joins it */
+static void move_name_chain(struct task_sym *head, struct task_sym *new)
+{
+	struct task_sym *is, *tmp;
+	size_t nr = 0;
+	LIST_HEAD(chain);
+
+	list_for_each_entry_safe(is, tmp, &head->list_name.head,
+				 list_name.node) {
+		list_move_tail(&is->list_name.node, &chain);
+		nr++;
+	}
+
+	/* The old head is the first duplicate now */
+	head->list_name.is_head = false;
+	list_add(&head->list_name.node, &chain);
+	head->refcount -= nr;
+
+	new->list_name.is_head = true;
+	list_init(&new->list_name.head);
+	list_splice(&chain, &new->list_name.head);
+	new->refcount += nr + 2;
+}
+
+static void replace_name_head(struct task_struct *task, struct task_sym *head,
+			      struct task_sym *new)
+{
+	struct task_syms *tsyms = &task->tsyms;
+
+	rb_replace_node(&head->sort_by_name, &new->sort_by_name,
+			&tsyms->rb_syms);
+	move_name_chain(head, new);
+
+	if (tsyms->hash)
+		*tsym_hash_slot(tsyms->hash, tsyms->hash_size, new->name) = new;
+}
+
+static bool name_chain_has(struct task_sym *head, unsigned long addr)
+{
+	struct task_sym *is;
+
+	if (head->addr == addr)
+		return true;
+	list_for_each_entry(is, &head->list_name.head, list_name.node)
+		if (unlikely(is->addr == addr))
+			return true;
+	return false;
+}
+
+static void name_chain_add(struct task_sym *head, struct task_sym *new)
+{
+	list_add(&new->list_name.node, &head->list_name.head);
+	new->refcount++;
+	head->refcount++;
+}
+
+static bool addr_chain_has(struct task_sym *head, const char *name)
+{
+	struct task_sym *is;
+
+	/* Interned names */
+	if (head->name == name)
+		return true;
+	list_for_each_entry(is, &head->list_addr.head, list_addr.node)
+		if (unlikely(is->name == name))
+			return true;
+	return false;
+}
+
+static void addr_chain_add(struct task_sym *head, struct task_sym *new)
+{
+	list_add(&new->list_addr.node, &head->list_addr.head);
+	new->refcount++;
+	head->refcount++;
+}
+
 /* If inserted, return 0 */
 static int __link_task_sym_name(struct task_struct *task, struct task_sym *new)
 {
 	struct rb_root *root;
 	struct rb_node *node;
 	struct task_sym *head;
-	struct task_sym *is, *tmp;
 	bool need_insert = true;
 
 	root = &task->tsyms.rb_syms;
@@ -179,6 +623,8 @@ static int __link_task_sym_name(struct task_struct *task, struct task_sym *new)
 		ulp_debug("TSYM new %s, %lx\n", new->name, new->addr);
 		new->list_name.is_head = true;
 		new->refcount++;
+		task->tsyms.nr_names++;
+		tsym_hash_insert(&task->tsyms, new);
 		goto done;
 	}
 
@@ -189,22 +635,13 @@ static int __link_task_sym_name(struct task_struct *task, struct task_sym *new)
 	 */
 	head = rb_entry(node, struct task_sym, sort_by_name);
 
-	if (head->addr == new->addr) {
+	if (name_chain_has(head, new->addr)) {
 		need_insert = false;
-		goto done;
-	}
-
-	list_for_each_entry_safe(is, tmp, &head->list_name.head,
-		   list_name.node) {
-		if (unlikely(is->addr == new->addr)) {
-			need_insert = false;
-			break;
-		}
-	}
-	if (need_insert) {
-		list_add(&new->list_name.node, &head->list_name.head);
-		new->refcount++;
-		head->refcount++;
+	} else if (tsym_name_before(new, head)) {
+		replace_name_head(task, head, new);
+		ulp_debug("TSYM dup %s, %lx, new head\n", new->name, new->addr);
+	} else {
+		name_chain_add(head, new);
 		ulp_debug("TSYM dup %s, %lx\n", new->name, new->addr);
 	}
 
@@ -218,7 +655,6 @@ static int __link_task_sym_addr(struct task_struct *task, struct task_sym *new)
 	struct rb_root *root;
 	struct rb_node *node;
 	struct task_sym *head;
-	struct task_sym *is, *tmp;
 	bool need_insert = true;
 
 	root = &task->tsyms.rb_addrs;
@@ -231,28 +667,16 @@ static int __link_task_sym_addr(struct task_struct *task, struct task_sym *new)
 		ulp_debug("TADDR new %s, %lx\n", new->name, new->addr);
 		new->list_addr.is_head = true;
 		new->refcount++;
+		task->tsyms.nr_addrs++;
 		goto done;
 	}
 
 	head = rb_entry(node, struct task_sym, sort_by_addr);
 
-	if (!strcmp(head->name, new->name)) {
+	if (addr_chain_has(head, new->name)) {
 		need_insert = false;
-		goto done;
-	}
-
-	list_for_each_entry_safe(is, tmp, &head->list_addr.head,
-		   list_addr.node) {
-		if (unlikely(!strcmp(is->name, new->name))) {
-			need_insert = false;
-			break;
-		}
-	}
-
-	if (need_insert) {
-		list_add(&new->list_addr.node, &head->list_addr.head);
-		new->refcount++;
-		head->refcount++;
+	} else {
+		addr_chain_add(head, new);
 		ulp_debug("TADDR dup %s, %lx\n", new->name, new->addr);
 	}
 
@@ -263,7 +687,8 @@ done:
 int link_task_sym(struct task_struct *task, struct task_sym *s)
 {
 	__link_task_sym_name(task, s);
-	__link_task_sym_addr(task, s);
+	if (!__link_task_sym_addr(task, s))
+		task->tsyms.ranges_dirty = true;
 	return 0;
 }
 
@@ -271,6 +696,8 @@ struct task_sym *next_task_sym(struct task_struct *task, struct task_sym *prev)
 {
 	struct rb_root *root;
 	struct rb_node *next;
+	if (!prev)
+		task_load_all_syms(task);
 	root = &task->tsyms.rb_syms;
 	next = prev ? rb_next(&prev->sort_by_name) : rb_first(root);
 	return next ? rb_entry(next, struct task_sym, sort_by_name) : NULL;
@@ -280,68 +707,600 @@ struct task_sym *next_task_addr(struct task_struct *task, struct task_sym *prev)
 {
 	struct rb_root *root;
 	struct rb_node *next;
+	if (!prev)
+		task_load_all_syms(task);
 	root = &task->tsyms.rb_addrs;
 	next = prev ? rb_next(&prev->sort_by_addr) : rb_first(root);
 	return next ? rb_entry(next, struct task_sym, sort_by_addr) : NULL;
 }
 
-int task_load_vma_elf_syms(struct vm_area_struct *vma)
+/**
+ * New symbols to link into task in bulk, see task_bulk_link_syms().
+ */
+struct tsym_batch {
+	struct task_sym **syms;
+	size_t nr, cap;
+};
+
+static int tsym_batch_add(struct tsym_batch *batch, struct task_sym *s)
 {
-	struct task_struct *task;
+	struct task_sym **syms;
+
+	if (batch->nr == batch->cap) {
+		batch->cap = batch->cap ? batch->cap << 1 : 256;
+		syms = realloc(batch->syms, batch->cap * sizeof(*syms));
+		if (!syms)
+			return -ENOMEM;
+		batch->syms = syms;
+	}
+	batch->syms[batch->nr++] = s;
+	return 0;
+}
+
+/**
+ * The in-order of rb_syms and rb_addrs is descending, see rb_search_node()
+ * and the comparators. The duplicate names are ordered by tsym_name_before(),
+ * thus the first one of them becomes the head.
+ */
+static int cmp_tsym_name_inorder(const void *a, const void *b)
+{
+	const struct task_sym *s1 = *(const struct task_sym **)a;
+	const struct task_sym *s2 = *(const struct task_sym **)b;
+	int ret = s1->name == s2->name ? 0 : strcmp(s2->name, s1->name);
+
+	if (ret)
+		return ret;
+	if (s1->vma->vm_start != s2->vma->vm_start)
+		return s1->vma->vm_start < s2->vma->vm_start ? -1 : 1;
+	return 0;
+}
+
+static int cmp_tsym_addr_inorder(const void *a, const void *b)
+{
+	const struct task_sym *s1 = *(const struct task_sym **)a;
+	const struct task_sym *s2 = *(const struct task_sym **)b;
+
+	if (s1->addr != s2->addr)
+		return s1->addr > s2->addr ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Merge the sorted new symbols with rb_syms in one linear pass, and build
+ * rb_syms bottom-up, the same result as __link_task_sym_name() each symbol.
+ */
+static int bulk_link_names(struct task_struct *task, struct task_sym **syms,
+			   size_t nr)
+{
+	struct task_syms *tsyms = &task->tsyms;
+	struct rb_node **nodes, *old;
+	struct task_sym *head, *s;
+	size_t i = 0, n = 0;
+	bool brand_new, replaced;
+
+	nodes = malloc((tsyms->nr_names + nr) * sizeof(*nodes) ?: 1);
+	if (!nodes)
+		return -ENOMEM;
+
+	qsort(syms, nr, sizeof(*syms), cmp_tsym_name_inorder);
+
+	old = rb_first(&tsyms->rb_syms);
+	while (old || i < nr) {
+		brand_new = replaced = false;
+
+		head = old ? rb_entry(old, struct task_sym, sort_by_name) : NULL;
+		if (head && (i == nr || head->name == syms[i]->name ||
+			     strcmp(head->name, syms[i]->name) > 0)) {
+			old = rb_next(old);
+		} else {
+			head = syms[i++];
+			head->list_name.is_head = true;
+			head->refcount++;
+			brand_new = true;
+		}
+
+		for (; i < nr && syms[i]->name == head->name; i++) {
+			s = syms[i];
+			if (name_chain_has(head, s->addr))
+				continue;
+			if (tsym_name_before(s, head)) {
+				move_name_chain(head, s);
+				head = s;
+				replaced = true;
+			} else
+				name_chain_add(head, s);
+		}
+
+		nodes[n++] = &head->sort_by_name;
+
+		if (brand_new)
+			tsym_hash_insert(tsyms, head);
+		else if (replaced && tsyms->hash)
+			*tsym_hash_slot(tsyms->hash, tsyms->hash_size,
+					head->name) = head;
+	}
+
+	rb_build_sorted(&tsyms->rb_syms, nodes, n);
+	tsyms->nr_names = n;
+	free(nodes);
+	return 0;
+}
+
+/* Same as bulk_link_names(), for rb_addrs */
+static int bulk_link_addrs(struct task_struct *task, struct task_sym **syms,
+			   size_t nr)
+{
+	struct task_syms *tsyms = &task->tsyms;
+	struct rb_node **nodes, *old;
+	struct task_sym *head, *s;
+	size_t i = 0, n = 0;
+
+	nodes = malloc((tsyms->nr_addrs + nr) * sizeof(*nodes) ?: 1);
+	if (!nodes)
+		return -ENOMEM;
+
+	qsort(syms, nr, sizeof(*syms), cmp_tsym_addr_inorder);
+
+	old = rb_first(&tsyms->rb_addrs);
+	while (old || i < nr) {
+		head = old ? rb_entry(old, struct task_sym, sort_by_addr) : NULL;
+		if (head && (i == nr || head->addr >= syms[i]->addr)) {
+			old = rb_next(old);
+		} else {
+			head = syms[i++];
+			head->list_addr.is_head = true;
+			head->refcount++;
+		}
+
+		for (; i < nr && syms[i]->addr == head->addr; i++) {
+			s = syms[i];
+			if (!addr_chain_has(head, s->name))
+				addr_chain_add(head, s);
+		}
+
+		nodes[n++] = &head->sort_by_addr;
+	}
+
+	rb_build_sorted(&tsyms->rb_addrs, nodes, n);
+	tsyms->nr_addrs = n;
+	tsyms->ranges_dirty = true;
+	free(nodes);
+	return 0;
+}
+
+/**
+ * Link a batch of new symbols, instead of two rbtree inserts with rebalance
+ * per symbol, merge them with the existing trees and rebuild the trees. The
+ * small batch into large trees is still inserted one by one, it's cheaper.
+ */
+static void task_bulk_link_syms(struct task_struct *task,
+				struct tsym_batch *batch)
+{
+	struct task_syms *tsyms = &task->tsyms;
+	size_t i;
+
+	if (!batch->nr)
+		return;
+
+	if (batch->nr * 8 < tsyms->nr_names ||
+	    bulk_link_names(task, batch->syms, batch->nr)) {
+		for (i = 0; i < batch->nr; i++)
+			__link_task_sym_name(task, batch->syms[i]);
+	}
+
+	if (batch->nr * 8 < tsyms->nr_addrs ||
+	    bulk_link_addrs(task, batch->syms, batch->nr)) {
+		for (i = 0; i < batch->nr; i++)
+			if (!__link_task_sym_addr(task, batch->syms[i]))
+				tsyms->ranges_dirty = true;
+	}
+
+	/* The duplicates linked into neither tree */
+	for (i = 0; i < batch->nr; i++)
+		if (batch->syms[i]->refcount == TS_REFCOUNT_NOT_USED)
+			slab_free(&tsyms->slab, batch->syms[i]);
+}
+
+static int vma_collect_elf_syms(struct vm_area_struct *vma,
+				struct tsym_batch *batch)
+{
+	/* PLT is the last one, see FTO_VMA_PLT */
+	static struct bfd_sym *(*const next_sym[])(struct bfd_elf_file *,
+						   struct bfd_sym *) = {
+		bfd_next_text_sym,
+		bfd_next_data_sym,
+		bfd_next_plt_sym,
+	};
 	struct bfd_elf_file *bfile;
 	struct bfd_sym *bsym;
 	struct task_sym *tsym;
+	unsigned long off;
+	int i, nr;
+
+	/**
+	 * ULP ELF VMA don't has vma::vma_elf value, the symbols are read from
+	 * the patch ELF in target, see load_ulp_syms().
+	 */
+	if (vma->type == VMA_ULPATCH) {
+		if (vma->syms_lazy) {
+			vma->syms_lazy = false;
+			vma->task->tsyms.nr_lazy_vmas--;
+		}
+		return vma_load_ulps_syms(vma);
+	}
 
 	if (!vma->is_elf || !vma->bfd_elf_file) {
 		ulp_debug("vma %s is not elf or not opened.\n", vma->name_);
 		return -EINVAL;
 	}
 
-	/**
-	 * FIXME: ULP ELF VMA don't has vma::vma_elf value, maybe we should
-	 * resolve symbol same as oridinary ELF VMA.
-	 */
-	if (vma->type == VMA_ULPATCH)
-		return -EINVAL;
-
-	task = vma->task;
 	bfile = vma->bfd_elf_file;
+	off = vma->vma_elf->load_addr;
 
-	for (bsym = bfd_next_text_sym(bfile, NULL); bsym;
-		bsym = bfd_next_text_sym(bfile, bsym)) {
-		const char *name = bfd_sym_name(bsym);
-		unsigned long addr = bfd_sym_addr(bsym);
-		unsigned long off = vma->vma_elf->load_addr;
+	if (vma->syms_lazy) {
+		vma->syms_lazy = false;
+		vma->task->tsyms.nr_lazy_vmas--;
+	}
 
-		tsym = alloc_task_sym(name, addr + off, vma);
-		link_task_sym(task, tsym);
+	nr = ARRAY_SIZE(next_sym);
+	if (!(vma->task->fto_flag & FTO_VMA_PLT))
+		nr--;
+
+	for (i = 0; i < nr; i++) {
+		for (bsym = next_sym[i](bfile, NULL); bsym;
+		     bsym = next_sym[i](bfile, bsym)) {
+			tsym = alloc_task_sym(bfd_sym_name(bsym),
+					      bfd_sym_addr(bsym) + off, vma);
+			if (!tsym || tsym_batch_add(batch, tsym))
+				return -ENOMEM;
+		}
 	}
 
-	for (bsym = bfd_next_data_sym(bfile, NULL); bsym;
-		bsym = bfd_next_data_sym(bfile, bsym)) {
-		const char *name = bfd_sym_name(bsym);
-		unsigned long addr = bfd_sym_addr(bsym);
-		unsigned long off = vma->vma_elf->load_addr;
+	return 0;
+}
 
-		tsym = alloc_task_sym(name, addr + off, vma);
-		link_task_sym(task, tsym);
+int task_load_vma_elf_syms(struct vm_area_struct *vma)
+{
+	struct tsym_batch batch = {};
+	int err;
+
+	err = vma_collect_elf_syms(vma, &batch);
+	task_bulk_link_syms(vma->task, &batch);
+	free(batch.syms);
+	return err;
+}
+
+/**
+ * Load all lazy VMAs, for whom need all symbols, like iteration, address
+ * lookup. All of them are linked in one batch.
+ */
+int task_load_all_syms(struct task_struct *task)
+{
+	struct tsym_batch batch = {};
+	struct vm_area_struct *vma;
+	int err = 0;
+
+	if (!task->tsyms.nr_lazy_vmas)
+		return 0;
+
+	task_for_each_vma(vma, task) {
+		if (vma->syms_lazy)
+			err = vma_collect_elf_syms(vma, &batch) ?: err;
 	}
 
-	for (bsym = bfd_next_plt_sym(bfile, NULL); bsym;
-		bsym = bfd_next_plt_sym(bfile, bsym)) {
-		const char *name = bfd_sym_name(bsym);
-		unsigned long addr = bfd_sym_addr(bsym);
-		unsigned long off = vma->vma_elf->load_addr;
+	task_bulk_link_syms(task, &batch);
+	free(batch.syms);
+	return err;
+}
 
-		tsym = alloc_task_sym(name, addr + off, vma);
-		link_task_sym(task, tsym);
+static bool vma_has_syms(struct task_syms *tsyms, struct vm_area_struct *vma)
+{
+	struct task_sym *s, *is;
+	struct rb_node *node;
+
+	for (node = rb_first(&tsyms->rb_syms); node; node = rb_next(node)) {
+		s = rb_entry(node, struct task_sym, sort_by_name);
+		if (s->vma == vma)
+			return true;
+		list_for_each_entry(is, &s->list_name.head, list_name.node)
+			if (is->vma == vma)
+				return true;
+	}
+	return false;
+}
+
+/**
+ * The @vma was unmapped, free all symbols of it, and relink the rest into
+ * empty trees and hash, as if they were loaded without the @vma. Every
+ * linked symbol is in rb_syms or in a list_name of it, they are collected
+ * by task_sym::list_addr, which is reset anyway, thus never fail.
+ */
+void task_unlink_vma_syms(struct vm_area_struct *vma)
+{
+	struct task_syms *tsyms = &vma->task->tsyms;
+	struct task_sym *s, *is, *tmp;
+	struct rb_node *node;
+	LIST_HEAD(keep);
+	LIST_HEAD(drop);
+
+	if (vma->type != VMA_ULPATCH && !vma->is_elf)
+		return;
+	if (!vma_has_syms(tsyms, vma))
+		return;
+
+	for (node = rb_first(&tsyms->rb_syms); node; node = rb_next(node)) {
+		s = rb_entry(node, struct task_sym, sort_by_name);
+		list_for_each_entry(is, &s->list_name.head, list_name.node)
+			list_add(&is->list_addr.node,
+				 is->vma == vma ? &drop : &keep);
+		list_add(&s->list_addr.node, s->vma == vma ? &drop : &keep);
+	}
+
+	rb_init(&tsyms->rb_syms);
+	rb_init(&tsyms->rb_addrs);
+	tsyms->nr_names = tsyms->nr_addrs = 0;
+	if (tsyms->hash)
+		memset(tsyms->hash, 0, tsyms->hash_size * sizeof(*tsyms->hash));
+	tsyms->nr_hash = 0;
+	tsyms->ranges_dirty = true;
+
+	list_for_each_entry_safe(s, tmp, &drop, list_addr.node) {
+		ulp_debug("TSYM del %s, %lx\n", s->name, s->addr);
+		list_del(&s->list_addr.node);
+		slab_free(&tsyms->slab, s);
+	}
+
+	list_for_each_entry_safe(s, tmp, &keep, list_addr.node) {
+		list_del(&s->list_addr.node);
+		s->refcount = TS_REFCOUNT_NOT_USED;
+		s->list_addr.is_head = false;
+		list_init(&s->list_addr.head);
+		s->list_name.is_head = false;
+		list_init(&s->list_name.head);
+		link_task_sym(vma->task, s);
+	}
+}
+
+/* Direct mapped cache of regexec(3) result, by interned name */
+#define TSYM_MATCH_CACHE_SIZE	4096
+
+struct tsym_match {
+	const char *name;
+	bool match;
+};
+
+struct tsym_filter {
+	const char *vma;
+	bool has_re;
+	regex_t re;
+	/* Every matched name starts with it, see regex_literal_prefix() */
+	char prefix[128];
+	struct tsym_match *cache;
+	/* Match and report the C++ symbols by demangled name */
+	bool demangle;
+	task_sym_fn fn;
+	void *arg;
+};
+
+/**
+ * The literal prefix of extended regex @regex anchored by '^', empty if
+ * unknown, such as not anchored or has alternation.
+ */
+static void regex_literal_prefix(const char *regex, char *buf, size_t size)
+{
+	const char *p;
+	size_t n = 0;
+
+	buf[0] = '\0';
+	if (regex[0] != '^' || strchr(regex, '|'))
+		return;
+
+	for (p = regex + 1; *p && n < size - 1; p++) {
+		if (strchr(".[]()*+?{}\\^$", *p))
+			break;
+		buf[n++] = *p;
+	}
+
+	/* The last literal is optional, such as "^ab*" and "^ab?" */
+	if (n && (*p == '*' || *p == '?' || *p == '{'))
+		n--;
+	buf[n] = '\0';
+}
+
+static bool tsym_filter_vma(struct tsym_filter *f, struct vm_area_struct *vma)
+{
+	if (!f->vma)
+		return true;
+	return !fnmatch(f->vma, vma->name_, 0) ||
+	       !fnmatch(f->vma, basename((char *)vma->name_), 0);
+}
+
+/* The same name in many ELFs is matched only once */
+static bool tsym_filter_name(struct tsym_filter *f, const char *name)
+{
+	struct tsym_match *m;
+
+	if (!f->has_re)
+		return true;
+
+	m = &f->cache[str_intern_hash(name) & (TSYM_MATCH_CACHE_SIZE - 1)];
+	if (m->name != name) {
+		m->name = name;
+		m->match = !regexec(&f->re, name, 0, NULL, 0);
+	}
+	return m->match;
+}
+
+/* Stream the symbols from the bfd_elf_file, never linked into task */
+static int tsym_filter_elf(struct tsym_filter *f, struct vm_area_struct *vma)
+{
+	struct bfd_elf_file *bfile = vma->bfd_elf_file;
+	unsigned long off = vma->vma_elf->load_addr;
+	const struct bfd_demangled *d;
+	struct bfd_sym *bsym;
+	const char *name;
+	int ret;
+
+	for (bsym = bfd_next_prefix_sym(bfile, f->prefix, NULL); bsym;
+	     bsym = bfd_next_prefix_sym(bfile, f->prefix, bsym)) {
+		name = bfd_sym_name(bsym);
+		/* Reported by the demangled name below */
+		if (f->demangle && !strncmp(name, "_Z", 2))
+			continue;
+		if (!tsym_filter_name(f, name))
+			continue;
+		ret = f->fn(vma, name, bfd_sym_addr(bsym) + off, f->arg);
+		if (ret)
+			return ret;
 	}
 
+	if (!f->demangle)
+		return 0;
+
+	for (d = bfd_next_demangled(bfile, f->prefix, NULL); d;
+	     d = bfd_next_demangled(bfile, f->prefix, d)) {
+		name = bfd_demangled_name(d);
+		if (!tsym_filter_name(f, name))
+			continue;
+		bsym = bfd_demangled_sym(d);
+		ret = f->fn(vma, name, bfd_sym_addr(bsym) + off, f->arg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* The symbols of patches are linked into task already */
+static int tsym_filter_ulp(struct tsym_filter *f, struct task_struct *task)
+{
+	struct task_sym *tsym, *is;
+	struct rb_node *node;
+	int ret;
+
+	for (node = rb_first(&task->tsyms.rb_syms); node;
+	     node = rb_next(node)) {
+		tsym = rb_entry(node, struct task_sym, sort_by_name);
+		if (strncmp(tsym->name, f->prefix, strlen(f->prefix)) ||
+		    !tsym_filter_name(f, tsym->name))
+			continue;
+
+		if (tsym->vma->type == VMA_ULPATCH &&
+		    tsym_filter_vma(f, tsym->vma)) {
+			ret = f->fn(tsym->vma, tsym->name, tsym->addr, f->arg);
+			if (ret)
+				return ret;
+		}
+
+		list_for_each_entry(is, &tsym->list_name.head, list_name.node) {
+			if (is->vma->type != VMA_ULPATCH ||
+			    !tsym_filter_vma(f, is->vma))
+				continue;
+			ret = f->fn(is->vma, is->name, is->addr, f->arg);
+			if (ret)
+				return ret;
+		}
+	}
 	return 0;
 }
 
+/**
+ * Call @fn for every symbol of task whose VMA name or basename matches the
+ * fnmatch(3) pattern @vma, and whose name matches the extended regex
+ * @regex, NULL matches all. The filter is pushed down, the VMAs not match
+ * are skipped, only the symbols start with the literal prefix of @regex are
+ * visited, and the symbols of lazy VMAs are streamed from the ELF file
+ * without loading into task, see task_lazy_vma_elf_syms().
+ *
+ * Stop if @fn returns non-zero and return it, -EINVAL if bad @regex.
+ */
+static int __task_filter_syms(struct task_struct *task, const char *vma,
+			      const char *regex, bool demangle,
+			      task_sym_fn fn, void *arg)
+{
+	struct tsym_filter f = {
+		.vma = vma,
+		.demangle = demangle,
+		.fn = fn,
+		.arg = arg,
+	};
+	struct vm_area_struct *v;
+	int ret = 0;
+
+	if (regex) {
+		if (regcomp(&f.re, regex, REG_EXTENDED | REG_NOSUB)) {
+			ulp_error("Invalid regex %s\n", regex);
+			return -EINVAL;
+		}
+		f.has_re = true;
+		regex_literal_prefix(regex, f.prefix, sizeof(f.prefix));
+
+		f.cache = calloc(TSYM_MATCH_CACHE_SIZE, sizeof(*f.cache));
+		if (!f.cache) {
+			regfree(&f.re);
+			return -ENOMEM;
+		}
+	}
+
+	task_for_each_vma(v, task) {
+		if (!v->is_elf || !v->bfd_elf_file || !v->vma_elf ||
+		    v->type == VMA_ULPATCH || !tsym_filter_vma(&f, v))
+			continue;
+		ret = tsym_filter_elf(&f, v);
+		if (ret)
+			goto out;
+	}
+
+	ret = tsym_filter_ulp(&f, task);
+
+out:
+	if (f.has_re) {
+		regfree(&f.re);
+		free(f.cache);
+	}
+	return ret;
+}
+
+int task_filter_syms(struct task_struct *task, const char *vma,
+		     const char *regex, task_sym_fn fn, void *arg)
+{
+	return __task_filter_syms(task, vma, regex, false, fn, arg);
+}
+
+/**
+ * Same as task_filter_syms(), but the C++ symbols of ELF files are matched
+ * and reported by the demangled name, such as '^ns::Class::'. Only the
+ * files visited are demangled, once, see bfd_next_demangled().
+ */
+int task_filter_demangled_syms(struct task_struct *task, const char *vma,
+			       const char *regex, task_sym_fn fn, void *arg)
+{
+	return __task_filter_syms(task, vma, regex, true, fn, arg);
+}
+
+/**
+ * All symbols come from task_syms::slab, release them in bulk instead of
+ * walking both rbtrees.
+ */
 void free_task_syms(struct task_struct *task)
 {
-	rb_destroy(&task->tsyms.rb_syms, __rb_free_task_sym_name);
-	rb_destroy(&task->tsyms.rb_addrs, __rb_free_task_sym_addr);
+	struct task_syms *tsyms = &task->tsyms;
+
+	rb_init(&tsyms->rb_syms);
+	rb_init(&tsyms->rb_addrs);
+	tsyms->nr_names = tsyms->nr_addrs = 0;
+	slab_cache_destroy(&tsyms->slab);
+
+	ulp_mem_account(ULP_MEM_TASK_SYM, -(long)(tsyms->hash_size *
+			sizeof(struct task_sym *)), 0);
+	free(tsyms->hash);
+	tsyms->hash = NULL;
+	tsyms->hash_size = tsyms->nr_hash = 0;
+	tsyms->hash_failed = false;
+
+	free(tsyms->ranges);
+	tsyms->ranges = NULL;
+	tsyms->nr_ranges = 0;
+	tsyms->ranges_dirty = false;
+	eytz_free(&tsyms->addr_index);
+	tsyms->nr_lazy_vmas = 0;
 }
@@ -12,6 +12,10 @@
 #include <stdlib.h>
 #include <elf.h>
 #include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 
 #include <elf/elf-api.h>
 
@@ -87,13 +91,54 @@ static void copy_regs(struct user_regs_struct *dst,
 # pragma GCC diagnostic pop
 #endif
 
+/**
+ * Classify one waitpid(2) @status of the leader of @task which runs to the
+ * trap of syscall, @sig is the signal to continue it if TASK_STOP_CONT.
+ */
+enum task_stop task_stop_status(struct task_struct *task, int status,
+				int *sig)
+{
+	*sig = 0;
+
+	if (!WIFSTOPPED(status))
+		return TASK_STOP_EXIT;
+
+	/**
+	 * PTRACE_SEIZE attached target reports group stop as
+	 * PTRACE_EVENT_STOP, it's not our breakpoint, just continue.
+	 */
+	if (status >> 16 == PTRACE_EVENT_STOP)
+		return TASK_STOP_CONT;
+
+	switch (WSTOPSIG(status)) {
+	case SIGSTOP:
+		/**
+		 * Only PTRACE_ATTACH sends SIGSTOP, under PTRACE_SEIZE it's a
+		 * real signal of target, deliver it, never lose it. The
+		 * freeze seizes the leader even in TASK_ATTACH_PTRACE mode.
+		 */
+		if (task->seized) {
+			*sig = SIGSTOP;
+			return TASK_STOP_CONT;
+		}
+		return TASK_STOP_TRAP;
+	case SIGTRAP:
+		return TASK_STOP_TRAP;
+	case SIGSEGV:
+		return TASK_STOP_FAULT;
+	default:
+		*sig = WSTOPSIG(status);
+		return TASK_STOP_CONT;
+	}
+}
+
 int wait_for_stop(struct task_struct *task)
 {
-	int ret, status = 0;
+	int ret, status, sig = 0;
 	pid_t pid = task->pid;
 
 	while (1) {
-		ret = ptrace(PTRACE_CONT, pid, NULL, (void *)(uintptr_t)status);
+		ret = ptrace(PTRACE_CONT, pid, NULL, (void *)(uintptr_t)sig);
 		if (ret < 0) {
 			print_vma(stderr, true, task->libc_vma, false);
 			ulp_error("ptrace(PTRACE_CONT, %d, ...) %m\n", pid);
@@ -105,135 +150,724 @@ int wait_for_stop(struct task_struct *task)
 			ulp_error("can't wait tracee %d\n", pid);
 			return -1;
 		}
-		if (WIFSTOPPED(status)) {
-			if (WSTOPSIG(status) == SIGSTOP ||
-				WSTOPSIG(status) == SIGTRAP) {
-				break;
-			}
-			if (WSTOPSIG(status) == SIGSEGV) {
-				ulp_error("Child process %d segment fault.\n",
-					  pid);
-				return -1;
-			}
-			status = WSTOPSIG(status);
-			continue;
+
+		switch (task_stop_status(task, status, &sig)) {
+		case TASK_STOP_TRAP:
+			return 0;
+		case TASK_STOP_CONT:
+			break;
+		case TASK_STOP_FAULT:
+			ulp_error("Child process %d segment fault.\n", pid);
+			return -1;
+		case TASK_STOP_EXIT:
+			ulp_error("Child process %d exited.\n", pid);
+			return -1;
 		}
+	}
+}
+
+/* The thread @tid must be stopped by tracer, which is current thread */
+int thread_getregs(pid_t tid, struct user_regs_struct *regs)
+{
+	int ret;
+#if defined(__x86_64__)
+	ret = ptrace(PTRACE_GETREGS, tid, NULL, regs);
+#elif defined(__aarch64__)
+	struct iovec regs_iov = {
+		.iov_base = regs,
+		.iov_len = sizeof(*regs),
+	};
+	ret = ptrace(PTRACE_GETREGSET, tid, (void *)NT_PRSTATUS,
+		     (void *)&regs_iov);
+#else
+# error "Unsupport architecture"
+#endif
+	if (ret == -1) {
+		ret = -errno;
+		if (task_err_account(TASK_ERR_REGS, -ret))
+			ulp_error("ptrace(PTRACE_GETREGS, %d, ...) failed, %s\n",
+				  tid, strerror(-ret));
+		return ret;
+	}
+	return 0;
+}
+
+static int task_getregs(struct task_struct *task, struct user_regs_struct *regs)
+{
+	return thread_getregs(task->pid, regs);
+}
+
+static int task_setregs(struct task_struct *task, struct user_regs_struct *regs)
+{
+	int ret;
+#if defined(__x86_64__)
+	ret = ptrace(PTRACE_SETREGS, task->pid, NULL, regs);
+#elif defined(__aarch64__)
+	struct iovec regs_iov = {
+		.iov_base = regs,
+		.iov_len = sizeof(*regs),
+	};
+	ret = ptrace(PTRACE_SETREGSET, task->pid, (void *)NT_PRSTATUS,
+		     (void *)&regs_iov);
+#else
+# error "Unsupport architecture"
+#endif
+	if (ret == -1) {
+		ulp_error("ptrace(PTRACE_SETREGS, %d, ...) failed, %m\n",
+			task->pid);
+		return -errno;
+	}
+	return 0;
+}
+
+/**
+ * Run target task from @regs until it stop, and get the registers when it
+ * stopped, then restore the original registers @old_regs, if @old_regs is
+ * NULL, registers will be restored by task_detach_session().
+ */
+static int task_run_regs(struct task_struct *task,
+			 struct user_regs_struct *old_regs,
+			 struct user_regs_struct *regs)
+{
+	int ret;
+
+	ret = task_setregs(task, regs);
+	if (ret)
+		return ret;
+
+	ret = wait_for_stop(task);
+	if (ret < 0) {
+		ulp_error("failed call to func\n");
+		goto restore;
+	}
+
+	ret = task_getregs(task, regs);
+
+restore:
+	if (old_regs && task_setregs(task, old_regs) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+/**
+ * Get the original registers of target task, if in attach session, use the
+ * cached registers, don't need to restore them after every syscall.
+ */
+static int task_orig_regs(struct task_struct *task,
+			  struct user_regs_struct *regs, bool *in_session)
+{
+	*in_session = task->session.active;
+	if (task->session.active) {
+		*regs = task->session.regs;
+		return 0;
+	}
+	return task_getregs(task, regs);
+}
+
+/**
+ * Attach target task, and save the original registers once, all syscalls
+ * before task_detach_session() will use the cached registers, thus, every
+ * task_syscall() only set registers and get the result registers.
+ */
+int task_attach_session(struct task_struct *task)
+{
+	int ret;
+
+	if (task->session.active) {
+		ulp_error("Task %d already in attach session.\n", task->pid);
+		return -EBUSY;
+	}
 
-		status = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+	ret = task_attach_leader(task);
+	if (ret)
+		return ret;
+
+	ret = task_getregs(task, &task->session.regs);
+	if (ret) {
+		task_detach_leader(task);
+		return ret;
 	}
+
+	task->session.active = true;
 	return 0;
 }
 
+/**
+ * Release the syscall trampoline if has, restore the original registers and
+ * detach the target task.
+ */
+int task_detach_session(struct task_struct *task)
+{
+	int ret = 0;
+
+	if (!task->session.active) {
+		ulp_error("Task %d not in attach session.\n", task->pid);
+		return -EINVAL;
+	}
+
+	task_syscall_tramp_disable(task);
+
+	task->session.active = false;
+
+	ret = task_setregs(task, &task->session.regs);
+	if (task_detach_leader(task) && !ret)
+		ret = -errno;
+	return ret;
+}
+
 int task_syscall(struct task_struct *task, int nr, unsigned long arg1,
 		 unsigned long arg2, unsigned long arg3, unsigned long arg4,
 		 unsigned long arg5, unsigned long arg6, unsigned long *res)
 {
 	int ret;
 	struct user_regs_struct old_regs, regs, syscall_regs;
+	bool in_session;
 	unsigned char __syscall[] = {SYSCALL_INSTR};
 	unsigned char orig_code[sizeof(__syscall)];
 	unsigned long libc_base = task->libc_vma->vm_start;
+	/* Use the trampoline if has one, no need to poke libc text */
+	bool use_tramp = !!task->syscall_tramp;
+	unsigned long sys_ip = use_tramp ? task->syscall_tramp : libc_base;
 
 	memset(&syscall_regs, 0x0, sizeof(syscall_regs));
 
-#if defined(__aarch64__)
-	struct iovec orig_regs_iov, regs_iov;
+	SYSCALL_REGS_PREPARE(syscall_regs, nr, arg1, arg2, arg3, arg4, arg5,
+		      arg6);
 
-	orig_regs_iov.iov_base = &old_regs;
-	orig_regs_iov.iov_len = sizeof(old_regs);
-	regs_iov.iov_base = &regs;
-	regs_iov.iov_len = sizeof(regs);
-#endif
+	errno = 0;
+
+	ret = task_orig_regs(task, &old_regs, &in_session);
+	if (ret)
+		return ret;
+
+	if (!use_tramp) {
+		memcpy_from_task(task, orig_code, libc_base, sizeof(__syscall));
+		memcpy_to_task(task, libc_base, __syscall, sizeof(__syscall));
+	}
+
+	regs = old_regs;
+
+	SYSCALL_IP(regs) = sys_ip;
+
+	copy_regs(&regs, &syscall_regs);
+
+	ret = task_run_regs(task, in_session ? NULL : &old_regs, &regs);
+	if (ret)
+		goto poke_back;
+
+	*res = SYSCALL_RET(regs);
+
+	ulp_debug("result %lx\n", *res);
+
+poke_back:
+	if (!use_tramp)
+		memcpy_to_task(task, libc_base, orig_code, sizeof(__syscall));
+	return ret;
+}
+
+void task_async_init(struct task_async *a, struct task_struct *task,
+		     task_async_fn step, void *arg)
+{
+	memset(a, 0, sizeof(*a));
+	a->task = task;
+	a->step = step;
+	a->arg = arg;
+	a->state = TASK_ASYNC_STOPPED;
+}
 
+static int __async_syscall(struct task_async *a, int nr, unsigned long arg1,
+			   unsigned long arg2, unsigned long arg3,
+			   unsigned long arg4, unsigned long arg5,
+			   unsigned long arg6)
+{
+	struct task_struct *task = a->task;
+	struct user_regs_struct regs, syscall_regs;
+	unsigned char __syscall[] = {SYSCALL_INSTR};
+	unsigned long libc_base = task->libc_vma->vm_start;
+	bool use_tramp = !!task->syscall_tramp;
+	int ret;
+
+	if (a->state != TASK_ASYNC_STOPPED || !task->session.active)
+		return -EINVAL;
+
+	memset(&syscall_regs, 0x0, sizeof(syscall_regs));
 	SYSCALL_REGS_PREPARE(syscall_regs, nr, arg1, arg2, arg3, arg4, arg5,
 		      arg6);
 
-	errno = 0;
+	regs = task->session.regs;
+	SYSCALL_IP(regs) = use_tramp ? task->syscall_tramp : libc_base;
+	copy_regs(&regs, &syscall_regs);
 
-#if defined(__x86_64__)
-	ret = ptrace(PTRACE_GETREGS, task->pid, NULL, &old_regs);
-#elif defined(__aarch64__)
-	ret = ptrace(PTRACE_GETREGSET, task->pid, (void *)NT_PRSTATUS,
-		     (void *)&orig_regs_iov);
-#else
-# error "Unsupport architecture"
-#endif
-	if (ret == -1) {
-		ulp_error("ptrace(PTRACE_GETREGS, %d, ...) failed, %m\n",
-			task->pid);
-		if (is_verbose())
-			do_backtrace(stdout);
+	if (!use_tramp && !a->poked) {
+		if (memcpy_from_task(task, a->orig_code, libc_base,
+				     sizeof(__syscall)) != sizeof(__syscall) ||
+		    memcpy_to_task(task, libc_base, __syscall,
+				   sizeof(__syscall)) != sizeof(__syscall))
+			return -EFAULT;
+		a->poked = true;
+	}
+
+	ret = task_setregs(task, &regs);
+	if (ret)
+		return ret;
+
+	if (ptrace(PTRACE_CONT, task->pid, NULL, NULL) < 0) {
+		ulp_error("ptrace(PTRACE_CONT, %d, ...) %m\n", task->pid);
 		return -errno;
 	}
+	a->state = TASK_ASYNC_RUNNING;
+	return 0;
+}
 
-	memcpy_from_task(task, orig_code, libc_base, sizeof(__syscall));
+/**
+ * Start a syscall in the stopped task of @a, like task_syscall(), but not
+ * wait for it, task_async_run() waits it and calls the step again. If
+ * failed, the error is kept for the step returns TASK_ASYNC_RUNNING.
+ */
+int task_async_syscall(struct task_async *a, int nr, unsigned long arg1,
+		       unsigned long arg2, unsigned long arg3,
+		       unsigned long arg4, unsigned long arg5,
+		       unsigned long arg6)
+{
+	int ret;
 
-	memcpy_to_task(task, libc_base, __syscall, sizeof(__syscall));
+	ret = __async_syscall(a, nr, arg1, arg2, arg3, arg4, arg5, arg6);
+	if (ret)
+		a->err = ret;
+	return ret;
+}
 
-	regs = old_regs;
+/* The libc text is restored once, when the task done or failed */
+static void async_unpoke(struct task_async *a)
+{
+	unsigned char __syscall[] = {SYSCALL_INSTR};
 
-	SYSCALL_IP(regs) = libc_base;
+	if (!a->poked)
+		return;
+	memcpy_to_task(a->task, a->task->libc_vma->vm_start, a->orig_code,
+		       sizeof(__syscall));
+	a->poked = false;
+}
 
-	copy_regs(&regs, &syscall_regs);
+static void async_finish(struct task_async *a, int err)
+{
+	if (err) {
+		a->state = TASK_ASYNC_FAILED;
+		a->err = err;
+		ulp_error("Task %d async failed after %u syscalls, %s\n",
+			  a->task->pid, a->nr_syscalls, strerror(-err));
+	} else
+		a->state = TASK_ASYNC_DONE;
+	/* Not to poke the text of dead task */
+	if (err != -ESRCH)
+		async_unpoke(a);
+}
 
-#if defined(__x86_64__)
-	ret = ptrace(PTRACE_SETREGS, task->pid, NULL, &regs);
-#elif defined(__aarch64__)
-	ret = ptrace(PTRACE_SETREGSET, task->pid, (void*)NT_PRSTATUS,
-			(void*)&regs_iov);
-#else
-# error "Unsupport architecture"
-#endif
-	if (ret == -1) {
-		ulp_error("ptrace(PTRACE_SETREGS, %d, ...) failed, %m\n",
-			task->pid);
-		ret = -errno;
-		goto poke_back;
+/* Call the step of stopped @a, until it starts a syscall or finishes */
+static void async_step(struct task_async *a)
+{
+	int ret;
+
+	ret = a->step(a);
+	if (ret == TASK_ASYNC_RUNNING && a->state == TASK_ASYNC_RUNNING)
+		return;
+	if (ret == TASK_ASYNC_RUNNING)
+		ret = a->err ?: -EINVAL;
+	else if (ret > 0)
+		ret = 0;
+	async_finish(a, ret);
+}
+
+/* Handle the waitpid(2) @status of the running @a */
+static void async_wake(struct task_async *a, int status)
+{
+	struct user_regs_struct regs;
+	pid_t pid = a->task->pid;
+	int ret;
+
+	switch (task_stop_status(a->task, status, &a->sig)) {
+	case TASK_STOP_CONT:
+		if (ptrace(PTRACE_CONT, pid, NULL,
+			   (void *)(uintptr_t)a->sig) < 0)
+			async_finish(a, -errno);
+		return;
+	case TASK_STOP_FAULT:
+		ulp_error("Child process %d segment fault.\n", pid);
+		async_finish(a, -EFAULT);
+		return;
+	case TASK_STOP_EXIT:
+		async_finish(a, -ESRCH);
+		return;
+	case TASK_STOP_TRAP:
+		break;
 	}
 
-	ret = wait_for_stop(task);
-	if (ret < 0) {
-		ulp_error("failed call to func\n");
-		goto poke_back;
+	ret = task_getregs(a->task, &regs);
+	if (ret) {
+		async_finish(a, ret);
+		return;
 	}
+	a->ret = SYSCALL_RET(regs);
+	a->nr_syscalls++;
+	a->state = TASK_ASYNC_STOPPED;
 
-#if defined(__x86_64__)
-	ret = ptrace(PTRACE_GETREGS, task->pid, NULL, &regs);
-#elif defined(__aarch64__)
-	ret = ptrace(PTRACE_GETREGSET, task->pid, (void *)NT_PRSTATUS,
-		     (void *)&regs_iov);
-#else
-# error "Unsupport architecture"
-#endif
-	if (ret == -1) {
-		ulp_error("ptrace(PTRACE_GETREGS, %d, ...) failed, %m\n",
-			task->pid);
-		ret = -errno;
-		goto poke_back;
+	async_step(a);
+}
+
+/**
+ * Drive the stopped tasks @as, by the steps of them, until all of them are
+ * done or failed, return the number of failed ones, or a negative errno.
+ *
+ * Every ptrace(2) of a tracee must come from the tracer thread, instead of
+ * one thread for each task, the calling thread keeps all of them running,
+ * it sleeps on signalfd(2) of SIGCHLD, which is blocked in the calling
+ * thread, and only reaps the running tracees by WNOHANG, the other
+ * children are not touched. The SIGCHLD may be taken by another thread,
+ * thus also wake up every TASK_ASYNC_TICK_MS. Run it in several threads
+ * for the shards of tasks, every one attaches its own shard.
+ */
+int task_async_run(struct task_async *as, int n)
+{
+	struct signalfd_siginfo si;
+	sigset_t mask, old;
+	struct pollfd pfd;
+	int i, nr_running, nr_failed, status, sfd;
+	bool blocked;
+	pid_t ret;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	blocked = !pthread_sigmask(SIG_BLOCK, &mask, &old) &&
+		  !sigismember(&old, SIGCHLD);
+
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0)
+		ulp_debug("signalfd failed, %m, poll tracees only.\n");
+
+	for (i = 0; i < n; i++) {
+		if (as[i].state == TASK_ASYNC_STOPPED)
+			async_step(&as[i]);
 	}
 
-#if defined(__x86_64__)
-	ret = ptrace(PTRACE_SETREGS, task->pid, NULL, &old_regs);
-#elif defined(__aarch64__)
-	ret = ptrace(PTRACE_SETREGSET, task->pid, (void*)NT_PRSTATUS,
-		     (void*)&orig_regs_iov);
-#else
-# error "Unsupport architecture"
-#endif
-	if (ret == -1) {
-		ulp_error("ptrace(PTRACE_SETREGS, %d, ...) failed, %m\n",
-			task->pid);
-		ret = -errno;
-		goto poke_back;
+	while (1) {
+		nr_running = 0;
+		for (i = 0; i < n; i++) {
+			struct task_async *a = &as[i];
+
+			if (a->state != TASK_ASYNC_RUNNING)
+				continue;
+
+			ret = waitpid(a->task->pid, &status, __WALL | WNOHANG);
+			if (ret < 0 && errno != EINTR)
+				async_finish(a, errno == ECHILD ? -ESRCH :
+					     -errno);
+			else if (ret > 0)
+				async_wake(a, status);
+
+			if (a->state == TASK_ASYNC_RUNNING)
+				nr_running++;
+		}
+		if (!nr_running)
+			break;
+
+		pfd.fd = sfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, sfd < 0 ? 0 : 1, TASK_ASYNC_TICK_MS) > 0) {
+			while (read(sfd, &si, sizeof(si)) == sizeof(si))
+				;
+		}
 	}
 
-	syscall_regs = regs;
-	*res = SYSCALL_RET(syscall_regs);
+	if (sfd >= 0)
+		close(sfd);
+	if (blocked)
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-	ulp_debug("result %lx\n", *res);
+	for (i = 0, nr_failed = 0; i < n; i++)
+		if (as[i].state == TASK_ASYNC_FAILED)
+			nr_failed++;
+	return nr_failed;
+}
 
-poke_back:
-	memcpy_to_task(task, libc_base, orig_code, sizeof(__syscall));
+/* Syscall table entry in target task, see SYSCALL_BATCH_STUB */
+struct remote_syscall {
+	unsigned long nr;
+	unsigned long args[6];
+	unsigned long ref_mask;
+	unsigned long ret;
+};
+
+/**
+ * Run @n syscalls in target task with only one ptrace stop/continue cycle.
+ *
+ * A scratch page contains SYSCALL_BATCH_STUB, the syscall table and @data is
+ * mapped in target task, the stub loop over the table, and all results be
+ * read back with one read. Every syscall will run even if the previous one
+ * failed, check every calls[i].ret.
+ *
+ * If bit i of calls[].ret_mask is set, the args[i] is an index of previous
+ * entry, and use it's return value as argument. If bit i of data_mask is set,
+ * the args[i] is an offset of @data, and use it's address in target task.
+ * If bit i of load_mask is set, the argument is loaded from that address
+ * when the syscall runs.
+ *
+ * If calls[i].pause is set, the target task stops after the syscall @i, the
+ * results so far are read back and @pause is called, then the rest of the
+ * table runs, which is one more stop/continue cycle.
+ */
+int task_syscall_batch_pause(struct task_struct *task,
+			     struct task_syscall_entry *calls, int n,
+			     const void *data, size_t data_len,
+			     task_syscall_pause_fn pause, void *pause_arg)
+{
+	int i, j, ret, start, end;
+	void *buf;
+	size_t len, stub_len, table_len, seg_len;
+	unsigned long page, table, remote_data;
+	struct user_regs_struct old_regs, regs;
+	bool in_session;
+	struct remote_syscall *rs;
+	unsigned char stub[] = {SYSCALL_BATCH_STUB};
+
+	if (n <= 0 || !calls)
+		return -EINVAL;
+
+	stub_len = ALIGN(sizeof(stub), sizeof(unsigned long));
+	table_len = n * sizeof(struct remote_syscall);
+	len = PAGE_UP(stub_len + table_len + data_len);
+
+	buf = malloc(stub_len + table_len + data_len);
+	if (!buf)
+		return -ENOMEM;
+
+	page = task_mmap(task, 0UL, len, PROT_READ | PROT_WRITE | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!page || page > -4096UL) {
+		ulp_error("remote mmap syscall batch failed.\n");
+		free(buf);
+		return -ENOMEM;
+	}
+
+	table = page + stub_len;
+	remote_data = table + table_len;
+
+	memset(buf, 0, stub_len + table_len);
+	memcpy(buf, stub, sizeof(stub));
+	if (data_len)
+		memcpy(buf + stub_len + table_len, data, data_len);
+
+	rs = buf + stub_len;
+	for (i = 0; i < n; i++) {
+		rs[i].nr = calls[i].nr;
+		rs[i].ret = -ENOSYS;
+		for (j = 0; j < ARRAY_SIZE(calls[i].args); j++) {
+			unsigned long arg = calls[i].args[j];
+
+			if (calls[i].ret_mask & BIT(j)) {
+				if (arg >= i) {
+					ulp_error("syscall %d arg %d refer to %ld\n",
+						  i, j, arg);
+					ret = -EINVAL;
+					goto unmap;
+				}
+				arg = table + arg * sizeof(struct remote_syscall)
+					+ offsetof(struct remote_syscall, ret);
+				rs[i].ref_mask |= BIT(j);
+			} else if (calls[i].data_mask & BIT(j))
+				arg = remote_data + arg;
+
+			if (calls[i].load_mask & BIT(j))
+				rs[i].ref_mask |= BIT(j);
+
+			rs[i].args[j] = arg;
+		}
+	}
+
+	ret = memcpy_to_task(task, page, buf, stub_len + table_len + data_len);
+	if (ret != stub_len + table_len + data_len) {
+		ret = -EFAULT;
+		goto unmap;
+	}
+
+	ret = task_orig_regs(task, &old_regs, &in_session);
+	if (ret)
+		goto unmap;
+
+	for (start = 0; start < n; start = end) {
+		/* Run until the entry which pauses, or the end of table */
+		end = start + 1;
+		while (end < n && !calls[end - 1].pause)
+			end++;
+
+		seg_len = (end - start) * sizeof(struct remote_syscall);
+
+		regs = old_regs;
+
+		SYSCALL_IP(regs) = page;
+		SYSCALL_BATCH_REGS_PREPARE(regs,
+			table + start * sizeof(struct remote_syscall),
+			end - start);
+
+		ret = task_run_regs(task, in_session ? NULL : &old_regs,
+				    &regs);
+		if (ret)
+			goto unmap;
+
+		/* Read all results back */
+		ret = memcpy_from_task(task, &rs[start],
+			table + start * sizeof(struct remote_syscall), seg_len);
+		if (ret != seg_len) {
+			ret = -EFAULT;
+			goto unmap;
+		}
+		ret = 0;
+
+		for (i = start; i < end; i++) {
+			calls[i].ret = rs[i].ret;
+			ulp_debug("batch syscall %ld result %lx\n",
+				  calls[i].nr, calls[i].ret);
+		}
+
+		if (end < n && pause)
+			pause(task, calls, end - 1, remote_data, pause_arg);
+	}
+
+unmap:
+	task_munmap(task, page, len);
+	free(buf);
+	return ret;
+}
+
+int task_syscall_batch(struct task_struct *task,
+		       struct task_syscall_entry *calls, int n,
+		       const void *data, size_t data_len)
+{
+	return task_syscall_batch_pause(task, calls, n, data, data_len, NULL,
+					NULL);
+}
+
+/**
+ * Run the position independent @stub in target task, with the @n entries
+ * @table of @table_len bytes after it, the registers are prepared by
+ * SYSCALL_BATCH_REGS_PREPARE(), the same as SYSCALL_BATCH_STUB, and the stub
+ * must end with a trap. The table is read back into @table. Target task
+ * must be attached.
+ */
+int task_run_stub(struct task_struct *task, const void *stub, size_t stub_len,
+		  void *table, size_t table_len, unsigned long n)
+{
+	struct user_regs_struct old_regs, regs;
+	unsigned long page, remote_table;
+	size_t code_len, len;
+	bool in_session;
+	void *buf;
+	int ret;
+
+	code_len = ALIGN(stub_len, sizeof(unsigned long));
+	len = PAGE_UP(code_len + table_len);
+
+	buf = calloc(1, code_len + table_len);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, stub, stub_len);
+	memcpy(buf + code_len, table, table_len);
+
+	page = task_mmap(task, 0UL, len, PROT_READ | PROT_WRITE | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!page || page > -4096UL) {
+		ulp_error("remote mmap stub failed.\n");
+		free(buf);
+		return -ENOMEM;
+	}
+	remote_table = page + code_len;
+
+	ret = memcpy_to_task(task, page, buf, code_len + table_len);
+	if (ret != code_len + table_len) {
+		ret = -EFAULT;
+		goto unmap;
+	}
+
+	ret = task_orig_regs(task, &old_regs, &in_session);
+	if (ret)
+		goto unmap;
+
+	regs = old_regs;
+	SYSCALL_IP(regs) = page;
+	SYSCALL_BATCH_REGS_PREPARE(regs, remote_table, n);
+
+	ret = task_run_regs(task, in_session ? NULL : &old_regs, &regs);
+	if (ret)
+		goto unmap;
+
+	if (table_len &&
+	    memcpy_from_task(task, table, remote_table, table_len) != table_len)
+		ret = -EFAULT;
+
+unmap:
+	task_munmap(task, page, len);
+	free(buf);
+	return ret;
+}
+
+/**
+ * Map a private executable page which contains SYSCALL_INSTR into target
+ * task, then task_syscall() jump to it, instead of overwrite and restore the
+ * first bytes of libc text on every syscall.
+ *
+ * Target task must be attached, and call task_syscall_tramp_disable() before
+ * detach.
+ */
+int task_syscall_tramp_enable(struct task_struct *task)
+{
+	unsigned char __syscall[] = {SYSCALL_INSTR};
+	unsigned long addr;
+	int n;
+
+	if (task->syscall_tramp)
+		return 0;
+
+	addr = task_mmap(task, 0UL, PAGE_SIZE, PROT_READ | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!addr || addr > -4096UL) {
+		ulp_error("remote mmap syscall trampoline failed.\n");
+		return -ENOMEM;
+	}
+
+	/* /proc/PID/mem is able to write the readonly page */
+	n = memcpy_to_task(task, addr, __syscall, sizeof(__syscall));
+	if (n != sizeof(__syscall)) {
+		ulp_error("write syscall trampoline failed.\n");
+		task_munmap(task, addr, PAGE_SIZE);
+		return -EFAULT;
+	}
+
+	ulp_debug("syscall trampoline at 0x%lx\n", addr);
+	task->syscall_tramp = addr;
+	return 0;
+}
+
+int task_syscall_tramp_disable(struct task_struct *task)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr = task->syscall_tramp;
+	int ret;
+
+	if (!addr)
+		return 0;
+
+	/**
+	 * Can't munmap the trampoline by itself, the trap instruction after
+	 * syscall will be unmapped, thus, use the libc way.
+	 */
+	task->syscall_tramp = 0;
+	ret = task_munmap(task, addr, PAGE_SIZE);
+
+	/* Maybe VMAs was updated after enable, drop the trampoline VMA */
+	vma = find_vma(task, addr);
+	if (vma && vma->vm_start == addr && vma->type == VMA_ANON) {
+		unlink_vma(task, vma);
+		free_vma(vma);
+	}
 	return ret;
 }
 
@@ -259,6 +893,7 @@ int task_munmap(struct task_struct *task, unsigned long addr, size_t size)
 	ret = task_syscall(task, __NR_munmap, addr, size, 0, 0, 0, 0, &result);
 	if (ret < 0)
 		return -1;
+	task_mem_cache_invalidate(task, addr, size);
 	return result;
 }
 
@@ -272,6 +907,20 @@ int task_mprotect(struct task_struct *task, unsigned long addr, size_t len,
 			   &result);
 	if (ret < 0)
 		return -1;
+	task_mem_cache_invalidate(task, addr, len);
+	return result;
+}
+
+int task_madvise(struct task_struct *task, unsigned long addr, size_t len,
+		 int advice)
+{
+	int ret;
+	unsigned long result;
+
+	ret = task_syscall(task, __NR_madvise, addr, len, advice, 0, 0, 0,
+			   &result);
+	if (ret < 0)
+		return -1;
 	return result;
 }
 
@@ -298,9 +947,18 @@ int task_msync_async(struct task_struct *task, unsigned long addr,
 	return task_msync(task, addr, length, MS_ASYNC);
 }
 
+/**
+ * If remote arena was created, small request is allocated from arena, see
+ * task_arena_create().
+ */
 unsigned long task_malloc(struct task_struct *task, size_t length)
 {
 	unsigned long remote_addr;
+
+	remote_addr = task_arena_alloc(task, length);
+	if (remote_addr)
+		return remote_addr;
+
 	remote_addr = task_mmap(task, 0UL, length, PROT_READ | PROT_WRITE,
 				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if (remote_addr == (unsigned long)MAP_FAILED) {
@@ -312,6 +970,8 @@ unsigned long task_malloc(struct task_struct *task, size_t length)
 
 int task_free(struct task_struct *task, unsigned long addr, size_t length)
 {
+	if (task_arena_contains(task, addr))
+		return task_arena_free(task, addr, length);
 	return task_munmap(task, addr, length);
 }
 
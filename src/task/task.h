@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/user.h>
 #include <gelf.h>
 #include <bfd.h>
 
@@ -17,7 +18,10 @@
 #include <utils/util.h>
 #include <utils/bitops.h>
 #include <utils/rbtree.h>
+#include <utils/interval_tree.h>
 #include <utils/list.h>
+#include <utils/slab.h>
+#include <utils/eytzinger.h>
 #include <utils/compiler.h>
 
 
@@ -51,6 +55,23 @@ enum vma_type {
 
 
 struct vm_area_struct;
+struct emitter;
+
+/**
+ * The dynamic symbol table of ELF in target task memory, parsed from
+ * PT_DYNAMIC, see src/task/dynsym.c.
+ */
+struct vma_elf_dynsym {
+	/* 0: not parsed yet, 1: ready, < 0: no DT_GNU_HASH or broken */
+	int state;
+	unsigned long symtab, strtab, strsz;
+	/* DT_GNU_HASH */
+	uint32_t nbuckets, symoffset, bloom_size, bloom_shift;
+	unsigned long bloom, buckets, chain;
+	/* Local copy of the bloom filter and buckets */
+	unsigned long *bloom_words;
+	uint32_t *bucket_words;
+};
 
 struct vma_elf_mem {
 	GElf_Ehdr ehdr;
@@ -61,26 +82,157 @@ struct vma_elf_mem {
 	 */
 	GElf_Phdr *phdrs;
 	unsigned long load_addr;
+	struct vma_elf_dynsym dynsym;
+};
+
+/**
+ * Patch pool, many small patches share one VMA to save VMAs, page tables
+ * and the low 4GB address space. The pool header is at the beginning of
+ * VMA, followed by the slots, each slot holds one patch ELF.
+ *
+ * VMA: | ulp_pool_hdr | slot 0 | slot 1 | ... | slot N-1 |
+ */
+#define ULP_POOL_MAGIC		"ULPPOOL"
+#define ULP_POOL_VERSION	1
+#define ULP_POOL_MAX_SLOTS	64
+#define ULP_POOL_HDR_SIZE	4096
+#define ULP_POOL_SLOT_SIZE	(64 * 1024)
+#define ULP_POOL_SIZE	\
+	(ULP_POOL_HDR_SIZE + ULP_POOL_MAX_SLOTS * ULP_POOL_SLOT_SIZE)
+
+struct ulp_pool_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_slots;
+	uint64_t slot_size;
+	/* Bitmap of used slots */
+	uint64_t used;
+	/* Length of patch ELF in each slot */
+	uint64_t len[ULP_POOL_MAX_SLOTS];
+};
+
+static inline unsigned long
+ulp_pool_slot_addr(unsigned long vm_start, const struct ulp_pool_hdr *hdr,
+		   int slot)
+{
+	return vm_start + ULP_POOL_HDR_SIZE + slot * hdr->slot_size;
+}
+
+/**
+ * Veneer island, the far patch functions are reached by the direct jump of
+ * target function to a veneer near it, which is struct jmp_table_entry, the
+ * islands are shared by all patches, so are the veneers of same patch
+ * function, see ULP_INFO_F_VENEER.
+ *
+ * VMA: | ulp_veneer_hdr | veneer 0 | veneer 1 | ... | veneer N-1 |
+ */
+#define ULP_VENEER_MAGIC	"ULPVENR"
+#define ULP_VENEER_VERSION	1
+#define ULP_VENEER_SIZE		4096
+#define ULP_VENEER_HDR_SIZE	512
+#define ULP_VENEER_SLOT_SIZE	16
+#define ULP_VENEER_MAX_SLOTS	\
+	((ULP_VENEER_SIZE - ULP_VENEER_HDR_SIZE) / ULP_VENEER_SLOT_SIZE)
+
+struct ulp_veneer_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_slots;
+	/* Number of patch functions jump through each veneer, 0 if free */
+	uint16_t refs[ULP_VENEER_MAX_SLOTS];
+};
+
+static inline unsigned long
+ulp_veneer_slot_addr(unsigned long vm_start, int slot)
+{
+	return vm_start + ULP_VENEER_HDR_SIZE + slot * ULP_VENEER_SLOT_SIZE;
+}
+
+/* Bytes of target task replaced by @ulp_info, see struct ulpatch_info */
+static inline size_t ulp_info_size(const struct ulpatch_info *ulp_info)
+{
+	if (ulp_info->flags & ULP_INFO_F_GOT)
+		return sizeof(ulp_info->orig_code[0]);
+	return sizeof(ulp_info->orig_code);
+}
+
+/**
+ * The bytes replaced by one function of patch, [virtual_addr, virtual_addr
+ * + ulp_info_size()), in task::ulp_ranges. The patches of one range are
+ * stacked in order of ULP ID, the highest one is on the top, it must be
+ * unpatched first, see find_ulp_range().
+ */
+struct ulp_range {
+	struct interval_tree_node node;
+	struct vma_ulp *ulp;
 };
 
 struct vma_ulp {
+	/* The first function of patch */
 	struct ulpatch_strtab strtab;
 	struct ulpatch_info info;
 
-	/* This is ELF */
+	/**
+	 * All functions of patch, see ULPATCH_INFO(). The infos point to
+	 * elf_mem, strtabs is malloc.
+	 */
+	unsigned int nr_funcs;
+	struct ulpatch_info *infos;
+	struct ulpatch_strtab *strtabs;
+
+	/**
+	 * Sparse image of the ELF, only the headers and the sections needed
+	 * by setup_load_info() are read, see ulp_read_sparse_elf().
+	 */
 	void *elf_mem;
+	/* Index of .symtab, not read until load_ulp_syms() */
+	unsigned int sym_idx;
+	bool syms_lazy;
+
+	/* Address and length of the ELF in target task */
+	unsigned long start;
+	unsigned long len;
+	/* Slot index if in patch pool, otherwise -1 */
+	int slot;
+	/* SEC_ULPATCH_COUNTER in target task, 0 if not counted */
+	unsigned long counters;
 
 #define MIN_ULP_START_VMA_ADDR	0x400000U
 #define MAX_ULP_START_VMA_ADDR	0xFFFFFFFFUL
 	/* Belongs to */
 	struct vm_area_struct *vma;
+	/* Next patch in the same patch pool VMA */
+	struct vma_ulp *next;
 
 	char *str_build_id;
 
 	/* struct task_struct.ulp_list */
 	struct list_head node;
+	/* struct task_struct.ulps_by_id and ulps_by_build_id */
+	struct rb_node node_id;
+	struct rb_node node_build_id;
+	/* One for each function, in task_struct.ulp_ranges */
+	struct ulp_range *ranges;
+	unsigned int nr_ranges;
 };
 
+/* Number of struct vm_area_struct of one task::vma_slab chunk */
+#define TASK_VMA_SLAB_NR	64
+
+/* Direct mapped cache of get_vma_type() by interned VMA name */
+#define TASK_VMA_TYPE_CACHE_SIZE	256
+
+struct vma_type_cache {
+	const char *name;
+	enum vma_type type;
+};
+
+/**
+ * The fields used by find_vma(), the address space walks and the lookup
+ * by name, vm_start to name_, fill the first cache line, the others follow.
+ * The name is interned and the ELF, bfd and patch details live in side
+ * structures, allocated only for the VMAs that have them.
+ */
 struct vm_area_struct {
 	/**
 	 * vaddr = load_bias + p_vaddr
@@ -88,11 +240,18 @@ struct vm_area_struct {
 	 * off = p_offset - ELF_PAGEOFFSET(p_vaddr)
 	 * vm_pgoff = off >> PAGE_SHIFT
 	 */
-	unsigned long vm_start, vm_end, vm_pgoff;
-	unsigned int major, minor;
-	unsigned long inode;
-	char name_[PATH_MAX];
-	char perms[5];
+	unsigned long vm_start, vm_end;
+	/* struct task_struct.vmas_rb */
+	struct rb_node node_rb;
+	/**
+	 * Free address space between the previous VMA and this VMA, and the
+	 * largest vm_gap of the vmas_rb subtree rooted at this VMA, see
+	 * find_vma_gap().
+	 */
+	unsigned long vm_gap;
+	unsigned long rb_subtree_gap;
+	/* Interned, see str_intern() */
+	const char *name_;
 #define PROT_FMT "%c%c%c"
 #define PROT_ARGS(p) \
 	(p & PROT_READ) ? 'r' : '-', \
@@ -100,19 +259,32 @@ struct vm_area_struct {
 	(p & PROT_EXEC) ? 'e' : '-'
 	/* parse from char perms field */
 	unsigned int prot;
-
 	enum vma_type type;
+	/**
+	 * All same name vma in one list, and the first vma is leader.
+	 * if vma == vma->leader means that this vma is leader.
+	 */
+	struct vm_area_struct *leader;
+	struct task_struct *task;
 
 	bool is_elf;
 	bool is_share_lib;
-	struct {
-		bool is_matched_phdr;
-		/**
-		 * Point to leader ELF VMA's vma::vma_elf_mem->phdrs[i] if
-		 * matched.
-		 */
-		GElf_Phdr phdr;
-	};
+	/**
+	 * The bfd_elf_file symbols are not loaded into task::tsyms yet, see
+	 * task_load_vma_elf_syms().
+	 */
+	bool syms_lazy;
+	char perms[5];
+	unsigned int major, minor;
+	unsigned long inode;
+	unsigned long vm_pgoff;
+	unsigned long voffset;
+
+	/**
+	 * Point to leader ELF VMA's vma::vma_elf->phdrs[i] if matched, NULL
+	 * otherwise, see vma_matched_phdr().
+	 */
+	GElf_Phdr *phdr;
 
 	/* Only elf has it */
 	struct vma_elf_mem *vma_elf;
@@ -123,26 +295,33 @@ struct vm_area_struct {
 	 */
 	struct bfd_elf_file *bfd_elf_file;
 
-	/* Only VMA_ULPATCH has it */
+	/**
+	 * Only VMA_ULPATCH has it. The patch pool VMA may have more than one
+	 * patch, linked by vma_ulp::next.
+	 */
 	struct vma_ulp *ulp;
-
-	struct task_struct *task;
+	/* Local copy of header if VMA_ULPATCH is patch pool */
+	struct ulp_pool_hdr *ulp_pool;
+	/**
+	 * Local copy of the whole VMA if VMA_ULPATCH is veneer island, the
+	 * veneers follow the header.
+	 */
+	struct ulp_veneer_hdr *ulp_veneer;
 
 	/* struct task_struct.vma_list */
 	struct list_head node_list;
-	/* struct task_struct.vmas_rb */
-	struct rb_node node_rb;
-
-	/**
-	 * All same name vma in one list, and the first vma is leader.
-	 * if vma == vma->leader means that this vma is leader.
-	 */
-	struct vm_area_struct *leader;
 	struct list_head siblings;
-
-	unsigned long voffset;
 };
 
+/* The 64 bytes cache line of x86_64 and aarch64 */
+_Static_assert(offsetof(struct vm_area_struct, name_) < 64,
+	       "vm_area_struct::name_ is not in the first cache line");
+
+static inline bool vma_matched_phdr(const struct vm_area_struct *vma)
+{
+	return vma->phdr != NULL;
+}
+
 /* see /usr/include/sys/user.h */
 #if defined(__x86_64__)
 typedef unsigned long long int pc_addr_t;
@@ -154,25 +333,49 @@ typedef unsigned long long pc_addr_t;
 
 struct thread {
 	pid_t tid;
-	/* TODO */
+	/**
+	 * PC when frozen, see task_check_stacks(), or when blocked, see
+	 * task_precheck_stacks().
+	 */
 	pc_addr_t ip;
+	/* stopped by task_freeze_threads() */
+	bool frozen;
+	/* signaled by task_quiesce_threads() */
+	bool quiesced;
+	/* nanoseconds from PTRACE_INTERRUPT to stopped */
+	unsigned long stop_ns;
 	/* struct task_struct.threads_list */
 	struct list_head node;
 };
 
+/* Give up if new threads are seen in this many rescans of freezing */
+#define TASK_FREEZE_MAX_ROUNDS	16
+
 /**
  * Record all file descriptors of target task
  *
  * @fd - read from /proc/PID/fd/
+ *
+ * All of them are in one task_struct::fd_table, see task_load_fds().
  */
 struct fd {
 	int fd;
-	/* Like /proc/self/fd/0 -> /dev/pts/3 */
-	char symlink[PATH_MAX];
+	/**
+	 * S_IFMT of the file with FTO_FD_TYPE, otherwise only S_IFSOCK and
+	 * S_IFIFO told by the symlink, 0 if not known.
+	 */
+	mode_t type;
+	/* Like /proc/self/fd/0 -> /dev/pts/3, in task_struct::fd_pools[] */
+	const char *symlink;
 	/* struct task_struct.fds_list */
 	struct list_head node;
 };
 
+/* At most worker threads of task_load_fds() */
+#define TASK_FD_MAX_THREADS	8
+/* Resolve in caller thread if less fds than this */
+#define TASK_FD_PARALLEL_MIN	4096
+
 /**
  * When task opening, what do you want to do?
  *
@@ -197,7 +400,9 @@ struct fd {
  */
 #define FTO_VMA_ELF_SYMBOLS	(BIT(3) | FTO_VMA_ELF | FTO_VMA_ELF_FILE)
 /**
- * Open and load /proc/PID/task/, get all target process's thread id.
+ * Freeze and check all threads of target process, otherwise only the thread
+ * group leader. The thread ids of /proc/PID/task/ are loaded by the first
+ * task_threads().
  */
 #define FTO_THREADS	BIT(4)
 /**
@@ -205,28 +410,72 @@ struct fd {
  */
 #define FTO_RDWR	BIT(5)
 /**
- * Open /proc/PID/fd/ directory and for each FD.
+ * Preload /proc/PID/fd/ directory and for each FD in open_task(), otherwise
+ * it's loaded by the first task_fds().
  */
 #define FTO_FD		BIT(6)
 /**
- * Open /proc/PID/auxv.
+ * Preload /proc/PID/auxv, otherwise it's loaded by the first task_auxv().
  */
 #define FTO_AUXV	BIT(7)
 /**
- * Open /proc/PID/status.
+ * Preload /proc/PID/status, otherwise it's loaded by the first
+ * task_status().
  */
 #define FTO_STATUS	BIT(8)
+/**
+ * Cache target task memory pages locally, only works without FTO_RDWR, see
+ * struct task_mem_cache.
+ */
+#define FTO_MEM_CACHE	BIT(9)
+/**
+ * Keep /proc/PID/maps opened, find_vma_or_query() will ask the kernel with
+ * PROCMAP_QUERY ioctl(2) if the address is not found in vmas_rb, thus, the
+ * VMAs created after open_task() could be found without re-read the whole
+ * /proc/PID/maps. Only works on Linux 6.11 and later.
+ */
+#define FTO_VMA_QUERY	BIT(10)
+/**
+ * Load the patches of ULPatch VMAs only, without the ELF of other VMAs, it's
+ * done by FTO_VMA_ELF too.
+ */
+#define FTO_VMA_ULP	BIT(11)
+/**
+ * Walk the link_map list of the dynamic linker in open_task(), the load
+ * bias of the ELF VMAs are l_addr, otherwise it's loaded by the first
+ * task_link_maps(). See src/task/linkmap.c.
+ */
+#define FTO_LINK_MAP	BIT(12)
+/**
+ * Load the PLT symbols of the ELF VMAs, such as "printf@plt", computing them
+ * from the relocations is one of the most expensive part of loading a large
+ * library, see bfd_next_plt_sym().
+ */
+#define FTO_VMA_PLT	BIT(13)
+/**
+ * Classify the fds by the inode type with stat(2) of /proc/PID/fd/N, the
+ * symlinks of sockets and anonymous inodes are made up without readlink(2),
+ * such as "socket:[1234]". Only with FTO_FD or task_fds().
+ */
+#define FTO_FD_TYPE	BIT(14)
 
 #define FTO_ALL 0xffffffff
 
+/**
+ * Profiles of commands, only what the command uses at startup, the threads,
+ * fds, auxv and status are loaded on first use. The read-only ones cache the
+ * target memory, see FTO_MEM_CACHE.
+ */
 #define FTO_ULFTRACE	(FTO_PROC | \
 			FTO_VMA_ELF_SYMBOLS | \
 			FTO_THREADS | \
-			FTO_RDWR | \
-			FTO_FD | \
-			FTO_AUXV | \
-			FTO_STATUS)
-#define FTO_ULPATCH	FTO_ULFTRACE
+			FTO_VMA_PLT | \
+			FTO_RDWR)
+#define FTO_ULPATCH	((FTO_ULFTRACE | FTO_VMA_QUERY) & ~FTO_VMA_PLT)
+#define FTO_ULPINFO	(FTO_VMA_ULP | FTO_MEM_CACHE)
+/* Read-only, ultask adds FTO_RDWR for the writing operations */
+#define FTO_ULTASK	(FTO_ALL & ~(FTO_FD | FTO_AUXV | FTO_STATUS | \
+				 FTO_LINK_MAP | FTO_RDWR))
 
 /* under ULP_PROC_ROOT_DIR/${PID}/ */
 #define TASK_PROC_COMM	"comm"
@@ -258,9 +507,26 @@ struct task_status {
 	gid_t gid, egid, sgid, fsgid;
 };
 
+/* One struct link_map of the dynamic linker in target, see FTO_LINK_MAP */
+struct task_link_map {
+	/* Address of struct link_map */
+	unsigned long addr;
+	/* Difference between the ELF vaddr and the address in memory */
+	unsigned long l_addr;
+	/* Address of .dynamic */
+	unsigned long l_ld;
+	/* Empty for the executable */
+	char *name;
+	/* The leader ELF VMA contains l_ld, NULL if not found */
+	struct vm_area_struct *vma;
+	/* head is task_struct::link_maps */
+	struct list_head node;
+};
+
 struct task_sym {
 /* Public */
-	char *name;
+	/* Interned, see str_intern() */
+	const char *name;
 	unsigned long addr;
 	struct vm_area_struct *vma;
 
@@ -313,6 +579,16 @@ struct task_sym {
 	list_name;
 };
 
+/**
+ * One entry of task_syms::ranges, the symbol covers [start, start + size),
+ * the size is the distance to the next symbol, limited by the VMA end.
+ */
+struct task_sym_range {
+	unsigned long start;
+	unsigned long size;
+	struct task_sym *sym;
+};
+
 struct task_syms {
 	/**
 	 * rb_syms:
@@ -321,13 +597,114 @@ struct task_syms {
 	 * - node is struct task_sym.sort_by_addr
 	 */
 	struct rb_root rb_syms, rb_addrs;
+	/* Number of nodes in rb_syms and rb_addrs */
+	size_t nr_names, nr_addrs;
+
+	/* All struct task_sym come from here */
+	struct slab_cache slab;
+
+	/**
+	 * Open addressing hash index over rb_syms, the key is the interned
+	 * name, see str_intern_hash(). The slot point to the same symbol as
+	 * rb_syms, the duplicate name symbols are still in list_name.
+	 *
+	 * NULL if the index could not be allocated, fallback to rb_syms.
+	 */
+	struct task_sym **hash;
+	/* power of two */
+	size_t hash_size;
+	size_t nr_hash;
+	bool hash_failed;
+
+	/**
+	 * Sorted by address, for containing symbol lookup, see
+	 * find_task_sym_contain(). Rebuilt on next lookup once new symbol
+	 * linked.
+	 */
+	struct task_sym_range *ranges;
+	size_t nr_ranges;
+	bool ranges_dirty;
+	/**
+	 * Exact address lookup of rb_addrs, see find_task_addr(), rebuilt
+	 * together with ranges.
+	 */
+	struct eytz_index addr_index;
+
+	/* Number of vm_area_struct::syms_lazy VMAs */
+	size_t nr_lazy_vmas;
+	/* Number of vma_ulp::syms_lazy patches, see load_ulp_syms() */
+	size_t nr_lazy_ulps;
 };
 
 static inline void task_syms_init(struct task_syms *tsyms) {
 	rb_init(&tsyms->rb_syms);
 	rb_init(&tsyms->rb_addrs);
+	tsyms->nr_names = tsyms->nr_addrs = 0;
+	slab_cache_init(&tsyms->slab, sizeof(struct task_sym), 0);
+	tsyms->slab.mem_type = ULP_MEM_TASK_SYM;
+	tsyms->hash = NULL;
+	tsyms->hash_size = tsyms->nr_hash = 0;
+	tsyms->hash_failed = false;
+	tsyms->ranges = NULL;
+	tsyms->nr_ranges = 0;
+	tsyms->ranges_dirty = false;
+	eytz_init(&tsyms->addr_index);
+	tsyms->nr_lazy_vmas = 0;
+	tsyms->nr_lazy_ulps = 0;
 }
 
+#define TASK_SYMS_HASH_MIN_SIZE	1024
+
+/**
+ * Page cache of target task memory, for read-mostly inspection like ultask
+ * and ulpinfo, which read the same pages again and again.
+ */
+struct task_mem_cache {
+	bool enabled;
+	/* struct task_page.node */
+	struct rb_root pages;
+	/* struct task_page.lru */
+	struct list_head lru;
+	size_t nr_pages;
+	size_t max_pages;
+#define TASK_MEM_CACHE_MAX_PAGES	256
+	unsigned long hits, misses;
+};
+
+/**
+ * Remote arena in target task, one big anonymous mmap, small task_malloc()
+ * requests are sub-allocated from it locally without any remote syscall,
+ * see task_arena_create().
+ */
+struct task_arena {
+	unsigned long base;
+	size_t size;
+	/* offset of the never allocated space */
+	size_t bump;
+	/* bytes of allocated chunks, and bytes the caller asked for */
+	size_t used, requested;
+	size_t peak;
+	unsigned long nr_allocs, nr_frees, nr_free_chunks;
+	/* power of two size classes, struct arena_chunk.node */
+#define TASK_ARENA_MIN_CHUNK	16
+#define TASK_ARENA_NR_CLASSES	9
+#define TASK_ARENA_MAX_CHUNK	(TASK_ARENA_MIN_CHUNK << (TASK_ARENA_NR_CLASSES - 1))
+#define TASK_ARENA_DEFAULT_SIZE	(16 * PAGE_SIZE)
+	struct list_head free_lists[TASK_ARENA_NR_CLASSES];
+};
+
+/**
+ * One element of scatter-gather remote memory copy, see
+ * memcpy_from_task_iov() and memcpy_to_task_iov().
+ */
+struct task_iov {
+	/* address in target task */
+	unsigned long remote;
+	/* local buffer */
+	void *local;
+	size_t len;
+};
+
 /**
  * This struct use to discript a running process in system, like you can see in
  * proc file system, there are lots of HANDLE in this structure get from procfs.
@@ -339,6 +716,12 @@ struct task_struct {
 	pid_t pid;
 
 	int fto_flag;
+	/**
+	 * FTO_THREADS, FTO_FD, FTO_AUXV, FTO_STATUS and FTO_LINK_MAP if
+	 * loaded, see task_threads(), task_fds(), task_auxv(), task_status()
+	 * and task_link_maps().
+	 */
+	int fto_loaded;
 
 	/* realpath of /proc/PID/exe */
 	char *exe;
@@ -348,13 +731,71 @@ struct task_struct {
 	struct task_struct_auxv auxv;
 	struct task_status status;
 
+	/**
+	 * pidfd_open(2) of task, -1 if not supported, and /proc/PID directory
+	 * opened after it, see src/task/pidfd.c.
+	 */
+	int pidfd;
+	int proc_dirfd;
+	/**
+	 * O_PATH of /proc/PID/root if task is in another mount namespace,
+	 * otherwise -1, see task_path().
+	 */
+	int root_dirfd;
+
 	/* open(2) /proc/[PID]/mem */
 	int proc_mem_fd;
+	/**
+	 * process_vm_readv(2)/process_vm_writev(2) is not permitted for this
+	 * task (ENOSYS, EPERM, seccomp, etc.), only use proc_mem_fd.
+	 */
+	bool proc_mem_only;
+
+	/* open(2) /proc/[PID]/maps, see FTO_VMA_QUERY */
+	int proc_maps_fd;
+	/* PROCMAP_QUERY ioctl(2) is supported */
+	bool procmap_query;
+
+	struct task_mem_cache mcache;
+
+	/**
+	 * Address of syscall trampoline page in target task, see
+	 * task_syscall_tramp_enable(), zero means poke libc text.
+	 */
+	unsigned long syscall_tramp;
+
+	/* Remote arena for task_malloc(), NULL if not created */
+	struct task_arena *arena;
+
+	/* Signal-based quiescence, see task_quiesce_threads() */
+	struct task_quiesce *quiesce;
+
+	/**
+	 * Attach session, the original registers are saved once when attach,
+	 * and restored when detach, see task_attach_session().
+	 */
+	struct {
+		bool active;
+		struct user_regs_struct regs;
+	} session;
+
+	/**
+	 * The leader is traced by PTRACE_SEIZE, no matter of the attach mode,
+	 * such as frozen by task_freeze_threads() with FTO_THREADS, thus no
+	 * SIGSTOP is sent by attach, see task_stop_status().
+	 */
+	bool seized;
 
 	/* struct vm_area_struct.node_list */
 	struct list_head vma_list;
 	/* struct vm_area_struct.node_rb */
 	struct rb_root vmas_rb;
+	/* All struct vm_area_struct come from here */
+	struct slab_cache vma_slab;
+	/* struct vma_elf_mem and the phdrs, see task_elf_alloc() */
+	struct str_pool elf_pool;
+	/* See task_vma_type() */
+	struct vma_type_cache vma_types[TASK_VMA_TYPE_CACHE_SIZE];
 
 	/* VMA_SELF ELF vma */
 	struct vm_area_struct *vma_self_elf;
@@ -376,12 +817,38 @@ struct task_struct {
 	/* struct vma_ulp.node */
 	struct list_head ulp_list;
 	unsigned int max_ulp_id;
+	/* Index of ulp_list, see task_index_ulp() */
+	struct rb_root_cached ulps_by_id;
+	struct rb_root ulps_by_build_id;
+	/* Interval tree of struct ulp_range, see find_ulp_range() */
+	struct rb_root ulp_ranges;
 
 	/* struct thread.node */
 	struct list_head threads_list;
 
-	/* struct fd.node */
+	/* struct fd.node, in order of fd */
 	struct list_head fds_list;
+	struct fd *fd_table;
+	unsigned int nr_fds;
+	/* The symlinks, one pool for each worker of task_load_fds() */
+	struct str_pool fd_pools[TASK_FD_MAX_THREADS];
+
+	/* struct task_link_map.node, in order of the linker */
+	struct list_head link_maps;
+	size_t nr_link_maps;
+
+	/**
+	 * Cached by task_cache_add(), @cache_ref is the number of open_task()
+	 * not closed, @start_time is the starttime of /proc/PID/stat, which
+	 * tells the reused pid.
+	 */
+	bool cached;
+	int cache_ref;
+	unsigned long long start_time;
+	/* Last time closed, in nanoseconds */
+	unsigned long cache_idle_ns;
+	/* task_cache list */
+	struct list_head cache_node;
 };
 
 
@@ -391,9 +858,22 @@ int open_pid_mem_ro(pid_t pid);
 int open_pid_mem_rw(pid_t pid);
 
 bool proc_pid_exist(pid_t pid);
+int proc_pgrep(const char *comm, pid_t *pids, int max);
+bool proc_pid_libc_mapped(pid_t pid);
 char *get_proc_pid_exe(pid_t pid, char *buf, size_t bufsz);
 char *get_proc_pid_cwd(pid_t pid, char *buf, size_t bufsz);
 
+/* Result of task_proc_gc() */
+struct task_proc_gc_stats {
+	/* ULP_PROC_ROOT_DIR/PID found */
+	unsigned int nr_dirs;
+	/* Of the exited processes */
+	unsigned int nr_removed;
+	unsigned int nr_errors;
+};
+
+int task_proc_gc(int nr_threads, struct task_proc_gc_stats *stats);
+
 struct vm_area_struct *next_vma(struct task_struct *task,
 				struct vm_area_struct *prev);
 
@@ -409,27 +889,92 @@ void insert_vma(struct task_struct *task, struct vm_area_struct *vma,
 void unlink_vma(struct task_struct *task, struct vm_area_struct *vma);
 void free_vma(struct vm_area_struct *vma);
 
+int task_vma_query_init(struct task_struct *task);
+void task_vma_query_destroy(struct task_struct *task);
+struct vm_area_struct *task_query_vma(struct task_struct *task,
+				      unsigned long vaddr);
+/* Lookup vmas_rb only, no side effect, see find_vma_or_query() */
 struct vm_area_struct *find_vma(const struct task_struct *task,
 				unsigned long vaddr);
+struct vm_area_struct *find_vma_or_query(struct task_struct *task,
+					 unsigned long vaddr);
 struct vm_area_struct *next_vma(struct task_struct *task,
 				struct vm_area_struct *prev);
 
 enum vma_type get_vma_type(pid_t pid, const char *exe, const char *name);
+pid_t ulp_vma_owner(const char *name);
 
 /* Find a span area between two vma */
+unsigned long find_vma_gap(struct task_struct *task, size_t size,
+			   unsigned long low, unsigned long high);
 unsigned long find_vma_span_area(struct task_struct *task, size_t size,
 				 unsigned long base);
+/**
+ * Change set of refresh_task_vmas().
+ */
+struct task_vma_changes {
+	unsigned int nr_added;
+	unsigned int nr_removed;
+	/* Same start address and same file, but size or permission changed */
+	unsigned int nr_resized;
+	unsigned int nr_unchanged;
+};
+
+enum task_vma_event {
+	TASK_VMA_ADDED,
+	TASK_VMA_REMOVED,
+	TASK_VMA_RESIZED,
+};
+
+/**
+ * Changed VMA of refresh_task_vmas_notify(), the removed one is freed after
+ * return, the resized one is updated already, @old_end and @old_perms are
+ * the ones before.
+ */
+typedef void (*task_vma_notify_fn)(struct vm_area_struct *vma,
+				   enum task_vma_event event,
+				   unsigned long old_end,
+				   const char *old_perms, void *arg);
+
+/**
+ * One line of /proc/PID/maps, or one VMA of PROCMAP_QUERY ioctl(2) or the
+ * task_vma BPF iterator, the name points into the buffer of the reader, and
+ * it is not NUL terminated.
+ */
+struct maps_entry {
+	unsigned long start, end, off;
+	unsigned int major, minor;
+	unsigned long inode;
+	char perms[5];
+	const char *name;
+	size_t name_len;
+};
+
 int read_task_vmas(struct task_struct *task, bool update_ulp);
+int read_task_vmas_from(struct task_struct *task,
+			const struct maps_entry *ents, unsigned int nr);
+int refresh_task_vmas(struct task_struct *task,
+		      struct task_vma_changes *changes);
+int refresh_task_vmas_notify(struct task_struct *task,
+			     struct task_vma_changes *changes,
+			     task_vma_notify_fn notify, void *arg);
 int update_task_vmas_ulp(struct task_struct *task);
+void vma_free_elf(struct vm_area_struct *vma);
+void *task_elf_alloc(struct task_struct *task, size_t size);
 int free_task_vmas(struct task_struct *task);
 
 int dump_task(FILE *fp, const struct task_struct *t, bool detail);
 
 void dump_task_vmas(FILE *fp, struct task_struct *task, bool detail);
+/* Skip the zero pages, see dump_task_addr_to_fd() */
+#define DUMP_F_SPARSE	BIT(0)
+
+int dump_task_addr_to_fd(int fd, struct task_struct *task, unsigned long addr,
+		unsigned long size, unsigned int flags);
 int dump_task_addr_to_file(const char *ofile, struct task_struct *task,
-		unsigned long addr, unsigned long size);
+		unsigned long addr, unsigned long size, unsigned int flags);
 int dump_task_vma_to_file(const char *ofile, struct task_struct *task,
-		unsigned long addr);
+		unsigned long addr, unsigned int flags);
 void dump_task_threads(FILE *fp, struct task_struct *task, bool detail);
 void dump_task_fds(FILE *fp, struct task_struct *task, bool detail);
 
@@ -437,6 +982,8 @@ int vma_prot2flags(unsigned int prot);
 unsigned int vma_perms2prot(char *perms);
 
 bool elf_vma_is_interp_exception(struct vm_area_struct *vma);
+int vma_read_build_id(struct vm_area_struct *vma, uint8_t *bid,
+		      size_t bid_size);
 
 const char *vma_type_name(enum vma_type type);
 void print_vma(FILE *fp, bool first_line, struct vm_area_struct *vma,
@@ -445,10 +992,23 @@ void print_thread(FILE *fp, struct task_struct *task, struct thread *thread);
 void print_fd(FILE *fp, struct task_struct *task, struct fd *fd);
 
 int alloc_ulp(struct vm_area_struct *vma);
+int alloc_ulp_slot(struct vm_area_struct *vma, int slot);
+void unlink_ulp(struct vma_ulp *ulp);
 void free_ulp(struct vm_area_struct *vma);
-
-int print_task_auxv(FILE *fp, const struct task_struct *task);
-int print_task_status(FILE *fp, const struct task_struct *task);
+int vma_load_ulp(struct vm_area_struct *vma);
+int task_index_ulp(struct task_struct *task, struct vma_ulp *ulp);
+struct vma_ulp *find_ulp_by_id(struct task_struct *task, unsigned int id);
+struct vma_ulp *find_ulp_by_build_id(struct task_struct *task,
+				     const char *build_id);
+unsigned int task_last_ulp_id(struct task_struct *task);
+struct ulp_range *find_ulp_range(struct task_struct *task, unsigned long start,
+				 unsigned long last);
+struct ulp_range *find_ulp_range_next(struct ulp_range *range,
+				      unsigned long start, unsigned long last);
+
+int print_task_auxv(FILE *fp, struct task_struct *task);
+int print_task_status(FILE *fp, struct task_struct *task);
+int print_task_link_map(FILE *fp, struct task_struct *task);
 
 #define current get_current_task()
 #define zero_task __zero_task()
@@ -458,22 +1018,471 @@ struct task_struct *const get_current_task(void);
 struct task_struct *const __zero_task(void);
 
 struct task_struct *open_task(pid_t pid, int flag);
+int task_open_handles(struct task_struct *task);
+void task_close_handles(struct task_struct *task);
+bool task_alive(struct task_struct *task);
+int task_proc_open(struct task_struct *task, const char *name, int flags);
+ssize_t task_proc_readlink(struct task_struct *task, const char *name,
+			   char *buf, size_t bufsz);
+int task_proc_stat(struct task_struct *task, const char *name,
+		   struct stat *st);
+int task_proc_readdir(struct task_struct *task, const char *name,
+		      int (*cb)(struct task_struct *task, int num, void *arg),
+		      void *arg);
+int task_getfd(struct task_struct *task, int fd);
+const char *task_path(struct task_struct *task, const char *path, char *buf,
+		      size_t bufsz);
+bool task_path_exist(struct task_struct *task, const char *path);
+int reload_task(struct task_struct *task);
+int task_load_threads(struct task_struct *task);
+int task_refresh_threads(struct task_struct *task);
+void task_free_threads(struct task_struct *task);
+int task_load_fds(struct task_struct *task);
+void task_free_fds(struct task_struct *task);
+struct list_head *task_threads(struct task_struct *task);
+struct list_head *task_fds(struct task_struct *task);
+const struct task_struct_auxv *task_auxv(struct task_struct *task);
+const struct task_status *task_status(struct task_struct *task);
+int task_load_link_map(struct task_struct *task);
+void task_free_link_map(struct task_struct *task);
+struct list_head *task_link_maps(struct task_struct *task);
+struct task_link_map *vma_link_map(struct vm_area_struct *vma);
+
+/**
+ * Cache of opened tasks for long-lived process, see ulpatchd(8) and
+ * src/task/cache.c.
+ */
+/* Saved cached task, see task_cache_save() */
+struct task_cache_ent {
+	int32_t pid;
+	int32_t flag;
+	/* Field 22 of /proc/PID/stat */
+	uint64_t start_time;
+};
+
+unsigned long long proc_pid_start_time(pid_t pid);
+void task_cache_enable(unsigned int max_tasks, unsigned long max_idle_ns);
+struct task_struct *task_cache_get(pid_t pid, int flag);
+void task_cache_add(struct task_struct *task);
+bool task_cache_put(struct task_struct *task);
+void task_cache_prune(void);
+void task_cache_flush(void);
+int task_cache_evict(pid_t pid);
+int task_cache_save(struct task_cache_ent *ents, int max);
+int task_cache_restore(const struct task_cache_ent *ent);
+void dump_task_cache(FILE *fp);
+
+/**
+ * Events of processes from the proc connector, see src/task/events.c.
+ */
+enum task_event_type {
+	TASK_EVENT_FORK,
+	TASK_EVENT_EXEC,
+	TASK_EVENT_EXIT,
+};
+
+struct task_event {
+	enum task_event_type type;
+	/* The tgid, never the thread */
+	pid_t pid;
+	/* TASK_EVENT_FORK only */
+	pid_t ppid;
+	/* TASK_EVENT_EXIT only, see waitpid(2) */
+	int exit_code;
+};
+
+int task_events_open(void);
+void task_events_close(int fd);
+int task_events_read(int fd,
+		     void (*cb)(const struct task_event *ev, void *arg),
+		     void *arg);
 int close_task(struct task_struct *task);
+void close_task_fast_enable(bool enable);
 void print_task(FILE *fp, const struct task_struct *task, bool detail);
 bool task_is_pie(struct task_struct *task);
 
+/**
+ * TASK_ATTACH_PTRACE: PTRACE_ATTACH, and wait for SIGSTOP.
+ * TASK_ATTACH_SEIZE: PTRACE_SEIZE and PTRACE_INTERRUPT, wait for the
+ *   PTRACE_EVENT_STOP, no SIGSTOP is sent to target task.
+ */
+enum task_attach_mode {
+	TASK_ATTACH_PTRACE,
+	TASK_ATTACH_SEIZE,
+};
+
+void set_task_attach_mode(enum task_attach_mode mode);
+enum task_attach_mode get_task_attach_mode(void);
+unsigned long task_attach_latency_ns(void);
+
 int task_attach(pid_t pid);
+int task_attach_leader(struct task_struct *task);
+int task_freeze_threads(struct task_struct *task);
+int task_thaw_threads(struct task_struct *task);
 int task_detach(pid_t pid);
+int task_detach_leader(struct task_struct *task);
+int task_attach_session(struct task_struct *task);
+int task_detach_session(struct task_struct *task);
+int thread_getregs(pid_t tid, struct user_regs_struct *regs);
+
+/* Max frames of walk one thread stack */
+#define TASK_STACK_MAX_DEPTH	128
+/* Max bytes of one thread stack from SP to the outermost frame */
+#define TASK_STACK_MAX_SIZE	SZ_8M
+#define TASK_STACK_MAX_THREADS	16
+/* Walk stacks in current thread if the task has less threads */
+#define TASK_STACK_PARALLEL_MIN	8
+
+/* Address range [start, end) */
+struct task_addr_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+/**
+ * Result of task_check_stacks(), @busy_tid and @busy_addr is the first
+ * thread found in ranges.
+ */
+struct task_stack_stats {
+	unsigned int nr_threads;
+	unsigned long nr_frames;
+	/* Whole cost of check, and the slowest thread */
+	unsigned long check_ns;
+	unsigned long max_thread_ns;
+	bool timeout;
+	pid_t busy_tid;
+	unsigned long busy_addr;
+	/* Not blocked, the PC is unknown, see task_precheck_stacks() */
+	unsigned int nr_running;
+};
+
+int task_check_stacks(struct task_struct *task,
+		      const struct task_addr_range *ranges, int nr,
+		      unsigned long budget_ns, struct task_stack_stats *stats);
+int task_precheck_stacks(struct task_struct *task,
+			 const struct task_addr_range *ranges, int nr,
+			 struct task_stack_stats *stats);
+
+/* Ranges checked by the injected signal handler at most */
+#define TASK_QUIESCE_MAX_RANGES	64
+
+int task_quiesce_threads(struct task_struct *task,
+			 const struct task_addr_range *ranges, int nr,
+			 unsigned long budget_ns,
+			 struct task_stack_stats *stats);
+bool task_quiesced(struct task_struct *task);
+int task_quiesce_check(struct task_struct *task);
+int task_quiesce_release(struct task_struct *task);
+int task_quiesce_end(struct task_struct *task);
+void task_quiesce_free(struct task_struct *task);
+
+/* Freeze only to copy the dirty pages again, see task_snapshot() */
+#define SNAPSHOT_F_SOFT_DIRTY	BIT(0)
+
+/**
+ * Result of task_snapshot(), @stop_ns is the sum of all freezes, @nr_dirty
+ * is the number of pages copied in the second freeze of soft-dirty mode.
+ */
+struct task_snapshot_stats {
+	unsigned int nr_threads;
+	int nr_loads;
+	unsigned long bytes;
+	/* Pages zeroed */
+	unsigned long unreadable;
+	unsigned long nr_dirty;
+	unsigned long stop_ns;
+	unsigned long copy_ns;
+	/* Of the .zst file, after thawed */
+	unsigned long compress_ns;
+};
+
+int task_snapshot(struct task_struct *task, const char *file,
+		  unsigned int flags, int nr_threads,
+		  struct task_snapshot_stats *stats);
+
+/* One match of task_search(), in @vma */
+struct task_search_match {
+	unsigned long addr;
+	struct vm_area_struct *vma;
+};
+
+ssize_t task_search(struct task_struct *task, const void *pat, size_t len,
+		    const char *vma_pattern, int nr_threads, size_t max,
+		    struct task_search_match **matches);
+
+/**
+ * Decode the object of DWARF type in target task, see src/task/decode.c,
+ * @depth levels of pointers are followed, TASK_DECODE_MAX_OBJS objects at
+ * most.
+ */
+#define TASK_DECODE_MAX_DEPTH	16
+#define TASK_DECODE_MAX_OBJS	4096
+
+struct task_decode_stats {
+	unsigned int nr_objs;
+	unsigned int nr_levels;
+	/* Vectored reads of levels, and the retries of failed objects */
+	unsigned int nr_reads;
+	unsigned int nr_unreadable;
+	/* Pointers not followed, more than TASK_DECODE_MAX_OBJS */
+	unsigned int nr_dropped;
+};
+
+int task_decode(FILE *fp, struct task_struct *task, const char *type,
+		unsigned long addr, int depth, struct task_decode_stats *stats);
+
+/* One differing range of task_verify_text(), in @vma */
+struct task_text_diff {
+	unsigned long start, end;
+	struct vm_area_struct *vma;
+};
+
+struct task_verify_stats {
+	unsigned int nr_vmas;
+	/* The VMAs skipped, the file was replaced or deleted */
+	unsigned int skipped;
+	unsigned long bytes;
+	unsigned long diff_bytes;
+	unsigned long unreadable;
+};
+
+ssize_t task_verify_text(struct task_struct *task, int nr_threads,
+			 struct task_text_diff **diffs,
+			 struct task_verify_stats *stats);
+
+/* see linux:Documentation/admin-guide/mm/pagemap.rst */
+#define PM_PFN_MASK	(BIT(55) - 1)
+#define PM_SOFT_DIRTY	BIT(55)
+#define PM_SWAP		BIT(62)
+#define PM_PRESENT	BIT(63)
+
+/**
+ * Pages of VMA, @thp is the pages in PMD mapped THPs, it is valid only if
+ * @pfn, the PFNs of pagemap are visible, see task_vma_residency().
+ */
+struct task_vma_residency {
+	unsigned long present;
+	unsigned long swapped;
+	unsigned long thp;
+	bool pfn;
+};
+
+int task_vma_residency(struct task_struct *task, struct vm_area_struct *vma,
+		       struct task_vma_residency *res);
+int task_vmas_residency(struct task_struct *task,
+			struct task_vma_residency *res, unsigned int nr);
+void dump_task_vmas_residency(FILE *fp, struct task_struct *task);
+
+/* Machine-readable records, see utils/emit.h */
+void emit_vma(struct emitter *e, struct vm_area_struct *vma,
+	      const struct task_vma_residency *res);
+void emit_task_vmas(struct emitter *e, struct task_struct *task);
+void emit_task_vmas_residency(struct emitter *e, struct task_struct *task);
+
+/**
+ * The VMAs of one process read by task_vma_iter_read(), feed them to
+ * read_task_vmas_from(), or read /proc/PID/maps instead if incomplete.
+ */
+struct task_vma_iter_task {
+	pid_t pid;
+	/* Some path is too long or can't be resolved */
+	bool incomplete;
+	const struct maps_entry *ents;
+	unsigned int nr;
+};
+
+struct task_vma_iter {
+	/* The records, the names of entries point into it */
+	char *buf;
+	size_t size;
+	struct maps_entry *ents;
+	unsigned int nr_ents;
+	/* In the order of pid */
+	struct task_vma_iter_task *tasks;
+	unsigned int nr_tasks;
+};
+
+int task_vma_iter_read(struct task_vma_iter *it);
+const struct task_vma_iter_task *task_vma_iter_find(
+		const struct task_vma_iter *it, pid_t pid);
+void task_vma_iter_free(struct task_vma_iter *it);
+void task_vma_iter_use(const struct task_vma_iter *it);
+
+int task_clear_soft_dirty(struct task_struct *task);
+int task_soft_dirty_ranges(struct task_struct *task, unsigned long start,
+			   unsigned long end, struct task_addr_range **ranges);
+int dump_task_soft_dirty_to_file(const char *ofile, struct task_struct *task,
+				 unsigned long addr, unsigned int flags);
+
+/**
+ * Failures of accessing task, counted whether reported or not, thus the
+ * expected ones of scanning, such as guard pages, are cheap but visible.
+ */
+enum task_err_type {
+	TASK_ERR_MEM_READ,
+	TASK_ERR_MEM_WRITE,
+	TASK_ERR_REGS,
+	TASK_ERR_NUM,
+};
+
+struct task_err_stats {
+	unsigned long nr[TASK_ERR_NUM];
+	/* errno of the last failure */
+	int last_errno[TASK_ERR_NUM];
+};
+
+bool task_err_account(enum task_err_type type, int err);
+void task_get_err_stats(struct task_err_stats *stats);
+void task_reset_err_stats(void);
+void print_task_err_stats(FILE *fp);
 
 int memcpy_to_task(struct task_struct *task,
 		unsigned long remote_dst, void *src, ssize_t size);
 int memcpy_from_task(struct task_struct *task,
 		void *dst, unsigned long remote_src, ssize_t size);
+ssize_t memcpy_from_task_iov(struct task_struct *task,
+		const struct task_iov *iov, int n);
+ssize_t memcpy_to_task_iov(struct task_struct *task,
+		const struct task_iov *iov, int n);
+ssize_t strscpy_from_task(struct task_struct *task, char *dst,
+			  unsigned long task_src, size_t size);
 char *strcpy_from_task(struct task_struct *task, char *dst,
 		       unsigned long task_src);
 char *strcpy_to_task(struct task_struct *task, unsigned long task_dst,
 		     char *src);
 
+void task_mem_cache_init(struct task_struct *task, size_t max_pages);
+ssize_t task_mem_cache_read(struct task_struct *task, void *dst,
+			    unsigned long task_src, size_t size);
+void task_mem_cache_invalidate(struct task_struct *task, unsigned long addr,
+			       size_t size);
+void task_mem_cache_destroy(struct task_struct *task);
+
+int task_arena_create(struct task_struct *task, size_t size);
+int task_arena_destroy(struct task_struct *task);
+void task_arena_release(struct task_struct *task);
+bool task_arena_contains(struct task_struct *task, unsigned long addr);
+unsigned long task_arena_alloc(struct task_struct *task, size_t size);
+int task_arena_free(struct task_struct *task, unsigned long addr, size_t size);
+void task_arena_stats(FILE *fp, const struct task_struct *task);
+
+/**
+ * One syscall of task_syscall_batch().
+ */
+struct task_syscall_entry {
+	unsigned long nr;
+	unsigned long args[6];
+	/* bit i: args[i] is index of previous entry, use it's return value */
+	unsigned int ret_mask;
+	/* bit i: args[i] is offset of data of task_syscall_batch() */
+	unsigned int data_mask;
+	/**
+	 * bit i: load args[i] from the address args[i], or from the data if
+	 * bit i of data_mask is set, when the syscall runs, such as the value
+	 * stored by a previous syscall.
+	 */
+	unsigned int load_mask;
+	/* stop after this syscall, see task_syscall_batch_pause() */
+	bool pause;
+	/* output */
+	unsigned long ret;
+};
+
+/**
+ * Called when the batch stops after the entry @i, @remote_data is the
+ * address of data in target task.
+ */
+typedef void (*task_syscall_pause_fn)(struct task_struct *task,
+				      struct task_syscall_entry *calls, int i,
+				      unsigned long remote_data, void *arg);
+
+int task_syscall_batch(struct task_struct *task,
+		       struct task_syscall_entry *calls, int n,
+		       const void *data, size_t data_len);
+int task_syscall_batch_pause(struct task_struct *task,
+			     struct task_syscall_entry *calls, int n,
+			     const void *data, size_t data_len,
+			     task_syscall_pause_fn pause, void *arg);
+int task_syscall_tramp_enable(struct task_struct *task);
+int task_syscall_tramp_disable(struct task_struct *task);
+int task_run_stub(struct task_struct *task, const void *stub, size_t stub_len,
+		  void *table, size_t table_len, unsigned long n);
+
+/* One waitpid(2) status of a tracee running to the syscall trap */
+enum task_stop {
+	/* Stopped at the trap, SIGTRAP, or SIGSTOP if not task::seized */
+	TASK_STOP_TRAP,
+	/* Not ours, continue it with the signal */
+	TASK_STOP_CONT,
+	TASK_STOP_FAULT,
+	/* Exited or killed */
+	TASK_STOP_EXIT,
+};
+
+enum task_stop task_stop_status(struct task_struct *task, int status,
+				int *sig);
+
+enum task_async_state {
+	/* Stopped at the trap, the step will be called */
+	TASK_ASYNC_STOPPED,
+	/* Running the syscall of task_async_syscall() */
+	TASK_ASYNC_RUNNING,
+	TASK_ASYNC_DONE,
+	TASK_ASYNC_FAILED,
+};
+
+struct task_async;
+
+/**
+ * The step of a task_async, called every time the task stopped, it calls
+ * task_async_syscall() and returns TASK_ASYNC_RUNNING, or returns
+ * TASK_ASYNC_DONE, or a negative errno to fail it. The result of the last
+ * syscall is task_async.ret.
+ */
+typedef int (*task_async_fn)(struct task_async *a);
+
+/**
+ * A task driven by task_async_run(), the task must be in attach session of
+ * the calling thread, see task_attach_session().
+ */
+struct task_async {
+	struct task_struct *task;
+	task_async_fn step;
+	void *arg;
+
+	enum task_async_state state;
+	/* If TASK_ASYNC_FAILED */
+	int err;
+	/* Completed syscalls */
+	unsigned int nr_syscalls;
+	unsigned long ret;
+
+	/* Private */
+	int sig;
+	bool poked;
+	/* The libc text under SYSCALL_INSTR, if no trampoline */
+	unsigned char orig_code[8];
+};
+
+/* See task_async_run(), the tick to poll the tracees if SIGCHLD lost */
+#define TASK_ASYNC_TICK_MS	10
+
+void task_async_init(struct task_async *a, struct task_struct *task,
+		     task_async_fn step, void *arg);
+int task_async_syscall(struct task_async *a, int nr, unsigned long arg1,
+		       unsigned long arg2, unsigned long arg3,
+		       unsigned long arg4, unsigned long arg5,
+		       unsigned long arg6);
+int task_async_run(struct task_async *as, int n);
+
+/* Since linux v5.14, prefault the page tables without write fault */
+#ifndef MADV_POPULATE_READ
+# define MADV_POPULATE_READ	22
+#endif
+#ifndef MADV_POPULATE_WRITE
+# define MADV_POPULATE_WRITE	23
+#endif
+
 /* syscalls based on task_syscall() */
 /* if mmap file, need to update_task_vmas_ulp() manual */
 unsigned long task_mmap(struct task_struct *task, unsigned long addr,
@@ -482,6 +1491,8 @@ unsigned long task_mmap(struct task_struct *task, unsigned long addr,
 int task_munmap(struct task_struct *task, unsigned long addr, size_t size);
 int task_mprotect(struct task_struct *task, unsigned long addr, size_t len,
 		  int prot);
+int task_madvise(struct task_struct *task, unsigned long addr, size_t len,
+		 int advice);
 int task_msync(struct task_struct *task, unsigned long addr, size_t length,
 	       int flags);
 int task_msync_sync(struct task_struct *task, unsigned long addr,
@@ -492,6 +1503,11 @@ unsigned long task_malloc(struct task_struct *task, size_t length);
 int task_free(struct task_struct *task, unsigned long addr, size_t length);
 int task_open(struct task_struct *task, char *pathname, int flags, mode_t mode);
 int task_open2(struct task_struct *task, char *pathname, int flags);
+/* Remote syscalls of task_mmap_fd() */
+#define TASK_MMAP_FD_NR_SYSCALLS	8
+unsigned long task_mmap_fd(struct task_struct *task, unsigned long addr,
+			   size_t length, int prot, int flags, int fd,
+			   off_t offset);
 int task_close(struct task_struct *task, int remote_fd);
 int task_ftruncate(struct task_struct *task, int remote_fd, off_t length);
 int task_fstat(struct task_struct *task, int remote_fd, struct stat *statbuf);
@@ -512,7 +1528,23 @@ void free_task_sym(struct task_sym *s);
 struct task_sym *find_task_sym(struct task_struct *task, const char *name,
 			       const struct task_sym ***extras,
 			       size_t *nr_extras);
+/**
+ * Walk the other symbols of the same name of @sym found by find_task_sym(),
+ * such as the @plt one, without allocation.
+ *
+ *   sym = find_task_sym(task, name, NULL, NULL);
+ *   task_sym_for_each_extra(is, sym)
+ *           addr = is->addr;
+ */
+#define task_sym_for_each_extra(is, sym)				\
+	list_for_each_entry(is, &(sym)->list_name.head, list_name.node)
+size_t task_sym_extras(const struct task_sym *sym, const struct task_sym **buf,
+		       size_t max);
 struct task_sym *find_task_addr(struct task_struct *task, unsigned long addr);
+struct task_sym *find_task_sym_contain(struct task_struct *task,
+				       unsigned long addr,
+				       unsigned long *offset);
+int task_syms_build_ranges(struct task_struct *task);
 
 int link_task_sym(struct task_struct *task, struct task_sym *s);
 
@@ -520,6 +1552,23 @@ struct task_sym *next_task_sym(struct task_struct *task, struct task_sym *prev);
 struct task_sym *next_task_addr(struct task_struct *task,
 				struct task_sym *prev);
 
+unsigned long vma_dynsym_addr(struct vm_area_struct *vma, const char *name);
+unsigned long vma_got_slot(struct vm_area_struct *vma, const char *name);
+void vma_free_dynsym(struct vm_area_struct *vma);
+unsigned long task_dynsym_addr(struct task_struct *task, const char *name);
+int task_dynsym_addrs(struct task_struct *task, const char **names,
+		      unsigned long *addrs, int n);
+
 int task_load_vma_elf_syms(struct vm_area_struct *vma);
+void task_lazy_vma_elf_syms(struct vm_area_struct *vma);
+int task_load_all_syms(struct task_struct *task);
+void task_unlink_vma_syms(struct vm_area_struct *vma);
 void free_task_syms(struct task_struct *task);
 
+typedef int (*task_sym_fn)(struct vm_area_struct *vma, const char *name,
+			   unsigned long addr, void *arg);
+int task_filter_syms(struct task_struct *task, const char *vma,
+		     const char *regex, task_sym_fn fn, void *arg);
+int task_filter_demangled_syms(struct task_struct *task, const char *vma,
+			       const char *regex, task_sym_fn fn, void *arg);
+
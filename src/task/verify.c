@@ -0,0 +1,347 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+
+/**
+ * Verify the text of target task: every r-x VMA of a mapped file is
+ * compared with the file range it maps, the file offset is vm_pgoff, see
+ * struct vm_area_struct, because PT_LOAD segments are mapped from the file
+ * directly. The VMAs are split into VERIFY_CHUNK_SIZE chunks, every chunk
+ * is read by process_vm_readv(2) and hashed page by page in parallel, only
+ * the pages whose hash differ from the file page are compared byte by byte
+ * to find the differing ranges.
+ */
+
+#define VERIFY_CHUNK_SIZE	SZ_1M
+#define VERIFY_MAX_THREADS	64
+
+struct verify_seg {
+	struct vm_area_struct *vma;
+	/* The file mapping, and the bytes of file from vm_pgoff */
+	const unsigned char *file;
+	size_t file_len;
+	size_t map_len;
+};
+
+struct verify_work {
+	struct task_struct *task;
+
+	struct verify_seg *segs;
+	int nr_segs;
+
+	pthread_mutex_t lock;
+	/* Next chunk, the segment and the offset in segment */
+	int seg;
+	unsigned long off;
+
+	struct task_text_diff *diffs;
+	size_t nr, cap;
+	struct task_verify_stats stats;
+	int err;
+};
+
+static bool vma_verifiable(struct vm_area_struct *vma)
+{
+	if ((vma->prot & (PROT_READ | PROT_EXEC)) != (PROT_READ | PROT_EXEC))
+		return false;
+
+	/* The patches are relocated when loaded, never the same as file */
+	if (vma->type == VMA_ULPATCH)
+		return false;
+
+	return vma->inode && vma->name_[0] == '/';
+}
+
+/**
+ * Map the file of @vma, return 1 if skipped, the file was replaced or
+ * deleted since it was mapped, thus can't be compared.
+ */
+static int verify_map_file(struct verify_seg *seg)
+{
+	struct vm_area_struct *vma = seg->vma;
+	off_t off = (off_t)vma->vm_pgoff << PAGE_SHIFT;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	fd = open(vma->name_, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ulp_debug("Skip %s: %m\n", vma->name_);
+		return 1;
+	}
+
+	if (fstat(fd, &st) || st.st_ino != vma->inode ||
+	    !S_ISREG(st.st_mode) || st.st_size <= off) {
+		ulp_warning("Skip %s, it's not the mapped file.\n", vma->name_);
+		close(fd);
+		return 1;
+	}
+
+	seg->file_len = MIN(st.st_size - off, vma->vm_end - vma->vm_start);
+	seg->map_len = ROUND_UP(seg->file_len, PAGE_SIZE);
+
+	map = mmap(NULL, seg->map_len, PROT_READ, MAP_PRIVATE, fd, off);
+	err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		ulp_error("mmap %s failed, %s\n", vma->name_, strerror(err));
+		return -err;
+	}
+
+	seg->file = map;
+	return 0;
+}
+
+static void verify_free_segs(struct verify_work *work)
+{
+	int i;
+
+	for (i = 0; i < work->nr_segs; i++)
+		munmap((void *)work->segs[i].file, work->segs[i].map_len);
+	free(work->segs);
+}
+
+static int verify_build_segs(struct verify_work *work)
+{
+	struct vm_area_struct *vma;
+	struct verify_seg *seg;
+	int n = 0, err;
+
+	task_for_each_vma(vma, work->task)
+		n++;
+
+	work->segs = calloc(n ?: 1, sizeof(struct verify_seg));
+	if (!work->segs)
+		return -ENOMEM;
+
+	task_for_each_vma(vma, work->task) {
+		if (!vma_verifiable(vma))
+			continue;
+
+		seg = &work->segs[work->nr_segs];
+		seg->vma = vma;
+		err = verify_map_file(seg);
+		if (err < 0)
+			return err;
+		if (err) {
+			work->stats.skipped++;
+			continue;
+		}
+		work->nr_segs++;
+	}
+	return 0;
+}
+
+static bool verify_take(struct verify_work *work, struct verify_seg **seg,
+			unsigned long *off, size_t *len)
+{
+	struct verify_seg *s;
+	bool ok = false;
+
+	pthread_mutex_lock(&work->lock);
+	for (; work->seg < work->nr_segs; work->seg++, work->off = 0) {
+		s = &work->segs[work->seg];
+		if (work->off >= s->file_len)
+			continue;
+
+		*seg = s;
+		*off = work->off;
+		*len = MIN(VERIFY_CHUNK_SIZE, s->file_len - *off);
+		work->off += *len;
+		ok = true;
+		break;
+	}
+	pthread_mutex_unlock(&work->lock);
+	return ok;
+}
+
+static int verify_add(struct verify_work *work, struct vm_area_struct *vma,
+		      unsigned long start, unsigned long end)
+{
+	struct task_text_diff *tmp;
+
+	if (work->nr == work->cap) {
+		work->cap = work->cap ? work->cap * 2 : 64;
+		tmp = realloc(work->diffs, work->cap * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		work->diffs = tmp;
+	}
+	work->diffs[work->nr].start = start;
+	work->diffs[work->nr].end = end;
+	work->diffs[work->nr].vma = vma;
+	work->nr++;
+	return 0;
+}
+
+/* Add the differing ranges of one page */
+static int verify_page(struct verify_work *work, struct vm_area_struct *vma,
+		       unsigned long addr, const unsigned char *mem,
+		       const unsigned char *file, size_t len)
+{
+	size_t i, start;
+	int err = 0;
+
+	pthread_mutex_lock(&work->lock);
+	for (i = 0; i < len && !err; i++) {
+		if (mem[i] == file[i])
+			continue;
+		for (start = i; i < len && mem[i] != file[i]; i++);
+		err = verify_add(work, vma, addr + start, addr + i);
+		work->stats.diff_bytes += i - start;
+	}
+	pthread_mutex_unlock(&work->lock);
+	return err;
+}
+
+static void *verify_worker(void *arg)
+{
+	struct verify_work *work = arg;
+	size_t nr_pages = VERIFY_CHUNK_SIZE / PAGE_SIZE;
+	unsigned long off, addr, len, n, nr;
+	const unsigned char *file;
+	struct verify_seg *seg;
+	struct task_iov *iov;
+	unsigned char *buf;
+	int i, err;
+
+	buf = malloc(VERIFY_CHUNK_SIZE);
+	iov = malloc(sizeof(*iov) * nr_pages);
+	if (!buf || !iov) {
+		work->err = -ENOMEM;
+		goto out;
+	}
+
+	while (!work->err && verify_take(work, &seg, &off, &len)) {
+		addr = seg->vma->vm_start + off;
+		file = seg->file + off;
+
+		for (i = 0, nr = 0; nr < len; i++, nr += PAGE_SIZE) {
+			iov[i].remote = addr + nr;
+			iov[i].local = buf + nr;
+			iov[i].len = MIN(PAGE_SIZE, len - nr);
+		}
+		memcpy_from_task_iov(work->task, iov, i);
+
+		for (i = 0, nr = 0; nr < len; i++, nr += PAGE_SIZE) {
+			n = iov[i].len;
+			if (ulp_hash64(buf + nr, n, 0) ==
+			    ulp_hash64(file + nr, n, 0))
+				continue;
+			/**
+			 * Zeroed by memcpy_from_task_iov(), reread it alone,
+			 * never through the task::mcache, not thread safe.
+			 */
+			if (memcpy_from_task_iov(work->task, &iov[i], 1) != n) {
+				__atomic_fetch_add(&work->stats.unreadable, n,
+						   __ATOMIC_RELAXED);
+				continue;
+			}
+			err = verify_page(work, seg->vma, addr + nr, buf + nr,
+					  file + nr, n);
+			if (err) {
+				work->err = err;
+				break;
+			}
+		}
+		__atomic_fetch_add(&work->stats.bytes, len, __ATOMIC_RELAXED);
+	}
+
+out:
+	free(iov);
+	free(buf);
+	return NULL;
+}
+
+static int cmp_diff(const void *a, const void *b)
+{
+	const struct task_text_diff *da = a, *db = b;
+
+	return da->start < db->start ? -1 : da->start > db->start;
+}
+
+/* Merge the ranges across the page boundary */
+static size_t merge_diffs(struct task_text_diff *diffs, size_t nr)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (n && diffs[n - 1].end == diffs[i].start &&
+		    diffs[n - 1].vma == diffs[i].vma) {
+			diffs[n - 1].end = diffs[i].end;
+			continue;
+		}
+		diffs[n++] = diffs[i];
+	}
+	return n;
+}
+
+/**
+ * Compare the text of all r-x file VMAs of @task with the files by
+ * @nr_threads threads. The differing ranges are stored into @diffs in the
+ * order of address, free(3) it. @stats is optional.
+ *
+ * Return the number of differing ranges, or negative errno.
+ */
+ssize_t task_verify_text(struct task_struct *task, int nr_threads,
+			 struct task_text_diff **diffs,
+			 struct task_verify_stats *stats)
+{
+	pthread_t threads[VERIFY_MAX_THREADS];
+	struct verify_work work = {
+		.task = task,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	int i, err;
+
+	*diffs = NULL;
+
+	err = verify_build_segs(&work);
+	if (err) {
+		verify_free_segs(&work);
+		return err;
+	}
+
+	nr_threads = MIN(MAX(nr_threads, 1) - 1, VERIFY_MAX_THREADS);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, verify_worker, &work))
+			break;
+	}
+	nr_threads = i;
+
+	/* If no thread was created, do the work in current thread */
+	verify_worker(&work);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	work.stats.nr_vmas = work.nr_segs;
+	verify_free_segs(&work);
+
+	if (work.err) {
+		free(work.diffs);
+		return work.err;
+	}
+
+	qsort(work.diffs, work.nr, sizeof(*work.diffs), cmp_diff);
+	work.nr = merge_diffs(work.diffs, work.nr);
+
+	ulp_debug("Verify %lu bytes of %u VMAs, %zu differing ranges\n",
+		  work.stats.bytes, work.stats.nr_vmas, work.nr);
+
+	if (stats)
+		*stats = work.stats;
+	*diffs = work.diffs;
+	return work.nr;
+}
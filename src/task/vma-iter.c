@@ -0,0 +1,896 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+
+
+/**
+ * The VMAs of all processes of host by one pass of the task_vma BPF
+ * iterator, see linux:kernel/bpf/task_iter.c, instead of formatting and
+ * parsing the /proc/PID/maps text of every process. The program is built
+ * here without libbpf and clang, the offsets of the kernel structures are
+ * looked up in /sys/kernel/btf/vmlinux. Every VMA is streamed as a binary
+ * struct vma_iter_rec, followed by the path of file if any.
+ */
+
+#define VMA_ITER_BTF		"/sys/kernel/btf/vmlinux"
+#define VMA_ITER_NAME_MAX	256
+
+/* linux:include/linux/mm.h */
+#define VM_READ		0x00000001
+#define VM_WRITE	0x00000002
+#define VM_EXEC		0x00000004
+#define VM_MAYSHARE	0x00000080
+
+/* struct vma_iter_rec::rflags */
+#define VMA_ITER_FILE	BIT(0)
+
+/* The header is written always, the name only if name_len is valid */
+struct vma_iter_rec {
+	uint32_t pid;
+	/* Length of name with the NUL, negative errno of bpf_d_path() */
+	int32_t name_len;
+	uint64_t start;
+	uint64_t end;
+	uint64_t flags;
+	uint64_t pgoff;
+	uint64_t ino;
+	/* The dev_t of kernel, not of userspace, see vma_iter_entry() */
+	uint32_t dev;
+	uint32_t rflags;
+	uint64_t start_brk;
+	uint64_t brk;
+	uint64_t start_stack;
+	char name[VMA_ITER_NAME_MAX];
+};
+
+#define VMA_ITER_HDR_SIZE	offsetof(struct vma_iter_rec, name)
+#define VMA_ITER_REC_SIZE	sizeof(struct vma_iter_rec)
+
+/* The BTF offsets of the members accessed by the program */
+struct vma_iter_offs {
+	int func_id;
+	int tgid;
+	int vm_start, vm_end, vm_flags, vm_pgoff;
+	int vm_mm, vm_file, vm_ops, vm_private_data;
+	int start_brk, brk, start_stack;
+	int f_path, f_inode;
+	int i_ino, i_sb;
+	int s_dev;
+};
+
+struct btf {
+	void *data;
+	size_t size;
+	const struct btf_type **types;
+	unsigned int nr_types;
+	const char *strs;
+	uint32_t str_len;
+};
+
+/* linux:include/uapi/linux/btf.h */
+struct btf_header {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t flags;
+	uint32_t hdr_len;
+	uint32_t type_off;
+	uint32_t type_len;
+	uint32_t str_off;
+	uint32_t str_len;
+};
+
+struct btf_type {
+	uint32_t name_off;
+	uint32_t info;
+	uint32_t size_or_type;
+};
+
+struct btf_member {
+	uint32_t name_off;
+	uint32_t type;
+	uint32_t offset;
+};
+
+#define BTF_MAGIC		0xeB9F
+#define BTF_INFO_KIND(info)	(((info) >> 24) & 0x1f)
+#define BTF_INFO_VLEN(info)	((info) & 0xffff)
+#define BTF_INFO_KFLAG(info)	((info) >> 31)
+
+enum {
+	BTF_KIND_INT = 1,
+	BTF_KIND_PTR,
+	BTF_KIND_ARRAY,
+	BTF_KIND_STRUCT,
+	BTF_KIND_UNION,
+	BTF_KIND_ENUM,
+	BTF_KIND_FWD,
+	BTF_KIND_TYPEDEF,
+	BTF_KIND_VOLATILE,
+	BTF_KIND_CONST,
+	BTF_KIND_RESTRICT,
+	BTF_KIND_FUNC,
+	BTF_KIND_FUNC_PROTO,
+	BTF_KIND_VAR,
+	BTF_KIND_DATASEC,
+	BTF_KIND_FLOAT,
+	BTF_KIND_DECL_TAG,
+	BTF_KIND_TYPE_TAG,
+	BTF_KIND_ENUM64,
+};
+
+/* The bytes after struct btf_type, -1 if unknown kind */
+static long btf_type_extra(const struct btf_type *t)
+{
+	unsigned int vlen = BTF_INFO_VLEN(t->info);
+
+	switch (BTF_INFO_KIND(t->info)) {
+	case BTF_KIND_INT:
+	case BTF_KIND_VAR:
+	case BTF_KIND_DECL_TAG:
+		return 4;
+	case BTF_KIND_ARRAY:
+		return 12;
+	case BTF_KIND_STRUCT:
+	case BTF_KIND_UNION:
+	case BTF_KIND_DATASEC:
+	case BTF_KIND_ENUM64:
+		return vlen * 12;
+	case BTF_KIND_ENUM:
+	case BTF_KIND_FUNC_PROTO:
+		return vlen * 8;
+	case BTF_KIND_PTR:
+	case BTF_KIND_FWD:
+	case BTF_KIND_TYPEDEF:
+	case BTF_KIND_VOLATILE:
+	case BTF_KIND_CONST:
+	case BTF_KIND_RESTRICT:
+	case BTF_KIND_FUNC:
+	case BTF_KIND_FLOAT:
+	case BTF_KIND_TYPE_TAG:
+		return 0;
+	}
+	return -1;
+}
+
+static void btf_free(struct btf *btf)
+{
+	free(btf->types);
+	free(btf->data);
+	memset(btf, 0, sizeof(*btf));
+}
+
+/* The sysfs file can't be mmap(2)ed, and read(2) returns a page a time */
+static int btf_read(struct btf *btf, const char *path)
+{
+	struct stat st;
+	ssize_t n;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		err = -errno ?: -ENOENT;
+		goto close;
+	}
+
+	btf->data = malloc(st.st_size);
+	if (!btf->data) {
+		err = -ENOMEM;
+		goto close;
+	}
+
+	while (btf->size < st.st_size) {
+		n = read(fd, btf->data + btf->size, st.st_size - btf->size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		btf->size += n;
+	}
+close:
+	close(fd);
+	return err;
+}
+
+static int btf_load(struct btf *btf, const char *path)
+{
+	const struct btf_header *hdr;
+	const char *p, *end;
+	unsigned int cap = 0;
+	const struct btf_type **types;
+	long extra;
+	int err;
+
+	memset(btf, 0, sizeof(*btf));
+
+	err = btf_read(btf, path);
+	if (err) {
+		btf_free(btf);
+		return err;
+	}
+
+	hdr = btf->data;
+	if (btf->size < sizeof(*hdr) || hdr->magic != BTF_MAGIC ||
+	    hdr->hdr_len + (size_t)hdr->type_off + hdr->type_len > btf->size ||
+	    hdr->hdr_len + (size_t)hdr->str_off + hdr->str_len > btf->size)
+		goto inval;
+
+	btf->strs = btf->data + hdr->hdr_len + hdr->str_off;
+	btf->str_len = hdr->str_len;
+
+	p = btf->data + hdr->hdr_len + hdr->type_off;
+	end = p + hdr->type_len;
+
+	/* Type ID 0 is void */
+	btf->nr_types = 1;
+	while (p + sizeof(struct btf_type) <= end) {
+		const struct btf_type *t = (const void *)p;
+
+		extra = btf_type_extra(t);
+		if (extra < 0)
+			goto inval;
+
+		if (btf->nr_types >= cap) {
+			cap = cap ? cap * 2 : 65536;
+			types = realloc(btf->types, cap * sizeof(*types));
+			if (!types) {
+				btf_free(btf);
+				return -ENOMEM;
+			}
+			btf->types = types;
+		}
+		btf->types[btf->nr_types++] = t;
+		p += sizeof(struct btf_type) + extra;
+	}
+	return 0;
+
+inval:
+	ulp_debug("Invalid BTF %s\n", path);
+	btf_free(btf);
+	return -EINVAL;
+}
+
+static const char *btf_name(const struct btf *btf, uint32_t off)
+{
+	return off < btf->str_len ? btf->strs + off : "";
+}
+
+static int btf_find(const struct btf *btf, const char *name, int kind)
+{
+	const struct btf_type *t;
+	unsigned int id;
+
+	for (id = 1; id < btf->nr_types; id++) {
+		t = btf->types[id];
+		if (BTF_INFO_KIND(t->info) != kind)
+			continue;
+		/* The forward declared struct has no member */
+		if (kind == BTF_KIND_STRUCT && !BTF_INFO_VLEN(t->info))
+			continue;
+		if (!strcmp(btf_name(btf, t->name_off), name))
+			return id;
+	}
+	return -ENOENT;
+}
+
+/* Skip the typedef and the qualifiers */
+static const struct btf_type *btf_resolve(const struct btf *btf, uint32_t id)
+{
+	const struct btf_type *t;
+
+	while (id && id < btf->nr_types) {
+		t = btf->types[id];
+		switch (BTF_INFO_KIND(t->info)) {
+		case BTF_KIND_TYPEDEF:
+		case BTF_KIND_VOLATILE:
+		case BTF_KIND_CONST:
+		case BTF_KIND_RESTRICT:
+		case BTF_KIND_TYPE_TAG:
+			id = t->size_or_type;
+			continue;
+		}
+		return t;
+	}
+	return NULL;
+}
+
+/**
+ * Byte offset of member @name of struct or union @t, the members of the
+ * anonymous ones are searched too, such as the vm_flags of vm_area_struct.
+ */
+static int btf_member_off(const struct btf *btf, const struct btf_type *t,
+			  const char *name)
+{
+	const struct btf_member *m = (const void *)(t + 1);
+	const struct btf_type *mt;
+	unsigned int i, bits;
+	int off;
+
+	for (i = 0; i < BTF_INFO_VLEN(t->info); i++, m++) {
+		bits = BTF_INFO_KFLAG(t->info) ? m->offset & 0xffffff
+					       : m->offset;
+		if (m->name_off) {
+			if (!strcmp(btf_name(btf, m->name_off), name))
+				return bits / 8;
+			continue;
+		}
+		mt = btf_resolve(btf, m->type);
+		if (!mt || (BTF_INFO_KIND(mt->info) != BTF_KIND_STRUCT &&
+			    BTF_INFO_KIND(mt->info) != BTF_KIND_UNION))
+			continue;
+		off = btf_member_off(btf, mt, name);
+		if (off >= 0)
+			return bits / 8 + off;
+	}
+	return -ENOENT;
+}
+
+static int btf_struct_member_off(const struct btf *btf, const char *sname,
+				 const char *mname)
+{
+	int id, off;
+
+	id = btf_find(btf, sname, BTF_KIND_STRUCT);
+	if (id < 0)
+		return id;
+	off = btf_member_off(btf, btf->types[id], mname);
+	if (off < 0)
+		ulp_debug("No %s::%s in BTF\n", sname, mname);
+	return off;
+}
+
+static int vma_iter_lookup_offs(struct vma_iter_offs *o)
+{
+	struct btf btf;
+	int err, *p;
+
+	err = btf_load(&btf, VMA_ITER_BTF);
+	if (err)
+		return err;
+
+	o->func_id = btf_find(&btf, "bpf_iter_task_vma", BTF_KIND_FUNC);
+
+#define OFF(field, sname, mname)	\
+	o->field = btf_struct_member_off(&btf, sname, mname)
+
+	OFF(tgid, "task_struct", "tgid");
+	OFF(vm_start, "vm_area_struct", "vm_start");
+	OFF(vm_end, "vm_area_struct", "vm_end");
+	OFF(vm_flags, "vm_area_struct", "vm_flags");
+	OFF(vm_pgoff, "vm_area_struct", "vm_pgoff");
+	OFF(vm_mm, "vm_area_struct", "vm_mm");
+	OFF(vm_file, "vm_area_struct", "vm_file");
+	OFF(vm_ops, "vm_area_struct", "vm_ops");
+	OFF(vm_private_data, "vm_area_struct", "vm_private_data");
+	OFF(start_brk, "mm_struct", "start_brk");
+	OFF(brk, "mm_struct", "brk");
+	OFF(start_stack, "mm_struct", "start_stack");
+	OFF(f_path, "file", "f_path");
+	OFF(f_inode, "file", "f_inode");
+	OFF(i_ino, "inode", "i_ino");
+	OFF(i_sb, "inode", "i_sb");
+	OFF(s_dev, "super_block", "s_dev");
+#undef OFF
+
+	btf_free(&btf);
+
+	/* All of them are int, find the missing one, if any */
+	for (p = &o->func_id; p <= &o->s_dev; p++) {
+		if (*p < 0) {
+			ulp_debug("No task_vma iterator in BTF\n");
+			return -EOPNOTSUPP;
+		}
+	}
+	return 0;
+}
+
+/**
+ * A tiny assembler of the program, the jumps are emitted to labels and
+ * fixed up at the end.
+ */
+enum {
+	L_OUT,
+	L_FILE,
+	L_PATH,
+	L_SPECIAL,
+	L_WRITE,
+	L_NUM,
+};
+
+#define VMA_ITER_MAX_INSNS	128
+#define VMA_ITER_MAX_JUMPS	16
+
+struct vma_iter_prog {
+	struct bpf_insn insns[VMA_ITER_MAX_INSNS];
+	int nr;
+	int labels[L_NUM];
+	/* The index of jump, and the target label */
+	int jumps[VMA_ITER_MAX_JUMPS][2];
+	int nr_jumps;
+};
+
+static void emit(struct vma_iter_prog *p, uint8_t code, uint8_t dst,
+		 uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn *insn;
+
+	if (p->nr >= VMA_ITER_MAX_INSNS) {
+		p->nr = VMA_ITER_MAX_INSNS + 1;
+		return;
+	}
+	insn = &p->insns[p->nr++];
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+	insn->off = off;
+	insn->imm = imm;
+}
+
+static void emit_jmp(struct vma_iter_prog *p, uint8_t op, uint8_t dst,
+		     int32_t imm, int label)
+{
+	if (p->nr_jumps < VMA_ITER_MAX_JUMPS) {
+		p->jumps[p->nr_jumps][0] = p->nr;
+		p->jumps[p->nr_jumps][1] = label;
+	}
+	p->nr_jumps++;
+	emit(p, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+}
+
+static void emit_label(struct vma_iter_prog *p, int label)
+{
+	p->labels[label] = p->nr;
+}
+
+#define LDX(p, size, dst, src, off)	\
+	emit(p, BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+#define STX(p, size, dst, src, off)	\
+	emit(p, BPF_STX | BPF_MEM | (size), dst, src, off, 0)
+#define ST(p, size, dst, off, imm)	\
+	emit(p, BPF_ST | BPF_MEM | (size), dst, 0, off, imm)
+#define MOV(p, dst, src)	\
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0)
+#define MOVI(p, dst, imm)	\
+	emit(p, BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define ADDI(p, dst, imm)	\
+	emit(p, BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+#define CALL(p, func)		emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, func)
+
+/* Offset of the member of struct vma_iter_rec on the stack */
+#define REC(member)	\
+	(int16_t)(offsetof(struct vma_iter_rec, member) - VMA_ITER_REC_SIZE)
+
+/**
+ * Like the C below, for each VMA, where ctx is struct bpf_iter__task_vma:
+ *
+ *	if (!ctx->task || !ctx->vma)
+ *		return 0;
+ *	rec = {};
+ *	rec.pid = task->tgid, rec.start = vma->vm_start, ...;
+ *	if (vma->vm_mm)
+ *		rec.start_brk = mm->start_brk, ...;
+ *	if (vma->vm_file) {
+ *		rec.ino, rec.dev = file->f_inode, ...;
+ *		rec.name_len = bpf_d_path(&file->f_path, rec.name, ...);
+ *	} else if (vma->vm_ops && vma->vm_private_data) {
+ *		// maybe struct vm_special_mapping, such as [vdso]
+ *		rec.name_len = bpf_probe_read_kernel_str(rec.name, ...,
+ *			((struct vm_special_mapping *)private)->name);
+ *	}
+ *	bpf_seq_write(seq, &rec, VMA_ITER_HDR_SIZE);
+ *	if (rec.name_len > 0 && rec.name_len <= VMA_ITER_NAME_MAX)
+ *		bpf_seq_write(seq, rec.name, rec.name_len);
+ */
+static int vma_iter_build(struct vma_iter_prog *p,
+			  const struct vma_iter_offs *o)
+{
+	int i, j;
+
+	memset(p, 0, sizeof(*p));
+
+	MOV(p, BPF_REG_6, BPF_REG_1);
+	/* ctx->task and ctx->vma */
+	LDX(p, BPF_DW, BPF_REG_7, BPF_REG_6, 8);
+	emit_jmp(p, BPF_JEQ, BPF_REG_7, 0, L_OUT);
+	LDX(p, BPF_DW, BPF_REG_8, BPF_REG_6, 16);
+	emit_jmp(p, BPF_JEQ, BPF_REG_8, 0, L_OUT);
+
+	for (i = 0; i < VMA_ITER_REC_SIZE; i += 8)
+		ST(p, BPF_DW, BPF_REG_10, i - (int)VMA_ITER_REC_SIZE, 0);
+
+	LDX(p, BPF_W, BPF_REG_1, BPF_REG_7, o->tgid);
+	STX(p, BPF_W, BPF_REG_10, BPF_REG_1, REC(pid));
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_8, o->vm_start);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(start));
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_8, o->vm_end);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(end));
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_8, o->vm_flags);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(flags));
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_8, o->vm_pgoff);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(pgoff));
+
+	LDX(p, BPF_DW, BPF_REG_9, BPF_REG_8, o->vm_mm);
+	emit_jmp(p, BPF_JEQ, BPF_REG_9, 0, L_FILE);
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_9, o->start_brk);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(start_brk));
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_9, o->brk);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(brk));
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_9, o->start_stack);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_1, REC(start_stack));
+
+	emit_label(p, L_FILE);
+	LDX(p, BPF_DW, BPF_REG_9, BPF_REG_8, o->vm_file);
+	emit_jmp(p, BPF_JEQ, BPF_REG_9, 0, L_SPECIAL);
+	ST(p, BPF_W, BPF_REG_10, REC(rflags), VMA_ITER_FILE);
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_9, o->f_inode);
+	emit_jmp(p, BPF_JEQ, BPF_REG_1, 0, L_PATH);
+	LDX(p, BPF_DW, BPF_REG_2, BPF_REG_1, o->i_ino);
+	STX(p, BPF_DW, BPF_REG_10, BPF_REG_2, REC(ino));
+	LDX(p, BPF_DW, BPF_REG_2, BPF_REG_1, o->i_sb);
+	emit_jmp(p, BPF_JEQ, BPF_REG_2, 0, L_PATH);
+	LDX(p, BPF_W, BPF_REG_2, BPF_REG_2, o->s_dev);
+	STX(p, BPF_W, BPF_REG_10, BPF_REG_2, REC(dev));
+
+	emit_label(p, L_PATH);
+	MOV(p, BPF_REG_1, BPF_REG_9);
+	ADDI(p, BPF_REG_1, o->f_path);
+	MOV(p, BPF_REG_2, BPF_REG_10);
+	ADDI(p, BPF_REG_2, REC(name));
+	MOVI(p, BPF_REG_3, VMA_ITER_NAME_MAX);
+	CALL(p, BPF_FUNC_d_path);
+	STX(p, BPF_W, BPF_REG_10, BPF_REG_0, REC(name_len));
+	emit_jmp(p, BPF_JA, 0, 0, L_WRITE);
+
+	emit_label(p, L_SPECIAL);
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_8, o->vm_ops);
+	emit_jmp(p, BPF_JEQ, BPF_REG_1, 0, L_WRITE);
+	LDX(p, BPF_DW, BPF_REG_3, BPF_REG_8, o->vm_private_data);
+	emit_jmp(p, BPF_JEQ, BPF_REG_3, 0, L_WRITE);
+	/* The name pointer, the first member of vm_special_mapping */
+	MOV(p, BPF_REG_1, BPF_REG_10);
+	ADDI(p, BPF_REG_1, REC(name));
+	MOVI(p, BPF_REG_2, 8);
+	CALL(p, BPF_FUNC_probe_read_kernel);
+	emit_jmp(p, BPF_JNE, BPF_REG_0, 0, L_WRITE);
+	LDX(p, BPF_DW, BPF_REG_3, BPF_REG_10, REC(name));
+	MOV(p, BPF_REG_1, BPF_REG_10);
+	ADDI(p, BPF_REG_1, REC(name));
+	MOVI(p, BPF_REG_2, VMA_ITER_NAME_MAX);
+	CALL(p, BPF_FUNC_probe_read_kernel_str);
+	emit_jmp(p, BPF_JSLE, BPF_REG_0, 0, L_WRITE);
+	STX(p, BPF_W, BPF_REG_10, BPF_REG_0, REC(name_len));
+
+	emit_label(p, L_WRITE);
+	/* ctx->meta->seq */
+	LDX(p, BPF_DW, BPF_REG_1, BPF_REG_6, 0);
+	LDX(p, BPF_DW, BPF_REG_9, BPF_REG_1, 0);
+	MOV(p, BPF_REG_1, BPF_REG_9);
+	MOV(p, BPF_REG_2, BPF_REG_10);
+	ADDI(p, BPF_REG_2, -(int)VMA_ITER_REC_SIZE);
+	MOVI(p, BPF_REG_3, VMA_ITER_HDR_SIZE);
+	CALL(p, BPF_FUNC_seq_write);
+	/* Unsigned, the negative errno is never written */
+	LDX(p, BPF_W, BPF_REG_3, BPF_REG_10, REC(name_len));
+	emit_jmp(p, BPF_JEQ, BPF_REG_3, 0, L_OUT);
+	emit_jmp(p, BPF_JGT, BPF_REG_3, VMA_ITER_NAME_MAX, L_OUT);
+	MOV(p, BPF_REG_1, BPF_REG_9);
+	MOV(p, BPF_REG_2, BPF_REG_10);
+	ADDI(p, BPF_REG_2, REC(name));
+	CALL(p, BPF_FUNC_seq_write);
+
+	emit_label(p, L_OUT);
+	MOVI(p, BPF_REG_0, 0);
+	emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	if (p->nr > VMA_ITER_MAX_INSNS || p->nr_jumps > VMA_ITER_MAX_JUMPS)
+		return -E2BIG;
+
+	for (i = 0; i < p->nr_jumps; i++) {
+		j = p->jumps[i][0];
+		p->insns[j].off = p->labels[p->jumps[i][1]] - (j + 1);
+	}
+	return 0;
+}
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int vma_iter_load(const struct vma_iter_prog *p, int func_id)
+{
+	union bpf_attr attr;
+	char *log = NULL;
+	int fd, err;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_TRACING;
+	attr.expected_attach_type = BPF_TRACE_ITER;
+	attr.attach_btf_id = func_id;
+	attr.insns = (unsigned long)p->insns;
+	attr.insn_cnt = p->nr;
+	/* bpf_d_path() is GPL only */
+	attr.license = (unsigned long)"GPL";
+	strncpy(attr.prog_name, "ulp_task_vma", sizeof(attr.prog_name) - 1);
+
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd >= 0 || !is_verbose())
+		return fd < 0 ? -errno : fd;
+
+	/* Load again with the log of verifier */
+	err = -errno;
+	log = malloc(SZ_64K);
+	if (!log)
+		return err;
+	attr.log_level = 1;
+	attr.log_buf = (unsigned long)log;
+	attr.log_size = SZ_64K;
+	log[0] = '\0';
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	ulp_debug("Load task_vma iterator failed, %s\n%s\n", strerror(-err),
+		  log);
+	free(log);
+	if (fd >= 0)
+		close(fd);
+	return err;
+}
+
+/* Create the iterator, the read(2) of the returned fd runs the program */
+static int vma_iter_create(void)
+{
+	struct vma_iter_offs offs;
+	struct vma_iter_prog *prog;
+	union bpf_attr attr;
+	int prog_fd, link_fd, fd, err;
+
+	err = vma_iter_lookup_offs(&offs);
+	if (err)
+		return err;
+
+	prog = malloc(sizeof(*prog));
+	if (!prog)
+		return -ENOMEM;
+	err = vma_iter_build(prog, &offs);
+	if (err) {
+		free(prog);
+		return err;
+	}
+
+	prog_fd = vma_iter_load(prog, offs.func_id);
+	free(prog);
+	if (prog_fd < 0)
+		return prog_fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.attach_type = BPF_TRACE_ITER;
+	link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	err = -errno;
+	close(prog_fd);
+	if (link_fd < 0)
+		return err;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.iter_create.link_fd = link_fd;
+	fd = sys_bpf(BPF_ITER_CREATE, &attr);
+	err = -errno;
+	close(link_fd);
+	return fd < 0 ? err : fd;
+}
+
+/* Read all records into a malloc(3) buffer */
+static char *vma_iter_read_all(int fd, size_t *size)
+{
+	size_t len = 0, cap = SZ_1M;
+	char *buf, *tmp;
+	ssize_t n;
+
+	buf = malloc(cap);
+	if (!buf)
+		return NULL;
+
+	while (1) {
+		if (cap - len < SZ_64K) {
+			cap *= 2;
+			tmp = realloc(buf, cap);
+			if (!tmp)
+				goto fail;
+			buf = tmp;
+		}
+		n = read(fd, buf + len, cap - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ulp_debug("Read task_vma iterator failed, %m\n");
+			goto fail;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	*size = len;
+	return buf;
+
+fail:
+	free(buf);
+	return NULL;
+}
+
+/* Same as the fields of /proc/PID/maps, see show_map_vma() of kernel */
+static void vma_iter_entry(struct maps_entry *e, const struct vma_iter_rec *r,
+			   const char *name, bool *incomplete)
+{
+	bool file = r->rflags & VMA_ITER_FILE;
+
+	memset(e, 0, sizeof(*e));
+	e->start = r->start;
+	e->end = r->end;
+	e->off = file ? r->pgoff << PAGE_SHIFT : 0;
+	e->inode = r->ino;
+	/* MAJOR() and MINOR() of kernel dev_t */
+	e->major = r->dev >> 20;
+	e->minor = r->dev & ((1U << 20) - 1);
+	e->perms[0] = r->flags & VM_READ ? 'r' : '-';
+	e->perms[1] = r->flags & VM_WRITE ? 'w' : '-';
+	e->perms[2] = r->flags & VM_EXEC ? 'x' : '-';
+	e->perms[3] = r->flags & VM_MAYSHARE ? 's' : 'p';
+	e->perms[4] = '\0';
+
+	e->name = "";
+	if (file) {
+		/* Too long, or not reachable such as no mount */
+		if (name)
+			e->name = name;
+		else
+			*incomplete = true;
+	} else if (r->start <= r->brk && r->end >= r->start_brk)
+		e->name = "[heap]";
+	else if (r->start <= r->start_stack && r->end >= r->start_stack)
+		e->name = "[stack]";
+	else if (name && name[0] == '[')
+		e->name = name;
+	e->name_len = strlen(e->name);
+}
+
+static int vma_iter_parse(struct task_vma_iter *it)
+{
+	const char *p = it->buf, *end = it->buf + it->size, *name;
+	struct task_vma_iter_task *t = NULL, *tmp;
+	unsigned int cap = 0, task_cap = 0, i;
+	unsigned long last_end = 0;
+	struct maps_entry *ents;
+	struct vma_iter_rec r;
+	size_t len;
+
+	while (p + VMA_ITER_HDR_SIZE <= end) {
+		memcpy(&r, p, VMA_ITER_HDR_SIZE);
+		p += VMA_ITER_HDR_SIZE;
+
+		name = NULL;
+		if (r.name_len > 0 && r.name_len <= VMA_ITER_NAME_MAX) {
+			len = r.name_len;
+			if (p + len > end)
+				return -EINVAL;
+			/* The NUL is written by kernel, make sure */
+			if (p[len - 1] == '\0')
+				name = p;
+			p += len;
+		}
+
+		/**
+		 * The threads not sharing files with the leader are iterated
+		 * again, after the leader or in the middle of it, skip them.
+		 */
+		if (t && (r.pid < t->pid ||
+			  (r.pid == t->pid && r.start < last_end)))
+			continue;
+
+		if (!t || r.pid != t->pid) {
+			if (it->nr_tasks == task_cap) {
+				task_cap = task_cap ? task_cap * 2 : 1024;
+				tmp = realloc(it->tasks,
+					      task_cap * sizeof(*tmp));
+				if (!tmp)
+					return -ENOMEM;
+				it->tasks = tmp;
+			}
+			t = &it->tasks[it->nr_tasks++];
+			memset(t, 0, sizeof(*t));
+			t->pid = r.pid;
+			/* The index of first entry, fixed below */
+			t->ents = (void *)(unsigned long)it->nr_ents;
+		}
+
+		if (it->nr_ents == cap) {
+			cap = cap ? cap * 2 : 65536;
+			ents = realloc(it->ents, cap * sizeof(*ents));
+			if (!ents)
+				return -ENOMEM;
+			it->ents = ents;
+		}
+		vma_iter_entry(&it->ents[it->nr_ents++], &r, name,
+			       &t->incomplete);
+		last_end = r.end;
+		t->nr++;
+	}
+
+	for (i = 0; i < it->nr_tasks; i++)
+		it->tasks[i].ents = it->ents +
+				    (unsigned long)it->tasks[i].ents;
+	return 0;
+}
+
+/**
+ * Read the VMAs of all processes of host by the task_vma BPF iterator,
+ * the tasks are in the order of pid. Need CAP_BPF and CAP_PERFMON, and a
+ * kernel with BTF, 5.12 at least. The anonymous names except [heap],
+ * [stack] and the special mappings like [vdso] are empty, such as the
+ * [anon:NAME] of prctl(PR_SET_VMA).
+ *
+ * Return 0, -EOPNOTSUPP if the kernel doesn't support, or other errno.
+ * Free it by task_vma_iter_free() whatever returned.
+ */
+int task_vma_iter_read(struct task_vma_iter *it)
+{
+	int fd, err;
+
+	memset(it, 0, sizeof(*it));
+
+	fd = vma_iter_create();
+	if (fd < 0) {
+		ulp_debug("No task_vma iterator, %s\n", strerror(-fd));
+		return fd == -EINVAL || fd == -ENOENT ? -EOPNOTSUPP : fd;
+	}
+
+	it->buf = vma_iter_read_all(fd, &it->size);
+	err = it->buf ? 0 : -errno ?: -ENOMEM;
+	close(fd);
+	if (err)
+		return err;
+
+	err = vma_iter_parse(it);
+	ulp_debug("task_vma iterator: %u tasks, %u vmas, %zu bytes, ret %d\n",
+		  it->nr_tasks, it->nr_ents, it->size, err);
+	return err;
+}
+
+const struct task_vma_iter_task *task_vma_iter_find(
+		const struct task_vma_iter *it, pid_t pid)
+{
+	unsigned int lo = 0, hi = it->nr_tasks, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (it->tasks[mid].pid == pid)
+			return &it->tasks[mid];
+		if (it->tasks[mid].pid < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+void task_vma_iter_free(struct task_vma_iter *it)
+{
+	free(it->tasks);
+	free(it->ents);
+	free(it->buf);
+	memset(it, 0, sizeof(*it));
+}
@@ -12,10 +12,13 @@
 #include <stdlib.h>
 #include <elf.h>
 #include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include <elf/elf-api.h>
 
 #include <utils/log.h>
+#include <utils/emit.h>
 #include <task/task.h>
 
 #if defined(__x86_64__)
@@ -30,9 +33,9 @@ struct vm_area_struct *alloc_vma(struct task_struct *task)
 {
 	struct vm_area_struct *vma;
 
-	vma = malloc(sizeof(struct vm_area_struct));
+	vma = slab_alloc(&task->vma_slab);
 	if (!vma) {
-		ulp_error("Malloc vma failed.\n");
+		ulp_error("Alloc vma failed.\n");
 		return NULL;
 	}
 	memset(vma, 0x00, sizeof(struct vm_area_struct));
@@ -44,6 +47,7 @@ struct vm_area_struct *alloc_vma(struct task_struct *task)
 
 	list_init(&vma->node_list);
 	list_init(&vma->siblings);
+	RB_CLEAR_NODE(&vma->node_rb);
 
 	return vma;
 }
@@ -67,25 +71,105 @@ static inline int __vma_rb_cmp(struct rb_node *node, unsigned long key)
 	return 0;
 }
 
+static inline unsigned long vma_compute_gap(struct vm_area_struct *vma)
+{
+	return vma->vm_gap;
+}
+
+/**
+ * vmas_rb is augmented with rb_subtree_gap, as same as the kernel did
+ * before maple tree, then we could find a free area in O(log n).
+ */
+RB_DECLARE_CALLBACKS_MAX(static, vma_gap_callbacks, struct vm_area_struct,
+			 node_rb, unsigned long, rb_subtree_gap,
+			 vma_compute_gap)
+
+static unsigned long vma_prev_end(struct vm_area_struct *vma)
+{
+	struct rb_node *prev = rb_prev(&vma->node_rb);
+	return prev ? rb_entry(prev, struct vm_area_struct, node_rb)->vm_end : 0;
+}
+
+/* Previous VMA changed, update vm_gap and the subtree gaps */
+static void vma_gap_update(struct vm_area_struct *vma)
+{
+	vma->vm_gap = vma->vm_start - vma_prev_end(vma);
+	vma_gap_callbacks_propagate(&vma->node_rb, NULL);
+}
+
+static void vma_gap_update_next(struct vm_area_struct *vma)
+{
+	struct rb_node *next = rb_next(&vma->node_rb);
+	if (next)
+		vma_gap_update(rb_entry(next, struct vm_area_struct, node_rb));
+}
+
 void insert_vma(struct task_struct *task, struct vm_area_struct *vma,
 		struct vm_area_struct *prev)
 {
-	if (prev && strcmp(prev->name_, vma->name_) == 0) {
+	struct rb_node **link = &task->vmas_rb.rb_node, *parent = NULL, *next;
+	int cmp;
+
+	/* Interned names */
+	if (prev && prev->name_ == vma->name_) {
 		struct vm_area_struct *leader = prev->leader;
 		vma->leader = leader;
 		list_add(&vma->siblings, &leader->siblings);
 	}
 
-	list_add(&vma->node_list, &task->vma_list);
-	rb_insert_node(&task->vmas_rb, &vma->node_rb, __vma_rb_cmp,
-			(unsigned long)vma);
+	while (*link) {
+		parent = *link;
+		cmp = __vma_rb_cmp(parent, (unsigned long)vma);
+		if (cmp < 0)
+			link = &parent->rb_left;
+		else if (cmp > 0)
+			link = &parent->rb_right;
+		else {
+			/* Overlapped, only in vma_list, skipped by next_vma() */
+			list_add(&vma->node_list, &task->vma_list);
+			return;
+		}
+	}
+
+	rb_link_node(&vma->node_rb, parent, link);
+
+	/**
+	 * Keep vma_list in the in-order of vmas_rb, insert before the next
+	 * VMA, thus next_vma() is a list walk, no tree walk at all.
+	 */
+	next = rb_next(&vma->node_rb);
+	if (next) {
+		struct vm_area_struct *nvma;
+		nvma = rb_entry(next, struct vm_area_struct, node_rb);
+		list_add(&vma->node_list, &nvma->node_list);
+	} else
+		list_add(&vma->node_list, &task->vma_list);
+
+	/* Update gaps on the path before rebalance */
+	vma->vm_gap = vma->vm_start - vma_prev_end(vma);
+	vma->rb_subtree_gap = 0;
+	vma_gap_callbacks_propagate(&vma->node_rb, NULL);
+	vma_gap_update_next(vma);
+
+	rb_insert_augmented(&vma->node_rb, &task->vmas_rb, &vma_gap_callbacks);
 }
 
 void unlink_vma(struct task_struct *task, struct vm_area_struct *vma)
 {
+	struct rb_node *next;
+
 	list_del(&vma->node_list);
-	rb_erase(&vma->node_rb, &task->vmas_rb);
 	list_del(&vma->siblings);
+
+	/* Overlapped one never linked, see insert_vma() */
+	if (RB_EMPTY_NODE(&vma->node_rb))
+		return;
+
+	next = rb_next(&vma->node_rb);
+	rb_erase_augmented(&vma->node_rb, &task->vmas_rb, &vma_gap_callbacks);
+	RB_CLEAR_NODE(&vma->node_rb);
+	if (next)
+		vma_gap_update(rb_entry(next, struct vm_area_struct, node_rb));
 }
 
 void free_vma(struct vm_area_struct *vma)
@@ -93,7 +177,7 @@ void free_vma(struct vm_area_struct *vma)
 	if (!vma)
 		return;
 	free_ulp(vma);
-	free(vma);
+	slab_free(&vma->task->vma_slab, vma);
 }
 
 static inline int __find_vma_cmp(struct rb_node *node, unsigned long vaddr)
@@ -118,53 +202,139 @@ struct vm_area_struct *find_vma(const struct task_struct *task,
 			       __find_vma_cmp, vaddr);
 	if (rnode)
 		return rb_entry(rnode, struct vm_area_struct, node_rb);
+
 	errno = ENOENT;
 	return NULL;
 }
 
+/**
+ * Same as find_vma(), but vmas_rb is just a cache of target VMAs, ask the
+ * kernel on miss, see FTO_VMA_QUERY, the queried VMA is inserted and the
+ * stale ones are dropped. Never call it while iterating the VMAs or from
+ * threads.
+ */
+struct vm_area_struct *find_vma_or_query(struct task_struct *task,
+					 unsigned long vaddr)
+{
+	struct vm_area_struct *vma;
+
+	vma = find_vma(task, vaddr);
+	if (!vma && task->procmap_query)
+		vma = task_query_vma(task, vaddr);
+	return vma;
+}
+
+/* vma_list is sorted by address, see insert_vma() */
 struct vm_area_struct *next_vma(struct task_struct *task,
 				struct vm_area_struct *prev)
 {
-	struct rb_node *next;
-	next = prev ? rb_next(&prev->node_rb) : rb_first(&task->vmas_rb);
-	return  next ? rb_entry(next, struct vm_area_struct, node_rb) : NULL;
+	struct list_head *next = prev ? &prev->node_list : &task->vma_list;
+	struct vm_area_struct *vma;
+
+	while ((next = next->next) != &task->vma_list) {
+		vma = list_entry(next, struct vm_area_struct, node_list);
+		if (!RB_EMPTY_NODE(&vma->node_rb))
+			return vma;
+	}
+	return NULL;
 }
 
-unsigned long find_vma_span_area(struct task_struct *task, size_t size,
-				 unsigned long base)
+/* Does free area [gap_start, gap_end) have @size bytes in [low, high) */
+static inline bool gap_fit(unsigned long gap_start, unsigned long gap_end,
+			   size_t size, unsigned long low, unsigned long high)
 {
-	struct vm_area_struct *ivma, *first_vma, *next_vma;
-	struct rb_node *first, *next, *rnode;
+	gap_start = MAX(gap_start, low);
+	gap_end = MIN(gap_end, high);
+	return gap_end > gap_start && gap_end - gap_start >= size;
+}
 
-	first = rb_first(&task->vmas_rb);
-	first_vma = rb_entry(first, struct vm_area_struct, node_rb);
+/**
+ * Find the lowest free area of @size bytes in [@low, @high), only the gaps
+ * before VMAs are considered, the area after the last VMA is not.
+ *
+ * Walk the vmas_rb with rb_subtree_gap, like unmapped_area() in kernel,
+ * skip the subtrees without large enough gap.
+ *
+ * Return the start address, 0 if not found.
+ */
+unsigned long find_vma_gap(struct task_struct *task, size_t size,
+			   unsigned long low, unsigned long high)
+{
+	struct vm_area_struct *vma, *left, *right, *prev;
+	unsigned long gap_start, gap_end;
+	struct rb_node *rnode;
 
-	/**
-	 * Start from base if base non-zero.
-	 */
-	if (base && base >= MIN_ULP_START_VMA_ADDR &&
-	    first_vma->vm_start > base &&
-	    first_vma->vm_start - base >= size)
-		return base;
+	if (!size || high <= low || high - low < size)
+		return 0;
 
-	/**
-	 * For each vma to find span area.
-	 */
-	for (rnode = first; rnode; rnode = rb_next(rnode)) {
-		ivma = rb_entry(rnode, struct vm_area_struct, node_rb);
-		next = rb_next(rnode);
-		if (!next)
-			return 0;
+	rnode = task->vmas_rb.rb_node;
+	if (!rnode)
+		return 0;
+
+	vma = rb_entry(rnode, struct vm_area_struct, node_rb);
+	if (vma->rb_subtree_gap < size)
+		return 0;
+
+	while (1) {
+		/* Visit left subtree if it looks promising */
+		gap_end = vma->vm_start;
+		if (gap_end >= low + size && vma->node_rb.rb_left) {
+			left = rb_entry(vma->node_rb.rb_left,
+					struct vm_area_struct, node_rb);
+			if (left->rb_subtree_gap >= size) {
+				vma = left;
+				continue;
+			}
+		}
 
-		ulp_debug("vma: %lx-%lx %s\n", ivma->vm_start, ivma->vm_end,
-			ivma->name_);
+		gap_start = vma->vm_start - vma->vm_gap;
+check_current:
+		/* All the gaps on the right are higher */
+		if (gap_start >= high || high - gap_start < size)
+			return 0;
+		if (gap_fit(gap_start, gap_end, size, low, high))
+			return MAX(gap_start, low);
+
+		/* Visit right subtree if it looks promising */
+		if (vma->node_rb.rb_right) {
+			right = rb_entry(vma->node_rb.rb_right,
+					 struct vm_area_struct, node_rb);
+			if (right->rb_subtree_gap >= size) {
+				vma = right;
+				continue;
+			}
+		}
 
-		next_vma = rb_entry(next, struct vm_area_struct, node_rb);
-		if (next_vma->vm_start - ivma->vm_end >= size)
-			return ivma->vm_end;
+		/* Go back up the rbtree to find next candidate node */
+		while (1) {
+			prev = vma;
+			rnode = rb_parent(&prev->node_rb);
+			if (!rnode)
+				return 0;
+			vma = rb_entry(rnode, struct vm_area_struct, node_rb);
+			if (&prev->node_rb == vma->node_rb.rb_left) {
+				gap_start = vma->vm_start - vma->vm_gap;
+				gap_end = vma->vm_start;
+				goto check_current;
+			}
+		}
 	}
-	ulp_error("No space fatal in target process, pid %d\n", task->pid);
-	return 0;
+}
+
+unsigned long find_vma_span_area(struct task_struct *task, size_t size,
+				 unsigned long base)
+{
+	unsigned long addr;
+
+	/**
+	 * Start from base if base non-zero.
+	 */
+	addr = find_vma_gap(task, size, base ?: MIN_ULP_START_VMA_ADDR,
+			    ULONG_MAX);
+	if (!addr)
+		ulp_error("No space fatal in target process, pid %d\n",
+			  task->pid);
+	return addr;
 }
 
 unsigned int vma_perms2prot(char *perms)
@@ -194,56 +364,98 @@ int vma_prot2flags(unsigned int prot)
 
 int free_task_vmas(struct task_struct *task);
 
+/**
+ * Return the PID in the name of patch VMA, see get_vma_type(), which is not
+ * the pid of task if the patch is inherited from parent, 0 if @name is not
+ * patch VMA.
+ */
+pid_t ulp_vma_owner(const char *name)
+{
+	const char *prefix = ULP_PROC_ROOT_DIR "/";
+	const char *suffix = "/" TASK_PROC_MAP_FILES "/" PATCH_VMA_TEMP_PREFIX;
+	const char *p;
+	char *end;
+	long pid;
+
+	if (strncmp(name, prefix, strlen(prefix)))
+		return 0;
+
+	p = name + strlen(prefix);
+	pid = strtol(p, &end, 10);
+	if (end == p || pid <= 0 || strncmp(end, suffix, strlen(suffix)))
+		return 0;
+	return pid;
+}
+
 enum vma_type get_vma_type(pid_t pid, const char *exe, const char *name)
 {
-	enum vma_type type = VMA_NONE;
+	const char *base = basename((char *)name);
 	char s_pid[64];
 
-	snprintf(s_pid, sizeof(s_pid), "%d", pid);
+	if (!strcmp(name, exe))
+		return VMA_SELF;
+
+	/* The names of special VMAs, such as "[heap]" */
+	if (name[0] == '[') {
+		if (!strcmp(name, "[heap]"))
+			return VMA_HEAP;
+		if (!strcmp(name, "[stack]"))
+			return VMA_STACK;
+		if (!strcmp(name, "[uprobes]"))
+			return VMA_UPROBES;
+		if (!strcmp(name, "[vvar]"))
+			return VMA_VVAR;
+		if (!strcmp(name, "[vvar_vclock]"))
+			return VMA_VVAR_VCLOCK;
+		if (!strcmp(name, "[vdso]"))
+			return VMA_VDSO;
+		if (!strcmp(name, "[vsyscall]"))
+			return VMA_VSYSCALL;
+		return VMA_NONE;
+	}
 
-	if (!strcmp(name, exe)) {
-		type = VMA_SELF;
 	/**
 	 * FIXME: What if has libc-just-test.so dynamic library?
 	 */
-	} else if (!strncmp(basename((char*)name), "libc.so", 7) ||
-		   !strncmp(basename((char*)name), "libssp", 6) ||
-		   !strncmp(basename((char*)name), "libc-", 5)) {
-		type = VMA_LIBC;
-	} else if (!strcmp(name, "[heap]")) {
-		type = VMA_HEAP;
-	} else if (!strncmp(basename((char*)name), "ld-linux", 8)) {
-		type = VMA_LD;
-	} else if (!strcmp(name, "[stack]")) {
-		type = VMA_STACK;
-	} else if (!strcmp(name, "[uprobes]")) {
-		type = VMA_UPROBES;
-	} else if (!strcmp(name, "[vvar]")) {
-		type = VMA_VVAR;
-	} else if (!strcmp(name, "[vvar_vclock]")) {
-		type = VMA_VVAR_VCLOCK;
-	} else if (!strcmp(name, "[vdso]")) {
-		type = VMA_VDSO;
-	} else if (!strcmp(name, "[vsyscall]")) {
-		type = VMA_VSYSCALL;
-	} else if (!strncmp(basename((char*)name), "lib", 3) &&
-		   strstr(name, ".so")) {
-		type = VMA_LIB_UNKNOWN;
-	} else if (strlen(name) == 0) {
-		type = VMA_ANON;
+	if (!strncmp(base, "libc.so", 7) || !strncmp(base, "libssp", 6) ||
+	    !strncmp(base, "libc-", 5))
+		return VMA_LIBC;
+	if (!strncmp(base, "ld-linux", 8))
+		return VMA_LD;
+	if (!strncmp(base, "lib", 3) && strstr(name, ".so"))
+		return VMA_LIB_UNKNOWN;
+	if (name[0] == '\0')
+		return VMA_ANON;
+
 	/**
 	 * Example:
 	 * /tmp/ulpatch/20298/map_files/ulp-GLpgJM
 	 *              ^^^^^           ^^^^
+	 * The PID is of the parent if inherited by fork(2).
 	 */
-	} else if (strstr(name, PATCH_VMA_TEMP_PREFIX) &&
-		   strstr(name, s_pid)) {
-		type = VMA_ULPATCH;
-	} else {
-		type = VMA_NONE;
-	}
+	if (!strstr(name, PATCH_VMA_TEMP_PREFIX))
+		return VMA_NONE;
+	snprintf(s_pid, sizeof(s_pid), "%d", pid);
+	if (strstr(name, s_pid) || ulp_vma_owner(name))
+		return VMA_ULPATCH;
+	return VMA_NONE;
+}
+
+/**
+ * get_vma_type() of the interned @name, cached in task, thus the maps lines
+ * of an already seen path cost one hash lookup only.
+ */
+static enum vma_type task_vma_type(struct task_struct *task, const char *name)
+{
+	struct vma_type_cache *c;
 
-	return type;
+	c = &task->vma_types[str_intern_hash(name) &
+			     (TASK_VMA_TYPE_CACHE_SIZE - 1)];
+	if (c->name != name) {
+		c->name = name;
+		c->type = get_vma_type(task->pid, task->exe, name);
+	}
+	return c->type;
 }
 
 static const struct {
@@ -277,7 +489,7 @@ const char *vma_type_name(enum vma_type type)
 
 bool elf_vma_is_interp_exception(struct vm_area_struct *vma)
 {
-	char *name = vma->name_;
+	const char *name = vma->name_;
 
 	/* libc */
 	if (!strncmp(name, "libc", 4) &&
@@ -304,6 +516,298 @@ bool elf_vma_is_interp_exception(struct vm_area_struct *vma)
 	return false;
 }
 
+static inline int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static const char *parse_hex(const char *p, const char *end,
+			     unsigned long *val)
+{
+	unsigned long v = 0;
+	const char *s = p;
+	int h;
+
+	while (p < end && (h = hexval(*p)) >= 0) {
+		v = (v << 4) | h;
+		p++;
+	}
+	*val = v;
+	return p == s ? NULL : p;
+}
+
+static const char *parse_dec(const char *p, const char *end,
+			     unsigned long *val)
+{
+	unsigned long v = 0;
+	const char *s = p;
+
+	while (p < end && *p >= '0' && *p <= '9') {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+	*val = v;
+	return p == s ? NULL : p;
+}
+
+static const char *expect_char(const char *p, const char *end, char c)
+{
+	return (p && p < end && *p == c) ? p + 1 : NULL;
+}
+
+/**
+ * Parse one line of /proc/PID/maps, looks like:
+ *
+ * 7f1c2b400000-7f1c2b428000 r--p 00000000 fd:00 1234    /usr/lib64/libc.so.6
+ *
+ * @line: start of line, @end: end of buffer
+ *
+ * Return the start of next line, NULL if malformed.
+ */
+static const char *parse_maps_line(const char *line, const char *end,
+				   struct maps_entry *e)
+{
+	const char *p = line, *eol;
+	unsigned long v = 0;
+
+	eol = memchr(line, '\n', end - line) ?: end;
+
+	p = parse_hex(p, eol, &e->start);
+	p = expect_char(p, eol, '-');
+	if (p)
+		p = parse_hex(p, eol, &e->end);
+	p = expect_char(p, eol, ' ');
+	if (!p || eol - p < 5)
+		return NULL;
+
+	memcpy(e->perms, p, 4);
+	e->perms[4] = '\0';
+	p = expect_char(p + 4, eol, ' ');
+
+	if (p)
+		p = parse_hex(p, eol, &e->off);
+	p = expect_char(p, eol, ' ');
+	if (p)
+		p = parse_hex(p, eol, &v);
+	e->major = v;
+	p = expect_char(p, eol, ':');
+	if (p)
+		p = parse_hex(p, eol, &v);
+	e->minor = v;
+	p = expect_char(p, eol, ' ');
+	if (p)
+		p = parse_dec(p, eol, &e->inode);
+	if (!p)
+		return NULL;
+
+	/* The name is the rest of line after the padding */
+	while (p < eol && *p == ' ')
+		p++;
+	e->name = p;
+	e->name_len = eol - p;
+
+	/**
+	 * Keep the name without " (deleted)" suffix, as same as we do
+	 * with sscanf(3) "%s" before.
+	 */
+#define DELETED_SUFFIX	" (deleted)"
+	if (e->name_len > strlen(DELETED_SUFFIX) &&
+	    !memcmp(eol - strlen(DELETED_SUFFIX), DELETED_SUFFIX,
+		    strlen(DELETED_SUFFIX)))
+		e->name_len -= strlen(DELETED_SUFFIX);
+#undef DELETED_SUFFIX
+
+	return eol < end ? eol + 1 : end;
+}
+
+/**
+ * PROCMAP_QUERY was introduced in Linux 6.11, define it if the uapi header
+ * is older.
+ */
+#ifndef PROCMAP_QUERY
+enum procmap_query_flags {
+	PROCMAP_QUERY_VMA_READABLE		= 0x01,
+	PROCMAP_QUERY_VMA_WRITABLE		= 0x02,
+	PROCMAP_QUERY_VMA_EXECUTABLE		= 0x04,
+	PROCMAP_QUERY_VMA_SHARED		= 0x08,
+	PROCMAP_QUERY_COVERING_OR_NEXT_VMA	= 0x10,
+	PROCMAP_QUERY_FILE_BACKED_VMA		= 0x20,
+};
+
+struct procmap_query {
+	__u64 size;
+	__u64 query_flags;
+	__u64 query_addr;
+	__u64 vma_start;
+	__u64 vma_end;
+	__u64 vma_flags;
+	__u64 vma_page_size;
+	__u64 vma_offset;
+	__u64 inode;
+	__u32 dev_major;
+	__u32 dev_minor;
+	__u32 vma_name_size;
+	__u32 build_id_size;
+	__u64 vma_name_addr;
+	__u64 build_id_addr;
+};
+
+#define PROCFS_IOCTL_MAGIC	'f'
+#define PROCMAP_QUERY	_IOWR(PROCFS_IOCTL_MAGIC, 17, struct procmap_query)
+#endif
+
+/**
+ * Query the VMA cover @addr with PROCMAP_QUERY ioctl(2), the name will be
+ * stored in @name.
+ *
+ * Return 0 if found, -ENOENT if no VMA cover @addr, others errno.
+ */
+static int procmap_query(int mapsfd, unsigned long addr, unsigned long flags,
+			 struct maps_entry *e, char *name, size_t name_size)
+{
+	struct procmap_query q;
+
+	memset(&q, 0, sizeof(q));
+	q.size = sizeof(q);
+	q.query_flags = flags;
+	q.query_addr = addr;
+	q.vma_name_addr = (unsigned long)name;
+	q.vma_name_size = name_size;
+
+	if (ioctl(mapsfd, PROCMAP_QUERY, &q) != 0)
+		return -errno;
+
+	e->start = q.vma_start;
+	e->end = q.vma_end;
+	e->off = q.vma_offset;
+	e->major = q.dev_major;
+	e->minor = q.dev_minor;
+	e->inode = q.inode;
+	e->perms[0] = q.vma_flags & PROCMAP_QUERY_VMA_READABLE ? 'r' : '-';
+	e->perms[1] = q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE ? 'w' : '-';
+	e->perms[2] = q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE ? 'x' : '-';
+	e->perms[3] = q.vma_flags & PROCMAP_QUERY_VMA_SHARED ? 's' : 'p';
+	e->perms[4] = '\0';
+	/* vma_name_size include the NUL, and zero if no name */
+	e->name = name;
+	e->name_len = q.vma_name_size ? q.vma_name_size - 1 : 0;
+
+	return 0;
+}
+
+/**
+ * Read the whole /proc/PID/maps into a malloc(3) buffer, the caller should
+ * free(3) it.
+ */
+static char *read_pid_maps(struct task_struct *task, size_t *size)
+{
+	size_t len = 0, cap = 64 * 1024;
+	char *buf, *tmp;
+	ssize_t n;
+	int mapsfd;
+
+	mapsfd = task_proc_open(task, "maps", O_RDONLY);
+	if (mapsfd <= 0) {
+		ulp_error("open /proc/%d/maps failed. %m\n", task->pid);
+		return NULL;
+	}
+
+	buf = malloc(cap);
+	if (!buf)
+		goto close_fd;
+
+	while (1) {
+		if (len == cap) {
+			cap *= 2;
+			tmp = realloc(buf, cap);
+			if (!tmp)
+				goto free_buf;
+			buf = tmp;
+		}
+		n = read(mapsfd, buf + len, cap - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ulp_error("read /proc/%d/maps failed, %m\n", task->pid);
+			goto free_buf;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	close(mapsfd);
+	*size = len;
+	return buf;
+
+free_buf:
+	free(buf);
+close_fd:
+	close(mapsfd);
+	return NULL;
+}
+
+static struct vm_area_struct *vma_from_maps_entry(struct task_struct *task,
+						   const struct maps_entry *e)
+{
+	struct vm_area_struct *vma;
+
+	vma = alloc_vma(task);
+	if (!vma)
+		return NULL;
+
+	vma->name_ = str_intern_len(e->name, e->name_len);
+	if (!vma->name_) {
+		free_vma(vma);
+		return NULL;
+	}
+
+	vma->vm_start = e->start;
+	vma->vm_end = e->end;
+	memcpy(vma->perms, e->perms, sizeof(vma->perms));
+	vma->prot = vma_perms2prot(vma->perms);
+	vma->vm_pgoff = (e->off >> PAGE_SHIFT);
+	vma->major = e->major;
+	vma->minor = e->minor;
+	vma->inode = e->inode;
+
+	vma->type = task_vma_type(task, vma->name_);
+
+	/* Find libc.so */
+	if (!task->libc_vma && vma->type == VMA_LIBC &&
+	    vma->prot & PROT_EXEC) {
+		ulp_debug("Get x libc: 0x%lx\n", vma->vm_start);
+		task->libc_vma = vma;
+	}
+
+	/* Find [stack] */
+	if (!task->stack && vma->type == VMA_STACK)
+		task->stack = vma;
+
+	vma->leader = vma;
+
+	return vma;
+}
+
+/* See task_vma_iter_use() */
+static const struct task_vma_iter *vma_iter_snapshot;
+
+/**
+ * Let read_task_vmas() take the VMAs from @it read by task_vma_iter_read(),
+ * NULL to stop. The snapshot is not refreshed, only for the tools which
+ * open many processes to read, such as ulpinfo(8), never for patching.
+ */
+void task_vma_iter_use(const struct task_vma_iter *it)
+{
+	vma_iter_snapshot = it;
+}
+
 /**
  * @update_ulp: if patch to target process, we need to insert the new vma to
  *              list.
@@ -311,89 +815,391 @@ bool elf_vma_is_interp_exception(struct vm_area_struct *vma)
 int read_task_vmas(struct task_struct *task, bool update_ulp)
 {
 	struct vm_area_struct *vma, *prev = NULL;
-	int mapsfd;
-	FILE *mapsfp;
-
-	/* open(2) /proc/[PID]/maps */
-	mapsfd = open_pid_maps(task->pid);
-	if (mapsfd <= 0)
-		return -errno;
-	lseek(mapsfd, 0, SEEK_SET);
-
-	mapsfp = fdopen(mapsfd, "r");
-	fseek(mapsfp, 0, SEEK_SET);
-	do {
-		unsigned long start, end, off;
-		unsigned int major, minor;
-		unsigned long inode;
-		char perms[5], name_[256];
-		int r;
-		char line[1024];
-		struct vm_area_struct __unused *old;
+	const struct task_vma_iter_task *t;
+	struct maps_entry e;
+	const char *p, *end;
+	char *buf;
+	size_t size;
+
+	/* Fall back to /proc/PID/maps if not in the snapshot */
+	if (!update_ulp && vma_iter_snapshot) {
+		t = task_vma_iter_find(vma_iter_snapshot, task->pid);
+		if (t && !t->incomplete &&
+		    !read_task_vmas_from(task, t->ents, t->nr))
+			return 0;
+		ulp_debug("No VMAs of %d in snapshot, read maps.\n",
+			  task->pid);
+	}
 
-		start = end = off = major = minor = inode = 0;
+	buf = read_pid_maps(task, &size);
+	if (!buf)
+		return -errno ?: -ENOMEM;
 
-		memset(perms, 0, sizeof(perms));
-		memset(name_, 0, sizeof(name_));
-		memset(line, 0, sizeof(line));
+	p = buf;
+	end = buf + size;
 
-		if (!fgets(line, sizeof(line), mapsfp))
-			break;
+	while (p < end) {
+		struct vm_area_struct __unused *old;
 
-		r = sscanf(line, "%lx-%lx %s %lx %x:%x %ld %255s", &start,
-			   &end, perms, &off, &major, &minor, &inode, name_);
-		if (r <= 0) {
-			ulp_error("sscanf failed.\n");
+		p = parse_maps_line(p, end, &e);
+		if (!p) {
+			ulp_error("parse /proc/%d/maps failed.\n", task->pid);
+			free(buf);
 			return -1;
 		}
 #if 1
 		if (update_ulp) {
-			old = find_vma(task, start + 1);
+			old = find_vma(task, e.start + 1);
 			/* Skip if alread exist. */
-			if (old && old->vm_start == start &&
-			    old->vm_end == end) {
-				ulp_warning("vma %s alread exist.\n", name_);
+			if (old && old->vm_start == e.start &&
+			    old->vm_end == e.end) {
+				ulp_warning("vma %.*s alread exist.\n",
+					    (int)e.name_len, e.name);
 				continue;
 			} else
-				ulp_warning("insert vma %s.\n", name_);
+				ulp_warning("insert vma %.*s.\n",
+					    (int)e.name_len, e.name);
 		}
 #endif
 
-		vma = alloc_vma(task);
-
-		vma->vm_start = start;
-		vma->vm_end = end;
-		memcpy(vma->perms, perms, sizeof(vma->perms));
-		vma->prot = vma_perms2prot(perms);
-		vma->vm_pgoff = (off >> PAGE_SHIFT);
-		vma->major = major;
-		vma->minor = minor;
-		vma->inode = inode;
-		strncpy(vma->name_, name_, sizeof(vma->name_));
-		vma->type = get_vma_type(task->pid, task->exe, name_);
-
-		/* Find libc.so */
-		if (!task->libc_vma && vma->type == VMA_LIBC &&
-		    vma->prot & PROT_EXEC) {
-			ulp_debug("Get x libc: 0x%lx\n", vma->vm_start);
-			task->libc_vma = vma;
+		vma = vma_from_maps_entry(task, &e);
+		if (!vma) {
+			free(buf);
+			return -ENOMEM;
 		}
 
-		/* Find [stack] */
-		if (!task->stack && vma->type == VMA_STACK)
-			task->stack = vma;
+		insert_vma(task, vma, prev);
+		prev = vma;
+	}
 
-		vma->leader = vma;
+	free(buf);
+	return 0;
+}
 
+/**
+ * Build the VMAs of @task from @nr entries read by such as
+ * task_vma_iter_read(), instead of reading /proc/PID/maps, the entries are
+ * in the order of address. The @task has no VMA yet, and has none again if
+ * failed.
+ */
+int read_task_vmas_from(struct task_struct *task,
+			const struct maps_entry *ents, unsigned int nr)
+{
+	struct vm_area_struct *vma, *prev = NULL;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		vma = vma_from_maps_entry(task, &ents[i]);
+		if (!vma) {
+			free_task_vmas(task);
+			return -ENOMEM;
+		}
 		insert_vma(task, vma, prev);
 		prev = vma;
-	} while (1);
+	}
+	return 0;
+}
 
-	fclose(mapsfp);
-	close(mapsfd);
+static bool vma_same_file(const struct vm_area_struct *vma,
+			  const struct maps_entry *e)
+{
+	return vma->inode == e->inode && vma->major == e->major &&
+	       vma->minor == e->minor &&
+	       strlen(vma->name_) == e->name_len &&
+	       !memcmp(vma->name_, e->name, e->name_len);
+}
+
+/**
+ * The VMA was unmapped, release it and everything point to it.
+ */
+static void drop_vma(struct task_struct *task, struct vm_area_struct *vma)
+{
+	struct vm_area_struct *sibling, *tmp, *leader = NULL;
+	struct task_link_map *lm;
+
+	ulp_debug("Remove vma %lx-%lx %s\n", vma->vm_start, vma->vm_end,
+		  vma->name_);
+
+	/* Before the vma::vma_elf and the patches are freed */
+	task_unlink_vma_syms(vma);
+
+	/**
+	 * Promote the next sibling to leader, the matched phdrs of siblings
+	 * point to the leader's vma::vma_elf, which is freed below.
+	 */
+	if (vma->leader == vma) {
+		list_for_each_entry_safe(sibling, tmp, &vma->siblings,
+					 siblings) {
+			if (!leader)
+				leader = sibling;
+			sibling->leader = leader;
+			sibling->phdr = NULL;
+		}
+	}
+
+	if (task->libc_vma == vma)
+		task->libc_vma = NULL;
+	if (task->stack == vma)
+		task->stack = NULL;
+	if (task->vma_self_elf == vma)
+		task->vma_self_elf = NULL;
+	/* Empty if FTO_LINK_MAP not loaded */
+	list_for_each_entry(lm, &task->link_maps, node) {
+		if (lm->vma == vma)
+			lm->vma = NULL;
+	}
+
+	if (vma->syms_lazy) {
+		vma->syms_lazy = false;
+		task->tsyms.nr_lazy_vmas--;
+	}
+
+	if (vma->is_elf) {
+		if (task->fto_flag & FTO_VMA_ELF)
+			vma_free_elf(vma);
+		if (task->fto_flag & FTO_VMA_ELF_FILE) {
+			if (task->exe_bfd == vma->bfd_elf_file)
+				task->exe_bfd = NULL;
+			if (task->libc_bfd == vma->bfd_elf_file)
+				task->libc_bfd = NULL;
+			bfd_elf_close(vma->bfd_elf_file);
+		}
+	}
+
+	unlink_vma(task, vma);
+	free_vma(vma);
+}
+
+static void refresh_drop_vma(struct task_struct *task,
+			     struct vm_area_struct *vma,
+			     struct task_vma_changes *c,
+			     task_vma_notify_fn notify, void *arg)
+{
+	if (notify)
+		notify(vma, TASK_VMA_REMOVED, vma->vm_end, vma->perms, arg);
+	drop_vma(task, vma);
+	c->nr_removed++;
+}
+
+/**
+ * Re-read /proc/PID/maps, and merge it with existing VMAs in one linear pass,
+ * both of them are sorted by address. Insert new VMAs, remove unmapped
+ * VMAs, and update resized VMAs in place, the unchanged VMAs stay untouched,
+ * the pointers to them are still valid.
+ *
+ * @changes: could be NULL.
+ * @notify: called for every changed VMA in address order, could be NULL.
+ */
+int refresh_task_vmas_notify(struct task_struct *task,
+			     struct task_vma_changes *changes,
+			     task_vma_notify_fn notify, void *arg)
+{
+	struct vm_area_struct *cur, *next, *vma, *prev = NULL;
+	struct task_vma_changes c = {};
+	struct maps_entry e;
+	const char *p, *end;
+	char *buf;
+	size_t size;
+	int ret = 0;
+
+	buf = read_pid_maps(task, &size);
+	if (!buf)
+		return -errno ?: -ENOMEM;
+
+	p = buf;
+	end = buf + size;
+	cur = first_vma(task);
+
+	while (p < end) {
+		p = parse_maps_line(p, end, &e);
+		if (!p) {
+			ulp_error("parse /proc/%d/maps failed.\n", task->pid);
+			ret = -1;
+			goto out;
+		}
+
+		/* The VMAs before this line were unmapped */
+		while (cur && cur->vm_start < e.start) {
+			next = next_vma(task, cur);
+			refresh_drop_vma(task, cur, &c, notify, arg);
+			cur = next;
+		}
+
+		if (cur && cur->vm_start == e.start && vma_same_file(cur, &e)) {
+			if (cur->vm_end == e.end &&
+			    !strcmp(cur->perms, e.perms)) {
+				c.nr_unchanged++;
+			} else {
+				unsigned long old_end = cur->vm_end;
+				char old_perms[sizeof(cur->perms)];
+
+				ulp_debug("Resize vma %lx-%lx to %lx-%lx %s\n",
+					  cur->vm_start, cur->vm_end, e.start,
+					  e.end, e.perms);
+				memcpy(old_perms, cur->perms, sizeof(old_perms));
+				/* Start address not changed, sorted still */
+				cur->vm_end = e.end;
+				memcpy(cur->perms, e.perms, sizeof(cur->perms));
+				cur->prot = vma_perms2prot(cur->perms);
+				cur->vm_pgoff = (e.off >> PAGE_SHIFT);
+				vma_gap_update_next(cur);
+				c.nr_resized++;
+				if (notify)
+					notify(cur, TASK_VMA_RESIZED, old_end,
+					       old_perms, arg);
+			}
+			prev = cur;
+			cur = next_vma(task, cur);
+			continue;
+		}
+
+		/* Same start, but different file, replace it */
+		if (cur && cur->vm_start == e.start) {
+			next = next_vma(task, cur);
+			refresh_drop_vma(task, cur, &c, notify, arg);
+			cur = next;
+		}
+
+		/**
+		 * The cached VMA overlap with new one, it was resized or
+		 * merged, drop it before insert.
+		 */
+		while (cur && cur->vm_start < e.end) {
+			next = next_vma(task, cur);
+			refresh_drop_vma(task, cur, &c, notify, arg);
+			cur = next;
+		}
+
+		vma = vma_from_maps_entry(task, &e);
+		if (!vma) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ulp_debug("Insert vma %lx-%lx %s\n", vma->vm_start, vma->vm_end,
+			  vma->name_);
+		insert_vma(task, vma, prev);
+		c.nr_added++;
+		if (notify)
+			notify(vma, TASK_VMA_ADDED, vma->vm_end, vma->perms,
+			       arg);
+		prev = vma;
+	}
+
+	/* All VMAs after the last line were unmapped */
+	while (cur) {
+		next = next_vma(task, cur);
+		refresh_drop_vma(task, cur, &c, notify, arg);
+		cur = next;
+	}
+
+	ulp_debug("Refresh vmas: added %u, removed %u, resized %u, unchanged %u\n",
+		  c.nr_added, c.nr_removed, c.nr_resized, c.nr_unchanged);
+
+	/* libc_vma may be found by vma_from_maps_entry() again */
+	if (!task->libc_vma || !task->stack)
+		ulp_warning("No libc or stack after refresh.\n");
+
+out:
+	if (changes)
+		*changes = c;
+	free(buf);
+	return ret;
+}
+
+int refresh_task_vmas(struct task_struct *task,
+		      struct task_vma_changes *changes)
+{
+	return refresh_task_vmas_notify(task, changes, NULL, NULL);
+}
+
+/**
+ * Open /proc/PID/maps for PROCMAP_QUERY ioctl(2), and check the kernel
+ * support it or not, see FTO_VMA_QUERY.
+ */
+int task_vma_query_init(struct task_struct *task)
+{
+	struct maps_entry e;
+	char name[PATH_MAX];
+	int ret;
+
+	task->procmap_query = false;
+
+	task->proc_maps_fd = task_proc_open(task, "maps", O_RDONLY);
+	if (task->proc_maps_fd <= 0)
+		return -errno;
+
+	ret = procmap_query(task->proc_maps_fd, 0,
+			    PROCMAP_QUERY_COVERING_OR_NEXT_VMA, &e, name,
+			    sizeof(name));
+	if (ret && ret != -ENOENT) {
+		ulp_debug("PROCMAP_QUERY not supported, %s\n", strerror(-ret));
+		task_vma_query_destroy(task);
+		return -EOPNOTSUPP;
+	}
+
+	task->procmap_query = true;
 	return 0;
 }
 
+void task_vma_query_destroy(struct task_struct *task)
+{
+	if (task->proc_maps_fd > STDERR_FILENO)
+		close(task->proc_maps_fd);
+	task->proc_maps_fd = -1;
+	task->procmap_query = false;
+}
+
+/**
+ * Ask the kernel which VMA cover @vaddr, and insert it to vmas_rb.
+ */
+struct vm_area_struct *task_query_vma(struct task_struct *task,
+				      unsigned long vaddr)
+{
+	struct vm_area_struct *vma, *old;
+	struct rb_node *rnode;
+	struct maps_entry e;
+	char name[PATH_MAX];
+	int ret;
+
+	if (!task->procmap_query) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+
+	ret = procmap_query(task->proc_maps_fd, vaddr, 0, &e, name,
+			    sizeof(name));
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	vma = vma_from_maps_entry(task, &e);
+	if (!vma)
+		return NULL;
+
+	/**
+	 * The VMA may be merged or resized after we read it, drop the stale
+	 * ones overlap with the new one.
+	 */
+	while ((rnode = rb_search_node(&task->vmas_rb, __vma_rb_cmp,
+				       (unsigned long)vma))) {
+		old = rb_entry(rnode, struct vm_area_struct, node_rb);
+		ulp_debug("Drop stale vma %lx-%lx\n", old->vm_start,
+			  old->vm_end);
+		if (task->libc_vma == old)
+			task->libc_vma = vma->type == VMA_LIBC ? vma : NULL;
+		if (task->stack == old)
+			task->stack = vma;
+		drop_vma(task, old);
+	}
+
+	ulp_debug("Query vma %lx-%lx %s\n", vma->vm_start, vma->vm_end,
+		  vma->name_);
+
+	insert_vma(task, vma, NULL);
+	return vma;
+}
+
 void print_vma(FILE *fp, bool first_line, struct vm_area_struct *vma,
 	       bool detail)
 {
@@ -420,7 +1226,7 @@ void print_vma(FILE *fp, bool first_line, struct vm_area_struct *vma,
 		vma->perms,
 		vma->is_elf ? "E" : "-",
 		vma->is_share_lib ? "S" : "-",
-		vma->is_matched_phdr ? "P" : "-",
+		vma_matched_phdr(vma) ? "P" : "-",
 		vma->leader == vma ? "L" : "-");
 	fprintf(fp, "%11s %016lx %016lx %s\n",
 		"",
@@ -445,10 +1251,82 @@ void print_vma(FILE *fp, bool first_line, struct vm_area_struct *vma,
 				first = false;
 			}
 		}
-		if (vma->is_matched_phdr)
-			print_phdr(fp, NULL, &vma->phdr, true);
+		if (vma_matched_phdr(vma))
+			print_phdr(fp, NULL, vma->phdr, true);
 		/* Add more information here */
 		if (fp == stdout || fp == stderr)
 			fprintf(fp, "\033[0m");
 	}
 }
+
+/**
+ * One record of @vma, the fields of print_vma(), and the resident, swapped
+ * and THP bytes if @res is not NULL, the THP is null without PFN.
+ */
+void emit_vma(struct emitter *e, struct vm_area_struct *vma,
+	      const struct task_vma_residency *res)
+{
+	/* Keep the number of keys same as below */
+	emit_map(e, res ? 14 : 11);
+	emit_kv_str(e, "type", vma_type_name(vma->type));
+	emit_kv_u64(e, "start", vma->vm_start);
+	emit_kv_u64(e, "end", vma->vm_end);
+	emit_kv_str(e, "perms", vma->perms);
+	emit_kv_u64(e, "offset", vma->vm_pgoff << PAGE_SHIFT);
+	emit_kv_u64(e, "voffset", vma->voffset);
+	emit_kv_str(e, "name", vma->name_);
+	emit_kv_bool(e, "elf", vma->is_elf);
+	emit_kv_bool(e, "shared_lib", vma->is_share_lib);
+	emit_kv_bool(e, "matched_phdr", vma_matched_phdr(vma));
+	emit_kv_bool(e, "leader", vma->leader == vma);
+
+	if (!res)
+		return;
+
+	emit_kv_u64(e, "rss", res->present * PAGE_SIZE);
+	emit_kv_u64(e, "swap", res->swapped * PAGE_SIZE);
+	emit_key(e, "thp");
+	if (res->pfn || !res->present)
+		emit_u64(e, res->thp * PAGE_SIZE);
+	else
+		emit_nil(e);
+}
+
+/**
+ * Read the GNU Build ID of ELF VMA from target task memory, through PT_NOTE
+ * of vma::vma_elf, the VMA must be the leader of ELF. Works even if the ELF
+ * file was deleted or replaced.
+ *
+ * Return the length of Build ID, negative errno if failed.
+ */
+int vma_read_build_id(struct vm_area_struct *vma, uint8_t *bid,
+		      size_t bid_size)
+{
+	struct vma_elf_mem *elf = vma->vma_elf;
+	/* Build ID note is at the beginning of PT_NOTE usually */
+	char notes[4096];
+	int i, ret = -ENOENT;
+
+	if (!elf || !elf->phdrs)
+		return -EINVAL;
+
+	for (i = 0; i < elf->ehdr.e_phnum && ret < 0; i++) {
+		GElf_Phdr *phdr = &elf->phdrs[i];
+		size_t size = MIN(phdr->p_memsz, sizeof(notes));
+
+		if (phdr->p_type != PT_NOTE || !size)
+			continue;
+
+		if (memcpy_from_task(vma->task, notes,
+				     elf->load_addr + phdr->p_vaddr,
+				     size) < size)
+			continue;
+
+		ret = elf_notes_build_id(notes, size, phdr->p_align, bid,
+					 bid_size);
+		if (ret == -ENOSPC)
+			break;
+	}
+
+	return ret;
+}
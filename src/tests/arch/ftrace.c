@@ -1,8 +1,11 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <utils/disasm.h>
 #include <utils/log.h>
@@ -10,6 +13,10 @@
 #include <task/task.h>
 #include <tests/test-api.h>
 
+#if defined(__x86_64__)
+#include <arch/x86_64/nops.h>
+#endif
+
 TEST_STUB(arch_ftrace);
 
 #if defined(__x86_64__)
@@ -28,3 +35,295 @@ TEST(Arch_ftrace, ftrace_call_replace, 0)
 }
 #endif
 
+
+#if defined(__x86_64__)
+TEST(Arch_ftrace, ftrace_find_mcount_site, 0)
+{
+	unsigned long mcount = 0x2000, ip = 0x1000, site;
+	/* endbr64; push %rbp; mov %rsp,%rbp; sub $0x10,%rsp; call mcount */
+	uint8_t code_call[32] = {
+		0xf3, 0x0f, 0x1e, 0xfa, 0x55, 0x48, 0x89, 0xe5,
+		0x48, 0x83, 0xec, 0x10, 0xe8,
+	};
+	/* push %rbp; mov %rsp,%rbp; push %rbx; nopl 0x0(%rax,%rax,1) */
+	uint8_t code_nop[32] = {
+		0x55, 0x48, 0x89, 0xe5, 0x53,
+		0x0f, 0x1f, 0x44, 0x00, 0x00,
+	};
+	/* push %rbp; mov %rsp,%rbp; mov %edi,-0x4(%rbp) */
+	uint8_t code_none[32] = {
+		0x55, 0x48, 0x89, 0xe5, 0x89, 0x7d, 0xfc,
+	};
+	int32_t disp = mcount - (ip + 12 + CALL_INSN_SIZE);
+	int ret = 0;
+
+	memcpy(&code_call[13], &disp, sizeof(disp));
+
+	if (ftrace_find_mcount_site(code_call, sizeof(code_call), ip, &mcount,
+				    1, &site) != FTRACE_SITE_CALL ||
+	    site != ip + 12)
+		ret = -1;
+
+	/* Call of other function */
+	if (ftrace_find_mcount_site(code_call, sizeof(code_call), ip + 1,
+				    &mcount, 1, &site) != -ENOENT)
+		ret = -1;
+
+	if (ftrace_find_mcount_site(code_nop, sizeof(code_nop), ip, &mcount, 1,
+				    &site) != FTRACE_SITE_NOP || site != ip + 5)
+		ret = -1;
+
+	if (ftrace_find_mcount_site(code_none, sizeof(code_none), ip, &mcount,
+				    1, &site) != -ENOENT)
+		ret = -1;
+
+	return ret;
+}
+#endif
+
+#if defined(__aarch64__)
+TEST(Arch_ftrace, ftrace_find_mcount_site, 0)
+{
+	unsigned long mcount = 0x2000, ip = 0x1000, site;
+	/* stp x29, x30, [sp, #-16]!; mov x29, sp; mov x0, x30; bl mcount */
+	uint32_t code_call[8] = {
+		0xa9bf7bfd, 0x910003fd, AARCH64_INSN_MOV_X0_LR,
+	};
+	/* stp x29, x30, [sp, #-16]!; mov x29, sp; mov x0, x30; nop */
+	uint32_t code_nop[8] = {
+		0xa9bf7bfd, 0x910003fd, AARCH64_INSN_MOV_X0_LR,
+		AARCH64_INSN_NOP,
+	};
+	uint32_t insn;
+	int ret = 0;
+
+	code_call[3] = aarch64_insn_gen_branch_imm(ip + 12, mcount,
+						   AARCH64_INSN_BRANCH_LINK);
+
+	if (ftrace_find_mcount_site((void *)code_call, sizeof(code_call), ip,
+				    &mcount, 1, &site) != FTRACE_SITE_CALL ||
+	    site != ip + 12)
+		ret = -1;
+
+	/* Call of other function */
+	if (ftrace_find_mcount_site((void *)code_call, sizeof(code_call),
+				    ip + 4, &mcount, 1, &site) != -ENOENT)
+		ret = -1;
+
+	if (ftrace_find_mcount_site((void *)code_nop, sizeof(code_nop), ip,
+				    &mcount, 1, &site) != FTRACE_SITE_NOP ||
+	    site != ip + 12)
+		ret = -1;
+
+	/* The enabled NOP site is the BL of _ftrace_mcount */
+	if (!ftrace_call_replace(&insn, ip + 12, mcount) ||
+	    insn != code_call[3])
+		ret = -1;
+
+	/* Out of +/-128M */
+	if (ftrace_call_replace(&insn, ip, ip + SZ_256M))
+		ret = -1;
+
+	return ret;
+}
+#endif
+
+#if defined(__x86_64__)
+/* Whichever table is selected, the NOP5 of mcount site is atomic */
+TEST(Arch_ftrace, ideal_nops, 0)
+{
+	const char call[] = {0xe8, 0x00, 0x00, 0x00, 0x00};
+	int i, ret = 0;
+
+	arch_init_ideal_nops();
+
+	if (!is_atomic_nop5(ideal_nops[NOP_ATOMIC5]) || is_atomic_nop5(call))
+		ret = -1;
+
+	/* Every NOP decodes as one instruction of its length */
+	for (i = 1; i <= ASM_NOP_MAX; i++)
+		fdisasm_arch(stdout, "nop", 0, (void *)ideal_nops[i], i);
+
+	return ret;
+}
+
+/**
+ * Replace two NOP5 in a scratch page of child with calls by int3, then
+ * restore them, the child keeps running.
+ */
+TEST(Arch_ftrace, text_poke_bp_batch, 0)
+{
+	struct code_write w[2];
+	struct task_struct *task;
+	struct task_notify notify;
+	union text_poke_insn insn[2];
+	unsigned long page;
+	const void *nop5;
+	char buf[5];
+	int i, ret = 0, status = 0;
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	task_notify_wait(&notify);
+
+	task = open_task(pid, FTO_RDWR);
+
+	arch_init_ideal_nops();
+	nop5 = ideal_nops[NOP_ATOMIC5];
+
+	ret = task_attach_session(task);
+	if (ret)
+		goto out;
+	page = task_mmap(task, 0UL, PAGE_SIZE, PROT_READ | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!page || page > -4096UL) {
+		task_detach_session(task);
+		ret = -1;
+		goto out;
+	}
+	for (i = 0; i < ARRAY_SIZE(w); i++) {
+		w[i].addr = page + i * 64;
+		w[i].len = 5;
+		w[i].old = nop5;
+		w[i].new = ftrace_call_replace(&insn[i], w[i].addr, page);
+		if (memcpy_to_task(task, w[i].addr, (void *)nop5, 5) != 5)
+			ret = -1;
+	}
+	/* The threads are seized by text_poke_bp_batch() itself */
+	if (task_detach_session(task) || ret) {
+		ret = -1;
+		goto unmap;
+	}
+
+	if (text_poke_bp_batch(task, w, ARRAY_SIZE(w)))
+		ret = -1;
+	for (i = 0; i < ARRAY_SIZE(w); i++) {
+		if (memcpy_from_task(task, buf, w[i].addr, 5) != 5 ||
+		    memcmp(buf, w[i].new, 5))
+			ret = -1;
+	}
+
+	/* Not the expected old bytes, nothing is written */
+	if (text_poke_bp_batch(task, w, ARRAY_SIZE(w)) != -EBUSY)
+		ret = -1;
+
+	/* Restore */
+	for (i = 0; i < ARRAY_SIZE(w); i++) {
+		w[i].old = w[i].new;
+		w[i].new = nop5;
+	}
+	if (text_poke_bp_batch(task, w, ARRAY_SIZE(w)))
+		ret = -1;
+	for (i = 0; i < ARRAY_SIZE(w); i++) {
+		if (memcpy_from_task(task, buf, w[i].addr, 5) != 5 ||
+		    memcmp(buf, nop5, 5))
+			ret = -1;
+	}
+
+unmap:
+	if (!task_attach_session(task)) {
+		task_munmap(task, page, PAGE_SIZE);
+		task_detach_session(task);
+	}
+out:
+	task_notify_trigger(&notify);
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+	task_notify_destroy(&notify);
+
+	return ret;
+}
+#endif
+
+#if defined(__aarch64__)
+/* Write some NOPs to a scratch page of child, with one cache flush */
+TEST(Arch_ftrace, insn_write_batch, 0)
+{
+	struct aarch64_insn_patch p[3];
+	struct task_struct *task;
+	struct task_notify notify;
+	unsigned long page;
+	uint32_t insn;
+	int i, ret = 0, status = 0;
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	task_notify_wait(&notify);
+
+	task = open_task(pid, FTO_RDWR);
+
+	ret = task_attach_session(task);
+	if (ret)
+		goto out;
+
+	page = task_mmap(task, 0UL, PAGE_SIZE, PROT_READ | PROT_EXEC,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (!page || page > -4096UL) {
+		ret = -1;
+		goto detach;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(p); i++) {
+		p[i].addr = page + i * 64;
+		p[i].insn = AARCH64_INSN_NOP;
+	}
+
+	if (aarch64_insn_write_batch(task, p, ARRAY_SIZE(p)))
+		ret = -1;
+
+	for (i = 0; i < ARRAY_SIZE(p); i++) {
+		if (aarch64_insn_read(task, p[i].addr, &insn) ||
+		    insn != AARCH64_INSN_NOP)
+			ret = -1;
+	}
+
+	/* Not aligned */
+	p[0].addr = page + 2;
+	if (aarch64_insn_write_batch(task, p, 1) != -EINVAL)
+		ret = -1;
+
+	task_munmap(task, page, PAGE_SIZE);
+detach:
+	if (task_detach_session(task))
+		ret = -1;
+out:
+	task_notify_trigger(&notify);
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+	task_notify_destroy(&notify);
+
+	return ret;
+}
+#endif
@@ -0,0 +1,791 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <elf/elf-api.h>
+#include <patch/patch.h>
+#include <task/task.h>
+#include <utils/cmds.h>
+#include <utils/log.h>
+#include <utils/perf.h>
+#include <utils/slab.h>
+#include <utils/util.h>
+
+#include <args-common.c>
+
+
+/**
+ * Microbenchmark of the hot paths of task, elf and patch. A synthetic target
+ * is forked with the VMAs, threads and libraries given by the command line,
+ * every hot path runs on it with warmup and repetitions, and every operation
+ * is timed alone, the setup of operation is not counted, such as open_task()
+ * of task_load_all_syms(). The target is a fork of ulpatch_bench, thus the
+ * addresses of the globals are the same in both processes.
+ */
+
+#define BENCH_MAX_LIBS	16
+
+static int nr_vmas = 128;
+static int nr_threads = 4;
+static const char *libs[BENCH_MAX_LIBS];
+static int nr_libs = 0;
+static int nr_reps = 1000;
+static int nr_warmup = 100;
+static unsigned long copy_size = SZ_4K;
+static const char *patch_file = NULL;
+static const char *bench_list = NULL;
+/* Existing target, such as ulpatch_bigproc, instead of fork */
+static pid_t target_pid = 0;
+/* Wrap every operation in perf counters, see utils/perf.h */
+static bool use_counters = false;
+static struct perf_counters counters;
+
+static const char *prog_name = "ulpatch_bench";
+
+/* Read by strcpy_from_task(), same address in target */
+static const char bench_string[] = "ulpatch_bench string, same in target";
+/* The pages of the synthetic VMAs, see target_fork() */
+static void *bench_vmas = NULL;
+
+/* The target function of empty.ulp, see src/tests/ulpatches/empty.c */
+void __attribute__((noinline)) hello_world(void)
+{
+	__asm__ __volatile__("" ::: "memory");
+}
+
+struct bench_ctx {
+	pid_t pid;
+	struct task_struct *task;
+	/* The symbols of find_task_sym() */
+	const char **names;
+	int nr_names;
+	/* The memory of memcpy_from_task() */
+	unsigned long addr;
+	unsigned long size;
+	char *buf;
+	/* The command line of the CLI startup benches */
+	const char *cli;
+	char cli_path[PATH_MAX];
+	char cli_pid[16];
+	char *cli_argv[4];
+};
+
+struct bench {
+	const char *name;
+	/* FTO_* of open_task() */
+	int flags;
+	/* Open task for every operation, otherwise once for all */
+	bool open_per_op;
+	/* Attach target before the bench */
+	bool attach;
+	/* Untimed, once after task opened, non-zero to skip the bench */
+	int (*prepare)(struct bench_ctx *ctx);
+	void (*release)(struct bench_ctx *ctx);
+	/* Untimed, before and after every operation */
+	void (*before)(struct bench_ctx *ctx);
+	void (*after)(struct bench_ctx *ctx);
+	/* The timed operation, non-zero if failed */
+	int (*run)(struct bench_ctx *ctx, int i);
+	/* The CLI to exec, see prepare_cli_startup() */
+	const char *cli;
+};
+
+static void bench_args_reset(void)
+{
+	nr_vmas = 128;
+	nr_threads = 4;
+	nr_libs = 0;
+	nr_reps = 1000;
+	nr_warmup = 100;
+	copy_size = SZ_4K;
+	patch_file = NULL;
+	bench_list = NULL;
+	target_pid = 0;
+	use_counters = false;
+}
+
+static int print_help(void)
+{
+	printf(
+	"\n"
+	" Usage: ulpatch_bench [OPTION]...\n"
+	"\n"
+	" Microbenchmark of ULPatch hot paths, fork a synthetic target, run\n"
+	" each hot path with warmup and repetitions, report ns/op and\n"
+	" percentiles.\n"
+	"\n"
+	"  -m, --vmas N        number of VMAs mapped by target, default %d\n"
+	"  -t, --threads N     number of threads of target, default %d\n"
+	"  -l, --lib FILE      dlopen(3) FILE in target, more symbols, can\n"
+	"                      be specified %d times.\n"
+	"  -n, --reps N        repetitions of each hot path, default %d\n"
+	"  -w, --warmup N      warmup operations of each hot path, default %d\n"
+	"  -s, --size SIZE     bytes of memcpy_from_task, default %lu\n"
+	"  -P, --patch FILE    patch of init_patch, default skip init_patch\n"
+	"  -p, --pid PID       run on an existing target, such as the process\n"
+	"                      of ulpatch_bigproc, instead of fork one, -m,\n"
+	"                      -t and -l are ignored, skip strcpy_from_task.\n"
+	"  -c, --counters      count cycles, instructions, cache-misses,\n"
+	"                      branch-misses and page-faults of every\n"
+	"                      operation by perf_event_open(2), report per op.\n"
+	"  -b, --bench NAME[,NAME...]\n"
+	"                      run the benches only, default all:\n",
+	nr_vmas, nr_threads, BENCH_MAX_LIBS, nr_reps, nr_warmup, copy_size);
+	printf(
+	"                      memcpy_from_task, strcpy_from_task,\n"
+	"                      read_task_vmas, task_load_all_syms,\n"
+	"                      find_task_sym, task_syscall, init_patch,\n"
+	"                      startup_ulpatch, startup_ulpinfo,\n"
+	"                      startup_ultask, startup_ulftrace\n"
+	"\n");
+	print_usage_common(prog_name);
+	cmd_exit_success();
+	return 0;
+}
+
+static int parse_config(int argc, char *argv[])
+{
+	struct option options[] = {
+		{ "vmas",    required_argument, 0, 'm' },
+		{ "threads", required_argument, 0, 't' },
+		{ "lib",     required_argument, 0, 'l' },
+		{ "reps",    required_argument, 0, 'n' },
+		{ "warmup",  required_argument, 0, 'w' },
+		{ "size",    required_argument, 0, 's' },
+		{ "patch",   required_argument, 0, 'P' },
+		{ "pid",     required_argument, 0, 'p' },
+		{ "bench",   required_argument, 0, 'b' },
+		{ "counters", no_argument,      0, 'c' },
+		COMMON_OPTIONS
+		{ NULL }
+	};
+
+	while (1) {
+		int c;
+		int option_index = 0;
+		c = getopt_long(argc, argv, "m:t:l:n:w:s:P:p:b:c"
+				COMMON_GETOPT_OPTSTRING, options,
+				&option_index);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'm':
+			nr_vmas = atoi(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'l':
+			if (nr_libs == BENCH_MAX_LIBS) {
+				fprintf(stderr, "Too many --lib, max %d.\n",
+					BENCH_MAX_LIBS);
+				cmd_exit(1);
+			}
+			libs[nr_libs++] = optarg;
+			break;
+		case 'n':
+			nr_reps = atoi(optarg);
+			break;
+		case 'w':
+			nr_warmup = atoi(optarg);
+			break;
+		case 's':
+			copy_size = str2size(optarg);
+			break;
+		case 'P':
+			patch_file = optarg;
+			break;
+		case 'p':
+			target_pid = atoi(optarg);
+			break;
+		case 'b':
+			bench_list = optarg;
+			break;
+		case 'c':
+			use_counters = true;
+			break;
+		COMMON_GETOPT_CASES(prog_name, print_help, argv)
+		default:
+			print_help();
+			cmd_exit(1);
+			break;
+		}
+	}
+
+	if (nr_vmas < 0 || nr_threads < 0 || nr_reps <= 0 || nr_warmup < 0 ||
+	    !copy_size || target_pid < 0) {
+		fprintf(stderr, "Invalid argument, see -h.\n");
+		cmd_exit(1);
+	}
+
+	return 0;
+}
+
+static void *target_thread(void *arg)
+{
+	while (1)
+		pause();
+	return NULL;
+}
+
+/* The synthetic target, start the threads and libraries, notify parent */
+static void __noreturn target_run(int fd)
+{
+	pthread_t thread;
+	char c = 0;
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&thread, NULL, target_thread, NULL);
+
+	for (i = 0; i < nr_libs; i++) {
+		if (!dlopen(libs[i], RTLD_NOW | RTLD_GLOBAL))
+			fprintf(stderr, "dlopen %s failed, %s\n", libs[i],
+				dlerror());
+	}
+
+	hello_world();
+
+	if (write(fd, &c, 1) != 1)
+		exit(1);
+	close(fd);
+
+	target_thread(NULL);
+	exit(0);
+}
+
+/**
+ * Map @nr_vmas pages with alternate protection before fork, thus every page
+ * is a VMA at the same address in target.
+ */
+static pid_t target_fork(void)
+{
+	int fds[2], i;
+	pid_t pid;
+	char c;
+
+	bench_vmas = mmap(NULL, MAX(nr_vmas, 1) * ulp_page_size(),
+			  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+	if (bench_vmas == MAP_FAILED)
+		return -errno;
+
+	for (i = 0; i < nr_vmas; i += 2)
+		mprotect(bench_vmas + i * ulp_page_size(), ulp_page_size(),
+			 PROT_READ);
+
+	if (pipe(fds))
+		return -errno;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		close(fds[0]);
+		target_run(fds[1]);
+	}
+
+	close(fds[1]);
+	if (read(fds[0], &c, 1) != 1) {
+		fprintf(stderr, "Target %d not ready.\n", pid);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		pid = -ECHILD;
+	}
+	close(fds[0]);
+	return pid;
+}
+
+/* The synthetic VMAs, or the top of stack of an existing target */
+static int prepare_memcpy_from_task(struct bench_ctx *ctx)
+{
+	struct vm_area_struct *stack = ctx->task->stack;
+
+	if (!target_pid) {
+		ctx->addr = (unsigned long)bench_vmas;
+		ctx->size = MIN(copy_size, MAX(nr_vmas, 1) * ulp_page_size());
+		return 0;
+	}
+
+	if (!stack)
+		return -ENOENT;
+	ctx->size = MIN(copy_size, stack->vm_end - stack->vm_start);
+	ctx->addr = stack->vm_end - ctx->size;
+	return 0;
+}
+
+static int run_memcpy_from_task(struct bench_ctx *ctx, int i)
+{
+	return memcpy_from_task(ctx->task, ctx->buf, ctx->addr, ctx->size)
+		!= ctx->size;
+}
+
+/* The address of string is known only in the forked target */
+static int prepare_strcpy_from_task(struct bench_ctx *ctx)
+{
+	return target_pid ? -ENOENT : 0;
+}
+
+static int run_strcpy_from_task(struct bench_ctx *ctx, int i)
+{
+	return !strcpy_from_task(ctx->task, ctx->buf,
+				 (unsigned long)bench_string);
+}
+
+/* The VMAs are released, read again without open_task() */
+static void before_read_task_vmas(struct bench_ctx *ctx)
+{
+	free_task_vmas(ctx->task);
+	slab_cache_init(&ctx->task->vma_slab, sizeof(struct vm_area_struct),
+			TASK_VMA_SLAB_NR);
+}
+
+static int run_read_task_vmas(struct bench_ctx *ctx, int i)
+{
+	return read_task_vmas(ctx->task, false);
+}
+
+static int run_load_all_syms(struct bench_ctx *ctx, int i)
+{
+	return task_load_all_syms(ctx->task);
+}
+
+/* All symbols are loaded and collected as the names to find */
+static int prepare_find_task_sym(struct bench_ctx *ctx)
+{
+	struct task_sym *tsym;
+	int n = 0;
+
+	task_load_all_syms(ctx->task);
+
+	for (tsym = next_task_sym(ctx->task, NULL); tsym;
+	     tsym = next_task_sym(ctx->task, tsym))
+		n++;
+	if (!n)
+		return -ENOENT;
+
+	ctx->names = malloc(n * sizeof(*ctx->names));
+	if (!ctx->names)
+		return -ENOMEM;
+
+	for (tsym = next_task_sym(ctx->task, NULL); tsym;
+	     tsym = next_task_sym(ctx->task, tsym))
+		ctx->names[ctx->nr_names++] = tsym->name;
+	return 0;
+}
+
+static void release_find_task_sym(struct bench_ctx *ctx)
+{
+	free(ctx->names);
+	ctx->names = NULL;
+	ctx->nr_names = 0;
+}
+
+static int run_find_task_sym(struct bench_ctx *ctx, int i)
+{
+	/* Stride of a prime, not in the order of rbtree */
+	const char *name = ctx->names[(i * 7919UL) % ctx->nr_names];
+
+	return !find_task_sym(ctx->task, name, NULL, NULL);
+}
+
+static int run_task_syscall(struct bench_ctx *ctx, int i)
+{
+	unsigned long res;
+
+	return task_syscall(ctx->task, __NR_getpid, 0, 0, 0, 0, 0, 0, &res);
+}
+
+static int prepare_init_patch(struct bench_ctx *ctx)
+{
+	return patch_file ? 0 : -ENOENT;
+}
+
+static int run_init_patch(struct bench_ctx *ctx, int i)
+{
+	return init_patch(ctx->task, patch_file);
+}
+
+static void after_init_patch(struct bench_ctx *ctx)
+{
+	delete_patch(ctx->task);
+}
+
+/**
+ * The CLI is exec'ed with --version and waited, thus the dynamic loading
+ * and the relocations of the linked libraries dominate, see utils/dl.c.
+ * The ulpinfo -p lists the patches of target, as scanning processes. The
+ * CLI is searched in the parent directory of ulpatch_bench, as the build
+ * tree, and its own directory, as installed, then $PATH.
+ */
+static int prepare_cli_startup(struct bench_ctx *ctx)
+{
+	char exe[PATH_MAX], *dir;
+	ssize_t len;
+	int n = 0;
+
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len > 0) {
+		exe[len] = '\0';
+		dir = dirname(exe);
+		snprintf(ctx->cli_path, sizeof(ctx->cli_path), "%s/../%s", dir,
+			 ctx->cli);
+		if (!fexist(ctx->cli_path))
+			snprintf(ctx->cli_path, sizeof(ctx->cli_path), "%s/%s",
+				 dir, ctx->cli);
+	}
+	if (len <= 0 || !fexist(ctx->cli_path))
+		snprintf(ctx->cli_path, sizeof(ctx->cli_path), "%s", ctx->cli);
+
+	ctx->cli_argv[n++] = ctx->cli_path;
+	if (!strcmp(ctx->cli, "ulpinfo")) {
+		snprintf(ctx->cli_pid, sizeof(ctx->cli_pid), "%d", ctx->pid);
+		ctx->cli_argv[n++] = "-p";
+		ctx->cli_argv[n++] = ctx->cli_pid;
+	} else
+		ctx->cli_argv[n++] = "--version";
+	ctx->cli_argv[n] = NULL;
+	return 0;
+}
+
+static int run_cli_startup(struct bench_ctx *ctx, int i)
+{
+	posix_spawn_file_actions_t fa;
+	extern char **environ;
+	int err, status;
+	pid_t pid;
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+					 O_WRONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO, STDERR_FILENO);
+
+	err = posix_spawnp(&pid, ctx->cli_path, &fa, NULL, ctx->cli_argv,
+			   environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (err)
+		return err;
+
+	if (waitpid(pid, &status, 0) < 0)
+		return -errno;
+	return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static const struct bench benches[] = {
+	{
+		.name = "memcpy_from_task",
+		.flags = FTO_NONE,
+		.prepare = prepare_memcpy_from_task,
+		.run = run_memcpy_from_task,
+	},
+	{
+		.name = "strcpy_from_task",
+		.flags = FTO_NONE,
+		.prepare = prepare_strcpy_from_task,
+		.run = run_strcpy_from_task,
+	},
+	{
+		.name = "read_task_vmas",
+		.flags = FTO_NONE,
+		.before = before_read_task_vmas,
+		.run = run_read_task_vmas,
+	},
+	{
+		.name = "task_load_all_syms",
+		.flags = FTO_VMA_ELF_SYMBOLS,
+		.open_per_op = true,
+		.run = run_load_all_syms,
+	},
+	{
+		.name = "find_task_sym",
+		.flags = FTO_VMA_ELF_SYMBOLS,
+		.prepare = prepare_find_task_sym,
+		.release = release_find_task_sym,
+		.run = run_find_task_sym,
+	},
+	{
+		.name = "task_syscall",
+		.flags = FTO_RDWR,
+		.attach = true,
+		.run = run_task_syscall,
+	},
+	{
+		.name = "init_patch",
+		.flags = FTO_ULPATCH,
+		.attach = true,
+		.prepare = prepare_init_patch,
+		.after = after_init_patch,
+		.run = run_init_patch,
+	},
+	{
+		.name = "startup_ulpatch",
+		.flags = FTO_NONE,
+		.prepare = prepare_cli_startup,
+		.run = run_cli_startup,
+		.cli = "ulpatch",
+	},
+	{
+		.name = "startup_ulpinfo",
+		.flags = FTO_NONE,
+		.prepare = prepare_cli_startup,
+		.run = run_cli_startup,
+		.cli = "ulpinfo",
+	},
+	{
+		.name = "startup_ultask",
+		.flags = FTO_NONE,
+		.prepare = prepare_cli_startup,
+		.run = run_cli_startup,
+		.cli = "ultask",
+	},
+	{
+		.name = "startup_ulftrace",
+		.flags = FTO_NONE,
+		.prepare = prepare_cli_startup,
+		.run = run_cli_startup,
+		.cli = "ulftrace",
+	},
+};
+
+static bool bench_selected(const char *name)
+{
+	const char *p = bench_list;
+	size_t len = strlen(name);
+
+	if (!p)
+		return true;
+
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == bench_list || p[-1] == ',') &&
+		    (p[len] == ',' || p[len] == '\0'))
+			return true;
+		p += len;
+	}
+	return false;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long percentile(unsigned long *ns, int n, int pct)
+{
+	return ns[MIN((long)n * pct / 100, n - 1)];
+}
+
+/**
+ * One operation, return the nanoseconds or -1 if failed, the counters of
+ * the measured operations only are accumulated.
+ */
+static long bench_one(const struct bench *b, struct bench_ctx *ctx, int i,
+		      bool measured)
+{
+	unsigned long start, end;
+	bool count = use_counters && measured;
+	int err;
+
+	if (b->open_per_op) {
+		ctx->task = open_task(ctx->pid, b->flags);
+		if (!ctx->task)
+			return -1;
+	}
+	if (b->before)
+		b->before(ctx);
+
+	if (count)
+		perf_counters_start(&counters);
+	start = nsecs();
+	err = b->run(ctx, i);
+	end = nsecs();
+	if (count && !err)
+		perf_counters_stop(&counters);
+
+	if (b->after)
+		b->after(ctx);
+	if (b->open_per_op) {
+		close_task(ctx->task);
+		ctx->task = NULL;
+	}
+
+	return err ? -1 : end - start;
+}
+
+/* The counters per operation, and IPC */
+static void print_counters(void)
+{
+	struct perf_counters *pc = &counters;
+	int i;
+
+	if (!pc->nr)
+		return;
+
+	printf("%-20s", "");
+	for (i = 0; i < PERF_CNT_NUM; i++) {
+		if (perf_counters_has(pc, i))
+			printf(" %s %.1f", perf_counter_name(i),
+			       (double)pc->sum[i] / pc->nr);
+	}
+	if (perf_counters_has(pc, PERF_CNT_CYCLES) &&
+	    perf_counters_has(pc, PERF_CNT_INSTRUCTIONS) &&
+	    pc->sum[PERF_CNT_CYCLES])
+		printf(" IPC %.2f", (double)pc->sum[PERF_CNT_INSTRUCTIONS] /
+		       pc->sum[PERF_CNT_CYCLES]);
+	printf("%s\n", pc->exclude_kernel ? " (user only)" : "");
+}
+
+static void print_result(const struct bench *b, unsigned long *ns, int n,
+			 int nr_errs)
+{
+	unsigned long sum = 0;
+	int i;
+
+	if (!n) {
+		printf("%-20s %10s\n", b->name, "skipped");
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+
+	qsort(ns, n, sizeof(*ns), cmp_ulong);
+	printf("%-20s %10d %10lu %10lu %10lu %10lu %10lu %10lu %6d\n",
+	       b->name, n, sum / n, ns[0], percentile(ns, n, 50),
+	       percentile(ns, n, 90), percentile(ns, n, 99), ns[n - 1],
+	       nr_errs);
+
+	if (use_counters)
+		print_counters();
+}
+
+static int run_bench(const struct bench *b, pid_t pid)
+{
+	struct bench_ctx ctx = {
+		.pid = pid,
+		.cli = b->cli,
+	};
+	unsigned long *ns;
+	int i, n = 0, nr_errs = 0, err = 0;
+	long t;
+
+	ns = malloc(nr_reps * sizeof(*ns));
+	ctx.buf = malloc(MAX(copy_size, sizeof(bench_string)));
+	if (!ns || !ctx.buf) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	if (b->attach && task_attach(pid)) {
+		fprintf(stderr, "%s: attach %d failed.\n", b->name, pid);
+		err = -EPERM;
+		goto free;
+	}
+
+	if (!b->open_per_op) {
+		ctx.task = open_task(pid, b->flags);
+		if (!ctx.task) {
+			err = -errno;
+			goto detach;
+		}
+	}
+
+	if (b->prepare && b->prepare(&ctx))
+		goto close;
+
+	perf_counters_reset(&counters);
+
+	for (i = 0; i < nr_warmup + nr_reps; i++) {
+		t = bench_one(b, &ctx, i, i >= nr_warmup);
+		if (t < 0)
+			nr_errs++;
+		else if (i >= nr_warmup)
+			ns[n++] = t;
+	}
+
+	if (b->release)
+		b->release(&ctx);
+close:
+	if (ctx.task)
+		close_task(ctx.task);
+detach:
+	if (b->attach)
+		task_detach(pid);
+
+	print_result(b, ns, n, nr_errs);
+free:
+	free(ns);
+	free(ctx.buf);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	pid_t pid;
+	int i, ret = 0;
+
+	COMMON_RESET_BEFORE_PARSE_ARGS(bench_args_reset);
+
+	parse_config(argc, argv);
+
+	COMMON_IN_MAIN_AFTER_PARSE_ARGS();
+
+	ulpatch_init();
+
+	if (use_counters && perf_counters_open(&counters)) {
+		fprintf(stderr, "No perf counter, check "
+			"/proc/sys/kernel/perf_event_paranoid.\n");
+		return 1;
+	}
+
+	if (target_pid) {
+		pid = target_pid;
+		printf("target %d: %d reps, %d warmup\n", pid, nr_reps,
+		       nr_warmup);
+	} else {
+		pid = target_fork();
+		if (pid < 0) {
+			fprintf(stderr, "Fork target failed, %s\n",
+				strerror(-pid));
+			return 1;
+		}
+		printf("target %d: %d VMAs, %d threads, %d libs, %d reps, "
+		       "%d warmup\n", pid, nr_vmas, nr_threads, nr_libs,
+		       nr_reps, nr_warmup);
+	}
+	printf("%-20s %10s %10s %10s %10s %10s %10s %10s %6s\n", "BENCH", "OPS",
+	       "NS/OP", "MIN", "P50", "P90", "P99", "MAX", "ERRS");
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		if (!bench_selected(benches[i].name))
+			continue;
+		if (run_bench(&benches[i], pid))
+			ret = 1;
+	}
+
+	if (!target_pid) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	if (use_counters)
+		perf_counters_close(&counters);
+	return ret;
+}
@@ -0,0 +1,373 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <task/task.h>
+#include <utils/cmds.h>
+#include <utils/log.h>
+#include <utils/util.h>
+
+#include <args-common.c>
+
+
+/**
+ * Generator of production-sized process for scaling benchmarks, such as
+ * 50k VMAs, 300 DSOs and 1M symbols. The shared objects are generated as C
+ * files and built by $CC into a cache directory, only once for the same
+ * number of symbols, then dlopen(3)ed. The file-backed regions are pages of
+ * one sparse file, also cached, mapped at increasing addresses with
+ * decreasing offsets, thus never merged into one VMA. Print the pid and
+ * wait, measure it with ulpatch_bench --pid or ultask.
+ */
+
+#define BIGPROC_DIR	"/tmp/ulpatch-bigproc"
+
+static int nr_dsos = 300;
+static unsigned long nr_syms = 1000000;
+static unsigned long nr_maps = 50000;
+static int nr_threads = 0;
+static int nr_jobs = 0;
+static const char *cache_dir = BIGPROC_DIR;
+
+static const char *prog_name = "ulpatch_bigproc";
+
+/* The target function of empty.ulp, see src/tests/ulpatches/empty.c */
+void __attribute__((noinline)) hello_world(void)
+{
+	__asm__ __volatile__("" ::: "memory");
+}
+
+static void bigproc_args_reset(void)
+{
+	nr_dsos = 300;
+	nr_syms = 1000000;
+	nr_maps = 50000;
+	nr_threads = 0;
+	nr_jobs = 0;
+	cache_dir = BIGPROC_DIR;
+}
+
+static int print_help(void)
+{
+	printf(
+	"\n"
+	" Usage: ulpatch_bigproc [OPTION]...\n"
+	"\n"
+	" Generate a production-sized process, build and dlopen(3) many\n"
+	" shared objects and map many file-backed regions, print the pid and\n"
+	" wait.\n"
+	"\n"
+	"  -d, --dsos N        number of generated shared objects, default %d\n"
+	"  -s, --syms N        number of symbols of all shared objects,\n"
+	"                      default %lu\n"
+	"  -m, --maps N        number of file-backed VMAs, default %lu, check\n"
+	"                      /proc/sys/vm/max_map_count.\n"
+	"  -t, --threads N     number of threads, default %d\n"
+	"  -j, --jobs N        build shared objects in N jobs, 0 means number\n"
+	"                      of CPUs, default %d\n"
+	"  -D, --dir DIR       cache directory of shared objects, default\n"
+	"                      %s, compiler is $CC, default cc.\n"
+	"\n",
+	nr_dsos, nr_syms, nr_maps, nr_threads, nr_jobs, BIGPROC_DIR);
+	print_usage_common(prog_name);
+	cmd_exit_success();
+	return 0;
+}
+
+static int parse_config(int argc, char *argv[])
+{
+	struct option options[] = {
+		{ "dsos",    required_argument, 0, 'd' },
+		{ "syms",    required_argument, 0, 's' },
+		{ "maps",    required_argument, 0, 'm' },
+		{ "threads", required_argument, 0, 't' },
+		{ "jobs",    required_argument, 0, 'j' },
+		{ "dir",     required_argument, 0, 'D' },
+		COMMON_OPTIONS
+		{ NULL }
+	};
+
+	while (1) {
+		int c;
+		int option_index = 0;
+		c = getopt_long(argc, argv, "d:s:m:t:j:D:"
+				COMMON_GETOPT_OPTSTRING, options,
+				&option_index);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'd':
+			nr_dsos = atoi(optarg);
+			break;
+		case 's':
+			nr_syms = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			nr_maps = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			break;
+		case 'D':
+			cache_dir = optarg;
+			break;
+		COMMON_GETOPT_CASES(prog_name, print_help, argv)
+		default:
+			print_help();
+			cmd_exit(1);
+			break;
+		}
+	}
+
+	if (nr_dsos < 0 || nr_threads < 0 || nr_jobs < 0) {
+		fprintf(stderr, "Invalid argument, see -h.\n");
+		cmd_exit(1);
+	}
+
+	return 0;
+}
+
+/* The path of DSO @i, the number of symbols is in the name for the cache */
+static void dso_path(char *buf, size_t len, int i, unsigned long syms,
+		     const char *suffix)
+{
+	snprintf(buf, len, "%s/libulpbig-%d-%lu%s", cache_dir, i, syms, suffix);
+}
+
+static int dso_write_source(const char *path, int i, unsigned long syms)
+{
+	unsigned long j;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+	for (j = 0; j < syms; j++)
+		fprintf(fp, "int ulpbig_%d_%lu(int x) { return x + %lu; }\n",
+			i, j, j);
+
+	if (fclose(fp))
+		return -errno;
+	return 0;
+}
+
+/* Start building DSO @i, return the pid of compiler, 0 if cached */
+static pid_t dso_build_start(int i, unsigned long syms)
+{
+	char so[PATH_MAX], tmp[PATH_MAX], src[PATH_MAX];
+	const char *cc = getenv("CC") ?: "cc";
+	pid_t pid;
+	int err;
+
+	dso_path(so, sizeof(so), i, syms, ".so");
+	if (fexist(so))
+		return 0;
+
+	dso_path(src, sizeof(src), i, syms, ".c");
+	dso_path(tmp, sizeof(tmp), i, syms, ".so.tmp");
+
+	err = dso_write_source(src, i, syms);
+	if (err)
+		return err;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+
+	if (pid == 0) {
+		char *argv[] = {
+			(char *)cc, "-shared", "-fPIC", "-O0", "-o", tmp, src,
+			NULL,
+		};
+		execvp(argv[0], argv);
+		fprintf(stderr, "exec %s failed, %m\n", cc);
+		_exit(127);
+	}
+	return pid;
+}
+
+static int dso_build_wait(void)
+{
+	int status;
+
+	if (wait(&status) < 0)
+		return -errno;
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -ECHILD;
+	return 0;
+}
+
+/**
+ * Build the DSOs not cached yet in @nr_jobs jobs, rename the temporary
+ * files when all are done, never use an incomplete one.
+ */
+static int dsos_build(unsigned long syms)
+{
+	char so[PATH_MAX], tmp[PATH_MAX];
+	int i, running = 0, jobs, err = 0;
+	pid_t pid;
+
+	jobs = nr_jobs ?: sysconf(_SC_NPROCESSORS_ONLN);
+	jobs = MAX(jobs, 1);
+
+	if (mkdir(cache_dir, 0755) && errno != EEXIST)
+		return -errno;
+
+	for (i = 0; i < nr_dsos; i++) {
+		if (running == jobs) {
+			running--;
+			err = dso_build_wait();
+			if (err)
+				break;
+		}
+		pid = dso_build_start(i, syms);
+		if (pid < 0) {
+			err = pid;
+			break;
+		}
+		if (pid > 0)
+			running++;
+	}
+
+	for (; running; running--) {
+		if (dso_build_wait() && !err)
+			err = -ECHILD;
+	}
+	if (err)
+		return err;
+
+	for (i = 0; i < nr_dsos; i++) {
+		dso_path(so, sizeof(so), i, syms, ".so");
+		dso_path(tmp, sizeof(tmp), i, syms, ".so.tmp");
+		if (!fexist(so) && rename(tmp, so))
+			return -errno;
+	}
+	return 0;
+}
+
+static int dsos_open(unsigned long syms)
+{
+	char so[PATH_MAX];
+	int i;
+
+	for (i = 0; i < nr_dsos; i++) {
+		dso_path(so, sizeof(so), i, syms, ".so");
+		if (!dlopen(so, RTLD_NOW | RTLD_LOCAL)) {
+			fprintf(stderr, "dlopen %s failed, %s\n", so,
+				dlerror());
+			return -ENOEXEC;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Map page i of the regions to page (@nr_maps - 1 - i) of the sparse file,
+ * the offsets of adjacent VMAs are not contiguous, never merged.
+ */
+static int maps_create(void)
+{
+	unsigned long i, page = ulp_page_size();
+	char path[PATH_MAX];
+	void *base, *addr;
+	int fd, err;
+
+	if (!nr_maps)
+		return 0;
+
+	/* Cached too, shared by the generated processes of same @nr_maps */
+	snprintf(path, sizeof(path), "%s/ulpbig-%lu.map", cache_dir, nr_maps);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, nr_maps * page)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	base = mmap(NULL, nr_maps * page, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	for (i = 0; i < nr_maps; i++) {
+		addr = mmap(base + i * page, page, PROT_READ,
+			    MAP_SHARED | MAP_FIXED, fd,
+			    (nr_maps - 1 - i) * page);
+		if (addr == MAP_FAILED) {
+			err = -errno;
+			fprintf(stderr, "mmap the %lu-th region failed, %m\n",
+				i);
+			close(fd);
+			return err;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void *bigproc_thread(void *arg)
+{
+	while (1)
+		pause();
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long syms;
+	pthread_t thread;
+	int i, err;
+
+	COMMON_RESET_BEFORE_PARSE_ARGS(bigproc_args_reset);
+
+	parse_config(argc, argv);
+
+	COMMON_IN_MAIN_AFTER_PARSE_ARGS();
+
+	syms = nr_dsos ? (nr_syms + nr_dsos - 1) / nr_dsos : 0;
+
+	err = dsos_build(syms);
+	if (!err)
+		err = dsos_open(syms);
+	if (!err)
+		err = maps_create();
+	if (err) {
+		fprintf(stderr, "Generate failed, %s\n", strerror(-err));
+		return 1;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_create(&thread, NULL, bigproc_thread, NULL);
+
+	hello_world();
+
+	printf("%d: %d DSOs, %lu symbols, %lu maps, %d threads\n", getpid(),
+	       nr_dsos, syms * nr_dsos, nr_maps, nr_threads);
+	fflush(stdout);
+
+	bigproc_thread(NULL);
+	return 0;
+}
@@ -1,7 +1,17 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2024-2025 Rong Tao */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
 #include <utils/log.h>
+#include <utils/list.h>
 #include <utils/cmds.h>
+#include <task/task.h>
 
 #include <tests/test-api.h>
 
@@ -14,3 +24,92 @@ TEST(ulpatch, display, 0)
 	ret += ulpatch(2, argv);
 	return ret;
 }
+
+/* Spin if @busy, otherwise never scheduled */
+static pid_t fork_canary_target(bool busy)
+{
+	volatile unsigned long loops = 0;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		while (busy)
+			loops++;
+		for (;;)
+			pause();
+	}
+	return pid;
+}
+
+static bool task_has_patch(pid_t pid)
+{
+	struct task_struct *task;
+	bool patched;
+
+	task = open_task(pid, FTO_ULPATCH);
+	if (!task)
+		return true;
+	patched = !list_empty(&task->ulp_list);
+	close_task(task);
+	return patched;
+}
+
+/**
+ * The canary is the first pid, it spins while the control sleeps, thus the
+ * canary regresses by far more than the threshold. The canary must be
+ * rolled back, and the control is never patched.
+ */
+TEST(ulpatch, canary_rollback, TEST_RET_SKIP)
+{
+	char spid[2][16];
+	pid_t pids[2];
+	int i, ret = 0;
+
+	if (access(ULPATCH_TEST_ULP_PRINTF_PATH, R_OK)) {
+		fprintf(stderr, "%s not exist. make install\n",
+			ULPATCH_TEST_ULP_PRINTF_PATH);
+		return -ENOENT;
+	}
+
+	pids[0] = fork_canary_target(true);
+	pids[1] = fork_canary_target(false);
+	if (pids[0] < 0 || pids[1] < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < 2; i++)
+		snprintf(spid[i], sizeof(spid[i]), "%d", pids[i]);
+
+	char *argv[] = {
+		"ulpatch",
+		"--patch", ULPATCH_TEST_ULP_PRINTF_PATH,
+		"-p", spid[0],
+		"-p", spid[1],
+		"--canary", "50",
+		"--canary-window", "1",
+		"--canary-threshold", "10",
+	};
+
+	if (ulpatch(ARRAY_SIZE(argv), argv) != 1) {
+		ulp_error("Regressed canary is not failed.\n");
+		ret = -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (task_has_patch(pids[i])) {
+			ulp_error("%d is patched after rollback.\n", pids[i]);
+			ret = -1;
+		}
+	}
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (pids[i] > 0) {
+			kill(pids[i], SIGKILL);
+			waitpid(pids[i], NULL, 0);
+		}
+	}
+	return ret;
+}
@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2024-2025 Rong Tao */
+#include <stdio.h>
+#include <unistd.h>
+
 #include <utils/log.h>
 #include <utils/cmds.h>
 
@@ -16,11 +19,63 @@ TEST(ulpinfo, objects, 0)
 		int argc = 3;
 		char *argv[] = { "ulpinfo", "-i", obj, };
 		char *argv2[] = { "ulpinfo", "--patch", obj, };
+		/* With the relocations */
+		char *argv3[] = { "ulpinfo", "--patch", obj, "-v", };
 
 		printf("\n");
 		ret += ulpinfo(argc, argv);
 		printf("\n");
 		ret += ulpinfo(argc, argv2);
+		printf("\n");
+		ret += ulpinfo(ARRAY_SIZE(argv3), argv3);
 	}
 	return ret;
 }
+
+TEST(ulpinfo, all, 0)
+{
+	int ret = 0;
+	char *argv[] = { "ulpinfo", "--all", };
+	char *argv2[] = { "ulpinfo", "--all", "-j", "2", "--format", "json", };
+
+	ret += ulpinfo(ARRAY_SIZE(argv), argv);
+	ret += ulpinfo(ARRAY_SIZE(argv2), argv2);
+	return ret;
+}
+
+/* Other tests may patch current process, 1 if any range differs */
+TEST(ulpinfo, verify, 0)
+{
+	int ret;
+	char pid[16];
+	char *argv[] = { "ulpinfo", "-p", pid, "--verify", "-j", "2", };
+	char *argv2[] = {
+		"ulpinfo", "-p", pid, "--verify", "--format", "json",
+	};
+
+	snprintf(pid, sizeof(pid), "%d", getpid());
+
+	ret = ulpinfo(ARRAY_SIZE(argv), argv);
+	if (ret < 0)
+		return ret;
+	ret = ulpinfo(ARRAY_SIZE(argv2), argv2);
+	return ret < 0 ? ret : 0;
+}
+
+/* The test itself and the libraries of current process */
+TEST(ulpinfo, warm_cache, 0)
+{
+	char exe[PATH_MAX] = {};
+	char *argv[] = { "ulpinfo", "--warm-cache", exe, };
+	char *argv2[] = { "ulpinfo", "--warm-cache", "--all", };
+	char *argv3[] = { "ulpinfo", "--warm-cache", "/not/exist", };
+
+	if (readlink("/proc/self/exe", exe, sizeof(exe) - 1) < 0)
+		return -1;
+
+	if (ulpinfo(ARRAY_SIZE(argv), argv))
+		return -1;
+	/* Some mapped files may be not ELF, such as removed ones */
+	ulpinfo(ARRAY_SIZE(argv2), argv2);
+	return ulpinfo(ARRAY_SIZE(argv3), argv3) ? 0 : -1;
+}
@@ -212,6 +212,95 @@ TEST(ultask, vma, 0)
 	return ret;
 }
 
+TEST(ultask, format, 0)
+{
+	int ret = 0;
+	char s_pid[64];
+
+	sprintf(s_pid, "%d", getpid());
+
+	int argc = 6;
+	char *argv[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--vmas",
+		"--format", "json",
+	};
+
+	int argc2 = 7;
+	char *argv2[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--vmas",
+		"--syms",
+		"--format", "msgpack",
+	};
+
+	ret += ultask(argc, argv);
+	ret += ultask(argc2, argv2);
+
+	return ret;
+}
+
+TEST(ultask, syms_filter, 0)
+{
+	int ret = 0;
+	char s_pid[64];
+
+	sprintf(s_pid, "%d", getpid());
+
+	int argc = 8;
+	char *argv[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--syms",
+		"--filter", "^mall",
+		"--vma", "libc*",
+	};
+
+	int argc2 = 8;
+	char *argv2[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--syms",
+		"--filter", "^(malloc|free)$",
+		"--format", "json",
+	};
+
+	ret += ultask(argc, argv);
+	ret += ultask(argc2, argv2);
+
+	return ret;
+}
+
+TEST(ultask, search, 0)
+{
+	int ret = 0;
+	char s_pid[64];
+
+	sprintf(s_pid, "%d", getpid());
+
+	int argc = 7;
+	char *argv[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--search", "0x7f454c46",
+		"--vma", "libc*",
+	};
+
+	int argc2 = 5;
+	char *argv2[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--search", "GLIBC_",
+	};
+
+	ret += ultask(argc, argv);
+	ret += ultask(argc2, argv2);
+
+	return ret;
+}
+
 TEST(ultask, misc, 0)
 {
 	int ret = 0;
@@ -343,6 +432,95 @@ done:
 	return err;
 }
 
+TEST(ultask, batch, 0)
+{
+	int err = 0;
+	char buffer[PATH_MAX];
+	char *f_name;
+	char s_pid[64], s_batch[PATH_MAX], s_maps[PATH_MAX];
+	char s_tcwd[PATH_MAX], *tcwd;
+	char s_tmfile[PATH_MAX];
+	int status = 0;
+	struct task_notify notify;
+	FILE *fp;
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		int ret = -1;
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Parent */
+
+	tcwd = get_proc_pid_cwd(pid, s_tcwd, sizeof(s_tcwd));
+	snprintf(s_tmfile, PATH_MAX, "%s/ultask-batch-XXXXXX", tcwd);
+	f_name = fmktempname(buffer, PATH_MAX, s_tmfile);
+	if (!f_name)
+		return -1;
+
+	if (ftouch(f_name, 64))
+		return -1;
+
+	snprintf(s_batch, PATH_MAX, "%s.batch", f_name);
+	fp = fopen(s_batch, "w");
+	if (!fp) {
+		err = -errno;
+		goto done;
+	}
+	/* hope addr 0x10000 is not in use */
+	fprintf(fp, "# map, mprotect and unmap a file\n");
+	fprintf(fp, "map file=%s,ro,noexec,addr=0x10000\n", f_name);
+	fprintf(fp, "\n");
+	fprintf(fp, "mprotect addr=0x10000,len=%ld,read\n", PAGE_SIZE);
+	fprintf(fp, "unmap 0x10000\n");
+	fclose(fp);
+
+	memset(s_pid, 0x0, sizeof(s_pid));
+	sprintf(s_pid, "%d", pid);
+
+	task_notify_wait(&notify);
+
+	int argc = 5;
+	char *argv[] = {
+		"ultask",
+		"--pid", s_pid,
+		"--batch", s_batch,
+	};
+
+	fprintf(stdout, "ultask --pid %s --batch %s\n", s_pid, s_batch);
+	fprint_file(stdout, s_batch);
+	err += ultask(argc, argv);
+
+	sprintf(s_maps, "/proc/%d/maps", pid);
+	fprint_file(stdout, s_maps);
+
+	task_notify_trigger(&notify);
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0) {
+		err = -EINVAL;
+	}
+
+	task_notify_destroy(&notify);
+
+	unlink(s_batch);
+done:
+	unlink(f_name);
+	return err;
+}
+
 TEST(ultask, mprotect, 0)
 {
 	int err = 0;
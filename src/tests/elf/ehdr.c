@@ -28,7 +28,7 @@ TEST(Elf_Ehdr, readelf, 0)
 {
 	int ret;
 	struct elf_file *elf;
-	elf = elf_file_open(ulpatch_test_path);
+	elf = test_fixture_elf(ulpatch_test_path);
 	if (!elf) {
 		ulp_error("open %s failed.\n", ulpatch_test_path);
 		return -ENOENT;
@@ -36,6 +36,6 @@ TEST(Elf_Ehdr, readelf, 0)
 
 	ret = print_ehdr(stdout, elf->ehdr);
 
-	elf_file_close(ulpatch_test_path);
+	test_fixture_elf_put(elf);
 	return ret;
 }
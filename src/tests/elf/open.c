@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <utils/log.h>
 #include <utils/list.h>
@@ -61,3 +63,96 @@ TEST(Elf_Open, open_find_close, 0)
 	return ret;
 }
 
+
+TEST(Elf_Open, open_lazy, 0)
+{
+	int i;
+	int ret = 0;
+	struct elf_file *e;
+	char *build_id;
+
+	for (i = 0; i < ARRAY_SIZE(test_elfs); i++) {
+		if (!fexist(test_elfs[i]))
+			continue;
+
+		e = elf_file_open(test_elfs[i]);
+		if (!e)
+			continue;
+		build_id = strdup(e->build_id);
+		elf_file_close(test_elfs[i]);
+
+		e = elf_file_open_lazy(test_elfs[i]);
+		if (!e) {
+			ulp_error("open %s lazily failed.\n", test_elfs[i]);
+			ret = -1;
+			free(build_id);
+			continue;
+		}
+
+		/* Build ID is ready, symbols are not loaded yet */
+		if (strcmp(build_id, e->build_id) || e->syms_loaded)
+			ret = -1;
+
+		elf_support_ftrace(e);
+		if (!e->syms_loaded)
+			ret = -1;
+
+		free(build_id);
+		elf_file_close(test_elfs[i]);
+	}
+
+	return ret;
+}
+
+TEST(Elf_Open, section_iter, 0)
+{
+	struct elf_section_iter it;
+	uint8_t bid[64];
+	char buf[256];
+	const void *data;
+	struct elf_file *e;
+	const char *file = "/usr/bin/ls";
+	int ret = 0, nr = 0, len;
+	bool found = false;
+
+	if (!fexist(file))
+		return 0;
+
+	e = elf_file_open(file);
+	if (!e)
+		return -1;
+
+	if (elf_section_iter_init(&it, e)) {
+		elf_file_close(file);
+		return -1;
+	}
+
+	while (!elf_section_iter_next(&it)) {
+		if (strcmp(it.name, e->shdrnames[it.idx]))
+			ret = -1;
+		nr++;
+
+		if (it.shdr->sh_type != SHT_NOTE)
+			continue;
+		data = elf_section_iter_data(&it);
+		if (!data)
+			continue;
+		len = elf_notes_build_id(data, it.shdr->sh_size,
+					 it.shdr->sh_addralign, bid,
+					 sizeof(bid));
+		if (len <= 0)
+			continue;
+		/* The same Build ID as libelf */
+		if (strcmp(elf_strbuildid(bid, len, buf, sizeof(buf)),
+			   e->build_id))
+			ret = -1;
+		found = true;
+	}
+	elf_section_iter_fini(&it);
+
+	if (nr != e->shdrnum || !found)
+		ret = -1;
+
+	elf_file_close(file);
+	return ret;
+}
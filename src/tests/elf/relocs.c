@@ -19,3 +19,48 @@ TEST(Elf_Reloc, rela, 0)
 	return errno;
 }
 
+
+TEST(Elf_Reloc, relocs_all, 0)
+{
+	int ret = 0, i, nr_relas, nr = 0;
+	struct elf_file *elf;
+	const char *file = "/usr/bin/ls";
+
+	if (!fexist(file))
+		return 0;
+
+	elf = elf_file_open(file);
+	if (!elf)
+		return -1;
+
+	/* Never decoded on open */
+	if (elf->relas)
+		ret = -1;
+
+	if (handle_relocs_all(elf) || !elf->nr_relas)
+		ret = -1;
+	nr_relas = elf->nr_relas;
+
+	/* Merged in section order, every entry recorded */
+	for (i = 0; i < elf->nr_relas; i++) {
+		struct elf_rela_sec *sec = &elf->relas[i];
+		GElf_Shdr *shdr = &elf->shdrs[sec->index];
+
+		if ((i && sec->index <= elf->relas[i - 1].index) ||
+		    shdr->sh_type != SHT_RELA ||
+		    sec->nr != shdr->sh_size / shdr->sh_entsize)
+			ret = -1;
+		nr += sec->nr;
+	}
+
+	/* Decode again, the result must be stable */
+	if (handle_relocs_all(elf) || elf->nr_relas != nr_relas)
+		ret = -1;
+	for (i = 0; i < elf->nr_relas; i++)
+		nr -= elf->relas[i].nr;
+	if (nr)
+		ret = -1;
+
+	elf_file_close(file);
+	return ret;
+}
@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <utils/log.h>
 #include <utils/list.h>
@@ -54,6 +57,9 @@ TEST(Bfd_sym, buildid, 0)
 	size_t refcount;
 	char buf[512];
 
+	/* Count the references of tests only */
+	test_fixtures_release();
+
 	for (i = 0; i < ARRAY_SIZE(test_files); i++) {
 
 		MODIFY_TEST_FILES(i);
@@ -96,7 +102,7 @@ TEST(Bfd_sym, for_each_sym, 0)
 		if (!fexist(test_files[i]))
 			continue;
 
-		file = bfd_elf_open(test_files[i]);
+		file = test_fixture_bfd(test_files[i]);
 		if (!file) {
 			ret = -1;
 			continue;
@@ -233,7 +239,7 @@ TEST(Bfd_sym, objdump_plt_sym_addr, 0)
 		if (!fexist(test_files[i]))
 			continue;
 
-		file = bfd_elf_open(test_files[i]);
+		file = test_fixture_bfd(test_files[i]);
 		if (!file) {
 			ret = -1;
 		} else {
@@ -245,3 +251,313 @@ TEST(Bfd_sym, objdump_plt_sym_addr, 0)
 	return ret;
 }
 
+
+TEST(Bfd_sym, preload, 0)
+{
+	int ret = 0, i, n = 0;
+	const char *names[ARRAY_SIZE(test_files)];
+	struct bfd_elf_file *file;
+
+	for (i = 0; i < ARRAY_SIZE(test_files); i++) {
+		MODIFY_TEST_FILES(i);
+		if (fexist(test_files[i]))
+			names[n++] = test_files[i];
+	}
+
+	if (bfd_elf_preload(names, n))
+		ret = -1;
+
+	for (i = 0; i < n; i++) {
+		file = bfd_elf_open(names[i]);
+		if (!file || bfd_elf_file_refcount(file) < 1 ||
+		    !bfd_next_text_sym(file, NULL)) {
+			ulp_error("Preload %s failed.\n", names[i]);
+			ret = -1;
+		}
+		bfd_elf_close(file);
+	}
+
+	return ret;
+}
+
+static int count_bfd_syms(const char *name, unsigned long *sum)
+{
+	struct bfd_elf_file *file;
+	struct bfd_sym *symbol;
+	int n = 0;
+
+	file = bfd_elf_open(name);
+	if (!file)
+		return -1;
+
+	*sum = 0;
+	for (symbol = bfd_next_text_sym(file, NULL); symbol;
+	     symbol = bfd_next_text_sym(file, symbol)) {
+		/* symbol cache must keep the lookup work */
+		if (bfd_elf_text_sym_addr(file, bfd_sym_name(symbol)) !=
+		    bfd_sym_addr(symbol))
+			n = -1;
+		if (n >= 0)
+			n++;
+		*sum += bfd_sym_addr(symbol);
+	}
+
+	bfd_elf_close(file);
+	return n;
+}
+
+TEST(Bfd_sym, sym_cache, 0)
+{
+	int ret = 0, i, n, n_cache;
+	unsigned long sum, sum_cache;
+	size_t budget;
+
+	/* No fixture pinned, every open goes to the cache */
+	test_fixtures_release();
+
+	/* Don't keep closed files in memory, every open goes to the cache */
+	budget = bfd_elf_cache_set_budget(0);
+
+	for (i = 0; i < ARRAY_SIZE(test_files); i++) {
+
+		MODIFY_TEST_FILES(i);
+
+		if (!fexist(test_files[i]))
+			continue;
+
+		bfd_elf_sym_cache_enable(false);
+		n = count_bfd_syms(test_files[i], &sum);
+
+		bfd_elf_sym_cache_enable(true);
+		/* First open save the cache, the second one load it */
+		count_bfd_syms(test_files[i], &sum_cache);
+		n_cache = count_bfd_syms(test_files[i], &sum_cache);
+
+		if (n < 0 || n != n_cache || sum != sum_cache) {
+			ulp_error("%s: symbol cache mismatch %d != %d\n",
+				  test_files[i], n, n_cache);
+			ret = -1;
+		}
+	}
+
+	bfd_elf_cache_set_budget(budget);
+	return ret;
+}
+
+TEST(Bfd_sym, lru_cache, 0)
+{
+	int ret = 0;
+	size_t budget;
+	struct bfd_elf_file *file, *file2;
+	struct bfd_elf_cache_stats st0, st;
+	const char *name = "/usr/bin/ls";
+
+	if (!fexist(name))
+		return 0;
+
+	/* No fixture pinned, only the LRU keeps the closed files */
+	test_fixtures_release();
+
+	budget = bfd_elf_cache_set_budget(BFD_ELF_CACHE_DEFAULT_BUDGET);
+	bfd_elf_cache_get_stats(&st0);
+
+	file = bfd_elf_open(name);
+	if (!file)
+		return -1;
+	bfd_elf_close(file);
+
+	/* Closed file is kept, the second open is a hit */
+	file2 = bfd_elf_open(name);
+	bfd_elf_cache_get_stats(&st);
+	if (file2 != file || bfd_elf_file_refcount(file2) != 1 ||
+	    st.hits <= st0.hits) {
+		ulp_error("bfd_elf_file not cached.\n");
+		ret = -1;
+	}
+	bfd_elf_close(file2);
+
+	/* Over budget, unreferenced files are evicted */
+	bfd_elf_cache_set_budget(0);
+	bfd_elf_cache_get_stats(&st);
+	if (st.nr_unused || st.unused_bytes || st.evictions <= st0.evictions) {
+		ulp_error("bfd_elf_file not evicted.\n");
+		ret = -1;
+	}
+
+	bfd_elf_cache_set_budget(budget);
+	return ret;
+}
+
+TEST(Bfd_sym, lru_cache_stale, 0)
+{
+	int ret = 0;
+	size_t budget;
+	char name[PATH_MAX];
+	struct bfd_elf_file *file;
+	struct bfd_elf_cache_stats st0, st;
+
+	if (!fexist("/usr/bin/ls"))
+		return 0;
+
+	snprintf(name, sizeof(name), "/tmp/ulpatch-bfd-stale-%d", getpid());
+	unlink(name);
+	if (fcopy("/usr/bin/ls", name))
+		return -1;
+
+	budget = bfd_elf_cache_set_budget(BFD_ELF_CACHE_DEFAULT_BUDGET);
+
+	file = bfd_elf_open(name);
+	if (!file) {
+		ret = -1;
+		goto out;
+	}
+	bfd_elf_close(file);
+
+	/* Replace the file on the same path, the cached one is stale */
+	unlink(name);
+	if (fcopy("/usr/bin/ls", name)) {
+		ret = -1;
+		goto out;
+	}
+
+	bfd_elf_cache_get_stats(&st0);
+	file = bfd_elf_open(name);
+	bfd_elf_cache_get_stats(&st);
+	if (!file || st.hits != st0.hits || st.misses <= st0.misses ||
+	    st.evictions <= st0.evictions) {
+		ulp_error("stale bfd_elf_file %s is used.\n", name);
+		ret = -1;
+	}
+	bfd_elf_close(file);
+
+out:
+	bfd_elf_cache_set_budget(budget);
+	unlink(name);
+	return ret;
+}
+
+TEST(Bfd_sym, elf_read_build_id, 0)
+{
+	int ret = 0, i, len;
+	struct bfd_elf_file *file;
+	const struct bfd_build_id *bid;
+	uint8_t buf[64];
+
+	for (i = 0; i < ARRAY_SIZE(test_files); i++) {
+
+		MODIFY_TEST_FILES(i);
+
+		if (!fexist(test_files[i]))
+			continue;
+
+		file = test_fixture_bfd(test_files[i]);
+		if (!file)
+			continue;
+
+		/* Only PT_NOTE read, must same as BFD */
+		bid = bfd_elf_bid(file);
+		len = elf_read_build_id(test_files[i], buf, sizeof(buf));
+		if (bid && (len != bid->size || memcmp(buf, bid->data, len))) {
+			ulp_error("%s: wrong build id\n", test_files[i]);
+			ret = -1;
+		}
+
+		bfd_elf_close(file);
+	}
+
+	return ret;
+}
+
+/* C++ symbol in C, demangled as "ulp::test::demangle(int)" */
+__attribute__((used, noinline))
+int ulp_test_demangle(int x) __asm__("_ZN3ulp4test8demangleEi");
+int ulp_test_demangle(int x)
+{
+	return x + 1;
+}
+
+TEST(Bfd_sym, demangle, 0)
+{
+	int ret = 0, nr = 0;
+	struct bfd_elf_file *file;
+	const struct bfd_demangled *d;
+	struct bfd_sym *s;
+
+	file = test_fixture_bfd(ulpatch_test_path);
+	if (!file)
+		return -1;
+
+	s = bfd_find_demangled_sym(file, "ulp::test::demangle");
+	if (!s || strcmp(bfd_sym_name(s), "_ZN3ulp4test8demangleEi")) {
+		ulp_error("qualified name not found.\n");
+		ret = -1;
+	}
+
+	if (bfd_find_demangled_sym(file, "ulp::test::demangle(int)") != s)
+		ret = -1;
+
+	if (bfd_find_demangled_sym(file, "ulp::test::demangl") ||
+	    bfd_find_demangled_sym(file, "ulp::test::demangle(long)"))
+		ret = -1;
+
+	for (d = bfd_next_demangled(file, "ulp::test::", NULL); d;
+	     d = bfd_next_demangled(file, "ulp::test::", d)) {
+		ulp_debug("%s\n", bfd_demangled_name(d));
+		nr++;
+	}
+	if (!nr)
+		ret = -1;
+
+	bfd_elf_close(file);
+	return ret;
+}
+
+TEST(Bfd_sym, debuginfo, 0)
+{
+	char cmd[PATH_MAX * 3], stripped[] = "/tmp/ulpatch-debuginfo-XXXXXX";
+	char debug[sizeof(stripped) + 8];
+	struct bfd_elf_file *file;
+	unsigned long addr;
+	size_t budget;
+	int ret = 0, fd;
+
+	file = test_fixture_bfd(ulpatch_test_path);
+	if (!file)
+		return -1;
+	addr = bfd_elf_text_sym_addr(file, "main");
+	bfd_elf_close(file);
+
+	fd = mkstemp(stripped);
+	if (fd < 0)
+		return -1;
+	close(fd);
+	snprintf(debug, sizeof(debug), "%s.debug", stripped);
+
+	/* The debug file is in the same directory, see .gnu_debuglink */
+	snprintf(cmd, sizeof(cmd),
+		 "objcopy --only-keep-debug %s %s && "
+		 "objcopy --strip-all --add-gnu-debuglink=%s %s %s",
+		 ulpatch_test_path, debug, debug, ulpatch_test_path, stripped);
+	if (system(cmd)) {
+		ulp_warning("No objcopy, skip.\n");
+		goto out;
+	}
+
+	/* The same build-id as ulpatch_test, never hit the cache of it */
+	budget = bfd_elf_cache_set_budget(0);
+	bfd_elf_sym_cache_enable(false);
+
+	file = bfd_elf_open(stripped);
+	if (!file || !addr || bfd_elf_text_sym_addr(file, "main") != addr) {
+		ulp_error("main of %s not loaded from %s\n", stripped, debug);
+		ret = -1;
+	}
+	bfd_elf_close(file);
+
+	bfd_elf_sym_cache_enable(true);
+	bfd_elf_cache_set_budget(budget);
+out:
+	unlink(stripped);
+	unlink(debug);
+	return ret;
+}
@@ -34,7 +34,7 @@ TEST(Elf_Sym, for_each_symbol, 0)
 {
 	int ret;
 	struct elf_file *elf;
-	elf = elf_file_open(ulpatch_test_path);
+	elf = test_fixture_elf(ulpatch_test_path);
 	if (!elf) {
 		ulp_error("open %s failed.\n", ulpatch_test_path);
 		return -ENOENT;
@@ -42,7 +42,7 @@ TEST(Elf_Sym, for_each_symbol, 0)
 
 	ret = for_each_symbol(elf, print_elf_symbol, NULL);
 
-	elf_file_close(ulpatch_test_path);
+	test_fixture_elf_put(elf);
 	return ret;
 }
 
@@ -56,7 +56,7 @@ TEST(Elf_Sym, find_symbols, 0)
 
 	struct elf_file *elf;
 
-	elf = elf_file_open(ulpatch_test_path);
+	elf = test_fixture_elf(ulpatch_test_path);
 	if (!elf) {
 		ulp_error("open %s failed.\n", ulpatch_test_path);
 		ret = -1;
@@ -81,7 +81,7 @@ TEST(Elf_Sym, find_symbols, 0)
 		}
 	}
 
-	elf_file_close(ulpatch_test_path);
+	test_fixture_elf_put(elf);
 	return ret;
 }
 
@@ -96,7 +96,7 @@ TEST(Elf_Sym, find_mcount, 0)
 	 * test ftrace compile with -pg, thus ulpatch_test_path has mcount
 	 * for sure.
 	 */
-	elf = elf_file_open(ulpatch_test_path);
+	elf = test_fixture_elf(ulpatch_test_path);
 	if (!elf) {
 		ulp_error("open %s failed.\n", ulpatch_test_path);
 		ret = -1;
@@ -107,8 +107,10 @@ TEST(Elf_Sym, find_mcount, 0)
 		goto finish_close_elf;
 
 	mcount_name = elf_mcount_name(elf);
-	if (!mcount_name)
-		return -ENOENT;
+	if (!mcount_name) {
+		ret = -ENOENT;
+		goto finish_close_elf;
+	}
 
 	s = find_symbol(elf, mcount_name, STT_FUNC);
 	if (!s) {
@@ -125,7 +127,7 @@ TEST(Elf_Sym, find_mcount, 0)
 		 s->sym.st_value);
 
 finish_close_elf:
-	elf_file_close(ulpatch_test_path);
+	test_fixture_elf_put(elf);
 
 finish:
 	return ret;
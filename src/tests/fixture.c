@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/compiler.h>
+#include <elf/elf-api.h>
+#include <task/task.h>
+
+#include <tests/test-api.h>
+
+#define TEST_FIXTURE_MAX	32
+
+/* Opened by elf_file_open(), @refs is the references not put yet */
+static struct {
+	char path[PATH_MAX];
+	int refs;
+} elf_fixtures[TEST_FIXTURE_MAX];
+static int nr_elf_fixtures = 0;
+
+/* Keep one reference, thus never on the LRU of bfd_elf_close() */
+static struct bfd_elf_file *bfd_fixtures[TEST_FIXTURE_MAX];
+static int nr_bfd_fixtures = 0;
+
+static struct {
+	unsigned int flags;
+	struct task_struct *task;
+} task_fixtures[TEST_FIXTURE_MAX];
+static int nr_task_fixtures = 0;
+
+/**
+ * The ELF file of @path opened once per test run, return it with one
+ * reference, the caller must not elf_file_close() it, but put it by
+ * test_fixture_elf_put().
+ */
+struct elf_file *test_fixture_elf(const char *path)
+{
+	struct elf_file *elf;
+	int i;
+
+	/* Return the opened one, or open it again if someone closed it */
+	elf = elf_file_open(path);
+	if (!elf)
+		return NULL;
+
+	for (i = 0; i < nr_elf_fixtures; i++) {
+		if (!strcmp(elf_fixtures[i].path, path))
+			break;
+	}
+	if (i == TEST_FIXTURE_MAX) {
+		ulp_warning("Too many ELF fixtures, %s\n", path);
+		return elf;
+	}
+	if (i == nr_elf_fixtures) {
+		strncpy(elf_fixtures[i].path, path, PATH_MAX - 1);
+		nr_elf_fixtures++;
+	}
+	elf_fixtures[i].refs++;
+	return elf;
+}
+
+void test_fixture_elf_put(struct elf_file *elf)
+{
+	int i;
+
+	if (!elf)
+		return;
+
+	for (i = 0; i < nr_elf_fixtures; i++) {
+		if (!strcmp(elf_fixtures[i].path, elf->filepath)) {
+			elf_fixtures[i].refs--;
+			return;
+		}
+	}
+	ulp_warning("%s is not a fixture.\n", elf->filepath);
+}
+
+/**
+ * The bfd_elf_file of @path opened once per test run, the fixture keeps
+ * one reference, the returned one has another reference, drop it by
+ * bfd_elf_close() as usual.
+ */
+struct bfd_elf_file *test_fixture_bfd(const char *path)
+{
+	struct bfd_elf_file *file;
+	int i;
+
+	for (i = 0; i < nr_bfd_fixtures; i++) {
+		if (!strcmp(bfd_elf_file_name(bfd_fixtures[i]), path))
+			return bfd_elf_open(path);
+	}
+
+	file = bfd_elf_open(path);
+	if (!file)
+		return NULL;
+	if (nr_bfd_fixtures == TEST_FIXTURE_MAX) {
+		ulp_warning("Too many BFD fixtures, %s\n", path);
+		return file;
+	}
+	bfd_fixtures[nr_bfd_fixtures++] = file;
+	return bfd_elf_open(path);
+}
+
+/**
+ * The read-only task of current process opened by @flags once per test
+ * run, shared by all the callers, never close it. The tester and each -j
+ * worker have their own.
+ */
+struct task_struct *test_fixture_task(unsigned int flags)
+{
+	struct task_struct *task;
+	int i;
+
+	/* No ULP_PROC_ROOT_DIR of our own, never write */
+	flags &= ~(FTO_PROC | FTO_RDWR);
+
+	for (i = 0; i < nr_task_fixtures; i++) {
+		if (task_fixtures[i].flags != flags)
+			continue;
+		task = task_fixtures[i].task;
+		if (task && task->pid == getpid())
+			return task;
+		/* Inherited from the parent of -j worker */
+		if (task)
+			close_task(task);
+		task_fixtures[i].task = open_task(getpid(), flags);
+		return task_fixtures[i].task;
+	}
+
+	task = open_task(getpid(), flags);
+	if (!task)
+		return NULL;
+	if (nr_task_fixtures == TEST_FIXTURE_MAX) {
+		ulp_warning("Too many task fixtures, %x\n", flags);
+		return task;
+	}
+	task_fixtures[nr_task_fixtures].flags = flags;
+	task_fixtures[nr_task_fixtures].task = task;
+	nr_task_fixtures++;
+	return task;
+}
+
+/**
+ * Close all fixtures, the references not dropped by tests are reported.
+ * The tests of the ELF caches call it first, the files opened by them are
+ * not pinned by fixtures.
+ */
+void test_fixtures_release(void)
+{
+	int i, refs;
+
+	for (i = 0; i < nr_task_fixtures; i++) {
+		if (task_fixtures[i].task)
+			close_task(task_fixtures[i].task);
+		task_fixtures[i].task = NULL;
+	}
+	nr_task_fixtures = 0;
+
+	for (i = 0; i < nr_bfd_fixtures; i++) {
+		refs = bfd_elf_file_refcount(bfd_fixtures[i]);
+		if (refs != 1)
+			ulp_warning("BFD fixture %s has %d references.\n",
+				    bfd_elf_file_name(bfd_fixtures[i]),
+				    refs - 1);
+		bfd_elf_close(bfd_fixtures[i]);
+		bfd_fixtures[i] = NULL;
+	}
+	nr_bfd_fixtures = 0;
+
+	for (i = 0; i < nr_elf_fixtures; i++) {
+		if (elf_fixtures[i].refs)
+			ulp_warning("ELF fixture %s has %d references.\n",
+				    elf_fixtures[i].path, elf_fixtures[i].refs);
+		elf_file_close(elf_fixtures[i].path);
+		elf_fixtures[i].refs = 0;
+	}
+	nr_elf_fixtures = 0;
+}
@@ -8,12 +8,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <signal.h>
 
 #include <utils/log.h>
 #include <utils/list.h>
@@ -27,6 +30,8 @@
 static int epollfd = -1;
 static int listenfd = -1;
 
+const char *listener_unix_path = TEST_UNIX_PATH;
+
 
 int init_listener(void)
 {
@@ -42,7 +47,8 @@ int init_listener(void)
 	epollfd = epoll_create(1);
 	assert(epollfd != -1 && "epoll_create failed.\n");
 
-	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	/* Keep the boundary of messages, one batch per message */
+	listenfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
 	if (listenfd < 0) {
 		ret = -errno;
 		ulp_error("create listening socket error, %m\n");
@@ -50,13 +56,14 @@ int init_listener(void)
 	}
 	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, NULL, 0);
 
-	if (fexist(TEST_UNIX_PATH) && (ret = unlink(TEST_UNIX_PATH))) {
-		ulp_error("unlink(%s) failed, %m\n", TEST_UNIX_PATH);
+	if (fexist(listener_unix_path) && (ret = unlink(listener_unix_path))) {
+		ulp_error("unlink(%s) failed, %m\n", listener_unix_path);
 		goto error;
 	}
 
 	srv_addr.sun_family = AF_UNIX;
-	strncpy(srv_addr.sun_path, TEST_UNIX_PATH, sizeof(srv_addr.sun_path) - 1);
+	strncpy(srv_addr.sun_path, listener_unix_path,
+		sizeof(srv_addr.sun_path) - 1);
 	ret = bind(listenfd, (struct sockaddr *)&srv_addr, sizeof(srv_addr));
 	if (ret == -1) {
 		ret = -errno;
@@ -79,7 +86,7 @@ int init_listener(void)
 error:
 	close(epollfd);
 	close(listenfd);
-	unlink(TEST_UNIX_PATH);
+	unlink(listener_unix_path);
 	return ret;
 }
 
@@ -87,7 +94,7 @@ void close_listener(void)
 {
 	close(epollfd);
 	close(listenfd);
-	unlink(TEST_UNIX_PATH);
+	unlink(listener_unix_path);
 }
 
 int listener_helper_create_test_client(void)
@@ -95,24 +102,51 @@ int listener_helper_create_test_client(void)
 	int connect_fd, ret = -1;
 	struct sockaddr_un srv_addr;
 
-	connect_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	connect_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
 	if (connect_fd < 0) {
 		ulp_error("create socket error: %m\n");
 		return -EINVAL;
 	}
 
 	srv_addr.sun_family = AF_UNIX;
-	strcpy(srv_addr.sun_path, TEST_UNIX_PATH);
+	strcpy(srv_addr.sun_path, listener_unix_path);
 
 	ret = connect(connect_fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr));
 	if (ret == -1) {
-		ulp_error("connect error: %m, %s\n", TEST_UNIX_PATH);
+		ulp_error("connect error: %m, %s\n", listener_unix_path);
 		close(connect_fd);
 		exit(1);
 	}
 	return connect_fd;
 }
 
+/**
+ * Connect to the listener of @path, retry for 1 second at most until the
+ * server is bound, return the fd or -errno.
+ */
+int listener_helper_connect(const char *path)
+{
+	struct sockaddr_un srv_addr = { .sun_family = AF_UNIX };
+	int fd, ret, i;
+
+	strncpy(srv_addr.sun_path, path, sizeof(srv_addr.sun_path) - 1);
+
+	for (i = 0; i < 1000; i++) {
+		fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		if (fd < 0)
+			return -errno;
+		if (!connect(fd, (struct sockaddr *)&srv_addr, sizeof(srv_addr)))
+			return fd;
+		ret = -errno;
+		close(fd);
+		if (ret != -ENOENT && ret != -ECONNREFUSED)
+			break;
+		usleep(1000);
+	}
+	ulp_error("connect %s: %s\n", path, strerror(-ret));
+	return ret;
+}
+
 int listener_helper_close_test_client(int fd)
 {
 	return close(fd);
@@ -196,21 +230,263 @@ int listener_helper_symbol(int fd, const char *sym, unsigned long *addr)
 	return 0;
 }
 
+/**
+ * Request the addresses of @nr symbols in one message, @nr is at most
+ * CTRL_BATCH_MAX, return the number of symbols responded, or -errno.
+ */
+int listener_helper_symbols(int fd, const char *syms[], unsigned long *addrs,
+			    int nr)
+{
+	struct ctrl_batch_hdr hdr = { .magic = CTRL_BATCH_MAGIC };
+	struct iovec iov[1 + CTRL_BATCH_MAX * 2];
+	struct ctrl_rec recs[CTRL_BATCH_MAX], rec;
+	static char buf[CTRL_BATCH_SIZE];
+	size_t off;
+	ssize_t n;
+	int i;
+
+	if (nr <= 0 || nr > CTRL_BATCH_MAX)
+		return -EINVAL;
+
+	hdr.nr = nr;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	for (i = 0; i < nr; i++) {
+		recs[i].code = TEST_MC_SYMBOL;
+		recs[i].len = strlen(syms[i]);
+		iov[1 + i * 2].iov_base = &recs[i];
+		iov[1 + i * 2].iov_len = sizeof(recs[i]);
+		iov[2 + i * 2].iov_base = (void *)syms[i];
+		iov[2 + i * 2].iov_len = recs[i].len;
+	}
+
+	if (writev(fd, iov, 1 + nr * 2) < 0) {
+		ulp_error("writev(2): %m\n");
+		return -errno;
+	}
+
+	n = read(fd, buf, sizeof(buf));
+	if (n < (ssize_t)sizeof(hdr)) {
+		ulp_error("read(2): %m\n");
+		return -EIO;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != CTRL_BATCH_MAGIC)
+		return -EPROTO;
+
+	off = sizeof(hdr);
+	for (i = 0; i < MIN(hdr.nr, nr); i++) {
+		if (off + sizeof(rec) > n)
+			break;
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+		if (off + rec.len > n)
+			break;
+		addrs[i] = 0;
+		if (rec.code == TEST_MC_SYMBOL && rec.len == sizeof(addrs[i]))
+			memcpy(&addrs[i], buf + off, sizeof(addrs[i]));
+		off += rec.len;
+	}
+	return i;
+}
+
+/**
+ * Fork @nr idle targets in one message, @nr is at most CTRL_BATCH_MAX,
+ * return the number of pids responded, or -errno.
+ */
+int listener_helper_fork(int fd, pid_t *pids, int nr)
+{
+	struct ctrl_batch_hdr hdr = { .magic = CTRL_BATCH_MAGIC };
+	struct ctrl_rec recs[CTRL_BATCH_MAX], rec;
+	static char buf[CTRL_BATCH_SIZE];
+	size_t off;
+	ssize_t n;
+	int i, got = 0;
+
+	if (nr <= 0 || nr > CTRL_BATCH_MAX)
+		return -EINVAL;
+
+	hdr.nr = nr;
+	memcpy(buf, &hdr, sizeof(hdr));
+	for (i = 0; i < nr; i++) {
+		recs[i].code = TEST_MC_FORK;
+		recs[i].len = 0;
+	}
+	memcpy(buf + sizeof(hdr), recs, sizeof(recs[0]) * nr);
+
+	if (write(fd, buf, sizeof(hdr) + sizeof(recs[0]) * nr) < 0) {
+		ulp_error("write(2): %m\n");
+		return -errno;
+	}
+
+	n = read(fd, buf, sizeof(buf));
+	if (n < (ssize_t)sizeof(hdr)) {
+		ulp_error("read(2): %m\n");
+		return -EIO;
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != CTRL_BATCH_MAGIC)
+		return -EPROTO;
+
+	off = sizeof(hdr);
+	for (i = 0; i < MIN(hdr.nr, nr); i++) {
+		if (off + sizeof(rec) > n)
+			break;
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+		if (off + rec.len > n)
+			break;
+		if (rec.code == TEST_MC_FORK && rec.len == sizeof(pid_t)) {
+			memcpy(&pids[got], buf + off, sizeof(pid_t));
+			if (pids[got] > 0)
+				got++;
+		}
+		off += rec.len;
+	}
+	return got;
+}
+
 
 static bool listener_need_close = false;
 
+/**
+ * The idle target forked by TEST_MC_FORK, it's the copy of listener, thus
+ * has all test symbols, and waits in pause(2) until killed, or the listener
+ * exits.
+ */
+static void __noreturn fork_target_loop(pid_t listener)
+{
+	struct test_client *client;
+
+	close(epollfd);
+	close(listenfd);
+	list_for_each_entry(client, &test_client_list, node)
+		close(client->connfd);
+
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != listener)
+		_exit(0);
+
+	for (;;)
+		pause();
+}
+
+static pid_t fork_target(void)
+{
+	static bool reap = false;
+	pid_t pid, self = getpid();
+
+	/* Nobody waits the targets, the kernel reaps them */
+	if (!reap) {
+		signal(SIGCHLD, SIG_IGN);
+		reap = true;
+	}
+
+	pid = fork();
+	if (pid == 0)
+		fork_target_loop(self);
+	if (pid < 0)
+		ulp_error("fork(2): %m\n");
+	return pid;
+}
+
+/**
+ * Handle all requests of a batch, and write all responses back in one
+ * message by writev(2), the payloads are never copied.
+ */
+static void handle_batch(struct test_client *client, const char *buf,
+			 size_t len)
+{
+	struct ctrl_batch_hdr hdr;
+	struct iovec iov[1 + CTRL_BATCH_MAX * 2];
+	struct ctrl_rec recs[CTRL_BATCH_MAX], rec;
+	unsigned long addrs[CTRL_BATCH_MAX];
+	pid_t pids[CTRL_BATCH_MAX];
+	static int close_rslt = 0;
+	struct test_symbol *sym;
+	char name[128];
+	int i, niov = 1;
+	size_t off;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	off = sizeof(hdr);
+	for (i = 0; i < MIN(hdr.nr, CTRL_BATCH_MAX); i++) {
+		if (off + sizeof(rec) > len)
+			break;
+		memcpy(&rec, buf + off, sizeof(rec));
+		off += sizeof(rec);
+		if (off + rec.len > len)
+			break;
+
+		recs[i].code = rec.code;
+		recs[i].len = 0;
+		iov[niov].iov_base = &recs[i];
+		iov[niov++].iov_len = sizeof(recs[i]);
+
+		switch (rec.code) {
+		case TEST_MC_SYMBOL:
+			memcpy(name, buf + off, MIN(rec.len, sizeof(name) - 1));
+			name[MIN(rec.len, sizeof(name) - 1)] = '\0';
+			sym = find_test_symbol(name);
+			addrs[i] = sym ? sym->addr : 0;
+			recs[i].len = sizeof(addrs[i]);
+			iov[niov].iov_base = &addrs[i];
+			iov[niov++].iov_len = sizeof(addrs[i]);
+			break;
+		case TEST_MC_CLOSE:
+			listener_need_close = true;
+			recs[i].len = sizeof(close_rslt);
+			iov[niov].iov_base = &close_rslt;
+			iov[niov++].iov_len = sizeof(close_rslt);
+			break;
+		case TEST_MC_FORK:
+			pids[i] = fork_target();
+			recs[i].len = sizeof(pids[i]);
+			iov[niov].iov_base = &pids[i];
+			iov[niov++].iov_len = sizeof(pids[i]);
+			break;
+		default:
+			ulp_error("unknown batch code %d\n", rec.code);
+			break;
+		}
+		off += rec.len;
+	}
+
+	hdr.nr = i;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	if (writev(client->connfd, iov, niov) < 0)
+		ulp_error("writev(2): %m\n");
+}
+
 static void recv_test_client_msg(struct test_client *client)
 {
 	int ret;
-	size_t nbytes;
+	ssize_t nbytes;
 	struct ctrl_msg msg, ack;
+	static char buf[CTRL_BATCH_SIZE];
+	uint32_t magic;
 
-	nbytes = read(client->connfd, &msg, sizeof(msg));
+	nbytes = read(client->connfd, buf, sizeof(buf));
 	if (nbytes <= 0) {
 		ulp_error("read(2): %m\n");
 		return;
 	}
 
+	if (nbytes >= sizeof(struct ctrl_batch_hdr)) {
+		memcpy(&magic, buf, sizeof(magic));
+		if (magic == CTRL_BATCH_MAGIC) {
+			handle_batch(client, buf, nbytes);
+			return;
+		}
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memcpy(&msg, buf, MIN(nbytes, sizeof(msg)));
+
 	if (msg.hdr.type != TEST_MT_REQUEST) {
 		ulp_error("Read unknown msg type %d\n", msg.hdr.type);
 		return;
@@ -32,6 +32,7 @@
 
 struct list_head test_list[TEST_PRIO_NUM];
 static LIST_HEAD(failed_list);
+static LIST_HEAD(regressed_list);
 
 static LIST_HEAD(mix_role_list);
 
@@ -86,6 +87,31 @@ static LIST_HEAD(filter_fmt_list);
 /* exit if Error */
 static bool error_exit = false;
 
+/* For -j, --jobs, number of worker processes, 1 means serial */
+static int nr_jobs = 1;
+
+/* For --results, one line per test */
+static const char *results_file = NULL;
+static FILE *results_fp = NULL;
+
+/**
+ * For --baseline and --regress, a test is regressed if it is slower than
+ * the baseline by --regress percent and at least REGRESS_MIN_US, the short
+ * tests jitter too much.
+ */
+static const char *baseline_file = NULL;
+static int regress_percent = 50;
+#define REGRESS_MIN_US	1000
+static unsigned long nr_regressed = 0;
+
+/**
+ * For --perf, the counters of the thread running tests, opened again in the
+ * worker of -j, the counters of perf_event_open(2) are not inherited.
+ */
+static bool use_perf = false;
+static struct perf_counters test_counters;
+static pid_t test_counters_pid = 0;
+
 /* set number of thread of ROLE_MULTI_THREADS */
 static int nr_threads = 3;
 
@@ -249,7 +275,19 @@ static void print_help(void)
 	"\n"
 	" -l, --list-tests    list all tests\n"
 	" -f, --filter [STR]  filter out some tests, (may be listed multiple times)\n"
-	"\n");
+	" -j, --jobs [N]      run tests in N worker processes, one per category,\n"
+	"                     priorities are barriers, output in order.\n"
+	"                     0 means number of CPUs, default 1, serial.\n"
+	"     --results [FILE]\n"
+	"                     write result and spend of each test to FILE.\n"
+	"     --baseline [FILE]\n"
+	"                     compare spend of each test with FILE, which is\n"
+	"                     written by --results of an earlier run.\n"
+	"     --regress [PCT] a test is regressed if slower than baseline by\n"
+	"                     PCT percent and %dus at least, default %d.\n"
+	"     --perf          count cycles, instructions, cache-misses,\n"
+	"                     branch-misses and page-faults of every test.\n"
+	"\n", REGRESS_MIN_US, regress_percent);
 	printf(
 	"Role:\n"
 	"\n"
@@ -295,9 +333,12 @@ static void print_help(void)
 	"    Execute for loop:\n"
 	"     --listener-epoll    start a loop with epoll(2), see listener.c.\n"
 	"                         if set, other --listener-??? argument skipped.\n"
+	"     --listener-path     unix socket path of --listener-epoll,\n"
+	"                         default %s\n"
 	"\n",
 	role_string[ROLE_LISTENER],
-	listener_nloop
+	listener_nloop,
+	TEST_UNIX_PATH
 	);
 	printf(
 	"\n"
@@ -331,8 +372,14 @@ enum {
 	ARG_LISTENER_REQUEST_LIST,
 	ARG_LISTENER_NLOOP,
 	ARG_LISTENER_EPOLL,
+	ARG_LISTENER_PATH,
 
 	ARG_SKIP,
+
+	ARG_RESULTS,
+	ARG_BASELINE,
+	ARG_REGRESS,
+	ARG_PERF,
 };
 
 static int parse_config(int argc, char *argv[])
@@ -340,6 +387,7 @@ static int parse_config(int argc, char *argv[])
 	struct option options[] = {
 		{ "list-tests",         no_argument,        0,  'l' },
 		{ "filter",             required_argument,  0,  'f' },
+		{ "jobs",               required_argument,  0,  'j' },
 		{ "skip",               required_argument,  0,  ARG_SKIP },
 		{ "role",               required_argument,  0,  'r' },
 		{ "usecond",            required_argument,  0,  's' },
@@ -351,7 +399,12 @@ static int parse_config(int argc, char *argv[])
 		{ "listener-req-list",  no_argument,        0,  ARG_LISTENER_REQUEST_LIST },
 		{ "listener-nloop",     required_argument,  0,  ARG_LISTENER_NLOOP },
 		{ "listener-epoll",     no_argument,        0,  ARG_LISTENER_EPOLL },
+		{ "listener-path",      required_argument,  0,  ARG_LISTENER_PATH },
 		{ "error-exit",         no_argument,        0,  ARG_ERROR_EXIT },
+		{ "results",            required_argument,  0,  ARG_RESULTS },
+		{ "baseline",           required_argument,  0,  ARG_BASELINE },
+		{ "regress",            required_argument,  0,  ARG_REGRESS },
+		{ "perf",               no_argument,        0,  ARG_PERF },
 		COMMON_OPTIONS
 		{ NULL }
 	};
@@ -359,7 +412,7 @@ static int parse_config(int argc, char *argv[])
 	while (1) {
 		int c;
 		int option_index = 0;
-		c = getopt_long(argc, argv, "lf:r:s:m:"COMMON_GETOPT_OPTSTRING,
+		c = getopt_long(argc, argv, "lf:j:r:s:m:"COMMON_GETOPT_OPTSTRING,
 				options, &option_index);
 		if (c < 0) {
 			break;
@@ -374,6 +427,11 @@ static int parse_config(int argc, char *argv[])
 		case ARG_SKIP:
 			add_filter_fmt(optarg, true);
 			break;
+		case 'j':
+			nr_jobs = atoi(optarg);
+			if (nr_jobs <= 0)
+				nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			break;
 		case 'r':
 			role = who_am_i(optarg);
 			break;
@@ -404,9 +462,24 @@ static int parse_config(int argc, char *argv[])
 		case ARG_LISTENER_EPOLL:
 			listener_epoll = true;
 			break;
+		case ARG_LISTENER_PATH:
+			listener_unix_path = optarg;
+			break;
 		case ARG_ERROR_EXIT:
 			error_exit = true;
 			break;
+		case ARG_RESULTS:
+			results_file = optarg;
+			break;
+		case ARG_BASELINE:
+			baseline_file = optarg;
+			break;
+		case ARG_REGRESS:
+			regress_percent = atoi(optarg);
+			break;
+		case ARG_PERF:
+			use_perf = true;
+			break;
 		COMMON_GETOPT_CASES(prog_name, print_help, argv)
 		default:
 			print_help();
@@ -507,9 +580,59 @@ static bool should_skip(struct test *test)
 	return skip;
 }
 
-static int execute_one_test(struct test *test)
+static bool test_is_failed(struct test *test)
+{
+	return test->real_ret != test->expect_ret &&
+		test->expect_ret != TEST_RET_SKIP;
+}
+
+/**
+ * 1. high priority failed
+ * 2. ordinary test failed, and set --error-exit argument
+ */
+static bool test_should_stop(struct test *test)
+{
+	return test_is_failed(test) &&
+		(test->prio < TEST_PRIO_MIDDLE || error_exit);
+}
+
+static void test_perf_start(void)
+{
+	if (test_counters_pid != getpid()) {
+		if (test_counters_pid)
+			perf_counters_close(&test_counters);
+		test_counters_pid = getpid();
+		if (perf_counters_open(&test_counters))
+			ulp_warning("No perf counter for --perf.\n");
+	}
+	perf_counters_reset(&test_counters);
+	perf_counters_start(&test_counters);
+}
+
+static void test_perf_stop(struct test *test)
+{
+	if (perf_counters_stop(&test_counters))
+		return;
+	memcpy(test->perf, test_counters.sum, sizeof(test->perf));
+}
+
+static void test_perf_log(struct test *test)
 {
-	bool failed = false;
+	int i;
+
+	test_log("\033[2m    ");
+	for (i = 0; i < PERF_CNT_NUM; i++) {
+		if (perf_counters_has(&test_counters, i))
+			test_log(" %s %lu", perf_counter_name(i),
+				 (unsigned long)test->perf[i]);
+	}
+	test_log("\033[m\n");
+}
+
+/* Run the test and log the result, the statistics are not counted */
+static int run_one_test(struct test *test)
+{
+	bool failed;
 	int verbose;
 
 	errno = 0;
@@ -534,33 +657,27 @@ static int execute_one_test(struct test *test)
 		goto done_test;
 	}
 
-	gettimeofday(&test->start, NULL);
+	test->start_ns = nsecs();
 
 	/* Exe test entry */
 	verbose = get_verbose();
+	if (use_perf)
+		test_perf_start();
 	test->real_ret = test->test_cb();
+	if (use_perf)
+		test_perf_stop(test);
 	enable_verbose(verbose);
 
 done_test:
-	if (test->real_ret == test->expect_ret || test->expect_ret == TEST_RET_SKIP) {
-		stat_count[STAT_IDX_SUCCESS]++;
-	} else {
-		stat_count[STAT_IDX_FAILED]++;
-		failed = true;
-		list_add(&test->failed, &failed_list);
-	}
-
-	gettimeofday(&test->end, NULL);
+	failed = test_is_failed(test);
 
-	test->spend_us = test->end.tv_sec * 1000000UL + test->end.tv_usec
-		- test->start.tv_sec * 1000000UL - test->start.tv_usec;
-
-	total_spent_us += test->spend_us;
+	test->end_ns = nsecs();
+	test->spend_us = (test->end_ns - test->start_ns) / 1000;
 
 	/* Reset current test */
 	current_test = NULL;
 
-	test_log("\033[2m%ldus\033[m %s%-8s%s %s ret:%d:%d\n",
+	test_log("\033[2m%luus\033[m %s%-8s%s %s ret:%d:%d\n",
 		test->spend_us,
 		failed ? "\033[31m" : "\033[32m",
 		failed ? "Failed: " : "OK",
@@ -570,15 +687,367 @@ done_test:
 		"\033[m",
 		test->expect_ret, test->real_ret);
 
-	if (failed) {
-		/**
-		 * 1. high priority failed
-		 * 2. ordinary test failed, and set --error-exit argument
-		 */
-		if (test->prio < TEST_PRIO_MIDDLE || error_exit)
-			return -1;
+	if (use_perf)
+		test_perf_log(test);
+
+	return 0;
+}
+
+static bool test_is_regressed(struct test *test)
+{
+	unsigned long base;
+
+	if (test->base_us < 0 || test_is_failed(test))
+		return false;
+
+	base = test->base_us;
+	return test->spend_us >= base + REGRESS_MIN_US &&
+		test->spend_us * 100 > base * (100 + regress_percent);
+}
+
+/* Count the result of test, return -1 if should stop testing */
+static int account_one_test(struct test *test)
+{
+	int i;
+
+	if (test_is_failed(test)) {
+		stat_count[STAT_IDX_FAILED]++;
+		list_add(&test->failed, &failed_list);
+	} else
+		stat_count[STAT_IDX_SUCCESS]++;
+
+	if (test_is_regressed(test)) {
+		nr_regressed++;
+		list_add(&test->regressed, &regressed_list);
+	}
+
+	total_spent_us += test->spend_us;
+
+	if (results_fp) {
+		fprintf(results_fp, "%s.%s %d %d %d %lu", test->category,
+			test->name, test->prio, test->expect_ret,
+			test->real_ret, test->spend_us);
+		for (i = 0; use_perf && i < PERF_CNT_NUM; i++)
+			fprintf(results_fp, " %lu",
+				(unsigned long)test->perf[i]);
+		fprintf(results_fp, "\n");
+	}
+
+	return test_should_stop(test) ? -1 : 0;
+}
+
+static int execute_one_test(struct test *test)
+{
+	int ret;
+
+	ret = run_one_test(test);
+	if (ret)
+		return ret;
+
+	return account_one_test(test);
+}
+
+/* The result of one test, written by worker over pipe */
+struct test_result {
+	int idx;
+	int real_ret;
+	unsigned long spend_us;
+	uint64_t perf[PERF_CNT_NUM];
+};
+
+/**
+ * For -j, --jobs, a worker process runs the tests of one category of same
+ * priority in order, the log is saved in a temporary file and printed by
+ * tester in the order of categories, thus the output is deterministic.
+ */
+struct test_worker {
+	const char *category;
+	struct test **tests;
+	int nr_tests;
+	/* The number of results received */
+	int nr_done;
+	FILE *log;
+	/* Read end of the results pipe */
+	int fd;
+	pid_t pid;
+	int status;
+	bool done;
+};
+
+static void __noreturn run_worker(struct test_worker *w, int fd)
+{
+	struct test_result r;
+	struct test *test;
+	int i;
+
+	dup2(fileno(w->log), STDERR_FILENO);
+	if (is_verbose())
+		dup2(fileno(w->log), STDOUT_FILENO);
+
+	for (i = 0; i < w->nr_tests; i++) {
+		test = w->tests[i];
+		if (run_one_test(test))
+			break;
+
+		r.idx = test->idx;
+		r.real_ret = test->real_ret;
+		r.spend_us = test->spend_us;
+		memcpy(r.perf, test->perf, sizeof(r.perf));
+		if (write(fd, &r, sizeof(r)) != sizeof(r))
+			break;
+
+		if (test_should_stop(test))
+			break;
+	}
+
+	test_pool_destroy();
+	test_fixtures_release();
+	fflush(NULL);
+	_exit(0);
+}
+
+static int start_worker(struct test_worker *w)
+{
+	int pipefd[2];
+
+	w->log = tmpfile();
+	if (!w->log)
+		return -errno;
+
+	if (pipe(pipefd))
+		return -errno;
+
+	/* Don't output the buffers twice */
+	fflush(NULL);
+
+	w->pid = fork();
+	if (w->pid < 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -errno;
+	}
+
+	if (w->pid == 0) {
+		close(pipefd[0]);
+		run_worker(w, pipefd[1]);
+	}
+
+	close(pipefd[1]);
+	w->fd = pipefd[0];
+	return 0;
+}
+
+/* Reap one worker, read all results of it */
+static int reap_worker(struct test_worker *workers, int nr)
+{
+	struct test_worker *w = NULL;
+	struct test_result r;
+	int i, status;
+	pid_t pid;
+
+	do {
+		pid = waitpid(-1, &status, 0);
+	} while (pid < 0 && errno == EINTR);
+	if (pid < 0)
+		return -errno;
+
+	for (i = 0; i < nr; i++) {
+		if (workers[i].pid == pid && !workers[i].done) {
+			w = &workers[i];
+			break;
+		}
+	}
+	if (!w)
+		return 0;
+
+	/* The results are less than pipe capacity, read after exit */
+	while (w->nr_done < w->nr_tests &&
+	       read(w->fd, &r, sizeof(r)) == sizeof(r)) {
+		struct test *test = w->tests[w->nr_done];
+		if (r.idx != test->idx)
+			break;
+		test->real_ret = r.real_ret;
+		test->spend_us = r.spend_us;
+		memcpy(test->perf, r.perf, sizeof(test->perf));
+		w->nr_done++;
+	}
+	close(w->fd);
+
+	w->status = status;
+	w->done = true;
+	return 1;
+}
+
+/* Print the log and count the results of worker, return -1 if stop */
+static int finish_worker(struct test_worker *w)
+{
+	char buf[BUFSIZ];
+	struct test *test;
+	int i, ret = 0;
+	size_t n;
+
+	if (w->log) {
+		rewind(w->log);
+		while ((n = fread(buf, 1, sizeof(buf), w->log)) > 0)
+			fwrite(buf, 1, n, stderr);
+		fclose(w->log);
+		w->log = NULL;
+	}
+
+	for (i = 0; i < w->nr_done; i++) {
+		if (account_one_test(w->tests[i]))
+			ret = -1;
+	}
+
+	/* The worker crashed, the test running is emergency */
+	if (!ret && w->nr_done < w->nr_tests &&
+	    (w->pid < 0 || !WIFEXITED(w->status) || WEXITSTATUS(w->status))) {
+		test = w->tests[w->nr_done];
+		test->real_ret = TEST_RET_EMERG;
+		test->spend_us = 0;
+		if (w->pid < 0)
+			test_log("=== %4d/%-4d %s.%s ", test->idx, nr_tests,
+				 test->category, test->name);
+		test_failed("Failed: worker %s, status %#x\n",
+			    w->pid < 0 ? "not started" : "crashed", w->status);
+		ret = account_one_test(test);
+	}
+
+	return ret;
+}
+
+/**
+ * Run the tests of priority @prio by @nr_jobs worker processes, one worker
+ * per category, the priority is a barrier, return -1 if should stop.
+ */
+static int execute_tests_jobs(int prio)
+{
+	struct test_worker *workers = NULL, *w;
+	struct test **tests;
+	int i, nr = 0, next = 0, running = 0, printed = 0, ret = 0, err;
+	struct test *test;
+
+	list_for_each_entry(test, &test_list[prio], node) {
+		if (should_skip(test))
+			continue;
+
+		for (i = 0; i < nr; i++)
+			if (!strcmp(workers[i].category, test->category))
+				break;
+		if (i == nr) {
+			w = realloc(workers, (nr + 1) * sizeof(*w));
+			if (!w) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			workers = w;
+			memset(&workers[nr++], 0, sizeof(*w));
+			workers[i].category = test->category;
+		}
+
+		w = &workers[i];
+		tests = realloc(w->tests, (w->nr_tests + 1) * sizeof(*tests));
+		if (!tests) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		w->tests = tests;
+		w->tests[w->nr_tests++] = test;
+	}
+
+	while (printed < next || (!ret && next < nr)) {
+		while (!ret && next < nr && running < nr_jobs) {
+			w = &workers[next++];
+			if (start_worker(w)) {
+				ulp_error("Start worker of %s failed, %m\n",
+					  w->category);
+				w->pid = -1;
+				w->done = true;
+				continue;
+			}
+			running++;
+		}
+
+		if (running) {
+			err = reap_worker(workers, next);
+			if (err < 0) {
+				ulp_error("Wait worker failed, %s\n",
+					  strerror(-err));
+				ret = err;
+				goto out;
+			}
+			running -= err;
+		}
+
+		while (printed < next && workers[printed].done) {
+			if (finish_worker(&workers[printed++]))
+				ret = -1;
+		}
+	}
+
+out:
+	for (i = 0; i < nr; i++) {
+		if (workers[i].pid > 0 && !workers[i].done)
+			close(workers[i].fd);
+		if (workers[i].log)
+			fclose(workers[i].log);
+		free(workers[i].tests);
+	}
+	free(workers);
+	return ret;
+}
+
+static struct test *find_test(const char *category_name)
+{
+	struct test *test;
+	size_t len;
+	int i;
+
+	for (i = 0; i < TEST_PRIO_NUM; i++) {
+		list_for_each_entry(test, &test_list[i], node) {
+			len = strlen(test->category);
+			if (!strncmp(category_name, test->category, len) &&
+			    category_name[len] == '.' &&
+			    !strcmp(category_name + len + 1, test->name))
+				return test;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Load the spend of tests from --baseline file, the format is same as
+ * --results, the tests not found, such as removed, are ignored.
+ */
+static int load_baseline(const char *file)
+{
+	char line[512], category_name[256];
+	unsigned long spend_us;
+	struct test *test;
+	FILE *fp;
+	int n = 0;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		ulp_error("Open baseline %s failed, %m\n", file);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%255s %*d %*d %*d %lu", category_name,
+			   &spend_us) != 2)
+			continue;
+		test = find_test(category_name);
+		if (!test)
+			continue;
+		test->base_us = spend_us;
+		n++;
 	}
 
+	fclose(fp);
+	ulp_debug("Load %d tests from baseline %s\n", n, file);
 	return 0;
 }
 
@@ -586,6 +1055,7 @@ static void launch_tester(void)
 {
 	int i, fd;
 	struct test *test = NULL;
+	unsigned long start;
 
 	test_log("=========================================\n");
 	test_log("===\n");
@@ -611,8 +1081,32 @@ static void launch_tester(void)
 			close(fd);
 	}
 
+	if (!just_list_tests && baseline_file && load_baseline(baseline_file))
+		exit(1);
+
+	if (!just_list_tests && results_file) {
+		results_fp = fopen(results_file, "w");
+		if (!results_fp) {
+			ulp_error("Open results %s failed, %m\n", results_file);
+			exit(1);
+		}
+		fprintf(results_fp, "# category.name prio expect_ret real_ret "
+			"spend_us");
+		for (i = 0; use_perf && i < PERF_CNT_NUM; i++)
+			fprintf(results_fp, " %s", perf_counter_name(i));
+		fprintf(results_fp, "\n");
+	}
+
+	start = nsecs();
+
 	/* for each priority */
 	for (i = 0; i < TEST_PRIO_NUM; i++) {
+		if (nr_jobs > 1 && !just_list_tests) {
+			if (execute_tests_jobs(i))
+				goto print_stat;
+			continue;
+		}
+
 		/* for each test entry */
 		list_for_each_entry(test, &test_list[i], node) {
 			int ret;
@@ -632,6 +1126,13 @@ static void launch_tester(void)
 	}
 
 print_stat:
+	test_pool_destroy();
+	test_fixtures_release();
+
+	if (results_fp) {
+		fclose(results_fp);
+		results_fp = NULL;
+	}
 
 	if (just_list_tests) {
 		fprintf(stderr, "\n");
@@ -652,6 +1153,12 @@ print_stat:
 		total_spent_us / 1000,
 		total_spent_us * 1.0f / total / 1000.0f
 	);
+	if (nr_jobs > 1) {
+		fprintf(stderr, "===  Wall %lums, %d jobs\n",
+			(nsecs() - start) / 1000000UL, nr_jobs);
+	}
+	if (baseline_file)
+		fprintf(stderr, "===  Regressed %ld\n", nr_regressed);
 
 	if (stat_count[STAT_IDX_FAILED] > 0) {
 		fprintf(stderr,
@@ -664,6 +1171,22 @@ print_stat:
 		list_for_each_entry(test, &failed_list, failed)
 			show_test(test, true);
 	}
+
+	if (nr_regressed > 0) {
+		fprintf(stderr,
+			"\n"
+			"Show regressed test list, more than %d%%\n"
+			"\n"
+			" %-10s  %-4s %s.%s\n",
+			regress_percent,
+			"Idx/NUM", "Prio", "Category", "name"
+		);
+		list_for_each_entry(test, &regressed_list, regressed)
+			fprintf(stderr,
+				" %4d/%-4d  %-4d %s.%s\t%ldus -> %luus\n",
+				test->idx, nr_tests, test->prio, test->category,
+				test->name, test->base_us, test->spend_us);
+	}
 	test_log("=========================================\n");
 }
 
@@ -746,6 +1269,7 @@ int printer_print_hello(int nloop, const char *content)
 			__stringify(printer_print_hello), printer_print_hello,
 			__stringify(static_func1), static_func1);
 	hello_world();
+	bye_world();
 	return ret;
 }
 
@@ -964,25 +1488,38 @@ void never_called_stub(void)
 	CALL_TEST_STUB(patch_meta);
 	CALL_TEST_STUB(patch_object);
 	CALL_TEST_STUB(patch_patch);
+	CALL_TEST_STUB(patch_reloc);
 	CALL_TEST_STUB(patch_symbol);
 	CALL_TEST_STUB(test_signal);
 	CALL_TEST_STUB(task_core);
 	CALL_TEST_STUB(task_current);
+	CALL_TEST_STUB(task_decode);
 	CALL_TEST_STUB(task_proc);
+	CALL_TEST_STUB(task_search);
 	CALL_TEST_STUB(task_symbol);
+	CALL_TEST_STUB(task_verify);
 	CALL_TEST_STUB(task_vma);
+	CALL_TEST_STUB(task_vma_iter);
 	CALL_TEST_STUB(utils_ansi);
 	CALL_TEST_STUB(utils_backtrace);
 	CALL_TEST_STUB(utils_disasm);
+	CALL_TEST_STUB(utils_dl);
+	CALL_TEST_STUB(utils_emit);
+	CALL_TEST_STUB(utils_eytzinger);
 	CALL_TEST_STUB(utils_file);
+	CALL_TEST_STUB(utils_hash);
 	CALL_TEST_STUB(utils_id);
 	CALL_TEST_STUB(utils_init);
 	CALL_TEST_STUB(utils_list);
 	CALL_TEST_STUB(utils_log);
 	CALL_TEST_STUB(utils_rbtree);
+	CALL_TEST_STUB(utils_slab);
 	CALL_TEST_STUB(utils_string);
+	CALL_TEST_STUB(utils_time);
+	CALL_TEST_STUB(utils_uring);
 	CALL_TEST_STUB(utils_utils);
 	CALL_TEST_STUB(utils_version);
+	CALL_TEST_STUB(utils_zstd);
 }
 
 static void ulpatch_test_args_reset_stub(void)
@@ -1041,7 +1578,8 @@ int main(int argc, char *argv[])
 	release_tests();
 	free_filter_fmt_list();
 
-	return stat_count[STAT_IDX_FAILED] == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	return stat_count[STAT_IDX_FAILED] == 0 && nr_regressed == 0 ?
+		EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /* There are some selftests */
@@ -1399,3 +1937,148 @@ TEST(ulpatch_test, listener_epoll, 0)
 	return ret;
 }
 
+
+/**
+ * Throughput of the control channel, one request per message vs batched
+ * requests, the addresses must be same.
+ */
+TEST(ulpatch_test, listener_batch, 0)
+{
+	int ret = 0;
+	int status = 0;
+	pid_t pid;
+	int fd = -1, i, j, n, rslt, nr_syms, loops = 100;
+	const char *syms[CTRL_BATCH_MAX];
+	unsigned long addrs[CTRL_BATCH_MAX], addr;
+	unsigned long ns_single, ns_batch;
+
+	nr_syms = MIN(nr_test_symbols(), CTRL_BATCH_MAX);
+	for (i = 0; i < nr_syms; i++)
+		syms[i] = test_symbols[i].sym;
+
+	pid = fork();
+	if (pid == 0) {
+		char *_argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "listener",
+			"--listener-epoll",
+			NULL,
+		};
+		execvp(_argv[0], _argv);
+		exit(1);
+	}
+
+	/**
+	 * Wait for server init done. this method is not perfect.
+	 */
+	usleep(10000);
+
+	fd = listener_helper_create_test_client();
+	if (fd <= 0)
+		return -1;
+
+	ns_single = nsecs();
+	for (j = 0; j < loops; j++)
+		for (i = 0; i < nr_syms; i++)
+			listener_helper_symbol(fd, syms[i], &addrs[i]);
+	ns_single = nsecs() - ns_single;
+
+	ns_batch = nsecs();
+	for (j = 0; j < loops; j++) {
+		n = listener_helper_symbols(fd, syms, addrs, nr_syms);
+		if (n != nr_syms) {
+			ulp_error("Batch responded %d of %d\n", n, nr_syms);
+			ret = -1;
+			break;
+		}
+	}
+	ns_batch = nsecs() - ns_batch;
+
+	for (i = 0; i < nr_syms; i++) {
+		listener_helper_symbol(fd, syms[i], &addr);
+		if (addr != addrs[i]) {
+			ulp_error("%s: batch %lx, single %lx\n", syms[i],
+				  addrs[i], addr);
+			ret = -1;
+		}
+	}
+
+	ulp_info("%d requests, single %lu ns/req, batch %lu ns/req\n",
+		 loops * nr_syms, ns_single / (loops * nr_syms),
+		 ns_batch / (loops * nr_syms));
+
+	listener_helper_close(fd, &rslt);
+	listener_helper_close_test_client(fd);
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+
+	return ret;
+}
+
+/**
+ * The clean target is reused, the dirty one is killed, and the shared one
+ * is same for every caller.
+ */
+TEST(ulpatch_test, target_pool, 0)
+{
+	pid_t a, b, shared;
+	int i;
+
+	a = test_pool_get();
+	b = test_pool_get();
+	if (a <= 0 || b <= 0 || a == b)
+		return -1;
+	if (!proc_pid_exist(a) || !proc_pid_exist(b))
+		return -1;
+
+	test_pool_put(a, true);
+	if (test_pool_get() != a)
+		return -1;
+
+	test_pool_put(b, false);
+	for (i = 0; i < 1000 && proc_pid_exist(b); i++)
+		usleep(1000);
+	if (proc_pid_exist(b))
+		return -1;
+	test_pool_put(a, true);
+
+	shared = test_pool_shared();
+	if (shared <= 0 || shared != test_pool_shared())
+		return -1;
+	return 0;
+}
+
+/* Every fixture is opened once, and the references are balanced */
+TEST(ulpatch_test, fixtures, 0)
+{
+	struct bfd_elf_file *b1, *b2;
+	struct elf_file *e1, *e2;
+	int ret = 0, refs;
+
+	/* The task fixtures may have references of it too */
+	b1 = test_fixture_bfd(ulpatch_test_path);
+	refs = bfd_elf_file_refcount(b1);
+	b2 = test_fixture_bfd(ulpatch_test_path);
+	if (!b1 || b1 != b2 || bfd_elf_file_refcount(b1) != refs + 1)
+		ret = -1;
+	bfd_elf_close(b2);
+	bfd_elf_close(b1);
+	/* Still pinned by the fixture */
+	if (bfd_elf_file_refcount(b1) != refs - 1 || refs < 2)
+		ret = -1;
+
+	e1 = test_fixture_elf(ulpatch_test_path);
+	e2 = test_fixture_elf(ulpatch_test_path);
+	if (!e1 || e1 != e2)
+		ret = -1;
+	test_fixture_elf_put(e2);
+	test_fixture_elf_put(e1);
+
+	if (!test_fixture_task(FTO_VMA_ELF) ||
+	    test_fixture_task(FTO_VMA_ELF) != test_fixture_task(FTO_VMA_ELF))
+		ret = -1;
+
+	return ret;
+}
@@ -51,6 +51,11 @@ TEST(Patch_object, check, 0)
 			ulp_error("Get wrong pad 0-3.\n");
 			ret++;
 		}
+		/* SEC_ULPATCH_INDEX is filled by loader, not object file */
+		if (ulp_ei_index(info.hdr) || info.ulp_index) {
+			ulp_error("Wrong %s section.\n", SEC_ULPATCH_INDEX);
+			ret++;
+		}
 
 		release_load_info(&info);
 		fremove(tmpfile);
@@ -59,3 +64,102 @@ TEST(Patch_object, check, 0)
 	return ret;
 }
 
+
+TEST(Patch_object, check_cached, TEST_RET_SKIP)
+{
+	struct patch_check_stats st0, st;
+	int i, ret;
+
+	patch_check_flush();
+
+	for (i = 0; i < nr_ulpatch_objs(); i++) {
+		char *obj = ulpatch_objs[i].path;
+
+		if (!fexist(obj))
+			return TEST_RET_SKIP;
+
+		ret = check_patch_file(obj);
+		if (ret) {
+			ulp_error("Check %s failed, %d.\n", obj, ret);
+			return ret;
+		}
+
+		/* The unchanged object is never mapped again */
+		patch_check_get_stats(&st0);
+		ret = check_patch_file(obj);
+		patch_check_get_stats(&st);
+		if (ret || st.hits != st0.hits + 1 || st.misses != st0.misses) {
+			ulp_error("Check %s not cached.\n", obj);
+			return -1;
+		}
+	}
+
+	/* ELF but not patch */
+	ret = check_patch_file(ulpatch_test_path);
+	patch_check_flush();
+	return ret == -ENODATA ? 0 : -1;
+}
+
+/* Only the sections target needs are in the image, see alloc_patch_file() */
+TEST(Patch_object, image_layout, 0)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < nr_ulpatch_objs(); i++) {
+		struct load_info info = {};
+		char *obj = ulpatch_objs[i].path;
+		char *tmpfile = "copy.obj";
+		unsigned long text_end = 0, data_start = ~0UL;
+		GElf_Shdr *shdrs;
+		unsigned int j;
+
+		if (!fexist(obj))
+			return -EEXIST;
+
+		ret = alloc_patch_file(obj, tmpfile, &info);
+		if (ret)
+			return ret;
+
+		if (info.len > fsize(obj)) {
+			ulp_error("Image %lu bigger than %s\n", info.len, obj);
+			ret = -1;
+		}
+
+		shdrs = (void *)info.hdr + info.hdr->e_shoff;
+		for (j = 1; j < info.hdr->e_shnum; j++) {
+			GElf_Shdr *shdr = &shdrs[j];
+
+			if (shdr->sh_type == SHT_RELA ||
+			    shdr->sh_type == SHT_REL) {
+				ulp_error("Relocation %u in image.\n", j);
+				ret = -1;
+			}
+			if (!(shdr->sh_flags & SHF_ALLOC))
+				continue;
+			if (shdr->sh_flags & SHF_WRITE) {
+				data_start = MIN(data_start, shdr->sh_offset);
+			} else if (shdr->sh_flags & SHF_EXECINSTR) {
+				if (shdr->sh_offset % 64) {
+					ulp_error("Text %u not aligned.\n", j);
+					ret = -1;
+				}
+				text_end = MAX(text_end,
+					       shdr->sh_offset + shdr->sh_size);
+			}
+		}
+
+		if (data_start != ~0UL && (data_start % PAGE_SIZE ||
+		    data_start < text_end)) {
+			ulp_error("Data %lx shares page with text.\n",
+				  data_start);
+			ret = -1;
+		}
+
+		release_load_info(&info);
+		fremove(tmpfile);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include <utils/log.h>
 #include <utils/list.h>
@@ -10,6 +12,7 @@
 #include <elf/elf-api.h>
 #include <patch/asm.h>
 #include <patch/patch.h>
+#include <patch/ftrace-ring.h>
 
 #include <tests/test-api.h>
 
@@ -237,3 +240,609 @@ close_ret:
 	close_task(task);
 	return test_ret;
 }
+
+#define TEST_RING_EVENTS	(ULP_FTRACE_RING_EVENTS * 16)
+
+static void *ring_producer(void *arg)
+{
+	struct ulp_ftrace_ring *ring = arg;
+	struct ulp_ftrace_event *e;
+	unsigned long i;
+
+	for (i = 0; i < TEST_RING_EVENTS; i++) {
+		e = ulp_ftrace_ring_reserve(ring);
+		if (!e)
+			continue;
+		e->ns = nsecs();
+		e->type = ULP_FTRACE_ENTRY;
+		e->child_ip = i;
+		ulp_ftrace_ring_commit(ring);
+	}
+	return NULL;
+}
+
+TEST(Patch, ftrace_ring, 0)
+{
+	struct ulp_ftrace_ring *ring;
+	struct ulp_ftrace_event e;
+	unsigned long nr = 0, last = 0;
+	pthread_t thread;
+	bool done = false;
+	int ret = 0;
+
+	ring = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+	memset(ring, 0, sizeof(*ring));
+
+	if (pthread_create(&thread, NULL, ring_producer, ring)) {
+		free(ring);
+		return -1;
+	}
+
+	while (!done) {
+		done = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) +
+			__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) ==
+			TEST_RING_EVENTS;
+		while (ulp_ftrace_ring_pop(ring, &e)) {
+			/* In order, some of them may be dropped */
+			if (nr && e.child_ip <= last)
+				ret = -1;
+			last = e.child_ip;
+			nr++;
+		}
+	}
+
+	pthread_join(thread, NULL);
+
+	ulp_info("Ring %lu events, %lu dropped.\n", nr, ring->dropped);
+	if (nr + ring->dropped != TEST_RING_EVENTS)
+		ret = -1;
+
+	free(ring);
+	return ret;
+}
+
+TEST(Patch, ftrace_ring_wake, 0)
+{
+	struct ulp_ftrace_event e[ULP_FTRACE_WATERMARK];
+	struct ulp_ftrace_shm *shm;
+	struct ulp_ftrace_ring *ring;
+	int i, ret = 0;
+
+	shm = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*shm));
+	if (!shm)
+		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	ulp_ftrace_shm_init(shm);
+	ring = &shm->rings[0];
+
+	for (i = 0; i < shm->watermark; i++) {
+		ulp_ftrace_ring_reserve(ring)->child_ip = i;
+		ulp_ftrace_ring_commit(ring);
+	}
+
+	/* Consumer is not waiting */
+	if (ulp_ftrace_need_wake(shm, ring))
+		ret = -1;
+
+	shm->waiting = 1;
+	if (!ulp_ftrace_need_wake(shm, ring) || shm->waiting || shm->futex != 1)
+		ret = -1;
+	/* Only one producer wakes up the consumer */
+	if (ulp_ftrace_need_wake(shm, ring))
+		ret = -1;
+
+	if (ulp_ftrace_ring_pop_batch(ring, e, 16) != 16 || e[15].child_ip != 15)
+		ret = -1;
+	if (ulp_ftrace_ring_pop_batch(ring, e, ARRAY_SIZE(e)) !=
+	    shm->watermark - 16)
+		ret = -1;
+	if (ulp_ftrace_ring_pop_batch(ring, e, ARRAY_SIZE(e)))
+		ret = -1;
+
+	free(shm);
+	return ret;
+}
+
+TEST(Patch, ftrace_owner, 0)
+{
+	unsigned int mask = ULP_FTRACE_MAX_RINGS - 1;
+	struct ulp_ftrace_shm *shm;
+	int i, first, ret = 0;
+
+	shm = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*shm));
+	if (!shm)
+		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	ulp_ftrace_shm_init(shm);
+
+	if (ulp_ftrace_owner_claim(shm, 0x1000, false) != -1)
+		ret = -1;
+
+	/* Claimed, but not published before touched */
+	first = ulp_ftrace_owner_claim(shm, 0x1000, true);
+	if (first < 0 || ulp_ftrace_ring_live(shm, first) ||
+	    ulp_ftrace_owner_claim(shm, 0x1000, false) != first)
+		return -1;
+
+	ulp_ftrace_ring_touch(&shm->rings[first], ulp_page_size());
+	ulp_ftrace_owner_publish(shm, first, 1234, 1);
+	if (!ulp_ftrace_ring_live(shm, first) ||
+	    shm->rings[first].tid != 1234 || shm->owners[first].node != 1 ||
+	    shm->rings[first].head)
+		ret = -1;
+
+	/* Same hash, probe the next ones until all of them are claimed */
+	for (i = 1; i < ULP_FTRACE_MAX_RINGS; i++) {
+		if (ulp_ftrace_owner_claim(shm, 0x1000 + i, true) !=
+		    ((first + i) & mask))
+			ret = -1;
+	}
+	if (ulp_ftrace_owner_claim(shm, 0x2000, true) != -1)
+		ret = -1;
+	if (ulp_ftrace_owner_claim(shm, 0x1000 + 5, true) !=
+	    ((first + 5) & mask))
+		ret = -1;
+
+	free(shm);
+	return ret;
+}
+
+TEST(Patch, ftrace_hist, 0)
+{
+	struct ulp_ftrace_hist *hist;
+	int i, ret = 0;
+
+	hist = calloc(1, sizeof(*hist));
+	if (!hist)
+		return -ENOMEM;
+
+	if (ulp_ftrace_hist_bucket(0) != 0 || ulp_ftrace_hist_bucket(1) != 1 ||
+	    ulp_ftrace_hist_bucket(1023) != 10 ||
+	    ulp_ftrace_hist_bucket(1024) != 11 ||
+	    ulp_ftrace_hist_bucket(~0ULL) != ULP_FTRACE_HIST_BUCKETS - 1)
+		ret = -1;
+
+	if (ulp_ftrace_hist_percentile(hist, 50))
+		ret = -1;
+
+	/* 98 calls of 100ns, 2 calls of 1ms */
+	for (i = 0; i < 98; i++)
+		ulp_ftrace_hist_add(hist, 100);
+	ulp_ftrace_hist_add(hist, 1000000);
+	ulp_ftrace_hist_add(hist, 1000000);
+
+	if (hist->count != 100 || hist->max_ns != 1000000 ||
+	    hist->sum_ns != 98 * 100 + 2 * 1000000)
+		ret = -1;
+
+	/* 100ns in [64, 128), 1ms in [2^19, 2^20) */
+	if (ulp_ftrace_hist_percentile(hist, 50) != 128 ||
+	    ulp_ftrace_hist_percentile(hist, 98) != 128 ||
+	    ulp_ftrace_hist_percentile(hist, 99) != 1UL << 20 ||
+	    ulp_ftrace_hist_percentile(hist, 100) != 1UL << 20)
+		ret = -1;
+
+	free(hist);
+	return ret;
+}
+
+TEST(Patch, ftrace_filter, 0)
+{
+	struct ulp_ftrace_shm *shm;
+	int i, ret = 0;
+
+	shm = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*shm));
+	if (!shm)
+		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	ulp_ftrace_shm_init(shm);
+
+	/* Trace all */
+	if (!ulp_ftrace_filter_match(shm, 0x1234))
+		ret = -1;
+
+	/* [0x1000, 0x1010), [0x1100, 0x1110), ... */
+	for (i = 0; i < 100; i++) {
+		shm->filters[i].start = 0x1000 + i * 0x100;
+		shm->filters[i].end = shm->filters[i].start + 0x10;
+	}
+	shm->nr_filters = i;
+
+	if (ulp_ftrace_filter_match(shm, 0xfff) ||
+	    !ulp_ftrace_filter_match(shm, 0x1000) ||
+	    !ulp_ftrace_filter_match(shm, 0x100f) ||
+	    ulp_ftrace_filter_match(shm, 0x1010) ||
+	    !ulp_ftrace_filter_match(shm, 0x1000 + 99 * 0x100 + 8) ||
+	    ulp_ftrace_filter_match(shm, 0x1000 + 99 * 0x100 + 0x10) ||
+	    !ulp_ftrace_filter_match(shm, 0x1000 + 50 * 0x100))
+		ret = -1;
+
+	/* Slot of counters in count mode */
+	if (ulp_ftrace_filter_index(shm, 0x1000) != 0 ||
+	    ulp_ftrace_filter_index(shm, 0x1000 + 50 * 0x100 + 4) != 50 ||
+	    ulp_ftrace_filter_index(shm, 0x1000 + 99 * 0x100) != 99 ||
+	    ulp_ftrace_filter_index(shm, 0x1000 + 50 * 0x100 + 0x20) != -1)
+		ret = -1;
+
+	free(shm);
+	return ret;
+}
+
+TEST(Patch, ftrace_pred, 0)
+{
+	struct ulp_ftrace_pred pred = { .arg = 1 };
+	struct ulp_ftrace_shm *shm;
+	int i, n, ret = 0;
+
+	pred.op = ULP_FTRACE_PRED_EQ;
+	pred.val = 16;
+	if (!ulp_ftrace_pred_test(&pred, 16) || ulp_ftrace_pred_test(&pred, 15))
+		ret = -1;
+
+	/* Signed */
+	pred.op = ULP_FTRACE_PRED_LT;
+	pred.val = 0;
+	if (!ulp_ftrace_pred_test(&pred, -1) || ulp_ftrace_pred_test(&pred, 0))
+		ret = -1;
+
+	pred.op = ULP_FTRACE_PRED_AND;
+	pred.val = 0x6;
+	if (!ulp_ftrace_pred_test(&pred, 0x4) || ulp_ftrace_pred_test(&pred, 0x9))
+		ret = -1;
+
+	shm = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*shm));
+	if (!shm)
+		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	ulp_ftrace_shm_init(shm);
+
+	if (!ulp_ftrace_tid_match(shm, 100))
+		ret = -1;
+	shm->tids[shm->nr_tids++] = 100;
+	if (!ulp_ftrace_tid_match(shm, 100) || ulp_ftrace_tid_match(shm, 101))
+		ret = -1;
+
+	/* 1 in 4 and 1 in 3 calls, the first one is recorded */
+	shm->sample = 4;
+	for (i = 0, n = 0; i < 100; i++)
+		n += ulp_ftrace_sample(shm, &shm->rings[0]);
+	if (n != 25 || shm->rings[0].calls != 100)
+		ret = -1;
+
+	shm->sample = 3;
+	for (i = 0, n = 0; i < 100; i++)
+		n += ulp_ftrace_sample(shm, &shm->rings[1]);
+	if (n != 34)
+		ret = -1;
+
+	free(shm);
+	return ret;
+}
+
+TEST(Patch, ftrace_cost, 0)
+{
+	struct ulp_ftrace_cost cost = { .calls = 0, .cycles = 0 };
+	uint64_t c0, c1;
+	int ret = 0;
+
+	if (ulp_ftrace_cost_cycles(&cost, 20) != 0)
+		ret = -1;
+
+	/* The cycles of reading counter is excluded */
+	cost.calls = 100;
+	cost.cycles = 100 * 50;
+	if (ulp_ftrace_cost_cycles(&cost, 20) != 30)
+		ret = -1;
+
+	/* Never negative */
+	if (ulp_ftrace_cost_cycles(&cost, 60) != 0)
+		ret = -1;
+
+	c0 = ulp_ftrace_cycles();
+	usleep(1000);
+	c1 = ulp_ftrace_cycles();
+	if (c1 <= c0)
+		ret = -1;
+
+	return ret;
+}
+
+TEST(Patch, ftrace_stack, 0)
+{
+	uint64_t a[] = { 0x1000, 0x2010, 0x3020 }, b[] = { 0x1000, 0x2040 };
+	struct ulp_ftrace_shm *shm;
+	unsigned int i, nr = 0;
+	uint64_t calls = 0;
+	int ret = 0;
+
+	shm = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*shm));
+	if (!shm)
+		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	ulp_ftrace_shm_init(shm);
+
+	if (!ulp_ftrace_stack_add(shm, a, ARRAY_SIZE(a)) ||
+	    !ulp_ftrace_stack_add(shm, a, ARRAY_SIZE(a)) ||
+	    !ulp_ftrace_stack_add(shm, b, ARRAY_SIZE(b)))
+		ret = -1;
+
+	/* Same stack is counted in one slot */
+	for (i = 0; i < ULP_FTRACE_STACKS; i++) {
+		const struct ulp_ftrace_stack *s = &shm->stacks[i];
+
+		if (!s->nr)
+			continue;
+		nr++;
+		calls += s->count;
+		if (s->nr == ARRAY_SIZE(a) &&
+		    (s->count != 2 || memcmp(s->ips, a, sizeof(a))))
+			ret = -1;
+		if (s->nr == ARRAY_SIZE(b) &&
+		    (s->count != 1 || memcmp(s->ips, b, sizeof(b))))
+			ret = -1;
+	}
+	if (nr != 2 || calls != 3)
+		ret = -1;
+
+	/* A prefix is another stack */
+	if (ulp_ftrace_stack_hash(a, 2) == ulp_ftrace_stack_hash(a, 3))
+		ret = -1;
+
+	free(shm);
+	return ret;
+}
+
+TEST(Patch, ftrace_cover, 0)
+{
+	struct ulp_ftrace_shm *shm;
+	unsigned int i;
+	int ret = 0;
+
+	shm = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*shm));
+	if (!shm)
+		return -ENOMEM;
+	memset(shm, 0, sizeof(*shm));
+	ulp_ftrace_shm_init(shm);
+
+	/* 100 functions of 0x10 bytes, with a hole after each one */
+	for (i = 0; i < 100; i++) {
+		shm->cover[i].start = 0x1000 + i * 0x20;
+		shm->cover[i].end = shm->cover[i].start + 0x10;
+	}
+	shm->nr_cover = 100;
+
+	ulp_ftrace_cover_hit(shm, 0x1004);
+	ulp_ftrace_cover_hit(shm, 0x1004);
+	/* The 65th one, in the second word */
+	ulp_ftrace_cover_hit(shm, 0x1000 + 64 * 0x20 + 0xf);
+	/* The holes and out of table */
+	ulp_ftrace_cover_hit(shm, 0x1010);
+	ulp_ftrace_cover_hit(shm, 0x100);
+	ulp_ftrace_cover_hit(shm, 0x1000 + 100 * 0x20);
+
+	for (i = 0; i < 100; i++) {
+		if (ulp_ftrace_cover_test(shm, i) != (i == 0 || i == 64))
+			ret = -1;
+	}
+	if (shm->cover_bits[0] != 1 || shm->cover_bits[1] != 1)
+		ret = -1;
+
+	free(shm);
+	return ret;
+}
+
+TEST(Patch, ftrace_args, 0)
+{
+	struct ulp_ftrace_event e[1 + ULP_FTRACE_ARGS_SLOTS(40)];
+	uint8_t args[40], *p = args;
+	struct ulp_ftrace_ring *ring;
+	unsigned int i, n, len;
+	int ret = 0;
+
+	ring = aligned_alloc(ULP_FTRACE_CACHELINE, sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+	memset(ring, 0, sizeof(*ring));
+
+	/* tag, zigzag -1, tag, 3 bytes varint, the rest are string */
+	*p++ = ULP_FTRACE_ARG_TAG(1, ULP_FTRACE_ARG_INT);
+	p = ulp_ftrace_put_varint(p, ulp_ftrace_zigzag(-1));
+	*p++ = ULP_FTRACE_ARG_TAG(2, ULP_FTRACE_ARG_HEX);
+	p = ulp_ftrace_put_varint(p, 0x10000);
+	if (p - args != 6 || args[1] != 1 || args[5] != 0x4)
+		ret = -1;
+	for (; p < args + sizeof(args); p++)
+		*p = p - args;
+
+	len = sizeof(args);
+	n = 1 + ULP_FTRACE_ARGS_SLOTS(len);
+	if (n != 3)
+		ret = -1;
+
+	/* The slots wrap around the end of ring */
+	ring->head = ring->tail = ULP_FTRACE_RING_EVENTS - 1;
+	if (!ulp_ftrace_ring_reserve_n(ring, n))
+		ret = -1;
+	ulp_ftrace_ring_slot(ring, 0)->type = ULP_FTRACE_ENTRY | len << 16;
+	for (i = 1; i < n; i++)
+		memcpy(ulp_ftrace_ring_slot(ring, i)->data,
+		       args + (i - 1) * sizeof(*e),
+		       MIN(len - (i - 1) * sizeof(*e), sizeof(*e)));
+	ulp_ftrace_ring_commit_n(ring, n);
+
+	if (ulp_ftrace_ring_pop_batch(ring, e, ARRAY_SIZE(e)) != n ||
+	    ULP_FTRACE_EVENT_TYPE(e[0].type) != ULP_FTRACE_ENTRY ||
+	    ULP_FTRACE_EVENT_ARGS(e[0].type) != len ||
+	    memcmp(&e[1], args, len))
+		ret = -1;
+
+	/* All or none */
+	ring->head = ring->tail + ULP_FTRACE_RING_EVENTS - 2;
+	if (ulp_ftrace_ring_reserve_n(ring, 3) || ring->dropped != 1 ||
+	    !ulp_ftrace_ring_reserve_n(ring, 2))
+		ret = -1;
+
+	free(ring);
+	return ret;
+}
+
+TEST(Patch, perf_map_remove, 0)
+{
+	/* No such process, the file is never read by any profiler */
+	pid_t pid = INT_MAX;
+	char path[PATH_MAX], buf[256];
+	const char *lines =
+		"1000 10 jit_func\n"
+		"2000 20 ulp_func_a\n"
+		"2100 30 ulp_func_b\n"
+		"3000 10 jit_func2\n";
+	int ret = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), PATCH_PERF_MAP_FMT, pid);
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+	fputs(lines, fp);
+	fclose(fp);
+
+	/* The JIT lines are kept */
+	if (perf_map_remove(pid, 0x2000, 0x1000))
+		ret = -1;
+	if (fload(path, buf, sizeof(buf)) < 0 ||
+	    strcmp(buf, "1000 10 jit_func\n3000 10 jit_func2\n"))
+		ret = -1;
+
+	/* Removed if nothing left */
+	if (perf_map_remove(pid, 0, -1UL) || fexist(path))
+		ret = -1;
+
+	/* No file */
+	if (perf_map_remove(pid, 0, -1UL))
+		ret = -1;
+
+	fremove(path);
+	return ret;
+}
+
+/**
+ * The entry of orig_asm_fn() has PC-relative load, conditional branch out of
+ * the relocated bytes, and a call crosses the end of them. Return the
+ * orig_asm_val + x + 1 if orig_asm_val is not zero, otherwise -1.
+ */
+int orig_asm_fn(int x);
+extern int orig_asm_val;
+
+#if defined(__x86_64__)
+__asm__(
+	"	.data\n"
+	"	.p2align 2\n"
+	"	.globl orig_asm_val\n"
+	"orig_asm_val:\n"
+	"	.long 0\n"
+	"	.text\n"
+	"	.globl orig_asm_fn\n"
+	"	.type orig_asm_fn, @function\n"
+	"orig_asm_fn:\n"
+	"	endbr64\n"
+	"	mov orig_asm_val(%rip), %eax\n"
+	"	test %eax, %eax\n"
+	"	je 1f\n"
+	"	call orig_asm_add\n"
+	"	ret\n"
+	"1:	mov $-1, %eax\n"
+	"	ret\n"
+	"orig_asm_add:\n"
+	"	lea 1(%rdi,%rax), %eax\n"
+	"	ret\n"
+	"	.size orig_asm_fn, .-orig_asm_fn\n"
+	"	.skip 32, 0xcc\n"
+);
+#elif defined(__aarch64__)
+__asm__(
+	"	.data\n"
+	"	.p2align 2\n"
+	"	.globl orig_asm_val\n"
+	"orig_asm_val:\n"
+	"	.long 0\n"
+	"	.text\n"
+	"	.p2align 2\n"
+	"	.globl orig_asm_fn\n"
+	"	.type orig_asm_fn, %function\n"
+	"orig_asm_fn:\n"
+	"	adrp x1, orig_asm_val\n"
+	"	ldr w1, [x1, :lo12:orig_asm_val]\n"
+	"	cbz w1, 1f\n"
+	"	add w0, w0, w1\n"
+	"	b orig_asm_add\n"
+	"1:	mov w0, #-1\n"
+	"	ret\n"
+	"orig_asm_add:\n"
+	"	add w0, w0, #1\n"
+	"	ret\n"
+	"	.size orig_asm_fn, .-orig_asm_fn\n"
+	"	.skip 32\n"
+);
+#endif
+
+TEST(Patch, orig_tramp, 0)
+{
+	unsigned long ip = (unsigned long)orig_asm_fn;
+	size_t page = ulp_page_size(), used;
+	size_t need = sizeof(struct jmp_table_entry);
+	struct ulpatch_orig *o;
+	int (*fn)(int);
+	int ret = 0;
+	ssize_t n;
+	void *mem;
+
+	/* The trampoline must be near to the PC-relative targets */
+	mem = mmap((void *)(ip & ~(page - 1)) - SZ_1M, page,
+		   PROT_READ | PROT_WRITE | PROT_EXEC,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -errno;
+	if (labs((long)((unsigned long)mem - ip)) > SZ_64M) {
+		ulp_warning("Trampoline at %p is far from %lx, skip.\n", mem,
+			    ip);
+		goto out;
+	}
+
+	o = mem;
+	fn = (void *)o->tramp;
+
+	/* Same as setup_orig_tramps() */
+	n = arch_orig_tramp(ip, (void *)ip, need * 2, need,
+			    (unsigned long)o->tramp, o->tramp,
+			    sizeof(o->tramp), (unsigned long)&o->addr, &used);
+	if (n < 0 || used < need) {
+		ulp_error("Relocate orig_asm_fn failed, %s.\n",
+			  strerror(n < 0 ? -n : EINVAL));
+		ret = -1;
+		goto out;
+	}
+	o->addr = ip + used;
+	__builtin___clear_cache(mem, mem + page);
+	fdisasm_arch(stdout, NULL, (unsigned long)o->tramp, o->tramp, n);
+
+	orig_asm_val = 41;
+	if (orig_asm_fn(0) != 42 || fn(0) != 42 || fn(1) != 43)
+		ret = -1;
+	orig_asm_val = 0;
+	if (fn(0) != -1)
+		ret = -1;
+
+	/* Nothing relocated, jump to the original one directly */
+	n = arch_orig_tramp(0, NULL, 0, 0, (unsigned long)o->tramp, o->tramp,
+			    sizeof(o->tramp), (unsigned long)&o->addr, &used);
+	o->addr = ip;
+	__builtin___clear_cache(mem, mem + page);
+	orig_asm_val = 1;
+	if (n < 0 || used || fn(1) != 3)
+		ret = -1;
+out:
+	munmap(mem, page);
+	return ret;
+}
@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <string.h>
+
+#include <utils/log.h>
+#include <utils/list.h>
+#include <utils/util.h>
+#include <elf/elf-api.h>
+#include <patch/patch.h>
+
+#include <tests/test-api.h>
+
+TEST_STUB(patch_reloc);
+
+#if defined(__x86_64__)
+
+/* The patch is loaded here in target, see struct load_info::target_hdr */
+#define RELOC_TARGET_HDR	0x7f1200000000UL
+#define RELOC_IMAGE_SIZE	4096
+#define RELOC_SYMTAB_OFF	2048
+/* The location of relocation */
+#define RELOC_OFF		256
+
+/**
+ * A fake patch image of one symbol, only the fields read by
+ * arch_plan_relocs() are set.
+ */
+struct reloc_test {
+	struct load_info info;
+	GElf_Shdr sechdrs[2];
+	char image[RELOC_IMAGE_SIZE] __align(8);
+	struct reloc_log log;
+	struct reloc_plan plan;
+	struct reloc_plans plans;
+};
+
+static void reloc_test_init(struct reloc_test *t, uint32_t type,
+			    unsigned long value, int64_t addend)
+{
+	Elf64_Sym *syms;
+
+	memset(t, 0, sizeof(*t));
+
+	t->info.hdr = (void *)t->image;
+	t->info.len = RELOC_IMAGE_SIZE;
+	t->info.target_hdr = RELOC_TARGET_HDR;
+	t->info.sechdrs = t->sechdrs;
+	t->info.strtab = "\0sym";
+	t->info.index.sym = 1;
+	t->sechdrs[1].sh_offset = RELOC_SYMTAB_OFF;
+	t->sechdrs[1].sh_size = 2 * sizeof(Elf64_Sym);
+
+	syms = (void *)t->image + RELOC_SYMTAB_OFF;
+	syms[1].st_name = 1;
+	syms[1].st_value = value;
+	syms[1].st_shndx = 1;
+	syms[1].st_info = GELF_ST_INFO(STB_GLOBAL, STT_FUNC);
+
+	t->log.offset = RELOC_OFF;
+	t->log.sym = 1;
+	t->log.type = type;
+	t->log.addend = addend;
+
+	t->plans.ents = &t->plan;
+}
+
+static Elf64_Sym *reloc_test_sym(struct reloc_test *t)
+{
+	return (void *)t->image + RELOC_SYMTAB_OFF + sizeof(Elf64_Sym);
+}
+
+static int reloc_test_plan(struct reloc_test *t)
+{
+	return arch_plan_relocs(&t->info, &t->log, 1, &t->plans);
+}
+
+/* P of the location in target */
+#define RELOC_P	(RELOC_TARGET_HDR + RELOC_OFF)
+
+TEST(Patch_reloc, x86_64_NONE, 0)
+{
+	struct reloc_test t;
+
+	reloc_test_init(&t, R_X86_64_NONE, 0x1000, 0);
+	if (reloc_test_plan(&t) || t.plan.size != 0)
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_64, 0)
+{
+	struct reloc_test t;
+
+	/* S + A, any 64bit value */
+	reloc_test_init(&t, R_X86_64_64, 0xffff800012345678UL, 0x10);
+	if (reloc_test_plan(&t) || t.plan.size != 8 ||
+	    t.plan.offset != RELOC_OFF ||
+	    t.plan.u64 != 0xffff800012345688UL)
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_32, 0)
+{
+	struct reloc_test t;
+
+	reloc_test_init(&t, R_X86_64_32, 0xfffffff0UL, 0xf);
+	if (reloc_test_plan(&t) || t.plan.size != 4 ||
+	    t.plan.u32 != 0xffffffffU)
+		return -1;
+
+	/* Zero extended, the 33rd bit overflows */
+	reloc_test_init(&t, R_X86_64_32, 0xfffffff0UL, 0x10);
+	if (reloc_test_plan(&t) != -ERANGE)
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_32S, 0)
+{
+	struct reloc_test t;
+
+	/* Sign extended, the kernel like address */
+	reloc_test_init(&t, R_X86_64_32S, 0xffffffff80000000UL, 0);
+	if (reloc_test_plan(&t) || t.plan.size != 4 ||
+	    t.plan.u32 != 0x80000000U)
+		return -1;
+
+	/* Fits R_X86_64_32, not R_X86_64_32S */
+	reloc_test_init(&t, R_X86_64_32S, 0x80000000UL, 0);
+	if (reloc_test_plan(&t) != -ERANGE)
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_PC32, 0)
+{
+	struct reloc_test t;
+
+	/* S + A - P */
+	reloc_test_init(&t, R_X86_64_PC32, RELOC_TARGET_HDR + 0x100000, -4);
+	if (reloc_test_plan(&t) || t.plan.size != 4 ||
+	    t.plan.u32 != (uint32_t)(RELOC_TARGET_HDR + 0x100000 - 4 -
+				     RELOC_P))
+		return -1;
+
+	/* Backward */
+	reloc_test_init(&t, R_X86_64_PC32, RELOC_TARGET_HDR - 0x1000, -4);
+	if (reloc_test_plan(&t) ||
+	    (int32_t)t.plan.u32 != -(0x1000 + 4 + RELOC_OFF))
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_PLT32, 0)
+{
+	struct reloc_test t;
+
+	/* The same as R_X86_64_PC32, the symbol is resolved already */
+	reloc_test_init(&t, R_X86_64_PLT32, RELOC_TARGET_HDR + 0x2000, -4);
+	if (reloc_test_plan(&t) || t.plan.size != 4 ||
+	    t.plan.u32 != (uint32_t)(0x2000 - 4 - RELOC_OFF))
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_PC64, 0)
+{
+	struct reloc_test t;
+
+	/* Never overflow */
+	reloc_test_init(&t, R_X86_64_PC64, 0x400000UL, 0);
+	if (reloc_test_plan(&t) || t.plan.size != 8 ||
+	    t.plan.u64 != 0x400000UL - RELOC_P)
+		return -1;
+	return 0;
+}
+
+/* Not TLS, the same as R_X86_64_PC32 */
+static int test_gotpcrel(uint32_t type)
+{
+	struct reloc_test t;
+
+	reloc_test_init(&t, type, RELOC_TARGET_HDR + 0x3000, -4);
+	if (reloc_test_plan(&t) || t.plan.size != 4 ||
+	    t.plan.u32 != (uint32_t)(0x3000 - 4 - RELOC_OFF))
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_GOTPCREL, 0)
+{
+	return test_gotpcrel(R_X86_64_GOTPCREL);
+}
+
+TEST(Patch_reloc, x86_64_GOTPCRELX, 0)
+{
+	return test_gotpcrel(R_X86_64_GOTPCRELX);
+}
+
+TEST(Patch_reloc, x86_64_REX_GOTPCRELX, 0)
+{
+	return test_gotpcrel(R_X86_64_REX_GOTPCRELX);
+}
+
+TEST(Patch_reloc, x86_64_GOTTPOFF, 0)
+{
+	struct reloc_test t;
+
+	/**
+	 * The defined TLS symbol, the GOT entry is in the patch already,
+	 * A + target_hdr - 4 - P.
+	 */
+	reloc_test_init(&t, R_X86_64_GOTTPOFF, 0x10, 0x800);
+	reloc_test_sym(&t)->st_info = GELF_ST_INFO(STB_GLOBAL, STT_TLS);
+	if (reloc_test_plan(&t) || t.plan.size != 4 ||
+	    (int32_t)t.plan.u32 != 0x800 - 4 - RELOC_OFF)
+		return -1;
+	return 0;
+}
+
+/* Should not be present, nothing is written */
+TEST(Patch_reloc, x86_64_TPOFF64, 0)
+{
+	struct reloc_test t;
+
+	reloc_test_init(&t, R_X86_64_TPOFF64, 0x10, 0);
+	if (reloc_test_plan(&t) || t.plan.size != 0)
+		return -1;
+	return 0;
+}
+
+TEST(Patch_reloc, x86_64_TPOFF32, 0)
+{
+	struct reloc_test t;
+
+	reloc_test_init(&t, R_X86_64_TPOFF32, 0x10, 0);
+	if (reloc_test_plan(&t) || t.plan.size != 0)
+		return -1;
+	return 0;
+}
+
+/* Not in the table */
+TEST(Patch_reloc, x86_64_COPY, 0)
+{
+	struct reloc_test t;
+
+	reloc_test_init(&t, R_X86_64_COPY, 0x10, 0);
+	if (reloc_test_plan(&t) != -ENOEXEC)
+		return -1;
+	return 0;
+}
+
+/**
+ * All relocations are planned and range checked before any byte is
+ * written, the out of range one fails the whole patch, and reports the
+ * undefined symbol to retry near it.
+ */
+TEST(Patch_reloc, plan_range, 0)
+{
+	struct reloc_test t;
+	struct reloc_log log[3];
+	struct reloc_plan plan[3];
+	char image[RELOC_IMAGE_SIZE];
+	unsigned long far = RELOC_TARGET_HDR + 4UL * SZ_1G;
+	int i, err;
+
+	reloc_test_init(&t, R_X86_64_PC32, far, -4);
+	reloc_test_sym(&t)->st_shndx = SHN_UNDEF;
+
+	for (i = 0; i < 3; i++) {
+		log[i] = t.log;
+		log[i].offset = RELOC_OFF + i * 8;
+	}
+	log[0].type = R_X86_64_64;
+	log[1].type = R_X86_64_PC64;
+	t.plans.ents = plan;
+
+	memcpy(image, t.image, sizeof(image));
+	err = arch_plan_relocs(&t.info, log, 3, &t.plans);
+	if (err != -ERANGE || t.plans.range_near != far)
+		return -1;
+	/* Only planned, never written */
+	if (memcmp(image, t.image, sizeof(image)))
+		return -1;
+
+	/* In range now, all of them are planned */
+	reloc_test_sym(&t)->st_value = RELOC_TARGET_HDR + SZ_1M;
+	t.plans.range_near = 0;
+	memcpy(image, t.image, sizeof(image));
+	err = arch_plan_relocs(&t.info, log, 3, &t.plans);
+	if (err || t.plans.range_near ||
+	    plan[0].u64 != RELOC_TARGET_HDR + SZ_1M - 4 ||
+	    plan[1].u64 != SZ_1M - 4 - RELOC_OFF - 8 ||
+	    plan[2].u32 != (uint32_t)(SZ_1M - 4 - RELOC_OFF - 16))
+		return -1;
+	if (memcmp(image, t.image, sizeof(image)))
+		return -1;
+	return 0;
+}
+
+/* The location must be zero, unless it's replayed, see rebase_prelink() */
+TEST(Patch_reloc, plan_replay, 0)
+{
+	struct reloc_test t;
+	uint64_t old = 0x1234;
+
+	reloc_test_init(&t, R_X86_64_64, 0x4000, 0);
+	memcpy(t.image + RELOC_OFF, &old, sizeof(old));
+	if (reloc_test_plan(&t) != -ENOEXEC)
+		return -1;
+
+	t.plans.replay = true;
+	if (reloc_test_plan(&t) || t.plan.u64 != 0x4000)
+		return -1;
+
+	/* Beyond the image */
+	t.log.offset = RELOC_IMAGE_SIZE - 4;
+	if (reloc_test_plan(&t) != -ENOEXEC)
+		return -1;
+	return 0;
+}
+
+#endif /* __x86_64__ */
@@ -1,6 +1,11 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 
@@ -15,7 +20,8 @@
 
 TEST_STUB(patch_symbol);
 
-static int test_task_patch(int fto_flags, int (*cb)(struct task_struct *))
+static int test_task_patch_obj(int fto_flags, const char *obj,
+			       int (*cb)(struct task_struct *))
 {
 	int ret = -1;
 	int status = 0;
@@ -42,11 +48,9 @@ static int test_task_patch(int fto_flags, int (*cb)(struct task_struct *))
 
 	struct task_struct *task = open_task(pid, fto_flags);
 
-	ret = init_patch(task, ULPATCH_OBJ_FTRACE_MCOUNT_PATH);
-	if (ret == -EEXIST) {
-		fprintf(stderr, "%s not exist. make install\n",
-			ULPATCH_OBJ_FTRACE_MCOUNT_PATH);
-	}
+	ret = init_patch(task, obj);
+	if (ret == -EEXIST)
+		fprintf(stderr, "%s not exist. make install\n", obj);
 
 	if (cb)
 		ret = cb(task);
@@ -67,6 +71,12 @@ static int test_task_patch(int fto_flags, int (*cb)(struct task_struct *))
 	return ret;
 }
 
+static int test_task_patch(int fto_flags, int (*cb)(struct task_struct *))
+{
+	return test_task_patch_obj(fto_flags, ULPATCH_OBJ_FTRACE_MCOUNT_PATH,
+				   cb);
+}
+
 TEST(Patch_sym, init_patch, TEST_RET_SKIP)
 {
 	return test_task_patch(FTO_ULFTRACE, NULL);
@@ -95,3 +105,465 @@ TEST(Patch_sym, find_task_symbol_list, 0)
 	return test_task_patch(FTO_ULFTRACE, find_task_symbol);
 }
 
+/* The patch symbols are linked on the first lookup, see load_ulp_syms() */
+static int check_ulp_syms(struct task_struct *task)
+{
+	struct vma_ulp *ulp;
+	struct task_sym *tsym;
+
+	if (list_empty(&task->ulp_list)) {
+		ulp_error("No patch loaded.\n");
+		return -1;
+	}
+
+	ulp = list_first_entry(&task->ulp_list, struct vma_ulp, node);
+	tsym = find_task_sym(task, ulp->strtab.src_func, NULL, NULL);
+	if (!tsym || tsym->vma != ulp->vma) {
+		ulp_error("Not found patch symbol %s\n", ulp->strtab.src_func);
+		return -1;
+	}
+
+	if (ulp->syms_lazy || task->tsyms.nr_lazy_ulps) {
+		ulp_error("Patch symbols still lazy.\n");
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, lazy_ulp_syms, TEST_RET_SKIP)
+{
+	return test_task_patch(FTO_ULFTRACE, check_ulp_syms);
+}
+
+
+static struct patch_prelink_stats prelink_st0;
+
+static int check_prelink(struct task_struct *task)
+{
+	struct patch_prelink_stats st;
+
+	/* Every patched task either hit or saved a prelink entry */
+	patch_prelink_get_stats(&st);
+	if (st.hits + st.misses <= prelink_st0.hits + prelink_st0.misses ||
+	    !st.nr_entries) {
+		ulp_error("No prelink lookup.\n");
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, prelink, TEST_RET_SKIP)
+{
+	int ret;
+
+	patch_prelink_enable(true);
+	patch_prelink_get_stats(&prelink_st0);
+
+	ret = test_task_patch(FTO_ULFTRACE, check_prelink);
+
+	patch_prelink_flush();
+	return ret;
+}
+
+static int check_patch_pool(struct task_struct *task)
+{
+	struct vma_ulp *ulp;
+
+	list_for_each_entry(ulp, &task->ulp_list, node) {
+		if (ulp->slot >= 0 && ulp->vma->ulp_pool &&
+		    ulp->vma->ulp_pool->used & BIT(ulp->slot))
+			return 0;
+	}
+
+	ulp_error("No patch in patch pool.\n");
+	return -1;
+}
+
+TEST(Patch_sym, init_patch_pool, TEST_RET_SKIP)
+{
+	int ret;
+
+	patch_pool_enable(true);
+	ret = test_task_patch(FTO_ULFTRACE, check_patch_pool);
+	patch_pool_enable(false);
+
+	return ret;
+}
+
+/* The far patch jumps through the veneer, the near one jumps directly */
+static int check_veneer(struct task_struct *task)
+{
+	struct vma_ulp *ulp;
+	struct vm_area_struct *vma;
+
+	ulp = find_ulp_by_id(task, task->max_ulp_id);
+	if (!ulp || verify_patch(task, ulp)) {
+		ulp_error("Patch is not verified.\n");
+		return -1;
+	}
+
+	if (!(ulp->info.flags & ULP_INFO_F_VENEER))
+		return 0;
+
+	task_for_each_vma(vma, task) {
+		if (vma->type == VMA_ULPATCH && vma->ulp_veneer)
+			return 0;
+	}
+
+	ulp_error("No veneer island.\n");
+	return -1;
+}
+
+TEST(Patch_sym, init_patch_veneer, TEST_RET_SKIP)
+{
+	int ret;
+
+	patch_veneer_enable(true);
+	ret = test_task_patch(FTO_ULFTRACE, check_veneer);
+	patch_veneer_enable(false);
+
+	return ret;
+}
+
+static int check_counters(struct task_struct *task)
+{
+	unsigned long counts[ULPATCH_MAX_FUNCS];
+	struct vma_ulp *ulp;
+
+	ulp = find_ulp_by_id(task, task->max_ulp_id);
+	if (!ulp || !(ulp->info.flags & ULP_INFO_F_COUNTER)) {
+		ulp_error("Patch is not loaded with counters.\n");
+		return -1;
+	}
+
+	if (read_patch_counters(task, ulp, counts)) {
+		ulp_error("Read counters of %lx failed.\n", ulp->counters);
+		return -1;
+	}
+	ulp_info("%s is called %lu times.\n", ulp->strtab.dst_func,
+		 counts[0]);
+	return 0;
+}
+
+TEST(Patch_sym, init_patch_counter, TEST_RET_SKIP)
+{
+	int ret;
+
+	patch_counter_enable(true);
+	ret = test_task_patch(FTO_ULFTRACE, check_counters);
+	patch_counter_enable(false);
+
+	return ret;
+}
+
+static int check_multi_patch(struct task_struct *task)
+{
+	struct patch_stop_stats st;
+
+	/* Both functions of multi.ulp are written in one stop window */
+	patch_get_stop_stats(&st);
+	if (st.nr_funcs != 2) {
+		ulp_error("Patched %u functions in one stop.\n", st.nr_funcs);
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, init_patch_multi, TEST_RET_SKIP)
+{
+	return test_task_patch_obj(FTO_ULFTRACE, ULPATCH_TEST_ULP_MULTI_PATH,
+				   check_multi_patch);
+}
+
+static int check_delete_by_id(struct task_struct *task)
+{
+	unsigned int id = task->max_ulp_id;
+	struct vma_ulp *ulp;
+	int ret;
+
+	ulp = find_ulp_by_id(task, id);
+	if (!ulp || find_ulp_by_build_id(task, ulp->str_build_id) != ulp) {
+		ulp_error("No ulp of ID %d indexed.\n", id);
+		return -1;
+	}
+
+	ret = delete_patch_by_id(task, id);
+	if (ret || find_ulp_by_id(task, id)) {
+		ulp_error("Delete ulp of ID %d failed, %d.\n", id, ret);
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, delete_patch_by_id, TEST_RET_SKIP)
+{
+	return test_task_patch(FTO_ULFTRACE, check_delete_by_id);
+}
+
+/**
+ * Replace the patch of both hello_world() and bye_world() by the one of
+ * hello_world() only, then by itself, bye_world() is restored, only one
+ * patch is left each time.
+ */
+static int check_update(struct task_struct *task)
+{
+	unsigned int id = task->max_ulp_id;
+	const char *paths[] = {
+		ULPATCH_TEST_ULP_PRINTF_PATH,
+		ULPATCH_TEST_ULP_PRINTF_PATH,
+	};
+	struct task_sym *tsym;
+	struct vma_ulp *ulp;
+	char code[16];
+	int i, ret, nr;
+
+	for (i = 0; i < ARRAY_SIZE(paths); i++) {
+		ret = update_patch(task, id, paths[i]);
+		if (ret) {
+			ulp_error("Update ulp %u by %s failed, %d.\n", id,
+				  paths[i], ret);
+			return -1;
+		}
+		if (find_ulp_by_id(task, id) || task->max_ulp_id == id) {
+			ulp_error("The ulp of ID %u still exists.\n", id);
+			return -1;
+		}
+		id = task->max_ulp_id;
+
+		nr = 0;
+		list_for_each_entry(ulp, &task->ulp_list, node)
+			nr++;
+		ulp = find_ulp_by_id(task, id);
+		if (nr != 1 || !ulp || (ulp->infos && ulp->nr_funcs != 1)) {
+			ulp_error("Expect one ulp of one function, %d.\n", nr);
+			return -1;
+		}
+	}
+
+	/* The same binary as current process */
+	tsym = find_task_sym(task, "bye_world", NULL, NULL);
+	if (!tsym)
+		return -1;
+	ret = memcpy_from_task(task, code, tsym->addr, sizeof(code));
+	if (ret != sizeof(code) ||
+	    memcmp(code, (void *)bye_world, sizeof(code))) {
+		ulp_error("bye_world() is not restored.\n");
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, update_patch, TEST_RET_SKIP)
+{
+	return test_task_patch_obj(FTO_ULFTRACE, ULPATCH_TEST_ULP_MULTI_PATH,
+				   check_update);
+}
+
+static int check_phase_stats(struct task_struct *task)
+{
+	struct patch_phase_stats st;
+	unsigned long sum = 0;
+	int i;
+
+	patch_get_phase_stats(&st);
+	print_patch_phase_stats(stdout, &st, false);
+	print_patch_phase_stats(stdout, &st, true);
+
+	if (st.pid != task->pid || strcmp(st.op, "patch") || st.ret) {
+		ulp_error("Wrong phase stats of %d.\n", task->pid);
+		return -1;
+	}
+
+	/* The stop window is accounted in kick phase too */
+	for (i = 0; i < PATCH_PHASE_NUM; i++) {
+		if (i != PATCH_PHASE_STOP)
+			sum += st.phase_ns[i];
+	}
+	if (!st.phase_ns[PATCH_PHASE_STOP] || sum > st.total_ns ||
+	    st.phase_ns[PATCH_PHASE_STOP] > st.phase_ns[PATCH_PHASE_KICK]) {
+		ulp_error("Bad phase cost, total %ld ns.\n", st.total_ns);
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, phase_stats, TEST_RET_SKIP)
+{
+	return test_task_patch(FTO_ULFTRACE, check_phase_stats);
+}
+
+static int check_estimate(struct task_struct *task)
+{
+	struct patch_estimate est;
+	struct vm_area_struct *vma;
+	unsigned int max_ulp_id = task->max_ulp_id;
+	int ret, nr_vmas = 0, nr = 0;
+
+	task_for_each_vma(vma, task)
+		nr_vmas++;
+
+	ret = estimate_patch(task, ULPATCH_TEST_ULP_MULTI_PATH, &est);
+	if (ret) {
+		ulp_error("Estimate failed, %d.\n", ret);
+		return ret;
+	}
+	print_patch_estimate(stdout, task->pid, &est, false);
+	print_patch_estimate(stdout, task->pid, &est, true);
+
+	/* Nothing is changed in target */
+	task_for_each_vma(vma, task)
+		nr++;
+	if (nr != nr_vmas || task->max_ulp_id != max_ulp_id) {
+		ulp_error("Task changed by dry run.\n");
+		return -1;
+	}
+
+	if (est.nr_funcs != 2 || est.nr_stops != 1 || est.nr_vmas != 1 ||
+	    !est.addr || est.bytes_written <= est.stop_bytes) {
+		ulp_error("Wrong estimate.\n");
+		return -1;
+	}
+	return 0;
+}
+
+TEST(Patch_sym, estimate_patch, TEST_RET_SKIP)
+{
+	return test_task_patch(FTO_ULFTRACE, check_estimate);
+}
+
+/* The patch VMA is prefaulted, the first calls take no page fault */
+static int check_prefault(struct task_struct *task)
+{
+	struct vm_area_struct *vma;
+	long rss;
+
+	task_for_each_vma(vma, task) {
+		if (vma->type != VMA_ULPATCH)
+			continue;
+		rss = test_vma_rss(task->pid, vma->vm_start);
+		if (rss != vma->vm_end - vma->vm_start) {
+			ulp_error("%s has %ld of %lu bytes resident.\n",
+				  vma->name_, rss, vma->vm_end - vma->vm_start);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+TEST(Patch_sym, init_patch_prefault, TEST_RET_SKIP)
+{
+	return test_task_patch_obj(FTO_ULFTRACE, ULPATCH_TEST_ULP_PRINTF_PATH,
+				   check_prefault);
+}
+
+/* The copy of tester, thus the identical processes of the same layout */
+static pid_t fork_sleeper(void)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		for (;;)
+			pause();
+	}
+	return pid;
+}
+
+/* The file of the only patch VMA of @task, must be the shared one */
+static int shared_patch_file(struct task_struct *task, char *path,
+			     struct stat *st)
+{
+	struct vm_area_struct *vma;
+
+	task_for_each_vma(vma, task) {
+		if (vma->type != VMA_ULPATCH)
+			continue;
+		if (!strstr(vma->name_, PATCH_VMA_TEMP_PREFIX "s")) {
+			ulp_error("%s is not shared.\n", vma->name_);
+			return -1;
+		}
+		strncpy(path, vma->name_, PATH_MAX - 1);
+		return stat(path, st) ? -errno : 0;
+	}
+	ulp_error("No patch VMA of %d.\n", task->pid);
+	return -ENOENT;
+}
+
+/**
+ * The identical images of two processes are mapped from one inode, which
+ * is linked by the canonical file and each process, and the canonical file
+ * is removed by the last unpatch, see share_patch_image().
+ */
+TEST(Patch_sym, share_patch_image, TEST_RET_SKIP)
+{
+	struct task_struct *tasks[2] = { NULL, NULL };
+	char paths[2][PATH_MAX] = { "", "" }, canon[PATH_MAX];
+	struct stat st[2];
+	pid_t pids[2] = { -1, -1 };
+	const char *hash;
+	int i, ret = 0;
+
+	patch_share_enable(true);
+
+	for (i = 0; i < 2; i++) {
+		pids[i] = fork_sleeper();
+		if (pids[i] < 0) {
+			ret = -errno;
+			goto out;
+		}
+		tasks[i] = open_task(pids[i], FTO_ULFTRACE);
+		if (!tasks[i]) {
+			ret = -1;
+			goto out;
+		}
+		ret = init_patch(tasks[i], ULPATCH_TEST_ULP_PRINTF_PATH);
+		if (ret)
+			goto out;
+		ret = shared_patch_file(tasks[i], paths[i], &st[i]);
+		if (ret)
+			goto out;
+		/* Remapped private, prefaulted by MADV_POPULATE_READ */
+		ret = check_prefault(tasks[i]);
+		if (ret)
+			goto out;
+	}
+
+	if (st[0].st_ino != st[1].st_ino || st[0].st_nlink != 3) {
+		ulp_error("Not one image, inode %lu %lu, links %lu.\n",
+			  (unsigned long)st[0].st_ino,
+			  (unsigned long)st[1].st_ino,
+			  (unsigned long)st[0].st_nlink);
+		ret = -1;
+		goto out;
+	}
+
+	hash = strrchr(paths[1], '/') + strlen(PATCH_VMA_TEMP_PREFIX) + 2;
+	snprintf(canon, sizeof(canon), ULP_SHARE_DIR "/%s", hash);
+
+	/* Still mapped by the second one */
+	delete_patch(tasks[0]);
+	if (stat(canon, &st[0]) || st[0].st_nlink != 2) {
+		ulp_error("%s is removed by the first unpatch.\n", canon);
+		ret = -1;
+	}
+
+	delete_patch(tasks[1]);
+	if (fexist(canon)) {
+		ulp_error("%s is left after the last unpatch.\n", canon);
+		ret = -1;
+	}
+
+out:
+	for (i = 0; i < 2; i++) {
+		if (tasks[i]) {
+			delete_patch(tasks[i]);
+			close_task(tasks[i]);
+		}
+		if (pids[i] > 0) {
+			kill(pids[i], SIGKILL);
+			waitpid(pids[i], NULL, 0);
+		}
+	}
+	patch_share_enable(false);
+	return ret;
+}
@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <utils/log.h>
+#include <utils/compiler.h>
+#include <task/task.h>
+
+#include <tests/test-api.h>
+
+/* Targets forked in one request */
+#define TEST_POOL_BATCH	4
+#define TEST_POOL_MAX	32
+
+static struct {
+	/* The tester process owns the pool, -j workers start their own */
+	pid_t owner;
+	pid_t server;
+	int fd;
+	char path[108];
+	pid_t idle[TEST_POOL_MAX];
+	int nr_idle;
+	pid_t shared;
+} pool = {
+	.fd = -1,
+};
+
+static int test_pool_init(void)
+{
+	pid_t pid;
+	int fd;
+
+	if (pool.owner == getpid() && pool.fd >= 0)
+		return 0;
+
+	/* Inherited from the parent, the targets are not ours */
+	if (pool.owner != getpid() && pool.fd >= 0)
+		close(pool.fd);
+	memset(&pool, 0, sizeof(pool));
+	pool.fd = -1;
+	pool.owner = getpid();
+
+	snprintf(pool.path, sizeof(pool.path), "/tmp/_unix_test_pool.%d",
+		 getpid());
+
+	pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char *)ulpatch_test_path,
+			"--role", "listener",
+			"--listener-epoll",
+			"--listener-path", pool.path,
+			NULL
+		};
+		execvp(argv[0], argv);
+		exit(1);
+	}
+	if (pid < 0)
+		return -errno;
+
+	fd = listener_helper_connect(pool.path);
+	if (fd < 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return fd;
+	}
+
+	pool.server = pid;
+	pool.fd = fd;
+	ulp_debug("Target pool server %d, %s\n", pid, pool.path);
+	return 0;
+}
+
+/* Not traced and not stopped, back to pause(2) */
+static bool target_is_idle(pid_t pid)
+{
+	char path[64], line[128], state = 0;
+	int tracer = -1;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "State:", 6))
+			sscanf(line + 6, " %c", &state);
+		else if (!strncmp(line, "TracerPid:", 10))
+			sscanf(line + 10, "%d", &tracer);
+	}
+	fclose(fp);
+
+	return (state == 'S' || state == 'R') && tracer == 0;
+}
+
+pid_t test_pool_get(void)
+{
+	pid_t pids[TEST_POOL_BATCH], pid;
+	int ret, i;
+
+	ret = test_pool_init();
+	if (ret)
+		return ret;
+
+	while (pool.nr_idle > 0) {
+		pid = pool.idle[--pool.nr_idle];
+		if (target_is_idle(pid))
+			return pid;
+		kill(pid, SIGKILL);
+	}
+
+	ret = listener_helper_fork(pool.fd, pids, TEST_POOL_BATCH);
+	if (ret <= 0)
+		return ret ? ret : -ECHILD;
+
+	for (i = 1; i < ret; i++)
+		pool.idle[pool.nr_idle++] = pids[i];
+	return pids[0];
+}
+
+void test_pool_put(pid_t pid, bool clean)
+{
+	if (pid <= 0 || pool.owner != getpid())
+		return;
+
+	/* The state reset, a modified target is never reused */
+	if (clean && pool.nr_idle < TEST_POOL_MAX && target_is_idle(pid)) {
+		pool.idle[pool.nr_idle++] = pid;
+		return;
+	}
+	ulp_debug("Kill target %d of pool\n", pid);
+	kill(pid, SIGKILL);
+}
+
+pid_t test_pool_shared(void)
+{
+	if (pool.shared > 0 && pool.owner == getpid() &&
+	    proc_pid_exist(pool.shared))
+		return pool.shared;
+
+	pool.shared = test_pool_get();
+	return pool.shared;
+}
+
+void test_pool_destroy(void)
+{
+	int i, rslt;
+
+	if (pool.owner != getpid() || pool.fd < 0)
+		return;
+
+	for (i = 0; i < pool.nr_idle; i++)
+		kill(pool.idle[i], SIGKILL);
+	if (pool.shared > 0)
+		kill(pool.shared, SIGKILL);
+
+	/* The targets left are killed by PR_SET_PDEATHSIG */
+	listener_helper_close(pool.fd, &rslt);
+	listener_helper_close_test_client(pool.fd);
+	waitpid(pool.server, NULL, 0);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.fd = -1;
+}
@@ -0,0 +1,598 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <elf/elf-api.h>
+#include <patch/patch.h>
+#include <task/task.h>
+#include <utils/cmds.h>
+#include <utils/log.h>
+#include <utils/util.h>
+#if defined(__x86_64__)
+#include <arch/x86_64/ftrace.h>
+#elif defined(__aarch64__)
+#include <arch/aarch64/ftrace.h>
+#endif
+
+#include <args-common.c>
+
+
+/**
+ * Benchmark of the stop window of patch, measured inside a busy target. All
+ * threads of the forked target call stall_hot() in a tight loop and record
+ * the largest gap of the cycle counter between two calls, rdtsc on x86_64
+ * and cntvct_el0 on aarch64. Every operation rewrites the entry of
+ * stall_hot() to jump to stall_ret(), or back, the same code write as the
+ * jump of patch, and the stall of operation is the largest gap of all
+ * threads during it.
+ *
+ * stall_hot() starts with a nop of the size of the jump, no thread could be
+ * stopped in the middle of the rewritten bytes, thus every strategy is safe,
+ * even the ones don't check stacks.
+ */
+
+#define STALL_MAX_THREADS	64
+/* Wait the threads of target at most, in nanoseconds */
+#define STALL_WAIT_NS		1000000000UL
+
+#if defined(__x86_64__)
+__asm__(
+	"	.text\n"
+	"	.globl stall_hot\n"
+	"	.type stall_hot, @function\n"
+	"stall_hot:\n"
+	/* nopl 0x0(%rax,%rax,1), same size as jmp rel32 */
+	"	.byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n"
+	"	ret\n"
+	"	.size stall_hot, .-stall_hot\n"
+	"	.globl stall_ret\n"
+	"	.type stall_ret, @function\n"
+	"stall_ret:\n"
+	"	ret\n"
+	"	.size stall_ret, .-stall_ret\n"
+);
+#elif defined(__aarch64__)
+__asm__(
+	"	.text\n"
+	"	.p2align 2\n"
+	"	.globl stall_hot\n"
+	"	.type stall_hot, %function\n"
+	"stall_hot:\n"
+	"	nop\n"
+	"	ret\n"
+	"	.size stall_hot, .-stall_hot\n"
+	"	.globl stall_ret\n"
+	"	.type stall_ret, %function\n"
+	"stall_ret:\n"
+	"	ret\n"
+	"	.size stall_ret, .-stall_ret\n"
+);
+#else
+# error "Unsupport architecture"
+#endif
+
+void stall_hot(void);
+void stall_ret(void);
+
+/* The target function of empty.ulp, see src/tests/ulpatches/empty.c */
+void __attribute__((noinline)) hello_world(void)
+{
+	__asm__ __volatile__("" ::: "memory");
+}
+
+/* One slot for each thread of target, shared with parent */
+struct stall_slot {
+	/* Largest gap since last reset, in cycles */
+	uint64_t max_gap;
+	uint64_t iters;
+	/* Set by parent, cleared by the thread after reset max_gap */
+	int reset;
+} __attribute__((aligned(64)));
+
+struct stall_shm {
+	struct stall_slot slots[STALL_MAX_THREADS];
+	int nr_ready;
+};
+
+struct stall_ctx {
+	pid_t pid;
+	struct task_struct *task;
+	/* The jump and the nop of stall_hot() */
+	char jmp[16];
+	char nop[16];
+	size_t len;
+};
+
+struct strategy {
+	const char *name;
+	/* Write @new over @old at the entry of stall_hot() */
+	int (*write)(struct stall_ctx *ctx, const void *new, const void *old);
+};
+
+static int nr_threads = 4;
+static int nr_reps = 200;
+static int nr_warmup = 10;
+static const char *patch_file = NULL;
+static const char *strategy_list = NULL;
+
+static struct stall_shm *shm = NULL;
+/* Call through pointer, never inlined */
+static void (*volatile stall_fn)(void) = stall_hot;
+
+static const char *prog_name = "ulpatch_stall";
+
+static void stall_args_reset(void)
+{
+	nr_threads = 4;
+	nr_reps = 200;
+	nr_warmup = 10;
+	patch_file = NULL;
+	strategy_list = NULL;
+}
+
+static int print_help(void)
+{
+	printf(
+	"\n"
+	" Usage: ulpatch_stall [OPTION]...\n"
+	"\n"
+	" Benchmark of the stop window of patch, fork a target of N busy\n"
+	" threads, rewrite its hot function repeatedly by every strategy, and\n"
+	" report the stall measured inside target.\n"
+	"\n"
+	"  -t, --threads N     number of busy threads of target, default %d,\n"
+	"                      max %d\n"
+	"  -n, --reps N        operations of each strategy, default %d\n"
+	"  -w, --warmup N      warmup operations, default %d\n"
+	"  -P, --patch FILE    also init_patch and delete_patch FILE, such as\n"
+	"                      empty.ulp, as strategy 'ulpatch'\n"
+	"  -S, --strategy NAME[,NAME...]\n"
+	"                      run the strategies only, default all:\n"
+	"                      baseline, legacy, seize, freeze, text_poke_bp,\n"
+	"                      ulpatch\n"
+	"\n",
+	nr_threads, STALL_MAX_THREADS, nr_reps, nr_warmup);
+	print_usage_common(prog_name);
+	cmd_exit_success();
+	return 0;
+}
+
+static int parse_config(int argc, char *argv[])
+{
+	struct option options[] = {
+		{ "threads",  required_argument, 0, 't' },
+		{ "reps",     required_argument, 0, 'n' },
+		{ "warmup",   required_argument, 0, 'w' },
+		{ "patch",    required_argument, 0, 'P' },
+		{ "strategy", required_argument, 0, 'S' },
+		COMMON_OPTIONS
+		{ NULL }
+	};
+
+	while (1) {
+		int c;
+		int option_index = 0;
+		c = getopt_long(argc, argv, "t:n:w:P:S:"
+				COMMON_GETOPT_OPTSTRING, options,
+				&option_index);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			nr_reps = atoi(optarg);
+			break;
+		case 'w':
+			nr_warmup = atoi(optarg);
+			break;
+		case 'P':
+			patch_file = optarg;
+			break;
+		case 'S':
+			strategy_list = optarg;
+			break;
+		COMMON_GETOPT_CASES(prog_name, print_help, argv)
+		default:
+			print_help();
+			cmd_exit(1);
+			break;
+		}
+	}
+
+	if (nr_threads <= 0 || nr_threads > STALL_MAX_THREADS ||
+	    nr_reps <= 0 || nr_warmup < 0) {
+		fprintf(stderr, "Invalid argument, see -h.\n");
+		cmd_exit(1);
+	}
+
+	return 0;
+}
+
+static void __noreturn target_loop(struct stall_slot *slot)
+{
+	uint64_t prev, now, gap;
+
+	__atomic_fetch_add(&shm->nr_ready, 1, __ATOMIC_RELEASE);
+
+	prev = ulp_cycles();
+	while (1) {
+		stall_fn();
+		now = ulp_cycles();
+		gap = now - prev;
+		prev = now;
+
+		if (__atomic_load_n(&slot->reset, __ATOMIC_ACQUIRE)) {
+			slot->max_gap = 0;
+			__atomic_store_n(&slot->reset, 0, __ATOMIC_RELEASE);
+		} else if (gap > slot->max_gap) {
+			__atomic_store_n(&slot->max_gap, gap,
+					 __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&slot->iters, slot->iters + 1,
+				 __ATOMIC_RELEASE);
+	}
+}
+
+static void *target_thread(void *arg)
+{
+	target_loop(arg);
+	return NULL;
+}
+
+/* The thread group leader is one of the busy threads too */
+static void __noreturn target_run(void)
+{
+	pthread_t thread;
+	int i;
+
+	hello_world();
+
+	for (i = 1; i < nr_threads; i++)
+		pthread_create(&thread, NULL, target_thread, &shm->slots[i]);
+	target_loop(&shm->slots[0]);
+}
+
+static pid_t target_fork(void)
+{
+	unsigned long start;
+	pid_t pid;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED)
+		return -errno;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (pid == 0)
+		target_run();
+
+	start = nsecs();
+	while (__atomic_load_n(&shm->nr_ready, __ATOMIC_ACQUIRE) <
+	       nr_threads) {
+		if (nsecs() - start > STALL_WAIT_NS) {
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+			return -ETIME;
+		}
+		usleep(1000);
+	}
+	return pid;
+}
+
+/* Cycles of the counter in one millisecond */
+static uint64_t calibrate_cycles(void)
+{
+	return cycles_calibrate(100000) * 1000000UL;
+}
+
+/* Reset all slots, and wait until every thread cleared its max_gap */
+static int slots_reset(void)
+{
+	unsigned long start = nsecs();
+	int i;
+
+	for (i = 0; i < nr_threads; i++)
+		__atomic_store_n(&shm->slots[i].reset, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < nr_threads; i++) {
+		while (__atomic_load_n(&shm->slots[i].reset,
+				       __ATOMIC_ACQUIRE)) {
+			if (nsecs() - start > STALL_WAIT_NS)
+				return -ETIME;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Wait until every thread ran after the operation, thus the gap across the
+ * stop window is recorded, return the largest one.
+ */
+static int slots_max_gap(const uint64_t *iters, uint64_t *max_gap)
+{
+	unsigned long start = nsecs();
+	int i;
+
+	*max_gap = 0;
+	for (i = 0; i < nr_threads; i++) {
+		while (__atomic_load_n(&shm->slots[i].iters,
+				       __ATOMIC_ACQUIRE) < iters[i] + 2) {
+			if (nsecs() - start > STALL_WAIT_NS)
+				return -ETIME;
+		}
+		*max_gap = MAX(*max_gap, __atomic_load_n(&shm->slots[i].max_gap,
+							 __ATOMIC_RELAXED));
+	}
+	return 0;
+}
+
+static int write_none(struct stall_ctx *ctx, const void *new, const void *old)
+{
+	return 0;
+}
+
+/**
+ * Stop the threads one by one, task_attach() every thread and wait it, the
+ * stall is the sum of all threads.
+ */
+static int write_one_by_one(struct stall_ctx *ctx, const void *new)
+{
+	struct list_head *threads;
+	struct thread *thread;
+	int err = 0, n;
+
+	threads = task_threads(ctx->task);
+	if (!threads)
+		return -errno;
+
+	list_for_each_entry(thread, threads, node) {
+		err = task_attach(thread->tid);
+		if (err)
+			break;
+		thread->frozen = true;
+	}
+
+	if (!err) {
+		n = memcpy_to_task(ctx->task, (unsigned long)stall_hot,
+				   (void *)new, ctx->len);
+		if (n == -1 || n < ctx->len)
+			err = -EIO;
+	}
+
+	list_for_each_entry(thread, threads, node) {
+		if (!thread->frozen)
+			continue;
+		task_detach(thread->tid);
+		thread->frozen = false;
+	}
+	return err;
+}
+
+/* PTRACE_ATTACH and SIGSTOP */
+static int write_legacy(struct stall_ctx *ctx, const void *new,
+			const void *old)
+{
+	set_task_attach_mode(TASK_ATTACH_PTRACE);
+	return write_one_by_one(ctx, new);
+}
+
+/* PTRACE_SEIZE and PTRACE_INTERRUPT */
+static int write_seize(struct stall_ctx *ctx, const void *new,
+		       const void *old)
+{
+	int err;
+
+	set_task_attach_mode(TASK_ATTACH_SEIZE);
+	err = write_one_by_one(ctx, new);
+	set_task_attach_mode(TASK_ATTACH_PTRACE);
+	return err;
+}
+
+/* Parallel freeze of all threads and check stacks, same as patch */
+static int write_freeze(struct stall_ctx *ctx, const void *new,
+			const void *old)
+{
+	struct code_write w = {
+		.addr = (unsigned long)stall_hot,
+		.new = new,
+		.old = old,
+		.len = ctx->len,
+	};
+
+	return write_code_safely(ctx->task, &w, 1);
+}
+
+/* No thread is stopped, see ftrace_modify_sites() */
+static int write_text_poke(struct stall_ctx *ctx, const void *new,
+			   const void *old)
+{
+	struct code_write w = {
+		.addr = (unsigned long)stall_hot,
+		.new = new,
+		.old = old,
+		.len = ctx->len,
+	};
+
+	return ftrace_modify_sites(ctx->task, &w, 1);
+}
+
+/* The real patch, apply for new is the jump, otherwise remove */
+static int write_ulpatch(struct stall_ctx *ctx, const void *new,
+			 const void *old)
+{
+	if (new == ctx->jmp)
+		return init_patch(ctx->task, patch_file);
+	return delete_patch(ctx->task);
+}
+
+static const struct strategy strategies[] = {
+	{ "baseline",     write_none },
+	{ "legacy",       write_legacy },
+	{ "seize",        write_seize },
+	{ "freeze",       write_freeze },
+	{ "text_poke_bp", write_text_poke },
+	{ "ulpatch",      write_ulpatch },
+};
+
+static bool strategy_selected(const char *name)
+{
+	const char *p = strategy_list;
+	size_t len = strlen(name);
+
+	if (!p)
+		return true;
+
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == strategy_list || p[-1] == ',') &&
+		    (p[len] == ',' || p[len] == '\0'))
+			return true;
+		p += len;
+	}
+	return false;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *ns, int n, int pct)
+{
+	return ns[MIN((long)n * pct / 100, n - 1)];
+}
+
+/* Apply on even operation and remove on odd one, end with removed */
+static int run_strategy(const struct strategy *s, struct stall_ctx *ctx,
+			uint64_t cycles_per_ms)
+{
+	uint64_t iters[STALL_MAX_THREADS], gap, *ns, sum = 0;
+	int i, j, n = 0, nr_errs = 0, total;
+	const void *new, *old;
+
+	if (s->write == write_ulpatch && !patch_file) {
+		printf("%-14s %10s\n", s->name, "skipped");
+		return 0;
+	}
+
+	ns = malloc(nr_reps * sizeof(*ns));
+	if (!ns)
+		return -ENOMEM;
+
+	total = ALIGN(nr_warmup + nr_reps, 2);
+	for (i = 0; i < total; i++) {
+		new = i % 2 ? ctx->nop : ctx->jmp;
+		old = i % 2 ? ctx->jmp : ctx->nop;
+
+		if (slots_reset())
+			goto timeout;
+		for (j = 0; j < nr_threads; j++)
+			iters[j] = __atomic_load_n(&shm->slots[j].iters,
+						   __ATOMIC_ACQUIRE);
+
+		if (s->write(ctx, new, old))
+			nr_errs++;
+
+		if (slots_max_gap(iters, &gap))
+			goto timeout;
+
+		if (i < nr_warmup || n == nr_reps)
+			continue;
+		ns[n] = gap * 1000000UL / cycles_per_ms;
+		sum += ns[n++];
+	}
+
+	if (!n) {
+		printf("%-14s %10s %6d\n", s->name, "failed", nr_errs);
+		free(ns);
+		return -EIO;
+	}
+
+	qsort(ns, n, sizeof(*ns), cmp_u64);
+	printf("%-14s %10d %10lu %10lu %10lu %10lu %6d\n", s->name, n,
+	       (unsigned long)(sum / n), (unsigned long)percentile(ns, n, 50),
+	       (unsigned long)percentile(ns, n, 99), (unsigned long)ns[n - 1],
+	       nr_errs);
+	free(ns);
+	return 0;
+
+timeout:
+	fprintf(stderr, "%s: target threads not running.\n", s->name);
+	free(ns);
+	return -ETIME;
+}
+
+int main(int argc, char *argv[])
+{
+	struct stall_ctx ctx = {};
+	uint64_t cycles_per_ms;
+	int i, ret = 0;
+
+	COMMON_RESET_BEFORE_PARSE_ARGS(stall_args_reset);
+
+	parse_config(argc, argv);
+
+	COMMON_IN_MAIN_AFTER_PARSE_ARGS();
+
+	ulpatch_init();
+
+	ctx.len = arch_near_jmp((unsigned long)stall_hot,
+				(unsigned long)stall_ret, ctx.jmp);
+	if (!ctx.len) {
+		fprintf(stderr, "No near jump to stall_ret().\n");
+		return 1;
+	}
+	memcpy(ctx.nop, (void *)stall_hot, ctx.len);
+
+	cycles_per_ms = calibrate_cycles();
+
+	ctx.pid = target_fork();
+	if (ctx.pid < 0) {
+		fprintf(stderr, "Fork target failed, %s\n",
+			strerror(-ctx.pid));
+		return 1;
+	}
+
+	ctx.task = open_task(ctx.pid, FTO_ULPATCH);
+	if (!ctx.task) {
+		fprintf(stderr, "Open target %d failed.\n", ctx.pid);
+		ret = 1;
+		goto kill;
+	}
+
+	printf("target %d: %d busy threads, %d reps, %d warmup, "
+	       "%lu cycles/ms\n", ctx.pid, nr_threads, nr_reps, nr_warmup,
+	       (unsigned long)cycles_per_ms);
+	printf("%-14s %10s %10s %10s %10s %10s %6s\n", "STRATEGY", "OPS",
+	       "MEAN(ns)", "P50(ns)", "P99(ns)", "MAX(ns)", "ERRS");
+
+	for (i = 0; i < ARRAY_SIZE(strategies); i++) {
+		if (!strategy_selected(strategies[i].name))
+			continue;
+		if (run_strategy(&strategies[i], &ctx, cycles_per_ms))
+			ret = 1;
+	}
+
+	close_task(ctx.task);
+kill:
+	kill(ctx.pid, SIGKILL);
+	waitpid(ctx.pid, NULL, 0);
+	return ret;
+}
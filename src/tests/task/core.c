@@ -5,8 +5,14 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/ptrace.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <elf.h>
+#include <link.h>
 
 #include <utils/log.h>
 #include <utils/list.h>
@@ -79,42 +85,402 @@ TEST(Task, dump, 0)
 	return close_task(task);
 }
 
-TEST(Task, attach_detach, 0)
+TEST(Task, lazy, 0)
 {
-	int ret = -1;
-	int status = 0;
-	struct task_notify notify;
+	int ret = 0;
+	struct list_head *threads, *fds;
+	const struct task_struct_auxv *auxv;
+	const struct task_status *status;
+	struct task_struct *task = open_task(getpid(), FTO_ULPINFO);
 
-	task_notify_init(&notify, NULL);
+	if (!task)
+		return -1;
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		char *argv[] = {
-			(char*)ulpatch_test_path,
-			"--role", "sleeper,trigger,sleeper,wait",
-			"--msgq", notify.tmpfile,
-			NULL
-		};
-		ret = execvp(argv[0], argv);
-		if (ret == -1) {
-			exit(1);
+	/* Nothing is loaded before the first use */
+	if (task->fto_loaded)
+		ret = -1;
+
+	threads = task_threads(task);
+	fds = task_fds(task);
+	auxv = task_auxv(task);
+	status = task_status(task);
+
+	if (!threads || list_empty(threads) || !fds || list_empty(fds))
+		ret = -1;
+	if (!auxv || auxv->auxv_entry == 0)
+		ret = -1;
+	if (!status || status->uid != getuid())
+		ret = -1;
+	if (task->fto_loaded !=
+	    (FTO_THREADS | FTO_FD | FTO_AUXV | FTO_STATUS))
+		ret = -1;
+
+	/* Loaded once */
+	if (task_threads(task) != threads)
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task, fd_type, 0)
+{
+	int ret = 0, sock, pipefd[2], found = 0;
+	char path[64], link[PATH_MAX];
+	struct task_struct *task;
+	struct list_head *fds;
+	struct fd *fd;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || pipe(pipefd))
+		return -1;
+
+	task = open_task(getpid(), FTO_FD_TYPE);
+	fds = task ? task_fds(task) : NULL;
+	if (!fds) {
+		ret = -1;
+		goto out;
+	}
+
+	/* Same as readlink(2), no matter made up or not */
+	list_for_each_entry(fd, fds, node) {
+		if (fd->fd != sock && fd->fd != pipefd[0])
+			continue;
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd->fd);
+		memset(link, 0, sizeof(link));
+		if (readlink(path, link, sizeof(link) - 1) < 0 ||
+		    strcmp(link, fd->symlink))
+			ret = -1;
+		if (fd->type != (fd->fd == sock ? S_IFSOCK : S_IFIFO))
+			ret = -1;
+		found++;
+	}
+	if (found != 2)
+		ret = -1;
+
+	close_task(task);
+out:
+	close(sock);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return ret;
+}
+
+static int count_objects(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(*(int *)data)++;
+	return 0;
+}
+
+TEST(Task, link_map, 0)
+{
+	int ret = 0, nr = 0;
+	struct task_link_map *lm;
+	struct task_struct *task;
+
+	task = open_task(getpid(), FTO_VMA_ELF | FTO_LINK_MAP);
+	if (!task)
+		return -1;
+
+	if (!(task->fto_loaded & FTO_LINK_MAP))
+		ret = -1;
+
+	/* Same objects as the dynamic linker tells us */
+	dl_iterate_phdr(count_objects, &nr);
+	if (task->nr_link_maps != nr) {
+		ulp_error("link_map %ld objects, expect %d\n",
+			  task->nr_link_maps, nr);
+		ret = -1;
+	}
+
+	lm = vma_link_map(task->libc_vma);
+	if (!lm || !task->libc_vma->vma_elf ||
+	    lm->l_addr != task->libc_vma->vma_elf->load_addr)
+		ret = -1;
+
+	print_task_link_map(stdout, task);
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task, cache, 0)
+{
+	int ret = 0;
+	void *addr;
+	struct task_struct *task, *cached, *rdwr;
+
+	task_cache_enable(4, 0);
+
+	task = open_task(getpid(), FTO_NONE);
+	if (!task) {
+		ret = -1;
+		goto disable;
+	}
+	close_task(task);
+
+	/* Reused on next open, and the new VMA is found */
+	addr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	cached = open_task(getpid(), FTO_NONE);
+	if (cached != task || !find_vma(cached, (unsigned long)addr)) {
+		ulp_error("Cached task %p != %p\n", cached, task);
+		ret = -1;
+	}
+	if (cached)
+		close_task(cached);
+	munmap(addr, PAGE_SIZE);
+
+	/* Writer is never cached */
+	rdwr = open_task(getpid(), FTO_RDWR);
+	if (!rdwr || rdwr == task)
+		ret = -1;
+	if (rdwr)
+		close_task(rdwr);
+
+disable:
+	/* Free all the tasks */
+	task_cache_enable(0, 0);
+	return ret;
+}
+
+/* Checkpoint of ulpatchd, see ckpt_load() */
+TEST(Task, cache_save_restore, 0)
+{
+	struct task_cache_ent ents[4], stale;
+	struct task_struct *task;
+	int ret = 0, n;
+
+	task_cache_enable(ARRAY_SIZE(ents), 0);
+
+	task = open_task(getpid(), FTO_NONE);
+	if (!task) {
+		ret = -1;
+		goto disable;
+	}
+	close_task(task);
+
+	n = task_cache_save(ents, ARRAY_SIZE(ents));
+	if (n != 1 || ents[0].pid != getpid() || ents[0].flag != FTO_NONE ||
+	    ents[0].start_time != proc_pid_start_time(getpid())) {
+		ulp_error("Save %d cached tasks\n", n);
+		ret = -1;
+		goto disable;
+	}
+
+	/* As restarted */
+	task_cache_flush();
+	if (task_cache_save(ents + 1, ARRAY_SIZE(ents) - 1) != 0 ||
+	    task_cache_restore(&ents[0]) ||
+	    task_cache_save(ents + 1, ARRAY_SIZE(ents) - 1) != 1)
+		ret = -1;
+
+	/* The pid is reused */
+	stale = ents[0];
+	stale.start_time++;
+	if (task_cache_restore(&stale) != -ESRCH)
+		ret = -1;
+
+disable:
+	task_cache_enable(0, 0);
+	return ret;
+}
+
+static int nr_ulp_ranges(struct task_struct *task, unsigned long start,
+			 unsigned long last)
+{
+	struct ulp_range *r;
+	int n = 0;
+
+	for (r = find_ulp_range(task, start, last); r;
+	     r = find_ulp_range_next(r, start, last))
+		n++;
+	return n;
+}
+
+/* Like alloc_ulp(), without the ELF of patch */
+static struct vma_ulp *fake_ulp(struct vm_area_struct *vma, unsigned int id,
+				unsigned long addr, unsigned int flags)
+{
+	struct vma_ulp *ulp;
+
+	ulp = calloc(1, sizeof(struct vma_ulp));
+	if (!ulp)
+		return NULL;
+
+	ulp->vma = vma;
+	RB_CLEAR_NODE(&ulp->node_id);
+	RB_CLEAR_NODE(&ulp->node_build_id);
+	ulp->slot = -1;
+	ulp->info.ulp_id = id;
+	ulp->info.virtual_addr = addr;
+	ulp->info.flags = flags;
+
+	ulp->next = vma->ulp;
+	vma->ulp = ulp;
+	list_add(&ulp->node, &vma->task->ulp_list);
+	return ulp;
+}
+
+/* Fake patches, the ranges are indexed, never written */
+TEST(Task, ulp_ranges, 0)
+{
+	unsigned long addrs[] = { 0x1000, 0x1000, 0x1008, 0x2000 };
+	struct vma_ulp *ulps[ARRAY_SIZE(addrs)];
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	int i, ret = 0;
+
+	/* Never cached */
+	task = open_task(getpid(), FTO_RDWR);
+	if (!task)
+		return -1;
+	vma = task->stack;
+
+	for (i = 0; i < ARRAY_SIZE(addrs); i++) {
+		ulps[i] = fake_ulp(vma, i + 1, addrs[i],
+				   i == 3 ? ULP_INFO_F_GOT : 0);
+		if (!ulps[i]) {
+			ret = -1;
+			goto close;
 		}
+		if (task_index_ulp(task, ulps[i]))
+			ret = -1;
 	}
 
-	/* Parent */
-	task_notify_wait(&notify);
+	/* [0x1000, 0x100f] twice and [0x1008, 0x1017] */
+	if (nr_ulp_ranges(task, 0x1000, 0x1000) != 2 ||
+	    nr_ulp_ranges(task, 0x100f, 0x100f) != 3 ||
+	    nr_ulp_ranges(task, 0x1010, 0x1fff) != 1 ||
+	    nr_ulp_ranges(task, 0x0, 0xfff) != 0)
+		ret = -1;
+
+	/* Only 8 bytes of GOT slot */
+	if (nr_ulp_ranges(task, 0x2007, 0x2007) != 1 ||
+	    nr_ulp_ranges(task, 0x2008, 0x3000) != 0)
+		ret = -1;
+
+	unlink_ulp(ulps[1]);
+	if (nr_ulp_ranges(task, 0x1000, 0x1000) != 1 ||
+	    find_ulp_range(task, 0x1000, 0x1000)->ulp != ulps[0])
+		ret = -1;
+
+close:
+	/* The fake patches are freed by free_ulp() */
+	close_task(task);
+	return ret;
+}
+
+/* The ELF details come from task::elf_pool, released by close_task() */
+TEST(Task, elf_pool, 0)
+{
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	int nr = 0, ret = 0;
+
+	task = open_task(getpid(), FTO_RDWR | FTO_VMA_ELF);
+	if (!task)
+		return -1;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->vma_elf)
+			continue;
+		nr++;
+		if ((unsigned long)vma->vma_elf % sizeof(long) ||
+		    (vma->vma_elf->phdrs &&
+		     (unsigned long)vma->vma_elf->phdrs % sizeof(long)))
+			ret = -1;
+	}
+
+	/* At least the executable and libc */
+	if (nr < 2 || !task->elf_pool.nr_chunks)
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
+/* Attach and detach never modify the target, share it */
+TEST(Task, attach_detach, 0)
+{
+	int ret;
+	pid_t pid = test_pool_shared();
+
+	if (pid <= 0)
+		return -1;
 
 	ret = task_attach(pid);
-	ret = task_detach(pid);
+	if (ret)
+		return ret;
+	return task_detach(pid);
+}
 
-	task_notify_trigger(&notify);
+TEST(Task, attach_seize, 0)
+{
+	int ret = -1;
+	struct task_struct *task;
+	unsigned long addr;
+	pid_t pid = test_pool_get();
 
-	waitpid(pid, &status, __WALL);
-	if (status != 0) {
-		ret = -EINVAL;
+	if (pid <= 0)
+		return -1;
+
+	task = open_task(pid, FTO_RDWR);
+	if (!task) {
+		test_pool_put(pid, false);
+		return -1;
 	}
 
-	task_notify_destroy(&notify);
+	set_task_attach_mode(TASK_ATTACH_SEIZE);
+
+	ret = task_attach_leader(task);
+	if (ret == 0) {
+		if (task_attach_latency_ns() == 0 || !task->seized)
+			ret = -1;
+		/* Remote syscall works in seize mode */
+		addr = task_malloc(task, 64);
+		if (!addr)
+			ret = -1;
+		task_free(task, addr, 64);
+		task_detach_leader(task);
+	}
+
+	set_task_attach_mode(TASK_ATTACH_PTRACE);
+
+	close_task(task);
+	test_pool_put(pid, ret == 0);
+
+	return ret;
+}
+
+/* The waitpid(2) status of stopped tracee, see WIFSTOPPED() */
+#define STOP_STATUS(sig)	(((sig) << 8) | 0x7f)
+
+TEST(Task, stop_status_seize, 0)
+{
+	int ret = 0, sig;
+	struct task_struct task = {};
+
+	/* SIGSTOP is the trap of PTRACE_ATTACH only */
+	if (task_stop_status(&task, STOP_STATUS(SIGSTOP), &sig) !=
+	    TASK_STOP_TRAP)
+		ret = -1;
+
+	/**
+	 * Seized by freeze, even in TASK_ATTACH_PTRACE mode, the SIGSTOP is
+	 * a real signal.
+	 */
+	task.seized = true;
+
+	if (task_stop_status(&task, STOP_STATUS(SIGSTOP), &sig) !=
+	    TASK_STOP_CONT || sig != SIGSTOP)
+		ret = -1;
+	if (task_stop_status(&task, STOP_STATUS(SIGTRAP), &sig) !=
+	    TASK_STOP_TRAP || sig != 0)
+		ret = -1;
+	if (task_stop_status(&task, STOP_STATUS(SIGTRAP) |
+			     (PTRACE_EVENT_STOP << 16), &sig) != TASK_STOP_CONT)
+		ret = -1;
 
 	return ret;
 }
@@ -138,6 +504,41 @@ TEST(Task, copy_from_task, 0)
 	return ret;
 }
 
+TEST(Task, err_stats, 0)
+{
+	struct task_err_stats before, after;
+	char buf[64];
+	void *addr;
+	int i, ret = 0;
+
+	struct task_struct *task = open_task(getpid(), FTO_NONE);
+
+	/* An address not mapped */
+	addr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	if (addr == MAP_FAILED) {
+		close_task(task);
+		return -1;
+	}
+	munmap(addr, PAGE_SIZE);
+
+	task_get_err_stats(&before);
+	for (i = 0; i < 10; i++) {
+		if (memcpy_from_task(task, buf, (unsigned long)addr,
+				     sizeof(buf)) != -1)
+			ret = -1;
+	}
+	task_get_err_stats(&after);
+	print_task_err_stats(stdout);
+
+	if (after.nr[TASK_ERR_MEM_READ] - before.nr[TASK_ERR_MEM_READ] != 10 ||
+	    !after.last_errno[TASK_ERR_MEM_READ])
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
 TEST(Task, copy_to_task, 0)
 {
 	char data[] = "ABCDEFG";
@@ -156,6 +557,47 @@ TEST(Task, copy_to_task, 0)
 	return ret;
 }
 
+TEST(Task, copy_task_iov, 0)
+{
+	char data1[] = "ABCDEFGH";
+	char data2[] = "123456789";
+	char buf1[64] = "XXXXXXXX";
+	char buf2[64] = "XXXXXXXX";
+	char dst[64] = "XXXXXXXX";
+	ssize_t n, expect;
+	int ret = 0;
+
+	struct task_struct *task = open_task(getpid(), FTO_RDWR);
+
+	struct task_iov rd[] = {
+		{ (unsigned long)data1, buf1, strlen(data1) + 1 },
+		{ (unsigned long)data2, buf2, strlen(data2) + 1 },
+	};
+	struct task_iov wr[] = {
+		{ (unsigned long)dst, data2, strlen(data2) + 1 },
+	};
+
+	expect = rd[0].len + rd[1].len;
+	n = memcpy_from_task_iov(task, rd, ARRAY_SIZE(rd));
+	if (n != expect || strcmp(data1, buf1) || strcmp(data2, buf2))
+		ret = -1;
+
+	n = memcpy_to_task_iov(task, wr, ARRAY_SIZE(wr));
+	if (n != wr[0].len || strcmp(data2, dst))
+		ret = -1;
+
+	/* Use /proc/PID/mem only */
+	task->proc_mem_only = true;
+	memset(buf1, 'X', sizeof(buf1));
+	memset(buf2, 'X', sizeof(buf2));
+	n = memcpy_from_task_iov(task, rd, ARRAY_SIZE(rd));
+	if (n != expect || strcmp(data1, buf1) || strcmp(data2, buf2))
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
 TEST(Task, task_strcpy, 0)
 {
 	char data[] = "ABCDEFGH\0";
@@ -178,36 +620,53 @@ TEST(Task, task_strcpy, 0)
 	return ret;
 }
 
+TEST(Task, task_strscpy, 0)
+{
+	int ret = 0;
+	ssize_t len;
+	char buf[64];
+	char *page, *s;
+	size_t page_size = getpagesize();
+
+	struct task_struct *task = open_task(getpid(), FTO_NONE);
+
+	/* String cross the page boundary */
+	page = mmap(NULL, page_size * 2, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	s = page + page_size - 4;
+	strcpy(s, "ABCDEFGH");
+
+	len = strscpy_from_task(task, buf, (unsigned long)s, sizeof(buf));
+	if (len != strlen(s) || strcmp(buf, s))
+		ret = -1;
+
+	/* Too small buffer */
+	len = strscpy_from_task(task, buf, (unsigned long)s, 4);
+	if (len != -E2BIG || strcmp(buf, "ABC"))
+		ret = -1;
+
+	munmap(page, page_size * 2);
+	close_task(task);
+	return ret;
+}
+
 TEST(Task, mmap_malloc, 0)
 {
 	int ret = -1;
-	int status = 0;
-	struct task_notify notify;
 	char data[] = "ABCDEFG";
 	char buf[64] = "XXXXXX";
 	int n;
 	unsigned long addr;
+	pid_t pid = test_pool_get();
 
-	task_notify_init(&notify, NULL);
-
-	pid_t pid = fork();
-	if (pid == 0) {
-		char *argv[] = {
-			(char*)ulpatch_test_path,
-			"--role", "sleeper,trigger,sleeper,wait",
-			"--msgq", notify.tmpfile,
-			NULL
-		};
-		ret = execvp(argv[0], argv);
-		if (ret == -1) {
-			exit(1);
-		}
-	}
-
-	/* Parent */
-	task_notify_wait(&notify);
+	if (pid <= 0)
+		return -1;
 
 	struct task_struct *task = open_task(pid, FTO_RDWR);
+	if (!task) {
+		test_pool_put(pid, false);
+		return -1;
+	}
 
 	ret = task_attach(pid);
 
@@ -225,14 +684,10 @@ TEST(Task, mmap_malloc, 0)
 
 	task_free(task, addr, 64);
 
-	ret = task_detach(pid);
-	task_notify_trigger(&notify);
-	waitpid(pid, &status, __WALL);
-	if (status != 0)
-		ret = -EINVAL;
+	if (task_detach(pid))
+		ret = -1;
 	close_task(task);
-
-	task_notify_destroy(&notify);
+	test_pool_put(pid, ret == 0);
 
 	return ret;
 }
@@ -466,3 +921,938 @@ TEST(Task, prctl_PR_SET_NAME, 0)
 	return ret;
 }
 
+
+TEST(Task, mem_cache, 0)
+{
+	int ret = 0;
+	int n;
+	char data[] = "ABCDEFGH";
+	char buf[64];
+
+	struct task_struct *task = open_task(getpid(), FTO_MEM_CACHE);
+
+	if (!task->mcache.enabled) {
+		close_task(task);
+		return -1;
+	}
+
+	n = memcpy_from_task(task, buf, (unsigned long)data, sizeof(data));
+	if (n != sizeof(data) || strcmp(data, buf))
+		ret = -1;
+
+	/* Second read hit the cache, we'll get the old value */
+	data[0] = 'X';
+	n = memcpy_from_task(task, buf, (unsigned long)data, sizeof(data));
+	if (n != sizeof(data) || buf[0] != 'A' || task->mcache.hits == 0)
+		ret = -1;
+
+	/* Read the new value after invalidate */
+	task_mem_cache_invalidate(task, (unsigned long)data, sizeof(data));
+	n = memcpy_from_task(task, buf, (unsigned long)data, sizeof(data));
+	if (n != sizeof(data) || strcmp(data, buf))
+		ret = -1;
+
+	print_task(stdout, task, true);
+
+	close_task(task);
+	return ret;
+}
+
+/* The read-only profiles get the cache, the writing one never */
+TEST(Task, mem_cache_profiles, 0)
+{
+	static const struct {
+		int flag;
+		bool enabled;
+	} profiles[] = {
+		{ FTO_ULPINFO, true },
+		{ FTO_ULTASK, true },
+		{ FTO_ULTASK | FTO_RDWR, false },
+		{ FTO_ULPATCH, false },
+	};
+	struct task_struct *task;
+	int i, ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(profiles); i++) {
+		task = open_task(getpid(), profiles[i].flag);
+		if (!task)
+			return -1;
+		if (task->mcache.enabled != profiles[i].enabled) {
+			ulp_error("FTO %x cache %d\n", profiles[i].flag,
+				  task->mcache.enabled);
+			ret = -1;
+		}
+		close_task(task);
+	}
+	return ret;
+}
+
+TEST(Task, syscall_trampoline, 0)
+{
+	int ret = 0;
+	int status = 0;
+	struct task_notify notify;
+	char data[] = "ABCDEFG";
+	char buf[64] = "XXXXXX";
+	unsigned long addr;
+	int n;
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Parent */
+	task_notify_wait(&notify);
+
+	struct task_struct *task = open_task(pid, FTO_RDWR);
+
+	task_attach(pid);
+
+	if (task_syscall_tramp_enable(task) || !task->syscall_tramp)
+		ret = -1;
+
+	addr = task_malloc(task, 64);
+	n = memcpy_to_task(task, addr, data, strlen(data) + 1);
+	n = memcpy_from_task(task, buf, addr, strlen(data) + 1);
+	if (n != strlen(data) + 1 || strcmp(data, buf))
+		ret = -1;
+	task_free(task, addr, 64);
+
+	if (task_syscall_tramp_disable(task) || task->syscall_tramp)
+		ret = -1;
+
+	task_detach(pid);
+
+	task_notify_trigger(&notify);
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	task_notify_destroy(&notify);
+
+	return ret;
+}
+
+TEST(Task, syscall_batch, 0)
+{
+	int ret = 0;
+	int status = 0;
+	struct task_notify notify;
+	char path[] = "/dev/null";
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Parent */
+	task_notify_wait(&notify);
+
+	struct task_struct *task = open_task(pid, FTO_RDWR);
+
+	struct task_syscall_entry calls[] = {
+		{
+			.nr = __NR_getpid,
+		},
+#if defined(__x86_64__)
+		{
+			.nr = __NR_open,
+			.args = { 0, O_RDONLY, 0 },
+			.data_mask = BIT(0),
+		},
+#elif defined(__aarch64__)
+		{
+			.nr = __NR_openat,
+			.args = { AT_FDCWD, 0, O_RDONLY, 0 },
+			.data_mask = BIT(1),
+		},
+#endif
+		{
+			.nr = __NR_close,
+			.args = { 1 },
+			.ret_mask = BIT(0),
+		},
+	};
+
+	task_attach(pid);
+
+	ret = task_syscall_batch(task, calls, ARRAY_SIZE(calls), path,
+				 sizeof(path));
+
+	ulp_info("getpid %ld, open %ld, close %ld\n", calls[0].ret,
+		 calls[1].ret, calls[2].ret);
+
+	if (calls[0].ret != pid || (long)calls[1].ret < 0 || calls[2].ret != 0)
+		ret = -1;
+
+	task_detach(pid);
+
+	task_notify_trigger(&notify);
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	task_notify_destroy(&notify);
+
+	return ret;
+}
+
+TEST(Task, mmap_fd, 0)
+{
+	int ret = 0;
+	int status = 0;
+	struct task_notify notify;
+	char magic[] = "ULPatch fd passing";
+	char buf[sizeof(magic)];
+	unsigned long addr;
+	int fd;
+
+	fd = memfd_create("ulpatch-test", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, PAGE_SIZE) ||
+	    pwrite(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+		ulp_error("memfd failed, %m\n");
+		return -1;
+	}
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Parent */
+	task_notify_wait(&notify);
+
+	struct task_struct *task = open_task(pid, FTO_RDWR);
+
+	task_attach(pid);
+
+	addr = task_mmap_fd(task, 0UL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (!addr || addr > -4096UL) {
+		ulp_error("task_mmap_fd failed, %s\n", strerror(-(long)addr));
+		ret = -1;
+	} else {
+		/* Shared with the memfd */
+		ret = memcpy_from_task(task, buf, addr, sizeof(buf));
+		if (ret != sizeof(buf) || memcmp(buf, magic, sizeof(magic)))
+			ret = -1;
+		else
+			ret = 0;
+		task_munmap(task, addr, PAGE_SIZE);
+	}
+
+	task_detach(pid);
+
+	task_notify_trigger(&notify);
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+	close(fd);
+
+	task_notify_destroy(&notify);
+
+	return ret;
+}
+
+/**
+ * The large shm of ulftrace is advised huge and prefaulted, see
+ * ftrace_shm_create(), all pages are resident without any access.
+ */
+TEST(Task, madvise_populate, 0)
+{
+	unsigned long addr;
+	size_t len = SZ_2M;
+	int ret = 0;
+	long rss;
+	pid_t pid = test_pool_get();
+
+	if (pid <= 0)
+		return -1;
+
+	struct task_struct *task = open_task(pid, FTO_RDWR);
+	if (!task) {
+		test_pool_put(pid, false);
+		return -1;
+	}
+
+	task_attach(pid);
+
+	addr = task_mmap(task, 0UL, len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (!addr || addr > -4096UL) {
+		ulp_error("task_mmap failed, %s\n", strerror(-(long)addr));
+		ret = -1;
+		goto detach;
+	}
+
+	rss = test_vma_rss(pid, addr);
+	if (rss != 0) {
+		ulp_error("Not accessed shm has %ld resident bytes.\n", rss);
+		ret = -1;
+		goto unmap;
+	}
+
+	/* No THP, it's fine */
+	if (task_madvise(task, addr, len, MADV_HUGEPAGE))
+		ulp_debug("No huge shm of %d\n", pid);
+
+	ret = task_madvise(task, addr, len, MADV_POPULATE_WRITE);
+	/* Before linux v5.14 */
+	if (ret == -EINVAL) {
+		ulp_warning("No MADV_POPULATE_WRITE, skip.\n");
+		ret = 0;
+		goto unmap;
+	}
+
+	rss = test_vma_rss(pid, addr);
+	if (ret || rss != (long)len) {
+		ulp_error("Prefault %d, %ld of %zu bytes resident.\n", ret,
+			  rss, len);
+		ret = -1;
+	}
+
+unmap:
+	task_munmap(task, addr, len);
+detach:
+	task_detach(pid);
+	close_task(task);
+	test_pool_put(pid, ret == 0);
+	return ret;
+}
+
+TEST(Task, attach_session, 0)
+{
+	int ret = 0;
+	unsigned long addr;
+	int i;
+	pid_t pid = test_pool_get();
+
+	if (pid <= 0)
+		return -1;
+
+	struct task_struct *task = open_task(pid, FTO_RDWR);
+	if (!task) {
+		test_pool_put(pid, false);
+		return -1;
+	}
+
+	ret = task_attach_session(task);
+	if (ret || task_attach_session(task) != -EBUSY)
+		ret = -1;
+
+	/* Registers will be restored once when detach */
+	for (i = 0; i < 4; i++) {
+		addr = task_malloc(task, 64);
+		if (!addr)
+			ret = -1;
+		task_free(task, addr, 64);
+	}
+
+	if (task_detach_session(task))
+		ret = -1;
+
+	close_task(task);
+	test_pool_put(pid, ret == 0);
+
+	return ret;
+}
+
+#define ASYNC_NR_TASKS	4
+
+struct async_test {
+	unsigned long pid;
+	unsigned long addr;
+	int nr_bad;
+};
+
+/* getpid(), mmap() and munmap() it, one syscall for each step */
+static int async_test_step(struct task_async *a)
+{
+	struct async_test *t = a->arg;
+
+	switch (a->nr_syscalls) {
+	case 0:
+		task_async_syscall(a, __NR_getpid, 0, 0, 0, 0, 0, 0);
+		return TASK_ASYNC_RUNNING;
+	case 1:
+		t->pid = a->ret;
+		task_async_syscall(a, __NR_mmap, 0, PAGE_SIZE,
+				   PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return TASK_ASYNC_RUNNING;
+	case 2:
+		t->addr = a->ret;
+		if (!t->addr || t->addr > -4096UL) {
+			t->nr_bad++;
+			return TASK_ASYNC_DONE;
+		}
+		task_async_syscall(a, __NR_munmap, t->addr, PAGE_SIZE, 0, 0,
+				   0, 0);
+		return TASK_ASYNC_RUNNING;
+	default:
+		if (a->ret)
+			t->nr_bad++;
+		return TASK_ASYNC_DONE;
+	}
+}
+
+/* Several tasks run their steps in one thread, interleaved */
+TEST(Task, async_syscall, 0)
+{
+	struct task_notify notify[ASYNC_NR_TASKS];
+	struct task_async as[ASYNC_NR_TASKS];
+	struct async_test ts[ASYNC_NR_TASKS];
+	struct task_struct *task[ASYNC_NR_TASKS];
+	pid_t pids[ASYNC_NR_TASKS];
+	int i, ret = 0, status;
+
+	memset(ts, 0, sizeof(ts));
+
+	for (i = 0; i < ASYNC_NR_TASKS; i++) {
+		task_notify_init(&notify[i], NULL);
+
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			char *argv[] = {
+				(char*)ulpatch_test_path,
+				"--role", "sleeper,trigger,sleeper,wait",
+				"--msgq", notify[i].tmpfile,
+				NULL
+			};
+			ret = execvp(argv[0], argv);
+			if (ret == -1) {
+				exit(1);
+			}
+		}
+		task_notify_wait(&notify[i]);
+
+		task[i] = open_task(pids[i], FTO_RDWR);
+		if (!task[i] || task_attach_session(task[i]))
+			ret = -1;
+		task_async_init(&as[i], task[i], async_test_step, &ts[i]);
+	}
+
+	if (!ret && task_async_run(as, ASYNC_NR_TASKS))
+		ret = -1;
+
+	for (i = 0; i < ASYNC_NR_TASKS; i++) {
+		if (as[i].state != TASK_ASYNC_DONE || as[i].nr_syscalls != 3 ||
+		    ts[i].pid != pids[i] || ts[i].nr_bad)
+			ret = -1;
+
+		if (task[i] && task_detach_session(task[i]))
+			ret = -1;
+
+		task_notify_trigger(&notify[i]);
+		waitpid(pids[i], &status, __WALL);
+		if (status != 0)
+			ret = -EINVAL;
+		close_task(task[i]);
+		task_notify_destroy(&notify[i]);
+	}
+
+	return ret;
+}
+
+TEST(Task, arena, 0)
+{
+	int ret = 0;
+	int status = 0;
+	struct task_notify notify;
+	unsigned long addrs[8], addr, big;
+	char buf[64] = "Hello arena";
+	char rbuf[64];
+	int i;
+
+	task_notify_init(&notify, NULL);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "sleeper,trigger,sleeper,wait",
+			"--msgq", notify.tmpfile,
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Parent */
+	task_notify_wait(&notify);
+
+	struct task_struct *task = open_task(pid, FTO_RDWR);
+
+	ret = task_attach_session(task);
+	if (ret)
+		goto done;
+
+	if (task_arena_create(task, TASK_ARENA_DEFAULT_SIZE)) {
+		ret = -1;
+		goto detach;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(addrs); i++) {
+		addrs[i] = task_malloc(task, sizeof(buf));
+		if (!task_arena_contains(task, addrs[i]))
+			ret = -1;
+	}
+
+	memcpy_to_task(task, addrs[3], buf, sizeof(buf));
+	memcpy_from_task(task, rbuf, addrs[3], sizeof(rbuf));
+	if (strcmp(buf, rbuf))
+		ret = -1;
+
+	/* Freed chunk will be reused */
+	task_free(task, addrs[3], sizeof(buf));
+	addr = task_malloc(task, sizeof(buf) - 1);
+	if (addr != addrs[3])
+		ret = -1;
+	if (task->arena->nr_allocs != ARRAY_SIZE(addrs) + 1 ||
+	    task->arena->used != ARRAY_SIZE(addrs) * sizeof(buf))
+		ret = -1;
+
+	/* Large request mmap directly */
+	big = task_malloc(task, TASK_ARENA_MAX_CHUNK + 1);
+	if (!big || task_arena_contains(task, big))
+		ret = -1;
+	task_free(task, big, TASK_ARENA_MAX_CHUNK + 1);
+
+	for (i = 0; i < ARRAY_SIZE(addrs); i++)
+		task_free(task, addrs[i], sizeof(buf));
+	if (task->arena->used != 0)
+		ret = -1;
+
+	task_arena_stats(stdout, task);
+
+	if (task_arena_destroy(task) || task->arena)
+		ret = -1;
+
+detach:
+	task_detach_session(task);
+done:
+	task_notify_trigger(&notify);
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	task_notify_destroy(&notify);
+
+	return ret;
+}
+
+TEST(Task, freeze_threads, 0)
+{
+	int ret = 0;
+	int status = 0;
+	struct thread *thread;
+	struct task_struct *task;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "multi-threads",
+			"--nr-threads", "4",
+			"--print-nloop", "20",
+			"--print-usec", "50000",
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Make sure threads created */
+	usleep(200000);
+
+	task = open_task(pid, FTO_THREADS);
+	if (!task)
+		return -1;
+
+	ret = task_freeze_threads(task);
+	if (ret == 0) {
+		list_for_each_entry(thread, &task->threads_list, node) {
+			if (!thread->frozen)
+				ret = -1;
+		}
+		dump_task_threads(stdout, task, true);
+		if (task_thaw_threads(task))
+			ret = -1;
+	}
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	return ret;
+}
+
+TEST(Task, freeze_new_threads, 0)
+{
+	int ret = 0, nr = 0;
+	int status = 0;
+	struct thread *thread, *tmp;
+	struct task_struct *task;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "multi-threads",
+			"--nr-threads", "4",
+			"--print-nloop", "20",
+			"--print-usec", "50000",
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Make sure threads created */
+	usleep(200000);
+
+	task = open_task(pid, FTO_THREADS);
+	if (!task || !task_threads(task))
+		return -1;
+
+	/* As if the threads were created after the list was read */
+	list_for_each_entry_safe(thread, tmp, &task->threads_list, node) {
+		if (thread->tid == pid)
+			continue;
+		list_del(&thread->node);
+		free(thread);
+	}
+
+	ret = task_freeze_threads(task);
+	if (ret == 0) {
+		list_for_each_entry(thread, &task->threads_list, node) {
+			if (!thread->frozen)
+				ret = -1;
+			nr++;
+		}
+		/* The leader and 4 threads */
+		if (nr != 5) {
+			ulp_error("Freeze %d threads, expect 5.\n", nr);
+			ret = -1;
+		}
+		if (task_thaw_threads(task))
+			ret = -1;
+	}
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	return ret;
+}
+
+TEST(Task, check_stacks, 0)
+{
+	int ret = 0, err;
+	int status = 0;
+	struct thread *thread;
+	struct task_struct *task;
+	struct task_stack_stats st;
+	struct task_addr_range range = {};
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "multi-threads",
+			"--nr-threads", "4",
+			"--print-nloop", "20",
+			"--print-usec", "50000",
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Make sure threads created */
+	usleep(200000);
+
+	task = open_task(pid, FTO_THREADS | FTO_RDWR);
+	if (!task)
+		return -1;
+
+	ret = task_freeze_threads(task);
+	if (ret == 0) {
+		/* Nobody executes in zero page */
+		range.start = 0;
+		range.end = PAGE_SIZE;
+		err = task_check_stacks(task, &range, 1, 0, &st);
+		if (err || st.nr_threads == 0) {
+			ulp_error("Check stacks: %d, %u threads\n", err,
+				  st.nr_threads);
+			ret = -1;
+		}
+
+		/* The PC of every thread is recorded, it's busy of course */
+		list_for_each_entry(thread, &task->threads_list, node) {
+			range.start = thread->ip;
+			range.end = thread->ip + 1;
+			break;
+		}
+		err = task_check_stacks(task, &range, 1, 0, &st);
+		if (err != -EBUSY || !st.busy_tid) {
+			ulp_error("Check stacks: %d, busy %d\n", err,
+				  st.busy_tid);
+			ret = -1;
+		}
+
+		if (task_thaw_threads(task))
+			ret = -1;
+	}
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	return ret;
+}
+
+/* Park and resume the threads by the injected handler twice */
+TEST(Task, quiesce_threads, 0)
+{
+	int ret = 0, err, i;
+	int status = 0;
+	struct task_struct *task;
+	struct task_stack_stats st;
+	struct task_addr_range range = {
+		/* Nobody executes in zero page */
+		.start = 0,
+		.end = PAGE_SIZE,
+	};
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "multi-threads",
+			"--nr-threads", "4",
+			"--print-nloop", "20",
+			"--print-usec", "50000",
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Make sure threads created */
+	usleep(200000);
+
+	task = open_task(pid, FTO_THREADS | FTO_RDWR);
+	if (!task)
+		return -1;
+
+	for (i = 0; i < 2 && !ret; i++) {
+		err = task_quiesce_threads(task, &range, 1, 1000000000UL, &st);
+		/* The leader and 4 threads */
+		if (err || st.nr_threads != 5 || !task_quiesced(task)) {
+			ulp_error("Quiesce: %d, %u threads\n", err,
+				  st.nr_threads);
+			ret = -1;
+			break;
+		}
+		if (task_quiesce_check(task)) {
+			ulp_error("Quiescence expired.\n");
+			ret = -1;
+		}
+		if (task_quiesce_release(task) || task_quiesced(task))
+			ret = -1;
+	}
+	if (task_quiesce_end(task))
+		ret = -1;
+
+	/* The resumed threads print and exit normally */
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	return ret;
+}
+
+/* The threads sleep between prints, most of time blocked in syscall */
+TEST(Task, precheck_stacks, 0)
+{
+	int ret = 0, err, i;
+	int status = 0;
+	struct thread *thread;
+	struct task_struct *task;
+	struct task_stack_stats st;
+	struct task_addr_range range = {};
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "multi-threads",
+			"--nr-threads", "4",
+			"--print-nloop", "20",
+			"--print-usec", "50000",
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Make sure threads created */
+	usleep(200000);
+
+	task = open_task(pid, FTO_THREADS);
+	if (!task)
+		return -1;
+
+	/* Nobody executes in zero page */
+	range.start = 0;
+	range.end = PAGE_SIZE;
+	err = task_precheck_stacks(task, &range, 1, &st);
+	if (err || st.nr_threads == 0 || st.nr_running == st.nr_threads) {
+		ulp_error("Precheck stacks: %d, %u threads, %u running\n",
+			  err, st.nr_threads, st.nr_running);
+		ret = -1;
+	}
+
+	/* The blocked one is busy at the same PC, unless it's running now */
+	for (i = 0, err = 0; i < 10 && err != -EBUSY; i++) {
+		list_for_each_entry(thread, &task->threads_list, node) {
+			if (!thread->ip)
+				continue;
+			range.start = thread->ip;
+			range.end = thread->ip + 1;
+			break;
+		}
+		err = task_precheck_stacks(task, &range, 1, &st);
+	}
+	if (err != -EBUSY || !st.busy_tid) {
+		ulp_error("Precheck stacks: %d, busy %d\n", err, st.busy_tid);
+		ret = -1;
+	}
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	return ret;
+}
+
+static int check_snapshot(struct task_struct *task, unsigned int flags)
+{
+	const char *file = "snapshot.core";
+	struct task_snapshot_stats st;
+	Elf64_Ehdr ehdr;
+	int ret, fd;
+
+	ret = task_snapshot(task, file, flags, 2, &st);
+	if (ret)
+		return ret;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr) ||
+	    memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_type != ET_CORE ||
+	    ehdr.e_phnum != st.nr_loads + 1)
+		ret = -1;
+	if (fd >= 0)
+		close(fd);
+	fremove(file);
+
+	if (!st.nr_threads || !st.bytes || !st.stop_ns)
+		ret = -1;
+	return ret;
+}
+
+TEST(Task, snapshot, 0)
+{
+	int ret = 0;
+	int status = 0;
+	struct task_struct *task;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char *argv[] = {
+			(char*)ulpatch_test_path,
+			"--role", "multi-threads",
+			"--nr-threads", "4",
+			"--print-nloop", "20",
+			"--print-usec", "50000",
+			NULL
+		};
+		ret = execvp(argv[0], argv);
+		if (ret == -1) {
+			exit(1);
+		}
+	}
+
+	/* Make sure threads created */
+	usleep(200000);
+
+	task = open_task(pid, FTO_THREADS);
+	if (!task)
+		return -1;
+
+	ret += check_snapshot(task, 0);
+	/* Fallback to copy in freeze if no CONFIG_MEM_SOFT_DIRTY */
+	ret += check_snapshot(task, SNAPSHOT_F_SOFT_DIRTY);
+
+	waitpid(pid, &status, __WALL);
+	if (status != 0)
+		ret = -EINVAL;
+	close_task(task);
+
+	return ret;
+}
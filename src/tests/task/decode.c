@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+#include <tests/test-api.h>
+
+TEST_STUB(task_decode);
+
+enum decode_test_color {
+	DECODE_TEST_RED,
+	DECODE_TEST_GREEN = 5,
+};
+
+struct decode_test_node {
+	int val;
+	unsigned int flag:3, mode:5;
+	enum decode_test_color color;
+	char name[8];
+	struct decode_test_node *next;
+};
+
+/**
+ * Decode a cycle of three nodes of the test itself, every node is printed
+ * once, the pointer back to the first one is not queued again. Skip if no
+ * debuginfo or libdw.
+ */
+TEST(Task, decode, 0)
+{
+	struct decode_test_node nodes[3] = {
+		{ .val = 1, .name = "head", .next = &nodes[1] },
+		{ .val = -2, .flag = 5, .mode = 17, .color = DECODE_TEST_GREEN,
+		  .next = &nodes[2] },
+		{ .val = 3, .next = &nodes[0] },
+	};
+	struct task_decode_stats st;
+	struct task_struct *task;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int err, ret = 0;
+
+	task = open_task(getpid(), FTO_NONE);
+	if (!task)
+		return -errno;
+
+	fp = open_memstream(&buf, &len);
+	if (!fp) {
+		close_task(task);
+		return -errno;
+	}
+
+	err = task_decode(fp, task, "struct decode_test_node",
+			  (unsigned long)nodes, 3, &st);
+	fclose(fp);
+
+	if (err == -ENOENT || err == -ENOSYS) {
+		ulp_warning("No DWARF of test, skip.\n");
+	} else if (err || st.nr_objs != 3 || st.nr_unreadable ||
+		   !strstr(buf, ".val = -2,") ||
+		   !strstr(buf, ".flag = 5,") ||
+		   !strstr(buf, ".mode = 17,") ||
+		   !strstr(buf, ".color = DECODE_TEST_GREEN (5),") ||
+		   !strstr(buf, ".name = \"head\",") ||
+		   !strstr(buf, "-> [0]")) {
+		fprintf(stderr, "%s", buf ?: "");
+		ret = -1;
+	}
+
+	free(buf);
+	close_task(task);
+	return ret;
+}
@@ -2,11 +2,13 @@
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <poll.h>
 
 #include <utils/log.h>
 #include <utils/list.h>
@@ -52,3 +54,216 @@ TEST(Task_proc, open_pid_maps, 0)
 	return 0;
 }
 
+
+struct events_child {
+	pid_t pid;
+	bool fork, exit;
+};
+
+static void events_cb(const struct task_event *ev, void *arg)
+{
+	struct events_child *child = arg;
+
+	if (ev->pid != child->pid)
+		return;
+	if (ev->type == TASK_EVENT_FORK && ev->ppid == getpid())
+		child->fork = true;
+	if (ev->type == TASK_EVENT_EXIT && WEXITSTATUS(ev->exit_code) == 3)
+		child->exit = true;
+}
+
+TEST(Task_proc, events, 0)
+{
+	struct events_child child = {};
+	struct pollfd pfd;
+	int fd, i;
+
+	fd = task_events_open();
+	if (fd < 0) {
+		/* No CAP_NET_ADMIN or CONFIG_PROC_EVENTS */
+		ulp_warning("No proc connector, %s, skip\n", strerror(-fd));
+		return 0;
+	}
+
+	child.pid = fork();
+	if (child.pid == 0)
+		_exit(3);
+	waitpid(child.pid, NULL, 0);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (i = 0; i < 100 && !child.exit; i++) {
+		if (poll(&pfd, 1, 10) > 0)
+			task_events_read(fd, events_cb, &child);
+	}
+
+	task_events_close(fd);
+	return child.fork && child.exit ? 0 : -1;
+}
+
+TEST(Task_proc, libc_mapped, 0)
+{
+	return proc_pid_libc_mapped(getpid()) ? 0 : -1;
+}
+
+TEST(Task_proc, handles, 0)
+{
+	struct task_struct *task;
+	struct stat st1, st2;
+	int pipefd[2], fd, ret = 0;
+	pid_t pid;
+	char c;
+
+	if (pipe(pipefd))
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(pipefd[1]);
+		ret = read(pipefd[0], &c, 1);
+		_exit(0);
+	}
+	close(pipefd[0]);
+
+	task = open_task(pid, FTO_NONE);
+	if (!task) {
+		ret = -1;
+		goto kill;
+	}
+
+	if (task->proc_dirfd < 0 || !task_alive(task))
+		ret = -1;
+
+	/* The read end of pipe is still opened by child */
+	fd = task_getfd(task, pipefd[0]);
+	if (fd < 0 || fstat(fd, &st1) || fstat(pipefd[1], &st2) ||
+	    st1.st_ino != st2.st_ino)
+		ret = -1;
+	if (fd >= 0)
+		close(fd);
+
+kill:
+	close(pipefd[1]);
+	waitpid(pid, NULL, 0);
+
+	/* Exited and reaped, the pid may be reused already */
+	if (task) {
+		if (task->pidfd >= 0 && task_alive(task))
+			ret = -1;
+		close_task(task);
+	}
+	return ret;
+}
+
+TEST(Task_proc, path, 0)
+{
+	struct task_struct *task;
+	int to_child[2], to_parent[2], ret = 0;
+	char buf[PATH_MAX], c = 0;
+	const char *path;
+	pid_t pid;
+
+	if (pipe(to_child))
+		return -1;
+	if (pipe(to_parent)) {
+		close(to_child[0]);
+		close(to_child[1]);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {
+		close(to_child[1]);
+		close(to_parent[0]);
+		/* Another mount namespace if permitted, like a container */
+		c = unshare(CLONE_NEWNS) ? 'n' : 'y';
+		ret = write(to_parent[1], &c, 1);
+		ret = read(to_child[0], &c, 1);
+		_exit(0);
+	}
+	close(to_child[0]);
+	close(to_parent[1]);
+
+	if (read(to_parent[0], &c, 1) != 1) {
+		ret = -1;
+		goto kill;
+	}
+
+	task = open_task(pid, FTO_NONE);
+	if (!task) {
+		ret = -1;
+		goto kill;
+	}
+
+	path = task_path(task, task->exe, buf, sizeof(buf));
+	printf("%c: %s -> %s\n", c, task->exe, path);
+
+	if (!task_path_exist(task, task->exe) || !fexist(path))
+		ret = -1;
+	if (c == 'y' && (task->root_dirfd < 0 || path == task->exe))
+		ret = -1;
+	if (c == 'n' && (task->root_dirfd >= 0 || path != task->exe))
+		ret = -1;
+
+	close_task(task);
+kill:
+	close(to_child[1]);
+	close(to_parent[0]);
+	waitpid(pid, NULL, 0);
+	return ret;
+}
+
+/**
+ * The directory of an exited process is removed with everything in it, the
+ * target of the symlink in it is kept, the one of current process is kept.
+ */
+TEST(Task_proc, gc, 0)
+{
+	struct task_proc_gc_stats stats;
+	char dead[PATH_MAX], self[PATH_MAX], buf[PATH_MAX];
+	char keep[] = "/tmp/ulpatch-gc-XXXXXX";
+	bool self_created;
+	int ret = 0;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0)
+		_exit(0);
+	waitpid(pid, NULL, 0);
+
+	if (!mkdtemp(keep))
+		return -errno;
+
+	mkdir(ULP_PROC_ROOT_DIR, 0755);
+	snprintf(dead, sizeof(dead), ULP_PROC_ROOT_DIR "/%d", pid);
+	snprintf(self, sizeof(self), ULP_PROC_ROOT_DIR "/%d", getpid());
+	self_created = !mkdir(self, 0755);
+
+	snprintf(buf, sizeof(buf), "%s/" TASK_PROC_MAP_FILES, dead);
+	if (mkdir(dead, 0755) || mkdir(buf, 0755))
+		ret = -1;
+	snprintf(buf, sizeof(buf), "%s/" TASK_PROC_MAP_FILES "/sub", dead);
+	if (mkdir(buf, 0755))
+		ret = -1;
+	snprintf(buf, sizeof(buf), "%s/" TASK_PROC_MAP_FILES "/sub/a", dead);
+	ret |= ftouch(buf, 16);
+	snprintf(buf, sizeof(buf), "%s/" TASK_PROC_COMM, dead);
+	ret |= ftouch(buf, 0);
+	snprintf(buf, sizeof(buf), "%s/" TASK_PROC_MAP_FILES "/link", dead);
+	if (symlink(keep, buf))
+		ret = -1;
+
+	if (task_proc_gc(2, &stats) || stats.nr_removed < 1) {
+		ulp_error("GC failed, %u removed.\n", stats.nr_removed);
+		ret = -1;
+	}
+
+	if (fexist(dead) || !fexist(keep) || !fexist(self))
+		ret = -1;
+
+	if (self_created)
+		rmdir(self);
+	fremove_recursive(dead);
+	rmdir(keep);
+	return ret;
+}
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <task/task.h>
+#include <tests/test-api.h>
+
+TEST_STUB(task_search);
+
+static bool has_match(const struct task_search_match *matches, ssize_t nr,
+		      unsigned long addr)
+{
+	ssize_t i;
+
+	for (i = 0; i < nr; i++)
+		if (matches[i].addr == addr)
+			return true;
+	return false;
+}
+
+/**
+ * The pattern across the 1M chunk boundary of a VMA is found once, and the
+ * one in an unreadable page is never. The needle itself is a match too.
+ */
+TEST(Task, search, 0)
+{
+	struct task_search_match *matches;
+	struct task_struct *task;
+	unsigned char pat[16];
+	size_t size = 3 * SZ_1M;
+	ssize_t nr, i;
+	char *mem;
+	int ret = 0;
+
+	/* Built at runtime, never in .rodata */
+	for (i = 0; i < sizeof(pat); i++)
+		pat[i] = 0xa5 ^ (i * 37);
+
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -errno;
+
+	memcpy(mem + SZ_1M - 5, pat, sizeof(pat));
+	memcpy(mem + 2 * SZ_1M + 100, pat, sizeof(pat));
+	memcpy(mem + 2 * SZ_1M + PAGE_SIZE, pat, sizeof(pat));
+	mprotect(mem + 2 * SZ_1M + PAGE_SIZE, PAGE_SIZE, PROT_NONE);
+
+	task = open_task(getpid(), FTO_NONE);
+	if (!task) {
+		munmap(mem, size);
+		return -errno;
+	}
+
+	nr = task_search(task, pat, sizeof(pat), NULL, 4, 0, &matches);
+	if (nr < 3 ||
+	    !has_match(matches, nr, (unsigned long)mem + SZ_1M - 5) ||
+	    !has_match(matches, nr, (unsigned long)mem + 2 * SZ_1M + 100) ||
+	    !has_match(matches, nr, (unsigned long)pat) ||
+	    has_match(matches, nr, (unsigned long)mem + 2 * SZ_1M + PAGE_SIZE))
+		ret = -1;
+
+	/* In the order of address, no duplicate */
+	for (i = 1; i < nr; i++)
+		if (matches[i - 1].addr >= matches[i].addr)
+			ret = -1;
+	free(matches);
+
+	/* Only the VMAs match, not the [stack] of needle */
+	nr = task_search(task, pat, sizeof(pat), "libc*", 1, 0, &matches);
+	if (nr < 0 || has_match(matches, nr, (unsigned long)pat))
+		ret = -1;
+	free(matches);
+
+	close_task(task);
+	munmap(mem, size);
+	return ret;
+}
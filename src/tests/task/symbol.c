@@ -2,6 +2,7 @@
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -106,7 +107,9 @@ TEST(Task_sym, find_task_symbol_value, 0)
 	int i, ret = 0;
 	struct task_struct *task;
 
-	task = open_task(getpid(), FTO_VMA_ELF_FILE);
+	task = test_fixture_task(FTO_VMA_ELF_FILE);
+	if (!task)
+		return -1;
 
 #if defined(__clang__)
 # pragma clang diagnostic push
@@ -123,7 +126,419 @@ TEST(Task_sym, find_task_symbol_value, 0)
 #elif defined(__clang__)
 # pragma clang diagnostic pop
 #endif
+	return ret;
+}
+
+/* The iterator and the buffer are the same as the malloced extras */
+TEST(Task_sym, sym_extras, 0)
+{
+	const struct task_sym **extras, *buf[4];
+	struct task_sym *sym, *is;
+	struct task_struct *task;
+	size_t i, n, nr_extras;
+	int j, ret = 0;
+
+	task = test_fixture_task(FTO_VMA_ELF_FILE);
+	if (!task)
+		return -1;
+
+	for (j = 0; j < nr_test_symbols(); j++) {
+		extras = NULL;
+		sym = find_task_sym(task, test_symbols[j].sym, &extras,
+				    &nr_extras);
+		if (!sym)
+			continue;
+
+		n = task_sym_extras(sym, buf, ARRAY_SIZE(buf));
+		if (n != nr_extras)
+			ret = -1;
+		for (i = 0; i < MIN(n, ARRAY_SIZE(buf)); i++)
+			if (buf[i] != extras[i])
+				ret = -1;
+
+		i = 0;
+		task_sym_for_each_extra(is, sym) {
+			if (i >= nr_extras || is != extras[i])
+				ret = -1;
+			i++;
+		}
+		if (i != nr_extras)
+			ret = -1;
+
+		free((void *)extras);
+	}
+
+	return ret;
+}
+
+
+TEST(Task_sym, hash_index, 0)
+{
+	int ret = 0;
+	size_t nr = 0;
+	char name[256];
+	struct task_struct *task;
+	struct task_sym *tsym;
+
+	task = open_task(getpid(), FTO_ULPATCH);
+	if (!task)
+		return -1;
+
+	for (tsym = next_task_sym(task, NULL); tsym;
+	     tsym = next_task_sym(task, tsym)) {
+		nr++;
+
+		if (strlen(tsym->name) >= sizeof(name))
+			continue;
+
+		/* Not interned copy of name */
+		strcpy(name, tsym->name);
+
+		if (find_task_sym(task, name, NULL, NULL) != tsym) {
+			ulp_error("Hash index miss %s\n", tsym->name);
+			ret = -1;
+		}
+	}
+
+	if (task->tsyms.hash && task->tsyms.nr_hash != nr) {
+		ulp_error("Hash index has %ld, rbtree has %ld\n",
+			  task->tsyms.nr_hash, nr);
+		ret = -1;
+	}
+
+	if (find_task_sym(task, "ulpatch_test_never_exist_symbol", NULL, NULL))
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task_sym, find_task_sym_contain, 0)
+{
+	int i, ret = 0;
+	unsigned long offset;
+	struct task_struct *task;
+	struct task_sym *tsym;
+
+	task = test_fixture_task(FTO_VMA_ELF_SYMBOLS);
+	if (!task)
+		return -1;
+
+	for (i = 0; i < nr_test_symbols(); i++) {
+		struct test_symbol *sym = &test_symbols[i];
+
+		if (sym->type != TYPE_TST_SYM_FUNC)
+			continue;
+
+		/* The PC inside the function */
+		tsym = find_task_sym_contain(task, sym->addr + 1, &offset);
+		if (!tsym || tsym->addr != sym->addr || offset != 1) {
+			ulp_error("%s: %lx not in %s %lx\n", sym->sym,
+				  sym->addr + 1, tsym ? tsym->name : "(nil)",
+				  tsym ? tsym->addr : 0);
+			ret = -1;
+		}
+	}
+
+	/* Not mapped */
+	if (find_task_sym_contain(task, 0, NULL))
+		ret = -1;
+
+	return ret;
+}
+
+TEST(Task_sym, lazy_load, 0)
+{
+	int i, ret = 0;
+	struct task_struct *lazy, *eager;
+	struct task_sym *s1, *s2;
+
+	lazy = open_task(getpid(), FTO_VMA_ELF_SYMBOLS);
+	eager = open_task(getpid(), FTO_VMA_ELF_SYMBOLS);
+	if (!lazy || !eager) {
+		ret = -1;
+		goto out;
+	}
+
+	/* Nothing loaded before the first lookup */
+	if (!lazy->tsyms.nr_lazy_vmas || next_task_sym(lazy, NULL) == NULL)
+		ret = -1;
+	close_task(lazy);
+
+	lazy = open_task(getpid(), FTO_VMA_ELF_SYMBOLS);
+	task_load_all_syms(eager);
+
+	if (eager->tsyms.nr_lazy_vmas)
+		ret = -1;
+
+	/* Same symbol no matter in which order the VMAs are loaded */
+	for (i = nr_test_symbols() - 1; i >= 0; i--) {
+		s1 = find_task_sym(lazy, test_symbols[i].sym, NULL, NULL);
+		s2 = find_task_sym(eager, test_symbols[i].sym, NULL, NULL);
+		if (!s1 || !s2 || s1->addr != s2->addr) {
+			ulp_error("%s: lazy %lx, eager %lx\n",
+				  test_symbols[i].sym, s1 ? s1->addr : 0,
+				  s2 ? s2->addr : 0);
+			ret = -1;
+		}
+	}
+
+out:
+	if (lazy)
+		close_task(lazy);
+	if (eager)
+		close_task(eager);
+	return ret;
+}
+
+TEST(Task_sym, dynsym, 0)
+{
+	int ret = 0;
+	struct task_struct *task;
+	unsigned long addr;
+
+	/* Only ELF headers of VMAs, no ELF file opened */
+	task = open_task(getpid(), FTO_VMA_ELF);
+	if (!task)
+		return -1;
+
+	addr = task_dynsym_addr(task, "fopen");
+	/* Non-PIE executable may have canonical PLT of fopen */
+	if (!addr || (task_is_pie(task) && addr != (unsigned long)fopen)) {
+		ulp_error("fopen: dynsym %lx, real %lx\n", addr,
+			  (unsigned long)fopen);
+		ret = -1;
+	}
+
+	if (task_dynsym_addr(task, "__ulpatch_not_exist_symbol"))
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task_sym, dynsym_batch, 0)
+{
+	int i, ret = 0;
+	struct task_struct *task;
+	const char *names[] = {
+		"fopen",
+		"__ulpatch_not_exist_symbol",
+		"fclose",
+		"malloc",
+	};
+	unsigned long addrs[ARRAY_SIZE(names)] = {};
+
+	task = open_task(getpid(), FTO_VMA_ELF);
+	if (!task)
+		return -1;
+
+	if (task_dynsym_addrs(task, names, addrs, ARRAY_SIZE(names)) != 3)
+		ret = -1;
+
+	/* Same as one by one */
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (addrs[i] != task_dynsym_addr(task, names[i])) {
+			ulp_error("%s: batch %lx\n", names[i], addrs[i]);
+			ret = -1;
+		}
+	}
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task_sym, dynsym_find_task_sym, 0)
+{
+	int ret = 0;
+	struct task_struct *task;
+	struct task_sym *s;
+
+	/* No bfd_elf_file, find_task_sym() falls back to dynsym */
+	task = open_task(getpid(), FTO_VMA_ELF);
+	if (!task)
+		return -1;
+
+	s = find_task_sym(task, "fopen", NULL, NULL);
+	if (!s || s->addr != task_dynsym_addr(task, "fopen")) {
+		ulp_error("fopen: %lx\n", s ? s->addr : 0);
+		ret = -1;
+	}
+
+	/* Linked, resolved once */
+	if (find_task_sym(task, "fopen", NULL, NULL) != s)
+		ret = -1;
+
+	if (find_task_sym(task, "__ulpatch_not_exist_symbol", NULL, NULL))
+		ret = -1;
+
 	close_task(task);
 	return ret;
 }
 
+TEST(Task_sym, got_slot, 0)
+{
+	int ret = 0;
+	struct task_struct *task;
+	unsigned long slot, val = 0;
+	FILE *fp;
+
+	/* Bind the PLT of fopen(3) if lazy binding */
+	fp = fopen("/proc/self/stat", "r");
+	if (fp)
+		fclose(fp);
+
+	task = open_task(getpid(), FTO_VMA_ELF);
+	if (!task)
+		return -1;
+
+	slot = vma_got_slot(task->vma_self_elf, "fopen");
+	if (!slot ||
+	    memcpy_from_task(task, &val, slot, sizeof(val)) != sizeof(val) ||
+	    val != task_dynsym_addr(task, "fopen")) {
+		ulp_error("fopen GOT slot %lx: %lx\n", slot, val);
+		ret = -1;
+	}
+
+	/* Not imported */
+	if (vma_got_slot(task->vma_self_elf, "__ulpatch_not_exist_symbol"))
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task_sym, layered_lookup, 0)
+{
+	int i, ret = 0;
+	size_t nr_lazy;
+	struct task_struct *task;
+	struct task_sym *s;
+
+	task = test_fixture_task(FTO_VMA_ELF_SYMBOLS);
+	if (!task)
+		return -1;
+
+	nr_lazy = task->tsyms.nr_lazy_vmas;
+
+	for (i = 0; i < nr_test_symbols(); i++) {
+		s = find_task_sym(task, test_symbols[i].sym, NULL, NULL);
+		if (!s) {
+			ulp_error("Not found %s\n", test_symbols[i].sym);
+			ret = -1;
+		}
+	}
+
+	/* Lookup by name never copy the whole VMA symbols */
+	if (task->tsyms.nr_lazy_vmas != nr_lazy)
+		ret = -1;
+
+	return ret;
+}
+
+/* Every linked symbol belongs to a VMA still in task, and not @unmapped */
+static int check_syms_vma(struct task_struct *task, unsigned long unmapped)
+{
+	struct task_sym *tsym, *s;
+	int ret = 0;
+
+	for (tsym = next_task_sym(task, NULL); tsym;
+	     tsym = next_task_sym(task, tsym)) {
+		if (find_vma(task, tsym->vma->vm_start) != tsym->vma ||
+		    tsym->vma->vm_start == unmapped) {
+			ulp_error("TSYM %s %lx of stale vma\n", tsym->name,
+				  tsym->addr);
+			ret = -1;
+		}
+		list_for_each_entry(s, &tsym->list_name.head, list_name.node) {
+			if (find_vma(task, s->vma->vm_start) != s->vma ||
+			    s->vma->vm_start == unmapped) {
+				ulp_error("TSYM: SUB %s %lx of stale vma\n",
+					  s->name, s->addr);
+				ret = -1;
+			}
+		}
+	}
+	return ret;
+}
+
+/* The symbols of unmapped VMA are unlinked by refresh_task_vmas() */
+TEST(Task_sym, unmap_vma, 0)
+{
+	int ret = 0, fd = -1, size = 0;
+	char file[PATH_MAX];
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	struct task_sym *s;
+	unsigned long addr;
+	void *map = MAP_FAILED, *anon = MAP_FAILED;
+
+	/* A private copy of libc, the ELF VMA is owned by the test */
+	task = open_task(getpid(), FTO_NONE);
+	if (!task || !task->libc_vma)
+		return -1;
+	snprintf(file, sizeof(file), "/tmp/ulpatch-unmap-syms-%d", getpid());
+	unlink(file);
+	if (fcopy(task->libc_vma->name_, file))
+		ret = -1;
+	close_task(task);
+	task = NULL;
+	if (ret)
+		return ret;
+
+	fd = open(file, O_RDONLY);
+	size = fsize(file);
+	if (fd < 0 || size <= 0) {
+		ret = -1;
+		goto out;
+	}
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -1;
+		goto out;
+	}
+	addr = (unsigned long)map;
+
+	task = open_task(getpid(), FTO_VMA_ELF_SYMBOLS);
+	vma = task ? find_vma(task, addr) : NULL;
+	if (!vma || !vma->is_elf || !vma->bfd_elf_file) {
+		ulp_error("%s is not ELF VMA\n", file);
+		ret = -1;
+		goto out;
+	}
+
+	task_load_all_syms(task);
+	if (!find_task_sym(task, "fopen", NULL, NULL)) {
+		ret = -1;
+		goto out;
+	}
+
+	munmap(map, size);
+	map = MAP_FAILED;
+	/* May take the slot of the dropped VMA in the same refresh */
+	anon = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+
+	if (refresh_task_vmas(task, NULL) || check_syms_vma(task, addr))
+		ret = -1;
+
+	/* The libc one is still there */
+	s = find_task_sym(task, "fopen", NULL, NULL);
+	if (!s || s->vma->vm_start == addr ||
+	    find_task_sym_contain(task, s->addr, NULL) == NULL) {
+		ulp_error("fopen: %lx\n", s ? s->addr : 0);
+		ret = -1;
+	}
+
+out:
+	if (anon != MAP_FAILED)
+		munmap(anon, PAGE_SIZE);
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (task)
+		close_task(task);
+	if (fd >= 0)
+		close(fd);
+	unlink(file);
+	return ret;
+}
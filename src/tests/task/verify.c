@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/list.h>
+#include <task/task.h>
+#include <tests/test-api.h>
+
+TEST_STUB(task_verify);
+
+static __opt_O0 int verify_victim(int a)
+{
+	return a + 1;
+}
+
+static bool diff_cover(struct task_text_diff *diffs, ssize_t nr,
+		       unsigned long addr)
+{
+	ssize_t i;
+
+	for (i = 0; i < nr; i++)
+		if (diffs[i].start <= addr && addr < diffs[i].end)
+			return true;
+	return false;
+}
+
+/**
+ * Other tests may patch the text of current process, only check the byte
+ * modified by this test.
+ */
+TEST(Task, verify_text, 0)
+{
+	unsigned long addr = (unsigned long)verify_victim;
+	struct task_verify_stats stats;
+	struct task_text_diff *diffs;
+	struct task_struct *task;
+	unsigned char orig, byte;
+	ssize_t nr;
+	int ret = 0;
+
+	task = open_task(getpid(), FTO_RDWR);
+	if (!task)
+		return -errno;
+
+	if (memcpy_from_task(task, &orig, addr, 1) != 1) {
+		ret = -EFAULT;
+		goto close;
+	}
+
+	nr = task_verify_text(task, 4, &diffs, &stats);
+	if (nr < 0 || diff_cover(diffs, nr, addr) || !stats.nr_vmas)
+		ret = -1;
+	free(diffs);
+
+	byte = ~orig;
+	if (memcpy_to_task(task, addr, &byte, 1) != 1) {
+		ret = -EFAULT;
+		goto close;
+	}
+
+	nr = task_verify_text(task, 4, &diffs, &stats);
+	if (nr <= 0 || !diff_cover(diffs, nr, addr) || !stats.diff_bytes)
+		ret = -1;
+	free(diffs);
+
+	memcpy_to_task(task, addr, &orig, 1);
+
+	/* Still callable */
+	if (verify_victim(1) != 2)
+		ret = -1;
+close:
+	close_task(task);
+	return ret;
+}
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/list.h>
+#include <task/task.h>
+#include <tests/test-api.h>
+
+TEST_STUB(task_vma_iter);
+
+/* No BTF, too old kernel, or no CAP_BPF */
+static bool vma_iter_unsupported(int err)
+{
+	return err == -EOPNOTSUPP || err == -EPERM || err == -EACCES;
+}
+
+/* The executable VMAs never change, compare them with /proc/self/maps */
+TEST(Task, vma_iter_maps, 0)
+{
+	const struct task_vma_iter_task *t;
+	struct task_vma_iter it;
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	const struct maps_entry *e;
+	unsigned int i, nr_exec = 0;
+	int ret = 0;
+
+	ret = task_vma_iter_read(&it);
+	if (vma_iter_unsupported(ret)) {
+		ulp_warning("No task_vma iterator, skip.\n");
+		task_vma_iter_free(&it);
+		return 0;
+	}
+	if (ret) {
+		task_vma_iter_free(&it);
+		return ret;
+	}
+
+	t = task_vma_iter_find(&it, getpid());
+	if (!t || !t->nr) {
+		task_vma_iter_free(&it);
+		return -ENOENT;
+	}
+
+	task = open_task(getpid(), FTO_NONE);
+	if (!task) {
+		task_vma_iter_free(&it);
+		return -errno;
+	}
+
+	for (i = 0; i < t->nr; i++) {
+		e = &t->ents[i];
+		if (e->perms[2] != 'x')
+			continue;
+		nr_exec++;
+		vma = find_vma(task, e->start);
+		if (!vma || vma->vm_start != e->start ||
+		    vma->vm_end != e->end ||
+		    memcmp(vma->perms, e->perms, 4) ||
+		    vma->vm_pgoff != e->off >> PAGE_SHIFT ||
+		    vma->inode != e->inode ||
+		    strlen(vma->name_) != e->name_len ||
+		    strncmp(vma->name_, e->name, e->name_len)) {
+			ulp_error("Mismatch VMA %lx-%lx %s %.*s\n", e->start,
+				  e->end, e->perms, (int)e->name_len, e->name);
+			ret = -1;
+		}
+	}
+
+	/* At least the executable and libc */
+	if (nr_exec < 2)
+		ret = -1;
+
+	close_task(task);
+	task_vma_iter_free(&it);
+	return ret;
+}
+
+/* The VMAs of open_task() are taken from the snapshot */
+TEST(Task, vma_iter_snapshot, 0)
+{
+	const struct task_vma_iter_task *t;
+	struct task_vma_iter it;
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	unsigned int nr = 0;
+	int ret = 0;
+
+	ret = task_vma_iter_read(&it);
+	if (vma_iter_unsupported(ret)) {
+		ulp_warning("No task_vma iterator, skip.\n");
+		task_vma_iter_free(&it);
+		return 0;
+	}
+	if (ret) {
+		task_vma_iter_free(&it);
+		return ret;
+	}
+
+	t = task_vma_iter_find(&it, getpid());
+	if (!t || t->incomplete) {
+		task_vma_iter_free(&it);
+		return t ? 0 : -ENOENT;
+	}
+
+	task_vma_iter_use(&it);
+	task = open_task(getpid(), FTO_NONE);
+	task_vma_iter_use(NULL);
+	if (!task) {
+		task_vma_iter_free(&it);
+		return -errno;
+	}
+
+	task_for_each_vma(vma, task)
+		nr++;
+	if (nr != t->nr || !task->libc_vma || !task->stack)
+		ret = -1;
+
+	close_task(task);
+	task_vma_iter_free(&it);
+	return ret;
+}
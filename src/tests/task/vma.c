@@ -10,6 +10,7 @@
 
 #include <utils/log.h>
 #include <utils/list.h>
+#include <elf/elf-api.h>
 #include <task/task.h>
 #include <tests/test-api.h>
 
@@ -76,7 +77,7 @@ TEST(Task, dump_task_vma_to_file, 0)
 		char *vdso = "vdso.so";
 
 		if (!strcmp(vma->name_, "[vdso]")) {
-			dump_task_vma_to_file(vdso, task, addr);
+			dump_task_vma_to_file(vdso, task, addr, 0);
 			if (!fexist(vdso))
 				ret++;
 			fremove(vdso);
@@ -87,3 +88,526 @@ TEST(Task, dump_task_vma_to_file, 0)
 	return ret;
 }
 
+
+TEST(Task, dump_task_addr_sparse, 0)
+{
+	int ret = 0, fd;
+	char *addr, *buf;
+	size_t size = PAGE_SIZE * 8;
+	const char *file = "dump-sparse.bin";
+	struct task_struct *task = open_task(getpid(), FTO_NONE);
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	buf = malloc(size);
+	if (addr == MAP_FAILED || !buf) {
+		ret = -1;
+		goto close;
+	}
+
+	/* Zero pages in the middle and the tail */
+	memset(addr, 'a', PAGE_SIZE + 1);
+	memset(addr + PAGE_SIZE * 5, 'b', PAGE_SIZE);
+
+	ret = dump_task_addr_to_file(file, task, (unsigned long)addr, size,
+				     DUMP_F_SPARSE);
+	if (ret)
+		goto unmap;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0 || read(fd, buf, size) != size || memcmp(buf, addr, size))
+		ret = -1;
+	if (fd >= 0)
+		close(fd);
+	fremove(file);
+
+unmap:
+	munmap(addr, size);
+close:
+	free(buf);
+	ret += close_task(task);
+	return ret;
+}
+
+TEST(Task, soft_dirty_ranges, 0)
+{
+	int ret = 0, nr;
+	char *addr;
+	size_t size = PAGE_SIZE * 8;
+	struct task_addr_range *ranges;
+	struct task_struct *task = open_task(getpid(), FTO_NONE);
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		ret = -1;
+		goto close;
+	}
+	memset(addr, 'a', size);
+
+	/**
+	 * Kernel without CONFIG_MEM_SOFT_DIRTY accepts clear_refs, but the
+	 * new pages are not soft-dirty.
+	 */
+	nr = task_soft_dirty_ranges(task, (unsigned long)addr,
+				    (unsigned long)addr + size, &ranges);
+	if (nr <= 0) {
+		ulp_warning("Not support soft-dirty, skip.\n");
+		goto unmap;
+	}
+	free(ranges);
+
+	if (task_clear_soft_dirty(task))
+		goto unmap;
+
+	addr[PAGE_SIZE * 2] = 'b';
+	memset(addr + PAGE_SIZE * 5, 'c', PAGE_SIZE * 2);
+
+	nr = task_soft_dirty_ranges(task, (unsigned long)addr,
+				    (unsigned long)addr + size, &ranges);
+	if (nr != 2 ||
+	    ranges[0].start != (unsigned long)addr + PAGE_SIZE * 2 ||
+	    ranges[0].end != (unsigned long)addr + PAGE_SIZE * 3 ||
+	    ranges[1].start != (unsigned long)addr + PAGE_SIZE * 5 ||
+	    ranges[1].end != (unsigned long)addr + PAGE_SIZE * 7) {
+		ulp_error("Got %d soft-dirty ranges\n", nr);
+		ret = -1;
+	}
+	if (nr > 0)
+		free(ranges);
+
+unmap:
+	munmap(addr, size);
+close:
+	ret += close_task(task);
+	return ret;
+}
+
+TEST(Task, vma_residency, 0)
+{
+	int ret = 0;
+	char *addr;
+	size_t size = PAGE_SIZE * 8;
+	struct task_vma_residency res;
+	struct vm_area_struct vma = {};
+	struct task_struct *task = open_task(getpid(), FTO_NONE);
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		ret = -1;
+		goto close;
+	}
+
+	/* Not the VMA of find_vma(), which may be merged with neighbour */
+	vma.vm_start = (unsigned long)addr;
+	vma.vm_end = (unsigned long)addr + size;
+	vma.type = VMA_ANON;
+	vma.task = task;
+
+	addr[0] = 'a';
+	addr[PAGE_SIZE * 3] = 'b';
+	memset(addr + PAGE_SIZE * 6, 'c', PAGE_SIZE * 2);
+
+	ret = task_vma_residency(task, &vma, &res);
+	if (ret || res.present != 4 || res.swapped || res.thp) {
+		ulp_error("Got residency %lu %lu %lu\n", res.present,
+			  res.swapped, res.thp);
+		ret = -1;
+	}
+
+	munmap(addr, size);
+close:
+	ret += close_task(task);
+	return ret;
+}
+
+TEST(Task, ulp_vma_owner, 0)
+{
+	static const struct {
+		const char *name;
+		pid_t owner;
+	} names[] = {
+		{ ULP_PROC_ROOT_DIR "/20298/" TASK_PROC_MAP_FILES "/"
+		  PATCH_VMA_TEMP_PREFIX "GLpgJM", 20298 },
+		{ ULP_PROC_ROOT_DIR "/7/" TASK_PROC_MAP_FILES "/"
+		  PATCH_POOL_TEMP_PREFIX "a1b2c3 (deleted)", 7 },
+		{ ULP_PROC_ROOT_DIR "/20298/" TASK_PROC_MAP_FILES "/libc.so",
+		  0 },
+		{ ULP_PROC_ROOT_DIR "/symcache/" TASK_PROC_MAP_FILES "/"
+		  PATCH_VMA_TEMP_PREFIX "GLpgJM", 0 },
+		{ "/usr/lib64/libc.so.6", 0 },
+		{ "", 0 },
+	};
+	int i, ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (ulp_vma_owner(names[i].name) != names[i].owner) {
+			ulp_error("%s owner %d, expect %d\n", names[i].name,
+				  ulp_vma_owner(names[i].name),
+				  names[i].owner);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+TEST(Task, get_vma_type, 0)
+{
+	static const struct {
+		const char *name;
+		enum vma_type type;
+	} names[] = {
+		{ "/usr/bin/ulpatch_test", VMA_SELF },
+		{ "/usr/lib64/libc.so.6", VMA_LIBC },
+		{ "/usr/lib64/ld-linux-x86-64.so.2", VMA_LD },
+		{ "/usr/lib64/libelf.so.1", VMA_LIB_UNKNOWN },
+		{ "[heap]", VMA_HEAP },
+		{ "[stack]", VMA_STACK },
+		{ "[vdso]", VMA_VDSO },
+		{ "[anon:libc.so]", VMA_NONE },
+		{ "", VMA_ANON },
+		{ ULP_PROC_ROOT_DIR "/20298/" TASK_PROC_MAP_FILES "/"
+		  PATCH_VMA_TEMP_PREFIX "GLpgJM", VMA_ULPATCH },
+		{ "/tmp/" PATCH_VMA_TEMP_PREFIX "1234", VMA_ULPATCH },
+		{ "/tmp/" PATCH_VMA_TEMP_PREFIX "GLpgJM", VMA_NONE },
+		{ "/usr/share/zoneinfo/UTC", VMA_NONE },
+	};
+	enum vma_type type;
+	int i, ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		type = get_vma_type(1234, "/usr/bin/ulpatch_test",
+				    names[i].name);
+		if (type != names[i].type) {
+			ulp_error("%s type %d, expect %d\n", names[i].name,
+				  type, names[i].type);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+TEST(Task, vma_long_name, 0)
+{
+	int ret = 0, fd;
+	char dir[PATH_MAX], file[PATH_MAX];
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	void *addr;
+
+	/* Longer than 255 bytes, and with space */
+	snprintf(dir, sizeof(dir), "/tmp/ulpatch-vma-long-name-%d-"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+		getpid());
+	snprintf(file, sizeof(file), "%s/with space "
+		"bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+		"bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+		"bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+		dir);
+
+	if (mkdir(dir, 0755))
+		return -1;
+
+	fd = open(file, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		ret = -1;
+		goto rmdir;
+	}
+	if (ftruncate(fd, PAGE_SIZE)) {
+		ret = -1;
+		goto close;
+	}
+
+	addr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		ret = -1;
+		goto close;
+	}
+
+	task = open_task(getpid(), FTO_NONE);
+
+	vma = find_vma(task, (unsigned long)addr);
+	if (!vma || strcmp(vma->name_, file)) {
+		ulp_error("Wrong vma name %s\n", vma ? vma->name_ : "(nil)");
+		ret = -1;
+	}
+
+	close_task(task);
+	munmap(addr, PAGE_SIZE);
+close:
+	close(fd);
+	unlink(file);
+rmdir:
+	rmdir(dir);
+	return ret;
+}
+
+TEST(Task, vma_query, 0)
+{
+	int ret = 0;
+	struct task_struct *task;
+	struct vm_area_struct *vma;
+	void *addr;
+
+	task = open_task(getpid(), FTO_VMA_QUERY);
+
+	/* Mapped after open_task() */
+	addr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	if (addr == MAP_FAILED) {
+		close_task(task);
+		return -1;
+	}
+
+	/* Never asks the kernel, and changes nothing */
+	if (find_vma(task, (unsigned long)addr)) {
+		ulp_error("find_vma() found a VMA mapped after open.\n");
+		ret = -1;
+		goto done;
+	}
+
+	vma = find_vma_or_query(task, (unsigned long)addr);
+
+	/* Kernel older than 6.11 */
+	if (!task->procmap_query) {
+		ulp_warning("PROCMAP_QUERY not supported.\n");
+		goto done;
+	}
+
+	if (!vma || vma->vm_start > (unsigned long)addr ||
+	    vma->vm_end <= (unsigned long)addr || strcmp(vma->perms, "r--p"))
+		ret = -1;
+	else
+		print_vma(stdout, true, vma, false);
+
+done:
+	munmap(addr, PAGE_SIZE);
+	close_task(task);
+	return ret;
+}
+
+TEST(Task, refresh_vmas, 0)
+{
+	int ret = 0, fd;
+	char file[] = "/tmp/ulpatch-refresh-vmas-XXXXXX";
+	struct task_struct *task;
+	struct task_vma_changes changes;
+	struct vm_area_struct *vma;
+	unsigned long addr;
+	void *map;
+
+	fd = mkstemp(file);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, PAGE_SIZE * 3)) {
+		close(fd);
+		unlink(file);
+		return -1;
+	}
+
+	task = open_task(getpid(), FTO_NONE);
+
+	/* File mapping, make sure not merged with others */
+	map = mmap(NULL, PAGE_SIZE * 3, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -1;
+		goto close;
+	}
+	addr = (unsigned long)map;
+
+	if (refresh_task_vmas(task, &changes) || changes.nr_added < 1 ||
+	    changes.nr_unchanged == 0 || !find_vma(task, addr))
+		ret = -1;
+
+	/* Split it into three VMAs */
+	mprotect(map + PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+	if (refresh_task_vmas(task, &changes) || changes.nr_resized < 1 ||
+	    changes.nr_added < 2)
+		ret = -1;
+
+	vma = find_vma(task, addr);
+	if (!vma || vma->vm_end != addr + PAGE_SIZE)
+		ret = -1;
+	vma = find_vma(task, addr + PAGE_SIZE);
+	if (!vma || !(vma->prot & PROT_WRITE))
+		ret = -1;
+
+	munmap(map, PAGE_SIZE * 3);
+
+	if (refresh_task_vmas(task, &changes) || changes.nr_removed < 3 ||
+	    find_vma(task, addr))
+		ret = -1;
+
+close:
+	close_task(task);
+	close(fd);
+	unlink(file);
+	return ret;
+}
+
+struct notify_count {
+	unsigned long addr;
+	int nr[3];
+};
+
+static void count_vma_notify(struct vm_area_struct *vma,
+			     enum task_vma_event event, unsigned long old_end,
+			     const char *old_perms, void *arg)
+{
+	struct notify_count *n = arg;
+
+	if (vma->vm_start >= n->addr && vma->vm_start < n->addr + PAGE_SIZE * 3)
+		n->nr[event]++;
+}
+
+/* Every changed VMA is notified, and the residency follows the writes */
+TEST(Task, refresh_vmas_notify, 0)
+{
+	int ret = 0, fd, n, i;
+	char file[] = "/tmp/ulpatch-refresh-notify-XXXXXX";
+	struct task_struct *task;
+	struct task_vma_changes changes;
+	struct task_vma_residency res[1024];
+	struct notify_count cnt = {};
+	struct vm_area_struct *vma;
+	char *map;
+
+	fd = mkstemp(file);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, PAGE_SIZE * 3)) {
+		close(fd);
+		unlink(file);
+		return -1;
+	}
+
+	task = open_task(getpid(), FTO_NONE);
+
+	map = mmap(NULL, PAGE_SIZE * 3, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -1;
+		goto close;
+	}
+	cnt.addr = (unsigned long)map;
+
+	if (refresh_task_vmas_notify(task, &changes, count_vma_notify, &cnt) ||
+	    cnt.nr[TASK_VMA_ADDED] != 1)
+		ret = -1;
+
+	/* Split it, the first one is resized, two are added */
+	mprotect(map + PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE);
+	memset(&cnt.nr, 0, sizeof(cnt.nr));
+
+	if (refresh_task_vmas_notify(task, &changes, count_vma_notify, &cnt) ||
+	    cnt.nr[TASK_VMA_RESIZED] != 1 || cnt.nr[TASK_VMA_ADDED] != 2)
+		ret = -1;
+
+	/* The written page is copied, resident in the middle VMA */
+	map[PAGE_SIZE] = 'a';
+	n = task_vmas_residency(task, res, ARRAY_SIZE(res));
+	i = 0;
+	list_for_each_entry(vma, &task->vma_list, node_list) {
+		if (i >= n)
+			break;
+		if (vma->vm_start == cnt.addr + PAGE_SIZE &&
+		    res[i].present != 1)
+			ret = -1;
+		i++;
+	}
+	if (n <= 0)
+		ret = -1;
+
+	munmap(map, PAGE_SIZE * 3);
+	memset(&cnt.nr, 0, sizeof(cnt.nr));
+
+	if (refresh_task_vmas_notify(task, &changes, count_vma_notify, &cnt) ||
+	    cnt.nr[TASK_VMA_REMOVED] != 3 || changes.nr_removed < 3)
+		ret = -1;
+
+close:
+	close_task(task);
+	close(fd);
+	unlink(file);
+	return ret;
+}
+
+/* Lowest gap in [low, high), walk all VMAs linearly */
+static unsigned long linear_find_gap(struct task_struct *task, size_t size,
+				     unsigned long low, unsigned long high)
+{
+	struct vm_area_struct *vma;
+	unsigned long prev_end = 0, start, end;
+
+	task_for_each_vma(vma, task) {
+		start = MAX(prev_end, low);
+		end = MIN(vma->vm_start, high);
+		if (end > start && end - start >= size)
+			return start;
+		prev_end = vma->vm_end;
+	}
+	return 0;
+}
+
+TEST(Task, find_vma_gap, 0)
+{
+	int ret = 0, i;
+	struct task_struct *task = open_task(getpid(), FTO_NONE);
+	struct vm_area_struct *vma;
+	unsigned long low, high, addr, expect;
+	size_t size;
+
+	task_for_each_vma(vma, task) {
+		for (i = 0; i < 4; i++) {
+			size = PAGE_SIZE << (i * 4);
+			low = vma->vm_start;
+			high = ULONG_MAX;
+			addr = find_vma_gap(task, size, low, high);
+			expect = linear_find_gap(task, size, low, high);
+			if (addr != expect) {
+				ulp_error("gap %lx != %lx, size %lx, low %lx\n",
+					  addr, expect, size, low);
+				ret = -1;
+			}
+		}
+	}
+
+	/* Below 4GB */
+	addr = find_vma_gap(task, PAGE_SIZE, MIN_ULP_START_VMA_ADDR,
+			    MAX_ULP_START_VMA_ADDR);
+	if (addr != linear_find_gap(task, PAGE_SIZE, MIN_ULP_START_VMA_ADDR,
+				    MAX_ULP_START_VMA_ADDR))
+		ret = -1;
+
+	close_task(task);
+	return ret;
+}
+
+TEST(Task, vma_read_build_id, 0)
+{
+	int ret = 0, len, flen;
+	uint8_t bid[64], fbid[64];
+	struct vm_area_struct *vma;
+	struct task_struct *task = open_task(getpid(), FTO_VMA_ELF);
+
+	if (!task)
+		return -1;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->vma_elf || vma->type != VMA_LIBC)
+			continue;
+
+		/* Build ID in memory is same as the file one */
+		len = vma_read_build_id(vma, bid, sizeof(bid));
+		flen = elf_read_build_id(vma->name_, fbid, sizeof(fbid));
+		if (len <= 0 || len != flen || memcmp(bid, fbid, len)) {
+			ulp_error("%s: build id mismatch\n", vma->name_);
+			ret = -1;
+		}
+	}
+
+	close_task(task);
+	return ret;
+}
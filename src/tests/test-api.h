@@ -2,6 +2,7 @@
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <malloc.h>
 #include <sys/time.h>
 #include <sys/msg.h>
@@ -10,6 +11,7 @@
 #include <utils/list.h>
 #include <utils/log.h>
 #include <utils/compiler.h>
+#include <utils/perf.h>
 
 #if defined(__x86_64__)
 #include <arch/x86_64/regs.h>
@@ -62,9 +64,13 @@ struct test {
 	/* after running return value */
 	int real_ret;
 
-	/* record testing time spend */
-	struct timeval start, end;
-	suseconds_t spend_us;
+	/* record testing time spend, CLOCK_MONOTONIC */
+	unsigned long start_ns, end_ns;
+	unsigned long spend_us;
+	/* spend of same test in --baseline file, -1 if not found */
+	long base_us;
+	/* counters of --perf, zero if not supported */
+	uint64_t perf[PERF_CNT_NUM];
 
 #define TEST_JMP_STATUS	0xff123
 
@@ -114,6 +120,8 @@ struct test {
 	struct list_head node;
 	/* if test result is failed, add to 'failed_list' */
 	struct list_head failed;
+	/* if test is slower than baseline, add to 'regressed_list' */
+	struct list_head regressed;
 };
 
 extern int nr_tests;
@@ -161,6 +169,9 @@ extern const char *ulpatch_test_path;
 
 #define TEST_UNIX_PATH	"/tmp/_unix_test_main"
 
+/* Socket path of ROLE_LISTENER, --listener-path, default TEST_UNIX_PATH */
+extern const char *listener_unix_path;
+
 
 struct test *create_test(char *category, char *name, test_prio prio,
 			 int (*cb)(void), int expect_ret);
@@ -190,6 +201,7 @@ struct ctrl_msg_hdr {
 	enum {
 		TEST_MC_CLOSE, /* Tell server can close */
 		TEST_MC_SYMBOL,
+		TEST_MC_FORK, /* Fork an idle target, response is pid_t */
 	} code;
 };
 
@@ -213,15 +225,67 @@ struct ctrl_msg {
 	} body;
 };
 
+/**
+ * Batch of requests or responses in one SOCK_SEQPACKET message, the header
+ * is followed by @nr records, every record is struct ctrl_rec and @len bytes
+ * of payload, a request of symbol is the name without '\0', the response is
+ * the unsigned long address, zero if not found. The records are packed, not
+ * aligned.
+ */
+#define CTRL_BATCH_MAGIC	0x42504c55 /* ULPB */
+#define CTRL_BATCH_MAX		256
+#define CTRL_BATCH_SIZE		SZ_64K
+
+struct ctrl_batch_hdr {
+	uint32_t magic;
+	uint32_t nr;
+};
+
+struct ctrl_rec {
+	uint16_t code;
+	uint16_t len;
+};
+
 
 int init_listener(void);
 void close_listener(void);
 void listener_main_loop(void *arg);
 
 int listener_helper_create_test_client(void);
+int listener_helper_connect(const char *path);
 int listener_helper_close_test_client(int fd);
 int listener_helper_close(int fd, int *rslt);
 int listener_helper_symbol(int fd, const char *sym, unsigned long *addr);
+int listener_helper_symbols(int fd, const char *syms[], unsigned long *addrs,
+			    int nr);
+int listener_helper_fork(int fd, pid_t *pids, int nr);
+
+/**
+ * Pool of idle targets forked by a ROLE_LISTENER fork server, which is
+ * started at the first use by each tester process. A target checked out by
+ * test_pool_get() is a ulpatch_test process blocked in pause(2), return it
+ * by test_pool_put(), it's killed instead of reused if @clean is false or
+ * it's still traced or stopped. The shared target is for the tests which
+ * never modify the target, never put it.
+ */
+pid_t test_pool_get(void);
+void test_pool_put(pid_t pid, bool clean);
+pid_t test_pool_shared(void);
+void test_pool_destroy(void);
+
+/**
+ * Read-only ELF, BFD and task fixtures opened once per test run, see
+ * fixture.c, all of them are released by test_fixtures_release().
+ */
+struct elf_file;
+struct bfd_elf_file;
+struct task_struct;
+
+struct elf_file *test_fixture_elf(const char *path);
+void test_fixture_elf_put(struct elf_file *elf);
+struct bfd_elf_file *test_fixture_bfd(const char *path);
+struct task_struct *test_fixture_task(unsigned int flags);
+void test_fixtures_release(void);
 
 extern void mcount(void);
 extern void _mcount(void);
@@ -253,7 +317,10 @@ int nr_ulpatch_objs(void);
 
 const char *str_special_ret(test_special_ret val);
 
+long test_vma_rss(pid_t pid, unsigned long start);
+
 /**
  * Test target functions.
  */
 void hello_world(void);
+void bye_world(void);
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
+#include <errno.h>
 #include <malloc.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <utils/log.h>
@@ -43,6 +45,8 @@ struct test *create_test(char *category, char *name, test_prio prio,
 	test->test_cb = cb;
 	test->expect_ret = expect_ret;
 	test->real_ret = expect_ret;
+	test->base_us = -1;
+	memset(test->perf, 0, sizeof(test->perf));
 
 	list_add(&test->node, &test_list[prio - TEST_PRIO_START]);
 
@@ -86,3 +90,33 @@ const char *str_special_ret(test_special_ret val)
 	}
 	return NULL;
 }
+
+/**
+ * The resident bytes of the VMA starts from @start of @pid, from
+ * /proc/PID/smaps, the prefaulted VMA is resident all.
+ */
+long test_vma_rss(pid_t pid, unsigned long start)
+{
+	char path[64], line[256];
+	unsigned long s, e, kb;
+	bool found = false;
+	long rss = -ENOENT;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		/* The attribute lines never have START-END */
+		if (sscanf(line, "%lx-%lx ", &s, &e) == 2)
+			found = s == start;
+		else if (found && sscanf(line, "Rss: %lu kB", &kb) == 1) {
+			rss = kb * 1024;
+			break;
+		}
+	}
+	fclose(fp);
+	return rss;
+}
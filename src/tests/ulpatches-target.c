@@ -9,3 +9,8 @@ void hello_world(void)
 {
 	printf("Hello World.\n");
 }
+
+void bye_world(void)
+{
+	printf("Bye World.\n");
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef __ULP_DEV
+#define __ULP_DEV
+#endif
+#include <stdio.h>
+#include <patch/asm.h>
+#include <patch/meta.h>
+
+void multi_hello_world(void)
+{
+	printf("Hello World from multi ulpatch.\n");
+}
+ULPATCH_INFO(multi_hello_world, hello_world, "Rong Tao");
+
+void multi_bye_world(void)
+{
+	printf("Bye World from multi ulpatch.\n");
+}
+ULPATCH_INFO(multi_bye_world, bye_world, "Rong Tao");
@@ -76,3 +76,19 @@ TEST(Utils_disasm, base_arch, 0)
 	fprintf(stdout, "Disasm test_disasm_stub2:\n");
 	return fdisasm_arch(stdout, "PFX: ", 0, code, size);
 }
+
+TEST(Utils_disasm, parallel, 0)
+{
+	unsigned char *code = (unsigned char *)X86_64_CODE;
+	unsigned long base = 0x1000;
+	/* push %rbp | mov 0x13b8(%rip),%rax | jmp ... */
+	struct disasm_range ranges[] = {
+		{ .addr = base, .size = 1, .name = "a", },
+		{ .addr = base + 1, .size = 7, },
+		{ .addr = base + 8, .size = sizeof(X86_64_CODE) - 1 - 8,
+		  .name = "b", },
+	};
+
+	return fdisasm_parallel(stdout, DISASM_ARCH_X86_64, code, base, ranges,
+				ARRAY_SIZE(ranges), 2);
+}
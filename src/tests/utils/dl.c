@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/dl.h>
+
+#include <tests/test-api.h>
+
+TEST_STUB(utils_dl);
+
+TEST(Utils_dl, load, 0)
+{
+	static __typeof__(getpid) *p_getpid;
+	static const struct ulp_dl_sym syms[] = {
+		ULP_DL_SYM(getpid, p_getpid),
+	};
+	static struct ulp_dl dl = {
+		.soname = "libc.so.6",
+		.syms = syms,
+		.nr_syms = ARRAY_SIZE(syms),
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	if (ulp_dl_load(&dl) || !p_getpid)
+		return -1;
+	/* Loaded once */
+	if (ulp_dl_load(&dl))
+		return -1;
+	return p_getpid() == getpid() ? 0 : -1;
+}
+
+TEST(Utils_dl, no_symbol, 0)
+{
+	static void (*p_getpid)(void), (*p_none)(void);
+	static const struct ulp_dl_sym syms[] = {
+		ULP_DL_SYM(getpid, p_getpid),
+		ULP_DL_SYM(ulpatch_no_such_symbol, p_none),
+	};
+	static struct ulp_dl dl = {
+		.soname = "libc.so.6",
+		.syms = syms,
+		.nr_syms = ARRAY_SIZE(syms),
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	if (ulp_dl_load(&dl) != -ENOSYS || ulp_dl_load(&dl) != -ENOSYS)
+		return -1;
+	/* None of the symbols is set */
+	return p_getpid || p_none ? -1 : 0;
+}
+
+TEST(Utils_dl, no_library, 0)
+{
+	static struct ulp_dl dl = {
+		.soname = "libulpatch-no-such-library.so",
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+
+	return ulp_dl_load(&dl) == -ENOENT ? 0 : -1;
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/log.h>
+#include <utils/emit.h>
+#include <tests/test-api.h>
+
+TEST_STUB(utils_emit);
+
+static void emit_record(struct emitter *e)
+{
+	emit_map(e, 5);
+	emit_kv_str(e, "name", "a\"b\n");
+	emit_kv_u64(e, "addr", 0x401000);
+	emit_kv_s64(e, "ret", -70000);
+	emit_key(e, "list");
+	emit_array(e, 3);
+	emit_bool(e, true);
+	emit_nil(e);
+	emit_array(e, 0);
+	emit_key(e, "map");
+	emit_map(e, 0);
+}
+
+static int emit_to_mem(enum emit_format format, char **buf, size_t *len)
+{
+	struct emitter e;
+	FILE *fp;
+	int err;
+
+	fp = open_memstream(buf, len);
+	if (!fp)
+		return -1;
+
+	err = emit_open(&e, fp, format);
+	if (!err) {
+		emit_record(&e);
+		emit_record(&e);
+		err = emit_close(&e);
+	}
+	fclose(fp);
+	return err;
+}
+
+TEST(Utils_emit, json, 0)
+{
+	const char *expect =
+		"{\"name\":\"a\\\"b\\n\",\"addr\":4198400,\"ret\":-70000,"
+		"\"list\":[true,null,[]],\"map\":{}}\n";
+	size_t len;
+	char *buf;
+	int ret;
+
+	ret = emit_to_mem(EMIT_JSON, &buf, &len);
+	if (!ret && (len != strlen(expect) * 2 ||
+		     strncmp(buf, expect, strlen(expect)) ||
+		     strcmp(buf + strlen(expect), expect))) {
+		ulp_error("Wrong JSON: %s\n", buf);
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+TEST(Utils_emit, msgpack, 0)
+{
+	const unsigned char expect[] = {
+		0x85,
+		0xa4, 'n', 'a', 'm', 'e', 0xa4, 'a', '"', 'b', '\n',
+		0xa4, 'a', 'd', 'd', 'r', 0xce, 0x00, 0x40, 0x10, 0x00,
+		0xa3, 'r', 'e', 't', 0xd2, 0xff, 0xfe, 0xee, 0x90,
+		0xa4, 'l', 'i', 's', 't', 0x93, 0xc3, 0xc0, 0x90,
+		0xa3, 'm', 'a', 'p', 0x80,
+	};
+	size_t len;
+	char *buf;
+	int ret;
+
+	ret = emit_to_mem(EMIT_MSGPACK, &buf, &len);
+	if (!ret && (len != sizeof(expect) * 2 ||
+		     memcmp(buf, expect, sizeof(expect)) ||
+		     memcmp(buf + sizeof(expect), expect, sizeof(expect)))) {
+		ulp_error("Wrong MessagePack, len %zu\n", len);
+		ret = -1;
+	}
+	free(buf);
+	return ret;
+}
+
+TEST(Utils_emit, mismatch, -EINVAL)
+{
+	struct emitter e;
+	FILE *fp;
+	int ret;
+
+	fp = fopen("/dev/null", "w");
+	if (!fp)
+		return -1;
+
+	ret = emit_open(&e, fp, EMIT_JSON);
+	if (!ret) {
+		/* One more element than the map has */
+		emit_map(&e, 1);
+		emit_kv_u64(&e, "a", 1);
+		emit_kv_u64(&e, "b", 2);
+		ret = emit_close(&e);
+	}
+	fclose(fp);
+	return ret;
+}
+
+TEST(Utils_emit, format, 0)
+{
+	if (emit_format_parse("json") != EMIT_JSON ||
+	    emit_format_parse("msgpack") != EMIT_MSGPACK ||
+	    emit_format_parse("text") != EMIT_TEXT ||
+	    emit_format_parse("xml") != -EINVAL)
+		return -1;
+	return 0;
+}
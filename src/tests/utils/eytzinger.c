@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/eytzinger.h>
+
+#include <tests/test-api.h>
+
+TEST_STUB(utils_eytzinger);
+
+#define NR_KEYS	1000
+
+/* Linear search of the index, same as eytz_lower_bound() */
+static size_t lower_bound_slow(const struct eytz_index *idx,
+			       unsigned long key)
+{
+	size_t k, found = 0;
+
+	for (k = 1; k <= idx->nr; k++) {
+		if (idx->keys[k] < key)
+			continue;
+		if (!found || idx->keys[k] < idx->keys[found])
+			found = k;
+	}
+	return found;
+}
+
+TEST(Utils_eytzinger, find, 0)
+{
+	static unsigned long keys[NR_KEYS];
+	static void *vals[NR_KEYS];
+	struct eytz_index idx;
+	unsigned long key;
+	size_t nr, i, k;
+	int err = 0;
+
+	eytz_init(&idx);
+
+	for (nr = 0; nr <= NR_KEYS && !err; nr += nr < 70 ? 1 : 131) {
+		/* Odd keys, the even keys never exist */
+		for (i = 0; i < nr; i++) {
+			keys[i] = i * 2 + 1;
+			vals[i] = &keys[i];
+		}
+		if (eytz_build(&idx, keys, vals, nr))
+			return -1;
+
+		for (key = 0; key <= nr * 2 + 1; key++) {
+			void *val = eytz_find(&idx, key);
+			void *expect = (key & 1) && key < nr * 2 ?
+				       &keys[key / 2] : NULL;
+
+			k = eytz_lower_bound(&idx, key);
+			if (val != expect || k != lower_bound_slow(&idx, key)) {
+				ulp_error("nr %ld key %ld: %p != %p\n", nr,
+					  key, val, expect);
+				err = -1;
+				break;
+			}
+		}
+	}
+
+	eytz_free(&idx);
+	return err;
+}
+
+TEST(Utils_eytzinger, unsorted, 0)
+{
+	static unsigned long keys[NR_KEYS], copy[NR_KEYS];
+	static void *vals[NR_KEYS];
+	struct eytz_index idx;
+	int i, err = 0;
+
+	eytz_init(&idx);
+
+	for (i = 0; i < NR_KEYS; i++) {
+		/* Unique keys, odd multiplier is a bijection */
+		keys[i] = copy[i] = (i * 2654435761UL) & 0xffffffffUL;
+		vals[i] = (void *)(copy[i] + 1);
+	}
+
+	if (eytz_build_unsorted(&idx, keys, vals, NR_KEYS))
+		return -1;
+
+	for (i = 0; i < NR_KEYS; i++) {
+		if (i && keys[i - 1] >= keys[i]) {
+			ulp_error("Not sorted at %d\n", i);
+			err = -1;
+		}
+		if (eytz_find(&idx, copy[i]) != (void *)(copy[i] + 1)) {
+			ulp_error("Not found %lx\n", copy[i]);
+			err = -1;
+		}
+	}
+
+	eytz_free(&idx);
+	return err;
+}
@@ -206,6 +206,31 @@ TEST(Utils_file, fcopy, 0)
 	return ret;
 }
 
+TEST(Utils_file, fmmap_shmem_copy, 0)
+{
+#define TMP_FILE	"./a.out"
+
+	int ret = 0;
+	struct mmap_struct *src, *dst;
+
+	src = fmmap_rdonly(USR_BIN_LS);
+	dst = fmmap_shmem_copy(TMP_FILE, USR_BIN_LS);
+
+	if (!src || !dst || src->size != dst->size ||
+	    memcmp(src->mem, dst->mem, src->size)) {
+		ulp_error("%s is not the copy of %s.\n", TMP_FILE, USR_BIN_LS);
+		ret = -1;
+	}
+
+	if (src)
+		fmunmap(src);
+	if (dst)
+		fmunmap(dst);
+	unlink(TMP_FILE);
+#undef TMP_FILE
+	return ret;
+}
+
 TEST(Utils_file, fprint_file, 0)
 {
 	fprint_file(stdout, "/etc/os-release");
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+#include <utils/log.h>
+#include <utils/util.h>
+#include <tests/test-api.h>
+
+TEST_STUB(utils_hash);
+
+TEST(Utils_hash, hash64, 0)
+{
+	unsigned char buf[4096 + 17];
+	uint64_t h;
+	int i, ret = 0;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	h = ulp_hash64(buf, 4096, 0);
+	if (h != ulp_hash64(buf, 4096, 0))
+		ret = -1;
+
+	/* Every bit flip changes the hash */
+	for (i = 0; i < 4096 * 8; i++) {
+		buf[i / 8] ^= 1 << (i % 8);
+		if (ulp_hash64(buf, 4096, 0) == h)
+			ret = -1;
+		buf[i / 8] ^= 1 << (i % 8);
+	}
+
+	/* The length, seed and tail bytes */
+	for (i = 1; i <= 17; i++)
+		if (ulp_hash64(buf, 4096 + i - 1, 0) ==
+		    ulp_hash64(buf, 4096 + i, 0))
+			ret = -1;
+	if (ulp_hash64(buf, 4096, 1) == h || ulp_hash64(NULL, 0, 0) ==
+	    ulp_hash64(NULL, 0, 1))
+		ret = -1;
+
+	return ret;
+}
@@ -1,5 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include <utils/log.h>
 #include <utils/list.h>
 #include <elf/elf-api.h>
@@ -42,6 +45,88 @@ TEST(Utils_log, set_log_level, 0)
 	return 0;
 }
 
+static int log_arg_evaluated(int *n)
+{
+	return ++(*n);
+}
+
+TEST(Utils_log, skip_format, 0)
+{
+	int n = 0, level = get_log_level();
+
+	set_log_level(LOG_ERR);
+
+	/* Arguments of disabled logs are never evaluated */
+	ulp_debug("DEBUG %d\n", log_arg_evaluated(&n));
+	ulp_info("INFO %d\n", log_arg_evaluated(&n));
+	if (n != 0 || ulp_log_enabled(LOG_DEBUG))
+		return -1;
+
+	ulp_error("ERROR %d\n", log_arg_evaluated(&n));
+	if (n != 1 || !ulp_log_enabled(LOG_ERR))
+		return -1;
+
+	set_log_level(level);
+	return 0;
+}
+
+TEST(Utils_log, async, 0)
+{
+	int i, ret = 0, level = get_log_level();
+
+	set_log_level(LOG_INFO);
+
+	if (ulp_log_async_start())
+		return -1;
+	/* Start twice is fine */
+	if (ulp_log_async_start())
+		ret = -1;
+
+	/* More than the ring size, the producer blocks for a while */
+	for (i = 0; i < 300; i++)
+		ulp_info("ASYNC %d\n", i);
+
+	ulp_log_flush();
+	ulp_log_async_stop();
+	/* Stop twice is fine */
+	ulp_log_async_stop();
+
+	ulp_info("SYNC\n");
+	set_log_level(level);
+	return ret;
+}
+
+/* The child has no writer thread, it must not block on the ring */
+TEST(Utils_log, async_fork, 0)
+{
+	int i, ret = 0, status = 0, level = get_log_level();
+	pid_t pid;
+
+	set_log_level(LOG_INFO);
+
+	if (ulp_log_async_start())
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		alarm(5);
+		for (i = 0; i < 300; i++)
+			ulp_info("CHILD %d\n", i);
+		ulp_log_flush();
+		_exit(0);
+	}
+	if (pid < 0)
+		ret = -1;
+
+	ulp_info("PARENT\n");
+	if (pid > 0 && (waitpid(pid, &status, 0) != pid || status != 0))
+		ret = -1;
+
+	ulp_log_async_stop();
+	set_log_level(level);
+	return ret;
+}
+
 TEST(Utils_log, set_log_prefix, 0)
 {
 	set_log_prefix(false);
@@ -2,6 +2,7 @@
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <utils/log.h>
 #include <utils/rbtree.h>
+#include <utils/interval_tree.h>
 #include <elf/elf-api.h>
 #include <tests/test-api.h>
 
@@ -95,3 +96,161 @@ TEST(Utils_rbtree, base, 0)
 	return ret;
 }
 
+
+/* Return black height, -1 if not valid red-black tree */
+static int rb_black_height(struct rb_node *node)
+{
+	int l, r;
+
+	if (!node)
+		return 1;
+	if (rb_is_red(node) &&
+	    ((node->rb_left && rb_is_red(node->rb_left)) ||
+	     (node->rb_right && rb_is_red(node->rb_right))))
+		return -1;
+
+	l = rb_black_height(node->rb_left);
+	r = rb_black_height(node->rb_right);
+	if (l < 0 || l != r)
+		return -1;
+	return l + rb_is_black(node);
+}
+
+TEST(Utils_rbtree, build_sorted, 0)
+{
+	int i, n, ret = 0;
+	struct rb_root rb_tree;
+	struct rb_node *nodes[64];
+	struct test_data tests[64 + 1];
+
+	for (n = 0; n <= ARRAY_SIZE(nodes); n++) {
+		/* The in-order is descending, see cmp_data() */
+		for (i = 0; i < n; i++) {
+			tests[i].v = n - i;
+			nodes[i] = &tests[i].node;
+		}
+
+		rb_build_sorted(&rb_tree, nodes, n);
+
+		if (rb_black_height(rb_tree.rb_node) < 0)
+			ret = -1;
+
+		for (i = 1; i <= n; i++)
+			if (!find_data(&rb_tree, i))
+				ret = -1;
+
+		/* Insert still works */
+		tests[n].v = n + 1;
+		link_data(&rb_tree, &tests[n]);
+		if (!find_data(&rb_tree, n + 1) ||
+		    rb_black_height(rb_tree.rb_node) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Check the __subtree_last of every node, return the max last of subtree */
+static long it_check_subtree(struct rb_node *rb, int *err)
+{
+	struct interval_tree_node *node;
+	long max, l, r;
+
+	if (!rb)
+		return -1;
+
+	node = rb_entry(rb, struct interval_tree_node, rb);
+	l = it_check_subtree(rb->rb_left, err);
+	r = it_check_subtree(rb->rb_right, err);
+	max = MAX((long)node->last, MAX(l, r));
+	if (max != node->__subtree_last)
+		*err = -1;
+	return max;
+}
+
+TEST(Utils_rbtree, interval_tree, 0)
+{
+	int i, j, n, err = 0;
+	struct rb_root root = RB_ROOT;
+	struct interval_tree_node nodes[256], *node;
+	bool inserted[ARRAY_SIZE(nodes)] = {};
+	unsigned long start, last;
+
+	srand(0x1234);
+
+	for (i = 0; i < ARRAY_SIZE(nodes); i++) {
+		nodes[i].start = rand() % 4096;
+		nodes[i].last = nodes[i].start + rand() % 64;
+		interval_tree_insert(&nodes[i], &root);
+		inserted[i] = true;
+	}
+
+	/* Remove some, the aggregates must be updated */
+	for (i = 0; i < ARRAY_SIZE(nodes); i += 3) {
+		interval_tree_remove(&nodes[i], &root);
+		inserted[i] = false;
+	}
+
+	it_check_subtree(root.rb_node, &err);
+	if (rb_black_height(root.rb_node) < 0)
+		err = -1;
+
+	/* Compare with linear walk */
+	for (j = 0; j < 512; j++) {
+		start = rand() % 4200;
+		last = start + rand() % 128;
+
+		n = 0;
+		for (node = interval_tree_iter_first(&root, start, last); node;
+		     node = interval_tree_iter_next(node, start, last)) {
+			if (node->start > last || node->last < start)
+				err = -1;
+			n++;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(nodes); i++) {
+			if (inserted[i] && nodes[i].start <= last &&
+			    nodes[i].last >= start)
+				n--;
+		}
+		if (n) {
+			ulp_error("Interval [%lu, %lu] mismatch %d\n", start,
+				  last, n);
+			err = -1;
+		}
+	}
+
+	return err;
+}
+
+TEST(Utils_rbtree, cached, 0)
+{
+	int i, ret = 0;
+	struct rb_root_cached root;
+	struct test_data tests[128];
+
+	rb_init_cached(&root);
+	srand(0x4321);
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		tests[i].v = rand() % 1024;
+		rb_insert_node_cached(&root, &tests[i].node, cmp_data,
+				      (unsigned long)tests[i].v);
+		if (rb_first_cached(&root) != rb_first(&root.rb_root))
+			ret = -1;
+	}
+
+	/* Erase the leftmost and others, duplicate values never inserted */
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		struct rb_node *node;
+		node = rb_search_node(&root.rb_root, cmp_data,
+				      (unsigned long)tests[i].v);
+		if (node != &tests[i].node)
+			continue;
+		rb_erase_cached(rb_first_cached(&root), &root);
+		if (rb_first_cached(&root) != rb_first(&root.rb_root))
+			ret = -1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <utils/log.h>
+#include <utils/slab.h>
+#include <elf/elf-api.h>
+#include <tests/test-api.h>
+
+TEST_STUB(utils_slab);
+
+struct test_data {
+	int v;
+	char buf[13];
+};
+
+TEST(Utils_slab, slab, 0)
+{
+	struct slab_cache cache;
+	struct test_data *datas[100], *data;
+	int i, ret = 0;
+
+	slab_cache_init(&cache, sizeof(struct test_data), 8);
+
+	for (i = 0; i < ARRAY_SIZE(datas); i++) {
+		datas[i] = slab_alloc(&cache);
+		if (!datas[i])
+			return -ENOMEM;
+		datas[i]->v = i;
+		/* objects must be aligned */
+		if ((unsigned long)datas[i] % sizeof(void *))
+			ret = -1;
+	}
+
+	if (cache.nr_chunks != ROUND_UP(ARRAY_SIZE(datas), 8) / 8)
+		ret = -1;
+
+	for (i = 0; i < ARRAY_SIZE(datas); i++)
+		if (datas[i]->v != i)
+			ret = -1;
+
+	/* The freed object will be reused */
+	data = datas[10];
+	slab_free(&cache, data);
+	if (slab_alloc(&cache) != data)
+		ret = -1;
+
+	slab_cache_destroy(&cache);
+	return ret;
+}
+
+TEST(Utils_slab, str_pool, 0)
+{
+	struct str_pool pool;
+	char *s1, *s2, *s3;
+	char long_str[256];
+	int ret = 0;
+
+	str_pool_init(&pool, 64);
+
+	memset(long_str, 'a', sizeof(long_str) - 1);
+	long_str[sizeof(long_str) - 1] = '\0';
+
+	s1 = str_pool_strdup(&pool, "hello");
+	s2 = str_pool_strdup(&pool, long_str);
+	s3 = str_pool_strdup(&pool, "world");
+
+	if (!s1 || !s2 || !s3)
+		ret = -1;
+	else if (strcmp(s1, "hello") || strcmp(s2, long_str) ||
+		 strcmp(s3, "world"))
+		ret = -1;
+
+	/* Long string has own chunk, the short strings share one chunk */
+	if (pool.nr_chunks != 2)
+		ret = -1;
+
+	str_pool_destroy(&pool);
+	return ret;
+}
+
+TEST(Utils_slab, str_intern, 0)
+{
+	const char *s1, *s2, *s3;
+	char buf[64];
+	int i, ret = 0;
+
+	s1 = str_intern("ulpatch_test_intern_hello");
+	snprintf(buf, sizeof(buf), "ulpatch_test_intern_%s", "hello");
+	s2 = str_intern(buf);
+	s3 = str_intern_len("ulpatch_test_intern_hello_world", 25);
+
+	/* Same string, same pointer */
+	if (!s1 || s1 != s2 || s1 != s3 || s1 == buf)
+		ret = -1;
+
+	if (str_intern_lookup(buf) != s1)
+		ret = -1;
+	if (str_intern_lookup("ulpatch_test_intern_never_interned"))
+		ret = -1;
+
+	if (str_intern_hash(s1) != str_hash(buf, strlen(buf)))
+		ret = -1;
+
+	/* Make the table grow */
+	for (i = 0; i < 4096; i++) {
+		snprintf(buf, sizeof(buf), "ulpatch_test_intern_%d", i);
+		s2 = str_intern(buf);
+		if (!s2 || strcmp(s2, buf) || str_intern(buf) != s2)
+			ret = -1;
+	}
+
+	if (str_intern_lookup("ulpatch_test_intern_hello") != s1)
+		ret = -1;
+
+	return ret;
+}
+
+/**
+ * The chunks and live objects of the typed slab are accounted, and all of
+ * them are gone after destroyed, the peak is kept.
+ */
+TEST(Utils_slab, mem_stats, 0)
+{
+	struct ulp_mem_stat before[ULP_MEM_NUM], after[ULP_MEM_NUM];
+	struct ulp_mem_stat *b, *a;
+	struct slab_cache cache;
+	void *objs[100];
+	int i, ret = 0;
+
+	slab_cache_init(&cache, 64, 16);
+	cache.mem_type = ULP_MEM_ARENA;
+
+	ulp_mem_get_stats(before, NULL);
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		objs[i] = slab_alloc(&cache);
+	for (i = 0; i < 10; i++)
+		slab_free(&cache, objs[i]);
+	ulp_mem_get_stats(after, NULL);
+
+	b = &before[ULP_MEM_ARENA];
+	a = &after[ULP_MEM_ARENA];
+	if (a->nr - b->nr != ARRAY_SIZE(objs) - 10 ||
+	    a->bytes - b->bytes < 64 * ARRAY_SIZE(objs) ||
+	    a->peak < a->bytes)
+		ret = -1;
+
+	print_ulp_mem_stats(stdout);
+
+	slab_cache_destroy(&cache);
+	ulp_mem_get_stats(after, NULL);
+	if (a->nr != b->nr || a->bytes != b->bytes || a->peak < b->bytes)
+		ret = -1;
+
+	return ret;
+}
@@ -36,6 +36,29 @@ TEST(Utils_str, memshow, 0)
 	return 0;
 }
 
+TEST(Utils_str, memshow_format, 0)
+{
+	static const char expect[] =
+		"00000000  48 65 6c 6c 6f 00 01 7f  20 57 6f 72 6c 64 0a 41   "
+		"|Hello... World.A|\n"
+		"00000010  42 43                                              "
+		"|BC              |\n";
+	const char data[] = "Hello\x00\x01\x7f World\nABC";
+	char buf[256];
+	FILE *fp;
+	int n;
+
+	memset(buf, 0, sizeof(buf));
+	fp = fmemopen(buf, sizeof(buf), "w");
+	if (!fp)
+		return -1;
+	n = memshow(fp, data, sizeof(data) - 1);
+	fclose(fp);
+
+	printf("%s", buf);
+	return n != strlen(expect) || strcmp(buf, expect);
+}
+
 TEST(Utils_str, fmembytes, 0)
 {
 	return fmembytes(stdout, docs, sizeof(docs));
@@ -356,3 +379,17 @@ TEST(Utils_str, strbytes2mem2strbytes, 0)
 
 	return err;
 }
+
+TEST(Utils_str, memmem, 0)
+{
+	const char hay[] = "0123456789abcdef0123456789abcdefxyz";
+	size_t len = sizeof(hay) - 1;
+
+	if (ulp_memmem(hay, len, "xyz", 3) != hay + 32 ||
+	    ulp_memmem(hay, len, "f01", 3) != hay + 15 ||
+	    ulp_memmem(hay, len, "0", 1) != hay ||
+	    ulp_memmem(hay, len, "xyzw", 4) ||
+	    ulp_memmem(hay, len, hay, len) != hay)
+		return -1;
+	return 0;
+}
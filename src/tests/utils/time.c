@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <unistd.h>
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/clock.h>
+#include <tests/test-api.h>
+
+TEST_STUB(utils_time);
+
+TEST(Utils_time, clocks, 0)
+{
+	unsigned long n0, n1, r0, r1, u0, u1;
+	int ret = 0;
+
+	n0 = nsecs();
+	r0 = nsecs_raw();
+	u0 = usecs();
+	usleep(1000);
+	n1 = nsecs();
+	r1 = nsecs_raw();
+	u1 = usecs();
+
+	if (n1 - n0 < 1000000UL || r1 - r0 < 1000000UL || u1 - u0 < 1000UL)
+		ret = -1;
+
+	/* The wall clock of patch time */
+	if (secs() < 1700000000UL)
+		ret = -1;
+	return ret;
+}
+
+TEST(Utils_time, cycles, 0)
+{
+	unsigned long t0, t1, ns;
+	uint64_t c0, c1;
+
+	if (cycles_per_ns() <= 0)
+		return -1;
+
+	t0 = nsecs();
+	c0 = ulp_cycles();
+	usleep(2000);
+	c1 = ulp_cycles();
+	t1 = nsecs();
+
+	/* Within 10% of the monotonic clock */
+	ns = cycles_to_ns(c1 - c0);
+	if (ns < (t1 - t0) * 9 / 10 || ns > (t1 - t0) * 11 / 10) {
+		ulp_error("%lu cycles ns, %lu ns\n", ns, t1 - t0);
+		return -1;
+	}
+	return 0;
+}
+
+static void timed_sleep(unsigned long *acc)
+{
+	SCOPED_TIMER_ACC(acc);
+	SCOPED_TIMER("timed_sleep");
+
+	usleep(1000);
+}
+
+TEST(Utils_time, scoped_timer, 0)
+{
+	unsigned long acc = 0;
+
+	timed_sleep(&acc);
+	timed_sleep(&acc);
+	return acc >= 2000000UL ? 0 : -1;
+}
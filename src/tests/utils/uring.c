@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/uring.h>
+
+#include <tests/test-api.h>
+
+TEST_STUB(utils_uring);
+
+/**
+ * The same content read by io_uring and one by one, the large file is
+ * larger than the registered buffer, the missing file fails alone.
+ */
+TEST(Utils_uring, read_files, 0)
+{
+	char big[] = "/tmp/ulpatch-uring-XXXXXX";
+	const char *paths[] = {
+		"/proc/self/cmdline",
+		"/proc/self/auxv",
+		"/proc/ulpatch-no-such-file",
+		big,
+	};
+	struct ulp_file_read r[ARRAY_SIZE(paths)], s[ARRAY_SIZE(paths)];
+	struct ulp_uring *ring;
+	char buf[4096];
+	int fd, i, ret = 0;
+
+	fd = mkstemp(big);
+	if (fd < 0)
+		return -errno;
+	memset(buf, 'u', sizeof(buf));
+	for (i = 0; i < 64; i++)
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			ret = -EIO;
+	close(fd);
+
+	/* NULL if not supported, read one by one */
+	ring = ulp_uring_open();
+
+	for (i = 0; i < ARRAY_SIZE(paths); i++)
+		r[i].path = s[i].path = paths[i];
+
+	if (ulp_read_files(ring, r, ARRAY_SIZE(r)))
+		ret = -1;
+	ulp_read_files(NULL, s, ARRAY_SIZE(s));
+
+	for (i = 0; i < ARRAY_SIZE(paths); i++) {
+		if (r[i].err != s[i].err || r[i].size != s[i].size)
+			ret = -1;
+		else if (!r[i].err && (r[i].buf[r[i].size] != '\0' ||
+			 memcmp(r[i].buf, s[i].buf, r[i].size)))
+			ret = -1;
+		free(r[i].buf);
+		free(s[i].buf);
+	}
+
+	if (r[2].err != -ENOENT || r[3].size != 64 * sizeof(buf))
+		ret = -1;
+
+	ulp_uring_close(ring);
+	unlink(big);
+	return ret;
+}
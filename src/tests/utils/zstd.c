@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/zstd.h>
+
+#include <tests/test-api.h>
+
+TEST_STUB(utils_zstd);
+
+/**
+ * Compress a stream of several frames by odd sized writes, and read back
+ * the ranges inside one frame, across frames and over the end.
+ */
+TEST(Utils_zstd, pread, 0)
+{
+	char tmp[] = "/tmp/ulpatch-zstd-XXXXXX";
+	const size_t size = ULP_ZST_FRAME_SIZE * 3 + 12345;
+	const struct {
+		off_t off;
+		size_t len;
+	} ranges[] = {
+		{ 0, 100 },
+		{ ULP_ZST_FRAME_SIZE - 10, 20 },
+		{ 4096, ULP_ZST_FRAME_SIZE * 2 },
+		{ size - 100, 200 },
+	};
+	struct ulp_zst *z;
+	unsigned char *src, *dst;
+	size_t off, n, i;
+	ssize_t ret_len;
+	int fd, ret = 0;
+
+	src = malloc(size);
+	dst = malloc(size);
+	if (!src || !dst) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Compressible, but not a repeat of one frame */
+	for (i = 0; i < size; i++)
+		src[i] = (i / 64) % 251 + (i >> 20);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+	unlink(tmp);
+
+	z = ulp_zst_open(fd, 4);
+	if (!z) {
+		if (errno == ENOSYS)
+			ulp_info("No libzstd, skip.\n");
+		else
+			ret = -errno;
+		goto close;
+	}
+
+	for (off = 0; off < size; off += n) {
+		n = MIN(size - off, 777777);
+		if (ulp_zst_write(z, src + off, n))
+			ret = -1;
+	}
+	if (ulp_zst_close(z))
+		ret = -1;
+
+	for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+		n = MIN(ranges[i].len, size - ranges[i].off);
+		ret_len = ulp_zst_pread(fd, dst, ranges[i].len, ranges[i].off);
+		if (ret_len != n || memcmp(dst, src + ranges[i].off, n)) {
+			ulp_error("Range %zu: %zd != %zu\n", i, ret_len, n);
+			ret = -1;
+		}
+	}
+
+close:
+	close(fd);
+out:
+	free(src);
+	free(dst);
+	return ret;
+}
@@ -6,6 +6,17 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <elf/elf-api.h>
 
@@ -16,14 +27,287 @@
 #include <utils/cmds.h>
 
 #include <patch/patch.h>
+#include <patch/ftrace-ring.h>
+#if defined(__x86_64__)
+#include <arch/x86_64/ftrace.h>
+#elif defined(__aarch64__)
+#include <arch/aarch64/ftrace.h>
+#endif
 
 #include <args-common.c>
 
 static pid_t target_pid = -1;
-static const char *target_func = NULL;
+/* Patterns of -f, --function, see fnmatch(3) */
+#define ULFTRACE_MAX_PATTERNS	64
+static char *func_patterns[ULFTRACE_MAX_PATTERNS];
+static int nr_func_patterns = 0;
+/**
+ * The mangled names of C++ functions whose demangled names match the
+ * patterns contain "::", such as 'ns::Class::*', sorted interned pointers,
+ * see resolve_demangled_patterns().
+ */
+static const char **demangled_matches = NULL;
+static size_t nr_demangled_matches = 0;
+/* Arguments captured of functions, see add_capture() */
+#define ULFTRACE_MAX_CAPTURES	16
+struct capture {
+	char *pattern;
+	struct ulp_ftrace_schema schema;
+};
+static struct capture captures[ULFTRACE_MAX_CAPTURES];
+static int nr_captures = 0;
 static struct task_struct *target_task = NULL;
 
 static const char *patch_object_file = NULL;
+/* Trace seconds, 0 means until SIGINT or SIGTERM */
+static unsigned long duration = 0;
+/* Function graph mode, see mcount_exit() of ftrace object */
+static bool graph = false;
+/* Count mode, display the calls of functions, no event */
+static bool count = false;
+/* Stack mode, display the folded stacks of calls, no event */
+static bool stack_mode = false;
+/* Coverage mode, see ftrace_cover_write() */
+static bool cover_mode = false;
+/* Binary trace file to write, and the one to symbolize offline */
+static const char *output_file = NULL;
+static const char *report_file = NULL;
+/* Convert the binary trace of --report into CTF directory */
+static const char *ctf_dir = NULL;
+/* Use the call-site index of ELF, see struct site_index */
+static bool site_cache = true;
+/* One consumer thread of each NUMA node, see ftrace_consumers_start() */
+static bool numa = true;
+
+static volatile sig_atomic_t ulftrace_stop = 0;
+
+/**
+ * The consumer sleeps on futex if all rings are empty, and it's woken up by
+ * the producer, or the timeout to drain the rings below watermark.
+ */
+#define ULFTRACE_WAIT_MS	100
+/* Events popped from ring at a time */
+#define ULFTRACE_BATCH		256
+/* Output is written when the buffer is full, or after each drain */
+#define ULFTRACE_OUTBUF_SIZE	SZ_64K
+
+/**
+ * Graph mode: wait for the hooked returns before unpatch, and the grace
+ * time for the returns just popped to leave the return trampoline.
+ */
+#define ULFTRACE_GRAPH_DRAIN_MS	1000
+#define ULFTRACE_GRAPH_GRACE_US	10000
+/* Width of histogram bars */
+#define ULFTRACE_GRAPH_BAR	40
+
+/**
+ * Time the probes in target since tracing starts, then estimate the
+ * overhead every interval with the calibrated costs, see --overhead-budget.
+ */
+#define ULFTRACE_CALIBRATE_MS		1000
+#define ULFTRACE_OVERHEAD_INTERVAL_MS	1000
+#define ULFTRACE_CYCLES_CALIBRATE_US	10000
+/* Downsample at most */
+#define ULFTRACE_MAX_SAMPLE		BIT(16)
+
+/* Count mode: refresh interval and rows of the live table */
+#define ULFTRACE_COUNT_INTERVAL_MS	1000
+/* Coverage mode: disarm the sites of called functions every interval */
+#define ULFTRACE_COVER_INTERVAL_MS	100
+#define ULFTRACE_COUNT_TOP		20
+
+/**
+ * Binary trace file of -o, --output, symbolized offline by --report.
+ *
+ * +-----------+---------+-----+---------+---------+-----------+
+ * | trace_hdr | module0 | ... | moduleN | records | ips table |
+ * +-----------+---------+-----+---------+---------+-----------+
+ *
+ * The modules are the snapshot of the ELF VMAs of target when tracing
+ * starts, each one is a trace_module followed by the path, the build id
+ * is used to check the ELF file when reporting.
+ *
+ * Each record starts with one byte of (type << 6 | ring), the fields are
+ * LEB128 varints. TRACE_REC_TID sets the tid of the ring. TRACE_REC_EVENT
+ * has the zigzag timestamp delta from the last event of the same ring (or
+ * trace_hdr::start_ns), and the indexes of child and parent ip in the ips
+ * table, which is written at last. TRACE_REC_ARGS has the length and the
+ * encoded arguments of the next event of the same ring, see --capture,
+ * since version 2.
+ */
+#define ULFTRACE_TRACE_MAGIC	"ULFTDATA"
+#define ULFTRACE_TRACE_VERSION	2
+#define ULFTRACE_TRACE_BID_SIZE	32
+
+enum trace_rec_type {
+	TRACE_REC_TID = 1,
+	TRACE_REC_EVENT = 2,
+	TRACE_REC_ARGS = 3,
+};
+#define TRACE_REC_TYPE_SHIFT	6
+#define TRACE_REC_RING_MASK	(BIT(TRACE_REC_TYPE_SHIFT) - 1)
+/* The longest TID record followed by the longest EVENT record */
+#define TRACE_REC_MAX		(1 + 5 + 1 + 10 + 5 + 5)
+/* The longest ARGS record */
+#define TRACE_REC_ARGS_MAX	(1 + 2 + ULP_FTRACE_ARGS_MAX)
+
+struct trace_hdr {
+	char magic[8];
+	uint32_t version;
+	int32_t pid;
+	/* CLOCK_MONOTONIC */
+	uint64_t start_ns;
+	uint32_t nr_modules;
+	uint32_t nr_ips;
+	uint64_t nr_events;
+	/* File offset of records and ips table */
+	uint64_t events_off;
+	uint64_t ips_off;
+};
+
+struct trace_module {
+	uint64_t start;
+	uint64_t end;
+	uint64_t load_addr;
+	uint8_t build_id[ULFTRACE_TRACE_BID_SIZE];
+	uint32_t build_id_len;
+	/* Include the '\0' */
+	uint32_t path_len;
+};
+
+struct trace_writer {
+	FILE *fp;
+	struct trace_hdr hdr;
+	/* Interned ips, open addressing, the slot is index + 1 */
+	uint64_t *ips;
+	uint32_t *slots;
+	unsigned int nr_slots;
+	unsigned long nr_lost;
+	uint64_t last_ns[ULP_FTRACE_MAX_RINGS];
+	uint32_t last_tid[ULP_FTRACE_MAX_RINGS];
+};
+
+#if !defined(MFD_CLOEXEC)
+# define MFD_CLOEXEC	0x0001U
+#endif
+
+/* Symbol of ftrace object, see src/objects/ftrace/mcount.c */
+#define ULFTRACE_SHM_SYMBOL	"ulp_ftrace_shm"
+#define ULFTRACE_MCOUNT_SYMBOL	"_ftrace_mcount"
+
+/* Call targets of the mcount site, see ftrace_find_mcount_site() */
+static const char *mcount_symbols[] = {
+	"mcount",
+	"mcount@plt",
+	"_mcount",
+	"_mcount@plt",
+};
+#define ULFTRACE_MAX_MCOUNTS	16
+
+/**
+ * The -mnop-mcount site of traced function, it's replaced with the call of
+ * _ftrace_mcount() while tracing, the mcount call site need not, the mcount
+ * is patched already.
+ */
+struct ftrace_site {
+	unsigned long addr;
+	char nop[MCOUNT_INSN_SIZE];
+	char call[MCOUNT_INSN_SIZE];
+};
+
+/**
+ * The mcount site of function of coverage mode, the bytes of each state,
+ * the NOP site is armed with the call of _ftrace_mcount() and disarmed
+ * with the NOP, the call site is armed already and disarmed with the NOP.
+ */
+enum cover_state {
+	COVER_ORIG,
+	COVER_ARMED,
+	COVER_DISARMED,
+	COVER_NUM,
+};
+
+struct cover_site {
+	unsigned long addr;
+	int type;
+	enum cover_state state;
+	char bytes[COVER_NUM][MCOUNT_INSN_SIZE];
+};
+
+struct ftrace_sites {
+	unsigned int nr_funcs;
+	/* Matched but no mcount site, not instrumented */
+	unsigned int nr_skipped;
+	unsigned int nr_nops;
+	struct ftrace_site *nops;
+	bool enabled;
+	/* Coverage mode: the sites of shm->cover, no one in @nops */
+	unsigned int nr_covers;
+	struct cover_site *covers;
+};
+
+struct ftrace_shm;
+
+/* Consumer of the rings on one NUMA node, see ftrace_consumer_of() */
+struct ftrace_consumer {
+	struct task_struct *task;
+	struct ftrace_shm *shm;
+	unsigned int node;
+	pthread_t thread;
+};
+
+struct ftrace_shm {
+	struct ulp_ftrace_shm *mem;
+	unsigned long remote;
+	size_t size;
+	unsigned long nr_events;
+	/* Events consumed of each ring */
+	unsigned long nr_ring_events[ULP_FTRACE_MAX_RINGS];
+	unsigned long nr_wakeups;
+	unsigned long nr_timeouts;
+
+	char outbuf[ULFTRACE_OUTBUF_SIZE];
+	size_t outlen;
+	/* stdout, or the binary trace file if trace is set */
+	FILE *out;
+	struct trace_writer *trace;
+
+	/* Count mode: calls of each filter at last refresh */
+	unsigned long *last_calls;
+	unsigned long last_ns;
+
+	/**
+	 * NUMA: the online nodes, and the consumer threads if more than one,
+	 * @lock serializes the output of them.
+	 */
+	cpu_set_t nodes;
+	unsigned int nr_consumers;
+	struct ftrace_consumer consumers[ULP_FTRACE_MAX_NODES];
+	pthread_mutex_t lock;
+	bool consumers_stop;
+
+	/* Probe overhead, see ftrace_overhead_calibrate() */
+	bool calibrated;
+	double cycles_per_ns;
+	uint64_t read_cycles;
+	double cost_ns[ULP_FTRACE_COST_NUM];
+	uint64_t last_overhead_calls;
+	unsigned long last_overhead_ns;
+	/* Estimated probe time of target, and the elapsed time */
+	double tax_ns;
+	unsigned long tax_elapsed_ns;
+};
+
+static unsigned int watermark = ULP_FTRACE_WATERMARK;
+/* Percent of one CPU the probes may cost, 0 means no limit */
+static double overhead_budget = 0;
+
+/* In-target predicates, see mcount_entry() of ftrace object */
+static unsigned int sample = 0;
+static struct ulp_ftrace_pred preds[ULP_FTRACE_MAX_PREDS];
+static unsigned int nr_preds = 0;
+static uint32_t tids[ULP_FTRACE_MAX_TIDS];
+static unsigned int nr_tids = 0;
 
 /* This is ftrace object file path, during 'make install' install to
  * /usr/share/ulpatch/, this macro is a absolute path of LSB relocatable file.
@@ -36,12 +320,50 @@ static const char *patch_object_file = NULL;
 
 static const char *prog_name = "ulftrace";
 
+enum {
+	ARG_MIN = ARG_COMMON_MAX,
+	ARG_WATERMARK,
+	ARG_TID,
+	ARG_SAMPLE,
+	ARG_ARG,
+	ARG_REPORT,
+	ARG_CTF,
+	ARG_OVERHEAD_BUDGET,
+	ARG_NO_SITE_CACHE,
+	ARG_NO_NUMA,
+	ARG_STACK,
+	ARG_COVERAGE,
+	ARG_CAPTURE,
+};
+
 static void ulftrace_args_reset(void)
 {
 	target_pid = -1;
-	target_func = NULL;
+	while (nr_func_patterns)
+		free(func_patterns[--nr_func_patterns]);
+	free(demangled_matches);
+	demangled_matches = NULL;
+	nr_demangled_matches = 0;
+	while (nr_captures)
+		free(captures[--nr_captures].pattern);
 	target_task = NULL;
 	patch_object_file = NULL;
+	duration = 0;
+	graph = false;
+	count = false;
+	stack_mode = false;
+	cover_mode = false;
+	output_file = NULL;
+	report_file = NULL;
+	ctf_dir = NULL;
+	watermark = ULP_FTRACE_WATERMARK;
+	overhead_budget = 0;
+	site_cache = true;
+	numa = true;
+	sample = 0;
+	nr_preds = 0;
+	nr_tids = 0;
+	ulftrace_stop = 0;
 }
 
 static int print_help(void)
@@ -49,6 +371,7 @@ static int print_help(void)
 	printf(
 	"\n"
 	" Usage: ulftrace [OPTION]... [FILE]...\n"
+	"        ulftrace --report [FILE]\n"
 	"\n"
 	" ulftrace is a user-space ftrace tool.\n"
 	"\n"
@@ -59,26 +382,384 @@ static int print_help(void)
 	"\n"
 	" Ftrace argument:\n"
 	"\n"
-	"  -f, --function [NAME]     tracing funtion specified by this argument.\n"
+	"  -f, --function [NAME]     tracing funtion specified by this argument,\n"
+	"                            could be glob pattern like 'foo*', or comma\n"
+	"                            separated list, and could be specified %d\n"
+	"                            times at most. The C++ function could be\n"
+	"                            the demangled name, like 'ns::Class::*'.\n"
 	"\n"
 	"  -j, --patch-obj [FILE]    input a ELF 64-bit LSB relocatable object file.\n"
 	"                            actually, this input is not necessary,\n"
 	"                            unless you know how to generate a ftrace\n"
 	"                            relocatable object.\n"
 	"                            default: %s\n"
+	"\n"
+	"  -d, --duration [SEC]      trace SEC seconds, default until SIGINT.\n"
+	"  --watermark [NUM]         wake up ulftrace once any ring of thread\n"
+	"                            has NUM events, default %d, at most %d.\n"
+	"  -g, --graph               function graph mode, display the latency\n"
+	"                            histogram of function instead of events.\n"
+	"  -c, --count               count mode, display the calls of functions\n"
+	"                            every second like top, and the time of them\n"
+	"                            with -g, instead of events.\n"
+	"  --stack                   stack mode, walk the frame pointers of\n"
+	"                            calls, display the unique stacks in the\n"
+	"                            folded format of flame graph, instead of\n"
+	"                            events.\n"
+	"  --coverage                coverage mode, the site of function is\n"
+	"                            disarmed after its first call, display\n"
+	"                            the called (+) and never called (-)\n"
+	"                            functions, %d at most.\n"
+	"  --overhead-budget [PCT]   percent of one CPU the probes may cost\n"
+	"                            in target, record less calls or stop\n"
+	"                            tracing if it's exceeded, the cost is\n"
+	"                            calibrated in the first second.\n"
+	"  --no-site-cache           find the mcount sites in target memory,\n"
+	"                            don't use or save the call-site index of\n"
+	"                            ELF files under %s.\n"
+	"  --no-numa                 consume all rings in one thread, and\n"
+	"                            prefault them, instead of one consumer\n"
+	"                            pinned to each NUMA node, and the rings\n"
+	"                            allocated on the nodes of their threads.\n"
+	"  -o, --output [FILE]       write the events into the binary trace\n"
+	"                            FILE, instead of the symbolized text.\n"
+	"  --report [FILE]           symbolize and display the binary trace\n"
+	"                            FILE written by -o, no -p needed.\n"
+	"  --ctf [DIR]               with --report, convert the binary trace\n"
+	"                            into CTF directory DIR instead, with the\n"
+	"                            LTTng-UST event names and fields.\n"
+	"\n"
+	" Filter argument, checked in target process before recording:\n"
+	"\n"
+	"  --tid [TID,...]           only trace these threads, %d at most.\n"
+	"  --sample [N]              record 1 in N calls of each thread.\n"
+	"  --arg [argN OP VALUE]     argument predicate, N is 1-%d, OP is one of\n"
+	"                            ==, !=, <, <=, >, >= and & (any bit set),\n"
+	"                            signed compare, such as 'arg1==0x10'. It\n"
+	"                            could be specified %d times, all of them\n"
+	"                            must match.\n"
+	"  --capture [PATTERN:argN=TYPE,...]\n"
+	"                            capture the arguments of the functions\n"
+	"                            whose symbol name matches PATTERN into\n"
+	"                            the events, TYPE is int, hex or str, the\n"
+	"                            str is copied %d bytes at most. It could\n"
+	"                            be specified %d times, the first matched\n"
+	"                            one is used.\n"
 	"\n",
-	ULPATCH_OBJ_FTRACE_MCOUNT_PATH);
+	ULFTRACE_MAX_PATTERNS,
+	ULPATCH_OBJ_FTRACE_MCOUNT_PATH,
+	ULP_FTRACE_WATERMARK, ULP_FTRACE_RING_EVENTS, ULP_FTRACE_MAX_COVER,
+	ULP_SYM_CACHE_DIR,
+	ULP_FTRACE_MAX_TIDS, ULP_FTRACE_PRED_ARGS, ULP_FTRACE_MAX_PREDS,
+	ULP_FTRACE_STR_MAX, ULFTRACE_MAX_CAPTURES);
 	print_usage_common(prog_name);
 	cmd_exit_success();
 	return 0;
 }
 
+static void add_func_patterns(const char *arg)
+{
+	char *buf, *tok, *save = NULL;
+
+	buf = strdup(arg);
+	if (!buf)
+		return;
+
+	for (tok = strtok_r(buf, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (nr_func_patterns >= ULFTRACE_MAX_PATTERNS) {
+			fprintf(stderr, "Too many functions, at most %d.\n",
+				ULFTRACE_MAX_PATTERNS);
+			free(buf);
+			cmd_exit(1);
+			return;
+		}
+		func_patterns[nr_func_patterns++] = strdup(tok);
+	}
+	free(buf);
+}
+
+static int add_tids(const char *arg)
+{
+	const char *p = arg;
+	char *end;
+	long tid;
+
+	while (*p) {
+		tid = strtol(p, &end, 0);
+		if (end == p || tid <= 0 || (*end && *end != ','))
+			return -EINVAL;
+		if (nr_tids >= ULP_FTRACE_MAX_TIDS)
+			return -E2BIG;
+		tids[nr_tids++] = tid;
+		p = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* Parse 'argN OP VALUE', the spaces are optional */
+static int add_pred(const char *arg)
+{
+	static const struct {
+		const char *str;
+		enum ulp_ftrace_pred_op op;
+	} ops[] = {
+		/* The longer first */
+		{ "==", ULP_FTRACE_PRED_EQ },
+		{ "!=", ULP_FTRACE_PRED_NE },
+		{ "<=", ULP_FTRACE_PRED_LE },
+		{ ">=", ULP_FTRACE_PRED_GE },
+		{ "<",  ULP_FTRACE_PRED_LT },
+		{ ">",  ULP_FTRACE_PRED_GT },
+		{ "&",  ULP_FTRACE_PRED_AND },
+	};
+	struct ulp_ftrace_pred *pred;
+	const char *p = arg;
+	char *end;
+	long n;
+	int i;
+
+	if (nr_preds >= ULP_FTRACE_MAX_PREDS)
+		return -E2BIG;
+
+	while (*p == ' ')
+		p++;
+	if (strncmp(p, "arg", 3))
+		return -EINVAL;
+	n = strtol(p + 3, &end, 10);
+	if (end == p + 3 || n < 1 || n > ULP_FTRACE_PRED_ARGS)
+		return -EINVAL;
+
+	p = end;
+	while (*p == ' ')
+		p++;
+
+	for (i = 0; i < ARRAY_SIZE(ops); i++) {
+		if (!strncmp(p, ops[i].str, strlen(ops[i].str)))
+			break;
+	}
+	if (i == ARRAY_SIZE(ops))
+		return -EINVAL;
+	p += strlen(ops[i].str);
+
+	pred = &preds[nr_preds];
+	errno = 0;
+	pred->val = strtoll(p, &end, 0);
+	if (errno || end == p)
+		return -EINVAL;
+	while (*end == ' ')
+		end++;
+	if (*end)
+		return -EINVAL;
+
+	pred->arg = n;
+	pred->op = ops[i].op;
+	nr_preds++;
+	return 0;
+}
+
+static int str2argtype(const char *str)
+{
+	if (!strcmp(str, "int"))
+		return ULP_FTRACE_ARG_INT;
+	if (!strcmp(str, "hex"))
+		return ULP_FTRACE_ARG_HEX;
+	if (!strcmp(str, "str"))
+		return ULP_FTRACE_ARG_STR;
+	return ULP_FTRACE_ARG_NONE;
+}
+
+/**
+ * Parse the capture like 'open*:arg1=str,arg2=hex', the pattern is up to
+ * the last ':', thus the C++ names with "::" are fine.
+ */
+static int add_capture(const char *arg)
+{
+	struct ulp_ftrace_schema *schema;
+	char *pattern, *colon, *tok, *save, *end;
+	unsigned long n;
+	int type;
+
+	if (nr_captures >= ULFTRACE_MAX_CAPTURES)
+		return -E2BIG;
+
+	pattern = strdup(arg);
+	if (!pattern)
+		return -ENOMEM;
+
+	colon = strrchr(pattern, ':');
+	if (!colon || colon == pattern)
+		goto invalid;
+	*colon = '\0';
+
+	schema = &captures[nr_captures].schema;
+	memset(schema, 0, sizeof(*schema));
+
+	for (tok = strtok_r(colon + 1, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (strncmp(tok, "arg", 3))
+			goto invalid;
+		n = strtoul(tok + 3, &end, 10);
+		if (*end != '=' || n < 1 || n > ULP_FTRACE_PRED_ARGS)
+			goto invalid;
+		type = str2argtype(end + 1);
+		if (type == ULP_FTRACE_ARG_NONE)
+			goto invalid;
+		if (schema->type[n - 1] == ULP_FTRACE_ARG_NONE)
+			schema->nr++;
+		schema->type[n - 1] = type;
+	}
+	if (!schema->nr)
+		goto invalid;
+
+	captures[nr_captures++].pattern = pattern;
+	return 0;
+
+invalid:
+	free(pattern);
+	return -EINVAL;
+}
+
+/* The schema of the first capture matches symbol @name, NULL if none */
+static const struct ulp_ftrace_schema *capture_schema(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_captures; i++) {
+		if (!fnmatch(captures[i].pattern, name, 0))
+			return &captures[i].schema;
+	}
+	return NULL;
+}
+
+static int cmp_name_ptr(const void *a, const void *b)
+{
+	const char *na = *(const char **)a, *nb = *(const char **)b;
+	return na < nb ? -1 : na > nb;
+}
+
+/* @name must be interned, see str_intern() */
+static bool func_match(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_func_patterns; i++) {
+		if (func_patterns[i] && !fnmatch(func_patterns[i], name, 0))
+			return true;
+	}
+
+	return nr_demangled_matches &&
+	       bsearch(&name, demangled_matches, nr_demangled_matches,
+		       sizeof(*demangled_matches), cmp_name_ptr);
+}
+
+/**
+ * Match the pattern @pat with the demangled @name, the qualified name only
+ * pattern matches all overloads, such as 'ns::Class::method' matches
+ * "ns::Class::method(int)".
+ */
+static bool demangled_match(const char *pat, const char *name)
+{
+	char buf[PATH_MAX];
+
+	if (!fnmatch(pat, name, 0))
+		return true;
+	if (strchr(pat, '(') ||
+	    snprintf(buf, sizeof(buf), "%s(*", pat) >= sizeof(buf))
+		return false;
+	return !fnmatch(buf, name, 0);
+}
+
+static int add_demangled_match(const char *name, size_t *cap)
+{
+	const char **tmp;
+
+	if (nr_demangled_matches == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		tmp = realloc(demangled_matches, *cap * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		demangled_matches = tmp;
+	}
+	demangled_matches[nr_demangled_matches++] = name;
+	return 0;
+}
+
+/**
+ * The patterns contain "::" are matched with the demangled names of C++
+ * functions, only the demangled names start with the literal prefix of the
+ * pattern are visited, see bfd_next_demangled(). The ELF files without any
+ * such pattern are never demangled.
+ */
+static int resolve_demangled_patterns(struct task_struct *task)
+{
+	const struct bfd_demangled *d;
+	struct vm_area_struct *vma;
+	struct bfd_elf_file *file;
+	char prefix[256];
+	size_t n, cap = 0;
+	int i;
+
+	/* Resolved again, such as the task is reloaded */
+	free(demangled_matches);
+	demangled_matches = NULL;
+	nr_demangled_matches = 0;
+
+	for (i = 0; i < nr_func_patterns; i++) {
+		if (!func_patterns[i] || !strstr(func_patterns[i], "::"))
+			continue;
+
+		n = strcspn(func_patterns[i], "*?[\\");
+		n = MIN(n, sizeof(prefix) - 1);
+		memcpy(prefix, func_patterns[i], n);
+		prefix[n] = '\0';
+
+		task_for_each_vma(vma, task) {
+			file = vma->bfd_elf_file;
+			if (!vma->vma_elf || !file || vma->type == VMA_ULPATCH)
+				continue;
+			for (d = bfd_next_demangled(file, prefix, NULL); d;
+			     d = bfd_next_demangled(file, prefix, d)) {
+				if (!demangled_match(func_patterns[i],
+						     bfd_demangled_name(d)))
+					continue;
+				if (add_demangled_match(
+				    bfd_sym_name(bfd_demangled_sym(d)), &cap))
+					return -ENOMEM;
+			}
+		}
+	}
+
+	qsort(demangled_matches, nr_demangled_matches,
+	      sizeof(*demangled_matches), cmp_name_ptr);
+	ulp_debug("%zu C++ functions match the demangled patterns.\n",
+		  nr_demangled_matches);
+	return 0;
+}
+
 static int parse_config(int argc, char *argv[])
 {
 	struct option options[] = {
 		{ "pid",            required_argument,  0, 'p' },
 		{ "function",       required_argument,  0, 'f' },
 		{ "patch-obj",      required_argument,  0, 'j' },
+		{ "duration",       required_argument,  0, 'd' },
+		{ "watermark",      required_argument,  0, ARG_WATERMARK },
+		{ "graph",          no_argument,        0, 'g' },
+		{ "count",          no_argument,        0, 'c' },
+		{ "output",         required_argument,  0, 'o' },
+		{ "report",         required_argument,  0, ARG_REPORT },
+		{ "ctf",            required_argument,  0, ARG_CTF },
+		{ "tid",            required_argument,  0, ARG_TID },
+		{ "sample",         required_argument,  0, ARG_SAMPLE },
+		{ "arg",            required_argument,  0, ARG_ARG },
+		{ "overhead-budget", required_argument, 0,
+		  ARG_OVERHEAD_BUDGET },
+		{ "no-site-cache",  no_argument,        0, ARG_NO_SITE_CACHE },
+		{ "no-numa",        no_argument,        0, ARG_NO_NUMA },
+		{ "stack",          no_argument,        0, ARG_STACK },
+		{ "coverage",       no_argument,        0, ARG_COVERAGE },
+		{ "capture",        required_argument,  0, ARG_CAPTURE },
 		COMMON_OPTIONS
 		{ NULL }
 	};
@@ -86,7 +767,8 @@ static int parse_config(int argc, char *argv[])
 	while (1) {
 		int c;
 		int option_index = 0;
-		c = getopt_long(argc, argv, "p:f:j:"COMMON_GETOPT_OPTSTRING,
+		c = getopt_long(argc, argv,
+				"p:f:j:d:gco:"COMMON_GETOPT_OPTSTRING,
 				options, &option_index);
 		if (c < 0)
 			break;
@@ -96,11 +778,83 @@ static int parse_config(int argc, char *argv[])
 			target_pid = atoi(optarg);
 			break;
 		case 'f':
-			target_func = optarg;
+			add_func_patterns(optarg);
 			break;
 		case 'j':
 			patch_object_file = optarg;
 			break;
+		case 'd':
+			duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			graph = true;
+			break;
+		case 'c':
+			count = true;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case ARG_REPORT:
+			report_file = optarg;
+			break;
+		case ARG_CTF:
+			ctf_dir = optarg;
+			break;
+		case ARG_WATERMARK:
+			watermark = strtoul(optarg, NULL, 0);
+			if (!watermark || watermark > ULP_FTRACE_RING_EVENTS) {
+				fprintf(stderr, "Invalid watermark %s.\n",
+					optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_TID:
+			if (add_tids(optarg)) {
+				fprintf(stderr, "Invalid tid %s.\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_SAMPLE:
+			sample = strtoul(optarg, NULL, 0);
+			if (!sample) {
+				fprintf(stderr, "Invalid sample %s.\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_OVERHEAD_BUDGET:
+			overhead_budget = strtod(optarg, NULL);
+			if (overhead_budget <= 0) {
+				fprintf(stderr, "Invalid overhead budget %s.\n",
+					optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_NO_SITE_CACHE:
+			site_cache = false;
+			break;
+		case ARG_NO_NUMA:
+			numa = false;
+			break;
+		case ARG_STACK:
+			stack_mode = true;
+			break;
+		case ARG_COVERAGE:
+			cover_mode = true;
+			break;
+		case ARG_CAPTURE:
+			if (add_capture(optarg)) {
+				fprintf(stderr, "Invalid capture %s.\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_ARG:
+			if (add_pred(optarg)) {
+				fprintf(stderr, "Invalid argument predicate %s.\n",
+					optarg);
+				cmd_exit(1);
+			}
+			break;
 		COMMON_GETOPT_CASES(prog_name, print_help, argv)
 		default:
 			print_help();
@@ -109,12 +863,48 @@ static int parse_config(int argc, char *argv[])
 		}
 	}
 
+	if (ctf_dir && !report_file) {
+		fprintf(stderr, "Specify binary trace with --report.\n");
+		cmd_exit(1);
+	}
+
+	if (report_file) {
+		if (!fexist(report_file)) {
+			fprintf(stderr, "%s not exist.\n", report_file);
+			cmd_exit(1);
+		}
+		return 0;
+	}
+
+	if (output_file && count) {
+		fprintf(stderr, "No event to write in count mode.\n");
+		cmd_exit(1);
+	}
+
+	if (stack_mode && (count || graph || output_file)) {
+		fprintf(stderr, "--stack is not allowed with -c, -g or -o.\n");
+		cmd_exit(1);
+	}
+
+	if (nr_captures && (count || stack_mode || cover_mode)) {
+		fprintf(stderr, "--capture is not allowed with -c, --stack or "
+			"--coverage.\n");
+		cmd_exit(1);
+	}
+
+	if (cover_mode && (count || graph || stack_mode || output_file ||
+			   sample || nr_preds || nr_tids)) {
+		fprintf(stderr, "--coverage is not allowed with -c, -g, -o, "
+			"--stack or the filters.\n");
+		cmd_exit(1);
+	}
+
 	if (target_pid == -1) {
 		fprintf(stderr, "Specify pid with -p, --pid.\n");
 		cmd_exit(1);
 	}
 
-	if (!target_func) {
+	if (!nr_func_patterns) {
 		fprintf(stderr, "Specify target function to trace with -f, --function.\n");
 		cmd_exit(1);
 	}
@@ -158,54 +948,2835 @@ static int parse_config(int argc, char *argv[])
 }
 
 
-int ulftrace(int argc, char *argv[])
+#define NUMA_NODE_DIR	"/sys/devices/system/node"
+
+/* Set the ids of list like "0-3,8\n" of @path into @set */
+static int load_id_list(const char *path, cpu_set_t *set)
 {
-	int ret = 0;
-	struct task_sym *tsym;
+	unsigned long a, b;
+	char buf[4096], *p = buf, *end;
+	ssize_t n;
 
-	COMMON_RESET_BEFORE_PARSE_ARGS(ulftrace_args_reset);
+	CPU_ZERO(set);
+	n = fload(path, buf, sizeof(buf));
+	if (n <= 0)
+		return n ?: -ENODATA;
 
-	ret = parse_config(argc, argv);
-#if !defined(ULP_CMD_MAIN)
-	if (ret == CMD_RETURN_SUCCESS_VALUE)
+	while (*p && *p != '\n') {
+		a = b = strtoul(p, &end, 10);
+		if (end == p)
+			return -EINVAL;
+		if (*end == '-') {
+			p = end + 1;
+			b = strtoul(p, &end, 10);
+			if (end == p || b < a)
+				return -EINVAL;
+		}
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return 0;
+}
+
+/**
+ * The online NUMA nodes, one consumer of each node if more than one, the
+ * rings on the other nodes beyond ULP_FTRACE_MAX_NODES are consumed by the
+ * first one, see ftrace_consumer_of(). Return the number of consumers.
+ */
+static unsigned int ftrace_numa_init(struct ftrace_shm *shm)
+{
+	unsigned int i, n = 0;
+
+	if (!numa || load_id_list(NUMA_NODE_DIR "/online", &shm->nodes) ||
+	    CPU_COUNT(&shm->nodes) <= 1)
 		return 0;
-#endif
+
+	for (i = 0; i < CPU_SETSIZE && n < ULP_FTRACE_MAX_NODES; i++) {
+		if (CPU_ISSET(i, &shm->nodes))
+			shm->consumers[n++].node = i;
+	}
+	ulp_info("%u NUMA nodes, one consumer of each.\n", n);
+	return n;
+}
+
+/* PMD size of x86_64 and aarch64 with 4K pages, see ftrace_shm_create() */
+#define FTRACE_SHM_HUGE_SIZE	(2 * MB)
+
+/**
+ * Create the memfd in target process, map it in both target and current
+ * process, the memfd is closed in target at last, the mappings keep it.
+ *
+ * The rings are written by the traced threads, the page faults of the
+ * first events are the latency tail of tracing, thus the large shm is
+ * sized to huge pages, the shmem mapping of it is aligned by kernel,
+ * advised huge and prefaulted. The madvise(2) of old kernel or without
+ * THP fails, which is harmless.
+ *
+ * On NUMA host, only the header before the rings is prefaulted, and no
+ * huge page, which is shared by the rings of threads on different nodes,
+ * each ring is touched by its owner at first, see thread_ring() of ftrace
+ * object.
+ */
+static int ftrace_shm_create(struct task_struct *task, struct ftrace_shm *shm)
+{
+	const char *name = "ulftrace";
+	char path[PATH_MAX];
+	int ret, fd, remote_fd;
+	void *mem;
+
+	shm->nr_consumers = ftrace_numa_init(shm);
+	shm->size = ALIGN(sizeof(struct ulp_ftrace_shm), PAGE_SIZE);
+	if (!shm->nr_consumers && shm->size >= FTRACE_SHM_HUGE_SIZE)
+		shm->size = ALIGN(shm->size, FTRACE_SHM_HUGE_SIZE);
+
+	struct task_syscall_entry calls[] = {
+		{
+			.nr = __NR_memfd_create,
+			.args = { 0, MFD_CLOEXEC },
+			.data_mask = BIT(0),
+		},
+		{
+			.nr = __NR_ftruncate,
+			.args = { 0, shm->size },
+			.ret_mask = BIT(0),
+		},
+		{
+			.nr = __NR_mmap,
+			.args = { 0, shm->size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, 0, 0 },
+			.ret_mask = BIT(4),
+		},
+		{
+			.nr = __NR_madvise,
+			.args = { 2, shm->size, shm->nr_consumers ?
+				  MADV_NORMAL : MADV_HUGEPAGE },
+			.ret_mask = BIT(0),
+		},
+		{
+			.nr = __NR_madvise,
+			.args = { 2, shm->nr_consumers ?
+				  offsetof(struct ulp_ftrace_shm, rings) :
+				  shm->size, MADV_POPULATE_WRITE },
+			.ret_mask = BIT(0),
+		},
+	};
+
+	ret = task_attach_session(task);
 	if (ret)
 		return ret;
 
-	COMMON_IN_MAIN_AFTER_PARSE_ARGS();
+	ret = task_syscall_batch(task, calls, ARRAY_SIZE(calls), name,
+				 strlen(name) + 1);
+	if (ret)
+		goto detach;
 
-	ulpatch_init();
+	remote_fd = calls[0].ret;
+	if (remote_fd < 0) {
+		ulp_error("remote memfd_create failed, %s.\n",
+			  strerror(-remote_fd));
+		ret = remote_fd;
+		goto detach;
+	}
 
-	target_task = open_task(target_pid, FTO_ULFTRACE);
-	if (!target_task) {
-		fprintf(stderr, "open %d failed. %m\n", target_pid);
-		return 1;
+	if (calls[1].ret || !calls[2].ret || calls[2].ret > -4096UL) {
+		ulp_error("remote ftruncate or mmap memfd failed.\n");
+		ret = -ENOMEM;
+		goto close;
+	}
+	shm->remote = calls[2].ret;
+	if (calls[3].ret || calls[4].ret)
+		ulp_debug("No huge or prefaulted shm, madvise %ld %ld.\n",
+			  (long)calls[3].ret, (long)calls[4].ret);
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", task->pid, remote_fd);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		ret = -errno;
+		ulp_error("open %s failed, %m.\n", path);
+		goto unmap;
+	}
+
+	mem = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		ret = -errno;
+		ulp_error("mmap %s failed, %m.\n", path);
+		goto unmap;
 	}
 
-	tsym = find_task_sym(target_task, target_func, NULL, NULL);
+	shm->mem = mem;
+	ulp_ftrace_shm_init(shm->mem);
+	shm->mem->nr_nodes = shm->nr_consumers ?: 1;
+	goto close;
+
+unmap:
+	task_munmap(task, shm->remote, shm->size);
+	shm->remote = 0;
+close:
+	task_close(task, remote_fd);
+detach:
+	task_detach_session(task);
+	return ret;
+}
+
+static void ftrace_shm_destroy(struct task_struct *task,
+			       struct ftrace_shm *shm)
+{
+	if (shm->remote) {
+		task_attach_session(task);
+		task_munmap(task, shm->remote, shm->size);
+		task_detach_session(task);
+	}
+	if (shm->mem)
+		munmap(shm->mem, shm->size);
+}
+
+/* Enable or disable the tracing of ftrace object in target */
+static int ftrace_shm_publish(struct task_struct *task, unsigned long addr)
+{
+	struct task_sym *tsym;
+	int n;
+
+	tsym = find_task_sym(task, ULFTRACE_SHM_SYMBOL, NULL, NULL);
 	if (!tsym) {
-		fprintf(stderr, "couldn't found symbol '%s'\n", target_func);
-		errno = ENOENT;
-		ret = 1;
-		goto done;
+		ulp_error("Not found %s in %s.\n", ULFTRACE_SHM_SYMBOL,
+			  patch_object_file);
+		return -ENOENT;
 	}
 
-	init_patch(target_task, ULPATCH_OBJ_FTRACE_MCOUNT_PATH);
+	n = memcpy_to_task(task, tsym->addr, &addr, sizeof(addr));
+	return n == sizeof(addr) ? 0 : -EFAULT;
+}
 
-	// MORE
+/* All addresses of mcount symbols, include the PLT entries */
+static int mcount_addrs(struct task_struct *task, unsigned long *addrs,
+			int max)
+{
+	struct task_sym *sym, *is;
+	int j, n = 0;
 
-	delete_patch(target_task);
+	for (j = 0; j < ARRAY_SIZE(mcount_symbols); j++) {
+		sym = find_task_sym(task, mcount_symbols[j], NULL, NULL);
+		if (!sym)
+			continue;
+		if (n < max)
+			addrs[n++] = sym->addr;
+		task_sym_for_each_extra(is, sym) {
+			if (n >= max)
+				break;
+			addrs[n++] = is->addr;
+		}
+	}
+	return n;
+}
 
-done:
-	close_task(target_task);
+/**
+ * Call-site index, the mcount site of every function of an ELF, found in
+ * the ELF file instead of target memory, and saved by GNU Build ID under
+ * ULP_SYM_CACHE_DIR, thus tracing the known binary reads no text of target.
+ * The functions not in index, such as the ones of ELF without Build ID, are
+ * read from target, see ftrace_shm_resolve().
+ *
+ *   struct site_cache_hdr
+ *   struct site_cache_ent[nr], sorted by function address of ELF
+ */
+#define SITE_CACHE_MAGIC	"ULPSITE"
+#define SITE_CACHE_VERSION	1
 
-	return ret;
+struct site_cache_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t build_id_len;
+	uint8_t build_id[ULFTRACE_TRACE_BID_SIZE];
+	uint64_t nr;
+};
+
+struct site_cache_ent {
+	/* Address in ELF, the load address is subtracted */
+	uint64_t func;
+	/* Offset of the site from function */
+	uint32_t site;
+	/* FTRACE_SITE_*, 0 if not instrumented */
+	uint8_t type;
+	uint8_t nop[MCOUNT_INSN_SIZE];
+};
+
+struct site_index {
+	struct list_head node;
+	struct vm_area_struct *leader;
+	unsigned long load_addr;
+	const struct site_cache_ent *ents;
+	size_t nr;
+	/* mmap(2) of cache file, or malloc if just built */
+	void *map;
+	size_t map_size;
+};
+
+static LIST_HEAD(site_indexes);
+
+static void site_cache_path(const uint8_t *bid, int len, char *buf,
+			    size_t blen)
+{
+	char sbid[ULFTRACE_TRACE_BID_SIZE * 2 + 1];
+	int i;
+
+	for (i = 0; i < len; i++)
+		sprintf(sbid + i * 2, "%02x", bid[i]);
+	sbid[len * 2] = '\0';
+	snprintf(buf, blen, ULP_SYM_CACHE_DIR "/%s.sites", sbid);
 }
 
-#if defined(ULP_CMD_MAIN)
-int main(int argc, char *argv[])
+/* Same trust of cache file as the symbol cache, see sym_cache_map() */
+static int site_cache_map(struct site_index *si, const uint8_t *bid, int len)
+{
+	const struct site_cache_hdr *hdr;
+	char path[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	site_cache_path(bid, len, path, sizeof(path));
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) || (st.st_uid != geteuid() && st.st_uid != 0) ||
+	    st.st_mode & (S_IWGRP | S_IWOTH) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EPERM;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	if (memcmp(hdr->magic, SITE_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SITE_CACHE_VERSION ||
+	    hdr->build_id_len != len || memcmp(hdr->build_id, bid, len) ||
+	    hdr->nr > st.st_size / sizeof(struct site_cache_ent) ||
+	    st.st_size != sizeof(*hdr) +
+			  hdr->nr * sizeof(struct site_cache_ent)) {
+		ulp_debug("Site cache %s is stale.\n", path);
+		munmap(map, st.st_size);
+		return -ESTALE;
+	}
+
+	si->map = map;
+	si->map_size = st.st_size;
+	si->ents = (void *)(hdr + 1);
+	si->nr = hdr->nr;
+	ulp_debug("Site cache %s hit, %zu functions.\n", path, si->nr);
+	return 0;
+}
+
+/* Write to temporary file and rename(2) it, see sym_cache_save() */
+static int site_cache_save(const struct site_index *si, const uint8_t *bid,
+			   int len)
 {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct site_cache_hdr hdr;
+	FILE *fp;
+	int fd;
+
+	site_cache_path(bid, len, path, sizeof(path));
+
+	if (mkdir(ULP_PROC_ROOT_DIR, 0755) && errno != EEXIST)
+		return -errno;
+	if (mkdir(ULP_SYM_CACHE_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -errno;
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		unlink(tmp);
+		return -errno;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SITE_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SITE_CACHE_VERSION;
+	hdr.build_id_len = len;
+	memcpy(hdr.build_id, bid, len);
+	hdr.nr = si->nr;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(si->ents, sizeof(*si->ents), si->nr, fp);
+
+	if (fclose(fp) || rename(tmp, path)) {
+		ulp_warning("Save site cache %s failed, %m\n", path);
+		unlink(tmp);
+		return -EIO;
+	}
+
+	ulp_debug("Save site cache %s, %zu functions.\n", path, si->nr);
+	return 0;
+}
+
+/* File offset of ELF address @addr, and the bytes of file after it */
+static long site_file_offset(const struct vma_elf_mem *elf,
+			     unsigned long addr, size_t *avail)
+{
+	const GElf_Phdr *phdr;
+	int i;
+
+	for (i = 0; i < elf->ehdr.e_phnum; i++) {
+		phdr = &elf->phdrs[i];
+		if (phdr->p_type != PT_LOAD || addr < phdr->p_vaddr ||
+		    addr >= phdr->p_vaddr + phdr->p_filesz)
+			continue;
+		*avail = phdr->p_vaddr + phdr->p_filesz - addr;
+		return addr - phdr->p_vaddr + phdr->p_offset;
+	}
+	return -ENOENT;
+}
+
+/**
+ * Find the sites of all functions of the ELF in its file, the file must
+ * have the same Build ID as the VMA, the text in target may be modified.
+ */
+static int site_index_build(struct task_struct *task, struct site_index *si,
+			    const uint8_t *bid, int len,
+			    const unsigned long *mcounts, int nr_mcounts)
+{
+	const struct vma_elf_mem *elf = si->leader->vma_elf;
+	struct task_syms *tsyms = &task->tsyms;
+	uint8_t fbid[ULFTRACE_TRACE_BID_SIZE];
+	const struct task_sym_range *r;
+	struct vm_area_struct *vma;
+	struct site_cache_ent *ents, *e;
+	struct mmap_struct *map;
+	char path[PATH_MAX];
+	const char *name;
+	unsigned long site;
+	size_t i, n = 0, avail;
+	long off;
+	int type;
+
+	name = task_path(task, si->leader->name_, path, sizeof(path));
+	if (elf_read_build_id(name, fbid, sizeof(fbid)) != len ||
+	    memcmp(fbid, bid, len))
+		return -ESTALE;
+
+	map = fmmap_rdonly(name);
+	if (!map)
+		return -EIO;
+
+	ents = calloc(tsyms->nr_ranges ?: 1, sizeof(*ents));
+	if (!ents) {
+		fmunmap(map);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < tsyms->nr_ranges; i++) {
+		r = &tsyms->ranges[i];
+		vma = r->sym->vma;
+		if (!vma || (vma->leader ?: vma) != si->leader ||
+		    !(vma->prot & PROT_EXEC))
+			continue;
+
+		off = site_file_offset(elf, r->start - si->load_addr, &avail);
+		if (off < 0 || off >= map->size)
+			continue;
+		avail = MIN(MIN(avail, map->size - off),
+			    MIN(r->size, FTRACE_SITE_SCAN_SIZE));
+
+		e = &ents[n++];
+		e->func = r->start - si->load_addr;
+		type = ftrace_find_mcount_site(map->mem + off, avail, r->start,
+					       mcounts, nr_mcounts, &site);
+		if (type < 0)
+			continue;
+		e->type = type;
+		e->site = site - r->start;
+		memcpy(e->nop, map->mem + off + e->site, MCOUNT_INSN_SIZE);
+	}
+
+	fmunmap(map);
+	si->ents = si->map = ents;
+	si->nr = n;
+	ulp_debug("Build site index of %s, %zu functions.\n",
+		  si->leader->name_, n);
+	return 0;
+}
+
+/* The site index of ELF of @vma, NULL if none */
+static struct site_index *site_index_get(struct task_struct *task,
+					 struct vm_area_struct *vma,
+					 const unsigned long *mcounts,
+					 int nr_mcounts)
+{
+	struct vm_area_struct *leader = vma->leader ?: vma;
+	uint8_t bid[ULFTRACE_TRACE_BID_SIZE];
+	struct site_index *si;
+	int len;
+
+	if (!site_cache || !leader->vma_elf || !leader->vma_elf->phdrs)
+		return NULL;
+
+	list_for_each_entry(si, &site_indexes, node) {
+		if (si->leader == leader)
+			return si->nr ? si : NULL;
+	}
+
+	/* Tried once, even if failed */
+	si = calloc(1, sizeof(*si));
+	if (!si)
+		return NULL;
+	si->leader = leader;
+	si->load_addr = leader->vma_elf->load_addr;
+	list_add(&si->node, &site_indexes);
+
+	len = vma_read_build_id(leader, bid, sizeof(bid));
+	if (len <= 0)
+		return NULL;
+
+	if (!site_cache_map(si, bid, len))
+		return si;
+
+	if (site_index_build(task, si, bid, len, mcounts, nr_mcounts))
+		return NULL;
+	site_cache_save(si, bid, len);
+	return si->nr ? si : NULL;
+}
+
+static int cmp_site_ent(const void *key, const void *elem)
+{
+	uint64_t func = *(const uint64_t *)key;
+	const struct site_cache_ent *e = elem;
+
+	return func < e->func ? -1 : func > e->func;
+}
+
+static const struct site_cache_ent *site_index_find(struct site_index *si,
+						    unsigned long addr)
+{
+	uint64_t func = addr - si->load_addr;
+
+	return bsearch(&func, si->ents, si->nr, sizeof(*si->ents),
+		       cmp_site_ent);
+}
+
+static void site_indexes_free(void)
+{
+	struct site_index *si, *tmp;
+
+	list_for_each_entry_safe(si, tmp, &site_indexes, node) {
+		list_del(&si->node);
+		if (si->map_size)
+			munmap(si->map, si->map_size);
+		else
+			free(si->map);
+		free(si);
+	}
+}
+
+/**
+ * Resolve all functions match the patterns, find the mcount site of them
+ * with one batch remote read of all function entries, and fill the filters
+ * of shared memory, in address order, see task_syms_build_ranges().
+ */
+static int ftrace_shm_resolve(struct task_struct *task, struct ftrace_shm *shm,
+			      struct ftrace_sites *sites)
+{
+	struct task_syms *tsyms = &task->tsyms;
+	unsigned long mcounts[ULFTRACE_MAX_MCOUNTS], site;
+	size_t max = cover_mode ? ULP_FTRACE_MAX_COVER : ULP_FTRACE_MAX_FILTERS;
+	struct ulp_ftrace_shm *mem = shm->mem;
+	uint32_t *nr_table = cover_mode ? &mem->nr_cover : &mem->nr_filters;
+	const struct ulp_ftrace_schema *schema;
+	struct ulp_ftrace_filter *f, *table;
+	struct cover_site *c;
+	const struct task_sym_range *r;
+	struct vm_area_struct *vma;
+	struct task_iov *iov = NULL;
+	const struct site_cache_ent **cached = NULL;
+	struct task_iov *riov = NULL;
+	size_t *idx = NULL, i, nr = 0, nr_read = 0;
+	uint8_t (*code)[FTRACE_SITE_SCAN_SIZE] = NULL;
+	int nr_mcounts, type, ret = 0;
+	struct site_index *si;
+	const char *nop;
+
+	nr_mcounts = mcount_addrs(task, mcounts, ARRAY_SIZE(mcounts));
+	if (!nr_mcounts) {
+		ulp_error("Not found mcount in %d, not compiled with -pg?\n",
+			  task->pid);
+		return -ENOENT;
+	}
+
+	if ((!tsyms->ranges || tsyms->ranges_dirty) &&
+	    task_syms_build_ranges(task))
+		return -ENOMEM;
+
+	if (resolve_demangled_patterns(task))
+		return -ENOMEM;
+
+	table = cover_mode ? mem->cover : mem->filters;
+
+	idx = malloc(sizeof(*idx) * max);
+	iov = malloc(sizeof(*iov) * max);
+	riov = malloc(sizeof(*riov) * max);
+	cached = malloc(sizeof(*cached) * max);
+	code = malloc(sizeof(*code) * max);
+	if (cover_mode)
+		sites->covers = malloc(sizeof(*sites->covers) * max);
+	else
+		sites->nops = malloc(sizeof(*sites->nops) * max);
+	if (!idx || !iov || !riov || !cached || !code ||
+	    (!sites->nops && !sites->covers)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < tsyms->nr_ranges; i++) {
+		r = &tsyms->ranges[i];
+		vma = r->sym->vma;
+		if (!vma || !(vma->prot & PROT_EXEC) ||
+		    vma->type == VMA_ULPATCH)
+			continue;
+		if (!func_match(r->sym->name))
+			continue;
+		if (nr >= max) {
+			ulp_warning("Too many functions, only trace %zu.\n",
+				    max);
+			break;
+		}
+		iov[nr].remote = r->start;
+		iov[nr].local = code[nr];
+		iov[nr].len = MIN(r->size, FTRACE_SITE_SCAN_SIZE);
+
+		si = site_index_get(task, vma, mcounts, nr_mcounts);
+		cached[nr] = si ? site_index_find(si, r->start) : NULL;
+		if (!cached[nr])
+			riov[nr_read++] = iov[nr];
+		idx[nr++] = i;
+	}
+
+	ulp_debug("Sites of %zu functions from index, %zu read.\n",
+		  nr - nr_read, nr_read);
+
+	/* The failed ones are zeroed, no site found in them */
+	if (nr_read)
+		memcpy_from_task_iov(task, riov, nr_read);
+
+	for (i = 0; i < nr; i++) {
+		r = &tsyms->ranges[idx[i]];
+		if (cached[i]) {
+			type = cached[i]->type ?: -ENOENT;
+			site = r->start + cached[i]->site;
+			nop = (const char *)cached[i]->nop;
+		} else {
+			type = ftrace_find_mcount_site(code[i], iov[i].len,
+						       r->start, mcounts,
+						       nr_mcounts, &site);
+			nop = (const char *)code[i] + (site - r->start);
+		}
+		if (type < 0) {
+			ulp_debug("No mcount site in %s.\n", r->sym->name);
+			sites->nr_skipped++;
+			continue;
+		}
+
+		f = &table[(*nr_table)++];
+		f->start = r->start;
+		f->end = r->start + r->size;
+		sites->nr_funcs++;
+
+		if (cover_mode) {
+			c = &sites->covers[sites->nr_covers++];
+			c->addr = site;
+			c->type = type;
+			c->state = COVER_ORIG;
+			memcpy(c->bytes[COVER_ORIG], nop, MCOUNT_INSN_SIZE);
+			continue;
+		}
+
+		schema = capture_schema(r->sym->name);
+		if (schema)
+			mem->schemas[*nr_table - 1] = *schema;
+
+		if (type == FTRACE_SITE_NOP) {
+			sites->nops[sites->nr_nops].addr = site;
+			memcpy(sites->nops[sites->nr_nops].nop, nop,
+			       MCOUNT_INSN_SIZE);
+			sites->nr_nops++;
+		}
+	}
+
+	if (!sites->nr_funcs) {
+		ulp_error("No function to trace, %u matched without mcount.\n",
+			  sites->nr_skipped);
+		ret = -ENOENT;
+	}
+
+out:
+	site_indexes_free();
+	free(idx);
+	free(iov);
+	free(riov);
+	free(cached);
+	free(code);
+	return ret;
+}
+
+static unsigned long ftrace_mcount_addr(struct task_struct *task)
+{
+	struct task_sym *sym, *is;
+	unsigned long addr = 0;
+
+	sym = find_task_sym(task, ULFTRACE_MCOUNT_SYMBOL, NULL, NULL);
+	if (!sym)
+		return 0;
+	if (sym->vma && sym->vma->type == VMA_ULPATCH)
+		addr = sym->addr;
+	/* The last loaded ftrace object */
+	task_sym_for_each_extra(is, sym) {
+		if (is->vma && is->vma->type == VMA_ULPATCH)
+			addr = MAX(addr, is->addr);
+	}
+	return addr;
+}
+
+/* The call of _ftrace_mcount() at @addr from the mcount site @ip */
+static int ftrace_site_call(unsigned long ip, unsigned long addr, char *call)
+{
+#if defined(__x86_64__)
+	union text_poke_insn insn;
+	long disp = addr - (ip + MCOUNT_INSN_SIZE);
+#elif defined(__aarch64__)
+	uint32_t insn;
+#endif
+	const char *p;
+
+#if defined(__x86_64__)
+	p = disp == (int32_t)disp ? ftrace_call_replace(&insn, ip, addr) : NULL;
+#else
+	p = ftrace_call_replace(&insn, ip, addr);
+#endif
+	if (!p) {
+		ulp_error("%lx is too far from %lx to call.\n", addr, ip);
+		return -ERANGE;
+	}
+	memcpy(call, p, MCOUNT_INSN_SIZE);
+	return 0;
+}
+
+/* The NOP replaces the call of mcount site */
+static void ftrace_site_nop(char *nop)
+{
+#if defined(__x86_64__)
+	memcpy(nop, ftrace_nop_replace(), MCOUNT_INSN_SIZE);
+#elif defined(__aarch64__)
+	uint32_t insn = AARCH64_INSN_NOP;
+
+	memcpy(nop, &insn, MCOUNT_INSN_SIZE);
+#endif
+}
+
+/**
+ * Replace all NOP mcount sites with the call of _ftrace_mcount() or the
+ * other way around, the target is not stopped, see ftrace_modify_sites(). On
+ * x86_64, the 5 bytes are rewritten through int3, on aarch64, the BL and NOP
+ * are swapped directly.
+ */
+static int ftrace_sites_enable(struct task_struct *task,
+			       struct ftrace_sites *sites, bool enable)
+{
+	struct code_write *w;
+	unsigned int i;
+	int err;
+
+	if (!sites->nr_nops || sites->enabled == enable)
+		return 0;
+
+	if (enable) {
+		unsigned long addr = ftrace_mcount_addr(task);
+
+		if (!addr) {
+			ulp_error("Not found %s in %d.\n",
+				  ULFTRACE_MCOUNT_SYMBOL, task->pid);
+			return -ENOENT;
+		}
+
+		for (i = 0; i < sites->nr_nops; i++) {
+			err = ftrace_site_call(sites->nops[i].addr, addr,
+					       sites->nops[i].call);
+			if (err)
+				return err;
+		}
+	}
+
+	w = malloc(sizeof(*w) * sites->nr_nops);
+	if (!w)
+		return -ENOMEM;
+
+	for (i = 0; i < sites->nr_nops; i++) {
+		w[i].addr = sites->nops[i].addr;
+		w[i].new = enable ? sites->nops[i].call : sites->nops[i].nop;
+		w[i].old = enable ? sites->nops[i].nop : sites->nops[i].call;
+		w[i].len = MCOUNT_INSN_SIZE;
+	}
+
+	err = ftrace_modify_sites(task, w, sites->nr_nops);
+	if (!err)
+		sites->enabled = enable;
+	free(w);
+	return err;
+}
+
+/**
+ * Coverage mode: rewrite the sites into @state in one batch, only the ones
+ * of called functions if @called. The sites are armed once, and disarmed
+ * by ulftrace after the first call of function every interval, thus the
+ * probe cost is paid by the first calls only, the called functions run as
+ * untraced ones after that. At last, all of them are restored.
+ */
+static int ftrace_cover_write(struct task_struct *task, struct ftrace_shm *shm,
+			      struct ftrace_sites *sites,
+			      enum cover_state state, bool called)
+{
+	struct code_write *w;
+	struct cover_site *c;
+	unsigned int i, n = 0, *idx;
+	int err = 0;
+
+	w = malloc(sizeof(*w) * (sites->nr_covers ?: 1));
+	idx = malloc(sizeof(*idx) * (sites->nr_covers ?: 1));
+	if (!w || !idx) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < sites->nr_covers; i++) {
+		c = &sites->covers[i];
+		if (c->state == state)
+			continue;
+		if (called && !ulp_ftrace_cover_test(shm->mem, i))
+			continue;
+		if (!memcmp(c->bytes[c->state], c->bytes[state],
+			    MCOUNT_INSN_SIZE)) {
+			c->state = state;
+			continue;
+		}
+		w[n].addr = c->addr;
+		w[n].new = c->bytes[state];
+		w[n].old = c->bytes[c->state];
+		w[n].len = MCOUNT_INSN_SIZE;
+		idx[n++] = i;
+	}
+
+	if (n)
+		err = ftrace_modify_sites(task, w, n);
+	if (!err) {
+		for (i = 0; i < n; i++)
+			sites->covers[idx[i]].state = state;
+		ulp_debug("Rewrite %u coverage sites into state %d.\n", n,
+			  state);
+	}
+out:
+	free(idx);
+	free(w);
+	return err;
+}
+
+/* Fill the armed and disarmed bytes of coverage sites, and arm them */
+static int ftrace_cover_arm(struct task_struct *task, struct ftrace_shm *shm,
+			    struct ftrace_sites *sites)
+{
+	unsigned long addr = ftrace_mcount_addr(task);
+	struct cover_site *c;
+	unsigned int i;
+	int err;
+
+	if (!addr) {
+		ulp_error("Not found %s in %d.\n", ULFTRACE_MCOUNT_SYMBOL,
+			  task->pid);
+		return -ENOENT;
+	}
+
+	for (i = 0; i < sites->nr_covers; i++) {
+		c = &sites->covers[i];
+		if (c->type == FTRACE_SITE_NOP) {
+			err = ftrace_site_call(c->addr, addr,
+					       c->bytes[COVER_ARMED]);
+			if (err)
+				return err;
+			memcpy(c->bytes[COVER_DISARMED], c->bytes[COVER_ORIG],
+			       MCOUNT_INSN_SIZE);
+		} else {
+			memcpy(c->bytes[COVER_ARMED], c->bytes[COVER_ORIG],
+			       MCOUNT_INSN_SIZE);
+			ftrace_site_nop(c->bytes[COVER_DISARMED]);
+		}
+	}
+
+	return ftrace_cover_write(task, shm, sites, COVER_ARMED, false);
+}
+
+static void outbuf_flush(struct ftrace_shm *shm)
+{
+	if (!shm->outlen)
+		return;
+	fwrite(shm->outbuf, 1, shm->outlen, shm->out);
+	fflush(shm->out);
+	shm->outlen = 0;
+}
+
+/* One line of event, symbolized with the ranges of task->tsyms */
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	unsigned int shift = 0;
+	uint64_t val = 0;
+
+	while (*p < end && shift < 64) {
+		val |= (uint64_t)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			*v = val;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -EINVAL;
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/**
+ * Format the encoded arguments like 'arg1=3, arg2="foo"', see enum
+ * ulp_ftrace_arg_type. The unprintable chars of string are shown as '.'.
+ * Return the length, or -EINVAL if it's broken.
+ */
+static int format_args(char *buf, size_t size, const uint8_t *p, size_t len)
+{
+	const uint8_t *end = p + len;
+	unsigned int tag, slen, i;
+	bool truncated;
+	uint64_t v;
+	int n = 0, ret;
+
+	if (size)
+		buf[0] = '\0';
+
+	while (p < end) {
+		tag = *p++;
+		ret = snprintf(buf + n, size - n, "%sarg%u=", n ? ", " : "",
+			       tag >> 4);
+		if (ret < 0 || n + ret >= size)
+			return -EINVAL;
+		n += ret;
+
+		switch (tag & 0xf) {
+		case ULP_FTRACE_ARG_INT:
+			if (get_varint(&p, end, &v))
+				return -EINVAL;
+			ret = snprintf(buf + n, size - n, "%ld",
+				       (long)unzigzag(v));
+			break;
+		case ULP_FTRACE_ARG_HEX:
+			if (get_varint(&p, end, &v))
+				return -EINVAL;
+			ret = snprintf(buf + n, size - n, "%#lx",
+				       (unsigned long)v);
+			break;
+		case ULP_FTRACE_ARG_STR:
+			if (p >= end)
+				return -EINVAL;
+			truncated = *p & ULP_FTRACE_STR_TRUNCATED;
+			slen = *p++ & ~ULP_FTRACE_STR_TRUNCATED;
+			if (slen > end - p || n + slen + 6 >= size)
+				return -EINVAL;
+			buf[n++] = '"';
+			for (i = 0; i < slen; i++)
+				buf[n++] = isprint(p[i]) ? p[i] : '.';
+			p += slen;
+			ret = snprintf(buf + n, size - n, "\"%s",
+				       truncated ? "..." : "");
+			break;
+		default:
+			return -EINVAL;
+		}
+		if (ret < 0 || n + ret >= size)
+			return -EINVAL;
+		n += ret;
+	}
+	return n;
+}
+
+/* Enough for ULP_FTRACE_ARGS_MAX bytes of arguments */
+#define ULFTRACE_ARGS_STR_SIZE	(ULP_FTRACE_ARGS_MAX * 2 + 64)
+
+static void print_event(struct task_struct *task, struct ftrace_shm *shm,
+			const struct ulp_ftrace_event *e, const uint8_t *args,
+			size_t len)
+{
+	struct task_sym *child, *parent;
+	unsigned long child_off = 0, parent_off = 0;
+	char abuf[ULFTRACE_ARGS_STR_SIZE];
+	int n;
+
+	if (len && format_args(abuf, sizeof(abuf), args, len) < 0)
+		strcpy(abuf, "??");
+
+	child = find_task_sym_contain(task, e->child_ip, &child_off);
+	parent = find_task_sym_contain(task, e->parent_ip, &parent_off);
+
+	for (;;) {
+		n = snprintf(shm->outbuf + shm->outlen,
+			     sizeof(shm->outbuf) - shm->outlen,
+			     "%lu.%09lu %6u %s+%#lx <- %s+%#lx%s%s%s\n",
+			     e->ns / 1000000000UL, e->ns % 1000000000UL,
+			     e->tid, child ? child->name : "??", child_off,
+			     parent ? parent->name : "??", parent_off,
+			     len ? " (" : "", len ? abuf : "",
+			     len ? ")" : "");
+		if (n < 0)
+			return;
+		if (shm->outlen + n < sizeof(shm->outbuf))
+			break;
+		/* Too long line for the empty buffer, drop it */
+		if (!shm->outlen)
+			return;
+		outbuf_flush(shm);
+	}
+	shm->outlen += n;
+}
+
+
+static inline uint32_t trace_ip_hash(uint64_t ip, unsigned int nr_slots)
+{
+	return (ip * 0x9e3779b97f4a7c15UL) >> 32 & (nr_slots - 1);
+}
+
+/* Double the slots, the ips array has nr_slots / 2 entries at most */
+static int trace_ips_grow(struct trace_writer *tw)
+{
+	unsigned int nr_slots = tw->nr_slots ? tw->nr_slots * 2 : SZ_4K;
+	uint32_t *slots, h, i;
+	uint64_t *ips;
+
+	ips = realloc(tw->ips, sizeof(*ips) * nr_slots / 2);
+	if (!ips)
+		return -ENOMEM;
+	tw->ips = ips;
+
+	slots = calloc(nr_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < tw->hdr.nr_ips; i++) {
+		h = trace_ip_hash(ips[i], nr_slots);
+		while (slots[h])
+			h = (h + 1) & (nr_slots - 1);
+		slots[h] = i + 1;
+	}
+
+	free(tw->slots);
+	tw->slots = slots;
+	tw->nr_slots = nr_slots;
+	return 0;
+}
+
+/* Return the index of ip in ips table, negative errno if failed */
+static int trace_intern_ip(struct trace_writer *tw, uint64_t ip)
+{
+	uint32_t h;
+
+	if (tw->hdr.nr_ips * 2 >= tw->nr_slots && trace_ips_grow(tw))
+		return -ENOMEM;
+
+	h = trace_ip_hash(ip, tw->nr_slots);
+	while (tw->slots[h]) {
+		if (tw->ips[tw->slots[h] - 1] == ip)
+			return tw->slots[h] - 1;
+		h = (h + 1) & (tw->nr_slots - 1);
+	}
+
+	tw->ips[tw->hdr.nr_ips] = ip;
+	tw->slots[h] = ++tw->hdr.nr_ips;
+	return tw->slots[h] - 1;
+}
+
+/* Encode the event into the output buffer, no symbolization at all */
+static void trace_write_event(struct ftrace_shm *shm, unsigned int ring,
+			      const struct ulp_ftrace_event *e,
+			      const uint8_t *args, size_t len)
+{
+	struct trace_writer *tw = shm->trace;
+	int child, parent;
+	uint8_t *p;
+
+	child = trace_intern_ip(tw, e->child_ip);
+	parent = trace_intern_ip(tw, e->parent_ip);
+	if (child < 0 || parent < 0) {
+		tw->nr_lost++;
+		return;
+	}
+
+	if (shm->outlen + TRACE_REC_MAX + TRACE_REC_ARGS_MAX >
+	    sizeof(shm->outbuf))
+		outbuf_flush(shm);
+
+	p = (uint8_t *)shm->outbuf + shm->outlen;
+	if (e->tid != tw->last_tid[ring]) {
+		*p++ = TRACE_REC_TID << TRACE_REC_TYPE_SHIFT | ring;
+		p = ulp_ftrace_put_varint(p, e->tid);
+		tw->last_tid[ring] = e->tid;
+	}
+	if (len) {
+		*p++ = TRACE_REC_ARGS << TRACE_REC_TYPE_SHIFT | ring;
+		p = ulp_ftrace_put_varint(p, len);
+		memcpy(p, args, len);
+		p += len;
+	}
+	*p++ = TRACE_REC_EVENT << TRACE_REC_TYPE_SHIFT | ring;
+	p = ulp_ftrace_put_varint(p,
+			ulp_ftrace_zigzag(e->ns - tw->last_ns[ring]));
+	p = ulp_ftrace_put_varint(p, child);
+	p = ulp_ftrace_put_varint(p, parent);
+	tw->last_ns[ring] = e->ns;
+
+	shm->outlen = p - (uint8_t *)shm->outbuf;
+	tw->hdr.nr_events++;
+}
+
+/* Snapshot the ELF VMAs and their build id, ULPatch VMAs are skipped */
+static int trace_write_modules(struct trace_writer *tw,
+			       struct task_struct *task)
+{
+	struct vm_area_struct *vma, *sibling;
+	struct trace_module m;
+	int ret;
+
+	task_for_each_vma(vma, task) {
+		if (!vma->vma_elf || vma->type == VMA_ULPATCH)
+			continue;
+
+		memset(&m, 0, sizeof(m));
+		m.start = vma->vm_start;
+		m.end = vma->vm_end;
+		list_for_each_entry(sibling, &vma->siblings, siblings)
+			m.end = MAX(m.end, sibling->vm_end);
+		m.load_addr = vma->vma_elf->load_addr;
+
+		ret = vma_read_build_id(vma, m.build_id, sizeof(m.build_id));
+		m.build_id_len = ret > 0 ? ret : 0;
+		m.path_len = strlen(vma->name_) + 1;
+
+		if (fwrite(&m, sizeof(m), 1, tw->fp) != 1 ||
+		    fwrite(vma->name_, m.path_len, 1, tw->fp) != 1)
+			return -errno;
+		tw->hdr.nr_modules++;
+	}
+	return 0;
+}
+
+static int trace_open(struct ftrace_shm *shm, struct task_struct *task,
+		      const char *path)
+{
+	struct trace_writer *tw;
+	int i, ret;
+
+	tw = calloc(1, sizeof(*tw));
+	if (!tw)
+		return -ENOMEM;
+
+	tw->fp = fopen(path, "w");
+	if (!tw->fp) {
+		ret = -errno;
+		free(tw);
+		return ret;
+	}
+
+	memcpy(tw->hdr.magic, ULFTRACE_TRACE_MAGIC, sizeof(tw->hdr.magic));
+	tw->hdr.version = ULFTRACE_TRACE_VERSION;
+	tw->hdr.pid = task->pid;
+	tw->hdr.start_ns = nsecs();
+	for (i = 0; i < ULP_FTRACE_MAX_RINGS; i++)
+		tw->last_ns[i] = tw->hdr.start_ns;
+
+	/* Rewritten at last */
+	if (fwrite(&tw->hdr, sizeof(tw->hdr), 1, tw->fp) != 1 ||
+	    trace_write_modules(tw, task)) {
+		ret = -errno ?: -EIO;
+		fclose(tw->fp);
+		free(tw);
+		return ret;
+	}
+	tw->hdr.events_off = ftell(tw->fp);
+
+	shm->trace = tw;
+	shm->out = tw->fp;
+	return 0;
+}
+
+static int trace_close(struct ftrace_shm *shm, const char *path)
+{
+	struct trace_writer *tw = shm->trace;
+	int ret = 0;
+
+	if (!tw)
+		return 0;
+
+	outbuf_flush(shm);
+	tw->hdr.ips_off = ftell(tw->fp);
+	if (fwrite(tw->ips, sizeof(*tw->ips), tw->hdr.nr_ips, tw->fp) !=
+	    tw->hdr.nr_ips || fseek(tw->fp, 0, SEEK_SET) ||
+	    fwrite(&tw->hdr, sizeof(tw->hdr), 1, tw->fp) != 1)
+		ret = -errno ?: -EIO;
+	if (fclose(tw->fp) && !ret)
+		ret = -errno;
+
+	if (ret)
+		fprintf(stderr, "write %s failed, %s\n", path, strerror(-ret));
+	else
+		printf("%lu events, %u ips and %u modules written into %s, "
+		       "%lu lost.\n", (unsigned long)tw->hdr.nr_events,
+		       tw->hdr.nr_ips, tw->hdr.nr_modules, path, tw->nr_lost);
+
+	shm->trace = NULL;
+	shm->out = stdout;
+	free(tw->ips);
+	free(tw->slots);
+	free(tw);
+	return ret;
+}
+
+/* Drain all rings in batches, return the number of events */
+/* Slots of the longest arguments following one entry */
+#define ULFTRACE_ARGS_SLOTS	ULP_FTRACE_ARGS_SLOTS(ULP_FTRACE_ARGS_MAX)
+
+/**
+ * The batch may end in the arguments of the last entry, which are committed
+ * with it, pop the rest of them after the @nr events of @e. Return the
+ * number of slots popped.
+ */
+static unsigned int ftrace_pop_args(struct ulp_ftrace_ring *ring,
+				    struct ulp_ftrace_event *e,
+				    unsigned int nr)
+{
+	unsigned int j = 0, len;
+
+	while (j < nr) {
+		len = ULP_FTRACE_EVENT_ARGS(e[j].type);
+		j += 1 + ULP_FTRACE_ARGS_SLOTS(len);
+	}
+	if (j == nr || j - nr > ULFTRACE_ARGS_SLOTS)
+		return 0;
+	return ulp_ftrace_ring_pop_batch(ring, e + nr, j - nr);
+}
+
+/**
+ * The ring @i is live and consumed by @c, any live one if @c is NULL, the
+ * only consumer. The node of ring is the node of its owner when claimed.
+ */
+static bool ftrace_consumer_of(struct ftrace_shm *shm,
+			       const struct ftrace_consumer *c, unsigned int i)
+{
+	unsigned int j, node;
+
+	if (!ulp_ftrace_ring_live(shm->mem, i))
+		return false;
+	if (!c)
+		return true;
+
+	node = shm->mem->owners[i].node;
+	if (node == c->node)
+		return true;
+	/* Not any consumer's node, such as the nodes beyond the max */
+	if (c != shm->consumers)
+		return false;
+	for (j = 1; j < shm->nr_consumers; j++) {
+		if (shm->consumers[j].node == node)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Drain the rings of consumer @c in batches, the batches are popped out of
+ * lock, the output of them is serialized. Return the number of events.
+ */
+static unsigned long ftrace_shm_consume(struct task_struct *task,
+					struct ftrace_shm *shm,
+					const struct ftrace_consumer *c)
+{
+	struct ulp_ftrace_event e[ULFTRACE_BATCH + ULFTRACE_ARGS_SLOTS];
+	unsigned long n = 0;
+	unsigned int i, j, nr, len, nr_entries;
+	const uint8_t *args;
+
+	for (i = 0; i < shm->mem->nr_rings; i++) {
+		struct ulp_ftrace_ring *ring = &shm->mem->rings[i];
+
+		if (!ftrace_consumer_of(shm, c, i))
+			continue;
+
+		while ((nr = ulp_ftrace_ring_pop_batch(ring, e,
+						       ULFTRACE_BATCH))) {
+			nr += ftrace_pop_args(ring, e, nr);
+			if (c)
+				pthread_mutex_lock(&shm->lock);
+			for (j = 0, nr_entries = 0; j < nr; nr_entries++) {
+				len = ULP_FTRACE_EVENT_ARGS(e[j].type);
+				args = (const uint8_t *)&e[j + 1];
+				if (j + 1 + ULP_FTRACE_ARGS_SLOTS(len) > nr)
+					len = 0;
+				if (shm->trace)
+					trace_write_event(shm, i, &e[j], args,
+							  len);
+				else
+					print_event(task, shm, &e[j], args,
+						    len);
+				j += 1 + ULP_FTRACE_ARGS_SLOTS(len);
+			}
+			if (c)
+				pthread_mutex_unlock(&shm->lock);
+			shm->nr_ring_events[i] += nr_entries;
+			n += nr_entries;
+		}
+	}
+
+	if (c)
+		pthread_mutex_lock(&shm->lock);
+	outbuf_flush(shm);
+	shm->nr_events += n;
+	if (c)
+		pthread_mutex_unlock(&shm->lock);
+	return n;
+}
+
+static bool ftrace_shm_empty(struct ftrace_shm *shm,
+			     const struct ftrace_consumer *c)
+{
+	struct ulp_ftrace_ring *ring;
+	int i;
+
+	for (i = 0; i < shm->mem->nr_rings; i++) {
+		if (!ftrace_consumer_of(shm, c, i))
+			continue;
+		ring = &shm->mem->rings[i];
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) !=
+		    ring->tail)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Sleep until any ring reaches the watermark, see ulp_ftrace_need_wake(),
+ * or timeout. The rings are checked again after @waiting is set, thus the
+ * events committed before it are not missed. All consumers are woken up,
+ * the one of node @c leaves @waiting set, which may be set by others.
+ */
+static void ftrace_shm_wait(struct ftrace_shm *shm,
+			    const struct ftrace_consumer *c)
+{
+	struct ulp_ftrace_shm *mem = shm->mem;
+	struct timespec ts = {
+		.tv_sec = ULFTRACE_WAIT_MS / 1000,
+		.tv_nsec = (ULFTRACE_WAIT_MS % 1000) * 1000000,
+	};
+	uint32_t val;
+	long ret;
+
+	val = __atomic_load_n(&mem->futex, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&mem->waiting, 1, __ATOMIC_SEQ_CST);
+
+	if (!ftrace_shm_empty(shm, c)) {
+		if (!c)
+			__atomic_store_n(&mem->waiting, 0, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Shared futex, the memfd is mapped by two processes */
+	ret = syscall(SYS_futex, &mem->futex, FUTEX_WAIT, val, &ts, NULL, 0);
+	if (ret == -1 && errno == ETIMEDOUT)
+		__atomic_fetch_add(&shm->nr_timeouts, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&shm->nr_wakeups, 1, __ATOMIC_RELAXED);
+
+	if (!c)
+		__atomic_store_n(&mem->waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* Pin current thread to the CPUs of @node, the memory follows it */
+static int ftrace_consumer_pin(unsigned int node)
+{
+	char path[PATH_MAX];
+	cpu_set_t cpus;
+	int ret;
+
+	snprintf(path, sizeof(path), NUMA_NODE_DIR "/node%u/cpulist", node);
+	ret = load_id_list(path, &cpus);
+	if (ret)
+		return ret;
+	/* Memory only node */
+	if (!CPU_COUNT(&cpus))
+		return -ENODEV;
+	return sched_setaffinity(0, sizeof(cpus), &cpus) ? -errno : 0;
+}
+
+static void *ftrace_consumer_thread(void *arg)
+{
+	struct ftrace_consumer *c = arg;
+	struct ftrace_shm *shm = c->shm;
+	int ret;
+
+	ret = ftrace_consumer_pin(c->node);
+	if (ret)
+		ulp_warning("Pin consumer to node %u failed, %s.\n", c->node,
+			    strerror(-ret));
+
+	while (!__atomic_load_n(&shm->consumers_stop, __ATOMIC_ACQUIRE)) {
+		if (!ftrace_shm_consume(c->task, shm, c))
+			ftrace_shm_wait(shm, c);
+	}
+	return NULL;
+}
+
+/* Stop and join the first @nr consumers */
+static void ftrace_consumers_stop(struct ftrace_shm *shm, unsigned int nr)
+{
+	unsigned int i;
+
+	__atomic_store_n(&shm->consumers_stop, true, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&shm->mem->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &shm->mem->futex, FUTEX_WAKE, INT_MAX, NULL, NULL,
+		0);
+
+	for (i = 0; i < nr; i++)
+		pthread_join(shm->consumers[i].thread, NULL);
+	pthread_mutex_destroy(&shm->lock);
+}
+
+/**
+ * Start the consumer of each NUMA node, the signals are handled by main
+ * thread. Return 0, or negative errno and no consumer is running, then
+ * the main thread consumes all rings.
+ */
+static int ftrace_consumers_start(struct task_struct *task,
+				  struct ftrace_shm *shm)
+{
+	struct ftrace_consumer *c;
+	sigset_t set, old;
+	unsigned int i;
+	int err = 0;
+
+	pthread_mutex_init(&shm->lock, NULL);
+	shm->consumers_stop = false;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < shm->nr_consumers; i++) {
+		c = &shm->consumers[i];
+		c->task = task;
+		c->shm = shm;
+		err = -pthread_create(&c->thread, NULL, ftrace_consumer_thread,
+				      c);
+		if (err)
+			break;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		ulp_warning("Start consumer of node %u failed, %s.\n",
+			    shm->consumers[i].node, strerror(-err));
+		ftrace_consumers_stop(shm, i);
+	}
+	return err;
+}
+
+static void ftrace_shm_summary(struct ftrace_shm *shm)
+{
+	struct ulp_ftrace_ring *ring;
+	unsigned long dropped = 0;
+	int i, nr_threads = 0;
+
+	printf("%-4s %-8s %-12s %-12s %-12s\n", "RING", "TID", "CALLS",
+	       "EVENTS", "DROPPED");
+	for (i = 0; i < shm->mem->nr_rings; i++) {
+		ring = &shm->mem->rings[i];
+		if (!ulp_ftrace_ring_live(shm->mem, i))
+			continue;
+		nr_threads++;
+		dropped += ring->dropped;
+		printf("%-4d %-8u %-12lu %-12lu %-12lu\n", i, ring->tid,
+		       ring->calls, shm->nr_ring_events[i], ring->dropped);
+	}
+
+	printf("%lu events of %d threads, %lu dropped, %lu lost, "
+	       "%lu wakeups, %lu timeouts.\n",
+	       shm->nr_events, nr_threads, dropped, shm->mem->lost,
+	       shm->nr_wakeups, shm->nr_timeouts);
+}
+
+/* Rings with hooked returns not came back */
+static unsigned int ftrace_graph_pending(struct ftrace_shm *shm)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < shm->mem->nr_rings; i++)
+		n += ulp_ftrace_ring_live(shm->mem, i) &&
+		     __atomic_load_n(&shm->mem->rings[i].depth,
+				     __ATOMIC_SEQ_CST);
+	return n;
+}
+
+/**
+ * Stop hooking new returns, and wait for the hooked ones, see hook_return()
+ * of ftrace object. Return the number of threads still have hooked returns,
+ * then it's not safe to unpatch.
+ */
+static unsigned int ftrace_graph_quiesce(struct task_struct *task,
+					 struct ftrace_shm *shm)
+{
+	unsigned long end = nsecs() + ULFTRACE_GRAPH_DRAIN_MS * 1000000UL;
+	unsigned int n;
+
+	__atomic_store_n(&shm->mem->flags, 0, __ATOMIC_SEQ_CST);
+
+	while ((n = ftrace_graph_pending(shm)) && nsecs() < end) {
+		if (!proc_pid_exist(task->pid))
+			return 0;
+		usleep(1000);
+	}
+	if (n)
+		return n;
+
+	usleep(ULFTRACE_GRAPH_GRACE_US);
+	return ftrace_graph_pending(shm);
+}
+
+static void hist_merge(struct ulp_ftrace_hist *dst,
+		       const struct ulp_ftrace_hist *src)
+{
+	int i;
+
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+	dst->sum_ns += src->sum_ns;
+	dst->max_ns = MAX(dst->max_ns, src->max_ns);
+	for (i = 0; i < ULP_FTRACE_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static const char *ns_str(uint64_t ns, char *buf, size_t len)
+{
+	if (ns < 1000UL)
+		snprintf(buf, len, "%luns", ns);
+	else if (ns < 1000000UL)
+		snprintf(buf, len, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000UL)
+		snprintf(buf, len, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, len, "%.1fs", ns / 1000000000.0);
+	return buf;
+}
+
+static void print_hist(const struct ulp_ftrace_hist *hist)
+{
+	char lo[16], hi[16];
+	uint64_t max = 0;
+	int b, first = -1, last = -1, w;
+
+	for (b = 0; b < ULP_FTRACE_HIST_BUCKETS; b++) {
+		if (!hist->buckets[b])
+			continue;
+		if (first < 0)
+			first = b;
+		last = b;
+		max = MAX(max, hist->buckets[b]);
+	}
+
+	for (b = first; max && b <= last; b++) {
+		w = hist->buckets[b] * ULFTRACE_GRAPH_BAR / max;
+		printf("  [%8s, %8s) %10lu |%-*.*s|\n",
+		       ns_str(b ? 1UL << (b - 1) : 0, lo, sizeof(lo)),
+		       ns_str(b ? 1UL << b : 1, hi, sizeof(hi)),
+		       hist->buckets[b], ULFTRACE_GRAPH_BAR, w,
+		       "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
+	}
+}
+
+/* Merge the histograms of all rings by function, and display them */
+static void ftrace_graph_summary(struct task_struct *task,
+				 struct ftrace_shm *shm)
+{
+	struct ulp_ftrace_shm *mem = shm->mem;
+	struct ulp_ftrace_hist *funcs, *h;
+	unsigned int i, j, k, nr = 0, nr_threads = 0;
+	char avg[16], max[16], p50[16], p90[16], p99[16];
+	struct task_sym *sym;
+	unsigned long off;
+	uint64_t ip;
+
+	funcs = calloc(ULP_FTRACE_MAX_RINGS * ULP_FTRACE_HISTS, sizeof(*funcs));
+	if (!funcs)
+		return;
+
+	for (i = 0; i < mem->nr_rings; i++) {
+		if (!ulp_ftrace_ring_live(mem, i))
+			continue;
+		nr_threads++;
+		for (j = 0; j < ULP_FTRACE_HISTS; j++) {
+			h = &mem->rings[i].hists[j];
+			ip = __atomic_load_n(&h->ip, __ATOMIC_ACQUIRE);
+			if (!ip)
+				break;
+			for (k = 0; k < nr; k++) {
+				if (funcs[k].ip == ip)
+					break;
+			}
+			if (k == nr)
+				funcs[nr++].ip = ip;
+			hist_merge(&funcs[k], h);
+		}
+	}
+
+	printf("%-32s %10s %8s %8s %8s %8s %8s\n", "FUNCTION", "CALLS", "AVG",
+	       "MAX", "P50", "P90", "P99");
+	for (k = 0; k < nr; k++) {
+		h = &funcs[k];
+		if (!h->count)
+			continue;
+		sym = find_task_sym_contain(task, h->ip, &off);
+		printf("%-32s %10lu %8s %8s %8s %8s %8s\n",
+		       sym ? sym->name : "??", h->count,
+		       ns_str(h->sum_ns / h->count, avg, sizeof(avg)),
+		       ns_str(h->max_ns, max, sizeof(max)),
+		       ns_str(ulp_ftrace_hist_percentile(h, 50), p50, sizeof(p50)),
+		       ns_str(ulp_ftrace_hist_percentile(h, 90), p90, sizeof(p90)),
+		       ns_str(ulp_ftrace_hist_percentile(h, 99), p99, sizeof(p99)));
+		print_hist(h);
+	}
+
+	printf("%u functions of %u threads, %lu too deep, %lu without "
+	       "histogram, %lu unwound, %lu lost.\n", nr, nr_threads,
+	       mem->graph_overflow, mem->hist_lost, mem->graph_unwound,
+	       mem->lost);
+	free(funcs);
+}
+
+struct count_row {
+	unsigned int slot;
+	unsigned long calls;
+	unsigned long delta;
+	unsigned long ns;
+};
+
+static int cmp_count_row(const void *a, const void *b)
+{
+	const struct count_row *ra = a, *rb = b;
+
+	if (ra->delta != rb->delta)
+		return ra->delta < rb->delta ? 1 : -1;
+	if (ra->calls != rb->calls)
+		return ra->calls < rb->calls ? 1 : -1;
+	return ra->slot < rb->slot ? -1 : ra->slot > rb->slot;
+}
+
+/**
+ * Sum the counters of all rings, sort the functions by the calls since last
+ * refresh, the top ones are displayed. At @last all functions called are
+ * displayed, sorted by calls.
+ */
+static void ftrace_count_show(struct task_struct *task, struct ftrace_shm *shm,
+			      bool last)
+{
+	struct ulp_ftrace_shm *mem = shm->mem;
+	unsigned int i, j, nr = 0, nr_filters = mem->nr_filters ?: 1;
+	const struct ulp_ftrace_counter *cnt;
+	unsigned long now = nsecs(), total = 0;
+	double secs = (now - shm->last_ns) / 1000000000.0;
+	char avg[16], sum[16];
+	struct count_row *rows;
+	struct task_sym *sym;
+
+	rows = calloc(nr_filters, sizeof(*rows));
+	if (!rows)
+		return;
+
+	for (i = 0; i < nr_filters; i++) {
+		struct count_row *row = &rows[nr];
+
+		memset(row, 0, sizeof(*row));
+		row->slot = i;
+		for (j = 0; j < mem->nr_rings; j++) {
+			if (!ulp_ftrace_ring_live(mem, j))
+				continue;
+			cnt = &mem->rings[j].counters[i];
+			row->calls += __atomic_load_n(&cnt->calls,
+						      __ATOMIC_RELAXED);
+			row->ns += __atomic_load_n(&cnt->ns, __ATOMIC_RELAXED);
+		}
+		if (!row->calls)
+			continue;
+		row->delta = last ? 0 : row->calls - shm->last_calls[i];
+		shm->last_calls[i] = row->calls;
+		total += row->calls;
+		nr++;
+	}
+
+	qsort(rows, nr, sizeof(*rows), cmp_count_row);
+
+	/* Live table like top(1) */
+	if (!last && isatty(STDOUT_FILENO))
+		printf("\033[H\033[J");
+
+	printf("%u functions called of %d, %lu calls.\n\n", nr, target_pid,
+	       total);
+	printf("%-32s %12s %12s", "FUNCTION", "CALLS", last ? "" : "CALLS/s");
+	if (graph)
+		printf(" %10s %10s", "AVG", "TOTAL");
+	printf("\n");
+
+	for (i = 0; i < nr && (last || i < ULFTRACE_COUNT_TOP); i++) {
+		struct count_row *row = &rows[i];
+
+		sym = find_task_sym_contain(task, mem->nr_filters ?
+				mem->filters[row->slot].start : 0, NULL);
+		printf("%-32s %12lu ", sym ? sym->name : "??", row->calls);
+		if (last)
+			printf("%12s", "");
+		else
+			printf("%12.0f", secs > 0 ? row->delta / secs : 0);
+		if (graph)
+			printf(" %10s %10s",
+			       ns_str(row->ns / row->calls, avg, sizeof(avg)),
+			       ns_str(row->ns, sum, sizeof(sum)));
+		printf("\n");
+	}
+	fflush(stdout);
+
+	shm->last_ns = now;
+	free(rows);
+}
+
+/**
+ * Append the frame @ip of stack to the folded line, the return address is
+ * symbolized by the call instruction before it.
+ */
+static int fold_frame(struct task_struct *task, char *buf, size_t size,
+		      int len, uint64_t ip, bool ret)
+{
+	struct task_sym *sym;
+	int n;
+
+	sym = find_task_sym_contain(task, ret ? ip - 1 : ip, NULL);
+	if (sym)
+		n = snprintf(buf + len, size - len, "%s%s", len ? ";" : "",
+			     sym->name);
+	else
+		n = snprintf(buf + len, size - len, "%s[%#lx]",
+			     len ? ";" : "", ip);
+	return n < 0 || len + n >= size ? -1 : len + n;
+}
+
+/**
+ * Display the unique stacks of stack table, one line for each, the frames
+ * from the outermost one to the traced function are separated by ';' and
+ * followed by the calls, the folded format of flamegraph.pl. Every stack
+ * is symbolized once, by the ranges of task->tsyms.
+ */
+static void ftrace_stack_show(struct task_struct *task, struct ftrace_shm *shm)
+{
+	struct ulp_ftrace_shm *mem = shm->mem;
+	const struct ulp_ftrace_stack *s;
+	unsigned long nr_stacks = 0, calls = 0;
+	char line[PATH_MAX * 2];
+	uint64_t n;
+	uint32_t nr;
+	int i, j, len;
+
+	for (i = 0; i < ULP_FTRACE_STACKS; i++) {
+		s = &mem->stacks[i];
+		nr = __atomic_load_n(&s->nr, __ATOMIC_ACQUIRE);
+		n = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		if (!nr || !n)
+			continue;
+
+		nr = MIN(nr, ULP_FTRACE_STACK_DEPTH);
+		for (j = nr - 1, len = 0; j >= 0 && len >= 0; j--)
+			len = fold_frame(task, line, sizeof(line), len,
+					 s->ips[j], j > 0);
+		if (len < 0)
+			continue;
+
+		printf("%s %lu\n", line, n);
+		nr_stacks++;
+		calls += n;
+	}
+	fflush(stdout);
+
+	ulp_info("%lu calls of %lu unique stacks, %lu lost.\n", calls,
+		 nr_stacks, mem->stack_lost);
+}
+
+/**
+ * Display the functions of coverage table in address order, '+' for the
+ * called ones, '-' for the never called ones.
+ */
+static void ftrace_cover_show(struct task_struct *task, struct ftrace_shm *shm)
+{
+	struct ulp_ftrace_shm *mem = shm->mem;
+	struct task_sym *sym;
+	unsigned int i, nr = 0;
+	bool called;
+
+	for (i = 0; i < mem->nr_cover; i++) {
+		called = ulp_ftrace_cover_test(mem, i);
+		sym = find_task_sym_contain(task, mem->cover[i].start, NULL);
+		if (sym)
+			printf("%c %s\n", called ? '+' : '-', sym->name);
+		else
+			printf("%c [%#lx]\n", called ? '+' : '-',
+			       (unsigned long)mem->cover[i].start);
+		nr += called;
+	}
+
+	printf("%u of %u functions called, %.1f%%.\n", nr, mem->nr_cover,
+	       mem->nr_cover ? nr * 100.0 / mem->nr_cover : 0);
+	fflush(stdout);
+}
+
+/* Frequency of ulp_ftrace_cycles(), and the cycles of reading it twice */
+static void ftrace_cycles_calibrate(struct ftrace_shm *shm)
+{
+	uint64_t c0, c1, read = UINT64_MAX;
+	int i;
+
+	/* Same counter as ulp_cycles() */
+	shm->cycles_per_ns = cycles_calibrate(ULFTRACE_CYCLES_CALIBRATE_US);
+
+	for (i = 0; i < 64; i++) {
+		c0 = ulp_ftrace_cycles();
+		c1 = ulp_ftrace_cycles();
+		read = MIN(read, c1 - c0);
+	}
+	shm->read_cycles = read;
+}
+
+/* Calls of all threads matched the predicates, before sampling */
+static uint64_t ftrace_total_calls(struct ulp_ftrace_shm *mem)
+{
+	uint64_t calls = 0;
+	int i;
+
+	for (i = 0; i < mem->nr_rings; i++) {
+		if (!ulp_ftrace_ring_live(mem, i))
+			continue;
+		calls += __atomic_load_n(&mem->rings[i].calls,
+					 __ATOMIC_RELAXED);
+	}
+	return calls;
+}
+
+/**
+ * Stop measuring, the average costs of the calls since tracing starts are
+ * the per-call overhead from now on, see ftrace_overhead_check().
+ */
+static void ftrace_overhead_calibrate(struct ftrace_shm *shm)
+{
+	struct ulp_ftrace_cost sum[ULP_FTRACE_COST_NUM] = {};
+	struct ulp_ftrace_shm *mem = shm->mem;
+	struct ulp_ftrace_cost *cost;
+	uint64_t cycles;
+	int i, t;
+
+	__atomic_fetch_and(&mem->flags, ~ULP_FTRACE_F_MEASURE,
+			   __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < mem->nr_rings; i++) {
+		if (!ulp_ftrace_ring_live(mem, i))
+			continue;
+		for (t = 0; t < ULP_FTRACE_COST_NUM; t++) {
+			cost = &mem->rings[i].costs[t];
+			sum[t].calls += __atomic_load_n(&cost->calls,
+							__ATOMIC_ACQUIRE);
+			sum[t].cycles += __atomic_load_n(&cost->cycles,
+							 __ATOMIC_RELAXED);
+		}
+	}
+
+	for (t = 0; t < ULP_FTRACE_COST_NUM; t++) {
+		cycles = ulp_ftrace_cost_cycles(&sum[t], shm->read_cycles);
+		shm->cost_ns[t] = shm->cycles_per_ns > 0 ?
+				  cycles / shm->cycles_per_ns : 0;
+	}
+
+	shm->calibrated = true;
+	shm->last_overhead_calls = ftrace_total_calls(mem);
+	shm->last_overhead_ns = nsecs();
+
+	ulp_info("Probe costs %.1f ns recorded, %.1f ns skipped, measured "
+		 "%lu and %lu calls.\n", shm->cost_ns[ULP_FTRACE_COST_RECORD],
+		 shm->cost_ns[ULP_FTRACE_COST_SKIP],
+		 (unsigned long)sum[ULP_FTRACE_COST_RECORD].calls,
+		 (unsigned long)sum[ULP_FTRACE_COST_SKIP].calls);
+}
+
+/**
+ * Estimate the CPU time of target spent in probes during the last interval
+ * from the calls and the calibrated costs. If it's over the budget, record
+ * less calls if the skipped calls alone are within the budget, otherwise
+ * stop tracing. The count mode is never sampled, the counts must be exact.
+ */
+static void ftrace_overhead_check(struct ftrace_shm *shm)
+{
+	struct ulp_ftrace_shm *mem = shm->mem;
+	unsigned long now = nsecs(), dt = now - shm->last_overhead_ns;
+	uint64_t calls = ftrace_total_calls(mem);
+	uint32_t sample = __atomic_load_n(&mem->sample, __ATOMIC_RELAXED) ?: 1;
+	double n = calls - shm->last_overhead_calls, rec = n / sample;
+	double skip_ns, ns, pct;
+
+	shm->last_overhead_calls = calls;
+	shm->last_overhead_ns = now;
+	if (!dt)
+		return;
+
+	skip_ns = n * shm->cost_ns[ULP_FTRACE_COST_SKIP];
+	ns = rec * shm->cost_ns[ULP_FTRACE_COST_RECORD] +
+	     (n - rec) * shm->cost_ns[ULP_FTRACE_COST_SKIP];
+	shm->tax_ns += ns;
+	shm->tax_elapsed_ns += dt;
+
+	pct = ns * 100 / dt;
+	if (overhead_budget <= 0 || pct <= overhead_budget)
+		return;
+
+	if (!count && sample < ULFTRACE_MAX_SAMPLE &&
+	    skip_ns * 100 / dt <= overhead_budget) {
+		/* The next power of 2, no division in target */
+		sample = 1U << (32 - __builtin_clz(sample));
+		__atomic_store_n(&mem->sample, sample, __ATOMIC_RELAXED);
+		ulp_warning("Overhead %.2f%% of CPU is over budget %.2f%%, "
+			    "record 1 in %u calls.\n", pct, overhead_budget,
+			    sample);
+		return;
+	}
+
+	ulp_warning("Overhead %.2f%% of CPU is over budget %.2f%%, stop "
+		    "tracing.\n", pct, overhead_budget);
+	ulftrace_stop = 1;
+}
+
+static void ftrace_overhead_summary(struct ftrace_shm *shm)
+{
+	if (!shm->calibrated)
+		return;
+
+	printf("Probe costs %.1f ns recorded, %.1f ns skipped, %.3f%% of "
+	       "one CPU on average, record 1 in %u calls at last.\n",
+	       shm->cost_ns[ULP_FTRACE_COST_RECORD],
+	       shm->cost_ns[ULP_FTRACE_COST_SKIP],
+	       shm->tax_elapsed_ns ?
+			shm->tax_ns * 100 / shm->tax_elapsed_ns : 0,
+	       shm->mem->sample ?: 1);
+}
+
+/* Drain the events left, and display the summary of modes */
+static void ftrace_shm_summary_all(struct task_struct *task,
+				   struct ftrace_shm *shm)
+{
+	ftrace_shm_consume(task, shm, NULL);
+	trace_close(shm, output_file);
+	if (count)
+		ftrace_count_show(task, shm, true);
+	if (graph)
+		ftrace_graph_summary(task, shm);
+	if (stack_mode)
+		ftrace_stack_show(task, shm);
+	if (cover_mode)
+		ftrace_cover_show(task, shm);
+	if (!count && !graph && !stack_mode && !cover_mode)
+		ftrace_shm_summary(shm);
+	ftrace_overhead_summary(shm);
+}
+
+static void ulftrace_sig_handler(int signum)
+{
+	ulftrace_stop = 1;
+}
+
+static void ftrace_loop(struct task_struct *task, struct ftrace_shm *shm,
+			struct ftrace_sites *sites)
+{
+	unsigned long end = duration ? nsecs() + duration * 1000000000UL : 0;
+	unsigned long interval = (cover_mode ? ULFTRACE_COVER_INTERVAL_MS :
+				  ULFTRACE_COUNT_INTERVAL_MS) * 1000000UL;
+	unsigned long next = nsecs() + interval;
+	unsigned long check = nsecs() + ULFTRACE_CALIBRATE_MS * 1000000UL;
+
+	signal(SIGINT, ulftrace_sig_handler);
+	signal(SIGTERM, ulftrace_sig_handler);
+
+	shm->last_ns = nsecs();
+	ftrace_cycles_calibrate(shm);
+
+	if (shm->nr_consumers && ftrace_consumers_start(task, shm))
+		shm->nr_consumers = 0;
+
+	while (!ulftrace_stop && (!end || nsecs() < end)) {
+		if (shm->nr_consumers)
+			usleep(ULFTRACE_WAIT_MS * 1000);
+		else if (!ftrace_shm_consume(task, shm, NULL))
+			ftrace_shm_wait(shm, NULL);
+		if (!proc_pid_exist(task->pid))
+			break;
+		if (count && nsecs() >= next) {
+			ftrace_count_show(task, shm, false);
+			next += interval;
+		}
+		/* Disarm the sites of functions called since last time */
+		if (cover_mode && nsecs() >= next) {
+			if (ftrace_cover_write(task, shm, sites,
+					       COVER_DISARMED, true))
+				ulp_warning("Disarm the coverage sites failed, "
+					    "retry later.\n");
+			next = nsecs() + interval;
+		}
+		/* No probe is measured in coverage mode */
+		if (!cover_mode && nsecs() >= check) {
+			if (shm->calibrated)
+				ftrace_overhead_check(shm);
+			else
+				ftrace_overhead_calibrate(shm);
+			check = nsecs() +
+				ULFTRACE_OVERHEAD_INTERVAL_MS * 1000000UL;
+		}
+	}
+
+	if (shm->nr_consumers)
+		ftrace_consumers_stop(shm, shm->nr_consumers);
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+}
+
+struct report_sym {
+	unsigned long addr;
+	const char *name;
+};
+
+struct report_module {
+	struct trace_module m;
+	const char *path;
+	struct bfd_elf_file *file;
+	bool loaded;
+	struct report_sym *syms;
+	unsigned int nr_syms;
+};
+
+struct report_ip {
+	const char *name;
+	unsigned long off;
+};
+
+static int cmp_report_sym(const void *a, const void *b)
+{
+	const struct report_sym *sa = a, *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Open the ELF file of module if not yet, the symbols come from the on-disk
+ * symbol cache if it is enabled, see bfd_elf_open().
+ */
+static void report_load_module(struct report_module *mod)
+{
+	uint8_t bid[ULFTRACE_TRACE_BID_SIZE];
+	struct bfd_sym *bsym;
+	unsigned int n = 0;
+	int len;
+
+	if (mod->loaded)
+		return;
+	mod->loaded = true;
+
+	/* Such as [vdso], no file to open */
+	if (mod->path[0] != '/')
+		return;
+
+	if (mod->m.build_id_len) {
+		len = elf_read_build_id(mod->path, bid, sizeof(bid));
+		if (len != mod->m.build_id_len ||
+		    memcmp(bid, mod->m.build_id, len)) {
+			ulp_warning("%s: build id mismatch, skip it.\n",
+				    mod->path);
+			return;
+		}
+	}
+
+	mod->file = bfd_elf_open(mod->path);
+	if (!mod->file) {
+		ulp_warning("open %s failed.\n", mod->path);
+		return;
+	}
+
+	for (bsym = bfd_next_text_sym(mod->file, NULL); bsym;
+	     bsym = bfd_next_text_sym(mod->file, bsym))
+		n++;
+
+	mod->syms = malloc(sizeof(*mod->syms) * (n ?: 1));
+	if (!mod->syms)
+		return;
+
+	for (bsym = bfd_next_text_sym(mod->file, NULL);
+	     bsym && mod->nr_syms < n;
+	     bsym = bfd_next_text_sym(mod->file, bsym)) {
+		mod->syms[mod->nr_syms].addr = bfd_sym_addr(bsym);
+		mod->syms[mod->nr_syms].name = bfd_sym_name(bsym);
+		mod->nr_syms++;
+	}
+	qsort(mod->syms, mod->nr_syms, sizeof(*mod->syms), cmp_report_sym);
+}
+
+/* The last symbol at or below ip, or the basename of module */
+static void report_symbolize(struct report_module *mods, unsigned int nr,
+			     uint64_t ip, struct report_ip *rip)
+{
+	struct report_module *mod = NULL;
+	unsigned long addr;
+	int lo = 0, hi, mid;
+	const char *base;
+
+	rip->name = "??";
+	rip->off = 0;
+
+	hi = (int)nr - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ip < mods[mid].m.start)
+			hi = mid - 1;
+		else if (ip >= mods[mid].m.end)
+			lo = mid + 1;
+		else {
+			mod = &mods[mid];
+			break;
+		}
+	}
+	if (!mod)
+		return;
+
+	report_load_module(mod);
+
+	addr = ip - mod->m.load_addr;
+	lo = 0;
+	hi = (int)mod->nr_syms - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mod->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	if (hi >= 0) {
+		rip->name = mod->syms[hi].name;
+		rip->off = addr - mod->syms[hi].addr;
+		return;
+	}
+
+	base = strrchr(mod->path, '/');
+	rip->name = base ? base + 1 : mod->path;
+	rip->off = ip - mod->m.start;
+}
+
+typedef int (*report_event_fn)(void *arg, unsigned int ring, uint32_t tid,
+			       uint64_t ns, uint32_t child, uint32_t parent,
+			       const uint8_t *args, size_t len);
+
+/* Decode the records, call @fn for each event */
+static int report_records(const uint8_t *p, const uint8_t *end,
+			  const struct trace_hdr *hdr, report_event_fn fn,
+			  void *arg)
+{
+	uint64_t last_ns[ULP_FTRACE_MAX_RINGS];
+	uint32_t last_tid[ULP_FTRACE_MAX_RINGS] = {};
+	const uint8_t *args[ULP_FTRACE_MAX_RINGS] = {};
+	uint64_t len[ULP_FTRACE_MAX_RINGS] = {};
+	uint64_t delta, child, parent, tid;
+	unsigned long nr = 0;
+	unsigned int type, ring;
+	int i, ret;
+
+	for (i = 0; i < ULP_FTRACE_MAX_RINGS; i++)
+		last_ns[i] = hdr->start_ns;
+
+	while (p < end) {
+		type = *p >> TRACE_REC_TYPE_SHIFT;
+		ring = *p++ & TRACE_REC_RING_MASK;
+
+		switch (type) {
+		case TRACE_REC_TID:
+			if (get_varint(&p, end, &tid))
+				return -EINVAL;
+			last_tid[ring] = tid;
+			break;
+		case TRACE_REC_ARGS:
+			if (get_varint(&p, end, &len[ring]) ||
+			    len[ring] > end - p)
+				return -EINVAL;
+			args[ring] = p;
+			p += len[ring];
+			break;
+		case TRACE_REC_EVENT:
+			if (get_varint(&p, end, &delta) ||
+			    get_varint(&p, end, &child) ||
+			    get_varint(&p, end, &parent) ||
+			    child >= hdr->nr_ips || parent >= hdr->nr_ips)
+				return -EINVAL;
+			last_ns[ring] += unzigzag(delta);
+			ret = fn(arg, ring, last_tid[ring], last_ns[ring],
+				 child, parent, args[ring], len[ring]);
+			if (ret)
+				return ret;
+			len[ring] = 0;
+			nr++;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if (nr != hdr->nr_events)
+		ulp_warning("%lu events decoded, %lu expected.\n", nr,
+			    (unsigned long)hdr->nr_events);
+	return 0;
+}
+
+/* Print the event the same as print_event() */
+static int report_print_event(void *arg, unsigned int ring, uint32_t tid,
+			      uint64_t ns, uint32_t child, uint32_t parent,
+			      const uint8_t *args, size_t len)
+{
+	const struct report_ip *rips = arg;
+	char abuf[ULFTRACE_ARGS_STR_SIZE];
+
+	if (len && format_args(abuf, sizeof(abuf), args, len) < 0)
+		strcpy(abuf, "??");
+
+	printf("%lu.%09lu %6u %s+%#lx <- %s+%#lx%s%s%s\n",
+	       (unsigned long)(ns / 1000000000UL),
+	       (unsigned long)(ns % 1000000000UL), tid,
+	       rips[child].name, rips[child].off,
+	       rips[parent].name, rips[parent].off,
+	       len ? " (" : "", len ? abuf : "", len ? ")" : "");
+	return 0;
+}
+
+/**
+ * CTF 1.8 export of --report --ctf, one stream file of one packet for each
+ * ring, the timestamps of one ring are monotonic, and the stream of module
+ * statedump. The event names and fields follow the LTTng-UST ones, thus the
+ * function entry and the module analyses of Trace Compass and LTTng tools
+ * work, the addresses are symbolized by them with bin_info and build_id.
+ *
+ * [0] https://diamon.org/ctf/v1.8.3/
+ * [1] https://lttng.org/man/3/lttng-ust-cyg-profile/
+ */
+#define CTF_MAGIC		0xC1FC1FC1U
+#define CTF_STREAM_STATEDUMP	ULP_FTRACE_MAX_RINGS
+
+enum ctf_event_id {
+	CTF_EVENT_BIN_INFO,
+	CTF_EVENT_BUILD_ID,
+	CTF_EVENT_FUNC_ENTRY,
+};
+
+struct ctf_packet {
+	/* trace.packet.header */
+	uint32_t magic;
+	uint32_t stream_id;
+	/* stream.packet.context */
+	uint64_t timestamp_begin;
+	uint64_t timestamp_end;
+	/* In bits */
+	uint64_t content_size;
+	uint64_t packet_size;
+} __packed;
+
+struct ctf_event_hdr {
+	/* stream.event.header */
+	uint32_t id;
+	uint64_t timestamp;
+	/* stream.event.context */
+	int32_t vtid;
+} __packed;
+
+struct ctf_stream {
+	FILE *fp;
+	struct ctf_packet packet;
+};
+
+struct ctf_writer {
+	const char *dir;
+	const uint64_t *ips;
+	struct ctf_stream streams[CTF_STREAM_STATEDUMP + 1];
+	int err;
+};
+
+static const char ctf_metadata[] =
+"/* CTF 1.8 */\n"
+"\n"
+"typealias integer { size = 8; align = 8; signed = false; } := uint8_t;\n"
+"typealias integer { size = 32; align = 8; signed = false; } := uint32_t;\n"
+"typealias integer { size = 32; align = 8; signed = true; } := int32_t;\n"
+"typealias integer { size = 64; align = 8; signed = false; } := uint64_t;\n"
+"typealias integer { size = 64; align = 8; signed = false; base = 16; }"
+" := uint64_x_t;\n"
+"\n"
+"trace {\n"
+"\tmajor = 1;\n"
+"\tminor = 8;\n"
+"\tbyte_order = %s;\n"
+"\tpacket.header := struct {\n"
+"\t\tuint32_t magic;\n"
+"\t\tuint32_t stream_id;\n"
+"\t};\n"
+"};\n"
+"\n"
+"env {\n"
+"\tdomain = \"ust\";\n"
+"\ttracer_name = \"ulftrace\";\n"
+"\tvpid = %d;\n"
+"};\n"
+"\n"
+"clock {\n"
+"\tname = \"monotonic\";\n"
+"\tdescription = \"CLOCK_MONOTONIC\";\n"
+"\tfreq = 1000000000;\n"
+"\toffset = 0;\n"
+"};\n"
+"\n"
+"typealias integer {\n"
+"\tsize = 64; align = 8; signed = false;\n"
+"\tmap = clock.monotonic.value;\n"
+"} := uint64_clock_monotonic_t;\n"
+"\n"
+"stream {\n"
+"\tid = 0;\n"
+"\tpacket.context := struct {\n"
+"\t\tuint64_clock_monotonic_t timestamp_begin;\n"
+"\t\tuint64_clock_monotonic_t timestamp_end;\n"
+"\t\tuint64_t content_size;\n"
+"\t\tuint64_t packet_size;\n"
+"\t};\n"
+"\tevent.header := struct {\n"
+"\t\tuint32_t id;\n"
+"\t\tuint64_clock_monotonic_t timestamp;\n"
+"\t};\n"
+"\tevent.context := struct {\n"
+"\t\tint32_t _vtid;\n"
+"\t};\n"
+"};\n"
+"\n"
+"event {\n"
+"\tname = \"lttng_ust_statedump:bin_info\";\n"
+"\tid = 0;\n"
+"\tstream_id = 0;\n"
+"\tfields := struct {\n"
+"\t\tuint64_x_t _baddr;\n"
+"\t\tuint64_t _memsz;\n"
+"\t\tstring _path;\n"
+"\t\tuint8_t _is_pic;\n"
+"\t\tuint8_t _has_build_id;\n"
+"\t};\n"
+"};\n"
+"\n"
+"event {\n"
+"\tname = \"lttng_ust_statedump:build_id\";\n"
+"\tid = 1;\n"
+"\tstream_id = 0;\n"
+"\tfields := struct {\n"
+"\t\tuint64_x_t _baddr;\n"
+"\t\tuint64_t __build_id_length;\n"
+"\t\tuint8_t _build_id[__build_id_length];\n"
+"\t};\n"
+"};\n"
+"\n"
+"event {\n"
+"\tname = \"lttng_ust_cyg_profile:func_entry\";\n"
+"\tid = 2;\n"
+"\tstream_id = 0;\n"
+"\tfields := struct {\n"
+"\t\tuint64_x_t _addr;\n"
+"\t\tuint64_x_t _call_site;\n"
+"\t};\n"
+"};\n";
+
+static int ctf_write_metadata(const char *dir, pid_t pid)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "%s/metadata", dir);
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (fprintf(fp, ctf_metadata, "le", pid) < 0)
+#else
+	if (fprintf(fp, ctf_metadata, "be", pid) < 0)
+#endif
+		ret = -EIO;
+	if (fclose(fp) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+/* Open the stream file and write the packet, rewritten at close */
+static struct ctf_stream *ctf_stream(struct ctf_writer *cw, unsigned int n)
+{
+	struct ctf_stream *s = &cw->streams[n];
+	char path[PATH_MAX];
+
+	if (s->fp)
+		return s;
+
+	if (n == CTF_STREAM_STATEDUMP)
+		snprintf(path, sizeof(path), "%s/statedump", cw->dir);
+	else
+		snprintf(path, sizeof(path), "%s/ring_%u", cw->dir, n);
+
+	s->fp = fopen(path, "w");
+	if (!s->fp) {
+		cw->err = -errno;
+		return NULL;
+	}
+
+	s->packet.magic = CTF_MAGIC;
+	s->packet.stream_id = 0;
+	s->packet.packet_size = sizeof(s->packet);
+	if (fwrite(&s->packet, sizeof(s->packet), 1, s->fp) != 1)
+		cw->err = -EIO;
+	return s;
+}
+
+static int ctf_write_event(struct ctf_writer *cw, unsigned int n,
+			   enum ctf_event_id id, uint64_t ns, uint32_t tid,
+			   const void *payload, size_t len)
+{
+	struct ctf_event_hdr eh = {
+		.id = id,
+		.timestamp = ns,
+		.vtid = tid,
+	};
+	struct ctf_stream *s;
+
+	s = ctf_stream(cw, n);
+	if (!s)
+		return cw->err;
+
+	if (s->packet.packet_size == sizeof(s->packet))
+		s->packet.timestamp_begin = ns;
+	s->packet.timestamp_end = ns;
+
+	if (fwrite(&eh, sizeof(eh), 1, s->fp) != 1 ||
+	    fwrite(payload, len, 1, s->fp) != 1)
+		return cw->err = -EIO;
+	s->packet.packet_size += sizeof(eh) + len;
+	return 0;
+}
+
+/* The bin_info and build_id of modules, at start of trace */
+static int ctf_write_statedump(struct ctf_writer *cw,
+			       const struct trace_hdr *hdr,
+			       const struct report_module *mods)
+{
+	uint8_t buf[PATH_MAX + 64], *p;
+	const struct trace_module *m;
+	uint64_t v;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < hdr->nr_modules; i++) {
+		m = &mods[i].m;
+		if (m->path_len > PATH_MAX)
+			continue;
+
+		p = buf;
+		memcpy(p, &m->start, sizeof(m->start));
+		p += sizeof(m->start);
+		v = m->end - m->start;
+		memcpy(p, &v, sizeof(v));
+		p += sizeof(v);
+		memcpy(p, mods[i].path, m->path_len);
+		p += m->path_len;
+		*p++ = m->load_addr != 0;
+		*p++ = m->build_id_len != 0;
+
+		ret = ctf_write_event(cw, CTF_STREAM_STATEDUMP,
+				      CTF_EVENT_BIN_INFO, hdr->start_ns, 0,
+				      buf, p - buf);
+		if (ret || !m->build_id_len)
+			continue;
+
+		p = buf;
+		memcpy(p, &m->start, sizeof(m->start));
+		p += sizeof(m->start);
+		v = m->build_id_len;
+		memcpy(p, &v, sizeof(v));
+		p += sizeof(v);
+		memcpy(p, m->build_id, m->build_id_len);
+		p += m->build_id_len;
+
+		ctf_write_event(cw, CTF_STREAM_STATEDUMP, CTF_EVENT_BUILD_ID,
+				hdr->start_ns, 0, buf, p - buf);
+	}
+	return cw->err;
+}
+
+/* The captured arguments have no LTTng-UST field, not exported */
+static int ctf_func_entry(void *arg, unsigned int ring, uint32_t tid,
+			  uint64_t ns, uint32_t child, uint32_t parent,
+			  const uint8_t *args, size_t len)
+{
+	struct ctf_writer *cw = arg;
+	uint64_t payload[2] = { cw->ips[child], cw->ips[parent] };
+
+	return ctf_write_event(cw, ring, CTF_EVENT_FUNC_ENTRY, ns, tid,
+			       payload, sizeof(payload));
+}
+
+/* Rewrite the packet context with the final sizes, close all streams */
+static int ctf_close(struct ctf_writer *cw)
+{
+	struct ctf_stream *s;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cw->streams); i++) {
+		s = &cw->streams[i];
+		if (!s->fp)
+			continue;
+		s->packet.packet_size *= 8;
+		s->packet.content_size = s->packet.packet_size;
+		if (fseek(s->fp, 0, SEEK_SET) ||
+		    fwrite(&s->packet, sizeof(s->packet), 1, s->fp) != 1)
+			cw->err = cw->err ?: -EIO;
+		if (fclose(s->fp))
+			cw->err = cw->err ?: -errno;
+		s->fp = NULL;
+	}
+	return cw->err;
+}
+
+/* Convert the binary trace into CTF directory @dir */
+static int report_ctf(const char *dir, const struct trace_hdr *hdr,
+		      const struct report_module *mods, const uint64_t *ips,
+		      const uint8_t *p, const uint8_t *end)
+{
+	struct ctf_writer cw = {
+		.dir = dir,
+		.ips = ips,
+	};
+	int ret;
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -errno;
+
+	ret = ctf_write_metadata(dir, hdr->pid);
+	if (!ret)
+		ret = ctf_write_statedump(&cw, hdr, mods);
+	if (!ret)
+		ret = report_records(p, end, hdr, ctf_func_entry, &cw);
+	ret = ctf_close(&cw) ?: ret;
+	return ret;
+}
+
+/* Symbolize the binary trace offline or convert it, see trace_hdr */
+static int ulftrace_report(const char *path)
+{
+	struct report_module *mods = NULL;
+	struct report_ip *rips = NULL;
+	uint64_t *ips = NULL;
+	const struct trace_hdr *hdr;
+	const uint8_t *map, *p, *end;
+	struct mmap_struct *mem;
+	struct trace_hdr h = {};
+	size_t size;
+	unsigned int i;
+	int ret = 1;
+
+	mem = fmmap_rdonly(path);
+	if (!mem) {
+		fprintf(stderr, "mmap %s failed. %m\n", path);
+		return 1;
+	}
+	map = mem->mem;
+	size = mem->size;
+
+	hdr = (const void *)map;
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, ULFTRACE_TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    !hdr->version || hdr->version > ULFTRACE_TRACE_VERSION ||
+	    hdr->events_off > hdr->ips_off || hdr->ips_off > size ||
+	    (size - hdr->ips_off) / sizeof(uint64_t) < hdr->nr_ips) {
+		fprintf(stderr, "%s is not ulftrace binary trace.\n", path);
+		goto out;
+	}
+	h = *hdr;
+
+	mods = calloc(h.nr_modules ?: 1, sizeof(*mods));
+	rips = calloc(h.nr_ips ?: 1, sizeof(*rips));
+	ips = malloc(sizeof(*ips) * (h.nr_ips ?: 1));
+	if (!mods || !rips || !ips)
+		goto out;
+	/* The table may be unaligned */
+	memcpy(ips, map + h.ips_off, sizeof(*ips) * h.nr_ips);
+
+	p = map + sizeof(h);
+	end = map + h.events_off;
+	for (i = 0; i < h.nr_modules; i++) {
+		if (end - p < sizeof(mods[i].m))
+			goto corrupt;
+		memcpy(&mods[i].m, p, sizeof(mods[i].m));
+		p += sizeof(mods[i].m);
+		if (end - p < mods[i].m.path_len || !mods[i].m.path_len ||
+		    mods[i].m.build_id_len > ULFTRACE_TRACE_BID_SIZE ||
+		    p[mods[i].m.path_len - 1] != '\0')
+			goto corrupt;
+		mods[i].path = (const char *)p;
+		p += mods[i].m.path_len;
+	}
+
+	if (ctf_dir) {
+		ret = report_ctf(ctf_dir, &h, mods, ips, map + h.events_off,
+				 map + h.ips_off);
+		if (ret == -EINVAL)
+			goto corrupt;
+		if (ret) {
+			fprintf(stderr, "write CTF into %s failed, %s\n",
+				ctf_dir, strerror(-ret));
+			ret = 1;
+			goto out;
+		}
+		printf("%lu events of %s converted into %s\n",
+		       (unsigned long)h.nr_events, path, ctf_dir);
+		goto out;
+	}
+
+	printf("# pid %d, %lu events, %u ips, %u modules\n", h.pid,
+	       (unsigned long)h.nr_events, h.nr_ips, h.nr_modules);
+
+	/* Each ip is symbolized once */
+	for (i = 0; i < h.nr_ips; i++)
+		report_symbolize(mods, h.nr_modules, ips[i], &rips[i]);
+
+	if (report_records(map + h.events_off, map + h.ips_off, &h,
+			   report_print_event, rips))
+		goto corrupt;
+
+	ret = 0;
+	goto out;
+
+corrupt:
+	fprintf(stderr, "%s is corrupted.\n", path);
+	ret = 1;
+out:
+	for (i = 0; mods && i < h.nr_modules; i++) {
+		free(mods[i].syms);
+		if (mods[i].file)
+			bfd_elf_close(mods[i].file);
+	}
+	free(mods);
+	free(rips);
+	free(ips);
+	fmunmap(mem);
+	return ret;
+}
+
+int ulftrace(int argc, char *argv[])
+{
+	int ret = 0;
+	unsigned int n;
+	struct ftrace_sites sites = {};
+	struct ftrace_shm *shm = NULL;
+
+	COMMON_RESET_BEFORE_PARSE_ARGS(ulftrace_args_reset);
+
+	ret = parse_config(argc, argv);
+#if !defined(ULP_CMD_MAIN)
+	if (ret == CMD_RETURN_SUCCESS_VALUE)
+		return 0;
+#endif
+	if (ret)
+		return ret;
+
+	COMMON_IN_MAIN_AFTER_PARSE_ARGS();
+
+	ulpatch_init();
+
+	if (report_file)
+		return ulftrace_report(report_file);
+
+	target_task = open_task(target_pid, FTO_ULFTRACE);
+	if (!target_task) {
+		fprintf(stderr, "open %d failed. %m\n", target_pid);
+		return 1;
+	}
+
+	shm = calloc(1, sizeof(struct ftrace_shm));
+	if (!shm) {
+		ret = 1;
+		goto done;
+	}
+	shm->out = stdout;
+
+	ret = ftrace_shm_create(target_task, shm);
+	if (ret) {
+		fprintf(stderr, "create ftrace shared memory failed.\n");
+		ret = 1;
+		goto done;
+	}
+
+	ret = ftrace_shm_resolve(target_task, shm, &sites);
+	if (ret) {
+		fprintf(stderr, "couldn't found function to trace.\n");
+		errno = -ret;
+		ret = 1;
+		goto destroy;
+	}
+	ulp_info("Trace %u functions, %u NOP sites, %u without mcount site.\n",
+		 sites.nr_funcs, sites.nr_nops, sites.nr_skipped);
+
+	shm->mem->watermark = watermark;
+	shm->mem->sample = sample;
+	memcpy(shm->mem->preds, preds, sizeof(preds[0]) * nr_preds);
+	shm->mem->nr_preds = nr_preds;
+	memcpy(shm->mem->tids, tids, sizeof(tids[0]) * nr_tids);
+	shm->mem->nr_tids = nr_tids;
+	if (count) {
+		shm->last_calls = calloc(shm->mem->nr_filters ?: 1,
+					 sizeof(*shm->last_calls));
+		if (!shm->last_calls) {
+			ret = 1;
+			goto destroy;
+		}
+		shm->mem->flags = ULP_FTRACE_F_COUNT;
+	} else if (stack_mode)
+		shm->mem->flags = ULP_FTRACE_F_STACK;
+	else if (cover_mode)
+		shm->mem->flags = ULP_FTRACE_F_COVER;
+	else
+		shm->mem->flags = ULP_FTRACE_F_EVENTS;
+	if (graph)
+		shm->mem->flags |= ULP_FTRACE_F_GRAPH;
+	/* Calibrate at start, see ftrace_overhead_calibrate() */
+	if (!cover_mode)
+		shm->mem->flags |= ULP_FTRACE_F_MEASURE;
+
+	ret = init_patch(target_task, patch_object_file);
+	if (ret) {
+		fprintf(stderr, "patch %s failed.\n", patch_object_file);
+		ret = 1;
+		goto destroy;
+	}
+
+	if (ftrace_shm_publish(target_task, shm->remote)) {
+		ret = 1;
+		goto unpatch;
+	}
+
+	if (output_file) {
+		ret = trace_open(shm, target_task, output_file);
+		if (ret) {
+			fprintf(stderr, "open %s failed, %s\n", output_file,
+				strerror(-ret));
+			ret = 1;
+			goto unpublish;
+		}
+	}
+
+	if (ftrace_sites_enable(target_task, &sites, true)) {
+		fprintf(stderr, "enable the NOP mcount sites failed.\n");
+		ret = 1;
+		goto unpublish;
+	}
+	if (cover_mode && ftrace_cover_arm(target_task, shm, &sites)) {
+		fprintf(stderr, "arm the coverage sites failed.\n");
+		ret = 1;
+		goto unpublish;
+	}
+
+	ftrace_loop(target_task, shm, &sites);
+
+	/* Stop producers first, then drain the events left */
+	__atomic_store_n(&shm->mem->flags, 0, __ATOMIC_SEQ_CST);
+
+	/**
+	 * The enabled NOP sites and the hooked returns jump into the ftrace
+	 * object, keep the patch and the shared memory in target if any of
+	 * them is left.
+	 */
+	if (ftrace_sites_enable(target_task, &sites, false)) {
+		ulp_warning("%u NOP sites are still enabled, keep the ftrace "
+			    "object in %d.\n", sites.nr_nops, target_pid);
+		goto keep;
+	}
+	if (cover_mode &&
+	    ftrace_cover_write(target_task, shm, &sites, COVER_ORIG, false)) {
+		ulp_warning("The coverage sites are not restored, keep the "
+			    "ftrace object in %d.\n", target_pid);
+		goto keep;
+	}
+	if (graph && (n = ftrace_graph_quiesce(target_task, shm))) {
+		ulp_warning("%u threads are still in traced functions, keep "
+			    "the ftrace object in %d.\n", n, target_pid);
+		goto keep;
+	}
+
+unpublish:
+	ftrace_shm_publish(target_task, 0);
+unpatch:
+	delete_patch(target_task);
+	ftrace_shm_summary_all(target_task, shm);
+destroy:
+	ftrace_shm_destroy(target_task, shm);
+	goto done;
+
+keep:
+	ftrace_shm_summary_all(target_task, shm);
+	munmap(shm->mem, shm->size);
+	ret = 1;
+done:
+	free(sites.nops);
+	free(sites.covers);
+	if (shm)
+		free(shm->last_calls);
+	free(shm);
+	close_task(target_task);
+
+	return ret;
+}
+
+#if defined(ULP_CMD_MAIN)
+int main(int argc, char *argv[])
+{
+	/* Only one task, closed before exit */
+	close_task_fast_enable(true);
+
 	return ulftrace(argc, argv);
 }
 #endif
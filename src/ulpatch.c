@@ -6,6 +6,9 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
 
 #include <elf/elf-api.h>
 
@@ -16,6 +19,7 @@
 #include <utils/compiler.h>
 #include <task/task.h>
 #include <utils/cmds.h>
+#include <utils/ulpatchd.h>
 
 #include <args-common.c>
 
@@ -24,29 +28,96 @@ enum command {
 	CMD_NONE,
 	CMD_PATCH,
 	CMD_UNPATCH,
+	CMD_UPDATE,
 } command_type = CMD_NONE;
 
 
-static pid_t target_pid = -1;
-static struct task_struct *target_task = NULL;
+/* At most target processes of one command */
+#define ULPATCH_MAX_PIDS	1024
+/* At most patches of one unpatch command */
+#define ULPATCH_MAX_UNPATCH	64
+/* Default number of processes patched concurrently */
+#define ULPATCH_DEFAULT_JOBS	4
+/* Default window of canary in seconds, and the interval of samples */
+#define ULPATCH_CANARY_WINDOW	10
+#define ULPATCH_CANARY_INTERVAL_MS	100
+/* Default regression of canary p99 in percent to roll back */
+#define ULPATCH_CANARY_THRESHOLD	10
+
+static pid_t target_pids[ULPATCH_MAX_PIDS];
+static int nr_target_pids = 0;
+static int max_jobs = ULPATCH_DEFAULT_JOBS;
 static char *patch_file = NULL;
 
+/* Patch the percent of processes first, see command_canary() */
+static int canary_pct = 0;
+static int canary_window = ULPATCH_CANARY_WINDOW;
+static int canary_threshold = ULPATCH_CANARY_THRESHOLD;
+
+/* Unpatch these patches, or the latest one if none of them is specified */
+static unsigned int unpatch_ids[ULPATCH_MAX_UNPATCH];
+static int nr_unpatch_ids = 0;
+static char *unpatch_build_ids[ULPATCH_MAX_UNPATCH];
+static int nr_unpatch_build_ids = 0;
+static bool unpatch_all = false;
+
+/* Replace this patch, or the latest one if 0 */
+static unsigned int update_id = 0;
+
+/* Print per-phase cost of every target process, see patch_phase_stats */
+enum stats_format {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
+};
+static enum stats_format stats_format = STATS_NONE;
+
 enum {
 	ARG_MIN = ARG_COMMON_MAX,
 	ARG_PATCH,
 	ARG_UNPATCH,
+	ARG_UNPATCH_ID,
+	ARG_UNPATCH_BUILD_ID,
+	ARG_UNPATCH_ALL,
+	ARG_UPDATE,
+	ARG_UPDATE_ID,
 	ARG_MAP_PFX,
+	ARG_PGREP,
+	ARG_POOL,
+	ARG_COUNTER,
+	ARG_SHARE,
+	ARG_PERF_MAP,
+	ARG_VENEER,
+	ARG_QUIESCE,
+	ARG_MODE,
+	ARG_STATS,
+	ARG_CANARY,
+	ARG_CANARY_WINDOW,
+	ARG_CANARY_THRESHOLD,
 };
 
 static const char *prog_name = "ulpatch";
 
-int check_patch_file(const char *file);
-
 static void ulpatch_args_reset(void)
 {
-	target_pid = -1;
-	target_task = NULL;
+	patch_pool_enable(false);
+	patch_counter_enable(false);
+	patch_share_enable(false);
+	patch_perf_map_enable(false);
+	patch_veneer_enable(false);
+	patch_quiesce_enable(false);
+	patch_set_mode(PATCH_MODE_JMP);
+	nr_target_pids = 0;
+	max_jobs = ULPATCH_DEFAULT_JOBS;
 	patch_file = NULL;
+	canary_pct = 0;
+	canary_window = ULPATCH_CANARY_WINDOW;
+	canary_threshold = ULPATCH_CANARY_THRESHOLD;
+	nr_unpatch_ids = 0;
+	nr_unpatch_build_ids = 0;
+	unpatch_all = false;
+	update_id = 0;
+	stats_format = STATS_NONE;
 }
 
 static int print_help(void)
@@ -61,33 +132,223 @@ static int print_help(void)
 	"\n"
 	" Option argument:\n"
 	"\n"
-	"  -p, --pid [PID]     specify a process identifier(pid_t)\n"
+	"  -p, --pid [PID,...] specify process identifiers(pid_t), separated by\n"
+	"                      comma.\n"
+	"  --pgrep [NAME]      patch all processes whose comm is NAME.\n"
+	"  -j, --jobs [NUM]    patch at most NUM processes concurrently, the\n"
+	"                      other processes keep running, default %d.\n"
+	"  --canary [PCT%%]     patch PCT percent of processes of --patch\n"
+	"                      first, compare the p99 CPU time of patched and\n"
+	"                      unpatched ones in a window, then patch the\n"
+	"                      others, or unpatch the canaries if regressed.\n"
+	"  --canary-window [SEC]\n"
+	"                      window of --canary, default %d seconds.\n"
+	"  --canary-threshold [PCT%%]\n"
+	"                      roll back if the p99 of canaries regresses by\n"
+	"                      more than PCT percent, default %d%%.\n"
 	"\n"
 	" Operate argument:\n"
 	"\n"
 	"  --patch  [PATCH]    patch an object file into target task, and patch\n"
 	"                      the patch.\n"
 	"  --unpatch           unpatch the latest ulpatch from target task.\n"
+	"  --unpatch-id [ID,...]\n"
+	"                      unpatch the ulpatches of ID, separated by comma,\n"
+	"                      see ulpinfo(8).\n"
+	"  --unpatch-build-id [BUILDID,...]\n"
+	"                      unpatch the ulpatches of Build ID, separated by\n"
+	"                      comma.\n"
+	"  --unpatch-all       unpatch all ulpatches from target task.\n"
+	"                      All ulpatches of one command are unpatched in one\n"
+	"                      stop of target task.\n"
+	"  --update [PATCH]    replace the latest ulpatch by PATCH, such as\n"
+	"                      upgrade it to a new version, the function of\n"
+	"                      both of them is switched by replacing only the\n"
+	"                      address of the jmp table or GOT slot.\n"
+	"  --update-id [ID]    replace the ulpatch of ID by --update.\n"
+	"  --pool              load the small patch into the shared patch pool\n"
+	"                      VMA, instead of mapping a new VMA for it.\n"
+	"  --counter           count the calls of every patched function by a\n"
+	"                      trampoline in the patch, see ulpinfo --stats.\n"
+	"  --share             map the identical relocated patch of different\n"
+	"                      processes from one file, the page cache is\n"
+	"                      spent once for each unique patch image.\n"
+	"  --perf-map          append the functions of patch into\n"
+	"                      /tmp/perf-PID.map, thus perf symbolizes them,\n"
+	"                      the lines are removed after unpatched.\n"
+	"  --veneer            jump to the far patch through a veneer near the\n"
+	"                      target function, only one direct jump is\n"
+	"                      written to the entry, instead of jmp table.\n"
+	"  --quiesce           park the threads of target by an injected\n"
+	"                      signal handler while rewriting the functions,\n"
+	"                      instead of ptrace stop of all threads, fall\n"
+	"                      back to ptrace stop if impossible.\n"
+	"  --mode [MODE]       how to redirect the target functions, MODE is\n"
+	"                      'jmp' or 'got', default 'jmp'.\n"
+	"                      jmp: rewrite the entry of target function.\n"
+	"                      got: write the GOT slot of main executable, only\n"
+	"                      the calls of it through PLT/GOT are redirected,\n"
+	"                      no text is modified.\n"
+	"  -u, --dry-run       resolve symbols, relocate the patch and search\n"
+	"                      the address of patch on host, display the\n"
+	"                      predicted remote syscalls, bytes written, VMAs\n"
+	"                      created and stop windows, target task is never\n"
+	"                      touched.\n"
 	"\n"
 	" Display argument:\n"
 	"\n"
 	"  --map-pfx           display /proc/PID/maps prefix: '%s'.\n"
+	"  --stats[=FORMAT]    display the cost of every phase of patch or\n"
+	"                      unpatch, and the stop window of target task,\n"
+	"                      FORMAT is 'text'(default) or 'json', one JSON\n"
+	"                      record per line for each process.\n"
 	"\n",
+	ULPATCH_DEFAULT_JOBS, ULPATCH_CANARY_WINDOW, ULPATCH_CANARY_THRESHOLD,
 	PATCH_VMA_TEMP_PREFIX);
 	print_usage_common(prog_name);
 	cmd_exit_success();
 	return 0;
 }
 
+static int add_target_pid(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nr_target_pids; i++)
+		if (target_pids[i] == pid)
+			return 0;
+
+	if (nr_target_pids >= ULPATCH_MAX_PIDS) {
+		fprintf(stderr, "Too many pids, at most %d.\n",
+			ULPATCH_MAX_PIDS);
+		return -E2BIG;
+	}
+
+	target_pids[nr_target_pids++] = pid;
+	return 0;
+}
+
+static int parse_pids(const char *str)
+{
+	char *dup, *tok, *saveptr = NULL;
+	int ret = 0;
+
+	dup = strdup(str);
+	for (tok = strtok_r(dup, ",", &saveptr); tok && !ret;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		pid_t pid = atoi(tok);
+		if (pid <= 0) {
+			fprintf(stderr, "Invalid pid %s.\n", tok);
+			ret = -EINVAL;
+			break;
+		}
+		ret = add_target_pid(pid);
+	}
+	free(dup);
+	return ret;
+}
+
+static int parse_unpatch_ids(const char *str)
+{
+	char *dup, *tok, *saveptr = NULL;
+	int ret = 0;
+
+	dup = strdup(str);
+	for (tok = strtok_r(dup, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		int id = atoi(tok);
+		if (id <= 0) {
+			fprintf(stderr, "Invalid ulpatch ID %s.\n", tok);
+			ret = -EINVAL;
+			break;
+		}
+		if (nr_unpatch_ids >= ULPATCH_MAX_UNPATCH) {
+			fprintf(stderr, "Too many IDs, at most %d.\n",
+				ULPATCH_MAX_UNPATCH);
+			ret = -E2BIG;
+			break;
+		}
+		unpatch_ids[nr_unpatch_ids++] = id;
+	}
+	free(dup);
+	return ret;
+}
+
+static int parse_unpatch_build_ids(const char *str)
+{
+	char *dup, *tok, *saveptr = NULL;
+	int ret = 0;
+
+	dup = strdup(str);
+	for (tok = strtok_r(dup, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (nr_unpatch_build_ids >= ULPATCH_MAX_UNPATCH) {
+			fprintf(stderr, "Too many Build IDs, at most %d.\n",
+				ULPATCH_MAX_UNPATCH);
+			ret = -E2BIG;
+			break;
+		}
+		unpatch_build_ids[nr_unpatch_build_ids++] = strdup(tok);
+	}
+	free(dup);
+	return ret;
+}
+
+static int parse_pgrep(const char *comm)
+{
+	pid_t pids[ULPATCH_MAX_PIDS];
+	int i, n, ret = 0;
+
+	n = proc_pgrep(comm, pids, ULPATCH_MAX_PIDS);
+	if (n <= 0) {
+		fprintf(stderr, "No process named %s.\n", comm);
+		return -ESRCH;
+	}
+
+	for (i = 0; i < n && !ret; i++)
+		ret = add_target_pid(pids[i]);
+	return ret;
+}
+
+/* Percent like 10% or 10, return -EINVAL if not in [1, 100] */
+static int parse_pct(const char *str)
+{
+	char *end;
+	long pct;
+
+	pct = strtol(str, &end, 10);
+	if (end == str || (*end && strcmp(end, "%")) || pct < 1 || pct > 100)
+		return -EINVAL;
+	return pct;
+}
+
 static int parse_config(int argc, char *argv[])
 {
-	int ret;
+	int ret, i;
 
 	struct option options[] = {
 		{ "pid",            required_argument, 0, 'p' },
+		{ "pgrep",          required_argument, 0, ARG_PGREP },
+		{ "jobs",           required_argument, 0, 'j' },
 		{ "patch",          required_argument, 0, ARG_PATCH },
 		{ "unpatch",        no_argument,       0, ARG_UNPATCH },
+		{ "unpatch-id",     required_argument, 0, ARG_UNPATCH_ID },
+		{ "unpatch-build-id", required_argument, 0, ARG_UNPATCH_BUILD_ID },
+		{ "unpatch-all",    no_argument,       0, ARG_UNPATCH_ALL },
+		{ "update",         required_argument, 0, ARG_UPDATE },
+		{ "update-id",      required_argument, 0, ARG_UPDATE_ID },
 		{ "map-pfx",        no_argument,       0, ARG_MAP_PFX },
+		{ "pool",           no_argument,       0, ARG_POOL },
+		{ "counter",        no_argument,       0, ARG_COUNTER },
+		{ "share",          no_argument,       0, ARG_SHARE },
+		{ "perf-map",       no_argument,       0, ARG_PERF_MAP },
+		{ "veneer",         no_argument,       0, ARG_VENEER },
+		{ "quiesce",        no_argument,       0, ARG_QUIESCE },
+		{ "mode",           required_argument, 0, ARG_MODE },
+		{ "stats",          optional_argument, 0, ARG_STATS },
+		{ "canary",         required_argument, 0, ARG_CANARY },
+		{ "canary-window",  required_argument, 0, ARG_CANARY_WINDOW },
+		{ "canary-threshold", required_argument, 0, ARG_CANARY_THRESHOLD },
 		COMMON_OPTIONS
 		{ NULL }
 	};
@@ -95,14 +356,26 @@ static int parse_config(int argc, char *argv[])
 	while (1) {
 		int c;
 		int option_index = 0;
-		c = getopt_long(argc, argv, "p:"COMMON_GETOPT_OPTSTRING,
+		c = getopt_long(argc, argv, "p:j:"COMMON_GETOPT_OPTSTRING,
 				options, &option_index);
 		if (c < 0)
 			break;
 
 		switch (c) {
 		case 'p':
-			target_pid = atoi(optarg);
+			if (parse_pids(optarg))
+				cmd_exit(1);
+			break;
+		case ARG_PGREP:
+			if (parse_pgrep(optarg))
+				cmd_exit(1);
+			break;
+		case 'j':
+			max_jobs = atoi(optarg);
+			if (max_jobs <= 0) {
+				fprintf(stderr, "Invalid jobs %s.\n", optarg);
+				cmd_exit(1);
+			}
 			break;
 		case ARG_PATCH:
 			command_type = CMD_PATCH;
@@ -111,6 +384,91 @@ static int parse_config(int argc, char *argv[])
 		case ARG_UNPATCH:
 			command_type = CMD_UNPATCH;
 			break;
+		case ARG_UNPATCH_ID:
+			command_type = CMD_UNPATCH;
+			if (parse_unpatch_ids(optarg))
+				cmd_exit(1);
+			break;
+		case ARG_UNPATCH_BUILD_ID:
+			command_type = CMD_UNPATCH;
+			if (parse_unpatch_build_ids(optarg))
+				cmd_exit(1);
+			break;
+		case ARG_UNPATCH_ALL:
+			command_type = CMD_UNPATCH;
+			unpatch_all = true;
+			break;
+		case ARG_UPDATE:
+			command_type = CMD_UPDATE;
+			patch_file = strdup(optarg);
+			break;
+		case ARG_UPDATE_ID:
+			if (atoi(optarg) <= 0) {
+				fprintf(stderr, "Invalid ulpatch ID %s.\n",
+					optarg);
+				cmd_exit(1);
+			}
+			update_id = atoi(optarg);
+			break;
+		case ARG_POOL:
+			patch_pool_enable(true);
+			break;
+		case ARG_COUNTER:
+			patch_counter_enable(true);
+			break;
+		case ARG_SHARE:
+			patch_share_enable(true);
+			break;
+		case ARG_PERF_MAP:
+			patch_perf_map_enable(true);
+			break;
+		case ARG_VENEER:
+			patch_veneer_enable(true);
+			break;
+		case ARG_QUIESCE:
+			patch_quiesce_enable(true);
+			break;
+		case ARG_MODE:
+			ret = patch_mode_parse(optarg);
+			if (ret < 0) {
+				fprintf(stderr, "Invalid mode %s.\n", optarg);
+				cmd_exit(1);
+			}
+			patch_set_mode(ret);
+			break;
+		case ARG_STATS:
+			if (!optarg || !strcmp(optarg, "text"))
+				stats_format = STATS_TEXT;
+			else if (!strcmp(optarg, "json"))
+				stats_format = STATS_JSON;
+			else {
+				fprintf(stderr, "Invalid stats format %s.\n",
+					optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_CANARY:
+			canary_pct = parse_pct(optarg);
+			if (canary_pct < 0) {
+				fprintf(stderr, "Invalid canary %s.\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_CANARY_WINDOW:
+			canary_window = atoi(optarg);
+			if (canary_window <= 0) {
+				fprintf(stderr, "Invalid window %s.\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_CANARY_THRESHOLD:
+			canary_threshold = parse_pct(optarg);
+			if (canary_threshold < 0) {
+				fprintf(stderr, "Invalid threshold %s.\n",
+					optarg);
+				cmd_exit(1);
+			}
+			break;
 		case ARG_MAP_PFX:
 			printf("%s\n", PATCH_VMA_TEMP_PREFIX);
 			cmd_exit_success();
@@ -128,18 +486,27 @@ static int parse_config(int argc, char *argv[])
 		cmd_exit(1);
 	}
 
-	if (target_pid == -1) {
-		fprintf(stderr, "Specify pid with -p, --pid.\n");
+	if (nr_target_pids == 0) {
+		fprintf(stderr, "Specify pid with -p, --pid or --pgrep.\n");
 		cmd_exit(1);
 	}
 
-	if (!proc_pid_exist(target_pid)) {
-		fprintf(stderr, "pid %d not exist.\n", target_pid);
+	for (i = 0; i < nr_target_pids; i++) {
+		if (!proc_pid_exist(target_pids[i])) {
+			fprintf(stderr, "pid %d not exist.\n", target_pids[i]);
+			cmd_exit(1);
+		}
+	}
+
+	if (canary_pct && (command_type != CMD_PATCH ||
+			   nr_target_pids < 2 || is_dry_run())) {
+		fprintf(stderr,
+			"--canary needs --patch and two pids at least.\n");
 		cmd_exit(1);
 	}
 
 	/* check patch file */
-	if (command_type == CMD_PATCH) {
+	if (command_type == CMD_PATCH || command_type == CMD_UPDATE) {
 		ret = check_patch_file(patch_file);
 		if (ret) {
 			fprintf(stderr, "Check %s failed.\n", patch_file);
@@ -150,49 +517,427 @@ static int parse_config(int argc, char *argv[])
 	return 0;
 }
 
-int check_patch_file(const char *file)
+/* Unpatch all specified patches of task in one stop */
+static int command_unpatch(struct task_struct *task)
 {
-	int err = 0;
-	struct load_info info = {0};
+	unsigned int ids[ULPATCH_MAX_UNPATCH * 2];
+	struct vma_ulp *ulp;
+	int i, nr = 0;
+
+	if (unpatch_all)
+		return delete_all_patches(task);
+
+	if (!nr_unpatch_ids && !nr_unpatch_build_ids)
+		return delete_patch(task);
 
-	if (!file)
-		return -EEXIST;
+	for (i = 0; i < nr_unpatch_ids; i++)
+		ids[nr++] = unpatch_ids[i];
 
-	if (file && !fexist(file)) {
-		ulp_debug("%s is not exist.\n", file);
-		return -EEXIST;
+	for (i = 0; i < nr_unpatch_build_ids; i++) {
+		ulp = find_ulp_by_build_id(task, unpatch_build_ids[i]);
+		if (!ulp) {
+			fprintf(stderr, "No ulpatch with Build ID %s in %d.\n",
+				unpatch_build_ids[i], task->pid);
+			return -ENOENT;
+		}
+		ids[nr++] = ulp->info.ulp_id;
 	}
-	err = alloc_patch_file(patch_file, "temp.ulp", &info);
-	if (err) {
-		ulp_error("Parse %s failed.\n", patch_file);
-		return err;
+
+	return delete_patches_by_id(task, ids, nr);
+}
+
+static void print_stats(void)
+{
+	struct patch_phase_stats stats;
+
+	patch_get_phase_stats(&stats);
+	print_patch_phase_stats(stdout, &stats, stats_format == STATS_JSON);
+	fflush(stdout);
+}
+
+/* Predict the cost of patch, target task is never touched */
+static int command_dry_run(struct task_struct *task)
+{
+	struct patch_estimate est;
+	int ret;
+
+	if (command_type == CMD_UNPATCH) {
+		printf("Dry run, skip unpatch %d.\n", task->pid);
+		return 0;
 	}
 
-	err = setup_load_info(&info);
-	if (err) {
-		ulp_debug("Load %s failed\n", file);
-		err = -ENODATA;
-		goto release;
+	ret = estimate_patch(task, patch_file, &est);
+	if (ret) {
+		fprintf(stderr, "Estimate %s for %d failed.\n", patch_file,
+			task->pid);
+		return ret;
 	}
 
-	if (strcmp(info.ulp_strtab.magic, SEC_ULPATCH_MAGIC)) {
-		ulp_debug("%s is not ulpatch file.\n", file);
-		err = -ENODATA;
+	print_patch_estimate(stdout, task->pid, &est,
+			     stats_format == STATS_JSON);
+	return 0;
+}
+
+static int command_task(struct task_struct *task)
+{
+	int ret;
+
+	if (is_dry_run()) {
+		ret = command_dry_run(task);
+		goto stats;
 	}
 
-release:
-	release_load_info(&info);
-	return err;
+	switch (command_type) {
+	case CMD_PATCH:
+		ret = init_patch(task, patch_file);
+		break;
+	case CMD_UNPATCH:
+		ret = command_unpatch(task);
+		break;
+	case CMD_UPDATE:
+		ret = update_patch(task, update_id, patch_file);
+		break;
+	case CMD_NONE:
+	default:
+		fprintf(stderr, "What to do.\n");
+		return -EINVAL;
+	}
+
+stats:
+	if (stats_format != STATS_NONE)
+		print_stats();
+	return ret;
 }
 
-static int command_patch(void)
+/**
+ * The child of patched parent has the patch already, only check it, the
+ * ELF files and symbols are never loaded. Return -ENOENT if not inherited.
+ */
+static int command_inherited(pid_t pid)
 {
-	return init_patch(target_task, patch_file);
+	int ret;
+
+	if (command_type != CMD_PATCH || is_dry_run())
+		return -ENOENT;
+
+	ret = check_inherited_patch(pid, patch_file);
+	if (ret != -ENOENT && stats_format != STATS_NONE)
+		print_stats();
+	return ret;
+}
+
+static int command_one(pid_t pid)
+{
+	int ret;
+	struct task_struct *task;
+
+	ret = command_inherited(pid);
+	if (ret != -ENOENT)
+		return ret;
+
+	task = open_task(pid, FTO_ULPATCH);
+	if (!task) {
+		fprintf(stderr, "open %d failed. %m\n", pid);
+		return -1;
+	}
+
+	ret = command_task(task);
+
+	close_task(task);
+	return ret;
 }
 
-static int command_unpatch(void)
+struct rollout {
+	pid_t pid;
+	/* the worker process, 0 if done in current process */
+	pid_t worker;
+	int ret;
+	unsigned long start_ns, end_ns;
+};
+
+/**
+ * Wait for one child, return 1 if it's one worker of @r, 0 if it's not,
+ * or negative errno, such as -ECHILD if no child left.
+ */
+static int rollout_reap(struct rollout *r, int nr)
 {
-	return delete_patch(target_task);
+	int i, status;
+	pid_t worker;
+
+	do {
+		worker = waitpid(-1, &status, 0);
+	} while (worker < 0 && errno == EINTR);
+	if (worker < 0)
+		return -errno;
+
+	for (i = 0; i < nr; i++) {
+		if (r[i].worker != worker)
+			continue;
+		r[i].end_ns = nsecs();
+		r[i].ret = WIFEXITED(status) ? -WEXITSTATUS(status) : -EINTR;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Patch many processes, the first one is patched in current process, which
+ * warms up the symbols and pre-linked patch caches, then the others are
+ * patched by forked workers that inherit the caches, at most @max_jobs
+ * workers run at the same time, thus at most @max_jobs target processes are
+ * stopped at the same time.
+ */
+static int command_rollout(const pid_t *pids, int nr)
+{
+	struct rollout *r;
+	int i, ret, running = 0, nr_failed = 0;
+
+	r = calloc(nr, sizeof(struct rollout));
+	if (!r)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		r[i].pid = pids[i];
+		r[i].start_ns = nsecs();
+
+		if (i == 0) {
+			r[i].ret = command_one(r[i].pid);
+			r[i].end_ns = nsecs();
+			continue;
+		}
+
+		while (running >= max_jobs) {
+			ret = rollout_reap(r, i);
+			if (ret < 0) {
+				running = 0;
+				break;
+			}
+			running -= ret;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+
+		r[i].worker = fork();
+		if (r[i].worker == 0)
+			exit(command_one(r[i].pid) ? 1 : 0);
+		if (r[i].worker < 0) {
+			r[i].ret = -errno;
+			r[i].end_ns = nsecs();
+			continue;
+		}
+		running++;
+	}
+
+	while (running > 0) {
+		ret = rollout_reap(r, nr);
+		if (ret < 0)
+			break;
+		running -= ret;
+	}
+
+	for (i = 0; i < nr; i++) {
+		/* Never reaped, the exit status is lost */
+		if (r[i].worker > 0 && !r[i].end_ns) {
+			r[i].ret = -ECHILD;
+			r[i].end_ns = nsecs();
+		}
+		if (r[i].ret)
+			nr_failed++;
+		printf("%-8d %-8s %8.3f ms\n", r[i].pid,
+		       r[i].ret ? "FAIL" : "OK",
+		       (r[i].end_ns - r[i].start_ns) / 1000000.0);
+	}
+	printf("Total %d, failed %d\n", nr, nr_failed);
+
+	free(r);
+	return nr_failed ? -1 : 0;
+}
+
+/* CPU time of all threads of @pid in ns, see proc_pid_schedstat(5) */
+static long proc_cpu_ns(pid_t pid)
+{
+	unsigned long long ns, sum = 0;
+	char path[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/schedstat", pid,
+			 d->d_name);
+		/* The thread exited */
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (fscanf(fp, "%llu", &ns) == 1)
+			sum += ns;
+		fclose(fp);
+	}
+
+	closedir(dir);
+	return sum;
+}
+
+/**
+ * Sample the CPU time of the @nr processes in every interval of the window,
+ * @usage has nr * @nr_ints entries, the intervals of process i start from
+ * usage[i * @nr_ints].
+ */
+static int canary_measure(const pid_t *pids, int nr, unsigned long *usage,
+			  int nr_ints)
+{
+	long last[nr], ns;
+	int i, k;
+
+	for (i = 0; i < nr; i++) {
+		last[i] = proc_cpu_ns(pids[i]);
+		if (last[i] < 0) {
+			fprintf(stderr, "Read CPU time of %d failed, %s.\n",
+				pids[i], strerror(-last[i]));
+			return last[i];
+		}
+	}
+
+	for (k = 0; k < nr_ints; k++) {
+		usleep(ULPATCH_CANARY_INTERVAL_MS * 1000);
+		for (i = 0; i < nr; i++) {
+			ns = proc_cpu_ns(pids[i]);
+			if (ns < 0) {
+				fprintf(stderr, "Process %d exited.\n",
+					pids[i]);
+				return ns;
+			}
+			/* Less if some threads exited */
+			usage[i * nr_ints + k] = ns > last[i] ? ns - last[i] : 0;
+			last[i] = ns;
+		}
+	}
+	return 0;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long ua = *(const unsigned long *)a;
+	unsigned long ub = *(const unsigned long *)b;
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* The @pct percentile of @nr samples, sorted in place */
+static unsigned long percentile(unsigned long *samples, int nr, int pct)
+{
+	qsort(samples, nr, sizeof(samples[0]), cmp_ulong);
+	return samples[MIN((long)nr * pct / 100, nr - 1)];
+}
+
+static void canary_rollback(const pid_t *pids, int nr)
+{
+	struct task_struct *task;
+	const char *bid;
+	int i;
+
+	bid = patch_file_build_id(patch_file);
+	if (!bid) {
+		fprintf(stderr, "No Build ID of %s, can't roll back.\n",
+			patch_file);
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		task = open_task(pids[i], FTO_ULPATCH);
+		if (!task) {
+			fprintf(stderr, "open %d failed. %m\n", pids[i]);
+			continue;
+		}
+		/* The failed canary has no such patch */
+		if (find_ulp_by_build_id(task, bid) &&
+		    delete_patch_by_build_id(task, bid))
+			fprintf(stderr, "Roll back %d failed.\n", pids[i]);
+		else
+			printf("%-8d rolled back\n", pids[i]);
+		close_task(task);
+	}
+}
+
+/**
+ * Patch @canary_pct percent of the processes, at least one, and at least
+ * one is left unpatched as control. Then compare the CPU time of both
+ * groups over the window, in intervals of ULPATCH_CANARY_INTERVAL_MS. If
+ * the p99 of canaries regresses by more than @canary_threshold percent, the
+ * canaries are unpatched, otherwise the others are patched.
+ *
+ * The CPU time of whole process is the proxy of the cost of patch, the
+ * latency of target function is not measurable in the unpatched ones,
+ * unless they are built with mcount, see ulftrace --graph.
+ */
+static int command_canary(void)
+{
+	int nr = nr_target_pids, nr_ints, nr_canary, err;
+	unsigned long *usage, p50[2], p99[2], floor;
+	long delta;
+
+	nr_canary = (nr * canary_pct + 99) / 100;
+	nr_canary = MIN(MAX(nr_canary, 1), nr - 1);
+	nr_ints = MAX(canary_window * 1000 / ULPATCH_CANARY_INTERVAL_MS, 1);
+
+	usage = calloc((size_t)nr * nr_ints, sizeof(usage[0]));
+	if (!usage)
+		return -ENOMEM;
+
+	printf("Canary %d of %d processes, window %d s\n", nr_canary, nr,
+	       canary_window);
+
+	err = command_rollout(target_pids, nr_canary);
+	if (err) {
+		fprintf(stderr, "Patch canaries failed, roll back.\n");
+		goto rollback;
+	}
+
+	err = canary_measure(target_pids, nr, usage, nr_ints);
+	if (err)
+		goto rollback;
+
+	/* The canaries are the first ones */
+	p50[0] = percentile(usage, nr_canary * nr_ints, 50);
+	p99[0] = percentile(usage, nr_canary * nr_ints, 99);
+	p50[1] = percentile(usage + nr_canary * nr_ints,
+			    (nr - nr_canary) * nr_ints, 50);
+	p99[1] = percentile(usage + nr_canary * nr_ints,
+			    (nr - nr_canary) * nr_ints, 99);
+
+	/* 0.1% of one CPU at least, the idle processes are noise only */
+	floor = ULPATCH_CANARY_INTERVAL_MS * 1000;
+	delta = ((long)p99[0] - (long)p99[1]) * 100 / (long)MAX(p99[1], floor);
+
+	printf("%-10s %10s %10s\n", "CPU", "p50", "p99");
+	printf("%-10s %9.2f%% %9.2f%%\n", "patched",
+	       p50[0] * 100.0 / (ULPATCH_CANARY_INTERVAL_MS * 1000000UL),
+	       p99[0] * 100.0 / (ULPATCH_CANARY_INTERVAL_MS * 1000000UL));
+	printf("%-10s %9.2f%% %9.2f%%\n", "unpatched",
+	       p50[1] * 100.0 / (ULPATCH_CANARY_INTERVAL_MS * 1000000UL),
+	       p99[1] * 100.0 / (ULPATCH_CANARY_INTERVAL_MS * 1000000UL));
+	printf("p99 delta %+ld%%, threshold %d%%\n", delta, canary_threshold);
+
+	if (delta > canary_threshold) {
+		fprintf(stderr, "Canaries regressed, roll back.\n");
+		err = -ERANGE;
+		goto rollback;
+	}
+
+	free(usage);
+	return command_rollout(target_pids + nr_canary, nr - nr_canary);
+
+rollback:
+	canary_rollback(target_pids, nr_canary);
+	free(usage);
+	return err;
 }
 
 int ulpatch(int argc, char *argv[])
@@ -213,35 +958,41 @@ int ulpatch(int argc, char *argv[])
 
 	ulpatch_init();
 
-	target_task = open_task(target_pid, FTO_ALL);
-
-	if (!target_task) {
-		fprintf(stderr, "open %d failed. %m\n", target_pid);
-		return 1;
-	}
-
-	switch (command_type) {
-	case CMD_PATCH:
-		command_patch();
-		break;
-	case CMD_UNPATCH:
-		command_unpatch();
-		break;
-	case CMD_NONE:
-	default:
-		fprintf(stderr, "What to do.\n");
-	}
+	/* Nothing to do for the child of patched parent */
+	if (nr_target_pids == 1 &&
+	    command_inherited(target_pids[0]) != -ENOENT) {
+		ret = 0;
+	} else if (nr_target_pids == 1) {
+		struct task_struct *task;
+
+		task = open_task(target_pids[0], FTO_ULPATCH);
+		if (!task) {
+			fprintf(stderr, "open %d failed. %m\n", target_pids[0]);
+			return 1;
+		}
+		command_task(task);
+		close_task(task);
+		ret = 0;
+	} else if (canary_pct)
+		ret = command_canary() ? 1 : 0;
+	else
+		ret = command_rollout(target_pids, nr_target_pids) ? 1 : 0;
 
-	close_task(target_task);
 	if (patch_file)
 		free(patch_file);
 
-	return 0;
+	return ret;
 }
 
 #if defined(ULP_CMD_MAIN)
 int main(int argc, char *argv[])
 {
+	int ret;
+
+	/* Run in ulpatchd(8) if ULPATCHD_SOCK is set */
+	if (!ulpatchd_client_run(prog_name, argc, argv, &ret))
+		return ret;
+
 	return ulpatch(argc, argv);
 }
 #endif
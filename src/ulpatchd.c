@@ -0,0 +1,1757 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <dirent.h>
+#include <sys/signalfd.h>
+
+#include <elf/elf-api.h>
+
+#include <patch/patch.h>
+
+#include <utils/log.h>
+#include <utils/list.h>
+#include <utils/compiler.h>
+#include <utils/ulpatchd.h>
+#include <task/task.h>
+#include <utils/cmds.h>
+
+#include <args-common.c>
+
+
+/**
+ * ulpatchd keeps the task_struct of target processes, the ELF files and
+ * symbols warm, see src/task/cache.c, and runs the commands of the tools
+ * in itself, see src/utils/ulpatchd.h. The requests are served one by one
+ * in one thread, as they share the global state of the tools.
+ *
+ * With the proc connector, see src/task/events.c, the cached tasks of the
+ * exited or exec(2)ed processes are dropped right away, and the processes
+ * exec(2) the executable of --watch are opened to warm the symbols before
+ * the first command. Without it, such as no CAP_NET_ADMIN, the cache is
+ * checked every PRUNE_INTERVAL_MS and by task_cache_get().
+ *
+ * The process exec(2) the executable of which the Build ID is in the
+ * --policy table is patched as soon as libc is mapped, because
+ * open_task() needs it, the relocated patches are reused from the
+ * pre-linked patch cache, see apply_prelink().
+ *
+ * The controller of many nodes talks the fleet protocol, see
+ * src/utils/ulpatchd.h, the patches of all processes are scanned by
+ * ulp_scan_all() for each request, and only the changed ones are sent.
+ *
+ * With --checkpoint, the fleet state and the pids of cached tasks are
+ * saved, the restarted ulpatchd keeps the epoch, and opens the same
+ * processes again with the symbols of symbol cache, see ckpt_load().
+ */
+
+#define MAX_EVENTS		16
+#define MAX_PRELOAD_PIDS	64
+#define MAX_WATCH_EXES		16
+/**
+ * Open the process exec(2) the watched executable after this milliseconds,
+ * the dynamic linker maps the libraries first.
+ */
+#define WARM_DELAY_MS		500
+
+#define MAX_POLICIES		64
+/* Check the new process every this milliseconds until it could be patched */
+#define AUTO_PATCH_POLL_MS	1
+/* Give up if the new process is not ready after this milliseconds */
+#define AUTO_PATCH_TIMEOUT_MS	1000
+/* Check the cached tasks every this milliseconds */
+#define PRUNE_INTERVAL_MS	5000
+/* Bad client should not block others */
+#define CLIENT_TIMEOUT_SEC	5
+/**
+ * Keep this many removed patches to report, then these records are dropped
+ * and the controllers of older generations get the whole state.
+ */
+#define MAX_FLEET_GONE		1024
+/* Concurrency of rollout, see ulpatch -j */
+#define FLEET_DEFAULT_JOBS	4
+/* Default of --checkpoint */
+#define CKPT_DEFAULT_PATH	ULP_PROC_ROOT_DIR "/ulpatchd.ckpt"
+
+static const char *prog_name = "ulpatchd";
+
+static const char *sock_path = ULPATCHD_SOCK_PATH;
+static pid_t preload_pids[MAX_PRELOAD_PIDS];
+static int nr_preload_pids = 0;
+static const char *watch_exes[MAX_WATCH_EXES];
+static int nr_watch_exes = 0;
+static unsigned int max_tasks = 64;
+static unsigned long max_idle_sec = 600;
+/* Build ID of target executable and the patch applied to it */
+struct patch_policy {
+	char build_id[ULPATCHD_BUILD_ID_LEN];
+	char *patch;
+	unsigned long nr_patched;
+	unsigned long nr_failed;
+};
+static const char *policy_file = NULL;
+static struct patch_policy policies[MAX_POLICIES];
+static int nr_policies = 0;
+
+/* Client mode, send to ulpatchd */
+static const char *client_cmd = NULL;
+/* Client of fleet protocol, see --status and --rollout */
+static const char *fleet_since = NULL;
+static const char *fleet_rollout_arg = NULL;
+static bool fleet_client = false;
+static unsigned int fleet_jobs = FLEET_DEFAULT_JOBS;
+/* --checkpoint, and the last saved one, the unchanged one is not written */
+static const char *ckpt_file = NULL;
+static void *ckpt_last = NULL;
+static size_t ckpt_last_len = 0;
+
+/**
+ * One for each patch of the last scan, sorted by pid and ULP ID, each is
+ * the record of fleet protocol. The removed ones are kept with
+ * ULPATCHD_FLEET_R_GONE until MAX_FLEET_GONE.
+ */
+struct fleet_entry {
+	struct ulpatchd_fleet_record r;
+	bool seen;
+};
+static struct fleet_entry *fleet_entries = NULL;
+static unsigned int nr_fleet_entries = 0, max_fleet_entries = 0;
+static unsigned int nr_fleet_gone = 0;
+/* The highest generation of the dropped removed records */
+static uint64_t fleet_dropped_gen = 0;
+/* Epoch, generation and counters of the response */
+static struct ulpatchd_fleet_response fleet_stat;
+
+static bool need_stop = false;
+/* Processes to warm, see WARM_DELAY_MS */
+static struct {
+	pid_t pid;
+	unsigned long ns;
+} warm_pids[MAX_PRELOAD_PIDS];
+static int nr_warm_pids = 0;
+/* Processes to patch, index of first matched policy */
+static struct {
+	pid_t pid;
+	unsigned long ns;
+	int policy;
+} patch_pids[MAX_PRELOAD_PIDS];
+static int nr_patch_pids = 0;
+/* Verbose of ulpatchd, restore it after every request */
+static int daemon_verbose = 0;
+
+static void ulpatchd_args_reset(void)
+{
+	sock_path = ULPATCHD_SOCK_PATH;
+	nr_preload_pids = 0;
+	nr_watch_exes = 0;
+	policy_file = NULL;
+	client_cmd = NULL;
+	fleet_since = NULL;
+	fleet_rollout_arg = NULL;
+	fleet_client = false;
+	fleet_jobs = FLEET_DEFAULT_JOBS;
+	ckpt_file = NULL;
+}
+
+static const struct ulpatchd_cmd {
+	const char *name;
+	int (*fn)(int argc, char *argv[]);
+} ulpatchd_cmds[] = {
+	{ "ulpatch", ulpatch },
+	{ "ulpinfo", ulpinfo },
+#if defined(CONFIG_BUILD_ULTASK)
+	{ "ultask", ultask },
+#endif
+};
+
+enum {
+	ARG_MIN = ARG_COMMON_MAX,
+	ARG_MAX_TASKS,
+	ARG_IDLE,
+	ARG_WATCH,
+	ARG_POLICY,
+	ARG_LIST,
+	ARG_FLUSH,
+	ARG_STOP,
+	ARG_STATUS,
+	ARG_ROLLOUT,
+	ARG_CHECKPOINT,
+};
+
+static int print_help(void)
+{
+	printf(
+	"\n"
+	" Usage: ulpatchd [OPTION]...\n"
+	"\n"
+	" ulpatchd is a daemon that keeps the processes, ELF files and symbols\n"
+	" opened, the ulpatch, ulpinfo and ultask commands run in it when the\n"
+	" environment " ULPATCHD_ENV_SOCK " is set to its socket path.\n"
+	"\n"
+	" Option argument:\n"
+	"\n"
+	"  -s, --socket [PATH] listen on UNIX socket PATH, default is\n"
+	"                      %s\n"
+	"\n"
+	"  -p, --pid [PID]     open PID when start, could be specified %d\n"
+	"                      times at most.\n"
+	"\n"
+	"  --max-tasks [N]     cache N processes at most, default %u\n"
+	"  --idle [SEC]        drop the unused process after SEC seconds, 0\n"
+	"                      means never, default %lu\n"
+	"\n"
+	"  --watch [EXE]       open the process when it exec EXE, which is the\n"
+	"                      absolute path or the file name, could be\n"
+	"                      specified %d times at most, need the proc\n"
+	"                      connector of netlink and CAP_NET_ADMIN.\n"
+	"\n"
+	"  --policy [FILE]     patch the process when it exec the executable\n"
+	"                      of the Build ID, every line of FILE is\n"
+	"                      'BUILD_ID PATCH_FILE', '#' starts comment,\n"
+	"                      need the proc connector as --watch.\n"
+	"\n"
+	"  --checkpoint[=FILE] save the fleet state and the cached processes\n"
+	"                      to FILE, restore them when start, default is\n"
+	"                      %s\n"
+	"\n"
+	"  --list              list processes cached in the running ulpatchd\n"
+	"  --flush             drop all unused processes of running ulpatchd\n"
+	"  --stop              stop the running ulpatchd\n"
+	"\n"
+	"  --status[=EPOCH:GEN]\n"
+	"                      print the patches of all processes of the node\n"
+	"                      by fleet protocol, only the ones changed since\n"
+	"                      EPOCH:GEN of the last output.\n"
+	"  --rollout [BUILD_ID:PATCH]\n"
+	"                      patch all processes of the executable of\n"
+	"                      BUILD_ID with PATCH, then print as --status.\n"
+	"  -j, --jobs [N]      stop N processes at most at the same time of\n"
+	"                      --rollout, default %d.\n"
+	"\n",
+	ULPATCHD_SOCK_PATH, MAX_PRELOAD_PIDS, max_tasks, max_idle_sec,
+	MAX_WATCH_EXES, CKPT_DEFAULT_PATH, FLEET_DEFAULT_JOBS);
+	print_usage_common(prog_name);
+	cmd_exit_success();
+	return 0;
+}
+
+static int parse_config(int argc, char *argv[])
+{
+	struct option options[] = {
+		{ "socket",         required_argument, 0, 's' },
+		{ "pid",            required_argument, 0, 'p' },
+		{ "max-tasks",      required_argument, 0, ARG_MAX_TASKS },
+		{ "idle",           required_argument, 0, ARG_IDLE },
+		{ "watch",          required_argument, 0, ARG_WATCH },
+		{ "policy",         required_argument, 0, ARG_POLICY },
+		{ "checkpoint",     optional_argument, 0, ARG_CHECKPOINT },
+		{ "list",           no_argument,       0, ARG_LIST },
+		{ "flush",          no_argument,       0, ARG_FLUSH },
+		{ "stop",           no_argument,       0, ARG_STOP },
+		{ "status",         optional_argument, 0, ARG_STATUS },
+		{ "rollout",        required_argument, 0, ARG_ROLLOUT },
+		{ "jobs",           required_argument, 0, 'j' },
+		COMMON_OPTIONS
+		{ NULL }
+	};
+
+	while (1) {
+		int c;
+		int option_index = 0;
+		c = getopt_long(argc, argv, "s:p:j:"COMMON_GETOPT_OPTSTRING,
+				options, &option_index);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 's':
+			sock_path = optarg;
+			break;
+		case 'p':
+			if (nr_preload_pids >= MAX_PRELOAD_PIDS) {
+				fprintf(stderr, "Too many -p, max %d\n",
+					MAX_PRELOAD_PIDS);
+				cmd_exit(1);
+			}
+			preload_pids[nr_preload_pids++] = atoi(optarg);
+			break;
+		case ARG_MAX_TASKS:
+			max_tasks = strtoul(optarg, NULL, 0);
+			break;
+		case ARG_IDLE:
+			max_idle_sec = strtoul(optarg, NULL, 0);
+			break;
+		case ARG_WATCH:
+			if (nr_watch_exes >= MAX_WATCH_EXES) {
+				fprintf(stderr, "Too many --watch, max %d\n",
+					MAX_WATCH_EXES);
+				cmd_exit(1);
+			}
+			watch_exes[nr_watch_exes++] = optarg;
+			break;
+		case ARG_POLICY:
+			policy_file = optarg;
+			break;
+		case ARG_CHECKPOINT:
+			ckpt_file = optarg ?: CKPT_DEFAULT_PATH;
+			break;
+		case ARG_LIST:
+			client_cmd = "list";
+			break;
+		case ARG_FLUSH:
+			client_cmd = "flush";
+			break;
+		case ARG_STOP:
+			client_cmd = "stop";
+			break;
+		case ARG_STATUS:
+			fleet_client = true;
+			fleet_since = optarg;
+			break;
+		case ARG_ROLLOUT:
+			fleet_client = true;
+			fleet_rollout_arg = optarg;
+			break;
+		case 'j':
+			fleet_jobs = strtoul(optarg, NULL, 0);
+			if (!fleet_jobs) {
+				fprintf(stderr, "--jobs must be positive\n");
+				cmd_exit(1);
+			}
+			break;
+		COMMON_GETOPT_CASES(prog_name, print_help, argv)
+		default:
+			print_help();
+			cmd_exit(1);
+			break;
+		}
+	}
+
+	if (!max_tasks) {
+		fprintf(stderr, "--max-tasks must be greater than 0\n");
+		cmd_exit(1);
+	}
+
+	return 0;
+}
+
+static int ulpatchd_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ulp_error("Socket path %s too long\n", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Another ulpatchd is running */
+	fd = ulpatchd_connect(path);
+	if (fd >= 0) {
+		close(fd);
+		ulp_error("ulpatchd is running on %s\n", path);
+		return -EADDRINUSE;
+	}
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = -errno;
+		ulp_error("create listening socket error, %m\n");
+		return ret;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		ret = -errno;
+		ulp_error("cannot bind %s, %m\n", path);
+		goto close;
+	}
+
+	/* Commands run with the privilege of ulpatchd, owner only */
+	if (chmod(path, 0600) == -1 || listen(fd, 16) == -1) {
+		ret = -errno;
+		ulp_error("listen on %s failed, %m\n", path);
+		unlink(path);
+		goto close;
+	}
+	return fd;
+
+close:
+	close(fd);
+	return ret;
+}
+
+static int recv_request(int fd, struct ulpatchd_request *req,
+			int fds[ULPATCHD_NR_FDS])
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * ULPATCHD_NR_FDS)];
+	struct iovec iov = {
+		.iov_base = req,
+		.iov_len = sizeof(*req),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	if (n != sizeof(*req))
+		return -EPROTO;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int) * ULPATCHD_NR_FDS))
+		return -EPROTO;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * ULPATCHD_NR_FDS);
+
+	if (req->magic != ULPATCHD_MAGIC || req->len > ULPATCHD_MAX_DATA ||
+	    req->argc > req->len) {
+		for (n = 0; n < ULPATCHD_NR_FDS; n++)
+			close(fds[n]);
+		return -EPROTO;
+	}
+	req->prog[sizeof(req->prog) - 1] = '\0';
+	return 0;
+}
+
+static void dump_policies(FILE *fp)
+{
+	int i;
+
+	if (!nr_policies)
+		return;
+
+	fprintf(fp, "\n%-40s %-8s %-8s %s\n", "BUILD_ID", "PATCHED",
+		"FAILED", "PATCH");
+	for (i = 0; i < nr_policies; i++)
+		fprintf(fp, "%-40s %-8lu %-8lu %s\n", policies[i].build_id,
+			policies[i].nr_patched, policies[i].nr_failed,
+			policies[i].patch);
+}
+
+/* Commands of ulpatchd itself, see --list, --flush and --stop */
+static int run_self_cmd(int argc, char *argv[])
+{
+	if (argc < 2)
+		return -EINVAL;
+
+	if (!strcmp(argv[1], "list")) {
+		dump_task_cache(stdout);
+		dump_policies(stdout);
+		fprintf(stdout, "\n");
+		print_ulp_mem_stats(stdout);
+	} else if (!strcmp(argv[1], "flush")) {
+		task_cache_flush();
+	} else if (!strcmp(argv[1], "stop")) {
+		need_stop = true;
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int run_cmd(const char *prog, int argc, char *argv[])
+{
+	int i;
+
+	if (!strcmp(prog, prog_name))
+		return run_self_cmd(argc, argv);
+
+	for (i = 0; i < ARRAY_SIZE(ulpatchd_cmds); i++) {
+		if (!strcmp(prog, ulpatchd_cmds[i].name))
+			return ulpatchd_cmds[i].fn(argc, argv);
+	}
+
+	fprintf(stderr, "ulpatchd not support %s\n", prog);
+	return -ENOTSUP;
+}
+
+/* The client may set them, see args_common_reset() */
+static void restore_daemon_args(void)
+{
+	set_log_level(log_level);
+	enable_verbose(daemon_verbose);
+	disable_dry_run();
+	set_task_attach_mode(TASK_ATTACH_PTRACE);
+}
+
+/**
+ * Run the command with the stdin, stdout, stderr and cwd of client, then
+ * restore them.
+ */
+static int run_request(const struct ulpatchd_request *req, char *data,
+		       int fds[ULPATCHD_NR_FDS])
+{
+	int saved[ULPATCHD_NR_FDS], oldcwd, i, ret;
+	char **argv, *p, *end = data + req->len;
+	const char *cwd = data;
+
+	argv = calloc(req->argc + 1, sizeof(char *));
+	if (!argv)
+		return -ENOMEM;
+
+	p = data + strnlen(data, req->len) + 1;
+	for (i = 0; i < req->argc && p < end; i++) {
+		argv[i] = p;
+		p += strnlen(p, end - p) + 1;
+	}
+	/* Every string must be NUL terminated */
+	if (i != req->argc || p != end || end[-1] != '\0') {
+		free(argv);
+		return -EPROTO;
+	}
+
+	oldcwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < ULPATCHD_NR_FDS; i++) {
+		saved[i] = fcntl(i, F_DUPFD_CLOEXEC, ULPATCHD_NR_FDS);
+		dup2(fds[i], i);
+	}
+
+	if (chdir(cwd) == -1) {
+		ret = -errno;
+		fprintf(stderr, "chdir %s failed, %s\n", cwd, strerror(-ret));
+	} else {
+		ulp_debug("Run %s in %s\n", req->prog, cwd);
+		ret = run_cmd(req->prog, req->argc, argv);
+	}
+
+	/* --mem-stats of client, the memory of ulpatchd after the command */
+	if (ulp_mem_stats_enabled()) {
+		print_ulp_mem_stats(stderr);
+		ulp_mem_stats_enable(false);
+	}
+
+	/* Restore the log settings and outputs of ulpatchd */
+	ulp_log_async_stop();
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < ULPATCHD_NR_FDS; i++) {
+		/* Closed when ulpatchd start, such as stdin of service */
+		if (saved[i] < 0) {
+			close(i);
+			continue;
+		}
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+	restore_daemon_args();
+
+	if (oldcwd >= 0) {
+		if (fchdir(oldcwd))
+			ulp_warning("Restore cwd failed, %m\n");
+		close(oldcwd);
+	}
+
+	free(argv);
+	return ret;
+}
+
+static int cmp_fleet_entry(const void *a, const void *b)
+{
+	const struct ulpatchd_fleet_record *ra = a, *rb = b;
+
+	if (ra->pid != rb->pid)
+		return ra->pid < rb->pid ? -1 : 1;
+	return ra->ulp_id < rb->ulp_id ? -1 : ra->ulp_id > rb->ulp_id;
+}
+
+static bool fleet_record_same(const struct ulpatchd_fleet_record *a,
+			      const struct ulpatchd_fleet_record *b)
+{
+	return a->flags == b->flags && a->nr_funcs == b->nr_funcs &&
+	       a->time == b->time && a->start == b->start &&
+	       !strcmp(a->build_id, b->build_id);
+}
+
+static struct fleet_entry *fleet_add(void)
+{
+	struct fleet_entry *new;
+	unsigned int max;
+
+	if (nr_fleet_entries == max_fleet_entries) {
+		max = MAX(max_fleet_entries * 2, 64U);
+		new = realloc(fleet_entries, max * sizeof(*new));
+		if (!new)
+			return NULL;
+		fleet_entries = new;
+		max_fleet_entries = max;
+	}
+	return &fleet_entries[nr_fleet_entries++];
+}
+
+/* Drop all removed records, the controllers behind get the whole state */
+static void fleet_drop_gone(void)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < nr_fleet_entries; i++) {
+		if (!(fleet_entries[i].r.flags & ULPATCHD_FLEET_R_GONE)) {
+			fleet_entries[n++] = fleet_entries[i];
+			continue;
+		}
+		fleet_dropped_gen = MAX(fleet_dropped_gen,
+					fleet_entries[i].r.gen);
+	}
+	nr_fleet_entries = n;
+	nr_fleet_gone = 0;
+}
+
+static void fleet_fill_record(struct ulpatchd_fleet_record *r,
+			      const struct ulp_scan_patch *p)
+{
+	memset(r, 0, sizeof(*r));
+	r->pid = p->pid;
+	r->ulp_id = p->infos[0].ulp_id;
+	r->flags = p->owner != p->pid ? ULPATCHD_FLEET_R_INHERITED : 0;
+	r->nr_funcs = p->nr_funcs;
+	r->time = p->infos[0].time;
+	r->start = p->start;
+	strncpy(r->build_id, p->str_build_id ?: "", sizeof(r->build_id) - 1);
+	strncpy(r->func, p->strtabs[0].dst_func, sizeof(r->func) - 1);
+}
+
+/**
+ * Scan the patches of all processes, the new and changed ones get the next
+ * generation, so do the removed ones, which are marked as
+ * ULPATCHD_FLEET_R_GONE.
+ */
+static int fleet_refresh(void)
+{
+	struct ulpatchd_fleet_record key;
+	struct ulp_scan_patch *p;
+	struct ulp_scan_task *st;
+	struct fleet_entry *e;
+	unsigned int i, nr_old = nr_fleet_entries;
+	struct ulp_scan scan;
+	int err;
+
+	err = ulp_scan_all(&scan, 0);
+	if (err)
+		goto free;
+
+	for (i = 0; i < nr_old; i++)
+		fleet_entries[i].seen = false;
+
+	for (i = 0; i < scan.nr_tasks && !err; i++) {
+		st = &scan.tasks[i];
+		list_for_each_entry(p, &st->patches, node) {
+			fleet_fill_record(&key, p);
+
+			/* The new ones are appended, sorted below */
+			e = bsearch(&key, fleet_entries, nr_old, sizeof(*e),
+				    cmp_fleet_entry);
+			if (e && fleet_record_same(&e->r, &key)) {
+				e->seen = true;
+				continue;
+			}
+			if (e && (e->r.flags & ULPATCHD_FLEET_R_GONE))
+				nr_fleet_gone--;
+			if (!e)
+				e = fleet_add();
+			if (!e) {
+				err = -ENOMEM;
+				break;
+			}
+			key.gen = ++fleet_stat.gen;
+			e->r = key;
+			e->seen = true;
+		}
+	}
+
+	for (i = 0; i < nr_old; i++) {
+		e = &fleet_entries[i];
+		if (e->seen || (e->r.flags & ULPATCHD_FLEET_R_GONE))
+			continue;
+		e->r.flags |= ULPATCHD_FLEET_R_GONE;
+		e->r.gen = ++fleet_stat.gen;
+		nr_fleet_gone++;
+	}
+
+	qsort(fleet_entries, nr_fleet_entries, sizeof(*e), cmp_fleet_entry);
+	if (nr_fleet_gone > MAX_FLEET_GONE)
+		fleet_drop_gone();
+
+	fleet_stat.nr_tasks = scan.nr_tasks;
+	fleet_stat.nr_errors = scan.nr_errors;
+free:
+	ulp_scan_free(&scan);
+	return err;
+}
+
+/* Account the stop window of the patch of @pid applied right now */
+static void fleet_note_stop(pid_t pid)
+{
+	struct patch_phase_stats ps;
+
+	patch_get_phase_stats(&ps);
+	if (ps.pid != pid || ps.ret || ps.inherited || !ps.op ||
+	    strcmp(ps.op, "patch"))
+		return;
+
+	fleet_stat.nr_stops++;
+	fleet_stat.stop_ns_sum += ps.stop.stop_ns;
+	fleet_stat.stop_ns_max = MAX(fleet_stat.stop_ns_max,
+				     (uint64_t)ps.stop.stop_ns);
+}
+
+/* Lowercase hex of the Build ID of executable of @pid */
+static int proc_exe_build_id(pid_t pid, char str[ULPATCHD_BUILD_ID_LEN])
+{
+	uint8_t bid[ULPATCHD_BUILD_ID_LEN / 2];
+	char path[64];
+	int i, len;
+
+	snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+	len = elf_read_build_id(path, bid, sizeof(bid));
+	if (len <= 0)
+		return -ENOENT;
+	for (i = 0; i < len; i++)
+		snprintf(str + i * 2, 3, "%02x", bid[i]);
+	return 0;
+}
+
+/* The pids of all processes of the executable of Build ID @bid */
+static int fleet_match_pids(const char *bid, pid_t **pids)
+{
+	char str[ULPATCHD_BUILD_ID_LEN];
+	int nr = 0, max = 0;
+	struct dirent *d;
+	pid_t pid, *new;
+	DIR *dir;
+
+	*pids = NULL;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return -errno;
+
+	while ((d = readdir(dir))) {
+		if (!isdigit(d->d_name[0]))
+			continue;
+		pid = atoi(d->d_name);
+		if (pid == getpid() || proc_exe_build_id(pid, str) ||
+		    strcmp(str, bid))
+			continue;
+		if (nr == max) {
+			max = MAX(max * 2, 64);
+			new = realloc(*pids, max * sizeof(pid_t));
+			if (!new) {
+				nr = -ENOMEM;
+				break;
+			}
+			*pids = new;
+		}
+		(*pids)[nr++] = pid;
+	}
+
+	closedir(dir);
+	return nr;
+}
+
+/* Already has the patch of Build ID @bid, see fleet_refresh() */
+static bool fleet_pid_patched(pid_t pid, const char *bid)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_fleet_entries; i++) {
+		const struct ulpatchd_fleet_record *r = &fleet_entries[i].r;
+
+		if (r->pid == pid && !(r->flags & ULPATCHD_FLEET_R_GONE) &&
+		    !strcmp(r->build_id, bid))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Patch the processes of executable of Build ID @bid with @patch by
+ * ulpatch -j @max_jobs, the ones have the patch already are skipped.
+ */
+static int fleet_rollout(const char *bid, const char *patch,
+			 unsigned int max_jobs)
+{
+	char jobs[16], (*strs)[16] = NULL, **argv = NULL;
+	int i, nr, argc = 0, ret;
+	const char *pbid;
+	pid_t *pids;
+
+	if (!bid[0] || strspn(bid, "0123456789abcdef") != strlen(bid) ||
+	    strlen(bid) >= ULPATCHD_BUILD_ID_LEN || !max_jobs)
+		return -EINVAL;
+
+	pbid = patch_file_build_id(patch);
+	if (!pbid)
+		return -ENOEXEC;
+
+	ret = fleet_refresh();
+	if (ret)
+		return ret;
+
+	nr = fleet_match_pids(bid, &pids);
+	if (nr < 0)
+		return nr;
+
+	/* The patch may be inherited or applied by previous rollout */
+	for (i = 0, ret = 0; i < nr; i++) {
+		if (!fleet_pid_patched(pids[i], pbid))
+			pids[ret++] = pids[i];
+	}
+	nr = ret;
+	ret = 0;
+	if (!nr)
+		goto free;
+
+	argv = calloc(nr * 2 + 6, sizeof(char *));
+	strs = calloc(nr, sizeof(*strs));
+	if (!argv || !strs) {
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	snprintf(jobs, sizeof(jobs), "%u", max_jobs);
+	argv[argc++] = "ulpatch";
+	argv[argc++] = "--patch";
+	argv[argc++] = (char *)patch;
+	argv[argc++] = "-j";
+	argv[argc++] = jobs;
+	for (i = 0; i < nr; i++) {
+		snprintf(strs[i], sizeof(strs[i]), "%d", pids[i]);
+		argv[argc++] = "-p";
+		argv[argc++] = strs[i];
+	}
+
+	ulp_info("Rollout %s to %d processes of %s, %u jobs\n", patch, nr,
+		 bid, max_jobs);
+	ret = ulpatch(argc, argv) ? -EIO : 0;
+	ulp_log_async_stop();
+	restore_daemon_args();
+
+	/* The first one is patched in ulpatchd, see command_rollout() */
+	fleet_note_stop(pids[0]);
+
+	ret = fleet_refresh() ?: ret;
+	for (i = 0; i < nr; i++) {
+		if (fleet_pid_patched(pids[i], pbid))
+			fleet_stat.nr_patched++;
+		else
+			fleet_stat.nr_failed++;
+	}
+
+free:
+	free(strs);
+	free(argv);
+	free(pids);
+	return ret;
+}
+
+/**
+ * Send the records changed since @epoch and @gen, or the whole state if
+ * the controller is too old or talked to another ulpatchd.
+ */
+static int fleet_reply(int fd, int ret, uint64_t epoch, uint64_t gen)
+{
+	struct ulpatchd_fleet_response rsp = fleet_stat;
+	struct ulpatchd_fleet_record *records;
+	const struct ulpatchd_fleet_record *r;
+	unsigned int i, nr = 0;
+	bool full;
+	int err = 0;
+
+	full = epoch != fleet_stat.epoch || !gen || gen > fleet_stat.gen ||
+	       gen < fleet_dropped_gen;
+
+	records = malloc(MAX(nr_fleet_entries, 1U) * sizeof(*records));
+	if (!records)
+		ret = ret ?: -ENOMEM;
+
+	for (i = 0; records && i < nr_fleet_entries; i++) {
+		r = &fleet_entries[i].r;
+		if (full ? !(r->flags & ULPATCHD_FLEET_R_GONE) : r->gen > gen)
+			records[nr++] = *r;
+	}
+
+	rsp.magic = ULPATCHD_FLEET_MAGIC;
+	rsp.ret = ret;
+	rsp.flags = full ? ULPATCHD_FLEET_F_FULL : 0;
+	rsp.nr = nr;
+
+	if (send(fd, &rsp, sizeof(rsp), MSG_NOSIGNAL) != sizeof(rsp))
+		err = -errno ?: -EIO;
+	for (i = 0; !err && i < nr; ) {
+		ssize_t n = send(fd, (char *)records + i * sizeof(*records),
+				 (nr - i) * sizeof(*records), MSG_NOSIGNAL);
+		if (n <= 0 || n % sizeof(*records))
+			err = -errno ?: -EIO;
+		else
+			i += n / sizeof(*records);
+	}
+
+	free(records);
+	return err;
+}
+
+/**
+ * The checkpoint of --checkpoint, the cached tasks, the pids of the fleet
+ * records with the starttime, then the fleet records. It is saved before
+ * the reply of every fleet request, thus the restarted ulpatchd never
+ * reuses the generation some controller has seen.
+ */
+#define CKPT_MAGIC	"ULPDCKPT"
+#define CKPT_VERSION	1
+
+struct ckpt_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nr_tasks;
+	uint32_t nr_pids;
+	uint32_t nr_records;
+	uint64_t dropped_gen;
+	struct ulpatchd_fleet_response stat;
+};
+
+static size_t ckpt_size(const struct ckpt_hdr *hdr)
+{
+	return sizeof(*hdr) +
+	       ((size_t)hdr->nr_tasks + hdr->nr_pids) *
+	       sizeof(struct task_cache_ent) +
+	       (size_t)hdr->nr_records * sizeof(struct ulpatchd_fleet_record);
+}
+
+static void *ckpt_build(size_t *len)
+{
+	struct ulpatchd_fleet_record *records;
+	struct task_cache_ent *tasks, *pids;
+	struct ckpt_hdr *hdr;
+	unsigned int i;
+	pid_t pid;
+
+	/* At most one pid of each record */
+	hdr = calloc(1, sizeof(*hdr) + (max_tasks + nr_fleet_entries) *
+		     sizeof(*tasks) + nr_fleet_entries * sizeof(*records));
+	if (!hdr)
+		return NULL;
+
+	memcpy(hdr->magic, CKPT_MAGIC, sizeof(hdr->magic));
+	hdr->version = CKPT_VERSION;
+	hdr->dropped_gen = fleet_dropped_gen;
+	hdr->stat = fleet_stat;
+
+	tasks = (void *)(hdr + 1);
+	hdr->nr_tasks = task_cache_save(tasks, max_tasks);
+
+	/* Records are sorted by pid, so are the pids */
+	pids = tasks + hdr->nr_tasks;
+	for (i = 0; i < nr_fleet_entries; i++) {
+		pid = fleet_entries[i].r.pid;
+		if (hdr->nr_pids && pids[hdr->nr_pids - 1].pid == pid)
+			continue;
+		pids[hdr->nr_pids].pid = pid;
+		pids[hdr->nr_pids].flag = -1;
+		pids[hdr->nr_pids].start_time = proc_pid_start_time(pid);
+		hdr->nr_pids++;
+	}
+
+	records = (void *)(pids + hdr->nr_pids);
+	for (i = 0; i < nr_fleet_entries; i++)
+		records[i] = fleet_entries[i].r;
+	hdr->nr_records = nr_fleet_entries;
+
+	*len = ckpt_size(hdr);
+	return hdr;
+}
+
+/* Write the checkpoint if changed, the failed one is removed */
+static int ckpt_save(void)
+{
+	char tmp[PATH_MAX];
+	size_t len;
+	void *buf;
+	int fd, err = 0;
+
+	if (!ckpt_file)
+		return 0;
+
+	buf = ckpt_build(&len);
+	if (!buf)
+		return -ENOMEM;
+	if (len == ckpt_last_len && !memcmp(buf, ckpt_last, len)) {
+		free(buf);
+		return 0;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", ckpt_file);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		err = -errno;
+		goto failed;
+	}
+	if (write(fd, buf, len) != (ssize_t)len)
+		err = -errno ?: -EIO;
+	close(fd);
+	if (!err && rename(tmp, ckpt_file))
+		err = -errno;
+	if (err) {
+		unlink(tmp);
+		goto failed;
+	}
+
+	free(ckpt_last);
+	ckpt_last = buf;
+	ckpt_last_len = len;
+	ulp_debug("Save checkpoint %s, %zu bytes\n", ckpt_file, len);
+	return 0;
+
+failed:
+	ulp_warning("Save checkpoint %s failed, %s\n", ckpt_file,
+		    strerror(-err));
+	/* The stale one must not be restored, see fleet_reply() */
+	unlink(ckpt_file);
+	free(ckpt_last);
+	ckpt_last = NULL;
+	ckpt_last_len = 0;
+	free(buf);
+	return err;
+}
+
+static void ckpt_reset(void)
+{
+	nr_fleet_entries = 0;
+	nr_fleet_gone = 0;
+	fleet_dropped_gen = 0;
+	memset(&fleet_stat, 0, sizeof(fleet_stat));
+}
+
+/**
+ * Restore the checkpoint of the last ulpatchd. The process of which the
+ * starttime differs exited, its patches are removed with new generation,
+ * the others are checked by the next fleet_refresh(), which sends only the
+ * changed ones. The cached tasks are opened again, the ELF files and the
+ * symbols are loaded from the symbol cache. Return 0 if the fleet state is
+ * restored, then the epoch is kept.
+ */
+static int ckpt_load(void)
+{
+	const struct ulpatchd_fleet_record *records, *r;
+	const struct task_cache_ent *tasks, *pids;
+	unsigned int i, j, nr_tasks = 0, nr_dead = 0;
+	const struct ckpt_hdr *hdr;
+	struct fleet_entry *e;
+	bool alive = false;
+	struct stat st;
+	void *map;
+	int fd, err = -EINVAL;
+
+	fd = open(ckpt_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	/* Never trust the one of others */
+	if (fstat(fd, &st) || st.st_uid != geteuid() ||
+	    st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = map;
+	if (memcmp(hdr->magic, CKPT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CKPT_VERSION || ckpt_size(hdr) != st.st_size)
+		goto unmap;
+
+	tasks = (const void *)(hdr + 1);
+	pids = tasks + hdr->nr_tasks;
+	records = (const void *)(pids + hdr->nr_pids);
+
+	/* The least recently used first, it is dropped first if full */
+	for (i = hdr->nr_tasks; i-- > 0;) {
+		if (!task_cache_restore(&tasks[i]))
+			nr_tasks++;
+	}
+
+	fleet_stat = hdr->stat;
+	fleet_dropped_gen = hdr->dropped_gen;
+
+	for (i = j = 0; i < hdr->nr_records; i++) {
+		r = &records[i];
+		if (!i || r->pid != records[i - 1].pid) {
+			while (j < hdr->nr_pids && pids[j].pid < r->pid)
+				j++;
+			alive = j < hdr->nr_pids && pids[j].pid == r->pid &&
+				pids[j].start_time &&
+				proc_pid_start_time(r->pid) ==
+				pids[j].start_time;
+		}
+
+		e = fleet_add();
+		if (!e) {
+			ckpt_reset();
+			err = -ENOMEM;
+			goto unmap;
+		}
+		e->r = *r;
+		if (r->flags & ULPATCHD_FLEET_R_GONE) {
+			nr_fleet_gone++;
+			continue;
+		}
+		if (!alive) {
+			e->r.flags |= ULPATCHD_FLEET_R_GONE;
+			e->r.gen = ++fleet_stat.gen;
+			nr_fleet_gone++;
+			nr_dead++;
+		}
+	}
+	if (nr_fleet_gone > MAX_FLEET_GONE)
+		fleet_drop_gone();
+
+	ulp_info("Restore checkpoint %s, %u/%u tasks, %u patches, %u of "
+		 "exited processes\n", ckpt_file, nr_tasks, hdr->nr_tasks,
+		 hdr->nr_records, nr_dead);
+	err = 0;
+unmap:
+	if (err)
+		ulp_warning("Ignore checkpoint %s, %s\n", ckpt_file,
+			    strerror(-err));
+	munmap(map, st.st_size);
+	return err;
+}
+
+/* One request of the fleet protocol, see src/utils/ulpatchd.h */
+static void handle_fleet(int fd, pid_t peer)
+{
+	struct ulpatchd_fleet_request req;
+	char *data = NULL, *patch;
+	int ret;
+
+	if (recv(fd, &req, sizeof(req), MSG_WAITALL) != sizeof(req) ||
+	    req.magic != ULPATCHD_FLEET_MAGIC ||
+	    req.len > ULPATCHD_MAX_DATA) {
+		ulp_warning("Bad fleet request from pid %d\n", peer);
+		return;
+	}
+
+	data = malloc(req.len + 1);
+	if (!data) {
+		ret = -ENOMEM;
+		goto reply;
+	}
+	if (req.len && recv(fd, data, req.len, MSG_WAITALL) != req.len) {
+		ret = -EPROTO;
+		goto reply;
+	}
+	data[req.len] = '\0';
+
+	switch (req.op) {
+	case ULPATCHD_FLEET_STATUS:
+		ret = fleet_refresh();
+		break;
+	case ULPATCHD_FLEET_ROLLOUT:
+		/* 'BUILD_ID\0PATCH\0' */
+		patch = data + strlen(data) + 1;
+		if (!req.len || patch >= data + req.len ||
+		    patch + strlen(patch) + 1 != data + req.len) {
+			ret = -EPROTO;
+			break;
+		}
+		ret = fleet_rollout(data, patch, req.max_jobs);
+		break;
+	default:
+		ret = -EOPNOTSUPP;
+		break;
+	}
+
+reply:
+	ckpt_save();
+	if (fleet_reply(fd, ret, req.epoch, req.gen))
+		ulp_warning("Reply fleet to pid %d failed\n", peer);
+	free(data);
+}
+
+static void handle_client(int fd)
+{
+	struct ulpatchd_response rsp = {
+		.magic = ULPATCHD_MAGIC,
+	};
+	struct timeval tv = {
+		.tv_sec = CLIENT_TIMEOUT_SEC,
+	};
+	struct ulpatchd_request req;
+	int fds[ULPATCHD_NR_FDS], i;
+	struct ucred cred = {};
+	socklen_t len = sizeof(cred);
+	char *data = NULL;
+	uint32_t magic;
+	int ret;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* Only root and the owner of ulpatchd */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+	    (cred.uid != 0 && cred.uid != geteuid())) {
+		ulp_warning("Reject client of uid %d\n", cred.uid);
+		return;
+	}
+
+	if (recv(fd, &magic, sizeof(magic), MSG_PEEK | MSG_WAITALL) ==
+	    sizeof(magic) && magic == ULPATCHD_FLEET_MAGIC) {
+		handle_fleet(fd, cred.pid);
+		return;
+	}
+
+	ret = recv_request(fd, &req, fds);
+	if (ret) {
+		ulp_warning("Bad request from pid %d\n", cred.pid);
+		return;
+	}
+
+	data = malloc(req.len + 1);
+	if (!data) {
+		ret = -ENOMEM;
+		goto reply;
+	}
+	if (!req.len || recv(fd, data, req.len, MSG_WAITALL) != req.len) {
+		ret = -EPROTO;
+		goto reply;
+	}
+
+	ret = run_request(&req, data, fds);
+
+reply:
+	rsp.ret = ret;
+	if (send(fd, &rsp, sizeof(rsp), MSG_NOSIGNAL) != sizeof(rsp))
+		ulp_warning("Reply to pid %d failed, %m\n", cred.pid);
+	for (i = 0; i < ULPATCHD_NR_FDS; i++)
+		close(fds[i]);
+	free(data);
+}
+
+/* Send --list, --flush or --stop to running ulpatchd */
+static int run_client(void)
+{
+	char *argv[] = { (char *)prog_name, (char *)client_cmd, NULL };
+	int ret;
+
+	setenv(ULPATCHD_ENV_SOCK, sock_path, 1);
+	if (ulpatchd_client_run(prog_name, 2, argv, &ret)) {
+		fprintf(stderr, "No ulpatchd on %s\n", sock_path);
+		return 1;
+	}
+	return ret;
+}
+
+static void print_fleet(const struct ulpatchd_fleet_response *rsp,
+			const struct ulpatchd_fleet_record *records)
+{
+	const struct ulpatchd_fleet_record *r;
+	unsigned int i;
+
+	printf("since %" PRIu64 ":%" PRIu64 " %s %u\n", rsp->epoch, rsp->gen,
+	       rsp->flags & ULPATCHD_FLEET_F_FULL ? "full" : "delta", rsp->nr);
+	printf("counters patched %" PRIu64 " failed %" PRIu64 " stops %" PRIu64
+	       " stop_ns_sum %" PRIu64 " stop_ns_max %" PRIu64
+	       " tasks %u errors %u\n", rsp->nr_patched, rsp->nr_failed,
+	       rsp->nr_stops, rsp->stop_ns_sum, rsp->stop_ns_max,
+	       rsp->nr_tasks, rsp->nr_errors);
+
+	for (i = 0; i < rsp->nr; i++) {
+		r = &records[i];
+		if (r->flags & ULPATCHD_FLEET_R_GONE) {
+			printf("- %d %u %" PRIu64 "\n", r->pid, r->ulp_id,
+			       r->gen);
+			continue;
+		}
+		printf("+ %d %u %" PRIu64 " %" PRIu64 " %#" PRIx64
+		       " %u %s %s %s\n", r->pid, r->ulp_id, r->gen, r->time,
+		       r->start, r->nr_funcs,
+		       r->flags & ULPATCHD_FLEET_R_INHERITED ? "inherited" :
+		       "owner", r->build_id[0] ? r->build_id : "-",
+		       r->func[0] ? r->func : "-");
+	}
+}
+
+/* Send --status or --rollout to running ulpatchd */
+static int run_fleet_client(void)
+{
+	struct ulpatchd_fleet_request req = {
+		.magic = ULPATCHD_FLEET_MAGIC,
+		.op = ULPATCHD_FLEET_STATUS,
+	};
+	struct ulpatchd_fleet_response rsp;
+	struct ulpatchd_fleet_record *records;
+	char *data = NULL, *sep;
+	int err;
+
+	if (fleet_since && sscanf(fleet_since, "%" SCNu64 ":%" SCNu64,
+				  &req.epoch, &req.gen) != 2) {
+		fprintf(stderr, "--status needs EPOCH:GEN\n");
+		return 1;
+	}
+
+	if (fleet_rollout_arg) {
+		sep = strchr(fleet_rollout_arg, ':');
+		if (!sep || sep == fleet_rollout_arg || !sep[1]) {
+			fprintf(stderr, "--rollout needs BUILD_ID:PATCH\n");
+			return 1;
+		}
+		/* 'BUILD_ID\0PATCH\0', the path is of ulpatchd */
+		data = strdup(fleet_rollout_arg);
+		if (!data)
+			return 1;
+		for (sep = data; *sep != ':'; sep++)
+			*sep = tolower(*sep);
+		*sep = '\0';
+		req.op = ULPATCHD_FLEET_ROLLOUT;
+		req.max_jobs = fleet_jobs;
+		req.len = strlen(fleet_rollout_arg) + 1;
+	}
+
+	err = ulpatchd_fleet_call(sock_path, &req, data, &rsp, &records);
+	free(data);
+	if (err) {
+		fprintf(stderr, "Fleet request to ulpatchd on %s failed, %s\n",
+			sock_path, strerror(-err));
+		return 1;
+	}
+
+	print_fleet(&rsp, records);
+	free(records);
+
+	if (rsp.ret) {
+		fprintf(stderr, "ulpatchd: %s\n", strerror(-rsp.ret));
+		return 1;
+	}
+	return 0;
+}
+
+static int warm_task(pid_t pid)
+{
+	struct task_struct *task;
+
+	/* Same flags as ultask without write, and ulpinfo */
+	task = open_task(pid, FTO_ULTASK);
+	if (!task)
+		return -1;
+	close_task(task);
+
+	task = open_task(pid, FTO_ULPINFO);
+	if (!task)
+		return -1;
+	close_task(task);
+	return 0;
+}
+
+static void preload_tasks(void)
+{
+	int i;
+
+	for (i = 0; i < nr_preload_pids; i++) {
+		if (warm_task(preload_pids[i]))
+			ulp_warning("open pid %d failed, %m\n",
+				    preload_pids[i]);
+	}
+}
+
+static bool exe_is_watched(pid_t pid)
+{
+	char exe[PATH_MAX];
+	const char *name;
+	int i;
+
+	if (!nr_watch_exes || !get_proc_pid_exe(pid, exe, sizeof(exe) - 1))
+		return false;
+
+	name = strrchr(exe, '/');
+	name = name ? name + 1 : exe;
+
+	for (i = 0; i < nr_watch_exes; i++) {
+		if (watch_exes[i][0] == '/' ? !strcmp(watch_exes[i], exe) :
+		    !strcmp(watch_exes[i], name))
+			return true;
+	}
+	return false;
+}
+
+static int load_policies(const char *file)
+{
+	char line[PATH_MAX + ULPATCHD_BUILD_ID_LEN + 16];
+	char bid[ULPATCHD_BUILD_ID_LEN], patch[PATH_MAX];
+	int i, n, lineno = 0, ret = 0;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		ulp_error("open %s failed, %m\n", file);
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+
+		n = sscanf(line, "%64s %4095s", bid, patch);
+		if (n <= 0)
+			continue;
+		if (n != 2 || strspn(bid, "0123456789abcdefABCDEF") !=
+		    strlen(bid) || strlen(bid) % 2) {
+			ulp_error("%s:%d: need 'BUILD_ID PATCH_FILE'\n", file,
+				  lineno);
+			ret = -EINVAL;
+			break;
+		}
+		if (nr_policies >= MAX_POLICIES) {
+			ulp_error("%s: too many policies, max %d\n", file,
+				  MAX_POLICIES);
+			ret = -E2BIG;
+			break;
+		}
+		/* Fail early, the checked one is cached */
+		if (check_patch_file(patch)) {
+			ulp_error("%s:%d: %s is not valid patch\n", file,
+				  lineno, patch);
+			ret = -ENOEXEC;
+			break;
+		}
+
+		for (i = 0; bid[i]; i++)
+			bid[i] = tolower(bid[i]);
+		strcpy(policies[nr_policies].build_id, bid);
+		policies[nr_policies].patch = strdup(patch);
+		policies[nr_policies].nr_patched = 0;
+		policies[nr_policies].nr_failed = 0;
+		nr_policies++;
+	}
+
+	fclose(fp);
+	return ret;
+}
+
+static void free_policies(void)
+{
+	int i;
+
+	for (i = 0; i < nr_policies; i++)
+		free(policies[i].patch);
+	nr_policies = 0;
+}
+
+/* Index of first policy of the executable of @pid, or -1 */
+static int match_policy(pid_t pid)
+{
+	char str[ULPATCHD_BUILD_ID_LEN];
+	int i;
+
+	if (!nr_policies || proc_exe_build_id(pid, str))
+		return -1;
+
+	for (i = 0; i < nr_policies; i++) {
+		if (!strcmp(policies[i].build_id, str))
+			return i;
+	}
+	return -1;
+}
+
+/* Apply all patches of the Build ID of policies[@first] */
+static int auto_patch(pid_t pid, int first, unsigned long exec_ns)
+{
+	struct task_struct *task;
+	int i, err, ret = 0;
+
+	task = open_task(pid, FTO_ULPATCH);
+	if (!task)
+		return -errno ?: -ESRCH;
+
+	for (i = first; i < nr_policies; i++) {
+		if (strcmp(policies[i].build_id, policies[first].build_id))
+			continue;
+
+		err = init_patch(task, policies[i].patch);
+		if (err) {
+			policies[i].nr_failed++;
+			fleet_stat.nr_failed++;
+			ulp_error("Auto patch %d with %s failed, %s\n", pid,
+				  policies[i].patch, strerror(-err));
+			ret = ret ?: err;
+			continue;
+		}
+		policies[i].nr_patched++;
+		fleet_stat.nr_patched++;
+		fleet_note_stop(pid);
+		ulp_info("Auto patch %d with %s, %.3fms after exec\n", pid,
+			 policies[i].patch, (nsecs() - exec_ns) / 1000000.0);
+	}
+
+	close_task(task);
+	return ret;
+}
+
+/**
+ * Patch the new processes of policies when libc is mapped, the ones not
+ * ready in AUTO_PATCH_TIMEOUT_MS are given up, such as static executable.
+ */
+static void patch_new_tasks(void)
+{
+	unsigned long now = nsecs();
+	int i, n = 0;
+	pid_t pid;
+
+	for (i = 0; i < nr_patch_pids; i++) {
+		pid = patch_pids[i].pid;
+
+		if (!proc_pid_exist(pid))
+			continue;
+
+		if (!proc_pid_libc_mapped(pid)) {
+			if (now - patch_pids[i].ns <
+			    AUTO_PATCH_TIMEOUT_MS * 1000000UL)
+				patch_pids[n++] = patch_pids[i];
+			else
+				ulp_warning("Task %d has no libc, not patch\n",
+					    pid);
+			continue;
+		}
+
+		auto_patch(pid, patch_pids[i].policy, patch_pids[i].ns);
+	}
+	nr_patch_pids = n;
+}
+
+static void handle_task_event(const struct task_event *ev, void *arg)
+{
+	int policy;
+
+	switch (ev->type) {
+	case TASK_EVENT_EXEC:
+		task_cache_evict(ev->pid);
+
+		/* Patched one is opened, no need to warm */
+		policy = match_policy(ev->pid);
+		if (policy >= 0) {
+			if (nr_patch_pids >= ARRAY_SIZE(patch_pids)) {
+				ulp_warning("Too many, not patch %d\n",
+					    ev->pid);
+				break;
+			}
+			patch_pids[nr_patch_pids].pid = ev->pid;
+			patch_pids[nr_patch_pids].ns = nsecs();
+			patch_pids[nr_patch_pids].policy = policy;
+			nr_patch_pids++;
+			break;
+		}
+
+		if (nr_warm_pids < ARRAY_SIZE(warm_pids) &&
+		    exe_is_watched(ev->pid)) {
+			warm_pids[nr_warm_pids].pid = ev->pid;
+			warm_pids[nr_warm_pids].ns = nsecs();
+			nr_warm_pids++;
+		}
+		break;
+	case TASK_EVENT_EXIT:
+		if (task_cache_evict(ev->pid))
+			ulp_debug("Task %d exit, uncached\n", ev->pid);
+		break;
+	/* The child is a new process, opened when exec or requested */
+	case TASK_EVENT_FORK:
+	default:
+		break;
+	}
+}
+
+/* Open the watched processes exec(2)ed WARM_DELAY_MS ago */
+static void warm_watched_tasks(void)
+{
+	unsigned long now = nsecs();
+	int i, n = 0;
+
+	for (i = 0; i < nr_warm_pids; i++) {
+		if (now - warm_pids[i].ns < WARM_DELAY_MS * 1000000UL) {
+			warm_pids[n++] = warm_pids[i];
+			continue;
+		}
+		/* Exited already, or static executable without libc */
+		if (!proc_pid_exist(warm_pids[i].pid) ||
+		    warm_task(warm_pids[i].pid))
+			ulp_debug("Warm task %d failed\n", warm_pids[i].pid);
+		else
+			ulp_info("Warm task %d\n", warm_pids[i].pid);
+	}
+	nr_warm_pids = n;
+}
+
+static int run_daemon(void)
+{
+	struct epoll_event event, events[MAX_EVENTS];
+	int listenfd, sigfd, epollfd, evfd, i, nfds;
+	unsigned long last_prune;
+	struct signalfd_siginfo si;
+	struct timespec ts;
+	sigset_t mask;
+	int ret = 0;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (sigfd == -1 || epollfd == -1) {
+		ulp_error("create signalfd or epoll failed, %m\n");
+		return 1;
+	}
+
+	listenfd = ulpatchd_listen(sock_path);
+	if (listenfd < 0) {
+		ret = 1;
+		goto close;
+	}
+
+	event.events = EPOLLIN;
+	event.data.fd = listenfd;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event);
+	event.data.fd = sigfd;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, sigfd, &event);
+
+	evfd = task_events_open();
+	if (evfd >= 0) {
+		event.data.fd = evfd;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, evfd, &event);
+	} else if (nr_watch_exes || nr_policies)
+		ulp_warning("No proc connector, %s, ignore --watch and "
+			    "--policy\n", strerror(-evfd));
+	else
+		ulp_info("No proc connector, %s, check processes every %dms\n",
+			 strerror(-evfd), PRUNE_INTERVAL_MS);
+
+	task_cache_enable(max_tasks, max_idle_sec * 1000000000UL);
+
+	/* Differs from the last run, the controller gets the whole state */
+	if (!ckpt_file || ckpt_load()) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		fleet_stat.epoch = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	preload_tasks();
+
+	ulp_info("ulpatchd listen on %s\n", sock_path);
+
+	last_prune = nsecs();
+	while (!need_stop) {
+		nfds = epoll_wait(epollfd, events, MAX_EVENTS,
+				  nr_patch_pids ? AUTO_PATCH_POLL_MS :
+				  nr_warm_pids ? WARM_DELAY_MS :
+				  PRUNE_INTERVAL_MS);
+		if (nfds == -1) {
+			if (errno == EINTR)
+				continue;
+			ulp_error("epoll_wait: %m\n");
+			ret = 1;
+			break;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			if (events[i].data.fd == sigfd) {
+				if (read(sigfd, &si, sizeof(si)) == sizeof(si))
+					ulp_info("Receive signal %d, stop\n",
+						 si.ssi_signo);
+				need_stop = true;
+			} else if (events[i].data.fd == evfd) {
+				/* Lost some, check all cached tasks */
+				if (task_events_read(evfd, handle_task_event,
+						     NULL) == -ENOBUFS)
+					task_cache_prune();
+			} else if (events[i].data.fd == listenfd) {
+				int connfd = accept4(listenfd, NULL, NULL,
+						     SOCK_CLOEXEC);
+				if (connfd == -1) {
+					ulp_warning("accept: %m\n");
+					continue;
+				}
+				handle_client(connfd);
+				close(connfd);
+			}
+		}
+
+		if (nr_patch_pids)
+			patch_new_tasks();
+		if (nr_warm_pids)
+			warm_watched_tasks();
+
+		if (nsecs() - last_prune > PRUNE_INTERVAL_MS * 1000000UL) {
+			task_cache_prune();
+			ckpt_save();
+			last_prune = nsecs();
+		}
+	}
+
+	ckpt_save();
+	task_cache_enable(0, 0);
+	free(fleet_entries);
+	free(ckpt_last);
+	task_events_close(evfd);
+	close(listenfd);
+	unlink(sock_path);
+close:
+	close(epollfd);
+	close(sigfd);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	COMMON_RESET_BEFORE_PARSE_ARGS(ulpatchd_args_reset);
+
+	ret = parse_config(argc, argv);
+	if (ret == CMD_RETURN_SUCCESS_VALUE)
+		return 0;
+	if (ret)
+		return ret;
+
+	COMMON_IN_MAIN_AFTER_PARSE_ARGS();
+
+	if (client_cmd)
+		return run_client();
+	if (fleet_client)
+		return run_fleet_client();
+
+	ulpatch_init();
+	daemon_verbose = get_verbose();
+
+	if (policy_file && load_policies(policy_file)) {
+		free_policies();
+		return 1;
+	}
+
+	ret = run_daemon();
+
+	free_policies();
+	return ret;
+}
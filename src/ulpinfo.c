@@ -6,6 +6,9 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <elf/elf-api.h>
 
@@ -15,21 +18,57 @@
 #include <utils/log.h>
 #include <utils/list.h>
 #include <utils/compiler.h>
+#include <utils/clock.h>
 #include <task/task.h>
 #include <utils/cmds.h>
+#include <utils/ulpatchd.h>
+#include <utils/emit.h>
 
 #include <args-common.c>
 
 
 static const char *prog_name = "ulpinfo";
 
+enum {
+	ARG_MIN = ARG_COMMON_MAX,
+	ARG_FORMAT,
+	ARG_ALL,
+	ARG_STATS,
+	ARG_BPF,
+	ARG_VERIFY,
+	ARG_GC,
+	ARG_WARM_CACHE,
+};
+
 static char *patch_file = NULL;
 static pid_t pid = 0;
+static enum emit_format output_format = EMIT_TEXT;
+static bool scan_all = false;
+static bool show_stats = false;
+static bool scan_bpf = false;
+static bool verify_text = false;
+static bool proc_gc = false;
+/* The FILE arguments of --warm-cache, the remaining of argv */
+static bool warm_cache = false;
+static char **warm_files = NULL;
+static int nr_warm_files = 0;
+/* 0 means the number of online CPUs */
+static int max_jobs = 0;
 
 static void ulpinfo_args_reset(void)
 {
 	patch_file = NULL;
 	pid = 0;
+	output_format = EMIT_TEXT;
+	scan_all = false;
+	show_stats = false;
+	scan_bpf = false;
+	verify_text = false;
+	proc_gc = false;
+	warm_cache = false;
+	warm_files = NULL;
+	nr_warm_files = 0;
+	max_jobs = 0;
 }
 
 static int print_help(void)
@@ -45,9 +84,44 @@ static int print_help(void)
 	"\n"
 	" Option argument:\n"
 	"\n"
-	"  -i, --patch [FILE]  specify an patch file to check\n"
+	"  -i, --patch [FILE]  specify an patch file to check, with -v, also\n"
+	"                      display the relocations of it.\n"
 	"\n"
 	"  -p, --pid [PID]     list all patches in specified PID process\n"
+	"\n"
+	"  --all               list all patches of all processes on host, only\n"
+	"                      the maps and patch info sections are read, no\n"
+	"                      symbols are loaded.\n"
+	"\n"
+	"  --bpf               read the maps of all processes of --all by one\n"
+	"                      pass of BPF task_vma iterator, fall back to\n"
+	"                      /proc if not supported.\n"
+	"\n"
+	"  --stats             display the calls of every patched function of\n"
+	"                      -p, the patch must be loaded by ulpatch\n"
+	"                      --counter.\n"
+	"\n"
+	"  --verify            compare the text of every r-x VMA of the mapped\n"
+	"                      files of -p with the files, display the\n"
+	"                      differing ranges, exit 1 if any.\n"
+	"\n"
+	"  --gc                remove the /tmp/ulpatch/PID directories of the\n"
+	"                      exited processes.\n"
+	"\n"
+	"  --warm-cache [FILE]...\n"
+	"                      parse the ELF FILEs, or the mapped files of all\n"
+	"                      processes with --all, in parallel, and save the\n"
+	"                      symbol caches of them by Build ID, such as at\n"
+	"                      package install time.\n"
+	"\n"
+	"  -j, --jobs [NUM]    scan processes of --all, verify the text of\n"
+	"                      --verify, or remove the directories of --gc by\n"
+	"                      NUM threads, default is the number of online\n"
+	"                      CPUs.\n"
+	"\n"
+	"  --format FORMAT     output format, 'text'(default), 'json', one\n"
+	"                      JSON record per line, or 'msgpack', one\n"
+	"                      MessagePack map after another.\n"
 	"\n");
 	print_usage_common(prog_name);
 	cmd_exit_success();
@@ -59,14 +133,22 @@ static int parse_config(int argc, char *argv[])
 	struct option options[] = {
 		{ "patch",          required_argument, 0, 'i' },
 		{ "pid",            required_argument, 0, 'p' },
+		{ "format",         required_argument, 0, ARG_FORMAT },
+		{ "all",            no_argument,       0, ARG_ALL },
+		{ "stats",          no_argument,       0, ARG_STATS },
+		{ "bpf",            no_argument,       0, ARG_BPF },
+		{ "verify",         no_argument,       0, ARG_VERIFY },
+		{ "gc",             no_argument,       0, ARG_GC },
+		{ "warm-cache",     no_argument,       0, ARG_WARM_CACHE },
+		{ "jobs",           required_argument, 0, 'j' },
 		COMMON_OPTIONS
 		{ NULL }
 	};
 
 	while (1) {
-		int c;
+		int c, fmt;
 		int option_index = 0;
-		c = getopt_long(argc, argv, "i:p:"COMMON_GETOPT_OPTSTRING,
+		c = getopt_long(argc, argv, "i:p:j:"COMMON_GETOPT_OPTSTRING,
 				options, &option_index);
 		if (c < 0)
 			break;
@@ -78,6 +160,39 @@ static int parse_config(int argc, char *argv[])
 		case 'p':
 			pid = atoi(optarg);
 			break;
+		case ARG_FORMAT:
+			fmt = emit_format_parse(optarg);
+			if (fmt < 0) {
+				fprintf(stderr, "Invalid format %s.\n", optarg);
+				cmd_exit(1);
+			}
+			output_format = fmt;
+			break;
+		case ARG_ALL:
+			scan_all = true;
+			break;
+		case ARG_STATS:
+			show_stats = true;
+			break;
+		case ARG_BPF:
+			scan_bpf = true;
+			break;
+		case ARG_VERIFY:
+			verify_text = true;
+			break;
+		case ARG_GC:
+			proc_gc = true;
+			break;
+		case ARG_WARM_CACHE:
+			warm_cache = true;
+			break;
+		case 'j':
+			max_jobs = atoi(optarg);
+			if (max_jobs <= 0) {
+				fprintf(stderr, "Invalid jobs %s.\n", optarg);
+				cmd_exit(1);
+			}
+			break;
 		COMMON_GETOPT_CASES(prog_name, print_help, argv)
 		default:
 			print_help();
@@ -86,14 +201,111 @@ static int parse_config(int argc, char *argv[])
 		}
 	}
 
+	if (optind < argc) {
+		warm_files = &argv[optind];
+		nr_warm_files = argc - optind;
+	}
+
 	return 0;
 }
 
+static int emit_patch_info(struct load_info *info)
+{
+	struct emitter e;
+	int err;
+
+	err = emit_open(&e, stdout, output_format);
+	if (err)
+		return err;
+
+	emit_map(&e, 3);
+	emit_kv_str(&e, "file", patch_file);
+	emit_kv_str(&e, "build_id", info->str_build_id);
+	emit_key(&e, "funcs");
+	emit_ulp_funcs(&e, info->ulp_strtabs, info->ulp_info, info->nr_funcs);
+
+	return emit_close(&e);
+}
+
+/* One record for each patch, same order of the text */
+static int emit_task_patch_info(struct task_struct *task)
+{
+	struct emitter e;
+	struct vma_ulp *ulp;
+	int i = 1, err;
+
+	err = emit_open(&e, stdout, output_format);
+	if (err)
+		return err;
+
+	list_for_each_entry(ulp, &task->ulp_list, node) {
+		emit_map(&e, 12);
+		emit_kv_s64(&e, "pid", task->pid);
+		emit_kv_str(&e, "exe", task->exe);
+		emit_kv_s64(&e, "num", i++);
+		emit_kv_u64(&e, "id", ulp->info.ulp_id);
+		emit_kv_u64(&e, "time", ulp->info.time);
+		emit_kv_u64(&e, "start", ulp->start);
+		emit_kv_u64(&e, "len", ulp->len);
+		emit_kv_s64(&e, "slot", ulp->slot);
+		emit_kv_str(&e, "build_id", ulp->str_build_id);
+		emit_kv_str(&e, "vma", ulp->vma->name_);
+		/* Not the pid if inherited from parent by fork(2) */
+		emit_kv_s64(&e, "owner", ulp_vma_owner(ulp->vma->name_));
+		emit_key(&e, "funcs");
+		if (ulp->infos)
+			emit_ulp_funcs(&e, ulp->strtabs, ulp->infos,
+				       ulp->nr_funcs);
+		else
+			emit_ulp_funcs(&e, &ulp->strtab, &ulp->info, 1);
+	}
+
+	return emit_close(&e);
+}
+
+/* Decoded by handle_relocs_all(), same as readelf -r */
+static int print_patch_relocs(FILE *fp, const char *file)
+{
+	struct elf_file *elf;
+	struct elf_rela_sec *sec;
+	struct elf_rela *r;
+	int i, j, err;
+
+	elf = elf_file_open(file);
+	if (!elf) {
+		ulp_error("Open ELF %s failed.\n", file);
+		return -ENOENT;
+	}
+
+	err = handle_relocs_all(elf);
+	if (err)
+		ulp_warning("Decode relocations of %s failed.\n", file);
+
+	for (i = 0; i < elf->nr_relas; i++) {
+		sec = &elf->relas[i];
+		fprintf(fp, "\tRelocation section '%s' at index %zu, %d entries:\n",
+			sec->name ?: "?", sec->index, sec->nr);
+		fprintf(fp, "\t  %-16s %-20s %-16s %s\n", "Offset", "Type",
+			"Value", "Name + Addend");
+		for (j = 0; j < sec->nr; j++) {
+			r = &sec->entries[j];
+			fprintf(fp, "\t  %016lx %-20s %016lx %s %+ld\n",
+				(unsigned long)r->offset,
+				rela_type_string(r->type),
+				(unsigned long)r->value, r->name ?: "",
+				(long)r->addend);
+		}
+	}
+
+	elf_file_close(file);
+	return err;
+}
+
 int show_patch_info(void)
 {
 	int err;
-	struct load_info info;
-	char *tmp_ulp = "temp.ulp";
+	unsigned int i;
+	struct load_info info = {};
 
 	if (!patch_file) {
 		fprintf(stderr, "Must specify --patch\n");
@@ -104,7 +316,8 @@ int show_patch_info(void)
 		cmd_exit(1);
 	}
 
-	err = alloc_patch_file(patch_file, tmp_ulp, &info);
+	/* Read only, no temp ulp file is needed */
+	err = open_patch_file(patch_file, &info);
 	if (err) {
 		ulp_error("Parse %s failed.\n", patch_file);
 		return err;
@@ -112,30 +325,45 @@ int show_patch_info(void)
 
 	setup_load_info(&info);
 
+	if (output_format != EMIT_TEXT) {
+		err = emit_patch_info(&info);
+		release_load_info(&info);
+		return err;
+	}
+
 	fprintf(stdout, "\tFile: %s\n", patch_file);
-	print_ulp_strtab(stdout, "\t", &info.ulp_strtab);
-	print_ulp_info(stdout, "\t", info.ulp_info);
+	for (i = 0; i < info.nr_funcs; i++) {
+		print_ulp_strtab(stdout, "\t", &info.ulp_strtabs[i]);
+		print_ulp_info(stdout, "\t", &info.ulp_info[i]);
+	}
 	fprintf(stdout, "\tBuildID    : %s\n", info.str_build_id);
 
-	release_load_info(&info);
+	if (is_verbose())
+		err = print_patch_relocs(stdout, patch_file);
 
-	fremove(tmp_ulp);
+	release_load_info(&info);
 
-	return 0;
+	return err;
 }
 
 int show_task_patch_info(pid_t pid)
 {
-	int i = 1;
+	int i = 1, j, err = 0;
+	pid_t owner;
 	struct task_struct *task;
 	struct vma_ulp *ulp, *tmpulp;
 
-	task = open_task(pid, FTO_ALL & ~FTO_RDWR);
+	task = open_task(pid, FTO_ULPINFO);
 	if (!task) {
 		ulp_error("Open pid=%d task failed.\n", pid);
 		return -ENOENT;
 	}
 
+	if (output_format != EMIT_TEXT) {
+		err = emit_task_patch_info(task);
+		goto free;
+	}
+
 	if (list_empty(&task->ulp_list)) {
 		fprintf(stdout, "No ULPatch founded in process %d\n", pid);
 		goto free;
@@ -159,7 +387,7 @@ int show_task_patch_info(pid_t pid)
 		struct vm_area_struct *vma = ulp->vma;
 		printf("%-4d %-4d %-20s %#016lx %-16s",
 			i, ulp->info.ulp_id, ulp_info_strftime(&ulp->info),
-			vma->vm_start, ulp->strtab.dst_func);
+			ulp->start, ulp->strtab.dst_func);
 
 		if (is_verbose())
 			printf(" %-41s", ulp->str_build_id);
@@ -169,8 +397,22 @@ int show_task_patch_info(pid_t pid)
 		if (is_verbose()) {
 			fpansi_gray(stdout);
 			print_vma(stdout, false, vma, 0);
-			print_ulp_strtab(stdout, "\t", &ulp->strtab);
-			print_ulp_info(stdout, "\t", &ulp->info);
+			if (ulp->slot >= 0)
+				fprintf(stdout, "\tPool slot %d, len %ld\n",
+					ulp->slot, ulp->len);
+			owner = ulp_vma_owner(vma->name_);
+			if (owner && owner != pid)
+				fprintf(stdout, "\tInherited from %d, %s\n",
+					owner, verify_patch(task, ulp) ?
+					"broken" : "intact");
+			if (!ulp->infos) {
+				print_ulp_strtab(stdout, "\t", &ulp->strtab);
+				print_ulp_info(stdout, "\t", &ulp->info);
+			}
+			for (j = 0; ulp->infos && j < ulp->nr_funcs; j++) {
+				print_ulp_strtab(stdout, "\t", &ulp->strtabs[j]);
+				print_ulp_info(stdout, "\t", &ulp->infos[j]);
+			}
 			fprintf(stdout, "\n");
 			fpansi_reset(stdout);
 		}
@@ -179,9 +421,397 @@ int show_task_patch_info(pid_t pid)
 
 free:
 	close_task(task);
+	return err;
+}
+
+/**
+ * The calls of every function, the counters of one patch are read by one
+ * remote read, see read_patch_counters().
+ */
+static int show_task_patch_stats(pid_t pid)
+{
+	unsigned long counts[ULPATCH_MAX_FUNCS];
+	struct ulpatch_strtab *strtabs;
+	struct task_struct *task;
+	struct vma_ulp *ulp;
+	struct emitter e;
+	unsigned int i, nr;
+	int err, ret;
+
+	task = open_task(pid, FTO_ULPINFO);
+	if (!task) {
+		ulp_error("Open pid=%d task failed.\n", pid);
+		return -ENOENT;
+	}
+
+	err = emit_open(&e, stdout, output_format);
+	if (err)
+		goto free;
+
+	if (output_format == EMIT_TEXT)
+		printf("%-4s %-24s %-24s %s\n", "ID", "SRC_FUNC", "DST_FUNC",
+		       "CALLS");
+
+	list_for_each_entry(ulp, &task->ulp_list, node) {
+		nr = ulp->infos ? ulp->nr_funcs : 1;
+		strtabs = ulp->infos ? ulp->strtabs : &ulp->strtab;
+		ret = nr <= ULPATCH_MAX_FUNCS ?
+			read_patch_counters(task, ulp, counts) : -E2BIG;
+
+		for (i = 0; i < nr; i++) {
+			if (output_format == EMIT_TEXT) {
+				printf("%-4d %-24s %-24s ", ulp->info.ulp_id,
+				       strtabs[i].src_func,
+				       strtabs[i].dst_func);
+				if (ret)
+					printf("-\n");
+				else
+					printf("%lu\n", counts[i]);
+				continue;
+			}
+			emit_map(&e, 5);
+			emit_kv_s64(&e, "pid", task->pid);
+			emit_kv_u64(&e, "id", ulp->info.ulp_id);
+			emit_kv_str(&e, "src_func", strtabs[i].src_func);
+			emit_kv_str(&e, "dst_func", strtabs[i].dst_func);
+			/* null if not loaded with counters */
+			emit_key(&e, "calls");
+			if (ret)
+				emit_nil(&e);
+			else
+				emit_u64(&e, counts[i]);
+		}
+	}
+
+	err = emit_close(&e);
+free:
+	close_task(task);
+	return err;
+}
+
+/**
+ * The text differs from the file, such as the patched functions, the
+ * breakpoints of debugger and uprobes, or the code modified by others.
+ * Return 1 if any range differs.
+ */
+static int show_task_text_verify(pid_t pid)
+{
+	struct task_verify_stats stats;
+	struct task_text_diff *diffs, *d;
+	struct task_struct *task;
+	unsigned long off;
+	struct emitter e;
+	ssize_t nr, i;
+	int err;
+
+	task = open_task(pid, FTO_NONE);
+	if (!task) {
+		ulp_error("Open pid=%d task failed.\n", pid);
+		return -ENOENT;
+	}
+
+	nr = task_verify_text(task, max_jobs ?: sysconf(_SC_NPROCESSORS_ONLN),
+			      &diffs, &stats);
+	if (nr < 0) {
+		ulp_error("Verify pid=%d failed, %s\n", pid, strerror(-nr));
+		err = nr;
+		goto free;
+	}
+
+	err = emit_open(&e, stdout, output_format);
+	if (err)
+		goto free_diffs;
+
+	if (output_format == EMIT_TEXT)
+		printf("%-18s %-18s %-10s %-10s %s\n", "START", "END", "OFFSET",
+		       "BYTES", "VMA");
+
+	for (i = 0; i < nr; i++) {
+		d = &diffs[i];
+		off = (d->vma->vm_pgoff << PAGE_SHIFT) +
+			(d->start - d->vma->vm_start);
+		if (output_format == EMIT_TEXT) {
+			printf("%#018lx %#018lx %#-10lx %-10lu %s\n", d->start,
+			       d->end, off, d->end - d->start, d->vma->name_);
+			continue;
+		}
+		emit_map(&e, 6);
+		emit_kv_s64(&e, "pid", task->pid);
+		emit_kv_u64(&e, "start", d->start);
+		emit_kv_u64(&e, "end", d->end);
+		emit_kv_u64(&e, "offset", off);
+		emit_kv_u64(&e, "bytes", d->end - d->start);
+		emit_kv_str(&e, "vma", d->vma->name_);
+	}
+
+	err = emit_close(&e);
+	if (output_format == EMIT_TEXT)
+		printf("%zd ranges, %lu of %lu bytes of %u VMAs differ, %u "
+		       "skipped, %lu bytes unreadable.\n", nr, stats.diff_bytes,
+		       stats.bytes, stats.nr_vmas, stats.skipped,
+		       stats.unreadable);
+	if (!err && nr)
+		err = 1;
+free_diffs:
+	free(diffs);
+free:
+	close_task(task);
+	return err;
+}
+
+/* Same keys as emit_task_patch_info() */
+static int emit_scan(struct ulp_scan *scan)
+{
+	struct ulp_scan_task *st;
+	struct ulp_scan_patch *p;
+	struct emitter e;
+	unsigned int i;
+	int num, err;
+
+	err = emit_open(&e, stdout, output_format);
+	if (err)
+		return err;
+
+	for (i = 0; i < scan->nr_tasks; i++) {
+		st = &scan->tasks[i];
+		num = 1;
+		list_for_each_entry(p, &st->patches, node) {
+			emit_map(&e, 12);
+			emit_kv_s64(&e, "pid", p->pid);
+			emit_kv_str(&e, "exe", st->exe);
+			emit_kv_s64(&e, "num", num++);
+			emit_kv_u64(&e, "id", p->infos[0].ulp_id);
+			emit_kv_u64(&e, "time", p->infos[0].time);
+			emit_kv_u64(&e, "start", p->start);
+			emit_kv_u64(&e, "len", p->len);
+			emit_kv_s64(&e, "slot", p->slot);
+			emit_kv_str(&e, "build_id", p->str_build_id);
+			emit_kv_str(&e, "vma", p->vma);
+			emit_kv_s64(&e, "owner", p->owner);
+			emit_key(&e, "funcs");
+			emit_ulp_funcs(&e, p->strtabs, p->infos, p->nr_funcs);
+		}
+	}
+
+	return emit_close(&e);
+}
+
+static void print_scan(struct ulp_scan *scan)
+{
+	struct ulp_scan_task *st;
+	struct ulp_scan_patch *p;
+	unsigned int i, nr_tasks = 0, nr_patches = 0;
+
+	fpansi_bold(stdout);
+	fpansi_reverse(stdout);
+	printf("%-8s %-4s %-20s %-16s %-16s", "PID", "ID", "DATE",
+	       "VMA_START", "TARGET_FUNC");
+	if (is_verbose())
+		printf(" %-41s", "Build ID");
+	printf(" %s", "EXE");
+	fpansi_reset(stdout);
+	printf("\n");
+
+	for (i = 0; i < scan->nr_tasks; i++) {
+		st = &scan->tasks[i];
+		if (!st->nr_patches)
+			continue;
+		nr_tasks++;
+		nr_patches += st->nr_patches;
+
+		list_for_each_entry(p, &st->patches, node) {
+			printf("%-8d %-4d %-20s %#016lx %-16s", p->pid,
+			       p->infos[0].ulp_id,
+			       ulp_info_strftime(&p->infos[0]), p->start,
+			       p->strtabs[0].dst_func);
+			if (is_verbose())
+				printf(" %-41s", p->str_build_id);
+			printf(" %s\n", st->exe ?: "?");
+		}
+	}
+
+	printf("%u patches in %u of %u processes, %u unreadable.\n",
+	       nr_patches, nr_tasks, scan->nr_tasks, scan->nr_errors);
+}
+
+int show_all_patch_info(void)
+{
+	struct ulp_scan scan;
+	int err;
+
+	ulp_scan_bpf_enable(scan_bpf);
+	err = ulp_scan_all(&scan, max_jobs);
+	if (err) {
+		ulp_error("Scan processes failed, %s\n", strerror(-err));
+		goto free;
+	}
+
+	if (output_format != EMIT_TEXT)
+		err = emit_scan(&scan);
+	else
+		print_scan(&scan);
+
+free:
+	ulp_scan_free(&scan);
+	return err;
+}
+
+static int gc_task_proc(void)
+{
+	struct task_proc_gc_stats stats;
+	int err;
+
+	err = task_proc_gc(max_jobs, &stats);
+	if (err) {
+		ulp_error("GC %s failed, %s\n", ULP_PROC_ROOT_DIR,
+			  strerror(-err));
+		return err;
+	}
+
+	printf("Removed %u of %u directories, %u failed.\n",
+	       stats.nr_removed, stats.nr_dirs, stats.nr_errors);
+	return stats.nr_errors ? -EIO : 0;
+}
+
+/* Unique ELF files of --warm-cache, by device and inode */
+struct warm_set {
+	char **names;
+	struct stat *sts;
+	int nr, max;
+};
+
+static int warm_add(struct warm_set *ws, const char *name)
+{
+	struct stat st;
+	void *p;
+	int i;
+
+	if (stat(name, &st) || !S_ISREG(st.st_mode))
+		return -ENOENT;
+
+	for (i = 0; i < ws->nr; i++) {
+		if (ws->sts[i].st_dev == st.st_dev &&
+		    ws->sts[i].st_ino == st.st_ino)
+			return 0;
+	}
+
+	if (ws->nr == ws->max) {
+		ws->max = ws->max ? ws->max * 2 : 64;
+		p = realloc(ws->names, ws->max * sizeof(*ws->names));
+		if (!p)
+			return -ENOMEM;
+		ws->names = p;
+		p = realloc(ws->sts, ws->max * sizeof(*ws->sts));
+		if (!p)
+			return -ENOMEM;
+		ws->sts = p;
+	}
+
+	ws->names[ws->nr] = strdup(name);
+	if (!ws->names[ws->nr])
+		return -ENOMEM;
+	ws->sts[ws->nr++] = st;
 	return 0;
 }
 
+/**
+ * The executable mapped files of all processes, under /proc/PID/root, the
+ * same file of processes in different mount namespaces is added once.
+ */
+static void warm_add_running(struct warm_set *ws)
+{
+	char path[PATH_MAX], *line = NULL, *name;
+	size_t len = 0;
+	struct dirent *ent;
+	char perms[5];
+	DIR *dir;
+	FILE *fp;
+	int n;
+
+	dir = opendir("/proc");
+	if (!dir)
+		return;
+
+	while ((ent = readdir(dir))) {
+		if (!atoi(ent->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%s/maps", ent->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+
+		while (getline(&line, &len, fp) > 0) {
+			n = 0;
+			if (sscanf(line, "%*x-%*x %4s %*s %*s %*s %n", perms,
+				   &n) != 1 || !n || perms[2] != 'x')
+				continue;
+			name = line + n;
+			name[strcspn(name, "\n")] = '\0';
+			if (name[0] != '/' || strstr(name, " (deleted)"))
+				continue;
+			snprintf(path, sizeof(path), "/proc/%s/root%s",
+				 ent->d_name, name);
+			warm_add(ws, path);
+		}
+		fclose(fp);
+	}
+
+	free(line);
+	closedir(dir);
+}
+
+/* Files of one bfd_elf_preload(), bound the memory of opened ones */
+#define WARM_BATCH	(BFD_ELF_PRELOAD_MAX_THREADS * 4)
+
+/**
+ * Fill the symbol caches, see ULP_SYM_CACHE_DIR, the files are opened in
+ * parallel by bfd_elf_preload(), which saves the cache of every file
+ * parsed, then they are closed, and evicted by the budget of memory, see
+ * bfd_elf_cache_set_budget().
+ */
+static int warm_symbol_cache(void)
+{
+	struct warm_set ws = {};
+	struct bfd_elf_file *file;
+	unsigned long start = nsecs();
+	int i, j, n, nr_failed = 0;
+
+	for (i = 0; i < nr_warm_files; i++) {
+		if (warm_add(&ws, warm_files[i])) {
+			fprintf(stderr, "%s is not a file.\n", warm_files[i]);
+			nr_failed++;
+		}
+	}
+	if (scan_all)
+		warm_add_running(&ws);
+
+	for (i = 0; i < ws.nr; i += n) {
+		n = MIN(ws.nr - i, WARM_BATCH);
+		bfd_elf_preload((const char **)&ws.names[i], n);
+
+		for (j = i; j < i + n; j++) {
+			file = bfd_elf_open(ws.names[j]);
+			if (!file) {
+				ulp_debug("Open %s failed.\n", ws.names[j]);
+				nr_failed++;
+				continue;
+			}
+			bfd_elf_close(file);
+		}
+	}
+
+	printf("Warm %d files in %.3f s, %d failed, cache %s.\n", ws.nr,
+	       (nsecs() - start) / 1000000000.0, nr_failed,
+	       ULP_SYM_CACHE_DIR);
+
+	for (i = 0; i < ws.nr; i++)
+		free(ws.names[i]);
+	free(ws.names);
+	free(ws.sts);
+	return nr_failed ? -EIO : 0;
+}
+
 int ulpinfo(int argc, char *argv[])
 {
 	int ret;
@@ -200,23 +830,56 @@ int ulpinfo(int argc, char *argv[])
 
 	ulpatch_init();
 
-	if (!patch_file && !pid) {
-		fprintf(stderr, "Must specify ulp file or pid, see -h.\n");
+	if (!patch_file && !pid && !scan_all && !proc_gc && !warm_cache) {
+		fprintf(stderr, "Must specify ulp file, pid, --all, --gc or "
+			"--warm-cache, see -h.\n");
 		return -EINVAL;
 	}
 
+	if (nr_warm_files && !warm_cache) {
+		fprintf(stderr, "FILE arguments need --warm-cache, see -h.\n");
+		return -EINVAL;
+	}
+
+	if (proc_gc)
+		return gc_task_proc();
+
+	if (warm_cache)
+		return warm_symbol_cache();
+
 	if (patch_file)
 		show_patch_info();
 
-	if (pid)
+	if (verify_text && !pid) {
+		fprintf(stderr, "--verify needs -p, see -h.\n");
+		return -EINVAL;
+	}
+
+	if (pid && verify_text)
+		return show_task_text_verify(pid);
+	else if (pid && show_stats)
+		show_task_patch_stats(pid);
+	else if (pid)
 		show_task_patch_info(pid);
 
+	if (scan_all)
+		return show_all_patch_info();
+
 	return 0;
 }
 
 #if defined(ULP_CMD_MAIN)
 int main(int argc, char *argv[])
 {
+	int ret;
+
+	/* Run in ulpatchd(8) if ULPATCHD_SOCK is set */
+	if (!ulpatchd_client_run(prog_name, argc, argv, &ret))
+		return ret;
+
+	/* Only one task, closed before exit */
+	close_task_fast_enable(true);
+
 	return ulpinfo(argc, argv);
 }
 #endif
@@ -8,6 +8,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <signal.h>
+#include <sys/syscall.h>
 
 #include <elf/elf-api.h>
 
@@ -18,6 +20,8 @@
 #include <utils/disasm.h>
 #include <utils/compiler.h>
 #include <utils/cmds.h>
+#include <utils/ulpatchd.h>
+#include <utils/emit.h>
 
 #include <patch/patch.h>
 
@@ -28,6 +32,7 @@ enum {
 	ARG_MIN = ARG_COMMON_MAX,
 	ARG_JMP,
 	ARG_VMAS,
+	ARG_RESIDENCY,
 	ARG_DUMP,
 	ARG_MAP,
 	ARG_MPROTECT,
@@ -36,7 +41,19 @@ enum {
 	ARG_FDS,
 	ARG_AUXV,
 	ARG_STATUS,
+	ARG_LINK_MAP,
 	ARG_LIST_SYMBOLS,
+	ARG_SNAPSHOT,
+	ARG_SOFT_DIRTY,
+	ARG_FORMAT,
+	ARG_SYM_FILTER,
+	ARG_SYM_VMA,
+	ARG_SYM_DEMANGLE,
+	ARG_SEARCH,
+	ARG_BATCH,
+	ARG_DECODE,
+	ARG_DEPTH,
+	ARG_WATCH,
 };
 
 enum {
@@ -44,6 +61,8 @@ enum {
 	DUMP_DISASM_OPTION,
 	DUMP_ADDR_OPTION,
 	DUMP_SIZE_OPTION,
+	DUMP_JOBS_OPTION,
+	DUMP_SPARSE_OPTION,
 	DUMP_END_NULL_OPTION,
 };
 
@@ -52,9 +71,35 @@ char *const dump_opts[] = {
 	[DUMP_DISASM_OPTION] = "disasm",
 	[DUMP_ADDR_OPTION] = "addr",
 	[DUMP_SIZE_OPTION] = "size",
+	[DUMP_JOBS_OPTION] = "jobs",
+	[DUMP_SPARSE_OPTION] = "sparse",
 	[DUMP_END_NULL_OPTION] = NULL,
 };
 
+enum {
+	SNAPSHOT_SOFT_DIRTY_OPTION,
+	SNAPSHOT_JOBS_OPTION,
+	END_SNAPSHOT_OPTION,
+};
+
+char *const snapshot_opts[] = {
+	[SNAPSHOT_SOFT_DIRTY_OPTION] = "soft-dirty",
+	[SNAPSHOT_JOBS_OPTION] = "jobs",
+	[END_SNAPSHOT_OPTION] = NULL,
+};
+
+enum {
+	SOFT_DIRTY_CLEAR_OPTION,
+	SOFT_DIRTY_ADDR_OPTION,
+	END_SOFT_DIRTY_OPTION,
+};
+
+char *const soft_dirty_opts[] = {
+	[SOFT_DIRTY_CLEAR_OPTION] = "clear",
+	[SOFT_DIRTY_ADDR_OPTION] = "addr",
+	[END_SOFT_DIRTY_OPTION] = NULL,
+};
+
 enum {
 	JMP_FROM_OPTION,
 	JMP_TO_OPTION,
@@ -107,6 +152,7 @@ static pid_t target_pid = -1;
 
 static bool flag_print_task = true;
 static bool flag_print_vmas = false;
+static bool flag_residency = false;
 static bool flag_dump_vma = false;
 static bool flag_dump_addr = false;
 static bool flag_unmap_vma = false;
@@ -121,29 +167,63 @@ static unsigned long mprotect_prot = PROT_NONE | PROT_READ | PROT_WRITE | PROT_E
 static unsigned long vma_addr = 0;
 static unsigned long dump_addr = 0;
 static unsigned long dump_size = 0;
+/* DUMP_F_* */
+static unsigned int dump_flags = 0;
 static unsigned long jmp_addr_from = 0;
 static unsigned long jmp_addr_to = 0;
 static bool flag_list_symbols = false;
+/* Filter of --syms, regex of name and fnmatch(3) pattern of VMA */
+static const char *sym_filter = NULL;
+static const char *sym_vma = NULL;
+static bool flag_sym_demangle = false;
+/* The bytes of --search, and the length */
+static void *search_pat = NULL;
+static size_t search_len = 0;
+/* --decode TYPE@ADDR, the type is in argv */
+static const char *decode_type = NULL;
+static unsigned long decode_addr = 0;
+static int decode_depth = 1;
 static bool flag_print_threads = false;
 static bool flag_print_fds = false;
 static bool flag_print_auxv = false;
 static bool flag_print_status = false;
+static bool flag_print_link_map = false;
 static bool flag_disasm = false;
 static unsigned long disasm_addr = 0;
 static unsigned long disasm_size = 0;
+/* -1 means not parallel, 0 means number of CPUs */
+static int disasm_jobs = -1;
+static bool flag_snapshot = false;
+/* SNAPSHOT_F_* */
+static unsigned int snapshot_flags = 0;
+/* 0 means number of CPUs */
+static int snapshot_jobs = 0;
+static bool flag_soft_dirty = false;
+static bool soft_dirty_clear = false;
+static unsigned long soft_dirty_addr = 0;
+/* Interval of --watch in milliseconds, 0 means no watch */
+#define ULTASK_WATCH_MS	1000
+static unsigned long watch_ms = 0;
+/* Nothing but --watch, the VMAs of /proc/PID/maps are enough */
+static bool watch_only = false;
+static volatile sig_atomic_t watch_stop = 0;
 static const char *output_file = NULL;
+/* Format of --vmas and --syms */
+static enum emit_format output_format = EMIT_TEXT;
 /* Default: read only */
 static bool flag_rdonly = true;
+/* Operations of --batch, one for each line, '-' is stdin */
+static const char *batch_file = NULL;
+/* All operations of --batch run in one attach session */
+static bool in_batch = false;
 
 static struct task_struct *target_task = NULL;
 
 static const char *prog_name = "ultask";
 
-static void ultask_args_reset(void)
+/* The arguments of operations, which are also the steps of --batch */
+static void reset_op_args(void)
 {
-	target_pid = -1;
-	flag_print_task = true;
-	flag_print_vmas = false;
 	flag_dump_vma = false;
 	flag_dump_addr = false;
 	flag_unmap_vma = false;
@@ -158,19 +238,52 @@ static void ultask_args_reset(void)
 	vma_addr = 0;
 	dump_addr = 0;
 	dump_size = 0;
+	dump_flags = 0;
 	jmp_addr_from = 0;
 	jmp_addr_to = 0;
+	flag_disasm = false;
+	disasm_addr = 0;
+	disasm_size = 0;
+	disasm_jobs = -1;
+}
+
+static void ultask_args_reset(void)
+{
+	target_pid = -1;
+	flag_print_task = true;
+	flag_print_vmas = false;
+	flag_residency = false;
+	reset_op_args();
 	flag_list_symbols = false;
+	sym_filter = NULL;
+	sym_vma = NULL;
+	flag_sym_demangle = false;
+	search_pat = NULL;
+	search_len = 0;
+	decode_type = NULL;
+	decode_addr = 0;
+	decode_depth = 1;
 	flag_print_threads = false;
 	flag_print_fds = false;
 	flag_print_auxv = false;
 	flag_print_status = false;
-	flag_disasm = false;
-	disasm_addr = 0;
-	disasm_size = 0;
+	flag_print_link_map = false;
+	flag_snapshot = false;
+	snapshot_flags = 0;
+	snapshot_jobs = 0;
+	flag_soft_dirty = false;
+	soft_dirty_clear = false;
+	soft_dirty_addr = 0;
+	watch_ms = 0;
+	watch_only = false;
+	watch_stop = 0;
 	output_file = NULL;
+	output_format = EMIT_TEXT;
 	flag_rdonly = true;
+	batch_file = NULL;
+	in_batch = false;
 	target_task = NULL;
+	task_reset_err_stats();
 }
 
 static int print_help(void)
@@ -186,7 +299,7 @@ static int print_help(void)
 	"\n"
 	"  -p, --pid [PID]     specify a process identifier(pid_t)\n"
 	"\n"
-	"  --dump [TYPE,addr=ADDR,size=SIZE]\n"
+	"  --dump [TYPE,addr=ADDR,size=SIZE,jobs=N,sparse]\n"
 	"\n"
 	"      TYPE=           type of dump.\n"
 	"\n"
@@ -195,9 +308,15 @@ static int print_help(void)
 	"                      need to specify address of a VMA. check with -v.\n"
 	"                      the input will be take as base 16, default output\n"
 	"                      is stdout, write(2), specify output file with -o.\n"
+	"                      the unreadable pages are dumped as zero, with\n"
+	"                      'sparse', the zero pages are holes of file.\n"
 	"\n"
 	"      TYPE=disasm\n"
 	"                      disassemble a piece of code of target process.\n"
+	"                      with jobs=N, split the code at the symbols, and\n"
+	"                      disassemble it in N threads, 0 means number of\n"
+	"                      CPUs, size= is optional, default is to the end\n"
+	"                      of VMA.\n"
 	"\n"
 	"  --jmp [from=ADDR,to=ADDR]\n"
 	"                      specify a jump entry SRC and DST address\n"
@@ -219,14 +338,77 @@ static int print_help(void)
 	"                      write=PROT_WRITE,exec=PROT_EXEC\n"
 	"\n"
 	"  --vmas              dump vmas\n"
+	"  --residency         with --vmas, print resident, swapped and THP size\n"
+	"                      of each VMA, from /proc/PID/pagemap.\n"
+	"  --watch [=MSEC]     re-read the VMAs every MSEC ms, default %d,\n"
+	"                      until SIGINT, print the inserted, removed and\n"
+	"                      resized ones. with --residency, print the\n"
+	"                      resident and swapped changes of every VMA too.\n"
 	"  --threads           dump threads\n"
 	"  --fds               dump fds\n"
 	"  --auxv              print auxv\n"
 	"  --status            print status\n"
+	"  --link-map          print link_map list of the dynamic linker, the\n"
+	"                      loaded objects and their load bias.\n"
 	"  --syms, --symbols   list all symbols\n"
+	"  --filter REGEX      with --syms, only list the symbols whose name\n"
+	"                      matches the extended regex, such as '^mall'.\n"
+	"  --vma PATTERN       with --syms, only list the symbols of the VMAs\n"
+	"                      whose path or basename matches glob PATTERN,\n"
+	"                      such as 'libc*'. the symbols of other VMAs are\n"
+	"                      never loaded. with --search, only search the\n"
+	"                      VMAs match PATTERN.\n"
+	"  --demangle          with --syms, display the C++ symbols by the\n"
+	"                      demangled name, and match --filter with it,\n"
+	"                      such as '^ns::Class::'.\n"
+	"  --format FORMAT     output format of --vmas and --syms, 'text'\n"
+	"                      (default), 'json', one JSON record per line, or\n"
+	"                      'msgpack', one MessagePack map after another.\n"
+	"\n"
+	"  --search HEX|STRING search the bytes in all readable VMAs, by the\n"
+	"                      threads of the number of CPUs, HEX is 0x and\n"
+	"                      the bytes in memory order, such as 0x7f454c46,\n"
+	"                      print the address, VMA and nearest symbol of\n"
+	"                      every match.\n"
+	"\n"
+	"  --decode TYPE@ADDR  decode the object of TYPE at ADDR by the DWARF\n"
+	"                      of the target, such as 'struct conn@0x1234' or\n"
+	"                      'conn_t@0x1234', follow the pointers to struct\n"
+	"                      and union --depth levels, the objects of one\n"
+	"                      level are read by one process_vm_readv(2).\n"
+	"                      the debuginfo and libdw are needed.\n"
+	"  --depth N           with --decode, levels of pointers to follow, 0\n"
+	"                      is only the object, default 1, at most %d.\n"
+	"\n"
+	"  --snapshot [=soft-dirty,jobs=N]\n"
+	"                      save the memory of all VMAs to an ELF core file,\n"
+	"                      default is core.PID, specify it with -o. the\n"
+	"                      threads are frozen while copying, with soft-dirty,\n"
+	"                      only frozen while copying the dirty pages again.\n"
+	"                      copy in N threads, 0 means number of CPUs.\n"
 	"\n"
-	"  -o, --output        specify output filename.\n"
-	"\n");
+	"  --soft-dirty [=clear,addr=ADDR]\n"
+	"                      list the pages written since the last clear of\n"
+	"                      soft-dirty bits, of all VMAs or the VMA of ADDR,\n"
+	"                      with -o, dump the dirty pages of the VMA of ADDR\n"
+	"                      at their offset, the clean pages are holes.\n"
+	"                      with clear, clear the bits after list or dump.\n"
+	"\n"
+	"  --batch [FILE]      run the operations of FILE, '-' is stdin, one\n"
+	"                      for each line in one attach session, like\n"
+	"                      'map file=FILE,ro', 'unmap ADDR', 'mprotect\n"
+	"                      addr=ADDR,len=SIZE,read', 'jmp from=ADDR,to=ADDR'\n"
+	"                      and 'dump addr=ADDR,size=SIZE OUTPUT', the\n"
+	"                      arguments are the same as the options. print\n"
+	"                      the result of each one, stop at the first\n"
+	"                      failed one.\n"
+	"\n"
+	"  -o, --output        specify output filename, the dump and snapshot\n"
+	"                      are compressed in seekable zstd format if it\n"
+	"                      ends with .zst, libzstd is needed.\n"
+	"\n",
+	ULTASK_WATCH_MS,
+	TASK_DECODE_MAX_DEPTH);
 	printf(
 	" FORMAT\n"
 	"  ADDR: 0x123, 123\n"
@@ -238,15 +420,292 @@ static int print_help(void)
 	return 0;
 }
 
+/* TYPE@ADDR of --decode, the type may have '@' of C++ */
+static int parse_decode(char *arg)
+{
+	char *at = strrchr(arg, '@');
+
+	if (!at || at == arg || !at[1])
+		return -EINVAL;
+	*at = '\0';
+	decode_type = arg;
+	decode_addr = str2addr(at + 1);
+	return decode_addr ? 0 : -EINVAL;
+}
+
+/**
+ * The bytes of --search, 0x and even hex digits are the bytes in memory
+ * order, otherwise the string without the NUL. The buffer is never freed.
+ */
+static void *parse_search_pattern(const char *arg, size_t *len)
+{
+	size_t n = strlen(arg), i;
+	unsigned char *buf;
+	unsigned int byte;
+
+	if (!n)
+		return NULL;
+
+	if (n > 2 && n % 2 == 0 && !strncmp(arg, "0x", 2) &&
+	    strspn(arg + 2, "0123456789abcdefABCDEF") == n - 2) {
+		*len = (n - 2) / 2;
+		buf = malloc(*len);
+		if (!buf)
+			return NULL;
+		for (i = 0; i < *len; i++) {
+			sscanf(arg + 2 + i * 2, "%2x", &byte);
+			buf[i] = byte;
+		}
+		return buf;
+	}
+
+	*len = n;
+	return strdup(arg);
+}
+
+/**
+ * The suboptions of the operations, also the arguments of the steps of
+ * --batch, see run_batch(). Return 0 or the exit code.
+ */
+static int parse_dump_opts(char *subopts)
+{
+	char *value;
+
+	while (*subopts != '\0') {
+		switch (getsubopt(&subopts, dump_opts, &value)) {
+		case DUMP_VMA_OPTION:
+			flag_dump_vma = true;
+			break;
+		case DUMP_DISASM_OPTION:
+			flag_disasm = true;
+			break;
+		case DUMP_ADDR_OPTION:
+			dump_addr = str2addr(value);
+			break;
+		case DUMP_SIZE_OPTION:
+			dump_size = str2size(value);
+			break;
+		case DUMP_SPARSE_OPTION:
+			dump_flags |= DUMP_F_SPARSE;
+			break;
+		case DUMP_JOBS_OPTION:
+			disasm_jobs = value ? atoi(value) : 0;
+			break;
+		default:
+			fprintf(stderr, "unknown option %s of --dump\n", value);
+			return 1;
+		}
+	}
+
+	if (flag_dump_vma && flag_disasm) {
+		fprintf(stderr, "only vma or disasm.\n");
+		return 1;
+	} else if (flag_dump_vma) {
+		if (dump_addr == 0) {
+			fprintf(stderr, "dump vma need addr=.\n");
+			return 1;
+		}
+		vma_addr = dump_addr;
+	} else if (flag_disasm) {
+		if (dump_addr == 0 ||
+		    (dump_size == 0 && disasm_jobs < 0)) {
+			fprintf(stderr, "disasm need addr= and size=\n");
+			return 1;
+		}
+		disasm_addr = dump_addr;
+		disasm_size = dump_size;
+	} else {
+		if (dump_addr == 0 || dump_size == 0) {
+			fprintf(stderr, "dump memory need addr= and size=\n");
+			return 1;
+		}
+		flag_dump_addr = true;
+	}
+	return 0;
+}
+
+static int parse_jmp_opts(char *subopts)
+{
+	char *value;
+
+	while (*subopts != '\0') {
+		switch (getsubopt(&subopts, jmp_opts, &value)) {
+		case JMP_FROM_OPTION:
+			jmp_addr_from = str2addr(value);
+			break;
+		case JMP_TO_OPTION:
+			jmp_addr_to = str2addr(value);
+			break;
+		default:
+			fprintf(stderr, "unknown option %s of --jmp\n", value);
+			return 1;
+		}
+	}
+	flag_rdonly = false;
+	if (jmp_addr_from == 0 || jmp_addr_to == 0) {
+		fprintf(stderr, "jmp need from= and to=\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int parse_map_opts(char *subopts)
+{
+	char *value;
+
+	while (*subopts != '\0') {
+		switch (getsubopt(&subopts, map_opts, &value)) {
+		case MAP_FILE_OPTION:
+			map_file = value;
+			break;
+		case MAP_RO_OPTION:
+			map_ro = true;
+			break;
+		case MAP_NO_EXEC_OPTION:
+			map_noexec = true;
+			break;
+		case MAP_DUMP_ADDR_OPTION:
+			map_addr = str2addr(value);
+			if (map_addr == 0) {
+				fprintf(stderr, "invalid map addr.\n");
+				return EINVAL;
+			}
+			break;
+		default:
+			fprintf(stderr, "unknown option %s of --map\n", value);
+			return 1;
+		}
+	}
+	flag_rdonly = false;
+	if (!map_file) {
+		fprintf(stderr, "map need file=\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int parse_mprotect_opts(char *subopts)
+{
+	bool flag_prot_none = false;
+	char *value;
+
+	mprotect_prot = PROT_NONE;
+	while (*subopts != '\0') {
+		switch (getsubopt(&subopts, mprotect_opts, &value)) {
+		case MPROT_DUMP_ADDR_OPTION:
+			mprotect_addr = str2addr(value);
+			break;
+		case MPROT_LEN_OPTION:
+			mprotect_len = str2addr(value);
+			break;
+		case MPROT_NONE_OPTION:
+			flag_prot_none = true;
+			break;
+		case MPROT_READ_OPTION:
+			mprotect_prot |= PROT_READ;
+			break;
+		case MPROT_WRITE_OPTION:
+			mprotect_prot |= PROT_WRITE;
+			break;
+		case MPROT_EXEC_OPTION:
+			mprotect_prot |= PROT_EXEC;
+			break;
+		default:
+			fprintf(stderr, "unknown option %s of --mprotect\n", value);
+			return 1;
+		}
+	}
+	if (flag_prot_none && mprotect_prot != PROT_NONE) {
+		fprintf(stderr, "mprotect: can't set none and read|write|exec at the same time.\n");
+		return EINVAL;
+	}
+	flag_rdonly = false;
+	if (!mprotect_addr || !mprotect_len) {
+		fprintf(stderr, "--mprotect addr or len error\n");
+		return 1;
+	}
+	/**
+	 * mprotect(2) addr must be aligned to a page boundary.
+	 * mprotect(2) will automatically handle page alignment
+	 * of the LEN parameter, but we still check here.
+	 */
+	if ((mprotect_addr % ulp_page_size()) ||
+	    (mprotect_len % ulp_page_size())) {
+		fprintf(stderr, "mprotect must align page 0x%x\n",
+			ulp_page_size());
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * The file of --map is the absolute path, or under the cwd of target, which
+ * must be a non-empty regular file. Return 0 or the exit code.
+ */
+static int resolve_map_file(void)
+{
+	static char map_path[PATH_MAX];
+	const char *real_map_file = NULL;
+	char cwd_file[PATH_MAX];
+
+	/* Absolute path */
+	if (map_file[0] == '/') {
+		if (!fexist(map_file)) {
+			fprintf(stderr, "%s is not exist.\n", map_file);
+			return EEXIST;
+		}
+		real_map_file = map_file;
+
+	/* Otherwise, file must in target process cwd. */
+	} else {
+		char buf_tcwd[PATH_MAX], *tcwd;
+
+		tcwd = get_proc_pid_cwd(target_pid, buf_tcwd,
+			sizeof(buf_tcwd));
+
+		snprintf(cwd_file, PATH_MAX, "%s/%s", tcwd, map_file);
+		if (!fexist(cwd_file)) {
+			fprintf(stderr, "%s is not exist under target cwd %s.\n",
+				map_file, tcwd);
+			return EEXIST;
+		}
+		real_map_file = cwd_file;
+	}
+
+	if (!fregular(real_map_file)) {
+		fprintf(stderr, "%s is not regular file.\n",
+			real_map_file);
+		return ENOENT;
+	}
+
+	/**
+	 * Although mmap(2) will fail for an empty file, I still want
+	 * to determine whether it is an empty file in advance. If it
+	 * is an empty file, I can directly report an error when
+	 * testing ultask(). After all, an empty file is also an
+	 * illegal input.
+	 */
+	if (fsize(real_map_file) == 0) {
+		fprintf(stderr, "%s is empty.\n", real_map_file);
+		return EINVAL;
+	}
+
+	snprintf(map_path, sizeof(map_path), "%s", real_map_file);
+	map_file = map_path;
+	return 0;
+}
+
 static int parse_config(int argc, char *argv[])
 {
 	struct option options[] = {
 		{ "pid",            required_argument, 0, 'p' },
 		{ "vmas",           no_argument,       0, ARG_VMAS },
+		{ "residency",      no_argument,       0, ARG_RESIDENCY },
 		{ "threads",        no_argument,       0, ARG_THREADS },
 		{ "fds",            no_argument,       0, ARG_FDS },
 		{ "auxv",           no_argument,       0, ARG_AUXV },
 		{ "status",         no_argument,       0, ARG_STATUS },
+		{ "link-map",       no_argument,       0, ARG_LINK_MAP },
 		{ "dump",           required_argument, 0, ARG_DUMP },
 		{ "jmp",            required_argument, 0, ARG_JMP },
 		{ "map",            required_argument, 0, ARG_MAP },
@@ -254,13 +713,26 @@ static int parse_config(int argc, char *argv[])
 		{ "unmap",          required_argument, 0, ARG_FILE_UNMAP_FROM_VMA },
 		{ "symbols",        no_argument,       0, ARG_LIST_SYMBOLS },
 		{ "syms",           no_argument,       0, ARG_LIST_SYMBOLS },
+		{ "snapshot",       optional_argument, 0, ARG_SNAPSHOT },
+		{ "soft-dirty",     optional_argument, 0, ARG_SOFT_DIRTY },
 		{ "output",         required_argument, 0, 'o' },
+		{ "format",         required_argument, 0, ARG_FORMAT },
+		{ "filter",         required_argument, 0, ARG_SYM_FILTER },
+		{ "vma",            required_argument, 0, ARG_SYM_VMA },
+		{ "demangle",       no_argument,       0, ARG_SYM_DEMANGLE },
+		{ "search",         required_argument, 0, ARG_SEARCH },
+		{ "batch",          required_argument, 0, ARG_BATCH },
+		{ "decode",         required_argument, 0, ARG_DECODE },
+		{ "depth",          required_argument, 0, ARG_DEPTH },
+		{ "watch",          optional_argument, 0, ARG_WATCH },
 		COMMON_OPTIONS
 		{ NULL }
 	};
+	bool no_action;
+	int ret;
 
 	while (1) {
-		int c;
+		int c, fmt;
 		int option_index = 0;
 		char *subopts, *value;
 
@@ -276,106 +748,63 @@ static int parse_config(int argc, char *argv[])
 		case ARG_VMAS:
 			flag_print_vmas = true;
 			break;
+		case ARG_RESIDENCY:
+			flag_residency = true;
+			break;
 		case ARG_DUMP:
-			subopts = optarg;
-			while (*subopts != '\0') {
-				switch (getsubopt(&subopts, dump_opts, &value)) {
-				case DUMP_VMA_OPTION:
-					flag_dump_vma = true;
-					break;
-				case DUMP_DISASM_OPTION:
-					flag_disasm = true;
-					break;
-				case DUMP_ADDR_OPTION:
-					dump_addr = str2addr(value);
-					break;
-				case DUMP_SIZE_OPTION:
-					dump_size = str2size(value);
-					break;
-				default:
-					fprintf(stderr, "unknown option %s of --dump\n", value);
-					cmd_exit(1);
-					break;
-				}
-			}
-
-			if (flag_dump_vma && flag_disasm) {
-				fprintf(stderr, "only vma or disasm.\n");
-				cmd_exit(1);
-			} else if (flag_dump_vma) {
-				if (dump_addr == 0) {
-					fprintf(stderr, "dump vma need addr=.\n");
-					cmd_exit(1);
-				}
-				vma_addr = dump_addr;
-			} else if (flag_disasm) {
-				if (dump_addr == 0 || dump_size == 0) {
-					fprintf(stderr, "disasm need addr= and size=\n");
-					cmd_exit(1);
-				}
-				disasm_addr = dump_addr;
-				disasm_size = dump_size;
-			} else {
-				if (dump_addr == 0 || dump_size == 0) {
-					fprintf(stderr, "dump memory need addr= and size=\n");
-					cmd_exit(1);
-				}
-				flag_dump_addr = true;
-			}
+			ret = parse_dump_opts(optarg);
+			if (ret)
+				cmd_exit(ret);
 			break;
 		case ARG_JMP:
+			ret = parse_jmp_opts(optarg);
+			if (ret)
+				cmd_exit(ret);
+			break;
+		case ARG_MAP:
+			ret = parse_map_opts(optarg);
+			if (ret)
+				cmd_exit(ret);
+			break;
+		case ARG_SNAPSHOT:
+			flag_snapshot = true;
 			subopts = optarg;
-			while (*subopts != '\0') {
-				switch (getsubopt(&subopts, jmp_opts, &value)) {
-				case JMP_FROM_OPTION:
-					jmp_addr_from = str2addr(value);
+			while (subopts && *subopts != '\0') {
+				switch (getsubopt(&subopts, snapshot_opts,
+						  &value)) {
+				case SNAPSHOT_SOFT_DIRTY_OPTION:
+					snapshot_flags |= SNAPSHOT_F_SOFT_DIRTY;
 					break;
-				case JMP_TO_OPTION:
-					jmp_addr_to = str2addr(value);
+				case SNAPSHOT_JOBS_OPTION:
+					snapshot_jobs = value ? atoi(value) : 0;
 					break;
 				default:
-					fprintf(stderr, "unknown option %s of --jmp\n", value);
+					fprintf(stderr, "unknown option %s of --snapshot\n",
+						value);
 					cmd_exit(1);
 					break;
 				}
 			}
-			flag_rdonly = false;
-			if (jmp_addr_from == 0 || jmp_addr_to == 0) {
-				fprintf(stderr, "jmp need from= and to=\n");
-				cmd_exit(1);
-			}
 			break;
-		case ARG_MAP:
+		case ARG_SOFT_DIRTY:
+			flag_soft_dirty = true;
 			subopts = optarg;
-			while (*subopts != '\0') {
-				switch (getsubopt(&subopts, map_opts, &value)) {
-				case MAP_FILE_OPTION:
-					map_file = value;
-					break;
-				case MAP_RO_OPTION:
-					map_ro = true;
-					break;
-				case MAP_NO_EXEC_OPTION:
-					map_noexec = true;
+			while (subopts && *subopts != '\0') {
+				switch (getsubopt(&subopts, soft_dirty_opts,
+						  &value)) {
+				case SOFT_DIRTY_CLEAR_OPTION:
+					soft_dirty_clear = true;
 					break;
-				case MAP_DUMP_ADDR_OPTION:
-					map_addr = str2addr(value);
-					if (map_addr == 0) {
-						fprintf(stderr, "invalid map addr.\n");
-						cmd_exit(EINVAL);
-					}
+				case SOFT_DIRTY_ADDR_OPTION:
+					soft_dirty_addr = str2addr(value);
 					break;
 				default:
-					fprintf(stderr, "unknown option %s of --map\n", value);
+					fprintf(stderr, "unknown option %s of --soft-dirty\n",
+						value);
 					cmd_exit(1);
 					break;
 				}
 			}
-			flag_rdonly = false;
-			if (!map_file) {
-				fprintf(stderr, "map need file=\n");
-				cmd_exit(1);
-			}
 			break;
 		case ARG_FILE_UNMAP_FROM_VMA:
 			flag_unmap_vma = true;
@@ -383,56 +812,9 @@ static int parse_config(int argc, char *argv[])
 			unmap_addr = str2addr(optarg);
 			break;
 		case ARG_MPROTECT:
-			subopts = optarg;
-			mprotect_prot = PROT_NONE;
-			bool flag_prot_none = false;
-			while (*subopts != '\0') {
-				switch (getsubopt(&subopts, mprotect_opts,
-					&value)) {
-				case MPROT_DUMP_ADDR_OPTION:
-					mprotect_addr = str2addr(value);
-					break;
-				case MPROT_LEN_OPTION:
-					mprotect_len = str2addr(value);
-					break;
-				case MPROT_NONE_OPTION:
-					flag_prot_none = true;
-					break;
-				case MPROT_READ_OPTION:
-					mprotect_prot |= PROT_READ;
-					break;
-				case MPROT_WRITE_OPTION:
-					mprotect_prot |= PROT_WRITE;
-					break;
-				case MPROT_EXEC_OPTION:
-					mprotect_prot |= PROT_EXEC;
-					break;
-				default:
-					fprintf(stderr, "unknown option %s of --mprotect\n", value);
-					cmd_exit(1);
-					break;
-				}
-			}
-			if (flag_prot_none && mprotect_prot != PROT_NONE) {
-				fprintf(stderr, "mprotect: can't set none and read|write|exec at the same time.\n");
-				cmd_exit(EINVAL);
-			}
-			flag_rdonly = false;
-			if (!mprotect_addr || !mprotect_len) {
-				fprintf(stderr, "--mprotect addr or len error\n");
-				cmd_exit(1);
-			}
-			/**
-			 * mprotect(2) addr must be aligned to a page boundary.
-			 * mprotect(2) will automatically handle page alignment
-			 * of the LEN parameter, but we still check here.
-			 */
-			if ((mprotect_addr % ulp_page_size()) ||
-			    (mprotect_len % ulp_page_size())) {
-				fprintf(stderr, "mprotect must align page 0x%x\n",
-					ulp_page_size());
-				cmd_exit(1);
-			}
+			ret = parse_mprotect_opts(optarg);
+			if (ret)
+				cmd_exit(ret);
 			break;
 		case ARG_LIST_SYMBOLS:
 			flag_list_symbols = true;
@@ -449,9 +831,63 @@ static int parse_config(int argc, char *argv[])
 		case ARG_STATUS:
 			flag_print_status = true;
 			break;
+		case ARG_LINK_MAP:
+			flag_print_link_map = true;
+			break;
 		case 'o':
 			output_file = optarg;
 			break;
+		case ARG_FORMAT:
+			fmt = emit_format_parse(optarg);
+			if (fmt < 0) {
+				fprintf(stderr, "Invalid format %s.\n", optarg);
+				cmd_exit(1);
+			}
+			output_format = fmt;
+			break;
+		case ARG_SYM_FILTER:
+			sym_filter = optarg;
+			break;
+		case ARG_SYM_VMA:
+			sym_vma = optarg;
+			break;
+		case ARG_SYM_DEMANGLE:
+			flag_sym_demangle = true;
+			break;
+		case ARG_SEARCH:
+			search_pat = parse_search_pattern(optarg, &search_len);
+			if (!search_pat) {
+				fprintf(stderr, "Invalid --search %s\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_BATCH:
+			batch_file = optarg;
+			flag_rdonly = false;
+			break;
+		case ARG_DECODE:
+			if (parse_decode(optarg)) {
+				fprintf(stderr, "Invalid --decode %s\n", optarg);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_DEPTH:
+			decode_depth = atoi(optarg);
+			if (decode_depth < 0 ||
+			    decode_depth > TASK_DECODE_MAX_DEPTH) {
+				fprintf(stderr, "--depth is 0-%d.\n",
+					TASK_DECODE_MAX_DEPTH);
+				cmd_exit(1);
+			}
+			break;
+		case ARG_WATCH:
+			watch_ms = optarg ? strtoul(optarg, NULL, 0) :
+				   ULTASK_WATCH_MS;
+			if (!watch_ms) {
+				fprintf(stderr, "--watch need MSEC > 0.\n");
+				cmd_exit(1);
+			}
+			break;
 		COMMON_GETOPT_CASES(prog_name, print_help, argv)
 		default:
 			print_help();
@@ -476,7 +912,7 @@ static int parse_config(int argc, char *argv[])
 	/**
 	 * There needs to be one action, or more than one action.
 	 */
-	if (!flag_print_vmas &&
+	no_action = !flag_print_vmas &&
 		!flag_dump_vma &&
 		!flag_dump_addr &&
 		!map_file &&
@@ -486,10 +922,17 @@ static int parse_config(int argc, char *argv[])
 		!flag_list_symbols &&
 		!flag_print_auxv &&
 		!flag_print_status &&
+		!flag_print_link_map &&
 		!flag_print_threads &&
 		!flag_disasm &&
-		!flag_print_fds)
-	{
+		!flag_snapshot &&
+		!flag_soft_dirty &&
+		!search_pat &&
+		!decode_type &&
+		!batch_file &&
+		!flag_print_fds;
+
+	if (no_action && !watch_ms) {
 		fprintf(stderr, "nothing to do, -h, --help.\n");
 	} else {
 		/**
@@ -499,66 +942,42 @@ static int parse_config(int argc, char *argv[])
 		 */
 		flag_print_task = false;
 	}
+	watch_only = no_action && watch_ms;
+
+	if (flag_residency && !flag_print_vmas && !watch_ms) {
+		fprintf(stderr, "--residency need --vmas or --watch.\n");
+		cmd_exit(1);
+	}
+
+	if ((sym_filter || flag_sym_demangle) && !flag_list_symbols) {
+		fprintf(stderr, "--filter and --demangle need --syms.\n");
+		cmd_exit(1);
+	}
+
+	if (sym_vma && !flag_list_symbols && !search_pat) {
+		fprintf(stderr, "--vma need --syms or --search.\n");
+		cmd_exit(1);
+	}
 
 	if (flag_dump_vma && !output_file) {
 		fprintf(stderr, "--dump vma need output file(-o).\n");
 		cmd_exit(1);
 	}
 
+	if (flag_soft_dirty && output_file && !soft_dirty_addr) {
+		fprintf(stderr, "--soft-dirty with -o need addr=.\n");
+		cmd_exit(1);
+	}
+
 	if (flag_dump_addr && !output_file) {
 		fprintf(stderr, "--dump need output file(-o).\n");
 		cmd_exit(1);
 	}
 
 	if (map_file) {
-		const char *real_map_file = NULL;
-		char cwd_file[PATH_MAX];
-
-		/* Absolute path */
-		if (map_file[0] == '/') {
-			if (!fexist(map_file)) {
-				fprintf(stderr, "%s is not exist.\n", map_file);
-				cmd_exit(EEXIST);
-			}
-			real_map_file = map_file;
-
-		/* Otherwise, file must in target process cwd. */
-		} else {
-			char buf_tcwd[PATH_MAX], *tcwd;
-
-			tcwd = get_proc_pid_cwd(target_pid, buf_tcwd,
-				sizeof(buf_tcwd));
-
-			snprintf(cwd_file, PATH_MAX, "%s/%s", tcwd, map_file);
-			if (!fexist(cwd_file)) {
-				fprintf(stderr, "%s is not exist under target cwd %s.\n",
-					map_file, tcwd);
-				cmd_exit(EEXIST);
-			}
-			real_map_file = cwd_file;
-		}
-
-		if (!fregular(real_map_file)) {
-			fprintf(stderr, "%s is not regular file.\n",
-				real_map_file);
-			cmd_exit(ENOENT);
-		}
-
-		/**
-		 * Although mmap(2) will fail for an empty file, I still want
-		 * to determine whether it is an empty file in advance. If it
-		 * is an empty file, I can directly report an error when
-		 * testing ultask(). After all, an empty file is also an
-		 * illegal input.
-		 */
-		if (fsize(real_map_file) == 0) {
-			fprintf(stderr, "%s is empty.\n", real_map_file);
-			cmd_exit(EINVAL);
-		}
-
-		map_file = malloc(PATH_MAX);
-
-		strcpy(map_file, real_map_file);
+		ret = resolve_map_file();
+		if (ret)
+			cmd_exit(ret);
 	}
 
 	if (output_file && !force && fexist(output_file)) {
@@ -569,13 +988,25 @@ static int parse_config(int argc, char *argv[])
 	return 0;
 }
 
+/**
+ * Attach the target for one operation, or nothing if it's attached by
+ * --batch already, see run_batch().
+ */
+static int op_attach_session(struct task_struct *task)
+{
+	return in_batch ? 0 : task_attach_session(task);
+}
+
+static void op_detach_session(struct task_struct *task)
+{
+	if (!in_batch)
+		task_detach_session(task);
+}
+
 static int mmap_a_file(void)
 {
 	int ret = 0;
 	ssize_t map_len = fsize(map_file);
-	unsigned long map_v;
-	int map_fd;
-	const char *filename = map_file;
 	int prot;
 	unsigned long addr = 0UL;
 
@@ -588,8 +1019,8 @@ static int mmap_a_file(void)
 	 * NOTE: map_addr equal to 0 also is a valid value.
 	 */
 	if (map_addr) {
-		if (find_vma(task, map_addr) ||
-		    find_vma(task, map_addr + map_len))
+		if (find_vma_or_query(task, map_addr) ||
+		    find_vma_or_query(task, map_addr + map_len))
 		{
 			fprintf(stderr, "address 0x%lx already in use.\n",
 				map_addr);
@@ -598,20 +1029,6 @@ static int mmap_a_file(void)
 		addr = map_addr;
 	}
 
-	task_attach(task->pid);
-
-	map_fd = task_open2(task, (char *)filename, O_RDWR);
-	if (map_fd <= 0) {
-		fprintf(stderr, "ERROR: remote open failed.\n");
-		return -1;
-	}
-
-	ret = task_ftruncate(task, map_fd, map_len);
-	if (ret != 0) {
-		fprintf(stderr, "ERROR: remote ftruncate failed.\n");
-		goto close_ret;
-	}
-
 	prot = PROT_READ | PROT_WRITE | PROT_EXEC;
 
 	if (map_ro)
@@ -620,15 +1037,65 @@ static int mmap_a_file(void)
 	if (map_noexec)
 		prot &= ~PROT_EXEC;
 
-	map_v = task_mmap(task, addr, map_len, prot, MAP_PRIVATE, map_fd, 0);
-	if (!map_v) {
+	/**
+	 * open, ftruncate, mmap and close in target task with one run of it,
+	 * the pathname is stored in data of the batch.
+	 */
+	struct task_syscall_entry calls[] = {
+#if defined(__x86_64__)
+		{
+			.nr = __NR_open,
+			.args = { 0, O_RDWR },
+			.data_mask = BIT(0),
+		},
+#elif defined(__aarch64__)
+		{
+			.nr = __NR_openat,
+			.args = { AT_FDCWD, 0, O_RDWR },
+			.data_mask = BIT(1),
+		},
+#else
+# error "Unsupport architecture"
+#endif
+		{
+			.nr = __NR_ftruncate,
+			.args = { 0, map_len },
+			.ret_mask = BIT(0),
+		},
+		{
+			.nr = __NR_mmap,
+			.args = { addr, map_len, prot, MAP_PRIVATE, 0, 0 },
+			.ret_mask = BIT(4),
+		},
+		{
+			.nr = __NR_close,
+			.args = { 0 },
+			.ret_mask = BIT(0),
+		},
+	};
+
+	ret = op_attach_session(task);
+	if (ret)
+		return ret;
+
+	ret = task_syscall_batch(task, calls, ARRAY_SIZE(calls), map_file,
+				 strlen(map_file) + 1);
+	if (ret) {
+		fprintf(stderr, "ERROR: remote syscalls failed.\n");
+	} else if ((long)calls[0].ret < 0) {
+		fprintf(stderr, "ERROR: remote open failed.\n");
+		ret = calls[0].ret;
+	} else if (calls[1].ret) {
+		fprintf(stderr, "ERROR: remote ftruncate failed.\n");
+		if (calls[2].ret && calls[2].ret <= -4096UL)
+			task_munmap(task, calls[2].ret, map_len);
+		ret = calls[1].ret;
+	} else if (!calls[2].ret || calls[2].ret > -4096UL) {
 		fprintf(stderr, "ERROR: remote mmap failed.\n");
-		goto close_ret;
+		ret = calls[2].ret ?: -ENOMEM;
 	}
 
-close_ret:
-	task_close(task, map_fd);
-	task_detach(task->pid);
+	op_detach_session(task);
 
 	update_task_vmas_ulp(task);
 
@@ -647,21 +1114,26 @@ static int mprotect_a_region(void)
 	if (!mprotect_addr || !mprotect_len)
 		return -EINVAL;
 
-	if (!find_vma(task, mprotect_addr) ||
-	    !find_vma(task, mprotect_addr + mprotect_len))
+	if (!find_vma_or_query(task, mprotect_addr) ||
+	    !find_vma_or_query(task, mprotect_addr + mprotect_len))
 	{
 		fprintf(stderr, "address 0x%lx-0x%lx not exist.\n",
 			mprotect_addr, mprotect_addr + mprotect_len);
 		return -EINVAL;
 	}
 
-	task_attach(task->pid);
+	ret = op_attach_session(task);
+	if (ret)
+		return ret;
 
 	ret = task_mprotect(task, mprotect_addr, mprotect_len, mprotect_prot);
 	if (ret)
 		fprintf(stderr, "ERROR: remote mprotect failed.\n");
 
-	task_detach(task->pid);
+	op_detach_session(task);
+
+	/* The VMAs may be split or merged */
+	update_task_vmas_ulp(task);
 	return ret;
 }
 
@@ -669,26 +1141,35 @@ static int munmap_an_vma(void)
 {
 	size_t size = 0;
 	struct task_struct *task = target_task;
+	char path[PATH_MAX];
 	unsigned long addr = 0;
+	int ret;
 
-	struct vm_area_struct *vma = find_vma(task, unmap_addr);
+	struct vm_area_struct *vma = find_vma_or_query(task, unmap_addr);
 	if (!vma) {
 		fprintf(stderr, "vma not exist.\n");
 		return -1;
 	}
 
-	if (fexist(vma->name_)) {
-		size = fsize(vma->name_);
+	if (task_path_exist(task, vma->name_)) {
+		size = fsize(task_path(task, vma->name_, path, sizeof(path)));
 	} else {
 		size = vma->vm_end - vma->vm_start;
 	}
 	addr = vma->vm_start;
 
-	task_attach(task->pid);
-	task_munmap(task, addr, size);
-	task_detach(task->pid);
+	ret = op_attach_session(task);
+	if (ret)
+		return ret;
 
-	return 0;
+	ret = task_munmap(task, addr, size);
+	if (ret)
+		fprintf(stderr, "ERROR: remote munmap failed.\n");
+
+	op_detach_session(task);
+
+	update_task_vmas_ulp(task);
+	return ret;
 }
 
 static void list_all_symbols(void)
@@ -703,7 +1184,7 @@ static void list_all_symbols(void)
 		int len = strlen(tsym->name);
 		if (max_name_len < len)
 			max_name_len = len;
-		len = strlen(basename(tsym->vma->name_));
+		len = strlen(basename((char *)tsym->vma->name_));
 		if (max_vma_len < len)
 			max_vma_len = len;
 	}
@@ -713,7 +1194,7 @@ static void list_all_symbols(void)
 	{
 #define PRINT_TSYM(tasksym)	\
 		printf("%-*s %-*s %#016lx\n",	\
-			max_vma_len, basename(tasksym->vma->name_),	\
+			max_vma_len, basename((char *)tasksym->vma->name_),	\
 			max_name_len, tasksym->name,	\
 			tasksym->addr);
 		PRINT_TSYM(tsym);
@@ -733,6 +1214,122 @@ static void list_all_symbols(void)
 	}
 }
 
+static void emit_sym(struct emitter *e, struct vm_area_struct *vma,
+		     const char *name, unsigned long addr)
+{
+	emit_map(e, 3);
+	emit_kv_str(e, "vma", vma->name_);
+	emit_kv_str(e, "name", name);
+	emit_kv_u64(e, "addr", addr);
+}
+
+static void emit_task_sym(struct emitter *e, struct task_sym *tsym)
+{
+	emit_sym(e, tsym->vma, tsym->name, tsym->addr);
+}
+
+/* Same symbols of list_all_symbols(), one record for each one */
+static void emit_all_symbols(struct emitter *e)
+{
+	struct task_sym *tsym, *is, *tmp;
+	struct task_struct *task = target_task;
+
+	for (tsym = next_task_sym(task, NULL); tsym;
+	     tsym = next_task_sym(task, tsym)) {
+		emit_task_sym(e, tsym);
+
+		if (!is_verbose())
+			continue;
+
+		list_for_each_entry_safe(is, tmp, &tsym->list_name.head,
+					 list_name.node)
+			emit_task_sym(e, is);
+	}
+}
+
+static int print_filter_sym(struct vm_area_struct *vma, const char *name,
+			    unsigned long addr, void *arg)
+{
+	int max_vma_len = *(int *)arg;
+
+	printf("%-*s %-32s %#016lx\n", max_vma_len,
+	       basename((char *)vma->name_), name, addr);
+	return 0;
+}
+
+static int emit_filter_sym(struct vm_area_struct *vma, const char *name,
+			   unsigned long addr, void *arg)
+{
+	emit_sym(arg, vma, name, addr);
+	return 0;
+}
+
+/**
+ * The --syms with --filter, --vma or --demangle, the symbols are streamed in
+ * the order of VMAs, from the ELF files of the VMAs match --vma only, and
+ * never loaded into task.
+ */
+static int filter_symbols(struct emitter *e)
+{
+	int (*filter)(struct task_struct *, const char *, const char *,
+		      task_sym_fn, void *) = task_filter_syms;
+	struct vm_area_struct *vma;
+	int max_vma_len = 0, len, err;
+
+	if (flag_sym_demangle)
+		filter = task_filter_demangled_syms;
+
+	if (e) {
+		err = filter(target_task, sym_vma, sym_filter, emit_filter_sym,
+			     e);
+	} else {
+		task_for_each_vma(vma, target_task) {
+			if (!vma->is_elf)
+				continue;
+			len = strlen(basename((char *)vma->name_));
+			max_vma_len = MAX(max_vma_len, len);
+		}
+		err = filter(target_task, sym_vma, sym_filter,
+			     print_filter_sym, &max_vma_len);
+	}
+	if (err) {
+		fprintf(stderr, "Filter symbols failed, %s\n", strerror(-err));
+		if (e && !e->err)
+			e->err = err;
+	}
+	return err;
+}
+
+/* The --vmas and --syms in machine-readable format */
+static int run_emit(void)
+{
+	struct emitter e;
+	int err;
+
+	if (!flag_print_vmas && !flag_list_symbols)
+		return 0;
+
+	err = emit_open(&e, stdout, output_format);
+	if (err)
+		return err;
+
+	if (flag_print_vmas && flag_residency)
+		emit_task_vmas_residency(&e, target_task);
+	else if (flag_print_vmas)
+		emit_task_vmas(&e, target_task);
+
+	if (flag_list_symbols && (sym_filter || sym_vma || flag_sym_demangle))
+		filter_symbols(&e);
+	else if (flag_list_symbols)
+		emit_all_symbols(&e);
+
+	err = emit_close(&e);
+	if (err)
+		fprintf(stderr, "Emit %s failed, %s\n",
+			emit_format_name(output_format), strerror(-err));
+	return err;
+}
+
 int run_jmp(void)
 {
 	int err = 0;
@@ -745,8 +1342,8 @@ int run_jmp(void)
 	if (!jmp_addr_from || !jmp_addr_to)
 		return 0;
 
-	vma_from = find_vma(target_task, jmp_addr_from);
-	vma_to = find_vma(target_task, jmp_addr_to);
+	vma_from = find_vma_or_query(target_task, jmp_addr_from);
+	vma_to = find_vma_or_query(target_task, jmp_addr_to);
 	if (!vma_from || !vma_to) {
 		fprintf(stderr,
 			"0x%lx ot 0x%lx not in process address space\n"
@@ -794,12 +1391,441 @@ done:
 	return err;
 }
 
+/**
+ * Split [disasm_addr, end) at the symbols, the code between the symbols or
+ * before the first one is disassembled without name.
+ */
+static int disasm_build_ranges(unsigned long end,
+			       struct disasm_range **pranges)
+{
+	struct task_syms *tsyms = &target_task->tsyms;
+	const struct task_sym_range *r;
+	struct disasm_range *ranges;
+	unsigned long addr = disasm_addr;
+	size_t lo, hi, mid, i;
+	int nr = 0;
+
+	/* Make sure task_syms::ranges is up to date */
+	find_task_sym_contain(target_task, addr, NULL);
+
+	ranges = malloc(sizeof(*ranges) * (tsyms->nr_ranges * 2 + 1));
+	if (!ranges)
+		return -ENOMEM;
+
+	/* The first symbol starts at or above @addr */
+	for (lo = 0, hi = tsyms->nr_ranges; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (tsyms->ranges[mid].start < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < tsyms->nr_ranges && addr < end; i++) {
+		r = &tsyms->ranges[i];
+		if (r->start >= end)
+			break;
+		if (r->start > addr) {
+			ranges[nr++] = (struct disasm_range) {
+				.addr = addr,
+				.size = r->start - addr,
+			};
+			addr = r->start;
+		}
+		ranges[nr++] = (struct disasm_range) {
+			.addr = addr,
+			.size = MIN(r->start + r->size, end) - addr,
+			.name = r->sym->name,
+		};
+		addr += ranges[nr - 1].size;
+	}
+
+	if (addr < end) {
+		ranges[nr++] = (struct disasm_range) {
+			.addr = addr,
+			.size = end - addr,
+		};
+	}
+
+	*pranges = ranges;
+	return nr;
+}
+
+static int run_disasm_parallel(void)
+{
+	struct vm_area_struct *vma;
+	struct disasm_range *ranges;
+	unsigned long end;
+	int nr, jobs, ret;
+	void *mem;
+
+	vma = find_vma_or_query(target_task, disasm_addr);
+	if (!vma) {
+		fprintf(stderr, "Bad address 0x%lx\n", disasm_addr);
+		return -ENOENT;
+	}
+	end = disasm_size ? disasm_addr + disasm_size : vma->vm_end;
+
+	mem = malloc(end - disasm_addr);
+	if (!mem)
+		return -ENOMEM;
+
+	ret = memcpy_from_task(target_task, mem, disasm_addr,
+			       end - disasm_addr);
+	if (ret <= 0 || ret < end - disasm_addr) {
+		fprintf(stderr, "Bad address 0x%lx\n", disasm_addr);
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	nr = disasm_build_ranges(end, &ranges);
+	if (nr < 0) {
+		ret = nr;
+		goto done;
+	}
+
+	jobs = disasm_jobs ?: sysconf(_SC_NPROCESSORS_ONLN);
+	ret = fdisasm_parallel(stdout, current_disasm_arch(), mem, disasm_addr,
+			       ranges, nr, MAX(jobs, 1));
+	if (ret)
+		fprintf(stderr, "Disasm failed\n");
+
+	free(ranges);
+done:
+	free(mem);
+	return ret;
+}
+
+static int run_snapshot(void)
+{
+	struct task_snapshot_stats st;
+	char file[PATH_MAX];
+	int jobs, ret;
+
+	if (!flag_snapshot)
+		return 0;
+
+	if (output_file)
+		snprintf(file, sizeof(file), "%s", output_file);
+	else
+		snprintf(file, sizeof(file), "core.%d", target_pid);
+
+	jobs = snapshot_jobs ?: sysconf(_SC_NPROCESSORS_ONLN);
+	ret = task_snapshot(target_task, file, snapshot_flags, MAX(jobs, 1),
+			    &st);
+	if (ret) {
+		fprintf(stderr, "Snapshot %d failed, %s\n", target_pid,
+			strerror(-ret));
+		return ret;
+	}
+
+	printf("Snapshot: %s\n", file);
+	printf("  Threads:    %u\n", st.nr_threads);
+	printf("  PT_LOADs:   %d\n", st.nr_loads);
+	printf("  Bytes:      %lu\n", st.bytes);
+	printf("  Unreadable: %lu pages\n", st.unreadable);
+	if (snapshot_flags & SNAPSHOT_F_SOFT_DIRTY)
+		printf("  Dirty:      %lu pages\n", st.nr_dirty);
+	printf("  Copy:       %lu ns\n", st.copy_ns);
+	printf("  Stop:       %lu ns\n", st.stop_ns);
+	if (st.compress_ns)
+		printf("  Compress:   %lu ns\n", st.compress_ns);
+	return 0;
+}
+
+/* Print the soft-dirty runs of VMA, return the number of dirty pages */
+static long soft_dirty_list_vma(struct vm_area_struct *vma)
+{
+	struct task_addr_range *ranges;
+	long pages = 0;
+	int i, nr;
+
+	nr = task_soft_dirty_ranges(target_task, vma->vm_start, vma->vm_end,
+				    &ranges);
+	if (nr <= 0)
+		return nr;
+
+	for (i = 0; i < nr; i++) {
+		printf("  %016lx-%016lx %8lu %s\n", ranges[i].start,
+		       ranges[i].end,
+		       (ranges[i].end - ranges[i].start) / PAGE_SIZE,
+		       vma->name_);
+		pages += (ranges[i].end - ranges[i].start) / PAGE_SIZE;
+	}
+	free(ranges);
+	return pages;
+}
+
+static int run_soft_dirty(void)
+{
+	struct vm_area_struct *vma;
+	unsigned long pages = 0;
+	long ret = 0;
+
+	if (!flag_soft_dirty)
+		return 0;
+
+	if (output_file) {
+		ret = dump_task_soft_dirty_to_file(output_file, target_task,
+						   soft_dirty_addr, 0);
+	} else if (soft_dirty_addr || !soft_dirty_clear) {
+		printf("  %-33s %8s %s\n", "Dirty", "Pages", "Name");
+		task_for_each_vma(vma, target_task) {
+			if (soft_dirty_addr &&
+			    (soft_dirty_addr < vma->vm_start ||
+			     soft_dirty_addr >= vma->vm_end))
+				continue;
+			/* Not readable, or not in pagemap as [vsyscall] */
+			if (!(vma->prot & PROT_READ) ||
+			    vma->type == VMA_VSYSCALL)
+				continue;
+			ret = soft_dirty_list_vma(vma);
+			if (ret < 0)
+				break;
+			pages += ret;
+			ret = 0;
+		}
+		printf("  Total: %lu pages\n", pages);
+	}
+
+	if (!ret && soft_dirty_clear)
+		ret = task_clear_soft_dirty(target_task);
+
+	return ret;
+}
+
+#define SEARCH_MAX_MATCHES	65536
+
+/* The matches of --search, with the VMA and the nearest symbol */
+static int run_search(void)
+{
+	struct task_search_match *matches, *m;
+	unsigned long off;
+	struct task_sym *sym;
+	ssize_t nr, i;
+
+	if (!search_pat)
+		return 0;
+
+	nr = task_search(target_task, search_pat, search_len, sym_vma,
+			 sysconf(_SC_NPROCESSORS_ONLN), SEARCH_MAX_MATCHES,
+			 &matches);
+	if (nr == -E2BIG) {
+		fprintf(stderr, "More than %d matches, only show them.\n",
+			SEARCH_MAX_MATCHES);
+		nr = SEARCH_MAX_MATCHES;
+	} else if (nr < 0) {
+		fprintf(stderr, "Search failed, %s\n", strerror(-nr));
+		return nr;
+	}
+
+	/* The symbols are loaded on demand, the ranges need all of them */
+	if (nr > 0 && task_load_all_syms(target_task))
+		ulp_warning("Load symbols failed, no symbol of matches.\n");
+
+	printf("  %-18s %-40s %s\n", "Address", "VMA", "Symbol");
+	for (i = 0; i < nr; i++) {
+		m = &matches[i];
+		printf("  %#018lx %s+%#lx", m->addr,
+		       basename((char *)m->vma->name_),
+		       m->addr - m->vma->vm_start);
+		sym = find_task_sym_contain(target_task, m->addr, &off);
+		if (sym)
+			printf(" %s+%#lx", sym->name, off);
+		printf("\n");
+	}
+	printf("  Total: %zd matches\n", nr);
+
+	free(matches);
+	return 0;
+}
+
+/* --decode, the objects are printed level by level */
+static int run_decode(void)
+{
+	struct task_decode_stats st;
+	int err;
+
+	if (!decode_type)
+		return 0;
+
+	err = task_decode(stdout, target_task, decode_type, decode_addr,
+			  decode_depth, &st);
+	if (err) {
+		fprintf(stderr, "Decode %s failed, %s\n", decode_type,
+			strerror(-err));
+		return err;
+	}
+
+	printf("Decode: %u objects, %u levels, %u reads", st.nr_objs,
+	       st.nr_levels, st.nr_reads);
+	if (st.nr_unreadable)
+		printf(", %u unreadable", st.nr_unreadable);
+	if (st.nr_dropped)
+		printf(", %u dropped", st.nr_dropped);
+	printf("\n");
+	return 0;
+}
+
+/* The resident and swapped pages of one VMA at the last --watch round */
+struct watch_rss {
+	unsigned long start;
+	unsigned long present;
+	unsigned long swapped;
+};
+
+static struct watch_rss *watch_rss = NULL;
+static unsigned int watch_nr_rss = 0;
+static unsigned long watch_start_ns = 0;
+
+static void watch_sig_handler(int signum)
+{
+	watch_stop = 1;
+}
+
+static void watch_notify(struct vm_area_struct *vma,
+			 enum task_vma_event event, unsigned long old_end,
+			 const char *old_perms, void *arg)
+{
+	double sec = (nsecs() - watch_start_ns) / 1000000000.0;
+
+	switch (event) {
+	case TASK_VMA_ADDED:
+	case TASK_VMA_REMOVED:
+		printf("%10.3f %c %016lx-%016lx %4s %s\n", sec,
+		       event == TASK_VMA_ADDED ? '+' : '-', vma->vm_start,
+		       vma->vm_end, vma->perms, vma->name_);
+		break;
+	case TASK_VMA_RESIZED:
+		printf("%10.3f ~ %016lx-%016lx %4s -> %016lx %4s %s\n", sec,
+		       vma->vm_start, old_end, old_perms, vma->vm_end,
+		       vma->perms, vma->name_);
+		break;
+	}
+}
+
+/**
+ * Compare the residency of all VMAs with the last round, both of them are
+ * sorted by address, only print the changed ones if @print.
+ */
+static int watch_residency(bool print)
+{
+	double sec = (nsecs() - watch_start_ns) / 1000000000.0;
+	struct task_vma_residency *res;
+	struct vm_area_struct *vma;
+	struct watch_rss *rss;
+	unsigned int nr = 0, i = 0, j = 0;
+	long dp, ds, kb = PAGE_SIZE / SZ_1K;
+	int n;
+
+	list_for_each_entry(vma, &target_task->vma_list, node_list)
+		nr++;
+
+	res = calloc(nr ?: 1, sizeof(*res));
+	rss = calloc(nr ?: 1, sizeof(*rss));
+	if (!res || !rss) {
+		free(res);
+		free(rss);
+		return -ENOMEM;
+	}
+
+	n = task_vmas_residency(target_task, res, nr);
+	if (n < 0) {
+		free(res);
+		free(rss);
+		return n;
+	}
+
+	list_for_each_entry(vma, &target_task->vma_list, node_list) {
+		if (i >= n)
+			break;
+		rss[i].start = vma->vm_start;
+		rss[i].present = res[i].present;
+		rss[i].swapped = res[i].swapped;
+
+		while (j < watch_nr_rss && watch_rss[j].start < vma->vm_start)
+			j++;
+		/* The new VMA is compared with zero */
+		dp = rss[i].present;
+		ds = rss[i].swapped;
+		if (j < watch_nr_rss && watch_rss[j].start == vma->vm_start) {
+			dp -= watch_rss[j].present;
+			ds -= watch_rss[j].swapped;
+		}
+		if (print && (dp || ds))
+			printf("%10.3f r %016lx-%016lx rss %+ldKB swap %+ldKB "
+			       "%s\n", sec, vma->vm_start, vma->vm_end,
+			       dp * kb, ds * kb, vma->name_);
+		i++;
+	}
+
+	free(res);
+	free(watch_rss);
+	watch_rss = rss;
+	watch_nr_rss = i;
+	return 0;
+}
+
+/**
+ * Keep the task opened, and apply the diff of /proc/PID/maps to the VMAs
+ * every --watch interval, the target is never attached, only its maps and
+ * pagemap are read.
+ */
+static int run_watch(void)
+{
+	struct task_vma_changes c;
+	int ret = 0;
+
+	if (!watch_ms)
+		return 0;
+
+	watch_start_ns = nsecs();
+	watch_stop = 0;
+	signal(SIGINT, watch_sig_handler);
+	signal(SIGTERM, watch_sig_handler);
+
+	printf("Watch the VMAs of %d every %lu ms, Ctrl-C to stop.\n",
+	       target_pid, watch_ms);
+
+	if (flag_residency)
+		ret = watch_residency(false);
+
+	while (!ret && !watch_stop) {
+		fflush(stdout);
+		usleep(watch_ms * 1000);
+		if (watch_stop || !proc_pid_exist(target_pid))
+			break;
+
+		ret = refresh_task_vmas_notify(target_task, &c, watch_notify,
+					       NULL);
+		if (!ret && flag_residency)
+			ret = watch_residency(true);
+	}
+
+	if (ret)
+		fprintf(stderr, "Watch %d failed, %s\n", target_pid,
+			strerror(ret < 0 ? -ret : EIO));
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	free(watch_rss);
+	watch_rss = NULL;
+	watch_nr_rss = 0;
+	return ret;
+}
+
 int run_disasm(void)
 {
 	void *mem;
 	int ret = 0;
 
-	if (!disasm_addr || !disasm_size)
+	if (!disasm_addr)
+		return 0;
+
+	if (disasm_jobs >= 0)
+		return run_disasm_parallel();
+
+	if (!disasm_size)
 		return 0;
 
 	mem = malloc(disasm_size);
@@ -822,10 +1848,125 @@ done:
 	return ret;
 }
 
+/**
+ * Run one step of --batch, the @line is the name of operation and the
+ * argument of it, and the output file of dump. Return 0 if success.
+ */
+static int run_batch_op(char *line)
+{
+	char *op, *arg, *out, *save;
+	const char *sep = " \t";
+
+	op = strtok_r(line, sep, &save);
+	arg = strtok_r(NULL, sep, &save);
+	out = strtok_r(NULL, sep, &save);
+
+	if (!arg || (out && strcmp(op, "dump")) || strtok_r(NULL, sep, &save)) {
+		fprintf(stderr, "invalid step '%s'\n", op);
+		return -EINVAL;
+	}
+
+	reset_op_args();
+
+	if (!strcmp(op, "map")) {
+		if (parse_map_opts(arg) || resolve_map_file())
+			return -EINVAL;
+		return mmap_a_file();
+	} else if (!strcmp(op, "unmap")) {
+		unmap_addr = str2addr(arg);
+		return munmap_an_vma();
+	} else if (!strcmp(op, "mprotect")) {
+		if (parse_mprotect_opts(arg))
+			return -EINVAL;
+		return mprotect_a_region();
+	} else if (!strcmp(op, "jmp")) {
+		if (parse_jmp_opts(arg))
+			return -EINVAL;
+		return run_jmp();
+	} else if (!strcmp(op, "dump")) {
+		if (parse_dump_opts(arg))
+			return -EINVAL;
+		if (flag_disasm)
+			return run_disasm();
+		if (!out || (!force && fexist(out))) {
+			fprintf(stderr, "dump need new output file.\n");
+			return -EINVAL;
+		}
+		if (flag_dump_vma)
+			return dump_task_vma_to_file(out, target_task, vma_addr,
+						     dump_flags);
+		return dump_task_addr_to_file(out, target_task, dump_addr,
+					      dump_size, dump_flags);
+	}
+
+	fprintf(stderr, "unknown operation '%s'\n", op);
+	return -EINVAL;
+}
+
+/**
+ * Run the steps of --batch, one for each line, in one attach session of
+ * target task, every syscall jumps to the trampoline, instead of poke the
+ * libc text. Print the result and the cost of each step, stop at the first
+ * failed one. The empty lines and the lines start with '#' are skipped.
+ */
+static int run_batch(void)
+{
+	char line[PATH_MAX * 2], step[PATH_MAX * 2], *p;
+	struct task_struct *task = target_task;
+	unsigned int lineno = 0, nr = 0;
+	unsigned long start;
+	FILE *fp;
+	int ret;
+
+	if (!batch_file)
+		return 0;
+
+	fp = strcmp(batch_file, "-") ? fopen(batch_file, "r") : stdin;
+	if (!fp) {
+		fprintf(stderr, "open %s failed, %m\n", batch_file);
+		return -errno;
+	}
+
+	ret = task_attach_session(task);
+	if (ret)
+		goto close;
+
+	if (task_syscall_tramp_enable(task))
+		ulp_debug("No syscall trampoline, poke libc instead.\n");
+	in_batch = true;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		p = line + strspn(line, " \t");
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		snprintf(step, sizeof(step), "%s", p);
+		start = nsecs();
+		ret = run_batch_op(p);
+		nr++;
+
+		printf("%u: %s: %s, %lu us\n", lineno, step,
+		       ret ? "FAILED" : "OK", (nsecs() - start) / 1000);
+		if (ret)
+			break;
+	}
+
+	in_batch = false;
+	task_detach_session(task);
+
+	printf("Batch: %u steps %s.\n", nr, ret ? "stopped" : "done");
+close:
+	if (fp != stdin)
+		fclose(fp);
+	return ret;
+}
+
 int ultask(int argc, char *argv[])
 {
 	int ret = 0;
-	int flags = FTO_ALL;
+	int flags = FTO_ULTASK;
 
 	COMMON_RESET_BEFORE_PARSE_ARGS(ultask_args_reset);
 
@@ -841,8 +1982,13 @@ int ultask(int argc, char *argv[])
 
 	ulpatch_init();
 
-	if (flag_rdonly)
-		flags &= ~FTO_RDWR;
+	/* The writing operations, FTO_MEM_CACHE is disabled by FTO_RDWR */
+	if (!flag_rdonly)
+		flags |= FTO_RDWR;
+
+	/* No ELF and symbol of VMAs is loaded */
+	if (watch_only)
+		flags = FTO_NONE;
 
 	target_task = open_task(target_pid, flags);
 	if (!target_task) {
@@ -868,20 +2014,36 @@ int ultask(int argc, char *argv[])
 	if (flag_print_status)
 		print_task_status(stdout, target_task);
 
+	if (flag_print_link_map && print_task_link_map(stdout, target_task)) {
+		fprintf(stderr, "No link_map found. %m\n");
+		ret++;
+	}
+
 	/* dump target task VMAs from /proc/PID/maps */
-	if (flag_print_vmas)
+	if (output_format != EMIT_TEXT) {
+		if (run_emit())
+			ret++;
+	} else if (flag_print_vmas && flag_residency) {
+		dump_task_vmas_residency(stdout, target_task);
+	} else if (flag_print_vmas) {
 		dump_task_vmas(stdout, target_task, is_verbose());
+	}
 
 	/* dump an VMA */
 	if (flag_dump_vma)
-		dump_task_vma_to_file(output_file, target_task, vma_addr);
+		dump_task_vma_to_file(output_file, target_task, vma_addr,
+				      dump_flags);
 
 	if (flag_dump_addr)
 		dump_task_addr_to_file(output_file, target_task, dump_addr,
-				       dump_size);
+				       dump_size, dump_flags);
 
-	if (flag_list_symbols)
-		list_all_symbols();
+	if (flag_list_symbols && output_format == EMIT_TEXT) {
+		if (!sym_filter && !sym_vma && !flag_sym_demangle)
+			list_all_symbols();
+		else if (filter_symbols(NULL))
+			ret++;
+	}
 
 	if (flag_print_threads)
 		dump_task_threads(stdout, target_task, is_verbose());
@@ -891,6 +2053,22 @@ int ultask(int argc, char *argv[])
 
 	run_jmp();
 	run_disasm();
+	if (run_batch())
+		ret++;
+	if (run_snapshot())
+		ret++;
+	if (run_soft_dirty())
+		ret++;
+	if (run_search())
+		ret++;
+	if (run_decode())
+		ret++;
+	if (run_watch())
+		ret++;
+
+	/* The unreadable pages of scanning are counted only */
+	if (is_verbose())
+		print_task_err_stats(stdout);
 
 	close_task(target_task);
 	return ret;
@@ -899,6 +2077,15 @@ int ultask(int argc, char *argv[])
 #if defined(ULP_CMD_MAIN)
 int main(int argc, char *argv[])
 {
+	int ret;
+
+	/* Run in ulpatchd(8) if ULPATCHD_SOCK is set */
+	if (!ulpatchd_client_run(prog_name, argc, argv, &ret))
+		return ret;
+
+	/* Only one task, closed before exit */
+	close_task_fast_enable(true);
+
 	return ultask(argc, argv);
 }
 #endif
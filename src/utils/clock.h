@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_CLOCK_H
+#define _UTILS_CLOCK_H
+
+#include <stdint.h>
+
+/**
+ * The clocks, all of them are read through vDSO or by one instruction,
+ * without syscall.
+ *
+ *   secs()        CLOCK_REALTIME seconds, only for the timestamps
+ *   nsecs()       CLOCK_MONOTONIC nanoseconds, for the elapsed time
+ *   usecs()       CLOCK_MONOTONIC microseconds
+ *   nsecs_raw()   CLOCK_MONOTONIC_RAW nanoseconds, not adjusted by NTP,
+ *                 for the benchmarks
+ *   ulp_cycles()  the constant rate cycle counter shared by all CPUs, TSC
+ *                 of x86_64 or the generic timer of aarch64, for the spans
+ *                 shorter than microsecond, see cycles_to_ns().
+ */
+unsigned long secs(void);
+unsigned long usecs(void);
+unsigned long nsecs(void);
+unsigned long nsecs_raw(void);
+
+static inline uint64_t ulp_cycles(void)
+{
+#if defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(v) :: "memory");
+	return v;
+#else
+# error "Unsupport architecture"
+#endif
+}
+
+double cycles_calibrate(unsigned long us);
+double cycles_per_ns(void);
+
+static inline unsigned long cycles_to_ns(uint64_t cycles)
+{
+	return cycles / cycles_per_ns();
+}
+
+struct scoped_timer {
+	unsigned long start;
+	/* Add the elapsed nanoseconds if not NULL */
+	unsigned long *acc;
+	/* Print the elapsed time by ulp_debug() if not NULL */
+	const char *name;
+};
+
+void scoped_timer_end(struct scoped_timer *t);
+
+#define __CLOCK_PASTE(a, b)	a##b
+#define __CLOCK_ID(a, b)	__CLOCK_PASTE(a, b)
+#define __SCOPED_TIMER(n, a)						\
+	struct scoped_timer __CLOCK_ID(__timer_, __COUNTER__)		\
+	__attribute__((cleanup(scoped_timer_end))) = {			\
+		.start = nsecs(), .acc = (a), .name = (n),		\
+	}
+
+/**
+ * Measure the rest of current scope by CLOCK_MONOTONIC, when the scope is
+ * left, by return or goto too, print the elapsed time, or add it into the
+ * unsigned long counter @acc:
+ *
+ *   {
+ *           SCOPED_TIMER("load symbols");
+ *           SCOPED_TIMER_ACC(&stats->load_ns);
+ *           ...
+ *   }
+ */
+#define SCOPED_TIMER(name)	__SCOPED_TIMER(name, NULL)
+#define SCOPED_TIMER_ACC(acc)	__SCOPED_TIMER(NULL, acc)
+
+#endif /* _UTILS_CLOCK_H */
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2024-2025 Rong Tao */
 #include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
 #if defined(CONFIG_CAPSTONE_HEADERS)
 # include <capstone/platform.h>
 # include <capstone/capstone.h>
@@ -9,8 +11,53 @@
 #include <utils/log.h>
 #include <utils/util.h>
 #include <utils/disasm.h>
+#include <utils/dl.h>
 
 
+/**
+ * Capstone is loaded by dlopen(3) on the first disassembling, most runs of
+ * the tools never print any instruction, don't relocate it at startup.
+ */
+static struct {
+	__typeof__(cs_open) *cs_open;
+	__typeof__(cs_close) *cs_close;
+	__typeof__(cs_option) *cs_option;
+	__typeof__(cs_malloc) *cs_malloc;
+	__typeof__(cs_free) *cs_free;
+	__typeof__(cs_disasm_iter) *cs_disasm_iter;
+	__typeof__(cs_version) *cs_version;
+} libcs;
+
+static const struct ulp_dl_sym libcs_syms[] = {
+	ULP_DL_SYM(cs_open, libcs.cs_open),
+	ULP_DL_SYM(cs_close, libcs.cs_close),
+	ULP_DL_SYM(cs_option, libcs.cs_option),
+	ULP_DL_SYM(cs_malloc, libcs.cs_malloc),
+	ULP_DL_SYM(cs_free, libcs.cs_free),
+	ULP_DL_SYM(cs_disasm_iter, libcs.cs_disasm_iter),
+	ULP_DL_SYM(cs_version, libcs.cs_version),
+};
+
+#ifndef LIBCAPSTONE_SONAME
+# define LIBCAPSTONE_SONAME	NULL
+#endif
+
+static struct ulp_dl libcs_dl = {
+	.soname = LIBCAPSTONE_SONAME,
+	.name = "libcapstone.so",
+	.syms = libcs_syms,
+	.nr_syms = ARRAY_SIZE(libcs_syms),
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define cs_open		libcs.cs_open
+#define cs_close	libcs.cs_close
+#define cs_option	libcs.cs_option
+#define cs_malloc	libcs.cs_malloc
+#define cs_free		libcs.cs_free
+#define cs_disasm_iter	libcs.cs_disasm_iter
+#define cs_version	libcs.cs_version
+
 int current_disasm_arch(void)
 {
 #if defined(__x86_64__)
@@ -28,76 +75,378 @@ int fdisasm_arch(FILE *fp, const char *pfx, unsigned long base,
 	return fdisasm(fp, pfx, current_disasm_arch(), base, code, size);
 }
 
-int fdisasm(FILE *fp, const char *pfx, int disasm_arch, unsigned long base,
-	    unsigned char *code, size_t size)
-{
-	uint64_t address;
-	cs_insn *insn;
-	size_t j, count;
-	csh handle;
-	int ret = 0;
+/**
+ * One capstone handle per architecture, opened at the first use and closed
+ * at exit, cs_open() initializes the whole architecture module, which costs
+ * much more than disassembling a few instructions. The detail of insn is
+ * off, fdisasm() only prints the mnemonic and operands.
+ */
+struct disasm_handle {
 	cs_arch arch;
 	cs_mode mode;
-	int max_bytes_per_insn = 0;
-	const char *prefix = pfx ?: "";
+	bool opened;
+	csh handle;
+};
 
-	address = base ?: (unsigned long)code;
+static struct disasm_handle disasm_handles[] = {
+	[DISASM_ARCH_X86_64] = {
+		.arch = CS_ARCH_X86,
+		.mode = CS_MODE_64,
+	},
+	[DISASM_ARCH_AARCH64] = {
+		.arch = CS_ARCH_ARM64,
+		.mode = CS_MODE_ARM,
+	},
+};
 
-	switch (disasm_arch) {
-	case DISASM_ARCH_X86_64:
-		arch = CS_ARCH_X86;
-		mode = CS_MODE_64;
-		break;
-	case DISASM_ARCH_AARCH64:
-		arch = CS_ARCH_ARM64;
-		mode = CS_MODE_ARM;
-		break;
-	default:
+/* The handle can't be used concurrently */
+static pthread_mutex_t disasm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void disasm_close_handles(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(disasm_handles); i++) {
+		if (disasm_handles[i].opened)
+			cs_close(&disasm_handles[i].handle);
+		disasm_handles[i].opened = false;
+	}
+}
+
+static int disasm_open(int disasm_arch, csh *handle)
+{
+	struct disasm_handle *h;
+	cs_err err;
+
+	if (disasm_arch <= 0 || disasm_arch >= ARRAY_SIZE(disasm_handles)) {
 		ulp_error("Disasm not support architecture.\n");
 		return -EINVAL;
 	}
 
-	cs_err err = cs_open(arch, mode, &handle);
+	if (ulp_dl_load(&libcs_dl))
+		return -ENOSYS;
+
+	h = &disasm_handles[disasm_arch];
+	err = cs_open(h->arch, h->mode, handle);
 	if (err) {
 		ulp_error("cs_open() fatal returned: %u\n", err);
 		return -EINVAL;
 	}
+	cs_option(*handle, CS_OPT_DETAIL, CS_OPT_OFF);
+	return 0;
+}
+
+/* Must hold disasm_lock */
+static csh *disasm_handle(int disasm_arch)
+{
+	static bool registered = false;
+	struct disasm_handle *h;
+	csh handle;
+
+	if (disasm_arch > 0 && disasm_arch < ARRAY_SIZE(disasm_handles) &&
+	    disasm_handles[disasm_arch].opened)
+		return &disasm_handles[disasm_arch].handle;
+
+	if (disasm_open(disasm_arch, &handle))
+		return NULL;
+
+	h = &disasm_handles[disasm_arch];
+	h->handle = handle;
+	h->opened = true;
+
+	if (!registered) {
+		atexit(disasm_close_handles);
+		registered = true;
+	}
+	return &h->handle;
+}
+
+static int disasm_width(int disasm_arch)
+{
+	return disasm_arch == DISASM_ARCH_X86_64 ? 8 : 4;
+}
+
+/**
+ * Print instructions of @code one by one, @address is updated to the end of
+ * the last decoded instruction, return the number of instructions.
+ */
+static unsigned long disasm_print(FILE *fp, const char *prefix, csh handle,
+				  cs_insn *insn, const uint8_t *code,
+				  size_t size, uint64_t *address, int width)
+{
+	unsigned long count = 0;
+	int nbytes;
+
+	while (cs_disasm_iter(handle, &code, &size, address, insn)) {
+		width = MAX(width, insn->size);
+		fprintf(fp, "%s0x%" PRIx64 ": ", prefix, insn->address);
+		nbytes = print_bytes(fp, insn->bytes, insn->size);
+		/* 1 byte equal to 3 char when print, like 'ff ' */
+		fprintf(fp, "%-*s ", width * 3 - nbytes, "");
+		fprintf(fp, "\t%s\t%s\n", insn->mnemonic, insn->op_str);
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Disassemble and print one instruction a time with cs_disasm_iter(), the
+ * memory is flat no matter how large the @code is, and the output starts
+ * right away. The bytes column is as wide as the longest instruction so
+ * far, at least the common one of the architecture.
+ */
+int fdisasm(FILE *fp, const char *pfx, int disasm_arch, unsigned long base,
+	    unsigned char *code, size_t size)
+{
+	const char *prefix = pfx ?: "";
+	unsigned long count;
+	uint64_t address;
+	cs_insn *insn;
+	csh *handle;
+	int ret = 0;
+
+	address = base ?: (unsigned long)code;
+
+	pthread_mutex_lock(&disasm_lock);
+
+	handle = disasm_handle(disasm_arch);
+	if (!handle) {
+		ret = -EINVAL;
+		goto unlock;
+	}
 
-	cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+	insn = cs_malloc(*handle);
+	if (!insn) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	fprintf(fp, "%sDisasm: code addr %p, size %ld\n", prefix, code, size);
 
-	count = cs_disasm(handle, code, size, address, 0, &insn);
+	count = disasm_print(fp, prefix, *handle, insn, code, size, &address,
+			     disasm_width(disasm_arch));
 	if (!count) {
 		ulp_error("ERROR: Failed to disasm given code!\n");
 		ret = -EINVAL;
-		goto close;
+	} else
+		fprintf(fp, "%s0x%" PRIx64 ":\n", prefix, address);
+
+	cs_free(insn, 1);
+unlock:
+	pthread_mutex_unlock(&disasm_lock);
+	return ret;
+}
+
+/**
+ * The ranges are grouped into chunks of DISASM_CHUNK_SIZE bytes at least,
+ * each chunk is disassembled into one memory stream by one thread.
+ */
+struct disasm_chunk {
+	int first;
+	int nr;
+	char *out;
+	size_t len;
+	int err;
+	bool done;
+};
+
+struct disasm_work {
+	int arch;
+	const unsigned char *code;
+	unsigned long base;
+	const struct disasm_range *ranges;
+
+	struct disasm_chunk *chunks;
+	int nr_chunks;
+	/* next chunk to disassemble, and next chunk to write */
+	int next;
+	int written;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void disasm_chunk(struct disasm_work *work, struct disasm_chunk *chunk,
+			 csh handle, cs_insn *insn)
+{
+	const struct disasm_range *r;
+	uint64_t address;
+	FILE *fp;
+	int i;
+
+	fp = open_memstream(&chunk->out, &chunk->len);
+	if (!fp) {
+		chunk->err = -errno;
+		return;
 	}
 
-	/* Get max bytes of every insn */
-	for (j = 0; j < count; j++)
-		if (max_bytes_per_insn < insn[j].size)
-			max_bytes_per_insn = insn[j].size;
-	/* 1 byte equal to 3 char when print, like 'ff ' */
-	max_bytes_per_insn *= 3;
+	for (i = chunk->first; i < chunk->first + chunk->nr; i++) {
+		r = &work->ranges[i];
+		address = r->addr;
+		if (r->name)
+			fprintf(fp, "\n%016lx <%s>:\n", r->addr, r->name);
+		disasm_print(fp, "", handle, insn,
+			     work->code + (r->addr - work->base), r->size,
+			     &address, disasm_width(work->arch));
+		/* Not code, or decoded out of sync */
+		if (address != r->addr + r->size)
+			fprintf(fp, "0x%" PRIx64 ":\t(bad)\n", address);
+	}
 
-	fprintf(fp, "%sDisasm: code addr %p, size %ld, count %ld\n", prefix,
-		code, size, count);
+	if (fclose(fp))
+		chunk->err = -errno;
+}
 
-	for (j = 0; j < count; j++) {
-		int nbytes = 0;
-		fprintf(fp, "%s0x%" PRIx64 ": ", prefix, insn[j].address);
-		nbytes = print_bytes(fp, insn[j].bytes, insn[j].size);
-		fprintf(fp, "%-*s ", max_bytes_per_insn - nbytes, "");
-		fprintf(fp, "\t%s\t%s\n",
-			insn[j].mnemonic,
-			insn[j].op_str);
+/**
+ * Take the next chunk, but not too far from the written one, the output of
+ * the taken chunks is held in memory until written.
+ */
+static struct disasm_chunk *disasm_take(struct disasm_work *work, int window)
+{
+	if (work->next >= work->nr_chunks ||
+	    work->next >= work->written + window)
+		return NULL;
+	return &work->chunks[work->next++];
+}
+
+static void *disasm_worker(void *arg)
+{
+	struct disasm_work *work = arg;
+	struct disasm_chunk *chunk;
+	cs_insn *insn = NULL;
+	csh handle;
+
+	if (disasm_open(work->arch, &handle))
+		return NULL;
+	insn = cs_malloc(handle);
+	if (!insn)
+		goto close;
+
+	pthread_mutex_lock(&work->lock);
+	while (work->next < work->nr_chunks) {
+		chunk = disasm_take(work, DISASM_MAX_THREADS * 2);
+		if (!chunk) {
+			pthread_cond_wait(&work->cond, &work->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&work->lock);
+
+		disasm_chunk(work, chunk, handle, insn);
+
+		pthread_mutex_lock(&work->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&work->cond);
 	}
-	fprintf(fp, "%s0x%" PRIx64 ":\n", prefix,
-		insn[j - 1].address + insn[j - 1].size);
+	pthread_mutex_unlock(&work->lock);
 
-	cs_free(insn, count);
+	cs_free(insn, 1);
 close:
 	cs_close(&handle);
-	return ret;
+	return NULL;
+}
+
+/**
+ * Disassemble @nr ranges in concurrent, each worker thread has its own
+ * capstone handle, the output is written to @fp in the order of @ranges.
+ * The @code is the local copy of [@base, ...), which contains all ranges,
+ * the range is printed with a "<name>:" line before if it has a name.
+ *
+ * The caller thread writes the output, and disassembles chunks too when no
+ * output is ready, thus it works even no thread could be created.
+ */
+int fdisasm_parallel(FILE *fp, int disasm_arch, const unsigned char *code,
+		     unsigned long base, const struct disasm_range *ranges,
+		     int nr, int nr_threads)
+{
+	pthread_t threads[DISASM_MAX_THREADS];
+	struct disasm_work work = {
+		.arch = disasm_arch,
+		.code = code,
+		.base = base,
+		.ranges = ranges,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct disasm_chunk *chunk;
+	cs_insn *insn = NULL;
+	int i, n, err = 0;
+	size_t size;
+	csh handle;
+
+	if (nr <= 0)
+		return 0;
+
+	err = disasm_open(disasm_arch, &handle);
+	if (err)
+		return err;
+
+	insn = cs_malloc(handle);
+	work.chunks = calloc(nr, sizeof(struct disasm_chunk));
+	if (!insn || !work.chunks) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i += n) {
+		chunk = &work.chunks[work.nr_chunks++];
+		chunk->first = i;
+		for (n = 0, size = 0; i + n < nr && size < DISASM_CHUNK_SIZE;
+		     n++)
+			size += ranges[i + n].size;
+		chunk->nr = n;
+	}
+
+	nr_threads = MIN(MIN(nr_threads, work.nr_chunks) - 1,
+			 DISASM_MAX_THREADS);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, disasm_worker, &work))
+			break;
+	}
+	nr_threads = i;
+
+	ulp_debug("Disasm %d ranges in %d chunks, %d threads.\n", nr,
+		  work.nr_chunks, nr_threads + 1);
+
+	pthread_mutex_lock(&work.lock);
+	while (work.written < work.nr_chunks) {
+		chunk = &work.chunks[work.written];
+		if (chunk->done) {
+			pthread_mutex_unlock(&work.lock);
+			if (chunk->out)
+				fwrite(chunk->out, 1, chunk->len, fp);
+			free(chunk->out);
+			chunk->out = NULL;
+			err = err ?: chunk->err;
+
+			pthread_mutex_lock(&work.lock);
+			work.written++;
+			pthread_cond_broadcast(&work.cond);
+			continue;
+		}
+
+		chunk = disasm_take(&work, DISASM_MAX_THREADS * 2);
+		if (!chunk) {
+			pthread_cond_wait(&work.cond, &work.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&work.lock);
+
+		disasm_chunk(&work, chunk, handle, insn);
+
+		pthread_mutex_lock(&work.lock);
+		chunk->done = true;
+	}
+	pthread_mutex_unlock(&work.lock);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+out:
+	free(work.chunks);
+	if (insn)
+		cs_free(insn, 1);
+	cs_close(&handle);
+	return err;
 }
 
 const char *capstone_buildtime_version(void)
@@ -118,6 +467,8 @@ const char *capstone_runtime_version(void)
 	static char buf[64];
 	if (!init) {
 		int major, minor;
+		if (ulp_dl_load(&libcs_dl))
+			return "Not Found";
 		cs_version(&major, &minor);
 		snprintf(buf, sizeof(buf), "%d.%d", major, minor);
 		init = true;
@@ -12,11 +12,29 @@
 
 int current_disasm_arch(void);
 
+/* see fdisasm_parallel() */
+#define DISASM_MAX_THREADS	64
+#define DISASM_CHUNK_SIZE	SZ_64K
+
+/**
+ * One piece of code to disassemble, like a function, the decoding starts
+ * from @addr, thus the instructions of the neighbors don't mess it up.
+ */
+struct disasm_range {
+	unsigned long addr;
+	size_t size;
+	/* Printed before the first instruction, could be NULL */
+	const char *name;
+};
+
 #if defined(CONFIG_CAPSTONE)
 int fdisasm_arch(FILE *fp, const char *pfx, unsigned long base,
 		 unsigned char *code, size_t size);
 int fdisasm(FILE *fp, const char *pfx, int disasm_arch, unsigned long base,
 	    unsigned char *code, size_t size);
+int fdisasm_parallel(FILE *fp, int disasm_arch, const unsigned char *code,
+		     unsigned long base, const struct disasm_range *ranges,
+		     int nr, int nr_threads);
 const char *capstone_buildtime_version(void);
 const char *capstone_runtime_version(void);
 #else
@@ -35,6 +53,15 @@ static int __unused fdisasm(FILE *fp, const char *pfx, int disasm_arch,
 	errno = ENOTSUPP;
 	return -ENOTSUPP;
 }
+static int __unused fdisasm_parallel(FILE *fp, int disasm_arch,
+				     const unsigned char *code,
+				     unsigned long base,
+				     const struct disasm_range *ranges,
+				     int nr, int nr_threads)
+{
+	errno = ENOTSUPP;
+	return -ENOTSUPP;
+}
 # define capstone_buildtime_version()	"Not Support Capstone"
 # define capstone_runtime_version()	"Not Support Capstone"
 #endif
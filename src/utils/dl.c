@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <dlfcn.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/dl.h>
+
+
+static void *dl_open(struct ulp_dl *dl)
+{
+	void *handle = NULL;
+
+	if (dl->soname && dl->soname[0])
+		handle = dlopen(dl->soname, RTLD_NOW | RTLD_LOCAL);
+	if (!handle && dl->name)
+		handle = dlopen(dl->name, RTLD_NOW | RTLD_LOCAL);
+	return handle;
+}
+
+/**
+ * Load the library and resolve all symbols of @dl, only the first call does
+ * the work, the later ones return the same result. On failure, none of the
+ * symbols is set.
+ */
+int ulp_dl_load(struct ulp_dl *dl)
+{
+	void *handle, *addr;
+	int i, err = 0;
+
+	if (__atomic_load_n(&dl->tried, __ATOMIC_ACQUIRE))
+		return dl->err;
+
+	pthread_mutex_lock(&dl->lock);
+	if (dl->tried) {
+		err = dl->err;
+		goto unlock;
+	}
+
+	handle = dl_open(dl);
+	if (!handle) {
+		ulp_error("dlopen %s failed, %s\n", dl->soname ?: dl->name,
+			  dlerror());
+		err = -ENOENT;
+		goto done;
+	}
+
+	for (i = 0; i < dl->nr_syms; i++) {
+		addr = dlsym(handle, dl->syms[i].name);
+		if (!addr) {
+			ulp_error("dlsym %s failed, %s\n", dl->syms[i].name,
+				  dlerror());
+			err = -ENOSYS;
+			break;
+		}
+		*dl->syms[i].addr = addr;
+	}
+	if (err) {
+		for (i = 0; i < dl->nr_syms; i++)
+			*dl->syms[i].addr = NULL;
+		dlclose(handle);
+		goto done;
+	}
+
+	dl->handle = handle;
+	ulp_debug("Loaded %s, %d symbols\n", dl->soname ?: dl->name,
+		  dl->nr_syms);
+done:
+	dl->err = err;
+	__atomic_store_n(&dl->tried, true, __ATOMIC_RELEASE);
+unlock:
+	pthread_mutex_unlock(&dl->lock);
+	return err;
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_DL_H
+#define _UTILS_DL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * A shared library loaded by dlopen(3) on first use instead of linked, the
+ * tool which never uses it doesn't pay the relocation at startup, such as
+ * libbfd for ulpinfo. The symbols are resolved into function pointers all
+ * at once, the library is never closed.
+ */
+struct ulp_dl_sym {
+	const char *name;
+	void **addr;
+};
+
+struct ulp_dl {
+	/* Try @soname first, the soname of build time, then @name */
+	const char *soname;
+	const char *name;
+	const struct ulp_dl_sym *syms;
+	int nr_syms;
+
+	pthread_mutex_t lock;
+	bool tried;
+	int err;
+	void *handle;
+};
+
+#define ULP_DL_SYM(sym, ptr)	{ #sym, (void **)&(ptr) }
+
+int ulp_dl_load(struct ulp_dl *dl);
+
+#endif /* _UTILS_DL_H */
@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <utils/log.h>
+#include <utils/emit.h>
+
+
+static const char *emit_format_names[] = {
+	[EMIT_TEXT] = "text",
+	[EMIT_JSON] = "json",
+	[EMIT_MSGPACK] = "msgpack",
+};
+
+/* Return enum emit_format, or -EINVAL */
+int emit_format_parse(const char *str)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(emit_format_names); i++)
+		if (!strcmp(str, emit_format_names[i]))
+			return i;
+	return -EINVAL;
+}
+
+const char *emit_format_name(enum emit_format format)
+{
+	return emit_format_names[format];
+}
+
+int emit_open(struct emitter *e, FILE *fp, enum emit_format format)
+{
+	memset(e, 0, sizeof(*e));
+
+	e->buf = malloc(EMIT_BUF_SIZE);
+	if (!e->buf)
+		return -ENOMEM;
+
+	e->fp = fp ?: stdout;
+	e->format = format;
+	return 0;
+}
+
+int emit_flush(struct emitter *e)
+{
+	if (e->len && fwrite(e->buf, 1, e->len, e->fp) != e->len && !e->err)
+		e->err = -EIO;
+	e->len = 0;
+	if (fflush(e->fp) && !e->err)
+		e->err = -errno;
+	return e->err;
+}
+
+/* Flush the buffer, return the first error */
+int emit_close(struct emitter *e)
+{
+	if (e->depth && !e->err) {
+		ulp_error("Emit closed with %d unterminated containers.\n",
+			  e->depth);
+		e->err = -EINVAL;
+	}
+	emit_flush(e);
+	free(e->buf);
+	e->buf = NULL;
+	return e->err;
+}
+
+/* Make sure @n bytes available, return the position */
+static char *emit_reserve(struct emitter *e, size_t n)
+{
+	if (e->len + n > EMIT_BUF_SIZE) {
+		if (fwrite(e->buf, 1, e->len, e->fp) != e->len && !e->err)
+			e->err = -EIO;
+		e->len = 0;
+	}
+	return e->buf + e->len;
+}
+
+static void emit_raw(struct emitter *e, const void *data, size_t n)
+{
+	/* Such as a large string, bypass the buffer */
+	if (n > EMIT_BUF_SIZE / 2) {
+		emit_reserve(e, EMIT_BUF_SIZE);
+		if (fwrite(data, 1, n, e->fp) != n && !e->err)
+			e->err = -EIO;
+		return;
+	}
+	memcpy(emit_reserve(e, n), data, n);
+	e->len += n;
+}
+
+static inline void emit_byte(struct emitter *e, uint8_t c)
+{
+	*emit_reserve(e, 1) = c;
+	e->len++;
+}
+
+/* MessagePack type byte and big endian value of @size bytes */
+static void mp_put(struct emitter *e, uint8_t type, uint64_t v, int size)
+{
+	char *p = emit_reserve(e, 1 + size);
+	int i;
+
+	*p++ = type;
+	for (i = size - 1; i >= 0; i--)
+		*p++ = v >> (i * 8);
+	e->len += 1 + size;
+}
+
+/* JSON separator before an element of current container */
+static void emit_item_begin(struct emitter *e)
+{
+	struct emit_level *lvl;
+
+	if (!e->depth)
+		return;
+
+	lvl = &e->stack[e->depth - 1];
+	if (lvl->done >= lvl->nr) {
+		if (!e->err)
+			ulp_error("Emit more than %u elements.\n", lvl->nr);
+		e->err = -EINVAL;
+	}
+	if (e->format == EMIT_JSON && lvl->done && !lvl->key)
+		emit_byte(e, ',');
+}
+
+/* One element is done, close the containers whose elements are done */
+static void emit_item_end(struct emitter *e)
+{
+	struct emit_level *lvl;
+
+	while (e->depth) {
+		lvl = &e->stack[e->depth - 1];
+		lvl->key = false;
+		if (++lvl->done < lvl->nr)
+			return;
+		if (e->format == EMIT_JSON)
+			emit_byte(e, lvl->map ? '}' : ']');
+		e->depth--;
+	}
+
+	/* One record per line */
+	if (e->format == EMIT_JSON)
+		emit_byte(e, '\n');
+}
+
+static void emit_container(struct emitter *e, uint32_t nr, bool map)
+{
+	struct emit_level *lvl;
+
+	emit_item_begin(e);
+
+	if (e->format == EMIT_JSON)
+		emit_byte(e, map ? '{' : '[');
+	else if (nr < 16)
+		emit_byte(e, (map ? 0x80 : 0x90) | nr);
+	else if (nr <= UINT16_MAX)
+		mp_put(e, map ? 0xde : 0xdc, nr, 2);
+	else
+		mp_put(e, map ? 0xdf : 0xdd, nr, 4);
+
+	if (e->depth == EMIT_MAX_DEPTH) {
+		ulp_error("Emit nested too deep.\n");
+		e->err = -E2BIG;
+		return;
+	}
+
+	/* Empty container is done */
+	if (!nr) {
+		if (e->format == EMIT_JSON)
+			emit_byte(e, map ? '}' : ']');
+		emit_item_end(e);
+		return;
+	}
+
+	lvl = &e->stack[e->depth++];
+	lvl->nr = nr;
+	lvl->done = 0;
+	lvl->map = map;
+	lvl->key = false;
+}
+
+void emit_map(struct emitter *e, uint32_t nr)
+{
+	emit_container(e, nr, true);
+}
+
+void emit_array(struct emitter *e, uint32_t nr)
+{
+	emit_container(e, nr, false);
+}
+
+static void json_str(struct emitter *e, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *start = str, *end = str + len;
+	unsigned char c;
+	char *p;
+
+	emit_byte(e, '"');
+	for (; str < end; str++) {
+		c = *str;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		emit_raw(e, start, str - start);
+		start = str + 1;
+
+		p = emit_reserve(e, 6);
+		p[0] = '\\';
+		switch (c) {
+		case '"':
+		case '\\':
+			p[1] = c;
+			e->len += 2;
+			break;
+		case '\n':
+			p[1] = 'n';
+			e->len += 2;
+			break;
+		case '\t':
+			p[1] = 't';
+			e->len += 2;
+			break;
+		default:
+			memcpy(p + 1, "u00", 3);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 0xf];
+			e->len += 6;
+			break;
+		}
+	}
+	emit_raw(e, start, str - start);
+	emit_byte(e, '"');
+}
+
+static void mp_str(struct emitter *e, const char *str, size_t len)
+{
+	if (len < 32)
+		emit_byte(e, 0xa0 | len);
+	else if (len <= UINT8_MAX)
+		mp_put(e, 0xd9, len, 1);
+	else if (len <= UINT16_MAX)
+		mp_put(e, 0xda, len, 2);
+	else
+		mp_put(e, 0xdb, len, 4);
+	emit_raw(e, str, len);
+}
+
+void emit_key(struct emitter *e, const char *key)
+{
+	struct emit_level *lvl = e->depth ? &e->stack[e->depth - 1] : NULL;
+
+	if (!lvl || !lvl->map || lvl->key) {
+		if (!e->err)
+			ulp_error("Emit key %s out of map.\n", key);
+		e->err = -EINVAL;
+		return;
+	}
+
+	emit_item_begin(e);
+	if (e->format == EMIT_JSON) {
+		json_str(e, key, strlen(key));
+		emit_byte(e, ':');
+	} else
+		mp_str(e, key, strlen(key));
+	lvl->key = true;
+}
+
+void emit_strn(struct emitter *e, const char *str, size_t len)
+{
+	emit_item_begin(e);
+	if (e->format == EMIT_JSON)
+		json_str(e, str, len);
+	else
+		mp_str(e, str, len);
+	emit_item_end(e);
+}
+
+void emit_str(struct emitter *e, const char *str)
+{
+	emit_strn(e, str, strlen(str));
+}
+
+static void json_u64(struct emitter *e, uint64_t v, bool neg)
+{
+	char tmp[21], *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (neg)
+		*--p = '-';
+	emit_raw(e, p, tmp + sizeof(tmp) - p);
+}
+
+static void mp_u64(struct emitter *e, uint64_t v)
+{
+	if (v < 128)
+		emit_byte(e, v);
+	else if (v <= UINT8_MAX)
+		mp_put(e, 0xcc, v, 1);
+	else if (v <= UINT16_MAX)
+		mp_put(e, 0xcd, v, 2);
+	else if (v <= UINT32_MAX)
+		mp_put(e, 0xce, v, 4);
+	else
+		mp_put(e, 0xcf, v, 8);
+}
+
+void emit_u64(struct emitter *e, uint64_t v)
+{
+	emit_item_begin(e);
+	if (e->format == EMIT_JSON)
+		json_u64(e, v, false);
+	else
+		mp_u64(e, v);
+	emit_item_end(e);
+}
+
+void emit_s64(struct emitter *e, int64_t v)
+{
+	if (v >= 0) {
+		emit_u64(e, v);
+		return;
+	}
+
+	emit_item_begin(e);
+	if (e->format == EMIT_JSON)
+		json_u64(e, -(uint64_t)v, true);
+	else if (v >= -32)
+		emit_byte(e, v);
+	else if (v >= INT8_MIN)
+		mp_put(e, 0xd0, v, 1);
+	else if (v >= INT16_MIN)
+		mp_put(e, 0xd1, v, 2);
+	else if (v >= INT32_MIN)
+		mp_put(e, 0xd2, v, 4);
+	else
+		mp_put(e, 0xd3, v, 8);
+	emit_item_end(e);
+}
+
+void emit_bool(struct emitter *e, bool v)
+{
+	emit_item_begin(e);
+	if (e->format == EMIT_JSON)
+		emit_raw(e, v ? "true" : "false", v ? 4 : 5);
+	else
+		emit_byte(e, v ? 0xc3 : 0xc2);
+	emit_item_end(e);
+}
+
+void emit_nil(struct emitter *e)
+{
+	emit_item_begin(e);
+	if (e->format == EMIT_JSON)
+		emit_raw(e, "null", 4);
+	else
+		emit_byte(e, 0xc0);
+	emit_item_end(e);
+}
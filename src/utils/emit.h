@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_EMIT_H
+#define _UTILS_EMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <utils/util.h>
+
+/**
+ * Streaming emitter of machine-readable records, JSON or MessagePack. Every
+ * top-level value is one record, in JSON, one record per line, in
+ * MessagePack, one object after another. The output is encoded into a large
+ * buffer and written to the FILE when the buffer is full, no fprintf(3) for
+ * every field.
+ *
+ * The number of elements of map and array must be known in advance, which
+ * is needed by MessagePack, and the container is closed automatically after
+ * its last element:
+ *
+ *   emit_map(e, 2);
+ *   emit_key(e, "name");
+ *   emit_str(e, "main");
+ *   emit_key(e, "addr");
+ *   emit_u64(e, 0x401000);
+ */
+
+enum emit_format {
+	EMIT_TEXT,
+	EMIT_JSON,
+	EMIT_MSGPACK,
+};
+
+#define EMIT_BUF_SIZE	SZ_1M
+#define EMIT_MAX_DEPTH	16
+
+struct emit_level {
+	/* Elements, map counts the key-value pairs */
+	uint32_t nr;
+	uint32_t done;
+	bool map;
+	/* The key of map is emitted, the value is next */
+	bool key;
+};
+
+struct emitter {
+	FILE *fp;
+	enum emit_format format;
+	char *buf;
+	size_t len;
+	int depth;
+	struct emit_level stack[EMIT_MAX_DEPTH];
+	/* The first error, negative errno */
+	int err;
+};
+
+int emit_format_parse(const char *str);
+const char *emit_format_name(enum emit_format format);
+
+int emit_open(struct emitter *e, FILE *fp, enum emit_format format);
+int emit_flush(struct emitter *e);
+int emit_close(struct emitter *e);
+
+void emit_map(struct emitter *e, uint32_t nr);
+void emit_array(struct emitter *e, uint32_t nr);
+void emit_key(struct emitter *e, const char *key);
+void emit_str(struct emitter *e, const char *str);
+void emit_strn(struct emitter *e, const char *str, size_t len);
+void emit_u64(struct emitter *e, uint64_t v);
+void emit_s64(struct emitter *e, int64_t v);
+void emit_bool(struct emitter *e, bool v);
+void emit_nil(struct emitter *e);
+
+static inline void emit_kv_str(struct emitter *e, const char *key,
+			       const char *str)
+{
+	emit_key(e, key);
+	if (str)
+		emit_str(e, str);
+	else
+		emit_nil(e);
+}
+
+static inline void emit_kv_u64(struct emitter *e, const char *key,
+			       uint64_t v)
+{
+	emit_key(e, key);
+	emit_u64(e, v);
+}
+
+static inline void emit_kv_s64(struct emitter *e, const char *key, int64_t v)
+{
+	emit_key(e, key);
+	emit_s64(e, v);
+}
+
+static inline void emit_kv_bool(struct emitter *e, const char *key, bool v)
+{
+	emit_key(e, key);
+	emit_bool(e, v);
+}
+
+#endif /* _UTILS_EMIT_H */
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdlib.h>
+#include <errno.h>
+
+#include <utils/util.h>
+#include <utils/eytzinger.h>
+
+
+/* Fill the subtree of @k in-order from the sorted @keys, return next @i */
+static size_t eytz_fill(struct eytz_index *idx, const unsigned long *keys,
+			void *const *vals, size_t i, size_t k)
+{
+	/* The depth is log2(nr), no deep recursion */
+	if (k > idx->nr)
+		return i;
+
+	i = eytz_fill(idx, keys, vals, i, 2 * k);
+	idx->keys[k] = keys[i];
+	idx->vals[k] = vals[i];
+	return eytz_fill(idx, keys, vals, i + 1, 2 * k + 1);
+}
+
+/**
+ * Build from @nr keys sorted in ascending order, the duplicate keys are
+ * allowed, eytz_find() returns any one of them. The old index is freed.
+ */
+int eytz_build(struct eytz_index *idx, const unsigned long *keys,
+	       void *const *vals, size_t nr)
+{
+	unsigned long *k;
+	void **v;
+
+	k = malloc((nr + 1) * sizeof(*k));
+	v = malloc((nr + 1) * sizeof(*v));
+	if (!k || !v) {
+		free(k);
+		free(v);
+		return -ENOMEM;
+	}
+
+	eytz_free(idx);
+	idx->keys = k;
+	idx->vals = v;
+	idx->nr = nr;
+	eytz_fill(idx, keys, vals, 0, 1);
+	return 0;
+}
+
+struct eytz_pair {
+	unsigned long key;
+	void *val;
+};
+
+static int eytz_pair_cmp(const void *a, const void *b)
+{
+	unsigned long x = ((const struct eytz_pair *)a)->key;
+	unsigned long y = ((const struct eytz_pair *)b)->key;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Same as eytz_build(), sort @keys and @vals together first */
+int eytz_build_unsorted(struct eytz_index *idx, unsigned long *keys,
+			void **vals, size_t nr)
+{
+	struct eytz_pair *pairs;
+	size_t i;
+
+	pairs = malloc(nr * sizeof(*pairs) ?: 1);
+	if (!pairs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		pairs[i].key = keys[i];
+		pairs[i].val = vals[i];
+	}
+	qsort(pairs, nr, sizeof(*pairs), eytz_pair_cmp);
+	for (i = 0; i < nr; i++) {
+		keys[i] = pairs[i].key;
+		vals[i] = pairs[i].val;
+	}
+	free(pairs);
+
+	return eytz_build(idx, keys, vals, nr);
+}
+
+void eytz_free(struct eytz_index *idx)
+{
+	free(idx->keys);
+	free(idx->vals);
+	eytz_init(idx);
+}
+
+/**
+ * Return the position of the first key >= @key, 0 if all keys are less
+ * than @key.
+ */
+size_t eytz_lower_bound(const struct eytz_index *idx, unsigned long key)
+{
+	const unsigned long *keys = idx->keys;
+	size_t k = 1;
+
+	while (k <= idx->nr) {
+		/* The 16 descendants 4 levels down, in one or two lines */
+		__builtin_prefetch(keys + 16 * k);
+		k = 2 * k + (keys[k] < key);
+	}
+
+	/* Go back up through the right turns, to the last left turn */
+	k >>= __builtin_ffsl(~k);
+	return k;
+}
+
+void *eytz_find(const struct eytz_index *idx, unsigned long key)
+{
+	size_t k = eytz_lower_bound(idx, key);
+
+	return k && idx->keys[k] == key ? idx->vals[k] : NULL;
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_EYTZINGER_H
+#define _UTILS_EYTZINGER_H
+
+#include <stddef.h>
+
+/**
+ * Build-once, search-many index of unsigned long keys, the sorted keys are
+ * stored in Eytzinger (BFS) order, eytz_index::keys[1] is the root and the
+ * children of keys[k] are keys[2k] and keys[2k+1]. The search is a branch
+ * free descent over one contiguous array, the next levels are prefetched,
+ * thus one cache miss per few levels instead of one per level of rbtree.
+ *
+ * The key is such as an address or an interned string pointer, see
+ * str_intern(), the values are parallel to the keys. Rebuild it after the
+ * indexed set changed, it's never updated in place.
+ */
+struct eytz_index {
+	/* 1-based, keys[0] and vals[0] are not used */
+	unsigned long *keys;
+	void **vals;
+	size_t nr;
+};
+
+static inline void eytz_init(struct eytz_index *idx)
+{
+	idx->keys = NULL;
+	idx->vals = NULL;
+	idx->nr = 0;
+}
+
+int eytz_build(struct eytz_index *idx, const unsigned long *keys,
+	       void *const *vals, size_t nr);
+int eytz_build_unsorted(struct eytz_index *idx, unsigned long *keys,
+			void **vals, size_t nr);
+void eytz_free(struct eytz_index *idx);
+
+size_t eytz_lower_bound(const struct eytz_index *idx, unsigned long key);
+void *eytz_find(const struct eytz_index *idx, unsigned long key);
+
+#endif /* _UTILS_EYTZINGER_H */
@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #include <string.h>
 #include <malloc.h>
 #include <errno.h>
@@ -119,49 +122,78 @@ int ftouch(const char *filepath, size_t size)
 	return 0;
 }
 
-static int __remove_recursive(const char *path)
+/**
+ * Remove @name of @dirfd and everything under it, relative to the opened
+ * directories, thus no path is built and no stat(2) is needed: unlink(2)
+ * first, it fails with EISDIR if a directory, unless @d_type says so. The
+ * symlinks are removed, never followed. readdir(3) reads the entries by
+ * getdents64(2) in batches.
+ */
+static int remove_tree_at(int dirfd, const char *name, unsigned char d_type)
 {
-	DIR *dirp;
+	int fd, err = 0, ret;
 	struct dirent *dp;
-	struct stat dir_stat;
-	char dir_name[PATH_MAX];
+	DIR *dir;
+
+	if (d_type != DT_DIR) {
+		if (!unlinkat(dirfd, name, 0) || errno == ENOENT)
+			return 0;
+		/* EPERM of POSIX, or no permission of a file */
+		if (errno != EISDIR && errno != EPERM)
+			return -errno;
+		err = -errno;
+	}
 
-	/* path not exist */
-	if (!fexist(path)) {
-		return 0;
+	fd = openat(dirfd, name,
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOTDIR && err)
+			return err;
+		return errno == ENOENT ? 0 : -errno;
 	}
+	err = 0;
 
-	/* get attribution error */
-	if (stat(path, &dir_stat) == -1) {
-		ulp_error("get dir:%s stat error.\n", path);
-		return -1;
+	dir = fdopendir(fd);
+	if (!dir) {
+		err = -errno;
+		close(fd);
+		return err;
 	}
 
-	/* regular file, delete */
-	if (S_ISREG(dir_stat.st_mode)) {
-		ulp_debug("Delete file %s\n", path);
-		remove(path);
-	} else if (S_ISDIR(dir_stat.st_mode)) {
-		dirp = opendir(path);
-		while ((dp = readdir(dirp))!= NULL) {
-			if ((0 == strcmp(".", dp->d_name)) ||
-			    (0 == strcmp("..", dp->d_name)))
-				continue;
-			sprintf(dir_name, "%s/%s", path, dp->d_name);
-			__remove_recursive(dir_name);
-		}
-		closedir(dirp);
-		ulp_debug("Delete dir %s\n", path);
-		rmdir(path);
-	} else {
-		ulp_error("unknow type: %s!\n", path);
+	while ((dp = readdir(dir)) != NULL) {
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		ret = remove_tree_at(fd, dp->d_name, dp->d_type);
+		if (ret && !err)
+			err = ret;
 	}
-	return 0;
+	closedir(dir);
+
+	/* Try even if some of it failed, report the first error */
+	if (unlinkat(dirfd, name, AT_REMOVEDIR) && errno != ENOENT && !err)
+		err = -errno;
+	return err;
+}
+
+/* Like rm -rf @name of @dirfd, return 0 if not exist, or -errno. */
+int fremove_recursive_at(int dirfd, const char *name)
+{
+	int err;
+
+	if (!name)
+		return -EINVAL;
+
+	err = remove_tree_at(dirfd, name, DT_UNKNOWN);
+	if (err)
+		ulp_debug("Remove %s failed, %s\n", name, strerror(-err));
+	return err;
 }
 
 int fremove_recursive(const char *filepath)
 {
-	return __remove_recursive(filepath);
+	if (!filepath)
+		return 0;
+	return fremove_recursive_at(AT_FDCWD, filepath);
 }
 
 static int _file_type_mem(struct mmap_struct *mem)
@@ -198,52 +230,65 @@ file_type ftype(const char *filepath)
 	return _file_type(filepath);
 }
 
-/* Make sure @srcpath is exist and @dstpath is not exist
- *
- * return - bytes of copy if success, -errno if fail
+/**
+ * Copy @size bytes from @src_fd to @dst_fd in kernel, reflink if filesystem
+ * supports it, then copy_file_range(2), which fails across filesystems of
+ * old kernels, then sendfile(2), the bytes left are copied through user
+ * buffer at last.
  */
-static int _file_copy(const char *srcpath, const char *dstpath)
+static int fcopy_fd(int dst_fd, int src_fd, size_t size)
 {
-	FILE *in, *out;
-	int n, nbytes = 0;
+	loff_t off_in = 0, off_out = 0;
+	char buf[64 * 1024];
+	ssize_t n;
 
-	in = fopen(srcpath, "r");
-	if (!in) {
-		ulp_error("open %s failed.\n", srcpath);
-		return -errno;
-	}
-	out = fopen(dstpath, "w");
-	if (!out) {
-		ulp_error("open %s failed.\n", dstpath);
-		fclose(in);
-		return -errno;
+#if defined(FICLONE)
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+		ulp_debug("Reflink %ld bytes.\n", size);
+		return 0;
 	}
+#endif
 
-	while (1) {
-		uint8_t c;
-
-		n = fread(&c, 1, 1, in);
-		if (n != 1 || feof(in))
-			break;
-
-		n = fwrite(&c, 1, 1, out);
-		if (n != 1)
+	while (size > 0) {
+		n = copy_file_range(src_fd, &off_in, dst_fd, &off_out, size, 0);
+		if (n <= 0)
 			break;
-
-		nbytes++;
+		size -= n;
 	}
 
-	fclose(in);
-	fclose(out);
+	/* sendfile(2) writes from current offset of @dst_fd */
+	if (size > 0 && lseek(dst_fd, off_out, SEEK_SET) == off_out) {
+		while (size > 0) {
+			n = sendfile(dst_fd, src_fd, &off_in, size);
+			if (n <= 0)
+				break;
+			off_out += n;
+			size -= n;
+		}
+	}
 
-	ulp_debug("copy a %d bytes file.\n", nbytes);
+	while (size > 0) {
+		n = pread(src_fd, buf, MIN(size, sizeof(buf)), off_in);
+		if (n <= 0 || pwrite(dst_fd, buf, n, off_out) != n) {
+			ulp_error("copy failed, %m\n");
+			return -EIO;
+		}
+		off_in += n;
+		off_out += n;
+		size -= n;
+	}
 
-	return nbytes;
+	return 0;
 }
 
+/**
+ * Copy @srcpath to a new file @dstpath of the same mode, in kernel, see
+ * fcopy_fd(). Return 0 if success, -errno if fail.
+ */
 int fcopy(const char *srcpath, const char *dstpath)
 {
-	int err, ret = 0;
+	int in_fd, out_fd, ret;
+	struct stat st;
 
 	if (!srcpath || !dstpath)
 		return -EINVAL;
@@ -251,12 +296,34 @@ int fcopy(const char *srcpath, const char *dstpath)
 	if (!fexist(srcpath) || fexist(dstpath))
 		return -EEXIST;
 
-	err = _file_copy(srcpath, dstpath);
-	if (err <= 0) {
-		ulp_error("copy from %s to %s failed\n", srcpath, dstpath);
-		ret = err;
+	in_fd = open(srcpath, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		ulp_error("open %s failed, %m\n", srcpath);
+		return -errno;
+	}
+	if (fstat(in_fd, &st)) {
+		ret = -errno;
+		goto close_in;
 	}
 
+	out_fd = open(dstpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		      st.st_mode & 0777);
+	if (out_fd < 0) {
+		ret = -errno;
+		ulp_error("open %s failed, %m\n", dstpath);
+		goto close_in;
+	}
+
+	ret = fcopy_fd(out_fd, in_fd, st.st_size);
+	close(out_fd);
+	if (ret) {
+		ulp_error("copy from %s to %s failed\n", srcpath, dstpath);
+		unlink(dstpath);
+	} else
+		ulp_debug("copy a %ld bytes file.\n", st.st_size);
+
+close_in:
+	close(in_fd);
 	return ret;
 }
 
@@ -284,6 +351,31 @@ char *fmktempname(char *buf, int buf_len, char *seed)
 	return basename(buf);
 }
 
+/**
+ * Read @filepath into @buf by one read(2), for the /proc files which are
+ * generated on read, one read returns the whole file if @len is large
+ * enough. The @buf is always null-terminated, at most @len - 1 bytes are
+ * read. Return the number of bytes read, or -errno.
+ */
+ssize_t fload(const char *filepath, void *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, buf, len - 1);
+	if (n < 0)
+		n = -errno;
+	else
+		((char *)buf)[n] = '\0';
+
+	close(fd);
+	return n;
+}
+
 /* Load a @file to @mem, make sure @file exist in file system */
 int fmemcpy(void *mem, int mem_len, const char *file)
 {
@@ -373,6 +465,43 @@ struct mmap_struct *fmmap_shmem_create(const char *filepath, size_t size)
 			PROT_READ | PROT_WRITE | PROT_EXEC, size);
 }
 
+/**
+ * Create @filepath as a copy of @from, and map it shared like
+ * fmmap_shmem_create(). The content never goes through user space, unless
+ * the kernel can't copy between the two filesystems.
+ */
+struct mmap_struct *fmmap_shmem_copy(const char *filepath, const char *from)
+{
+	int fd, from_fd, ret, size;
+
+	size = fsize(from);
+	if (size < 0)
+		return NULL;
+
+	from_fd = open(from, O_RDONLY);
+	if (from_fd < 0) {
+		ulp_error("open %s failed, %m\n", from);
+		return NULL;
+	}
+
+	fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ulp_error("open %s failed, %m\n", filepath);
+		close(from_fd);
+		return NULL;
+	}
+
+	ret = fcopy_fd(fd, from_fd, size);
+	close(from_fd);
+	close(fd);
+	if (ret)
+		return NULL;
+
+	/* Already has the size, no truncate */
+	return _mmap_file(filepath, O_RDWR, MAP_SHARED,
+			  PROT_READ | PROT_WRITE | PROT_EXEC, 0);
+}
+
 int fmunmap(struct mmap_struct *mem)
 {
 	return _munmap_file(mem);
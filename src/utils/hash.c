@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdint.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+
+#define HASH_STRIPE	64
+#define HASH_LANES	(HASH_STRIPE / sizeof(uint64_t))
+
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+
+static const uint64_t hash_keys[HASH_LANES] = {
+	0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+	0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+	0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL,
+	0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static inline void hash_stripe(uint64_t *acc, const unsigned char *p)
+{
+	uint64_t d[HASH_LANES], k;
+	int i;
+
+	memcpy(d, p, sizeof(d));
+	for (i = 0; i < HASH_LANES; i++) {
+		k = d[i] ^ hash_keys[i];
+		acc[i ^ 1] += d[i];
+		acc[i] += (k & 0xffffffff) * (k >> 32);
+	}
+}
+
+/**
+ * 64 bits hash of the XXH3 style, for the large buffers, such as pages: all
+ * 64 bytes stripes are accumulated into 8 lanes independently, the lane
+ * adds the data of neighbour lane, and the product of the low and high 32
+ * bits of data xor key, thus the loop is vectorized by compiler, SSE2 or
+ * AVX2 of x86_64, NEON of aarch64. The result is not the same as XXH3.
+ */
+uint64_t ulp_hash64(const void *data, size_t len, uint64_t seed)
+{
+	uint64_t acc[HASH_LANES], h;
+	unsigned char tail[HASH_STRIPE];
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < HASH_LANES; i++)
+		acc[i] = seed + hash_keys[i] * PRIME64_1;
+
+	for (i = 0; i + HASH_STRIPE <= len; i += HASH_STRIPE)
+		hash_stripe(acc, p + i);
+
+	if (i < len) {
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, p + i, len - i);
+		hash_stripe(acc, tail);
+	}
+
+	h = len * PRIME64_1;
+	for (i = 0; i < HASH_LANES; i++) {
+		h ^= acc[i] * PRIME64_2;
+		h = (h << 31 | h >> 33) * PRIME64_1;
+	}
+
+	/* Avalanche */
+	h ^= h >> 37;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
@@ -19,6 +19,10 @@
 #include <patch/patch.h>
 #include <patch/meta.h>
 
+#if defined(__x86_64__)
+#include <arch/x86_64/nops.h>
+#endif
+
 
 static int __dry_run = false;
 static int __verbose = 0;
@@ -102,6 +106,10 @@ void ulpatch_init(void)
 	__check_and_exit();
 	__env_init();
 
+#if defined(__x86_64__)
+	arch_init_ideal_nops();
+#endif
+
 	elf_core_init();
 }
 
@@ -116,6 +124,11 @@ void enable_dry_run(void)
 	__dry_run = true;
 }
 
+void disable_dry_run(void)
+{
+	__dry_run = false;
+}
+
 /* Verbose APIs */
 bool is_verbose(void)
 {
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_INTERVAL_TREE_H
+#define _UTILS_INTERVAL_TREE_H
+
+#include <utils/rbtree.h>
+
+/**
+ * Interval tree of unsigned long closed intervals [start, last], such as
+ * address ranges, see include/linux/interval_tree.h. Every node keeps the
+ * max last of its subtree, thus the overlapped intervals are found in
+ * O(log n + k). Other types can be defined by INTERVAL_TREE_DEFINE() of
+ * utils/interval_tree_generic.h.
+ *
+ *   for (n = interval_tree_iter_first(&root, start, last); n;
+ *        n = interval_tree_iter_next(n, start, last))
+ */
+struct interval_tree_node {
+	struct rb_node rb;
+	unsigned long start;	/* Start of interval */
+	unsigned long last;	/* Last location _in_ interval */
+	unsigned long __subtree_last;
+};
+
+void interval_tree_insert(struct interval_tree_node *node,
+			  struct rb_root *root);
+void interval_tree_remove(struct interval_tree_node *node,
+			  struct rb_root *root);
+
+struct interval_tree_node *
+interval_tree_iter_first(struct rb_root *root, unsigned long start,
+			 unsigned long last);
+struct interval_tree_node *
+interval_tree_iter_next(struct interval_tree_node *node, unsigned long start,
+			unsigned long last);
+
+#endif /* _UTILS_INTERVAL_TREE_H */
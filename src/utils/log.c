@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <utils/log.h>
 
@@ -25,13 +26,45 @@ static const char *level_prefix[] = {
 	"[\033[1;35mDEBUG\033[m]",
 };
 
-static int log_level = LOG_ERR;
+int ulp_log_level = LOG_ERR;
 static bool prefix_on = false;
 static FILE *log_fp = NULL;
 
+/**
+ * Asynchronous writer, ulp_log() formats the record into a bounded ring and
+ * returns, the writer thread does the slow stdio and syslog. A full ring
+ * blocks the producer instead of dropping logs, and messages longer than
+ * LOG_MSG_MAX are truncated.
+ */
+#define LOG_RING_SIZE	256
+#define LOG_MSG_MAX	1024
+
+struct log_record {
+	int level;
+	FILE *fp;
+	/* syslog has it's own prefix */
+	int prefix_len;
+	char msg[LOG_MSG_MAX];
+};
+
+static struct {
+	bool running;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct log_record *ring;
+	unsigned int head, tail;
+} log_async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.not_empty = PTHREAD_COND_INITIALIZER,
+	.not_full = PTHREAD_COND_INITIALIZER,
+};
+
 void init_syslog(void)
 {
-	setlogmask(LOG_UPTO(log_level));
+	setlogmask(LOG_UPTO(ulp_log_level));
 	openlog("ulpatch", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 }
 
@@ -42,8 +75,8 @@ static void close_syslog(void)
 
 void set_log_level(int level)
 {
-	if (log_level != level) {
-		log_level = level;
+	if (ulp_log_level != level) {
+		ulp_log_level = level;
 		close_syslog();
 		init_syslog();
 	}
@@ -51,7 +84,7 @@ void set_log_level(int level)
 
 int get_log_level(void)
 {
-	return log_level;
+	return ulp_log_level;
 }
 
 void set_log_debug(void)
@@ -112,22 +145,186 @@ const char *log_level_list(void)
 	return "debug,dbg,info,inf,notice,note,warning,warn,error,err,crit,alert,emerg";
 }
 
+static void *log_async_writer(void *arg)
+{
+	struct log_record *r;
+
+	pthread_mutex_lock(&log_async.lock);
+	for (;;) {
+		while (log_async.head == log_async.tail && !log_async.stop)
+			pthread_cond_wait(&log_async.not_empty, &log_async.lock);
+		if (log_async.head == log_async.tail)
+			break;
+
+		/* Producers never touch the slot until tail moves on */
+		r = &log_async.ring[log_async.tail % LOG_RING_SIZE];
+		pthread_mutex_unlock(&log_async.lock);
+
+		syslog(r->level, "%s", r->msg + r->prefix_len);
+		fputs(r->msg, r->fp);
+
+		pthread_mutex_lock(&log_async.lock);
+		log_async.tail++;
+		pthread_cond_broadcast(&log_async.not_full);
+	}
+	pthread_mutex_unlock(&log_async.lock);
+	return NULL;
+}
+
+/* No one holds the lock across fork(), see log_async_atfork_child() */
+static void log_async_atfork_prepare(void)
+{
+	pthread_mutex_lock(&log_async.lock);
+}
+
+static void log_async_atfork_parent(void)
+{
+	pthread_mutex_unlock(&log_async.lock);
+}
+
+/**
+ * The writer thread doesn't exist in child, the logs of child are written
+ * synchronous, the queued ones are left to the writer of parent.
+ */
+static void log_async_atfork_child(void)
+{
+	struct log_record *ring = log_async.ring;
+
+	log_async.running = false;
+	log_async.stop = false;
+	log_async.ring = NULL;
+	log_async.head = log_async.tail = 0;
+	pthread_cond_init(&log_async.not_empty, NULL);
+	pthread_cond_init(&log_async.not_full, NULL);
+	pthread_mutex_unlock(&log_async.lock);
+	free(ring);
+}
+
+/**
+ * Start the asynchronous writer thread, the logs are written in order, but
+ * may interleave with printf() to the same FILE. ulp_log_async_stop() is
+ * registered with atexit(), thus no log is lost at exit(). The child of
+ * fork(2) logs synchronous.
+ */
+int ulp_log_async_start(void)
+{
+	static bool registered = false;
+	struct log_record *ring;
+	int err;
+
+	if (log_async.running)
+		return 0;
+
+	ring = malloc(sizeof(*ring) * LOG_RING_SIZE);
+	if (!ring)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&log_async.lock);
+	log_async.ring = ring;
+	log_async.head = log_async.tail = 0;
+	log_async.stop = false;
+	err = pthread_create(&log_async.thread, NULL, log_async_writer, NULL);
+	if (err) {
+		log_async.ring = NULL;
+		pthread_mutex_unlock(&log_async.lock);
+		free(ring);
+		return -err;
+	}
+	log_async.running = true;
+	pthread_mutex_unlock(&log_async.lock);
+
+	if (!registered) {
+		atexit(ulp_log_async_stop);
+		pthread_atfork(log_async_atfork_prepare,
+			       log_async_atfork_parent,
+			       log_async_atfork_child);
+		registered = true;
+	}
+	return 0;
+}
+
+/* Drain the ring and stop the writer thread */
+void ulp_log_async_stop(void)
+{
+	struct log_record *ring;
+
+	pthread_mutex_lock(&log_async.lock);
+	if (!log_async.running) {
+		pthread_mutex_unlock(&log_async.lock);
+		return;
+	}
+	/* New logs fallback to synchronous from now on */
+	log_async.running = false;
+	log_async.stop = true;
+	pthread_cond_signal(&log_async.not_empty);
+	pthread_mutex_unlock(&log_async.lock);
+
+	pthread_join(log_async.thread, NULL);
+
+	pthread_mutex_lock(&log_async.lock);
+	ring = log_async.ring;
+	log_async.ring = NULL;
+	pthread_mutex_unlock(&log_async.lock);
+	free(ring);
+
+	fflush(get_log_fp());
+}
+
+/* Wait for all queued logs to be written */
+void ulp_log_flush(void)
+{
+	pthread_mutex_lock(&log_async.lock);
+	while (log_async.ring && log_async.head != log_async.tail)
+		pthread_cond_wait(&log_async.not_full, &log_async.lock);
+	pthread_mutex_unlock(&log_async.lock);
+}
+
+/**
+ * Queue one record, return -1 if the asynchronous writer is not running,
+ * the caller writes it synchronously.
+ */
+static int log_async_push(int level, FILE *fp, const char *prefix,
+			  const char *fmt, va_list va)
+{
+	struct log_record *r;
+	int len, n;
+
+	pthread_mutex_lock(&log_async.lock);
+	if (!log_async.running) {
+		pthread_mutex_unlock(&log_async.lock);
+		return -1;
+	}
+
+	while (log_async.head - log_async.tail >= LOG_RING_SIZE)
+		pthread_cond_wait(&log_async.not_full, &log_async.lock);
+
+	r = &log_async.ring[log_async.head % LOG_RING_SIZE];
+	r->level = level;
+	r->fp = fp;
+	len = snprintf(r->msg, sizeof(r->msg), "%s", prefix);
+	r->prefix_len = MIN(len, (int)sizeof(r->msg) - 1);
+	n = vsnprintf(r->msg + r->prefix_len, sizeof(r->msg) - r->prefix_len,
+		      fmt, va);
+
+	log_async.head++;
+	pthread_cond_signal(&log_async.not_empty);
+	pthread_mutex_unlock(&log_async.lock);
+
+	return n;
+}
+
 int __attribute__((format(printf, 6, 7)))
 ulp_log(int level, bool has_prefix, const char *file, const char *func,
 	unsigned long int line, char *fmt, ...)
 {
 	int n = 0;
 	FILE *fp = get_log_fp();
+	char prefix[256] = "";
 	va_list va;
 	int _en = errno;
 
-
-	/* syslog anyway */
-	va_start(va, fmt);
-	vsyslog(level, fmt, va);
-	va_end(va);
-
-	if (level > log_level)
+	/* The macros check it already, but ulp_log() may be called directly */
+	if (level > ulp_log_level)
 		return 0;
 
 	if (has_prefix && likely(prefix_on)) {
@@ -137,20 +334,31 @@ ulp_log(int level, bool has_prefix, const char *file, const char *func,
 		/* like 15:53:52 */
 		strftime(buffer, 32, "%T", localtime(&timestamp));
 
-		fprintf(fp, "%s %s[%s %s:%ld]",
-			buffer,
-			level_prefix[level],
-			basename((char *)file),
-			func,
-			line);
-		if (level <= LOG_ERR && _en != 0)
-			fprintf(fp, "[%s]", strerror(_en));
-
-		fprintf(fp, " ");
+		n = snprintf(prefix, sizeof(prefix), "%s %s[%s %s:%ld]",
+			     buffer, level_prefix[level],
+			     basename((char *)file), func, line);
+		if (level <= LOG_ERR && _en != 0 && n < sizeof(prefix))
+			n += snprintf(prefix + n, sizeof(prefix) - n, "[%s]",
+				      strerror(_en));
+		if (n < sizeof(prefix) - 1)
+			strcat(prefix, " ");
+		n = 0;
 	}
 
 	va_start(va, fmt);
-	n += vfprintf(fp, fmt, va);
+	n = log_async_push(level, fp, prefix, fmt, va);
+	va_end(va);
+	if (n >= 0)
+		return n;
+
+	va_start(va, fmt);
+	vsyslog(level, fmt, va);
+	va_end(va);
+
+	fputs(prefix, fp);
+
+	va_start(va, fmt);
+	n = vfprintf(fp, fmt, va);
 	va_end(va);
 
 	return n;
@@ -158,8 +366,9 @@ ulp_log(int level, bool has_prefix, const char *file, const char *func,
 
 int memshowinlog(int level, const void *data, int data_len)
 {
-	if (level > log_level)
+	if (level > ulp_log_level)
 		return 0;
+	ulp_log_flush();
 	return memshow(get_log_fp(), data, data_len);
 }
 
@@ -6,15 +6,37 @@
 #include <syslog.h>
 #include <stdbool.h>
 
+/**
+ * Logs above CONFIG_LOG_MAX_LEVEL are compiled out, and logs above the runtime
+ * log level are not formatted at all, even the arguments are not evaluated,
+ * so feel free to ulp_debug() in hot paths.
+ */
+#ifndef CONFIG_LOG_MAX_LEVEL
+# define CONFIG_LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+extern int ulp_log_level;
+
+#define ulp_log_enabled(level)	\
+	((level) <= CONFIG_LOG_MAX_LEVEL &&	\
+	 __builtin_expect((level) <= ulp_log_level, 0))
+
 /* Has prefix if set_log_prefix on */
-#define ulp_debug(fmt...) ulp_log(LOG_DEBUG, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_info(fmt...) ulp_log(LOG_INFO, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_notice(fmt...) ulp_log(LOG_NOTICE, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_warning(fmt...) ulp_log(LOG_WARNING, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_error(fmt...) ulp_log(LOG_ERR, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_crit(fmt...) ulp_log(LOG_CRIT, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_alert(fmt...) ulp_log(LOG_ALERT, true, __FILE__, __func__, __LINE__, fmt)
-#define ulp_emerg(fmt...) ulp_log(LOG_EMERG, true, __FILE__, __func__, __LINE__, fmt)
+#define __ulp_log(level, fmt...) ({	\
+	int __n = 0;	\
+	if (ulp_log_enabled(level))	\
+		__n = ulp_log(level, true, __FILE__, __func__, __LINE__, fmt);	\
+	__n;	\
+})
+
+#define ulp_debug(fmt...) __ulp_log(LOG_DEBUG, fmt)
+#define ulp_info(fmt...) __ulp_log(LOG_INFO, fmt)
+#define ulp_notice(fmt...) __ulp_log(LOG_NOTICE, fmt)
+#define ulp_warning(fmt...) __ulp_log(LOG_WARNING, fmt)
+#define ulp_error(fmt...) __ulp_log(LOG_ERR, fmt)
+#define ulp_crit(fmt...) __ulp_log(LOG_CRIT, fmt)
+#define ulp_alert(fmt...) __ulp_log(LOG_ALERT, fmt)
+#define ulp_emerg(fmt...) __ulp_log(LOG_EMERG, fmt)
 
 
 int __attribute__((format(printf, 6, 7)))
@@ -29,6 +51,10 @@ void set_log_debug(void);
 void set_log_error(void);
 void set_log_prefix(bool on);
 
+int ulp_log_async_start(void);
+void ulp_log_async_stop(void);
+void ulp_log_flush(void);
+
 int str2loglevel(const char *str);
 const char *log_level_list(void);
 
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+
+#include <utils/util.h>
+#include <utils/memstat.h>
+
+
+static struct ulp_mem_stat mem_stats[ULP_MEM_NUM];
+/* The peak of the sum, not the sum of peaks */
+static struct ulp_mem_stat mem_total;
+static bool mem_stats_enabled = false;
+
+static const char *mem_type_names[ULP_MEM_NUM] = {
+	[ULP_MEM_OTHER] = "other",
+	[ULP_MEM_VMA] = "vma",
+	[ULP_MEM_TASK_SYM] = "task_sym",
+	[ULP_MEM_BFD_SYM] = "bfd_sym",
+	[ULP_MEM_ELF_SYM] = "elf_sym",
+	[ULP_MEM_ELF_FILE] = "elf_file",
+	[ULP_MEM_LOAD_INFO] = "load_info",
+	[ULP_MEM_CACHE] = "mem_cache",
+	[ULP_MEM_ARENA] = "arena",
+	[ULP_MEM_STRING] = "string",
+};
+
+static void mem_stat_add(struct ulp_mem_stat *s, long bytes, long nr)
+{
+	long now, peak;
+
+	if (nr)
+		__atomic_add_fetch(&s->nr, nr, __ATOMIC_RELAXED);
+	if (!bytes)
+		return;
+
+	now = __atomic_add_fetch(&s->bytes, bytes, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&s->peak, __ATOMIC_RELAXED);
+	while (now > peak &&
+	       !__atomic_compare_exchange_n(&s->peak, &peak, now, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * Add @bytes and @nr objects to @type, the negative ones for release. The
+ * objects of slab are counted one by one, by one relaxed atomic add.
+ */
+void ulp_mem_account(enum ulp_mem_type type, long bytes, long nr)
+{
+	mem_stat_add(&mem_stats[type], bytes, nr);
+	mem_stat_add(&mem_total, bytes, nr);
+}
+
+void ulp_mem_get_stats(struct ulp_mem_stat stats[ULP_MEM_NUM],
+		       struct ulp_mem_stat *total)
+{
+	int i;
+
+	for (i = 0; i < ULP_MEM_NUM; i++) {
+		stats[i].bytes = __atomic_load_n(&mem_stats[i].bytes,
+						 __ATOMIC_RELAXED);
+		stats[i].peak = __atomic_load_n(&mem_stats[i].peak,
+						__ATOMIC_RELAXED);
+		stats[i].nr = __atomic_load_n(&mem_stats[i].nr,
+					      __ATOMIC_RELAXED);
+	}
+	if (total) {
+		total->bytes = __atomic_load_n(&mem_total.bytes,
+					       __ATOMIC_RELAXED);
+		total->peak = __atomic_load_n(&mem_total.peak,
+					      __ATOMIC_RELAXED);
+		total->nr = __atomic_load_n(&mem_total.nr, __ATOMIC_RELAXED);
+	}
+}
+
+const char *ulp_mem_type_name(enum ulp_mem_type type)
+{
+	return type < ULP_MEM_NUM ? mem_type_names[type] : "unknown";
+}
+
+void print_ulp_mem_stats(FILE *fp)
+{
+	struct ulp_mem_stat stats[ULP_MEM_NUM], total;
+	int i;
+
+	ulp_mem_get_stats(stats, &total);
+
+	fprintf(fp, "%-12s %12s %12s %10s\n", "MEMORY", "BYTES", "PEAK",
+		"OBJECTS");
+	for (i = 0; i < ULP_MEM_NUM; i++) {
+		if (!stats[i].peak && !stats[i].nr)
+			continue;
+		fprintf(fp, "%-12s %12ld %12ld %10ld\n", mem_type_names[i],
+			stats[i].bytes, stats[i].peak, stats[i].nr);
+	}
+	fprintf(fp, "%-12s %12ld %12ld %10ld\n", "total", total.bytes,
+		total.peak, total.nr);
+}
+
+void ulp_mem_stats_enable(bool enable)
+{
+	mem_stats_enabled = enable;
+}
+
+bool ulp_mem_stats_enabled(void)
+{
+	return mem_stats_enabled;
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_MEMSTAT_H
+#define _UTILS_MEMSTAT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * Local memory of each subsystem, the live bytes, the peak of them, and the
+ * number of live objects, accounted where the memory is allocated in bulk,
+ * such as the chunks of slab_cache and str_pool, thus it's always on, and
+ * the daemon could report it whenever asked. The memory of libelf, libbfd
+ * and the other libraries is not counted, except the estimate of
+ * bfd_elf_file.
+ */
+enum ulp_mem_type {
+	/* The slab_cache and str_pool of no type */
+	ULP_MEM_OTHER,
+	ULP_MEM_VMA,
+	ULP_MEM_TASK_SYM,
+	ULP_MEM_BFD_SYM,
+	ULP_MEM_ELF_SYM,
+	ULP_MEM_ELF_FILE,
+	ULP_MEM_LOAD_INFO,
+	ULP_MEM_CACHE,
+	ULP_MEM_ARENA,
+	ULP_MEM_STRING,
+	ULP_MEM_NUM,
+};
+
+struct ulp_mem_stat {
+	long bytes;
+	long peak;
+	long nr;
+};
+
+void ulp_mem_account(enum ulp_mem_type type, long bytes, long nr);
+void ulp_mem_get_stats(struct ulp_mem_stat stats[ULP_MEM_NUM],
+		       struct ulp_mem_stat *total);
+const char *ulp_mem_type_name(enum ulp_mem_type type);
+void print_ulp_mem_stats(FILE *fp);
+
+/* See --mem-stats */
+void ulp_mem_stats_enable(bool enable);
+bool ulp_mem_stats_enabled(void);
+
+#endif /* _UTILS_MEMSTAT_H */
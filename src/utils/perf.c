@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/perf.h>
+
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_CNT_NUM] = {
+	[PERF_CNT_CYCLES] = {
+		"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+	},
+	[PERF_CNT_INSTRUCTIONS] = {
+		"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+	},
+	[PERF_CNT_CACHE_MISSES] = {
+		"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,
+	},
+	[PERF_CNT_BRANCH_MISSES] = {
+		"branch-misses", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	},
+	[PERF_CNT_PAGE_FAULTS] = {
+		"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,
+	},
+};
+
+const char *perf_counter_name(enum perf_counter cnt)
+{
+	return perf_events[cnt].name;
+}
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+	return syscall(__NR_perf_event_open, attr, 0, -1, group_fd,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+static int perf_open_one(struct perf_counters *pc, enum perf_counter cnt,
+			 int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_events[cnt].type;
+	attr.config = perf_events[cnt].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = group_fd < 0;
+	attr.exclude_kernel = pc->exclude_kernel;
+	attr.exclude_hv = 1;
+
+	return perf_event_open(&attr, group_fd);
+}
+
+/**
+ * Open the counters of current thread, the kernel is counted too if
+ * perf_event_paranoid allows, it's where the syscalls, such as ptrace(2)
+ * and process_vm_readv(2), spend. Return -errno if no counter opened.
+ */
+int perf_counters_open(struct perf_counters *pc)
+{
+	int i, fd, group_fd = -1;
+
+	memset(pc, 0, sizeof(*pc));
+	for (i = 0; i < PERF_CNT_NUM; i++) {
+		pc->fds[i] = -1;
+		pc->pos[i] = -1;
+	}
+
+	for (i = 0; i < PERF_CNT_NUM; i++) {
+		fd = perf_open_one(pc, i, group_fd);
+		if (fd < 0 && (errno == EACCES || errno == EPERM) &&
+		    !pc->exclude_kernel && group_fd < 0) {
+			pc->exclude_kernel = true;
+			fd = perf_open_one(pc, i, group_fd);
+		}
+		if (fd < 0) {
+			ulp_debug("perf counter %s not supported, %m\n",
+				  perf_events[i].name);
+			continue;
+		}
+		if (group_fd < 0)
+			group_fd = fd;
+		pc->fds[i] = fd;
+		pc->pos[i] = pc->nr_opened++;
+	}
+
+	if (group_fd < 0)
+		return -ENOTSUP;
+
+	ioctl(group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return 0;
+}
+
+void perf_counters_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = PERF_CNT_NUM - 1; i >= 0; i--) {
+		if (pc->fds[i] >= 0)
+			close(pc->fds[i]);
+		pc->fds[i] = -1;
+		pc->pos[i] = -1;
+	}
+	pc->nr_opened = 0;
+}
+
+void perf_counters_reset(struct perf_counters *pc)
+{
+	memset(pc->sum, 0, sizeof(pc->sum));
+	pc->nr = 0;
+}
+
+/* Group read, the leader is the first opened counter */
+static int perf_read(struct perf_counters *pc, uint64_t *vals)
+{
+	uint64_t buf[1 + PERF_CNT_NUM];
+	ssize_t len = (1 + pc->nr_opened) * sizeof(uint64_t);
+	int i;
+
+	for (i = 0; i < PERF_CNT_NUM && pc->fds[i] < 0; i++);
+	if (i == PERF_CNT_NUM)
+		return -ENOTSUP;
+
+	if (read(pc->fds[i], buf, len) != len)
+		return -EIO;
+
+	for (i = 0; i < PERF_CNT_NUM; i++)
+		vals[i] = pc->pos[i] >= 0 ? buf[1 + pc->pos[i]] : 0;
+	return 0;
+}
+
+int perf_counters_start(struct perf_counters *pc)
+{
+	return perf_read(pc, pc->start);
+}
+
+int perf_counters_stop(struct perf_counters *pc)
+{
+	uint64_t vals[PERF_CNT_NUM];
+	int i, err;
+
+	err = perf_read(pc, vals);
+	if (err)
+		return err;
+
+	for (i = 0; i < PERF_CNT_NUM; i++)
+		pc->sum[i] += vals[i] - pc->start[i];
+	pc->nr++;
+	return 0;
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_PERF_H
+#define _UTILS_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Hardware and software counters of perf_event_open(2) of current thread,
+ * opened as one group, thus read by one read(2) and scheduled together.
+ * The counters not supported, such as the hardware counters in some VMs,
+ * are skipped, see perf_counters_has().
+ *
+ *   perf_counters_open(&pc);
+ *   perf_counters_start(&pc);
+ *   ...measured section...
+ *   perf_counters_stop(&pc);
+ *   perf_counters_close(&pc);
+ *
+ * pc.sum[] are accumulated by every start/stop, pc.nr is the number of
+ * measured sections.
+ */
+
+enum perf_counter {
+	PERF_CNT_CYCLES,
+	PERF_CNT_INSTRUCTIONS,
+	PERF_CNT_CACHE_MISSES,
+	PERF_CNT_BRANCH_MISSES,
+	PERF_CNT_PAGE_FAULTS,
+	PERF_CNT_NUM,
+};
+
+struct perf_counters {
+	int fds[PERF_CNT_NUM];
+	/* The position in the value array of group read, -1 if not opened */
+	int pos[PERF_CNT_NUM];
+	int nr_opened;
+	bool exclude_kernel;
+
+	uint64_t start[PERF_CNT_NUM];
+	uint64_t sum[PERF_CNT_NUM];
+	unsigned long nr;
+};
+
+const char *perf_counter_name(enum perf_counter cnt);
+
+int perf_counters_open(struct perf_counters *pc);
+void perf_counters_close(struct perf_counters *pc);
+void perf_counters_reset(struct perf_counters *pc);
+int perf_counters_start(struct perf_counters *pc);
+int perf_counters_stop(struct perf_counters *pc);
+
+static inline bool perf_counters_has(struct perf_counters *pc,
+				     enum perf_counter cnt)
+{
+	return pc->pos[cnt] >= 0;
+}
+
+#endif /* _UTILS_PERF_H */
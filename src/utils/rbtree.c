@@ -93,7 +93,8 @@ __rb_rotate_set_parents(struct rb_node *old, struct rb_node *new,
 }
 
 static __always_inline void
-__rb_insert(struct rb_node *node, struct rb_root *root)
+__rb_insert(struct rb_node *node, struct rb_root *root,
+	    void (*augment_rotate)(struct rb_node *old, struct rb_node *new))
 {
 	struct rb_node *parent = rb_red_parent(node), *gparent, *tmp;
 
@@ -158,6 +159,7 @@ __rb_insert(struct rb_node *node, struct rb_root *root)
 					rb_set_parent_color(tmp, parent,
 							    RB_BLACK);
 				rb_set_parent_color(parent, node, RB_RED);
+				augment_rotate(parent, node);
 				parent = node;
 				tmp = node->rb_right;
 			}
@@ -176,6 +178,7 @@ __rb_insert(struct rb_node *node, struct rb_root *root)
 			if (tmp)
 				rb_set_parent_color(tmp, gparent, RB_BLACK);
 			__rb_rotate_set_parents(gparent, parent, root, RB_RED);
+			augment_rotate(gparent, parent);
 			break;
 		} else {
 			tmp = gparent->rb_left;
@@ -199,6 +202,7 @@ __rb_insert(struct rb_node *node, struct rb_root *root)
 					rb_set_parent_color(tmp, parent,
 							    RB_BLACK);
 				rb_set_parent_color(parent, node, RB_RED);
+				augment_rotate(parent, node);
 				parent = node;
 				tmp = node->rb_left;
 			}
@@ -209,6 +213,7 @@ __rb_insert(struct rb_node *node, struct rb_root *root)
 			if (tmp)
 				rb_set_parent_color(tmp, gparent, RB_BLACK);
 			__rb_rotate_set_parents(gparent, parent, root, RB_RED);
+			augment_rotate(gparent, parent);
 			break;
 		}
 	}
@@ -219,7 +224,8 @@ __rb_insert(struct rb_node *node, struct rb_root *root)
  * and eliminate the dummy_rotate callback there
  */
 static __always_inline void
-____rb_erase_color(struct rb_node *parent, struct rb_root *root)
+____rb_erase_color(struct rb_node *parent, struct rb_root *root,
+	void (*augment_rotate)(struct rb_node *old, struct rb_node *new))
 {
 	struct rb_node *node = NULL, *sibling, *tmp1, *tmp2;
 
@@ -249,6 +255,7 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root)
 				rb_set_parent_color(tmp1, parent, RB_BLACK);
 				__rb_rotate_set_parents(parent, sibling, root,
 							RB_RED);
+				augment_rotate(parent, sibling);
 				sibling = tmp1;
 			}
 			tmp1 = sibling->rb_right;
@@ -316,6 +323,7 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root)
 				if (tmp1)
 					rb_set_parent_color(tmp1, sibling,
 							    RB_BLACK);
+				augment_rotate(sibling, tmp2);
 				tmp1 = sibling;
 				sibling = tmp2;
 			}
@@ -339,6 +347,7 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root)
 				rb_set_parent(tmp2, parent);
 			__rb_rotate_set_parents(parent, sibling, root,
 						RB_BLACK);
+			augment_rotate(parent, sibling);
 			break;
 		} else {
 			sibling = parent->rb_left;
@@ -350,6 +359,7 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root)
 				rb_set_parent_color(tmp1, parent, RB_BLACK);
 				__rb_rotate_set_parents(parent, sibling, root,
 							RB_RED);
+				augment_rotate(parent, sibling);
 				sibling = tmp1;
 			}
 			tmp1 = sibling->rb_left;
@@ -377,6 +387,7 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root)
 				if (tmp1)
 					rb_set_parent_color(tmp1, sibling,
 							    RB_BLACK);
+				augment_rotate(sibling, tmp2);
 				tmp1 = sibling;
 				sibling = tmp2;
 			}
@@ -389,14 +400,17 @@ ____rb_erase_color(struct rb_node *parent, struct rb_root *root)
 				rb_set_parent(tmp2, parent);
 			__rb_rotate_set_parents(parent, sibling, root,
 						RB_BLACK);
+			augment_rotate(parent, sibling);
 			break;
 		}
 	}
 }
 
-void __rb_erase_color(struct rb_node *parent, struct rb_root *root)
+/* Non-inline version for rb_erase_augmented() use */
+void __rb_erase_color(struct rb_node *parent, struct rb_root *root,
+	void (*augment_rotate)(struct rb_node *old, struct rb_node *new))
 {
-	____rb_erase_color(parent, root);
+	____rb_erase_color(parent, root, augment_rotate);
 }
 
 
@@ -407,18 +421,41 @@ void __rb_erase_color(struct rb_node *parent, struct rb_root *root)
  * out of the rb_insert_color() and rb_erase() function definitions.
  */
 
+static inline void dummy_propagate(struct rb_node *node, struct rb_node *stop) {}
+static inline void dummy_copy(struct rb_node *old, struct rb_node *new) {}
+static inline void dummy_rotate(struct rb_node *old, struct rb_node *new) {}
+
+static const struct rb_augment_callbacks dummy_callbacks = {
+	.propagate = dummy_propagate,
+	.copy = dummy_copy,
+	.rotate = dummy_rotate
+};
+
 void rb_insert_color(struct rb_node *node, struct rb_root *root)
 {
-	__rb_insert(node, root);
+	__rb_insert(node, root, dummy_rotate);
 }
 
 
 void rb_erase(struct rb_node *node, struct rb_root *root)
 {
 	struct rb_node *rebalance;
-	rebalance = __rb_erase(node, root);
+	rebalance = __rb_erase_augmented(node, root, &dummy_callbacks);
 	if (rebalance)
-		____rb_erase_color(rebalance, root);
+		____rb_erase_color(rebalance, root, dummy_rotate);
+}
+
+/*
+ * Augmented rbtree manipulation functions.
+ *
+ * This instantiates the same __always_inline functions as in the non-augmented
+ * case, but this time with user-defined callbacks.
+ */
+
+void __rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+	void (*augment_rotate)(struct rb_node *old, struct rb_node *new))
+{
+	__rb_insert(node, root, augment_rotate);
 }
 
 
@@ -568,3 +605,46 @@ struct rb_node *rb_first_postorder(const struct rb_root *root)
 
 	return rb_left_deepest_node(root->rb_node);
 }
+
+static struct rb_node *__rb_build_sorted(struct rb_node **nodes,
+					 unsigned long nr,
+					 struct rb_node *parent, int depth,
+					 int red_depth)
+{
+	struct rb_node *node;
+	unsigned long mid;
+
+	if (!nr)
+		return NULL;
+
+	mid = nr / 2;
+	node = nodes[mid];
+	rb_set_parent_color(node, parent,
+			    depth == red_depth ? RB_RED : RB_BLACK);
+	node->rb_left = __rb_build_sorted(nodes, mid, node, depth + 1,
+					  red_depth);
+	node->rb_right = __rb_build_sorted(nodes + mid + 1, nr - mid - 1, node,
+					   depth + 1, red_depth);
+	return node;
+}
+
+/*
+ * Build a balanced tree bottom-up from @nodes, which must be in the order
+ * rb_first()/rb_next() would return them, the old links of nodes are
+ * overwritten.
+ *
+ * Splitting at the middle, all levels except the deepest one are full, the
+ * nodes of the full levels are black and the ones of the deepest partial
+ * level are red, thus all paths have the same number of black nodes.
+ */
+void rb_build_sorted(struct rb_root *root, struct rb_node **nodes,
+		     unsigned long nr)
+{
+	int red_depth = 0;
+
+	/* Number of full levels, nr >= 2^red_depth - 1 */
+	while ((2UL << red_depth) - 1 <= nr)
+		red_depth++;
+
+	root->rb_node = __rb_build_sorted(nodes, nr, NULL, 0, red_depth);
+}
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <utils/log.h>
+#include <utils/slab.h>
+
+
+struct slab_chunk {
+	/* struct slab_cache.chunks or struct str_pool.chunks */
+	struct list_head node;
+	/* Include this header, see ulp_mem_account() */
+	size_t size;
+	/* keep data aligned for any object type */
+	long double data[];
+};
+
+#define SLAB_ALIGN	sizeof(long double)
+
+static struct slab_chunk *alloc_chunk(struct list_head *chunks, size_t size,
+				      enum ulp_mem_type mem_type)
+{
+	struct slab_chunk *chunk;
+
+	chunk = malloc(sizeof(struct slab_chunk) + size);
+	if (!chunk) {
+		ulp_error("Malloc slab chunk failed.\n");
+		return NULL;
+	}
+	chunk->size = sizeof(struct slab_chunk) + size;
+	ulp_mem_account(mem_type, chunk->size, 0);
+	list_add(&chunk->node, chunks);
+	return chunk;
+}
+
+static void free_chunks(struct list_head *chunks, enum ulp_mem_type mem_type)
+{
+	struct slab_chunk *chunk, *tmp;
+	long bytes = 0;
+
+	list_for_each_entry_safe(chunk, tmp, chunks, node) {
+		list_del(&chunk->node);
+		bytes += chunk->size;
+		free(chunk);
+	}
+	ulp_mem_account(mem_type, -bytes, 0);
+}
+
+void slab_cache_init(struct slab_cache *cache, size_t obj_size,
+		     size_t nr_per_chunk)
+{
+	memset(cache, 0, sizeof(struct slab_cache));
+
+	/* Free object store the next free object pointer */
+	obj_size = MAX(obj_size, sizeof(void *));
+	cache->obj_size = ROUND_UP(obj_size, SLAB_ALIGN);
+	cache->nr_per_chunk = nr_per_chunk ?: SLAB_DEFAULT_NR_PER_CHUNK;
+	list_init(&cache->chunks);
+}
+
+/**
+ * The returned object is not zeroed.
+ */
+void *slab_alloc(struct slab_cache *cache)
+{
+	struct slab_chunk *chunk;
+	void *obj;
+
+	if (cache->free_list) {
+		obj = cache->free_list;
+		cache->free_list = *(void **)obj;
+		goto done;
+	}
+
+	if (cache->cur == cache->end) {
+		size_t size = cache->obj_size * cache->nr_per_chunk;
+
+		chunk = alloc_chunk(&cache->chunks, size, cache->mem_type);
+		if (!chunk)
+			return NULL;
+		cache->cur = (char *)chunk->data;
+		cache->end = cache->cur + size;
+		cache->nr_chunks++;
+	}
+
+	obj = cache->cur;
+	cache->cur += cache->obj_size;
+
+done:
+	cache->nr_allocs++;
+	ulp_mem_account(cache->mem_type, 0, 1);
+	return obj;
+}
+
+void slab_free(struct slab_cache *cache, void *obj)
+{
+	if (!obj)
+		return;
+	*(void **)obj = cache->free_list;
+	cache->free_list = obj;
+	cache->nr_frees++;
+	ulp_mem_account(cache->mem_type, 0, -1);
+}
+
+void slab_cache_destroy(struct slab_cache *cache)
+{
+	ulp_mem_account(cache->mem_type, 0,
+			-(long)(cache->nr_allocs - cache->nr_frees));
+	free_chunks(&cache->chunks, cache->mem_type);
+	cache->cur = cache->end = NULL;
+	cache->free_list = NULL;
+	cache->nr_chunks = 0;
+	cache->nr_allocs = cache->nr_frees = 0;
+}
+
+void str_pool_init(struct str_pool *pool, size_t chunk_size)
+{
+	memset(pool, 0, sizeof(struct str_pool));
+	pool->chunk_size = chunk_size ?: STR_POOL_DEFAULT_CHUNK_SIZE;
+	list_init(&pool->chunks);
+}
+
+/**
+ * The returned memory is not aligned.
+ */
+void *str_pool_alloc(struct str_pool *pool, size_t size)
+{
+	struct slab_chunk *chunk;
+	void *p;
+
+	if ((size_t)(pool->end - pool->cur) < size) {
+		/* Too large allocation has it's own chunk */
+		size_t chunk_size = MAX(size, pool->chunk_size);
+
+		chunk = alloc_chunk(&pool->chunks, chunk_size, pool->mem_type);
+		if (!chunk)
+			return NULL;
+		pool->nr_chunks++;
+
+		/* Keep the current chunk if the new one is used up */
+		if (chunk_size == size) {
+			p = chunk->data;
+			goto done;
+		}
+		pool->cur = (char *)chunk->data;
+		pool->end = pool->cur + chunk_size;
+	}
+
+	p = pool->cur;
+	pool->cur += size;
+
+done:
+	pool->nr_bytes += size;
+	pool->nr_allocs++;
+	ulp_mem_account(pool->mem_type, 0, 1);
+	return p;
+}
+
+char *str_pool_strdup(struct str_pool *pool, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *str;
+
+	str = str_pool_alloc(pool, len);
+	if (str)
+		memcpy(str, s, len);
+	return str;
+}
+
+void str_pool_destroy(struct str_pool *pool)
+{
+	ulp_mem_account(pool->mem_type, 0, -(long)pool->nr_allocs);
+	free_chunks(&pool->chunks, pool->mem_type);
+	pool->cur = pool->end = NULL;
+	pool->nr_chunks = 0;
+	pool->nr_bytes = 0;
+	pool->nr_allocs = 0;
+}
+
+/**
+ * The interned string is stored in str_intern_pool right after it's hash
+ * value, thus str_intern_hash() is free.
+ */
+struct intern_entry {
+	unsigned int hash;
+	unsigned int len;
+	const char *str;
+};
+
+#define STR_INTERN_MIN_SLOTS	1024
+
+static struct {
+	struct intern_entry *slots;
+	/* power of two */
+	size_t nr_slots;
+	size_t nr_strs;
+	struct str_pool pool;
+} str_intern_table = {
+	.pool = {
+		.chunks = LIST_HEAD_INIT(str_intern_table.pool.chunks),
+		.chunk_size = STR_POOL_DEFAULT_CHUNK_SIZE,
+		.mem_type = ULP_MEM_STRING,
+	},
+};
+
+/* FNV-1a */
+unsigned int str_hash(const char *s, size_t len)
+{
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)s[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+unsigned int str_intern_hash(const char *interned)
+{
+	unsigned int hash;
+	memcpy(&hash, interned - sizeof(hash), sizeof(hash));
+	return hash;
+}
+
+static struct intern_entry *intern_slot(const char *s, size_t len,
+					unsigned int hash)
+{
+	struct intern_entry *e;
+	size_t mask = str_intern_table.nr_slots - 1;
+	size_t i;
+
+	/* Linear probing, the table is never full */
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		e = &str_intern_table.slots[i];
+		if (!e->str)
+			return e;
+		if (e->hash == hash && e->len == len && !memcmp(e->str, s, len))
+			return e;
+	}
+}
+
+static int intern_grow(void)
+{
+	struct intern_entry *old = str_intern_table.slots, *e;
+	size_t old_nr = str_intern_table.nr_slots, i;
+	size_t nr = old_nr ? old_nr << 1 : STR_INTERN_MIN_SLOTS;
+
+	e = calloc(nr, sizeof(struct intern_entry));
+	if (!e) {
+		ulp_error("Malloc intern table failed.\n");
+		return -ENOMEM;
+	}
+
+	ulp_mem_account(ULP_MEM_STRING,
+			(long)(nr - old_nr) * sizeof(struct intern_entry), 0);
+	str_intern_table.slots = e;
+	str_intern_table.nr_slots = nr;
+
+	for (i = 0; i < old_nr; i++) {
+		if (!old[i].str)
+			continue;
+		e = intern_slot(old[i].str, old[i].len, old[i].hash);
+		*e = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+const char *str_intern_len(const char *s, size_t len)
+{
+	struct intern_entry *e;
+	unsigned int hash;
+	char *str;
+
+	/* Keep load factor under 3/4 */
+	if ((str_intern_table.nr_strs + 1) * 4 >
+	    str_intern_table.nr_slots * 3 && intern_grow())
+		return NULL;
+
+	hash = str_hash(s, len);
+	e = intern_slot(s, len, hash);
+	if (e->str)
+		return e->str;
+
+	str = str_pool_alloc(&str_intern_table.pool, sizeof(hash) + len + 1);
+	if (!str)
+		return NULL;
+
+	memcpy(str, &hash, sizeof(hash));
+	str += sizeof(hash);
+	memcpy(str, s, len);
+	str[len] = '\0';
+
+	e->hash = hash;
+	e->len = len;
+	e->str = str;
+	str_intern_table.nr_strs++;
+
+	return str;
+}
+
+const char *str_intern(const char *s)
+{
+	return str_intern_len(s, strlen(s));
+}
+
+/**
+ * Return NULL if the string was never interned, which means no symbol or
+ * anything else has this name.
+ */
+const char *str_intern_lookup(const char *s)
+{
+	struct intern_entry *e;
+	size_t len = strlen(s);
+
+	if (!str_intern_table.nr_strs)
+		return NULL;
+
+	e = intern_slot(s, len, str_hash(s, len));
+	return e->str;
+}
+
+void str_intern_destroy(void)
+{
+	ulp_mem_account(ULP_MEM_STRING, -(long)(str_intern_table.nr_slots *
+			sizeof(struct intern_entry)), 0);
+	free(str_intern_table.slots);
+	str_intern_table.slots = NULL;
+	str_intern_table.nr_slots = 0;
+	str_intern_table.nr_strs = 0;
+	str_pool_destroy(&str_intern_table.pool);
+}
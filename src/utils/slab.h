@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_SLAB_H
+#define _UTILS_SLAB_H
+
+#include <stddef.h>
+
+#include <utils/list.h>
+#include <utils/memstat.h>
+
+/**
+ * Fixed size object cache, objects are carved out of large chunks, the freed
+ * objects are kept in a free list and reused. All objects are released by
+ * one slab_cache_destroy(), no need to free them one by one.
+ *
+ * The chunks and objects are accounted to @mem_type, set it after init.
+ */
+struct slab_cache {
+	size_t obj_size;
+	size_t nr_per_chunk;
+	enum ulp_mem_type mem_type;
+
+	/* struct slab_chunk.node */
+	struct list_head chunks;
+	/* next unused object in the newest chunk */
+	char *cur, *end;
+	/* freed objects, linked through the first word of the object */
+	void *free_list;
+
+	unsigned long nr_chunks;
+	unsigned long nr_allocs;
+	unsigned long nr_frees;
+};
+
+/**
+ * Bump allocator for strings, the strings can't be released separately,
+ * str_pool_destroy() release all of them.
+ */
+struct str_pool {
+	size_t chunk_size;
+	/* See slab_cache::mem_type */
+	enum ulp_mem_type mem_type;
+	/* struct slab_chunk.node */
+	struct list_head chunks;
+	char *cur, *end;
+
+	unsigned long nr_chunks;
+	unsigned long nr_bytes;
+	unsigned long nr_allocs;
+};
+
+#define SLAB_DEFAULT_NR_PER_CHUNK	256
+#define STR_POOL_DEFAULT_CHUNK_SIZE	(64 * 1024)
+
+void slab_cache_init(struct slab_cache *cache, size_t obj_size,
+		     size_t nr_per_chunk);
+void *slab_alloc(struct slab_cache *cache);
+void slab_free(struct slab_cache *cache, void *obj);
+void slab_cache_destroy(struct slab_cache *cache);
+
+void str_pool_init(struct str_pool *pool, size_t chunk_size);
+void *str_pool_alloc(struct str_pool *pool, size_t size);
+char *str_pool_strdup(struct str_pool *pool, const char *s);
+void str_pool_destroy(struct str_pool *pool);
+
+/**
+ * Global interned strings, each distinct string is stored only once, and
+ * lives until str_intern_destroy(). Two interned strings are equal if and
+ * only if the pointers are equal. The interned string must not be modified.
+ */
+const char *str_intern(const char *s);
+const char *str_intern_len(const char *s, size_t len);
+const char *str_intern_lookup(const char *s);
+unsigned int str_intern_hash(const char *interned);
+unsigned int str_hash(const char *s, size_t len);
+void str_intern_destroy(void);
+
+#endif /* _UTILS_SLAB_H */
@@ -8,116 +8,233 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #include <utils/list.h>
 #include <utils/log.h>
 
+/* 16 bytes vector, SSE2 of x86_64 and NEON of aarch64 */
+typedef unsigned char u8x16 __attribute__((vector_size(16)));
+
+/**
+ * The hex strings of memory are formatted into a buffer, which is written
+ * by one fwrite(3) once full, no fprintf(3) for each byte, thus dump MBs
+ * of memory is bound by I/O.
+ */
+#define HEX_BUF_SIZE	16384
+
+struct hex_buf {
+	FILE *fp;
+	size_t len;
+	size_t total;
+	char buf[HEX_BUF_SIZE];
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void hex_buf_flush(struct hex_buf *hb)
+{
+	if (hb->len)
+		fwrite(hb->buf, 1, hb->len, hb->fp);
+	hb->total += hb->len;
+	hb->len = 0;
+}
+
+/* Room of @n bytes at least, @n is less than HEX_BUF_SIZE */
+static char *hex_buf_reserve(struct hex_buf *hb, size_t n)
+{
+	if (hb->len + n > HEX_BUF_SIZE)
+		hex_buf_flush(hb);
+	return hb->buf + hb->len;
+}
+
+static void hex_buf_puts(struct hex_buf *hb, const char *s)
+{
+	size_t n = strlen(s);
+
+	memcpy(hex_buf_reserve(hb, n), s, n);
+	hb->len += n;
+}
+
+static inline char *hex_byte(char *p, uint8_t b)
+{
+	p[0] = hex_digits[b >> 4];
+	p[1] = hex_digits[b & 0xf];
+	return p + 2;
+}
+
+/**
+ * The high and low hex digits, and the printable characters of 16 bytes,
+ * all of them are computed at once in vectors.
+ */
+static void hex16(const unsigned char *src, char hi[16], char lo[16],
+		  char text[16])
+{
+	u8x16 v, h, l, m;
+
+	memcpy(&v, src, sizeof(v));
+	h = v >> 4;
+	l = v & 0xf;
+	h += '0' + ((u8x16)(h > 9) & ('a' - '0' - 10));
+	l += '0' + ((u8x16)(l > 9) & ('a' - '0' - 10));
+	/* Same as isprint(3) of "C" locale */
+	m = (u8x16)(v >= 0x20) & (u8x16)(v < 0x7f);
+	v = (v & m) | (((u8x16){} + '.') & ~m);
+
+	memcpy(hi, &h, sizeof(h));
+	memcpy(lo, &l, sizeof(l));
+	memcpy(text, &v, sizeof(v));
+}
+
 /**
  * @fp - if NULL, return directly
  */
 int memshow(FILE *fp, const void *data, int data_len)
 {
-	if (!data || data_len <= 0) return -EINVAL;
+	static const int align = 16;
+	unsigned char tail[16];
+	char hi[16], lo[16], text[16], *p;
+	const unsigned char *line;
+	struct hex_buf *hb;
+	int i, n, off;
 
-	int i, iline, len = 0;
-	const int align = 16;
+	if (!data || data_len <= 0) return -EINVAL;
 
 	if (!fp)
 		return 0;
 
-	for (iline = 0; iline * align < data_len; iline++) {
-
-		unsigned char *line = (unsigned char *)data + iline * align;
+	hb = malloc(sizeof(*hb));
+	if (!hb)
+		return -ENOMEM;
+	hb->fp = fp;
+	hb->len = hb->total = 0;
+
+	for (off = 0; off < data_len; off += align) {
+		line = (const unsigned char *)data + off;
+		n = MIN(data_len - off, align);
+		/* Never read over the end of data */
+		if (n < align) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, line, n);
+			line = tail;
+		}
+		hex16(line, hi, lo, text);
 
-		len += fprintf(fp, "%08x  ", iline * align);
+		/* "%08x  " + 16 * "%02x " + " " + "  |" + 16 + "|\n" */
+		p = hex_buf_reserve(hb, 80);
+		for (i = 28; i >= 0; i -= 4)
+			*p++ = hex_digits[(off >> i) & 0xf];
+		*p++ = ' ';
+		*p++ = ' ';
 
 		for (i = 0; i < align; i++) {
-			char *e = " ";
-			int len = iline * align + i;
-
+			*p++ = i < n ? hi[i] : ' ';
+			*p++ = i < n ? lo[i] : ' ';
+			*p++ = ' ';
 			if (i == align / 2 - 1)
-				e = "  ";
-
-			if (len >= data_len) {
-				len += fprintf(fp, "%2s%s", "", e);
-			} else {
-				len += fprintf(fp, "%02x%s", line[i], e);
-			}
+				*p++ = ' ';
 		}
 
-		len += fprintf(fp, "  |");
+		*p++ = ' ';
+		*p++ = ' ';
+		*p++ = '|';
+		for (i = 0; i < align; i++)
+			*p++ = i < n ? text[i] : ' ';
+		*p++ = '|';
+		*p++ = '\n';
 
-		for (i = 0; i < align; i++) {
-			char e = '.';
-			int len = iline * align + i;
+		hb->len = p - hb->buf;
+	}
 
-			if (isprint(line[i]))
-				e = line[i];
+	hex_buf_flush(hb);
+	n = hb->total;
+	free(hb);
+	return n;
+}
 
-			if (len >= data_len) {
-				len += fprintf(fp, " ");
-			} else {
-				len += fprintf(fp, "%c", e);
-			}
-		}
+/**
+ * Format each byte of @mem as @prefix, two hex digits and @suffix, the
+ * @suffix of the last byte is @last_suffix, if not NULL.
+ */
+static size_t fhexbytes(FILE *fp, const void *mem, size_t len,
+			const char *prefix, const char *suffix,
+			const char *last_suffix)
+{
+	size_t i, np = strlen(prefix), ns = strlen(suffix), total;
+	const uint8_t *b = mem;
+	struct hex_buf *hb;
+	char *p;
 
-		len += fprintf(fp, "|\n");
+	hb = malloc(sizeof(*hb));
+	if (!hb)
+		return 0;
+	hb->fp = fp;
+	hb->len = hb->total = 0;
+
+	for (i = 0; i < len; i++) {
+		if (last_suffix && i == len - 1) {
+			suffix = last_suffix;
+			ns = strlen(suffix);
+		}
+		p = hex_buf_reserve(hb, np + 2 + ns);
+		memcpy(p, prefix, np);
+		p = hex_byte(p + np, b[i]);
+		memcpy(p, suffix, ns);
+		hb->len = p + ns - hb->buf;
 	}
 
-	return len;
+	hex_buf_flush(hb);
+	total = hb->total;
+	free(hb);
+	return total;
 }
 
 void print_string_hex(FILE *fp, const char *comment, unsigned char *str,
 		      size_t len)
 {
-	unsigned char *c;
 	if (comment)
 		fprintf(fp, "%s", comment);
-	for (c = str; c < str + len; c++)
-		fprintf(fp, "0x%02x ", *c & 0xff);
+	fhexbytes(fp, str, len, "0x", " ", NULL);
 	fprintf(fp, "\n");
 }
 
 int print_bytes(FILE *fp, void *mem, size_t len)
 {
-	int ret = 0;
-	unsigned char *c, *str = mem;
-	for (c = str; c < str + len; c++)
-		ret += fprintf(fp, "%02x ", *c & 0xff);
-	return ret;
+	return fhexbytes(fp, mem, len, "", " ", NULL);
 }
 
 int fmembytes(FILE *fp, const void *data, int data_len)
 {
-	int i;
-	const uint8_t *b;
-
 	if (!fp)
 		fp = stdout;
 
-	for (i = 0, b = data; i < data_len; i++, b++)
-		fprintf(fp, "0x%02x%s", *b, i < (data_len - 1) ? "," : "");
+	if (data_len > 0)
+		fhexbytes(fp, data, data_len, "0x", ",", "");
 	fprintf(fp, "\n");
 	return 0;
 }
 
+/* The value of hex digit @c, -1 if not */
+static inline int hex_value(char c)
+{
+	switch (c) {
+	case '0' ... '9':
+		return c - '0';
+	case 'a' ... 'f':
+		return c - 'a' + 10;
+	case 'A' ... 'F':
+		return c - 'A' + 10;
+	default:
+		return -1;
+	}
+}
+
 static int strbytes2mem_check(const char *bytes, char seperator)
 {
 	const char *s = bytes;
 
 	while (s && *s != '\0') {
-#if defined(DEBUG)
-		ulp_debug("s %s %c %c\n", s, *s, seperator);
-#endif
-		switch (*s) {
-		case '0' ... '9':
-		case 'a' ... 'f':
-		case 'A' ... 'F':
-		case 'x':
-			break;
-		default:
-			if (*s == seperator)
-				break;
+		if (hex_value(*s) < 0 && *s != 'x' && *s != seperator) {
 			errno = EINVAL;
 			return -EINVAL;
 		}
@@ -135,10 +252,11 @@ static int strbytes2mem_check(const char *bytes, char seperator)
 void *strbytes2mem(const char *bytes, size_t *nbytes, void *buf, size_t buf_len,
 		   char seperator)
 {
-	int err;
+	int err, d;
 	size_t n = 0;
-	uint8_t *u = buf;
-	char sep = ',', str_sep[2];
+	uint8_t *u = buf, val;
+	char sep = ',';
+	const char *s;
 
 	errno = 0;
 
@@ -155,40 +273,29 @@ void *strbytes2mem(const char *bytes, size_t *nbytes, void *buf, size_t buf_len,
 	if (err)
 		return NULL;
 
-	sprintf(str_sep, "%c", sep);
-
-	const char *s = bytes;
+	s = bytes;
 
 	/* Skip seperator prefix */
-	while (s && *s == sep && *s != '\0')
+	while (s && *s == sep)
 		s++;
 
 	while (s && *s != '\0') {
-		if (s[0] != '0' || s[1] != 'x') {
-			errno = EINVAL;
-			*nbytes = 0;
-			return NULL;
-		}
-		*u = (uint8_t)strtoull(s, NULL, 16);
-#if defined(DEBUG)
-		ulp_debug("u %d, s %s\n", *u, s);
-#endif
-		u++;
-		n++;
-
-		if (n > buf_len) {
+		if (s[0] != '0' || s[1] != 'x' || n >= buf_len) {
 			errno = EINVAL;
 			*nbytes = 0;
 			return NULL;
 		}
-		s = strstr(s, str_sep);
+
+		/* Like strtoull(3), stop at the first non-hex digit */
+		for (s += 2, val = 0; (d = hex_value(*s)) >= 0; s++)
+			val = (val << 4) | d;
+		u[n++] = val;
+
+		s = strchr(s, sep);
 
 		/* Skip all seperator */
-		while (s && *s == sep && *s != '\0')
+		while (s && *s == sep)
 			s++;
-#if defined(DEBUG)
-		ulp_debug("loop: s %s\n", s);
-#endif
 	}
 
 	*nbytes = n;
@@ -202,7 +309,9 @@ void *strbytes2mem(const char *bytes, size_t *nbytes, void *buf, size_t buf_len,
 char *mem2strbytes(const void *mem, size_t mem_len, char *bytes_buf,
 		   size_t buf_len, char seperator)
 {
-	int i;
+	const uint8_t *b = mem;
+	char *s = bytes_buf;
+	size_t i;
 
 	errno = 0;
 
@@ -222,27 +331,69 @@ char *mem2strbytes(const void *mem, size_t mem_len, char *bytes_buf,
 		return NULL;
 	}
 
-	bytes_buf[0] = '\0';
 	for (i = 0; i < mem_len; i++) {
-		uint8_t u8 = *(uint8_t *)(mem + i);
-		char *s = bytes_buf + i * 5;
-		/**
-		 * "0x12,0x34,0x56\0"
-		 *            ^^^^^
-		 */
-		if (i == mem_len - 1)
-			sprintf(s, "0x%02x", u8);
+		*s++ = '0';
+		*s++ = 'x';
+		s = hex_byte(s, b[i]);
 		/**
 		 * "0x12,0x34,0x56\0"
 		 *  ^^^^^
 		 */
-		else
-			sprintf(s, "0x%02x%c", u8, seperator);
+		if (i != mem_len - 1)
+			*s++ = seperator;
 	}
+	*s = '\0';
 
 	return bytes_buf;
 }
 
+
+/**
+ * Same as memmem(3), but 16 offsets are checked a time: the first and the
+ * last byte of @needle are compared with 16 bytes of @hay at once, and
+ * only the offsets both match are compared with memcmp(3). Unlike glibc's
+ * memmem(3), which is a byte-at-a-time two-way search except the memchr(3)
+ * of the first byte, which degenerates on the frequent first byte, such
+ * as zero in memory.
+ */
+void *ulp_memmem(const void *hay, size_t len, const void *needle, size_t n)
+{
+	const unsigned char *h = hay, *p = needle;
+	u8x16 first, last, a, b, eq;
+	uint64_t mask[2];
+	size_t i, j;
+
+	if (!n)
+		return (void *)hay;
+	if (n > len)
+		return NULL;
+	if (n == 1)
+		return memchr(hay, p[0], len);
+
+	for (j = 0; j < sizeof(first); j++) {
+		first[j] = p[0];
+		last[j] = p[n - 1];
+	}
+
+	for (i = 0; i + n - 1 + sizeof(a) <= len; i += sizeof(a)) {
+		memcpy(&a, h + i, sizeof(a));
+		memcpy(&b, h + i + n - 1, sizeof(b));
+		eq = (u8x16)((a == first) & (b == last));
+		memcpy(mask, &eq, sizeof(mask));
+		if (!(mask[0] | mask[1]))
+			continue;
+		for (j = 0; j < sizeof(a); j++)
+			if (eq[j] && !memcmp(h + i + j + 1, p + 1, n - 2))
+				return (void *)(h + i + j);
+	}
+
+	/* The tail, less than 16 offsets */
+	for (; i + n <= len; i++)
+		if (h[i] == p[0] && !memcmp(h + i + 1, p + 1, n - 1))
+			return (void *)(h + i);
+	return NULL;
+}
+
 /* Return TRUE if the start of STR matches PREFIX, FALSE otherwise.  */
 int ulp_startswith(const char *str, const char *prefix)
 {
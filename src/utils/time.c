@@ -1,22 +1,96 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /* Copyright (C) 2022-2025 Rong Tao */
 #include <time.h>
-#include <sys/time.h>
+#include <pthread.h>
 
+#include <utils/log.h>
 #include <utils/util.h>
+#include <utils/clock.h>
 
 
+/* Calibrate the TSC against CLOCK_MONOTONIC_RAW for it by default */
+#define CYCLES_CALIBRATE_US	10000
+
+static inline unsigned long clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Wall clock, such as the time of patch, never for the elapsed time */
 unsigned long secs(void)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec + tv.tv_usec / 1000000UL;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec;
 }
 
 unsigned long usecs(void)
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec * 1000000UL + tv.tv_usec;
+	return clock_ns(CLOCK_MONOTONIC) / 1000UL;
+}
+
+/* Monotonic nanoseconds, use it to measure elapsed time */
+unsigned long nsecs(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+unsigned long nsecs_raw(void)
+{
+	return clock_ns(CLOCK_MONOTONIC_RAW);
+}
+
+/**
+ * Measure the cycles of ulp_cycles() per nanosecond in @us microseconds.
+ * The generic timer of aarch64 has the frequency register, no need to
+ * measure.
+ */
+double cycles_calibrate(unsigned long us)
+{
+#if defined(__aarch64__)
+	uint64_t frq;
+
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frq));
+	return frq / 1e9;
+#else
+	unsigned long t0, t1;
+	uint64_t c0, c1;
+
+	t0 = nsecs_raw();
+	c0 = ulp_cycles();
+	do {
+		t1 = nsecs_raw();
+		c1 = ulp_cycles();
+	} while (t1 - t0 < us * 1000UL);
+
+	return (double)(c1 - c0) / (t1 - t0);
+#endif
+}
+
+static pthread_once_t cycles_once = PTHREAD_ONCE_INIT;
+static double cycles_ns = 1.0;
+
+static void cycles_init(void)
+{
+	cycles_ns = cycles_calibrate(CYCLES_CALIBRATE_US);
+	ulp_debug("Cycle counter %.3f cycles/ns\n", cycles_ns);
 }
 
+/* Calibrated once, the first call costs CYCLES_CALIBRATE_US */
+double cycles_per_ns(void)
+{
+	pthread_once(&cycles_once, cycles_init);
+	return cycles_ns;
+}
+
+void scoped_timer_end(struct scoped_timer *t)
+{
+	unsigned long ns = nsecs() - t->start;
+
+	if (t->acc)
+		*t->acc += ns;
+	if (t->name)
+		ulp_debug("%s: %lu.%03lu us\n", t->name, ns / 1000, ns % 1000);
+}
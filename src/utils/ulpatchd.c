@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <utils/log.h>
+#include <utils/ulpatchd.h>
+
+
+int ulpatchd_connect(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	return fd;
+}
+
+/* Send the request header with stdin, stdout and stderr */
+static int send_request(int fd, const struct ulpatchd_request *req)
+{
+	int fds[ULPATCHD_NR_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+	struct iovec iov = {
+		.iov_base = (void *)req,
+		.iov_len = sizeof(*req),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(*req))
+		return -errno ?: -EIO;
+	return 0;
+}
+
+/**
+ * Run the command in ulpatchd(8) if environment ULPATCHD_SOCK is set, the
+ * return value of the command is saved to @ret, and return 0. Otherwise,
+ * return negative errno, the command should run in current process.
+ */
+int ulpatchd_client_run(const char *prog, int argc, char *argv[], int *ret)
+{
+	struct ulpatchd_request req = {
+		.magic = ULPATCHD_MAGIC,
+		.argc = argc,
+	};
+	struct ulpatchd_response rsp;
+	char cwd[PATH_MAX], *data, *p;
+	const char *path;
+	size_t len;
+	ssize_t n;
+	int i, fd, err = 0;
+
+	path = getenv(ULPATCHD_ENV_SOCK);
+	if (!path || !path[0])
+		return -ENOENT;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		return -errno;
+
+	len = strlen(cwd) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > ULPATCHD_MAX_DATA)
+		return -E2BIG;
+
+	fd = ulpatchd_connect(path);
+	if (fd < 0) {
+		ulp_warning("Connect ulpatchd %s failed, %s, run locally.\n",
+			    path, strerror(-fd));
+		return fd;
+	}
+
+	data = malloc(len);
+	if (!data) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	p = stpcpy(data, cwd) + 1;
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	strncpy(req.prog, prog, sizeof(req.prog) - 1);
+	req.len = len;
+
+	err = send_request(fd, &req);
+	for (p = data; !err && p < data + len; p += n) {
+		n = send(fd, p, data + len - p, MSG_NOSIGNAL);
+		if (n <= 0)
+			err = -errno ?: -EIO;
+	}
+	free(data);
+
+	/* Once sent, the command may run, never run it again locally */
+	if (!err) {
+		n = recv(fd, &rsp, sizeof(rsp), MSG_WAITALL);
+		if (n != sizeof(rsp) || rsp.magic != ULPATCHD_MAGIC) {
+			fprintf(stderr, "ulpatchd %s closed connection.\n",
+				path);
+			*ret = 1;
+		} else
+			*ret = rsp.ret;
+	} else {
+		ulp_warning("Send to ulpatchd %s failed, %s, run locally.\n",
+			    path, strerror(-err));
+	}
+
+	close(fd);
+	return err;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	for (; len; p += n, len -= n) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -errno ?: -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Send one fleet request to ulpatchd on @path, the @records is malloc, and
+ * has rsp->nr entries. Return zero or negative errno, rsp->ret is the
+ * return value of ulpatchd.
+ */
+int ulpatchd_fleet_call(const char *path,
+			const struct ulpatchd_fleet_request *req,
+			const void *data, struct ulpatchd_fleet_response *rsp,
+			struct ulpatchd_fleet_record **records)
+{
+	struct ulpatchd_fleet_record *r = NULL;
+	size_t size;
+	int fd, err;
+
+	*records = NULL;
+
+	fd = ulpatchd_connect(path);
+	if (fd < 0)
+		return fd;
+
+	err = send_all(fd, req, sizeof(*req));
+	if (!err && req->len)
+		err = send_all(fd, data, req->len);
+	if (err)
+		goto close;
+
+	if (recv(fd, rsp, sizeof(*rsp), MSG_WAITALL) != sizeof(*rsp) ||
+	    rsp->magic != ULPATCHD_FLEET_MAGIC ||
+	    rsp->nr > ULPATCHD_FLEET_MAX_RECORDS) {
+		err = -EPROTO;
+		goto close;
+	}
+
+	if (rsp->nr) {
+		size = rsp->nr * sizeof(*r);
+		r = malloc(size);
+		if (!r) {
+			err = -ENOMEM;
+			goto close;
+		}
+		if (recv(fd, r, size, MSG_WAITALL) != size) {
+			free(r);
+			err = -EPROTO;
+			goto close;
+		}
+	}
+	*records = r;
+
+close:
+	close(fd);
+	return err;
+}
@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#pragma once
+
+#include <stdint.h>
+
+#include <utils/util.h>
+
+/**
+ * Protocol between ulpatchd(8) and the command line tools. If environment
+ * ULPATCHD_SOCK is set, the tool connects to it, sends one request, which
+ * is the name of the tool, the current directory and all arguments, with
+ * its stdin, stdout and stderr passed by SCM_RIGHTS, then waits for the
+ * response, which is the return value of the command run in ulpatchd. One
+ * connection serves one request.
+ */
+
+#define ULPATCHD_SOCK_PATH	ULP_PROC_ROOT_DIR "/ulpatchd.sock"
+#define ULPATCHD_ENV_SOCK	"ULPATCHD_SOCK"
+
+#define ULPATCHD_MAGIC		0x554c5044	/* ULPD */
+/* Max length of cwd and all arguments */
+#define ULPATCHD_MAX_DATA	SZ_64K
+#define ULPATCHD_NR_FDS		3
+
+struct ulpatchd_request {
+	uint32_t magic;
+	/* ulpatch, ulpinfo, ultask, or ulpatchd itself */
+	char prog[16];
+	uint32_t argc;
+	/**
+	 * Length of the data follows the request, the cwd and the argv,
+	 * each one is NUL terminated.
+	 */
+	uint32_t len;
+};
+
+struct ulpatchd_response {
+	uint32_t magic;
+	int32_t ret;
+};
+
+/**
+ * Fleet protocol between ulpatchd(8) and the controller of many nodes, no
+ * file descriptor is passed, thus the socket could be forwarded, such as
+ * ssh -L. The patch state of node is reported in records of every patch of
+ * all processes, each record has the generation it changed in, the request
+ * carries the epoch and generation of the last response, and only the
+ * records changed since then are sent, one batch for each request. The
+ * removed patches are reported once by the ULPATCHD_FLEET_R_GONE record.
+ *
+ * If the epoch differs, such as ulpatchd restarted, or the removed records
+ * since then are dropped already, the response is the whole state with
+ * ULPATCHD_FLEET_F_FULL, the controller drops what it has of the node.
+ *
+ * ULPATCHD_FLEET_ROLLOUT patches all processes of the executable of the
+ * Build ID, at most @max_jobs stopped at the same time, see ulpatch -j,
+ * the response is the state after the rollout.
+ */
+#define ULPATCHD_FLEET_MAGIC	0x554c5046	/* ULPF */
+
+enum ulpatchd_fleet_op {
+	ULPATCHD_FLEET_STATUS,
+	ULPATCHD_FLEET_ROLLOUT,
+};
+
+/* Hex string of the longest Build ID, such as SHA-256 */
+#define ULPATCHD_BUILD_ID_LEN	(32 * 2 + 1)
+
+struct ulpatchd_fleet_request {
+	uint32_t magic;
+	uint32_t op;
+	uint64_t epoch;
+	uint64_t gen;
+	/* ULPATCHD_FLEET_ROLLOUT only */
+	uint32_t max_jobs;
+	/**
+	 * Length of the data follows the request, the Build ID of target
+	 * executable and the patch file, each one is NUL terminated.
+	 */
+	uint32_t len;
+};
+
+struct ulpatchd_fleet_response {
+	uint32_t magic;
+	int32_t ret;
+#define ULPATCHD_FLEET_F_FULL	0x1
+	uint32_t flags;
+	/* Number of records follow the response */
+	uint32_t nr;
+	uint64_t epoch;
+	uint64_t gen;
+	/* Counters of ulpatchd, the policies and rollouts */
+	uint64_t nr_patched;
+	uint64_t nr_failed;
+	/* Stop windows of the patches applied in ulpatchd */
+	uint64_t nr_stops;
+	uint64_t stop_ns_sum;
+	uint64_t stop_ns_max;
+	/* Processes can't be scanned, such as no permission */
+	uint32_t nr_errors;
+	uint32_t nr_tasks;
+};
+
+struct ulpatchd_fleet_record {
+	int32_t pid;
+	uint32_t ulp_id;
+#define ULPATCHD_FLEET_R_GONE	0x1
+	/* Inherited from parent by fork(2) */
+#define ULPATCHD_FLEET_R_INHERITED	0x2
+	uint32_t flags;
+	uint32_t nr_funcs;
+	uint64_t gen;
+	/* Patched time, see struct ulpatch_info */
+	uint64_t time;
+	uint64_t start;
+	/* Build ID of the patch */
+	char build_id[ULPATCHD_BUILD_ID_LEN];
+	/* Name of the first target function */
+	char func[63];
+};
+
+/* Sanity limit of records of one response */
+#define ULPATCHD_FLEET_MAX_RECORDS	SZ_64K
+
+int ulpatchd_connect(const char *path);
+int ulpatchd_client_run(const char *prog, int argc, char *argv[], int *ret);
+int ulpatchd_fleet_call(const char *path,
+			const struct ulpatchd_fleet_request *req,
+			const void *data, struct ulpatchd_fleet_response *rsp,
+			struct ulpatchd_fleet_record **records);
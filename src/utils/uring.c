@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/uring.h>
+
+
+/* The files of one batch, and the registered buffers of them */
+#define URING_ENTRIES	64
+#define URING_BUF_SIZE	(32 * 1024)
+
+struct ulp_uring {
+	int fd;
+	unsigned int entries;
+
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/* URING_BUF_SIZE for each entry, NULL if not registered */
+	char *bufs;
+	/* The result of every entry of the batch */
+	int res[URING_ENTRIES];
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_register_bufs(struct ulp_uring *ring)
+{
+	struct iovec iovs[URING_ENTRIES];
+	size_t size = URING_ENTRIES * URING_BUF_SIZE;
+	void *bufs;
+	int i;
+
+	bufs = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs == MAP_FAILED)
+		return -errno;
+
+	for (i = 0; i < URING_ENTRIES; i++) {
+		iovs[i].iov_base = bufs + i * URING_BUF_SIZE;
+		iovs[i].iov_len = URING_BUF_SIZE;
+	}
+
+	/* Pinned, may fail by RLIMIT_MEMLOCK of old kernels */
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs,
+			      URING_ENTRIES)) {
+		munmap(bufs, size);
+		return -errno;
+	}
+	ring->bufs = bufs;
+	return 0;
+}
+
+/**
+ * Return NULL if io_uring is not supported, ulp_read_files() reads the
+ * files one by one then.
+ */
+struct ulp_uring *ulp_uring_open(void)
+{
+	struct io_uring_params p;
+	struct ulp_uring *ring;
+	void *ptr;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(URING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		ulp_debug("io_uring_setup failed, %m\n");
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_size = p.sq_off.array +
+			     p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto close;
+	ring->sq_ring = ptr;
+
+	ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto close;
+	ring->cq_ring = ptr;
+
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto close;
+	ring->sqes = ptr;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	/* Not fatal, IORING_OP_READ into the buffers of files then */
+	if (uring_register_bufs(ring))
+		ulp_debug("io_uring register buffers failed, %m\n");
+	return ring;
+
+close:
+	ulp_debug("io_uring mmap failed, %m\n");
+	ulp_uring_close(ring);
+	return NULL;
+}
+
+void ulp_uring_close(struct ulp_uring *ring)
+{
+	if (!ring)
+		return;
+	if (ring->bufs)
+		munmap(ring->bufs, URING_ENTRIES * URING_BUF_SIZE);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct ulp_uring *ring,
+					  unsigned int i)
+{
+	unsigned int tail = *ring->sq_tail + i;
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	ring->sq_array[idx] = idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = i;
+	return sqe;
+}
+
+/**
+ * Submit the @nr SQEs filled by uring_get_sqe(), and wait all of them, the
+ * results are in ring->res[], indexed by the user_data.
+ */
+static int uring_submit_wait(struct ulp_uring *ring, unsigned int nr)
+{
+	unsigned int head, tail, done = 0, submitted = 0;
+	struct io_uring_cqe *cqe;
+	int n;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + nr, __ATOMIC_RELEASE);
+
+	while (done < nr) {
+		n = io_uring_enter(ring->fd, nr - submitted, 1,
+				   IORING_ENTER_GETEVENTS);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		submitted += n;
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			if (cqe->user_data < URING_ENTRIES)
+				ring->res[cqe->user_data] = cqe->res;
+			done++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/* Read the rest of @r from offset r->size, the buffer holds r->size bytes */
+static int read_rest(int fd, struct ulp_file_read *r)
+{
+	size_t cap = 0;
+	char *tmp;
+	ssize_t n;
+
+	while (1) {
+		if (r->size + 1 >= cap) {
+			cap = MAX(cap * 2, r->size + URING_BUF_SIZE);
+			tmp = realloc(r->buf, cap);
+			if (!tmp)
+				return -ENOMEM;
+			r->buf = tmp;
+		}
+		n = pread(fd, r->buf + r->size, cap - r->size - 1, r->size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (n == 0)
+			break;
+		r->size += n;
+	}
+	r->buf[r->size] = '\0';
+	return 0;
+}
+
+static void read_file_sync(struct ulp_file_read *r)
+{
+	int fd;
+
+	fd = open(r->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		r->err = -errno;
+		return;
+	}
+	r->err = read_rest(fd, r);
+	close(fd);
+}
+
+/* The kernel has no such opcode, before 5.6 */
+static bool uring_op_unsupported(int res)
+{
+	return res == -EINVAL || res == -EOPNOTSUPP;
+}
+
+static int uring_read_batch(struct ulp_uring *ring, struct ulp_file_read *rs,
+			    unsigned int nr)
+{
+	struct io_uring_sqe *sqe;
+	int fds[URING_ENTRIES];
+	unsigned int i, n;
+	char *bufs = ring->bufs;
+	int err;
+
+	for (i = 0; i < nr; i++) {
+		sqe = uring_get_sqe(ring, i);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)rs[i].path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	err = uring_submit_wait(ring, nr);
+	if (err)
+		return err;
+
+	for (i = 0; i < nr; i++)
+		fds[i] = ring->res[i];
+
+	/* Into the registered buffers, or the buffers of every file */
+	for (i = 0; i < nr; i++) {
+		if (!bufs) {
+			rs[i].buf = malloc(URING_BUF_SIZE);
+			if (!rs[i].buf) {
+				err = -ENOMEM;
+				goto close;
+			}
+		}
+		sqe = uring_get_sqe(ring, i);
+		sqe->fd = fds[i] >= 0 ? fds[i] : -1;
+		sqe->len = URING_BUF_SIZE;
+		if (bufs) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->addr = (unsigned long)(bufs + i * URING_BUF_SIZE);
+			sqe->buf_index = i;
+		} else {
+			sqe->opcode = IORING_OP_READ;
+			sqe->addr = (unsigned long)rs[i].buf;
+		}
+		/* Nothing to do for the failed open */
+		if (fds[i] < 0)
+			sqe->opcode = IORING_OP_NOP;
+	}
+	err = uring_submit_wait(ring, nr);
+	if (err)
+		goto close;
+
+	for (i = 0; i < nr; i++) {
+		n = ring->res[i];
+		if (fds[i] < 0 || ring->res[i] < 0) {
+			rs[i].err = fds[i] < 0 ? fds[i] : ring->res[i];
+			if (uring_op_unsupported(rs[i].err)) {
+				free(rs[i].buf);
+				rs[i].buf = NULL;
+				rs[i].err = 0;
+				if (fds[i] >= 0)
+					rs[i].err = read_rest(fds[i], &rs[i]);
+				else
+					read_file_sync(&rs[i]);
+			}
+			continue;
+		}
+		if (bufs) {
+			rs[i].buf = malloc(n + 1);
+			if (!rs[i].buf) {
+				rs[i].err = -ENOMEM;
+				continue;
+			}
+			memcpy(rs[i].buf, bufs + i * URING_BUF_SIZE, n);
+		}
+		rs[i].size = n;
+		/* The buffer is full, maybe more */
+		if (n == URING_BUF_SIZE)
+			rs[i].err = read_rest(fds[i], &rs[i]);
+		else
+			rs[i].buf[n] = '\0';
+	}
+
+	for (i = 0, n = 0; i < nr; i++) {
+		if (fds[i] < 0)
+			continue;
+		sqe = uring_get_sqe(ring, n);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = fds[i];
+		n++;
+	}
+	err = uring_submit_wait(ring, n);
+	if (err)
+		goto close;
+	/* The kernel before 5.6 can't close */
+	for (i = 0, n = 0; i < nr; i++) {
+		if (fds[i] < 0)
+			continue;
+		if (uring_op_unsupported(ring->res[n++]))
+			close(fds[i]);
+	}
+	return 0;
+
+close:
+	for (i = 0; i < nr; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return err;
+}
+
+/**
+ * Read @nr files of @reads, the errors of every file are in
+ * ulp_file_read::err, return non-zero only if the ring is broken, the
+ * files not read yet are read one by one then. @ring may be NULL.
+ */
+int ulp_read_files(struct ulp_uring *ring, struct ulp_file_read *reads,
+		   unsigned int nr)
+{
+	unsigned int i = 0, n;
+	int err = 0;
+
+	for (i = 0; i < nr; i++) {
+		reads[i].buf = NULL;
+		reads[i].size = 0;
+		reads[i].err = 0;
+	}
+
+	for (i = 0; ring && i < nr; i += n) {
+		n = MIN(nr - i, URING_ENTRIES);
+		n = MIN(n, ring->entries);
+		err = uring_read_batch(ring, reads + i, n);
+		if (err) {
+			ulp_warning("io_uring read failed, %s\n",
+				    strerror(-err));
+			break;
+		}
+	}
+
+	for (; i < nr; i++) {
+		free(reads[i].buf);
+		reads[i].buf = NULL;
+		reads[i].size = 0;
+		read_file_sync(&reads[i]);
+	}
+	return err;
+}
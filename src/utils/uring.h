@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_URING_H
+#define _UTILS_URING_H
+
+#include <stddef.h>
+
+/**
+ * Read many small files, such as the /proc/PID/maps of all processes, by
+ * io_uring(7) in batches. One io_uring_enter(2) opens a batch of files, one
+ * reads all of them into the registered buffers, one closes them, instead
+ * of three syscalls per file. If io_uring is not supported or disabled,
+ * such as by sysctl kernel.io_uring_disabled, the files are read one by
+ * one as usual.
+ *
+ *   ring = ulp_uring_open();
+ *   ulp_read_files(ring, reads, nr);
+ *   ...reads[i].buf...
+ *   ulp_uring_close(ring);
+ *
+ * The ring is not thread safe, open one for each thread.
+ */
+struct ulp_uring;
+
+struct ulp_file_read {
+	const char *path;
+	/* The content, always NUL terminated, free(3) it */
+	char *buf;
+	size_t size;
+	/* Zero or negative errno */
+	int err;
+};
+
+struct ulp_uring *ulp_uring_open(void);
+void ulp_uring_close(struct ulp_uring *ring);
+int ulp_read_files(struct ulp_uring *ring, struct ulp_file_read *reads,
+		   unsigned int nr);
+
+#endif /* _UTILS_URING_H */
@@ -133,6 +133,10 @@
 
 /* all output need file store here, mkdir(2) it before running. */
 #define ULP_PROC_ROOT_DIR	"/tmp/ulpatch"
+/* ELF symbol cache, see src/elf/symbol-bfd.c */
+#define ULP_SYM_CACHE_DIR	ULP_PROC_ROOT_DIR "/symcache"
+/* Shared relocated patch images, see src/patch/patch.c */
+#define ULP_SHARE_DIR		ULP_PROC_ROOT_DIR "/shared"
 
 #define MODE_0777 (S_IRUSR | S_IWUSR | S_IXUSR | \
 		   S_IRGRP | S_IWGRP | S_IXGRP | \
@@ -194,6 +198,7 @@ int str2verbose(const char *str);
 
 bool is_dry_run(void);
 void enable_dry_run(void);
+void disable_dry_run(void);
 
 /* Check some thing */
 bool is_root(const char *prog);
@@ -213,6 +218,9 @@ void print_string_hex(FILE *fp, const char *comment, unsigned char *str,
 		      size_t len);
 int print_bytes(FILE *fp, void *mem, size_t len);
 
+void *ulp_memmem(const void *hay, size_t len, const void *needle, size_t n);
+uint64_t ulp_hash64(const void *data, size_t len, uint64_t seed);
+
 /* Return TRUE if the start of STR matches PREFIX, FALSE otherwise.  */
 int ulp_startswith(const char *str, const char *prefix);
 
@@ -256,16 +264,19 @@ bool fregular(const char *filepath);
 int ftouch(const char *filepath, size_t size);
 int fremove(const char *filepath);
 int fremove_recursive(const char *filepath);
+int fremove_recursive_at(int dirfd, const char *name);
 file_type ftype(const char *filepath);
 int fcopy(const char *srcpath, const char *dstpath);
 char *fmktempfile(char *buf, int buf_len, char *seed);
 char *fmktempname(char *buf, int buf_len, char *seed);
 int fmemcpy(void *mem, int mem_len, const char *file);
+ssize_t fload(const char *filepath, void *buf, size_t len);
 int fprint_file(FILE *fp, const char *file);
 int fprint_fd(FILE *fp, int fd);
 
 struct mmap_struct *fmmap_rdonly(const char *filepath);
 struct mmap_struct *fmmap_shmem_create(const char *filepath, size_t size);
+struct mmap_struct *fmmap_shmem_copy(const char *filepath, const char *from);
 int fmunmap(struct mmap_struct *mem);
 
 
@@ -279,8 +290,7 @@ int insert_callback(struct callback_chain *chain,
 void callback_launch_chain(struct callback_chain *chain);
 int destroy_callback_chain(struct callback_chain *chain);
 
-unsigned long secs(void);
-unsigned long usecs(void);
+#include <utils/clock.h>
 
 #endif /* _UTIL_H */
 
@@ -107,6 +107,11 @@ void ulpatch_info(const char *progname)
 #else
 	printf("  ultask no\n");
 #endif
+#ifdef CONFIG_BUILD_ULPATCHD
+	printf("  ulpatchd yes\n");
+#else
+	printf("  ulpatchd no\n");
+#endif
 #ifdef CONFIG_BUILD_TESTING
 	printf("  testing yes\n");
 #else
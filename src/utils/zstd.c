@@ -0,0 +1,561 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#include <errno.h>
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <utils/log.h>
+#include <utils/util.h>
+#include <utils/dl.h>
+#include <utils/zstd.h>
+
+
+/* The few functions of libzstd used, zstd.h is not needed to build */
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+
+static struct {
+	ZSTD_CCtx *(*ZSTD_createCCtx)(void);
+	size_t (*ZSTD_freeCCtx)(ZSTD_CCtx *cctx);
+	size_t (*ZSTD_compressCCtx)(ZSTD_CCtx *cctx, void *dst, size_t cap,
+				    const void *src, size_t len, int level);
+	size_t (*ZSTD_decompress)(void *dst, size_t cap, const void *src,
+				  size_t len);
+	size_t (*ZSTD_compressBound)(size_t len);
+	unsigned (*ZSTD_isError)(size_t code);
+	const char *(*ZSTD_getErrorName)(size_t code);
+} libzstd;
+
+static const struct ulp_dl_sym libzstd_syms[] = {
+	ULP_DL_SYM(ZSTD_createCCtx, libzstd.ZSTD_createCCtx),
+	ULP_DL_SYM(ZSTD_freeCCtx, libzstd.ZSTD_freeCCtx),
+	ULP_DL_SYM(ZSTD_compressCCtx, libzstd.ZSTD_compressCCtx),
+	ULP_DL_SYM(ZSTD_decompress, libzstd.ZSTD_decompress),
+	ULP_DL_SYM(ZSTD_compressBound, libzstd.ZSTD_compressBound),
+	ULP_DL_SYM(ZSTD_isError, libzstd.ZSTD_isError),
+	ULP_DL_SYM(ZSTD_getErrorName, libzstd.ZSTD_getErrorName),
+};
+
+static struct ulp_dl libzstd_dl = {
+	.soname = "libzstd.so.1",
+	.name = "libzstd.so",
+	.syms = libzstd_syms,
+	.nr_syms = ARRAY_SIZE(libzstd_syms),
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Fast level, the dump of an incident is bound by the compression */
+#define ZST_LEVEL		1
+#define ZST_MAX_THREADS		64
+
+/* See zstd_seekable_compression_format.md */
+#define ZST_SKIPPABLE_MAGIC	0x184D2A5EU
+#define ZST_SEEKABLE_MAGIC	0x8F92EAB1U
+#define ZST_FOOTER_SIZE		9
+#define ZST_F_CHECKSUM		0x80
+
+enum zst_slot_state {
+	/* Being filled by the producer */
+	ZST_SLOT_FREE,
+	/* Submitted, to be compressed */
+	ZST_SLOT_FULL,
+	/* Compressed, to be written */
+	ZST_SLOT_DONE,
+};
+
+struct zst_slot {
+	enum zst_slot_state state;
+	void *src;
+	size_t src_len;
+	void *dst;
+	size_t dst_len;
+	int err;
+};
+
+struct zst_worker {
+	struct ulp_zst *z;
+	ZSTD_CCtx *cctx;
+	pthread_t thread;
+	bool started;
+};
+
+/* One frame of seek table */
+struct zst_entry {
+	uint32_t csize;
+	uint32_t dsize;
+};
+
+struct ulp_zst {
+	int fd;
+	size_t dst_cap;
+
+	/**
+	 * The frame of sequence N is in slot N % nr_slots, the frames are
+	 * submitted, taken by workers and written in order, thus
+	 * nr_written <= nr_taken <= nr_submit.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct zst_slot *slots;
+	int nr_slots;
+	unsigned long nr_submit;
+	unsigned long nr_taken;
+	unsigned long nr_written;
+	bool stop;
+	/* Bytes in the slot of nr_submit, being filled */
+	size_t fill;
+
+	/* The first one compresses in the producer if no thread started */
+	struct zst_worker *workers;
+	int nr_workers;
+	int nr_threads;
+
+	struct zst_entry *entries;
+	unsigned long nr_entries;
+	unsigned long cap_entries;
+	int err;
+};
+
+bool ulp_zst_path(const char *path)
+{
+	size_t len = path ? strlen(path) : 0;
+
+	return len > 4 && !strcmp(path + len - 4, ".zst");
+}
+
+static int zst_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -errno ?: -EIO;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static ssize_t zst_pread_all(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, buf + done, len - done, off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+static void zst_compress(struct ulp_zst *z, ZSTD_CCtx *cctx,
+			 struct zst_slot *s)
+{
+	size_t ret;
+
+	ret = libzstd.ZSTD_compressCCtx(cctx, s->dst, z->dst_cap, s->src,
+					s->src_len, ZST_LEVEL);
+	if (libzstd.ZSTD_isError(ret)) {
+		ulp_error("zstd compress failed, %s\n",
+			  libzstd.ZSTD_getErrorName(ret));
+		s->err = -EIO;
+		return;
+	}
+	s->dst_len = ret;
+	s->err = 0;
+}
+
+static void *zst_worker(void *arg)
+{
+	struct zst_worker *w = arg;
+	struct ulp_zst *z = w->z;
+	struct zst_slot *s;
+
+	pthread_mutex_lock(&z->lock);
+	for (;;) {
+		while (!z->stop && z->nr_taken == z->nr_submit)
+			pthread_cond_wait(&z->cond, &z->lock);
+		/* Stopped and nothing left */
+		if (z->nr_taken == z->nr_submit)
+			break;
+
+		s = &z->slots[z->nr_taken++ % z->nr_slots];
+		pthread_mutex_unlock(&z->lock);
+
+		zst_compress(z, w->cctx, s);
+
+		pthread_mutex_lock(&z->lock);
+		s->state = ZST_SLOT_DONE;
+		pthread_cond_broadcast(&z->cond);
+	}
+	pthread_mutex_unlock(&z->lock);
+	return NULL;
+}
+
+static int zst_add_entry(struct ulp_zst *z, size_t csize, size_t dsize)
+{
+	struct zst_entry *e;
+	unsigned long cap;
+
+	if (z->nr_entries == z->cap_entries) {
+		cap = MAX(z->cap_entries * 2, 64UL);
+		e = realloc(z->entries, cap * sizeof(*e));
+		if (!e)
+			return -ENOMEM;
+		z->entries = e;
+		z->cap_entries = cap;
+	}
+	z->entries[z->nr_entries].csize = csize;
+	z->entries[z->nr_entries].dsize = dsize;
+	z->nr_entries++;
+	return 0;
+}
+
+/**
+ * Write the compressed frames in order, until @upto frames are written,
+ * wait for the workers if needed. Only the producer calls it.
+ */
+static void zst_drain(struct ulp_zst *z, unsigned long upto)
+{
+	struct zst_slot *s;
+	int err;
+
+	pthread_mutex_lock(&z->lock);
+	while (z->nr_written < z->nr_submit) {
+		s = &z->slots[z->nr_written % z->nr_slots];
+		if (s->state != ZST_SLOT_DONE) {
+			if (z->nr_written >= upto)
+				break;
+			pthread_cond_wait(&z->cond, &z->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&z->lock);
+
+		err = s->err;
+		if (!err && !z->err)
+			err = zst_add_entry(z, s->dst_len, s->src_len) ?:
+			      zst_write_all(z->fd, s->dst, s->dst_len);
+		if (err && !z->err)
+			z->err = err;
+
+		pthread_mutex_lock(&z->lock);
+		s->state = ZST_SLOT_FREE;
+		z->nr_written++;
+	}
+	pthread_mutex_unlock(&z->lock);
+}
+
+static void zst_submit(struct ulp_zst *z, struct zst_slot *s)
+{
+	s->src_len = z->fill;
+	z->fill = 0;
+
+	if (!z->nr_threads) {
+		zst_compress(z, z->workers[0].cctx, s);
+		s->state = ZST_SLOT_DONE;
+		z->nr_submit++;
+		z->nr_taken++;
+		zst_drain(z, z->nr_submit);
+		return;
+	}
+
+	pthread_mutex_lock(&z->lock);
+	s->state = ZST_SLOT_FULL;
+	z->nr_submit++;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	/* Write the finished ones, never wait */
+	zst_drain(z, 0);
+}
+
+static void zst_free(struct ulp_zst *z)
+{
+	int i;
+
+	for (i = 0; z->workers && i < z->nr_workers; i++) {
+		if (z->workers[i].cctx)
+			libzstd.ZSTD_freeCCtx(z->workers[i].cctx);
+	}
+	for (i = 0; z->slots && i < z->nr_slots; i++) {
+		free(z->slots[i].src);
+		free(z->slots[i].dst);
+	}
+	free(z->workers);
+	free(z->slots);
+	free(z->entries);
+	free(z);
+}
+
+/**
+ * Compress into @fd, which is written from current offset, by @nr_threads
+ * threads, 0 means the number of CPUs.
+ */
+struct ulp_zst *ulp_zst_open(int fd, int nr_threads)
+{
+	struct ulp_zst *z;
+	int i;
+
+	if (ulp_dl_load(&libzstd_dl)) {
+		ulp_error("No libzstd, it's needed by the .zst output.\n");
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	if (nr_threads <= 0)
+		nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = MIN(MAX(nr_threads, 1), ZST_MAX_THREADS);
+
+	z = calloc(1, sizeof(*z));
+	if (!z)
+		goto nomem;
+
+	z->fd = fd;
+	z->dst_cap = libzstd.ZSTD_compressBound(ULP_ZST_FRAME_SIZE);
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+
+	/* One frame compressed by each worker, one filled, one written */
+	z->nr_slots = nr_threads + 2;
+	z->slots = calloc(z->nr_slots, sizeof(*z->slots));
+	z->workers = calloc(nr_threads, sizeof(*z->workers));
+	if (!z->slots || !z->workers)
+		goto free;
+	z->nr_workers = nr_threads;
+
+	for (i = 0; i < z->nr_slots; i++) {
+		z->slots[i].src = malloc(ULP_ZST_FRAME_SIZE);
+		z->slots[i].dst = malloc(z->dst_cap);
+		if (!z->slots[i].src || !z->slots[i].dst)
+			goto free;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		z->workers[i].z = z;
+		z->workers[i].cctx = libzstd.ZSTD_createCCtx();
+		if (!z->workers[i].cctx)
+			goto free;
+	}
+
+	/* The producer compresses by itself if no thread is created */
+	for (i = 0; nr_threads > 1 && i < nr_threads; i++) {
+		if (pthread_create(&z->workers[i].thread, NULL, zst_worker,
+				   &z->workers[i]))
+			break;
+		z->workers[i].started = true;
+	}
+	z->nr_threads = i;
+	return z;
+
+free:
+	zst_free(z);
+nomem:
+	errno = ENOMEM;
+	return NULL;
+}
+
+int ulp_zst_write(struct ulp_zst *z, const void *buf, size_t len)
+{
+	struct zst_slot *s;
+	size_t n;
+
+	while (len && !z->err) {
+		s = &z->slots[z->nr_submit % z->nr_slots];
+
+		/* The last frame in this slot must be written */
+		if (!z->fill && z->nr_submit >= z->nr_slots)
+			zst_drain(z, z->nr_submit - z->nr_slots + 1);
+
+		n = MIN(len, ULP_ZST_FRAME_SIZE - z->fill);
+		memcpy(s->src + z->fill, buf, n);
+		z->fill += n;
+		buf += n;
+		len -= n;
+
+		if (z->fill == ULP_ZST_FRAME_SIZE)
+			zst_submit(z, s);
+	}
+	return z->err;
+}
+
+static int zst_write_seek_table(struct ulp_zst *z)
+{
+	size_t size = 8 + z->nr_entries * 8 + ZST_FOOTER_SIZE;
+	uint8_t *buf, *p;
+	uint32_t v;
+	unsigned long i;
+	int err;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+#define put32(x) ({ v = htole32(x); memcpy(p, &v, 4); p += 4; })
+	p = buf;
+	put32(ZST_SKIPPABLE_MAGIC);
+	put32(size - 8);
+	for (i = 0; i < z->nr_entries; i++) {
+		put32(z->entries[i].csize);
+		put32(z->entries[i].dsize);
+	}
+	put32(z->nr_entries);
+	/* Seek_Table_Descriptor, no checksum */
+	*p++ = 0;
+	put32(ZST_SEEKABLE_MAGIC);
+#undef put32
+
+	err = zst_write_all(z->fd, buf, size);
+	free(buf);
+	return err;
+}
+
+/* Flush the last frame and the seek table, and free @z */
+int ulp_zst_close(struct ulp_zst *z)
+{
+	struct zst_slot *s;
+	int i, err;
+
+	if (!z)
+		return -EINVAL;
+
+	s = &z->slots[z->nr_submit % z->nr_slots];
+	if (z->fill && !z->err)
+		zst_submit(z, s);
+
+	zst_drain(z, z->nr_submit);
+
+	pthread_mutex_lock(&z->lock);
+	z->stop = true;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	for (i = 0; i < z->nr_threads; i++) {
+		if (z->workers[i].started)
+			pthread_join(z->workers[i].thread, NULL);
+	}
+
+	if (!z->err)
+		z->err = zst_write_seek_table(z);
+
+	err = z->err;
+	zst_free(z);
+	return err;
+}
+
+/**
+ * Read [off, off + len) of the decompressed stream of seekable zstd file
+ * @fd, only the frames of the range are read and decompressed. Return the
+ * bytes read, less than @len if over the end, or negative errno.
+ */
+ssize_t ulp_zst_pread(int fd, void *buf, size_t len, off_t off)
+{
+	uint8_t footer[ZST_FOOTER_SIZE], *table = NULL, *e;
+	void *cbuf = NULL, *dbuf = NULL;
+	size_t esz, table_size, csize, dsize, from, n, done = 0;
+	uint64_t coff = 0, doff = 0;
+	uint32_t nr, v;
+	struct stat st;
+	ssize_t ret;
+	unsigned long i;
+
+	if (ulp_dl_load(&libzstd_dl))
+		return -ENOSYS;
+
+	if (off < 0)
+		return -EINVAL;
+	if (fstat(fd, &st))
+		return -errno;
+	if (st.st_size < 8 + ZST_FOOTER_SIZE)
+		return -EINVAL;
+
+	ret = zst_pread_all(fd, footer, sizeof(footer),
+			    st.st_size - ZST_FOOTER_SIZE);
+	if (ret != sizeof(footer))
+		return ret < 0 ? ret : -EIO;
+
+	memcpy(&v, footer + 5, 4);
+	if (le32toh(v) != ZST_SEEKABLE_MAGIC)
+		return -EINVAL;
+	memcpy(&nr, footer, 4);
+	nr = le32toh(nr);
+	esz = (footer[4] & ZST_F_CHECKSUM) ? 12 : 8;
+
+	table_size = 8 + (size_t)nr * esz + ZST_FOOTER_SIZE;
+	if (table_size > st.st_size)
+		return -EINVAL;
+
+	table = malloc(table_size);
+	if (!table)
+		return -ENOMEM;
+	ret = zst_pread_all(fd, table, table_size, st.st_size - table_size);
+	if (ret != table_size) {
+		ret = ret < 0 ? ret : -EIO;
+		goto out;
+	}
+	memcpy(&v, table, 4);
+	if (le32toh(v) != ZST_SKIPPABLE_MAGIC) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (i = 0, e = table + 8; i < nr && done < len; i++, e += esz) {
+		memcpy(&v, e, 4);
+		csize = le32toh(v);
+		memcpy(&v, e + 4, 4);
+		dsize = le32toh(v);
+
+		if (!dsize || doff + dsize <= off) {
+			coff += csize;
+			doff += dsize;
+			continue;
+		}
+
+		free(cbuf);
+		free(dbuf);
+		cbuf = malloc(csize);
+		dbuf = malloc(dsize);
+		if (!cbuf || !dbuf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		ret = zst_pread_all(fd, cbuf, csize, coff);
+		if (ret != csize) {
+			ret = ret < 0 ? ret : -EIO;
+			goto out;
+		}
+		n = libzstd.ZSTD_decompress(dbuf, dsize, cbuf, csize);
+		if (libzstd.ZSTD_isError(n) || n != dsize) {
+			ret = -EIO;
+			goto out;
+		}
+
+		from = off + done - doff;
+		n = MIN(dsize - from, len - done);
+		memcpy(buf + done, dbuf + from, n);
+		done += n;
+
+		coff += csize;
+		doff += dsize;
+	}
+	ret = done;
+
+out:
+	free(cbuf);
+	free(dbuf);
+	free(table);
+	return ret;
+}
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/* Copyright (C) 2025 Rong Tao */
+#ifndef _UTILS_ZSTD_H
+#define _UTILS_ZSTD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Write a stream into a file of zstd seekable format, such as the VMA dump
+ * of "-o file.zst". The stream is cut into ULP_ZST_FRAME_SIZE frames, they
+ * are compressed by a pool of threads while the next ones are produced,
+ * and written in order. The seek table is a skippable frame at the end,
+ * any zstd(1) decompresses the whole file, ulp_zst_pread() decompresses
+ * only the frames of a range, see
+ * zstd:contrib/seekable_format/zstd_seekable_compression_format.md
+ *
+ *   z = ulp_zst_open(fd, nr_threads);
+ *   ulp_zst_write(z, buf, len);
+ *   ...
+ *   err = ulp_zst_close(z);
+ *
+ * libzstd is loaded by dlopen(3) on the first open.
+ */
+#define ULP_ZST_FRAME_SIZE	(1UL << 20)
+
+struct ulp_zst;
+
+bool ulp_zst_path(const char *path);
+struct ulp_zst *ulp_zst_open(int fd, int nr_threads);
+int ulp_zst_write(struct ulp_zst *z, const void *buf, size_t len);
+int ulp_zst_close(struct ulp_zst *z);
+ssize_t ulp_zst_pread(int fd, void *buf, size_t len, off_t off);
+
+#endif /* _UTILS_ZSTD_H */
@@ -152,6 +152,7 @@ popd
 %{_bindir}/ulftrace
 %endif
 %{_bindir}/ulpinfo
+%{_bindir}/ulpatchd
 %if 0%{?with_ultask}
 %{_bindir}/ultask
 %endif
@@ -160,6 +161,7 @@ popd
 %endif
 %{_mandir}/man8/ulpatch.8.gz
 %{_mandir}/man8/ulpinfo.8.gz
+%{_mandir}/man8/ulpatchd.8.gz
 %if 0%{?with_ultask}
 %{_mandir}/man8/ultask.8.gz
 %endif
@@ -180,6 +182,7 @@ popd
 %files devel
 %{_includedir}/ulpatch/asm.h
 %{_includedir}/ulpatch/meta.h
+%{_includedir}/ulpatch/ftrace-ring.h
 %{_bindir}/ulpconfig
 %{_mandir}/man8/ulpconfig.8.gz
 
@@ -187,6 +190,7 @@ popd
 %{_bindir}/ulpatch_test
 %{_datadir}/ulpatch/ulpatches/empty.ulp
 %{_datadir}/ulpatch/ulpatches/printf.ulp
+%{_datadir}/ulpatch/ulpatches/multi.ulp
 
 %changelog
 * Thu Jan 02 2025 Rong Tao <rtoax@foxmail.com> - 0.5.12-3